@@ -29,6 +29,7 @@
 	to the Syslog (see man syslog).  In the latter case, the application can specify a facility
 	number in order to control what Syslog does with the messages.  The facility number for
 	activity numbers is controlled separately from that of the other message types.
+	Output to a log file is buffered; see osrfLogFlush().
 
 	The messages are formatted like the following example:
 
@@ -87,6 +88,20 @@ void osrfRestoreLogType( void );
 
 void osrfLogSetFile( const char* logfile );
 
+void osrfLogFlush( void );
+
+void osrfLogReopen( void );
+
+int osrfLogSetAsync( int entries, int block );
+
+unsigned long osrfLogGetDropped( void );
+
+void osrfLogResetPid( void );
+
+int osrfLogSetRecorder( int entries, const char* path );
+
+int osrfLogDumpRecorder( const char* reason );
+
 void osrfLogSetAppname( const char* appname );
 
 void osrfLogSetLevel( int loglevel );
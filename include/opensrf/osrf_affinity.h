@@ -0,0 +1,60 @@
+#ifndef OSRF_AFFINITY_H
+#define OSRF_AFFINITY_H
+
+/**
+	@file osrf_affinity.h
+	@brief Header for pinning listeners, drones and routers to CPUs and NUMA nodes.
+
+	A CPU list names CPUs the way the kernel does in /proc and /sys: numbers and
+	ranges, separated by commas, as in "0-7,16-23".
+
+	A service may pin its listener to one CPU list and its drones to another, so
+	that they don't compete for the same cores.  It may also spread its drones across
+	the host's NUMA nodes: each drone then runs on the CPUs of a single node, taking
+	the nodes in turn by status board slot.  Once a drone is pinned to one node, the
+	kernel's usual policy of allocating memory on the node that first touches it keeps
+	the drone's new memory local; a service may further bind its drones' memory to
+	their nodes outright.
+
+	The NUMA layout is read from /sys/devices/system/node, so there is no dependency on
+	libnuma.  On a host without NUMA, or where the calls aren't available, spreading
+	and memory binding quietly do nothing, and the CPU list alone applies.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Number of CPUs an osrfCpuSet can hold; CPUs beyond it are ignored. */
+#define OSRF_MAX_CPUS 1024
+
+/** @brief Number of NUMA nodes the spreading can tell apart. */
+#define OSRF_MAX_NUMA_NODES 64
+
+/**
+	@brief A set of CPUs, one bit per CPU number.
+*/
+typedef struct {
+	unsigned long bits[ OSRF_MAX_CPUS / ( 8 * sizeof( unsigned long ))];
+} osrfCpuSet;
+
+int osrfCpuSetParse( osrfCpuSet* set, const char* list );
+
+int osrfCpuSetHas( const osrfCpuSet* set, int cpu );
+
+int osrfCpuSetCount( const osrfCpuSet* set );
+
+char* osrfCpuSetFormat( const osrfCpuSet* set );
+
+void osrfNumaSetSysfsDir( const char* dir );
+
+int osrfAffinityPlan( osrfCpuSet* cpus, int* node, const char* list, int spread, int index );
+
+int osrfAffinityApply( const char* list, int spread, int bind_memory, int index,
+	const char* who );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,7 +33,13 @@ enum OSRF_SESSION_TYPE {
 struct osrf_app_request_struct;
 typedef struct osrf_app_request_struct osrfAppRequest;
 
-#define OSRF_REQUEST_HASH_SIZE 64
+/**
+	@brief Initial, and smallest, number of buckets in a session's table of pending requests.
+
+	The table doubles as the number of pending requests outgrows it, and halves again as
+	they drain away.  It must stay a power of two.
+*/
+#define OSRF_REQUEST_HASH_SIZE 16
 
 /**
 	@brief Default size of output buffer.
@@ -41,6 +47,40 @@ typedef struct osrf_app_request_struct osrfAppRequest;
 #define OSRF_MSG_BUNDLE_SIZE 25600 /* 25K */
 #define OSRF_MSG_CHUNK_SIZE  (OSRF_MSG_BUNDLE_SIZE * 2)
 
+/**
+	@brief Default number of chunks a client lets a server send ahead of it.
+
+	A server honoring the window stops sending the chunks of a partial response when the
+	client has granted no more, so that a slow client can't make the Jabber server and
+	routers buffer a huge response.  The client grants more as it receives them.
+*/
+#define OSRF_CHUNK_WINDOW 16
+
+/**
+	@brief How many seconds a server waits for a client to grant more chunks before
+	giving up on the response.
+*/
+#define OSRF_CREDIT_TIMEOUT 60
+
+/**
+	@brief Initial, and smallest, number of buckets in the global session cache.
+
+	Like a session's table of requests, the cache doubles and halves with the number of
+	sessions in it, and must stay a power of two.
+*/
+#define OSRF_SESSION_CACHE_SIZE 64
+
+/**
+	@brief Default number of seconds a server session may go unused before the cache
+	frees it; see osrfAppSessionSetIdleTimeout().
+*/
+#define OSRF_SESSION_IDLE_TIMEOUT 600
+
+/**
+	@brief How many freed osrfAppSessions to keep for reuse by new sessions.
+*/
+#define OSRF_SESSION_SPARES 32
+
 /**
 	@brief Representation of a session with another application.
 
@@ -91,8 +131,20 @@ struct osrf_app_session_struct {
 
 	int transport_error;
 
-	/** Hash table of pending requests. */
-	osrfAppRequest* request_hash[ OSRF_REQUEST_HASH_SIZE ];
+	/** Hash table of pending requests, allocated along with the first one. */
+	osrfAppRequest** request_hash;
+	/** Number of buckets in request_hash: a power of two, or zero if not yet allocated. */
+	unsigned int request_hash_size;
+	/** Number of pending requests. */
+	unsigned int request_count;
+	/** The most recently added request, if still pending; checked before the hash table. */
+	osrfAppRequest* last_request;
+	/** Requests waiting for osrfAppSessionSendQueued(), or NULL if none have been queued. */
+	osrfList* queued_requests;
+
+	/** If greater than zero, a server is answering a batch of requests: responses     */
+	/** accumulate in outbuf, to go out together by osrfAppSessionFlush().              */
+	int batch;
 
 	/** Boolean: true if the app wants to terminate the process.  Typically this means that */
 	/** a drone has lost its database connection and can therefore no longer function.      */
@@ -100,6 +152,42 @@ struct osrf_app_session_struct {
 
 	/** Buffer used by server drone to collect outbound response messages */
 	growing_buffer* outbuf;
+	/** How many messages outbuf holds, when it holds them as MessagePack. */
+	int outbuf_count;
+
+	/** For a client: how many chunks of a partial response to take before granting the */
+	/** server more; zero to let it send them as fast as it can.                        */
+	int recv_window;
+	/** For a client: how many milliseconds the server has to answer each request, or */
+	/** zero for no limit.                                                           */
+	int time_budget;
+	/** For a server: the request whose chunks are flow-controlled, or -1 if none, and  */
+	/** how many more chunks the client has granted for it.                             */
+	int credit_request;
+	int send_credit;
+	/** For a server: a request whose response we gave up on when the client granted */
+	/** no more credit, or -1 if none.  Nothing more goes out for it.                 */
+	int abandoned_request;
+
+	/** The body encoding we ask the other side to use when talking to us, and the one */
+	/** we use when talking to it: one of the OSRF_ENCODING_* values.                  */
+	int accept_encoding;
+	int encoding;
+
+	/** For a server, the osrfMethod last run in this session, checked first when the */
+	/** next request arrives; opaque here, and owned by the application registry.     */
+	void* last_method;
+
+	/** When the session last sent or received a message, on the monotonic clock in ms. */
+	long long last_activity;
+	/** If greater than zero, the session is handling messages, and mustn't be evicted. */
+	int in_use;
+	/** Links for the global session cache: a hash of the session id, the next session */
+	/** in the same bucket, and, for a server session, its neighbors by last activity.  */
+	unsigned int cache_hash;
+	struct osrf_app_session_struct* cache_next;
+	struct osrf_app_session_struct* newer;
+	struct osrf_app_session_struct* older;
 };
 typedef struct osrf_app_session_struct osrfAppSession;
 
@@ -121,8 +209,15 @@ char* osrfAppSessionSetIngress( const char* );
 
 const char* osrfAppSessionGetIngress();
 
+/* deadline of the request being served, inherited by the requests it makes */
+long long osrfAppSessionSetDeadline( long long deadline );
+
+long long osrfAppSessionGetDeadline( void );
+
 osrfAppSession* osrf_app_session_find_session( const char* session_id );
 
+void osrfAppSessionSetIdleTimeout( int seconds );
+
 /* DEPRECATED; use osrfAppSessionSendRequest() instead. */
 int osrfAppSessionMakeRequest(
 		osrfAppSession* session, const jsonObject* params,
@@ -132,6 +227,14 @@ int osrfAppSessionSendRequest(
 		 osrfAppSession* session, const jsonObject* params,
 		 const char* method_name, int protocol );
 
+int osrfAppSessionQueueRequest(
+		 osrfAppSession* session, const jsonObject* params,
+		 const char* method_name, int protocol );
+
+int osrfAppSessionSendQueued( osrfAppSession* session );
+
+int osrfAppSessionSendBatch( osrfAppSession* session, osrfMessage* msgs[], int size );
+
 void osrf_app_session_set_complete( osrfAppSession* session, int request_id );
 
 int osrf_app_session_request_complete( const osrfAppSession* session, int request_id );
@@ -139,16 +242,43 @@ int osrf_app_session_request_complete( const osrfAppSession* session, int reques
 osrfMessage* osrfAppSessionRequestRecv(
 		osrfAppSession* session, int request_id, int timeout );
 
+osrfMessage* osrfAppSessionRequestRecvMs(
+		osrfAppSession* session, int request_id, int timeout );
+
+osrfMessage* osrfAppSessionRequestNext( osrfAppSession* session, int request_id );
+
+int osrfAppSessionRequestContinued( osrfAppSession* session, int request_id );
+
 void osrf_app_session_request_finish( osrfAppSession* session, int request_id );
 
 int osrf_app_session_request_resend( osrfAppSession*, int request_id );
 
+int osrfNeedsChunking( const char* payload, size_t payload_size, size_t chunk_size );
+
 int osrfSendChunkedResult(
 		osrfAppSession* session, int request_id, const char* payload,
 		size_t payload_size, size_t chunk_size );
 
 int osrfSendTransportPayload( osrfAppSession* session, const char* payload );
 
+int osrfAppSessionFlush( osrfAppSession* session );
+
+void osrfAppSessionSetWindow( osrfAppSession* session, int window );
+
+void osrfAppSessionSetTimeBudget( osrfAppSession* session, int ms );
+
+void osrfAppSessionSetEncoding( osrfAppSession* session, int encoding );
+
+int osrfAppSessionUseEncoding( osrfAppSession* session, int encoding );
+
+int osrfAppSessionAwaitCredit( osrfAppSession* session, int request_id );
+
+int osrfAppSessionAbandoned( const osrfAppSession* session, int request_id );
+
+void osrfAppSessionCork( osrfAppSession* session );
+
+void osrfAppSessionUncork( osrfAppSession* session );
+
 void osrf_app_session_reset_remote( osrfAppSession* );
 
 void osrf_app_session_set_remote( osrfAppSession* session, const char* remote_id );
@@ -161,8 +291,12 @@ int osrf_app_session_disconnect( osrfAppSession* );
 
 int osrf_app_session_queue_wait( osrfAppSession*, int timeout, int* recvd );
 
+int osrf_app_session_queue_wait_ms( osrfAppSession*, int timeout, int* recvd );
+
 void osrfAppSessionFree( osrfAppSession* );
 
+int osrfAppSessionReset( osrfAppSession* session );
+
 void osrf_app_session_request_reset_timeout( osrfAppSession* session, int req_id );
 
 int osrfAppRequestRespond( osrfAppSession* ses, int requestId, const jsonObject* data );
@@ -22,13 +22,21 @@
 	Any arguments passed to the method are bundled together in a jsonObject inside the
 	osrfMethodContext.
 
-	An application's shared object may also implement any or all of three standard functions:
+	If the client said how long it would wait, the osrfMethodContext has a deadline.  A
+	request whose deadline has passed is answered with OSRF_STATUS_DEADLINEEXCEEDED instead
+	of being run.  A long method may check osrfMethodExpired() as it goes, and give up;
+	any requests it makes of other services inherit what's left of the deadline.
+
+	An application's shared object may also implement any or all of four standard functions:
 
 	- int osrfAppInitialize( void ) Called when an application is registered
+	- int osrfAppTemplateInit( void ) Called once before drones are spawned, to set up
+	  state that they can share (in each drone if the server has no fork template)
 	- int osrfAppChildInit( void ) Called when a server drone is spawned
 	- void osrfAppChildExit( void ) Called when a server drone terminates
 
-	osrfAppInitialize() and osrfAppChild return zero if successful, and non-zero if not.
+	osrfAppInitialize(), osrfAppTemplateInit() and osrfAppChildInit() return zero if
+	successful, and non-zero if not.
 */
 
 #include <opensrf/utils.h>
@@ -72,17 +80,48 @@ extern "C" {
 */
 #define OSRF_METHOD_STREAMING       2
 /**
-	@brief  Notes that a previous result to the same call may be available in memcache.
+	@brief  Notes that a previous result to the same call may be reused.
 
-	Before calling the registered function, a cachable method checks memcache for a previously
-	determined result for the same call.  If no such result is available, it calls the
-	registered function and caches the new result before returning.
+	Before calling the registered function, a cachable method checks a cache for the
+	responses to a previous call with the same parameters.  If it finds them, it sends them
+	again without calling the function at all.  Otherwise it calls the function, and caches
+	the responses before returning.
 
-	This caching is not currently implemented for C methods.
+	For C methods the cache lives in the server process, and optionally in memcache as well;
+	see osrfMethodSetCache().  Only methods whose responses depend on nothing but their
+	parameters should be cachable.
 */
 #define OSRF_METHOD_CACHABLE        8
 /*@}*/
 
+/** Default number of seconds for which a cachable method's responses are reused. */
+#define OSRF_METHOD_CACHE_TTL       60
+
+/** Default number of calls, per server process or thread, whose responses we cache. */
+#define OSRF_METHOD_CACHE_SIZE      256
+
+/** Number of buckets in a method's latency histogram. */
+#define OSRF_LATENCY_BUCKETS        16
+
+/**
+	@brief Running totals for one method, kept by the process that serves it.
+
+	Bucket 0 of the histogram counts calls that took less than a millisecond; bucket n,
+	calls that took less than 2^n milliseconds but at least half that; the last bucket,
+	everything slower.  The counters are updated with atomic increments, so that worker
+	threads can share them.
+*/
+typedef struct {
+	unsigned long calls;                /**< Number of calls finished. */
+	unsigned long cache_hits;           /**< How many of them were answered from the cache. */
+	unsigned long slow;                 /**< How many took longer than the slow threshold. */
+	unsigned long responses;            /**< Number of responses sent. */
+	unsigned long long bytes;           /**< JSON bytes in those sent one at a time. */
+	unsigned long long total_usec;      /**< Total time spent in the calls. */
+	unsigned long max_usec;             /**< Time taken by the slowest call. */
+	unsigned long buckets[ OSRF_LATENCY_BUCKETS ];  /**< Calls by latency. */
+} osrfMethodStats;
+
 typedef struct {
 	char* name;                 /**< Method name. */
 	char* symbol;               /**< Symbol name (function name) within the shared object. */
@@ -93,6 +132,14 @@ typedef struct {
 	void* userData;             /**< Opaque pointer to application-specific data. */
 	size_t max_bundle_size;     /**< How big a buffer to use for non-atomic methods */
 	size_t max_chunk_size;      /**< Maximum content size per message; 0 means no limit */
+	unsigned int hash;          /**< Hash of the name, for the application's method table. */
+	void* function;             /**< The function, once looked up by symbol; else NULL. */
+	int cache_ttl;              /**< Seconds to reuse cached responses, if cachable. */
+	int cache_shared;           /**< Boolean: true to share cached responses via memcache. */
+	int log_every;              /**< Log one call in this many; zero to log none. */
+	unsigned long log_seen;     /**< Calls counted toward sampling the call log. */
+	int log_redact;             /**< Boolean: true to log calls without their parameters. */
+	osrfMethodStats stats;      /**< Latency and volume of the calls served so far. */
 
 	/*
 	int sysmethod;
@@ -108,8 +155,27 @@ typedef struct {
 	jsonObject* params;         /**< Parameters to the method. */
 	int request;                /**< Request id. */
 	jsonObject* responses;      /**< Array of cached responses. */
+	jsonObject* memo;           /**< Copies of the responses sent, for the method cache. */
+	unsigned long response_count;  /**< Number of responses so far. */
+	size_t response_bytes;      /**< JSON bytes in the responses sent one at a time. */
+	long long deadline;         /**< When the client stops waiting, on the monotonic clock
+	                                 in ms; zero if it didn't say. */
 } osrfMethodContext;
 
+/**
+	@brief Callbacks through which a server can watch methods as they run.
+
+	See osrfAppSetMethodMonitor().  Any of the function pointers may be NULL.
+*/
+typedef struct {
+	/** Called just before a method runs. */
+	void (*start) ( const char* methodName );
+	/** Called when a method has finished, with how long it took, in seconds. */
+	void (*finish) ( const char* methodName, double elapsed );
+	/** Builds the response to opensrf.system.drone_stats; the caller frees it. */
+	jsonObject* (*report) ( void );
+} osrfMethodMonitor;
+
 int osrfAppRegisterApplication( const char* appName, const char* soFile );
 
 int osrfAppRegisterMethod( const char* appName, const char* methodName,
@@ -120,6 +186,12 @@ int osrfAppRegisterExtendedMethod( const char* appName, const char* methodName,
 
 int osrfMethodSetBundleSize( const char* appName, const char* methodName, size_t max_bundle_size );
 
+int osrfMethodSetCache( const char* appName, const char* methodName, int ttl, int shared );
+
+int osrfAppLoadMethodCache( const char* appName );
+
+int osrfAppLoadCallLog( const char* appName );
+
 osrfMethod* _osrfAppFindMethod( const char* appName, const char* methodName );
 
 int osrfAppRunMethod( const char* appName, const char* methodName,
@@ -131,12 +203,26 @@ int osrfAppRespond( osrfMethodContext* context, const jsonObject* data );
 
 int osrfAppRespondComplete( osrfMethodContext* context, const jsonObject* data );
 
+int osrfAppRespondOwned( osrfMethodContext* context, jsonObject* data );
+
+int osrfAppRespondCompleteOwned( osrfMethodContext* context, jsonObject* data );
+
+int osrfAppRunTemplateInit(const char* appname);
+
 int osrfAppRunChildInit(const char* appname);
 
 void osrfAppRunExitCode( void );
 
 int osrfMethodVerifyContext( osrfMethodContext* ctx );
 
+long long osrfMethodTimeLeft( const osrfMethodContext* ctx );
+
+int osrfMethodExpired( const osrfMethodContext* ctx );
+
+void osrfAppSetMethodMonitor( const osrfMethodMonitor* monitor );
+
+void osrfAppSetSlowThreshold( double seconds );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,52 @@
+#ifndef OSRF_ARENA_H
+#define OSRF_ARENA_H
+
+/**
+	@file osrf_arena.h
+	@brief Header for osrfArena, a region from which memory is carved and released all at once.
+
+	An osrfArena hands out memory from large blocks by bumping a pointer.  Nothing carved
+	from it is freed individually; instead osrfArenaReset() gives everything back in one
+	go, keeping the first block for reuse, and osrfArenaFree() gives back the arena itself.
+
+	Code that must do something before its memory goes away -- such as freeing heap memory
+	that hangs off an object in the arena -- can register a cleanup with osrfArenaOnReset().
+
+	An osrfArena is not thread-safe; each thread should have its own.
+*/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Default size of the blocks that an osrfArena carves memory from. */
+#define OSRF_ARENA_BLOCK_SIZE 65536
+
+struct osrf_arena_struct;
+typedef struct osrf_arena_struct osrfArena;
+
+osrfArena* osrfNewArena( size_t block_size );
+
+void* osrfArenaAlloc( osrfArena* arena, size_t size );
+
+void* osrfArenaCalloc( osrfArena* arena, size_t size );
+
+char* osrfArenaStrdup( osrfArena* arena, const char* str );
+
+void osrfArenaOnReset( osrfArena* arena, void (*func)( void* ), void* data );
+
+int osrfArenaCancel( osrfArena* arena, void (*func)( void* ), void* data );
+
+size_t osrfArenaUsed( const osrfArena* arena );
+
+void osrfArenaReset( osrfArena* arena );
+
+void osrfArenaFree( osrfArena* arena );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef OSRF_BACKLOG_H
+#define OSRF_BACKLOG_H
+
+/**
+	@file osrf_backlog.h
+	@brief Header for the queue of requests waiting for a prefork child.
+
+	The backlog is really three queues, one for each priority class: requests are served
+	from the highest class that has any, oldest first.  When the backlog is full, a new
+	request may take the place of the newest request in a lower class; otherwise it is
+	turned away.
+
+	An empty backlog always takes a request, whatever its limit, so that a limit of zero
+	still lets one request wait for the next child to come free.
+*/
+
+#include <opensrf/transport_message.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OSRF_PRIORITY_HIGH   0  /**< Priority class for interactive requests. */
+#define OSRF_PRIORITY_NORMAL 1  /**< Priority class for requests not otherwise assigned. */
+#define OSRF_PRIORITY_LOW    2  /**< Priority class for bulk or batch requests. */
+#define OSRF_PRIORITY_COUNT  3
+
+/**
+	@brief A request waiting in the backlog for a child to become available.
+*/
+struct osrfBacklogItemStruct {
+	transport_message* msg;   /**< The request. */
+	double arrived;           /**< When the listener received it, in seconds. */
+	long long deadline;       /**< When its client stops waiting, on the monotonic clock in
+	                               ms; zero if it didn't say. */
+	int priority;             /**< One of the OSRF_PRIORITY_* values. */
+	struct osrfBacklogItemStruct* next;  /**< Linkage pointer for linked list. */
+};
+typedef struct osrfBacklogItemStruct osrfBacklogItem;
+
+/**
+	@brief Requests waiting for a child to become available, in order of priority and arrival.
+
+	Initialize by zeroing it.
+*/
+typedef struct {
+	osrfBacklogItem* head[ OSRF_PRIORITY_COUNT ];  /**< Oldest request in each class. */
+	osrfBacklogItem* tail[ OSRF_PRIORITY_COUNT ];  /**< Newest request in each class. */
+	osrfBacklogItem* free_list;  /**< Used osrfBacklogItems, available for reuse. */
+	int size;                    /**< Number of requests in all classes. */
+} osrfBacklog;
+
+void osrfBacklogPush( osrfBacklog* queue, transport_message* msg, int priority,
+	long long deadline );
+
+transport_message* osrfBacklogAdmit( osrfBacklog* queue, transport_message* msg,
+	int priority, long long deadline, int limit );
+
+osrfBacklogItem* osrfBacklogPeek( osrfBacklog* queue );
+
+transport_message* osrfBacklogPop( osrfBacklog* queue, int priority );
+
+transport_message* osrfBacklogEvict( osrfBacklog* queue, int priority );
+
+void osrfBacklogClear( osrfBacklog* queue );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,8 +19,13 @@ typedef struct __osrfBigHashStruct osrfBigHash;
 
 
 struct __osrfBigHashIteratorStruct {
-	char* current;
+	char* current;						/* the current key (points into key), or NULL */
 	osrfBigHash* hash;
+	uint8_t key[OSRF_HASH_MAXKEY];		/* the current key, advanced in place by Judy */
+	char* start;						/* the first key to consider, or NULL */
+	size_t prefix_len;					/* how much of start every key must share */
+	char* end;							/* the first key past the range, or NULL */
+	int done;							/* true once the iterator has run off the end */
 };
 typedef struct __osrfBigHashIteratorStruct osrfBigHashIterator;
 
@@ -75,6 +80,22 @@ unsigned long osrfBigHashGetCount( osrfBigHash* hash );
   */
 osrfBigHashIterator* osrfNewBigHashIterator( osrfBigHash* hash );
 
+/**
+  Creates an iterator over the items whose keys begin with the given
+  prefix, in key order.  Returns NULL if the prefix is too long to be
+  the start of a key.
+  */
+osrfBigHashIterator* osrfNewBigHashPrefixIterator( osrfBigHash* hash, const char* prefix );
+
+/**
+  Creates an iterator over the items whose keys are at least 'from' and
+  less than 'to', in key order.  A NULL 'from' starts with the first key;
+  a NULL 'to' runs through the last.  Returns NULL if 'from' is too long
+  to be a key.
+  */
+osrfBigHashIterator* osrfNewBigHashRangeIterator( osrfBigHash* hash,
+		const char* from, const char* to );
+
 /**
   Returns the next non-NULL item in the list, return NULL when
   the end of the list has been reached
@@ -88,6 +109,13 @@ void osrfBigHashIteratorFree( osrfBigHashIterator* itr );
 
 void osrfBigHashIteratorReset( osrfBigHashIterator* itr );
 
+/**
+  @return The key of the item last returned by osrfBigHashIteratorNext(),
+  or NULL if there is none.  The key belongs to the iterator, and changes
+  with the next call to osrfBigHashIteratorNext(); copy it to keep it.
+  */
+const char* osrfBigHashIteratorKey( const osrfBigHashIterator* itr );
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,6 +17,8 @@ GNU General Public License for more details.
 #define OSRF_CACHE_H
 
 #include <opensrf/osrf_json.h>
+#include <opensrf/osrf_hash.h>
+#include <opensrf/string_array.h>
 #include <libmemcached/memcached.h>
 #include <opensrf/log.h>
 
@@ -29,6 +31,31 @@ extern "C" {
   */
 
 
+/**
+  How the memcached client talks to the servers.  Each member is a boolean.
+  */
+typedef struct {
+	int binary_protocol;     /**< Speak the binary protocol instead of text */
+	int tcp_nodelay;         /**< Send small requests at once (TCP_NODELAY) */
+	int consistent_hashing;  /**< Spread keys by ketama, so adding a server moves few */
+	int noreply;             /**< Don't wait for the server to acknowledge stores and deletes */
+	int non_blocking;        /**< Use non-blocking I/O */
+} osrfCacheBehaviors;
+
+/**
+  Fill in the default behaviors: consistent hashing, noreply, and TCP_NODELAY on;
+  the binary protocol and non-blocking I/O off.
+  */
+void osrfCacheDefaultBehaviors( osrfCacheBehaviors* behaviors );
+
+/**
+  Set the behaviors for the cache connection, taking effect at once if the cache is
+  already initialized, and otherwise when osrfCacheInit() is called.  Until this is
+  called, the defaults from osrfCacheDefaultBehaviors() apply.
+  @return 0 on success, -1 on error
+  */
+int osrfCacheSetBehaviors( const osrfCacheBehaviors* behaviors );
+
 /**
   Initialize the cache.
   @param serverStrings An array of "ip:port" strings to use as cache servers
@@ -39,6 +66,35 @@ extern "C" {
 int osrfCacheInit( const char* serverStrings[], int size, time_t maxCacheSeconds );
 
 
+/**
+  Compress values of at least threshold bytes before storing them; 0, the default,
+  turns compression off.  Values are gzipped and flagged the way Cache::Memcached
+  does it, so Perl clients read them as they are.  Compressed values are read back
+  whatever the threshold.
+  */
+void osrfCacheSetCompression( size_t threshold );
+
+/**
+  The most seconds an object may live in the in-process cache, however
+  osrfCacheInitLocal() is called.
+  */
+#define OSRF_CACHE_LOCAL_MAX_AGE 60
+
+/**
+  Turn on (or off) an in-process cache in front of memcached.
+  @param maxItems How many parsed objects each thread may keep; 0 turns the local
+	cache off
+  @param maxAge How many seconds an object may be served locally before it is
+	fetched again, capped at OSRF_CACHE_LOCAL_MAX_AGE
+
+  osrfCacheGetObject() and osrfCacheGetObjects() look here first, and remember what
+  memcached gives them.  Local puts and removes forget the key, but changes made by
+  other processes go unseen for up to maxAge seconds, so reserve this for data that can
+  stand that.
+  @return 0 on success, -1 on error
+  */
+int osrfCacheInitLocal( int maxItems, time_t maxAge );
+
 /**
   Puts an object into the cache
   @param key The cache key
@@ -59,6 +115,18 @@ int osrfCachePutObject( const char* key, const jsonObject* obj, time_t seconds )
   */
 int osrfCachePutString( const char* key, const char* value, time_t seconds);
 
+/**
+  Puts a string into the cache, unless the key is already there.  Since the check
+  and the store happen together in memcached, of several processes adding the same
+  key only one succeeds, which makes this a lock shared among them
+  @param key The cache key
+  @param value The string to cache
+  @param seconds The amount of time to cache the data, negative number means
+	to cache up to 'maxCacheSeconds' as set by osrfCacheInit()
+  @return 0 if stored, 1 if the key was already there, -1 on error
+  */
+int osrfCacheAddString( const char* key, const char* value, time_t seconds );
+
 /**
   Grabs an object from the cache.
   @param key The cache key
@@ -79,6 +147,46 @@ char* osrfCacheGetString( const char* key, ... );
   */
 int osrfCacheRemove( const char* key, ... );
 
+/**
+  Grabs several objects from the cache in one round trip.
+  @param keys The cache keys
+  @return An osrfHash (which must be freed) holding an object for each key that was
+	found, keyed the way it was asked for.  Freeing the hash frees the objects.
+	Returns NULL if keys is NULL.
+  */
+osrfHash* osrfCacheGetObjects( const osrfStringArray* keys );
+
+/**
+  Grabs several strings from the cache in one round trip.
+  @param keys The cache keys
+  @return An osrfHash (which must be freed) holding a string for each key that was
+	found, keyed the way it was asked for.  Freeing the hash frees the strings.
+	Returns NULL if keys is NULL.
+  */
+osrfHash* osrfCacheGetStrings( const osrfStringArray* keys );
+
+/**
+  Puts several objects into the cache, sending the requests together.
+  @param objs An osrfHash of jsonObjects, keyed by cache key
+  @param seconds As for osrfCachePutObject()
+  @return 0 on success, -1 on error
+  */
+int osrfCachePutObjects( osrfHash* objs, time_t seconds );
+
+/**
+  Puts several strings into the cache, sending the requests together.
+  @param strings An osrfHash of strings, keyed by cache key
+  @param seconds As for osrfCachePutString()
+  @return 0 on success, -1 on error
+  */
+int osrfCachePutStrings( osrfHash* strings, time_t seconds );
+
+/**
+  Removes the items with the given keys from the cache, sending the requests together.
+  @return 0 on success, -1 on error.
+  */
+int osrfCacheRemoveMany( const osrfStringArray* keys );
+
 /**
  * Sets the expire time to 'seconds' for the given key
  */
@@ -0,0 +1,71 @@
+#ifndef OSRF_CAPTURE_H
+#define OSRF_CAPTURE_H
+
+/**
+	@file osrf_capture.h
+	@brief Header for capturing the requests a service receives, for replay elsewhere.
+
+	A service configured with a capture file appends a record to it for every REQUEST
+	that reaches one of its drones: when it arrived, the service and method, the xid,
+	and the parameters as JSON.  The parameters of methods matched by log_protect are
+	left out.  srfsh's "replay" command reads the file back, and makes the same calls
+	against another cluster, with the same spacing in time, or scaled, or as fast as
+	it can.
+
+	The file starts with an eight-byte magic string, "OSRFCAP1".  Every record after it
+	is laid out as follows, all integers unsigned and little-endian:
+
+	- 4 bytes: length of the rest of the record;
+	- 8 bytes: arrival time, in microseconds since the epoch;
+	- 2 bytes: length of the service name, followed by the name;
+	- 2 bytes: length of the method name, followed by the name;
+	- 2 bytes: length of the xid, followed by the xid;
+	- 4 bytes: length of the parameters, followed by the JSON array, or nothing if the
+	parameters were protected.
+
+	A reader skips whatever follows the fields it knows in a record, so that a later
+	version may add some.
+*/
+
+#include <opensrf/osrf_message.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief The magic string at the start of a capture file. */
+#define OSRF_CAPTURE_MAGIC "OSRFCAP1"
+
+/**
+	@brief One captured request, as read back by osrfCaptureRead().
+
+	The strings belong to the osrfCaptureFile, and last until the next read.
+*/
+typedef struct {
+	long long time;         /**< Arrival time, in microseconds since the epoch. */
+	const char* service;    /**< Name of the service. */
+	const char* method;     /**< Name of the method. */
+	const char* xid;        /**< The request's xid; may be empty. */
+	const char* params;     /**< JSON array of parameters, or NULL if protected. */
+} osrfCaptureRecord;
+
+struct osrf_capture_file_struct;
+typedef struct osrf_capture_file_struct osrfCaptureFile;
+
+int osrfCaptureInit( const char* path );
+
+int osrfCaptureEnabled( void );
+
+void osrfCaptureRequest( const char* service, osrfMessage* msg );
+
+osrfCaptureFile* osrfCaptureOpen( const char* path );
+
+int osrfCaptureRead( osrfCaptureFile* file, osrfCaptureRecord* record );
+
+void osrfCaptureClose( osrfCaptureFile* file );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,18 +20,51 @@
 	@file osrf_digest.h
 	@brief Header for digest functions.
 
-	In each case, the input is a nul-terminated character string.  The result is returned
+	The one-shot functions take a nul-terminated character string.  The result is returned
 	in a structure provided by the calling code, both in a binary buffer and in a
 	nul-terminated string of hex characters encoding the same value.
+
+	An osrfDigest computes a digest incrementally, from input fed to it in pieces, so that
+	the calling code needn't assemble the pieces into one string first.
+
+	All the digests come from gnutls, which uses the CPU's hash instructions where it has
+	them.  Where gnutls refuses MD5, as in FIPS mode, MD5 comes from the bundled md5.c
+	instead, since we use it for naming things rather than for security.
 */
 
 #ifndef OSRF_DIGEST_H
 #define OSRF_DIGEST_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** @brief Size, in bytes, of the largest digest we compute. */
+#define OSRF_DIGEST_MAX_SIZE 32
+
+/**
+	@brief The digest algorithms available.
+*/
+typedef enum {
+	OSRF_DIGEST_MD5,        /**< MD5: 16 bytes. */
+	OSRF_DIGEST_SHA1,       /**< SHA-1: 20 bytes. */
+	OSRF_DIGEST_SHA256      /**< SHA-256: 32 bytes. */
+} osrfDigestAlgorithm;
+
+/**
+	@brief A digest in progress.
+
+	Start one with osrfDigestInit(), feed it with osrfDigestUpdate(), and finish it with
+	osrfDigestFinal(), which releases what osrfDigestInit() acquired.
+*/
+typedef struct {
+	void* handle;                   /**< The underlying gnutls hash, or NULL. */
+	void* md5;                      /**< The bundled MD5, used instead; or NULL. */
+	osrfDigestAlgorithm algorithm;  /**< Which digest we're computing. */
+} osrfDigest;
+
 /**
 	@brief Contains an SHA1 digest.
 */
@@ -40,6 +73,14 @@ typedef struct {
 	char hex[ 41 ];              /**< Same digest, in the form of a hex string. */
 } osrfSHA1Buffer;
 
+/**
+	@brief Contains an SHA256 digest.
+*/
+typedef struct {
+	unsigned char binary[ 32 ];  /**< Binary SHA256 digest. */
+	char hex[ 65 ];              /**< Same digest, in the form of a hex string. */
+} osrfSHA256Buffer;
+
 /**
 	@brief Contains an MD5 digest.
 */
@@ -48,10 +89,22 @@ typedef struct {
 	char hex[ 33 ];              /**< Same digest, in the form of a hex string. */
 } osrfMD5Buffer;
 
+size_t osrfDigestSize( osrfDigestAlgorithm algorithm );
+
+int osrfDigestInit( osrfDigest* digest, osrfDigestAlgorithm algorithm );
+
+void osrfDigestUpdate( osrfDigest* digest, const void* data, size_t len );
+
+size_t osrfDigestFinal( osrfDigest* digest, unsigned char* binary, char* hex );
+
 void osrf_sha1_digest( osrfSHA1Buffer* result, const char *str );
 
 void osrf_sha1_digest_fmt( osrfSHA1Buffer* result, const char* str, ... );
 
+void osrf_sha256_digest( osrfSHA256Buffer* result, const char *str );
+
+void osrf_sha256_digest_fmt( osrfSHA256Buffer* result, const char* str, ... );
+
 void osrf_md5_digest( osrfMD5Buffer* result, const char *str );
 
 void osrf_md5_digest_fmt( osrfMD5Buffer* result, const char* str, ... );
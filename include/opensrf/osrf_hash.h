@@ -27,10 +27,18 @@ typedef struct _osrfHashStruct osrfHash;
 struct _osrfHashIteratorStruct;
 typedef struct _osrfHashIteratorStruct osrfHashIterator;
 
+struct _osrfHashNodeStruct;
+/** @brief A position in an osrfHash, for traversal without allocating an iterator. */
+typedef const struct _osrfHashNodeStruct* osrfHashCursor;
+
 osrfHash* osrfNewHash();
 
+osrfHash* osrfNewHashArena( osrfArena* arena );
+
 void osrfHashSetCallback( osrfHash* hash, void (*callback) (char* key, void* item) );
 
+void osrfHashInternKeys( osrfHash* hash );
+
 void* osrfHashSet( osrfHash* hash, void* item, const char* key, ... );
 
 void* osrfHashRemove( osrfHash* hash, const char* key, ... );
@@ -59,6 +67,8 @@ void osrfHashIteratorFree( osrfHashIterator* itr );
 
 void osrfHashIteratorReset( osrfHashIterator* itr );
 
+void* osrfHashCursorNext( const osrfHash* hash, osrfHashCursor* cursor, const char** key );
+
 #ifdef __cplusplus
 }
 #endif
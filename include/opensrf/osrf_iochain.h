@@ -0,0 +1,71 @@
+#ifndef OSRF_IOCHAIN_H
+#define OSRF_IOCHAIN_H
+
+/**
+	@file osrf_iochain.h
+	@brief Header for osrfIoChain, a buffer made of slices, for scatter-gather output.
+
+	An osrfIoChain is a series of slices that together make up one stream of bytes, such
+	as a stanza, without being copied into one place.  A slice may be:
+	- a copy, in storage that belongs to the chain (for small or computed pieces);
+	- static text, such as a string literal, which must outlive the chain;
+	- a reference to someone else's storage, such as a reference-counted message body,
+	which the chain releases, through a callback, when it is done with it.
+
+	The slices are kept as an array of struct iovec, ready to hand to writev().  Sending
+	may consume the array, so reset the chain afterwards instead of sending it twice.
+*/
+
+#include <sys/uio.h>
+#include <opensrf/utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Callback that gives back a reference held by a slice. */
+typedef void (*osrfIoRelease)( void* owner );
+
+struct osrfIoBlockStruct;
+typedef struct osrfIoBlockStruct osrfIoBlock;
+
+/** @brief What a slice has to give back when the chain is done with it. */
+typedef struct {
+	osrfIoRelease release;   /**< Callback, or NULL if there is nothing to give back. */
+	void* owner;             /**< What to pass to the callback. */
+} osrfIoRef;
+
+/**
+	@brief A series of slices making up one stream of bytes.
+*/
+typedef struct {
+	struct iovec* iov;       /**< The slices, in order. */
+	osrfIoRef* refs;         /**< What each slice holds a reference to, if anything. */
+	int count;               /**< Number of slices. */
+	int size;                /**< Capacity of iov and refs. */
+	size_t length;           /**< Total length of the slices. */
+	osrfIoBlock* blocks;     /**< Storage for copied slices, newest first. */
+} osrfIoChain;
+
+osrfIoChain* osrfNewIoChain( void );
+
+int osrfIoChainAdd( osrfIoChain* chain, const char* data, size_t len );
+
+int osrfIoChainAddStatic( osrfIoChain* chain, const char* data, size_t len );
+
+int osrfIoChainAddRef( osrfIoChain* chain, const char* data, size_t len,
+		osrfIoRelease release, void* owner );
+
+char* osrfIoChainAlloc( osrfIoChain* chain, size_t len );
+
+char* osrfIoChainFlatten( const osrfIoChain* chain );
+
+void osrfIoChainReset( osrfIoChain* chain );
+
+void osrfIoChainFree( osrfIoChain* chain );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
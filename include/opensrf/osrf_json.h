@@ -103,12 +103,25 @@ extern "C" {
 	(We used to store numbers as doubles.  We still have the @em n member lying around as
 	a relic of those times, but we don't use it.  We can't get rid of it yet, either.  Long
 	story.)
+
+	The string remains the authoritative form of a JSON_NUMBER, but the first time anyone
+	asks for its numeric value we convert it and keep the result in @em num: as a 64-bit
+	integer if the string is one, and as a double otherwise.  jsonNewNumberObject() and
+	jsonObjectSetNumber() fill it in right away.  Code that writes to @em value.s directly
+	must set @em num_cache to zero.
+
+	A jsonObject created while an osrfArena is in effect (see jsonSetArena()) lives in that
+	arena, along with its strings and containers.
 */
 struct _jsonObjectStruct {
 	unsigned long size;     /**< Number of sub-items. */
 	char* classname;        /**< Optional class hint (not part of the JSON spec). */
 	int type;               /**< JSON type. */
+	int num_cache;          /**< For a JSON_NUMBER, what @em num holds: zero for nothing yet. */
+	unsigned int refs;      /**< Zero if private; else how many hold us (see jsonObjectShare()). */
+	int class_interned;     /**< Boolean: true if @em classname is interned, not ours to free. */
 	struct _jsonObjectStruct* parent;   /**< Whom we're attached to. */
+	osrfArena* arena;       /**< Arena we live in, or NULL if we're on the heap. */
 	/** Union used for various types of cargo. */
 	union _jsonValue {
 		osrfHash*	h;      /**< Object container. */
@@ -117,6 +130,11 @@ struct _jsonObjectStruct {
 		int 		b;      /**< Bool. */
 		double	n;          /**< Number (no longer used). */
 	} value;
+	/** Native value of a JSON_NUMBER, as described by @em num_cache. */
+	union _jsonNumber {
+		long long i;        /**< Value of an integer. */
+		double d;           /**< Value of anything else. */
+	} num;
 };
 typedef struct _jsonObjectStruct jsonObject;
 
@@ -166,6 +184,8 @@ void jsonObjectFree( jsonObject* o );
 
 void jsonObjectFreeUnused( void );
 
+osrfArena* jsonSetArena( osrfArena* arena );
+
 unsigned long jsonObjectPush(jsonObject* o, jsonObject* newo);
 
 unsigned long jsonObjectSetKey(
@@ -196,12 +216,16 @@ unsigned long jsonObjectRemoveIndex(jsonObject* dest, unsigned long index);
 
 jsonObject* jsonObjectExtractIndex(jsonObject* dest, unsigned long index);
 
+jsonObject* jsonObjectExtractKey( jsonObject* dest, const char* key );
+
 unsigned long jsonObjectRemoveKey( jsonObject* dest, const char* key);
 
 const char* jsonObjectGetString(const jsonObject*);
 
 double jsonObjectGetNumber( const jsonObject* obj );
 
+long long jsonObjectGetInteger( const jsonObject* obj );
+
 void jsonObjectSetString(jsonObject* dest, const char* string);
 
 void jsonObjectSetNumber(jsonObject* dest, double num);
@@ -218,6 +242,16 @@ void jsonSetBool(jsonObject* bl, int val);
 
 jsonObject* jsonObjectClone( const jsonObject* o );
 
+jsonObject* jsonObjectShare( jsonObject* o );
+
+int jsonObjectIsShared( const jsonObject* o );
+
+jsonObject* jsonObjectMakeWritable( jsonObject* o );
+
+jsonObject* jsonObjectGetKeyWritable( jsonObject* obj, const char* key );
+
+jsonObject* jsonObjectGetIndexWritable( jsonObject* obj, unsigned long index );
+
 char* jsonObjectToSimpleString( const jsonObject* o );
 
 char* doubleToString( double num );
@@ -242,6 +276,27 @@ char* jsonScrubNumber( const char* s );
 */
 jsonObject* jsonObjectFindPath( const jsonObject* obj, const char* path, ... );
 
+/**
+	@brief A search path compiled for jsonObjectFindPath() and kin, to be evaluated many times.
+
+	See jsonPathCompile().
+*/
+struct jsonPathStruct;
+typedef struct jsonPathStruct jsonPath;
+
+jsonPath* jsonPathCompile( const char* path );
+
+void jsonPathFree( jsonPath* path );
+
+int jsonPathIsMulti( const jsonPath* path );
+
+const jsonObject* jsonPathFind( const jsonPath* path, const jsonObject* obj );
+
+unsigned long jsonPathFindAll( const jsonPath* path, const jsonObject* obj,
+		osrfList* results );
+
+jsonObject* jsonPathEval( const jsonPath* path, const jsonObject* obj );
+
 
 /**
 	@brief Prettify a JSON string for printing, by adding newlines and other white space.
@@ -282,6 +337,15 @@ jsonObject* jsonObjectDecodeClass( const jsonObject* obj );
  */ 
 jsonObject* jsonObjectEncodeClass( const jsonObject* obj );
 
+/* Like jsonObjectDecodeClass() and jsonObjectEncodeClass(), but
+ * rearrange the object instead of copying it.  They take over the
+ * object, which must not be part of another; the caller uses and
+ * frees the returned object instead.
+ */
+jsonObject* jsonObjectDecodeClassInPlace( jsonObject* obj );
+
+jsonObject* jsonObjectEncodeClassInPlace( jsonObject* obj );
+
 /* ------------------------------------------------------------------------- */
 
 
@@ -294,6 +358,27 @@ char* jsonObjectToXML(const jsonObject*);
  */
 jsonObject* jsonXMLToJSONObject(const char* xml);
 
+/*
+ * Streaming versions of the above.  jsonObjectToXMLStream() hands the
+ * XML to a sink every few kilobytes; the sink gets the next len bytes
+ * (not nul-terminated) and returns non-zero to stop.  A jsonXMLParser
+ * builds a JSON object from XML pushed to it in pieces.
+ */
+typedef int (*jsonXMLSink)( void* blob, const char* data, size_t len );
+
+int jsonObjectToXMLStream( const jsonObject* obj, jsonXMLSink sink, void* blob );
+
+struct jsonXMLParserStruct;
+typedef struct jsonXMLParserStruct jsonXMLParser;
+
+jsonXMLParser* jsonNewXMLParser( void );
+
+int jsonXMLParserPush( jsonXMLParser* p, const char* data, size_t len );
+
+jsonObject* jsonXMLParserFinish( jsonXMLParser* p );
+
+void jsonXMLParserFree( jsonXMLParser* p );
+
 #ifdef __cplusplus
 }
 #endif
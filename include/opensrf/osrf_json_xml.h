@@ -29,6 +29,20 @@ char* jsonObjectToXML( const jsonObject*);
  */
 jsonObject* jsonXMLToJSONObject(const char* xml);
 
+/*
+ * Streaming versions of the above; jsonXMLSink and jsonXMLParser are
+ * declared in osrf_json.h
+ */
+int jsonObjectToXMLStream( const jsonObject* obj, jsonXMLSink sink, void* blob );
+
+jsonXMLParser* jsonNewXMLParser( void );
+
+int jsonXMLParserPush( jsonXMLParser* p, const char* data, size_t len );
+
+jsonObject* jsonXMLParserFinish( jsonXMLParser* p );
+
+void jsonXMLParserFree( jsonXMLParser* p );
+
 #ifdef __cplusplus
 }
 #endif
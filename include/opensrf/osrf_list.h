@@ -21,12 +21,17 @@
 	stored, treating it as disposable.  Conclusion: you can store NULLs in an osrfList, but
 	not safely, unless you are familiar with the internal details of the implementation and
 	work around them accordingly.
+
+	A list created with no more than OSRF_LIST_INLINE_SIZE slots keeps them inside the
+	osrfList itself, and allocates an array only when it outgrows them.  Most JSON arrays
+	hold only a few items, so most of them never allocate an array at all.
  */
 
 #ifndef OSRF_LIST_H
 #define OSRF_LIST_H
 
 #include <opensrf/utils.h>
+#include <opensrf/osrf_arena.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,6 +44,9 @@ extern "C" {
 */
 #define OSRF_LIST_GET_INDEX(l, i) (!(l) || (i) >= (l)->size) ? NULL: (l)->arrlist[(i)]
 
+/** @brief How many slots an osrfList holds within itself. */
+#define OSRF_LIST_INLINE_SIZE 4
+
 /**
 	@brief Structure for managing an array of pointers.
 */
@@ -51,6 +59,10 @@ struct _osrfListStruct {
 	void** arrlist;
 	/** @brief Capacity of the currently allocated array. */
 	int arrsize;
+	/** @brief Arena the list and its array come from, or NULL for the heap. */
+	osrfArena* arena;
+	/** @brief Slots used as the array until the list outgrows them. */
+	void* inline_slots[ OSRF_LIST_INLINE_SIZE ];
 };
 typedef struct _osrfListStruct osrfList;
 
@@ -68,6 +80,10 @@ typedef struct _osrfListIteratorStruct osrfListIterator;
 
 osrfList* osrfNewListSize( unsigned int size );
 
+osrfList* osrfNewListArena( osrfArena* arena, unsigned int size );
+
+void osrfListInit( osrfList* list, unsigned int size );
+
 osrfListIterator* osrfNewListIterator( const osrfList* list );
 
 void* osrfListIteratorNext( osrfListIterator* itr );
@@ -80,6 +96,10 @@ osrfList* osrfNewList();
 
 int osrfListPush( osrfList* list, void* item );
 
+int osrfListPushMany( osrfList* list, void* const* items, unsigned int count );
+
+int osrfListReserve( osrfList* list, unsigned int size );
+
 void* osrfListPop( osrfList* list );
 
 void* osrfListSet( osrfList* list, void* item, unsigned int position );
@@ -32,7 +32,11 @@ extern "C" {
 
 #define OSRF_XML_NAMESPACE "http://open-ils.org/xml/namespaces/oils_v1"
 
+/* the max number of oilsMessage blobs present in any one root packet */
+#define OSRF_MAX_MSGS_PER_PACKET 256
+
 #define OSRF_STATUS_CONTINUE             100
+#define OSRF_STATUS_CREDIT               101
 
 #define OSRF_STATUS_OK                   200
 #define OSRF_STATUS_ACCEPTED             202
@@ -54,11 +58,23 @@ extern "C" {
 #define OSRF_STATUS_INTERNALSERVERERROR  500
 #define OSRF_STATUS_NOTIMPLEMENTED       501
 #define OSRF_STATUS_SERVICEUNAVAILABLE   503
+/** The request's deadline passed before a server got to it; unlike OSRF_STATUS_TIMEOUT,
+    it isn't worth sending again. */
+#define OSRF_STATUS_DEADLINEEXCEEDED     504
 #define OSRF_STATUS_VERSIONNOTSUPPORTED  505
 
 
 enum M_TYPE { CONNECT, REQUEST, RESULT, STATUS, DISCONNECT };
 
+/**
+	@name Body encodings
+	@brief How a batch of osrfMessages may travel in a transport message.
+*/
+/*@{*/
+#define OSRF_ENCODING_JSON     0  /**< A JSON array; always understood. */
+#define OSRF_ENCODING_MSGPACK  1  /**< MessagePack in text form; see osrf_msgpack.h. */
+/*@}*/
+
 struct osrf_message_struct {
 
 	/** One of the four message types: CONNECT, REQUEST, RESULT, STATUS, or DISCONNECT. */
@@ -91,17 +107,44 @@ struct osrf_message_struct {
 	/** For a REQUEST message: parameters to pass to the remote procedure call. */
 	jsonObject* _params;
 
+	/** After lazy deserialization: the JSON text of the params, until something asks
+	    for them.  See osrfMessageGetParams(). */
+	char* _raw_params;
+
+	/** After lazy deserialization: the JSON text of the result content, until something
+	    asks for it.  See osrfMessageGetResult(). */
+	char* _raw_content;
+
 	/** Pointer for linked lists.  Used only by calling code. */
 	struct osrf_message_struct* next;
 
-	/** Magical LOCALE hint. */
-	char* sender_locale;
+	/** Magical LOCALE hint.  Like the other hints, normally a string shared by way of
+	    osrf_intern(); set it only through its setter. */
+	const char* sender_locale;
 
 	/** Magical ingress hint. */
-	char* sender_ingress;
+	const char* sender_ingress;
 
 	/** Magical TZ hint. */
-	char* sender_tz;
+	const char* sender_tz;
+
+	/** Bit switches noting which hints are private copies, to be freed with the message. */
+	int own_hints;
+
+	/** Flow control for partial (chunked) responses.  On a REQUEST: how many chunks the
+	    client takes before it must grant more.  On a STATUS with OSRF_STATUS_CREDIT: how
+	    many more it grants.  Zero for no flow control. */
+	int window;
+
+	/** Body encoding.  On a CONNECT, or a stateless REQUEST: the best encoding the sender
+	    can read, one of the OSRF_ENCODING_* values.  On the STATUS answering a CONNECT:
+	    the encoding the server agrees to.  OSRF_ENCODING_JSON if unspecified. */
+	int encoding;
+
+	/** On a REQUEST: when the caller stops waiting for an answer, in milliseconds on the
+	    monotonic clock (see get_monotonic_millis()); zero for no deadline.  On the wire
+	    it's the time left when the message was serialized. */
+	long long deadline;
 };
 typedef struct osrf_message_struct osrfMessage;
 
@@ -128,6 +171,8 @@ void osrf_message_set_result( osrfMessage* msg, const jsonObject* obj );
 
 void osrfMessageFree( osrfMessage* );
 
+long long osrfMessageTimeLeft( const osrfMessage* msg );
+
 char* osrf_message_to_xml( osrfMessage* );
 
 jsonObject* osrfMessageToJSON( const osrfMessage* msg );
@@ -138,6 +183,12 @@ osrfList* osrfMessageDeserialize( const char* string, osrfList* list );
 
 int osrf_message_deserialize(const char* json, osrfMessage* msgs[], int count);
 
+osrfList* osrfMessageDeserializeLazy( const char* string, osrfList* list );
+
+int osrf_message_deserialize_lazy( const char* json, osrfMessage* msgs[], int count );
+
+osrfMessage* osrfMessageFromJSON( const jsonObject* obj );
+
 void osrf_message_set_params( osrfMessage* msg, const jsonObject* o );
 
 void osrf_message_set_method( osrfMessage* msg, const char* method_name );
@@ -148,8 +199,20 @@ void osrf_message_add_param( osrfMessage*, const char* param_string );
 
 const jsonObject* osrfMessageGetResult( osrfMessage* msg );
 
+const jsonObject* osrfMessageGetParams( osrfMessage* msg );
+
 char* osrfMessageSerializeBatch( osrfMessage* msgs [], int count );
 
+char* osrfMessageSerializeBatchEncoded( osrfMessage* msgs [], int count, int encoding );
+
+/** What follows the content in the JSON for a RESULT message; see osrfMessageAddResultPrefix(). */
+#define OSRF_RESULT_JSON_SUFFIX "}}}}"
+
+void osrfMessageAddResultPrefix( growing_buffer* buf, const osrfMessage* msg );
+
+void osrfMessageAddMsgpack( growing_buffer* buf, const osrfMessage* msg,
+		const jsonObject* content );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,60 @@
+#ifndef OSRF_MESSAGE_STREAM_H
+#define OSRF_MESSAGE_STREAM_H
+
+/**
+	@file osrf_message_stream.h
+	@brief Header for decoding osrfMessages incrementally, as their JSON arrives.
+
+	An osrfMessageStream is fed a JSON array of osrfMessages a chunk at a time, in the form
+	osrf_message_deserialize() accepts.  It hands each osrfMessage to a callback as soon as
+	the message is complete.
+
+	If the content of a RESULT is an array, each element goes to a second callback when that
+	element is complete, instead of accumulating in the message.  The message then arrives
+	with an empty array for its content.  So a client can deal with a huge result one row at
+	a time, without ever holding all of it as a jsonObject.
+
+	The JSON is parsed by a JSONPushParser; see jsonpush.h.
+*/
+
+#include "opensrf/osrf_message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct osrf_message_stream_struct;
+typedef struct osrf_message_stream_struct osrfMessageStream;
+
+/**
+	@brief Callback for each element of the content of a RESULT.
+
+	@a index is the position of the message in the array, starting at zero.  The row
+	belongs to the callback, which must eventually free it with jsonObjectFree().
+*/
+typedef void (*osrfMessageStreamRowHandler)( void* blob, int index, jsonObject* row );
+
+/**
+	@brief Callback for each complete osrfMessage.
+
+	The message belongs to the callback, which must eventually free it with
+	osrfMessageFree().
+*/
+typedef void (*osrfMessageStreamHandler)( void* blob, int index, osrfMessage* msg );
+
+osrfMessageStream* osrfNewMessageStream( osrfMessageStreamRowHandler on_row,
+		osrfMessageStreamHandler on_message, void* blob );
+
+int osrfMessageStreamPush( osrfMessageStream* stream, const char* data, size_t length );
+
+int osrfMessageStreamFinish( osrfMessageStream* stream );
+
+void osrfMessageStreamReset( osrfMessageStream* stream );
+
+void osrfMessageStreamFree( osrfMessageStream* stream );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
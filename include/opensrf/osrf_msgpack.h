@@ -0,0 +1,50 @@
+#ifndef OSRF_MSGPACK_H
+#define OSRF_MSGPACK_H
+
+/**
+	@file osrf_msgpack.h
+	@brief Header for translating jsonObjects to and from MessagePack.
+
+	MessagePack is a binary form of the JSON data model: numbers and booleans travel as
+	native values, and strings as raw bytes with a length, without escaping.  A class name
+	travels the way it does in JSON, as a map of JSON_CLASS_KEY and JSON_DATA_KEY, so that
+	any MessagePack library can read it.
+
+	Integers travel as integers.  Any other JSON_NUMBER travels as a double, so a number
+	that a double can't represent exactly, or written with trailing zeros, may come back
+	in a different form.  One too big for a double travels as a string of its digits.
+
+	For a transport that carries only text, the "text" form is the MessagePack encoded in
+	base64, behind OSRF_MSGPACK_PREFIX.  The prefix can't begin a JSON text, so a receiver
+	can tell the two apart.
+*/
+
+#include <stddef.h>
+#include <opensrf/osrf_json.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief What the text form of MessagePack begins with. */
+#define OSRF_MSGPACK_PREFIX "msgpack:"
+
+char* jsonObjectToMsgpack( const jsonObject* obj, size_t* len );
+
+jsonObject* jsonMsgpackToObject( const char* data, size_t len );
+
+char* jsonObjectToMsgpackText( const jsonObject* obj );
+
+void jsonObjectAppendMsgpack( growing_buffer* buf, const jsonObject* obj );
+
+char* osrfMsgpackArrayText( const char* items, size_t len, size_t count );
+
+jsonObject* jsonMsgpackTextToObject( const char* text );
+
+int jsonIsMsgpackText( const char* text );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef OSRF_MULTISESSION_H
+#define OSRF_MULTISESSION_H
+
+/**
+	@file osrf_multisession.h
+	@brief Header for keeping many client requests in flight at once.
+
+	An osrfMultiSession submits requests to any number of services, each over an
+	osrfAppSession of its own, and waits on all of them together by reading the shared
+	transport connection in one loop.  Responses are handed to a per-request callback as
+	they arrive, or collected with the request; finished requests are handed to a
+	completion callback or placed on a completion queue for the caller to drain.
+*/
+
+#include "opensrf/osrf_app_session.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct osrf_multi_session_struct;
+typedef struct osrf_multi_session_struct osrfMultiSession;
+
+struct osrf_multi_request_struct;
+typedef struct osrf_multi_request_struct osrfMultiRequest;
+
+/**
+	@brief Callback for each response to a request.
+
+	The content belongs to the library and is freed when the callback returns.
+*/
+typedef void (*osrfMultiResponseHandler)( osrfMultiSession* ms, osrfMultiRequest* req,
+		const jsonObject* content );
+
+/**
+	@brief Callback for a request that has finished, one way or another.
+
+	The request is freed when the callback returns.
+*/
+typedef void (*osrfMultiCompleteHandler)( osrfMultiSession* ms, osrfMultiRequest* req );
+
+/**
+	@brief One request submitted through an osrfMultiSession.
+*/
+struct osrf_multi_request_struct {
+	/** Sequence number assigned by the osrfMultiSession, starting at 1. */
+	int id;
+	/** Name of the service called. */
+	char* service;
+	/** Name of the method called. */
+	char* method;
+	/** Parameters of the call, held until the request is sent. */
+	jsonObject* params;
+	/** The session carrying the request, or NULL until it is sent. */
+	osrfAppSession* session;
+	/** Request ID within the session, or -1 until it is sent. */
+	int request_id;
+	/** How many milliseconds to wait, between responses, before giving up. */
+	int timeout;
+	/** When to give up, on the monotonic clock in milliseconds. */
+	long long deadline;
+	/** Boolean: true once the request has finished. */
+	int complete;
+	/** OSRF_STATUS_OK, or the status code of whatever cut the request short. */
+	int status_code;
+	/** Text accompanying a failing status code, if any. */
+	char* status_text;
+	/** JSON array of responses, collected when there is no response callback. */
+	jsonObject* responses;
+	/** Called for each response, or NULL to collect them in @a responses. */
+	osrfMultiResponseHandler on_response;
+	/** Called when the request finishes, or NULL to queue it for the caller. */
+	osrfMultiCompleteHandler on_complete;
+	/** Whatever the caller wants to keep with the request. */
+	void* userData;
+	/** Links for whichever list the request is on. */
+	osrfMultiRequest* next;
+	osrfMultiRequest* prev;
+};
+
+/**
+	@brief A set of client requests in flight together.
+*/
+struct osrf_multi_session_struct {
+	/** Most requests to have in flight at once; zero for no limit. */
+	int max_pending;
+	/** Default timeout for new requests, in milliseconds. */
+	int timeout;
+	/** Sequence number for the next request. */
+	int next_id;
+	/** Requests sent and not yet finished. */
+	osrfMultiRequest* pending;
+	int pending_count;
+	/** Requests held back by max_pending, oldest first. */
+	osrfMultiRequest* waiting;
+	osrfMultiRequest* waiting_tail;
+	int waiting_count;
+	/** Finished requests with no completion callback, oldest first. */
+	osrfMultiRequest* done;
+	osrfMultiRequest* done_tail;
+	/** osrfLists of idle osrfAppSessions, keyed by service, for reuse. */
+	osrfHash* idle;
+	/** Boolean: true if the transport connection failed. */
+	int transport_error;
+	/** Locale for requests sent from now on, or NULL for the default. */
+	char* locale;
+	/** Whatever the caller wants to keep with the set. */
+	void* userData;
+};
+
+osrfMultiSession* osrfMultiSessionInit( int max_pending );
+
+void osrfMultiSessionSetTimeout( osrfMultiSession* ms, int timeout_ms );
+
+void osrfMultiSessionSetLocale( osrfMultiSession* ms, const char* locale );
+
+osrfMultiRequest* osrfMultiSessionRequest( osrfMultiSession* ms, const char* service,
+		const char* method, const jsonObject* params, osrfMultiResponseHandler on_response,
+		osrfMultiCompleteHandler on_complete, void* userData );
+
+int osrfMultiSessionWait( osrfMultiSession* ms, int timeout_ms );
+
+int osrfMultiSessionRun( osrfMultiSession* ms, int timeout_ms );
+
+int osrfMultiSessionOutstanding( const osrfMultiSession* ms );
+
+osrfMultiRequest* osrfMultiSessionNextComplete( osrfMultiSession* ms );
+
+void osrfMultiRequestFree( osrfMultiRequest* req );
+
+void osrfMultiSessionFree( osrfMultiSession* ms );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
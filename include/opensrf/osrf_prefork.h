@@ -1,6 +1,8 @@
 #ifndef OSRF_PREFORK_H
 #define OSRF_PREFORK_H
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +20,8 @@ extern "C" {
 
 int osrf_prefork_run(const char* appname);
 
+void osrf_prefork_register_routers( const char* appname, bool unregister );
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,7 +19,8 @@
 	@brief Facility for retrieving server configuration settings.
 
 	Look up server configuration settings from a settings server, cache them in the form of
-	a jsonObject, and retrieve them on request.
+	a jsonObject, and retrieve them on request.  A host may keep a snapshot of its settings
+	on disk, so that processes starting up don't all have to ask the settings server.
 
 	Not generally intended for client processes, unless they are also servers in their own right.
 */
@@ -33,7 +34,14 @@ typedef struct osrf_host_config_ osrf_host_config;
 void osrf_settings_free_host_config(osrf_host_config*);
 char* osrf_settings_host_value(const char* path, ...);
 jsonObject* osrf_settings_host_value_object(const char* format, ...);
+const jsonObject* osrf_settings_host_value_const(const char* format, ...);
 int osrf_settings_retrieve(const char* hostname);
+jsonObject* osrf_settings_fetch(const char* hostname);
+const char* osrf_settings_hostname( void );
+int osrf_settings_replace( jsonObject* cfg );
+int osrf_settings_load_snapshot( const char* path, const char* hostname, long generation,
+		long max_age, time_t* age );
+int osrf_settings_save_snapshot( const char* path, long generation );
 
 #ifdef __cplusplus
 }
@@ -21,6 +21,12 @@ struct osrf_app_session_struct*  osrf_stack_transport_handler( transport_message
 
 int osrf_stack_process( transport_client* client, int timeout, int* msg_received );
 
+int osrf_stack_process_ms( transport_client* client, int timeout, int* msg_received );
+
+void osrf_stack_set_arena( osrfArena* arena );
+
+void osrf_stack_set_batch_wait( int ms );
+
 #ifdef __cplusplus
 }
 #endif
@@ -40,6 +40,8 @@ int osrf_system_shutdown( void );
 
 void osrfSystemIgnoreTransportClient();
 
+void osrfSystemReportReady( const char* status );
+
 int osrfSystemInitCache(void);
 
 extern osrfStringArray* log_protect_arr;
@@ -0,0 +1,102 @@
+#ifndef OSRF_TRACE_H
+#define OSRF_TRACE_H
+
+/**
+	@file osrf_trace.h
+	@brief Header for request tracing: spans timed across clients, routers, and drones.
+
+	A span times one step in the life of a request: a client waiting for its responses, a
+	router forwarding it, a listener holding it in the backlog, a drone running the method.
+	Spans of the same request share a trace id, and each names the span it happened
+	within, so that a trace viewer can show where the time went.
+
+	The context of the current span travels with each message in the "osrf_span" attribute
+	of its &lt;opensrf&gt; element, as a W3C traceparent:
+
+	00-<32 hex digits of trace id>-<16 hex digits of span id>-<flags>
+
+	Finished spans are exported as OpenTelemetry (OTLP/JSON) records, collected in batches
+	and appended to a file, one export request per line, for an OpenTelemetry collector to
+	pick up.  A process that doesn't export spans still passes the context along.
+*/
+
+#include <opensrf/utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Room for a traceparent, terminal nul included. */
+#define OSRF_TRACEPARENT_SIZE 56
+
+/* Span kinds, numbered as in OTLP */
+#define OSRF_SPAN_INTERNAL 1    /**< Some step within a process. */
+#define OSRF_SPAN_SERVER   2    /**< Serving a request, as a drone does. */
+#define OSRF_SPAN_CLIENT   3    /**< Waiting for a request to be served. */
+#define OSRF_SPAN_PRODUCER 4    /**< Passing a request on, as a router does. */
+#define OSRF_SPAN_CONSUMER 5    /**< Taking a request off a queue, as a listener does. */
+
+/** @brief Most attributes a span may carry. */
+#define OSRF_SPAN_ATTRS 4
+/** @brief Most events a span may record; later ones are ignored. */
+#define OSRF_SPAN_EVENTS 8
+
+/**
+	@brief A span: one timed step of a request.
+
+	It lives wherever its caller likes, usually on the stack.  Unless it is recording, as
+	determined by osrfSpanStart(), the other functions ignore it.
+*/
+typedef struct {
+	char trace_id[ 33 ];        /**< Trace id, in hex. */
+	char span_id[ 17 ];         /**< Span id, in hex. */
+	char parent_id[ 17 ];       /**< Id of the enclosing span, or empty for a root. */
+	char name[ 64 ];            /**< What is being timed. */
+	int kind;                   /**< One of the OSRF_SPAN_* kinds. */
+	int recording;              /**< Boolean; true if the span is to be exported. */
+	int error;                  /**< Boolean; set it if the step failed. */
+	long long start;            /**< Start time, in nanoseconds since the epoch. */
+	int attr_count;             /**< Number of attributes. */
+	const char* attr_keys[ OSRF_SPAN_ATTRS ];     /**< Attribute names, as literals. */
+	char attr_values[ OSRF_SPAN_ATTRS ][ 64 ];    /**< Attribute values, truncated. */
+	int event_count;            /**< Number of events. */
+	const char* event_names[ OSRF_SPAN_EVENTS ];  /**< Event names, as literals. */
+	long long event_times[ OSRF_SPAN_EVENTS ];    /**< Event times, in nanoseconds. */
+	char saved[ OSRF_TRACEPARENT_SIZE ];  /**< Context displaced by osrfSpanActivate(). */
+} osrfSpan;
+
+int osrfTraceInit( const char* service, const char* path, int batch, double sample );
+
+void osrfTraceSetService( const char* service );
+
+int osrfTraceEnabled( void );
+
+int osrfTraceParse( const char* traceparent, char* trace_id, char* span_id, int* sampled );
+
+void osrfTraceSetContext( const char* traceparent );
+
+const char* osrfTraceGetContext( void );
+
+void osrfTraceClearContext( void );
+
+int osrfSpanStart( osrfSpan* span, const char* name, int kind, double start );
+
+void osrfSpanSetAttr( osrfSpan* span, const char* key, const char* value );
+
+void osrfSpanAddEvent( osrfSpan* span, const char* name );
+
+void osrfSpanFormat( const osrfSpan* span, char* buf );
+
+void osrfSpanActivate( osrfSpan* span );
+
+void osrfSpanDeactivate( osrfSpan* span );
+
+void osrfSpanEnd( osrfSpan* span );
+
+void osrfTraceFlush( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,12 +14,25 @@ extern "C" {
 #endif
 
 /**
-  Maintains a set of transport clients 
+  Maintains a pool of transport clients, any number of them per domain.
+
+  Outbound messages are spread over the active members, either in proportion to
+  their weights or, with OSRF_TG_STICKY, so that all messages in the same thread go
+  over the same connection.  A member whose send fails, or whose connection drops,
+  is set aside and reconnected after a retry interval.
   */
 
+#define OSRF_TG_WEIGHTED 0		/* weighted round robin (plain round robin by default) */
+#define OSRF_TG_STICKY   1		/* keep each thread on one connection */
+
+#define OSRF_TG_RETRY_INTERVAL 30	/* default seconds before reconnecting a failed node */
+
 struct __osrfTransportGroupStruct {
-	osrfHash* nodes;						/* our hash of nodes keyed by domain */
-	osrfHashIterator* itr;				/* points to the next node in the list */
+	osrfList* members;					/* every node, in the order added */
+	osrfHash* domains;					/* osrfLists of nodes, keyed by domain */
+	int policy;								/* OSRF_TG_WEIGHTED or OSRF_TG_STICKY */
+	int retry_interval;					/* seconds before reconnecting a failed node */
+	unsigned int next;					/* where the next receive scan starts */
 };
 typedef struct __osrfTransportGroupStruct osrfTransportGroup;
 
@@ -34,6 +47,9 @@ struct __osrfTransportGroupNode {
 
 	int active;								/* true if we're able to send data on this connection */
 	time_t lastsent;						/* the last time we sent a message */
+	int weight;								/* share of the outbound messages; 1 by default */
+	int current_weight;					/* running score for the weighted round robin */
+	time_t failed;							/* when we last lost or failed to make the connection */
 };
 typedef struct __osrfTransportGroupNode osrfTransportGroupNode;
 
@@ -50,14 +66,58 @@ typedef struct __osrfTransportGroupNode osrfTransportGroupNode;
 osrfTransportGroupNode* osrfNewTransportGroupNode( 
 		char* domain, int port, char* username, char* password, char* resource );
 
+/**
+  Sets a node's share of the outbound messages, relative to the other nodes.
+  @param node The node
+  @param weight The weight; anything less than 1 is taken as 1
+  */
+void osrfTransportGroupNodeSetWeight( osrfTransportGroupNode* node, int weight );
+
 
 /**
   Allocates and initializes a new transport group.
   The first node in the array is the default node for client connections.
+  Several nodes may share a domain, so long as their resources differ.
   @param nodes The nodes in the group.
   */
 osrfTransportGroup* osrfNewTransportGroup( osrfTransportGroupNode* nodes[], int count );
 
+/**
+  Adds a node to a transport group, which takes ownership of it.
+  @param grp The transport group
+  @param node The node to add; it is connected by the next osrfTransportGroupConnectAll(),
+  or else when the retry interval next comes around
+  @return 0 on success, -1 on error.
+  */
+int osrfTransportGroupAddNode( osrfTransportGroup* grp, osrfTransportGroupNode* node );
+
+/**
+  Adds several connections to the same domain, distinguished by resource.
+  The resources are the given resource with "_1", "_2", and so on appended.
+  @return The number of nodes added
+  */
+int osrfTransportGroupAddConnections( osrfTransportGroup* grp, char* domain, int port,
+		char* username, char* password, char* resource, int count );
+
+/**
+  Chooses how outbound messages are spread over the nodes.
+  @param grp The transport group
+  @param policy OSRF_TG_WEIGHTED or OSRF_TG_STICKY
+  */
+void osrfTransportGroupSetPolicy( osrfTransportGroup* grp, int policy );
+
+/**
+  Sets how long a failed node sits out before we try to reconnect it.
+  @param grp The transport group
+  @param seconds The retry interval; negative never to reconnect
+  */
+void osrfTransportGroupSetRetryInterval( osrfTransportGroup* grp, int seconds );
+
+/**
+  Disconnects and frees a transport group, along with its nodes.
+  */
+void osrfTransportGroupFree( osrfTransportGroup* grp );
+
 /**
   Attempts to connect all of the nodes in this group.
   @param grp The transport group
@@ -77,6 +137,9 @@ void osrfTransportGroupDisconnectAll( osrfTransportGroup* grp );
   considered a 'remote' message and the message is sent directly (unchanged)
   to the next connection in the set.
 
+  The next connection is chosen by the group's policy.  If a send fails, the node
+  is set aside and the next choice is tried, until every active node has been tried.
+
   @param grp The transport group
   @param msg The message to send 
   @return 0 on normal successful send.  
@@ -85,15 +148,12 @@ void osrfTransportGroupDisconnectAll( osrfTransportGroup* grp );
 int osrfTransportGroupSend( osrfTransportGroup* grp, transport_message* msg );
 
 /**
-  Sends the message to the exact recipient.  No failover is attempted.
+  Sends the message to the exact recipient domain, over any of that domain's
+  connections chosen by the group's policy.  No failover to other domains is attempted.
   @return 0 on success, -1 on error.
   */
 int osrfTransportGroupSendMatch( osrfTransportGroup* grp, transport_message* msg );
 
-
-int _osrfTGServerSend( osrfTransportGroup* grp, char* domain, transport_message* msg );
-int _osrfTGClientSend( osrfTransportGroup* grp, char* domain, transport_message* msg );
-
 /**
   Waits on all connections for inbound data.
   @param grp The transport group
@@ -114,7 +174,8 @@ transport_message* osrfTransportGroupRecv( osrfTransportGroup* grp, char* domain
 
 /**
   Tells the group that a message to the given domain failed
-  domain did not make it through;
+  domain did not make it through.  Each of the domain's nodes is set aside until the
+  retry interval has passed, and then reconnected.
   @param grp The transport group
   @param comain The failed domain
   */
@@ -122,7 +183,7 @@ void osrfTransportGroupSetInactive( osrfTransportGroup* grp, char* domain );
 
 
 /**
-  Finds a node in our list of nodes 
+  Finds the first node for a domain in our list of nodes 
   */
 osrfTransportGroupNode* __osrfTransportGroupFindNode( osrfTransportGroup* grp, char* domain );
 
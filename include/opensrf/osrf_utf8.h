@@ -58,6 +58,12 @@ int is__utf8( int c );
 
 int buffer_append_utf8( growing_buffer* buf, const char* string );
 
+// The same translation, into memory that the caller has sized
+
+size_t osrf_utf8_escaped_length( const char* string );
+
+char* osrf_utf8_escape( char* dest, const char* string );
+
 #ifdef __cplusplus
 }
 #endif
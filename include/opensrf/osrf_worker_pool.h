@@ -0,0 +1,24 @@
+#ifndef OSRF_WORKER_POOL_H
+#define OSRF_WORKER_POOL_H
+
+/**
+	@file osrf_worker_pool.h
+	@brief Header for serving a thread-safe application from a pool of threads.
+
+	An alternative to the prefork server: one process listens for requests and queues
+	them, and a fixed number of worker threads, each with its own Jabber connection,
+	take them from the queue and service them.  An application opts in by declaring
+	itself thread-safe in opensrf.xml.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int osrf_worker_pool_run( const char* appname );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -40,6 +40,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 
 #include <signal.h>
 
@@ -51,6 +52,9 @@ extern "C" {
 struct socket_node_struct;
 typedef struct socket_node_struct socket_node;
 
+/* Read buffer and readiness state, private to socket_bundle.c */
+struct socket_io_struct;
+
 
 /* Maintains the socket set */
 /**
@@ -62,7 +66,7 @@ struct socket_manager_struct {
 	- @em blob  Opaque pointer from the calling code.
 	- @em mgr Pointer to the socket_manager that manages the socket.
 	- @em sock_fd File descriptor of the socket that read the data.
-	- @em data Pointer to the data received.
+	- @em data Pointer to the data received, with a terminal nul appended (see data_len).
 	- @em parent_id (if > 0) listener socket from which the data socket was spawned.
 	*/
 	void (*data_received) (
@@ -85,6 +89,9 @@ struct socket_manager_struct {
 
 	socket_node* socket;       /**< Linked list of managed sockets. */
 	void* blob;                /**< Opaque pointer from the calling code .*/
+	struct socket_io_struct* io; /**< Read buffer and poller; created on demand. */
+	/** Number of bytes passed to the current data_received call, not counting the nul. */
+	size_t data_len;
 };
 typedef struct socket_manager_struct socket_manager;
 
@@ -106,11 +113,15 @@ int socket_send(int sock_fd, const char* data);
 
 int socket_send_timeout( int sock_fd, const char* data, int usecs );
 
+int socket_send_iov( int sock_fd, struct iovec* iov, int count );
+
 void socket_disconnect(socket_manager*, int sock_fd);
 
 int socket_wait(socket_manager* mgr, int timeout, int sock_fd);
 
 int socket_wait_all(socket_manager* mgr, int timeout);
+int socket_wait_ms(socket_manager* mgr, int timeout, int sock_fd);
+int socket_wait_all_ms(socket_manager* mgr, int timeout);
 
 void _socket_print_list(socket_manager* mgr);
 
@@ -5,6 +5,11 @@
 	An osrfStringArray manages an array of character pointers pointing to nul-terminated
 	strings.  New entries are added at the end.  When a string is removed, entries above
 	it are shifted down to fill in the gap.
+
+	Once an osrfStringArray holds more than a few strings, osrfStringArrayContains() builds
+	an index of them on first use, so that later searches don't have to compare the strings
+	one by one.  Changing the array through its own functions keeps the index honest; don't
+	change the underlying list directly.
 */
 
 #ifndef STRING_ARRAY_H
@@ -28,8 +33,16 @@ extern "C" {
 */
 #define STRING_ARRAY_MAX_SIZE 4096
 
+/**
+	@brief How many strings an osrfStringArray may hold before osrfStringArrayContains()
+	builds an index for it.
+*/
+#define STRING_ARRAY_INDEX_MIN 8
+
 /** @brief Macro version of osrfStringArrayFree() */
-#define OSRF_STRING_ARRAY_FREE(arr) osrfListFree( (osrfList*) (arr) )
+#define OSRF_STRING_ARRAY_FREE(arr) osrfStringArrayFree( (arr) )
+
+struct _osrfHashStruct;
 
 /**
 	@brief Structure of an osrfStringArray.
@@ -39,6 +52,8 @@ typedef struct {
     osrfList list;
 	/** @brief The number of strings stored. */
 	int size;    // redundant with list.size
+	/** @brief Index of the strings for osrfStringArrayContains(), or NULL if none. */
+	struct _osrfHashStruct* index;
 } osrfStringArray;
 
 osrfStringArray* osrfNewStringArray( int size );
@@ -54,6 +69,10 @@ void osrfStringArrayFree( osrfStringArray* );
 
 void osrfStringArrayRemove( osrfStringArray* arr, const char* str );
 
+void osrfStringArrayClear( osrfStringArray* arr );
+
+void osrfStringArraySwap( osrfStringArray* one, osrfStringArray* two );
+
 osrfStringArray* osrfStringArrayTokenize( const char* src, char delim );
 
 #ifdef __cplusplus
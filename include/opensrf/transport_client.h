@@ -19,6 +19,7 @@ extern "C" {
 #endif
 
 struct message_list_struct;
+struct transport_shm_struct;
 
 /**
 	@brief A collection of members used for keeping track of transport_messages.
@@ -33,6 +34,9 @@ struct transport_client_struct {
 	int error;                       /**< Boolean: true if an error has occurred */
 	char* host;                      /**< Domain name or IP address of the Jabber server */
 	char* xmpp_id;                   /**< Jabber ID used for outgoing messages */
+	struct transport_shm_struct* shm; /**< Same-host shortcut around Jabber, or NULL */
+	int shm_listen;                  /**< Boolean: true if we receive through shm as well */
+	char* locality;                  /**< Where we run, for routers to see; or NULL */
 };
 typedef struct transport_client_struct transport_client;
 
@@ -54,8 +58,28 @@ int client_connected( const transport_client* client );
 
 transport_message* client_recv( transport_client* client, int timeout );
 
+transport_message* client_recv_ms( transport_client* client, int timeout );
+
 int client_sock_fd( transport_client* client );
 
+void client_keep_body_xml( transport_client* client, int keep );
+
+void client_set_compression( transport_client* client, int compress );
+
+int client_set_shm( transport_client* client, const char* dir, int listen );
+
+void client_close_shm( transport_client* client );
+
+int client_sweep_shm( transport_client* client );
+
+void client_set_locality( transport_client* client, const char* locality );
+
+void client_cork( transport_client* client );
+
+int client_uncork( transport_client* client );
+
+int client_flush( transport_client* client );
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,6 +18,7 @@
 #include <libxml/xmlmemory.h>
 
 #include <opensrf/utils.h>
+#include <opensrf/osrf_iochain.h>
 #include <opensrf/xml_utils.h>
 #include <opensrf/log.h>
 
@@ -36,8 +37,17 @@ extern "C" {
 	- router_class
 	- router_command
 	- osrf_xid
+	- osrf_span
 	- broadcast
+
+	The body and body_xml members are reference-counted, and may be shared with other
+	transport_messages (see message_share_body()).  The other strings are usually packed
+	into storage allocated along with the message.  Treat them all as read-only, and
+	replace them only through the functions provided here.
 */
+struct transport_text_struct;
+typedef struct transport_text_struct transport_text;
+
 struct transport_message_struct {
 	char* body;            /**< Text enclosed by the body element. */
 	char* subject;         /**< Text enclosed by the subject element. */
@@ -49,11 +59,20 @@ struct transport_message_struct {
 	char* router_class;    /**< Value of the "router_class" attribute in the message element. */
 	char* router_command;  /**< Value of the "router_command" attribute in the message element. */
 	char* osrf_xid;        /**< Value of the "osrf_xid" attribute in the message element. */
+	char* osrf_span;       /**< Value of the "osrf_span" attribute: the trace context. */
+	char* osrf_locality;   /**< Value of the "osrf_locality" attribute: where the sender
+	                            runs, such as a host, rack or zone. */
 	int is_error;          /**< Boolean; true if &lt;error&gt; is present. */
 	char* error_type;      /**< Value of the "type" attribute of &lt;error&gt;. */
 	int error_code;        /**< Value of the "code" attribute of &lt;error&gt;. */
 	int broadcast;         /**< Value of the "broadcast" attribute in the message element. */
+	int queued;            /**< Milliseconds a listener held the request before handing it
+	                            to a drone; travels only by way of message_pack(). */
 	char* msg_xml;         /**< The entire message as XML, complete with entity encoding. */
+	size_t xml_len;        /**< Length of the stanza as last serialized, or 0. */
+	char* body_xml;        /**< Body as received on the wire, still entity-encoded (or NULL). */
+	transport_text* body_text;     /**< Reference-counted storage behind body. */
+	transport_text* body_xml_text; /**< Reference-counted storage behind body_xml. */
 	struct transport_message_struct* next;
 };
 typedef struct transport_message_struct transport_message;
@@ -69,8 +88,32 @@ void message_set_router_info( transport_message* msg, const char* router_from,
 
 void message_set_osrf_xid( transport_message* msg, const char* osrf_xid );
 
+void message_set_osrf_span( transport_message* msg, const char* osrf_span );
+
+void message_set_osrf_locality( transport_message* msg, const char* osrf_locality );
+
+void message_set_sender( transport_message* msg, const char* sender );
+
+void message_set_recipient( transport_message* msg, const char* recipient );
+
+void message_set_body_xml( transport_message* msg, const char* body_xml );
+
+void message_set_body_xml_n( transport_message* msg, const char* body_xml, size_t len );
+
+void message_share_body( transport_message* msg, const transport_message* src );
+
+void message_adopt_body( transport_message* msg, char* body );
+
+void message_adopt_body_xml( transport_message* msg, char* body_xml );
+
 int message_prepare_xml( transport_message* msg );
 
+size_t message_append_xml( transport_message* msg, osrfIoChain* chain );
+
+char* message_pack( const transport_message* msg, size_t* len );
+
+transport_message* message_unpack( const char* buf, size_t len );
+
 int message_free( transport_message* msg );
 
 void jid_get_username( const char* jid, char buf[], int size );
@@ -32,6 +32,9 @@
 extern "C" {
 #endif
 
+/* zlib state for stream compression; see transport_session.c */
+struct z_stream_s;
+
 /** Note whether the login information should be sent as plaintext or as a hash digest. */
 enum TRANSPORT_AUTH_TYPE { AUTH_PLAIN, AUTH_DIGEST };
 
@@ -86,8 +89,30 @@ struct transport_session_struct {
 	growing_buffer* router_class_buffer;  /**< "router_class" attribute of &lt;message&gt;. */
 	growing_buffer* router_command_buffer; /**< "router_command" attribute of &lt;message&gt;. */
 	growing_buffer* osrf_xid_buffer;      /**< "osrf_xid" attribute of &lt;message&gt;. */
+	growing_buffer* osrf_span_buffer;     /**< "osrf_span" attribute of &lt;message&gt;. */
+	growing_buffer* osrf_locality_buffer; /**< "osrf_locality" attribute of &lt;message&gt;. */
 	int router_broadcast;                 /**< "broadcast" attribute of &lt;message&gt;. */
 
+	/* for forwarding bodies without re-encoding them */
+	int keep_body_xml;                    /**< Boolean; true if we capture the encoded body. */
+	growing_buffer* raw_buffer;           /**< Raw input not yet consumed past a message. */
+	long raw_offset;                      /**< Stream offset of the first byte in raw_buffer. */
+	int raw_body_start;                   /**< Offset of the encoded body in raw_buffer. */
+	int raw_body_len;                     /**< Length of the encoded body, or -1 if none. */
+
+	/* for batching outgoing stanzas */
+	int cork_depth;                       /**< Nesting depth of session_cork() calls. */
+	osrfIoChain* out_chain;               /**< Stanzas held back until session_flush(). */
+
+	/* for stream compression (XEP-0138) */
+	int compress;                         /**< Boolean; true if we ask for compression. */
+	int compress_state;                   /**< How far compression has been negotiated. */
+	struct z_stream_s* zout;              /**< Deflates output once compression is on. */
+	struct z_stream_s* zin;               /**< Inflates input once compression is on. */
+	char* zout_buf;                       /**< Compressed output waiting to be sent. */
+	size_t zout_size;                     /**< Capacity of zout_buf. */
+	char* zin_buf;                        /**< Inflated input to be parsed. */
+
 	void* user_data;                      /**< Opaque pointer from calling code. */
 
 	char* server;                         /**< address of Jabber server. */
@@ -108,6 +133,8 @@ transport_session* init_transport( const char* server, int port,
 
 int session_wait( transport_session* session, int timeout );
 
+int session_wait_ms( transport_session* session, int timeout );
+
 int session_send_msg( transport_session* session, transport_message* msg );
 
 int session_connected( transport_session* session );
@@ -123,6 +150,18 @@ int session_connect( transport_session* session,
 
 int session_disconnect( transport_session* session );
 
+void session_keep_body_xml( transport_session* session, int keep );
+
+void session_cork( transport_session* session );
+
+int session_uncork( transport_session* session );
+
+int session_flush( transport_session* session );
+
+void session_set_compression( transport_session* session, int compress );
+
+int session_compressed( const transport_session* session );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,46 @@
+#ifndef TRANSPORT_SHM_H
+#define TRANSPORT_SHM_H
+
+/**
+	@file transport_shm.h
+	@brief Header for a same-host shortcut around the Jabber server.
+
+	A process that listens on a shared memory ring can receive transport_messages from
+	other processes on the same host without their passing through the Jabber server.
+	Each listener owns one ring, named after its Jabber ID, and a doorbell that it can
+	wait on alongside its Jabber socket.  Senders look for a ring under the recipient's
+	Jabber ID, and fall back to Jabber when there isn't one.
+*/
+
+#include <opensrf/transport_message.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct transport_shm_struct;
+typedef struct transport_shm_struct transport_shm;
+
+transport_shm* transport_shm_init( const char* dir, size_t ring_size );
+
+int transport_shm_listen( transport_shm* shm, const char* jid );
+
+int transport_shm_fd( const transport_shm* shm );
+
+int transport_shm_send( transport_shm* shm, const transport_message* msg );
+
+transport_message* transport_shm_recv( transport_shm* shm );
+
+int transport_shm_sleep( transport_shm* shm );
+
+void transport_shm_wake( transport_shm* shm );
+
+void transport_shm_free( transport_shm* shm, int owner );
+
+int transport_shm_sweep( transport_shm* shm );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -37,6 +37,7 @@ GNU General Public License for more details.
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 //#include <sys/timeb.h>
 
 #ifdef __cplusplus
@@ -160,6 +161,9 @@ extern "C" {
 #define OSRF_BUFFER_C_STR( x ) ((const char *) (x)->buf)
 
 
+/** @brief How long a string VA_LIST_TO_STRING() can build without formatting twice. */
+#define VA_BUF_INLINE_SIZE 256
+
 /**
 	@brief Turn a printf-style format string and a va_list into a string.
 	@param x A printf-style format string.
@@ -169,22 +173,27 @@ extern "C" {
 	The resulting string is constructed in a local buffer, whose address is
 	given by the pointer VA_BUF,  This buffer is NOT allocated dynamically,
 	so don't try to free it.
+
+	A string shorter than VA_BUF_INLINE_SIZE is formatted only once; a longer
+	one is formatted again into a buffer big enough for it.
 */
 #define VA_LIST_TO_STRING(x) \
-	unsigned long __len = 0;\
+	int __len = 0;\
 	va_list args; \
 	va_list a_copy;\
-	va_copy(a_copy, args); \
+	char _s[VA_BUF_INLINE_SIZE]; \
 	va_start(args, x); \
-	__len = vsnprintf(NULL, 0, x, args); \
+	va_copy(a_copy, args); \
+	__len = vsnprintf(_s, sizeof(_s), x, args); \
 	va_end(args); \
-	__len += 2; \
-	char _b[__len]; \
-	bzero(_b, __len); \
-	va_start(a_copy, x); \
-	vsnprintf(_b, __len - 1, x, a_copy); \
+	if( __len < 0 ) { __len = 0; _s[0] = '\0'; } \
+	char _b[__len < (int) sizeof(_s) ? 1 : __len + 1]; \
+	char* VA_BUF = _s; \
+	if( __len >= (int) sizeof(_s) ) { \
+		vsnprintf(_b, __len + 1, x, a_copy); \
+		VA_BUF = _b; \
+	} \
 	va_end(a_copy); \
-	char* VA_BUF = _b; \
 
 /**
 	@brief Format a long into a string.
@@ -319,7 +328,12 @@ growing_buffer* buffer_init( int initial_num_bytes);
 
 int buffer_add(growing_buffer* gb, const char* c);
 int buffer_add_n(growing_buffer* gb, const char* data, size_t n);
+int buffer_reserve( growing_buffer* gb, size_t n );
 int buffer_fadd(growing_buffer* gb, const char* format, ... );
+int buffer_vfadd( growing_buffer* gb, const char* format, va_list args );
+int buffer_add_int64( growing_buffer* gb, int64_t n );
+int buffer_add_uint( growing_buffer* gb, unsigned long long n );
+int buffer_add_double( growing_buffer* gb, double num );
 int buffer_reset( growing_buffer* gb);
 char* buffer_data( const growing_buffer* gb);
 char* buffer_release( growing_buffer* gb );
@@ -358,6 +372,10 @@ int clr_fl( int fd, int flags );
 // Utility method
 double get_timestamp_millis( void );
 
+long long get_monotonic_millis( void );
+
+int timeout_secs_to_millis( int secs );
+
 
 /* returns true if the whole string is a number */
 int stringisnum(const char* s);
@@ -383,6 +401,33 @@ int osrfUtilsCheckFileDescriptor( int fd );
 */
 size_t osrfXmlEscapingLength ( const char* str );
 
+size_t osrfXmlEscapeSize( const char* str );
+
+char* osrfXmlEscape( char* dest, const char* str );
+
+int buffer_add_xml_escaped( growing_buffer* gb, const char* str );
+
+/*
+	Returns a shared, permanent copy of a short string, such as a
+	locale, so that many objects can point to one copy instead of
+	each keeping its own.  Returns NULL if the string is too long,
+	or if the table of shared strings is full.
+*/
+const char* osrf_intern( const char* str );
+
+/*
+	Like osrf_intern(), but only for a string that looks like an
+	identifier, such as a hash key or a class name.  Returns NULL
+	for anything else.
+*/
+const char* osrf_intern_name( const char* name );
+
+/*
+	For a string returned by osrf_intern(), returns the same string
+	encoded as a JSON string literal, quotes and all; otherwise NULL.
+*/
+const char* osrf_intern_json( const char* interned );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,371 @@
+/**
+	@file osrf_bench.c
+	@brief Micro-benchmarks for JSON and message serialization.
+
+	Each benchmark runs one operation -- parsing, serializing, cloning, and so on -- over
+	each payload in a corpus, repeatedly, until enough time has gone by to time it.  The
+	built-in corpus is made of fieldmapper-style rows like those an Evergreen service
+	returns; any files named on the command line join it, each holding one JSON text.
+
+	The results go to standard output, one JSON object per line, for instance:
+
+	{"benchmark":"jsonParse","corpus":"page","ops":20480,"seconds":0.5012,
+	"ops_per_sec":40862.0,"bytes_per_sec":250713337.4,"allocs_per_op":4105.0}
+
+	Bytes are those of the JSON (or XML) read or written by one operation.  Allocations are
+	counted by wrapping malloc(), where the C library lets us (glibc); elsewhere
+	allocs_per_op is null.
+
+	Usage: osrf_bench [-t seconds] [-b benchmark] [file ...]
+
+	-t is the least time to spend on each benchmark (default 0.5), and -b runs only the
+	benchmarks whose names begin with the given string.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "opensrf/utils.h"
+#include "opensrf/osrf_json.h"
+#include "opensrf/osrf_message.h"
+#include "opensrf/transport_message.h"
+
+/** @brief How many calls to malloc() and friends there have been. */
+static unsigned long alloc_count = 0;
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCS 1
+
+extern void* __libc_malloc( size_t size );
+extern void* __libc_calloc( size_t n, size_t size );
+extern void* __libc_realloc( void* ptr, size_t size );
+extern void __libc_free( void* ptr );
+
+// glibc lets a program replace malloc() and friends; ours count, and pass the work on.
+
+void* malloc( size_t size ) {
+	++alloc_count;
+	return __libc_malloc( size );
+}
+
+void* calloc( size_t n, size_t size ) {
+	++alloc_count;
+	return __libc_calloc( n, size );
+}
+
+void* realloc( void* ptr, size_t size ) {
+	++alloc_count;
+	return __libc_realloc( ptr, size );
+}
+
+void free( void* ptr ) {
+	__libc_free( ptr );
+}
+#else
+#define COUNT_ALLOCS 0
+#endif
+
+/**
+	@brief One payload of the corpus, in each of the forms the benchmarks start from.
+*/
+typedef struct {
+	char* name;               /**< What to call it in the results. */
+	char* json;               /**< The JSON text. */
+	jsonObject* obj;          /**< Parsed, with class hints decoded. */
+	jsonObject* raw;          /**< Parsed, with class hints left as wrappers. */
+	osrfMessage* msg;         /**< A RESULT message with the payload as its content. */
+	char* msg_json;           /**< The message, serialized as a batch of one. */
+	transport_message* tmsg;  /**< A transport message carrying msg_json. */
+	char* xml;                /**< The transport message as XML. */
+} payload;
+
+/** @brief An operation to time; returns how many bytes it read or wrote. */
+typedef size_t (*bench_op)( const payload* p );
+
+static size_t bench_parse( const payload* p ) {
+	jsonObject* obj = jsonParse( p->json );
+	jsonObjectFree( obj );
+	return strlen( p->json );
+}
+
+static size_t bench_to_json( const payload* p ) {
+	char* json = jsonObjectToJSON( p->obj );
+	size_t len = strlen( json );
+	free( json );
+	return len;
+}
+
+static size_t bench_clone( const payload* p ) {
+	jsonObjectFree( jsonObjectClone( p->obj ));
+	return strlen( p->json );
+}
+
+static size_t bench_decode_class( const payload* p ) {
+	jsonObjectFree( jsonObjectDecodeClass( p->raw ));
+	return strlen( p->json );
+}
+
+static size_t bench_encode_class( const payload* p ) {
+	jsonObjectFree( jsonObjectEncodeClass( p->obj ));
+	return strlen( p->json );
+}
+
+static size_t bench_serialize( const payload* p ) {
+	char* json = osrf_message_serialize( p->msg );
+	size_t len = strlen( json );
+	free( json );
+	return len;
+}
+
+static size_t bench_deserialize( const payload* p ) {
+	osrfList* list = osrfMessageDeserialize( p->msg_json, NULL );
+	osrfListFree( list );
+	return strlen( p->msg_json );
+}
+
+static size_t bench_prepare_xml( const payload* p ) {
+	free( p->tmsg->msg_xml );
+	p->tmsg->msg_xml = NULL;
+	message_prepare_xml( p->tmsg );
+	return strlen( p->tmsg->msg_xml );
+}
+
+static size_t bench_from_xml( const payload* p ) {
+	message_free( new_message_from_xml( p->xml ));
+	return strlen( p->xml );
+}
+
+/** @brief The benchmarks, in the order they run. */
+static const struct {
+	const char* name;
+	bench_op op;
+} benchmarks[] = {
+	{ "jsonParse",              bench_parse },
+	{ "jsonObjectToJSON",       bench_to_json },
+	{ "jsonObjectClone",        bench_clone },
+	{ "jsonObjectDecodeClass",  bench_decode_class },
+	{ "jsonObjectEncodeClass",  bench_encode_class },
+	{ "osrf_message_serialize", bench_serialize },
+	{ "osrfMessageDeserialize", bench_deserialize },
+	{ "message_prepare_xml",    bench_prepare_xml },
+	{ "new_message_from_xml",   bench_from_xml },
+};
+
+/**
+	@brief Append a row like one from a fieldmapper class, such as a copy ("acp").
+	@param buf Pointer to the growing_buffer to append to.
+	@param id The row's id, from which everything else in it is made up.
+	@param nested Boolean: true to flesh out the row with a call number and an org unit.
+
+	The mix is what such rows usually carry: ids, short codes, timestamps, prices held as
+	strings, "t" and "f" for booleans, nulls for empty fields, and now and then some
+	non-ASCII text or a character that needs escaping.
+*/
+static void append_row( growing_buffer* buf, int id, int nested ) {
+	buffer_fadd( buf, "{\"__c\":\"acp\",\"__p\":[%d,\"3%011d\",%d,null,\"%s\","
+		"\"2024-0%d-1%dT10:%02d:00-0500\",\"%d.%02d\",", id, id * 7919, 100 + id % 17,
+		id % 3 ? "t" : "f", 1 + id % 9, id % 10, id % 60, 5 + id % 40, id % 100 );
+
+	if( nested )
+		buffer_fadd( buf, "{\"__c\":\"acn\",\"__p\":[%d,\"QA76.73 .C15 K47 %d\",%d,"
+			"{\"__c\":\"aou\",\"__p\":[%d,\"BR%d\",\"Branch %d\",null,\"t\"]}]}",
+			id / 3, 1978 + id % 40, 100 + id % 17, 100 + id % 17, id % 17, id % 17 );
+	else
+		buffer_fadd( buf, "%d", id / 3 );
+
+	if( id % 5 == 0 )
+		buffer_add( buf, ",\"Caf\\u00e9 \\\"Noir\\\" \xe2\x80\x94 r\xc3\xa9\xc3\xa9" "dition\"" );
+	else
+		buffer_fadd( buf, ",\"Copy note %d\"", id );
+
+	buffer_add( buf, ",false,0,null,null,\"\"]}" );
+}
+
+/**
+	@brief Make up a JSON array of rows.
+	@param count How many rows.
+	@param nested Boolean: true to flesh the rows out.
+	@return The JSON text, which the calling code must free.
+*/
+static char* make_rows( int count, int nested ) {
+	growing_buffer* buf = buffer_init( 256 * count );
+	buffer_add_char( buf, '[' );
+	int i;
+	for( i = 1; i <= count; ++i ) {
+		if( i > 1 )
+			buffer_add_char( buf, ',' );
+		append_row( buf, i, nested );
+	}
+	buffer_add_char( buf, ']' );
+	return buffer_release( buf );
+}
+
+/**
+	@brief Read a whole file.
+	@param path The file's name.
+	@return Its contents, which the calling code must free; or NULL if we can't read it.
+*/
+static char* read_file( const char* path ) {
+	FILE* f = fopen( path, "r" );
+	if( !f )
+		return NULL;
+
+	growing_buffer* buf = buffer_init( 4096 );
+	char chunk[ 4096 ];
+	size_t n;
+	while( (n = fread( chunk, 1, sizeof( chunk ), f )) > 0 )
+		buffer_add_n( buf, chunk, n );
+	fclose( f );
+	return buffer_release( buf );
+}
+
+/**
+	@brief Fill in a payload from its JSON text.
+	@param p Pointer to the payload, with its name and JSON already filled in.
+	@return Zero if successful, or -1 if the JSON is invalid.
+*/
+static int prepare_payload( payload* p ) {
+	p->obj = jsonParse( p->json );
+	p->raw = jsonParseRaw( p->json );
+	if( !p->obj || !p->raw )
+		return -1;
+
+	p->msg = osrf_message_init( RESULT, 1, 1 );
+	osrf_message_set_status_info( p->msg, "osrfResult", "OK", OSRF_STATUS_OK );
+	osrf_message_set_result( p->msg, p->obj );
+	p->msg_json = osrf_message_serialize( p->msg );
+
+	p->tmsg = message_init( p->msg_json, NULL, "bench-thread",
+		"opensrf@private.localhost/open-ils.cstore_listener",
+		"opensrf@private.localhost/client" );
+	message_prepare_xml( p->tmsg );
+	p->xml = strdup( p->tmsg->msg_xml );
+	return 0;
+}
+
+static void free_payload( payload* p ) {
+	free( p->name );
+	free( p->json );
+	jsonObjectFree( p->obj );
+	jsonObjectFree( p->raw );
+	osrfMessageFree( p->msg );
+	free( p->msg_json );
+	message_free( p->tmsg );
+	free( p->xml );
+}
+
+static double now( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+	@brief Time one benchmark over one payload, and print the result.
+	@param name The benchmark's name.
+	@param op The operation to time.
+	@param p Pointer to the payload.
+	@param min_time The least number of seconds to spend timing.
+
+	We run the operation in rounds, doubling the count each time, until a round takes at
+	least @a min_time; only that last round counts.
+*/
+static void run_benchmark( const char* name, bench_op op, const payload* p,
+		double min_time ) {
+	op( p );    // warm up
+
+	unsigned long ops = 1;
+	unsigned long allocs;
+	double bytes;
+	double elapsed;
+	for( ;; ) {
+		bytes = 0;
+		allocs = alloc_count;
+		double start = now();
+		unsigned long i;
+		for( i = 0; i < ops; ++i )
+			bytes += op( p );
+		elapsed = now() - start;
+		allocs = alloc_count - allocs;
+		if( elapsed >= min_time || ops >= (1UL << 40) )
+			break;
+		ops *= 2;
+	}
+
+	if( elapsed <= 0 )
+		elapsed = 1e-9;
+	printf( "{\"benchmark\":\"%s\",\"corpus\":\"%s\",\"ops\":%lu,\"seconds\":%.4f,"
+		"\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f,", name, p->name, ops, elapsed,
+		ops / elapsed, bytes / elapsed );
+	if( COUNT_ALLOCS )
+		printf( "\"allocs_per_op\":%.1f}\n", (double) allocs / ops );
+	else
+		printf( "\"allocs_per_op\":null}\n" );
+	fflush( stdout );
+}
+
+int main( int argc, char* argv[] ) {
+	double min_time = 0.5;
+	const char* only = NULL;
+	int opt;
+	while( (opt = getopt( argc, argv, "t:b:" )) != -1 ) {
+		switch( opt ) {
+			case 't' :
+				min_time = atof( optarg );
+				break;
+			case 'b' :
+				only = optarg;
+				break;
+			default :
+				fprintf( stderr, "Usage: %s [-t seconds] [-b benchmark] [file ...]\n",
+					argv[ 0 ] );
+				return 1;
+		}
+	}
+
+	// The built-in corpus, and any files named on the command line
+	int count = 4 + ( argc - optind );
+	payload* corpus = safe_malloc( count * sizeof( payload ));
+	corpus[ 0 ].name = strdup( "single" );
+	corpus[ 0 ].json = make_rows( 1, 1 );
+	corpus[ 1 ].name = strdup( "page" );
+	corpus[ 1 ].json = make_rows( 50, 0 );
+	corpus[ 2 ].name = strdup( "fleshed" );
+	corpus[ 2 ].json = make_rows( 50, 1 );
+	corpus[ 3 ].name = strdup( "bulk" );
+	corpus[ 3 ].json = make_rows( 1000, 0 );
+
+	int n = 4;
+	int i;
+	for( i = optind; i < argc; ++i ) {
+		corpus[ n ].json = read_file( argv[ i ] );
+		if( !corpus[ n ].json ) {
+			fprintf( stderr, "Unable to read %s\n", argv[ i ] );
+			continue;
+		}
+		corpus[ n ].name = strdup( argv[ i ] );
+		++n;
+	}
+
+	for( i = 0; i < n; ++i ) {
+		if( prepare_payload( &corpus[ i ] )) {
+			fprintf( stderr, "Invalid JSON in %s\n", corpus[ i ].name );
+			return 1;
+		}
+	}
+
+	int b;
+	for( b = 0; b < sizeof( benchmarks ) / sizeof( benchmarks[ 0 ] ); ++b ) {
+		if( only && strncmp( benchmarks[ b ].name, only, strlen( only )))
+			continue;
+		for( i = 0; i < n; ++i )
+			run_benchmark( benchmarks[ b ].name, benchmarks[ b ].op, &corpus[ i ], min_time );
+	}
+
+	for( i = 0; i < n; ++i )
+		free_payload( &corpus[ i ] );
+	free( corpus );
+	return 0;
+}
@@ -8,9 +8,13 @@
 #include <malloc.h>
 #include "opensrf/utils.h"
 #include "opensrf/osrf_json.h"
+#include "opensrf/osrf_utf8.h"
 
 struct timeval diff_timeval( const struct timeval * begin,
 	const struct timeval * end );
+static void time_serializer( long count );
+static jsonObject* sample_rows( int n );
+static void buffer_json( const jsonObject* obj, growing_buffer* buf, int second_pass );
 
 static const char sample_json[] =
 	"{\"menu\": {\"id\": \"file\", \"value\": \"File\","
@@ -19,7 +23,7 @@ static const char sample_json[] =
 	"{\"value\": \"Open\", \"onclick\": \"OpenDoc()\"}, "
 	"{\"value\": \"Close\", \"onclick\": \"CloseDoc()\"}]}}}";
 
-int main( void ) {
+int main( int argc, char* argv[] ) {
 	int rc = 0;
 
 	struct timezone tz = { 240, 1 };
@@ -62,9 +66,156 @@ int main( void ) {
 #else
 	fprintf(stderr, "malloc_stats() is not available on your system\n");
 #endif
+
+	time_serializer( argc > 1 ? atol( argv[ 1 ] ) : 20000 );
 	return rc;
 }
 
+/**
+	@brief Time jsonObjectToJSON() against serializing into a growing_buffer.
+	@param count How many times to serialize the sample.
+
+	The growing_buffer version is the way jsonObjectToJSON() used to work; it doubles as a
+	check that the output hasn't changed.
+*/
+static void time_serializer( long count ) {
+	struct timezone tz = { 240, 1 };
+	struct timeval begin_timeval;
+	struct timeval end_timeval;
+	struct timeval elapsed;
+	long i;
+
+	jsonObject* rows = sample_rows( 100 );
+
+	growing_buffer* buf = buffer_init( 32 );
+	buffer_json( rows, buf, 0 );
+	char* json = jsonObjectToJSON( rows );
+	if( strcmp( json, OSRF_BUFFER_C_STR( buf ) ) )
+		printf( "jsonObjectToJSON output differs from the growing_buffer output\n" );
+	printf( "Serializing %ld bytes of JSON %ld times\n", (long) strlen( json ), count );
+	free( json );
+	buffer_free( buf );
+
+	gettimeofday( &begin_timeval, &tz );
+	for( i = count; i; --i ) {
+		buf = buffer_init( 32 );
+		buffer_json( rows, buf, 0 );
+		free( buffer_release( buf ) );
+	}
+	gettimeofday( &end_timeval, &tz );
+	elapsed = diff_timeval( &begin_timeval, &end_timeval );
+	printf( "growing_buffer:   %ld seconds, %ld microseconds\n",
+			(long) elapsed.tv_sec, (long) elapsed.tv_usec );
+
+	gettimeofday( &begin_timeval, &tz );
+	for( i = count; i; --i )
+		free( jsonObjectToJSON( rows ) );
+	gettimeofday( &end_timeval, &tz );
+	elapsed = diff_timeval( &begin_timeval, &end_timeval );
+	printf( "jsonObjectToJSON: %ld seconds, %ld microseconds\n",
+			(long) elapsed.tv_sec, (long) elapsed.tv_usec );
+
+	jsonObjectFree( rows );
+}
+
+/**
+	@brief Build something like a typical search result: an array of classed rows.
+	@param n How many rows.
+	@return Pointer to the new jsonObject, which the caller must free.
+*/
+static jsonObject* sample_rows( int n ) {
+	jsonObject* rows = jsonNewObjectType( JSON_ARRAY );
+	int i;
+	for( i = 0; i < n; ++i ) {
+		jsonObject* row = jsonNewObjectType( JSON_ARRAY );
+		jsonObjectSetClass( row, "acp" );
+		jsonObjectPush( row, jsonNewNumberObject( 1000000 + i ) );
+		jsonObjectPush( row, jsonNewObjectFmt( "3120700%06d", i ) );
+		jsonObjectPush( row, jsonNewObject( "Main Library \"Stacks\"" ) );
+		jsonObjectPush( row, jsonNewObject(
+			"Caf\xc3\xa9 society : a history of the coffee house, 1650-1950" ) );
+		jsonObjectPush( row, jsonNewBoolObject( i % 2 ) );
+		jsonObjectPush( row, NULL );
+		jsonObjectPush( row, jsonNewNumberObject( 24.95 ) );
+
+		jsonObject* notes = jsonNewObject( NULL );
+		jsonObjectSetKey( notes, "create_date", jsonNewObject( "2009-03-05T10:15:00-0500" ) );
+		jsonObjectSetKey( notes, "circ_lib", jsonNewNumberObject( 4 ) );
+		jsonObjectSetKey( notes, "note", jsonNewObject( "Spine damaged\nrepaired" ) );
+		jsonObjectPush( row, notes );
+
+		jsonObjectPush( rows, row );
+	}
+	return rows;
+}
+
+/**
+	@brief Translate a jsonObject to JSON the old way, a piece at a time.
+	@param obj Pointer to the jsonObject.
+	@param buf Pointer to the growing_buffer to receive the JSON.
+	@param second_pass Boolean: true when called to expand a class name.
+*/
+static void buffer_json( const jsonObject* obj, growing_buffer* buf, int second_pass ) {
+	if( NULL == obj ) {
+		OSRF_BUFFER_ADD( buf, "null" );
+		return;
+	}
+
+	if( obj->classname && !second_pass ) {
+		OSRF_BUFFER_ADD( buf, "{\"" JSON_CLASS_KEY "\":\"" );
+		OSRF_BUFFER_ADD( buf, obj->classname );
+		OSRF_BUFFER_ADD( buf, "\",\"" JSON_DATA_KEY "\":" );
+		buffer_json( obj, buf, 1 );
+		OSRF_BUFFER_ADD_CHAR( buf, '}' );
+		return;
+	}
+
+	switch( obj->type ) {
+		case JSON_BOOL :
+			OSRF_BUFFER_ADD( buf, obj->value.b ? "true" : "false" );
+			break;
+		case JSON_NUMBER :
+			OSRF_BUFFER_ADD( buf, obj->value.s ? obj->value.s : "0" );
+			break;
+		case JSON_NULL :
+			OSRF_BUFFER_ADD( buf, "null" );
+			break;
+		case JSON_STRING :
+			OSRF_BUFFER_ADD_CHAR( buf, '"' );
+			buffer_append_utf8( buf, obj->value.s );
+			OSRF_BUFFER_ADD_CHAR( buf, '"' );
+			break;
+		case JSON_ARRAY : {
+			unsigned long i;
+			OSRF_BUFFER_ADD_CHAR( buf, '[' );
+			for( i = 0; i < obj->size; ++i ) {
+				if( i > 0 )
+					OSRF_BUFFER_ADD_CHAR( buf, ',' );
+				buffer_json( jsonObjectGetIndex( obj, i ), buf, 0 );
+			}
+			OSRF_BUFFER_ADD_CHAR( buf, ']' );
+			break;
+		}
+		case JSON_HASH : {
+			jsonIterator* itr = jsonNewIterator( obj );
+			const jsonObject* item;
+			int i = 0;
+			OSRF_BUFFER_ADD_CHAR( buf, '{' );
+			while( (item = jsonIteratorNext( itr )) ) {
+				if( i++ > 0 )
+					OSRF_BUFFER_ADD_CHAR( buf, ',' );
+				OSRF_BUFFER_ADD_CHAR( buf, '"' );
+				buffer_append_utf8( buf, itr->key );
+				OSRF_BUFFER_ADD( buf, "\":" );
+				buffer_json( item, buf, 0 );
+			}
+			jsonIteratorFree( itr );
+			OSRF_BUFFER_ADD_CHAR( buf, '}' );
+			break;
+		}
+	}
+}
+
 struct timeval diff_timeval( const struct timeval * begin, const struct timeval * end )
 {
 	struct timeval diff;
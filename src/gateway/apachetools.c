@@ -1,109 +1,183 @@
 #include "apachetools.h"
 
-osrfStringArray* apacheParseParms(request_rec* r) {
+/* State of a form decoder between one block of input and the next */
+typedef struct {
+	growing_buffer* key;
+	growing_buffer* value;
+	int in_value;       /* boolean: past the '=' of the current pair */
+	char escape[3];     /* a %XX escape not yet complete, or empty */
+	int pairs;
+	apacheParamHandler handler;
+	void* blob;
+} apacheParamDecoder;
+
+static int hex_digit( char c ) {
+	if( c >= '0' && c <= '9' ) return c - '0';
+	if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
 
-	if( r == NULL ) return NULL;
+/* Add a decoded character to the key or value of the current pair */
+static void decoder_put( apacheParamDecoder* d, char c ) {
+	growing_buffer* buf = d->in_value ? d->value : d->key;
+	OSRF_BUFFER_ADD_CHAR( buf, c );
+}
 
-	char* arg = NULL;
-	apr_pool_t *p = r->pool;	/* memory pool */
-	growing_buffer* buffer = buffer_init(1025);
+/* Add what there is of an unfinished escape as it came, as ap_unescape_url() does */
+static void decoder_flush_escape( apacheParamDecoder* d ) {
+	const char* c;
+	for( c = d->escape; *c; c++ )
+		decoder_put( d, *c );
+	d->escape[ 0 ] = '\0';
+}
 
-	/* gather the post args and append them to the url query string */
-	if( !strcmp(r->method,"POST") ) {
+/* Hand the current pair, if any, to the handler; -1 if it says to stop */
+static int decoder_end_pair( apacheParamDecoder* d ) {
+	decoder_flush_escape( d );
+	int rc = 0;
+	if( d->key->n_used ) {
+		osrfLogInternal( OSRF_LOG_MARK, "parsed URL param %s", d->key->buf );
+		if( ++d->pairs > 1000 ) {
+			osrfLogError( OSRF_LOG_MARK,
+				"Parsing URL params failed sanity check: 1000 iterations" );
+			rc = -1;
+		} else if( d->handler( d->blob, d->key->buf, d->value->buf, d->value->n_used ) )
+			rc = -1;
+	}
+	buffer_reset( d->key );
+	buffer_reset( d->value );
+	d->in_value = 0;
+	return rc;
+}
 
-		ap_setup_client_block(r, REQUEST_CHUNKED_DECHUNK);
-		
-		osrfLogDebug(OSRF_LOG_MARK, "gateway reading post data..");
+/* Decode a block of form data: name=value pairs separated by '&', with %XX
+   escapes, which may be split from one block to the next */
+static int decoder_feed( apacheParamDecoder* d, const char* data, size_t len ) {
+	size_t i;
+	for( i = 0; i < len; i++ ) {
+		char c = data[ i ];
+		if( d->escape[ 0 ] ) {
+			if( hex_digit( c ) >= 0 ) {
+				if( !d->escape[ 1 ] ) {
+					d->escape[ 1 ] = c;
+					continue;
+				}
+				d->escape[ 0 ] = '\0';
+				decoder_put( d, (char) ( hex_digit( d->escape[ 1 ] ) * 16 + hex_digit( c ) ) );
+				continue;
+			}
+			decoder_flush_escape( d );
+		}
 
-		if(ap_should_client_block(r)) {
+		if( c == '&' ) {
+			if( decoder_end_pair( d ) )
+				return -1;
+		} else if( c == '=' && !d->in_value ) {
+			d->in_value = 1;
+		} else if( c == '%' ) {
+			d->escape[ 0 ] = '%';
+			d->escape[ 1 ] = '\0';
+			d->escape[ 2 ] = '\0';
+		} else {
+			decoder_put( d, c );
+		}
+	}
+	return 0;
+}
 
+int apacheParseParamsStream( request_rec* r, size_t max_size,
+		apacheParamHandler handler, void* blob ) {
+
+	if( r == NULL || handler == NULL ) return -1;
+
+	apacheParamDecoder d;
+	d.key = buffer_init( 64 );
+	d.value = buffer_init( 1024 );
+	d.in_value = 0;
+	d.escape[ 0 ] = '\0';
+	d.pairs = 0;
+	d.handler = handler;
+	d.blob = blob;
+
+	int rc = 0;
+	size_t total = 0;
+
+	/* Start with url query string, if any */
+	if( r->args && r->args[0] ) {
+		total = strlen( r->args );
+		if( total > max_size ) {
+			osrfLogError( OSRF_LOG_MARK, "gateway received a query string larger "
+				"than %lu bytes. dropping request", (unsigned long) max_size );
+			rc = -2;
+		} else if( decoder_feed( &d, r->args, total ) || decoder_end_pair( &d ) )
+			rc = -1;
+	}
 
-			/* Start with url query string, if any */
-			
-			if(r->args && r->args[0])
-				buffer_add(buffer, r->args);
+	/* then the POST data, decoded block by block as it arrives */
+	if( !rc && !strcmp( r->method, "POST" ) ) {
 
-			char body[1025];
+		const char* length = apr_table_get( r->headers_in, "Content-Length" );
+		if( length && strtoull( length, NULL, 10 ) > max_size - total ) {
+			osrfLogError( OSRF_LOG_MARK, "gateway received POST of %s bytes, larger "
+				"than %lu. dropping request", length, (unsigned long) max_size );
+			rc = -2;
 
-			osrfLogDebug(OSRF_LOG_MARK, "gateway client has post data, reading...");
+		} else if( ap_setup_client_block( r, REQUEST_CHUNKED_DECHUNK ) == OK
+				&& ap_should_client_block( r ) ) {
 
-			/* Append POST data */
-			
+			osrfLogDebug( OSRF_LOG_MARK, "gateway client has post data, reading..." );
+			char body[ 8192 ];
 			long bread;
-			while( (bread = ap_get_client_block(r, body, sizeof(body) - 1)) ) {
+			while( !rc && (bread = ap_get_client_block( r, body, sizeof(body) )) ) {
 
-				if(bread < 0) {
-					osrfLogInfo(OSRF_LOG_MARK, 
-						"ap_get_client_block(): returned error, exiting POST reader");
+				if( bread < 0 ) {
+					osrfLogInfo( OSRF_LOG_MARK,
+						"ap_get_client_block(): returned error, exiting POST reader" );
 					break;
 				}
 
-				body[bread] = '\0';
-				buffer_add( buffer, body );
-
-				osrfLogDebug(OSRF_LOG_MARK, 
-					"gateway read %ld bytes: %d bytes of data so far", bread, buffer->n_used);
-
-				if(buffer->n_used > APACHE_TOOLS_MAX_POST_SIZE) {
-					osrfLogError(OSRF_LOG_MARK, "gateway received POST larger "
-						"than %d bytes. dropping request", APACHE_TOOLS_MAX_POST_SIZE);
-					buffer_free(buffer);
-					return NULL;
-				}
+				total += bread;
+				if( total > max_size ) {
+					osrfLogError( OSRF_LOG_MARK, "gateway received POST larger "
+						"than %lu bytes. dropping request", (unsigned long) max_size );
+					rc = -2;
+				} else if( decoder_feed( &d, body, bread ) )
+					rc = -1;
 			}
 
-			osrfLogDebug(OSRF_LOG_MARK, "gateway done reading post data");
+			if( !rc && decoder_end_pair( &d ) )
+				rc = -1;
+			osrfLogDebug( OSRF_LOG_MARK, "gateway read %lu bytes of data", (unsigned long) total );
 		}
+	}
 
-	} else { /* GET */
-
-        if(r->args && r->args[0])
-            buffer_add(buffer, r->args);
-    }
+	buffer_free( d.key );
+	buffer_free( d.value );
+	return rc;
+}
 
+/* Handler for apacheParseParms(): collect each pair */
+static int collect_param( void* blob, const char* key, char* value, size_t len ) {
+	osrfStringArray* sarray = blob;
+	osrfStringArrayAdd( sarray, key );
+	osrfStringArrayAdd( sarray, value );
+	return 0;
+}
 
-    if(buffer->n_used > 0)
-        arg = apr_pstrdup(p, buffer->buf);
-    else
-        arg = NULL; 
-    buffer_free(buffer);
+osrfStringArray* apacheParseParms(request_rec* r) {
 
-	if( !arg || !arg[0] ) { /* we received no request */
-		return NULL;
-	}
+	if( r == NULL ) return NULL;
 
-	osrfLogDebug(OSRF_LOG_MARK, "parsing URL params from post/get request data: %s", arg);
-	
-	osrfStringArray* sarray		= osrfNewStringArray(12); /* method parameters */
-	int sanity = 0;
-	char* key					= NULL;	/* query item name */
-	char* val					= NULL;	/* query item value */
+	osrfStringArray* sarray = osrfNewStringArray(12); /* method parameters */
 
 	/* Parse the post/get request data into a series of name/value pairs.   */
 	/* Load each name into an even-numbered slot of an osrfStringArray, and */
 	/* the corresponding value into the following odd-numbered slot.        */
-
-	while( arg && (val = ap_getword(p, (const char**) &arg, '&'))) {
-
-		key = ap_getword(r->pool, (const char**) &val, '=');
-		if(!key || !key[0])
-			break;
-
-		ap_unescape_url(key);
-		ap_unescape_url(val);
-
-		osrfLogDebug(OSRF_LOG_MARK, "parsed URL params %s=%s", key, val);
-
-		osrfStringArrayAdd(sarray, key);
-		osrfStringArrayAdd(sarray, val);
-
-		if( sanity++ > 1000 ) {
-			osrfLogError(OSRF_LOG_MARK, 
-				"Parsing URL params failed sanity check: 1000 iterations");
-			osrfStringArrayFree(sarray);
-			return NULL;
-		}
-
+	if( apacheParseParamsStream( r, APACHE_TOOLS_MAX_POST_SIZE, collect_param, sarray )
+			|| sarray->size == 0 ) {
+		osrfStringArrayFree(sarray);
+		return NULL;
 	}
 
 	osrfLogDebug(OSRF_LOG_MARK,
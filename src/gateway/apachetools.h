@@ -23,6 +23,19 @@ extern "C" {
 #define OSRF_HTTP_ALL_HEADERS "X-OpenSRF-to,X-OpenSRF-xid,X-OpenSRF-from,X-OpenSRF-thread,X-OpenSRF-timeout,X-OpenSRF-service,X-OpenSRF-multipart"
 
 
+/* Called for each name=value pair by apacheParseParamsStream(), with both
+	URL-decoded and nul-terminated.  The value, len bytes long, may be changed in
+	place, as by a parser, but is gone once the handler returns.  Return 0 to go
+	on, or anything else to stop */
+typedef int (*apacheParamHandler)( void* blob, const char* key, char* value, size_t len );
+
+/* parses apache URL params (GET and POST) as they arrive, handing each pair to 
+	the handler.  Returns 0 if successful, -2 if the params would exceed max_size
+	bytes (known from Content-Length, where given, before reading any), or -1 if
+	the handler stopped early or there were too many params */
+int apacheParseParamsStream( request_rec* r, size_t max_size,
+		apacheParamHandler handler, void* blob );
+
 /* parses apache URL params (GET and POST).  
 	Returns a osrfStringArray of the form [ key, val, key, val, ...]
 	Returns NULL if there are no params */
@@ -24,6 +24,8 @@
 #define JSON_CONTENT_TYPE "text/plain"
 #define MAX_MSGS_PER_PACKET 256
 #define CACHE_TIME 300
+#define AFFINITY_LOCAL_MAX 1024
+#define AFFINITY_LOCAL_SECS 5
 #define TRANSLATOR_INGRESS "translator-v1"
 
 #define OSRF_HTTP_HEADER_TO "X-OpenSRF-to"
@@ -46,6 +48,17 @@ char recipientBuf[128];
 char contentTypeBuf[80];
 osrfStringArray* allowedOrigins = NULL;
 
+// Sessions this child has seen, thread => affinityEntry, checked before
+// memcached, which only matters when a conversation moves between children.
+// Entries live only a few seconds, so that a session another child has
+// moved or ended isn't followed for long.
+typedef struct {
+    time_t expires;
+    char value[]; // "<ip> <service> <jid>", as cached
+} affinityEntry;
+static osrfHash* affinityLocal = NULL;
+static int affinityRemoved = 0; // removals since the table was last built
+
 #if 0
 // Commented out to avoid compiler warning
 // for development only, writes to apache error log
@@ -184,13 +197,80 @@ static void osrfHttpTranslatorDebug(osrfHttpTranslator* trans) {
 }
 #endif
 
+static void affinityReset(void) {
+    osrfHashFree(affinityLocal);
+    affinityLocal = osrfNewHash();
+    osrfHashSetCallback(affinityLocal, (void (*)(char*, void*)) free);
+    affinityRemoved = 0;
+}
+
+static void affinityRemember(const char* thread, const char* value) {
+    // rather than track which is oldest, start over when full; memcached
+    // still has them.  Removed entries linger in the hash as dead nodes
+    // until it's freed, so start over once enough of them pile up, too.
+    if(!affinityLocal || osrfHashGetCount(affinityLocal) >= AFFINITY_LOCAL_MAX
+            || affinityRemoved >= AFFINITY_LOCAL_MAX)
+        affinityReset();
+    size_t len = strlen(value);
+    affinityEntry* entry = safe_malloc(sizeof(affinityEntry) + len + 1);
+    entry->expires = time(NULL) + AFFINITY_LOCAL_SECS;
+    memcpy(entry->value, value, len + 1);
+    osrfHashSet(affinityLocal, entry, "%s", thread);
+}
+
+static void affinityForget(const char* thread) {
+    if(affinityLocal && osrfHashGet(affinityLocal, thread)) {
+        osrfHashRemove(affinityLocal, "%s", thread);
+        affinityRemoved++;
+    }
+}
+
+/**
+ * Looks up the session of a thread: the address it came from, its service, 
+ * and the JID of the backend process serving it.  Checks this child first, 
+ * then memcached.  Returns "<ip> <service> <jid>", to be freed, or NULL.
+ */
+static char* osrfHttpTranslatorGetSession(const char* thread) {
+    affinityEntry* entry = affinityLocal ? osrfHashGet(affinityLocal, thread) : NULL;
+    if(entry) {
+        if(entry->expires > time(NULL))
+            return strdup(entry->value);
+        affinityForget(thread);
+    }
+
+    char* value = osrfCacheGetString("%s", thread);
+    if(value && *value == '{') {
+        // cached as a JSON object, the old way, by a child not yet upgraded
+        jsonObject* old = jsonParse(value);
+        free(value);
+        value = NULL;
+        const char* ip = jsonObjectGetString(jsonObjectGetKeyConst(old, "ip"));
+        const char* service = jsonObjectGetString(jsonObjectGetKeyConst(old, "service"));
+        const char* jid = jsonObjectGetString(jsonObjectGetKeyConst(old, "jid"));
+        if(ip && service && jid) {
+            growing_buffer* buf = buffer_init(128);
+            buffer_fadd(buf, "%s %s %s", ip, service, jid);
+            value = buffer_release(buf);
+        }
+        jsonObjectFree(old);
+    }
+    if(value)
+        affinityRemember(thread, value);
+    return value;
+}
+
+static void osrfHttpTranslatorForgetSession(const char* thread) {
+    affinityForget(thread);
+    osrfCacheRemove("%s", thread);
+}
+
 /**
  * Determines the correct recipient address based on the requested 
  * service or recipient address.  
  */
 static int osrfHttpTranslatorSetTo(osrfHttpTranslator* trans) {
     int stat = 0;
-    jsonObject* sessionCache = NULL;
+    char* sessionCache = NULL;
 
     if(trans->service) {
         if(trans->recipient) {
@@ -210,13 +290,18 @@ static int osrfHttpTranslatorSetTo(osrfHttpTranslator* trans) {
     } else {
 
         if(trans->recipient) {
-            sessionCache = osrfCacheGetObject(trans->thread);
+            sessionCache = osrfHttpTranslatorGetSession(trans->thread);
+
+            // split "<ip> <service> <jid>" in place
+            char* service = sessionCache ? strchr(sessionCache, ' ') : NULL;
+            char* recipient = service ? strchr(service + 1, ' ') : NULL;
+            if(recipient) {
+                *service++ = '\0';
+                *recipient++ = '\0';
+            }
 
-            if(sessionCache) {
-                const char* ipAddr = jsonObjectGetString(
-                    jsonObjectGetKeyConst( sessionCache, "ip" ));
-                const char* recipient = jsonObjectGetString(
-                    jsonObjectGetKeyConst( sessionCache, "jid" ));
+            if(recipient) {
+                const char* ipAddr = sessionCache;
 
                 // choosing a specific recipient address requires that the recipient and 
                 // thread be cached on the server (so drone processes cannot be hijacked)
@@ -225,9 +310,7 @@ static int osrfHttpTranslatorSetTo(osrfHttpTranslator* trans) {
                         "Found cached session from host %s and recipient %s",
                         trans->remoteHost, trans->recipient);
                     stat = 1;
-                    trans->service = apr_pstrdup(
-                        trans->apreq->pool, jsonObjectGetString(
-                            jsonObjectGetKeyConst( sessionCache, "service" )));
+                    trans->service = apr_pstrdup(trans->apreq->pool, service);
 
                 } else {
                     osrfLogError(OSRF_LOG_MARK, 
@@ -242,7 +325,7 @@ static int osrfHttpTranslatorSetTo(osrfHttpTranslator* trans) {
         } 
     }
 
-    jsonObjectFree(sessionCache);
+    free(sessionCache);
     return stat;
 }
 
@@ -254,7 +337,7 @@ static int osrfHttpTranslatorSetTo(osrfHttpTranslator* trans) {
 static char* osrfHttpTranslatorParseRequest(osrfHttpTranslator* trans) {
     osrfMessage* msg;
     osrfMessage* msgList[MAX_MSGS_PER_PACKET];
-    int numMsgs = osrf_message_deserialize(trans->body, msgList, MAX_MSGS_PER_PACKET);
+    int numMsgs = osrf_message_deserialize_lazy(trans->body, msgList, MAX_MSGS_PER_PACKET);
     osrfLogDebug(OSRF_LOG_MARK, "parsed %d opensrf messages in this packet", numMsgs);
 
     if(numMsgs == 0)
@@ -269,7 +352,7 @@ static char* osrfHttpTranslatorParseRequest(osrfHttpTranslator* trans) {
         switch(msg->m_type) {
 
             case REQUEST: {
-                const jsonObject* params = msg->_params;
+                const jsonObject* params = NULL;
                 growing_buffer* act = buffer_init(128);	
                 char* method = msg->method_name;
                 buffer_fadd(act, "[%s] [%s] %s %s", trans->remoteHost, "",
@@ -289,6 +372,7 @@ static char* osrfHttpTranslatorParseRequest(osrfHttpTranslator* trans) {
                 if(redactParams) {
                     OSRF_BUFFER_ADD(act, " **PARAMS REDACTED**");
                 } else {
+                    params = osrfMessageGetParams(msg);
                     i = 0;
                     while((obj = jsonObjectGetIndex(params, i++))) {
                         str = jsonObjectToJSON(obj);
@@ -341,23 +425,27 @@ static char* osrfHttpTranslatorParseRequest(osrfHttpTranslator* trans) {
 
 static int osrfHttpTranslatorCheckStatus(osrfHttpTranslator* trans, transport_message* msg) {
     osrfMessage* omsgList[MAX_MSGS_PER_PACKET];
-    int numMsgs = osrf_message_deserialize(msg->body, omsgList, MAX_MSGS_PER_PACKET);
+    // Only the status matters here; the content goes to the client as it came
+    int numMsgs = osrf_message_deserialize_lazy(msg->body, omsgList, MAX_MSGS_PER_PACKET);
     osrfLogDebug(OSRF_LOG_MARK, "parsed %d response messages", numMsgs);
     if(numMsgs == 0) return 0;
 
+    int rc = 1;
     osrfMessage* last = omsgList[numMsgs-1];
     if(last->m_type == STATUS) {
         if(last->status_code == OSRF_STATUS_TIMEOUT) {
             osrfLogDebug(OSRF_LOG_MARK, "removing cached session on request timeout");
-            osrfCacheRemove(trans->thread);
-            return 0;
-        }
+            osrfHttpTranslatorForgetSession(trans->thread);
+            rc = 0;
         // XXX hm, check for explicit status=COMPLETE message instead??
-        if(last->status_code != OSRF_STATUS_CONTINUE)
+        } else if(last->status_code != OSRF_STATUS_CONTINUE)
             trans->complete = 1;
     }
 
-    return 1;
+    int i;
+    for(i = 0; i < numMsgs; i++)
+        osrfMessageFree(omsgList[i]);
+    return rc;
 }
 
 static void osrfHttpTranslatorInitHeaders(osrfHttpTranslator* trans, transport_message* msg) {
@@ -379,11 +467,11 @@ static void osrfHttpTranslatorInitHeaders(osrfHttpTranslator* trans, transport_m
  * Cache the transaction with the JID of the backend process we are talking to
  */
 static void osrfHttpTranslatorCacheSession(osrfHttpTranslator* trans, const char* jid) {
-    jsonObject* cacheObj = jsonNewObject(NULL);
-    jsonObjectSetKey(cacheObj, "ip", jsonNewObject(trans->remoteHost));
-    jsonObjectSetKey(cacheObj, "jid", jsonNewObject(jid));
-    jsonObjectSetKey(cacheObj, "service", jsonNewObject(trans->service));
-    osrfCachePutObject(trans->thread, cacheObj, CACHE_TIME);
+    growing_buffer* buf = buffer_init(128);
+    buffer_fadd(buf, "%s %s %s", trans->remoteHost, trans->service, jid);
+    affinityRemember(trans->thread, buf->buf);
+    osrfCachePutString(trans->thread, buf->buf, CACHE_TIME);
+    buffer_free(buf);
 }
 
 
@@ -430,7 +518,7 @@ static int osrfHttpTranslatorProcess(osrfHttpTranslator* trans) {
 
     if(trans->disconnectOnly) {
         osrfLogDebug(OSRF_LOG_MARK, "exiting early on disconnect");
-        osrfCacheRemove(trans->thread);
+        osrfHttpTranslatorForgetSession(trans->thread);
         return OK;
     }
 
@@ -441,7 +529,7 @@ static int osrfHttpTranslatorProcess(osrfHttpTranslator* trans) {
 
         if(trans->handle->error) {
             osrfLogError(OSRF_LOG_MARK, "Transport error");
-            osrfCacheRemove(trans->thread);
+            osrfHttpTranslatorForgetSession(trans->thread);
             return HTTP_INTERNAL_SERVER_ERROR;
         }
 
@@ -450,7 +538,7 @@ static int osrfHttpTranslatorProcess(osrfHttpTranslator* trans) {
 
         if(msg->is_error) {
             osrfLogError(OSRF_LOG_MARK, "XMPP message resulted in error code %d", msg->error_code);
-            osrfCacheRemove(trans->thread);
+            osrfHttpTranslatorForgetSession(trans->thread);
             return HTTP_NOT_FOUND;
         }
 
@@ -493,7 +581,7 @@ static int osrfHttpTranslatorProcess(osrfHttpTranslator* trans) {
     }
 
     if(trans->disconnecting) // DISCONNECT within a multi-message batch
-        osrfCacheRemove(trans->thread);
+        osrfHttpTranslatorForgetSession(trans->thread);
 
     return OK;
 }
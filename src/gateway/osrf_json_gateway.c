@@ -1,5 +1,7 @@
 #include "apachetools.h"
 #include "opensrf/osrf_app_session.h"
+#include "opensrf/osrf_multisession.h"
+#include "opensrf/osrf_cache.h"
 #include "opensrf/osrf_system.h"
 #include "opensrf/osrfConfig.h"
 #include <opensrf/osrf_json.h>
@@ -10,6 +12,7 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #include <strings.h>
+#include <zlib.h>
 
 
 #define MODULE_NAME "osrf_json_gateway_module"
@@ -18,6 +21,23 @@
 #define CONFIG_CONTEXT "gateway"
 #define JSON_PROTOCOL "OSRFGatewayLegacyJSON"
 #define GATEWAY_USE_LEGACY_JSON 0
+/* idle client sessions kept per service for reuse; <session_pool> overrides */
+#define GATEWAY_SESSION_POOL 4
+/* bytes of response after which it goes out gzipped, if the client takes gzip;
+   <compress_min_size> overrides, and 0 turns compression off */
+#define GATEWAY_COMPRESS_MIN 1024
+/* bytes of response held back before a flush to the client; <flush_size> overrides */
+#define GATEWAY_FLUSH_SIZE 16384
+/* most calls in one batch; <batch_max> overrides */
+#define GATEWAY_BATCH_MAX 50
+/* most calls of a batch in flight at once, 0 for all; <batch_concurrency> overrides */
+#define GATEWAY_BATCH_CONCURRENCY 0
+/* for methods listed under <coalesce>: seconds to keep a response for identical
+   calls, and most seconds to wait on an identical call in flight elsewhere */
+#define GATEWAY_COALESCE_TTL 5
+#define GATEWAY_COALESCE_WAIT 10
+/* most responses kept in-process when there are no coalescing cache servers */
+#define GATEWAY_COALESCE_LOCAL_MAX 256
 
 typedef struct {
 	int legacyJSON;
@@ -31,6 +51,42 @@ char* osrf_json_gateway_config_file = NULL;
 int bootstrapped = 0;
 int numserved = 0;
 osrfStringArray* allowedOrigins = NULL;
+/* service name => osrfList of idle client sessions, ready for reuse */
+osrfHash* sessionPool = NULL;
+int sessionPoolSize = GATEWAY_SESSION_POOL;
+int compressMinSize = GATEWAY_COMPRESS_MIN;
+int flushSize = GATEWAY_FLUSH_SIZE;
+int batchMax = GATEWAY_BATCH_MAX;
+int batchConcurrency = GATEWAY_BATCH_CONCURRENCY;
+size_t maxRequestSize = APACHE_TOOLS_MAX_POST_SIZE;
+
+/* Coalescing: identical calls to the methods listed share one response, kept
+   for coalesceTTL seconds.  With cache servers, children share responses, and
+   a call waits for an identical one already in flight in another child;
+   otherwise each child keeps its own, in coalesceLocal. */
+osrfStringArray* coalesceMethods = NULL;
+int coalesceTTL = GATEWAY_COALESCE_TTL;
+int coalesceWait = GATEWAY_COALESCE_WAIT;
+int coalesceShared = 0;
+osrfHash* coalesceLocal = NULL;   /* key => coalesce_entry */
+
+typedef struct {
+	time_t expires;
+	char body[];
+} coalesce_entry;
+
+/* A response on its way to the client.  Output collects in buf until there's
+   enough of it to decide whether to compress it, then goes out in flushes of
+   about flushSize bytes, through the deflater if compressing. */
+typedef struct {
+	request_rec* r;
+	growing_buffer* buf;  /* output not yet sent */
+	z_stream* z;          /* gzip stream, or NULL if sending plain */
+	int gzip;             /* boolean: the client accepts gzip */
+	int started;          /* boolean: the headers are decided, and output is flowing */
+	int failed;           /* boolean: the client went away, or zlib gave up */
+	growing_buffer* capture;  /* if not NULL, collects the whole response, uncompressed */
+} gateway_output;
 
 static const char* osrf_json_gateway_set_default_locale(cmd_parms *parms,
 		void *config, const char *arg) {
@@ -91,6 +147,76 @@ static void osrf_json_gateway_child_init(apr_pool_t *p, server_rec *s) {
 	allowedOrigins = osrfNewStringArray(4);
 	osrfConfigGetValueList(NULL, allowedOrigins, "/cross_origin/origin");
 
+	char* pool_size = osrfConfigGetValue(NULL, "/session_pool");
+	if( pool_size ) {
+		sessionPoolSize = atoi( pool_size );
+		if( sessionPoolSize < 0 )
+			sessionPoolSize = 0;
+		free( pool_size );
+	}
+	sessionPool = osrfNewHash();
+
+	char* compress_min = osrfConfigGetValue(NULL, "/compress_min_size");
+	if( compress_min ) {
+		compressMinSize = atoi( compress_min );
+		free( compress_min );
+	}
+	char* flush_size = osrfConfigGetValue(NULL, "/flush_size");
+	if( flush_size ) {
+		flushSize = atoi( flush_size );
+		if( flushSize < 1024 )
+			flushSize = 1024;
+		free( flush_size );
+	}
+	char* max_request = osrfConfigGetValue(NULL, "/max_request_size");
+	if( max_request ) {
+		if( atol( max_request ) > 0 )
+			maxRequestSize = atol( max_request );
+		free( max_request );
+	}
+	char* batch_max = osrfConfigGetValue(NULL, "/batch_max");
+	if( batch_max ) {
+		batchMax = atoi( batch_max );
+		free( batch_max );
+	}
+	char* batch_concurrency = osrfConfigGetValue(NULL, "/batch_concurrency");
+	if( batch_concurrency ) {
+		batchConcurrency = atoi( batch_concurrency );
+		free( batch_concurrency );
+	}
+
+	coalesceMethods = osrfNewStringArray(8);
+	osrfConfigGetValueList(NULL, coalesceMethods, "/coalesce/methods/method");
+	if( coalesceMethods->size ) {
+		char* ttl = osrfConfigGetValue(NULL, "/coalesce/ttl");
+		if( ttl ) {
+			coalesceTTL = atoi( ttl );
+			free( ttl );
+		}
+		char* wait = osrfConfigGetValue(NULL, "/coalesce/wait");
+		if( wait ) {
+			coalesceWait = atoi( wait );
+			free( wait );
+		}
+
+		osrfStringArray* servers = osrfNewStringArray(4);
+		osrfConfigGetValueList(NULL, servers, "/coalesce/servers/server");
+		if( servers->size ) {
+			const char* list[ servers->size ];
+			int i;
+			for( i = 0; i < servers->size; i++ )
+				list[ i ] = osrfStringArrayGetString( servers, i );
+			coalesceShared = !osrfCacheInit( list, servers->size,
+				coalesceTTL > coalesceWait ? coalesceTTL : coalesceWait );
+		}
+		osrfStringArrayFree( servers );
+
+		coalesceLocal = osrfNewHash();
+		osrfHashSetCallback( coalesceLocal, (void (*)(char*, void*)) free );
+		osrfLogInfo(OSRF_LOG_MARK, "Coalescing calls to %d methods, %s", coalesceMethods->size,
+			coalesceShared ? "shared among children" : "within each child" );
+	}
+
 	bootstrapped = 1;
 	osrfLogInfo(OSRF_LOG_MARK, "Bootstrapping gateway child for requests");
 
@@ -100,6 +226,472 @@ static void osrf_json_gateway_child_init(apr_pool_t *p, server_rec *s) {
 	//apr_pool_cleanup_register(p, NULL, child_exit, apr_pool_cleanup_null);
 }
 
+/* Take an idle session for the service from the pool, or make a new one */
+static osrfAppSession* gateway_session_get(const char* service) {
+	osrfList* idle = osrfHashGet( sessionPool, service );
+	if( idle && idle->size > 0 )
+		return osrfListPop( idle );
+	return osrfAppSessionClientInit( service );
+}
+
+/* Return a session to its service's pool, or free it if it can't be reused
+   or the pool is full */
+static void gateway_session_put(osrfAppSession* session) {
+	if( !session )
+		return;
+	if( sessionPoolSize <= 0 || osrfAppSessionReset( session ) ) {
+		osrfAppSessionFree( session );
+		return;
+	}
+
+	osrfList* idle = osrfHashGet( sessionPool, session->remote_service );
+	if( !idle ) {
+		idle = osrfNewList();
+		osrfHashSet( sessionPool, idle, "%s", session->remote_service );
+	}
+	if( (int) idle->size < sessionPoolSize )
+		osrfListPush( idle, session );
+	else
+		osrfAppSessionFree( session );
+}
+
+/* True if an Accept-Encoding header admits gzip, i.e. names gzip (or x-gzip,
+   or *) without giving it a q-value of zero */
+static int accepts_gzip(const char* accept) {
+	while( accept && *accept ) {
+		while( *accept == ' ' || *accept == '\t' || *accept == ',' )
+			accept++;
+		const char* end = accept + strcspn( accept, ",;" );
+		size_t len = end - accept;
+		while( len && ( accept[ len - 1 ] == ' ' || accept[ len - 1 ] == '\t' ) )
+			len--;
+
+		int match = ( len == 4 && !strncasecmp( accept, "gzip", 4 ) )
+			|| ( len == 6 && !strncasecmp( accept, "x-gzip", 6 ) )
+			|| ( len == 1 && *accept == '*' );
+
+		const char* next = strchr( end, ',' );
+		if( match ) {
+			const char* q = strstr( end, "q=" );
+			if( !q || ( next && q > next ) || atof( q + 2 ) > 0 )
+				return 1;
+		}
+		accept = next;
+	}
+	return 0;
+}
+
+/* Send what's been collected, deflated if compressing.  A flush of Z_SYNC_FLUSH
+   or Z_FINISH ends the compressed output on a boundary the client can decode up
+   to, and pushes everything through Apache's filters to the client. */
+static void output_send(gateway_output* out, int flush) {
+	request_rec* r = out->r;
+	if( out->failed )
+		return;
+
+	if( !out->z ) {
+		if( out->buf->n_used && ap_rwrite( out->buf->buf, out->buf->n_used, r ) < 0 )
+			out->failed = 1;
+		buffer_reset( out->buf );
+		if( !out->failed && flush != Z_NO_FLUSH && ap_rflush( r ) < 0 )
+			out->failed = 1;
+		return;
+	}
+
+	unsigned char chunk[ 8192 ];
+	int status;
+	out->z->next_in = (unsigned char*) out->buf->buf;
+	out->z->avail_in = out->buf->n_used;
+	do {
+		out->z->next_out = chunk;
+		out->z->avail_out = sizeof( chunk );
+		status = deflate( out->z, flush );
+		if( status == Z_STREAM_ERROR ) {
+			osrfLogError( OSRF_LOG_MARK, "Unable to compress the gateway response" );
+			out->failed = 1;
+			break;
+		}
+		size_t n = sizeof( chunk ) - out->z->avail_out;
+		if( n && ap_rwrite( chunk, n, r ) < 0 ) {
+			out->failed = 1;
+			break;
+		}
+	} while( out->z->avail_out == 0 || ( flush == Z_FINISH && status != Z_STREAM_END ) );
+	buffer_reset( out->buf );
+
+	if( !out->failed && flush != Z_NO_FLUSH && ap_rflush( r ) < 0 )
+		out->failed = 1;
+}
+
+/* Decide how the response goes out: gzipped if the client accepts it, and if
+   it's big enough to be worth compressing (or of unknown size yet), else plain */
+static void output_start(gateway_output* out) {
+	out->started = 1;
+	if( !out->gzip || out->buf->n_used < (size_t) compressMinSize )
+		return;
+
+	out->z = safe_malloc( sizeof( z_stream ) );
+	/* window bits of 15 + 16 asks for a gzip header and trailer */
+	if( deflateInit2( out->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY ) != Z_OK ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to set up gzip; sending the response plain" );
+		free( out->z );
+		out->z = NULL;
+		return;
+	}
+	apr_table_mergen( out->r->headers_out, "Content-Encoding", "gzip" );
+	apr_table_unset( out->r->headers_out, "Content-Length" );
+}
+
+/* Add to the response, sending it on once enough has collected */
+static int output_write(gateway_output* out, const char* data, size_t len) {
+	buffer_add_n( out->buf, data, len );
+	if( out->capture )
+		buffer_add_n( out->capture, data, len );
+	if( !out->started && out->buf->n_used >= (size_t) compressMinSize )
+		output_start( out );
+	if( out->buf->n_used >= (size_t) flushSize ) {
+		if( !out->started )
+			output_start( out );
+		output_send( out, Z_SYNC_FLUSH );
+	}
+	return out->failed ? -1 : 0;
+}
+
+static int output_puts(gateway_output* out, const char* str) {
+	return output_write( out, str, strlen( str ) );
+}
+
+/* Send the rest of the response, and release the output's resources */
+static void output_finish(gateway_output* out) {
+	if( !out->started )
+		output_start( out );
+	output_send( out, out->z ? Z_FINISH : Z_NO_FLUSH );
+	if( out->z ) {
+		deflateEnd( out->z );
+		free( out->z );
+		out->z = NULL;
+	}
+	buffer_free( out->buf );
+	out->buf = NULL;
+}
+
+/* Sink for jsonObjectToXMLStream(): pass the XML on to the response as it comes */
+static int write_to_client(void* blob, const char* data, size_t len) {
+	return output_write( (gateway_output*) blob, data, len );
+}
+
+/* Build the key under which identical calls share a response: a digest of all
+   that shapes the response, with JSON params in canonical form */
+static char* coalesce_key(const char* service, const char* method, const char* locale,
+		int api_level, const char* input_format, const char* output,
+		const osrfStringArray* mparams) {
+	growing_buffer* buf = buffer_init( 256 );
+	buffer_fadd( buf, "%s\n%s\n%s\n%d\n%s\n%s", service, method, locale, api_level,
+		input_format, output );
+
+	int json = !strcasecmp( input_format, "json" );
+	const char* str;
+	int i = 0;
+	while( (str = osrfStringArrayGetString(mparams, i++)) ) {
+		buffer_add_char( buf, '\n' );
+		jsonObject* param = json ? jsonParse( str ) : NULL;
+		if( param ) {
+			char* canonical = jsonObjectToJSON( param );
+			buffer_add( buf, canonical );
+			free( canonical );
+			jsonObjectFree( param );
+		} else
+			buffer_add( buf, str );
+	}
+
+	char* digest = md5sum( buf->buf );
+	buffer_reset( buf );
+	buffer_fadd( buf, "osrfgw.coalesce.%s", digest );
+	free( digest );
+	return buffer_release( buf );
+}
+
+/* Find a response shared by an identical call.  If there is none, but an
+   identical call is in flight in another child, wait for it, up to wait
+   seconds.  Returns the response, or NULL, with *owner set if this call is to
+   run and share its response; then coalesce_store() must follow. */
+static char* coalesce_lookup(const char* key, int wait, int* owner) {
+	*owner = 0;
+	if( !coalesceShared ) {
+		coalesce_entry* entry = osrfHashGet( coalesceLocal, key );
+		if( entry && entry->expires > time( NULL ) )
+			return strdup( entry->body );
+		*owner = 1;
+		return NULL;
+	}
+
+	char lock[ strlen( key ) + 6 ];
+	snprintf( lock, sizeof( lock ), "%s.lock", key );
+	long long deadline = get_monotonic_millis() + wait * 1000LL;
+	for( ;; ) {
+		char* body = osrfCacheGetString( "%s", key );
+		if( body )
+			return body;
+
+		int added = osrfCacheAddString( lock, "1", wait > 0 ? wait : 1 );
+		if( added <= 0 ) {
+			/* our turn, or the cache is out of reach and it's every call for itself */
+			*owner = ( added == 0 );
+			return NULL;
+		}
+		if( get_monotonic_millis() >= deadline ) {
+			osrfLogInfo( OSRF_LOG_MARK, "Gave up waiting on a coalesced call; running it" );
+			return NULL;
+		}
+		usleep( 20000 ); /* 20 milliseconds */
+	}
+}
+
+/* Share a call's response with the identical calls to come, if it succeeded,
+   and let any that are waiting go on */
+static void coalesce_store(const char* key, const char* body) {
+	if( !coalesceShared ) {
+		if( !body || coalesceTTL <= 0 )
+			return;
+		time_t now = time( NULL );
+		if( osrfHashGetCount( coalesceLocal ) >= GATEWAY_COALESCE_LOCAL_MAX ) {
+			/* make room by dropping what's expired, or else everything */
+			osrfStringArray* expired = osrfNewStringArray( 32 );
+			osrfHashIterator* itr = osrfNewHashIterator( coalesceLocal );
+			coalesce_entry* entry;
+			while( (entry = osrfHashIteratorNext( itr )) )
+				if( entry->expires <= now )
+					osrfStringArrayAdd( expired, osrfHashIteratorKey( itr ) );
+			osrfHashIteratorFree( itr );
+			if( expired->size ) {
+				int i;
+				for( i = 0; i < expired->size; i++ )
+					osrfHashRemove( coalesceLocal, "%s", osrfStringArrayGetString( expired, i ) );
+			} else {
+				osrfHashFree( coalesceLocal );
+				coalesceLocal = osrfNewHash();
+				osrfHashSetCallback( coalesceLocal, (void (*)(char*, void*)) free );
+			}
+			osrfStringArrayFree( expired );
+		}
+
+		size_t len = strlen( body );
+		coalesce_entry* entry = safe_malloc( sizeof( coalesce_entry ) + len + 1 );
+		entry->expires = now + coalesceTTL;
+		memcpy( entry->body, body, len + 1 );
+		osrfHashSet( coalesceLocal, entry, "%s", key );
+		return;
+	}
+
+	/* waiters need a moment to pick the response up, even if it isn't to be kept */
+	if( body )
+		osrfCachePutString( key, body, coalesceTTL > 0 ? coalesceTTL : 1 );
+	osrfCacheRemove( "%s.lock", key );
+}
+
+/* What gateway_param() collects from the request */
+typedef struct {
+	osrfStringArray* params;   /* [ key, val, key, val, ... ] but for these below */
+	osrfStringArray* mparams;  /* values of "param", in order */
+	jsonObject* batch;         /* "batch", parsed as soon as it's decoded */
+	int bad_batch;             /* boolean: "batch" wasn't JSON */
+	jsonObject* (*parseJSONFunc) (const char*);
+} gateway_params;
+
+/* Handler for apacheParseParamsStream(): sort each param as it's decoded,
+   parsing a batch in place rather than keeping another copy of it */
+static int gateway_param(void* blob, const char* key, char* value, size_t len) {
+	gateway_params* gp = (gateway_params*) blob;
+	if( !strcmp( key, "param" ) ) {
+		osrfStringArrayAdd( gp->mparams, value );
+	} else if( !strcmp( key, "batch" ) ) {
+		if( !gp->batch && !gp->bad_batch && !( gp->batch = gp->parseJSONFunc( value ) ) )
+			gp->bad_batch = 1;
+	} else {
+		osrfStringArrayAdd( gp->params, key );
+		osrfStringArrayAdd( gp->params, value );
+	}
+	return 0;
+}
+
+/* Log a call to the activity log, unless its params are protected */
+static void log_activity(request_rec* r, const char* locale, const char* service,
+		const char* method, const osrfStringArray* mparams) {
+	const char* authtoken = apr_table_get(r->headers_in, "X-OILS-Authtoken");
+	if(!authtoken) authtoken = "";
+	growing_buffer* act = buffer_init(128);
+#ifdef APACHE_MIN_24
+	buffer_fadd(act, "[%s] [%s] [%s] %s %s", r->connection->client_ip,
+		authtoken, locale, service, method );
+#else
+	buffer_fadd(act, "[%s] [%s] [%s] %s %s", r->connection->remote_ip,
+		authtoken, locale, service, method );
+#endif
+
+	const char* str; int i = 0;
+	int redact_params = 0;
+	while( (str = osrfStringArrayGetString(log_protect_arr, i++)) ) {
+		//osrfLogInternal(OSRF_LOG_MARK, "Checking for log protection [%s]", str);
+		if(!strncmp(method, str, strlen(str))) {
+			redact_params = 1;
+			break;
+		}
+	}
+	if(redact_params) {
+		OSRF_BUFFER_ADD(act, " **PARAMS REDACTED**");
+	} else {
+		i = 0;
+		while( (str = osrfStringArrayGetString(mparams, i++)) ) {
+			if( i == 1 ) {
+				OSRF_BUFFER_ADD(act, " ");
+				OSRF_BUFFER_ADD(act, str);
+			} else {
+				OSRF_BUFFER_ADD(act, ", ");
+				OSRF_BUFFER_ADD(act, str);
+			}
+		}
+	}
+
+	osrfLogActivity( OSRF_LOG_MARK, "%s", act->buf );
+	buffer_free(act);
+}
+
+/* Write one finished batch call as {"index":n,"payload":[...],"status":n},
+   with a "debug" message if it failed */
+static void write_batch_entry(gateway_output* out, int index, osrfMultiRequest* req,
+		int first, char* (*jsonToStringFunc) (const jsonObject*)) {
+	jsonObject* entry = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( entry, "index", jsonNewNumberObject( index ) );
+	if( req ) {
+		jsonObjectSetKey( entry, "payload", req->responses );
+		req->responses = NULL;
+		jsonObjectSetKey( entry, "status", jsonNewNumberObject( req->status_code ) );
+		if( req->status_code != OSRF_STATUS_OK )
+			jsonObjectSetKey( entry, "debug", jsonNewObject(
+				req->status_text ? req->status_text : "No Error Message" ) );
+	} else {
+		jsonObjectSetKey( entry, "payload", jsonNewObjectType( JSON_ARRAY ) );
+		jsonObjectSetKey( entry, "status", jsonNewNumberObject( OSRF_STATUS_BADREQUEST ) );
+		jsonObjectSetKey( entry, "debug",
+			jsonNewObject( "A batch entry needs a service and a method" ) );
+	}
+
+	char* output = jsonToStringFunc( entry );
+	if( !first ) output_puts( out, "," );
+	output_puts( out, output );
+	free( output );
+	jsonObjectFree( entry );
+}
+
+/* Run a batch of calls at once, given as a JSON array of
+   {"service":...,"method":...,"params":[...]}, and write their results, each
+   as one entry in the payload.  The entries come in the order of the calls,
+   each as soon as it and those before it have finished; or, if in_completion
+   is set, in the order the calls finish.  Frees the batch.  Returns an HTTP
+   status. */
+static int gateway_batch(request_rec* r, jsonObject* batch, int in_completion,
+		const char* locale, int timeout,
+		char* (*jsonToStringFunc) (const jsonObject*)) {
+
+	if( !batch || batch->type != JSON_ARRAY || batch->size == 0
+			|| (int) batch->size > batchMax ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Rejecting a malformed batch of %d calls",
+			batch && batch->type == JSON_ARRAY ? (int) batch->size : 0 );
+		jsonObjectFree( batch );
+		return HTTP_BAD_REQUEST;
+	}
+
+	int count = batch->size;
+	/* finished calls: a call's slot stays NULL until it finishes */
+	osrfMultiRequest** done = safe_malloc( count * sizeof( osrfMultiRequest* ) );
+	int* indexes = safe_malloc( count * sizeof( int ) );
+	char* invalid = safe_malloc( count );
+
+	osrfMultiSession* ms = osrfMultiSessionInit( batchConcurrency );
+	osrfMultiSessionSetTimeout( ms, timeout * 1000 );
+	osrfMultiSessionSetLocale( ms, locale );
+
+	int i;
+	for( i = 0; i < count; i++ ) {
+		const jsonObject* call = jsonObjectGetIndex( batch, i );
+		const char* service = jsonObjectGetString( jsonObjectGetKeyConst( call, "service" ) );
+		const char* method = jsonObjectGetString( jsonObjectGetKeyConst( call, "method" ) );
+		const jsonObject* params = jsonObjectGetKeyConst( call, "params" );
+
+		indexes[ i ] = i;
+		if( !service || !method
+				|| !osrfMultiSessionRequest( ms, service, method, params, NULL, NULL, &indexes[ i ] ) ) {
+			invalid[ i ] = 1;
+			continue;
+		}
+
+		osrfStringArray* logged = osrfNewStringArray( 8 );
+		unsigned long p;
+		for( p = 0; params && params->type == JSON_ARRAY && p < params->size; p++ ) {
+			char* str = jsonToStringFunc( jsonObjectGetIndex( params, p ) );
+			osrfStringArrayAdd( logged, str );
+			free( str );
+		}
+		log_activity( r, locale, service, method, logged );
+		osrfStringArrayFree( logged );
+	}
+	jsonObjectFree( batch );
+
+	gateway_output out = { r, buffer_init( 4096 ), NULL, 0, 0, 0, NULL };
+	if( compressMinSize > 0 ) {
+		apr_table_mergen( r->headers_out, "Vary", "Accept-Encoding" );
+		out.gzip = accepts_gzip( apr_table_get( r->headers_in, "Accept-Encoding" ) );
+	}
+	output_puts( &out, "{\"payload\":[" );
+
+	int written = 0;  /* in call order, how many entries have gone out */
+	int first = 1;
+	for( ;; ) {
+		osrfMultiRequest* req;
+		while( ( req = osrfMultiSessionNextComplete( ms ) ) ) {
+			int index = *(int*) req->userData;
+			if( in_completion ) {
+				write_batch_entry( &out, index, req, first, jsonToStringFunc );
+				first = 0;
+				osrfMultiRequestFree( req );
+			} else
+				done[ index ] = req;
+		}
+
+		/* invalid calls finish at once, without a request */
+		for( i = 0; in_completion && i < count; i++ ) {
+			if( invalid[ i ] == 1 ) {
+				write_batch_entry( &out, i, NULL, first, jsonToStringFunc );
+				first = 0;
+				invalid[ i ] = 2;
+			}
+		}
+		while( !in_completion && written < count
+				&& ( invalid[ written ] || done[ written ] ) ) {
+			write_batch_entry( &out, written, done[ written ], first, jsonToStringFunc );
+			first = 0;
+			osrfMultiRequestFree( done[ written ] );
+			done[ written ] = NULL;
+			written++;
+		}
+
+		if( osrfMultiSessionOutstanding( ms ) <= 0 && !ms->done )
+			break;
+		osrfMultiSessionWait( ms, -1 );
+	}
+
+	output_puts( &out, "],\"status\":200}" );
+	output_finish( &out );
+
+	osrfLogDebug( OSRF_LOG_MARK, "Gateway ran a batch of %d calls", count );
+	osrfMultiSessionFree( ms );
+	free( done );
+	free( indexes );
+	free( invalid );
+	return OK;
+}
+
 static int osrf_json_gateway_method_handler (request_rec *r) {
 
 	/* make sure we're needed first thing*/
@@ -144,6 +736,10 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 	char* format        = NULL;  /* method to perform */
 	char* a_l           = NULL;  /* request api level */
 	char* input_format  = NULL;  /* POST data format, defaults to 'format' */
+	char* batch_order   = NULL;  /* "completion" to return them as they finish */
+	char* coalesced_key = NULL;  /* key of a coalesced call's shared response */
+	char* coalesced     = NULL;  /* response shared by an identical call */
+	int   coalesce_owner = 0;    /* boolean: this call's response is to be shared */
 	int   isXML         = 0;
 	int   api_level     = 1;
 
@@ -151,15 +747,23 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 	r->allowed |= (AP_METHOD_BIT << M_POST);
 
 	osrfLogDebug(OSRF_LOG_MARK, "osrf gateway: parsing URL params");
-	osrfStringArray* mparams = NULL;
-	osrfStringArray* params  = apacheParseParms(r); /* free me */
+	gateway_params gp = { osrfNewStringArray(12), osrfNewStringArray(8), NULL, 0, parseJSONFunc };
+	int parsed = apacheParseParamsStream( r, maxRequestSize, gateway_param, &gp );
+	if( parsed ) {
+		osrfStringArrayFree( gp.params );
+		osrfStringArrayFree( gp.mparams );
+		jsonObjectFree( gp.batch );
+		return parsed == -2 ? HTTP_REQUEST_ENTITY_TOO_LARGE : HTTP_BAD_REQUEST;
+	}
+	osrfStringArray* params  = gp.params;  /* free me */
+	osrfStringArray* mparams = gp.mparams; /* free me */
 	param_locale             = apacheGetFirstParamValue( params, "locale" );
 	service                  = apacheGetFirstParamValue( params, "service" );
 	method                   = apacheGetFirstParamValue( params, "method" );
 	format                   = apacheGetFirstParamValue( params, "format" );
 	input_format             = apacheGetFirstParamValue( params, "input_format" );
 	a_l                      = apacheGetFirstParamValue( params, "api_level" );
-	mparams                  = apacheGetParamValues( params, "param" ); /* free me */
+	batch_order              = apacheGetFirstParamValue( params, "batch_order" );
 
 	if(format == NULL)
 		format = strdup( "json" );
@@ -222,12 +826,42 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 	/* ----------------------------------------------------------------- */
 
 
-	if(!(service && method)) {
+	if( gp.batch || gp.bad_batch ) {
+
+		if( isXML ) {
+			osrfLogError(OSRF_LOG_MARK, "A batch of calls requires the JSON format");
+			ret = HTTP_BAD_REQUEST;
+		} else {
+			ret = gateway_batch( r, gp.batch,
+				batch_order && !strcasecmp( batch_order, "completion" ),
+				osrf_locale, timeout, jsonToStringFunc );
+			gp.batch = NULL;
+		}
+
+	} else if(!(service && method)) {
 
 		osrfLogError(OSRF_LOG_MARK,
 			"Service [%s] not found or not allowed", service);
 		ret = HTTP_NOT_FOUND;
 
+	} else if( coalesceMethods && osrfStringArrayContains( coalesceMethods, method )
+			&& ( coalesced_key = coalesce_key( service, method, osrf_locale, api_level,
+				input_format, isXML ? "xml" : dir_conf->legacyJSON ? "legacy" : "json",
+				mparams ) )
+			&& ( coalesced = coalesce_lookup( coalesced_key,
+				timeout < coalesceWait ? timeout : coalesceWait, &coalesce_owner ) ) ) {
+
+		/* an identical call already has the answer */
+		log_activity( r, osrf_locale, service, method, mparams );
+		osrfLogDebug(OSRF_LOG_MARK, "Sharing the response of an identical call");
+		gateway_output out = { r, buffer_init( 4096 ), NULL, 0, 0, 0, NULL };
+		if( compressMinSize > 0 ) {
+			apr_table_mergen( r->headers_out, "Vary", "Accept-Encoding" );
+			out.gzip = accepts_gzip( apr_table_get( r->headers_in, "Accept-Encoding" ) );
+		}
+		output_puts( &out, coalesced );
+		output_finish( &out );
+
 	} else {
 
 		/* This will log all heaers to the apache error log
@@ -241,7 +875,7 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 		fflush(stderr);
 		*/
 
-		osrfAppSession* session = osrfAppSessionClientInit(service);
+		osrfAppSession* session = gateway_session_get(service);
 		osrf_app_session_set_locale(session, osrf_locale);
 
 		double starttime = get_timestamp_millis();
@@ -290,56 +924,30 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 
 		/* ----------------------------------------------------------------- */
 		/* log all requests to the activity log */
-		const char* authtoken = apr_table_get(r->headers_in, "X-OILS-Authtoken");
-		if(!authtoken) authtoken = "";
-		growing_buffer* act = buffer_init(128);
-#ifdef APACHE_MIN_24
-		buffer_fadd(act, "[%s] [%s] [%s] %s %s", r->connection->client_ip,
-			authtoken, osrf_locale, service, method );
-#else
-		buffer_fadd(act, "[%s] [%s] [%s] %s %s", r->connection->remote_ip,
-			authtoken, osrf_locale, service, method );
-#endif
-
-		const char* str; int i = 0;
-		int redact_params = 0;
-		while( (str = osrfStringArrayGetString(log_protect_arr, i++)) ) {
-			//osrfLogInternal(OSRF_LOG_MARK, "Checking for log protection [%s]", str);
-			if(!strncmp(method, str, strlen(str))) {
-				redact_params = 1;
-				break;
-			}
-		}
-		if(redact_params) {
-			OSRF_BUFFER_ADD(act, " **PARAMS REDACTED**");
-		} else {
-			i = 0;
-			while( (str = osrfStringArrayGetString(mparams, i++)) ) {
-				if( i == 1 ) {
-					OSRF_BUFFER_ADD(act, " ");
-					OSRF_BUFFER_ADD(act, str);
-				} else {
-					OSRF_BUFFER_ADD(act, ", ");
-					OSRF_BUFFER_ADD(act, str);
-				}
-			}
-		}
-
-		osrfLogActivity( OSRF_LOG_MARK, "%s", act->buf );
-		buffer_free(act);
+		log_activity( r, osrf_locale, service, method, mparams );
 		/* ----------------------------------------------------------------- */
 
 
 		osrfMessage* omsg = NULL;
 
 		int statuscode = 200;
+		int error_seen = 0;   /* boolean: some message carried an error status */
+
+		/* collect the response, to stream it out in flushes, gzipped if the client takes it */
+		gateway_output out = { r, buffer_init( 4096 ), NULL, 0, 0, 0, NULL };
+		if( compressMinSize > 0 ) {
+			apr_table_mergen( r->headers_out, "Vary", "Accept-Encoding" );
+			out.gzip = accepts_gzip( apr_table_get( r->headers_in, "Accept-Encoding" ) );
+		}
+		if( coalesce_owner )
+			out.capture = buffer_init( 4096 );
 
 		/* kick off the object */
 		if (isXML)
-			ap_rputs( "<response xmlns=\"http://opensrf.org/-/namespaces/gateway/v1\"><payload>",
-				r );
+			output_puts( &out,
+				"<response xmlns=\"http://opensrf.org/-/namespaces/gateway/v1\"><payload>" );
 		else
-			ap_rputs("{\"payload\":[", r);
+			output_puts( &out, "{\"payload\":[" );
 
 		int morethan1       = 0;
 		char* statusname    = NULL;
@@ -349,18 +957,21 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 		while((omsg = osrfAppSessionRequestRecv( session, req_id, timeout ))) {
 
 			statuscode = omsg->status_code;
+			if( statuscode > 299 )
+				error_seen = 1;
 			const jsonObject* res;
 
 			if( ( res = osrfMessageGetResult(omsg)) ) {
 
 				if (isXML) {
-					output = jsonObjectToXML( res );
+					/* write as we go, rather than building the whole result first */
+					jsonObjectToXMLStream( res, write_to_client, &out );
 				} else {
 					output = jsonToStringFunc( res );
-					if( morethan1 ) ap_rputs(",", r); /* comma between JSON array items */
+					if( morethan1 ) output_puts( &out, "," ); /* comma between JSON array items */
+					output_puts( &out, output );
+					free(output);
 				}
-				ap_rputs(output, r);
-				free(output);
 				morethan1 = 1;
 
 			} else {
@@ -383,10 +994,11 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 
 
 		if (isXML)
-			ap_rputs("</payload>", r);
+			output_puts( &out, "</payload>" );
 		else
-			ap_rputs("]",r); /* finish off the payload array */
+			output_puts( &out, "]" ); /* finish off the payload array */
 
+		int call_failed = ( statusname != NULL );
 		if(statusname) {
 
 			/* add a debug field if the request died */
@@ -407,7 +1019,7 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 				jsonObjectFree(tmp);
 			}
 
-			ap_rputs(buf->buf, r);
+			output_puts( &out, buf->buf );
 
 			buffer_free(buf);
 			free(statusname);
@@ -422,14 +1034,24 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 		else
 			snprintf(buf, sizeof(buf), ",\"status\":%d", statuscode );
 
-		ap_rputs( buf, r );
+		output_puts( &out, buf );
 
 		if (isXML)
-			ap_rputs("</response>", r);
+			output_puts( &out, "</response>" );
 		else
-			ap_rputs( "}", r ); /* finish off the object */
+			output_puts( &out, "}" ); /* finish off the object */
+		output_finish( &out );
+
+		if( out.capture ) {
+			/* let identical calls share the response, unless it's an error or
+			   incomplete (as when the request timed out); either way, wake the waiters */
+			int keep = !call_failed && !error_seen && statuscode == 200
+				&& osrf_app_session_request_complete( session, req_id );
+			coalesce_store( coalesced_key, keep ? out.capture->buf : NULL );
+			buffer_free( out.capture );
+		}
 
-		osrfAppSessionFree(session);
+		gateway_session_put(session);
 	}
 
 	osrfLogInfo(OSRF_LOG_MARK, "Completed processing service=%s, method=%s", service, method);
@@ -439,6 +1061,10 @@ static int osrf_json_gateway_method_handler (request_rec *r) {
 	free( input_format );
 	free( method );
 	free( service );
+	jsonObjectFree( gp.batch );
+	free( batch_order );
+	free( coalesced_key );
+	free( coalesced );
 
 	osrfLogDebug(OSRF_LOG_MARK, "Gateway served %d requests", ++numserved);
 	osrfLogClearXid();
@@ -422,6 +422,21 @@ OpenSRF.Session.setup_shared_ws = function() {
             return;
         }
 
+        if (data.action == 'messages') {
+            // a batch of replies, already parsed; pass them up the
+            // opensrf stack in the order they arrived
+            OpenSRF.sharedWebsocketConnected = true;
+            for (var i = 0; i < data.messages.length; i++) {
+                var msg = decodeJS(data.messages[i]);
+                OpenSRF.Stack.push(
+                    new OpenSRF.NetMessage(
+                       null, null, msg.thread, null, msg.osrf_msg)
+                );
+            }
+
+            return;
+        }
+
 
         if (data.action == 'event') {
             if (data.type.match(/onclose|onerror/)) {
@@ -162,6 +162,11 @@ JSONPushParser* jsonNewPushParser( const JSONHandlerMap* map, void* blob )
 */
 void jsonPushParserReset( JSONPushParser* parser ) {
 	if( parser ) {
+		// Discard whatever was left of an unfinished parse
+		while( parser->state_stack )
+			pop_pp_state( parser );
+		osrfStringArrayClear( parser->keylist );
+		parser->again = '\0';
 		parser->line = 1;
 		parser->pos = 1;
 		parser->state = PP_BEGIN;
@@ -528,7 +533,9 @@ static int do_str    ( JSONPushParser* parser, char c ) {
 		}
 	} else if( '\\' == c ) {
 		parser->state = PP_SLASH;       // Handle an escaped special character
-	} else if( iscntrl( (unsigned char) c ) || ! isprint( (unsigned char) c ) ) {
+	} else if( (unsigned char) c < 0x80
+			&& ( iscntrl( (unsigned char) c ) || ! isprint( (unsigned char) c ) ) ) {
+		// Bytes from 0x80 up are parts of UTF-8 characters, which we take as they come
 		report_pp_error( parser, "Illegal character 0x%02X in string literal",
 			(unsigned int) c );
 		rc = 1;
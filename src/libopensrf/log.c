@@ -4,11 +4,69 @@
 */
 
 #include <opensrf/log.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 /** Pseudo-log type indicating that no previous log type was defined.
 	See also _prevLogType. */
 #define OSRF_NO_LOG_TYPE -1
 
+/** Size of the buffer holding log file output until it's written. */
+#define OSRF_LOG_BUFSIZE 8192
+/** Most seconds that buffered log file output may wait before being written. */
+#define OSRF_LOG_FLUSH_INTERVAL 1
+/** Seconds between checks whether the log file has been rotated. */
+#define OSRF_LOG_CHECK_INTERVAL 5
+/** Room for one message in the queue for the log shipping thread, longer ones truncated. */
+#define OSRF_LOG_ASYNC_LINE 2048
+/** Room for one message in the flight recorder, longer ones truncated. */
+#define OSRF_LOG_RECORD_LINE 448
+
+/**
+	@brief One message in the queue for the log shipping thread.
+
+	The queue is a bounded ring, after Dmitry Vyukov's design.  Each entry's sequence
+	number tells whose turn it is: equal to a position, the entry is free for the producer
+	claiming that position; one more, it holds a message for the consumer.
+*/
+typedef struct {
+	volatile unsigned long seq;  /**< Sequence number, as described above. */
+	int priority;                /**< Syslog facility and level, or -1 for the log file. */
+	int len;                     /**< Length of the message. */
+	char text[ OSRF_LOG_ASYNC_LINE ];  /**< The message, formatted for its destination. */
+} _osrfLogEntry;
+
+/**
+	@brief One message in the flight recorder (see osrfLogSetRecorder()).
+
+	Kept as it came, to be formatted only if the recorder is dumped.  None of the strings
+	is necessarily terminated, if it fills its array.
+*/
+typedef struct {
+	volatile unsigned long seq;  /**< One more than its position once written; else 0. */
+	int level;                   /**< The message level. */
+	int line;                    /**< Line number from whence the message was issued. */
+	char date[ 20 ];             /**< Local date and time, formatted as for the log file. */
+	char file[ 48 ];             /**< (The end of) the name of the source file. */
+	char xid[ 48 ];              /**< Transaction id. */
+	char text[ OSRF_LOG_RECORD_LINE ];  /**< The message. */
+} _osrfLogRecord;
+
+/**
+	@brief The flight recorder: a ring of the most recent messages.
+
+	Each message takes the next position, wrapping around to overwrite the oldest.
+*/
+typedef struct {
+	unsigned long mask;             /**< The number of entries, less one. */
+	volatile unsigned long next;    /**< The position for the next message. */
+	unsigned long dumped;           /**< Where the last dump stopped. */
+	_osrfLogRecord records[];       /**< The entries. */
+} _osrfLogRecorderRing;
+
 /** Stores a log type during temporary redirections to standard error. */
 static int _prevLogType             = OSRF_NO_LOG_TYPE;
 /** Defines the destination of log messages: standard error, a log file, or Syslog. */
@@ -22,6 +80,8 @@ static int _osrfLogActFacility		= LOG_LOCAL1;
 static char* _osrfLogFile			= NULL;
 /** Application name.  This string will preface every log message. */
 static char* _osrfLogAppname		= NULL;
+/** Length of _osrfLogAppname. */
+static size_t _osrfLogAppnameLen	= 0;
 static char* _osrfLogTag		= NULL;
 /** Maximum message level.  Messages of higher levels will be suppressed.
 	Default: OSRF_LOG_INFO. */
@@ -34,16 +94,105 @@ static int _osrfLogActivityEnabled	= 1;
 static int _osrfLogIsClient         = 0;
 
 /** An id identifying the current transaction.  If defined, it is included into every
-	log message. */
-static char* _osrfLogXid            = NULL; /* current xid */
+	log message.  Each thread has its own, since a multi-threaded process (such as a
+	sharded router) may be working on several transactions at once. */
+static __thread char* _osrfLogXid   = NULL; /* current xid */
 /** A prefix used to generate transaction ids.  It incorporates a timestamp and a process id. */
 static char* _osrfLogXidPfx         = NULL; /* xid prefix string */
 
+/** Descriptor of the open log file, or -1 if it isn't open. */
+static int _osrfLogFd               = -1;
+/** Output waiting to be written to the log file. */
+static char _osrfLogBuf[ OSRF_LOG_BUFSIZE ];
+/** How many bytes of _osrfLogBuf are in use. */
+static size_t _osrfLogBufUsed       = 0;
+/** When the buffered output was last written. */
+static time_t _osrfLogFlushed       = 0;
+/** When we last checked whether the log file had been rotated. */
+static time_t _osrfLogChecked       = 0;
+/** Guards the log file and its buffer, which all threads share. */
+static pthread_mutex_t _osrfLogLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Queue for the log shipping thread, or NULL if there has never been one. */
+static _osrfLogEntry* _osrfLogRing  = NULL;
+/** Boolean: true if messages go through the queue, instead of being written right away. */
+static volatile int _osrfLogAsync   = 0;
+/** Number of entries in _osrfLogRing, less one (a power of two, less one). */
+static unsigned long _osrfLogRingMask = 0;
+/** Next position for a producer to claim. */
+static volatile unsigned long _osrfLogRingTail = 0;
+/** Next position for the consumer to take. */
+static unsigned long _osrfLogRingHead = 0;
+/** Boolean: true if a producer should wait for room, instead of dropping its message. */
+static int _osrfLogRingBlock        = 0;
+/** Boolean: true if the log shipping thread is running in this process. */
+static volatile int _osrfLogShipping = 0;
+/** Posted once for each message queued. */
+static sem_t _osrfLogRingSem;
+/** Held by whoever is draining the queue, so that there's only one consumer at a time. */
+static pthread_mutex_t _osrfLogDrainLock = PTHREAD_MUTEX_INITIALIZER;
+/** Number of messages dropped because the queue was full. */
+static volatile unsigned long _osrfLogDropped = 0;
+/** Number of dropped messages already reported. */
+static unsigned long _osrfLogDropReported = 0;
+
+/** The flight recorder, if there is one (see osrfLogSetRecorder()). */
+static _osrfLogRecorderRing* volatile _osrfLogRecorder = NULL;
+/** Boolean: true if messages are going into the flight recorder. */
+static volatile int _osrfLogRecording = 0;
+/** Name of the file to dump the flight recorder to. */
+static char* volatile _osrfLogRecorderFile = NULL;
+
+/** Labels for the levels of message, indexed as by _osrfLogLevelIndex(). */
+static const char* const _osrfLogLabels[] = { "ACT", "ERR ", "WARN", "INFO", "DEBG", "INT " };
+/** Number of entries in _osrfLogLabels. */
+#define OSRF_LOG_LABELS 6
+/** Process id, cached until the next fork (see osrfLogResetPid()). */
+static long _osrfLogPid             = 0;
+/** Message headers, "[LABEL:pid:", one for each level, built whenever the pid changes. */
+static char _osrfLogHeads[ OSRF_LOG_LABELS ][ 32 ];
+/** Lengths of the headers in _osrfLogHeads. */
+static size_t _osrfLogHeadLens[ OSRF_LOG_LABELS ];
+/** For doing the first-time setup exactly once (see _osrfLogRegister()). */
+static pthread_once_t _osrfLogOnce  = PTHREAD_ONCE_INIT;
+/** The second for which _osrfLogDate holds the local date and time. */
+static __thread time_t _osrfLogDateTime = (time_t) -1;
+/** Local date and time, formatted for the log file, for the second in _osrfLogDateTime. */
+static __thread char _osrfLogDate[ 36 ];
+/** Length of _osrfLogDate. */
+static __thread size_t _osrfLogDateLen = 0;
+
 static void osrfLogSetType( int logtype );
 static void _osrfLogDetail( int level, const char* filename, int line, char* msg );
-static void _osrfLogToFile( const char* label, long pid, const char* filename, int line,
+static void _osrfLogToFile( int level, const char* filename, int line,
 							const char* xid, const char* msg );
 static void _osrfLogSetXid( const char* xid );
+static int _osrfLogFormatLine( char* buf, size_t size, int level,
+		const char* filename, int line, const char* xid, const char* msg );
+static void _osrfLogRegister( void );
+static void _osrfLogSetUp( void );
+static int _osrfLogLevelIndex( int level );
+static int _osrfLogReady( void );
+static int _osrfLogOpen( void );
+static void _osrfLogClose( void );
+static void _osrfLogWrite( void );
+static void _osrfLogAtFork( void );
+static void _osrfLogEnqueue( int priority, int level, const char* filename,
+		int line, const char* xid, const char* msg );
+static void _osrfLogDrain( void );
+static void* _osrfLogShipper( void* arg );
+static void _osrfLogDateNow( void );
+static const char* _osrfLogNumber( char* end, long num );
+static _osrfLogRecord* _osrfLogRecordStart( _osrfLogRecorderRing* ring, unsigned long* pos,
+		int level, const char* filename, int line );
+static void _osrfLogRecordDone( _osrfLogRecord* rec, unsigned long pos );
+static void _osrfLogRecordMsg( int level, const char* filename, int line, const char* msg );
+static void _osrfLogRecordV( int level, const char* filename, int line,
+		const char* msg, va_list args );
+static void _osrfLogCrash( int sig );
+static size_t _osrfLogAppend( char* buf, size_t size, size_t used, const char* str,
+		long max );
+static void _osrfLogWriteAll( int fd, const char* buf, size_t len );
 
 /**
 	@brief Reset certain local static variables to their initial values.
@@ -54,11 +203,15 @@ static void _osrfLogSetXid( const char* xid );
 	- log type (reset to OSRF_LOG_TYPE_STDERR)
 */
 void osrfLogCleanup( void ) {
+	pthread_mutex_lock( &_osrfLogLock );
+	_osrfLogClose();
+	pthread_mutex_unlock( &_osrfLogLock );
 	if (_osrfLogTag)
 		free(_osrfLogTag);
 	_osrfLogTag = NULL;
 	free(_osrfLogAppname);
 	_osrfLogAppname = NULL;
+	_osrfLogAppnameLen = 0;
 	free(_osrfLogFile);
 	_osrfLogFile = NULL;
 	_osrfLogType = OSRF_LOG_TYPE_STDERR;
@@ -157,9 +310,9 @@ void osrfLogMkXid( void ) {
    if(_osrfLogIsClient) {
       static int _osrfLogXidInc = 0; /* increments with each new xid for uniqueness */
       char buf[32];
-      snprintf(buf, sizeof(buf), "%s%d", _osrfLogXidPfx, _osrfLogXidInc);
+      snprintf(buf, sizeof(buf), "%s%d", _osrfLogXidPfx,
+         __sync_fetch_and_add(&_osrfLogXidInc, 1));
       _osrfLogSetXid(buf);
-      _osrfLogXidInc++;
    }
 }
 
@@ -254,15 +407,253 @@ void osrfRestoreLogType( void )
 	@brief Store a file name for a log file.
 	@param logfile Pointer to the file name.
 
-	The new file name replaces whatever file name was previously in place, if any.
+	The new file name replaces whatever file name was previously in place, if any.  If
+	it's the same name, keep the old copy, since another thread may be using it.
+	Otherwise write out anything buffered for the old file, and close it.
 
 	This function does not affect the logging type.  The choice of file name makes a
 	difference only when the logging type is OSRF_LOG_TYPE_FILE.
 */
 void osrfLogSetFile( const char* logfile ) {
 	if(!logfile) return;
+	if(_osrfLogFile && !strcmp(_osrfLogFile, logfile)) return;
+	pthread_mutex_lock( &_osrfLogLock );
+	_osrfLogClose();
 	if(_osrfLogFile) free(_osrfLogFile);
 	_osrfLogFile = strdup(logfile);
+	pthread_mutex_unlock( &_osrfLogLock );
+}
+
+/**
+	@brief Write out any log file output still in the buffer.
+
+	Output to a log file is buffered, and written when the buffer fills, when an error
+	is logged, or when a message arrives more than OSRF_LOG_FLUSH_INTERVAL seconds after
+	the last write.  A process about to sit idle should call this function, so that its
+	last messages don't wait for the next ones.  It's also called on exit.
+
+	If messages are queued for a log shipping thread (see osrfLogSetAsync()), write out
+	the queue as well.
+*/
+void osrfLogFlush( void ) {
+	if( _osrfLogRing ) {
+		pthread_mutex_lock( &_osrfLogDrainLock );
+		_osrfLogDrain();
+		pthread_mutex_unlock( &_osrfLogDrainLock );
+	}
+	pthread_mutex_lock( &_osrfLogLock );
+	_osrfLogWrite();
+	pthread_mutex_unlock( &_osrfLogLock );
+}
+
+/**
+	@brief Close the log file, to be opened afresh with the next message.
+
+	For use after the log file has been rotated, as from a SIGHUP.  Even without being
+	told, we notice a rotation within OSRF_LOG_CHECK_INTERVAL seconds.
+*/
+void osrfLogReopen( void ) {
+	pthread_mutex_lock( &_osrfLogLock );
+	_osrfLogClose();
+	pthread_mutex_unlock( &_osrfLogLock );
+}
+
+/**
+	@brief Hand messages for Syslog or the log file to a background thread.
+	@param entries How many messages may wait for the thread, at most; zero to go back
+		to writing them right away.
+	@param block Boolean: true if a thread finding the queue full should wait for room;
+		false if it should drop its message.
+	@return Zero if successful, or -1 if the queue couldn't be set up.
+
+	With a queue, the calling thread only formats each message into it; a slow Syslog
+	can't hold up the work at hand.  When dropping, the thread reports from time to time
+	how many messages it has dropped (see also osrfLogGetDropped()).  Messages to
+	standard error are always written right away, and so are errors, once the messages
+	queued ahead of them are written.
+
+	The queue is set up only once; later calls may change @a block, or turn the queue
+	on and off, but not resize it.  A forked child starts a thread of its own when it
+	first logs something.
+*/
+int osrfLogSetAsync( int entries, int block ) {
+	_osrfLogRingBlock = block;
+	if( entries <= 0 ) {
+		// Stop queueing, and write out whatever is already queued
+		_osrfLogAsync = 0;
+		osrfLogFlush();
+		return 0;
+	}
+
+	if( !_osrfLogRing ) {
+		unsigned long size = 2;
+		while( size < (unsigned long) entries )
+			size *= 2;
+		_osrfLogEntry* ring = malloc( size * sizeof( _osrfLogEntry ));
+		if( !ring )
+			return -1;
+		if( sem_init( &_osrfLogRingSem, 0, 0 )) {
+			free( ring );
+			return -1;
+		}
+		unsigned long i;
+		for( i = 0; i < size; i++ )
+			ring[ i ].seq = i;
+		_osrfLogRingMask = size - 1;
+		_osrfLogRing = ring;
+		_osrfLogRegister();
+	}
+
+	_osrfLogAsync = 1;
+	return 0;
+}
+
+/**
+	@brief Keep the most recent messages, of every level, in memory.
+	@param entries How many messages to keep; zero to stop keeping them.
+	@param path Name of the file to dump them to; if NULL, the name of the log file
+		with ".flight" appended, or, without a log file, /tmp/osrf.flight.
+	@return Zero if successful, or -1 if unable to allocate the memory.
+
+	The flight recorder lets a process run at a modest log level and still leave behind
+	full detail, DEBUG and INTERNAL messages included, of what it was doing just before
+	something went wrong.  Messages go into the recorder raw; they are formatted only if
+	the recorder is dumped (see osrfLogDumpRecorder()).  While recording, a crash of the
+	process (SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT, unless the program handles the
+	signal itself) dumps the recorder before the process dies.
+
+	A call with a bigger @a entries than before replaces the recorder; since other threads
+	may still be writing to the old one, its memory is never freed.
+*/
+int osrfLogSetRecorder( int entries, const char* path ) {
+	if( entries <= 0 ) {
+		_osrfLogRecording = 0;
+		return 0;
+	}
+
+	_osrfLogRecorderRing* ring = _osrfLogRecorder;
+	if( !ring || (unsigned long) entries > ring->mask + 1 ) {
+		unsigned long size = 2;
+		while( size < (unsigned long) entries )
+			size *= 2;
+		ring = calloc( 1, sizeof( _osrfLogRecorderRing ) + size * sizeof( _osrfLogRecord ));
+		if( !ring )
+			return -1;
+		ring->mask = size - 1;
+		__sync_synchronize();
+		_osrfLogRecorder = ring;
+	}
+
+	char* file;
+	if( path )
+		file = strdup( path );
+	else if( _osrfLogFile )
+		file = va_list_to_string( "%s.flight", _osrfLogFile );
+	else
+		file = strdup( "/tmp/osrf.flight" );
+	// Something may be dumping to the old name, so keep it
+	_osrfLogRecorderFile = file;
+
+	_osrfLogRegister();
+	static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	int i;
+	for( i = 0; i < (int) ( sizeof( fatal ) / sizeof( fatal[ 0 ] )); i++ ) {
+		struct sigaction old;
+		if( sigaction( fatal[ i ], NULL, &old ) || old.sa_handler != SIG_DFL )
+			continue;
+		struct sigaction act;
+		memset( &act, 0, sizeof( act ));
+		act.sa_handler = _osrfLogCrash;
+		act.sa_flags = SA_RESETHAND;
+		sigemptyset( &act.sa_mask );
+		sigaction( fatal[ i ], &act, NULL );
+	}
+
+	_osrfLogRecording = 1;
+	return 0;
+}
+
+/**
+	@brief Write out the contents of the flight recorder.
+	@param reason A few words about why, for the heading of the dump; may be NULL.
+	@return Zero if successful, or -1 if there is no recorder or its file can't be opened.
+
+	Each message recorded since the previous dump is written to the recorder's file (see
+	osrfLogSetRecorder()), formatted as for the log file, beneath a heading naming the
+	process and the @a reason.  Messages recorded before the previous dump are not written
+	again, so that frequent dumps don't repeat themselves.
+
+	Uses only async-signal-safe functions, so that it may be called from a signal handler.
+*/
+int osrfLogDumpRecorder( const char* reason ) {
+	_osrfLogRecorderRing* ring = _osrfLogRecorder;
+	const char* path = _osrfLogRecorderFile;
+	if( !ring || !path )
+		return -1;
+
+	int fd = open( path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+	if( fd < 0 )
+		return -1;
+
+	const char* appname = _osrfLogAppname ? _osrfLogAppname : "osrf";
+	char buf[ OSRF_LOG_RECORD_LINE + 256 ];
+	char digits[ 24 ];
+	size_t n = 0;
+	n = _osrfLogAppend( buf, sizeof( buf ), n, "==== Flight recorder of ", -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n, appname, -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n, " pid ", -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n,
+		_osrfLogNumber( digits + sizeof( digits ), (long) getpid() ), -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n, ": ", -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n, reason ? reason : "dump", -1 );
+	n = _osrfLogAppend( buf, sizeof( buf ), n, " ====\n", -1 );
+	_osrfLogWriteAll( fd, buf, n );
+
+	unsigned long next = __atomic_load_n( &ring->next, __ATOMIC_ACQUIRE );
+	unsigned long pos = ring->dumped;
+	if( next - pos > ring->mask + 1 )
+		pos = next - ( ring->mask + 1 );
+	ring->dumped = next;
+
+	for( ; pos < next; pos++ ) {
+		_osrfLogRecord* rec = ring->records + ( pos & ring->mask );
+		if( __atomic_load_n( &rec->seq, __ATOMIC_ACQUIRE ) != pos + 1 )
+			continue;      // Still being written, or already overwritten
+		_osrfLogRecord copy;
+		memcpy( &copy, rec, sizeof( copy ));
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		if( __atomic_load_n( &rec->seq, __ATOMIC_RELAXED ) != pos + 1 )
+			continue;      // Overwritten while we copied it
+
+		int i = _osrfLogLevelIndex( copy.level );
+		n = 0;
+		n = _osrfLogAppend( buf, sizeof( buf ), n, appname, -1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, " ", 1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, copy.date, sizeof( copy.date ));
+		n = _osrfLogAppend( buf, sizeof( buf ), n, " ", 1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, _osrfLogHeads[ i ], _osrfLogHeadLens[ i ] );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, copy.file, sizeof( copy.file ));
+		n = _osrfLogAppend( buf, sizeof( buf ), n, ":", 1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n,
+			_osrfLogNumber( digits + sizeof( digits ), copy.line ), -1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, ":", 1 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, copy.xid, sizeof( copy.xid ));
+		n = _osrfLogAppend( buf, sizeof( buf ), n, "] ", 2 );
+		n = _osrfLogAppend( buf, sizeof( buf ), n, copy.text, sizeof( copy.text ));
+		n = _osrfLogAppend( buf, sizeof( buf ), n, "\n", 1 );
+		_osrfLogWriteAll( fd, buf, n );
+	}
+
+	close( fd );
+	return 0;
+}
+
+/**
+	@brief Report how many messages have been dropped because the queue was full.
+	@return The number of messages dropped, in this process, since it started.
+*/
+unsigned long osrfLogGetDropped( void ) {
+	return _osrfLogDropped;
 }
 
 /**
@@ -292,6 +683,7 @@ void osrfLogSetAppname( const char* appname ) {
 
 	if(_osrfLogAppname) free(_osrfLogAppname);
 	_osrfLogAppname = strdup(buf);
+	_osrfLogAppnameLen = strlen(_osrfLogAppname);
 
 	/* if syslogging, re-open the log with the appname */
 	if( _osrfLogType == OSRF_LOG_TYPE_SYSLOG) {
@@ -322,7 +714,9 @@ void osrfLogSetSyslogFacility( int facility ) {
 */
 
 void osrfLogSetLogTag( const char* logtag ) {
-	if (logtag) _osrfLogTag = strdup(logtag);
+	if (!logtag) return;
+	if (_osrfLogTag && !strcmp(_osrfLogTag, logtag)) return;
+	_osrfLogTag = strdup(logtag);
 }
 
 /**
@@ -394,7 +788,15 @@ int osrfLogGetLevel( void ) {
 */
 void osrfLogError( const char* file, int line, const char* msg, ... ) {
 	if( !msg ) return;
-	if( _osrfLogLevel < OSRF_LOG_ERROR ) return;
+	if( _osrfLogLevel < OSRF_LOG_ERROR ) {
+		if( _osrfLogRecording ) {
+			va_list args;
+			va_start( args, msg );
+			_osrfLogRecordV( OSRF_LOG_ERROR, file, line, msg, args );
+			va_end( args );
+		}
+		return;
+	}
 	VA_LIST_TO_STRING( msg );
 	_osrfLogDetail( OSRF_LOG_ERROR, file, line, VA_BUF );
 }
@@ -409,7 +811,15 @@ void osrfLogError( const char* file, int line, const char* msg, ... ) {
  */
 void osrfLogWarning( const char* file, int line, const char* msg, ... ) {
 	if( !msg ) return;
-	if( _osrfLogLevel < OSRF_LOG_WARNING ) return;
+	if( _osrfLogLevel < OSRF_LOG_WARNING ) {
+		if( _osrfLogRecording ) {
+			va_list args;
+			va_start( args, msg );
+			_osrfLogRecordV( OSRF_LOG_WARNING, file, line, msg, args );
+			va_end( args );
+		}
+		return;
+	}
 	VA_LIST_TO_STRING( msg );
 	_osrfLogDetail( OSRF_LOG_WARNING, file, line, VA_BUF );
 }
@@ -424,7 +834,15 @@ void osrfLogWarning( const char* file, int line, const char* msg, ... ) {
  */
 void osrfLogInfo( const char* file, int line, const char* msg, ... ) {
 	if( !msg ) return;
-	if( _osrfLogLevel < OSRF_LOG_INFO ) return;
+	if( _osrfLogLevel < OSRF_LOG_INFO ) {
+		if( _osrfLogRecording ) {
+			va_list args;
+			va_start( args, msg );
+			_osrfLogRecordV( OSRF_LOG_INFO, file, line, msg, args );
+			va_end( args );
+		}
+		return;
+	}
 	VA_LIST_TO_STRING( msg );
 	_osrfLogDetail( OSRF_LOG_INFO, file, line, VA_BUF );
 }
@@ -439,7 +857,15 @@ void osrfLogInfo( const char* file, int line, const char* msg, ... ) {
  */
 void osrfLogDebug( const char* file, int line, const char* msg, ... ) {
 	if( !msg ) return;
-	if( _osrfLogLevel < OSRF_LOG_DEBUG ) return;
+	if( _osrfLogLevel < OSRF_LOG_DEBUG ) {
+		if( _osrfLogRecording ) {
+			va_list args;
+			va_start( args, msg );
+			_osrfLogRecordV( OSRF_LOG_DEBUG, file, line, msg, args );
+			va_end( args );
+		}
+		return;
+	}
 	VA_LIST_TO_STRING( msg );
 	_osrfLogDetail( OSRF_LOG_DEBUG, file, line, VA_BUF );
 }
@@ -454,7 +880,15 @@ void osrfLogDebug( const char* file, int line, const char* msg, ... ) {
  */
 void osrfLogInternal( const char* file, int line, const char* msg, ... ) {
 	if( !msg ) return;
-	if( _osrfLogLevel < OSRF_LOG_INTERNAL ) return;
+	if( _osrfLogLevel < OSRF_LOG_INTERNAL ) {
+		if( _osrfLogRecording ) {
+			va_list args;
+			va_start( args, msg );
+			_osrfLogRecordV( OSRF_LOG_INTERNAL, file, line, msg, args );
+			va_end( args );
+		}
+		return;
+	}
 	VA_LIST_TO_STRING( msg );
 	_osrfLogDetail( OSRF_LOG_INTERNAL, file, line, VA_BUF );
 }
@@ -517,38 +951,33 @@ static void _osrfLogDetail( int level, const char* filename, int line, char* msg
 
 	if(!filename) filename = "";
 
-	char* label = "INFO";		/* level name */
+	_osrfLogRegister();
+
+	if( _osrfLogRecording )
+		_osrfLogRecordMsg( level, filename, line, msg );
+
 	int lvl = LOG_INFO;	/* syslog level */
 	int fac = _osrfLogFacility;
 
 	switch( level ) {
 		case OSRF_LOG_ERROR:		
-			label = "ERR "; 
 			lvl = LOG_ERR;
 			break;
 
 		case OSRF_LOG_WARNING:	
-			label = "WARN"; 
 			lvl = LOG_WARNING;
 			break;
 
 		case OSRF_LOG_INFO:		
-			label = "INFO"; 
 			lvl = LOG_INFO;
 			break;
 
 		case OSRF_LOG_DEBUG:	
-			label = "DEBG"; 
-			lvl = LOG_DEBUG;
-			break;
-
 		case OSRF_LOG_INTERNAL: 
-			label = "INT "; 
 			lvl = LOG_DEBUG;
 			break;
 
 		case OSRF_LOG_ACTIVITY: 
-			label = "ACT"; 
 			lvl = LOG_INFO;
 			fac = _osrfLogActFacility;
 			break;
@@ -563,6 +992,20 @@ static void _osrfLogDetail( int level, const char* filename, int line, char* msg
 	   logtype = OSRF_LOG_TYPE_STDERR;
    }
 
+	if( _osrfLogAsync && logtype != OSRF_LOG_TYPE_STDERR ) {
+		if( OSRF_LOG_ERROR != level ) {
+			_osrfLogEnqueue( logtype == OSRF_LOG_TYPE_SYSLOG ? ( fac | lvl ) : -1,
+				level, filename, line, xid, msg );
+			return;
+		}
+
+		// An error may be the last thing we say before dying, so don't leave it in the
+		// queue; write out what's ahead of it, and then the error itself, right away
+		osrfLogFlush();
+	}
+
+	const char* head = _osrfLogHeads[ _osrfLogLevelIndex( level ) ];
+
    if( logtype == OSRF_LOG_TYPE_SYSLOG ) {
 		char buf[1536];  
 		buf[0] = '\0';
@@ -572,33 +1015,425 @@ static void _osrfLogDetail( int level, const char* filename, int line, char* msg
 		buf[1533] = '.';
 		buf[1534] = '.';
 		buf[1535] = '\0';
-		syslog( fac | lvl, "[%s:%ld:%s:%d:%s] %s", label, (long) getpid(), filename, line, xid, buf );
+		syslog( fac | lvl, "%s%s:%d:%s] %s", head, filename, line, xid, buf );
 	}
 
 	else if( logtype == OSRF_LOG_TYPE_FILE )
-		_osrfLogToFile( label, (long) getpid(), filename, line, xid, msg );
+		_osrfLogToFile( level, filename, line, xid, msg );
 
 	else if( logtype == OSRF_LOG_TYPE_STDERR )
-		fprintf( stderr, "[%s:%ld:%s:%d:%s] %s\n", label, (long) getpid(), filename, line, xid, msg );
+		fprintf( stderr, "%s%s:%d:%s] %s\n", head, filename, line, xid, msg );
+}
+
+
+/**
+	@brief Map a message level to an index into _osrfLogLabels and _osrfLogHeads.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@return The index.  Unrecognized levels are treated as OSRF_LOG_INFO.
+*/
+static int _osrfLogLevelIndex( int level ) {
+	if( OSRF_LOG_ACTIVITY == level )
+		return 0;
+	if( level < OSRF_LOG_ERROR || level > OSRF_LOG_INTERNAL )
+		return OSRF_LOG_INFO;
+	return level;
+}
+
+/**
+	@brief Format a message as a line for the log file.
+	@param buf Where to put the line.
+	@param size Size of @a buf.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@param filename Name of the source file from whence the message was issued.
+	@param line Line number from whence the message was issued.
+	@param xid Transaction id (or an empty string if there is no transaction).
+	@param msg Message text.
+	@return The length of the line, as for snprintf().
+
+	The date is formatted at most once a second, and the header bearing the label and
+	the process id is prebuilt, so that in the usual case the line is just copied together.
+*/
+static int _osrfLogFormatLine( char* buf, size_t size, int level,
+		const char* filename, int line, const char* xid, const char* msg ) {
+	_osrfLogDateNow();
+
+	int i = _osrfLogLevelIndex( level );
+
+	char digits[ 24 ];
+	const char* num = _osrfLogNumber( digits + sizeof( digits ), line );
+	size_t numlen = digits + sizeof( digits ) - 1 - num;
+
+	size_t filelen = strlen( filename );
+	size_t xidlen = strlen( xid );
+	size_t msglen = strlen( msg );
+	size_t len = _osrfLogAppnameLen + 1 + _osrfLogDateLen + 1 + _osrfLogHeadLens[ i ]
+		+ filelen + 1 + numlen + 1 + xidlen + 2 + msglen + 1;
+	if( len >= size )
+		return snprintf( buf, size, "%s %s %s%s:%d:%s] %s\n", _osrfLogAppname,
+			_osrfLogDate, _osrfLogHeads[ i ], filename, line, xid, msg );
+
+	char* p = buf;
+	memcpy( p, _osrfLogAppname, _osrfLogAppnameLen );
+	p += _osrfLogAppnameLen;
+	*p++ = ' ';
+	memcpy( p, _osrfLogDate, _osrfLogDateLen );
+	p += _osrfLogDateLen;
+	*p++ = ' ';
+	memcpy( p, _osrfLogHeads[ i ], _osrfLogHeadLens[ i ] );
+	p += _osrfLogHeadLens[ i ];
+	memcpy( p, filename, filelen );
+	p += filelen;
+	*p++ = ':';
+	memcpy( p, num, numlen );
+	p += numlen;
+	*p++ = ':';
+	memcpy( p, xid, xidlen );
+	p += xidlen;
+	*p++ = ']';
+	*p++ = ' ';
+	memcpy( p, msg, msglen );
+	p += msglen;
+	*p++ = '\n';
+	*p = '\0';
+	return (int) len;
+}
+
+/**
+	@brief Bring the local date and time, as formatted for the log file, up to date.
+
+	The date is formatted into thread-local storage, only when the second changes.
+*/
+static void _osrfLogDateNow( void ) {
+	time_t t = time(NULL);
+	if( t != _osrfLogDateTime ) {
+		struct tm tms;
+		_osrfLogDateLen = strftime( _osrfLogDate, sizeof( _osrfLogDate ),
+			"%Y-%m-%d %H:%M:%S", localtime_r( &t, &tms ));
+		_osrfLogDateTime = t;
+	}
+}
+
+/**
+	@brief Format a number in decimal, backwards from the end of a buffer.
+	@param end Pointer just past the end of the buffer, which must have room for 22 bytes.
+	@param num The number.
+	@return Pointer to the number, terminated by a nul byte at the end of the buffer.
+
+	Async-signal-safe, for osrfLogDumpRecorder().
+*/
+static const char* _osrfLogNumber( char* end, long num ) {
+	char* p = end;
+	*--p = '\0';
+	unsigned long n = num < 0 ? - (unsigned long) num : (unsigned long) num;
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while( n );
+	if( num < 0 )
+		*--p = '-';
+	return p;
+}
+
+/**
+	@brief Claim the next entry of the flight recorder, and fill in all but the message.
+	@param ring Pointer to the recorder.
+	@param pos Where to put the position of the entry, for _osrfLogRecordDone().
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@param filename Name of the source file from whence the message was issued.
+	@param line Line number from whence the message was issued.
+	@return Pointer to the entry, whose text the caller fills in.
+*/
+static _osrfLogRecord* _osrfLogRecordStart( _osrfLogRecorderRing* ring, unsigned long* pos,
+		int level, const char* filename, int line ) {
+	*pos = __sync_fetch_and_add( &ring->next, 1 );
+	_osrfLogRecord* rec = ring->records + ( *pos & ring->mask );
+	__atomic_store_n( &rec->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	rec->level = level;
+	rec->line = line;
+	_osrfLogDateNow();
+	memcpy( rec->date, _osrfLogDate, sizeof( rec->date ));
+
+	// Keep the end of the file name, if it's too long
+	if( !filename )
+		filename = "";
+	size_t len = strlen( filename );
+	if( len >= sizeof( rec->file ))
+		filename += len - ( sizeof( rec->file ) - 1 );
+	strncpy( rec->file, filename, sizeof( rec->file ));
+
+	strncpy( rec->xid, _osrfLogXid ? _osrfLogXid : "", sizeof( rec->xid ));
+	return rec;
+}
+
+/**
+	@brief Mark an entry of the flight recorder as complete.
+	@param rec Pointer to the entry, from _osrfLogRecordStart().
+	@param pos Position of the entry, from _osrfLogRecordStart().
+*/
+static void _osrfLogRecordDone( _osrfLogRecord* rec, unsigned long pos ) {
+	__atomic_store_n( &rec->seq, pos + 1, __ATOMIC_RELEASE );
+}
+
+/**
+	@brief Put an already formatted message in the flight recorder.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@param filename Name of the source file from whence the message was issued.
+	@param line Line number from whence the message was issued.
+	@param msg Message text.
+*/
+static void _osrfLogRecordMsg( int level, const char* filename, int line, const char* msg ) {
+	_osrfLogRecorderRing* ring = _osrfLogRecorder;
+	unsigned long pos;
+	_osrfLogRecord* rec = _osrfLogRecordStart( ring, &pos, level, filename, line );
+	strncpy( rec->text, msg, sizeof( rec->text ));
+	_osrfLogRecordDone( rec, pos );
+}
+
+/**
+	@brief Format a message that isn't being logged otherwise into the flight recorder.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@param filename Name of the source file from whence the message was issued.
+	@param line Line number from whence the message was issued.
+	@param msg A printf-style format string.
+	@param args The values to format.
+
+	The message goes straight into the entry, truncated if need be.
+*/
+static void _osrfLogRecordV( int level, const char* filename, int line,
+		const char* msg, va_list args ) {
+	_osrfLogRecorderRing* ring = _osrfLogRecorder;
+	unsigned long pos;
+	_osrfLogRecord* rec = _osrfLogRecordStart( ring, &pos, level, filename, line );
+	if( vsnprintf( rec->text, sizeof( rec->text ), msg, args ) < 0 )
+		rec->text[ 0 ] = '\0';
+	_osrfLogRecordDone( rec, pos );
+}
+
+/**
+	@brief Dump the flight recorder when the process crashes, and then crash.
+	@param sig The signal: SIGSEGV, etc..
+
+	Installed by osrfLogSetRecorder(), to be reset to the default by the signal.
+*/
+static void _osrfLogCrash( int sig ) {
+	const char* reason = "fatal signal";
+	switch( sig ) {
+		case SIGSEGV : reason = "SIGSEGV"; break;
+		case SIGBUS  : reason = "SIGBUS";  break;
+		case SIGFPE  : reason = "SIGFPE";  break;
+		case SIGILL  : reason = "SIGILL";  break;
+		case SIGABRT : reason = "SIGABRT"; break;
+	}
+	osrfLogDumpRecorder( reason );
+	raise( sig );
+}
+
+/**
+	@brief Append a string to a buffer, as far as it fits.
+	@param buf The buffer.
+	@param size Size of @a buf.
+	@param used How much of @a buf is already used.
+	@param str The string.
+	@param max Most bytes to take from @a str, which may end sooner; -1 for no limit.
+	@return How much of @a buf is used now.
+
+	Async-signal-safe, for osrfLogDumpRecorder().
+*/
+static size_t _osrfLogAppend( char* buf, size_t size, size_t used, const char* str,
+		long max ) {
+	while( used < size && max-- != 0 && *str )
+		buf[ used++ ] = *str++;
+	return used;
+}
+
+/**
+	@brief Write all of a buffer to a file descriptor, as far as possible.
+	@param fd The file descriptor.
+	@param buf The buffer.
+	@param len How many bytes to write.
+*/
+static void _osrfLogWriteAll( int fd, const char* buf, size_t len ) {
+	while( len ) {
+		ssize_t n = write( fd, buf, len );
+		if( n < 0 && EINTR == errno )
+			continue;
+		if( n <= 0 )
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+	@brief Do the one-time setup for logging, the first time we have anything to log.
+
+	Arrange for buffered and queued messages to be written on exit, and to be forgotten
+	by a forked child; and build the message headers for this process.
+*/
+static void _osrfLogRegister( void ) {
+	pthread_once( &_osrfLogOnce, _osrfLogSetUp );
 }
 
+/**
+	@brief Do the work of _osrfLogRegister(), exactly once per program.
+*/
+static void _osrfLogSetUp( void ) {
+	atexit( osrfLogFlush );
+	pthread_atfork( NULL, NULL, _osrfLogAtFork );
+	osrfLogResetPid();
+}
+
+/**
+	@brief Note the current process id, for the headers of future messages.
+
+	The process id is looked up once and then reused for every message, until the next
+	fork().  A forked child picks up its own process id automatically, but a process
+	created otherwise (or that has a reason to be sure) may call this function.  It should
+	be called before the process starts any threads that might log.
+*/
+void osrfLogResetPid( void ) {
+	_osrfLogPid = (long) getpid();
+	int i;
+	for( i = 0; i < OSRF_LOG_LABELS; i++ )
+		_osrfLogHeadLens[ i ] = snprintf( _osrfLogHeads[ i ], sizeof( _osrfLogHeads[ i ] ),
+			"[%s:%ld:", _osrfLogLabels[ i ], _osrfLogPid );
+}
+
+/**
+	@brief Make sure that the log file is open, and is the one by its name.
+	@return Zero if the log file is open, or -1 if it can't be opened.
+
+	Every OSRF_LOG_CHECK_INTERVAL seconds, check whether the file by that name is still
+	the one we have open; if not, it has been rotated, so open the new one.
+
+	Called with _osrfLogLock held.
+*/
+static int _osrfLogReady( void ) {
+	time_t t = time( NULL );
+	if( _osrfLogFd >= 0 && t - _osrfLogChecked >= OSRF_LOG_CHECK_INTERVAL ) {
+		_osrfLogChecked = t;
+		struct stat named, opened;
+		if( stat( _osrfLogFile, &named ) || fstat( _osrfLogFd, &opened )
+				|| named.st_ino != opened.st_ino || named.st_dev != opened.st_dev )
+			_osrfLogClose();
+	}
+
+	if( _osrfLogFd < 0 && _osrfLogOpen() ) {
+		fprintf(stderr,
+			"Unable to open log file %s for writing; logging to standard error\n", _osrfLogFile);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Open the log file named by _osrfLogFile, in append mode.
+	@return Zero if successful, or -1 if not.
+
+	Called with _osrfLogLock held.
+*/
+static int _osrfLogOpen( void ) {
+	_osrfLogRegister();
+	_osrfLogFd = open( _osrfLogFile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+	_osrfLogChecked = time( NULL );
+	return _osrfLogFd < 0 ? -1 : 0;
+}
+
+/**
+	@brief Write out the log file buffer, and close the log file.
+
+	Called with _osrfLogLock held.
+*/
+static void _osrfLogClose( void ) {
+	_osrfLogWrite();
+	if( _osrfLogFd >= 0 ) {
+		close( _osrfLogFd );
+		_osrfLogFd = -1;
+	}
+}
+
+/**
+	@brief Write out the log file buffer.
+
+	If the log file can't be written, the output goes to standard error instead.
+
+	Called with _osrfLogLock held.
+*/
+static void _osrfLogWrite( void ) {
+	size_t done = 0;
+	while( _osrfLogFd >= 0 && done < _osrfLogBufUsed ) {
+		ssize_t n = write( _osrfLogFd, _osrfLogBuf + done, _osrfLogBufUsed - done );
+		if( n < 0 && EINTR == errno )
+			continue;
+		if( n <= 0 ) {
+			fprintf( stderr, "Error writing log file %s: %s\n", _osrfLogFile,
+				n < 0 ? strerror( errno ) : "nothing written" );
+			break;
+		}
+		done += n;
+	}
+	if( done < _osrfLogBufUsed )
+		fwrite( _osrfLogBuf + done, 1, _osrfLogBufUsed - done, stderr );
+
+	_osrfLogBufUsed = 0;
+	_osrfLogFlushed = time( NULL );
+}
+
+/**
+	@brief Start afresh in a newly forked child.
+
+	Whatever is in the buffer or the queue belongs to the parent, which will write it.
+	The locks, which some other thread in the parent may have held, start out free.  The
+	log shipping thread didn't survive the fork; the next message starts another.  The
+	process id is, of course, a new one.
+*/
+static void _osrfLogAtFork( void ) {
+	osrfLogResetPid();
+	_osrfLogBufUsed = 0;
+	pthread_mutex_init( &_osrfLogLock, NULL );
+
+	if( _osrfLogRing ) {
+		unsigned long i;
+		for( i = 0; i <= _osrfLogRingMask; i++ )
+			_osrfLogRing[ i ].seq = i;
+		_osrfLogRingHead = 0;
+		_osrfLogRingTail = 0;
+		_osrfLogDropped = 0;
+		_osrfLogDropReported = 0;
+		_osrfLogShipping = 0;
+		sem_destroy( &_osrfLogRingSem );
+		sem_init( &_osrfLogRingSem, 0, 0 );
+		pthread_mutex_init( &_osrfLogDrainLock, NULL );
+	}
+
+	// What's in the flight recorder is the parent's to tell
+	_osrfLogRecorderRing* ring = _osrfLogRecorder;
+	if( ring ) {
+		unsigned long i;
+		for( i = 0; i <= ring->mask; i++ )
+			ring->records[ i ].seq = 0;
+		ring->next = 0;
+		ring->dumped = 0;
+	}
+}
 
 /**
 	@brief Write a message to a log file.
-	@param label The message type: "ERR", "WARN", etc..
-	@param pid The process id.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
 	@param filename Name of the source file from whence the message was issued.
 	@param line Line number from whence the message was issued.
 	@param xid Transaction id (or an empty string if there is no transaction).
 	@param msg Message text.
 
-	Open the log file named by _osrfLogFile, in append mode; write the message; close the
-	file.  If unable to open the log file, write the message to standard error.
+	Keep the log file named by _osrfLogFile open, and add the message to a buffer (see
+	osrfLogFlush()).  If unable to open the log file, write the message to standard error.
 */
-static void _osrfLogToFile( const char* label, long pid, const char* filename, int line,
+static void _osrfLogToFile( int level, const char* filename, int line,
 	const char* xid, const char* msg ) {
 
-	if( !label || !filename || !xid || !msg )
+	if( !filename || !xid || !msg )
 		return;           // missing parameter(s)
 
 	if(!_osrfLogFile)
@@ -607,26 +1442,199 @@ static void _osrfLogToFile( const char* label, long pid, const char* filename, i
 	if(!_osrfLogAppname)
 		osrfLogSetAppname("osrf"); // apply default application name
 
-	char datebuf[36];
-	time_t t = time(NULL);
-	struct tm* tms = localtime(&t);
-	strftime(datebuf, sizeof( datebuf ), "%Y-%m-%d %H:%M:%S", tms);
-
-	FILE* file = fopen(_osrfLogFile, "a");
-	if(!file) {
-		fprintf(stderr,
-			"Unable to fopen log file %s for writing; logging to standard error\n", _osrfLogFile);
-		fprintf(stderr, "%s %s [%s:%ld:%s:%d:%s] %s\n",
-			_osrfLogAppname, datebuf, label, (long) getpid(), filename, line, xid, msg );
+	pthread_mutex_lock( &_osrfLogLock );
 
+	if( _osrfLogReady() ) {
+		pthread_mutex_unlock( &_osrfLogLock );
+		char buf[ OSRF_LOG_ASYNC_LINE ];
+		_osrfLogFormatLine( buf, sizeof( buf ), level, filename, line, xid, msg );
+		fputs( buf, stderr );
 		return;
 	}
 
-	fprintf(file, "%s %s [%s:%ld:%s:%d:%s] %s\n",
-		_osrfLogAppname, datebuf, label, (long) getpid(), filename, line, xid, msg );
-	if( fclose(file) != 0 ) 
-		fprintf( stderr, "Error closing log file: %s", strerror(errno));
+	// Format the message into the buffer, making room if need be
+	size_t room = OSRF_LOG_BUFSIZE - _osrfLogBufUsed;
+	int len = _osrfLogFormatLine( _osrfLogBuf + _osrfLogBufUsed, room,
+		level, filename, line, xid, msg );
+	if( len >= 0 && (size_t) len >= room && _osrfLogBufUsed ) {
+		_osrfLogWrite();
+		room = OSRF_LOG_BUFSIZE;
+		len = _osrfLogFormatLine( _osrfLogBuf, room, level, filename, line, xid, msg );
+	}
+
+	if( len < 0 )
+		;                 // Nothing we can do
+	else if( (size_t) len < room )
+		_osrfLogBufUsed += len;
+	else {
+		// Too big for the buffer; write it directly
+		char* big = safe_malloc( len + 1 );
+		_osrfLogFormatLine( big, len + 1, level, filename, line, xid, msg );
+		if( write( _osrfLogFd, big, len ) != len )
+			fprintf( stderr, "Error writing log file %s: %s\n", _osrfLogFile,
+				strerror( errno ));
+		free( big );
+	}
+
+	if( OSRF_LOG_ERROR == level || time( NULL ) - _osrfLogFlushed >= OSRF_LOG_FLUSH_INTERVAL )
+		_osrfLogWrite();
 
+	pthread_mutex_unlock( &_osrfLogLock );
+}
+
+/**
+	@brief Queue a message for the log shipping thread.
+	@param priority Syslog facility and level, or -1 for the log file.
+	@param level The message level: OSRF_LOG_ERROR, etc., or OSRF_LOG_ACTIVITY.
+	@param filename Name of the source file from whence the message was issued.
+	@param line Line number from whence the message was issued.
+	@param xid Transaction id (or an empty string if there is no transaction).
+	@param msg Message text.
+
+	Claim an entry without taking a lock, format the message right into it, and wake the
+	thread, starting one first if this process doesn't have one yet.  If the queue is full,
+	either wait for room or drop the message, as configured.  Messages too long for an
+	entry are truncated.
+*/
+static void _osrfLogEnqueue( int priority, int level, const char* filename,
+		int line, const char* xid, const char* msg ) {
+
+	if( !_osrfLogShipping && __sync_bool_compare_and_swap( &_osrfLogShipping, 0, 1 )) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init( &attr );
+		pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+		if( pthread_create( &thread, &attr, _osrfLogShipper, NULL )) {
+			fprintf( stderr, "Unable to start log shipping thread; logging directly\n" );
+			_osrfLogAsync = 0;
+		}
+		pthread_attr_destroy( &attr );
+	}
+
+	_osrfLogEntry* entry;
+	unsigned long pos = __atomic_load_n( &_osrfLogRingTail, __ATOMIC_RELAXED );
+	for( ;; ) {
+		entry = _osrfLogRing + ( pos & _osrfLogRingMask );
+		long diff = (long) __atomic_load_n( &entry->seq, __ATOMIC_ACQUIRE ) - (long) pos;
+		if( 0 == diff ) {
+			if( __sync_bool_compare_and_swap( &_osrfLogRingTail, pos, pos + 1 ))
+				break;
+		} else if( diff < 0 ) {
+			// Full
+			if( !_osrfLogRingBlock || !_osrfLogAsync ) {
+				__sync_fetch_and_add( &_osrfLogDropped, 1 );
+				return;
+			}
+			sem_post( &_osrfLogRingSem );
+			usleep( 1000 );
+		}
+		pos = __atomic_load_n( &_osrfLogRingTail, __ATOMIC_RELAXED );
+	}
+
+	int len;
+	if( priority < 0 ) {
+		if(!_osrfLogAppname)
+			osrfLogSetAppname("osrf"); // apply default application name
+		len = _osrfLogFormatLine( entry->text, sizeof( entry->text ),
+			level, filename, line, xid, msg );
+	} else
+		len = snprintf( entry->text, sizeof( entry->text ), "%s%s:%d:%s] %s",
+			_osrfLogHeads[ _osrfLogLevelIndex( level ) ], filename, line, xid, msg );
+
+	if( len < 0 )
+		len = 0;
+	else if( len >= (int) sizeof( entry->text )) {
+		// Truncated; be cute about it, as for Syslog
+		len = sizeof( entry->text ) - 1;
+		memcpy( entry->text + len - 4, priority < 0 ? "...\n" : "....", 4 );
+	}
+	entry->priority = priority;
+	entry->len = len;
+
+	__atomic_store_n( &entry->seq, pos + 1, __ATOMIC_RELEASE );
+	sem_post( &_osrfLogRingSem );
+}
+
+/**
+	@brief Write out everything in the queue for the log shipping thread.
+
+	Messages for the log file go into its buffer, which is written once the queue is
+	empty.  If any messages have been dropped since the last report, report them.
+
+	Called with _osrfLogDrainLock held.
+*/
+static void _osrfLogDrain( void ) {
+	int to_file = 0;
+	for( ;; ) {
+		_osrfLogEntry* entry = _osrfLogRing + ( _osrfLogRingHead & _osrfLogRingMask );
+		if( (long) __atomic_load_n( &entry->seq, __ATOMIC_ACQUIRE )
+				- (long) ( _osrfLogRingHead + 1 ) < 0 )
+			break;     // Empty, or the next message isn't finished yet
+
+		if( entry->priority >= 0 )
+			syslog( entry->priority, "%s", entry->text );
+		else {
+			to_file = 1;
+			pthread_mutex_lock( &_osrfLogLock );
+			if( _osrfLogReady() )
+				fwrite( entry->text, 1, entry->len, stderr );
+			else {
+				if( (size_t) entry->len > OSRF_LOG_BUFSIZE - _osrfLogBufUsed )
+					_osrfLogWrite();
+				memcpy( _osrfLogBuf + _osrfLogBufUsed, entry->text, entry->len );
+				_osrfLogBufUsed += entry->len;
+			}
+			pthread_mutex_unlock( &_osrfLogLock );
+		}
+
+		__atomic_store_n( &entry->seq, _osrfLogRingHead + _osrfLogRingMask + 1,
+			__ATOMIC_RELEASE );
+		_osrfLogRingHead++;
+	}
+
+	unsigned long dropped = __atomic_load_n( &_osrfLogDropped, __ATOMIC_RELAXED );
+	if( dropped != _osrfLogDropReported ) {
+		unsigned long count = dropped - _osrfLogDropReported;
+		_osrfLogDropReported = dropped;
+		if( _osrfLogType == OSRF_LOG_TYPE_SYSLOG )
+			syslog( _osrfLogFacility | LOG_WARNING, "%slog.c:%d:] "
+				"Log queue full; dropped %lu messages", _osrfLogHeads[ OSRF_LOG_WARNING ],
+				__LINE__, count );
+		else {
+			char msg[ 64 ];
+			snprintf( msg, sizeof( msg ), "Log queue full; dropped %lu messages", count );
+			_osrfLogToFile( OSRF_LOG_WARNING, "log.c", __LINE__, "", msg );
+			to_file = 1;
+		}
+	}
+
+	if( to_file ) {
+		pthread_mutex_lock( &_osrfLogLock );
+		_osrfLogWrite();
+		pthread_mutex_unlock( &_osrfLogLock );
+	}
+}
+
+/**
+	@brief Main loop of the log shipping thread.
+	@param arg Not used.
+	@return Never.
+
+	Wait for messages to be queued, and write them out, batching as many as have
+	piled up in the meantime.
+*/
+static void* _osrfLogShipper( void* arg ) {
+	for( ;; ) {
+		while( sem_wait( &_osrfLogRingSem ) && EINTR == errno )
+			;
+		// One wakeup is enough for everything queued so far
+		while( 0 == sem_trywait( &_osrfLogRingSem ))
+			;
+		pthread_mutex_lock( &_osrfLogDrainLock );
+		_osrfLogDrain();
+		pthread_mutex_unlock( &_osrfLogDrainLock );
+	}
+	return NULL;
 }
 
 /**
@@ -0,0 +1,408 @@
+/**
+	@file osrf_affinity.c
+	@brief CPU lists, the NUMA layout, and the calls that pin a process to them.
+
+	See osrf_affinity.h for the policies.  Everything here works from the CPU lists the
+	kernel publishes in sysfs, and from the raw set_mempolicy() system call, so as not to
+	depend on libnuma.
+*/
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include <opensrf/osrf_affinity.h>
+#include <opensrf/utils.h>
+#include <opensrf/log.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+/** @brief Number of bits in each word of an osrfCpuSet. */
+#define WORD_BITS ( 8 * sizeof( unsigned long ))
+
+/** @brief Where the kernel describes the NUMA nodes. */
+static const char* sysfs_dir = "/sys/devices/system/node";
+
+/** @brief The CPUs we were allowed before we first pinned ourselves. */
+static osrfCpuSet startup_cpus;
+/** @brief Boolean: true once startup_cpus has been filled in. */
+static int have_startup_cpus = 0;
+
+static void cpu_set_add( osrfCpuSet* set, int cpu );
+static int read_node_cpus( int node, osrfCpuSet* set );
+static int list_nodes( int* nodes );
+static int get_allowed( osrfCpuSet* set );
+
+/**
+	@brief Parse a CPU list into a set.
+	@param set Pointer to the osrfCpuSet to fill in.
+	@param list The CPU list, as in "0-3,8,10-11".
+	@return Zero if successful, or -1 if the list is malformed or empty.
+
+	White space around the numbers is ignored, and so are CPUs beyond OSRF_MAX_CPUS.
+*/
+int osrfCpuSetParse( osrfCpuSet* set, const char* list ) {
+	if( !set )
+		return -1;
+	memset( set, 0, sizeof( *set ));
+	if( !list )
+		return -1;
+
+	const char* p = list;
+	int found = 0;
+	for( ;; ) {
+		while( isspace( (unsigned char) *p ))
+			p++;
+		if( !*p )
+			break;
+
+		char* end;
+		if( !isdigit( (unsigned char) *p ))
+			return -1;
+		long first = strtol( p, &end, 10 );
+		long last = first;
+		p = end;
+		while( isspace( (unsigned char) *p ))
+			p++;
+		if( '-' == *p ) {
+			p++;
+			while( isspace( (unsigned char) *p ))
+				p++;
+			if( !isdigit( (unsigned char) *p ))
+				return -1;
+			last = strtol( p, &end, 10 );
+			p = end;
+			if( last < first )
+				return -1;
+		}
+
+		long cpu;
+		for( cpu = first; cpu <= last && cpu < OSRF_MAX_CPUS; cpu++ )
+			cpu_set_add( set, (int) cpu );
+		found = 1;
+
+		while( isspace( (unsigned char) *p ))
+			p++;
+		if( ',' == *p )
+			p++;
+		else if( *p )
+			return -1;
+	}
+
+	return ( found && osrfCpuSetCount( set )) ? 0 : -1;
+}
+
+/**
+	@brief Add a CPU to a set.
+	@param set Pointer to the osrfCpuSet.
+	@param cpu The CPU number.
+*/
+static void cpu_set_add( osrfCpuSet* set, int cpu ) {
+	if( cpu >= 0 && cpu < OSRF_MAX_CPUS )
+		set->bits[ cpu / WORD_BITS ] |= 1UL << ( cpu % WORD_BITS );
+}
+
+/**
+	@brief Tell whether a set holds a given CPU.
+	@param set Pointer to the osrfCpuSet.
+	@param cpu The CPU number.
+	@return 1 if it does, or 0 if not.
+*/
+int osrfCpuSetHas( const osrfCpuSet* set, int cpu ) {
+	if( !set || cpu < 0 || cpu >= OSRF_MAX_CPUS )
+		return 0;
+	return ( set->bits[ cpu / WORD_BITS ] >> ( cpu % WORD_BITS )) & 1;
+}
+
+/**
+	@brief Count the CPUs in a set.
+	@param set Pointer to the osrfCpuSet.
+	@return The number of CPUs.
+*/
+int osrfCpuSetCount( const osrfCpuSet* set ) {
+	int count = 0;
+	int cpu;
+	for( cpu = 0; set && cpu < OSRF_MAX_CPUS; cpu++ )
+		count += osrfCpuSetHas( set, cpu );
+	return count;
+}
+
+/**
+	@brief Format a set as a CPU list.
+	@param set Pointer to the osrfCpuSet.
+	@return A newly allocated string, such as "0-3,8", which the caller must free.
+
+	Runs of three or more CPUs become ranges.
+*/
+char* osrfCpuSetFormat( const osrfCpuSet* set ) {
+	growing_buffer* buf = buffer_init( 32 );
+	int cpu = 0;
+	while( cpu < OSRF_MAX_CPUS ) {
+		if( !osrfCpuSetHas( set, cpu )) {
+			cpu++;
+			continue;
+		}
+		int last = cpu;
+		while( last + 1 < OSRF_MAX_CPUS && osrfCpuSetHas( set, last + 1 ))
+			last++;
+
+		if( buf->n_used )
+			OSRF_BUFFER_ADD_CHAR( buf, ',' );
+		if( last == cpu )
+			buffer_fadd( buf, "%d", cpu );
+		else if( last == cpu + 1 )
+			buffer_fadd( buf, "%d,%d", cpu, last );
+		else
+			buffer_fadd( buf, "%d-%d", cpu, last );
+		cpu = last + 1;
+	}
+	return buffer_release( buf );
+}
+
+/**
+	@brief Look for the NUMA layout somewhere other than /sys/devices/system/node.
+	@param dir The directory holding the node0, node1, ... directories, or NULL to go
+	back to the default.
+
+	Meant for tests.
+*/
+void osrfNumaSetSysfsDir( const char* dir ) {
+	sysfs_dir = dir ? dir : "/sys/devices/system/node";
+}
+
+/**
+	@brief Read the CPUs of a NUMA node.
+	@param node The node number.
+	@param set Pointer to an osrfCpuSet to fill in.
+	@return Zero if successful, or -1 if the node has no CPUs or can't be read.
+*/
+static int read_node_cpus( int node, osrfCpuSet* set ) {
+	char path[ 256 ];
+	snprintf( path, sizeof( path ), "%s/node%d/cpulist", sysfs_dir, node );
+	FILE* file = fopen( path, "r" );
+	if( !file )
+		return -1;
+
+	char line[ 4096 ];
+	int rc = -1;
+	if( fgets( line, sizeof( line ), file ))
+		rc = osrfCpuSetParse( set, line );
+	fclose( file );
+	return rc;
+}
+
+/**
+	@brief List the NUMA nodes that have CPUs.
+	@param nodes Array of OSRF_MAX_NUMA_NODES ints, to receive the node numbers.
+	@return The number of nodes found, in ascending order; zero if there's no NUMA layout.
+*/
+static int list_nodes( int* nodes ) {
+	DIR* dir = opendir( sysfs_dir );
+	if( !dir )
+		return 0;
+
+	unsigned long long seen = 0;
+	struct dirent* entry;
+	while(( entry = readdir( dir ))) {
+		const char* name = entry->d_name;
+		if( strncmp( name, "node", 4 ) || !isdigit( (unsigned char) name[ 4 ] ))
+			continue;
+		int node = atoi( name + 4 );
+		if( node < OSRF_MAX_NUMA_NODES )
+			seen |= 1ULL << node;
+	}
+	closedir( dir );
+
+	int count = 0;
+	int node;
+	osrfCpuSet cpus;
+	for( node = 0; node < OSRF_MAX_NUMA_NODES; node++ )
+		if(( seen >> node & 1 ) && !read_node_cpus( node, &cpus ))
+			nodes[ count++ ] = node;
+	return count;
+}
+
+/**
+	@brief Find the CPUs the process may run on, absent a CPU list.
+	@param set Pointer to an osrfCpuSet to fill in.
+	@return Zero if successful, or -1 if not.
+
+	That's the CPUs we were allowed before we first pinned ourselves, so that a drone
+	isn't confined to its listener's CPUs just because its own list was left out.
+*/
+static int get_allowed( osrfCpuSet* set ) {
+	if( have_startup_cpus ) {
+		*set = startup_cpus;
+		return 0;
+	}
+
+	memset( set, 0, sizeof( *set ));
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t mask;
+	CPU_ZERO( &mask );
+	if( sched_getaffinity( 0, sizeof( mask ), &mask ))
+		return -1;
+	int cpu;
+	for( cpu = 0; cpu < CPU_SETSIZE && cpu < OSRF_MAX_CPUS; cpu++ )
+		if( CPU_ISSET( cpu, &mask ))
+			cpu_set_add( set, cpu );
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+	@brief Work out which CPUs a process should run on.
+	@param cpus Pointer to an osrfCpuSet to receive the CPUs.
+	@param node Pointer to an int to receive the NUMA node chosen, or -1 if none; may be NULL.
+	@param list The CPU list to confine the process to, or NULL or empty for any CPU.
+	@param spread Boolean: true to confine the process to the CPUs of one NUMA node.
+	@param index Which process of its kind this is, such as a drone's status board slot;
+	the nodes are taken in turn by index.
+	@return Zero if successful, or -1 if the list is malformed or names no usable CPU.
+
+	Only the nodes that share CPUs with the list take part in the spreading.  Without a
+	NUMA layout, the process gets the whole list.
+*/
+int osrfAffinityPlan( osrfCpuSet* cpus, int* node, const char* list, int spread, int index ) {
+	if( node )
+		*node = -1;
+	if( !cpus )
+		return -1;
+
+	if( list && *list ) {
+		if( osrfCpuSetParse( cpus, list ))
+			return -1;
+	} else if( get_allowed( cpus ))
+		return -1;
+
+	if( !spread || index < 0 )
+		return 0;
+
+	int nodes[ OSRF_MAX_NUMA_NODES ];
+	osrfCpuSet node_cpus[ OSRF_MAX_NUMA_NODES ];
+	int count = 0;
+	int total = list_nodes( nodes );
+	int i;
+	for( i = 0; i < total; i++ ) {
+		osrfCpuSet* both = node_cpus + count;
+		read_node_cpus( nodes[ i ], both );
+		unsigned int w;
+		int any = 0;
+		for( w = 0; w < sizeof( both->bits ) / sizeof( both->bits[ 0 ] ); w++ ) {
+			both->bits[ w ] &= cpus->bits[ w ];
+			any |= both->bits[ w ] != 0;
+		}
+		if( any )
+			nodes[ count++ ] = nodes[ i ];
+	}
+
+	if( count ) {
+		*cpus = node_cpus[ index % count ];
+		if( node )
+			*node = nodes[ index % count ];
+	}
+	return 0;
+}
+
+/**
+	@brief Pin the calling process to its CPUs, and perhaps its memory to their nodes.
+	@param list The CPU list to confine the process to, or NULL or empty for any CPU.
+	@param spread Boolean: true to confine the process to the CPUs of one NUMA node.
+	@param bind_memory Boolean: true to allocate memory only on the nodes of the CPUs chosen.
+	@param index Which process of its kind this is, or -1 if it's the only one.
+	@param who What to call the process in the log, such as "drone".
+	@return Zero if successful, or -1 if not.
+
+	With nothing to do, that is with no list and no spreading, leave things as they are.
+	A failure is logged; the process may carry on unpinned.
+*/
+int osrfAffinityApply( const char* list, int spread, int bind_memory, int index,
+		const char* who ) {
+
+	if( !( list && *list ) && !spread && !bind_memory && !have_startup_cpus )
+		return 0;
+	if( !who )
+		who = "process";
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	if( !have_startup_cpus && !get_allowed( &startup_cpus ))
+		have_startup_cpus = 1;
+
+	osrfCpuSet cpus;
+	int node;
+	if( osrfAffinityPlan( &cpus, &node, list, spread, index )) {
+		osrfLogError( OSRF_LOG_MARK, "Invalid CPU list for %s: \"%s\"", who, list ? list : "" );
+		return -1;
+	}
+
+	cpu_set_t mask;
+	CPU_ZERO( &mask );
+	int cpu;
+	for( cpu = 0; cpu < CPU_SETSIZE && cpu < OSRF_MAX_CPUS; cpu++ )
+		if( osrfCpuSetHas( &cpus, cpu ))
+			CPU_SET( cpu, &mask );
+
+	char* str = osrfCpuSetFormat( &cpus );
+	if( sched_setaffinity( 0, sizeof( mask ), &mask )) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to pin %s to CPUs %s: %s",
+			who, str, strerror( errno ));
+		free( str );
+		return -1;
+	}
+	if( node >= 0 )
+		osrfLogDebug( OSRF_LOG_MARK, "Pinned %s to CPUs %s on NUMA node %d", who, str, node );
+	else
+		osrfLogDebug( OSRF_LOG_MARK, "Pinned %s to CPUs %s", who, str );
+	free( str );
+
+	if( !bind_memory )
+		return 0;
+
+#ifdef SYS_set_mempolicy
+	// Bind to the node chosen, or else to every node sharing CPUs with the process
+	unsigned long nodemask = 0;
+	if( node >= 0 )
+		nodemask = 1UL << node;
+	else {
+		int nodes[ OSRF_MAX_NUMA_NODES ];
+		int count = list_nodes( nodes );
+		int i;
+		for( i = 0; i < count; i++ ) {
+			osrfCpuSet node_cpus;
+			read_node_cpus( nodes[ i ], &node_cpus );
+			for( cpu = 0; cpu < OSRF_MAX_CPUS; cpu++ )
+				if( osrfCpuSetHas( &node_cpus, cpu ) && osrfCpuSetHas( &cpus, cpu )) {
+					if( nodes[ i ] < (int) WORD_BITS )
+						nodemask |= 1UL << nodes[ i ];
+					break;
+				}
+		}
+	}
+
+	if( !nodemask )
+		return 0;    // No NUMA layout; nothing to bind to
+	if( syscall( SYS_set_mempolicy, MPOL_BIND, &nodemask, WORD_BITS + 1 )) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to bind the memory of %s to its NUMA nodes: %s",
+			who, strerror( errno ));
+		return -1;
+	}
+#endif
+	return 0;
+
+#else
+	osrfLogWarning( OSRF_LOG_MARK, "CPU affinity is not supported here; %s is not pinned", who );
+	return -1;
+#endif
+}
@@ -6,8 +6,14 @@
 #include <time.h>
 #include "opensrf/osrf_app_session.h"
 #include "opensrf/osrf_stack.h"
+#include "opensrf/osrf_utf8.h"
+#include "opensrf/osrf_msgpack.h"
+#include "opensrf/osrf_trace.h"
 
-static char* current_ingress = NULL;
+static __thread char* current_ingress = NULL;
+
+/** Deadline of the request this thread is serving, if any, for the requests it makes. */
+static __thread long long current_deadline = 0;
 
 struct osrf_app_request_struct {
 	/** The controlling session. */
@@ -30,28 +36,76 @@ struct osrf_app_request_struct {
 	/** Boolean; if true, then a call that is waiting on a response will reset the
 	timeout and set this variable back to false. */
 	int reset_timeout;
+	/** Boolean; true while the REQUEST waits in the session's queue to be sent. */
+	int queued;
+	/** Chunks of a partial response received since we last granted the server more. */
+	int chunks_ungranted;
+	/** Times the request until it's complete, if we're tracing it; otherwise NULL. */
+	osrfSpan* span;
 	/** Linkage pointers for a linked list.  We maintain a hash table of pending requests,
 	    and each slot of the hash table is a doubly linked list. */
 	osrfAppRequest* next;
 	osrfAppRequest* prev;
 };
 
-static inline unsigned int request_id_hash( int req_id );
+static inline unsigned int request_id_hash( const osrfAppSession* session, int req_id );
+static void resize_request_table( osrfAppSession* session, unsigned int size );
 static osrfAppRequest* find_app_request( const osrfAppSession* session, int req_id );
 static void add_app_request( osrfAppSession* session, osrfAppRequest* req );
 
 /* Send the given message */
 static int _osrf_app_session_send( osrfAppSession*, osrfMessage* msg );
 
+static void grant_credit( osrfAppSession* session, int request_id, int chunks );
+
 static int osrfAppSessionMakeLocaleRequest(
 		osrfAppSession* session, const jsonObject* params, const char* method_name,
-		int protocol, osrfStringArray* param_strings, char* locale );
+		int protocol, osrfStringArray* param_strings, char* locale, int queue );
+
+static inline unsigned int session_id_hash( const char* session_id );
+static void resize_session_cache( unsigned int size );
+static void remove_cached_session( osrfAppSession* session );
+static inline void touch_session( osrfAppSession* session );
+static void evict_idle_sessions( void );
+static osrfAppSession* alloc_session( void );
+static void release_session( osrfAppSession* session );
+
+/**
+	@brief The global session cache, and the spare sessions kept for reuse.
+
+	Sessions are chained in a hash table keyed by session id.  Server sessions are also
+	kept in a list by last activity, so that those idle for too long can be found and
+	freed a few at a time, without a scan.  Client sessions belong to whoever created
+	them, and are never evicted.
+*/
+typedef struct {
+	osrfAppSession** buckets;   /**< Hash table of sessions, by session id. */
+	unsigned int size;          /**< Number of buckets: a power of two, or zero. */
+	unsigned int count;         /**< Number of sessions in the table. */
+	osrfAppSession* newest;     /**< Server session most recently active. */
+	osrfAppSession* oldest;     /**< Server session least recently active. */
+	osrfAppSession* spares;     /**< Freed sessions, linked through cache_next. */
+	int spare_count;            /**< Number of spares. */
+} session_cache;
+
+/** @brief The global session cache.  Thread-local, like the transport client. */
+static __thread session_cache osrfAppSessionCache;
+
+/** @brief Seconds a server session may sit idle before it's evicted; zero for never. */
+static int session_idle_timeout = OSRF_SESSION_IDLE_TIMEOUT;
 
-/** @brief The global session cache.
+/**
+	@brief The router's Jabber ID ("router_name@domain"), for addressing client sessions.
 
-	Key: session_id.  Data: osrfAppSession.
+	Looked up in the configuration the first time a client session needs it, and again only
+	if the configuration is replaced, which client_router_config notices.  Thread-local,
+	like the session cache.
 */
-static osrfHash* osrfAppSessionCache = NULL;
+static __thread char* client_router_jid = NULL;
+/** @brief The configuration from which client_router_jid came. */
+static __thread const osrfConfig* client_router_config = NULL;
+
+static const char* client_router( void );
 
 // --------------------------------------------------------------------------
 // Request API
@@ -77,6 +131,9 @@ static osrfAppRequest* _osrf_app_request_init(
 	req->payload        = msg;
 	req->result         = NULL;
 	req->reset_timeout  = 0;
+	req->queued         = 0;
+	req->chunks_ungranted = 0;
+	req->span           = NULL;
 	req->next           = NULL;
 	req->prev           = NULL;
 	req->part_response_buffer = NULL;
@@ -105,6 +162,13 @@ static void _osrf_app_request_free( osrfAppRequest * req ) {
         if (req->part_response_buffer)
             buffer_free(req->part_response_buffer);
 
+		if( req->span ) {
+			if( !req->complete )
+				req->span->error = 1;     // Given up on
+			osrfSpanEnd( req->span );
+			free( req->span );
+		}
+
 		free( req );
 	}
 }
@@ -121,6 +185,8 @@ static void _osrf_app_request_push_queue( osrfAppRequest* req, osrfMessage* resu
 	if(req == NULL || result == NULL)
 		return;
 
+	osrfSpanAddEvent( req->span, "response" );
+
     if (result->status_code == OSRF_STATUS_PARTIAL) {
         osrfLogDebug(OSRF_LOG_MARK, "received partial message response");
 
@@ -141,6 +207,13 @@ static void _osrf_app_request_push_queue( osrfAppRequest* req, osrfMessage* resu
             buffer_add(req->part_response_buffer, partial);
         }
 
+        // Let the server send more, once we've taken half of what we allowed
+        int window = req->payload ? req->payload->window : 0;
+        if( window > 0 && ++req->chunks_ungranted >= ( window + 1 ) / 2 ) {
+            grant_credit( req->session, req->request_id, req->chunks_ungranted );
+            req->chunks_ungranted = 0;
+        }
+
         // all done.  req and result are freed by the caller
         return;
 
@@ -197,40 +270,78 @@ void osrf_app_session_request_finish( osrfAppSession* session, int req_id ) {
 
 	if( session ) {
 		// Search the hash table for the request in question
-		unsigned int index = request_id_hash( req_id );
-		osrfAppRequest* old_req = session->request_hash[ index ];
-		while( old_req ) {
-			if( old_req->request_id == req_id )
-				break;
-			else
-				old_req = old_req->next;
-		}
+		osrfAppRequest* old_req = find_app_request( session, req_id );
 
 		if( old_req ) {
 			// Remove the request from the doubly linked list
 			if( old_req->prev )
 				old_req->prev->next = old_req->next;
 			else
-				session->request_hash[ index ] = old_req->next;
+				session->request_hash[ request_id_hash( session, req_id ) ] = old_req->next;
 
 			if( old_req->next )
 				old_req->next->prev = old_req->prev;
 
+			if( session->last_request == old_req )
+				session->last_request = NULL;
+
+			// Don't leave the queue pointing at it, if it never went out
+			if( old_req->queued )
+				osrfListExtract( session->queued_requests,
+					osrfListFind( session->queued_requests, old_req ) );
+
 			_osrf_app_request_free( old_req );
+
+			// Give back most of the room if the requests have mostly drained away
+			--session->request_count;
+			if( session->request_hash_size > OSRF_REQUEST_HASH_SIZE
+					&& session->request_count < session->request_hash_size / 8 )
+				resize_request_table( session, session->request_hash_size / 2 );
 		}
 	}
 }
 
 /**
 	@brief Derive a hash key from a request id.
+	@param session Pointer to the osrfAppSession that owns the hash table.
 	@param req_id The request id.
 	@return The corresponding hash key; an index into request_hash[].
 
-	If OSRF_REQUEST_HASH_SIZE is a power of two, then this calculation should
-	reduce to a binary AND.
+	Request ids are assigned consecutively, so the low bits spread them evenly.
+*/
+static inline unsigned int request_id_hash( const osrfAppSession* session, int req_id ) {
+	return ((unsigned int) req_id ) & ( session->request_hash_size - 1 );
+}
+
+/**
+	@brief Move a session's pending requests into a hash table of a different size.
+	@param session Pointer to the osrfAppSession.
+	@param size The new number of buckets; a power of two.
 */
-static inline unsigned int request_id_hash( int req_id ) {
-	return ((unsigned int) req_id ) % OSRF_REQUEST_HASH_SIZE;
+static void resize_request_table( osrfAppSession* session, unsigned int size ) {
+
+	osrfAppRequest** old_table = session->request_hash;
+	unsigned int old_size = session->request_hash_size;
+
+	session->request_hash = safe_malloc( size * sizeof( osrfAppRequest* ));
+	session->request_hash_size = size;
+
+	unsigned int i;
+	for( i = 0; i < old_size; ++i ) {
+		osrfAppRequest* req = old_table[ i ];
+		while( req ) {
+			osrfAppRequest* next = req->next;
+			unsigned int index = request_id_hash( session, req->request_id );
+			req->prev = NULL;
+			req->next = session->request_hash[ index ];
+			if( req->next )
+				req->next->prev = req;
+			session->request_hash[ index ] = req;
+			req = next;
+		}
+	}
+
+	free( old_table );
 }
 
 /**
@@ -238,10 +349,20 @@ static inline unsigned int request_id_hash( int req_id ) {
 	@param session Pointer to the relevant osrfAppSession.
 	@param req_id The request_id of the osrfAppRequest being sought.
 	@return A pointer to the osrfAppRequest if found, or NULL if not.
+
+	Most sessions have only one request pending at a time, so look first at the one
+	added most recently.
 */
 static osrfAppRequest* find_app_request( const osrfAppSession* session, int req_id ) {
 
-	osrfAppRequest* req = session->request_hash[ request_id_hash( req_id) ];
+	osrfAppRequest* req = session->last_request;
+	if( req && req->request_id == req_id )
+		return req;
+
+	if( !session->request_hash )
+		return NULL;
+
+	req = session->request_hash[ request_id_hash( session, req_id ) ];
 	while( req ) {
 		if( req->request_id == req_id )
 			break;
@@ -259,14 +380,24 @@ static osrfAppRequest* find_app_request( const osrfAppSession* session, int req_
 
 	Find the right spot in the hash table; then add the request to the linked list at that
 	spot.  We just add it to the head of the list, without trying to maintain any particular
-	ordering.
+	ordering.  Create the hash table with the first request, and double it whenever the
+	requests outnumber its buckets.
 */
 static void add_app_request( osrfAppSession* session, osrfAppRequest* req ) {
 	if( session && req ) {
-		unsigned int index = request_id_hash( req->request_id );
+		if( !session->request_hash )
+			resize_request_table( session, OSRF_REQUEST_HASH_SIZE );
+		else if( session->request_count >= session->request_hash_size )
+			resize_request_table( session, session->request_hash_size * 2 );
+
+		unsigned int index = request_id_hash( session, req->request_id );
 		req->next = session->request_hash[ index ];
 		req->prev = NULL;
+		if( req->next )
+			req->next->prev = req;
 		session->request_hash[ index ] = req;
+		++session->request_count;
+		session->last_request = req;
 	}
 }
 
@@ -292,14 +423,15 @@ void osrf_app_session_request_reset_timeout( osrfAppSession* session, int req_id
 /**
 	@brief Fetch the next response message to a given previous request, subject to a timeout.
 	@param req Pointer to the osrfAppRequest representing the request.
-	@param timeout Maxmimum time to wait, in seconds.
+	@param timeout Maxmimum time to wait, in milliseconds.
 
 	@return Pointer to the next osrfMessage for this request, if one is available, or if it
 	becomes available before the end of the timeout; otherwise NULL;
 
 	If there is already a message available in the input queue for this request, dequeue and
-	return it immediately.  Otherwise wait up to timeout seconds until you either get an
-	input message for the specified request, run out of time, or encounter an error.
+	return it immediately.  Otherwise wait up to timeout milliseconds until you either get an
+	input message for the specified request, run out of time, or encounter an error.  If
+	@a timeout is negative, don't wait at all.
 
 	If the only message we receive for this request is a STATUS message with a status code
 	OSRF_STATUS_COMPLETE, then return NULL.  That means that the server has nothing further
@@ -320,8 +452,8 @@ static osrfMessage* _osrf_app_request_recv( osrfAppRequest* req, int timeout ) {
 		return tmp_msg;
 	}
 
-	time_t start = time(NULL);
-	time_t remaining = (time_t) timeout;
+	long long deadline = get_monotonic_millis() + timeout;
+	long long remaining = timeout;
 
 	// Wait repeatedly for input messages until you either receive one for the request
 	// you're interested in, run out of time, or encounter an error.
@@ -330,11 +462,11 @@ static osrfMessage* _osrf_app_request_recv( osrfAppRequest* req, int timeout ) {
 	// you're looking for.
 	while( remaining >= 0 ) {
 		/* tell the session to wait for stuff */
-		osrfLogDebug( OSRF_LOG_MARK,  "In app_request receive with remaining time [%d]",
+		osrfLogDebug( OSRF_LOG_MARK,  "In app_request receive with remaining time [%d ms]",
 				(int) remaining );
 
 
-		osrf_app_session_queue_wait( req->session, 0, NULL );
+		osrf_app_session_queue_wait_ms( req->session, 0, NULL );
 		if(req->session->transport_error) {
 			osrfLogError(OSRF_LOG_MARK, "Transport error in recv()");
 			return NULL;
@@ -354,7 +486,7 @@ static osrfMessage* _osrf_app_request_recv( osrfAppRequest* req, int timeout ) {
 		if( req->complete )
 			return NULL;
 
-		osrf_app_session_queue_wait( req->session, (int) remaining, NULL );
+		osrf_app_session_queue_wait_ms( req->session, (int) remaining, NULL );
 
 		if(req->session->transport_error) {
 			osrfLogError(OSRF_LOG_MARK, "Transport error in recv()");
@@ -379,17 +511,16 @@ static osrfMessage* _osrf_app_request_recv( osrfAppRequest* req, int timeout ) {
 		if(req->reset_timeout) {
 			// We got a reprieve.  This happens when a client receives a STATUS message
 			// with a status code OSRF_STATUS_CONTINUE.  We restart the timer from the
-			// beginning -- but only once.  We reset reset_timeout to zero. so that a
-			// second attempted reprieve will allow, at most, only one more second.
-			remaining = (time_t) timeout;
+			// beginning.  We reset reset_timeout to zero, so that it takes another
+			// such STATUS message to earn another reprieve.
+			deadline = get_monotonic_millis() + timeout;
+			remaining = timeout;
 			req->reset_timeout = 0;
 			osrfLogDebug( OSRF_LOG_MARK, "Received a timeout reset");
 		} else {
-			// Subtract the amount of time taken during this loop 
-			// iteration, not the combined time of all iterations.
-			time_t tmp = time(NULL);
-			remaining -= (int) (tmp - start);
-			start = tmp;
+			remaining = deadline - get_monotonic_millis();
+			if( remaining <= 0 )
+				break;
 		}
 	}
 
@@ -463,8 +594,12 @@ char* osrf_app_session_set_tz( osrfAppSession* session, const char* tz ) {
 */
 char* osrfAppSessionSetIngress(const char* ingress) {
 	if (!ingress) return NULL;
-    if(current_ingress) 
+    if(current_ingress) {
+        // Nearly every message carries the same ingress as the last one
+        if(!strcmp(current_ingress, ingress))
+            return current_ingress;
         free(current_ingress);
+    }
     return current_ingress = strdup(ingress);
 }
 
@@ -476,6 +611,30 @@ const char* osrfAppSessionGetIngress() {
     return current_ingress;
 }
 
+/**
+	@brief Install the deadline of the request we're serving, for the requests we make.
+	@param deadline When our client stops waiting, on the monotonic clock in ms; or zero
+		for no deadline.
+	@return The deadline it replaces, so that the caller can restore it.
+
+	Every request sent from now on, by any session, gets this deadline, unless its own
+	time budget (see osrfAppSessionSetTimeBudget()) runs out sooner.
+*/
+long long osrfAppSessionSetDeadline( long long deadline ) {
+	long long prev = current_deadline;
+	current_deadline = deadline > 0 ? deadline : 0;
+	return prev;
+}
+
+/**
+	@brief Return the deadline of the request we're serving.
+	@return When our client stops waiting, on the monotonic clock in ms; or zero if it
+		didn't say, or if we aren't serving a request.
+*/
+long long osrfAppSessionGetDeadline( void ) {
+	return current_deadline;
+}
+
 /**
 	@brief Find the osrfAppSession for a given session id.
 	@param session_id The session id to look for.
@@ -484,27 +643,239 @@ const char* osrfAppSessionGetIngress() {
 	Search the global session cache for the specified session id.
 */
 osrfAppSession* osrf_app_session_find_session( const char* session_id ) {
-	if(session_id)
-		return osrfHashGet( osrfAppSessionCache, session_id );
+	if( !session_id )
+		return NULL;
+
+	evict_idle_sessions();
+
+	session_cache* cache = &osrfAppSessionCache;
+	if( !cache->size )
+		return NULL;
+
+	unsigned int hash = session_id_hash( session_id );
+	osrfAppSession* session = cache->buckets[ hash & ( cache->size - 1 ) ];
+	while( session ) {
+		if( session->cache_hash == hash && !strcmp( session->session_id, session_id )) {
+			touch_session( session );
+			return session;
+		}
+		session = session->cache_next;
+	}
 	return NULL;
 }
 
+/**
+	@brief Set how long a server session may go unused before it is freed.
+	@param seconds The idle timeout, in seconds; zero or less to keep sessions until
+	they are freed explicitly.
+
+	A server normally frees each session when it is done with it.  A session that it
+	never gets back to, such as one started by a stray message, would otherwise stay in
+	the cache for the life of the process.  The timeout should be well beyond the time a
+	server keeps a connected session alive while awaiting the next request.
+*/
+void osrfAppSessionSetIdleTimeout( int seconds ) {
+	session_idle_timeout = seconds > 0 ? seconds : 0;
+}
+
+/**
+	@brief Hash a session id for the global session cache.
+	@param session_id The session id.
+	@return A 32-bit FNV-1a hash of the id.
+*/
+static inline unsigned int session_id_hash( const char* session_id ) {
+	unsigned int h = 2166136261u;
+	while( *session_id ) {
+		h ^= (unsigned char) *session_id++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+	@brief Move the sessions in the global session cache into a table of a different size.
+	@param size The new number of buckets; a power of two.
+*/
+static void resize_session_cache( unsigned int size ) {
+	session_cache* cache = &osrfAppSessionCache;
+	osrfAppSession** old_table = cache->buckets;
+	unsigned int old_size = cache->size;
+
+	cache->buckets = safe_malloc( size * sizeof( osrfAppSession* ));
+	cache->size = size;
+
+	unsigned int i;
+	for( i = 0; i < old_size; ++i ) {
+		osrfAppSession* session = old_table[ i ];
+		while( session ) {
+			osrfAppSession* next = session->cache_next;
+			unsigned int index = session->cache_hash & ( size - 1 );
+			session->cache_next = cache->buckets[ index ];
+			cache->buckets[ index ] = session;
+			session = next;
+		}
+	}
+
+	free( old_table );
+}
 
 /**
 	@brief Add a session to the global session cache, keyed by session id.
 	@param session Pointer to the osrfAppSession to be added.
 
-	If a cache doesn't exist yet, create one.  It's an osrfHash using session ids for the
-	key and osrfAppSessions for the data.
+	Grow the cache if it's getting crowded, and take the chance to evict an idle session
+	or two.
 */
 static void _osrf_app_session_push_session( osrfAppSession* session ) {
-	if( session ) {
-		if( osrfAppSessionCache == NULL )
-			osrfAppSessionCache = osrfNewHash();
-		if( osrfHashGet( osrfAppSessionCache, session->session_id ) )
-			return;   // A session with this id is already in the cache.  Shouldn't happen.
-		osrfHashSet( osrfAppSessionCache, session, session->session_id );
+	if( !session )
+		return;
+
+	evict_idle_sessions();
+
+	session_cache* cache = &osrfAppSessionCache;
+	if( !cache->size )
+		resize_session_cache( OSRF_SESSION_CACHE_SIZE );
+	else if( cache->count >= cache->size )
+		resize_session_cache( cache->size * 2 );
+
+	session->cache_hash = session_id_hash( session->session_id );
+	osrfAppSession** bucket = &cache->buckets[ session->cache_hash & ( cache->size - 1 ) ];
+	session->cache_next = *bucket;
+	*bucket = session;
+	++cache->count;
+
+	session->last_activity = get_monotonic_millis();
+	if( session->type == OSRF_SESSION_SERVER ) {
+		session->newer = NULL;
+		session->older = cache->newest;
+		if( cache->newest )
+			cache->newest->newer = session;
+		else
+			cache->oldest = session;
+		cache->newest = session;
+	}
+}
+
+/**
+	@brief Remove a session from the global session cache.
+	@param session Pointer to the osrfAppSession, which may or may not be in the cache.
+
+	Shrink the cache once it's mostly empty.
+*/
+static void remove_cached_session( osrfAppSession* session ) {
+	session_cache* cache = &osrfAppSessionCache;
+	if( !cache->size )
+		return;
+
+	osrfAppSession** link = &cache->buckets[ session->cache_hash & ( cache->size - 1 ) ];
+	while( *link && *link != session )
+		link = &(*link)->cache_next;
+	if( !*link )
+		return;   // Not in the cache
+	*link = session->cache_next;
+	--cache->count;
+
+	if( session->type == OSRF_SESSION_SERVER ) {
+		if( session->newer )
+			session->newer->older = session->older;
+		else
+			cache->newest = session->older;
+		if( session->older )
+			session->older->newer = session->newer;
+		else
+			cache->oldest = session->newer;
+	}
+
+	if( cache->size > OSRF_SESSION_CACHE_SIZE && cache->count < cache->size / 8 )
+		resize_session_cache( cache->size / 2 );
+}
+
+/**
+	@brief Note that a session has just sent or received a message.
+	@param session Pointer to the osrfAppSession.
+
+	A server session moves to the front of the line for eviction.
+*/
+static inline void touch_session( osrfAppSession* session ) {
+	session->last_activity = get_monotonic_millis();
+
+	// Only the newest session has nothing newer
+	if( session->type != OSRF_SESSION_SERVER || !session->newer )
+		return;
+
+	session_cache* cache = &osrfAppSessionCache;
+
+	session->newer->older = session->older;
+	if( session->older )
+		session->older->newer = session->newer;
+	else
+		cache->oldest = session->newer;
+	session->newer = NULL;
+	session->older = cache->newest;
+	cache->newest->newer = session;
+	cache->newest = session;
+}
+
+/**
+	@brief Free up to two server sessions that have been idle longer than the timeout.
+
+	Called whenever the cache is searched or added to; so, a couple at a time, the idle
+	sessions go away about as fast as new ones come in.  A session still handling
+	messages is spared, and moves to the back of the line.
+*/
+static void evict_idle_sessions( void ) {
+	session_cache* cache = &osrfAppSessionCache;
+	if( !session_idle_timeout || !cache->oldest )
+		return;
+
+	long long cutoff = get_monotonic_millis() - (long long) session_idle_timeout * 1000;
+	int i;
+	for( i = 0; i < 2; ++i ) {
+		osrfAppSession* session = cache->oldest;
+		if( !session || session->last_activity > cutoff )
+			break;
+
+		if( session->in_use ) {
+			touch_session( session );
+			continue;
+		}
+
+		osrfLogInfo( OSRF_LOG_MARK, "Freeing server session %s for %s after %d seconds idle",
+			session->session_id, session->remote_service, session_idle_timeout );
+		osrfAppSessionFree( session );
+	}
+}
+
+/**
+	@brief Get memory for a new osrfAppSession, reusing a spare if there is one.
+	@return Pointer to an osrfAppSession, zeroed.
+*/
+static osrfAppSession* alloc_session( void ) {
+	session_cache* cache = &osrfAppSessionCache;
+	osrfAppSession* session = cache->spares;
+	if( !session )
+		return safe_malloc( sizeof( osrfAppSession ));
+
+	cache->spares = session->cache_next;
+	--cache->spare_count;
+	memset( session, 0, sizeof( osrfAppSession ));
+	return session;
+}
+
+/**
+	@brief Keep a freed osrfAppSession for reuse, or free it if we have enough spares.
+	@param session Pointer to the osrfAppSession, no longer in use.
+*/
+static void release_session( osrfAppSession* session ) {
+	session_cache* cache = &osrfAppSessionCache;
+	if( cache->spare_count >= OSRF_SESSION_SPARES ) {
+		free( session );
+		return;
 	}
+
+	session->cache_next = cache->spares;
+	cache->spares = session;
+	++cache->spare_count;
 }
 
 /**
@@ -531,7 +902,7 @@ osrfAppSession* osrfAppSessionClientInit( const char* remote_service ) {
 		return NULL;
 	}
 
-	osrfAppSession* session = safe_malloc(sizeof(osrfAppSession));
+	osrfAppSession* session = alloc_session();
 
 	// Grab an existing transport_client for talking with Jabber
 	session->transport_handle = osrfSystemGetTransportClient();
@@ -541,24 +912,10 @@ osrfAppSession* osrfAppSessionClientInit( const char* remote_service ) {
 		return NULL;
 	}
 
-	// Get a list of domain names from the config settings;
-	// ignore all but the first one in the list.
-	osrfStringArray* arr = osrfNewStringArray(8);
-	osrfConfigGetValueList(NULL, arr, "/domain");
-	const char* domain = osrfStringArrayGetString(arr, 0);
-	if (!domain) {
-		osrfLogWarning( OSRF_LOG_MARK, "No domains specified in the OpenSRF config file");
-		free( session );
-		osrfStringArrayFree(arr);
-		return NULL;
-	}
-
-	// Get a router name from the config settings.
-	char* router_name = osrfConfigGetValue(NULL, "/router_name");
-	if (!router_name) {
-		osrfLogWarning( OSRF_LOG_MARK, "No router name specified in the OpenSRF config file");
+	// Get the router's Jabber ID from the config settings, unless we already have it
+	const char* router = client_router();
+	if( !router ) {
 		free( session );
-		osrfStringArrayFree(arr);
 		return NULL;
 	}
 
@@ -567,12 +924,7 @@ osrfAppSession* osrfAppSessionClientInit( const char* remote_service ) {
 
 	// Using the router name, domain, and service name,
 	// build a Jabber ID for addressing the service.
-	int len = snprintf( target_buf, sizeof(target_buf), "%s@%s/%s",
-			router_name ? router_name : "(null)",
-			domain ? domain : "(null)",
-			remote_service ? remote_service : "(null)" );
-	osrfStringArrayFree(arr);
-	free(router_name);
+	int len = snprintf( target_buf, sizeof(target_buf), "%s/%s", router, remote_service );
 
 	if( len >= sizeof( target_buf ) ) {
 		osrfLogWarning( OSRF_LOG_MARK, "Buffer overflow for remote_id");
@@ -588,6 +940,7 @@ osrfAppSession* osrfAppSessionClientInit( const char* remote_service ) {
 	session->transport_error = 0;
 	session->panic = 0;
 	session->outbuf = NULL;   // Not used by client
+	session->outbuf_count = 0;
 
 	#ifdef ASSUME_STATELESS
 	session->stateless = 1;
@@ -612,15 +965,131 @@ osrfAppSession* osrfAppSessionClientInit( const char* remote_service ) {
 	session->userData = NULL;
 	session->userDataFree = NULL;
 
-	// Initialize the hash table
-	int i;
-	for( i = 0; i < OSRF_REQUEST_HASH_SIZE; ++i )
-		session->request_hash[ i ] = NULL;
+	// The hash table waits for the first request
+	session->request_hash = NULL;
+	session->request_hash_size = 0;
+	session->request_count = 0;
+	session->last_request = NULL;
+	session->queued_requests = NULL;
+	session->batch = 0;
+	session->last_method = NULL;
+	session->recv_window = OSRF_CHUNK_WINDOW;
+	session->time_budget = 0;
+	session->credit_request = -1;
+	session->send_credit = 0;
+	session->abandoned_request = -1;
+	session->accept_encoding = OSRF_ENCODING_JSON;
+	session->encoding = OSRF_ENCODING_JSON;
 
 	_osrf_app_session_push_session( session );
 	return session;
 }
 
+/**
+	@brief Get the Jabber ID of the router, through which client sessions reach services.
+	@return The ID, as "router_name@domain", or NULL if the configuration lacks either.
+
+	Of the domains in the configuration, use the first.  Once found, the ID is kept for as
+	long as the configuration stays the same.
+*/
+static const char* client_router( void ) {
+	const osrfConfig* cfg = osrfConfigGetDefaultConfig();
+	if( client_router_jid && cfg == client_router_config )
+		return client_router_jid;
+
+	free( client_router_jid );
+	client_router_jid = NULL;
+	client_router_config = cfg;
+
+	// Get a list of domain names from the config settings;
+	// ignore all but the first one in the list.
+	osrfStringArray* arr = osrfNewStringArray(8);
+	osrfConfigGetValueList(NULL, arr, "/domain");
+	const char* domain = osrfStringArrayGetString(arr, 0);
+	if (!domain) {
+		osrfLogWarning( OSRF_LOG_MARK, "No domains specified in the OpenSRF config file");
+		osrfStringArrayFree(arr);
+		return NULL;
+	}
+
+	// Get a router name from the config settings.
+	char* router_name = osrfConfigGetValue(NULL, "/router_name");
+	if (!router_name) {
+		osrfLogWarning( OSRF_LOG_MARK, "No router name specified in the OpenSRF config file");
+		osrfStringArrayFree(arr);
+		return NULL;
+	}
+
+	growing_buffer* buf = buffer_init( 64 );
+	buffer_fadd( buf, "%s@%s", router_name, domain );
+	client_router_jid = buffer_release( buf );
+	osrfStringArrayFree(arr);
+	free(router_name);
+	return client_router_jid;
+}
+
+/**
+	@brief Make a client session ready to serve again, as if newly created.
+	@param session Pointer to the osrfAppSession.
+	@return 0 if successful, or -1 if the session isn't fit for reuse, in which case the
+		caller should free it.
+
+	Disconnect the session if it's connected, and discard its requests, along with any
+	responses still queued for them.  Forget its locale, time zone, user data, and whatever
+	encoding the server agreed to.  Keep the session id and the thread trace, so that a
+	late response to an earlier request is recognized as such, and dropped.
+
+	A pool of client sessions, like the JSON gateway's, thus spares each request the cost
+	of osrfAppSessionClientInit() and osrfAppSessionFree().  A session that has seen a
+	transport error, or a server session, can't be reused.
+*/
+int osrfAppSessionReset( osrfAppSession* session ) {
+	if( !session || session->type != OSRF_SESSION_CLIENT
+			|| session->transport_error || session->panic )
+		return -1;
+
+	osrf_app_session_disconnect( session );
+	session->state = OSRF_SESSION_DISCONNECTED;
+	osrf_app_session_reset_remote( session );
+
+	if( session->userDataFree && session->userData )
+		session->userDataFree( session->userData );
+	session->userData = NULL;
+	session->userDataFree = NULL;
+
+	free( session->session_locale );
+	session->session_locale = NULL;
+	free( session->session_tz );
+	session->session_tz = NULL;
+
+	// Empty the request hash, keeping its buckets for the next requests
+	unsigned int i;
+	for( i = 0; i < session->request_hash_size; ++i ) {
+		osrfAppRequest* app = session->request_hash[ i ];
+		while( app ) {
+			osrfAppRequest* next = app->next;
+			_osrf_app_request_free( app );
+			app = next;
+		}
+		session->request_hash[ i ] = NULL;
+	}
+	session->request_count = 0;
+	session->last_request = NULL;
+	if( session->queued_requests )
+		osrfListClear( session->queued_requests );
+
+	session->batch = 0;
+	session->last_method = NULL;
+	session->recv_window = OSRF_CHUNK_WINDOW;
+	session->time_budget = 0;
+	session->credit_request = -1;
+	session->send_credit = 0;
+	session->abandoned_request = -1;
+	session->accept_encoding = OSRF_ENCODING_JSON;
+	session->encoding = OSRF_ENCODING_JSON;
+	return 0;
+}
+
 /**
 	@brief Create an osrfAppSession for a server.
 	@param session_id The session ID.  In practice this comes from the thread member of
@@ -654,7 +1123,7 @@ osrfAppSession* osrf_app_server_session_init(
 		return NULL;
 	}
 
-	session = safe_malloc(sizeof(osrfAppSession));
+	session = alloc_session();
 
 	// Grab an existing transport_client for talking with Jabber
 	session->transport_handle = osrfSystemGetTransportClient();
@@ -668,10 +1137,10 @@ osrfAppSession* osrf_app_server_session_init(
 	// this determination is pointless because it will immediately be overruled according
 	// to the compile-time macro ASSUME_STATELESS.
 	int stateless = 0;
-	char* statel = osrf_settings_host_value("/apps/%s/stateless", our_app );
+	const char* statel = jsonObjectGetString(
+		osrf_settings_host_value_const( "/apps/%s/stateless", our_app ));
 	if( statel )
 		stateless = atoi( statel );
-	free(statel);
 
 	session->remote_id = strdup(remote_id);
 	session->orig_remote_id = strdup(remote_id);
@@ -695,13 +1164,25 @@ osrfAppSession* osrf_app_server_session_init(
 	session->userDataFree = NULL;
 	session->transport_error = 0;
 
-	// Initialize the hash table
-	int i;
-	for( i = 0; i < OSRF_REQUEST_HASH_SIZE; ++i )
-		session->request_hash[ i ] = NULL;
+	// The hash table waits for the first request
+	session->request_hash = NULL;
+	session->request_hash_size = 0;
+	session->request_count = 0;
+	session->last_request = NULL;
+	session->queued_requests = NULL;
+	session->batch = 0;
+	session->last_method = NULL;
+	session->recv_window = OSRF_CHUNK_WINDOW;
+	session->time_budget = 0;
+	session->credit_request = -1;
+	session->send_credit = 0;
+	session->abandoned_request = -1;
+	session->accept_encoding = OSRF_ENCODING_JSON;
+	session->encoding = OSRF_ENCODING_JSON;
 
 	session->panic = 0;
 	session->outbuf = buffer_init( 4096 );
+	session->outbuf_count = 0;
 
 	_osrf_app_session_push_session( session );
 	return session;
@@ -741,7 +1222,7 @@ int osrfAppSessionMakeRequest(
 	osrfLogWarning( OSRF_LOG_MARK, "Function osrfAppSessionMakeRequest() is deprecated; "
 			"call osrfAppSessionSendRequest() instead" );
 	return osrfAppSessionMakeLocaleRequest( session, params,
-			method_name, protocol, param_strings, NULL );
+			method_name, protocol, param_strings, NULL, 0 );
 }
 
 /**
@@ -762,7 +1243,81 @@ int osrfAppSessionSendRequest( osrfAppSession* session, const jsonObject* params
 		const char* method_name, int protocol ) {
 
 	return osrfAppSessionMakeLocaleRequest( session, params,
-		 method_name, protocol, NULL, NULL );
+		 method_name, protocol, NULL, NULL, 0 );
+}
+
+/**
+	@brief Create a REQUEST message and save it, to be sent later with others.
+	@param session Pointer to the current session, which has the addressing information.
+	@param params The parameters for the method, as for osrfAppSessionSendRequest().
+	@param method_name The name of the method to be called.
+	@param protocol Protocol.
+	@return The request ID of the resulting REQUEST message, or -1 upon error.
+
+	The request is pending from now on, as if it had been sent, but it doesn't go out
+	until the next call to osrfAppSessionSendQueued().  Queue several requests and send
+	them together, and they travel to the server in a single transport message.
+*/
+int osrfAppSessionQueueRequest( osrfAppSession* session, const jsonObject* params,
+		const char* method_name, int protocol ) {
+
+	return osrfAppSessionMakeLocaleRequest( session, params,
+		 method_name, protocol, NULL, NULL, 1 );
+}
+
+/**
+	@brief Send all the queued REQUEST messages of a session.
+	@param session Pointer to the osrfAppSession.
+	@return The number of requests sent, or -1 upon failure.
+
+	The requests go out together, up to OSRF_MAX_MSGS_PER_PACKET of them per transport
+	message.  A server answers them in the order sent, bundling the responses to as many as
+	it can into each transport message of its own.
+*/
+int osrfAppSessionSendQueued( osrfAppSession* session ) {
+	if( !session )
+		return -1;
+	if( !session->queued_requests )
+		return 0;
+
+	osrfMessage* msgs[ OSRF_MAX_MSGS_PER_PACKET ];
+	int count = 0;
+	int sent = 0;
+	int rc = 0;
+
+	unsigned int i;
+	for( i = 0; i < session->queued_requests->size; ++i ) {
+		osrfAppRequest* req = osrfListGetIndex( session->queued_requests, i );
+		if( !req )
+			continue;   // finished before it was sent
+		req->queued = 0;
+		msgs[ count++ ] = req->payload;
+
+		if( count == OSRF_MAX_MSGS_PER_PACKET ) {
+			if( osrfAppSessionSendBatch( session, msgs, count ) )
+				rc = -1;
+			sent += count;
+			count = 0;
+		}
+	}
+
+	if( count ) {
+		if( osrfAppSessionSendBatch( session, msgs, count ) )
+			rc = -1;
+		sent += count;
+	}
+
+	osrfListClear( session->queued_requests );
+
+	if( rc ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Error sending queued requests for session [%s]",
+			session->session_id );
+		return -1;
+	}
+
+	osrfLogDebug( OSRF_LOG_MARK, "Sent %d queued requests for session [%s]",
+		sent, session->session_id );
+	return sent;
 }
 
 /**
@@ -773,17 +1328,19 @@ int osrfAppSessionSendRequest( osrfAppSession* session, const jsonObject* params
 	@param protocol Protocol.
 	@param param_strings Another way of specifying the parameters for the method.
 	@param locale Pointer to a locale string.
+	@param queue Boolean: if true, queue the message for osrfAppSessionSendQueued()
+	instead of sending it now.
 	@return The request ID of the resulting REQUEST message, or -1 upon error.
 
 	See the discussion of osrfAppSessionSendRequest(), which at this writing is the only
-	place that calls this function, except for the similar but deprecated function
-	osrfAppSessionMakeRequest().
+	place that calls this function, except for osrfAppSessionQueueRequest() and the
+	similar but deprecated function osrfAppSessionMakeRequest().
 
 	At this writing, the @a param_strings and @a locale parameters are always NULL.
 */
 static int osrfAppSessionMakeLocaleRequest(
 		osrfAppSession* session, const jsonObject* params, const char* method_name,
-		int protocol, osrfStringArray* param_strings, char* locale ) {
+		int protocol, osrfStringArray* param_strings, char* locale, int queue ) {
 
 	if(session == NULL) return -1;
 
@@ -799,6 +1356,16 @@ static int osrfAppSessionMakeLocaleRequest(
 	}
 
 	osrf_message_set_tz(req_msg, session->session_tz);
+	req_msg->window = session->recv_window;
+	req_msg->encoding = session->accept_encoding;
+
+	// Pass along what's left of our own client's patience, if it's less than ours
+	req_msg->deadline = current_deadline;
+	if( session->time_budget > 0 ) {
+		long long deadline = get_monotonic_millis() + session->time_budget;
+		if( !req_msg->deadline || deadline < req_msg->deadline )
+			req_msg->deadline = deadline;
+	}
 
 	if (!current_ingress)
 		osrfAppSessionSetIngress("opensrf");
@@ -819,11 +1386,37 @@ static int osrfAppSessionMakeLocaleRequest(
 	}
 
 	osrfAppRequest* req = _osrf_app_request_init( session, req_msg );
-	if(_osrf_app_session_send( session, req_msg ) ) {
-		osrfLogWarning( OSRF_LOG_MARK,  "Error sending request message [%d]",
-				session->thread_trace );
-		_osrf_app_request_free(req);
-		return -1;
+
+	// Time the request until it's complete, as a span of whatever we're doing now
+	if( osrfTraceEnabled() ) {
+		req->span = safe_malloc( sizeof( osrfSpan ));
+		if( osrfSpanStart( req->span, method_name, OSRF_SPAN_CLIENT, 0.0 ))
+			osrfSpanSetAttr( req->span, "rpc.service", session->remote_service );
+		else {
+			free( req->span );
+			req->span = NULL;
+		}
+	}
+
+	if( queue ) {
+		if( !session->queued_requests )
+			session->queued_requests = osrfNewList();
+		osrfListPush( session->queued_requests, req );
+		req->queued = 1;
+
+	} else {
+		// The request goes out as part of its own span
+		osrfSpanActivate( req->span );
+		int rc = _osrf_app_session_send( session, req_msg );
+		osrfSpanDeactivate( req->span );
+		if( rc ) {
+			osrfLogWarning( OSRF_LOG_MARK,  "Error sending request message [%d]",
+					session->thread_trace );
+			if( req->span )
+				req->span->error = 1;
+			_osrf_app_request_free(req);
+			return -1;
+		}
 	}
 
 	osrfLogDebug( OSRF_LOG_MARK,  "Pushing [%d] onto request queue for session [%s] [%s]",
@@ -842,8 +1435,10 @@ void osrf_app_session_set_complete( osrfAppSession* session, int request_id ) {
 		return;
 
 	osrfAppRequest* req = find_app_request( session, request_id );
-	if(req)
+	if(req) {
 		req->complete = 1;
+		osrfSpanEnd( req->span );
+	}
 }
 
 /**
@@ -911,6 +1506,8 @@ void osrf_app_session_push_queue( osrfAppSession* session, osrfMessage* msg ) {
 		osrfAppRequest* req = find_app_request( session, msg->thread_trace );
 		if( req )
 			_osrf_app_request_push_queue( req, msg );
+		else
+			osrfMessageFree( msg );  // a late response to a request we've given up on
 	}
 }
 
@@ -939,6 +1536,7 @@ int osrfAppSessionConnect( osrfAppSession* session ) {
 
 	/* defaulting to protocol 1 for now */
 	osrfMessage* con_msg = osrf_message_init( CONNECT, session->thread_trace, 1 );
+	con_msg->encoding = session->accept_encoding;
 
 	// Address this message to the router
 	osrf_app_session_reset_remote( session );
@@ -948,18 +1546,18 @@ int osrfAppSessionConnect( osrfAppSession* session ) {
 	if(ret)
 		return 0;
 
-	time_t start = time(NULL);
-	time_t remaining = (time_t) timeout;
+	long long deadline = get_monotonic_millis() + timeout * 1000;
+	long long remaining = timeout * 1000;
 
 	// Wait for the acknowledgement.  We look for it repeatedly because, under the covers,
 	// we may receive and process messages other than the one we're looking for.
-	while( session->state != OSRF_SESSION_CONNECTED && remaining >= 0 ) {
-		osrf_app_session_queue_wait( session, remaining, NULL );
+	while( session->state != OSRF_SESSION_CONNECTED && remaining > 0 ) {
+		osrf_app_session_queue_wait_ms( session, (int) remaining, NULL );
 		if(session->transport_error) {
 			osrfLogError(OSRF_LOG_MARK, "cannot communicate with %s", session->remote_service);
 			return 0;
 		}
-		remaining -= (int) (time(NULL) - start);
+		remaining = deadline - get_monotonic_millis();
 	}
 
 	if(session->state == OSRF_SESSION_CONNECTED)
@@ -1023,7 +1621,10 @@ int osrf_app_session_request_resend( osrfAppSession* session, int req_id ) {
 		rc = 0;
 	} else if(!req->complete) {
 		osrfLogDebug( OSRF_LOG_MARK, "Resending request [%d]", req->request_id );
+		osrfSpanAddEvent( req->span, "resend" );
+		osrfSpanActivate( req->span );
 		rc = _osrf_app_session_send( req->session, req->payload );
+		osrfSpanDeactivate( req->span );
 	} else {
 		rc = 1;
 	}
@@ -1037,12 +1638,59 @@ int osrf_app_session_request_resend( osrfAppSession* session, int req_id ) {
 	@param msgs Pointer to an array of pointers to osrfMessages.
 	@param size How many messages to send.
 	@return 0 upon success, or -1 upon failure.
+
+	The messages travel together in a single transport message.
+
+	While a server session is answering a batch of requests, the messages are appended to
+	its output buffer instead, to go out with the rest of the responses when the batch is
+	done, or sooner if the buffer fills.
 */
-static int osrfAppSessionSendBatch( osrfAppSession* session, osrfMessage* msgs[], int size ) {
+int osrfAppSessionSendBatch( osrfAppSession* session, osrfMessage* msgs[], int size ) {
 
 	if( !(session && msgs && size > 0) ) return -1;
 	int retval = 0;
 
+	touch_session( session );
+
+	if( session->batch && session->outbuf && OSRF_ENCODING_MSGPACK == session->encoding ) {
+		// The buffer holds MessagePack, counted; pack our messages onto the end of it
+		growing_buffer* packed = buffer_init( 256 );
+		int i;
+		for( i = 0; i < size; ++i ) {
+			if( msgs[ i ] )
+				osrfMessageAddMsgpack( packed, msgs[ i ], NULL );
+		}
+
+		size_t len_so_far = buffer_length( session->outbuf );
+		if( len_so_far && (len_so_far + buffer_length( packed )) / 3 * 4 >= OSRF_MSG_BUNDLE_SIZE )
+			retval = osrfAppSessionFlush( session );
+
+		buffer_add_n( session->outbuf, OSRF_BUFFER_C_STR( packed ), buffer_length( packed ));
+		for( i = 0; i < size; ++i ) {
+			if( msgs[ i ] )
+				++session->outbuf_count;
+		}
+		buffer_free( packed );
+		return retval;
+	}
+
+	if( session->batch && session->outbuf ) {
+		char* string = osrfMessageSerializeBatch( msgs, size );
+		if( !string )
+			return -1;
+
+		size_t len = strlen( string );
+		size_t len_so_far = buffer_length( session->outbuf );
+		if( len_so_far && len_so_far + len >= OSRF_MSG_BUNDLE_SIZE )
+			retval = osrfAppSessionFlush( session );
+
+		// The buffer holds a JSON array still open at the end; add our elements to it
+		buffer_add_char( session->outbuf, buffer_length( session->outbuf ) ? ',' : '[' );
+		buffer_add_n( session->outbuf, string + 1, len - 2 );
+		free( string );
+		return retval;
+	}
+
 	osrfMessage* msg = msgs[0];
 
 	if(msg) {
@@ -1073,8 +1721,9 @@ static int osrfAppSessionSendBatch( osrfAppSession* session, osrfMessage* msgs[]
 		}
 	}
 
-	// Translate the collection of osrfMessages into a JSON array
-	char* string = osrfMessageSerializeBatch(msgs, size);
+	// Translate the collection of osrfMessages into a JSON array, or whatever encoding
+	// the other side has asked for
+	char* string = osrfMessageSerializeBatchEncoded( msgs, size, session->encoding );
 
 	// Send the JSON as the payload of a transport_message
 	if( string ) {
@@ -1085,76 +1734,247 @@ static int osrfAppSessionSendBatch( osrfAppSession* session, osrfMessage* msgs[]
 	return retval;
 }
 
+/**
+	@brief Tell whether a byte goes into a chunk as is, neither JSON- nor XML-escaped.
+	@param c The byte.
+	@return Non-zero if the byte needs no escaping, or zero if it does.
+*/
+static inline int plain_chunk_byte( unsigned char c ) {
+	return c < 0x80 && is_utf8_print( c )
+		&& c != '"' && c != '\\' && c != '<' && c != '>' && c != '&';
+}
+
+/**
+	@brief Encode the next character of a payload as it goes into a chunk.
+	@param s Pointer to the next byte of the payload.
+	@param avail How many bytes of the payload are left; at least one.
+	@param buf Pointer to a buffer of at least 8 bytes, for escaping an ASCII character.
+	@param scratch Pointer to a growing_buffer, for escaping any other character.
+	@param used Pointer through which to return how many bytes of the payload were consumed.
+	@return The character as it appears inside a JSON string literal; possibly empty, if
+		the payload isn't valid UTF-8 here.
+
+	The escaping is the same as buffer_append_utf8() does for the whole string.  A UTF-8
+	sequence is taken whole, so that a chunk never ends in the middle of one.
+*/
+static const char* encode_chunk_char( const unsigned char* s, size_t avail, char* buf,
+		growing_buffer* scratch, size_t* used ) {
+	unsigned char c = *s;
+	*used = 1;
+
+	if( c < 0x80 ) {
+		if( is_utf8_print( c ) ) {
+			if( '"' == c || '\\' == c ) {
+				buf[ 0 ] = '\\';
+				buf[ 1 ] = c;
+				buf[ 2 ] = '\0';
+			} else {
+				buf[ 0 ] = c;
+				buf[ 1 ] = '\0';
+			}
+		} else {
+			switch( c ) {
+				case '\n' : strcpy( buf, "\\n" ); break;
+				case '\t' : strcpy( buf, "\\t" ); break;
+				case '\r' : strcpy( buf, "\\r" ); break;
+				case '\f' : strcpy( buf, "\\f" ); break;
+				case '\b' : strcpy( buf, "\\b" ); break;
+				default   : snprintf( buf, 8, "\\u%04x", c ); break;
+			}
+		}
+		return buf;
+	}
+
+	size_t len = 1;
+	if( is_utf8_2_byte( c ) )
+		len = 2;
+	else if( is_utf8_3_byte( c ) )
+		len = 3;
+	else if( is_utf8_4_byte( c ) )
+		len = 4;
+
+	// Stop short at a missing continuation byte; the encoder drops the fragment
+	size_t n = 1;
+	while( n < len && n < avail && is_utf8_continue( s[ n ] ) )
+		++n;
+	*used = n;
+
+	char seq[ 5 ];
+	memcpy( seq, s, n );
+	seq[ n ] = '\0';
+
+	buffer_reset( scratch );
+	buffer_append_utf8( scratch, seq );
+	return scratch->buf;
+}
+
+/**
+	@brief Send a transport message to the remote party of a session.
+	@param session Pointer to the osrfAppSession.
+	@param t_msg Pointer to the transport_message, which this function frees.
+	@return 0 upon success.  Upon failure, exit.
+*/
+static int send_transport_message( osrfAppSession* session, transport_message* t_msg ) {
+	message_set_osrf_xid( t_msg, osrfLogGetXid() );
+	message_set_osrf_span( t_msg, osrfTraceGetContext() );
+
+	int retval = client_send_message( session->transport_handle, t_msg );
+	if( retval ) {
+		osrfLogError( OSRF_LOG_MARK, "client_send_message failed, exit()ing immediately" );
+		exit(99);
+	}
+
+	osrfLogInfo(OSRF_LOG_MARK, "[%s] sent %d bytes of data to %s",
+		session->remote_service, strlen( t_msg->body ), t_msg->recipient );
+
+	osrfLogDebug( OSRF_LOG_MARK, "Sent: %s", t_msg->body );
+
+	message_free( t_msg );
+	return retval;
+}
+
+/**
+	@brief Decide whether a response is too big to go in a single message.
+	@param payload The response, serialized as JSON.
+	@param payload_size Length of @a payload.
+	@param chunk_size Most bytes of content per message, as they go over the wire; zero
+		means no limit.
+	@return Non-zero if the response should go out in chunks, via osrfSendChunkedResult().
+
+	XML escaping adds at most four bytes per byte of JSON, so the payload is measured only
+	when it is big enough for the escaping to make a difference.
+*/
+int osrfNeedsChunking( const char* payload, size_t payload_size, size_t chunk_size ) {
+	if( 0 == chunk_size || payload_size <= chunk_size / 5 )
+		return 0;
+	if( payload_size > chunk_size )
+		return 1;
+	return osrfXmlEscapeSize( payload ) > chunk_size;
+}
+
 /**
 	@brief Split a given string into one or more transport result messages and send it
 	@param session Pointer to the osrfAppSession responsible for sending the message(s).
 	@param request_id Request ID of the osrfAppRequest.
 	@param payload A string to be sent via Jabber.
 	@param payload_size length of payload
-	@param chunk_size chunk_size to use
+	@param chunk_size Most bytes of content per chunk, counted as they go over the wire.
 
 	@return 0 upon success, or -1 upon failure.
+
+	The payload is walked once.  Each chunk carries a piece of it as a JSON string, and
+	both the JSON and its XML-escaped form are built together; the latter goes out as the
+	ready-made body of the stanza, so the transport doesn't escape the chunk again.  A
+	chunk ends where the next character, once escaped both ways, would take the content
+	past @a chunk_size.  No escape sequence or UTF-8 character is split between chunks.
+
+	The chunks are held back and sent together once the last one is ready -- unless the
+	client asked for flow control, in which case they go out as it grants credit for them.
 */
 int osrfSendChunkedResult(
         osrfAppSession* session, int request_id, const char* payload,
         size_t payload_size, size_t chunk_size ) {
 
-	// chunking payload
-	int i;
-	for (i = 0; i < payload_size; i += chunk_size) {
-		osrfMessage* msg = osrf_message_init(RESULT, request_id, 1);
-		osrf_message_set_status_info(msg,
-			"osrfResultPartial",
-			"Partial Response",
-			OSRF_STATUS_PARTIAL
-		);
-
-		// see how long this chunk is.  If this is the last
-		// chunk, it will likely be less than chunk_size
-		int partial_size = strlen(&payload[i]);
-		if (partial_size > chunk_size)
-			partial_size = chunk_size;
-
-		// substr(data, i, partial_size)
-		char partial_buf[partial_size + 1];
-		memcpy(partial_buf, &payload[i], partial_size);
-		partial_buf[partial_size] = '\0';
-
-		// package the partial chunk as a JSON string object
-		jsonObject*  partial_obj = jsonNewObject(partial_buf);
-		osrf_message_set_result(msg, partial_obj);
-		jsonObjectFree(partial_obj);
-
-		// package the osrf message within an array then
-		// serialize to json for delivery
-		jsonObject* arr = jsonNewObject(NULL);
-
-		// msg json freed when arr is freed
-		jsonObjectPush(arr, osrfMessageToJSON(msg));
-		char* json = jsonObjectToJSON(arr);
-
-		osrfSendTransportPayload(session, json);
-		osrfMessageFree(msg);
-		jsonObjectFree(arr);
-		free(json);
+	osrfAppSessionCork( session );
+
+	// Every chunk has the same envelope around it; build it once, both ways
+	osrfMessage msg;
+	memset( &msg, 0, sizeof( msg ) );
+	msg.m_type = RESULT;
+	msg.thread_trace = request_id;
+	msg.protocol = 1;
+	msg.status_text = "Partial Response";
+	msg.status_code = OSRF_STATUS_PARTIAL;
+
+	growing_buffer* head = buffer_init( 256 );
+	OSRF_BUFFER_ADD_CHAR( head, '[' );
+	osrfMessageAddResultPrefix( head, &msg );
+	OSRF_BUFFER_ADD_CHAR( head, '"' );
+
+	growing_buffer* head_xml = buffer_init( 256 );
+	buffer_add_xml_escaped( head_xml, head->buf );
+
+	static const char tail[] = "\"" OSRF_RESULT_JSON_SUFFIX "]";
+
+	growing_buffer* scratch = buffer_init( 16 );
+	const unsigned char* s = (const unsigned char*) payload;
+	const unsigned char* end = s + payload_size;
+	int rc = 0;
+
+	while( s < end ) {
+		// Don't get further ahead of the client than it allows
+		if( osrfAppSessionAwaitCredit( session, request_id ) ) {
+			rc = -1;
+			break;
+		}
+
+		// The escaped content can't be shorter than the raw content
+		growing_buffer* body = buffer_init( head->n_used + chunk_size + sizeof( tail ) );
+		growing_buffer* xml  = buffer_init( head_xml->n_used + chunk_size + sizeof( tail ) );
+		buffer_add_n( body, head->buf, head->n_used );
+		buffer_add_n( xml, head_xml->buf, head_xml->n_used );
+
+		size_t content = 0;
+		while( s < end ) {
+			// Copy a run of bytes that need no escaping either way in one go
+			size_t room = chunk_size > content ? chunk_size - content : 0;
+			size_t run = 0;
+			while( run < room && s + run < end && plain_chunk_byte( s[ run ] ) )
+				++run;
+			if( run ) {
+				buffer_add_n( body, (const char*) s, run );
+				buffer_add_n( xml, (const char*) s, run );
+				content += run;
+				s += run;
+				continue;
+			}
+
+			char buf[ 8 ];
+			size_t used;
+			const char* text = encode_chunk_char( s, end - s, buf, scratch, &used );
+			size_t cost = osrfXmlEscapeSize( text );
+			if( content > 0 && content + cost > chunk_size )
+				break;
+
+			OSRF_BUFFER_ADD( body, text );
+			buffer_add_xml_escaped( xml, text );
+			content += cost;
+			s += used;
+		}
+
+		OSRF_BUFFER_ADD( body, tail );
+		OSRF_BUFFER_ADD( xml, tail );
+
+		transport_message* t_msg = message_init(
+			NULL, "", session->session_id, session->remote_id, NULL );
+		message_adopt_body( t_msg, buffer_release( body ));
+		message_adopt_body_xml( t_msg, buffer_release( xml ));
+		send_transport_message( session, t_msg );
+	}
+
+	buffer_free( scratch );
+	buffer_free( head_xml );
+	buffer_free( head );
+
+	if( rc ) {
+		osrfAppSessionUncork( session );
+		return -1;
 	}
 
 	// all chunks sent; send the final partial-complete msg
-	osrfMessage* msg = osrf_message_init(RESULT, request_id, 1);
-	osrf_message_set_status_info(msg,
+	osrfMessage* done = osrf_message_init(RESULT, request_id, 1);
+	osrf_message_set_status_info(done,
 		"osrfResultPartialComplete",
 		"Partial Response Finalized",
 		OSRF_STATUS_NOCONTENT
 	);
 
-	jsonObject* arr = jsonNewObject(NULL);
-	jsonObjectPush(arr, osrfMessageToJSON(msg));
-	char* json = jsonObjectToJSON(arr);
+	char* json = osrfMessageSerializeBatchEncoded( &done, 1, session->encoding );
 	osrfSendTransportPayload(session, json);
-	osrfMessageFree(msg);
-	jsonObjectFree(arr);
+	osrfMessageFree(done);
 	free(json);
 
+	osrfAppSessionUncork( session );
 	return 0;
 }
 
@@ -1168,23 +1988,231 @@ int osrfSendChunkedResult(
 	about it.
 */
 int osrfSendTransportPayload( osrfAppSession* session, const char* payload ) {
-	transport_message* t_msg = message_init(
-		payload, "", session->session_id, session->remote_id, NULL );
-	message_set_osrf_xid( t_msg, osrfLogGetXid() );
+	return send_transport_message( session, message_init(
+		payload, "", session->session_id, session->remote_id, NULL ));
+}
 
-	int retval = client_send_message( session->transport_handle, t_msg );
-	if( retval ) {
-		osrfLogError( OSRF_LOG_MARK, "client_send_message failed, exit()ing immediately" );
-		exit(99);
+/**
+	@brief Set how many chunks of a partial response the server may send ahead of us.
+	@param session Pointer to the client's osrfAppSession.
+	@param window Number of chunks, or zero to turn flow control off.
+
+	Applies to requests made from now on.  Servers that don't know about flow control
+	ignore it.
+*/
+void osrfAppSessionSetWindow( osrfAppSession* session, int window ) {
+	if( session )
+		session->recv_window = window > 0 ? window : 0;
+}
+
+/**
+	@brief Set how long the server has to answer each request.
+	@param session Pointer to the client's osrfAppSession.
+	@param ms Milliseconds from when a request is made, or zero for no limit.
+
+	Applies to requests made from now on.  A request that is still waiting for a drone when
+	its time is up is dropped, and one that has reached a drone too late isn't run; either
+	way the answer is a STATUS of OSRF_STATUS_DEADLINEEXCEEDED, in case we're still
+	listening.  Typically the budget matches the timeout with which we'll wait for the
+	responses.  Servers that don't know about deadlines ignore them.
+*/
+void osrfAppSessionSetTimeBudget( osrfAppSession* session, int ms ) {
+	if( session )
+		session->time_budget = ms > 0 ? ms : 0;
+}
+
+/**
+	@brief Ask the server to send us message bodies in a given encoding.
+	@param session Pointer to the client's osrfAppSession.
+	@param encoding OSRF_ENCODING_JSON, or OSRF_ENCODING_MSGPACK.
+
+	Applies to connections and requests made from now on.  A server that agrees to a
+	CONNECT says so in its reply, and from then on we send our requests in the same
+	encoding.  A stateless request gets its responses in the encoding, but is itself
+	sent as JSON.  A server that doesn't know about encodings ignores the request and
+	answers in JSON, which we always understand.
+
+	The chunks of a partial response still come as JSON, since each one carries a slice
+	of JSON text; everything else in the response, including the message that ends the
+	chunks, comes in the encoding.
+*/
+void osrfAppSessionSetEncoding( osrfAppSession* session, int encoding ) {
+	if( session )
+		session->accept_encoding =
+			OSRF_ENCODING_MSGPACK == encoding ? OSRF_ENCODING_MSGPACK : OSRF_ENCODING_JSON;
+}
+
+/**
+	@brief As a client, allow the server to send more chunks of a partial response.
+	@param session Pointer to the osrfAppSession.
+	@param request_id Request ID of the request being answered.
+	@param chunks How many more chunks to allow.
+
+	Called while the stack is processing input, so send the STATUS message straight to
+	the transport rather than through osrfAppSessionSendBatch(), which would read input
+	first.  It goes to whichever drone is answering, since receiving its chunks set our
+	remote ID to it.
+*/
+static void grant_credit( osrfAppSession* session, int request_id, int chunks ) {
+	osrfMessage* msg = osrf_message_init( STATUS, request_id, 1 );
+	osrf_message_set_status_info( msg, "osrfFlowCredit", "Credit", OSRF_STATUS_CREDIT );
+	msg->window = chunks;
+
+	char* json = osrfMessageSerializeBatch( &msg, 1 );
+	if( json ) {
+		osrfSendTransportPayload( session, json );
+		free( json );
 	}
+	osrfMessageFree( msg );
+}
 
-	osrfLogInfo(OSRF_LOG_MARK, "[%s] sent %d bytes of data to %s",
-		session->remote_service, strlen( payload ), t_msg->recipient );
+/**
+	@brief As a server, wait until the client will take another chunk of a partial response.
+	@param session Pointer to the server's osrfAppSession.
+	@param request_id Request ID of the request being answered.
+	@return 0 when the chunk may go, or -1 if the client granted nothing in time.
+
+	If the client didn't ask for flow control, there is never any waiting.  Otherwise use
+	up one chunk of credit, first waiting for more if there is none left.  Anything held
+	back by osrfAppSessionCork() goes out before we wait, since the client can't grant
+	credit for chunks it hasn't seen.  Its grants arrive as STATUS messages, which the
+	stack adds to send_credit.
+
+	A request that times out is marked abandoned, and fails at once from then on; see
+	osrfAppSessionAbandoned().
+*/
+int osrfAppSessionAwaitCredit( osrfAppSession* session, int request_id ) {
+	if( osrfAppSessionAbandoned( session, request_id ))
+		return -1;
+	if( !session || session->credit_request != request_id )
+		return 0;
 
-	osrfLogDebug( OSRF_LOG_MARK, "Sent: %s", payload );
+	if( session->send_credit <= 0 ) {
+		client_flush( session->transport_handle );
+
+		long long deadline = get_monotonic_millis() + OSRF_CREDIT_TIMEOUT * 1000;
+		while( session->send_credit <= 0 ) {
+			long long remaining = deadline - get_monotonic_millis();
+			if( remaining <= 0 ) {
+				osrfLogWarning( OSRF_LOG_MARK, "Client granted no more chunks for request %d "
+					"within %d seconds; abandoning the response", request_id,
+					OSRF_CREDIT_TIMEOUT );
+				session->abandoned_request = request_id;
+				return -1;
+			}
 
-	message_free( t_msg );
-	return retval;
+			if( osrf_app_session_queue_wait_ms( session, (int) remaining, NULL ) < 0
+					|| session->transport_error ) {
+				osrfLogError( OSRF_LOG_MARK, "Transport error awaiting flow control credit" );
+				session->abandoned_request = request_id;
+				return -1;
+			}
+
+			if( session->credit_request != request_id )
+				return 0;   // no longer flow-controlled (shouldn't happen)
+		}
+	}
+
+	--session->send_credit;
+	return 0;
+}
+
+/**
+	@brief As a server, tell whether we have given up on responding to a request.
+	@param session Pointer to the server's osrfAppSession.
+	@param request_id Request ID of the request being answered.
+	@return Non-zero if osrfAppSessionAwaitCredit() abandoned the request.
+
+	Once the client stops granting credit, anything more we sent for the request --
+	further responses, or the STATUS message saying it's complete -- would only mislead
+	it, so it all fails instead.
+*/
+int osrfAppSessionAbandoned( const osrfAppSession* session, int request_id ) {
+	return session && session->abandoned_request >= 0
+		&& session->abandoned_request == request_id;
+}
+
+/**
+	@brief Send whatever response messages have accumulated in a server's output buffer.
+	@param session Pointer to the osrfAppSession.
+	@return 0 upon success, or -1 upon failure.
+
+	The buffer holds a JSON array with its closing bracket still to come.  Close it, send
+	it as a single transport message, and empty the buffer.  A session with nothing
+	buffered, or no buffer at all, has nothing to do.
+
+	If the client asked for MessagePack, the buffer holds the packed messages instead,
+	one after another; wrap them up in an array header and send that.
+*/
+int osrfAppSessionFlush( osrfAppSession* session ) {
+	if( !session || !session->outbuf )
+		return 0;
+
+	int rc = 0;
+	if( buffer_length( session->outbuf ) > 0 ) {    // If there's anything to send...
+		const char* body;
+		char* packed = NULL;
+		if( OSRF_ENCODING_MSGPACK == session->encoding ) {
+			packed = osrfMsgpackArrayText( OSRF_BUFFER_C_STR( session->outbuf ),
+				buffer_length( session->outbuf ), session->outbuf_count );
+			body = packed;
+		} else {
+			buffer_add_char( session->outbuf, ']' );    // Close the JSON array
+			body = OSRF_BUFFER_C_STR( session->outbuf );
+		}
+		if( osrfSendTransportPayload( session, body )) {
+			osrfLogError( OSRF_LOG_MARK, "Unable to flush response buffer" );
+			rc = -1;
+		}
+		free( packed );
+	}
+	buffer_reset( session->outbuf );
+	session->outbuf_count = 0;
+	return rc;
+}
+
+/**
+	@brief As a server, answer in a given encoding from now on.
+	@param session Pointer to the server's osrfAppSession.
+	@param encoding OSRF_ENCODING_JSON, or OSRF_ENCODING_MSGPACK.
+	@return 0 upon success, or -1 if unable to flush the output buffer.
+
+	The output buffer holds its messages in the encoding they are to go out in, so send
+	anything already there before switching to another one.
+*/
+int osrfAppSessionUseEncoding( osrfAppSession* session, int encoding ) {
+	if( !session || session->encoding == encoding )
+		return 0;
+
+	int rc = osrfAppSessionFlush( session );
+	session->encoding = encoding;
+	return rc;
+}
+
+/**
+	@brief Hold back outgoing transport messages, to be sent together later.
+	@param session Pointer to the osrfAppSession.
+
+	Until the matching call to osrfAppSessionUncork(), messages sent for this session are
+	queued in the transport layer rather than written to the socket one at a time.  Calls
+	may be nested; the queue goes out when the outermost one is undone.
+*/
+void osrfAppSessionCork( osrfAppSession* session ) {
+	if( session )
+		client_cork( session->transport_handle );
+}
+
+/**
+	@brief Undo a call to osrfAppSessionCork(), sending any messages held back.
+	@param session Pointer to the osrfAppSession.
+
+	As with osrfSendTransportPayload(), a failure to send is fatal.
+*/
+void osrfAppSessionUncork( osrfAppSession* session ) {
+	if( session && client_uncork( session->transport_handle ) ) {
+		osrfLogError( OSRF_LOG_MARK, "client_uncork failed, exit()ing immediately" );
+		exit(99);
+	}
 }
 
 /**
@@ -1220,6 +2248,8 @@ static int _osrf_app_session_send( osrfAppSession* session, osrfMessage* msg ){
 	transport_session (to talk to the Jabber server), and all app sessions in that process
 	use the same transport_session.
 
+	A thin wrapper for osrf_app_session_queue_wait_ms().
+
 	Hence this function indiscriminately waits for input messages for all osrfAppSessions
 	tied to the same Jabber session, not just the one specified.
 
@@ -1230,9 +2260,24 @@ static int _osrf_app_session_send( osrfAppSession* session, osrfMessage* msg ){
 	requested method.  And so forth.
 */
 int osrf_app_session_queue_wait( osrfAppSession* session, int timeout, int* recvd ){
+	return osrf_app_session_queue_wait_ms( session, timeout_secs_to_millis( timeout ), recvd );
+}
+
+/**
+	@brief Wait up to a given number of milliseconds for input messages, and process them.
+	@param session Pointer to the osrfAppSession whose transport_session we will use.
+	@param timeout How many milliseconds to wait for the first input message: negative to
+		wait indefinitely, or zero not to wait at all.
+	@param recvd Pointer to an boolean int.  If you receive at least one message, set the boolean
+	to true; otherwise set it to false.
+	@return 0 upon success (even if a timeout occurs), or -1 upon failure.
+
+	Otherwise the same as osrf_app_session_queue_wait().
+*/
+int osrf_app_session_queue_wait_ms( osrfAppSession* session, int timeout, int* recvd ){
 	if(session == NULL) return 0;
-	osrfLogDebug(OSRF_LOG_MARK, "AppSession in queue_wait with timeout %d", timeout );
-	return osrf_stack_process(session->transport_handle, timeout, recvd);
+	osrfLogDebug(OSRF_LOG_MARK, "AppSession in queue_wait with timeout %d ms", timeout );
+	return osrf_stack_process_ms(session->transport_handle, timeout, recvd);
 }
 
 /**
@@ -1262,7 +2307,7 @@ void osrfAppSessionFree( osrfAppSession* session ){
 
 	/* Remove self from the global session cache */
 
-	osrfHashRemove( osrfAppSessionCache, session->session_id );
+	remove_cached_session( session );
 
 	/* Free the memory */
 
@@ -1281,8 +2326,8 @@ void osrfAppSessionFree( osrfAppSession* session ){
 	free(session->remote_service);
 
 	// Free the request hash
-	int i;
-	for( i = 0; i < OSRF_REQUEST_HASH_SIZE; ++i ) {
+	unsigned int i;
+	for( i = 0; i < session->request_hash_size; ++i ) {
 		osrfAppRequest* app = session->request_hash[ i ];
 		while( app ) {
 			osrfAppRequest* next = app->next;
@@ -1290,11 +2335,13 @@ void osrfAppSessionFree( osrfAppSession* session ){
 			app = next;
 		}
 	}
+	free( session->request_hash );
+	osrfListFree( session->queued_requests );
 
 	if( session->outbuf )
 		buffer_free( session->outbuf );
 
-	free(session);
+	release_session( session );
 }
 
 /**
@@ -1304,10 +2351,25 @@ void osrfAppSessionFree( osrfAppSession* session ){
 	@param timeout How many seconds to wait.
 	@return A pointer to the received osrfMessage if one arrives; otherwise NULL.
 
+	A thin wrapper for osrfAppSessionRequestRecvMs().  A negative @a timeout means not to
+	wait at all.
+*/
+osrfMessage* osrfAppSessionRequestRecv(
+		osrfAppSession* session, int req_id, int timeout ) {
+	return osrfAppSessionRequestRecvMs( session, req_id, timeout_secs_to_millis( timeout ) );
+}
+
+/**
+	@brief Wait for a response to a given request, for up to a given number of milliseconds.
+	@param session Pointer to the osrfAppSession that owns the request.
+	@param req_id Request ID for the request.
+	@param timeout How many milliseconds to wait.
+	@return A pointer to the received osrfMessage if one arrives; otherwise NULL.
+
 	A thin wrapper.  Given a session and a request ID, look up the corresponding request
 	and pass it to _osrf_app_request_recv().
 */
-osrfMessage* osrfAppSessionRequestRecv(
+osrfMessage* osrfAppSessionRequestRecvMs(
 		osrfAppSession* session, int req_id, int timeout ) {
 	if(req_id < 0 || session == NULL)
 		return NULL;
@@ -1315,6 +2377,50 @@ osrfMessage* osrfAppSessionRequestRecv(
 	return _osrf_app_request_recv( req, timeout );
 }
 
+/**
+	@brief Take the next response already queued for a request, without waiting.
+	@param session Pointer to the osrfAppSession that owns the request.
+	@param req_id Request ID for the request.
+	@return A pointer to the oldest queued osrfMessage, or NULL if none is queued.
+
+	Unlike osrfAppSessionRequestRecvMs(), this function does no input.  It is for callers
+	that read the transport themselves, such as an osrfMultiSession, and need only to
+	collect whatever has been queued for each request since.  The caller is responsible
+	for freeing the returned message.
+*/
+osrfMessage* osrfAppSessionRequestNext( osrfAppSession* session, int req_id ) {
+	if(req_id < 0 || session == NULL)
+		return NULL;
+	osrfAppRequest* req = find_app_request( session, req_id );
+	if( !req || !req->result )
+		return NULL;
+
+	osrfMessage* msg = req->result;
+	req->result = msg->next;
+	msg->next = NULL;
+	if( msg->sender_locale )
+		osrf_app_session_set_locale( session, msg->sender_locale );
+	return msg;
+}
+
+/**
+	@brief Report whether the server has asked for more time on a request.
+	@param session Pointer to the osrfAppSession that owns the request.
+	@param req_id Request ID for the request.
+	@return 1 if a CONTINUE status has arrived since the last call, otherwise 0.
+
+	The flag is cleared as it is reported, so that each CONTINUE earns one reprieve.
+*/
+int osrfAppSessionRequestContinued( osrfAppSession* session, int req_id ) {
+	if(req_id < 0 || session == NULL)
+		return 0;
+	osrfAppRequest* req = find_app_request( session, req_id );
+	if( !req || !req->reset_timeout )
+		return 0;
+	req->reset_timeout = 0;
+	return 1;
+}
+
 /**
 	@brief In response to a specified request, send a payload of data to a client.
 	@param ses Pointer to the osrfAppSession that owns the request.
@@ -1369,19 +2475,16 @@ int osrfAppRequestRespondComplete(
 	if (data) {
 		char* json = jsonObjectToJSON(data);
 		size_t raw_size = strlen(json);
-		size_t extra_size = osrfXmlEscapingLength(json);
-		size_t data_size = raw_size + extra_size;
 		size_t chunk_size = OSRF_MSG_CHUNK_SIZE;
 
-		if (data_size > chunk_size) // calculate an escape-scaled chunk size
-			chunk_size = ((double)raw_size / (double)data_size) * (double)chunk_size;
-
-		if (chunk_size > 0 && chunk_size < raw_size) {
+		if( osrfNeedsChunking( json, raw_size, chunk_size )) {
 			// chunking -- response message exceeds max message size.
 			// break it up into chunks for partial delivery
 
-			osrfSendChunkedResult(ses, requestId, json, raw_size, chunk_size);
-			osrfAppSessionSendBatch( ses, &status, 1 );
+			osrfAppSessionCork( ses );
+			if( !osrfSendChunkedResult( ses, requestId, json, raw_size, chunk_size ))
+				osrfAppSessionSendBatch( ses, &status, 1 );
+			osrfAppSessionUncork( ses );
 
 		} else {
 			// message doesn't need to be chunked
@@ -1435,16 +2538,21 @@ int osrfAppSessionStatus( osrfAppSession* ses, int type,
 }
 
 /**
-	@brief Free the global session cache.
+	@brief Free the global session cache, and the spare sessions kept for reuse.
 
-	Note that the osrfHash that implements the global session cache does @em not have a
-	callback function installed for freeing its cargo.  As a result, any remaining
-	osrfAppSessions are leaked, along with all the osrfAppRequests and osrfMessages they
-	own.
+	Note that the sessions still in the cache are @em not freed.  As a result, any
+	remaining osrfAppSessions are leaked, along with all the osrfAppRequests and
+	osrfMessages they own.
 */
 void osrfAppSessionCleanup( void ) {
-	osrfHashFree(osrfAppSessionCache);
-	osrfAppSessionCache = NULL;
+	session_cache* cache = &osrfAppSessionCache;
+	free( cache->buckets );
+	while( cache->spares ) {
+		osrfAppSession* next = cache->spares->cache_next;
+		free( cache->spares );
+		cache->spares = next;
+	}
+	memset( cache, 0, sizeof( session_cache ));
 }
 
 /**
@@ -1,4 +1,8 @@
 #include <opensrf/osrf_application.h>
+#include <opensrf/osrf_cache.h>
+#include <opensrf/osrf_settings.h>
+#include <opensrf/osrf_trace.h>
+#include <opensrf/osrf_utf8.h>
 
 /**
 	@file osrf_application.c
@@ -9,7 +13,11 @@
 	For each application, load a shared object library so that we can call
 	application-specific functions dynamically.  In order to map method names to the
 	corresponding functions (i.e. symbol names in the library), maintain a registry of
-	methods, using an osrfHash keyed on method name.
+	methods, using an osrfHash keyed on method name.  For dispatch, index the same methods
+	in an open-addressed table, and look up each function only once.
+
+	For cachable methods, keep the responses to recent calls, keyed by method name and
+	parameters, so that a repeated call can be answered without running the method again.
 */
 
 // The following macro is commented out because it ia no longer used.
@@ -46,6 +54,10 @@
 #define OSRF_SYSMETHOD_INTROSPECT_ALL_ATOMIC    "opensrf.system.method.all.atomic"
 #define OSRF_SYSMETHOD_ECHO                     "opensrf.system.echo"
 #define OSRF_SYSMETHOD_ECHO_ATOMIC              "opensrf.system.echo.atomic"
+#define OSRF_SYSMETHOD_DRONE_STATS              "opensrf.system.drone_stats"
+#define OSRF_SYSMETHOD_DRONE_STATS_ATOMIC       "opensrf.system.drone_stats.atomic"
+#define OSRF_SYSMETHOD_METHOD_STATS             "opensrf.system.method_stats"
+#define OSRF_SYSMETHOD_METHOD_STATS_ATOMIC      "opensrf.system.method_stats.atomic"
 /*@}*/
 
 /**
@@ -90,11 +102,43 @@
 	@brief Represent an Application.
 */
 typedef struct {
+	char* name;                 /**< Name of the application. */
 	void* handle;               /**< Handle to the shared object library. */
-	osrfHash* methods;          /**< Registry of method names. */
+	osrfHash* methods;          /**< Registry of method names, in order of registration. */
+	osrfMethod** method_table;  /**< Open-addressed index of the same methods, for dispatch. */
+	unsigned int table_size;    /**< Slots in method_table: zero, or a power of two. */
+	unsigned int method_count;  /**< Slots in use in method_table. */
 	void (*onExit) (void);      /**< Exit handler for the application. */
 } osrfApplication;
 
+/** Initial number of slots in an application's method table. */
+#define METHOD_TABLE_SIZE 64
+
+/**
+	@brief The saved responses to one call of a cachable method.
+*/
+typedef struct memo_entry_struct memo_entry;
+struct memo_entry_struct {
+	char* key;                  /**< Application, method, and canonical parameters. */
+	unsigned int hash;          /**< Hash of the key. */
+	jsonObject* responses;      /**< JSON array of the responses, in order. */
+	long long expires;          /**< When to stop using them, on the monotonic clock in ms. */
+	memo_entry* next;           /**< Next entry in the same bucket. */
+	memo_entry* newer;          /**< Neighbors in order of use, for eviction. */
+	memo_entry* older;
+};
+
+/**
+	@brief Responses to recent calls of cachable methods, evicted least recently used first.
+*/
+typedef struct {
+	memo_entry** buckets;       /**< Chained hash table of entries. */
+	unsigned int bucket_count;  /**< Number of buckets: a power of two. */
+	int count;                  /**< Number of entries. */
+	memo_entry* newest;         /**< Most recently used entry. */
+	memo_entry* oldest;         /**< Least recently used entry, the next to go. */
+} memo_cache;
+
 static void register_method( osrfApplication* app, const char* methodName,
 	const char* symbolName, const char* notes, int argc, int options, void * user_data );
 static osrfMethod* build_method( const char* methodName, const char* symbolName,
@@ -103,7 +147,10 @@ static void osrfAppSetOnExit(osrfApplication* app, const char* appName);
 static void register_system_methods( osrfApplication* app );
 static inline osrfApplication* _osrfAppFindApplication( const char* name );
 static inline osrfMethod* osrfAppFindMethod( osrfApplication* app, const char* methodName );
+static inline unsigned int method_hash( const char* name );
+static void index_method( osrfApplication* app, osrfMethod* method );
 static int _osrfAppRespond( osrfMethodContext* context, const jsonObject* data, int complete );
+static int respond_owned( osrfMethodContext* ctx, jsonObject* data, int complete );
 static int _osrfAppPostProcess( osrfMethodContext* context, int retcode );
 static int _osrfAppRunSystemMethod(osrfMethodContext* context);
 static void _osrfAppSetIntrospectMethod( osrfMethodContext* ctx, const osrfMethod* method,
@@ -111,8 +158,27 @@ static void _osrfAppSetIntrospectMethod( osrfMethodContext* ctx, const osrfMetho
 static int osrfAppIntrospect( osrfMethodContext* ctx );
 static int osrfAppIntrospectAll( osrfMethodContext* ctx );
 static int osrfAppEcho( osrfMethodContext* ctx );
+static int osrfAppDroneStats( osrfMethodContext* ctx );
+static int osrfAppMethodStats( osrfMethodContext* ctx );
+static void record_call( const osrfMethodContext* ctx, double elapsed, int cached );
+static int call_log_apply( osrfApplication* app, const jsonObject* names,
+		int every, int redact );
+static void log_call( const osrfMethodContext* ctx );
+static double latency_quantile( const osrfMethodStats* stats, double q );
+static int run_method( osrfApplication* app, const char* appName,
+		osrfMethodContext* context, osrfSpan* span );
 static void osrfMethodFree( char* name, void* p );
 static void osrfAppFree( char* name, void* p );
+static char* memo_key( const char* appName, const osrfMethod* method,
+		const jsonObject* params );
+static int compare_keys( const void* a, const void* b );
+static void canonical_json( growing_buffer* buf, const jsonObject* obj );
+static char* shared_memo_key( const char* key );
+static const jsonObject* memo_get( const char* key, const osrfMethod* method );
+static void memo_put( const char* key, const osrfMethod* method, jsonObject* responses,
+		int share );
+static void memo_remove( memo_cache* cache, memo_entry* entry );
+static int memo_replay( osrfMethodContext* ctx, const jsonObject* responses );
 
 /**
 	@brief Registry of applications.
@@ -121,6 +187,39 @@ static void osrfAppFree( char* name, void* p );
 */
 static osrfHash* _osrfAppHash = NULL;
 
+/**
+	@brief The application most recently looked up, checked before the registry.
+
+	A server process normally serves a single application, so this nearly always hits.
+	Thread-local, like the session cache, for servers running worker threads.
+*/
+static __thread osrfApplication* last_app = NULL;
+
+/**
+	@brief Callbacks for watching methods run, installed by osrfAppSetMethodMonitor().
+*/
+static osrfMethodMonitor method_monitor = { NULL, NULL, NULL };
+
+/**
+	@brief Responses to recent calls of cachable methods.
+
+	Thread-local, so that each worker thread of a server keeps a cache of its own and
+	never has to lock one.
+*/
+static __thread memo_cache* method_cache = NULL;
+
+/** Most calls whose responses we keep in each method cache. */
+static int method_cache_size = OSRF_METHOD_CACHE_SIZE;
+
+/** Calls taking longer than this many seconds are logged; zero to log none. */
+static double slow_threshold = 0.0;
+
+/** Boolean: true to log calls as JSON objects rather than as text (see osrfAppLoadCallLog()). */
+static int call_log_json = 0;
+
+/** Most bytes of the parameters to put in the call log; zero for no limit. */
+static size_t call_log_max_params = 0;
+
 /**
 	@brief Register an application.
 	@param appName Name of the application.
@@ -129,13 +228,14 @@ static osrfHash* _osrfAppHash = NULL;
 
 	Open the shared object file and call its osrfAppInitialize() function, if it has one.
 	Register the standard system methods for it.  Arrange for the application name to
-	appear in subsequent log messages.
+	appear in subsequent log messages, and in the spans we export.
 */
 int osrfAppRegisterApplication( const char* appName, const char* soFile ) {
 	if( !appName || ! soFile ) return -1;
 	char* error;
 
 	osrfLogSetAppname( appName );
+	osrfTraceSetService( appName );
 
 	if( !_osrfAppHash ) {
 		_osrfAppHash = osrfNewHash();
@@ -154,6 +254,7 @@ int osrfAppRegisterApplication( const char* appName, const char* soFile ) {
 
 	// Construct the osrfApplication.
 	osrfApplication* app = safe_malloc(sizeof(osrfApplication));
+	app->name = strdup( appName );
 	app->handle = handle;
 	app->methods = osrfNewHash();
 	osrfHashSetCallback( app->methods, osrfMethodFree );
@@ -250,6 +351,41 @@ int osrfAppRunChildInit(const char* appname) {
 	return 0;
 }
 
+/**
+	@brief Run the application-specific template initialization function for an application.
+	@param appname Name of the application.
+	@return Zero if successful, or if the application has no template initialization
+	function; -1 if the application is not registered, or if the function returns non-zero.
+
+	The template initialization function must be named "osrfAppTemplateInit" within the
+	shared object library.  It sets up whatever state the drones of a server can share,
+	such as data loaded from files, but not connections.  It runs once in a fork template
+	process, if the server uses one, and otherwise in each drone, in either case before
+	osrfAppChildInit().
+*/
+int osrfAppRunTemplateInit(const char* appname) {
+	osrfApplication* app = _osrfAppFindApplication(appname);
+	if(!app) return -1;
+
+	char* error;
+	int (*templateInit) (void);
+
+	*(void**) (&templateInit) = dlsym(app->handle, "osrfAppTemplateInit");
+
+	if( (error = dlerror()) != NULL ) {
+		osrfLogDebug( OSRF_LOG_MARK, "No template init defined for app %s : %s", appname, error);
+		return 0;
+	}
+
+	if( (*templateInit)() ) {
+		osrfLogError(OSRF_LOG_MARK, "App %s template init failed", appname);
+		return -1;
+	}
+
+	osrfLogInfo(OSRF_LOG_MARK, "%s template init succeeded", appname);
+	return 0;
+}
+
 /**
 	@brief Call the exit handler for every application that has one.
 
@@ -365,12 +501,74 @@ static void register_method( osrfApplication* app, const char* methodName,
 
 	if( !app || ! methodName ) return;
 
-	// Build a method and add it to the list of methods
+	// Build a method and add it to the list of methods.  Index it first: if it replaces
+	// a method of the same name, the hash frees the old one.
 	osrfMethod* method = build_method(
 		methodName, symbolName, notes, argc, options, user_data );
+	index_method( app, method );
 	osrfHashSet( app->methods, method, method->name );
 }
 
+/**
+	@brief Add a method to an application's method table, growing the table as needed.
+	@param app Pointer to the osrfApplication.
+	@param method Pointer to the osrfMethod, whose hash is already set.
+
+	The table uses linear probing, and doubles whenever it would become half full, so
+	that a lookup costs about the same for a service with thousands of methods as for one
+	with a handful.  A method with the same name as one already in the table replaces it.
+*/
+static void index_method( osrfApplication* app, osrfMethod* method ) {
+
+	if( ( app->method_count + 1 ) * 2 > app->table_size ) {
+		unsigned int new_size = app->table_size ? app->table_size * 2 : METHOD_TABLE_SIZE;
+		osrfMethod** new_table = safe_malloc( new_size * sizeof( osrfMethod* ) );
+
+		unsigned int i;
+		for( i = 0; i < app->table_size; ++i ) {
+			osrfMethod* m = app->method_table[ i ];
+			if( m ) {
+				unsigned int j = m->hash & ( new_size - 1 );
+				while( new_table[ j ] )
+					j = ( j + 1 ) & ( new_size - 1 );
+				new_table[ j ] = m;
+			}
+		}
+
+		free( app->method_table );
+		app->method_table = new_table;
+		app->table_size = new_size;
+	}
+
+	unsigned int mask = app->table_size - 1;
+	unsigned int i = method->hash & mask;
+	while( app->method_table[ i ] ) {
+		osrfMethod* m = app->method_table[ i ];
+		if( m->hash == method->hash && !strcmp( m->name, method->name ) ) {
+			app->method_table[ i ] = method;
+			return;
+		}
+		i = ( i + 1 ) & mask;
+	}
+
+	app->method_table[ i ] = method;
+	++app->method_count;
+}
+
+/**
+	@brief Hash a method name for the method table.
+	@param name The method name.
+	@return A 32-bit FNV-1a hash of the name.
+*/
+static inline unsigned int method_hash( const char* name ) {
+	unsigned int h = 2166136261u;
+	while( *name ) {
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
 /**
 	@brief Allocate and populate an osrfMethod.
 	@param methodName Name of the method.
@@ -399,6 +597,7 @@ static osrfMethod* build_method( const char* methodName, const char* symbolName,
 	} else {
 		method->name        = strdup(methodName);
 	}
+	method->hash            = method_hash( method->name );
 
 	if(symbolName)
 		method->symbol      = strdup(symbolName);
@@ -418,6 +617,9 @@ static osrfMethod* build_method( const char* methodName, const char* symbolName,
 
 	method->max_bundle_size = OSRF_MSG_BUNDLE_SIZE;
     method->max_chunk_size  = OSRF_MSG_CHUNK_SIZE;
+	if( options & OSRF_METHOD_CACHABLE )
+		method->cache_ttl   = OSRF_METHOD_CACHE_TTL;
+	method->log_every       = 1;
 	return method;
 }
 
@@ -454,6 +656,248 @@ int osrfMethodSetBundleSize( const char* appName, const char* methodName, size_t
 	}
 }
 
+/**
+	@brief Turn caching of a method's responses on or off.
+	@param appName Name of the application.
+	@param methodName Name of the method.
+	@param ttl How many seconds to reuse a call's responses; zero to stop caching them.
+	@param shared Boolean: true to share responses through memcache as well.
+	@return Zero if successful, or -1 if the specified method cannot be found.
+
+	While caching is on, a call whose method name and parameters match those of a recent call
+	gets the same responses again, without the method being run.  Only a method whose
+	responses depend on nothing but its parameters should be cached this way.
+
+	Each server process, or thread, keeps responses for the most recent calls, up to a limit
+	set by osrfAppLoadMethodCache().  If @a shared is true, responses are also stored in
+	memcache, where other processes can find them; the server must have connected to
+	memcache, typically via osrfSystemInitCache().
+
+	Registering a method with OSRF_METHOD_CACHABLE is the same as turning caching on with a
+	@a ttl of OSRF_METHOD_CACHE_TTL, unshared.  For a streaming method, the atomic and the
+	non-atomic versions are cached separately.
+*/
+int osrfMethodSetCache( const char* appName, const char* methodName, int ttl, int shared ) {
+	osrfMethod* method = _osrfAppFindMethod( appName, methodName );
+	if( !method ) {
+		osrfLogWarning( OSRF_LOG_MARK,
+			"Unable to set caching for method %s of application %s", methodName, appName );
+		return -1;
+	}
+
+	if( method->options & OSRF_METHOD_SYSTEM ) {
+		osrfLogWarning( OSRF_LOG_MARK,
+			"Not caching system method %s of application %s", methodName, appName );
+		return -1;
+	}
+
+	if( ttl > 0 ) {
+		osrfLogInfo( OSRF_LOG_MARK, "Caching responses of method %s of application %s "
+			"for %d seconds%s", methodName, appName, ttl, shared ? ", shared" : "" );
+		method->options |= OSRF_METHOD_CACHABLE;
+		method->cache_ttl = ttl;
+		method->cache_shared = shared ? 1 : 0;
+	} else {
+		method->options &= ~OSRF_METHOD_CACHABLE;
+		method->cache_ttl = 0;
+		method->cache_shared = 0;
+	}
+	return 0;
+}
+
+/**
+	@brief Turn on caching for the methods of an application listed in opensrf.xml.
+	@param appName Name of the application.
+	@return The number of methods cached.
+
+	The configuration looks like this, where every element is optional and @em method may
+	be repeated:
+
+	@code
+	<method_cache>
+	  <ttl>60</ttl>
+	  <shared>false</shared>
+	  <max_entries>256</max_entries>
+	  <method>...</method>
+	</method_cache>
+	@endcode
+
+	Each listed method, together with its atomic version if it has one, is cached for
+	@em ttl seconds, through memcache as well if @em shared is true.  @em max_entries sets
+	how many calls to keep responses for, in each server process or thread.
+
+	Call after registering the application, and before serving any requests.
+*/
+int osrfAppLoadMethodCache( const char* appName ) {
+	if( !appName )
+		return 0;
+
+	char* max_entries = osrf_settings_host_value( "/apps/%s/method_cache/max_entries", appName );
+	if( max_entries ) {
+		int n = atoi( max_entries );
+		if( n > 0 )
+			method_cache_size = n;
+		free( max_entries );
+	}
+
+	jsonObject* names = osrf_settings_host_value_object(
+		"/apps/%s/method_cache/method", appName );
+	if( !names )
+		return 0;
+
+	int ttl = OSRF_METHOD_CACHE_TTL;
+	char* ttl_str = osrf_settings_host_value( "/apps/%s/method_cache/ttl", appName );
+	if( ttl_str ) {
+		ttl = atoi( ttl_str );
+		free( ttl_str );
+	}
+
+	int shared = 0;
+	char* shared_str = osrf_settings_host_value( "/apps/%s/method_cache/shared", appName );
+	if( shared_str ) {
+		shared = !strcasecmp( shared_str, "true" ) || !strcmp( shared_str, "1" );
+		free( shared_str );
+	}
+
+	int count = 0;
+	unsigned long i = 0;
+	const jsonObject* name = names;
+	do {
+		if( JSON_ARRAY == names->type )
+			name = jsonObjectGetIndex( names, i );
+		const char* str = jsonObjectGetString( name );
+		if( str && *str && !osrfMethodSetCache( appName, str, ttl, shared )) {
+			++count;
+			char atomic[ strlen( str ) + 8 ];
+			sprintf( atomic, "%s.atomic", str );
+			if( _osrfAppFindMethod( appName, atomic ))
+				osrfMethodSetCache( appName, atomic, ttl, shared );
+		}
+	} while( JSON_ARRAY == names->type && ++i < names->size );
+
+	jsonObjectFree( names );
+	return count;
+}
+
+/**
+	@brief Load the settings for logging the calls to an application, from opensrf.xml.
+	@param appName Name of the application.
+	@return Zero if successful, or -1 if there is no such application.
+
+	By default every call is logged at the INFO level, as text.  The configuration looks
+	like this, where every element is optional, and @em sample, @em redact and @em method
+	may be repeated:
+
+	@code
+	<call_log>
+	  <format>json</format>
+	  <max_params>1024</max_params>
+	  <sample>
+	    <rate>0.01</rate>
+	    <method>...</method>
+	  </sample>
+	  <redact>
+	    <method>...</method>
+	  </redact>
+	</call_log>
+	@endcode
+
+	A @em format of "json" logs each call as a JSON object instead of as text.  The
+	parameters are cut short after @em max_params bytes.  Only the @em rate fraction of
+	the calls to each method whose name begins with a @em method string of a @em sample is
+	logged; where more than one @em sample applies to a method, the last one wins.
+	Methods whose names begin with a @em method string of @em redact are logged without
+	their parameters, as are the methods listed under log_protect in opensrf_core.xml.
+
+	Which calls are logged is decided before their parameters are serialized, so that a
+	call not logged costs next to nothing.
+
+	Call after registering the application, and before serving any requests.
+*/
+int osrfAppLoadCallLog( const char* appName ) {
+	osrfApplication* app = _osrfAppFindApplication( appName );
+	if( !app )
+		return -1;
+
+	const jsonObject* cfg = osrf_settings_host_value_const( "/apps/%s/call_log", appName );
+	if( !cfg || cfg->type != JSON_HASH )
+		return 0;
+
+	const char* format = jsonObjectGetString( jsonObjectGetKeyConst( cfg, "format" ));
+	call_log_json = format && !strcasecmp( format, "json" );
+
+	const char* max = jsonObjectGetString( jsonObjectGetKeyConst( cfg, "max_params" ));
+	if( max && atoi( max ) > 0 )
+		call_log_max_params = atoi( max );
+
+	const jsonObject* sample = jsonObjectGetKeyConst( cfg, "sample" );
+	unsigned long i = 0;
+	while( sample ) {
+		const jsonObject* one = sample;
+		if( JSON_ARRAY == sample->type )
+			one = jsonObjectGetIndex( sample, i );
+
+		// Log one call in every so many; 0 for none
+		const char* rate_str = jsonObjectGetString( jsonObjectGetKeyConst( one, "rate" ));
+		double rate = rate_str ? atof( rate_str ) : 1.0;
+		int every = rate <= 0.0 ? 0 : rate >= 1.0 ? 1 : (int) ( 1.0 / rate + 0.5 );
+		int count = call_log_apply( app, jsonObjectGetKeyConst( one, "method" ), every, -1 );
+		osrfLogDebug( OSRF_LOG_MARK, "Logging 1 in %d calls to %d methods of %s",
+			every, count, appName );
+
+		if( JSON_ARRAY != sample->type || ++i >= sample->size )
+			break;
+	}
+
+	const jsonObject* redact = jsonObjectGetKeyConst( cfg, "redact" );
+	if( redact )
+		call_log_apply( app, jsonObjectGetKeyConst( redact, "method" ), -1, 1 );
+
+	return 0;
+}
+
+/**
+	@brief Apply call log settings to the methods of an application whose names match.
+	@param app Pointer to the application.
+	@param names A method name prefix, or an array of them; may be NULL.
+	@param every Sample one call in this many (zero for none), or -1 to leave as is.
+	@param redact Boolean: true to log no parameters, or -1 to leave as is.
+	@return The number of methods whose names match.
+*/
+static int call_log_apply( osrfApplication* app, const jsonObject* names,
+		int every, int redact ) {
+	if( !names )
+		return 0;
+
+	int count = 0;
+	unsigned long i = 0;
+	const jsonObject* name = names;
+	do {
+		if( JSON_ARRAY == names->type )
+			name = jsonObjectGetIndex( names, i );
+		const char* str = jsonObjectGetString( name );
+		if( str && *str ) {
+			size_t len = strlen( str );
+			osrfHashIterator* itr = osrfNewHashIterator( app->methods );
+			osrfMethod* method;
+			while( (method = osrfHashIteratorNext( itr )) ) {
+				if( strncmp( method->name, str, len ))
+					continue;
+				if( every >= 0 ) {
+					method->log_every = every;
+					method->log_seen = 0;
+				}
+				if( redact >= 0 )
+					method->log_redact = redact;
+				++count;
+			}
+			osrfHashIteratorFree( itr );
+		}
+	} while( JSON_ARRAY == names->type && ++i < names->size );
+
+	return count;
+}
+
 /**
 	@brief Register all of the system methods for this application.
 	@param app Pointer to the application.
@@ -503,6 +947,36 @@ static void register_system_methods( osrfApplication* app ) {
 		"Echos all data sent to the server back to the client. PARAMS([a, b, ...])",
 		0, OSRF_METHOD_SYSTEM | OSRF_METHOD_STREAMING | OSRF_METHOD_ATOMIC,
 		NULL );
+
+	register_method(
+		app, OSRF_SYSMETHOD_DRONE_STATS, NULL,
+		"Returns what each of the server's drones is doing, and how long each method "
+		"has been taking. PARAMS()",
+		0, OSRF_METHOD_SYSTEM | OSRF_METHOD_STREAMING,
+		NULL );
+
+	register_method(
+		app, OSRF_SYSMETHOD_DRONE_STATS, NULL,
+		"Returns what each of the server's drones is doing, and how long each method "
+		"has been taking. PARAMS()",
+		0, OSRF_METHOD_SYSTEM | OSRF_METHOD_STREAMING | OSRF_METHOD_ATOMIC,
+		NULL );
+
+	register_method(
+		app, OSRF_SYSMETHOD_METHOD_STATS, NULL,
+		"Returns call counts, response volume, and latency for each method this server "
+		"process has run whose name starts with the given prefix, or for all of them. "
+		"PARAMS( methodNamePrefix )",
+		0, OSRF_METHOD_SYSTEM | OSRF_METHOD_STREAMING,
+		NULL );
+
+	register_method(
+		app, OSRF_SYSMETHOD_METHOD_STATS, NULL,
+		"Returns call counts, response volume, and latency for each method this server "
+		"process has run whose name starts with the given prefix, or for all of them. "
+		"PARAMS( methodNamePrefix )",
+		0, OSRF_METHOD_SYSTEM | OSRF_METHOD_STREAMING | OSRF_METHOD_ATOMIC,
+		NULL );
 }
 
 /**
@@ -511,7 +985,13 @@ static void register_system_methods( osrfApplication* app ) {
 	@return Pointer to the corresponding osrfApplication if found, or NULL if not.
 */
 static inline osrfApplication* _osrfAppFindApplication( const char* name ) {
-	return (osrfApplication*) osrfHashGet(_osrfAppHash, name);
+	if( last_app && !strcmp( last_app->name, name ) )
+		return last_app;
+
+	osrfApplication* app = (osrfApplication*) osrfHashGet(_osrfAppHash, name);
+	if( app )
+		last_app = app;
+	return app;
 }
 
 /**
@@ -521,8 +1001,18 @@ static inline osrfApplication* _osrfAppFindApplication( const char* name ) {
 	@return Pointer to the corresponding osrfMethod if found, or NULL if not.
 */
 static inline osrfMethod* osrfAppFindMethod( osrfApplication* app, const char* methodName ) {
-	if( !app ) return NULL;
-	return (osrfMethod*) osrfHashGet( app->methods, methodName );
+	if( !app || !app->table_size || !methodName ) return NULL;
+
+	unsigned int hash = method_hash( methodName );
+	unsigned int mask = app->table_size - 1;
+	unsigned int i = hash & mask;
+	osrfMethod* method;
+	while( ( method = app->method_table[ i ] ) ) {
+		if( method->hash == hash && !strcmp( method->name, methodName ) )
+			return method;
+		i = ( i + 1 ) & mask;
+	}
+	return NULL;
 }
 
 /**
@@ -561,10 +1051,26 @@ int osrfAppRunMethod( const char* appName, const char* methodName,
 		return osrfAppRequestRespondException( ses,
 				reqId, "Application not found: %s", appName );
 
-	osrfMethod* method = osrfAppFindMethod( app, methodName );
-	if( !method )
-		return osrfAppRequestRespondException( ses, reqId,
-				"Method [%s] not found for service %s", methodName, appName );
+	// A session usually calls the same method over and over, so try the last one first.
+	// A server session only ever calls methods of the application it serves.
+	osrfMethod* method = ses->last_method;
+	if( !method || appName != ses->remote_service || strcmp( method->name, methodName ) ) {
+		method = osrfAppFindMethod( app, methodName );
+		if( !method )
+			return osrfAppRequestRespondException( ses, reqId,
+					"Method [%s] not found for service %s", methodName, appName );
+		if( appName == ses->remote_service )
+			ses->last_method = method;
+	}
+
+	// Don't spend anything on an answer that nobody is waiting for
+	long long deadline = osrfAppSessionGetDeadline();
+	if( deadline > 0 && get_monotonic_millis() >= deadline ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Not running method %s: the client stopped waiting "
+			"%lld ms ago", methodName, get_monotonic_millis() - deadline );
+		return osrfAppSessionStatus( ses, OSRF_STATUS_DEADLINEEXCEEDED,
+			"osrfMethodException", reqId, "Request deadline exceeded" );
+	}
 
 	#ifdef OSRF_STRICT_PARAMS
 	if( method->argc > 0 ) {
@@ -583,39 +1089,202 @@ int osrfAppRunMethod( const char* appName, const char* methodName,
 	context.params = params;
 	context.request = reqId;
 	context.responses = NULL;
+	context.memo = NULL;
+	context.response_count = 0;
+	context.response_bytes = 0;
+	context.deadline = deadline;
+	double started = get_timestamp_millis();
+
+	// Time the method as a span of the request; whatever it sends belongs to the span
+	osrfSpan span;
+	if( osrfSpanStart( &span, method->name, OSRF_SPAN_SERVER, started ))
+		osrfSpanSetAttr( &span, "rpc.service", appName );
+	osrfSpanActivate( &span );
+
+	// For a cachable method, answer from the cache if we can.  Otherwise collect the
+	// responses as they go out, for the next time.
+	char* key = NULL;
+	if( ( method->options & OSRF_METHOD_CACHABLE ) && method->cache_ttl > 0 ) {
+		key = memo_key( appName, method, params );
+		const jsonObject* cached = memo_get( key, method );
+		if( cached ) {
+			osrfLogDebug( OSRF_LOG_MARK, "Replaying cached responses for method %s",
+				method->name );
+			int retcode = memo_replay( &context, cached );
+			record_call( &context, get_timestamp_millis() - started, 1 );
+			osrfSpanSetAttr( &span, "opensrf.cached", "1" );
+			osrfSpanDeactivate( &span );
+			osrfSpanEnd( &span );
+			if( context.responses )
+				jsonObjectFree( context.responses );
+			free( key );
+			return retcode;
+		}
+		context.memo = jsonNewObjectType( JSON_ARRAY );
+	}
+
+	if( method_monitor.start )
+		method_monitor.start( method->name );
+
+	int retcode = run_method( app, appName, &context, &span );
+
+	osrfSpanDeactivate( &span );
+	osrfSpanEnd( &span );
 
+	double elapsed = get_timestamp_millis() - started;
+	if( method_monitor.finish )
+		method_monitor.finish( method->name, elapsed );
+	record_call( &context, elapsed, 0 );
+
+	// run_method() discards the memo if the method failed.
+	if( context.memo ) {
+		if( method->options & OSRF_METHOD_ATOMIC ) {
+			// The responses all went out together, and we're done with them.
+			jsonObjectFree( context.memo );
+			context.memo = context.responses ? context.responses
+				: jsonNewObjectType( JSON_ARRAY );
+			context.responses = NULL;
+		}
+		memo_put( key, method, context.memo, method->cache_shared );
+	}
+	free( key );
+
+	if( context.responses )
+		jsonObjectFree( context.responses );
+	return retcode;
+}
+
+/**
+	@brief Call the function that implements a method, and finish up after it.
+	@param app Pointer to the osrfApplication that owns the method.
+	@param appName Name of the application.
+	@param context Pointer to the method context, already filled in.
+	@param span Pointer to the span timing the method, to be marked if the method fails.
+	@return Zero if successful, or -1 upon failure.
+
+	Called only by osrfAppRunMethod(), which times the whole thing.
+*/
+static int run_method( osrfApplication* app, const char* appName,
+		osrfMethodContext* context, osrfSpan* span ) {
+
+	osrfAppSession* ses = context->session;
+	osrfMethod* method = context->method;
 	int retcode = 0;
 
 	if( method->options & OSRF_METHOD_SYSTEM ) {
-		retcode = _osrfAppRunSystemMethod(&context);
+		retcode = _osrfAppRunSystemMethod( context );
 
 	} else {
 
 		// Function pointer through which we will call the function dynamically
 		int (*meth) (osrfMethodContext*);
 
-		// Open the function that implements the method
-		meth = dlsym(app->handle, method->symbol);
-
-		const char* error = dlerror();
-		if( error != NULL ) {
-			return osrfAppRequestRespondException( ses, reqId,
-				"Unable to execute method [%s] for service %s", methodName, appName );
+		// Look up the function that implements the method, the first time only
+		if( !method->function ) {
+			dlerror();
+			method->function = dlsym(app->handle, method->symbol);
+
+			const char* error = dlerror();
+			if( error != NULL ) {
+				method->function = NULL;
+				jsonObjectFree( context->memo );
+				context->memo = NULL;
+				span->error = 1;
+				return osrfAppRequestRespondException( ses, context->request,
+					"Unable to execute method [%s] for service %s",
+					method->name, appName );
+			}
 		}
+		*(void**) (&meth) = method->function;
 
 		// Run it
-		retcode = meth( &context );
+		retcode = meth( context );
 	}
 
-	if(retcode < 0)
+	if(retcode < 0) {
+		// Don't cache a failure.
+		jsonObjectFree( context->memo );
+		context->memo = NULL;
+
+		span->error = 1;
+
+		// Leave behind the details of what led up to it
+		char reason[ 256 ];
+		snprintf( reason, sizeof( reason ), "%s failed", method->name );
+		osrfLogDumpRecorder( reason );
+
 		return osrfAppRequestRespondException(
-				ses, reqId, "An unknown server error occurred" );
+				ses, context->request, "An unknown server error occurred" );
+	}
 
-	retcode = _osrfAppPostProcess( &context, retcode );
+	return _osrfAppPostProcess( context, retcode );
+}
 
-	if( context.responses )
-		jsonObjectFree( context.responses );
-	return retcode;
+/**
+	@brief Install callbacks for watching methods run.
+	@param monitor Pointer to the callbacks, which we copy; or NULL to remove them.
+
+	A server that keeps statistics about the methods it runs, such as the prefork server,
+	installs these once, before it starts serving requests.  The report callback also
+	answers opensrf.system.drone_stats; without one, that method reports an exception.
+*/
+void osrfAppSetMethodMonitor( const osrfMethodMonitor* monitor ) {
+	if( monitor )
+		method_monitor = *monitor;
+	else
+		memset( &method_monitor, 0, sizeof( method_monitor ));
+}
+
+/**
+	@brief Set how long a call may take before it is logged as slow.
+	@param seconds The threshold, in seconds; zero or less to log no calls as slow.
+
+	A slow call is logged as a warning, with the service, the method, how long it took, and
+	how many responses it sent; the CALL line logged earlier under the same transaction ID
+	has the parameters.  Every call, slow or not, is counted in the method's statistics,
+	reported by opensrf.system.method_stats.
+*/
+void osrfAppSetSlowThreshold( double seconds ) {
+	slow_threshold = seconds > 0.0 ? seconds : 0.0;
+}
+
+/**
+	@brief Add a finished call to its method's statistics, and log it if it was slow.
+	@param ctx Pointer to the method context.
+	@param elapsed How long the call took, in seconds.
+	@param cached Boolean: true if the call was answered from the method cache.
+*/
+static void record_call( const osrfMethodContext* ctx, double elapsed, int cached ) {
+	osrfMethodStats* stats = &ctx->method->stats;
+
+	unsigned long usec = elapsed > 0.0 ? (unsigned long) ( elapsed * 1000000.0 ) : 0;
+	int bucket = 0;
+	while( bucket < OSRF_LATENCY_BUCKETS - 1 && usec >= ( 1000UL << bucket ))
+		bucket++;
+
+	__sync_fetch_and_add( &stats->buckets[ bucket ], 1 );
+	__sync_fetch_and_add( &stats->total_usec, usec );
+	__sync_fetch_and_add( &stats->responses, ctx->response_count );
+	__sync_fetch_and_add( &stats->bytes, ctx->response_bytes );
+	if( cached )
+		__sync_fetch_and_add( &stats->cache_hits, 1 );
+	__sync_fetch_and_add( &stats->calls, 1 );
+
+	unsigned long old_max = stats->max_usec;
+	while( usec > old_max ) {
+		unsigned long seen = __sync_val_compare_and_swap( &stats->max_usec, old_max, usec );
+		if( seen == old_max )
+			break;
+		old_max = seen;
+	}
+
+	if( slow_threshold > 0.0 && elapsed >= slow_threshold ) {
+		__sync_fetch_and_add( &stats->slow, 1 );
+		osrfLogWarning( OSRF_LOG_MARK, "SLOW: %s %s took %.3f seconds, "
+			"responses=%lu bytes=%lu cached=%d", ctx->session->remote_service,
+			ctx->method->name, elapsed, ctx->response_count,
+			(unsigned long) ctx->response_bytes, cached ? 1 : 0 );
+	}
 }
 
 /**
@@ -654,6 +1323,69 @@ int osrfAppRespondComplete( osrfMethodContext* context, const jsonObject* data )
 	return _osrfAppRespond( context, data, 1 );
 }
 
+/**
+	@brief Respond to a client with a jsonObject that the method no longer needs.
+	@param ctx Pointer to the current method context.
+	@param data Pointer to the response, which the library takes over and frees.
+	@return Zero if successful, or -1 upon error.
+
+	The same as osrfAppRespond(), except for who owns the data.  For an atomic method the
+	response goes into the cache as it is, rather than as a copy, so that a method
+	returning many large results doesn't hold two copies of each until it's done.  The
+	caller must not touch @a data afterwards, even if the call fails.
+*/
+int osrfAppRespondOwned( osrfMethodContext* ctx, jsonObject* data ) {
+	return respond_owned( ctx, data, 0 );
+}
+
+/**
+	@brief Respond to a client with a jsonObject that the method no longer needs, with a
+	completion notice.
+	@param ctx Pointer to the current method context.
+	@param data Pointer to the response, which the library takes over and frees.
+	@return Zero if successful, or -1 upon error.
+
+	The same as osrfAppRespondComplete(), except that the library takes over @a data, as
+	with osrfAppRespondOwned().
+*/
+int osrfAppRespondCompleteOwned( osrfMethodContext* ctx, jsonObject* data ) {
+	return respond_owned( ctx, data, 1 );
+}
+
+/**
+	@brief Common code for osrfAppRespondOwned() and osrfAppRespondCompleteOwned().
+	@param ctx Pointer to the current method context.
+	@param data Pointer to the response, to be adopted or freed.
+	@param complete Boolean: true to send a STATUS message along with a non-atomic response.
+	@return Zero if successful, or -1 upon error.
+
+	An atomic method's cache adopts the data.  Anything else goes through _osrfAppRespond(),
+	after which we free the data ourselves.
+*/
+static int respond_owned( osrfMethodContext* ctx, jsonObject* data, int complete ) {
+	if( !(ctx && ctx->method) ) {
+		jsonObjectFree( data );
+		return -1;
+	}
+
+	if( ctx->method->options & OSRF_METHOD_ATOMIC ) {
+		if( ctx->responses == NULL )
+			ctx->responses = jsonNewObjectType( JSON_ARRAY );
+		if( data != NULL ) {
+			// The cache may outlive the request, but an object in the request arena won't
+			if( data->arena )
+				data = jsonObjectClone( data );
+			jsonObjectPush( ctx->responses, data );
+			++ctx->response_count;
+		}
+		return 0;
+	}
+
+	int rc = _osrfAppRespond( ctx, data, complete );
+	jsonObjectFree( data );
+	return rc;
+}
+
 /**
 	@brief Send any response messages that have accumulated in the output buffer.
 	@param ses Pointer to the current application session.
@@ -668,16 +1400,7 @@ static int flush_responses( osrfAppSession* ses, growing_buffer* outbuf ) {
 	// immediate task at hand, but it may help to keep TCP from getting clogged in some cases.
 	osrf_app_session_queue_wait( ses, 0, NULL );
 
-	int rc = 0;
-	if( buffer_length( outbuf ) > 0 ) {    // If there's anything to send...
-		buffer_add_char( outbuf, ']' );    // Close the JSON array
-		if( osrfSendTransportPayload( ses, OSRF_BUFFER_C_STR( ses->outbuf ))) {
-			osrfLogError( OSRF_LOG_MARK, "Unable to flush response buffer" );
-			rc = -1;
-		}
-	}
-	buffer_reset( ses->outbuf );
-	return rc;
+	return osrfAppSessionFlush( ses );
 }
 
 /**
@@ -717,6 +1440,10 @@ static inline void append_msg( growing_buffer* outbuf, const char* msg ) {
 static int _osrfAppRespond( osrfMethodContext* ctx, const jsonObject* data, int complete ) {
 	if(!(ctx && ctx->method)) return -1;
 
+	// The client stopped taking chunks; don't send it anything more for this request
+	if( osrfAppSessionAbandoned( ctx->session, ctx->request ))
+		return -1;
+
 	if( ctx->method->options & OSRF_METHOD_ATOMIC ) {
 		osrfLogDebug( OSRF_LOG_MARK,
 			"Adding responses to stash for atomic method %s", ctx->method->name );
@@ -726,63 +1453,96 @@ static int _osrfAppRespond( osrfMethodContext* ctx, const jsonObject* data, int
 			ctx->responses = jsonNewObjectType( JSON_ARRAY );
 
 		// Add a copy of the data object to the cache.
-		if ( data != NULL )
+		if ( data != NULL ) {
 			jsonObjectPush( ctx->responses, jsonObjectClone(data) );
+			++ctx->response_count;
+		}
 	} else {
 		osrfLogDebug( OSRF_LOG_MARK,
 			"Adding responses to stash for method %s", ctx->method->name );
 
+		if( data && ctx->memo )
+			jsonObjectPush( ctx->memo, jsonObjectClone( data ));
+
 		if( data ) {
-            char* data_str = jsonObjectToJSON(data); // free me (below)
-            size_t raw_size = strlen(data_str);
-            size_t extra_size = osrfXmlEscapingLength(data_str);
-            size_t data_size = raw_size + extra_size;
-            size_t chunk_size = ctx->method->max_chunk_size;
-
-            if (data_size > chunk_size) // calculate an escape-scaled chunk size
-                chunk_size = ((double)raw_size / (double)data_size) * (double)chunk_size;
-
-            if (chunk_size > 0 && chunk_size < raw_size) {
-                // chunking -- response message exceeds max message size.
-                // break it up into chunks for partial delivery
-
-                // but first, send out any any messages that may have
-                // been queued for bundling
-                if( flush_responses( ctx->session, ctx->session->outbuf ))
-                    return -1;
-
-				osrfSendChunkedResult(ctx->session, ctx->request,
-									  data_str, raw_size, chunk_size);
-
-            } else {
-
-                // bundling -- message body (may be) too small for single
-                // delivery.  prepare message for bundling.
-
-                // Create an OSRF message
-                osrfMessage* msg = osrf_message_init( RESULT, ctx->request, 1 );
-                osrf_message_set_status_info( msg, NULL, "OK", OSRF_STATUS_OK );
-                osrf_message_set_result( msg, data );
-
-                // Serialize the OSRF message into JSON text
-                jsonObject* msg_jsonobj = osrfMessageToJSON( msg );
-                char* json = jsonObjectToJSON( msg_jsonobj );
-                jsonObjectFree( msg_jsonobj );
-                osrfMessageFree( msg );
-
-                // If the new message would overflow the buffer, flush the output buffer first
-                int len_so_far = buffer_length( ctx->session->outbuf );
-                if( len_so_far && (strlen( json ) + len_so_far + 3 >= ctx->method->max_bundle_size )) {
-                    if( flush_responses( ctx->session, ctx->session->outbuf ))
-                        return -1;
-                }
-
-                // Append the JSON text to the output buffer
-                append_msg( ctx->session->outbuf, json );
-                free( json );
-            }
-
-            free(data_str);
+			char* data_str = jsonObjectToJSON(data); // free me (below)
+			size_t raw_size = strlen(data_str);
+			++ctx->response_count;
+			ctx->response_bytes += raw_size;
+			size_t chunk_size = ctx->method->max_chunk_size;
+
+			if( osrfNeedsChunking( data_str, raw_size, chunk_size )) {
+				// chunking -- response message exceeds max message size.
+				// break it up into chunks for partial delivery
+
+				// but first, send out any any messages that may have
+				// been queued for bundling -- in the same batch of writes
+				osrfAppSessionCork( ctx->session );
+				if( flush_responses( ctx->session, ctx->session->outbuf )) {
+					osrfAppSessionUncork( ctx->session );
+					free( data_str );
+					return -1;
+				}
+
+				int rc = osrfSendChunkedResult( ctx->session, ctx->request,
+									  data_str, raw_size, chunk_size );
+				osrfAppSessionUncork( ctx->session );
+				if( rc ) {
+					free( data_str );
+					return -1;
+				}
+
+			} else {
+
+				// bundling -- message body (may be) too small for single
+				// delivery.  Write a RESULT message around the content, straight
+				// into the output buffer.
+				osrfMessage msg;
+				memset( &msg, 0, sizeof( msg ) );
+				msg.m_type = RESULT;
+				msg.thread_trace = ctx->request;
+				msg.protocol = 1;
+				msg.status_text = "OK";
+				msg.status_code = OSRF_STATUS_OK;
+
+				// A MessagePack session packs the content in place; its base64 text
+				// will run to about four bytes for every three packed.
+				int packing = OSRF_ENCODING_MSGPACK == ctx->session->encoding;
+				growing_buffer* prefix = buffer_init( 256 );
+				size_t json_len;
+				if( packing ) {
+					osrfMessageAddMsgpack( prefix, &msg, data );
+					json_len = buffer_length( prefix ) / 3 * 4;
+				} else {
+					osrfMessageAddResultPrefix( prefix, &msg );
+					json_len = buffer_length( prefix ) + raw_size
+						+ sizeof( OSRF_RESULT_JSON_SUFFIX ) - 1;
+				}
+
+				// If the new message would overflow the buffer, flush the output buffer first
+				int len_so_far = buffer_length( ctx->session->outbuf );
+				if( len_so_far && (json_len + len_so_far + 3 >= ctx->method->max_bundle_size )) {
+					if( flush_responses( ctx->session, ctx->session->outbuf )) {
+						buffer_free( prefix );
+						free( data_str );
+						return -1;
+					}
+				}
+
+				if( packing ) {
+					buffer_add_n( ctx->session->outbuf, OSRF_BUFFER_C_STR( prefix ),
+						buffer_length( prefix ));
+					++ctx->session->outbuf_count;
+				} else {
+					// Append the JSON text to the output buffer
+					append_msg( ctx->session->outbuf, OSRF_BUFFER_C_STR( prefix ));
+					buffer_add_n( ctx->session->outbuf, data_str, raw_size );
+					OSRF_BUFFER_ADD( ctx->session->outbuf, OSRF_RESULT_JSON_SUFFIX );
+				}
+				buffer_free( prefix );
+			}
+
+			free(data_str);
 		}
 
 		if(complete) {
@@ -791,19 +1551,23 @@ static int _osrfAppRespond( osrfMethodContext* ctx, const jsonObject* data, int
 			osrf_message_set_status_info( status_msg, "osrfConnectStatus", "Request Complete",
 				OSRF_STATUS_COMPLETE );
 
-			// Serialize the STATUS message into JSON text
-			jsonObject* status_msg_jsonobj = osrfMessageToJSON( status_msg );
-			char* json = jsonObjectToJSON( status_msg_jsonobj );
-			jsonObjectFree( status_msg_jsonobj );
-			osrfMessageFree( status_msg );
-
-			// Add the STATUS message to the output buffer.
+			// Add the STATUS message to the output buffer, packed or as JSON text.
 			// It's short, so don't worry about avoiding overflow.
-			append_msg( ctx->session->outbuf, json );
-			free( json );
+			if( OSRF_ENCODING_MSGPACK == ctx->session->encoding ) {
+				osrfMessageAddMsgpack( ctx->session->outbuf, status_msg, NULL );
+				++ctx->session->outbuf_count;
+			} else {
+				jsonObject* status_msg_jsonobj = osrfMessageToJSON( status_msg );
+				char* json = jsonObjectToJSON( status_msg_jsonobj );
+				jsonObjectFree( status_msg_jsonobj );
+				append_msg( ctx->session->outbuf, json );
+				free( json );
+			}
+			osrfMessageFree( status_msg );
 
-			// Flush the output buffer, sending any accumulated messages.
-			if( flush_responses( ctx->session, ctx->session->outbuf ))
+			// Flush the output buffer, sending any accumulated messages -- unless this
+			// request is one of a batch, whose responses go out together at the end.
+			if( !ctx->session->batch && flush_responses( ctx->session, ctx->session->outbuf ))
 				return -1;
 		}
 	}
@@ -924,6 +1688,16 @@ static int _osrfAppRunSystemMethod(osrfMethodContext* ctx) {
 		return osrfAppEcho(ctx);
 	}
 
+	if( !strcmp(ctx->method->name, OSRF_SYSMETHOD_DRONE_STATS ) ||
+			!strcmp(ctx->method->name, OSRF_SYSMETHOD_DRONE_STATS_ATOMIC )) {
+		return osrfAppDroneStats(ctx);
+	}
+
+	if( !strcmp(ctx->method->name, OSRF_SYSMETHOD_METHOD_STATS ) ||
+			!strcmp(ctx->method->name, OSRF_SYSMETHOD_METHOD_STATS_ATOMIC )) {
+		return osrfAppMethodStats(ctx);
+	}
+
 	osrfAppRequestRespondException( ctx->session,
 			ctx->request, "System method implementation not found");
 
@@ -960,8 +1734,7 @@ static int osrfAppIntrospect( osrfMethodContext* ctx ) {
 			if( !strncmp( method->name, methodSubstring, len) ) {
 				jsonObject* resp = jsonNewObject(NULL);
 				_osrfAppSetIntrospectMethod( ctx, method, resp );
-				osrfAppRespond(ctx, resp);
-				jsonObjectFree(resp);
+				osrfAppRespondOwned(ctx, resp);
 			}
 		}
 	}
@@ -986,8 +1759,7 @@ static int osrfAppIntrospectAll( osrfMethodContext* ctx ) {
 		while( (method = osrfHashIteratorNext(itr)) ) {
 			jsonObject* resp = jsonNewObject(NULL);
 			_osrfAppSetIntrospectMethod( ctx, method, resp );
-			osrfAppRespond(ctx, resp);
-			jsonObjectFree(resp);
+			osrfAppRespondOwned(ctx, resp);
 		}
 		osrfHashIteratorFree(itr);
 		return 1;
@@ -1016,6 +1788,126 @@ static int osrfAppEcho( osrfMethodContext* ctx ) {
 	return 1;
 }
 
+/**
+	@brief Run the drone_stats method.
+	@param ctx Pointer to the method context.
+	@return 1 if successful, or 0 if the server doesn't keep drone statistics.
+
+	Respond with whatever report the server's method monitor builds.
+*/
+static int osrfAppDroneStats( osrfMethodContext* ctx ) {
+	jsonObject* report = method_monitor.report ? method_monitor.report() : NULL;
+	if( !report ) {
+		osrfAppRequestRespondException( ctx->session, ctx->request,
+			"Drone statistics are not available for this service" );
+		return 0;
+	}
+
+	osrfAppRespond( ctx, report );
+	jsonObjectFree( report );
+	return 1;
+}
+
+/**
+	@brief Run the method_stats method.
+	@param ctx Pointer to the method context.
+	@return 1 if successful, or -1 if unable to find a pointer to the application.
+
+	Respond with a hash of statistics, keyed by method name, for each method that this
+	process has run, optionally limited to those whose names start with the first parameter.
+	Each method's "histogram" counts calls by latency: under 1 ms, under 2 ms, under 4 ms,
+	and so on, with the last entry counting everything from 16 seconds up.  Times are in
+	seconds; "p50" and "p99" are upper bounds read from the histogram.
+*/
+static int osrfAppMethodStats( osrfMethodContext* ctx ) {
+	osrfApplication* app = _osrfAppFindApplication( ctx->session->remote_service );
+	if( !app )
+		return -1;
+
+	const char* prefix = jsonObjectGetString( jsonObjectGetIndex( ctx->params, 0 ));
+	size_t prefix_len = prefix ? strlen( prefix ) : 0;
+
+	jsonObject* report = jsonNewObjectType( JSON_HASH );
+	osrfHashIterator* itr = osrfNewHashIterator( app->methods );
+	const osrfMethod* method;
+	while( (method = osrfHashIteratorNext( itr )) ) {
+		const osrfMethodStats* stats = &method->stats;
+		if( !stats->calls || ( prefix_len && strncmp( method->name, prefix, prefix_len )))
+			continue;
+
+		jsonObject* m = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( m, "count", jsonNewNumberObject( stats->calls ));
+		jsonObjectSetKey( m, "cache_hits", jsonNewNumberObject( stats->cache_hits ));
+		jsonObjectSetKey( m, "slow", jsonNewNumberObject( stats->slow ));
+		jsonObjectSetKey( m, "responses", jsonNewNumberObject( stats->responses ));
+		jsonObjectSetKey( m, "bytes", jsonNewNumberObject( stats->bytes ));
+		jsonObjectSetKey( m, "total", jsonNewNumberObject( stats->total_usec / 1e6 ));
+		jsonObjectSetKey( m, "max", jsonNewNumberObject( stats->max_usec / 1e6 ));
+		jsonObjectSetKey( m, "p50", jsonNewNumberObject( latency_quantile( stats, 0.50 )));
+		jsonObjectSetKey( m, "p99", jsonNewNumberObject( latency_quantile( stats, 0.99 )));
+		jsonObject* histogram = jsonNewObjectType( JSON_ARRAY );
+		int i;
+		for( i = 0; i < OSRF_LATENCY_BUCKETS; i++ )
+			jsonObjectPush( histogram, jsonNewNumberObject( stats->buckets[ i ] ));
+		jsonObjectSetKey( m, "histogram", histogram );
+		jsonObjectSetKey( report, method->name, m );
+	}
+	osrfHashIteratorFree( itr );
+
+	osrfAppRespondOwned( ctx, report );
+	return 1;
+}
+
+/**
+	@brief Estimate a quantile of a method's latency from its histogram.
+	@param stats Pointer to the method's statistics.
+	@param q The quantile, between 0 and 1.
+	@return The upper bound of the bucket holding the quantile, in seconds, but no more
+	than the slowest call.
+*/
+static double latency_quantile( const osrfMethodStats* stats, double q ) {
+	unsigned long total = 0;
+	int i;
+	for( i = 0; i < OSRF_LATENCY_BUCKETS; i++ )
+		total += stats->buckets[ i ];
+
+	double max = stats->max_usec / 1e6;
+	unsigned long seen = 0;
+	for( i = 0; i < OSRF_LATENCY_BUCKETS - 1; i++ ) {
+		seen += stats->buckets[ i ];
+		if( seen && seen >= q * total ) {
+			double bound = ( 1UL << i ) / 1000.0;
+			return bound < max ? bound : max;
+		}
+	}
+	return max;
+}
+
+/**
+	@brief Report how long the client will still wait for a method to answer.
+	@param ctx Pointer to the method context.
+	@return The milliseconds left before the request's deadline, zero if it has passed, or
+		-1 if the request has no deadline.
+*/
+long long osrfMethodTimeLeft( const osrfMethodContext* ctx ) {
+	if( !ctx || ctx->deadline <= 0 )
+		return -1;
+	long long left = ctx->deadline - get_monotonic_millis();
+	return left > 0 ? left : 0;
+}
+
+/**
+	@brief Find out whether the client has stopped waiting for a method to answer.
+	@param ctx Pointer to the method context.
+	@return 1 if the request's deadline has passed, or 0 if not, or if it has none.
+
+	A method that works for a long time, or in many steps, may check now and then, and
+	give up once nobody will read what it sends.
+*/
+int osrfMethodExpired( const osrfMethodContext* ctx ) {
+	return 0 == osrfMethodTimeLeft( ctx );
+}
+
 /**
 	@brief Perform a series of sanity tests on an osrfMethodContext.
 	@param ctx Pointer to the osrfMethodContext to be checked.
@@ -1057,35 +1949,349 @@ int osrfMethodVerifyContext( osrfMethodContext* ctx )
 		 return -1;
 	}
 
-	// Log the call, with the method and parameters
-	char* params_str = jsonObjectToJSON( ctx->params );
-	if( params_str ) {
-		// params_str will at minimum be "[]"
-		int i = 0;
-		const char* str;
-		char* method = ctx->method->name;
-		int redact_params = 0;
-		while( (str = osrfStringArrayGetString(log_protect_arr, i++)) ) {
-			//osrfLogInternal(OSRF_LOG_MARK, "Checking for log protection [%s]", str);
-			if(!strncmp(method, str, strlen(str))) {
-				redact_params = 1;
-				break;
+	log_call( ctx );
+	return 0;
+}
+
+/**
+	@brief Log a call, with the method and parameters, as configured by osrfAppLoadCallLog().
+	@param ctx Pointer to the method context, already verified.
+
+	Do nothing at all for a call that the log level, or the sampling rate of the method,
+	rules out.
+*/
+static void log_call( const osrfMethodContext* ctx ) {
+	if( osrfLogGetLevel() < OSRF_LOG_INFO )
+		return;
+
+	osrfMethod* method = ctx->method;
+	if( method->log_every != 1 && ( !method->log_every
+			|| __sync_fetch_and_add( &method->log_seen, 1 ) % method->log_every ))
+		return;      // Sampled out
+
+	int redact = method->log_redact;
+	int i = 0;
+	const char* str;
+	while( !redact && (str = osrfStringArrayGetString( log_protect_arr, i++ )) ) {
+		//osrfLogInternal(OSRF_LOG_MARK, "Checking for log protection [%s]", str);
+		if( !strncmp( method->name, str, strlen( str )))
+			redact = 1;
+	}
+
+	char* params_str = NULL;
+	const char* params = "**PARAMS REDACTED**";
+	size_t len = strlen( params );
+	int truncated = 0;
+	if( !redact ) {
+		params_str = ctx->params ? jsonObjectToJSON( ctx->params ) : strdup( "[]" );
+		if( !params_str )
+			return;
+		params = params_str;
+		len = strlen( params );
+		if( !call_log_json && len >= 2 ) {
+			// Drop the enclosing brackets
+			++params;
+			len -= 2;
+		}
+		if( call_log_max_params && len > call_log_max_params ) {
+			// Cut it short, but not in the middle of a UTF-8 character
+			len = call_log_max_params;
+			while( len && ( (unsigned char) params[ len ] & 0xC0 ) == 0x80 )
+				--len;
+			truncated = 1;
+		}
+	}
+
+	growing_buffer* buf = buffer_init( len + 128 );
+	if( call_log_json ) {
+		buffer_add( buf, "{\"service\":\"" );
+		buffer_append_utf8( buf, ctx->session->remote_service );
+		buffer_add( buf, "\",\"method\":\"" );
+		buffer_append_utf8( buf, method->name );
+		buffer_add( buf, "\",\"params\":" );
+		if( redact || truncated ) {
+			// Not valid JSON as it stands, so embed it as a string
+			char* part = strndup( params, len );
+			buffer_add_char( buf, '"' );
+			buffer_append_utf8( buf, part );
+			buffer_add( buf, truncated ? "...\"" : "\"" );
+			free( part );
+			buffer_add( buf, redact ? ",\"redacted\":true" : ",\"truncated\":true" );
+		} else
+			buffer_add_n( buf, params, len );
+		buffer_add_char( buf, '}' );
+	} else {
+		buffer_fadd( buf, "%s %s ", ctx->session->remote_service, method->name );
+		buffer_add_n( buf, params, len );
+		if( truncated )
+			buffer_add( buf, "..." );
+	}
+	free( params_str );
+
+	osrfLogInfo( OSRF_LOG_MARK, "CALL: %s", OSRF_BUFFER_C_STR( buf ));
+	buffer_free( buf );
+}
+
+/**
+	@brief Build the cache key for a call to a cachable method.
+	@param appName Name of the application.
+	@param method Pointer to the method.
+	@param params Pointer to the parameters of the call; may be NULL.
+	@return The key, which the caller must free.
+
+	The key holds the application name, the method name, and the parameters in canonical
+	form, so that calls whose parameters differ only in the order of their keys share the
+	same responses.
+*/
+static char* memo_key( const char* appName, const osrfMethod* method,
+		const jsonObject* params ) {
+	growing_buffer* buf = buffer_init( 128 );
+	buffer_add( buf, appName );
+	buffer_add_char( buf, '\n' );
+	buffer_add( buf, method->name );
+	buffer_add_char( buf, '\n' );
+	canonical_json( buf, params );
+	return buffer_release( buf );
+}
+
+/**
+	@brief Compare two strings by way of pointers to them, for qsort().
+*/
+static int compare_keys( const void* a, const void* b ) {
+	return strcmp( *(const char* const*) a, *(const char* const*) b );
+}
+
+/**
+	@brief Append a jsonObject to a buffer as JSON, with the keys of objects sorted.
+	@param buf Pointer to the buffer.
+	@param obj Pointer to the jsonObject; may be NULL.
+
+	A class hint is written as the class name and a colon, ahead of the value.  The output
+	is meant only for comparison, not for parsing.
+*/
+static void canonical_json( growing_buffer* buf, const jsonObject* obj ) {
+	if( !obj ) {
+		OSRF_BUFFER_ADD( buf, "null" );
+		return;
+	}
+
+	if( obj->classname ) {
+		buffer_add( buf, obj->classname );
+		buffer_add_char( buf, ':' );
+	}
+
+	switch( obj->type ) {
+		case JSON_HASH : {
+			osrfStringArray* keys = osrfHashKeys( obj->value.h );
+			qsort( keys->list.arrlist, keys->size, sizeof( void* ), compare_keys );
+			buffer_add_char( buf, '{' );
+			int i;
+			for( i = 0; i < keys->size; ++i ) {
+				const char* k = osrfStringArrayGetString( keys, i );
+				if( i )
+					buffer_add_char( buf, ',' );
+				buffer_add_char( buf, '"' );
+				buffer_append_utf8( buf, k );
+				OSRF_BUFFER_ADD( buf, "\":" );
+				canonical_json( buf, jsonObjectGetKeyConst( obj, k ));
 			}
+			buffer_add_char( buf, '}' );
+			osrfStringArrayFree( keys );
+			break;
 		}
+		case JSON_ARRAY : {
+			buffer_add_char( buf, '[' );
+			unsigned long i;
+			for( i = 0; i < obj->size; ++i ) {
+				if( i )
+					buffer_add_char( buf, ',' );
+				canonical_json( buf, jsonObjectGetIndex( obj, i ));
+			}
+			buffer_add_char( buf, ']' );
+			break;
+		}
+		case JSON_STRING :
+			buffer_add_char( buf, '"' );
+			buffer_append_utf8( buf, obj->value.s );
+			buffer_add_char( buf, '"' );
+			break;
+		case JSON_NUMBER :
+			buffer_add( buf, obj->value.s );
+			break;
+		case JSON_BOOL :
+			OSRF_BUFFER_ADD( buf, obj->value.b ? "true" : "false" );
+			break;
+		default :
+			OSRF_BUFFER_ADD( buf, "null" );
+			break;
+	}
+}
+
+/**
+	@brief Build the memcache key for a call to a cachable method.
+	@param key The local cache key.
+	@return The memcache key, which the caller must free.
+
+	A digest keeps the key within memcache's limits, and keeps it from being mangled by
+	osrfCache's removal of white space.
+*/
+static char* shared_memo_key( const char* key ) {
+	char* digest = md5sum( key );
+	char* shared_key = va_list_to_string( "osrf_method_cache_%s", digest );
+	free( digest );
+	return shared_key;
+}
 
-		char* params_logged;
-		if(redact_params) {
-			params_logged = strdup("**PARAMS REDACTED**");
-		} else {
-			params_str[strlen(params_str) - 1] = '\0'; // drop the trailing ']'
-			params_logged = strdup(params_str + 1);
+/**
+	@brief Look for the cached responses to a call.
+	@param key The cache key, from memo_key().
+	@param method Pointer to the method called.
+	@return A pointer to a JSON array of the responses, owned by the cache; or NULL if
+	there are none, or they have expired.
+
+	Look in the local cache first and then, for a shared method, in memcache, adding what
+	we find there to the local cache.
+*/
+static const jsonObject* memo_get( const char* key, const osrfMethod* method ) {
+	if( method_cache ) {
+		unsigned int hash = method_hash( key );
+		memo_entry* entry = method_cache->buckets[ hash & ( method_cache->bucket_count - 1 ) ];
+		while( entry && !( entry->hash == hash && !strcmp( entry->key, key )))
+			entry = entry->next;
+
+		if( entry ) {
+			if( entry->expires <= get_monotonic_millis() ) {
+				memo_remove( method_cache, entry );
+			} else {
+				// Move it to the front of the line.
+				if( entry != method_cache->newest ) {
+					entry->newer->older = entry->older;
+					if( entry->older )
+						entry->older->newer = entry->newer;
+					else
+						method_cache->oldest = entry->newer;
+					entry->newer = NULL;
+					entry->older = method_cache->newest;
+					method_cache->newest->newer = entry;
+					method_cache->newest = entry;
+				}
+				return entry->responses;
+			}
 		}
-		free( params_str );
-		osrfLogInfo( OSRF_LOG_MARK, "CALL: %s %s %s",
-			ctx->session->remote_service, ctx->method->name, params_logged);
-		free( params_logged );
 	}
-	return 0;
+
+	if( method->cache_shared ) {
+		char* shared_key = shared_memo_key( key );
+		jsonObject* responses = osrfCacheGetObject( shared_key );
+		free( shared_key );
+		if( responses && responses->type == JSON_ARRAY ) {
+			memo_put( key, method, responses, 0 );
+			return method_cache->newest->responses;
+		}
+		jsonObjectFree( responses );
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Cache the responses to a call.
+	@param key The cache key, from memo_key().
+	@param method Pointer to the method called.
+	@param responses Pointer to a JSON array of the responses, which the cache takes over.
+	@param share Boolean: true to store the responses in memcache as well.
+
+	Replace any responses already cached for the same key, and evict the least recently
+	used entries to make room.
+*/
+static void memo_put( const char* key, const osrfMethod* method, jsonObject* responses,
+		int share ) {
+	if( !method_cache ) {
+		method_cache = safe_malloc( sizeof( memo_cache ));
+		unsigned int count = 16;
+		while( count < (unsigned int) method_cache_size )
+			count *= 2;
+		method_cache->bucket_count = count;
+		method_cache->buckets = safe_malloc( count * sizeof( memo_entry* ));
+	}
+
+	unsigned int hash = method_hash( key );
+	memo_entry** bucket = &method_cache->buckets[ hash & ( method_cache->bucket_count - 1 ) ];
+	memo_entry* entry = *bucket;
+	while( entry ) {
+		if( entry->hash == hash && !strcmp( entry->key, key )) {
+			memo_remove( method_cache, entry );
+			break;
+		}
+		entry = entry->next;
+	}
+
+	while( method_cache->count >= method_cache_size && method_cache->oldest )
+		memo_remove( method_cache, method_cache->oldest );
+
+	entry = safe_malloc( sizeof( memo_entry ));
+	entry->key = strdup( key );
+	entry->hash = hash;
+	// Shared, so that replaying them to an atomic method doesn't copy them
+	entry->responses = jsonObjectShare( responses );
+	jsonObjectFree( responses );
+	entry->expires = get_monotonic_millis() + (long long) method->cache_ttl * 1000;
+	entry->next = *bucket;
+	*bucket = entry;
+	entry->older = method_cache->newest;
+	if( method_cache->newest )
+		method_cache->newest->newer = entry;
+	else
+		method_cache->oldest = entry;
+	method_cache->newest = entry;
+	++method_cache->count;
+
+	if( share ) {
+		char* shared_key = shared_memo_key( key );
+		osrfCachePutObject( shared_key, entry->responses, method->cache_ttl );
+		free( shared_key );
+	}
+}
+
+/**
+	@brief Remove an entry from a method cache, and free it.
+	@param cache Pointer to the method cache.
+	@param entry Pointer to the entry, which must be in the cache.
+*/
+static void memo_remove( memo_cache* cache, memo_entry* entry ) {
+	memo_entry** link = &cache->buckets[ entry->hash & ( cache->bucket_count - 1 ) ];
+	while( *link != entry )
+		link = &(*link)->next;
+	*link = entry->next;
+
+	if( entry->newer )
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+	if( entry->older )
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+	--cache->count;
+
+	free( entry->key );
+	jsonObjectFree( entry->responses );
+	free( entry );
+}
+
+/**
+	@brief Send cached responses to a client, as if the method had just produced them.
+	@param ctx Pointer to the method context.
+	@param responses Pointer to a JSON array of the responses.
+	@return Zero if successful, or -1 upon error.
+*/
+static int memo_replay( osrfMethodContext* ctx, const jsonObject* responses ) {
+	unsigned long i;
+	for( i = 0; i < responses->size; ++i ) {
+		if( _osrfAppRespond( ctx, jsonObjectGetIndex( responses, i ), 0 ))
+			return -1;
+	}
+	return _osrfAppPostProcess( ctx, 1 );
 }
 
 /**
@@ -1117,8 +2323,12 @@ static void osrfMethodFree( char* name, void* p ) {
 static void osrfAppFree( char* name, void* p ) {
 	osrfApplication* app = p;
 	if( app ) {
+		if( last_app == app )
+			last_app = NULL;
 		dlclose( app->handle );
+		free( app->method_table );
 		osrfHashFree( app->methods );
+		free( app->name );
 		free( app );
 	}
 }
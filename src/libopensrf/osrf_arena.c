@@ -0,0 +1,260 @@
+/**
+	@file osrf_arena.c
+	@brief Implementation of osrfArena, a region allocator.
+
+	Memory comes from a chain of blocks.  Small requests are carved from the newest block
+	until it runs out, whereupon we start another.  A request too big to fit comfortably in
+	a block gets a block of its own, which goes behind the current one so that the space
+	left in the current one isn't wasted.
+
+	Cleanups registered with osrfArenaOnReset() live in the arena themselves, on a stack,
+	and are run newest first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <opensrf/osrf_arena.h>
+
+/** @brief Alignment of everything carved from an osrfArena. */
+#define ARENA_ALIGN 16
+
+/** @brief Round a size up to a multiple of ARENA_ALIGN. */
+#define ARENA_ROUND(n) ( ( (n) + ARENA_ALIGN - 1 ) & ~( (size_t) ARENA_ALIGN - 1 ) )
+
+/**
+	@brief A block of memory in an osrfArena.
+*/
+typedef struct arena_block_struct {
+	struct arena_block_struct* next;  /**< Next older block. */
+	size_t size;                      /**< Bytes available in @a data. */
+	size_t used;                      /**< Bytes carved from @a data so far. */
+	/** The memory itself, aligned for anything. */
+	union {
+		long double ld;
+		void* p;
+		long long ll;
+		char data[ 1 ];
+	} mem;
+} arena_block;
+
+/**
+	@brief Something to do before an osrfArena gives its memory back.
+*/
+typedef struct arena_cleanup_struct {
+	void (*func)( void* );                /**< What to do; NULL if canceled. */
+	void* data;                           /**< What to do it to. */
+	struct arena_cleanup_struct* next;    /**< Next older cleanup. */
+} arena_cleanup;
+
+struct osrf_arena_struct {
+	arena_block* blocks;        /**< Newest block first. */
+	arena_block* first;         /**< The block allocated with the arena, kept on reset. */
+	size_t block_size;          /**< Size of a regular block. */
+	size_t used;                /**< Bytes handed out since the last reset. */
+	arena_cleanup* cleanups;    /**< Newest cleanup first. */
+};
+
+/**
+	@brief Allocate a block for an osrfArena.
+	@param size How many bytes it should hold.
+	@return Pointer to the new block.  Upon failure, exit.
+*/
+static arena_block* new_block( size_t size ) {
+	arena_block* block = malloc( offsetof( arena_block, mem ) + size );
+	if( !block ) {
+		perror( "osrfArena: Out of Memory" );
+		exit( 99 );
+	}
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+/**
+	@brief Create a new osrfArena.
+	@param block_size Size of the blocks to carve memory from, or zero for
+		OSRF_ARENA_BLOCK_SIZE.
+	@return Pointer to the new osrfArena.
+
+	The first block is allocated right away, and kept until the arena is freed.
+
+	The calling code is responsible for freeing the osrfArena by calling osrfArenaFree().
+*/
+osrfArena* osrfNewArena( size_t block_size ) {
+	if( 0 == block_size )
+		block_size = OSRF_ARENA_BLOCK_SIZE;
+	block_size = ARENA_ROUND( block_size );
+
+	osrfArena* arena = malloc( sizeof( osrfArena ) );
+	if( !arena ) {
+		perror( "osrfArena: Out of Memory" );
+		exit( 99 );
+	}
+	arena->blocks = arena->first = new_block( block_size );
+	arena->block_size = block_size;
+	arena->used = 0;
+	arena->cleanups = NULL;
+	return arena;
+}
+
+/**
+	@brief Carve memory from an osrfArena.
+	@param arena Pointer to the osrfArena.
+	@param size How many bytes are needed.
+	@return Pointer to the memory, suitably aligned for anything, or NULL if @a arena is NULL.
+
+	The memory is not initialized.  It stays valid until the next osrfArenaReset() or
+	osrfArenaFree(); don't free() it.
+*/
+void* osrfArenaAlloc( osrfArena* arena, size_t size ) {
+	if( !arena )
+		return NULL;
+
+	size = ARENA_ROUND( size ? size : 1 );
+	arena->used += size;
+
+	arena_block* block = arena->blocks;
+	if( block->size - block->used < size ) {
+		if( size > arena->block_size / 4 ) {
+			// Too big to share a block; give it one of its own, behind the current one
+			arena_block* big = new_block( size );
+			big->used = size;
+			big->next = block->next;
+			block->next = big;
+			return big->mem.data;
+		}
+		block = new_block( arena->block_size );
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	void* p = block->mem.data + block->used;
+	block->used += size;
+	return p;
+}
+
+/**
+	@brief Carve zeroed memory from an osrfArena.
+	@param arena Pointer to the osrfArena.
+	@param size How many bytes are needed.
+	@return Pointer to the memory, or NULL if @a arena is NULL.
+
+	Otherwise the same as osrfArenaAlloc().
+*/
+void* osrfArenaCalloc( osrfArena* arena, size_t size ) {
+	void* p = osrfArenaAlloc( arena, size );
+	if( p )
+		memset( p, 0, size );
+	return p;
+}
+
+/**
+	@brief Copy a string into an osrfArena.
+	@param arena Pointer to the osrfArena.
+	@param str The string to copy.
+	@return Pointer to the copy, or NULL if either parameter is NULL.
+*/
+char* osrfArenaStrdup( osrfArena* arena, const char* str ) {
+	if( !arena || !str )
+		return NULL;
+	size_t len = strlen( str ) + 1;
+	char* p = osrfArenaAlloc( arena, len );
+	memcpy( p, str, len );
+	return p;
+}
+
+/**
+	@brief Arrange for a function to be called when an osrfArena is reset or freed.
+	@param arena Pointer to the osrfArena.
+	@param func The function to call.
+	@param data What to pass to it.
+
+	Cleanups run newest first, before any of the arena's memory goes away, so they may
+	still look at anything in the arena.
+*/
+void osrfArenaOnReset( osrfArena* arena, void (*func)( void* ), void* data ) {
+	if( !arena || !func )
+		return;
+	arena_cleanup* cleanup = osrfArenaAlloc( arena, sizeof( arena_cleanup ) );
+	cleanup->func = func;
+	cleanup->data = data;
+	cleanup->next = arena->cleanups;
+	arena->cleanups = cleanup;
+}
+
+/**
+	@brief Cancel a cleanup registered with osrfArenaOnReset().
+	@param arena Pointer to the osrfArena.
+	@param func The function that was to be called.
+	@param data What was to be passed to it.
+	@return 1 if the cleanup was found and canceled, or 0 if not.
+
+	Cancels the newest matching cleanup only.  This is a linear search, meant for the
+	exceptional case.
+*/
+int osrfArenaCancel( osrfArena* arena, void (*func)( void* ), void* data ) {
+	if( !arena )
+		return 0;
+	arena_cleanup* cleanup;
+	for( cleanup = arena->cleanups; cleanup; cleanup = cleanup->next ) {
+		if( cleanup->func == func && cleanup->data == data ) {
+			cleanup->func = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+	@brief Report how much memory has been carved from an osrfArena since it was last reset.
+	@param arena Pointer to the osrfArena.
+	@return The number of bytes, after rounding each request up for alignment.
+*/
+size_t osrfArenaUsed( const osrfArena* arena ) {
+	return arena ? arena->used : 0;
+}
+
+/**
+	@brief Release everything carved from an osrfArena, keeping the arena for reuse.
+	@param arena Pointer to the osrfArena.
+
+	First run any cleanups; then free every block but the first, and empty that one.
+*/
+void osrfArenaReset( osrfArena* arena ) {
+	if( !arena )
+		return;
+
+	// A cleanup may register another; take them off the list as we go
+	while( arena->cleanups ) {
+		arena_cleanup* cleanup = arena->cleanups;
+		arena->cleanups = cleanup->next;
+		if( cleanup->func )
+			cleanup->func( cleanup->data );
+	}
+
+	arena_block* block = arena->blocks;
+	while( block ) {
+		arena_block* next = block->next;
+		if( block != arena->first )
+			free( block );
+		block = next;
+	}
+	arena->first->next = NULL;
+	arena->first->used = 0;
+	arena->blocks = arena->first;
+	arena->used = 0;
+}
+
+/**
+	@brief Free an osrfArena and everything carved from it.
+	@param arena Pointer to the osrfArena.
+*/
+void osrfArenaFree( osrfArena* arena ) {
+	if( !arena )
+		return;
+	osrfArenaReset( arena );
+	free( arena->first );
+	free( arena );
+}
@@ -0,0 +1,163 @@
+/**
+	@file osrf_backlog.c
+	@brief The queue of requests waiting for a prefork child.
+
+	See osrf_backlog.h for the policies.  Items are recycled through a free list, since
+	a busy listener pushes and pops them constantly.
+*/
+
+#include <stdlib.h>
+#include <opensrf/osrf_backlog.h>
+#include <opensrf/utils.h>
+
+/**
+	@brief Add a request to the end of its priority class.
+	@param queue Pointer to the osrfBacklog.
+	@param msg Pointer to the request, which the queue takes over.
+	@param priority The priority class of the request.
+	@param deadline When the request's client stops waiting, on the monotonic clock in ms;
+		or zero if it didn't say.
+
+	The request goes in regardless of any limit; see osrfBacklogAdmit() for that.
+*/
+void osrfBacklogPush( osrfBacklog* queue, transport_message* msg, int priority,
+		long long deadline ) {
+	osrfBacklogItem* item;
+	if( queue->free_list ) {
+		item = queue->free_list;
+		queue->free_list = item->next;
+	} else
+		item = safe_malloc( sizeof( osrfBacklogItem ));
+	item->msg = msg;
+	item->arrived = get_timestamp_millis();
+	item->deadline = deadline;
+	item->priority = priority;
+	item->next = NULL;
+
+	if( queue->tail[ priority ] )
+		queue->tail[ priority ]->next = item;
+	else
+		queue->head[ priority ] = item;
+	queue->tail[ priority ] = item;
+	queue->size++;
+}
+
+/**
+	@brief Add a request, within a limit on the size of the queue.
+	@param queue Pointer to the osrfBacklog.
+	@param msg Pointer to the request.
+	@param priority The priority class of the request.
+	@param deadline When the request's client stops waiting, on the monotonic clock in ms;
+		or zero if it didn't say.
+	@param limit The most requests the queue may hold.
+	@return NULL if the request went in without dropping anything; otherwise a pointer
+		to the request that was dropped, which may be @a msg itself.
+
+	If the queue is full, make room by dropping the newest request of the lowest class
+	below @a priority; failing that, drop @a msg instead.  An empty queue takes the
+	request whatever the limit.
+
+	The queue takes over @a msg unless it comes back; the caller takes over whatever
+	request comes back, and is responsible for telling its client.
+*/
+transport_message* osrfBacklogAdmit( osrfBacklog* queue, transport_message* msg,
+		int priority, long long deadline, int limit ) {
+	transport_message* dropped = NULL;
+	if( queue->size && queue->size >= limit ) {
+		dropped = osrfBacklogEvict( queue, priority );
+		if( !dropped )
+			return msg;
+	}
+
+	osrfBacklogPush( queue, msg, priority, deadline );
+	return dropped;
+}
+
+/**
+	@brief Find the request that should be serviced next.
+	@param queue Pointer to the osrfBacklog.
+	@return Pointer to the oldest request in the highest non-empty priority class, or
+		NULL if the queue is empty.
+*/
+osrfBacklogItem* osrfBacklogPeek( osrfBacklog* queue ) {
+	int i;
+	for( i = 0; i < OSRF_PRIORITY_COUNT; i++ )
+		if( queue->head[ i ] )
+			return queue->head[ i ];
+	return NULL;
+}
+
+/**
+	@brief Remove the oldest request from a priority class.
+	@param queue Pointer to the osrfBacklog.
+	@param priority The priority class, which must not be empty.
+	@return Pointer to the request, which the caller takes over.
+*/
+transport_message* osrfBacklogPop( osrfBacklog* queue, int priority ) {
+	osrfBacklogItem* item = queue->head[ priority ];
+	queue->head[ priority ] = item->next;
+	if( !item->next )
+		queue->tail[ priority ] = NULL;
+	queue->size--;
+
+	transport_message* msg = item->msg;
+	item->next = queue->free_list;
+	queue->free_list = item;
+	return msg;
+}
+
+/**
+	@brief Make room in a full queue by dropping a request of lower priority.
+	@param queue Pointer to the osrfBacklog.
+	@param priority The priority class of the request that needs the room.
+	@return Pointer to the newest request of the lowest priority class below @a priority,
+		which the caller takes over; or NULL if there is no such request.
+*/
+transport_message* osrfBacklogEvict( osrfBacklog* queue, int priority ) {
+	int i;
+	for( i = OSRF_PRIORITY_COUNT - 1; i > priority; i-- ) {
+		osrfBacklogItem* victim = queue->tail[ i ];
+		if( !victim )
+			continue;
+
+		// Find the item ahead of the victim, so we can make it the new tail
+		osrfBacklogItem* prev = NULL;
+		osrfBacklogItem* cur = queue->head[ i ];
+		while( cur != victim ) {
+			prev = cur;
+			cur = cur->next;
+		}
+		if( prev )
+			prev->next = NULL;
+		else
+			queue->head[ i ] = NULL;
+		queue->tail[ i ] = prev;
+		queue->size--;
+
+		transport_message* msg = victim->msg;
+		victim->next = queue->free_list;
+		queue->free_list = victim;
+		return msg;
+	}
+	return NULL;
+}
+
+/**
+	@brief Empty the queue and release its memory.
+	@param queue Pointer to the osrfBacklog.
+
+	Free any requests still waiting, along with the items on the free list.  The queue
+	is left empty, ready for reuse.
+*/
+void osrfBacklogClear( osrfBacklog* queue ) {
+	int i;
+	for( i = 0; i < OSRF_PRIORITY_COUNT; i++ )
+		while( queue->head[ i ] )
+			message_free( osrfBacklogPop( queue, i ));
+
+	while( queue->free_list ) {
+		osrfBacklogItem* item = queue->free_list;
+		queue->free_list = item->next;
+		free( item );
+	}
+}
@@ -110,63 +110,108 @@ unsigned long osrfBigHashGetCount( osrfBigHash* hash ) {
 void osrfBigHashFree( osrfBigHash* hash ) {
 	if(!hash) return;
 
-	int i;
-	osrfStringArray* keys = osrfBigHashKeys( hash );
-
-	for( i = 0; i != keys->size; i++ )  {
-		const char* key = osrfStringArrayGetString( keys, i );
-		osrfBigHashRemove( hash, key );
+	/* Walk the keys in place, rather than collecting them all first */
+	if( hash->freeItem ) {
+		Word_t* value;
+		uint8_t idx[OSRF_HASH_MAXKEY];
+		strcpy( (char*) idx, "" );
+		JSLF( value, hash->hash, idx );
+
+		while( value ) {
+			if( *value )
+				hash->freeItem( (char*) idx, (void*) *value );
+			JSLN( value, hash->hash, idx );
+		}
 	}
 
-	osrfStringArrayFree(keys);
+	Word_t bytes;
+	JSLFA( bytes, hash->hash );
+	(void) bytes;
 	free(hash);
 }
 
 
 
-osrfBigHashIterator* osrfNewBigHashIterator( osrfBigHash* hash ) {
+static osrfBigHashIterator* new_iterator( osrfBigHash* hash, const char* start,
+		size_t prefix_len, const char* end ) {
 	if(!hash) return NULL;
+	if( start && strlen(start) >= OSRF_HASH_MAXKEY ) return NULL;
+
 	osrfBigHashIterator* itr = safe_malloc(sizeof(osrfBigHashIterator));
 	itr->hash = hash;
 	itr->current = NULL;
+	itr->start = start ? strdup(start) : NULL;
+	itr->prefix_len = prefix_len;
+	itr->end = end ? strdup(end) : NULL;
+	itr->done = 0;
 	return itr;
 }
 
+osrfBigHashIterator* osrfNewBigHashIterator( osrfBigHash* hash ) {
+	return new_iterator( hash, NULL, 0, NULL );
+}
+
+osrfBigHashIterator* osrfNewBigHashPrefixIterator( osrfBigHash* hash, const char* prefix ) {
+	if(!prefix) prefix = "";
+	return new_iterator( hash, prefix, strlen(prefix), NULL );
+}
+
+osrfBigHashIterator* osrfNewBigHashRangeIterator( osrfBigHash* hash,
+		const char* from, const char* to ) {
+	return new_iterator( hash, from, 0, to );
+}
+
+/* Judy keeps its keys in strcmp() order, so the first key out of range ends the walk */
+static int in_range( const osrfBigHashIterator* itr ) {
+	const char* key = (const char*) itr->key;
+	if( itr->prefix_len && strncmp( key, itr->start, itr->prefix_len ) )
+		return 0;
+	if( itr->end && strcmp( key, itr->end ) >= 0 )
+		return 0;
+	return 1;
+}
+
 void* osrfBigHashIteratorNext( osrfBigHashIterator* itr ) {
-	if(!(itr && itr->hash)) return NULL;
+	if(!(itr && itr->hash) || itr->done) return NULL;
 
 	Word_t* value;
-	uint8_t idx[OSRF_HASH_MAXKEY];
 
-	if( itr->current == NULL ) { /* get the first item in the list */
-		strcpy(idx, "");
-		JSLF( value, itr->hash->hash, idx );
+	if( itr->current == NULL ) { /* get the first item in the range */
+		strcpy( (char*) itr->key, itr->start ? itr->start : "" );
+		JSLF( value, itr->hash->hash, itr->key );
 
 	} else {
-		strcpy(idx, itr->current);
-		JSLN( value, itr->hash->hash, idx );
+		/* Judy advances the key in place, so there's nothing to copy */
+		JSLN( value, itr->hash->hash, itr->key );
 	}
 
-	if(value) {
-		free(itr->current);
-		itr->current = strdup((char*) idx);
+	if( value && in_range( itr ) ) {
+		itr->current = (char*) itr->key;
 		return (void*) *value;
 	}
 
+	itr->current = NULL;
+	itr->done = 1;
 	return NULL;
 
 }
 
+const char* osrfBigHashIteratorKey( const osrfBigHashIterator* itr ) {
+	if(!itr) return NULL;
+	return itr->current;
+}
+
 void osrfBigHashIteratorFree( osrfBigHashIterator* itr ) {
 	if(!itr) return;
-	free(itr->current);
+	free(itr->start);
+	free(itr->end);
 	free(itr);
 }
 
 void osrfBigHashIteratorReset( osrfBigHashIterator* itr ) {
 	if(!itr) return;
-	free(itr->current);
 	itr->current = NULL;
+	itr->done = 0;
 }
 
 
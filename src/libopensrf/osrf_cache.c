@@ -14,13 +14,99 @@ GNU General Public License for more details.
 */
 
 #include <opensrf/osrf_cache.h>
+#include <opensrf/osrf_digest.h>
 #include <ctype.h>
+#include <zlib.h>
 
 #define MAX_KEY_LEN 250
 
-static struct memcached_st* _osrfCache = NULL;
+/* item flag for a gzipped value: the one Cache::Memcached uses, so Perl can read it */
+#define OSRF_CACHE_F_COMPRESS 2
+
+/* compressed values are kept only if they save at least this many percent */
+#define OSRF_CACHE_COMPRESS_SAVINGS 20
+
+static __thread struct memcached_st* _osrfCache = NULL;   /* one per thread */
 static time_t _osrfCacheMaxSeconds = -1;
-static char* _clean_key( const char* );
+static osrfCacheBehaviors _osrfCacheBehaviors = { 0, 1, 1, 1, 0 };
+static size_t _osrfCacheCompressThreshold = 0;   /* 0 means never compress */
+static char* _compress( const char* value, size_t len, size_t* out_len );
+static char* _cache_value( char* data, size_t len, uint32_t flags, const char* key );
+static int _apply_behaviors( void );
+static size_t _clean_key( const char* key, char* buf );
+static void _cache_set( const char* key, const char* value, time_t seconds );
+static void _cache_delete( const char* key );
+static osrfHash* _cache_mget( const osrfStringArray* keys );
+static uint64_t _begin_batch( void );
+static int _end_batch( uint64_t buffered );
+
+/* ------------------------------------------------------------------
+   The local cache: parsed objects kept in-process, one set per thread
+   like the memcached handle, keyed by cleaned key.  The entries form a
+   list from most to least recently used, and the least recently used
+   one goes when there are too many.
+   ------------------------------------------------------------------ */
+typedef struct _localEntryStruct {
+	struct _localEntryStruct* newer;
+	struct _localEntryStruct* older;
+	jsonObject* obj;
+	time_t expires;
+	char key[];
+} localEntry;
+
+/* how many removals to allow beyond maxItems before compacting the local cache */
+#define LOCAL_CACHE_SLACK 64
+
+static int _localMaxItems = 0;    /* 0 means there is no local cache */
+static time_t _localMaxAge = OSRF_CACHE_LOCAL_MAX_AGE;
+static __thread osrfHash* _local = NULL;
+static __thread localEntry* _localNewest = NULL;
+static __thread localEntry* _localOldest = NULL;
+static __thread int _localDropped = 0;  /* dead nodes the osrfHash is holding on to */
+
+static jsonObject* _local_get( const char* clean_key );
+static void _local_put( const char* clean_key, const jsonObject* obj );
+static void _local_forget( const char* clean_key );
+static void _local_clear( void );
+
+void osrfCacheDefaultBehaviors( osrfCacheBehaviors* behaviors ) {
+	if( !behaviors ) return;
+	behaviors->binary_protocol = 0;
+	behaviors->tcp_nodelay = 1;
+	behaviors->consistent_hashing = 1;
+	behaviors->noreply = 1;
+	behaviors->non_blocking = 0;
+}
+
+int osrfCacheSetBehaviors( const osrfCacheBehaviors* behaviors ) {
+	if( !behaviors ) return -1;
+	_osrfCacheBehaviors = *behaviors;
+	return _osrfCache ? _apply_behaviors() : 0;
+}
+
+static int _apply_behaviors( void ) {
+	const osrfCacheBehaviors* b = &_osrfCacheBehaviors;
+	struct { memcached_behavior_t behavior; int value; const char* name; } settings[] = {
+		{ MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, b->binary_protocol, "binary_protocol" },
+		{ MEMCACHED_BEHAVIOR_TCP_NODELAY, b->tcp_nodelay, "tcp_nodelay" },
+		{ MEMCACHED_BEHAVIOR_KETAMA, b->consistent_hashing, "consistent_hashing" },
+		{ MEMCACHED_BEHAVIOR_NOREPLY, b->noreply, "noreply" },
+		{ MEMCACHED_BEHAVIOR_NO_BLOCK, b->non_blocking, "non_blocking" }
+	};
+
+	int ret = 0;
+	int i;
+	for( i = 0; i < sizeof( settings ) / sizeof( settings[0] ); i++ ) {
+		memcached_return rc = memcached_behavior_set( _osrfCache,
+			settings[i].behavior, settings[i].value ? 1 : 0 );
+		if( rc != MEMCACHED_SUCCESS ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to set memcached behavior %s - %s",
+				settings[i].name, memcached_strerror( _osrfCache, rc ) );
+			ret = -1;
+		}
+	}
+	return ret;
+}
 
 int osrfCacheInit( const char* serverStrings[], int size, time_t maxCacheSeconds ) {
 	memcached_server_st *server_pool;
@@ -32,21 +118,218 @@ int osrfCacheInit( const char* serverStrings[], int size, time_t maxCacheSeconds
 	int i;
 	_osrfCache = memcached_create(NULL);
 	_osrfCacheMaxSeconds = maxCacheSeconds;
+	_apply_behaviors();
 
+	/* hand libmemcached all the servers at once, so that it hashes over the full set */
+	growing_buffer* servers = buffer_init( 64 );
 	for( i = 0; i < size && serverStrings[i]; i++ ) {
-		/* TODO: modify caller to pass a list of servers all at once */
-		server_pool = memcached_servers_parse(serverStrings[i]);
-		rc = memcached_server_push(_osrfCache, server_pool);
-		if (rc != MEMCACHED_SUCCESS) {
-			osrfLogError(OSRF_LOG_MARK,
-				"Failed to add memcached server: %s - %s",
-				serverStrings[i], memcached_strerror(_osrfCache, rc));
+		if( i ) OSRF_BUFFER_ADD_CHAR( servers, ',' );
+		OSRF_BUFFER_ADD( servers, serverStrings[i] );
+	}
+
+	server_pool = memcached_servers_parse( OSRF_BUFFER_C_STR( servers ) );
+	rc = memcached_server_push(_osrfCache, server_pool);
+	if (rc != MEMCACHED_SUCCESS) {
+		osrfLogError(OSRF_LOG_MARK,
+			"Failed to add memcached servers: %s - %s",
+			OSRF_BUFFER_C_STR( servers ), memcached_strerror(_osrfCache, rc));
+	}
+	if( server_pool )
+		memcached_server_list_free( server_pool );
+	buffer_free( servers );
+
+	return 0;
+}
+
+void osrfCacheSetCompression( size_t threshold ) {
+	_osrfCacheCompressThreshold = threshold;
+}
+
+/**
+  Gzips a value, returning a newly allocated buffer and its length through out_len,
+  or NULL on error.  Speed matters more than size here.
+  */
+static char* _compress( const char* value, size_t len, size_t* out_len ) {
+	z_stream z;
+	memset( &z, 0, sizeof( z ) );
+	if( deflateInit2( &z, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		return NULL;
+
+	size_t size = deflateBound( &z, len );
+	char* out = safe_malloc( size );
+	z.next_in = (Bytef*) value;
+	z.avail_in = len;
+	z.next_out = (Bytef*) out;
+	z.avail_out = size;
+	int rc = deflate( &z, Z_FINISH );
+	*out_len = z.total_out;
+	deflateEnd( &z );
+
+	if( rc != Z_STREAM_END ) {
+		free( out );
+		return NULL;
+	}
+	return out;
+}
+
+/**
+  Turns a value as memcached returned it into a nul-terminated string, gunzipping it
+  if its flags say so.  Takes over data, and returns either it or a replacement;
+  NULL if the value won't decompress.
+  */
+static char* _cache_value( char* data, size_t len, uint32_t flags, const char* key ) {
+	if( !data || !(flags & OSRF_CACHE_F_COMPRESS) )
+		return data;
+
+	z_stream z;
+	memset( &z, 0, sizeof( z ) );
+	if( inflateInit2( &z, 15 + 32 ) != Z_OK ) {
+		free( data );
+		return NULL;
+	}
+
+	size_t size = len * 4 + 64;
+	char* out = safe_malloc( size );
+	z.next_in = (Bytef*) data;
+	z.avail_in = len;
+	int rc;
+	for( ;; ) {
+		z.next_out = (Bytef*) out + z.total_out;
+		z.avail_out = size - 1 - z.total_out;   /* leave room for the nul */
+		rc = inflate( &z, Z_NO_FLUSH );
+		if( rc != Z_OK || z.avail_out != 0 )
+			break;        /* done, or stuck; either way, out of room isn't the problem */
+		size *= 2;
+		char* bigger = realloc( out, size );
+		if( !bigger ) {
+			rc = Z_MEM_ERROR;
+			break;
 		}
+		out = bigger;
 	}
+	size_t out_len = z.total_out;
+	inflateEnd( &z );
+	free( data );
 
+	if( rc != Z_STREAM_END ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to decompress cached value for key [%s]", key );
+		free( out );
+		return NULL;
+	}
+	out[ out_len ] = '\0';
+	return out;
+}
+
+int osrfCacheInitLocal( int maxItems, time_t maxAge ) {
+	if( maxItems < 0 ) return -1;
+	_local_clear();
+	_localMaxItems = maxItems;
+	_localMaxAge = (maxAge <= 0 || maxAge > OSRF_CACHE_LOCAL_MAX_AGE) ?
+		OSRF_CACHE_LOCAL_MAX_AGE : maxAge;
+	if( maxItems )
+		osrfLogInfo( OSRF_LOG_MARK, "Keeping up to %d cached objects locally for %ld seconds",
+			maxItems, (long) _localMaxAge );
 	return 0;
 }
 
+static void _local_unlink( localEntry* e ) {
+	if( e->newer ) e->newer->older = e->older;
+	else _localNewest = e->older;
+	if( e->older ) e->older->newer = e->newer;
+	else _localOldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+static void _local_push( localEntry* e ) {
+	e->newer = NULL;
+	e->older = _localNewest;
+	if( _localNewest ) _localNewest->newer = e;
+	else _localOldest = e;
+	_localNewest = e;
+}
+
+/* item-freeing callback for the local cache's osrfHash */
+static void _local_free_entry( char* key, void* item ) {
+	localEntry* e = (localEntry*) item;
+	_local_unlink( e );
+	jsonObjectFree( e->obj );
+	free( e );
+}
+
+/**
+  Removes an entry from the local cache.  An osrfHash keeps the node of every removed
+  item until it is freed, so once enough have piled up, move the live entries to a new
+  osrfHash and free the old one.
+  */
+static void _local_drop( localEntry* e ) {
+	osrfHashRemove( _local, "%s", e->key );
+	if( ++_localDropped <= _localMaxItems + LOCAL_CACHE_SLACK )
+		return;
+
+	osrfHash* fresh = osrfNewHash();
+	osrfHashSetCallback( fresh, _local_free_entry );
+	for( e = _localOldest; e; e = e->newer )
+		osrfHashSet( fresh, e, "%s", e->key );
+	osrfHashSetCallback( _local, NULL );
+	osrfHashFree( _local );
+	_local = fresh;
+	_localDropped = 0;
+}
+
+/**
+  Returns a copy of the locally cached object for a key, or NULL if there is none
+  that is still fresh.
+  */
+static jsonObject* _local_get( const char* clean_key ) {
+	if( !_local ) return NULL;
+	localEntry* e = osrfHashGet( _local, clean_key );
+	if( !e ) return NULL;
+	if( e->expires <= time( NULL ) ) {
+		_local_drop( e );
+		return NULL;
+	}
+	_local_unlink( e );
+	_local_push( e );
+	osrfLogInternal( OSRF_LOG_MARK, "Returning object (key=%s) from the local cache", clean_key );
+	return jsonObjectClone( e->obj );
+}
+
+/**
+  Keeps a copy of an object in the local cache, if there is one, making room if need be.
+  */
+static void _local_put( const char* clean_key, const jsonObject* obj ) {
+	if( _localMaxItems <= 0 || !obj ) return;
+	if( !_local ) {
+		_local = osrfNewHash();
+		osrfHashSetCallback( _local, _local_free_entry );
+	}
+
+	size_t len = strlen( clean_key );
+	localEntry* e = safe_malloc( sizeof( localEntry ) + len + 1 );
+	memcpy( e->key, clean_key, len + 1 );
+	e->obj = jsonObjectClone( obj );
+	e->expires = time( NULL ) + _localMaxAge;
+	osrfHashSet( _local, e, "%s", clean_key );   /* frees any older entry */
+	_local_push( e );
+
+	while( osrfHashGetCount( _local ) > (unsigned long) _localMaxItems )
+		_local_drop( _localOldest );
+}
+
+static void _local_forget( const char* clean_key ) {
+	localEntry* e = _local ? osrfHashGet( _local, clean_key ) : NULL;
+	if( e )
+		_local_drop( e );
+}
+
+static void _local_clear( void ) {
+	if( _local ) {
+		osrfHashFree( _local );
+		_local = NULL;
+		_localDropped = 0;
+	}
+}
+
 int osrfCachePutObject( const char* key, const jsonObject* obj, time_t seconds ) {
 	if( !(key && obj) ) return -1;
 	char* s = jsonObjectToJSON( obj );
@@ -56,40 +339,92 @@ int osrfCachePutObject( const char* key, const jsonObject* obj, time_t seconds )
 	return 0;
 }
 
-char* _clean_key( const char* key ) {
-    char* clean_key = (char*)strdup(key);
-    char* d = clean_key;
-    char* s = clean_key;
-    do {
-        while(isspace(*s) || ((*s != '\0') && iscntrl(*s))) s++;
-    } while((*d++ = *s++));
-    if (strlen(clean_key) > MAX_KEY_LEN) {
-        char *hashed = md5sum(clean_key);
-        clean_key[0] = '\0';
-        strncat(clean_key, "shortened_", 11);
-        strncat(clean_key, hashed, MAX_KEY_LEN);
-        free(hashed);
-    }
-    return clean_key;
+/**
+  Writes a key, minus whitespace and control characters, into buf, which must hold
+  MAX_KEY_LEN + 1 bytes.  A key still too long for memcached is replaced by
+  "shortened_" and the MD5 of what it would have been; or, should there be no MD5 to
+  be had, cut short.  Returns the length.
+  */
+static size_t _clean_key( const char* key, char* buf ) {
+	size_t len = 0;
+	const unsigned char* s;
+	for( s = (const unsigned char*) key; *s; s++ ) {
+		if( isspace(*s) || iscntrl(*s) )
+			continue;
+		if( len == MAX_KEY_LEN ) {
+			len++;
+			break;
+		}
+		buf[len++] = *s;
+	}
+
+	if( len > MAX_KEY_LEN ) {
+		// Digest the cleaned key a run of kept characters at a time, without copying it
+		osrfDigest digest;
+		const unsigned char* run = NULL;
+		if( osrfDigestInit( &digest, OSRF_DIGEST_MD5 )) {
+			osrfLogError( OSRF_LOG_MARK, "Unable to digest a long cache key; truncating it" );
+			buf[ MAX_KEY_LEN ] = '\0';
+			return MAX_KEY_LEN;
+		}
+		for( s = (const unsigned char*) key; ; s++ ) {
+			if( *s && !(isspace(*s) || iscntrl(*s)) ) {
+				if( !run )
+					run = s;
+			} else {
+				if( run )
+					osrfDigestUpdate( &digest, run, s - run );
+				run = NULL;
+				if( !*s )
+					break;
+			}
+		}
+
+		memcpy( buf, "shortened_", 10 );
+		len = 10 + 2 * osrfDigestFinal( &digest, NULL, buf + 10 );
+	}
+
+	buf[len] = '\0';
+	return len;
 }
 
 int osrfCachePutString( const char* key, const char* value, time_t seconds ) {
-	memcached_return rc;
 	if( !(key && value) ) return -1;
+	_cache_set( key, value, seconds );
+	return 0;
+}
+
+static void _cache_set( const char* key, const char* value, time_t seconds ) {
+	memcached_return rc;
 	seconds = (seconds <= 0 || seconds > _osrfCacheMaxSeconds) ? _osrfCacheMaxSeconds : seconds;
 	osrfLogInternal( OSRF_LOG_MARK, "osrfCachePutString(): Putting string (key=%s): %s", key, value);
 
-	char* clean_key = _clean_key( key );
+	char clean_key[ MAX_KEY_LEN + 1 ];
+	size_t key_len = _clean_key( key, clean_key );
+	_local_forget( clean_key );
+
+	size_t len = strlen(value);
+	uint32_t flags = 0;
+	char* packed = NULL;
+	if( _osrfCacheCompressThreshold && len >= _osrfCacheCompressThreshold ) {
+		size_t packed_len;
+		packed = _compress( value, len, &packed_len );
+		if( packed && packed_len < len / 100 * (100 - OSRF_CACHE_COMPRESS_SAVINGS) ) {
+			osrfLogInternal( OSRF_LOG_MARK, "Compressed [%s] from %lu to %lu bytes",
+				key, (unsigned long) len, (unsigned long) packed_len );
+			value = packed;
+			len = packed_len;
+			flags |= OSRF_CACHE_F_COMPRESS;
+		}
+	}
 
 	/* add or overwrite existing key:value pair */
-	rc = memcached_set(_osrfCache, clean_key, strlen(clean_key), value, strlen(value), seconds, 0);
-	if (rc != MEMCACHED_SUCCESS) {
+	rc = memcached_set(_osrfCache, clean_key, key_len, value, len, seconds, flags);
+	if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED) {
 		osrfLogError(OSRF_LOG_MARK, "Failed to cache key:value [%s]:[%s] - %s",
-			key, value, memcached_strerror(_osrfCache, rc));
+			key, flags ? "(compressed)" : value, memcached_strerror(_osrfCache, rc));
 	}
-
-	free(clean_key);
-	return 0;
+	free( packed );
 }
 
 jsonObject* osrfCacheGetObject( const char* key, ... ) {
@@ -98,16 +433,21 @@ jsonObject* osrfCacheGetObject( const char* key, ... ) {
 	memcached_return rc;
 	jsonObject* obj = NULL;
 	if( key ) {
-		char* clean_key = _clean_key( key );
-		const char* data = (const char*) memcached_get(_osrfCache, clean_key, strlen(clean_key), &val_len, &flags, &rc);
-		free(clean_key);
+		char clean_key[ MAX_KEY_LEN + 1 ];
+		size_t key_len = _clean_key( key, clean_key );
+		if( (obj = _local_get( clean_key )) )
+			return obj;
+		char* data = (char*) memcached_get(_osrfCache, clean_key, key_len, &val_len, &flags, &rc);
 		if (rc != MEMCACHED_SUCCESS) {
 			osrfLogDebug(OSRF_LOG_MARK, "Failed to get key [%s] - %s",
 				key, memcached_strerror(_osrfCache, rc));
 		}
+		data = _cache_value( data, val_len, flags, key );
 		if( data ) {
 			osrfLogInternal( OSRF_LOG_MARK, "osrfCacheGetObject(): Returning object (key=%s): %s", key, data);
 			obj = jsonParse( data );
+			_local_put( clean_key, obj );
+			free(data);
 			return obj;
 		}
 		osrfLogDebug(OSRF_LOG_MARK, "No cache data exists with key %s", key);
@@ -120,13 +460,14 @@ char* osrfCacheGetString( const char* key, ... ) {
 	uint32_t flags;
 	memcached_return rc;
 	if( key ) {
-		char* clean_key = _clean_key( key );
-		char* data = (char*) memcached_get(_osrfCache, clean_key, strlen(clean_key), &val_len, &flags, &rc);
-		free(clean_key);
+		char clean_key[ MAX_KEY_LEN + 1 ];
+		size_t key_len = _clean_key( key, clean_key );
+		char* data = (char*) memcached_get(_osrfCache, clean_key, key_len, &val_len, &flags, &rc);
 		if (rc != MEMCACHED_SUCCESS) {
 			osrfLogDebug(OSRF_LOG_MARK, "Failed to get key [%s] - %s",
 				key, memcached_strerror(_osrfCache, rc));
 		}
+		data = _cache_value( data, val_len, flags, key );
 		osrfLogInternal( OSRF_LOG_MARK, "osrfCacheGetString(): Returning object (key=%s): %s", key, data);
 		if(!data) osrfLogDebug(OSRF_LOG_MARK, "No cache data exists with key %s", key);
 		return data;
@@ -136,35 +477,267 @@ char* osrfCacheGetString( const char* key, ... ) {
 
 
 int osrfCacheRemove( const char* key, ... ) {
-	memcached_return rc;
 	if( key ) {
-		char* clean_key = _clean_key( key );
-		rc = memcached_delete(_osrfCache, clean_key, strlen(clean_key), 0 );
-		free(clean_key);
-		if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED) {
-			osrfLogDebug(OSRF_LOG_MARK, "Failed to delete key [%s] - %s",
-				key, memcached_strerror(_osrfCache, rc));
-		}
+		_cache_delete( key );
 		return 0;
 	}
 	return -1;
 }
 
+static void _cache_delete( const char* key ) {
+	memcached_return rc;
+	char clean_key[ MAX_KEY_LEN + 1 ];
+	size_t key_len = _clean_key( key, clean_key );
+	_local_forget( clean_key );
+	rc = memcached_delete(_osrfCache, clean_key, key_len, 0 );
+	if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED) {
+		osrfLogDebug(OSRF_LOG_MARK, "Failed to delete key [%s] - %s",
+			key, memcached_strerror(_osrfCache, rc));
+	}
+}
+
+/* item-freeing callbacks for the hashes the multi-gets return */
+static void _free_string( char* key, void* item ) {
+	free( item );
+}
+
+static void _free_object( char* key, void* item ) {
+	jsonObjectFree( (jsonObject*) item );
+}
+
+/**
+  Fetches the values for a list of keys with a single memcached_mget(), returning
+  an osrfHash of strings keyed by the keys as given (not as cleaned).
+  */
+static osrfHash* _cache_mget( const osrfStringArray* keys ) {
+	if( !keys ) return NULL;
+
+	osrfHash* found = osrfNewHash();
+	osrfHashSetCallback( found, _free_string );
+	int count = keys->size;
+	if( count <= 0 ) return found;
+
+	/* memcached hands results back by cleaned key, so remember where each came from */
+	char (*clean_keys)[ MAX_KEY_LEN + 1 ] = safe_malloc( count * sizeof( *clean_keys ) );
+	const char** key_ptrs = safe_malloc( count * sizeof( char* ) );
+	size_t* key_lens = safe_malloc( count * sizeof( size_t ) );
+	osrfHash* originals = osrfNewHash();
+	int i;
+	for( i = 0; i < count; i++ ) {
+		const char* key = osrfStringArrayGetString( keys, i );
+		key_lens[i] = _clean_key( key ? key : "", clean_keys[i] );
+		key_ptrs[i] = clean_keys[i];
+		if( key )
+			osrfHashSet( originals, (void*) key, "%s", clean_keys[i] );
+	}
+
+	memcached_return rc = memcached_mget( _osrfCache,
+		key_ptrs, key_lens, count );
+	if( rc != MEMCACHED_SUCCESS ) {
+		osrfLogDebug( OSRF_LOG_MARK, "Failed to get %d keys - %s",
+			count, memcached_strerror( _osrfCache, rc ) );
+	} else {
+		memcached_result_st result;
+		if( memcached_result_create( _osrfCache, &result ) ) {
+			char kbuf[ MAX_KEY_LEN + 1 ];
+			while( memcached_fetch_result( _osrfCache, &result, &rc ) ) {
+				size_t klen = memcached_result_key_length( &result );
+				if( klen > MAX_KEY_LEN )
+					continue;
+				memcpy( kbuf, memcached_result_key_value( &result ), klen );
+				kbuf[ klen ] = '\0';
+				const char* key = osrfHashGet( originals, kbuf );
+				if( !key )
+					continue;
+
+				size_t val_len = memcached_result_length( &result );
+				char* data = safe_malloc( val_len + 1 );
+				memcpy( data, memcached_result_value( &result ), val_len );
+				data = _cache_value( data, val_len, memcached_result_flags( &result ), key );
+				if( !data )
+					continue;
+				osrfLogInternal( OSRF_LOG_MARK,
+					"osrfCacheGetStrings(): Returning object (key=%s): %s", key, data );
+				osrfHashSet( found, data, "%s", key );
+			}
+			memcached_result_free( &result );
+		}
+	}
+
+	osrfLogDebug( OSRF_LOG_MARK, "Found %lu of %d keys in the cache",
+		osrfHashGetCount( found ), count );
+
+	osrfHashFree( originals );
+	free( clean_keys );
+	free( key_ptrs );
+	free( key_lens );
+	return found;
+}
+
+osrfHash* osrfCacheGetStrings( const osrfStringArray* keys ) {
+	return _cache_mget( keys );
+}
+
+osrfHash* osrfCacheGetObjects( const osrfStringArray* keys ) {
+	if( !keys ) return NULL;
+
+	osrfHash* objs = osrfNewHash();
+	osrfHashSetCallback( objs, _free_object );
+
+	/* take what we can from the local cache, and ask memcached for the rest */
+	osrfStringArray* misses = NULL;
+	int i;
+	if( _local ) {
+		misses = osrfNewStringArray( keys->size );
+		for( i = 0; i < keys->size; i++ ) {
+			const char* key = osrfStringArrayGetString( keys, i );
+			char clean_key[ MAX_KEY_LEN + 1 ];
+			_clean_key( key, clean_key );
+			jsonObject* obj = _local_get( clean_key );
+			if( obj )
+				osrfHashSet( objs, obj, "%s", key );
+			else
+				osrfStringArrayAdd( misses, key );
+		}
+	}
+
+	osrfHash* strings = _cache_mget( misses ? misses : keys );
+	osrfHashCursor cursor = NULL;
+	const char* key;
+	const char* data;
+	while( (data = osrfHashCursorNext( strings, &cursor, &key )) ) {
+		jsonObject* obj = jsonParse( data );
+		if( obj ) {
+			if( _localMaxItems > 0 ) {
+				char clean_key[ MAX_KEY_LEN + 1 ];
+				_clean_key( key, clean_key );
+				_local_put( clean_key, obj );
+			}
+			osrfHashSet( objs, obj, "%s", key );
+		}
+	}
+
+	osrfHashFree( strings );
+	osrfStringArrayFree( misses );
+	return objs;
+}
+
+/**
+  Turns on request buffering, so that a series of stores or deletes goes out together
+  instead of waiting on a reply apiece.  Returns the previous setting, for _end_batch().
+  */
+static uint64_t _begin_batch( void ) {
+	uint64_t buffered = memcached_behavior_get( _osrfCache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS );
+	memcached_behavior_set( _osrfCache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1 );
+	return buffered;
+}
+
+/**
+  Sends whatever _begin_batch() held back, and restores the buffering setting.
+  Returns 0 on success, -1 on error.
+  */
+static int _end_batch( uint64_t buffered ) {
+	memcached_return rc = memcached_flush_buffers( _osrfCache );
+	memcached_behavior_set( _osrfCache, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, buffered );
+	if( rc != MEMCACHED_SUCCESS ) {
+		osrfLogError( OSRF_LOG_MARK, "Failed to send batched cache requests - %s",
+			memcached_strerror( _osrfCache, rc ) );
+		return -1;
+	}
+	return 0;
+}
+
+int osrfCacheAddString( const char* key, const char* value, time_t seconds ) {
+	if( !(key && value && _osrfCache) ) return -1;
+	seconds = (seconds <= 0 || seconds > _osrfCacheMaxSeconds) ? _osrfCacheMaxSeconds : seconds;
+
+	char clean_key[ MAX_KEY_LEN + 1 ];
+	size_t key_len = _clean_key( key, clean_key );
+	_local_forget( clean_key );
+
+	/* the answer is the point, so wait for it even if stores normally don't */
+	uint64_t noreply = memcached_behavior_get( _osrfCache, MEMCACHED_BEHAVIOR_NOREPLY );
+	if( noreply )
+		memcached_behavior_set( _osrfCache, MEMCACHED_BEHAVIOR_NOREPLY, 0 );
+	memcached_return rc = memcached_add( _osrfCache, clean_key, key_len,
+		value, strlen( value ), seconds, 0 );
+	if( noreply )
+		memcached_behavior_set( _osrfCache, MEMCACHED_BEHAVIOR_NOREPLY, noreply );
+
+	if( rc == MEMCACHED_SUCCESS )
+		return 0;
+	if( rc == MEMCACHED_NOTSTORED || rc == MEMCACHED_DATA_EXISTS )
+		return 1;
+	osrfLogError( OSRF_LOG_MARK, "Failed to add key:value [%s]:[%s] - %s",
+		key, value, memcached_strerror( _osrfCache, rc ) );
+	return -1;
+}
+
+int osrfCachePutStrings( osrfHash* strings, time_t seconds ) {
+	if( !strings ) return -1;
+
+	uint64_t buffered = _begin_batch();
+	osrfHashCursor cursor = NULL;
+	const char* key;
+	const char* value;
+	while( (value = osrfHashCursorNext( strings, &cursor, &key )) )
+		_cache_set( key, value, seconds );
+	return _end_batch( buffered );
+}
+
+int osrfCachePutObjects( osrfHash* objs, time_t seconds ) {
+	if( !objs ) return -1;
+
+	uint64_t buffered = _begin_batch();
+	osrfHashCursor cursor = NULL;
+	const char* key;
+	const jsonObject* obj;
+	while( (obj = osrfHashCursorNext( objs, &cursor, &key )) ) {
+		char* s = jsonObjectToJSON( obj );
+		_cache_set( key, s, seconds );
+		free( s );
+	}
+	return _end_batch( buffered );
+}
+
+int osrfCacheRemoveMany( const osrfStringArray* keys ) {
+	if( !keys ) return -1;
+
+	uint64_t buffered = _begin_batch();
+	int i;
+	for( i = 0; i < keys->size; i++ ) {
+		const char* key = osrfStringArrayGetString( keys, i );
+		if( key )
+			_cache_delete( key );
+	}
+	return _end_batch( buffered );
+}
+
 
 int osrfCacheSetExpire( time_t seconds, const char* key, ... ) {
 	if( key ) {
-		char* clean_key = _clean_key( key );
-		jsonObject* o = osrfCacheGetObject( clean_key );
-		int rc = osrfCachePutObject( clean_key, o, seconds );
-		jsonObjectFree(o);
+		// Go to memcached itself, not the local copy, which may be stale, or may
+		// outlive a removal by another process.  Putting the value back also drops
+		// whatever local copy there is.
+		char* data = osrfCacheGetString( key );
+		if( !data ) {
+			char clean_key[ MAX_KEY_LEN + 1 ];
+			_clean_key( key, clean_key );
+			_local_forget( clean_key );
+			return -1;
+		}
+		int rc = osrfCachePutString( key, data, seconds );
+		free( data );
 		return rc;
 	}
 	return -1;
 }
 
 void osrfCacheCleanup() {
+	_local_clear();
 	if(_osrfCache) {
 		memcached_free(_osrfCache);
+		_osrfCache = NULL;
 	}
 }
 
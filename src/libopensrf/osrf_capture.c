@@ -0,0 +1,305 @@
+/**
+	@file osrf_capture.c
+	@brief Writing and reading the capture files described in osrf_capture.h.
+
+	The file is opened once, for appending, before the service forks its drones, so that
+	they all share it.  Each record goes out in a single write(), which the kernel appends
+	whole, so that records from different drones, or from different threads of a drone,
+	never interleave.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <opensrf/osrf_capture.h>
+#include <opensrf/osrf_system.h>
+#include <opensrf/log.h>
+
+/** @brief Fixed part of a record, after its length: time and the four field lengths. */
+#define CAPTURE_FIXED_SIZE 18
+/** @brief Longest record osrfCaptureRead() will accept. */
+#define CAPTURE_MAX_RECORD ( 64 * 1024 * 1024 )
+
+/** @brief The capture file, or -1 if we don't capture requests. */
+static int capture_fd = -1;
+
+/**
+	@brief A capture file open for reading.
+*/
+struct osrf_capture_file_struct {
+	FILE* file;         /**< The file itself. */
+	char* buf;          /**< The latest record, followed by its fields, nul-terminated. */
+	size_t size;        /**< Size of the buffer. */
+};
+
+static void add_uint( growing_buffer* buf, unsigned long long value, int bytes );
+static unsigned long long get_uint( const unsigned char* p, int bytes );
+static const char* get_field( const char** pos, const char* end, int bytes, char** out );
+
+/**
+	@brief Start or stop capturing requests.
+	@param path Name of the file to which to append them; or NULL, to stop.
+	@return 0 if successful, or -1 if not.
+
+	Write the magic string if the file is new.
+*/
+int osrfCaptureInit( const char* path ) {
+	if( capture_fd >= 0 ) {
+		close( capture_fd );
+		capture_fd = -1;
+	}
+
+	if( !path )
+		return 0;
+
+	int fd = open( path, O_WRONLY | O_APPEND | O_CREAT, 0640 );
+	if( fd < 0 ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to open capture file %s: %s",
+			path, strerror( errno ));
+		return -1;
+	}
+
+	struct stat st;
+	if( fstat( fd, &st ) == 0 && st.st_size == 0
+			&& write( fd, OSRF_CAPTURE_MAGIC, 8 ) != 8 ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to write to capture file %s: %s",
+			path, strerror( errno ));
+		close( fd );
+		return -1;
+	}
+
+	capture_fd = fd;
+	osrfLogInfo( OSRF_LOG_MARK, "Capturing requests to %s", path );
+	return 0;
+}
+
+/**
+	@brief Tell whether we capture requests.
+	@return Boolean; true if we do.
+*/
+int osrfCaptureEnabled( void ) {
+	return capture_fd >= 0;
+}
+
+/**
+	@brief Append a record of a request to the capture file.
+	@param service Name of the service receiving the request.
+	@param msg Pointer to the REQUEST message.
+
+	Other kinds of messages are ignored.  The xid is the one the log uses for the
+	current request.  Parameters left as JSON text by lazy deserialization are copied
+	as they are, without being parsed.
+*/
+void osrfCaptureRequest( const char* service, osrfMessage* msg ) {
+	if( capture_fd < 0 || !msg || msg->m_type != REQUEST || !msg->method_name )
+		return;
+
+	const char* method = msg->method_name;
+	const char* xid = osrfLogGetXid();
+	if( !service )
+		service = "";
+	if( !xid )
+		xid = "";
+
+	size_t service_len = strlen( service );
+	size_t method_len = strlen( method );
+	size_t xid_len = strlen( xid );
+	if( service_len > 0xFFFF || method_len > 0xFFFF || xid_len > 0xFFFF )
+		return;
+
+	int redact = 0;
+	int i = 0;
+	const char* str;
+	while( !redact && (str = osrfStringArrayGetString( log_protect_arr, i++ )) ) {
+		if( !strncmp( method, str, strlen( str )))
+			redact = 1;
+	}
+
+	char* params_str = NULL;
+	const char* params = "";
+	if( !redact ) {
+		if( msg->_raw_params && !msg->_params )
+			params = msg->_raw_params;
+		else if( msg->_params )
+			params = params_str = jsonObjectToJSON( msg->_params );
+		else
+			params = "[]";
+		if( !params )
+			return;
+	}
+	size_t params_len = strlen( params );
+
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	long long now = (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+
+	size_t len = CAPTURE_FIXED_SIZE + service_len + method_len + xid_len + params_len;
+	growing_buffer* buf = buffer_init( len + 4 );
+	add_uint( buf, len, 4 );
+	add_uint( buf, now, 8 );
+	add_uint( buf, service_len, 2 );
+	buffer_add_n( buf, service, service_len );
+	add_uint( buf, method_len, 2 );
+	buffer_add_n( buf, method, method_len );
+	add_uint( buf, xid_len, 2 );
+	buffer_add_n( buf, xid, xid_len );
+	add_uint( buf, params_len, 4 );
+	buffer_add_n( buf, params, params_len );
+	free( params_str );
+
+	ssize_t written = write( capture_fd, OSRF_BUFFER_C_STR( buf ), buf->n_used );
+	if( written != (ssize_t) buf->n_used )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to capture request for %s: %s",
+			method, strerror( errno ));
+	buffer_free( buf );
+}
+
+/**
+	@brief Open a capture file for reading.
+	@param path Name of the file.
+	@return Pointer to a newly created osrfCaptureFile, or NULL if the file can't be
+		opened, or isn't a capture file.
+
+	The caller should close it with osrfCaptureClose().
+*/
+osrfCaptureFile* osrfCaptureOpen( const char* path ) {
+	if( !path )
+		return NULL;
+
+	FILE* file = fopen( path, "rb" );
+	if( !file ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to open capture file %s: %s",
+			path, strerror( errno ));
+		return NULL;
+	}
+
+	char magic[ 8 ];
+	if( fread( magic, 1, 8, file ) != 8 || memcmp( magic, OSRF_CAPTURE_MAGIC, 8 )) {
+		osrfLogError( OSRF_LOG_MARK, "%s is not a capture file", path );
+		fclose( file );
+		return NULL;
+	}
+
+	osrfCaptureFile* cf = safe_malloc( sizeof( osrfCaptureFile ));
+	cf->file = file;
+	cf->buf = NULL;
+	cf->size = 0;
+	return cf;
+}
+
+/**
+	@brief Read the next record from a capture file.
+	@param file Pointer to the osrfCaptureFile.
+	@param record Pointer to an osrfCaptureRecord to fill in.
+	@return 1 if a record was read, 0 at the end of the file, or -1 if the file is
+		truncated or corrupt.
+*/
+int osrfCaptureRead( osrfCaptureFile* file, osrfCaptureRecord* record ) {
+	if( !file || !record )
+		return -1;
+
+	unsigned char prefix[ 4 ];
+	size_t got = fread( prefix, 1, 4, file->file );
+	if( got == 0 && feof( file->file ))
+		return 0;
+	if( got != 4 )
+		return -1;
+
+	size_t len = get_uint( prefix, 4 );
+	if( len < CAPTURE_FIXED_SIZE || len > CAPTURE_MAX_RECORD )
+		return -1;
+
+	// Room for the record, and then for its four fields with a nul after each
+	size_t size = 2 * len + 4;
+	if( size > file->size ) {
+		free( file->buf );
+		file->buf = safe_malloc( size );
+		file->size = size;
+	}
+
+	if( fread( file->buf, 1, len, file->file ) != len )
+		return -1;
+
+	const char* pos = file->buf + 8;
+	const char* end = file->buf + len;
+	char* out = file->buf + len;
+
+	record->time = get_uint( (const unsigned char*) file->buf, 8 );
+	if( !(record->service = get_field( &pos, end, 2, &out ))
+			|| !(record->method = get_field( &pos, end, 2, &out ))
+			|| !(record->xid = get_field( &pos, end, 2, &out ))
+			|| !(record->params = get_field( &pos, end, 4, &out )))
+		return -1;
+
+	if( !*record->params )
+		record->params = NULL;    // Protected
+
+	return 1;
+}
+
+/**
+	@brief Close a capture file opened by osrfCaptureOpen().
+	@param file Pointer to the osrfCaptureFile.
+*/
+void osrfCaptureClose( osrfCaptureFile* file ) {
+	if( !file )
+		return;
+	fclose( file->file );
+	free( file->buf );
+	free( file );
+}
+
+/**
+	@brief Append an unsigned integer to a buffer, little-endian.
+	@param buf Pointer to the growing_buffer.
+	@param value The integer.
+	@param bytes How many bytes to write.
+*/
+static void add_uint( growing_buffer* buf, unsigned long long value, int bytes ) {
+	char bytes_out[ 8 ];
+	int i;
+	for( i = 0; i < bytes; i++ ) {
+		bytes_out[ i ] = (char) ( value & 0xFF );
+		value >>= 8;
+	}
+	buffer_add_n( buf, bytes_out, bytes );
+}
+
+/**
+	@brief Decode a little-endian unsigned integer.
+	@param p Pointer to the first byte.
+	@param bytes How many bytes to decode.
+	@return The integer.
+*/
+static unsigned long long get_uint( const unsigned char* p, int bytes ) {
+	unsigned long long value = 0;
+	while( bytes-- > 0 )
+		value = ( value << 8 ) | p[ bytes ];
+	return value;
+}
+
+/**
+	@brief Copy a length-prefixed field out of a record, as a nul-terminated string.
+	@param pos Pointer to the read position, advanced past the field.
+	@param end End of the record.
+	@param bytes Size of the length prefix.
+	@param out Pointer to the write position, advanced past the copy and its nul.
+	@return Pointer to the copy, or NULL if the field runs past the end of the record.
+*/
+static const char* get_field( const char** pos, const char* end, int bytes, char** out ) {
+	if( end - *pos < bytes )
+		return NULL;
+	size_t len = get_uint( (const unsigned char*) *pos, bytes );
+	*pos += bytes;
+	if( (size_t) ( end - *pos ) < len )
+		return NULL;
+
+	char* copy = *out;
+	memcpy( copy, *pos, len );
+	copy[ len ] = '\0';
+	*pos += len;
+	*out += len + 1;
+	return copy;
+}
@@ -20,39 +20,130 @@
 
 /**
 	@file osrf_digest.c
-	@brief Routines to calculate SHA1 and MD5 digests of strings.
+	@brief Routines to calculate MD5, SHA1, and SHA256 digests.
+
+	Everything goes through gnutls' hash interface, which picks the fastest implementation
+	the CPU supports.  If gnutls won't compute MD5, as in FIPS mode, we compute it with
+	the routines in md5.c, so that keys and names made from MD5 digests still work.
 */
 
 #include <stdlib.h>
 #include <string.h>
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
 #include "opensrf/utils.h"
 #include "opensrf/osrf_digest.h"
+#include "opensrf/md5.h"
 
+static gnutls_digest_algorithm_t gnutls_algorithm( osrfDigestAlgorithm algorithm );
+static void digest_string( osrfDigestAlgorithm algorithm, const char* str,
+	unsigned char* binary, char* hex );
 static void format_hex( char* buf, const unsigned char* s, size_t n );
+static void md5_feed( struct md5_ctx* ctx, const void* data, size_t len );
 
 /**
-	@brief Calculate an SHA1 digest for a specified string.
-	@param result Pointer to an osrfSHA1Buffer to receive the result.
-	@param str Pointer to a nul-terminated string to be digested.
+	@brief Report the size of a digest.
+	@param algorithm Which digest.
+	@return The size of the binary digest, in bytes.
 */
-void osrf_sha1_digest( osrfSHA1Buffer* result, const char *str ) {
-	if( !result )
+size_t osrfDigestSize( osrfDigestAlgorithm algorithm ) {
+	switch( algorithm ) {
+		case OSRF_DIGEST_MD5    : return 16;
+		case OSRF_DIGEST_SHA1   : return 20;
+		case OSRF_DIGEST_SHA256 : return 32;
+	}
+	return 0;
+}
+
+/**
+	@brief Start an incremental digest.
+	@param digest Pointer to the osrfDigest to initialize.
+	@param algorithm Which digest to compute.
+	@return 0 if successful, or -1 if not.
+
+	If this function fails, osrfDigestUpdate() ignores the digest, and osrfDigestFinal()
+	reports an empty one.  An MD5 digest doesn't fail, since we can always fall back on
+	our own.
+*/
+int osrfDigestInit( osrfDigest* digest, osrfDigestAlgorithm algorithm ) {
+	if( !digest )
+		return -1;
+
+	gnutls_hash_hd_t handle;
+	digest->algorithm = algorithm;
+	digest->handle = NULL;
+	digest->md5 = NULL;
+	if( gnutls_hash_init( &handle, gnutls_algorithm( algorithm )) != GNUTLS_E_SUCCESS ) {
+		if( OSRF_DIGEST_MD5 != algorithm )
+			return -1;
+		struct md5_ctx* ctx = safe_malloc( sizeof( struct md5_ctx ));
+		MD5_start( ctx );
+		digest->md5 = ctx;
+		return 0;
+	}
+
+	digest->handle = handle;
+	return 0;
+}
+
+/**
+	@brief Feed input to an incremental digest.
+	@param digest Pointer to the osrfDigest.
+	@param data Pointer to the input.
+	@param len Length of the input, in bytes.
+*/
+void osrfDigestUpdate( osrfDigest* digest, const void* data, size_t len ) {
+	if( !( digest && data && len ))
 		return;
+	if( digest->handle )
+		gnutls_hash( (gnutls_hash_hd_t) digest->handle, data, len );
+	else if( digest->md5 )
+		md5_feed( digest->md5, data, len );
+}
 
-	result->hex[0] = '\0';
+/**
+	@brief Finish an incremental digest.
+	@param digest Pointer to the osrfDigest.
+	@param binary Pointer to a buffer to receive the binary digest, at least
+		osrfDigestSize() bytes long; may be NULL.
+	@param hex Pointer to a buffer to receive the digest as a nul-terminated hex string,
+		at least twice osrfDigestSize() bytes long, plus one; may be NULL.
+	@return The size of the digest in bytes, or zero if it couldn't be computed.
 
-	if( str ) {
-		size_t out_size = sizeof( result->binary ); /* SHA1 is 160 bits output. */
-
-		gnutls_datum_t in;
-		in.data = (unsigned char*) str;
-		in.size = strlen( str );
-		if( gnutls_fingerprint( GNUTLS_DIG_SHA1, &in, result->binary, &out_size )
-				== GNUTLS_E_SUCCESS ) {
-			format_hex( result->hex, result->binary, out_size );
-		}
+	The osrfDigest may be initialized again afterwards, for another digest.
+*/
+size_t osrfDigestFinal( osrfDigest* digest, unsigned char* binary, char* hex ) {
+	if( hex )
+		hex[ 0 ] = '\0';
+	if( !digest || !( digest->handle || digest->md5 ))
+		return 0;
+
+	unsigned char out[ OSRF_DIGEST_MAX_SIZE ];
+	size_t size = osrfDigestSize( digest->algorithm );
+	if( digest->md5 ) {
+		MD5_stop( digest->md5, out );
+		free( digest->md5 );
+		digest->md5 = NULL;
+	} else {
+		gnutls_hash_deinit( (gnutls_hash_hd_t) digest->handle, out );
+		digest->handle = NULL;
 	}
+
+	if( binary )
+		memcpy( binary, out, size );
+	if( hex )
+		format_hex( hex, out, size );
+	return size;
+}
+
+/**
+	@brief Calculate an SHA1 digest for a specified string.
+	@param result Pointer to an osrfSHA1Buffer to receive the result.
+	@param str Pointer to a nul-terminated string to be digested.
+*/
+void osrf_sha1_digest( osrfSHA1Buffer* result, const char *str ) {
+	if( result )
+		digest_string( OSRF_DIGEST_SHA1, str, result->binary, result->hex );
 }
 
 /**
@@ -69,28 +160,38 @@ void osrf_sha1_digest_fmt( osrfSHA1Buffer* result, const char* str, ... ) {
 		result->hex[0] = '\0';
 }
 
+/**
+	@brief Calculate an SHA256 digest for a specified string.
+	@param result Pointer to an osrfSHA256Buffer to receive the result.
+	@param str Pointer to a nul-terminated string to be digested.
+*/
+void osrf_sha256_digest( osrfSHA256Buffer* result, const char *str ) {
+	if( result )
+		digest_string( OSRF_DIGEST_SHA256, str, result->binary, result->hex );
+}
+
+/**
+	@brief Calculate an SHA256 digest for a formatted string.
+	@param result Pointer to an osrfSHA256Buffer to receive the result.
+	@param str Pointer to a printf-style format string.  Subsequent arguments, if any, are
+	formatted and inserted into the string to be digested.
+*/
+void osrf_sha256_digest_fmt( osrfSHA256Buffer* result, const char* str, ... ) {
+	if( str ) {
+		VA_LIST_TO_STRING( str );
+		osrf_sha256_digest( result, VA_BUF );
+	} else if( result )
+		result->hex[0] = '\0';
+}
+
 /**
 	@brief Calculate an MD5 digest for a specified string.
 	@param result Pointer to an osrfMD5Buffer to receive the result.
 	@param str Pointer to a nul-terminated string to be digested.
 */
 void osrf_md5_digest( osrfMD5Buffer* result, const char *str )  {
-	if( !result )
-		return;
-
-	result->hex[0] = '\0';
-
-	if( str ) {
-		size_t out_size = sizeof( result->binary ); /* MD5 is 128 bits output. */
-
-		gnutls_datum_t in;
-		in.data = (unsigned char*) str;
-		in.size = strlen( str );
-		if( gnutls_fingerprint( GNUTLS_DIG_MD5, &in, result->binary, &out_size )
-				  == GNUTLS_E_SUCCESS ) {
-			format_hex( result->hex, result->binary, out_size );
-		}
-	}
+	if( result )
+		digest_string( OSRF_DIGEST_MD5, str, result->binary, result->hex );
 }
 
 /**
@@ -107,6 +208,60 @@ void osrf_md5_digest_fmt( osrfMD5Buffer* result, const char* str, ... ) {
 		result->hex[0] = '\0';
 }
 
+/**
+	@brief Map one of our digest algorithms onto the corresponding one of gnutls.
+	@param algorithm Our algorithm.
+	@return The gnutls algorithm.
+*/
+static gnutls_digest_algorithm_t gnutls_algorithm( osrfDigestAlgorithm algorithm ) {
+	switch( algorithm ) {
+		case OSRF_DIGEST_MD5    : return GNUTLS_DIG_MD5;
+		case OSRF_DIGEST_SHA1   : return GNUTLS_DIG_SHA1;
+		case OSRF_DIGEST_SHA256 : return GNUTLS_DIG_SHA256;
+	}
+	return GNUTLS_DIG_UNKNOWN;
+}
+
+/**
+	@brief Calculate a digest of a string, in one shot.
+	@param algorithm Which digest.
+	@param str Pointer to a nul-terminated string to be digested; may be NULL.
+	@param binary Pointer to a buffer to receive the binary digest.
+	@param hex Pointer to a buffer to receive the hex digest.
+
+	If @a str is NULL, or the digest fails, the hex digest is left empty.  An MD5 digest
+	that gnutls refuses goes the long way round, through osrfDigestInit().
+*/
+static void digest_string( osrfDigestAlgorithm algorithm, const char* str,
+		unsigned char* binary, char* hex ) {
+	hex[0] = '\0';
+	if( !str )
+		return;
+
+	size_t len = strlen( str );
+	if( gnutls_hash_fast( gnutls_algorithm( algorithm ), str, len, binary )
+			== GNUTLS_E_SUCCESS )
+		format_hex( hex, binary, osrfDigestSize( algorithm ));
+	else if( OSRF_DIGEST_MD5 == algorithm ) {
+		osrfDigest digest;
+		osrfDigestInit( &digest, algorithm );
+		osrfDigestUpdate( &digest, str, len );
+		osrfDigestFinal( &digest, binary, hex );
+	}
+}
+
+/**
+	@brief Feed input to the bundled MD5.
+	@param ctx Pointer to its context.
+	@param data Pointer to the input.
+	@param len Length of the input, in bytes.
+*/
+static void md5_feed( struct md5_ctx* ctx, const void* data, size_t len ) {
+	const unsigned char* p = data;
+	while( len-- )
+		MD5_feed( ctx, *p++ );
+}
+
 /**
 	@brief Translate a series of bytes to the corresponding hexadecimal representation.
 	@param buf Pointer to the buffer that will receive the output hex characters.
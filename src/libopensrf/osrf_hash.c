@@ -18,45 +18,73 @@ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 GNU General Public License for more details.
 */
 
+#include <stddef.h>
 #include <opensrf/osrf_hash.h>
 
 /**
 	@brief A node storing a single item within an osrfHash.
+
+	The key is stored in the same allocation as the node, unless it is interned (see
+	osrfHashInternKeys()), in which case the node just points to it.
 */
 struct _osrfHashNodeStruct {
-	/** @brief String containing the key for the item */
+	/** @brief String containing the key for the item, or NULL if logically deleted */
 	char* key;
 	/** @brief Pointer to the stored item data */
 	void* item;
-	/** @brief Pointer to the next node in a doubly linked list */
-	struct _osrfHashNodeStruct* prev;
 	/** @brief Pointer to the previous node in a doubly linked list */
+	struct _osrfHashNodeStruct* prev;
+	/** @brief Pointer to the next node in a doubly linked list */
 	struct _osrfHashNodeStruct* next;
+	/** @brief Once deleted, the next deleted node */
+	struct _osrfHashNodeStruct* chain;
+	/** @brief Hash of the key, valid once the osrfHash has a table */
+	unsigned int hashval;
+	/** @brief Storage for the key */
+	char name[];
 };
 typedef struct _osrfHashNodeStruct osrfHashNode;
 
+/**
+	@brief A slot in the hash table of an osrfHash.
+
+	The slot keeps its own copy of the hash, so that a search can pass over most slots
+	without looking at their nodes.
+*/
+typedef struct {
+	/** @brief Pointer to the node, or NULL if the slot is empty */
+	osrfHashNode* node;
+	/** @brief Hash of the node's key */
+	unsigned int hashval;
+} osrfHashSlot;
+
 /**
 	@brief osrfHash structure
 
 	An osrfHash is partly a key/value store based on a hash table, and partly a linear
 	structure implemented as a linked list.
 
-	The hash table is an array of pointers, managed by an osrfList.  Each pointer in that array
-	points to another layer of osrfList, which stores pointers to osrfHashNodes for keys that
-	hash to the same value.
-
-	Besides residing in this hash table structure, each osrfHashNode resides in a doubly
-	linked list that includes all the osrfHashNodes in the osrfHash (except for any nodes
-	that have been logically deleted).  New nodes are added to the end of the list.
-
-	The hash table supports lookups based on a key.
-
-	The linked list supports sequential traversal, reflecting the sequence in which the nodes
-	were added.
+	Every osrfHashNode resides in a doubly linked list that includes all the osrfHashNodes
+	in the osrfHash (except for any nodes that have been logically deleted).  New nodes are
+	added to the end of the list.  The linked list supports sequential traversal, reflecting
+	the sequence in which the nodes were added.
+
+	Most osrfHashes -- such as the ones holding the contents of JSON objects -- have only a
+	handful of entries, and we look for a key simply by searching the list.  Once an
+	osrfHash grows past OSRF_HASH_SMALL_SIZE entries, we build a hash table, using open
+	addressing with Robin Hood hashing: each node goes in the first free slot at or after
+	the one its key hashes to, except that a node farther from its home slot takes the
+	place of one nearer to its own, which moves on.  That keeps every node near home, and
+	lets a search for a missing key stop early.  The table doubles in size whenever it is
+	more than OSRF_HASH_MAX_LOAD percent full.
+
+	Logically deleted nodes go on a list of their own, to be freed with the osrfHash.
 */
 struct _osrfHashStruct {
-	/** @brief Pointer to the osrfList used as a hash table */
-	osrfList* hash;
+	/** @brief Array of slots, or NULL while the osrfHash is small */
+	osrfHashSlot* table;
+	/** @brief Number of slots, a power of two, or zero if there's no table */
+	unsigned int table_size;
 	/** @brief Callback function for freeing stored items */
 	void (*freeItem) (char* key, void* item);
 	/** @brief How many items are in the osrfHash */
@@ -65,6 +93,12 @@ struct _osrfHashStruct {
 	osrfHashNode* first_key;
 	/** @brief Pointer to the last node in the linked list */
 	osrfHashNode* last_key;
+	/** @brief Logically deleted nodes, linked through their chain pointers */
+	osrfHashNode* deleted;
+	/** @brief Arena the nodes and keys come from, or NULL for the heap */
+	osrfArena* arena;
+	/** @brief Boolean: true to intern keys where we can (see osrfHashInternKeys()) */
+	int intern_keys;
 };
 
 /**
@@ -78,30 +112,30 @@ struct _osrfHashIteratorStruct {
 };
 
 /**
-	@brief How many slots in the hash table.
+	@brief How many items an osrfHash may hold before we build a hash table for it.
+
+	Up to this many, comparing keys one by one is about as fast as hashing them.
+*/
+#define OSRF_HASH_SMALL_SIZE 8
+
+/**
+	@brief How many slots a new hash table has.
 
 	Must be a power of 2, or the hashing algorithm won't work properly.
 */
-/* 0x100 is a good size for small hashes */
-//#define OSRF_HASH_LIST_SIZE 0x100  /* size of the main hash list */
 #define OSRF_HASH_LIST_SIZE 0x10  /* size of the main hash list */
 
-
-/* used internally */
 /**
-	@brief Free an osrfHashNode, and its cargo, from within a given osrfHash.
-	@param h Pointer to the osrfHash
-	@param n Pointer to the osrfHashNode
-
-	If there is a callback function for freeing the item, call it.
+	@brief How full, in percent, the hash table may get before we double it.
+*/
+#define OSRF_HASH_MAX_LOAD 80
 
-	We use this macro only when freeing an entire osrfHash.
+/**
+	@brief How far a slot is from the one its node's key hashes to.
 */
-#define OSRF_HASH_NODE_FREE(h, n) \
-	if(h && n) { \
-		if(h->freeItem && n->key) h->freeItem(n->key, n->item);\
-		free(n->key); free(n); \
-}
+#define PROBE_DISTANCE(hash,slot) \
+	( (unsigned int) ( ( (slot) - (hash)->table ) - (slot)->hashval ) \
+		& ((hash)->table_size - 1) )
 
 /**
 	@brief Create and initialize a new (and empty) osrfHash.
@@ -112,13 +146,38 @@ struct _osrfHashIteratorStruct {
 osrfHash* osrfNewHash() {
 	osrfHash* hash;
 	OSRF_MALLOC(hash, sizeof(osrfHash));
-	hash->hash		= osrfNewListSize( OSRF_HASH_LIST_SIZE );
+	hash->table     = NULL;
 	hash->first_key = NULL;
 	hash->last_key  = NULL;
+	hash->deleted   = NULL;
+	hash->arena     = NULL;
+	hash->intern_keys = 0;
 	return hash;
 }
 
-static osrfHashNode* osrfNewHashNode(char* key, void* item);
+/**
+	@brief Create a new (and empty) osrfHash in an osrfArena.
+	@param arena Pointer to the osrfArena, or NULL for the heap.
+	@return Pointer to the newly created osrfHash.
+
+	The osrfHash, its table, its nodes and their keys are all carved from the arena, and go
+	away with it.  osrfHashFree() calls the item-freeing callback for every item as usual,
+	but gives back no memory.
+*/
+osrfHash* osrfNewHashArena( osrfArena* arena ) {
+	if( !arena )
+		return osrfNewHash();
+
+	osrfHash* hash = osrfArenaCalloc( arena, sizeof(osrfHash) );
+	hash->arena = arena;
+	return hash;
+}
+
+static osrfHashNode* osrfNewHashNode( osrfArena* arena, const char* key, void* item,
+		int interned );
+static void build_table( osrfHash* hash, unsigned int table_size );
+static void place_node( osrfHash* hash, osrfHashNode* node, unsigned int hashval );
+static void unlink_node( osrfHash* hash, osrfHashNode* node );
 
 /*
 static unsigned int osrfHashMakeKey(char* str) {
@@ -128,7 +187,7 @@ static unsigned int osrfHashMakeKey(char* str) {
 	unsigned int i = 0;
 	for(i = 0; i < len; str++, i++)
 		h = ((h << 5) ^ (h >> 27)) ^ (*str);
-	return (h & (OSRF_HASH_LIST_SIZE-1));
+	return h;
 }
 */
 
@@ -140,6 +199,9 @@ static unsigned int osrfHashMakeKey(char* str) {
 
 	This macro implements an algorithm proposed by Donald E. Knuth
 	in The Art of Computer Programming Volume 3 (more or less..)
+
+	The result is not reduced to a bucket number, so that it can be reused when the table
+	grows.
 */
 #define OSRF_HASH_MAKE_KEY(str,num) \
    do {\
@@ -149,7 +211,7 @@ static unsigned int osrfHashMakeKey(char* str) {
       unsigned int i__ = 0;\
       for(i__ = 0; i__ < len__; k__++, i__++)\
          h__ = ((h__ << 5) ^ (h__ >> 27)) ^ (*k__);\
-      num = (h__ & (OSRF_HASH_LIST_SIZE-1));\
+      num = h__;\
    } while(0)
 
 /**
@@ -166,75 +228,173 @@ void osrfHashSetCallback( osrfHash* hash, void (*callback) (char* key, void* ite
 	if( hash ) hash->freeItem = callback;
 }
 
-/* Returns a pointer to the item's node if found; otherwise returns NULL. */
+/**
+	@brief Store interned copies of keys instead of copies of their own.
+	@param hash Pointer to the osrfHash.
+
+	Meant for osrfHashes that, between them, use the same few keys over and over, such as
+	the ones in jsonObjects.  Keys that osrf_intern_name() won't take are copied as usual.
+	Looking up an interned key is faster too, since two interned keys are the same string
+	only if they are the same pointer.
+*/
+void osrfHashInternKeys( osrfHash* hash ) {
+	if( hash ) hash->intern_keys = 1;
+}
+
+/**
+	@brief Tell whether a node's key is interned.
+	@param node Pointer to the node.
+	@return true if the key is an interned string, rather than a copy in the node itself.
+*/
+#define NODE_KEY_INTERNED(node) ( (node)->key != (node)->name )
+
 /**
 	@brief Search for a given key in an osrfHash.
 	@param hash Pointer to the osrfHash.
 	@param key The key to be sought.
-	@param bucketkey Pointer through which we can report which slot the item belongs in.
+	@param hashval Pointer through which to report the hash of the key, or NULL.
+	@param interned Boolean: true if @a key is an interned string.
 	@return A pointer to the osrfHashNode where the item resides; or NULL, if it isn't there.
 
-	If the bucketkey parameter is not NULL, we update the index of the hash bucket where the
-	item belongs (whether or not we actually found it).  In some cases this feedback enables the
-	calling function to avoid hashing the same key twice.
+	If the osrfHash has a hash table, we report the hash of the key through @a hashval (if
+	it isn't NULL), whether or not we find the key, so that the calling code needn't hash the
+	same key twice.  Otherwise we search the linked list and don't hash anything.
+
+	An interned key matches another interned key only if it is the very same pointer, so
+	we needn't compare the strings.
 */
 static osrfHashNode* find_item( const osrfHash* hash,
-		const char* key, unsigned int* bucketkey ) {
-
-	// Find the sub-list in the hash table
-
-	if( hash->size < 6 && !bucketkey )
-	{
-		// For only a few entries, when we don't need to identify
-		// the hash bucket, it's probably faster to search the
-		// linked list instead of hashing
+		const char* key, unsigned int* hashval, int interned ) {
 
+	if( !hash->table ) {
+		// For only a few entries, it's probably faster to
+		// search the linked list instead of hashing
 		osrfHashNode* currnode = hash->first_key;
-		while( currnode && strcmp( currnode->key, key ) )
+		while( currnode && currnode->key != key
+				&& ( ( interned && NODE_KEY_INTERNED( currnode ))
+					|| strcmp( currnode->key, key )))
 			 currnode = currnode->next;
 
 		return currnode;
 	}
 
-	unsigned int i = 0;
-	OSRF_HASH_MAKE_KEY(key,i);
-
-	// If asked, report which slot the key hashes to
-	if( bucketkey ) *bucketkey = i;
-
-	osrfList* list = OSRF_LIST_GET_INDEX( hash->hash, i );
-	if( !list ) { return NULL; }
-
-	// Search the sub-list
-
-	int k;
-	osrfHashNode* node = NULL;
-	for( k = 0; k < list->size; k++ ) {
-		node = OSRF_LIST_GET_INDEX(list, k);
-		if( node && node->key && !strcmp(node->key, key) )
-			return node;
+	unsigned int h = 0;
+	OSRF_HASH_MAKE_KEY(key,h);
+
+	// If asked, report what the key hashes to
+	if( hashval ) *hashval = h;
+
+	// Probe from the home slot.  Once we're farther from home than the node in the slot
+	// is from its own, the key isn't there: if it were, it would have taken that slot.
+	const unsigned int mask = hash->table_size - 1;
+	unsigned int i = h & mask;
+	unsigned int dist;
+	for( dist = 0; ; ++dist, i = (i + 1) & mask ) {
+		const osrfHashSlot* slot = hash->table + i;
+		if( !slot->node || PROBE_DISTANCE( hash, slot ) < dist )
+			return NULL;
+		if( slot->hashval == h ) {
+			osrfHashNode* node = slot->node;
+			if( node->key == key || !( ( interned && NODE_KEY_INTERNED( node ))
+					|| strcmp( node->key, key )))
+				return node;
+		}
 	}
-
-	return NULL;
 }
 
 /**
 	@brief Create and populate a new osrfHashNode.
+	@param arena Pointer to the osrfArena to carve the node from, or NULL for the heap.
 	@param key The key string.
 	@param item A pointer to the item associated with the key.
+	@param interned Boolean: true if @a key is interned, so that the node needn't copy it.
 	@return A pointer to the newly created node.
 */
-static osrfHashNode* osrfNewHashNode(char* key, void* item) {
+static osrfHashNode* osrfNewHashNode( osrfArena* arena, const char* key, void* item,
+		int interned ) {
 	if(!(key && item)) return NULL;
+	size_t len = interned ? 0 : strlen( key ) + 1;
+	size_t node_size = offsetof( osrfHashNode, name ) + len;
 	osrfHashNode* n;
-	OSRF_MALLOC(n, sizeof(osrfHashNode));
-	n->key = strdup(key);
+	if( arena )
+		n = osrfArenaCalloc( arena, node_size );
+	else
+		OSRF_MALLOC(n, node_size);
+	if( interned )
+		n->key = (char*) key;
+	else {
+		memcpy( n->name, key, len );
+		n->key = n->name;
+	}
 	n->item = item;
-	n->prev = NULL;
-	n->prev = NULL;
 	return n;
 }
 
+/**
+	@brief Put a node into the hash table of an osrfHash.
+	@param hash Pointer to the osrfHash.
+	@param node Pointer to the node, whose key isn't in the table already.
+	@param hashval The hash of the node's key.
+
+	We probe from the node's home slot.  Whenever we come to a node nearer to its home than
+	the one we're carrying, the two swap, and we carry the displaced one on from there.
+	There's always a free slot, since the table is never full.
+*/
+static void place_node( osrfHash* hash, osrfHashNode* node, unsigned int hashval ) {
+	const unsigned int mask = hash->table_size - 1;
+	osrfHashSlot carry = { node, hashval };
+	unsigned int i = hashval & mask;
+	unsigned int dist = 0;
+
+	for( ;; ) {
+		osrfHashSlot* slot = hash->table + i;
+		if( !slot->node ) {
+			*slot = carry;
+			return;
+		}
+
+		unsigned int slot_dist = PROBE_DISTANCE( hash, slot );
+		if( slot_dist < dist ) {
+			osrfHashSlot displaced = *slot;
+			*slot = carry;
+			carry = displaced;
+			dist = slot_dist;
+		}
+
+		i = (i + 1) & mask;
+		++dist;
+	}
+}
+
+/**
+	@brief Build, or rebuild, the hash table for an osrfHash.
+	@param hash Pointer to the osrfHash.
+	@param table_size How many slots the new table should have (a power of two).
+
+	Every node on the linked list goes into the new table.  Logically deleted nodes aren't
+	on the list, and aren't in any slot.  Each node remembers the hash of its key, so we
+	hash the keys only the first time.
+*/
+static void build_table( osrfHash* hash, unsigned int table_size ) {
+	int have_hashes = hash->table != NULL;
+	if( hash->table && !hash->arena )
+		free( hash->table );
+
+	size_t bytes = table_size * sizeof( osrfHashSlot );
+	if( hash->arena )
+		hash->table = osrfArenaCalloc( hash->arena, bytes );
+	else
+		OSRF_MALLOC( hash->table, bytes );
+	hash->table_size = table_size;
+
+	osrfHashNode* node;
+	for( node = hash->first_key; node; node = node->next ) {
+		if( !have_hashes )
+			OSRF_HASH_MAKE_KEY( node->key, node->hashval );
+		place_node( hash, node, node->hashval );
+	}
+}
+
 /**
 	@brief Store an item for a given key in an osrfHash.
 	@param hash Pointer to the osrfHash in which the item is to be stored.
@@ -256,10 +416,12 @@ static osrfHashNode* osrfNewHashNode(char* key, void* item) {
 void* osrfHashSet( osrfHash* hash, void* item, const char* key, ... ) {
 	if(!(hash && item && key )) return NULL;
 
-	unsigned int bucketkey;
+	unsigned int hashval = 0;
 
 	VA_LIST_TO_STRING(key);
-	osrfHashNode* node = find_item( hash, VA_BUF, &bucketkey );
+	const char* interned = hash->intern_keys ? osrf_intern_name( VA_BUF ) : NULL;
+	const char* k = interned ? interned : VA_BUF;
+	osrfHashNode* node = find_item( hash, k, &hashval, interned != NULL );
 	if( node ) {
 
 		// We already have an item for this key.  Update it in place.
@@ -275,20 +437,10 @@ void* osrfHashSet( osrfHash* hash, void* item, const char* key, ... ) {
 		return olditem;
 	}
 
-	// There is no entry for this key.  Create a new one.
-	osrfList* bucket;
-	if( !(bucket = OSRF_LIST_GET_INDEX(hash->hash, bucketkey)) ) {
-		bucket = osrfNewList();
-		osrfListSet( hash->hash, bucket, bucketkey );
-	}
-
-	node = osrfNewHashNode(VA_BUF, item);
-	osrfListPushFirst( bucket, node );
-
+	// There is no entry for this key.  Create a new one, at the end of the linked list.
+	node = osrfNewHashNode( hash->arena, k, item, interned != NULL );
 	hash->size++;
 
-	// Add the new hash node to the end of the linked list
-
 	if( NULL == hash->first_key )
 		hash->first_key = hash->last_key = node;
 	else {
@@ -297,9 +449,68 @@ void* osrfHashSet( osrfHash* hash, void* item, const char* key, ... ) {
 		hash->last_key = node;
 	}
 
+	if( hash->table ) {
+		node->hashval = hashval;
+		if( hash->size * 100UL > hash->table_size * (unsigned long) OSRF_HASH_MAX_LOAD )
+			build_table( hash, hash->table_size * 2 );
+		else
+			place_node( hash, node, hashval );
+	} else if( hash->size > OSRF_HASH_SMALL_SIZE )
+		build_table( hash, OSRF_HASH_LIST_SIZE );
+
 	return NULL;
 }
 
+/**
+	@brief Logically delete a node from an osrfHash.
+	@param hash Pointer to the osrfHash.
+	@param node Pointer to the node, which must be one of the live nodes in @a hash.
+
+	Take the node out of its slot, if there's a table, and out of the linked list, and put
+	it on the list of deleted nodes.  We leave its next and prev pointers in place so that an
+	iterator parked on it can find its way to an adjacent node.
+
+	Rather than leave a marker in the slot, we shift back the nodes after it, up to the next
+	free slot or the next node already at home, so that every node stays where a search
+	will find it.
+*/
+static void unlink_node( osrfHash* hash, osrfHashNode* node ) {
+	hash->size--;
+
+	if( hash->table ) {
+		const unsigned int mask = hash->table_size - 1;
+		unsigned int i = node->hashval & mask;
+		while( hash->table[ i ].node != node )
+			i = (i + 1) & mask;
+
+		for( ;; ) {
+			unsigned int next = (i + 1) & mask;
+			osrfHashSlot* slot = hash->table + next;
+			if( !slot->node || 0 == PROBE_DISTANCE( hash, slot ))
+				break;
+			hash->table[ i ] = *slot;
+			i = next;
+		}
+		hash->table[ i ].node = NULL;
+	}
+
+	node->key = NULL;
+	node->item = NULL;
+
+	if( node->prev )
+		node->prev->next = node->next;
+	else
+		hash->first_key = node->next;
+
+	if( node->next )
+		node->next->prev = node->prev;
+	else
+		hash->last_key = node->prev;
+
+	node->chain = hash->deleted;
+	hash->deleted = node;
+}
+
 /**
 	@brief Remove the item for a specified key from an osrfHash.
 	@param hash Pointer to the osrfHash from which the item is to be removed.
@@ -319,46 +530,24 @@ void* osrfHashSet( osrfHash* hash, void* item, const char* key, ... ) {
 	Note: the osrfHashNode for the removed item is logically deleted so that subsequent searches
 	and traversals will ignore it.  However it is physically left in place so that an
 	osrfHashIterator pointing to it can advance to the next node.  The downside of this
-	design is that, if a lot of items are removed, the accumulation of logically deleted nodes
-	will slow down searches.  In addition, the memory used by a logically deleted osrfHashNode
-	remains allocated until the entire osrfHashNode is freed.
+	design is that the memory used by a logically deleted osrfHashNode remains allocated
+	until the entire osrfHash is freed.
 */
 void* osrfHashRemove( osrfHash* hash, const char* key, ... ) {
 	if(!(hash && key )) return NULL;
 
 	VA_LIST_TO_STRING(key);
 
-	osrfHashNode* node = find_item( hash, VA_BUF, NULL );
+	osrfHashNode* node = find_item( hash, VA_BUF, NULL, 0 );
 	if( !node ) return NULL;
 
-	hash->size--;
-
 	void* item = NULL;  // to be returned
 	if( hash->freeItem )
 		hash->freeItem( node->key, node->item );
 	else
 		item = node->item;
 
-	// Mark the node as logically deleted
-
-	free(node->key);
-	node->key = NULL;
-	node->item = NULL;
-
-	// Make the node unreachable from the rest of the linked list.
-	// We leave the next and prev pointers in place so that an
-	// iterator parked here can find its way to an adjacent node.
-
-	if( node->prev )
-		node->prev->next = node->next;
-	else
-		hash->first_key = node->next;
-
-	if( node->next )
-		node->next->prev = node->prev;
-	else
-		hash->last_key = node->prev;
-
+	unlink_node( hash, node );
 	return item;
 }
 
@@ -380,31 +569,11 @@ void* osrfHashExtract( osrfHash* hash, const char* key, ... ) {
 
 	VA_LIST_TO_STRING(key);
 
-	osrfHashNode* node = find_item( hash, VA_BUF, NULL );
+	osrfHashNode* node = find_item( hash, VA_BUF, NULL, 0 );
 	if( !node ) return NULL;
 
-	hash->size--;
-
 	void* item = node->item;  // to be returned
-
-	// Mark the node as logically deleted
-	free(node->key);
-	node->key = NULL;
-	node->item = NULL;
-
-	// Make the node unreachable from the rest of the linked list.
-	// We leave the next and prev pointers in place so that an
-	// iterator parked here can find its way to an adjacent node.
-	if( node->prev )
-		node->prev->next = node->next;
-	else
-		hash->first_key = node->next;
-
-	if( node->next )
-		node->next->prev = node->prev;
-	else
-		hash->last_key = node->prev;
-
+	unlink_node( hash, node );
 	return item;
 }
 
@@ -417,7 +586,7 @@ void* osrfHashExtract( osrfHash* hash, const char* key, ... ) {
 void* osrfHashGet( osrfHash* hash, const char* key ) {
 	if(!(hash && key )) return NULL;
 
-	osrfHashNode* node = find_item( hash, key, NULL );
+	osrfHashNode* node = find_item( hash, key, NULL, 0 );
 	if( !node ) return NULL;
 	return node->item;
 }
@@ -433,7 +602,7 @@ void* osrfHashGetFmt( osrfHash* hash, const char* key, ... ) {
 	if(!(hash && key )) return NULL;
 	VA_LIST_TO_STRING(key);
 
-	osrfHashNode* node = find_item( hash, (char*) VA_BUF, NULL );
+	osrfHashNode* node = find_item( hash, (char*) VA_BUF, NULL, 0 );
 	if( !node ) return NULL;
 	return node->item;
 }
@@ -492,23 +661,26 @@ unsigned long osrfHashGetCount( osrfHash* hash ) {
 void osrfHashFree( osrfHash* hash ) {
 	if(!hash) return;
 
-	int i, j;
-	osrfList* list;
-	osrfHashNode* node;
+	osrfHashNode* node = hash->first_key;
+	while( node ) {
+		osrfHashNode* next = node->next;
+		if( hash->freeItem )
+			hash->freeItem( node->key, node->item );
+		if( !hash->arena )
+			free( node );
+		node = next;
+	}
 
-	for( i = 0; i != hash->hash->size; i++ ) {
-		if( ( list = OSRF_LIST_GET_INDEX( hash->hash, i )) ) {
-			for( j = 0; j != list->size; j++ ) {
-				if( (node = OSRF_LIST_GET_INDEX( list, j )) ) {
-					OSRF_HASH_NODE_FREE(hash, node);
-				}
-			}
-			osrfListFree(list);
+	if( !hash->arena ) {
+		node = hash->deleted;
+		while( node ) {
+			osrfHashNode* next = node->chain;
+			free( node );
+			node = next;
 		}
+		free( hash->table );
+		free( hash );
 	}
-
-	osrfListFree(hash->hash);
-	free(hash);
 }
 
 /**
@@ -591,6 +763,28 @@ void osrfHashIteratorReset( osrfHashIterator* itr ) {
 }
 
 
+/**
+	@brief Advance a cursor to the next item in an osrfHash.
+	@param hash Pointer to the osrfHash.
+	@param cursor Pointer to the cursor, which should start out NULL.
+	@param key Pointer through which to return the key of the item, or NULL if not wanted.
+	@return Pointer to the next item, or NULL if there are no more.
+
+	This is the same traversal as an osrfHashIterator provides, for callers that would
+	rather keep their position on the stack than allocate an iterator.  A NULL return means
+	the end only if the cursor is NULL too; a stored item may itself be NULL.
+*/
+void* osrfHashCursorNext( const osrfHash* hash, osrfHashCursor* cursor, const char** key ) {
+	if( !hash || !cursor )
+		return NULL;
+
+	const osrfHashNode* node = *cursor ? (*cursor)->next : hash->first_key;
+	*cursor = node;
+	if( key )
+		*key = node ? node->key : NULL;
+	return node ? node->item : NULL;
+}
+
 /**
 	@brief Determine whether there is another entry in an osrfHash beyond the current
 		position of an osrfHashIterator.
@@ -0,0 +1,252 @@
+/**
+	@file osrf_iochain.c
+	@brief Implementation of osrfIoChain, a buffer made of slices.
+
+	Copied slices are carved from blocks that never move once allocated, so that the
+	iovecs pointing into them stay valid as the chain grows.  A copy that lands right
+	after the previous copy extends that slice instead of starting a new one, so a run of
+	small pieces goes out as a single iovec.
+*/
+
+#include <opensrf/osrf_iochain.h>
+
+/** @brief Usual size of a block of storage for copied slices, header included. */
+#define OSRF_IOCHAIN_BLOCK_SIZE 1024
+
+/** @brief How many slices a new chain has room for. */
+#define OSRF_IOCHAIN_INIT_SLICES 8
+
+/**
+	@brief Storage for copied slices.
+*/
+struct osrfIoBlockStruct {
+	osrfIoBlock* next;       /**< The next older block. */
+	size_t size;             /**< Capacity of data. */
+	size_t used;             /**< How much of data is in use. */
+	char data[];             /**< The copied bytes. */
+};
+
+static int add_slice( osrfIoChain* chain, const char* data, size_t len,
+		osrfIoRelease release, void* owner );
+
+/**
+	@brief Create an empty osrfIoChain.
+	@return Pointer to the new osrfIoChain.
+
+	The calling code is responsible for freeing the chain by calling osrfIoChainFree().
+*/
+osrfIoChain* osrfNewIoChain( void ) {
+	osrfIoChain* chain = safe_malloc( sizeof( osrfIoChain ) );
+	chain->size = OSRF_IOCHAIN_INIT_SLICES;
+	chain->iov = safe_malloc( chain->size * sizeof( struct iovec ) );
+	chain->refs = safe_malloc( chain->size * sizeof( osrfIoRef ) );
+	return chain;
+}
+
+/**
+	@brief Append a slice to an osrfIoChain.
+	@param chain Pointer to the osrfIoChain.
+	@param data Pointer to the bytes of the slice.
+	@param len Length of the slice.
+	@param release Callback to give back the reference, or NULL.
+	@param owner What to pass to @a release.
+	@return 0 if successful, or -1 if out of memory.
+*/
+static int add_slice( osrfIoChain* chain, const char* data, size_t len,
+		osrfIoRelease release, void* owner ) {
+
+	if( chain->count == chain->size ) {
+		int size = chain->size * 2;
+		struct iovec* iov = realloc( chain->iov, size * sizeof( struct iovec ) );
+		if( ! iov )
+			return -1;
+		chain->iov = iov;
+		osrfIoRef* refs = realloc( chain->refs, size * sizeof( osrfIoRef ) );
+		if( ! refs )
+			return -1;
+		chain->refs = refs;
+		chain->size = size;
+	}
+
+	chain->iov[ chain->count ].iov_base = (char*) data;
+	chain->iov[ chain->count ].iov_len = len;
+	chain->refs[ chain->count ].release = release;
+	chain->refs[ chain->count ].owner = owner;
+	++chain->count;
+	chain->length += len;
+	return 0;
+}
+
+/**
+	@brief Append room for a copied slice to an osrfIoChain.
+	@param chain Pointer to the osrfIoChain.
+	@param len How many bytes the slice needs.
+	@return Pointer to where the calling code is to write the @a len bytes, or NULL if
+		@a chain is NULL or memory runs out.
+
+	The memory belongs to the chain, and stays put until the chain is reset or freed.
+*/
+char* osrfIoChainAlloc( osrfIoChain* chain, size_t len ) {
+	if( ! chain )
+		return NULL;
+
+	osrfIoBlock* block = chain->blocks;
+	if( ! block || block->size - block->used < len ) {
+		size_t size = OSRF_IOCHAIN_BLOCK_SIZE - sizeof( osrfIoBlock );
+		if( size < len )
+			size = len;
+		block = malloc( sizeof( osrfIoBlock ) + size );
+		if( ! block )
+			return NULL;
+		block->size = size;
+		block->used = 0;
+		block->next = chain->blocks;
+		chain->blocks = block;
+	}
+
+	char* p = block->data + block->used;
+
+	// Extend the last slice if it ends right here
+	struct iovec* last = chain->count ? chain->iov + chain->count - 1 : NULL;
+	if( last && (char*) last->iov_base + last->iov_len == p ) {
+		last->iov_len += len;
+		chain->length += len;
+	} else if( add_slice( chain, p, len, NULL, NULL ) )
+		return NULL;
+
+	block->used += len;
+	return p;
+}
+
+/**
+	@brief Append a copy of some bytes to an osrfIoChain.
+	@param chain Pointer to the osrfIoChain.
+	@param data Pointer to the bytes to copy.
+	@param len How many bytes to copy.
+	@return 0 if successful, or -1 if not.
+*/
+int osrfIoChainAdd( osrfIoChain* chain, const char* data, size_t len ) {
+	if( ! chain || ( len && ! data ) )
+		return -1;
+	if( ! len )
+		return 0;
+
+	char* p = osrfIoChainAlloc( chain, len );
+	if( ! p )
+		return -1;
+	memcpy( p, data, len );
+	return 0;
+}
+
+/**
+	@brief Append bytes to an osrfIoChain without copying them.
+	@param chain Pointer to the osrfIoChain.
+	@param data Pointer to the bytes, which must stay put for as long as the chain uses them.
+	@param len How many bytes.
+	@return 0 if successful, or -1 if not.
+
+	Meant for string literals and the like.
+*/
+int osrfIoChainAddStatic( osrfIoChain* chain, const char* data, size_t len ) {
+	if( ! chain || ( len && ! data ) )
+		return -1;
+	if( ! len )
+		return 0;
+	return add_slice( chain, data, len, NULL, NULL );
+}
+
+/**
+	@brief Append a slice of someone else's storage to an osrfIoChain, holding a reference.
+	@param chain Pointer to the osrfIoChain.
+	@param data Pointer to the bytes.
+	@param len How many bytes.
+	@param release Callback to give back the reference.
+	@param owner What to pass to @a release.
+	@return 0 if successful, or -1 if not.
+
+	The chain takes over one reference to @a owner, and gives it back by calling
+	@a release when the chain is reset or freed.  If the slice can't be added, the
+	reference is given back at once.
+*/
+int osrfIoChainAddRef( osrfIoChain* chain, const char* data, size_t len,
+		osrfIoRelease release, void* owner ) {
+	if( chain && ( data || ! len ) && ! add_slice( chain, data, len, release, owner ) )
+		return 0;
+
+	if( release )
+		release( owner );
+	return -1;
+}
+
+/**
+	@brief Copy the contents of an osrfIoChain into one string.
+	@param chain Pointer to the osrfIoChain.
+	@return Pointer to a newly allocated, nul-terminated string, or NULL if @a chain is NULL.
+
+	For when the bytes are needed in one piece after all, as for logging.  The calling
+	code is responsible for freeing the string.
+*/
+char* osrfIoChainFlatten( const osrfIoChain* chain ) {
+	if( ! chain )
+		return NULL;
+
+	char* str = safe_malloc( chain->length + 1 );
+	char* p = str;
+	int i;
+	for( i = 0; i < chain->count; ++i ) {
+		memcpy( p, chain->iov[ i ].iov_base, chain->iov[ i ].iov_len );
+		p += chain->iov[ i ].iov_len;
+	}
+	*p = '\0';
+	return str;
+}
+
+/**
+	@brief Make an osrfIoChain empty, giving back every reference it holds.
+	@param chain Pointer to the osrfIoChain.
+
+	Keep the slice arrays and a block of storage, so that the chain can be filled again
+	without allocating much.
+*/
+void osrfIoChainReset( osrfIoChain* chain ) {
+	if( ! chain )
+		return;
+
+	int i;
+	for( i = 0; i < chain->count; ++i ) {
+		if( chain->refs[ i ].release )
+			chain->refs[ i ].release( chain->refs[ i ].owner );
+	}
+	chain->count = 0;
+	chain->length = 0;
+
+	// Keep the newest block, unless it was sized for some one big slice
+	osrfIoBlock* block = chain->blocks;
+	if( block && block->size == OSRF_IOCHAIN_BLOCK_SIZE - sizeof( osrfIoBlock ) ) {
+		block->used = 0;
+		block = block->next;
+		chain->blocks->next = NULL;
+	} else
+		chain->blocks = NULL;
+
+	while( block ) {
+		osrfIoBlock* next = block->next;
+		free( block );
+		block = next;
+	}
+}
+
+/**
+	@brief Free an osrfIoChain, giving back every reference it holds.
+	@param chain Pointer to the osrfIoChain.
+*/
+void osrfIoChainFree( osrfIoChain* chain ) {
+	if( ! chain )
+		return;
+
+	osrfIoChainReset( chain );
+	free( chain->blocks );
+	free( chain->iov );
+	free( chain->refs );
+	free( chain );
+}
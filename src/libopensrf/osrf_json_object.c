@@ -22,12 +22,24 @@ GNU General Public License for more details.
 	we can take one from the free list, if one is available, instead of calling
 	malloc().  Likewise when we free a jsonObject, we can stick it on the free list
 	for potential reuse instead of calling free().
+
+	Alternatively, a thread may create jsonObjects in an osrfArena (see jsonSetArena()).
+	Such a jsonObject, its strings, and the osrfHash or osrfList that holds its contents
+	are all carved from the arena.  Freeing it does nothing; it goes away, with everything
+	else in the arena, when the arena is reset.  A jsonObject from the heap that is
+	attached to one in an arena is adopted by the arena, and freed when it is reset.
+
+	A jsonObject on the heap may also be shared (see jsonObjectShare()).  A shared
+	jsonObject counts the references to it, and jsonObjectFree() only drops one of them.
+	Cloning a shared jsonObject, or anything containing one, shares it rather than copying
+	it, so that a large tree can be handed around without being copied again and again.
 */
 
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <opensrf/log.h>
 #include <opensrf/osrf_json.h>
 #include <opensrf/osrf_utf8.h>
@@ -55,28 +67,41 @@ GNU General Public License for more details.
 		osrfListFree(_obj_->value.l);			\
 		_obj_->value.l = NULL;					\
 	} else if( _obj_->type == JSON_STRING || _obj_->type == JSON_NUMBER ) { \
-		free(_obj_->value.s);					\
+		if( !_obj_->arena )						\
+			free(_obj_->value.s);				\
 		_obj_->value.s = NULL;					\
 	} else if( _obj_->type == JSON_BOOL && newtype != JSON_BOOL ) { \
 		_obj_->value.l = NULL;					\
 	} \
 	_obj_->type = newtype; \
+	_obj_->num_cache = NUM_UNKNOWN; \
 	if( newtype == JSON_HASH && _obj_->value.h == NULL ) {	\
-		_obj_->value.h = osrfNewHash();		\
+		_obj_->value.h = osrfNewHashArena( _obj_->arena );		\
 		osrfHashSetCallback( _obj_->value.h, _jsonFreeHashItem ); \
+		osrfHashInternKeys( _obj_->value.h ); \
 	} else if( newtype == JSON_ARRAY && _obj_->value.l == NULL ) {	\
-		_obj_->value.l = osrfNewList();		\
+		_obj_->value.l = osrfNewListArena( _obj_->arena, OSRF_LIST_INLINE_SIZE ); \
 		_obj_->value.l->freeItem = _jsonFreeListItem;\
 	}
 
+/**
+	@name Number cache
+	@brief Values of the num_cache member of a jsonObject.
+*/
+/*@{*/
+#define NUM_UNKNOWN 0    /**< Not converted yet. */
+#define NUM_INTEGER 1    /**< num.i holds the value, exactly. */
+#define NUM_DOUBLE  2    /**< num.d holds the value. */
+/*@}*/
+
 /** Count of the times we put a freed jsonObject on the free list instead of calling free() */
-static int unusedObjCapture = 0;
+static __thread int unusedObjCapture = 0;
 /** Count of the times we reused a jsonObject from the free list instead of calling malloc() */
-static int unusedObjRelease = 0;
+static __thread int unusedObjRelease = 0;
 /** Count of the times we allocated a jsonObject with malloc() */
-static int mallocObjCreate = 0;
+static __thread int mallocObjCreate = 0;
 /** Number of unused jsonObjects currently on the free list */
-static int currentListLen = 0;
+static __thread int currentListLen = 0;
 
 /**
 	Union overlaying a jsonObject with a pointer.  When the jsonObject is not in use as a
@@ -89,11 +114,20 @@ union unusedObjUnion{
 };
 typedef union unusedObjUnion unusedObj;
 
-/** Pointer to the head of the free list */
-static unusedObj* freeObjList = NULL;
+/** Pointer to the head of the free list.  Each thread keeps its own, so that threads
+	needn't lock each other out to allocate a jsonObject. */
+static __thread unusedObj* freeObjList = NULL;
+
+/** Arena in which to create new jsonObjects, or NULL to create them on the heap. */
+static __thread osrfArena* currentArena = NULL;
 
-static void add_json_to_buffer( const jsonObject* obj,
-	growing_buffer * buf, int do_classname, int second_pass );
+static size_t json_length( const jsonObject* obj, int do_classname, int second_pass );
+static char* write_json( const jsonObject* obj, char* p, int do_classname, int second_pass );
+static jsonObject* clone_object( const jsonObject* o, int share );
+static void freeze_object( jsonObject* o );
+static int refuse_shared( const jsonObject* o );
+static char* number_string( jsonObject* o, double num );
+static int number_cache( const jsonObject* obj );
 
 /**
 	@brief Return all jsonObjects in the free list to the heap.
@@ -114,41 +148,340 @@ void jsonObjectFreeUnused( void ) {
 }
 
 /**
-	@brief Create a new jsonObject, optionally containing a string.
-	@param data Pointer to a string to be stored in the jsonObject; may be NULL.
-	@return Pointer to a newly allocate jsonObject.
+	@brief Create jsonObjects in a given osrfArena from now on, or on the heap.
+	@param arena Pointer to the osrfArena, or NULL for the heap.
+	@return The arena previously in effect, or NULL if there wasn't one.
 
-	If @a data is NULL, create a jsonObject of type JSON_NULL.  Otherwise create
-	a jsonObject of type JSON_STRING, containing the specified string.
+	Applies to the calling thread only.  Everything that creates jsonObjects uses the arena,
+	including the parser, except for jsonObjectClone(), which always copies to the heap --
+	so that a clone is the way to get something out of the arena that must outlive it.
 
-	The calling code is responsible for freeing the jsonObject by calling jsonObjectFree().
+	Nothing in the arena may be used after the arena is reset.  In particular, don't attach
+	a jsonObject in the arena to a longer-lived one on the heap.
+
+	Typical usage is to set an arena, parse or build something short-lived, and restore
+	the previous setting.
 */
-jsonObject* jsonNewObject(const char* data) {
+osrfArena* jsonSetArena( osrfArena* arena ) {
+	osrfArena* previous = currentArena;
+	currentArena = arena;
+	return previous;
+}
+
+/**
+	@brief Allocate a jsonObject of type JSON_NULL.
+	@return Pointer to the new jsonObject.
+
+	Carve it from the current arena, if there is one.  Otherwise take it from the free list
+	if possible, or from the heap if necessary.
+*/
+static jsonObject* new_object( void ) {
 
 	jsonObject* o;
 
-	// Allocate a jsonObject; from the free list if possible,
-	// or from the heap if necessary.
-	if( freeObjList ) {
-		o = (jsonObject*) freeObjList;
-		freeObjList = freeObjList->next;
-        unusedObjRelease++;
-        currentListLen--;
+	if( currentArena ) {
+		o = osrfArenaAlloc( currentArena, sizeof(jsonObject) );
+		o->arena = currentArena;
 	} else {
-		OSRF_MALLOC( o, sizeof(jsonObject) );
-        mallocObjCreate++;
-    }
+		if( freeObjList ) {
+			o = (jsonObject*) freeObjList;
+			freeObjList = freeObjList->next;
+			unusedObjRelease++;
+			currentListLen--;
+		} else {
+			OSRF_MALLOC( o, sizeof(jsonObject) );
+			mallocObjCreate++;
+		}
+		o->arena = NULL;
+	}
 
 	o->size = 0;
 	o->classname = NULL;
+	o->class_interned = 0;
+	o->parent = NULL;
+	o->type = JSON_NULL;
+	o->num_cache = NUM_UNKNOWN;
+	o->refs = 0;
+	o->value.s = NULL;
+
+	return o;
+}
+
+/**
+	@brief Copy a string for a jsonObject, into its arena if it has one.
+	@param o Pointer to the jsonObject that will own the copy.
+	@param str The string to copy.
+	@return Pointer to the copy.
+*/
+static char* object_strdup( const jsonObject* o, const char* str ) {
+	return o->arena ? osrfArenaStrdup( o->arena, str ) : strdup( str );
+}
+
+/**
+	@brief Hand a string allocated on the heap to a jsonObject.
+	@param o Pointer to the jsonObject that will own the string.
+	@param str The string, allocated with malloc().
+	@return Pointer to the string to store: @a str itself, or for a jsonObject in an arena,
+		a copy in the arena (in which case @a str is freed).
+*/
+static char* object_adopt_string( const jsonObject* o, char* str ) {
+	if( !o->arena || !str )
+		return str;
+	char* copy = osrfArenaStrdup( o->arena, str );
+	free( str );
+	return copy;
+}
+
+/**
+	@brief Free a jsonObject adopted by an arena.
+	@param item Pointer to the jsonObject, which lives on the heap.
+
+	An osrfArena cleanup; see adopt_object().
+*/
+static void free_adopted( void* item ) {
+	jsonObject* o = (jsonObject*) item;
+	o->parent = NULL;
+	jsonObjectFree( o );
+}
+
+/**
+	@brief Attach a jsonObject to another one, as its child.
+	@param parent Pointer to the jsonObject to which the child is being attached.
+	@param child Pointer to the child.
+	@return Pointer to what to store in the parent: normally the child itself.
+
+	If the parent lives in an arena and the child doesn't, the arena adopts the child: it
+	frees the child when it is reset, since freeing the parent won't.  Until then, removing
+	or replacing the child leaves it to the arena; extracting it takes it back.
+
+	A shared child has no single parent, so it isn't told about this one.  An arena can't
+	hold a reference to it, so a parent in an arena gets a private copy instead.
+*/
+static jsonObject* adopt_object( jsonObject* parent, jsonObject* child ) {
+	if( child->refs ) {
+		if( !parent->arena )
+			return child;
+		osrfArena* arena = jsonSetArena( parent->arena );
+		jsonObject* copy = clone_object( child, 0 );
+		jsonSetArena( arena );
+		jsonObjectFree( child );
+		child = copy;
+	}
+
+	child->parent = parent;
+	if( parent->arena && !child->arena )
+		osrfArenaOnReset( parent->arena, free_adopted, child );
+	return child;
+}
+
+/**
+	@brief Mark a jsonObject, and everything in it, as shared.
+	@param o Pointer to the jsonObject.
+
+	Each part not already shared gets a reference count of one, for whatever holds it now,
+	and forgets its parent.  A part already shared is already shared all the way down.
+*/
+static void freeze_object( jsonObject* o ) {
+	if( o->refs )
+		return;
+	o->refs = 1;
 	o->parent = NULL;
 
+	if( JSON_HASH == o->type ) {
+		osrfHashCursor cursor = NULL;
+		jsonObject* child;
+		while( (child = osrfHashCursorNext( o->value.h, &cursor, NULL )) )
+			freeze_object( child );
+	} else if( JSON_ARRAY == o->type ) {
+		unsigned long i;
+		for( i = 0; i < o->size; ++i ) {
+			jsonObject* child = OSRF_LIST_GET_INDEX( o->value.l, i );
+			if( child )
+				freeze_object( child );
+		}
+	}
+}
+
+/**
+	@brief Reject an attempt to change a jsonObject that others are sharing.
+	@param o Pointer to the jsonObject.
+	@return 1 if @a o is shared, or 0 if it may be changed.
+*/
+static int refuse_shared( const jsonObject* o ) {
+	if( o->refs ) {
+		osrfLogError( OSRF_LOG_MARK,
+			"Attempt to change a shared jsonObject; use jsonObjectMakeWritable()" );
+		return 1;
+	}
+	return 0;
+}
+
+/**
+	@brief Share a jsonObject instead of copying it.
+	@param o Pointer to the jsonObject to share.
+	@return Another reference to @a o, or if @a o can't be shared, a copy of it.
+
+	Sharing marks @a o, and everything in it, as shared, and adds a reference to it.  Each
+	holder frees its reference with jsonObjectFree(); the last one to do so frees the
+	jsonObject.  From then on, jsonObjectClone() shares @a o, or any part of it, in the
+	same way instead of copying it -- including when something containing it is cloned.
+
+	Nothing may change a shared jsonObject, or any part of it: the functions that change a
+	jsonObject refuse to, and code that changes one directly must not.  A holder that needs
+	to change one calls jsonObjectMakeWritable() first, and then jsonObjectGetKeyWritable()
+	or jsonObjectGetIndexWritable() for the parts it needs to change.
+
+	Only the current owner of @a o may share it for the first time, and nothing else may be
+	using it meanwhile.  Afterwards the holders may use it from different threads.
+
+	Something in an arena can't be shared; in that case we return a copy on the heap, as
+	jsonObjectClone() would.  Once @a o is shared, don't free its parts with
+	jsonObjectFree() except as references of their own.
+*/
+jsonObject* jsonObjectShare( jsonObject* o ) {
+	if( !o )
+		return NULL;
+	if( o->arena || ( o->parent && o->parent->arena ))
+		return jsonObjectClone( o );
+
+	freeze_object( o );
+	__atomic_add_fetch( &o->refs, 1, __ATOMIC_ACQ_REL );
+	return o;
+}
+
+/**
+	@brief Tell whether a jsonObject is shared.
+	@param o Pointer to the jsonObject.
+	@return 1 if @a o is shared, so that it mustn't be changed; otherwise zero.
+
+	Something shared stays so, even when only one holder is left, until that holder calls
+	jsonObjectMakeWritable().
+*/
+int jsonObjectIsShared( const jsonObject* o ) {
+	return o && o->refs ? 1 : 0;
+}
+
+/**
+	@brief Copy the top level of a shared jsonObject, sharing its contents.
+	@param o Pointer to the shared jsonObject.
+	@return Pointer to the copy, on the heap.
+*/
+static jsonObject* copy_top( const jsonObject* o ) {
+	osrfArena* arena = jsonSetArena( NULL );
+	jsonObject* copy;
+
+	if( JSON_HASH == o->type ) {
+		copy = jsonNewObjectType( JSON_HASH );
+		osrfHashCursor cursor = NULL;
+		const char* key;
+		jsonObject* child;
+		while( (child = osrfHashCursorNext( o->value.h, &cursor, &key )) )
+			jsonObjectSetKey( copy, key, clone_object( child, 1 ));
+	} else if( JSON_ARRAY == o->type ) {
+		copy = jsonNewObjectType( JSON_ARRAY );
+		unsigned long i;
+		for( i = 0; i < o->size; ++i )
+			jsonObjectPush( copy, clone_object( jsonObjectGetIndex( o, i ), 1 ));
+	} else
+		copy = clone_object( o, 0 );
+
+	jsonObjectSetClass( copy, o->classname );
+	jsonSetArena( arena );
+	return copy;
+}
+
+/**
+	@brief Make sure that a jsonObject may be changed, copying it if it's shared.
+	@param o Pointer to the jsonObject, which the calling code owns a reference to.
+	@return Pointer to a jsonObject that the calling code may change: @a o itself if no one
+		else holds it, or otherwise a copy of it.
+
+	This is where the copying happens that sharing put off.  Only the top level is copied;
+	its contents remain shared, to be made writable in turn if need be.
+
+	In the case of a copy, we give up the calling code's reference to @a o, and the calling
+	code owns the copy instead.  Either way, it should use only the returned pointer from
+	now on.
+*/
+jsonObject* jsonObjectMakeWritable( jsonObject* o ) {
+	if( !o || !o->refs )
+		return o;
+	if( 1 == __atomic_load_n( &o->refs, __ATOMIC_ACQUIRE )) {
+		o->refs = 0;  // ours alone, so no copy needed
+		return o;
+	}
+	jsonObject* copy = copy_top( o );
+	jsonObjectFree( o );
+	return copy;
+}
+
+/**
+	@brief From a jsonObject of type JSON_HASH, fetch the item for a key, ready to be changed.
+	@param obj Pointer to the outer jsonObject, which must not be shared.
+	@param key The key.
+	@return Pointer to the item, if found, or NULL if not, or if @a obj is shared.
+
+	Like jsonObjectGetKey(), except that if the item is shared, we replace it with a copy of
+	its top level that may be changed (see jsonObjectMakeWritable()).
+*/
+jsonObject* jsonObjectGetKeyWritable( jsonObject* obj, const char* key ) {
+	jsonObject* item = jsonObjectGetKey( obj, key );
+	if( !item || !item->refs )
+		return item;
+	if( refuse_shared( obj ))
+		return NULL;
+	if( 1 == __atomic_load_n( &item->refs, __ATOMIC_ACQUIRE )) {
+		item->refs = 0;  // held only by obj, so no copy needed
+		item->parent = obj;
+		return item;
+	}
+	jsonObject* copy = copy_top( item );
+	jsonObjectSetKey( obj, key, copy );
+	return copy;
+}
+
+/**
+	@brief From a jsonObject of type JSON_ARRAY, fetch an element, ready to be changed.
+	@param obj Pointer to the outer jsonObject, which must not be shared.
+	@param index A zero-based index identifying the element.
+	@return Pointer to the element, if found, or NULL if not, or if @a obj is shared.
+
+	Like jsonObjectGetIndex(), except that if the element is shared, we replace it with a
+	copy of its top level that may be changed (see jsonObjectMakeWritable()).
+*/
+jsonObject* jsonObjectGetIndexWritable( jsonObject* obj, unsigned long index ) {
+	jsonObject* item = jsonObjectGetIndex( obj, index );
+	if( !item || !item->refs )
+		return item;
+	if( refuse_shared( obj ))
+		return NULL;
+	if( 1 == __atomic_load_n( &item->refs, __ATOMIC_ACQUIRE )) {
+		item->refs = 0;  // held only by obj, so no copy needed
+		item->parent = obj;
+		return item;
+	}
+	jsonObject* copy = copy_top( item );
+	jsonObjectSetIndex( obj, index, copy );
+	return copy;
+}
+
+/**
+	@brief Create a new jsonObject, optionally containing a string.
+	@param data Pointer to a string to be stored in the jsonObject; may be NULL.
+	@return Pointer to a newly allocate jsonObject.
+
+	If @a data is NULL, create a jsonObject of type JSON_NULL.  Otherwise create
+	a jsonObject of type JSON_STRING, containing the specified string.
+
+	The calling code is responsible for freeing the jsonObject by calling jsonObjectFree().
+*/
+jsonObject* jsonNewObject(const char* data) {
+
+	jsonObject* o = new_object();
+
 	if(data) {
 		o->type = JSON_STRING;
-		o->value.s = strdup(data);
-	} else {
-		o->type = JSON_NULL;
-		o->value.s = NULL;
+		o->value.s = object_strdup( o, data );
 	}
 
 	return o;
@@ -167,32 +500,14 @@ jsonObject* jsonNewObject(const char* data) {
  */
 jsonObject* jsonNewObjectFmt(const char* data, ...) {
 
-	jsonObject* o;
-
-	if( freeObjList ) {
-		o = (jsonObject*) freeObjList;
-		freeObjList = freeObjList->next;
-        unusedObjRelease++;
-        currentListLen--;
-	} else {
-		OSRF_MALLOC( o, sizeof(jsonObject) );
-        mallocObjCreate++;
-    }
-
-	o->size = 0;
-	o->classname = NULL;
-	o->parent = NULL;
+	jsonObject* o = new_object();
 
 	if(data) {
 		VA_LIST_TO_STRING(data);
 		o->type = JSON_STRING;
-		o->value.s = strdup(VA_BUF);
-	}
-	else {
-		o->type = JSON_NULL;
-		o->value.s = NULL;
+		o->value.s = object_strdup( o, VA_BUF );
 	}
-	
+
 	return o;
 }
 
@@ -202,17 +517,51 @@ jsonObject* jsonNewObjectFmt(const char* data, ...) {
 	@return Pointer to the newly created jsonObject.
 
 	The number is stored internally as a character string, as formatted by
-	doubleToString().
+	doubleToString(), and as a native number.
 
 	The calling code is responsible for freeing the jsonObject by calling jsonObjectFree().
 */
 jsonObject* jsonNewNumberObject( double num ) {
 	jsonObject* o = jsonNewObject(NULL);
 	o->type = JSON_NUMBER;
-	o->value.s = doubleToString( num );
+	o->value.s = number_string( o, num );
 	return o;
 }
 
+/**
+	@brief Format a number for a JSON_NUMBER, and remember its value.
+	@param o Pointer to the jsonObject that will hold the number.
+	@param num The number.
+	@return Pointer to the string, owned by @a o.
+
+	A whole number in the range of a long long is formatted directly, with the same
+	result that doubleToString() would give.  Anything else goes through doubleToString(),
+	whose 30 significant digits are enough for strtod() to give back @a num exactly.
+*/
+static char* number_string( jsonObject* o, double num ) {
+	if( num >= -9223372036854775808.0 && num < 9223372036854775808.0
+			&& num == (double) (long long) num && !( 0 == num && signbit( num )) ) {
+		long long value = (long long) num;
+		unsigned long long mag = value < 0 ? - (unsigned long long) value : value;
+		char buf[ 24 ];
+		char* p = buf + sizeof( buf );
+		*--p = '\0';
+		do {
+			*--p = '0' + mag % 10;
+			mag /= 10;
+		} while( mag );
+		if( value < 0 )
+			*--p = '-';
+		o->num.i = value;
+		o->num_cache = NUM_INTEGER;
+		return object_strdup( o, p );
+	}
+
+	o->num.d = num;
+	o->num_cache = NUM_DOUBLE;
+	return object_adopt_string( o, doubleToString( num ));
+}
+
 /**
 	@brief Create a new jsonObject of type JSON_NUMBER from a numeric string.
 	@param numstr Pointer to a numeric character string.
@@ -231,7 +580,7 @@ jsonObject* jsonNewNumberStringObject( const char* numstr ) {
 
 	jsonObject* o = jsonNewObject(NULL);
 	o->type = JSON_NUMBER;
-	o->value.s = strdup( numstr );
+	o->value.s = object_strdup( o, numstr );
 	return o;
 }
 
@@ -281,11 +630,19 @@ jsonObject* jsonNewObjectType(int type) {
 
 	Any jsonObjects stored inside the jsonObject (in hashes or arrays) will be freed as
 	well, and so one, recursively.
+
+	A jsonObject in an arena is left alone, to go away when the arena is reset.
+
+	For a shared jsonObject, give up one reference to it, and free it only if that was the
+	last one.
 */
 void jsonObjectFree( jsonObject* o ) {
 
-	if(!o || o->parent) return;
-	free(o->classname);
+	if(!o || o->parent || o->arena) return;
+	if( o->refs && __atomic_sub_fetch( &o->refs, 1, __ATOMIC_ACQ_REL ) > 0 )
+		return;
+	if( !o->class_interned )
+		free(o->classname);
 
 	switch(o->type) {
 		case JSON_HASH		: osrfHashFree(o->value.h); break;
@@ -320,7 +677,10 @@ void jsonObjectFree( jsonObject* o ) {
 static void _jsonFreeHashItem(char* key, void* item){
 	if(!item) return;
 	jsonObject* o = (jsonObject*) item;
-	o->parent = NULL; /* detach the item */
+	if( o->parent && o->parent->arena && !o->arena )
+		return;  /* adopted; the arena frees it */
+	if( o->parent )
+		o->parent = NULL; /* detach the item */
 	jsonObjectFree(o);
 }
 
@@ -333,7 +693,10 @@ static void _jsonFreeHashItem(char* key, void* item){
 static void _jsonFreeListItem(void* item){
 	if(!item) return;
 	jsonObject* o = (jsonObject*) item;
-	o->parent = NULL; /* detach the item */
+	if( o->parent && o->parent->arena && !o->arena )
+		return;  /* adopted; the arena frees it */
+	if( o->parent )
+		o->parent = NULL; /* detach the item */
 	jsonObjectFree(o);
 }
 
@@ -350,7 +713,7 @@ static void _jsonFreeListItem(void* item){
 	take advantage of that fact, because future versions may behave differently.
 */
 void jsonSetBool(jsonObject* bl, int val) {
-    if(!bl) return;
+    if(!bl || refuse_shared(bl)) return;
     JSON_INIT_CLEAR(bl, JSON_BOOL);
     bl->value.b = val;
 }
@@ -371,10 +734,10 @@ void jsonSetBool(jsonObject* bl, int val) {
 	of type JSON_NULL, and appends it to the array.
 */
 unsigned long jsonObjectPush(jsonObject* o, jsonObject* newo) {
-    if(!o) return -1;
+    if(!o || refuse_shared(o)) return -1;
     if(!newo) newo = jsonNewObject(NULL);
 	JSON_INIT_CLEAR(o, JSON_ARRAY);
-	newo->parent = o;
+	newo = adopt_object( o, newo );
 	osrfListPush( o->value.l, newo );
 	o->size = o->value.l->size;
 	return o->size;
@@ -403,10 +766,10 @@ unsigned long jsonObjectPush(jsonObject* o, jsonObject* newo) {
 	number of jsonObjects in the array.  See osrf_list.c for further details.
 */
 unsigned long jsonObjectSetIndex(jsonObject* dest, unsigned long index, jsonObject* newObj) {
-	if(!dest) return -1;
+	if(!dest || refuse_shared(dest)) return -1;
 	if(!newObj) newObj = jsonNewObject(NULL);
 	JSON_INIT_CLEAR(dest, JSON_ARRAY);
-	newObj->parent = dest;
+	newObj = adopt_object( dest, newObj );
 	osrfListSet( dest->value.l, newObj, index );
 	dest->size = dest->value.l->size;
 	return dest->value.l->size;
@@ -433,10 +796,10 @@ unsigned long jsonObjectSetIndex(jsonObject* dest, unsigned long index, jsonObje
 	If a previous jsonObject is already stored with the same key, it is freed and replaced.
 */
 unsigned long jsonObjectSetKey( jsonObject* o, const char* key, jsonObject* newo) {
-    if(!o) return -1;
+    if(!o || refuse_shared(o)) return -1;
     if(!newo) newo = jsonNewObject(NULL);
 	JSON_INIT_CLEAR(o, JSON_HASH);
-	newo->parent = o;
+	newo = adopt_object( o, newo );
 	osrfHashSet( o->value.h, newo, key );
 	o->size = osrfHashGetCount(o->value.h);
 	return o->size;
@@ -475,105 +838,213 @@ const jsonObject* jsonObjectGetKeyConst( const jsonObject* obj, const char* key
 }
 
 /**
-	@brief Recursively traverse a jsonObject, translating it into a JSON string.
-	@param obj Pointer to the jsonObject to be translated.
-	@param buf Pointer to a growing_buffer that will receive the JSON string.
+	@brief Recursively traverse a jsonObject, working out how long its JSON will be.
+	@param obj Pointer to the jsonObject to be measured.
 	@param do_classname Boolean; if true, expand (i.e. encode) class names.
 	@param second_pass Boolean; should always be false except for some recursive calls.
- 
+	@return The exact length of the JSON that write_json() will produce, not counting
+		the terminal nul.
+
 	If @a do_classname is true, expand any class names, as described in the discussion of
 	jsonObjectToJSON().
 
 	@a second_pass should always be false except for some recursive calls.  It is used
 	when expanding classnames, to distinguish between the first and second passes
 	through a given node.
+
+	This function and write_json() must walk the tree in exactly the same way.
 */
-static void add_json_to_buffer( const jsonObject* obj,
-	growing_buffer * buf, int do_classname, int second_pass ) {
+static size_t json_length( const jsonObject* obj, int do_classname, int second_pass ) {
 
-    if(NULL == obj) {
-        OSRF_BUFFER_ADD(buf, "null");
-        return;
-    }
+	if( NULL == obj )
+		return sizeof( "null" ) - 1;
 
-	if( obj->classname && do_classname )
-	{
+	if( obj->classname && do_classname ) {
 		if( second_pass )
 			second_pass = 0;
-		else
-		{
-			// Pretend we see an extra layer of JSON_HASH
-			
-			OSRF_BUFFER_ADD( buf, "{\"" );
-			OSRF_BUFFER_ADD( buf, JSON_CLASS_KEY );
-			OSRF_BUFFER_ADD( buf, "\":\"" );
-			OSRF_BUFFER_ADD( buf, obj->classname );
-			OSRF_BUFFER_ADD( buf, "\",\"" );
-			OSRF_BUFFER_ADD( buf, JSON_DATA_KEY );
-			OSRF_BUFFER_ADD( buf, "\":" );
-			add_json_to_buffer( obj, buf, 1, 1 );
-			buffer_add_char( buf, '}' );
-			return;
+		else {
+			// Pretend we see an extra layer of JSON_HASH:
+			// {"__c":"classname","__p":...}
+			return sizeof( "{\"" JSON_CLASS_KEY "\":\"\",\"" JSON_DATA_KEY "\":}" ) - 1
+				+ strlen( obj->classname ) + json_length( obj, 1, 1 );
 		}
 	}
 
-	switch(obj->type) {
+	size_t len = 0;
+	switch( obj->type ) {
 
 		case JSON_BOOL :
-			if(obj->value.b) OSRF_BUFFER_ADD(buf, "true"); 
-			else OSRF_BUFFER_ADD(buf, "false"); 
+			len = obj->value.b ? sizeof( "true" ) - 1 : sizeof( "false" ) - 1;
 			break;
 
-        case JSON_NUMBER: {
-            if(obj->value.s) OSRF_BUFFER_ADD( buf, obj->value.s );
-            else OSRF_BUFFER_ADD_CHAR( buf, '0' );
-            break;
-        }
+		case JSON_NUMBER :
+			len = obj->value.s ? strlen( obj->value.s ) : 1;
+			break;
 
-		case JSON_NULL:
-			OSRF_BUFFER_ADD(buf, "null");
+		case JSON_NULL :
+			len = sizeof( "null" ) - 1;
 			break;
 
-		case JSON_STRING:
-			OSRF_BUFFER_ADD_CHAR(buf, '"');
-			buffer_append_utf8(buf, obj->value.s);
-			OSRF_BUFFER_ADD_CHAR(buf, '"');
+		case JSON_STRING :
+			len = 2 + osrf_utf8_escaped_length( obj->value.s );
 			break;
-			
-		case JSON_ARRAY: {
-			OSRF_BUFFER_ADD_CHAR(buf, '[');
+
+		case JSON_ARRAY : {
+			len = 2;
 			if( obj->value.l ) {
-				int i;
-				for( i = 0; i != obj->value.l->size; i++ ) {
-					if(i > 0) OSRF_BUFFER_ADD(buf, ",");
-					add_json_to_buffer(
-						OSRF_LIST_GET_INDEX(obj->value.l, i), buf, do_classname, second_pass );
+				unsigned int i;
+				for( i = 0; i < obj->value.l->size; i++ ) {
+					if( i > 0 )
+						++len;
+					len += json_length(
+						OSRF_LIST_GET_INDEX( obj->value.l, i ), do_classname, second_pass );
 				}
 			}
-			OSRF_BUFFER_ADD_CHAR(buf, ']');
 			break;
 		}
 
-		case JSON_HASH: {
-	
-			OSRF_BUFFER_ADD_CHAR(buf, '{');
-			osrfHashIterator* itr = osrfNewHashIterator(obj->value.h);
-			jsonObject* item;
+		case JSON_HASH : {
+			len = 2;
+			osrfHashCursor cursor = NULL;
+			const char* key;
+			const jsonObject* item;
 			int i = 0;
 
-			while( (item = osrfHashIteratorNext(itr)) ) {
-				if(i++ > 0) OSRF_BUFFER_ADD_CHAR(buf, ',');
-				OSRF_BUFFER_ADD_CHAR(buf, '"');
-				buffer_append_utf8(buf, osrfHashIteratorKey(itr));
-				OSRF_BUFFER_ADD(buf, "\":");
-				add_json_to_buffer( item, buf, do_classname, second_pass );
+			// Like an osrfHashIterator, stop at the first NULL item
+			while( (item = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+				if( i++ > 0 )
+					++len;
+				len += 3 + osrf_utf8_escaped_length( key );   // "key":
+				len += json_length( item, do_classname, second_pass );
 			}
+			break;
+		}
+	}
+
+	return len;
+}
 
-			osrfHashIteratorFree(itr);
-			OSRF_BUFFER_ADD_CHAR(buf, '}');
+/** @brief Copy a string literal into the output, and advance past it. */
+#define WRITE_LITERAL(p,lit) do { \
+		memcpy( (p), (lit), sizeof( lit ) - 1 ); \
+		(p) += sizeof( lit ) - 1; \
+	} while( 0 )
+
+/**
+	@brief Recursively traverse a jsonObject, translating it into JSON in memory sized
+		by json_length().
+	@param obj Pointer to the jsonObject to be translated.
+	@param p Pointer to where to write the JSON.
+	@param do_classname Boolean; if true, expand (i.e. encode) class names.
+	@param second_pass Boolean; should always be false except for some recursive calls.
+	@return Pointer to the byte just past the last one written.
+
+	No terminal nul is written.  See json_length() for the parameters.
+*/
+static char* write_json( const jsonObject* obj, char* p, int do_classname, int second_pass ) {
+
+	if( NULL == obj ) {
+		WRITE_LITERAL( p, "null" );
+		return p;
+	}
+
+	if( obj->classname && do_classname ) {
+		if( second_pass )
+			second_pass = 0;
+		else {
+			// Pretend we see an extra layer of JSON_HASH
+			size_t n = strlen( obj->classname );
+			WRITE_LITERAL( p, "{\"" JSON_CLASS_KEY "\":\"" );
+			memcpy( p, obj->classname, n );
+			p += n;
+			WRITE_LITERAL( p, "\",\"" JSON_DATA_KEY "\":" );
+			p = write_json( obj, p, 1, 1 );
+			*p++ = '}';
+			return p;
+		}
+	}
+
+	switch( obj->type ) {
+
+		case JSON_BOOL :
+			if( obj->value.b )
+				WRITE_LITERAL( p, "true" );
+			else
+				WRITE_LITERAL( p, "false" );
+			break;
+
+		case JSON_NUMBER :
+			if( obj->value.s ) {
+				size_t n = strlen( obj->value.s );
+				memcpy( p, obj->value.s, n );
+				p += n;
+			} else
+				*p++ = '0';
+			break;
+
+		case JSON_NULL :
+			WRITE_LITERAL( p, "null" );
+			break;
+
+		case JSON_STRING :
+			*p++ = '"';
+			p = osrf_utf8_escape( p, obj->value.s );
+			*p++ = '"';
+			break;
+
+		case JSON_ARRAY : {
+			*p++ = '[';
+			if( obj->value.l ) {
+				unsigned int i;
+				for( i = 0; i < obj->value.l->size; i++ ) {
+					if( i > 0 )
+						*p++ = ',';
+					p = write_json(
+						OSRF_LIST_GET_INDEX( obj->value.l, i ), p, do_classname, second_pass );
+				}
+			}
+			*p++ = ']';
+			break;
+		}
+
+		case JSON_HASH : {
+			*p++ = '{';
+			osrfHashCursor cursor = NULL;
+			const char* key;
+			const jsonObject* item;
+			int i = 0;
+
+			while( (item = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+				if( i++ > 0 )
+					*p++ = ',';
+				*p++ = '"';
+				p = osrf_utf8_escape( p, key );
+				*p++ = '"';
+				*p++ = ':';
+				p = write_json( item, p, do_classname, second_pass );
+			}
+			*p++ = '}';
 			break;
 		}
 	}
+
+	return p;
+}
+
+/**
+	@brief Translate a jsonObject into a newly allocated JSON string.
+	@param obj Pointer to the jsonObject to be translated.
+	@param do_classname Boolean; if true, expand class names.
+	@return A pointer to the string.
+
+	Measure first, then allocate exactly once and fill it in.
+*/
+static char* object_to_json( const jsonObject* obj, int do_classname ) {
+	size_t len = json_length( obj, do_classname, 0 );
+	char* json = safe_malloc( len + 1 );
+	char* end = write_json( obj, json, do_classname, 0 );
+	*end = '\0';
+	return json;
 }
 
 /**
@@ -585,9 +1056,7 @@ static void add_json_to_buffer( const jsonObject* obj,
 */
 char* jsonObjectToJSONRaw( const jsonObject* obj ) {
 	if(!obj) return NULL;
-	growing_buffer* buf = buffer_init(32);
-	add_json_to_buffer( obj, buf, 0, 0 );
-	return buffer_release( buf );
+	return object_to_json( obj, 0 );
 }
 
 /**
@@ -603,9 +1072,7 @@ char* jsonObjectToJSONRaw( const jsonObject* obj ) {
  */
 char* jsonObjectToJSON( const jsonObject* obj ) {
 	if(!obj) return NULL;
-	growing_buffer* buf = buffer_init(32);
-	add_json_to_buffer( obj, buf, 1, 0 );
-	return buffer_release( buf );
+	return object_to_json( obj, 1 );
 }
 
 /**
@@ -735,7 +1202,7 @@ jsonObject* jsonObjectGetIndex( const jsonObject* obj, unsigned long index ) {
 	the outer jsonObject, not counting any at lower levels.
 */
 unsigned long jsonObjectRemoveIndex(jsonObject* dest, unsigned long index) {
-	if( dest && dest->type == JSON_ARRAY ) {
+	if( dest && dest->type == JSON_ARRAY && !refuse_shared( dest )) {
 		osrfListRemove(dest->value.l, index);
 		return dest->value.l->size;
 	}
@@ -759,10 +1226,39 @@ unsigned long jsonObjectRemoveIndex(jsonObject* dest, unsigned long index) {
 	the removed sub-object instead of destroying it.
 */
 jsonObject* jsonObjectExtractIndex(jsonObject* dest, unsigned long index) {
-	if( dest && dest->type == JSON_ARRAY ) {
+	if( dest && dest->type == JSON_ARRAY && !refuse_shared( dest )) {
 		jsonObject* obj = osrfListExtract(dest->value.l, index);
-		if( obj )
+		if( obj ) {
+			if( dest->arena && !obj->arena )  // take it back from the arena
+				osrfArenaCancel( dest->arena, free_adopted, obj );
+			obj->parent = NULL;
+		}
+		return obj;
+	} else
+		return NULL;
+}
+
+/**
+	@brief Extract an element, specified by key, from a jsonObject of type JSON_HASH.
+	@param dest Pointer to the jsonObject from which the element is to be extracted.
+	@param key The key for the element to be extracted.
+	@return A pointer to the extracted element, if successful; otherwise NULL.
+
+	The return value is NULL if either parameter is NULL, if @a dest points to a jsonObject
+	not of type JSON_HASH, or if the key is not found.
+
+	Otherwise the calling code assumes ownership of the extracted jsonObject, as for
+	jsonObjectExtractIndex().
+*/
+jsonObject* jsonObjectExtractKey( jsonObject* dest, const char* key ) {
+	if( dest && key && dest->type == JSON_HASH && !refuse_shared( dest )) {
+		jsonObject* obj = osrfHashExtract( dest->value.h, key );
+		if( obj ) {
+			if( dest->arena && !obj->arena )  // take it back from the arena
+				osrfArenaCancel( dest->arena, free_adopted, obj );
 			obj->parent = NULL;
+			dest->size = osrfHashGetCount( dest->value.h );
+		}
 		return obj;
 	} else
 		return NULL;
@@ -778,7 +1274,7 @@ jsonObject* jsonObjectExtractIndex(jsonObject* dest, unsigned long index) {
 	@a dest points to a jsonObject of type JSON_HASH, even if the specified key is not found.
 */
 unsigned long jsonObjectRemoveKey( jsonObject* dest, const char* key) {
-	if( dest && key && dest->type == JSON_HASH ) {
+	if( dest && key && dest->type == JSON_HASH && !refuse_shared( dest )) {
 		osrfHashRemove(dest->value.h, key);
 		return 1;
 	}
@@ -843,8 +1339,77 @@ const char* jsonObjectGetString(const jsonObject* obj) {
 	returned is zero.
 */
 double jsonObjectGetNumber( const jsonObject* obj ) {
-	return (obj && obj->type == JSON_NUMBER && obj->value.s)
-			? strtod( obj->value.s, NULL ) : 0;
+	if( !(obj && obj->type == JSON_NUMBER && obj->value.s) )
+		return 0;
+	return NUM_INTEGER == number_cache( obj ) ? (double) obj->num.i : obj->num.d;
+}
+
+/**
+	@brief Translate a jsonObject to a long long.
+	@param @obj Pointer to the jsonObject.
+	@return The numeric value stored in the jsonObject, truncated to a whole number.
+
+	Unlike jsonObjectGetNumber(), we return an integer exactly, even one too big for a
+	double to hold, such as a 64-bit ID.  Anything else is truncated toward zero, and
+	clamped to the range of a long long.
+
+	If @a obj is NULL, or if it points to a jsonObject not of type JSON_NUMBER, the value
+	returned is zero.
+*/
+long long jsonObjectGetInteger( const jsonObject* obj ) {
+	if( !(obj && obj->type == JSON_NUMBER && obj->value.s) )
+		return 0;
+	if( NUM_INTEGER == number_cache( obj ) )
+		return obj->num.i;
+
+	double d = obj->num.d;
+	if( d != d )
+		return 0;      // NaN
+	else if( d >= 9223372036854775808.0 )
+		return LLONG_MAX;
+	else if( d < -9223372036854775808.0 )
+		return LLONG_MIN;
+	else
+		return (long long) d;
+}
+
+/**
+	@brief Make sure that a JSON_NUMBER's native value has been converted.
+	@param obj Pointer to the jsonObject, of type JSON_NUMBER with a non-NULL string.
+	@return NUM_INTEGER or NUM_DOUBLE, telling which member of @em num holds the value.
+
+	The conversion is done once, the first time that anyone asks.  Although @a obj is
+	const, we update its cache.  Other threads reading the same object may race us to do
+	so; they'll store the same value, and publish the cache state only after the value.
+*/
+static int number_cache( const jsonObject* obj ) {
+	int state = __atomic_load_n( &obj->num_cache, __ATOMIC_ACQUIRE );
+	if( state != NUM_UNKNOWN )
+		return state;
+
+	jsonObject* o = (jsonObject*) obj;
+	const char* s = obj->value.s;
+
+	// Is it a plain integer, as most of our numbers (IDs, counts) are?
+	const char* p = ( '-' == *s ) ? s + 1 : s;
+	const char* digits = p;
+	while( isdigit( (unsigned char) *p ) )
+		++p;
+
+	state = NUM_DOUBLE;
+	if( !*p && p > digits ) {
+		errno = 0;
+		long long value = strtoll( s, NULL, 10 );
+		if( 0 == errno && !( 0 == value && '-' == *s )) {   // keep "-0" a double
+			o->num.i = value;
+			state = NUM_INTEGER;
+		}
+	}
+	if( NUM_DOUBLE == state )
+		o->num.d = strtod( s, NULL );
+
+	__atomic_store_n( &o->num_cache, state, __ATOMIC_RELEASE );
+	return state;
 }
 
 /**
@@ -858,9 +1423,9 @@ double jsonObjectGetNumber( const jsonObject* obj ) {
 	with any previous contents freed.
 */
 void jsonObjectSetString(jsonObject* dest, const char* string) {
-	if(!(dest && string)) return;
+	if(!(dest && string) || refuse_shared(dest)) return;
 	JSON_INIT_CLEAR(dest, JSON_STRING);
-	dest->value.s = strdup(string);
+	dest->value.s = object_strdup( dest, string );
 }
 
 /**
@@ -882,11 +1447,11 @@ void jsonObjectSetString(jsonObject* dest, const char* string) {
 	is zero.
  */
 int jsonObjectSetNumberString(jsonObject* dest, const char* string) {
-	if(!(dest && string)) return -1;
+	if(!(dest && string) || refuse_shared(dest)) return -1;
 	JSON_INIT_CLEAR(dest, JSON_NUMBER);
 
 	if( jsonIsNumeric( string ) ) {
-		dest->value.s = strdup(string);
+		dest->value.s = object_strdup( dest, string );
 		return 0;
 	}
 	else {
@@ -904,9 +1469,9 @@ int jsonObjectSetNumberString(jsonObject* dest, const char* string) {
 	previous contents freed.
 */
 void jsonObjectSetNumber(jsonObject* dest, double num) {
-	if(!dest) return;
+	if(!dest || refuse_shared(dest)) return;
 	JSON_INIT_CLEAR(dest, JSON_NUMBER);
-	dest->value.s = doubleToString( num );
+	dest->value.s = number_string( dest, num );
 }
 
 /**
@@ -915,11 +1480,23 @@ void jsonObjectSetNumber(jsonObject* dest, double num) {
 	@param classname Pointer to a string containing the class name.
 
 	Both dest and classname must be non-NULL.
+
+	The same few class names turn up on object after object, so share an interned copy
+	if we can (see osrf_intern_name()), and make a private one only if we must.
 */
 void jsonObjectSetClass(jsonObject* dest, const char* classname ) {
-	if(!(dest && classname)) return;
-	free(dest->classname);
-	dest->classname = strdup(classname);
+	if(!(dest && classname) || refuse_shared(dest)) return;
+	if( !dest->arena && !dest->class_interned )
+		free(dest->classname);
+
+	const char* interned = osrf_intern_name( classname );
+	if( interned ) {
+		dest->classname = (char*) interned;
+		dest->class_interned = 1;
+	} else {
+		dest->classname = object_strdup( dest, classname );
+		dest->class_interned = 0;
+	}
 }
 
 /**
@@ -940,11 +1517,36 @@ const char* jsonObjectGetClass(const jsonObject* dest) {
 	@param o Pointer to the jsonObject to be copied.
 	@return A pointer to the newly created copy.
 
-	The calling code is responsible for freeing the copy of the original.
+	The copy is always on the heap, even if the original is in an arena, or an arena is in
+	effect.  The calling code is responsible for freeing the copy of the original.
+
+	Anything shared (see jsonObjectShare()), whether @a o itself or a part of it, isn't
+	copied; the copy gets another reference to it instead.
 */
 jsonObject* jsonObjectClone( const jsonObject* o ) {
+	osrfArena* arena = jsonSetArena( NULL );
+	jsonObject* result = clone_object( o, 1 );
+	jsonSetArena( arena );
+	return result;
+}
+
+/**
+	@brief Copy a jsonObject, including all internal sub-objects, in the current arena if any.
+	@param o Pointer to the jsonObject to be copied.
+	@param share Boolean: true to add a reference to anything shared instead of copying it.
+	@return A pointer to the newly created copy.
+
+	The workhorse for jsonObjectClone().
+*/
+static jsonObject* clone_object( const jsonObject* o, int share ) {
     if(!o) return jsonNewObject(NULL);
 
+	if( share && o->refs ) {
+		jsonObject* shared = (jsonObject*) o;
+		__atomic_add_fetch( &shared->refs, 1, __ATOMIC_ACQ_REL );
+		return shared;
+	}
+
     int i;
     jsonObject* arr; 
     jsonObject* hash; 
@@ -962,15 +1564,18 @@ jsonObject* jsonObjectClone( const jsonObject* o ) {
         case JSON_NUMBER:
 			result = jsonNewObject( o->value.s );
 			result->type = JSON_NUMBER;
+			result->num_cache = __atomic_load_n( &o->num_cache, __ATOMIC_ACQUIRE );
+			result->num = o->num;
             break;
         case JSON_BOOL:
             result = jsonNewBoolObject(jsonBoolIsTrue((jsonObject*) o));
             break;
         case JSON_ARRAY:
             arr = jsonNewObject(NULL);
-            arr->type = JSON_ARRAY;
+            JSON_INIT_CLEAR(arr, JSON_ARRAY);
+            osrfListReserve(arr->value.l, o->size);
             for(i=0; i < o->size; i++) 
-                jsonObjectPush(arr, jsonObjectClone(jsonObjectGetIndex(o, i)));
+                jsonObjectPush(arr, clone_object(jsonObjectGetIndex(o, i), share));
             result = arr;
             break;
         case JSON_HASH:
@@ -978,13 +1583,17 @@ jsonObject* jsonObjectClone( const jsonObject* o ) {
             hash->type = JSON_HASH;
             itr = jsonNewIterator(o);
             while( (tmp = jsonIteratorNext(itr)) )
-                jsonObjectSetKey(hash, itr->key, jsonObjectClone(tmp));
+                jsonObjectSetKey(hash, itr->key, clone_object(tmp, share));
             jsonIteratorFree(itr);
             result = hash;
             break;
     }
 
-    jsonObjectSetClass(result, jsonObjectGetClass(o));
+	if( o->class_interned ) {
+		result->classname = o->classname;
+		result->class_interned = 1;
+	} else
+		jsonObjectSetClass(result, jsonObjectGetClass(o));
     return result;
 }
 
@@ -16,9 +16,6 @@ GNU General Public License for more details.
 #include <ctype.h>
 #include "opensrf/osrf_json.h"
 
-static jsonObject* findMultiPath( const jsonObject* o,
-		const char* root, const char* path );
-static jsonObject* findMultiPathRecurse( const jsonObject* o, const char* root );
 static jsonObject* _jsonObjectEncodeClass( const jsonObject* obj, int ignoreClass );
 
 /**
@@ -219,119 +216,469 @@ static jsonObject* _jsonObjectEncodeClass( const jsonObject* obj, int ignoreClas
 	return newObj;
 }
 
-jsonObject* jsonObjectFindPath( const jsonObject* obj, const char* format, ...) {
-	if(!obj || !format || strlen(format) < 1) return NULL;	
+/**
+	@brief Decode the class hints in a jsonObject without copying it.
+	@param obj Pointer to the jsonObject, which may be changed.
+	@return What should take the place of @a obj: @a obj itself, its decoded payload, or a
+		decoded copy of it; or NULL for a class hint without a payload.
 
-	VA_LIST_TO_STRING(format);
-	char* buf = VA_BUF;
-	char* token = NULL;
-	char* tt; /* strtok storage */
+	If the return value isn't @a obj, the calling code disposes of @a obj.  A payload is
+	extracted from its wrapper first, so disposing of the wrapper doesn't free it.
 
-	/* special case where path starts with //  (start anywhere) */
-	if(buf[0] == '/' && buf[1] == '/' && buf[2] != '\0') {
+	Something shared, or in an arena, is decoded by copying, as jsonObjectDecodeClass()
+	does; everything else is decoded in place.
+*/
+static jsonObject* decode_in_place( jsonObject* obj ) {
+	if( obj->refs || obj->arena )
+		return jsonObjectDecodeClass( obj );
+
+	if( JSON_HASH == obj->type ) {
+		const jsonObject* classObj = jsonObjectGetKeyConst( obj, JSON_CLASS_KEY );
+		if( classObj ) {
+			jsonObject* payload = jsonObjectGetKey( obj, JSON_DATA_KEY );
+			if( !payload )
+				return NULL;    // class is defined but there is no payload
+
+			jsonObject* decoded = decode_in_place( payload );
+			if( decoded == payload )
+				jsonObjectExtractKey( obj, JSON_DATA_KEY );
+			if( decoded )
+				jsonObjectSetClass( decoded, jsonObjectGetString( classObj ));
+			return decoded;
+		}
 
-		/* copy the path before strtok_r destroys it */
-		char* pathcopy = strdup(buf);
+		// A regular hash; replace any child that doesn't decode in place
+		osrfHashCursor cursor = NULL;
+		const char* key;
+		jsonObject* child;
+		while( (child = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+			jsonObject* decoded = decode_in_place( child );
+			if( decoded != child )
+				jsonObjectSetKey( obj, key, decoded );
+		}
 
-		/* grab the root of the path */
-		token = strtok_r(buf, "/", &tt);
-		if(!token) {
-			free(pathcopy);
-			return NULL;
+	} else if( JSON_ARRAY == obj->type ) {
+		unsigned long i;
+		for( i = 0; i < obj->size; ++i ) {
+			jsonObject* child = jsonObjectGetIndex( obj, i );
+			jsonObject* decoded = child ? decode_in_place( child ) : NULL;
+			if( decoded != child || !child )
+				jsonObjectSetIndex( obj, i, decoded );
 		}
+	}
+
+	return obj;
+}
+
+/**
+	@brief Convert a class-wrapped jsonObject into one with class names, without copying it.
+	@param obj Pointer to the jsonObject, which we take over.
+	@return Pointer to the decoded jsonObject, or NULL for a class hint without a payload.
+
+	The result is the same as jsonObjectDecodeClass() would return, but instead of building
+	a new tree we rearrange @a obj, moving each payload out of its wrapper.  Use it in place
+	of jsonObjectDecodeClass() when the original isn't needed afterwards.
+
+	@a obj must not be part of another jsonObject; jsonObjectExtractKey() or
+	jsonObjectExtractIndex() can detach it.  The calling code may use only the returned
+	pointer from now on, and is responsible for freeing it.
+*/
+jsonObject* jsonObjectDecodeClassInPlace( jsonObject* obj ) {
+	if( !obj ) return jsonNewObject( NULL );
+
+	jsonObject* decoded = decode_in_place( obj );
+	if( decoded != obj )
+		jsonObjectFree( obj );
+	return decoded;
+}
+
+/**
+	@brief Move the contents of one jsonObject into another.
+	@param to Pointer to the receiving jsonObject, a JSON_NULL on the heap.
+	@param from Pointer to the jsonObject to be emptied, which becomes a JSON_NULL.
+
+	The class name stays where it is.
+*/
+static void move_contents( jsonObject* to, jsonObject* from ) {
+	to->type = from->type;
+	to->size = from->size;
+	to->value = from->value;
+	to->num_cache = from->num_cache;
+	to->num = from->num;
+
+	// Tell the children about their new parent
+	jsonObject* child;
+	if( JSON_HASH == to->type ) {
+		osrfHashCursor cursor = NULL;
+		while( (child = osrfHashCursorNext( to->value.h, &cursor, NULL )) )
+			if( child->parent == from )
+				child->parent = to;
+	} else if( JSON_ARRAY == to->type ) {
+		unsigned long i;
+		for( i = 0; i < to->size; ++i )
+			if( (child = OSRF_LIST_GET_INDEX( to->value.l, i )) && child->parent == from )
+				child->parent = to;
+	}
+
+	from->type = JSON_NULL;
+	from->size = 0;
+	memset( &from->value, 0, sizeof( from->value ));
+	from->num_cache = 0;
+}
 
-		jsonObject* it = findMultiPath(obj, token, pathcopy + 1);
-		free(pathcopy);
-		return it;
+/**
+	@brief Encode the class names in a jsonObject as wrappers, without copying it.
+	@param obj Pointer to the jsonObject, which may be changed.
+	@return What should take the place of @a obj: @a obj itself, or an encoded copy of it.
+
+	If the return value isn't @a obj, the calling code disposes of @a obj.
+
+	A jsonObject with a class name becomes its own wrapper: its contents move into a new
+	payload, and its class name into the JSON_CLASS_KEY member.  Something shared, or in an
+	arena, is encoded by copying, as jsonObjectEncodeClass() does.
+*/
+static jsonObject* encode_in_place( jsonObject* obj ) {
+	if( obj->refs || obj->arena )
+		return jsonObjectEncodeClass( obj );
+
+	if( JSON_HASH == obj->type ) {
+		osrfHashCursor cursor = NULL;
+		const char* key;
+		jsonObject* child;
+		while( (child = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+			jsonObject* encoded = encode_in_place( child );
+			if( encoded != child )
+				jsonObjectSetKey( obj, key, encoded );
+		}
+	} else if( JSON_ARRAY == obj->type ) {
+		unsigned long i;
+		for( i = 0; i < obj->size; ++i ) {
+			jsonObject* child = jsonObjectGetIndex( obj, i );
+			jsonObject* encoded = child ? encode_in_place( child ) : NULL;
+			if( encoded != child || !child )
+				jsonObjectSetIndex( obj, i, encoded );
+		}
 	}
-	else
-	{
-		/* grab the root of the path */
-		token = strtok_r(buf, "/", &tt);
-		if(!token) return NULL;
 
-		do {
-			obj = jsonObjectGetKeyConst(obj, token);
-		} while( (token = strtok_r(NULL, "/", &tt)) && obj);
+	if( obj->classname ) {
+		jsonObject* payload = jsonNewObject( NULL );
+		move_contents( payload, obj );
 
-		return jsonObjectClone(obj);
+		// Move the class name into a string, unless it's interned
+		jsonObject* classObj;
+		if( obj->class_interned )
+			classObj = jsonNewObject( obj->classname );
+		else {
+			classObj = jsonNewObject( NULL );
+			classObj->type = JSON_STRING;
+			classObj->value.s = obj->classname;
+		}
+		obj->classname = NULL;
+		obj->class_interned = 0;
+
+		jsonObjectSetKey( obj, JSON_CLASS_KEY, classObj );
+		jsonObjectSetKey( obj, JSON_DATA_KEY, payload );
 	}
+
+	return obj;
 }
 
-/* --------------------------------------------------------------- */
+/**
+	@brief Convert a jsonObject with class names into a class-wrapped one, without copying it.
+	@param obj Pointer to the jsonObject, which we take over.
+	@return Pointer to the encoded jsonObject.
 
-/* Utility method. finds any object in the tree that matches the path.  
-	Use this for finding paths that start with '//' */
-static jsonObject* findMultiPath(const jsonObject* obj,
-		const char* root, const char* path) {
+	The result is the same as jsonObjectEncodeClass() would return, except that a payload
+	never keeps a class name of its own.  Instead of building a new tree we rearrange @a obj,
+	turning each jsonObject with a class name into a wrapper around its former contents.
 
-	if(!obj || ! root || !path) return NULL;
+	As for jsonObjectDecodeClassInPlace(), @a obj must not be part of another jsonObject,
+	and the calling code may use only the returned pointer from now on.
+*/
+jsonObject* jsonObjectEncodeClassInPlace( jsonObject* obj ) {
+	if( !obj ) return jsonNewObject( NULL );
 
-	/* collect all of the potential objects */
-	jsonObject* arr = findMultiPathRecurse(obj, root);
+	jsonObject* encoded = encode_in_place( obj );
+	if( encoded != obj )
+		jsonObjectFree( obj );
+	return encoded;
+}
 
-	/* path is just /root or /root/ */
-	if( strlen(root) + 2 >= strlen(path) ) {
-		return arr;
+/**
+	@brief A search path, split into its steps.
 
-	} else {
+	For a path beginning with "//", @em root is the key to look for at any depth, and
+	@em rest is the path below it, if any.  Otherwise @em steps are the keys to follow
+	from the top, in order.
+*/
+struct jsonPathStruct {
+	char* root;              /**< For a "//" path: the key to look for anywhere. */
+	jsonPath* rest;          /**< For a "//" path: the path below @em root, or NULL. */
+	unsigned int count;      /**< For any other path: how many keys to follow. */
+	char** steps;            /**< For any other path: the keys to follow. */
+};
 
-		/* container for fully matching objects */
-		jsonObject* newarr = jsonNewObjectType(JSON_ARRAY);
-		int i;
-
-		/* gather all of the sub-objects that match the full path */
-		for( i = 0; i < arr->size; i++ ) {
-			const jsonObject* a = jsonObjectGetIndex(arr, i);
-			jsonObject* thing = jsonObjectFindPath(a , path + strlen(root) + 1); 
-
-			if(thing) { //jsonObjectPush(newarr, thing);
-				if(thing->type == JSON_ARRAY) {
-            		int i;
-					for( i = 0; i != thing->size; i++ )
-						jsonObjectPush(newarr, jsonObjectClone(jsonObjectGetIndex(thing,i)));
-					jsonObjectFree(thing);
-				} else {
-					jsonObjectPush(newarr, thing);
-				}
-			}
+/**
+	@brief Compile a search path for repeated use.
+	@param path The path, as for jsonObjectFindPath() but with any formatting done.
+	@return Pointer to the compiled path, or NULL if the path has no keys in it.
+
+	A path such as "/some/node/here" names a key at each level, starting at the top.  Empty
+	steps are ignored.  A path beginning with "//", such as "//node/here", looks for the
+	first key at any depth, and from each place it is found, for the rest of the path.
+
+	The calling code is responsible for freeing the compiled path by calling jsonPathFree().
+*/
+jsonPath* jsonPathCompile( const char* path ) {
+	if( !path )
+		return NULL;
+
+	jsonPath* compiled = safe_malloc( sizeof( jsonPath ) );
+
+	if( path[ 0 ] == '/' && path[ 1 ] == '/' && path[ 2 ] != '\0' ) {
+		const char* root = path + 2;
+		while( '/' == *root )
+			++root;
+		size_t len = strcspn( root, "/" );
+		if( 0 == len ) {
+			free( compiled );
+			return NULL;
+		}
+		compiled->root = strndup( root, len );
+
+		// Unless there's nothing below the root but a slash, compile what's below it
+		const char* rest = root + len;
+		if( rest[ 0 ] && rest[ 1 ] )
+			compiled->rest = jsonPathCompile( rest );
+		return compiled;
+	}
+
+	// Split the path at the slashes, into a single allocation holding both the
+	// pointers and the keys they point to
+	size_t len = strlen( path );
+	unsigned int count = 0;
+	const char* p;
+	for( p = path; *p; ) {
+		while( '/' == *p )
+			++p;
+		if( *p ) {
+			++count;
+			p += strcspn( p, "/" );
 		}
+	}
+	if( 0 == count ) {
+		free( compiled );
+		return NULL;
+	}
 
-		jsonObjectFree(arr);
-		return newarr;
+	compiled->steps = safe_malloc( count * sizeof( char* ) + len + 1 );
+	char* keys = (char*) ( compiled->steps + count );
+	memcpy( keys, path, len + 1 );
+	unsigned int i = 0;
+	char* k;
+	for( k = keys; *k; ) {
+		while( '/' == *k )
+			*k++ = '\0';
+		if( *k ) {
+			compiled->steps[ i++ ] = k;
+			k += strcspn( k, "/" );
+		}
 	}
+	compiled->count = count;
+	return compiled;
 }
 
-/* returns a list of object whose key is 'root'.  These are used as
-	potential objects when doing a // search */
-static jsonObject* findMultiPathRecurse(const jsonObject* obj, const char* root) {
+/**
+	@brief Free a compiled search path.
+	@param path Pointer to the path, from jsonPathCompile().
+*/
+void jsonPathFree( jsonPath* path ) {
+	if( !path )
+		return;
+	free( path->root );
+	jsonPathFree( path->rest );
+	free( path->steps );
+	free( path );
+}
 
-	jsonObject* arr = jsonNewObjectType(JSON_ARRAY);
-	if(!obj) return arr;
+/**
+	@brief Tell whether a compiled path can match in more than one place.
+	@param path Pointer to the compiled path.
+	@return 1 if the path began with "//", or 0 if not.
 
-	int i;
+	For jsonObjectFindPath(), such a path yields an array of everything it matches.
+*/
+int jsonPathIsMulti( const jsonPath* path ) {
+	return path && path->root ? 1 : 0;
+}
 
-	/* if the current object has a node that matches, add it */
+/**
+	@brief Follow a path that starts at the top.
+	@param path Pointer to the compiled path, which doesn't begin with "//".
+	@param obj Pointer to the jsonObject to search.
+	@return Pointer to what the path leads to, or NULL if it leads nowhere.
+*/
+static const jsonObject* follow_steps( const jsonPath* path, const jsonObject* obj ) {
+	unsigned int i;
+	for( i = 0; i < path->count && obj; ++i )
+		obj = jsonObjectGetKeyConst( obj, path->steps[ i ] );
+	return obj;
+}
+
+/**
+	@brief Find, at any depth, everything below a given key, and add it to a list.
+	@param obj Pointer to the jsonObject to search.
+	@param root The key.
+	@param found Pointer to the osrfList to add to.
+
+	A key in a hash comes before anything at the same key further down, and the
+	children of a container come in order.
+*/
+static void find_root( const jsonObject* obj, const char* root, osrfList* found ) {
+	if( !obj )
+		return;
+
+	if( JSON_HASH == obj->type ) {
+		const jsonObject* o = jsonObjectGetKeyConst( obj, root );
+		if( o )
+			osrfListPush( found, (void*) o );
+
+		// Like a jsonIterator, stop at the first NULL item
+		osrfHashCursor cursor = NULL;
+		const jsonObject* child;
+		while( (child = osrfHashCursorNext( obj->value.h, &cursor, NULL )) )
+			find_root( child, root, found );
+
+	} else if( JSON_ARRAY == obj->type ) {
+		unsigned long i;
+		for( i = 0; i < obj->size; ++i )
+			find_root( jsonObjectGetIndex( obj, i ), root, found );
+	}
+}
 
-	const jsonObject* o = jsonObjectGetKeyConst(obj, root);
-	if(o) jsonObjectPush( arr, jsonObjectClone(o) );
+/**
+	@brief Evaluate a compiled path, yielding the first thing it leads to.
+	@param path Pointer to the compiled path.
+	@param obj Pointer to the jsonObject to search.
+	@return Pointer to what the path leads to, or NULL if it leads nowhere.
 
-	jsonObject* tmp = NULL;
-	jsonObject* childarr;
-	jsonIterator* itr = jsonNewIterator(obj);
+	For a path beginning with "//", return the first of the things that jsonPathFindAll()
+	would find.
 
-	/* recurse through the children and find all potential nodes */
-	while( (tmp = jsonIteratorNext(itr)) ) {
-		childarr = findMultiPathRecurse(tmp, root);
-		if(childarr && childarr->size > 0) {
-			for( i = 0; i!= childarr->size; i++ ) {
-				jsonObjectPush( arr, jsonObjectClone(jsonObjectGetIndex(childarr, i)) );
-			}
+	The result points into @a obj; it isn't a copy, and mustn't be freed.
+*/
+const jsonObject* jsonPathFind( const jsonPath* path, const jsonObject* obj ) {
+	if( !path || !obj )
+		return NULL;
+	if( !path->root )
+		return follow_steps( path, obj );
+
+	osrfList* found = osrfNewListSize( 4 );
+	jsonPathFindAll( path, obj, found );
+	const jsonObject* first = found->size ? OSRF_LIST_GET_INDEX( found, 0 ) : NULL;
+	osrfListFree( found );
+	return first;
+}
+
+/**
+	@brief Evaluate a compiled path, yielding everything it leads to.
+	@param path Pointer to the compiled path.
+	@param obj Pointer to the jsonObject to search.
+	@param results Pointer to an osrfList, to which we add a pointer to each thing found.
+	@param keep_misses Boolean: true to add a NULL wherever the rest of a "//" path leads
+		nowhere, as jsonObjectFindPath() has always added a JSON null.
+*/
+static void find_all( const jsonPath* path, const jsonObject* obj, osrfList* results,
+		int keep_misses ) {
+	if( !path->root ) {
+		const jsonObject* o = follow_steps( path, obj );
+		if( o )
+			osrfListPush( results, (void*) o );
+		return;
+	}
+
+	if( !path->rest ) {
+		find_root( obj, path->root, results );
+		return;
+	}
+
+	osrfList* candidates = osrfNewListSize( 8 );
+	find_root( obj, path->root, candidates );
+	unsigned int i;
+	for( i = 0; i < candidates->size; ++i ) {
+		const jsonObject* candidate = OSRF_LIST_GET_INDEX( candidates, i );
+		if( path->rest->root )
+			find_all( path->rest, candidate, results, keep_misses );
+		else {
+			const jsonObject* o = follow_steps( path->rest, candidate );
+			if( o && JSON_ARRAY == o->type ) {
+				unsigned long j;
+				for( j = 0; j < o->size; ++j )
+					osrfListPush( results, jsonObjectGetIndex( o, j ));
+			} else if( o || keep_misses )
+				osrfListPush( results, (void*) o );
 		}
-		jsonObjectFree(childarr);
 	}
+	osrfListFree( candidates );
+}
 
-	jsonIteratorFree(itr);
+/**
+	@brief Evaluate a compiled path, yielding everything it leads to.
+	@param path Pointer to the compiled path.
+	@param obj Pointer to the jsonObject to search.
+	@param results Pointer to an osrfList, to which we add a pointer to each thing found.
+	@return How many things were found.
+
+	For a path that doesn't begin with "//", there is at most one thing to find.  For one
+	that does, we look for what lies below the rest of the path from each place the first
+	key turns up; where that's an array, each of its elements counts as found.
+
+	The results point into @a obj; they aren't copies, and mustn't be freed.  So the list
+	shouldn't have a freeItem callback.
+*/
+unsigned long jsonPathFindAll( const jsonPath* path, const jsonObject* obj,
+		osrfList* results ) {
+	if( !path || !obj || !results )
+		return 0;
+	unsigned long before = results->size;
+	find_all( path, obj, results, 0 );
+	return results->size - before;
+}
+
+/**
+	@brief Evaluate a compiled path the way jsonObjectFindPath() does.
+	@param path Pointer to the compiled path.
+	@param obj Pointer to the jsonObject to search.
+	@return A copy of what the path leads to, or a JSON null if it leads nowhere.  For a
+		path beginning with "//", a JSON_ARRAY of copies of everything jsonPathFindAll()
+		finds, with a JSON null wherever the rest of the path led nowhere.
 
+	Only the results are copied, not anything searched along the way.
+
+	The calling code is responsible for freeing the result by calling jsonObjectFree().
+*/
+jsonObject* jsonPathEval( const jsonPath* path, const jsonObject* obj ) {
+	if( !path || !obj )
+		return NULL;
+	if( !path->root )
+		return jsonObjectClone( follow_steps( path, obj ));
+
+	osrfList* found = osrfNewListSize( 8 );
+	find_all( path, obj, found, 1 );
+	jsonObject* arr = jsonNewObjectType( JSON_ARRAY );
+	unsigned int i;
+	for( i = 0; i < found->size; ++i )
+		jsonObjectPush( arr, jsonObjectClone( OSRF_LIST_GET_INDEX( found, i )));
+	osrfListFree( found );
 	return arr;
 }
+
+jsonObject* jsonObjectFindPath( const jsonObject* obj, const char* format, ...) {
+	if(!obj || !format || strlen(format) < 1) return NULL;	
+
+	VA_LIST_TO_STRING(format);
+	jsonPath* path = jsonPathCompile( VA_BUF );
+	jsonObject* result = jsonPathEval( path, obj );
+	jsonPathFree( path );
+	return result;
+}
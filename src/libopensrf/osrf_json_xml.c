@@ -2,15 +2,19 @@
 
 #ifdef OSRF_JSON_ENABLE_XML_UTILS
 
-struct osrfXMLGatewayParserStruct {
+/** @brief How much XML to collect before handing it to a sink. */
+#define XML_CHUNK_SIZE 8192
+
+struct jsonXMLParserStruct {
     osrfList* objStack;
     osrfList* keyStack;
     jsonObject* obj;
+    growing_buffer* text;   /* character data of the current string or number */
+    xmlParserCtxtPtr ctxt;
     short inString;
     short inNumber;
     short error;
 };
-typedef struct osrfXMLGatewayParserStruct osrfXMLGatewayParser;
 
 /** returns the attribute value with the given attribute name */
 static char* getXMLAttr(const xmlChar** atts, const char* attr_name) {
@@ -27,13 +31,15 @@ static char* getXMLAttr(const xmlChar** atts, const char* attr_name) {
 }
 
 
-static void appendChild(osrfXMLGatewayParser* p, jsonObject* obj) {
-
-    if(p->obj == NULL) 
-        p->obj = obj;
+static void appendChild(jsonXMLParser* p, jsonObject* obj) {
 
-    if(p->objStack->size == 0)
+    if(p->objStack->size == 0) {
+        if(p->obj == NULL)
+            p->obj = obj;
+        else
+            jsonObjectFree(obj); /* a second top-level node; can't happen in valid XML */
         return;
+    }
     
     jsonObject* parent = OSRF_LIST_GET_INDEX(p->objStack, p->objStack->size - 1);
 
@@ -41,8 +47,11 @@ static void appendChild(osrfXMLGatewayParser* p, jsonObject* obj) {
         jsonObjectPush(parent, obj);
     } else {
         char* key = osrfListPop(p->keyStack);
-        jsonObjectSetKey(parent, key, obj);
-        free(key); /* the list is not setup for auto-freeing */
+        if(key)
+            jsonObjectSetKey(parent, key, obj);
+        else
+            jsonObjectFree(obj); /* no <element> to hold it */
+        free(key);
     }
 }
 
@@ -51,7 +60,8 @@ static void appendChild(osrfXMLGatewayParser* p, jsonObject* obj) {
 static void startElementHandler(
     void *parser, const xmlChar *name, const xmlChar **atts) {
 
-    osrfXMLGatewayParser* p = (osrfXMLGatewayParser*) parser;
+    jsonXMLParser* p = (jsonXMLParser*) parser;
+    if(p->error) return;
     jsonObject* obj;
 
     char* hint = getXMLAttr(atts, "class_hint");
@@ -63,11 +73,13 @@ static void startElementHandler(
 
     if(!strcmp((char*) name, "string")) {
         p->inString = 1;
+        buffer_reset(p->text);
         return;
     }
 
     if(!strcmp((char*) name, "element")) {
-       osrfListPush(p->keyStack, strdup(getXMLAttr(atts, "key")));
+       const char* key = getXMLAttr(atts, "key");
+       osrfListPush(p->keyStack, strdup(key ? key : ""));
        return;
     }
 
@@ -92,6 +104,7 @@ static void startElementHandler(
 
     if(!strcmp((char*) name, "number")) {
         p->inNumber = 1;
+        buffer_reset(p->text);
         return;
     }
 
@@ -108,32 +121,29 @@ static void startElementHandler(
 }
 
 static void endElementHandler( void *parser, const xmlChar *name) {
+    jsonXMLParser* p = (jsonXMLParser*) parser;
+    if(p->error) return;
+
     if(!strcmp((char*) name, "array") || !strcmp((char*) name, "object")) {
-        osrfXMLGatewayParser* p = (osrfXMLGatewayParser*) parser;
         osrfListPop(p->objStack);
-    }
-}
 
-static void characterHandler(void *parser, const xmlChar *ch, int len) {
-
-    char data[len+1];
-    strncpy(data, (char*) ch, len);
-    data[len] = '\0';
-    osrfXMLGatewayParser* p = (osrfXMLGatewayParser*) parser;
-
-    if(p->inString) {
-        appendChild(p, jsonNewObject(data));
+    } else if(p->inString && !strcmp((char*) name, "string")) {
+        /* the text may have come in pieces, or not at all */
+        appendChild(p, jsonNewObject(OSRF_BUFFER_C_STR(p->text)));
         p->inString = 0;
-        return;
-    }
 
-    if(p->inNumber) {
-        appendChild(p, jsonNewNumberObject(atof(data)));
+    } else if(p->inNumber && !strcmp((char*) name, "number")) {
+        appendChild(p, jsonNewNumberObject(atof(OSRF_BUFFER_C_STR(p->text))));
         p->inNumber = 0;
-        return;
     }
 }
 
+static void characterHandler(void *parser, const xmlChar *ch, int len) {
+    jsonXMLParser* p = (jsonXMLParser*) parser;
+    if(!p->error && (p->inString || p->inNumber))
+        buffer_add_n(p->text, (const char*) ch, len);
+}
+
 static void parseWarningHandler(void *parser, const char* msg, ...) {
     VA_LIST_TO_STRING(msg);
     fprintf(stderr, "Parser warning %s\n", VA_BUF);
@@ -146,16 +156,8 @@ static void parseErrorHandler(void *parser, const char* msg, ...) {
     fprintf(stderr, "Parser error %s\n", VA_BUF);
     fflush(stderr);
 
-    osrfXMLGatewayParser* p = (osrfXMLGatewayParser*) parser;
-
-    /*  keyStack as strdup'ed strings.  The list may
-     *  not be empty, so tell it to free the items
-     *  when it's freed (from the main routine)
-     */
-    osrfListSetDefaultFree(p->keyStack);
-    jsonObjectFree(p->obj);
-
-    p->obj = NULL;
+    /* From here on we ignore the input; what we have so far is freed with the parser */
+    jsonXMLParser* p = (jsonXMLParser*) parser;
     p->error = 1;
 }
 
@@ -199,38 +201,97 @@ static xmlSAXHandler SAXHandlerStruct = {
 
 static const xmlSAXHandlerPtr SAXHandler = &SAXHandlerStruct;
 
-jsonObject* jsonXMLToJSONObject(const char* xml) {
+/**
+	@brief Create a parser to build a jsonObject from XML that arrives in pieces.
+	@return Pointer to a newly created jsonXMLParser.
 
-    osrfXMLGatewayParser parser;
+	Feed it with jsonXMLParserPush(), get the result from jsonXMLParserFinish(), and free
+	it with jsonXMLParserFree().  The XML is the kind that jsonObjectToXML() writes.
+*/
+jsonXMLParser* jsonNewXMLParser( void ) {
+    jsonXMLParser* p = safe_malloc(sizeof(jsonXMLParser));
 
     /* don't define freeItem, since objects will be cleaned by freeing the parent */
-    parser.objStack = osrfNewList(); 
-    /* don't define freeItem, since the list eill end up empty if there are no errors*/
-    parser.keyStack = osrfNewList(); 
-    parser.obj = NULL;
-    parser.inString = 0;
-    parser.inNumber = 0;
-
-    xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(SAXHandler, &parser, "", 0, NULL);
-    xmlParseChunk(ctxt, xml, strlen(xml), 1);
-
-    osrfListFree(parser.objStack);
-    osrfListFree(parser.keyStack);
-    xmlFreeParserCtxt(ctxt);
-    xmlCleanupCharEncodingHandlers();
-    xmlDictCleanup();
-    xmlCleanupParser();
-
-    return parser.obj;
+    p->objStack = osrfNewList();
+    /* don't define freeItem yet, since popping a key mustn't free it */
+    p->keyStack = osrfNewList();
+    p->text = buffer_init(64);
+    p->ctxt = xmlCreatePushParserCtxt(SAXHandler, p, NULL, 0, NULL);
+    return p;
+}
+
+/**
+	@brief Feed the next piece of XML to a jsonXMLParser.
+	@param p Pointer to the jsonXMLParser.
+	@param data Pointer to the XML, which needn't end on any particular boundary.
+	@param len How many bytes of XML there are.
+	@return Zero if all is well so far, or -1 if the XML is invalid.
+*/
+int jsonXMLParserPush( jsonXMLParser* p, const char* data, size_t len ) {
+    if(!p || p->error || !p->ctxt)
+        return -1;
+    if(len && xmlParseChunk(p->ctxt, data, (int) len, 0))
+        p->error = 1;
+    return p->error ? -1 : 0;
+}
+
+/**
+	@brief Tell a jsonXMLParser that the XML is complete, and take the result.
+	@param p Pointer to the jsonXMLParser.
+	@return Pointer to the jsonObject built from the XML, or NULL if the XML was invalid.
+
+	The calling code is responsible for freeing the jsonObject.  After this the parser is
+	good only for freeing.
+*/
+jsonObject* jsonXMLParserFinish( jsonXMLParser* p ) {
+    if(!p || !p->ctxt)
+        return NULL;
+    if(!p->error && xmlParseChunk(p->ctxt, NULL, 0, 1))
+        p->error = 1;
+    xmlFreeParserCtxt(p->ctxt);
+    p->ctxt = NULL;
+
+    if(p->error)
+        return NULL;
+    jsonObject* obj = p->obj;
+    p->obj = NULL;
+    return obj;
+}
+
+/**
+	@brief Free a jsonXMLParser, and anything it was building.
+	@param p Pointer to the jsonXMLParser.
+*/
+void jsonXMLParserFree( jsonXMLParser* p ) {
+    if(!p)
+        return;
+    if(p->ctxt)
+        xmlFreeParserCtxt(p->ctxt);
+    jsonObjectFree(p->obj);
+    osrfListFree(p->objStack);
+    osrfListSetDefaultFree(p->keyStack); /* any keys left are ours to free */
+    osrfListFree(p->keyStack);
+    buffer_free(p->text);
+    free(p);
 }
 
+jsonObject* jsonXMLToJSONObject(const char* xml) {
+    if(!xml)
+        return NULL;
+
+    jsonXMLParser* p = jsonNewXMLParser();
+    jsonXMLParserPush(p, xml, strlen(xml));
+    jsonObject* obj = jsonXMLParserFinish(p);
+    jsonXMLParserFree(p);
+    return obj;
+}
 
 
 
 
 
-static char* _escape_xml (const char*);
-static int _recurse_jsonObjectToXML(const jsonObject*, growing_buffer*);
+static int _recurse_jsonObjectToXML(const jsonObject*, growing_buffer*, jsonXMLSink, void*);
+static void _escape_xml(growing_buffer*, const char*);
 
 char* jsonObjectToXML(const jsonObject* obj) {
 
@@ -239,17 +300,53 @@ char* jsonObjectToXML(const jsonObject* obj) {
 	
 	growing_buffer * res_xml = buffer_init(1024);
 
-	_recurse_jsonObjectToXML( obj, res_xml );
+	_recurse_jsonObjectToXML( obj, res_xml, NULL, NULL );
 	return buffer_release(res_xml);
 
 }
 
-int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml) {
+/**
+	@brief Write the XML for a jsonObject to a sink, a piece at a time.
+	@param obj Pointer to the jsonObject.
+	@param sink Callback to receive the XML.
+	@param blob Opaque pointer to pass to the sink.
+	@return Zero if successful, or -1 if the sink failed.
+
+	The XML is the same as jsonObjectToXML() returns, but instead of building all of it
+	first, we hand it to the sink every few kilobytes, so that the first of it can be on
+	its way before we're done.  If the sink returns non-zero we stop.
+*/
+int jsonObjectToXMLStream(const jsonObject* obj, jsonXMLSink sink, void* blob) {
+	if (!sink)
+		return -1;
+	if (!obj)
+		return sink(blob, "<null/>", 7) ? -1 : 0;
+
+	growing_buffer * res_xml = buffer_init(XML_CHUNK_SIZE + 1024);
+	int rc = _recurse_jsonObjectToXML( obj, res_xml, sink, blob ) ? 0 : -1;
+	if (!rc && res_xml->n_used && sink(blob, res_xml->buf, res_xml->n_used))
+		rc = -1;
+	buffer_free(res_xml);
+	return rc;
+}
 
-	char * hint = NULL;
-	
-	if (obj->classname)
-		hint = strdup(obj->classname);
+/**
+	@brief Hand the XML collected so far to the sink, if there's enough of it.
+	@return 1 if all is well, or 0 if the sink failed.
+*/
+static int _flush_xml(growing_buffer* res_xml, jsonXMLSink sink, void* blob) {
+	if (!sink || res_xml->n_used < XML_CHUNK_SIZE)
+		return 1;
+	if (sink(blob, res_xml->buf, res_xml->n_used))
+		return 0;
+	buffer_reset(res_xml);
+	return 1;
+}
+
+static int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml,
+		jsonXMLSink sink, void* blob) {
+
+	const char * hint = obj->classname;
 
 	if(obj->type == JSON_NULL) {
 
@@ -272,27 +369,28 @@ int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml) {
 			buffer_fadd(res_xml, "<boolean value=\"%s\"/>", bool_val);
 
 	} else if (obj->type == JSON_STRING) {
-		if (hint) {
-			char * t = _escape_xml(jsonObjectGetString(obj));
-			buffer_fadd(res_xml,"<string class_hint=\"%s\">%s</string>", hint, t);
-			free(t);
-		} else {
-			char * t = _escape_xml(jsonObjectGetString(obj));
-			buffer_fadd(res_xml,"<string>%s</string>", t);
-			free(t);
-		}
+		if (hint)
+			buffer_fadd(res_xml,"<string class_hint=\"%s\">", hint);
+		else
+			buffer_add(res_xml,"<string>");
+		_escape_xml(res_xml, jsonObjectGetString(obj));
+		buffer_add(res_xml,"</string>");
 
 	} else if(obj->type == JSON_NUMBER) {
 		double x = jsonObjectGetNumber(obj);
 		if (hint) {
-			if (x == (int)x)
-				buffer_fadd(res_xml,"<number class_hint=\"%s\">%d</number>", hint, (int)x);
-			else
+			if (x == (int)x) {
+				buffer_fadd(res_xml,"<number class_hint=\"%s\">", hint);
+				buffer_add_int64(res_xml, (int)x);
+				buffer_add(res_xml,"</number>");
+			} else
 				buffer_fadd(res_xml,"<number class_hint=\"%s\">%lf</number>", hint, x);
 		} else {
-			if (x == (int)x)
-				buffer_fadd(res_xml,"<number>%d</number>", (int)x);
-			else
+			if (x == (int)x) {
+				buffer_add(res_xml,"<number>");
+				buffer_add_int64(res_xml, (int)x);
+				buffer_add(res_xml,"</number>");
+			} else
 				buffer_fadd(res_xml,"<number>%lf</number>", x);
 		}
 
@@ -304,8 +402,10 @@ int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml) {
                		buffer_add(res_xml,"<array>");
 
         int i;
-        for ( i = 0; i!= obj->size; i++ )
-		    _recurse_jsonObjectToXML(jsonObjectGetIndex(obj,i), res_xml);
+        for ( i = 0; i!= obj->size; i++ ) {
+		    if (!_recurse_jsonObjectToXML(jsonObjectGetIndex(obj,i), res_xml, sink, blob))
+		        return 0;
+		}
 
 		buffer_add(res_xml,"</array>");
 
@@ -320,7 +420,10 @@ int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml) {
 		const jsonObject* tmp;
 		while( (tmp = jsonIteratorNext(itr)) ) {
 			buffer_fadd(res_xml,"<element key=\"%s\">",itr->key);
-			_recurse_jsonObjectToXML(tmp, res_xml);
+			if (!_recurse_jsonObjectToXML(tmp, res_xml, sink, blob)) {
+				jsonIteratorFree(itr);
+				return 0;
+			}
 			buffer_add(res_xml,"</element>");
 		}
 		jsonIteratorFree(itr);
@@ -328,27 +431,26 @@ int _recurse_jsonObjectToXML(const jsonObject* obj, growing_buffer* res_xml) {
 		buffer_add(res_xml,"</object>");
 	}
 
-	if (hint)
-		free(hint);
-
-	return 1;
+	return _flush_xml(res_xml, sink, blob);
 }
 
-static char* _escape_xml (const char* text) {
-	growing_buffer* b = buffer_init(256);
-	int len = strlen(text);
-	int i;
-	for (i = 0; i < len; i++) {
-		if (text[i] == '&')
-			buffer_add(b,"&amp;");
-		else if (text[i] == '<')
-			buffer_add(b,"&lt;");
-		else if (text[i] == '>')
-			buffer_add(b,"&gt;");
+static void _escape_xml (growing_buffer* b, const char* text) {
+	const char* run = text;
+	for (; *text; text++) {
+		const char* entity;
+		if (*text == '&')
+			entity = "&amp;";
+		else if (*text == '<')
+			entity = "&lt;";
+		else if (*text == '>')
+			entity = "&gt;";
 		else
-			buffer_add_char(b,text[i]);
+			continue;
+		buffer_add_n(b, run, text - run);
+		buffer_add(b, entity);
+		run = text + 1;
 	}
-	return buffer_release(b);
+	buffer_add_n(b, run, text - run);
 }
 
 #endif
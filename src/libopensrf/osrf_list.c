@@ -30,22 +30,95 @@ osrfList* osrfNewList() {
 osrfList* osrfNewListSize( unsigned int size ) {
 	osrfList* list;
 	OSRF_MALLOC(list, sizeof(osrfList));
+	osrfListInit( list, size );
+	return list;
+}
+
+/**
+	@brief Initialize an osrfList that is part of some larger structure.
+	@param list Pointer to the osrfList to be initialized.
+	@param size How many pointers to store initially.
+
+	If @a size is no more than OSRF_LIST_INLINE_SIZE, the list uses its inline slots and
+	allocates nothing; otherwise it allocates an array of @a size pointers, or of 16 if
+	@a size is zero.  Either way, osrfListFree() frees the osrfList itself, so an osrfList
+	embedded in another structure must be its first member.
+*/
+void osrfListInit( osrfList* list, unsigned int size ) {
+	if(!list) return;
 	list->size = 0;
 	list->freeItem = NULL;
+	list->arena = NULL;
 	if( size <= 0 ) size = 16;
-	list->arrsize = size;
-	OSRF_MALLOC( list->arrlist, list->arrsize * sizeof(void*) );
+	if( size <= OSRF_LIST_INLINE_SIZE ) {
+		list->arrsize = OSRF_LIST_INLINE_SIZE;
+		list->arrlist = list->inline_slots;
+	} else {
+		list->arrsize = size;
+		OSRF_MALLOC( list->arrlist, list->arrsize * sizeof(void*) );
+	}
 
 	// Nullify all pointers in the array
 
 	int i;
 	for( i = 0; i < list->arrsize; ++i )
 		list->arrlist[ i ] = NULL;
+}
+
+/**
+	@brief Create a new osrfList in an osrfArena.
+	@param arena Pointer to the osrfArena, or NULL for the heap.
+	@param size How many pointers to store initially.
+	@return A pointer to the new osrfList.
 
+	The list, and its array as it grows, are carved from the arena and go away with it.
+	osrfListFree() calls the item-freeing callback for every item as usual, but gives
+	back no memory.
+*/
+osrfList* osrfNewListArena( osrfArena* arena, unsigned int size ) {
+	if( !arena )
+		return osrfNewListSize( size );
+
+	osrfList* list = osrfArenaCalloc( arena, sizeof(osrfList) );
+	list->size = 0;
+	list->freeItem = NULL;
+	if( size <= 0 ) size = 16;
+	if( size <= OSRF_LIST_INLINE_SIZE ) {
+		list->arrsize = OSRF_LIST_INLINE_SIZE;
+		list->arrlist = list->inline_slots;
+	} else {
+		list->arrsize = size;
+		list->arrlist = osrfArenaCalloc( arena, list->arrsize * sizeof(void*) );
+	}
+	list->arena = arena;
 	return list;
 }
 
 
+/**
+	@brief Replace the array of an osrfList with a bigger one.
+	@param list A pointer to the osrfList.
+	@param newsize How many slots the new array should have.
+
+	Copy the old pointers, and nullify the new ones.  The old array goes back to the heap
+	unless it is the inline slots or belongs to an arena.
+*/
+static void grow_list( osrfList* list, unsigned int newsize ) {
+	void** newarr;
+	if( list->arena )
+		newarr = osrfArenaAlloc( list->arena, newsize * sizeof(void*) );
+	else
+		OSRF_MALLOC(newarr, newsize * sizeof(void*));
+
+	memcpy( newarr, list->arrlist, list->arrsize * sizeof(void*) );
+	memset( newarr + list->arrsize, 0, (newsize - list->arrsize) * sizeof(void*) );
+
+	if( !list->arena && list->arrlist != list->inline_slots )
+		free(list->arrlist);
+	list->arrlist = newarr;
+	list->arrsize = newsize;
+}
+
 /**
 	@brief Add a pointer to the end of the array.
 	@param list A pointer to the osrfList
@@ -62,6 +135,44 @@ int osrfListPush( osrfList* list, void* item ) {
 	return 0;
 }
 
+/**
+	@brief Add a series of pointers to the end of the array.
+	@param list A pointer to the osrfList.
+	@param items Pointer to an array of the pointers to be added.
+	@param count How many pointers to add.
+	@return Zero if successful, or -1 if the list parameter is NULL, or if the items
+		parameter is NULL with a non-zero count.
+
+	The same as calling osrfListPush() for each item in turn, except that the array grows
+	at most once.
+*/
+int osrfListPushMany( osrfList* list, void* const* items, unsigned int count ) {
+	if( !list || ( count && !items ) ) return -1;
+	if( !count ) return 0;
+
+	osrfListReserve( list, list->size + count );
+	memcpy( list->arrlist + list->size, items, count * sizeof(void*) );
+	list->size += count;
+	return 0;
+}
+
+/**
+	@brief Make sure that an osrfList has room for a given number of pointers.
+	@param list A pointer to the osrfList.
+	@param size How many slots the array should have, at least.
+	@return Zero if successful, or -1 if the list parameter is NULL.
+
+	If the array is smaller than @a size, replace it with one of exactly @a size slots, so
+	that the next @a size - osrfListGetCount() pushes don't need to allocate anything.
+	The contents of the osrfList are unchanged.
+*/
+int osrfListReserve( osrfList* list, unsigned int size ) {
+	if(!list) return -1;
+	if( size > list->arrsize )
+		grow_list( list, size );
+	return 0;
+}
+
 /**
 	@brief Store a pointer in the first unoccupied slot.
 	@param list A pointer to the osrfList.
@@ -105,25 +216,17 @@ int osrfListPushFirst( osrfList* list, void* item ) {
 void* osrfListSet( osrfList* list, void* item, unsigned int position ) {
 	if(!list) return NULL;
 
-	int newsize = list->arrsize;
+	if( position >= list->arrsize ) { /* expand the list if necessary */
+		unsigned int newsize = list->arrsize;
 
-	while( position >= newsize )
-		newsize += OSRF_LIST_INC_SIZE;
+		// Leaving the inline slots, start where a default list would; in an arena,
+		// the old array isn't reused, so double, so as to waste less of it
+		if( list->arrlist == list->inline_slots && !list->arena )
+			newsize = OSRF_LIST_DEFAULT_SIZE;
+		while( position >= newsize )
+			newsize = list->arena ? newsize * 2 : newsize + OSRF_LIST_INC_SIZE;
 
-	if( newsize > list->arrsize ) { /* expand the list if necessary */
-		void** newarr;
-		OSRF_MALLOC(newarr, newsize * sizeof(void*));
-
-		// Copy the old pointers, and nullify the new ones
-
-		int i;
-		for( i = 0; i < list->arrsize; i++ )
-			newarr[i] = list->arrlist[i];
-		for( ; i < newsize; i++ )
-			newarr[i] = NULL;
-		free(list->arrlist);
-		list->arrlist = newarr;
-		list->arrsize = newsize;
+		grow_list( list, newsize );
 	}
 
 	void* olditem = osrfListRemove( list, position );
@@ -153,7 +256,7 @@ void* osrfListGetIndex( const osrfList* list, unsigned int position ) {
 	@param list A pointer to the osrfList to be freed.
 
 	If the calling code has specified a function for freeing items, it is called for every
-	non-NULL pointer in the array.
+	non-NULL pointer in the array.  A list in an osrfArena leaves its memory to the arena.
 */
 void osrfListFree( osrfList* list ) {
 	if(!list) return;
@@ -166,8 +269,11 @@ void osrfListFree( osrfList* list ) {
 		}
 	}
 
-	free(list->arrlist);
-	free(list);
+	if( !list->arena ) {
+		if( list->arrlist != list->inline_slots )
+			free(list->arrlist);
+		free(list);
+	}
 }
 
 /**
@@ -176,6 +282,8 @@ void osrfListFree( osrfList* list ) {
 
 	Delete every item in the list.  If a callback function is defined for freeing the items,
 	call it for every item.
+
+	The list keeps its array, so that it can be filled again without allocating anything.
 */
 void osrfListClear( osrfList* list ) {
 	if(!list) return;
@@ -203,9 +311,16 @@ void osrfListClear( osrfList* list ) {
 */
 void osrfListSwap( osrfList* one, osrfList* two ) {
 	if( one && two ) {
+		// An array in the inline slots has to move with them
+		int one_inline = one->arrlist == one->inline_slots;
+		int two_inline = two->arrlist == two->inline_slots;
 		osrfList temp = *one;
 		*one = *two;
 		*two = temp;
+		if( two_inline )
+			one->arrlist = one->inline_slots;
+		if( one_inline )
+			two->arrlist = two->inline_slots;
 	}
 }
 
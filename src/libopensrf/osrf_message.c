@@ -10,13 +10,41 @@
 #include <libxml/xpathInternals.h>
 #include <libxml/tree.h>
 
+#include <ctype.h>
 #include <opensrf/osrf_message.h>
 #include "opensrf/osrf_stack.h"
+#include "opensrf/osrf_utf8.h"
+#include "opensrf/osrf_msgpack.h"
+
+static osrfMessage* deserialize_one_message( const jsonObject* message, int take );
+static const char* set_hint( osrfMessage* msg, const char** hint, int bit,
+		const char* value );
+static void add_hint( growing_buffer* buf, const char* hint );
+static void add_json_string( growing_buffer* buf, const char* str );
+static void add_prefix( growing_buffer* buf, const osrfMessage* msg,
+		const char* type, const char* cname );
+static void add_message_json( growing_buffer* buf, const osrfMessage* msg );
+static jsonObject* parse_envelope( const char* string, osrfList** params,
+		osrfList** content );
+static void attach_payload( osrfMessage* msg, unsigned int index, osrfList* params,
+		osrfList* content );
+static jsonObject* decode_raw( const char* raw );
+static jsonObject* parse_body( const char* string, int lazy, osrfList** params,
+		osrfList** content );
+static void materialize( osrfMessage* msg );
 
-static osrfMessage* deserialize_one_message( const jsonObject* message );
+/**
+	@name Hint ownership
+	@brief Bits of osrfMessage.own_hints, set for a hint too long or too novel to intern.
+*/
+/*@{*/
+#define OWN_LOCALE  1
+#define OWN_TZ      2
+#define OWN_INGRESS 4
+/*@}*/
 
 static char default_locale[17] = "en-US\0\0\0\0\0\0\0\0\0\0\0\0";
-static char* current_locale = NULL;
+static __thread char* current_locale = NULL;
 
 /**
 	@brief Allocate and initialize an osrfMessage.
@@ -40,10 +68,16 @@ osrfMessage* osrf_message_init( enum M_TYPE type, int thread_trace, int protocol
 	msg->is_exception           = 0;
 	msg->_params                = NULL;
 	msg->_result_content        = NULL;
+	msg->_raw_params            = NULL;
+	msg->_raw_content           = NULL;
 	msg->method_name            = NULL;
 	msg->sender_locale          = NULL;
 	msg->sender_tz              = NULL;
 	msg->sender_ingress         = NULL;
+	msg->own_hints              = 0;
+	msg->window                 = 0;
+	msg->encoding               = OSRF_ENCODING_JSON;
+	msg->deadline               = 0;
 
 	return msg;
 }
@@ -79,9 +113,7 @@ const char* osrf_message_get_last_locale() {
 const char* osrf_message_set_locale( osrfMessage* msg, const char* locale ) {
 	if( msg == NULL || locale == NULL )
 		return NULL;
-	if( msg->sender_locale )
-		free( msg->sender_locale );
-	return msg->sender_locale = strdup( locale );
+	return set_hint( msg, &msg->sender_locale, OWN_LOCALE, locale );
 }
 
 /**
@@ -98,9 +130,7 @@ const char* osrf_message_set_locale( osrfMessage* msg, const char* locale ) {
 const char* osrf_message_set_tz( osrfMessage* msg, const char* tz ) {
 	if( msg == NULL || tz == NULL )
 		return NULL;
-	if( msg->sender_tz )
-		free( msg->sender_tz );
-	return msg->sender_tz = strdup( tz );
+	return set_hint( msg, &msg->sender_tz, OWN_TZ, tz );
 }
 
 /**
@@ -117,9 +147,33 @@ const char* osrf_message_set_tz( osrfMessage* msg, const char* tz ) {
 const char* osrfMessageSetIngress( osrfMessage* msg, const char* ingress ) {
 	if( msg == NULL || ingress == NULL )
 		return NULL;
-	if( msg->sender_ingress )
-		free( msg->sender_ingress );
-	return msg->sender_ingress = strdup( ingress );
+	return set_hint( msg, &msg->sender_ingress, OWN_INGRESS, ingress );
+}
+
+/**
+	@brief Install a locale, TZ, or ingress hint in an osrfMessage.
+	@param msg Pointer to the osrfMessage.
+	@param hint Pointer to the member of the osrfMessage for the hint.
+	@param bit The bit of own_hints for the hint.
+	@param value The new value.
+	@return The new value as installed.
+
+	The same few values turn up in message after message, so share an interned copy if we
+	can, and make a private one only if we must.
+*/
+static const char* set_hint( osrfMessage* msg, const char** hint, int bit,
+		const char* value ) {
+	if( msg->own_hints & bit ) {
+		free( (char*) *hint );
+		msg->own_hints &= ~bit;
+	}
+
+	*hint = osrf_intern( value );
+	if( !*hint ) {
+		*hint = strdup( value );
+		msg->own_hints |= bit;
+	}
+	return *hint;
 }
 
 /**
@@ -176,6 +230,7 @@ void osrf_message_set_method( osrfMessage* msg, const char* method_name ) {
 */
 void osrf_message_add_object_param( osrfMessage* msg, const jsonObject* o ) {
 	if(!msg|| !o) return;
+	materialize( msg );
 	if(!msg->_params)
 		msg->_params = jsonNewObjectType( JSON_ARRAY );
 	jsonObjectPush(msg->_params, jsonObjectDecodeClass( o ));
@@ -203,6 +258,8 @@ void osrf_message_set_params( osrfMessage* msg, const jsonObject* o ) {
 
 	if(msg->_params)
 		jsonObjectFree(msg->_params);
+	free( msg->_raw_params );
+	msg->_raw_params = NULL;
 
 	if(o->type == JSON_ARRAY) {
 		msg->_params = jsonObjectClone(o);
@@ -235,6 +292,7 @@ void osrf_message_set_params( osrfMessage* msg, const jsonObject* o ) {
 */
 void osrf_message_add_param( osrfMessage* msg, const char* param_string ) {
 	if(msg == NULL || param_string == NULL) return;
+	materialize( msg );
 	if(!msg->_params) msg->_params = jsonNewObjectType( JSON_ARRAY );
 	jsonObjectPush(msg->_params, jsonParse(param_string));
 }
@@ -283,6 +341,8 @@ void osrf_message_set_result_content( osrfMessage* msg, const char* json_string
 	if( msg == NULL || json_string == NULL) return;
 	if( msg->_result_content )
 		jsonObjectFree( msg->_result_content );
+	free( msg->_raw_content );
+	msg->_raw_content = NULL;
 
 	msg->_result_content = jsonParse(json_string);
 }
@@ -299,6 +359,8 @@ void osrf_message_set_result( osrfMessage* msg, const jsonObject* obj ) {
 	if( msg == NULL || obj == NULL) return;
 	if( msg->_result_content )
 		jsonObjectFree( msg->_result_content );
+	free( msg->_raw_content );
+	msg->_raw_content = NULL;
 
 	msg->_result_content = jsonObjectDecodeClass( obj );
 }
@@ -324,21 +386,36 @@ void osrfMessageFree( osrfMessage* msg ) {
 	if( msg->method_name != NULL )
 		free(msg->method_name);
 
-	if( msg->sender_locale != NULL )
-		free(msg->sender_locale);
+	if( msg->own_hints & OWN_LOCALE )
+		free( (char*) msg->sender_locale );
 
-	if( msg->sender_tz != NULL )
-		free(msg->sender_tz);
+	if( msg->own_hints & OWN_TZ )
+		free( (char*) msg->sender_tz );
 
-	if( msg->sender_ingress != NULL )
-		free(msg->sender_ingress);
+	if( msg->own_hints & OWN_INGRESS )
+		free( (char*) msg->sender_ingress );
 
 	if( msg->_params != NULL )
 		jsonObjectFree(msg->_params);
 
+	free( msg->_raw_params );
+	free( msg->_raw_content );
 	free(msg);
 }
 
+/**
+	@brief Report how long the sender of a message will still wait for an answer.
+	@param msg Pointer to the osrfMessage.
+	@return The milliseconds left before its deadline, zero if the deadline has passed,
+		or -1 if it has no deadline.
+*/
+long long osrfMessageTimeLeft( const osrfMessage* msg ) {
+	if( !msg || msg->deadline <= 0 )
+		return -1;
+	long long left = msg->deadline - get_monotonic_millis();
+	return left > 0 ? left : 0;
+}
+
 
 /**
 	@brief Turn a collection of osrfMessages into one big JSON string.
@@ -346,27 +423,62 @@ void osrfMessageFree( osrfMessage* msg ) {
 	@param count Maximum number of messages to serialize.
 	@return Pointer to the JSON string.
 
-	Traverse the array, adding each osrfMessage in turn to a JSON_ARRAY.  Stop when you have added
-	the maximum number of messages, or when you encounter a NULL pointer in the array.  Then
-	translate the JSON_ARRAY into a JSON string.
+	Traverse the array, translating each osrfMessage in turn into an element of a JSON
+	array.  Stop when you have translated the maximum number of messages, or when you
+	encounter a NULL pointer in the array.
+
+	A message deserialized lazily, and whose payload nobody has looked at, passes its
+	payload through as the JSON text it arrived with.
 
 	The calling code is responsible for freeing the returned string.
 */
 char* osrfMessageSerializeBatch( osrfMessage* msgs [], int count ) {
 	if( !msgs ) return NULL;
 
-	jsonObject* wrapper = jsonNewObjectType(JSON_ARRAY);
+	growing_buffer* buf = buffer_init( 256 );
+	OSRF_BUFFER_ADD_CHAR( buf, '[' );
 
 	int i = 0;
 	while( (i < count) && msgs[i] ) {
-		jsonObjectPush(wrapper, osrfMessageToJSON( msgs[i] ));
+		if( i > 0 )
+			OSRF_BUFFER_ADD_CHAR( buf, ',' );
+		add_message_json( buf, msgs[i] );
 		++i;
 	}
 
-	char* j = jsonObjectToJSON(wrapper);
-	jsonObjectFree(wrapper);
+	OSRF_BUFFER_ADD_CHAR( buf, ']' );
+	return buffer_release( buf );
+}
+
+/**
+	@brief Turn a collection of osrfMessages into the body of a transport message, in a
+		given encoding.
+	@param msgs Pointer to an array of osrfMessages.
+	@param count Maximum number of messages to serialize.
+	@param encoding OSRF_ENCODING_JSON or OSRF_ENCODING_MSGPACK.
+	@return Pointer to the body.
+
+	For OSRF_ENCODING_JSON, the same as osrfMessageSerializeBatch().  For
+	OSRF_ENCODING_MSGPACK, the same array of messages in the text form of MessagePack,
+	which osrfMessageDeserialize() and its kin recognize and read as well as JSON.
+
+	The calling code is responsible for freeing the returned string.
+*/
+char* osrfMessageSerializeBatchEncoded( osrfMessage* msgs [], int count, int encoding ) {
+	if( encoding != OSRF_ENCODING_MSGPACK )
+		return osrfMessageSerializeBatch( msgs, count );
+	if( !msgs ) return NULL;
+
+	jsonObject* array = jsonNewObjectType( JSON_ARRAY );
+	int i = 0;
+	while( (i < count) && msgs[i] ) {
+		jsonObjectPush( array, osrfMessageToJSON( msgs[i] ));
+		++i;
+	}
 
-	return j;
+	char* body = jsonObjectToMsgpackText( array );
+	jsonObjectFree( array );
+	return body;
 }
 
 
@@ -384,18 +496,41 @@ char* osrfMessageSerializeBatch( osrfMessage* msgs [], int count ) {
 char* osrf_message_serialize(const osrfMessage* msg) {
 
 	if( msg == NULL ) return NULL;
-	char* j = NULL;
 
-	jsonObject* json = osrfMessageToJSON( msg );
+	growing_buffer* buf = buffer_init( 256 );
+	OSRF_BUFFER_ADD_CHAR( buf, '[' );
+	add_message_json( buf, msg );
+	OSRF_BUFFER_ADD_CHAR( buf, ']' );
+	return buffer_release( buf );
+}
 
-	if(json) {
-		jsonObject* wrapper = jsonNewObjectType(JSON_ARRAY);
-		jsonObjectPush(wrapper, json);
-		j = jsonObjectToJSON(wrapper);
-		jsonObjectFree(wrapper);
-	}
+/**
+	@brief Append the JSON for one osrfMessage to a buffer.
+	@param buf Pointer to the growing_buffer.
+	@param msg Pointer to the osrfMessage.
 
-	return j;
+	If the payload is still the raw JSON text from lazy deserialization, copy it as it
+	stands; otherwise go by way of osrfMessageToJSON().
+*/
+static void add_message_json( growing_buffer* buf, const osrfMessage* msg ) {
+	if( RESULT == msg->m_type && msg->_raw_content && !msg->_result_content ) {
+		osrfMessageAddResultPrefix( buf, msg );
+		buffer_add( buf, msg->_raw_content );
+		OSRF_BUFFER_ADD( buf, OSRF_RESULT_JSON_SUFFIX );
+	} else if( REQUEST == msg->m_type && msg->_raw_params && !msg->_params ) {
+		add_prefix( buf, msg, "REQUEST", "osrfMethod" );
+		OSRF_BUFFER_ADD( buf, "\"method\":" );
+		add_json_string( buf, msg->method_name );
+		OSRF_BUFFER_ADD( buf, ",\"params\":" );
+		buffer_add( buf, msg->_raw_params );
+		OSRF_BUFFER_ADD( buf, OSRF_RESULT_JSON_SUFFIX );
+	} else {
+		jsonObject* json = osrfMessageToJSON( msg );
+		char* j = jsonObjectToJSON( json );
+		buffer_add( buf, j );
+		free( j );
+		jsonObjectFree( json );
+	}
 }
 
 
@@ -456,6 +591,15 @@ jsonObject* osrfMessageToJSON( const osrfMessage* msg ) {
 	if (msg->protocol > 0) 
 		jsonObjectSetKey(json, "api_level", jsonNewNumberObject(msg->protocol));
 
+	if (msg->window > 0)
+		jsonObjectSetKey(json, "window", jsonNewNumberObject(msg->window));
+
+	if (msg->encoding == OSRF_ENCODING_MSGPACK)
+		jsonObjectSetKey(json, "encoding", jsonNewObject("msgpack"));
+
+	if (msg->deadline > 0)
+		jsonObjectSetKey(json, "deadline", jsonNewNumberObject(osrfMessageTimeLeft(msg)));
+
 	switch(msg->m_type) {
 
 		case CONNECT:
@@ -481,7 +625,10 @@ jsonObject* osrfMessageToJSON( const osrfMessage* msg ) {
 			payload = jsonNewObject(NULL);
 			jsonObjectSetClass(payload, "osrfMethod");
 			jsonObjectSetKey(payload, "method", jsonNewObject(msg->method_name));
-			jsonObjectSetKey( payload, "params", jsonObjectDecodeClass( msg->_params ) );
+			if( msg->_params || !msg->_raw_params )
+				jsonObjectSetKey( payload, "params", jsonObjectDecodeClass( msg->_params ) );
+			else
+				jsonObjectSetKey( payload, "params", decode_raw( msg->_raw_params ) );
 			jsonObjectSetKey(json, "payload", payload);
 
 			break;
@@ -499,7 +646,10 @@ jsonObject* osrfMessageToJSON( const osrfMessage* msg ) {
 			jsonObjectSetKey(payload, "status", jsonNewObject(msg->status_text));
 			snprintf(sc, sizeof(sc), "%d", msg->status_code);
 			jsonObjectSetKey(payload, "statusCode", jsonNewObject(sc));
-			jsonObjectSetKey(payload, "content", jsonObjectDecodeClass( msg->_result_content ));
+			if( msg->_result_content || !msg->_raw_content )
+				jsonObjectSetKey(payload, "content", jsonObjectDecodeClass( msg->_result_content ));
+			else
+				jsonObjectSetKey(payload, "content", decode_raw( msg->_raw_content ));
 			jsonObjectSetKey(json, "payload", payload);
 			break;
 	}
@@ -507,6 +657,156 @@ jsonObject* osrfMessageToJSON( const osrfMessage* msg ) {
 	return json;
 }
 
+/**
+	@brief Append a string to a buffer as a quoted JSON string, or as null.
+	@param buf Pointer to the growing_buffer.
+	@param str The string, or NULL.
+*/
+static void add_json_string( growing_buffer* buf, const char* str ) {
+	if( str ) {
+		OSRF_BUFFER_ADD_CHAR( buf, '"' );
+		buffer_append_utf8( buf, str );
+		OSRF_BUFFER_ADD_CHAR( buf, '"' );
+	} else
+		OSRF_BUFFER_ADD( buf, "null" );
+}
+
+/**
+	@brief Append a locale, TZ, or ingress hint to a buffer as a JSON string literal.
+	@param buf Pointer to the growing_buffer.
+	@param hint The hint.
+
+	An interned hint comes with its JSON ready-made.
+*/
+static void add_hint( growing_buffer* buf, const char* hint ) {
+	const char* json = osrf_intern_json( hint );
+	if( json )
+		buffer_add( buf, json );
+	else
+		add_json_string( buf, hint );
+}
+
+/**
+	@brief Write the JSON for a RESULT message, up to the point where its content goes.
+	@param buf Pointer to the growing_buffer to which the JSON is appended.
+	@param msg Pointer to the RESULT message.  Its content, if any, is ignored.
+
+	The caller then appends the content, already serialized as JSON, followed by
+	OSRF_RESULT_JSON_SUFFIX.  The result is the same text as jsonObjectToJSON() would
+	make of osrfMessageToJSON( msg ), but the content is neither cloned into a jsonObject
+	nor serialized a second time.
+*/
+void osrfMessageAddResultPrefix( growing_buffer* buf, const osrfMessage* msg ) {
+	if( !buf || !msg )
+		return;
+
+	const char* cname = "osrfResult";
+	if( msg->status_code == OSRF_STATUS_PARTIAL )
+		cname = "osrfResultPartial";
+	else if( msg->status_code == OSRF_STATUS_NOCONTENT )
+		cname = "osrfResultPartialComplete";
+
+	add_prefix( buf, msg, "RESULT", cname );
+	OSRF_BUFFER_ADD( buf, "\"status\":" );
+	add_json_string( buf, msg->status_text );
+	OSRF_BUFFER_ADD( buf, ",\"statusCode\":\"" );
+	buffer_add_int64( buf, msg->status_code );
+	OSRF_BUFFER_ADD( buf, "\",\"content\":" );
+}
+
+/**
+	@brief Append the MessagePack for an osrfMessage to a buffer.
+	@param buf Pointer to the growing_buffer to which the MessagePack is appended.
+	@param msg Pointer to the osrfMessage.
+	@param content For a RESULT message without content of its own, the content to pack
+		in its place; otherwise NULL.
+
+	The MessagePack counterpart of osrfMessageAddResultPrefix(): a series of these,
+	wrapped up by osrfMsgpackArrayText(), makes the same body as
+	osrfMessageSerializeBatchEncoded(), and @a content is packed where it lies rather than
+	being cloned into the message first.  Since the content is the last value of the
+	message, the envelope is packed without it, and its closing nil replaced.
+*/
+void osrfMessageAddMsgpack( growing_buffer* buf, const osrfMessage* msg,
+		const jsonObject* content ) {
+	if( !buf || !msg )
+		return;
+
+	jsonObject* json = osrfMessageToJSON( msg );
+	size_t start = buffer_length( buf );
+	jsonObjectAppendMsgpack( buf, json );
+	jsonObjectFree( json );
+
+	if( content && RESULT == msg->m_type && !msg->_result_content && !msg->_raw_content
+			&& buffer_length( buf ) > start
+			&& 0xC0 == (unsigned char) buf->buf[ buf->n_used - 1 ] ) {
+		buf->buf[ --buf->n_used ] = '\0';
+		jsonObjectAppendMsgpack( buf, content );
+	}
+}
+
+/**
+	@brief Write the JSON for an osrfMessage, up to the first key of its payload.
+	@param buf Pointer to the growing_buffer to which the JSON is appended.
+	@param msg Pointer to the osrfMessage.
+	@param type The message type, as it appears in the JSON.
+	@param cname Class name of the payload.
+
+	The keys come in the same order as from osrfMessageToJSON().
+*/
+static void add_prefix( growing_buffer* buf, const osrfMessage* msg,
+		const char* type, const char* cname ) {
+
+	OSRF_BUFFER_ADD( buf, "{\"" JSON_CLASS_KEY "\":\"osrfMessage\",\"" JSON_DATA_KEY "\":{" );
+	OSRF_BUFFER_ADD( buf, "\"threadTrace\":\"" );
+	buffer_add_int64( buf, msg->thread_trace );
+	OSRF_BUFFER_ADD( buf, "\",\"locale\":" );
+
+	if( msg->sender_locale != NULL )
+		add_hint( buf, msg->sender_locale );
+	else if( current_locale != NULL )
+		add_json_string( buf, current_locale );
+	else
+		add_json_string( buf, default_locale );
+
+	if( msg->sender_tz != NULL ) {
+		OSRF_BUFFER_ADD( buf, ",\"tz\":" );
+		add_hint( buf, msg->sender_tz );
+	}
+
+	if( msg->sender_ingress != NULL ) {
+		OSRF_BUFFER_ADD( buf, ",\"ingress\":" );
+		add_hint( buf, msg->sender_ingress );
+	}
+
+	if( msg->protocol > 0 ) {
+		OSRF_BUFFER_ADD( buf, ",\"api_level\":" );
+		buffer_add_int64( buf, msg->protocol );
+	}
+
+	if( msg->window > 0 ) {
+		OSRF_BUFFER_ADD( buf, ",\"window\":" );
+		buffer_add_int64( buf, msg->window );
+	}
+
+	if( msg->encoding == OSRF_ENCODING_MSGPACK )
+		OSRF_BUFFER_ADD( buf, ",\"encoding\":\"msgpack\"" );
+
+	if( msg->deadline > 0 ) {
+		OSRF_BUFFER_ADD( buf, ",\"deadline\":" );
+		buffer_add_int64( buf, osrfMessageTimeLeft( msg ));
+	}
+
+	OSRF_BUFFER_ADD( buf, ",\"type\":\"" );
+	OSRF_BUFFER_ADD( buf, type );
+	OSRF_BUFFER_ADD( buf, "\",\"payload\":{\"" JSON_CLASS_KEY "\":\"" );
+	OSRF_BUFFER_ADD( buf, cname );
+	OSRF_BUFFER_ADD( buf, "\",\"" JSON_DATA_KEY "\":{" );
+}
+
+static osrfList* deserialize_list( const char* string, osrfList* list, int lazy );
+static int deserialize_array( const char* string, osrfMessage* msgs[], int count, int lazy );
+
 /**
 	@brief Translate a JSON array into an osrfList of osrfMessages.
 	@param string The JSON string to be translated.
@@ -530,25 +830,60 @@ jsonObject* osrfMessageToJSON( const osrfMessage* msg ) {
 	osrfListFree().
  */
 osrfList* osrfMessageDeserialize( const char* string, osrfList* list ) {
+	return deserialize_list( string, list, 0 );
+}
+
+/**
+	@brief Translate a JSON array into an osrfList of osrfMessages, leaving their payloads
+		as JSON text.
+	@param string The JSON string to be translated.
+	@param list Pointer to an osrfList of osrfMessages (may be NULL)
+	@return Pointer to an osrfList containing pointers to osrfMessages.
+
+	The same as osrfMessageDeserialize(), except that the params of a REQUEST and the
+	content of a RESULT aren't parsed.  They are parsed on demand by osrfMessageGetParams()
+	and osrfMessageGetResult(), or passed through untouched if the messages are serialized
+	again.  Meant for relays, which look at the type, thread trace and status of a message
+	but seldom at what it carries.
+
+	Read the payload of a lazily deserialized message only through those accessors, not
+	through the _params and _result_content members.
+*/
+osrfList* osrfMessageDeserializeLazy( const char* string, osrfList* list ) {
+	return deserialize_list( string, list, 1 );
+}
+
+/**
+	@brief Translate a JSON array into an osrfList of osrfMessages, eagerly or lazily.
+	@param string The JSON string to be translated.
+	@param list Pointer to an osrfList of osrfMessages (may be NULL)
+	@param lazy Boolean: true to leave the payloads as JSON text.
+	@return Pointer to an osrfList containing pointers to osrfMessages.
+
+	See osrfMessageDeserialize() and osrfMessageDeserializeLazy().
+*/
+static osrfList* deserialize_list( const char* string, osrfList* list, int lazy ) {
 
 	if( list )
 		osrfListClear( list );
 
 	if( ! string  || ! *string ) {
 		if( ! list ) {
-			list = osrfNewList( 1 );
+			list = osrfNewListSize( 1 );
 			list->freeItem = (void(*)(void*)) osrfMessageFree;
 		}
 		return list;                   // No string?  Return empty list.
 	}
 	
 	// Parse the JSON
-	jsonObject* json = jsonParse(string);
+	osrfList* params = NULL;
+	osrfList* content = NULL;
+	jsonObject* json = parse_body( string, lazy, &params, &content );
 	if(!json) {
 		osrfLogWarning( OSRF_LOG_MARK,
 				"osrfMessageDeserialize() unable to parse data: \n%s\n", string);
 		if( ! list ) {
-			list = osrfNewList( 1 );
+			list = osrfNewListSize( 1 );
 			list->freeItem = (void(*)(void*)) osrfMessageFree;
 		}
 		return list;                   // Bad JSON?  Return empty list.
@@ -557,7 +892,7 @@ osrfList* osrfMessageDeserialize( const char* string, osrfList* list ) {
 	const unsigned int count = (int) json->size;
 	if( ! list ) {
 		// Create a right-sized osrfList
-		list = osrfNewList( count );
+		list = osrfNewListSize( count );
 		list->freeItem = (void(*)(void*)) osrfMessageFree;
 	}
 
@@ -568,10 +903,14 @@ osrfList* osrfMessageDeserialize( const char* string, osrfList* list ) {
 		const jsonObject* message = jsonObjectGetIndex( json, i );
 		if( message && message->type != JSON_NULL &&
 				  message->classname && !strcmp(message->classname, "osrfMessage" )) {
-			osrfListPush( list, deserialize_one_message( message ) );
+			osrfMessage* msg = deserialize_one_message( message, 1 );
+			attach_payload( msg, i, params, content );
+			osrfListPush( list, msg );
 		}
 	}
 
+	osrfListFree( params );
+	osrfListFree( content );
 	jsonObjectFree( json );
 	return list;
 }
@@ -589,12 +928,41 @@ osrfList* osrfMessageDeserialize( const char* string, osrfList* list ) {
 	silently ignore the excess.
 */
 int osrf_message_deserialize(const char* string, osrfMessage* msgs[], int count) {
+	return deserialize_array( string, msgs, count, 0 );
+}
+
+/**
+	@brief Translate a JSON array into an array of osrfMessages, leaving their payloads
+		as JSON text.
+	@param string The JSON string to be translated.
+	@param msgs Pointer to an array of pointers to osrfMessage, to receive the results.
+	@param count How many slots are available in the @a msgs array.
+	@return The number of osrfMessages created.
+
+	The same as osrf_message_deserialize(), but lazy in the manner of
+	osrfMessageDeserializeLazy().
+*/
+int osrf_message_deserialize_lazy( const char* string, osrfMessage* msgs[], int count ) {
+	return deserialize_array( string, msgs, count, 1 );
+}
+
+/**
+	@brief Translate a JSON array into an array of osrfMessages, eagerly or lazily.
+	@param string The JSON string to be translated.
+	@param msgs Pointer to an array of pointers to osrfMessage, to receive the results.
+	@param count How many slots are available in the @a msgs array.
+	@param lazy Boolean: true to leave the payloads as JSON text.
+	@return The number of osrfMessages created.
+*/
+static int deserialize_array( const char* string, osrfMessage* msgs[], int count, int lazy ) {
 
 	if(!string || !msgs || count <= 0) return 0;
 	int numparsed = 0;
 
 	// Parse the JSON
-	jsonObject* json = jsonParse(string);
+	osrfList* params = NULL;
+	osrfList* content = NULL;
+	jsonObject* json = parse_body( string, lazy, &params, &content );
 
 	if(!json) {
 		osrfLogWarning( OSRF_LOG_MARK,
@@ -610,18 +978,316 @@ int osrf_message_deserialize(const char* string, osrfMessage* msgs[], int count)
 
 		if( message && message->type != JSON_NULL &&
 			message->classname && !strcmp(message->classname, "osrfMessage" )) {
-			msgs[numparsed++] = deserialize_one_message( message );
+			msgs[numparsed] = deserialize_one_message( message, 1 );
+			attach_payload( msgs[numparsed++], x, params, content );
 		}
 	}
 
+	osrfListFree( params );
+	osrfListFree( content );
 	jsonObjectFree( json );
 	return numparsed;
 }
 
+/**
+	@brief The progress of a scan for message payloads; see parse_envelope().
+*/
+typedef struct {
+	growing_buffer* envelope;   /**< The JSON with the payloads left out. */
+	const char* copied;         /**< How far into the original we have copied. */
+	osrfList* params;           /**< JSON text of params, by message index. */
+	osrfList* content;          /**< JSON text of content, by message index. */
+	unsigned int index;         /**< Index of the message being scanned. */
+} payload_scan;
+
+/** @brief How deeply a scan for payloads may nest before we give up and parse eagerly. */
+#define PAYLOAD_SCAN_DEPTH 200
+
+/**
+	@name Scan levels
+	@brief Where a value lies on the path from the outer array to a payload.
+*/
+/*@{*/
+#define SCAN_NONE     -1  /**< Off the path. */
+#define SCAN_ARRAY     0  /**< The array of messages. */
+#define SCAN_MESSAGE   1  /**< A message, with its class name encoded. */
+#define SCAN_BODY      2  /**< The data of a message. */
+#define SCAN_PAYLOAD   3  /**< A payload, with its class name encoded. */
+#define SCAN_CONTENTS  4  /**< The data of a payload, holding params or content. */
+/*@}*/
+
+/** @brief Tell whether a stretch of JSON text, unescaped, is a given key. */
+#define KEY_IS(key,len,lit) ( (len) == sizeof( lit ) - 1 && !memcmp( (key), (lit), (len) ) )
+
+static const char* scan_value( const char* p, payload_scan* scan, int level, int depth );
+
+/**
+	@brief Skip over white space, as the JSON parser sees it.
+	@param p Pointer into the JSON text.
+	@return Pointer to the next byte that isn't white space.
+*/
+static const char* skip_space( const char* p ) {
+	while( isspace( (unsigned char) *p ) )
+		++p;
+	return p;
+}
+
+/**
+	@brief Skip over a quoted string.
+	@param p Pointer to the opening quotation mark.
+	@return Pointer just past the closing quotation mark, or NULL if there isn't one.
+*/
+static const char* scan_string( const char* p ) {
+	for( ++p; *p != '"'; ++p ) {
+		if( '\0' == *p )
+			return NULL;
+		if( '\\' == *p && '\0' == *++p )
+			return NULL;
+	}
+	return p + 1;
+}
+
+/**
+	@brief Skip over a JSON value, noting and cutting out any payloads on the way.
+	@param p Pointer to the value, or to white space before it.
+	@param scan Pointer to the scan in progress.
+	@param level Where the value lies on the path to a payload; one of the scan levels.
+	@param depth How deeply the value is nested.
+	@return Pointer just past the value, or NULL if the JSON isn't what we expect.
+
+	This is not a validator: anything it lets through still has to get past jsonParse().
+*/
+static const char* scan_value( const char* p, payload_scan* scan, int level, int depth ) {
+
+	if( depth > PAYLOAD_SCAN_DEPTH )
+		return NULL;
+
+	p = skip_space( p );
+	if( '"' == *p )
+		return scan_string( p );
+
+	if( '[' == *p ) {
+		p = skip_space( p + 1 );
+		if( ']' == *p )
+			return p + 1;
+		unsigned int i = 0;
+		for( ;; ) {
+			if( SCAN_ARRAY == level )
+				scan->index = i++;
+			p = scan_value( p, scan, SCAN_ARRAY == level ? SCAN_MESSAGE : SCAN_NONE, depth + 1 );
+			if( !p )
+				return NULL;
+			p = skip_space( p );
+			if( ',' == *p )
+				++p;
+			else if( ']' == *p )
+				return p + 1;
+			else
+				return NULL;
+		}
+	}
+
+	if( '{' == *p ) {
+		p = skip_space( p + 1 );
+		if( '}' == *p )
+			return p + 1;
+		for( ;; ) {
+			p = skip_space( p );
+			if( *p != '"' )
+				return NULL;
+			const char* key = p + 1;
+			if( !(p = scan_string( p )) )
+				return NULL;
+			size_t keylen = p - 1 - key;
+			p = skip_space( p );
+			if( *p != ':' )
+				return NULL;
+			++p;
+
+			int child = SCAN_NONE;
+			osrfList* target = NULL;
+			if( (SCAN_MESSAGE == level || SCAN_PAYLOAD == level)
+					&& KEY_IS( key, keylen, JSON_DATA_KEY ) )
+				child = level + 1;
+			else if( SCAN_BODY == level && KEY_IS( key, keylen, "payload" ) )
+				child = SCAN_PAYLOAD;
+			else if( SCAN_CONTENTS == level && KEY_IS( key, keylen, "params" ) )
+				target = scan->params;
+			else if( SCAN_CONTENTS == level && KEY_IS( key, keylen, "content" ) )
+				target = scan->content;
+
+			if( target ) {
+				// Save the payload, and leave a null in its place
+				const char* start = skip_space( p );
+				if( !(p = scan_value( start, scan, SCAN_NONE, depth + 1 )) )
+					return NULL;
+				buffer_add_n( scan->envelope, scan->copied, start - scan->copied );
+				OSRF_BUFFER_ADD( scan->envelope, "null" );
+				scan->copied = p;
+				char* raw = safe_malloc( p - start + 1 );
+				memcpy( raw, start, p - start );
+				osrfListSet( target, raw, scan->index );
+			} else if( !(p = scan_value( p, scan, child, depth + 1 )) )
+				return NULL;
+
+			p = skip_space( p );
+			if( ',' == *p )
+				++p;
+			else if( '}' == *p )
+				return p + 1;
+			else
+				return NULL;
+		}
+	}
+
+	// A number, true, false, or null
+	const char* start = p;
+	while( *p && !isspace( (unsigned char) *p ) && !strchr( ",:]}[{\"", *p ) )
+		++p;
+	return p > start ? p : NULL;
+}
+
+/**
+	@brief Parse a JSON array of messages, leaving out their payloads.
+	@param string The JSON text.
+	@param params Pointer through which to return an osrfList of the params of each
+		message, as JSON text, by index within the array.
+	@param content Likewise, for the content of each message.
+	@return Pointer to the parsed jsonObject, with a null in place of each payload; or
+		NULL if the JSON is invalid.
+
+	If the text isn't laid out the way we expect, parse it all the usual way, and return
+	NULL through @a params and @a content.
+
+	The caller is responsible for freeing the jsonObject and both osrfLists.
+*/
+static jsonObject* parse_envelope( const char* string, osrfList** params,
+		osrfList** content ) {
+
+	*params = *content = NULL;
+
+	payload_scan scan;
+	scan.envelope = buffer_init( 256 );
+	scan.copied = string;
+	scan.params = osrfNewList();
+	scan.params->freeItem = free;
+	scan.content = osrfNewList();
+	scan.content->freeItem = free;
+	scan.index = 0;
+
+	const char* end = NULL;
+	const char* p = skip_space( string );
+	if( '[' == *p && (end = scan_value( p, &scan, SCAN_ARRAY, 0 )) )
+		end = skip_space( end );
+
+	jsonObject* json;
+	if( end && '\0' == *end && scan.copied != string ) {
+		OSRF_BUFFER_ADD( scan.envelope, scan.copied );
+		json = jsonParse( OSRF_BUFFER_C_STR( scan.envelope ) );
+		*params = scan.params;
+		*content = scan.content;
+	} else {
+		// Nothing to leave out, or not laid out as we expected
+		json = jsonParse( string );
+		osrfListFree( scan.params );
+		osrfListFree( scan.content );
+	}
+
+	buffer_free( scan.envelope );
+	return json;
+}
+
+/**
+	@brief Parse the body of a transport message, in whichever encoding it arrived.
+	@param string The body: a JSON array, or the text form of MessagePack.
+	@param lazy Boolean: true to leave the payloads as JSON text, if the body is JSON.
+	@param params Pointer through which to return the params, as for parse_envelope().
+	@param content Pointer through which to return the content, as for parse_envelope().
+	@return Pointer to the parsed array of messages, or NULL if it isn't valid.
+
+	MessagePack is always read eagerly; there is no text to leave the payloads in.
+*/
+static jsonObject* parse_body( const char* string, int lazy, osrfList** params,
+		osrfList** content ) {
+	if( jsonIsMsgpackText( string ) ) {
+		jsonObject* json = jsonMsgpackTextToObject( string );
+		if( json && json->type != JSON_ARRAY ) {
+			jsonObjectFree( json );
+			json = NULL;
+		}
+		return json;
+	}
+	return lazy ? parse_envelope( string, params, content ) : jsonParse( string );
+}
+
+/**
+	@brief Give an osrfMessage the payload that parse_envelope() left out for it.
+	@param msg Pointer to the osrfMessage.
+	@param index Index of the message within the array of messages.
+	@param params The params of each message, as JSON text; may be NULL.
+	@param content The content of each message, as JSON text; may be NULL.
+
+	The message was built from a null in place of the payload.  Replace that null with
+	the JSON text, which we take from the osrfList.
+*/
+static void attach_payload( osrfMessage* msg, unsigned int index, osrfList* params,
+		osrfList* content ) {
+
+	char* raw = params ? osrfListExtract( params, index ) : NULL;
+	if( raw ) {
+		jsonObjectFree( msg->_params );
+		msg->_params = NULL;
+		msg->_raw_params = raw;
+	}
+
+	raw = content ? osrfListExtract( content, index ) : NULL;
+	if( raw ) {
+		jsonObjectFree( msg->_result_content );
+		msg->_result_content = NULL;
+		msg->_raw_content = raw;
+	}
+}
+
+/**
+	@brief Translate a jsonObject into a single osrfMessage.
+	@param obj Pointer to the jsonObject, with its class names decoded as by jsonParse().
+	@return Pointer to a newly created osrfMessage, or NULL if @a obj isn't an osrfMessage.
+
+	The public face of deserialize_one_message(), for callers that already have the message
+	as a jsonObject, e.g. from a streaming parser.
+
+	The calling code is responsible for freeing the osrfMessage by calling osrfMessageFree().
+*/
+osrfMessage* osrfMessageFromJSON( const jsonObject* obj ) {
+	if( !obj || obj->type == JSON_NULL
+			|| !obj->classname || strcmp( obj->classname, "osrfMessage" ) )
+		return NULL;
+	return deserialize_one_message( obj, 0 );
+}
+
+/**
+	@brief Fetch the parameters or content of a message payload, decoded.
+	@param payload Pointer to the payload of a message.
+	@param key "params" or "content".
+	@param take Boolean: true if we may take the value out of @a payload.
+	@return Pointer to the decoded value, or NULL if there is none.
+
+	Taking the value lets us decode it where it is, instead of decoding a copy.
+*/
+static jsonObject* get_payload_value( const jsonObject* payload, const char* key, int take ) {
+	if( !jsonObjectGetKeyConst( payload, key ))
+		return NULL;
+	else if( take )
+		return jsonObjectDecodeClassInPlace( jsonObjectExtractKey( (jsonObject*) payload, key ));
+	else
+		return jsonObjectDecodeClass( jsonObjectGetKeyConst( payload, key ));
+}
 
 /**
 	@brief Translate a jsonObject into a single osrfMessage.
 	@param obj Pointer to the jsonObject to be translated.
+	@param take Boolean: true if the calling code is about to free @a obj, so that we may
+		take its parameters and content out of it instead of copying them.
 	@return Pointer to a newly created osrfMessage.
 
 	It is assumed that @a obj is non-NULL and points to a valid representation of a message.
@@ -629,7 +1295,7 @@ int osrf_message_deserialize(const char* string, osrfMessage* msgs[], int count)
 
 	The calling code is responsible for freeing the osrfMessage by calling osrfMessageFree().
 */
-static osrfMessage* deserialize_one_message( const jsonObject* obj ) {
+static osrfMessage* deserialize_one_message( const jsonObject* obj, int take ) {
 
 	// Get the message type.  If it isn't present, default to CONNECT.
 	const jsonObject* tmp = jsonObjectGetKeyConst( obj, "type" );
@@ -668,10 +1334,34 @@ static osrfMessage* deserialize_one_message( const jsonObject* obj ) {
 	// Now that we have the essentials, create an osrfMessage
 	osrfMessage* msg = osrf_message_init( type, trace, protocol );
 
+	// Get the flow control window, if any
+	tmp = jsonObjectGetKeyConst( obj, "window" );
+	if( tmp ) {
+		const char* window = jsonObjectGetString( tmp );
+		if( window && atoi( window ) > 0 )
+			msg->window = atoi( window );
+	}
+
+	// Get the body encoding, if any; we ignore any we don't know
+	tmp = jsonObjectGetKeyConst( obj, "encoding" );
+	const char* encoding = jsonObjectGetString( tmp );
+	if( encoding && !strcmp( encoding, "msgpack" ) )
+		msg->encoding = OSRF_ENCODING_MSGPACK;
+
+	// Get the time the sender has left, if it said; we count it down from now
+	tmp = jsonObjectGetKeyConst( obj, "deadline" );
+	if( tmp ) {
+		const char* left = jsonObjectGetString( tmp );
+		if( left && *left != '-' )
+			msg->deadline = get_monotonic_millis() + atoll( left );
+	}
+
 	// Update current_locale with the locale of the message
 	// (or set it to NULL if not specified)
 	tmp = jsonObjectGetKeyConst( obj, "locale" );
-	if(tmp && ( msg->sender_locale = jsonObjectToSimpleString(tmp))) {
+	const char* locale = jsonObjectGetString( tmp );
+	if( locale ) {
+		osrf_message_set_locale( msg, locale );
 		if ( current_locale ) {
 			if( strcmp( current_locale, msg->sender_locale ) ) {
 				free( current_locale );
@@ -704,15 +1394,12 @@ static osrfMessage* deserialize_one_message( const jsonObject* obj ) {
 		if(tmp_str)
 			msg->method_name = strdup(tmp_str);
 
-		tmp0 = jsonObjectGetKeyConst(tmp,"params");
-		if(tmp0) {
-			// Note that we use jsonObjectDecodeClass() instead of
-			// jsonObjectClone().  The classnames are already decoded,
-			// but jsonObjectDecodeClass removes the decoded classnames.
-			msg->_params = jsonObjectDecodeClass( tmp0 );
-			if(msg->_params && msg->_params->type == JSON_NULL)
-				msg->_params->type = JSON_ARRAY;
-		}
+		// Note that we decode the params instead of cloning them.  The
+		// classnames are already decoded, but decoding removes the
+		// decoded classnames.
+		msg->_params = get_payload_value( tmp, "params", take );
+		if(msg->_params && msg->_params->type == JSON_NULL)
+			msg->_params->type = JSON_ARRAY;
 
 		// Get status fields for a RESULT or STATUS
 		if(tmp->classname)
@@ -733,13 +1420,7 @@ static osrfMessage* deserialize_one_message( const jsonObject* obj ) {
 		}
 
 		// Get the content for a RESULT
-		tmp0 = jsonObjectGetKeyConst(tmp,"content");
-		if(tmp0) {
-			// Note that we use jsonObjectDecodeClass() instead of
-			// jsonObjectClone().  The classnames are already decoded,
-			// but jsonObjectDecodeClass removes the decoded classnames.
-			msg->_result_content = jsonObjectDecodeClass( tmp0 );
-		}
+		msg->_result_content = get_payload_value( tmp, "content", take );
 
 	}
 
@@ -757,6 +1438,63 @@ static osrfMessage* deserialize_one_message( const jsonObject* obj ) {
 	@em not call jsonObjectFree() on it, because the osrfMessage still owns it.
 */
 const jsonObject* osrfMessageGetResult( osrfMessage* msg ) {
-	if(msg) return msg->_result_content;
+	if(msg) {
+		materialize( msg );
+		return msg->_result_content;
+	}
 	return NULL;
 }
+
+/**
+	@brief Return a pointer to the parameters of an osrfMessage.
+	@param msg Pointer to the osrfMessage whose parameters are to be returned.
+	@return Pointer to the parameters, normally a JSON_ARRAY (or NULL if there are no
+	parameters, or if @a msg is NULL).
+
+	As with osrfMessageGetResult(), the osrfMessage still owns what the returned pointer
+	points to.
+*/
+const jsonObject* osrfMessageGetParams( osrfMessage* msg ) {
+	if(msg) {
+		materialize( msg );
+		return msg->_params;
+	}
+	return NULL;
+}
+
+/**
+	@brief Parse the JSON text of a payload the way eager deserialization would have.
+	@param raw The JSON text.
+	@return Pointer to a newly created jsonObject, or NULL if the JSON is invalid.
+*/
+static jsonObject* decode_raw( const char* raw ) {
+	jsonObject* parsed = jsonParse( raw );
+	if( !parsed ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to parse message payload: %s", raw );
+		return NULL;
+	}
+	return jsonObjectDecodeClassInPlace( parsed );
+}
+
+/**
+	@brief Turn any payload left as JSON text by lazy deserialization into a jsonObject.
+	@param msg Pointer to the osrfMessage.
+*/
+static void materialize( osrfMessage* msg ) {
+	if( msg->_raw_params ) {
+		if( !msg->_params ) {
+			msg->_params = decode_raw( msg->_raw_params );
+			if(msg->_params && msg->_params->type == JSON_NULL)
+				msg->_params->type = JSON_ARRAY;
+		}
+		free( msg->_raw_params );
+		msg->_raw_params = NULL;
+	}
+
+	if( msg->_raw_content ) {
+		if( !msg->_result_content )
+			msg->_result_content = decode_raw( msg->_raw_content );
+		free( msg->_raw_content );
+		msg->_raw_content = NULL;
+	}
+}
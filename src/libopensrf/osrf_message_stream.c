@@ -0,0 +1,388 @@
+/**
+	@file osrf_message_stream.c
+	@brief Decode osrfMessages incrementally, handing out RESULT rows as they complete.
+
+	A JSONPushParser reports the syntax of the JSON as it goes by.  We build jsonObjects
+	from the reports, on a stack of partly built arrays and hashes, and decode class names
+	as each hash closes, the way jsonParse() would.
+
+	Each container on the stack knows where it lies on the path from the outer array of
+	messages to the content of a RESULT.  When a message closes, we turn it into an
+	osrfMessage and hand it out; when an element of the content closes, we hand it out
+	rather than add it to the content.  Neither stays on the stack, so memory use depends
+	on the size of the largest row, not on the size of the whole response.
+*/
+
+#include <opensrf/osrf_message_stream.h>
+#include <opensrf/jsonpush.h>
+
+/**
+	@name Stream levels
+	@brief Where a container lies on the path from the outer array to the rows of a RESULT.
+*/
+/*@{*/
+#define LEVEL_NONE      -1  /**< Off the path. */
+#define LEVEL_ARRAY      0  /**< The array of messages. */
+#define LEVEL_MESSAGE    1  /**< A message, with its class name encoded. */
+#define LEVEL_BODY       2  /**< The data of a message. */
+#define LEVEL_PAYLOAD    3  /**< A payload, with its class name encoded. */
+#define LEVEL_CONTENTS   4  /**< The data of a payload. */
+#define LEVEL_ROWS       5  /**< The content of a RESULT, when it's an array. */
+/*@}*/
+
+/**
+	@brief An array or hash under construction.
+*/
+typedef struct {
+	jsonObject* obj;        /**< The container itself. */
+	char* key;              /**< For a hash: the key awaiting a value. */
+	jsonObject* class_obj;  /**< For a hash: the value for JSON_CLASS_KEY, held aside. */
+	jsonObject* payload;    /**< For a hash: the value for JSON_DATA_KEY, held aside. */
+	int level;              /**< One of the stream levels. */
+} stream_frame;
+
+struct osrf_message_stream_struct {
+	JSONPushParser* parser;                 /**< Does the actual parsing. */
+	osrfMessageStreamRowHandler on_row;     /**< Called for each row, or NULL for none. */
+	osrfMessageStreamHandler on_message;    /**< Called for each message. */
+	void* blob;                             /**< Passed to the callbacks. */
+	stream_frame* frames;                   /**< Stack of containers under construction. */
+	int depth;                              /**< How many frames are in use. */
+	int capacity;                           /**< How many frames there is room for. */
+	int index;                              /**< Position of the current message. */
+	int error;                              /**< Boolean: true if the JSON is invalid. */
+};
+
+static int begin_container( osrfMessageStream* stream, jsonObject* obj );
+static int end_container( osrfMessageStream* stream );
+static void add_value( osrfMessageStream* stream, jsonObject* value );
+static void clear_frames( osrfMessageStream* stream );
+
+static int handle_string( void* blob, const char* str );
+static int handle_number( void* blob, const char* str );
+static int handle_begin_array( void* blob );
+static int handle_begin_obj( void* blob );
+static int handle_obj_key( void* blob, const char* key );
+static int handle_end( void* blob );
+static int handle_bool( void* blob, int b );
+static int handle_null( void* blob );
+static void handle_error( void* blob, const char* msg, unsigned line, unsigned pos );
+
+/** @brief How the JSONPushParser reaches us. */
+static const JSONHandlerMap stream_handlers = {
+	handle_string,
+	handle_number,
+	handle_begin_array,
+	handle_end,
+	handle_begin_obj,
+	handle_obj_key,
+	handle_end,
+	handle_bool,
+	handle_null,
+	NULL,
+	handle_error
+};
+
+/**
+	@brief Create a new osrfMessageStream.
+	@param on_row Function to call for each element of the content of a RESULT, or NULL to
+		leave the content in the message.
+	@param on_message Function to call for each osrfMessage.  If NULL, the messages are
+		discarded, which makes sense only for a caller that wants nothing but the rows.
+	@param blob An arbitrary pointer to pass to the callbacks.
+	@return Pointer to the new osrfMessageStream.
+
+	The calling code is responsible for freeing the osrfMessageStream by calling
+	osrfMessageStreamFree().
+*/
+osrfMessageStream* osrfNewMessageStream( osrfMessageStreamRowHandler on_row,
+		osrfMessageStreamHandler on_message, void* blob ) {
+
+	osrfMessageStream* stream = safe_malloc( sizeof( osrfMessageStream ) );
+	stream->parser = jsonNewPushParser( &stream_handlers, stream );
+	stream->on_row = on_row;
+	stream->on_message = on_message;
+	stream->blob = blob;
+	stream->capacity = 16;
+	stream->frames = safe_malloc( stream->capacity * sizeof( stream_frame ) );
+	stream->depth = 0;
+	stream->index = 0;
+	stream->error = 0;
+	return stream;
+}
+
+/**
+	@brief Parse the next chunk of a JSON array of osrfMessages.
+	@param stream Pointer to the osrfMessageStream.
+	@param data Pointer to the chunk.  It need not end on any particular boundary.
+	@param length Length of the chunk.
+	@return 0 if successful, or -1 if the JSON is invalid.
+
+	Calls the callbacks for anything the chunk completes.  After an error, the stream
+	accepts nothing more until it is reset.
+*/
+int osrfMessageStreamPush( osrfMessageStream* stream, const char* data, size_t length ) {
+	if( !stream || !data )
+		return -1;
+	if( stream->error )
+		return -1;
+	if( jsonPush( stream->parser, data, length ) || stream->error ) {
+		stream->error = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Tell an osrfMessageStream that there is no more JSON.
+	@param stream Pointer to the osrfMessageStream.
+	@return 0 if the JSON was complete and valid, or -1 if not.
+
+	Messages already handed out stay handed out, even if the JSON turns out to be
+	incomplete.
+*/
+int osrfMessageStreamFinish( osrfMessageStream* stream ) {
+	if( !stream )
+		return -1;
+	if( stream->error || jsonPushParserFinish( stream->parser ) || stream->error ) {
+		stream->error = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Make an osrfMessageStream ready for another JSON array of osrfMessages.
+	@param stream Pointer to the osrfMessageStream.
+
+	Discards anything partly built.
+*/
+void osrfMessageStreamReset( osrfMessageStream* stream ) {
+	if( !stream )
+		return;
+	clear_frames( stream );
+	jsonPushParserReset( stream->parser );
+	stream->index = 0;
+	stream->error = 0;
+}
+
+/**
+	@brief Free an osrfMessageStream, and anything partly built.
+	@param stream Pointer to the osrfMessageStream.
+*/
+void osrfMessageStreamFree( osrfMessageStream* stream ) {
+	if( !stream )
+		return;
+	clear_frames( stream );
+	jsonPushParserFree( stream->parser );
+	free( stream->frames );
+	free( stream );
+}
+
+/**
+	@brief Free every container on the stack.
+	@param stream Pointer to the osrfMessageStream.
+*/
+static void clear_frames( osrfMessageStream* stream ) {
+	while( stream->depth > 0 ) {
+		stream_frame* frame = &stream->frames[ --stream->depth ];
+		jsonObjectFree( frame->obj );
+		jsonObjectFree( frame->class_obj );
+		jsonObjectFree( frame->payload );
+		free( frame->key );
+	}
+}
+
+/**
+	@brief Push a new array or hash onto the stack.
+	@param stream Pointer to the osrfMessageStream.
+	@param obj Pointer to the new, empty container.
+	@return Zero, to tell the JSONPushParser to carry on.
+*/
+static int begin_container( osrfMessageStream* stream, jsonObject* obj ) {
+
+	// Work out where the container lies on the path to the rows
+	int level = LEVEL_NONE;
+	if( 0 == stream->depth ) {
+		if( JSON_ARRAY == obj->type )
+			level = LEVEL_ARRAY;
+	} else {
+		const stream_frame* parent = &stream->frames[ stream->depth - 1 ];
+		const char* key = parent->key;
+		switch( parent->level ) {
+			case LEVEL_ARRAY :
+				if( JSON_HASH == obj->type )
+					level = LEVEL_MESSAGE;
+				break;
+			case LEVEL_MESSAGE :
+				if( key && !strcmp( key, JSON_DATA_KEY ) )
+					level = LEVEL_BODY;
+				break;
+			case LEVEL_BODY :
+				if( key && !strcmp( key, "payload" ) )
+					level = LEVEL_PAYLOAD;
+				break;
+			case LEVEL_PAYLOAD :
+				if( key && !strcmp( key, JSON_DATA_KEY ) )
+					level = LEVEL_CONTENTS;
+				break;
+			case LEVEL_CONTENTS :
+				if( key && !strcmp( key, "content" ) && JSON_ARRAY == obj->type
+						&& stream->on_row )
+					level = LEVEL_ROWS;
+				break;
+			default :
+				break;
+		}
+	}
+
+	if( stream->depth == stream->capacity ) {
+		stream->capacity *= 2;
+		stream_frame* frames = realloc( stream->frames,
+				stream->capacity * sizeof( stream_frame ) );
+		if( !frames ) {
+			perror( "osrfMessageStream: Out of Memory" );
+			exit( 99 );
+		}
+		stream->frames = frames;
+	}
+
+	stream_frame* frame = &stream->frames[ stream->depth++ ];
+	frame->obj = obj;
+	frame->key = NULL;
+	frame->class_obj = NULL;
+	frame->payload = NULL;
+	frame->level = level;
+	return 0;
+}
+
+/**
+	@brief Pop a finished array or hash off the stack, and put it where it belongs.
+	@param stream Pointer to the osrfMessageStream.
+	@return Zero, to tell the JSONPushParser to carry on.
+
+	A hash with a class name becomes its payload, with the class name attached, as
+	jsonObjectDecodeClass() would make of it.  As there, a class name without a payload
+	yields a JSON null, and other keys alongside the class name are dropped.
+*/
+static int end_container( osrfMessageStream* stream ) {
+	if( 0 == stream->depth )
+		return 0;     // Can't happen; the parser matches brackets for us
+
+	stream_frame frame = stream->frames[ --stream->depth ];
+	jsonObject* value = frame.obj;
+	free( frame.key );
+
+	if( frame.class_obj ) {
+		if( frame.payload ) {
+			value = frame.payload;
+			jsonObjectSetClass( value, jsonObjectGetString( frame.class_obj ) );
+		} else
+			value = jsonNewObject( NULL );
+		jsonObjectFree( frame.obj );
+		jsonObjectFree( frame.class_obj );
+	} else if( frame.payload )
+		jsonObjectSetKey( value, JSON_DATA_KEY, frame.payload );   // Just another key
+
+	add_value( stream, value );
+	return 0;
+}
+
+/**
+	@brief Put a finished value where it belongs.
+	@param stream Pointer to the osrfMessageStream.
+	@param value Pointer to the value, which we take over.
+
+	A message goes to the message callback, a row to the row callback, and anything else
+	into its parent.
+*/
+static void add_value( osrfMessageStream* stream, jsonObject* value ) {
+
+	if( 0 == stream->depth ) {
+		// The outer array, emptied as we went; or something that was never an array
+		jsonObjectFree( value );
+		return;
+	}
+
+	stream_frame* parent = &stream->frames[ stream->depth - 1 ];
+
+	if( LEVEL_ARRAY == parent->level ) {
+		osrfMessage* msg = osrfMessageFromJSON( value );
+		jsonObjectFree( value );
+		if( msg ) {
+			if( stream->on_message )
+				stream->on_message( stream->blob, stream->index, msg );
+			else
+				osrfMessageFree( msg );
+		}
+		++stream->index;
+	} else if( LEVEL_ROWS == parent->level ) {
+		stream->on_row( stream->blob, stream->index, value );
+	} else if( JSON_HASH == parent->obj->type ) {
+		char* key = parent->key;
+		parent->key = NULL;
+		if( !key )
+			jsonObjectFree( value );    // Can't happen; the parser insists on keys
+		else if( !strcmp( key, JSON_CLASS_KEY ) ) {
+			jsonObjectFree( parent->class_obj );
+			parent->class_obj = value;
+		} else if( !strcmp( key, JSON_DATA_KEY ) ) {
+			jsonObjectFree( parent->payload );
+			parent->payload = value;
+		} else
+			jsonObjectSetKey( parent->obj, key, value );
+		free( key );
+	} else
+		jsonObjectPush( parent->obj, value );
+}
+
+// -------- Callbacks for the JSONPushParser --------------------------
+
+static int handle_string( void* blob, const char* str ) {
+	add_value( (osrfMessageStream*) blob, jsonNewObject( str ) );
+	return 0;
+}
+
+static int handle_number( void* blob, const char* str ) {
+	add_value( (osrfMessageStream*) blob, jsonNewNumberStringObject( str ) );
+	return 0;
+}
+
+static int handle_begin_array( void* blob ) {
+	return begin_container( (osrfMessageStream*) blob, jsonNewObjectType( JSON_ARRAY ) );
+}
+
+static int handle_begin_obj( void* blob ) {
+	return begin_container( (osrfMessageStream*) blob, jsonNewObjectType( JSON_HASH ) );
+}
+
+static int handle_obj_key( void* blob, const char* key ) {
+	osrfMessageStream* stream = (osrfMessageStream*) blob;
+	if( stream->depth > 0 ) {
+		stream_frame* frame = &stream->frames[ stream->depth - 1 ];
+		free( frame->key );
+		frame->key = strdup( key );
+	}
+	return 0;
+}
+
+static int handle_end( void* blob ) {
+	return end_container( (osrfMessageStream*) blob );
+}
+
+static int handle_bool( void* blob, int b ) {
+	add_value( (osrfMessageStream*) blob, jsonNewBoolObject( b ) );
+	return 0;
+}
+
+static int handle_null( void* blob ) {
+	add_value( (osrfMessageStream*) blob, jsonNewObject( NULL ) );
+	return 0;
+}
+
+static void handle_error( void* blob, const char* msg, unsigned line, unsigned pos ) {
+	osrfMessageStream* stream = (osrfMessageStream*) blob;
+	stream->error = 1;
+	osrfLogWarning( OSRF_LOG_MARK, "osrfMessageStream: invalid JSON at line %u, "
+		"position %u: %s", line, pos, msg );
+}
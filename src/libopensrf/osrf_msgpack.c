@@ -0,0 +1,744 @@
+/**
+	@file osrf_msgpack.c
+	@brief Translate jsonObjects to and from MessagePack, and MessagePack to and from text.
+
+	We write the smallest encoding MessagePack allows for each value, and read any
+	encoding of the types the JSON data model has.  Binary strings are read as strings;
+	extension types aren't read at all.
+
+	See https://github.com/msgpack/msgpack/blob/master/spec.md for the format.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <opensrf/utils.h>
+#include <opensrf/log.h>
+#include <opensrf/osrf_msgpack.h>
+
+/** @brief How deeply MessagePack may nest before we refuse to read it. */
+#define MSGPACK_MAX_DEPTH 512
+
+/**
+	@brief The state of a read through MessagePack.
+*/
+typedef struct {
+	const unsigned char* p;     /**< The next byte to read. */
+	const unsigned char* end;   /**< Just past the last byte. */
+	growing_buffer* scratch;    /**< For giving strings a terminal nul. */
+} msgpack_reader;
+
+static char* msgpack_text( const unsigned char* data, size_t len );
+static void write_value( growing_buffer* buf, const jsonObject* obj );
+static jsonObject* read_value( msgpack_reader* reader, int depth );
+
+// -------- Writing ---------------------------------------------------
+
+/**
+	@brief Append a type byte and a big-endian unsigned value of a given width.
+	@param buf Pointer to the growing_buffer.
+	@param type The type byte.
+	@param value The value.
+	@param width How many bytes of @a value to write: 0, 1, 2, 4 or 8.
+*/
+static void write_head( growing_buffer* buf, unsigned char type, uint64_t value, int width ) {
+	char bytes[ 9 ];
+	bytes[ 0 ] = (char) type;
+	int i;
+	for( i = width; i > 0; --i ) {
+		bytes[ i ] = (char) ( value & 0xFF );
+		value >>= 8;
+	}
+	buffer_add_n( buf, bytes, width + 1 );
+}
+
+/**
+	@brief Append the header of a string, array or map of a given size.
+	@param buf Pointer to the growing_buffer.
+	@param n The length of the string, or the number of elements or pairs.
+	@param fix The type byte of the "fix" form, which holds @a n itself.
+	@param fix_max The largest @a n the "fix" form holds.
+	@param type8 The type byte of the form with an 8-bit length, or zero if there is none.
+	@param type16 The type byte of the form with a 16-bit length.
+
+	The form with a 32-bit length always follows the one with a 16-bit length.
+*/
+static void write_size( growing_buffer* buf, size_t n, unsigned char fix, size_t fix_max,
+		unsigned char type8, unsigned char type16 ) {
+	if( n <= fix_max )
+		write_head( buf, fix | (unsigned char) n, 0, 0 );
+	else if( type8 && n <= 0xFF )
+		write_head( buf, type8, n, 1 );
+	else if( n <= 0xFFFF )
+		write_head( buf, type16, n, 2 );
+	else
+		write_head( buf, type16 + 1, n, 4 );
+}
+
+/**
+	@brief Append a string.
+	@param buf Pointer to the growing_buffer.
+	@param s Pointer to the string.
+*/
+static void write_string( growing_buffer* buf, const char* s ) {
+	size_t len = strlen( s );
+	write_size( buf, len, 0xA0, 31, 0xD9, 0xDA );
+	buffer_add_n( buf, s, len );
+}
+
+/**
+	@brief Append an integer, in the fewest bytes that hold it.
+	@param buf Pointer to the growing_buffer.
+	@param value The integer.
+*/
+static void write_integer( growing_buffer* buf, long long value ) {
+	if( value >= 0 ) {
+		uint64_t v = (uint64_t) value;
+		if( v < 0x80 )
+			write_head( buf, (unsigned char) v, 0, 0 );
+		else if( v <= 0xFF )
+			write_head( buf, 0xCC, v, 1 );
+		else if( v <= 0xFFFF )
+			write_head( buf, 0xCD, v, 2 );
+		else if( v <= 0xFFFFFFFFULL )
+			write_head( buf, 0xCE, v, 4 );
+		else
+			write_head( buf, 0xCF, v, 8 );
+	} else {
+		uint64_t v = (uint64_t) value;
+		if( value >= -32 )
+			write_head( buf, (unsigned char) value, 0, 0 );
+		else if( value >= -128 )
+			write_head( buf, 0xD0, v, 1 );
+		else if( value >= -32768 )
+			write_head( buf, 0xD1, v, 2 );
+		else if( value >= -2147483648LL )
+			write_head( buf, 0xD2, v, 4 );
+		else
+			write_head( buf, 0xD3, v, 8 );
+	}
+}
+
+/**
+	@brief Append a JSON_NUMBER: as an integer if its string is one, or as a double.
+	@param buf Pointer to the growing_buffer.
+	@param s The string of the JSON_NUMBER; NULL is the equivalent of zero.
+*/
+static void write_number( growing_buffer* buf, const char* s ) {
+	if( !s ) {
+		write_integer( buf, 0 );
+		return;
+	}
+
+	const char* p = ( '-' == *s ) ? s + 1 : s;
+	const char* digits = p;
+	while( *p >= '0' && *p <= '9' )
+		++p;
+
+	if( !*p && p > digits ) {
+		errno = 0;
+		long long value = strtoll( s, NULL, 10 );
+		if( 0 == errno && !( 0 == value && '-' == *s )) {   // keep "-0" a double
+			write_integer( buf, value );
+			return;
+		}
+		if( *s != '-' ) {
+			errno = 0;
+			unsigned long long uvalue = strtoull( s, NULL, 10 );
+			if( 0 == errno ) {
+				write_head( buf, 0xCF, uvalue, 8 );
+				return;
+			}
+		}
+	}
+
+	union {
+		double d;
+		uint64_t u;
+	} num;
+	num.d = strtod( s, NULL );
+	if( isfinite( num.d ) )
+		write_head( buf, 0xCB, num.u, 8 );
+	else
+		write_string( buf, s );     // Too big for a double; keep the digits, at least
+}
+
+/**
+	@brief Append a jsonObject, with its class name if it has one.
+	@param buf Pointer to the growing_buffer.
+	@param obj Pointer to the jsonObject; NULL is written as nil.
+*/
+static void write_value( growing_buffer* buf, const jsonObject* obj ) {
+	if( !obj ) {
+		write_head( buf, 0xC0, 0, 0 );
+		return;
+	}
+
+	if( obj->classname ) {
+		write_size( buf, 2, 0x80, 15, 0, 0xDE );
+		write_string( buf, JSON_CLASS_KEY );
+		write_string( buf, obj->classname );
+		write_string( buf, JSON_DATA_KEY );
+	}
+
+	switch( obj->type ) {
+		case JSON_NULL :
+			write_head( buf, 0xC0, 0, 0 );
+			break;
+
+		case JSON_BOOL :
+			write_head( buf, obj->value.b ? 0xC3 : 0xC2, 0, 0 );
+			break;
+
+		case JSON_NUMBER :
+			write_number( buf, obj->value.s );
+			break;
+
+		case JSON_STRING :
+			write_string( buf, obj->value.s ? obj->value.s : "" );
+			break;
+
+		case JSON_ARRAY : {
+			const osrfList* list = obj->value.l;
+			unsigned int count = list ? list->size : 0;
+			write_size( buf, count, 0x90, 15, 0, 0xDC );
+			unsigned int i;
+			for( i = 0; i < count; ++i )
+				write_value( buf, OSRF_LIST_GET_INDEX( list, i ));
+			break;
+		}
+
+		case JSON_HASH : {
+			// Like an osrfHashIterator, stop at the first NULL item
+			osrfHashCursor cursor = NULL;
+			const char* key;
+			size_t count = 0;
+			while( osrfHashCursorNext( obj->value.h, &cursor, &key ) )
+				++count;
+
+			write_size( buf, count, 0x80, 15, 0, 0xDE );
+			const jsonObject* item;
+			cursor = NULL;
+			while( (item = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+				write_string( buf, key );
+				write_value( buf, item );
+			}
+			break;
+		}
+
+		default :
+			write_head( buf, 0xC0, 0, 0 );
+			break;
+	}
+}
+
+/**
+	@brief Translate a jsonObject into MessagePack.
+	@param obj Pointer to the jsonObject.
+	@param len Pointer to a size_t to receive the length of the result.  May be NULL.
+	@return Pointer to the MessagePack, or NULL if @a obj is NULL.
+
+	The result is binary, and may contain nul bytes; there is an extra nul past the end.
+
+	The calling code is responsible for freeing the result.
+*/
+char* jsonObjectToMsgpack( const jsonObject* obj, size_t* len ) {
+	if( !obj )
+		return NULL;
+
+	growing_buffer* buf = buffer_init( 256 );
+	write_value( buf, obj );
+	if( len )
+		*len = buffer_length( buf );
+	return buffer_release( buf );
+}
+
+/**
+	@brief Append the MessagePack for a jsonObject to a buffer.
+	@param buf Pointer to the growing_buffer.
+	@param obj Pointer to the jsonObject; NULL is packed as nil.
+
+	For building up a series of values, to be sent together by osrfMsgpackArrayText().
+*/
+void jsonObjectAppendMsgpack( growing_buffer* buf, const jsonObject* obj ) {
+	if( buf )
+		write_value( buf, obj );
+}
+
+// -------- Reading ---------------------------------------------------
+
+/**
+	@brief Read a big-endian unsigned value of a given width.
+	@param reader Pointer to the msgpack_reader.
+	@param width How many bytes to read: 1, 2, 4 or 8.
+	@param value Pointer to a uint64_t to receive the value.
+	@return 0 if successful, or -1 if the MessagePack ends too soon.
+*/
+static int read_uint( msgpack_reader* reader, int width, uint64_t* value ) {
+	if( reader->end - reader->p < width )
+		return -1;
+	uint64_t v = 0;
+	int i;
+	for( i = 0; i < width; ++i )
+		v = ( v << 8 ) | *reader->p++;
+	*value = v;
+	return 0;
+}
+
+/**
+	@brief Read a string of a given length, and give it a terminal nul.
+	@param reader Pointer to the msgpack_reader.
+	@param len The length of the string.
+	@return Pointer to the string, in the reader's scratch buffer, or NULL if the
+		MessagePack ends too soon.
+
+	The string is good only until the next string is read.
+*/
+static const char* read_chars( msgpack_reader* reader, uint64_t len ) {
+	if( (uint64_t) ( reader->end - reader->p ) < len )
+		return NULL;
+	buffer_reset( reader->scratch );
+	buffer_add_n( reader->scratch, (const char*) reader->p, (size_t) len );
+	reader->p += len;
+	return OSRF_BUFFER_C_STR( reader->scratch );
+}
+
+/**
+	@brief Read a string of any encoding, as a map key must be.
+	@param reader Pointer to the msgpack_reader.
+	@return Pointer to the string, in the reader's scratch buffer, or NULL if the next
+		value isn't a string.
+*/
+static const char* read_key( msgpack_reader* reader ) {
+	if( reader->p >= reader->end )
+		return NULL;
+	unsigned char type = *reader->p++;
+	uint64_t len;
+
+	if( ( type & 0xE0 ) == 0xA0 )
+		len = type & 0x1F;
+	else if( 0xD9 == type || 0xC4 == type ) {
+		if( read_uint( reader, 1, &len ) )
+			return NULL;
+	} else if( 0xDA == type || 0xC5 == type ) {
+		if( read_uint( reader, 2, &len ) )
+			return NULL;
+	} else if( 0xDB == type || 0xC6 == type ) {
+		if( read_uint( reader, 4, &len ) )
+			return NULL;
+	} else
+		return NULL;
+
+	return read_chars( reader, len );
+}
+
+/**
+	@brief Read the elements of an array.
+	@param reader Pointer to the msgpack_reader.
+	@param count How many elements there are.
+	@param depth How deeply the array is nested.
+	@return Pointer to a JSON_ARRAY, or NULL if the MessagePack is invalid.
+*/
+static jsonObject* read_array( msgpack_reader* reader, uint64_t count, int depth ) {
+	// Each element takes at least a byte; don't believe a count that says otherwise
+	if( count > (uint64_t) ( reader->end - reader->p ) )
+		return NULL;
+
+	jsonObject* array = jsonNewObjectType( JSON_ARRAY );
+	uint64_t i;
+	for( i = 0; i < count; ++i ) {
+		jsonObject* item = read_value( reader, depth + 1 );
+		if( !item ) {
+			jsonObjectFree( array );
+			return NULL;
+		}
+		jsonObjectPush( array, item );
+	}
+	return array;
+}
+
+/**
+	@brief Read the pairs of a map, decoding a class name as jsonObjectDecodeClass() does.
+	@param reader Pointer to the msgpack_reader.
+	@param count How many pairs there are.
+	@param depth How deeply the map is nested.
+	@return Pointer to the jsonObject, or NULL if the MessagePack is invalid.
+
+	A map with a class name becomes its payload, with the class name attached.  A class
+	name without a payload yields a JSON null, and other keys alongside the class name
+	are dropped.
+*/
+static jsonObject* read_map( msgpack_reader* reader, uint64_t count, int depth ) {
+	if( count > (uint64_t) ( reader->end - reader->p ) / 2 )
+		return NULL;
+
+	jsonObject* hash = jsonNewObjectType( JSON_HASH );
+	jsonObject* class_obj = NULL;
+	jsonObject* payload = NULL;
+	uint64_t i;
+	for( i = 0; i < count; ++i ) {
+		const char* scratch_key = read_key( reader );
+		if( !scratch_key )
+			break;
+
+		// Reading the value reuses the scratch buffer, so copy the key out of it first;
+		// nearly all keys are short enough to copy onto the stack
+		char short_key[ 64 ];
+		size_t key_len = buffer_length( reader->scratch );
+		char* key = short_key;
+		if( key_len < sizeof( short_key ) )
+			memcpy( short_key, scratch_key, key_len + 1 );
+		else
+			key = strdup( scratch_key );
+
+		jsonObject* item = read_value( reader, depth + 1 );
+		if( !item ) {
+			if( key != short_key )
+				free( key );
+			break;
+		}
+
+		if( !strcmp( key, JSON_CLASS_KEY ) ) {
+			jsonObjectFree( class_obj );
+			class_obj = item;
+		} else if( !strcmp( key, JSON_DATA_KEY ) ) {
+			jsonObjectFree( payload );
+			payload = item;
+		} else
+			jsonObjectSetKey( hash, key, item );
+		if( key != short_key )
+			free( key );
+	}
+
+	if( i < count ) {
+		jsonObjectFree( hash );
+		jsonObjectFree( class_obj );
+		jsonObjectFree( payload );
+		return NULL;
+	}
+
+	if( class_obj ) {
+		jsonObject* value = payload ? payload : jsonNewObject( NULL );
+		if( payload )
+			jsonObjectSetClass( value, jsonObjectGetString( class_obj ));
+		jsonObjectFree( hash );
+		jsonObjectFree( class_obj );
+		return value;
+	} else if( payload )
+		jsonObjectSetKey( hash, JSON_DATA_KEY, payload );   // Just another key
+
+	return hash;
+}
+
+/**
+	@brief Turn an integer into a JSON_NUMBER.
+	@param value The integer.
+	@param is_signed Boolean: true if @a value holds a signed integer.
+	@return Pointer to a new JSON_NUMBER.
+*/
+static jsonObject* new_integer( uint64_t value, int is_signed ) {
+	// Write the digits backwards from the end of the buffer; this is hot enough that
+	// snprintf() shows up in profiles
+	char str[ 24 ];
+	char* p = str + sizeof( str ) - 1;
+	*p = '\0';
+	int negative = is_signed && (int64_t) value < 0;
+	if( negative )
+		value = 0 - value;
+	do {
+		*--p = (char) ( '0' + value % 10 );
+		value /= 10;
+	} while( value );
+	if( negative )
+		*--p = '-';
+	return jsonNewNumberStringObject( p );
+}
+
+/**
+	@brief Read a value of any type.
+	@param reader Pointer to the msgpack_reader.
+	@param depth How deeply the value is nested.
+	@return Pointer to the value as a jsonObject, or NULL if the MessagePack is invalid.
+*/
+static jsonObject* read_value( msgpack_reader* reader, int depth ) {
+	if( depth > MSGPACK_MAX_DEPTH || reader->p >= reader->end )
+		return NULL;
+
+	unsigned char type = *reader->p;
+	uint64_t n;
+
+	if( type < 0x80 ) {
+		++reader->p;
+		return new_integer( type, 0 );
+	} else if( type >= 0xE0 ) {
+		++reader->p;
+		return new_integer( (uint64_t) (int64_t) (signed char) type, 1 );
+	} else if( ( type & 0xF0 ) == 0x80 ) {
+		++reader->p;
+		return read_map( reader, type & 0x0F, depth );
+	} else if( ( type & 0xF0 ) == 0x90 ) {
+		++reader->p;
+		return read_array( reader, type & 0x0F, depth );
+	} else if( ( type & 0xE0 ) == 0xA0 || ( type >= 0xC4 && type <= 0xC6 )
+			|| ( type >= 0xD9 && type <= 0xDB ) ) {
+		const char* str = read_key( reader );
+		return str ? jsonNewObject( str ) : NULL;
+	}
+
+	++reader->p;
+	switch( type ) {
+		case 0xC0 :
+			return jsonNewObject( NULL );
+		case 0xC2 :
+			return jsonNewBoolObject( 0 );
+		case 0xC3 :
+			return jsonNewBoolObject( 1 );
+
+		case 0xCA : {     // float 32
+			union {
+				float f;
+				uint32_t u;
+			} num;
+			if( read_uint( reader, 4, &n ) )
+				return NULL;
+			num.u = (uint32_t) n;
+			return jsonNewNumberObject( num.f );
+		}
+		case 0xCB : {     // float 64
+			union {
+				double d;
+				uint64_t u;
+			} num;
+			if( read_uint( reader, 8, &n ) )
+				return NULL;
+			num.u = n;
+			return jsonNewNumberObject( num.d );
+		}
+
+		case 0xCC :
+			return read_uint( reader, 1, &n ) ? NULL : new_integer( n, 0 );
+		case 0xCD :
+			return read_uint( reader, 2, &n ) ? NULL : new_integer( n, 0 );
+		case 0xCE :
+			return read_uint( reader, 4, &n ) ? NULL : new_integer( n, 0 );
+		case 0xCF :
+			return read_uint( reader, 8, &n ) ? NULL : new_integer( n, 0 );
+
+		case 0xD0 :
+			return read_uint( reader, 1, &n ) ? NULL
+				: new_integer( (uint64_t) (int64_t) (int8_t) n, 1 );
+		case 0xD1 :
+			return read_uint( reader, 2, &n ) ? NULL
+				: new_integer( (uint64_t) (int64_t) (int16_t) n, 1 );
+		case 0xD2 :
+			return read_uint( reader, 4, &n ) ? NULL
+				: new_integer( (uint64_t) (int64_t) (int32_t) n, 1 );
+		case 0xD3 :
+			return read_uint( reader, 8, &n ) ? NULL : new_integer( n, 1 );
+
+		case 0xDC :
+			return read_uint( reader, 2, &n ) ? NULL : read_array( reader, n, depth );
+		case 0xDD :
+			return read_uint( reader, 4, &n ) ? NULL : read_array( reader, n, depth );
+		case 0xDE :
+			return read_uint( reader, 2, &n ) ? NULL : read_map( reader, n, depth );
+		case 0xDF :
+			return read_uint( reader, 4, &n ) ? NULL : read_map( reader, n, depth );
+
+		default :         // Extension types, and the one byte that's never used
+			return NULL;
+	}
+}
+
+/**
+	@brief Translate MessagePack into a jsonObject.
+	@param data Pointer to the MessagePack.
+	@param len Length of the MessagePack.
+	@return Pointer to the jsonObject, with its class names decoded as by jsonParse(), or
+		NULL if the MessagePack is invalid, or holds anything but a single value.
+
+	The calling code is responsible for freeing the result by calling jsonObjectFree().
+*/
+jsonObject* jsonMsgpackToObject( const char* data, size_t len ) {
+	if( !data )
+		return NULL;
+
+	msgpack_reader reader;
+	reader.p = (const unsigned char*) data;
+	reader.end = reader.p + len;
+	reader.scratch = buffer_init( 64 );
+
+	jsonObject* obj = read_value( &reader, 0 );
+	if( obj && reader.p != reader.end ) {
+		jsonObjectFree( obj );
+		obj = NULL;
+	}
+
+	buffer_free( reader.scratch );
+	if( !obj )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to read %lu bytes of MessagePack",
+			(unsigned long) len );
+	return obj;
+}
+
+// -------- Text form -------------------------------------------------
+
+/** @brief The base64 alphabet. */
+static const char base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+	@brief Translate a jsonObject into MessagePack, encoded as base64 behind
+		OSRF_MSGPACK_PREFIX.
+	@param obj Pointer to the jsonObject.
+	@return Pointer to the text, or NULL if @a obj is NULL.
+
+	The calling code is responsible for freeing the result.
+*/
+char* jsonObjectToMsgpackText( const jsonObject* obj ) {
+	size_t len;
+	char* data = jsonObjectToMsgpack( obj, &len );
+	if( !data )
+		return NULL;
+
+	char* text = msgpack_text( (const unsigned char*) data, len );
+	free( data );
+	return text;
+}
+
+/**
+	@brief Wrap a series of packed values as an array, in the text form of MessagePack.
+	@param items Pointer to the values, as from jsonObjectAppendMsgpack().
+	@param len Length of @a items, in bytes.
+	@param count How many values @a items holds.
+	@return Pointer to the text.
+
+	The result is the same as jsonObjectToMsgpackText() would make of a JSON_ARRAY of the
+	values, without their being unpacked or packed again.
+
+	The calling code is responsible for freeing the result.
+*/
+char* osrfMsgpackArrayText( const char* items, size_t len, size_t count ) {
+	growing_buffer* buf = buffer_init( len + 8 );
+	write_size( buf, count, 0x90, 15, 0, 0xDC );
+	if( items )
+		buffer_add_n( buf, items, len );
+	char* text = msgpack_text( (const unsigned char*) buf->buf, buffer_length( buf ));
+	buffer_free( buf );
+	return text;
+}
+
+/**
+	@brief Encode MessagePack as base64 behind OSRF_MSGPACK_PREFIX.
+	@param data Pointer to the MessagePack.
+	@param len Its length, in bytes.
+	@return Pointer to the text, which the caller must free.
+*/
+static char* msgpack_text( const unsigned char* data, size_t len ) {
+	size_t prefix_len = sizeof( OSRF_MSGPACK_PREFIX ) - 1;
+	char* text = safe_malloc( prefix_len + ( len + 2 ) / 3 * 4 + 1 );
+	memcpy( text, OSRF_MSGPACK_PREFIX, prefix_len );
+	char* out = text + prefix_len;
+
+	size_t i;
+	for( i = 0; i + 2 < len; i += 3 ) {
+		uint32_t v = ( data[ i ] << 16 ) | ( data[ i + 1 ] << 8 ) | data[ i + 2 ];
+		*out++ = base64_chars[ ( v >> 18 ) & 0x3F ];
+		*out++ = base64_chars[ ( v >> 12 ) & 0x3F ];
+		*out++ = base64_chars[ ( v >> 6 ) & 0x3F ];
+		*out++ = base64_chars[ v & 0x3F ];
+	}
+	if( i < len ) {
+		uint32_t v = data[ i ] << 16;
+		if( i + 1 < len )
+			v |= data[ i + 1 ] << 8;
+		*out++ = base64_chars[ ( v >> 18 ) & 0x3F ];
+		*out++ = base64_chars[ ( v >> 12 ) & 0x3F ];
+		*out++ = ( i + 1 < len ) ? base64_chars[ ( v >> 6 ) & 0x3F ] : '=';
+		*out++ = '=';
+	}
+	*out = '\0';
+	return text;
+}
+
+/**
+	@brief Tell whether a string is MessagePack in text form.
+	@param text The string.
+	@return 1 if it begins with OSRF_MSGPACK_PREFIX, or 0 if not.
+*/
+int jsonIsMsgpackText( const char* text ) {
+	return text && !strncmp( text, OSRF_MSGPACK_PREFIX, sizeof( OSRF_MSGPACK_PREFIX ) - 1 );
+}
+
+/**
+	@brief Get the value of a base64 digit.
+	@param c The digit.
+	@return Its value, or -1 if it isn't a base64 digit.
+*/
+static int base64_value( unsigned char c ) {
+	if( c >= 'A' && c <= 'Z' )
+		return c - 'A';
+	else if( c >= 'a' && c <= 'z' )
+		return c - 'a' + 26;
+	else if( c >= '0' && c <= '9' )
+		return c - '0' + 52;
+	else if( '+' == c )
+		return 62;
+	else if( '/' == c )
+		return 63;
+	else
+		return -1;
+}
+
+/**
+	@brief Translate MessagePack in text form into a jsonObject.
+	@param text The text: OSRF_MSGPACK_PREFIX, then the MessagePack encoded as base64.
+	@return Pointer to the jsonObject, with its class names decoded as by jsonParse(), or
+		NULL if the text is invalid.
+
+	The calling code is responsible for freeing the result by calling jsonObjectFree().
+*/
+jsonObject* jsonMsgpackTextToObject( const char* text ) {
+	if( !jsonIsMsgpackText( text ) )
+		return NULL;
+
+	const unsigned char* in = (const unsigned char*) text + sizeof( OSRF_MSGPACK_PREFIX ) - 1;
+	size_t in_len = strlen( (const char*) in );
+	if( in_len % 4 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "MessagePack text has a partial base64 group" );
+		return NULL;
+	}
+
+	unsigned char* data = safe_malloc( in_len / 4 * 3 + 1 );
+	size_t len = 0;
+	size_t i;
+	for( i = 0; i < in_len; i += 4 ) {
+		int pad = 0;
+		uint32_t v = 0;
+		int j;
+		for( j = 0; j < 4; ++j ) {
+			int digit;
+			if( '=' == in[ i + j ] && i + 4 == in_len && j >= 2 ) {
+				digit = 0;
+				++pad;
+			} else if( pad || ( digit = base64_value( in[ i + j ] )) < 0 ) {
+				osrfLogWarning( OSRF_LOG_MARK, "MessagePack text isn't valid base64" );
+				free( data );
+				return NULL;
+			}
+			v = ( v << 6 ) | (uint32_t) digit;
+		}
+		data[ len++ ] = ( v >> 16 ) & 0xFF;
+		if( pad < 2 )
+			data[ len++ ] = ( v >> 8 ) & 0xFF;
+		if( pad < 1 )
+			data[ len++ ] = v & 0xFF;
+	}
+
+	jsonObject* obj = jsonMsgpackToObject( (const char*) data, len );
+	free( data );
+	return obj;
+}
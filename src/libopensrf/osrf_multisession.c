@@ -0,0 +1,487 @@
+/**
+	@file osrf_multisession.c
+	@brief Keep many client requests in flight at once, and wait on them together.
+
+	osrfAppSessionRequestRecv() waits on one request at a time, so a client that needs
+	answers from several services asks them one after another.  An osrfMultiSession lets
+	it ask them all at once.  Each request goes out over an osrfAppSession of its own;
+	but since all of a process's client sessions share one transport connection, a single
+	call to osrf_stack_process_ms() reads the responses to all of them.  After each read
+	we visit the pending requests and hand on whatever has been queued for them.
+
+	Finished sessions are kept, per service, and reused for later requests, so that a
+	long-running fan-out doesn't build and tear down a session for every call.  Only
+	sessions whose requests finished cleanly are reused; one that timed out may still
+	receive a late response, and is freed instead.
+
+	Callbacks run from within osrfMultiSessionWait().  They may submit further requests,
+	but must not wait on, or free, the osrfMultiSession that called them.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "opensrf/utils.h"
+#include "opensrf/log.h"
+#include "opensrf/osrf_stack.h"
+#include "opensrf/osrf_system.h"
+#include "opensrf/osrf_app_session.h"
+#include "opensrf/osrf_multisession.h"
+
+/** Default number of milliseconds to wait for each response. */
+#define OSRF_MULTI_TIMEOUT 60000
+
+static void send_waiting( osrfMultiSession* ms );
+static void send_request( osrfMultiSession* ms, osrfMultiRequest* req );
+static void fail_request( osrfMultiRequest* req, int status_code, const char* text );
+static void collect( osrfMultiSession* ms );
+static void finish_request( osrfMultiSession* ms, osrfMultiRequest* req );
+static void free_session_list( char* key, void* item );
+
+/**
+	@brief Create an osrfMultiSession.
+	@param max_pending Most requests to have in flight at once; zero or less for no limit.
+	@return Pointer to the new osrfMultiSession.
+
+	Requests beyond @a max_pending are held back, in the order submitted, until earlier
+	ones finish.  The caller is responsible for freeing the osrfMultiSession by calling
+	osrfMultiSessionFree().
+*/
+osrfMultiSession* osrfMultiSessionInit( int max_pending ) {
+	osrfMultiSession* ms = safe_malloc( sizeof( osrfMultiSession ) );
+	ms->max_pending = max_pending > 0 ? max_pending : 0;
+	ms->timeout = OSRF_MULTI_TIMEOUT;
+	ms->next_id = 1;
+	ms->idle = osrfNewHash();
+	osrfHashSetCallback( ms->idle, free_session_list );
+	return ms;
+}
+
+/**
+	@brief Set the timeout for requests submitted from now on.
+	@param ms Pointer to the osrfMultiSession.
+	@param timeout_ms How many milliseconds to wait, between responses, before giving up.
+
+	As with osrfAppSessionRequestRecv(), a CONTINUE status from the server restarts the
+	clock, as does each response.
+*/
+void osrfMultiSessionSetTimeout( osrfMultiSession* ms, int timeout_ms ) {
+	if( ms && timeout_ms >= 0 )
+		ms->timeout = timeout_ms;
+}
+
+/**
+	@brief Set the locale for requests sent from now on.
+	@param ms Pointer to the osrfMultiSession.
+	@param locale The locale, such as "en-US", or NULL for the default.
+*/
+void osrfMultiSessionSetLocale( osrfMultiSession* ms, const char* locale ) {
+	if( !ms )
+		return;
+	free( ms->locale );
+	ms->locale = locale ? strdup( locale ) : NULL;
+}
+
+/**
+	@brief Submit a request.
+	@param ms Pointer to the osrfMultiSession.
+	@param service Name of the service to call.
+	@param method Name of the method to call.
+	@param params Parameters of the call: normally a JSON array, or NULL for none.
+	@param on_response Callback for each response, or NULL to collect them with the request.
+	@param on_complete Callback for the finished request, or NULL to queue it instead.
+	@param userData Whatever the caller wants to keep with the request.
+	@return Pointer to the new osrfMultiRequest, or NULL if an argument is missing.
+
+	The request is sent at once, unless max_pending requests are already in flight.  If it
+	can't be sent, it finishes with a failing status code on the next wait, like any other.
+
+	The osrfMultiSession owns the request.  It is freed after @a on_complete returns; or,
+	if there is no @a on_complete, by the caller, once osrfMultiSessionNextComplete() has
+	returned it.
+*/
+osrfMultiRequest* osrfMultiSessionRequest( osrfMultiSession* ms, const char* service,
+		const char* method, const jsonObject* params, osrfMultiResponseHandler on_response,
+		osrfMultiCompleteHandler on_complete, void* userData ) {
+
+	if( !ms || !service || !method ) {
+		osrfLogWarning( OSRF_LOG_MARK, "osrfMultiSessionRequest(): missing %s",
+			ms ? ( service ? "method" : "service" ) : "multisession" );
+		return NULL;
+	}
+
+	osrfMultiRequest* req = safe_malloc( sizeof( osrfMultiRequest ) );
+	req->id          = ms->next_id++;
+	req->service     = strdup( service );
+	req->method      = strdup( method );
+	req->params      = params ? jsonObjectClone( params ) : NULL;
+	req->request_id  = -1;
+	req->timeout     = ms->timeout;
+	req->status_code = OSRF_STATUS_OK;
+	req->on_response = on_response;
+	req->on_complete = on_complete;
+	req->userData    = userData;
+	if( !on_response )
+		req->responses = jsonNewObjectType( JSON_ARRAY );
+
+	if( ms->waiting_tail )
+		ms->waiting_tail->next = req;
+	else
+		ms->waiting = req;
+	ms->waiting_tail = req;
+	ms->waiting_count++;
+
+	send_waiting( ms );
+	return req;
+}
+
+/**
+	@brief Send held-back requests, oldest first, as far as max_pending allows.
+	@param ms Pointer to the osrfMultiSession.
+*/
+static void send_waiting( osrfMultiSession* ms ) {
+	while( ms->waiting && ( !ms->max_pending || ms->pending_count < ms->max_pending ) ) {
+		osrfMultiRequest* req = ms->waiting;
+		ms->waiting = req->next;
+		if( !ms->waiting )
+			ms->waiting_tail = NULL;
+		ms->waiting_count--;
+		req->next = NULL;
+		send_request( ms, req );
+	}
+}
+
+/**
+	@brief Send a request over an idle session for its service, or over a new one.
+	@param ms Pointer to the osrfMultiSession.
+	@param req Pointer to the osrfMultiRequest, which goes onto the pending list either way.
+*/
+static void send_request( osrfMultiSession* ms, osrfMultiRequest* req ) {
+
+	req->prev = NULL;
+	req->next = ms->pending;
+	if( ms->pending )
+		ms->pending->prev = req;
+	ms->pending = req;
+	ms->pending_count++;
+
+	if( ms->transport_error ) {
+		fail_request( req, OSRF_STATUS_SERVICEUNAVAILABLE, "Transport error" );
+		return;
+	}
+
+	osrfAppSession* session = NULL;
+	osrfList* idle = osrfHashGet( ms->idle, req->service );
+	if( idle && idle->size )
+		session = osrfListPop( idle );
+	else
+		session = osrfAppSessionClientInit( req->service );
+
+	if( !session ) {
+		fail_request( req, OSRF_STATUS_SERVICEUNAVAILABLE, "Unable to open a session" );
+		return;
+	}
+	if( ms->locale )
+		osrf_app_session_set_locale( session, ms->locale );
+
+	int request_id = osrfAppSessionSendRequest( session, req->params, req->method, 1 );
+	if( request_id < 0 ) {
+		osrfAppSessionFree( session );
+		fail_request( req, OSRF_STATUS_SERVICEUNAVAILABLE, "Unable to send request" );
+		return;
+	}
+
+	osrfLogDebug( OSRF_LOG_MARK, "Multisession request %d sent to %s as %s [%d]",
+		req->id, req->service, session->session_id, request_id );
+
+	req->session = session;
+	req->request_id = request_id;
+	req->deadline = get_monotonic_millis() + req->timeout;
+	jsonObjectFree( req->params );
+	req->params = NULL;
+}
+
+/**
+	@brief Mark a pending request as finished with a failing status.
+	@param req Pointer to the osrfMultiRequest.
+	@param status_code The status code to report.
+	@param text Text to report with it.
+
+	The request stays on the pending list until collect() finishes it.
+*/
+static void fail_request( osrfMultiRequest* req, int status_code, const char* text ) {
+	if( req->complete )
+		return;
+	osrfLogWarning( OSRF_LOG_MARK, "Multisession request %d to %s %s failed: %d %s",
+		req->id, req->service, req->method, status_code, text ? text : "" );
+	req->complete = 1;
+	req->status_code = status_code;
+	free( req->status_text );
+	req->status_text = text ? strdup( text ) : NULL;
+}
+
+/**
+	@brief Wait once for input, and handle whatever arrives.
+	@param ms Pointer to the osrfMultiSession.
+	@param timeout_ms Most milliseconds to wait: zero not to wait, or negative to wait until
+	something arrives or some request times out.
+	@return The number of requests still outstanding, or -1 upon a transport error.
+
+	Stop waiting when any input arrives, or when the earliest pending deadline passes.
+	Then hand on the responses and finish the requests that are done.
+*/
+int osrfMultiSessionWait( osrfMultiSession* ms, int timeout_ms ) {
+	if( !ms )
+		return -1;
+
+	send_waiting( ms );
+	if( !ms->pending )
+		return osrfMultiSessionOutstanding( ms );
+
+	// Don't sleep past the earliest deadline, nor at all if something is already done
+	long long now = get_monotonic_millis();
+	long long wait = timeout_ms;
+	osrfMultiRequest* req;
+	for( req = ms->pending; req; req = req->next ) {
+		long long left = req->complete ? 0 : req->deadline - now;
+		if( left < 0 )
+			left = 0;
+		if( wait < 0 || left < wait )
+			wait = left;
+	}
+
+	if( !ms->transport_error ) {
+		transport_client* client = osrfSystemGetTransportClient();
+		if( osrf_stack_process_ms( client, (int) wait, NULL ) < 0 ) {
+			osrfLogError( OSRF_LOG_MARK, "Multisession lost its transport connection" );
+			ms->transport_error = 1;
+			for( req = ms->pending; req; req = req->next )
+				fail_request( req, OSRF_STATUS_SERVICEUNAVAILABLE, "Transport error" );
+		}
+	}
+
+	collect( ms );
+	send_waiting( ms );
+
+	// Without a connection, everything still outstanding fails at once
+	while( ms->transport_error && ms->pending ) {
+		collect( ms );
+		send_waiting( ms );
+	}
+
+	return ms->transport_error ? -1 : osrfMultiSessionOutstanding( ms );
+}
+
+/**
+	@brief Wait until every request has finished, or until a timeout.
+	@param ms Pointer to the osrfMultiSession.
+	@param timeout_ms Most milliseconds to wait in all, or negative for no limit.
+	@return The number of requests still outstanding, or -1 upon a transport error.
+*/
+int osrfMultiSessionRun( osrfMultiSession* ms, int timeout_ms ) {
+	if( !ms )
+		return -1;
+
+	long long deadline = get_monotonic_millis() + timeout_ms;
+	int outstanding = osrfMultiSessionOutstanding( ms );
+	while( outstanding > 0 ) {
+		long long left = -1;
+		if( timeout_ms >= 0 ) {
+			left = deadline - get_monotonic_millis();
+			if( left < 0 )
+				left = 0;
+		}
+
+		outstanding = osrfMultiSessionWait( ms, (int) left );
+		if( outstanding < 0 || left == 0 )
+			break;
+	}
+
+	return outstanding;
+}
+
+/**
+	@brief Hand on what has arrived for each pending request, and finish those that are done.
+	@param ms Pointer to the osrfMultiSession.
+*/
+static void collect( osrfMultiSession* ms ) {
+
+	long long now = get_monotonic_millis();
+	osrfMultiRequest* req = ms->pending;
+	while( req ) {
+		osrfMultiRequest* next = req->next;  // req may be gone before we move on
+
+		if( req->session && !req->complete ) {
+			int heard = osrfAppSessionRequestContinued( req->session, req->request_id );
+			osrfMessage* msg;
+			while( !req->complete &&
+					( msg = osrfAppSessionRequestNext( req->session, req->request_id ) ) ) {
+				heard = 1;
+				if( msg->is_exception ) {
+					fail_request( req, msg->status_code, msg->status_text );
+				} else {
+					const jsonObject* content = osrfMessageGetResult( msg );
+					if( req->on_response )
+						req->on_response( ms, req, content );
+					else
+						jsonObjectPush( req->responses,
+							content ? jsonObjectClone( content ) : jsonNewObject( NULL ) );
+				}
+				osrfMessageFree( msg );
+			}
+
+			if( heard )
+				req->deadline = now + req->timeout;
+
+			if( osrf_app_session_request_complete( req->session, req->request_id ) )
+				req->complete = 1;
+			else if( !req->complete && now >= req->deadline )
+				fail_request( req, OSRF_STATUS_TIMEOUT, "Request timed out" );
+		}
+
+		if( req->complete )
+			finish_request( ms, req );
+
+		req = next;
+	}
+}
+
+/**
+	@brief Take a finished request off the pending list, and deliver it.
+	@param ms Pointer to the osrfMultiSession.
+	@param req Pointer to the finished osrfMultiRequest.
+
+	Release its session, for reuse if the request ended cleanly.  Then pass the request
+	to its completion callback and free it, or append it to the completion queue.
+*/
+static void finish_request( osrfMultiSession* ms, osrfMultiRequest* req ) {
+
+	if( req->prev )
+		req->prev->next = req->next;
+	else
+		ms->pending = req->next;
+	if( req->next )
+		req->next->prev = req->prev;
+	req->next = req->prev = NULL;
+	ms->pending_count--;
+
+	if( req->session ) {
+		osrf_app_session_request_finish( req->session, req->request_id );
+		if( req->status_code == OSRF_STATUS_OK && !ms->transport_error ) {
+			osrfList* idle = osrfHashGet( ms->idle, req->service );
+			if( !idle ) {
+				idle = osrfNewList();
+				osrfHashSet( ms->idle, idle, "%s", req->service );
+			}
+			osrfListPush( idle, req->session );
+		} else
+			osrfAppSessionFree( req->session );
+		req->session = NULL;
+	}
+
+	if( req->on_complete ) {
+		req->on_complete( ms, req );
+		osrfMultiRequestFree( req );
+	} else {
+		if( ms->done_tail )
+			ms->done_tail->next = req;
+		else
+			ms->done = req;
+		ms->done_tail = req;
+	}
+}
+
+/**
+	@brief Count the requests submitted and not yet finished.
+	@param ms Pointer to the osrfMultiSession.
+	@return The number of requests pending or held back.
+
+	Finished requests waiting on the completion queue don't count.
+*/
+int osrfMultiSessionOutstanding( const osrfMultiSession* ms ) {
+	return ms ? ms->pending_count + ms->waiting_count : 0;
+}
+
+/**
+	@brief Take the oldest finished request off the completion queue.
+	@param ms Pointer to the osrfMultiSession.
+	@return Pointer to the finished osrfMultiRequest, or NULL if the queue is empty.
+
+	Only requests submitted without a completion callback are queued.  The caller is
+	responsible for freeing the request by calling osrfMultiRequestFree().
+*/
+osrfMultiRequest* osrfMultiSessionNextComplete( osrfMultiSession* ms ) {
+	if( !ms || !ms->done )
+		return NULL;
+
+	osrfMultiRequest* req = ms->done;
+	ms->done = req->next;
+	if( !ms->done )
+		ms->done_tail = NULL;
+	req->next = NULL;
+	return req;
+}
+
+/**
+	@brief Free a finished osrfMultiRequest.
+	@param req Pointer to the osrfMultiRequest.
+
+	A request still in flight belongs to its osrfMultiSession, and is freed along with it.
+*/
+void osrfMultiRequestFree( osrfMultiRequest* req ) {
+	if( !req )
+		return;
+	if( req->session ) {
+		osrf_app_session_request_finish( req->session, req->request_id );
+		osrfAppSessionFree( req->session );
+	}
+	free( req->service );
+	free( req->method );
+	free( req->status_text );
+	jsonObjectFree( req->params );
+	jsonObjectFree( req->responses );
+	free( req );
+}
+
+/**
+	@brief Free every member of a list of requests.
+	@param req Pointer to the first osrfMultiRequest in the list.
+*/
+static void free_request_list( osrfMultiRequest* req ) {
+	while( req ) {
+		osrfMultiRequest* next = req->next;
+		osrfMultiRequestFree( req );
+		req = next;
+	}
+}
+
+/**
+	@brief Free an osrfMultiSession and every request it still owns.
+	@param ms Pointer to the osrfMultiSession.
+
+	Requests still in flight are abandoned, and their sessions freed.  Calling this from
+	a callback is not allowed.
+*/
+void osrfMultiSessionFree( osrfMultiSession* ms ) {
+	if( !ms )
+		return;
+	free_request_list( ms->pending );
+	free_request_list( ms->waiting );
+	free_request_list( ms->done );
+	osrfHashFree( ms->idle );
+	free( ms->locale );
+	free( ms );
+}
+
+/**
+	@brief Free a list of idle sessions; installed as the callback for the idle hash.
+	@param key Name of the service (not used).
+	@param item Pointer to the osrfList of osrfAppSessions.
+*/
+static void free_session_list( char* key, void* item ) {
+	osrfList* idle = item;
+	osrfAppSession* session;
+	while( ( session = osrfListPop( idle ) ) )
+		osrfAppSessionFree( session );
+	osrfListFree( idle );
+}
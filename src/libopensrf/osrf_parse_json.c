@@ -22,8 +22,37 @@ GNU General Public License for more details.
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <opensrf/osrf_json.h>
 
+/*
+	Vector scanners look for the end of a plain run 16 or 32 bytes at a time.  SSE2 and NEON
+	are always there on x86_64 and aarch64 respectively; AVX2 is chosen at run time, if the
+	CPU has it.
+*/
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define PARSER_SSE2 1
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARSER_AVX2 1
+#endif
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PARSER_NEON 1
+#endif
+
+/*
+	A vector scanner reads whole aligned blocks, which may run past the terminal nul -- but
+	never past the end of the page holding it, so it can't fault.  Keep AddressSanitizer from
+	objecting.
+*/
+#if defined(__GNUC__)
+#define PARSER_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define PARSER_NO_ASAN
+#endif
+
 /**
 	@brief A collection of things the parser uses to keep track of what it's doing.
 */
@@ -63,10 +92,27 @@ static jsonObject* get_false( Parser* parser );
 static int get_utf8( Parser* parser, Unibuff* unibuff );
 
 static char skip_white_space( Parser* parser );
+static const char* scan_string_plain( const char* s );
+static const char* scan_space_plain( const char* s );
+static void choose_scanners( void );
 static inline void parser_ungetc( Parser* parser );
 static inline char parser_nextc( Parser* parser );
 static void report_error( Parser* parser, char badchar, const char* err );
 
+/**
+	@brief Find the first quotation mark, backslash or nul at or after a given position.
+
+	Chosen by choose_scanners() to suit the CPU.
+*/
+static const char* (*scan_string)( const char* s ) = NULL;
+
+/**
+	@brief Find the first non-white-space character at or after a given position.
+
+	Chosen by choose_scanners() to suit the CPU.
+*/
+static const char* (*scan_space)( const char* s ) = NULL;
+
 /* ------------------------------------- */
 
 /**
@@ -132,6 +178,9 @@ static jsonObject* parse_it( const char* s, int decode ) {
 	if( !s || !*s )
 		return NULL;    // Nothing to parse
 
+	if( !scan_string || !scan_space )
+		choose_scanners();
+
 	Parser parser;
 
 	parser.str_buf = NULL;
@@ -172,11 +221,8 @@ static jsonObject* get_json_node( Parser* parser, char firstc ) {
 	// Branch on the first character
 	if( '"' == firstc ) {
 		const char* str = get_string( parser );
-		if( str ) {
-			obj = jsonNewObject( NULL );
-			obj->type = JSON_STRING;
-			obj->value.s = strdup( str );
-		}
+		if( str )
+			obj = jsonNewObject( str );
 	} else if( '[' == firstc ) {
 		obj = get_array( parser );
 	} else if( '{' == firstc ) {
@@ -227,16 +273,29 @@ static const char* get_string( Parser* parser ) {
 
 	// Collect the characters.
 	for( ;; ) {
+		// Copy any run of plain characters in one go
+		const char* start = parser->buff + parser->index;
+		const char* end = scan_string( start );
+		if( end > start ) {
+			OSRF_BUFFER_ADD_N( gb, start, end - start );
+			parser->index += end - start;
+		}
+
 		char c = parser_nextc( parser );
 		if( '"' == c )
 			break;
 		else if( !c ) {
+			parser_ungetc( parser );     // Don't go past the terminal nul
 			report_error( parser, parser->buff[ parser->index - 1  ],
 						  "Quoted string not terminated" );
 			return NULL;
 		} else if( '\\' == c ) {
 			c = parser_nextc( parser );
 			switch( c ) {
+				case '\0' :
+					parser_ungetc( parser );
+					report_error( parser, '\\', "Quoted string not terminated" );
+					return NULL;
 				case '"'  : OSRF_BUFFER_ADD_CHAR( gb, '"'  ); break;
 				case '\\' : OSRF_BUFFER_ADD_CHAR( gb, '\\' ); break;
 				case '/'  : OSRF_BUFFER_ADD_CHAR( gb, '/'  ); break;
@@ -309,11 +368,11 @@ static jsonObject* get_number( Parser* parser, char firstc ) {
 		}
 	}
 
-	char* s = buffer_data( gb );
+	const char* s = OSRF_BUFFER_C_STR( gb );
+	char* scrubbed = NULL;
 	if( ! jsonIsNumeric( s ) ) {
-		char* temp = jsonScrubNumber( s );
-		free( s );
-		s = temp;
+		scrubbed = jsonScrubNumber( s );
+		s = scrubbed;
 		if( !s ) {
 			report_error( parser, parser->buff[ parser->index - 1 ],
 					"Invalid numeric format" );
@@ -321,9 +380,10 @@ static jsonObject* get_number( Parser* parser, char firstc ) {
 		}
 	}
 
-	jsonObject* obj = jsonNewObject( NULL );
+	// Copy the number straight from the buffer (into the current arena, if any)
+	jsonObject* obj = jsonNewObject( s );
 	obj->type = JSON_NUMBER;
-	obj->value.s = s;
+	free( scrubbed );
 
 	return obj;
 }
@@ -454,6 +514,15 @@ static jsonObject* get_hash( Parser* parser ) {
 	return hash;
 }
 
+/**
+	@brief Tell whether a jsonObject can serve as a class hint.
+	@param obj Pointer to the value of a JSON_CLASS_KEY member.
+	@return 1 if it's a string or a number, whose text can be the class name; otherwise 0.
+*/
+static int is_class_hint( const jsonObject* obj ) {
+	return JSON_STRING == obj->type || JSON_NUMBER == obj->type;
+}
+
 /**
 	@brief Parse a hash (JSON object), and create a JSON_HASH for it; decode class hints.
 	@param parser Pointer to a Parser.
@@ -468,15 +537,21 @@ static jsonObject* get_hash( Parser* parser ) {
 	If there is no member with a key equal to JSON_CLASS_KEY, then return the same sort of
 	jsonObject as get_hash() would return (except of course that lower levels may be
 	decoded as described above).
+
+	We don't build a hash just to take it apart again.  The class hint and the payload are
+	held aside instead of stored, and a hash is created only for other keys, or for a
+	payload that comes before any class hint.  Short keys are copied onto the stack.
 */
 static jsonObject* get_decoded_hash( Parser* parser ) {
-	jsonObject* hash = jsonNewObjectType( JSON_HASH );
+	jsonObject* hash = NULL;
+	jsonObject* class_obj = NULL;     // value of a class hint, held aside
+	jsonObject* payload = NULL;       // payload that followed a class hint, held aside
+	char key_buf[ 64 ];
+	int done = 0;
 
 	char c = skip_white_space( parser );
 	if( '}' == c )
-		return hash;           // Empty hash
-
-	char* class_name = NULL;
+		return jsonNewObjectType( JSON_HASH );   // Empty hash
 
 	for( ;; ) {
 
@@ -484,21 +559,29 @@ static jsonObject* get_decoded_hash( Parser* parser ) {
 		if( '"' != c ) {
 			report_error( parser, c,
 					"Expected quotation mark to begin hash key; didn't find it\n" );
-			jsonObjectFree( hash );
-			return NULL;
+			break;
 		}
 
 		const char* key = get_string( parser );
-		if( ! key ) {
-			jsonObjectFree( hash );
-			return NULL;
-		}
-		char* key_copy = strdup( key );
+		if( ! key )
+			break;
 
-		if( jsonObjectGetKeyConst( hash, key_copy ) ) {
+		int is_class = !strcmp( key, JSON_CLASS_KEY );
+		int is_data  = !strcmp( key, JSON_DATA_KEY );
+		if( ( is_class && class_obj ) || ( is_data && payload ) ||
+				jsonObjectGetKeyConst( hash, key ) ) {
 			report_error( parser, '"', "Duplicate key in JSON object" );
-			jsonObjectFree( hash );
-			return NULL;
+			break;
+		}
+
+		// Copy the key, since parsing the value reuses the buffer
+		char* key_copy = NULL;
+		if( !is_class && !is_data ) {
+			size_t len = strlen( key );
+			if( len < sizeof( key_buf ) )
+				key_copy = memcpy( key_buf, key, len + 1 );
+			else
+				key_copy = strdup( key );
 		}
 
 		// Get the colon
@@ -506,63 +589,78 @@ static jsonObject* get_decoded_hash( Parser* parser ) {
 		if( c != ':' ) {
 			report_error( parser, c,
 					"Expected colon after hash key; didn't find it\n" );
-			free( key_copy );
-			jsonObjectFree( hash );
-			return NULL;
+			if( key_copy != key_buf )
+				free( key_copy );
+			break;
 		}
 
 		// Get the associated value
 		jsonObject* obj = get_json_node( parser, skip_white_space( parser ) );
 		if( !obj ) {
-			free( key_copy );
-			jsonObjectFree( hash );
-			return NULL;
+			if( key_copy != key_buf )
+				free( key_copy );
+			break;
 		}
 
-		// Add a new entry to the hash
-		jsonObjectSetKey( hash, key_copy, obj );
-
-		// Save info for class hint, if present
-		if( !strcmp( key_copy, JSON_CLASS_KEY ) )
-			class_name = jsonObjectToSimpleString( obj );
+		if( is_class && is_class_hint( obj ) )
+			class_obj = obj;
+		else if( is_data && class_obj )
+			payload = obj;
+		else {
+			// Add a new entry to the hash
+			if( !hash )
+				hash = jsonNewObjectType( JSON_HASH );
+			if( is_class )
+				jsonObjectSetKey( hash, JSON_CLASS_KEY, obj );
+			else if( is_data )
+				jsonObjectSetKey( hash, JSON_DATA_KEY, obj );
+			else
+				jsonObjectSetKey( hash, key_copy, obj );
+		}
 
-		free( key_copy );
+		if( key_copy != key_buf )
+			free( key_copy );
 
 		// Look for comma or right brace
 		c = skip_white_space( parser );
-		if( '}' == c )
+		if( '}' == c ) {
+			done = 1;
 			break;
-		else if( c != ',' ) {
+		} else if( c != ',' ) {
 			report_error( parser, c,
 					"Expected comma or brace in hash, didn't find it" );
-			jsonObjectFree( hash );
-			return NULL;
+			break;
 		}
 		c = skip_white_space( parser );
 	}
 
-	if( class_name ) {
-		// We found a class hint.  Extract the data node and return it.
-		jsonObject* class_data = osrfHashExtract( hash->value.h, JSON_DATA_KEY );
-		if( class_data ) {
-			class_data->parent = NULL;
-			jsonObjectFree( hash );
-			hash = class_data;
-			hash->parent = NULL;
-			hash->classname = class_name;
-		} else {
+	if( !done ) {
+		// We broke out on an error
+		jsonObjectFree( hash );
+		jsonObjectFree( class_obj );
+		jsonObjectFree( payload );
+		return NULL;
+	}
+
+	if( class_obj ) {
+		// We found a class hint.  Return the data node, if any, with the class name.
+		if( !payload && hash )
+			payload = jsonObjectExtractKey( hash, JSON_DATA_KEY );
+		jsonObjectFree( hash );
+
+		if( payload )
+			jsonObjectSetClass( payload, jsonObjectGetString( class_obj ));
+		else {
 			// Huh?  We have a class name but no data for it.
-			// Throw away what we have and return a JSON_NULL.
-			jsonObjectFree( hash );
-			hash = jsonNewObjectType( JSON_NULL );
+			// Return a JSON_NULL.
+			payload = jsonNewObjectType( JSON_NULL );
 		}
 
-	} else {
-		if( class_name )
-			free( class_name );
+		jsonObjectFree( class_obj );
+		return payload;
 	}
 
-	return hash;
+	return hash ? hash : jsonNewObjectType( JSON_HASH );
 }
 
 /**
@@ -761,12 +859,221 @@ static int get_utf8( Parser* parser, Unibuff* unibuff ) {
 	@return The next non-whitespace character.
 */
 static char skip_white_space( Parser* parser ) {
-	char c;
-	do {
-		c = parser_nextc( parser );
-	} while( isspace( (unsigned char) c ) );
+	const char* p = parser->buff + parser->index;
+
+	// Usually there's no white space, or a single blank; only a longer run, such as
+	// indentation in pretty-printed JSON, is worth a vector scan.
+	if( isspace( (unsigned char) *p ) ) {
+		++p;
+		if( isspace( (unsigned char) *p ) )
+			p = scan_space( p );
+	}
+
+	parser->index = p - parser->buff;
+	return parser_nextc( parser );
+}
+
+/**
+	@brief Find the first quotation mark, backslash or nul, one byte at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the byte found.
+*/
+static const char* scan_string_plain( const char* s ) {
+	while( *s && '"' != *s && '\\' != *s )
+		++s;
+	return s;
+}
+
+/**
+	@brief Find the first non-white-space character, one byte at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the character found, which may be the terminal nul.
+*/
+static const char* scan_space_plain( const char* s ) {
+	while( isspace( (unsigned char) *s ) )
+		++s;
+	return s;
+}
+
+/**
+	@brief Tell whether a byte is white space, as isspace() sees it in the C locale.
+
+	Vector scanners use this to get up to an aligned boundary.
+*/
+static inline int is_json_space( char c ) {
+	return ' ' == c || ( c >= '\t' && c <= '\r' );
+}
+
+#ifdef PARSER_SSE2
+/**
+	@brief Find the first quotation mark, backslash or nul, sixteen bytes at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the byte found.
+*/
+PARSER_NO_ASAN static const char* scan_string_sse2( const char* s ) {
+	// Step up to a 16-byte boundary, so that no load strays into the next page.
+	while( (uintptr_t) s & 15 ) {
+		if( !*s || '"' == *s || '\\' == *s )
+			return s;
+		++s;
+	}
+
+	const __m128i quote = _mm_set1_epi8( '"' );
+	const __m128i backslash = _mm_set1_epi8( '\\' );
+	const __m128i nul = _mm_setzero_si128();
+	for( ;; s += 16 ) {
+		__m128i v = _mm_load_si128( (const __m128i*) s );
+		__m128i hit = _mm_or_si128( _mm_or_si128(
+			_mm_cmpeq_epi8( v, quote ), _mm_cmpeq_epi8( v, backslash ) ),
+			_mm_cmpeq_epi8( v, nul ) );
+		int mask = _mm_movemask_epi8( hit );
+		if( mask )
+			return s + __builtin_ctz( mask );
+	}
+}
+
+/**
+	@brief Find the first non-white-space character, sixteen bytes at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the character found, which may be the terminal nul.
+*/
+PARSER_NO_ASAN static const char* scan_space_sse2( const char* s ) {
+	while( (uintptr_t) s & 15 ) {
+		if( !is_json_space( *s ) )
+			return s;
+		++s;
+	}
 
-	return c;
+	const __m128i blank = _mm_set1_epi8( ' ' );
+	const __m128i tab = _mm_set1_epi8( '\t' );
+	const __m128i span = _mm_set1_epi8( '\r' - '\t' );
+	for( ;; s += 16 ) {
+		__m128i v = _mm_load_si128( (const __m128i*) s );
+		// A control character from tab to carriage return is at most span above tab
+		__m128i off = _mm_sub_epi8( v, tab );
+		__m128i ctl = _mm_cmpeq_epi8( _mm_min_epu8( off, span ), off );
+		__m128i space = _mm_or_si128( ctl, _mm_cmpeq_epi8( v, blank ) );
+		int mask = ~_mm_movemask_epi8( space ) & 0xFFFF;
+		if( mask )
+			return s + __builtin_ctz( mask );
+	}
+}
+#endif
+
+#ifdef PARSER_AVX2
+/**
+	@brief Find the first quotation mark, backslash or nul, 32 bytes at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the byte found.
+*/
+PARSER_NO_ASAN __attribute__((target("avx2")))
+static const char* scan_string_avx2( const char* s ) {
+	while( (uintptr_t) s & 31 ) {
+		if( !*s || '"' == *s || '\\' == *s )
+			return s;
+		++s;
+	}
+
+	const __m256i quote = _mm256_set1_epi8( '"' );
+	const __m256i backslash = _mm256_set1_epi8( '\\' );
+	const __m256i nul = _mm256_setzero_si256();
+	for( ;; s += 32 ) {
+		__m256i v = _mm256_load_si256( (const __m256i*) s );
+		__m256i hit = _mm256_or_si256( _mm256_or_si256(
+			_mm256_cmpeq_epi8( v, quote ), _mm256_cmpeq_epi8( v, backslash ) ),
+			_mm256_cmpeq_epi8( v, nul ) );
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8( hit );
+		if( mask )
+			return s + __builtin_ctz( mask );
+	}
+}
+#endif
+
+#ifdef PARSER_NEON
+/**
+	@brief Reduce a NEON comparison result to a 64-bit mask, four bits per byte.
+*/
+static inline uint64_t neon_mask( uint8x16_t hit ) {
+	uint8x8_t nibbles = vshrn_n_u16( vreinterpretq_u16_u8( hit ), 4 );
+	return vget_lane_u64( vreinterpret_u64_u8( nibbles ), 0 );
+}
+
+/**
+	@brief Find the first quotation mark, backslash or nul, sixteen bytes at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the byte found.
+*/
+PARSER_NO_ASAN static const char* scan_string_neon( const char* s ) {
+	while( (uintptr_t) s & 15 ) {
+		if( !*s || '"' == *s || '\\' == *s )
+			return s;
+		++s;
+	}
+
+	const uint8x16_t quote = vdupq_n_u8( '"' );
+	const uint8x16_t backslash = vdupq_n_u8( '\\' );
+	const uint8x16_t nul = vdupq_n_u8( 0 );
+	for( ;; s += 16 ) {
+		uint8x16_t v = vld1q_u8( (const uint8_t*) s );
+		uint8x16_t hit = vorrq_u8( vorrq_u8( vceqq_u8( v, quote ), vceqq_u8( v, backslash ) ),
+			vceqq_u8( v, nul ) );
+		uint64_t mask = neon_mask( hit );
+		if( mask )
+			return s + ( __builtin_ctzll( mask ) >> 2 );
+	}
+}
+
+/**
+	@brief Find the first non-white-space character, sixteen bytes at a time.
+	@param s Pointer to where to start looking.
+	@return Pointer to the character found, which may be the terminal nul.
+*/
+PARSER_NO_ASAN static const char* scan_space_neon( const char* s ) {
+	while( (uintptr_t) s & 15 ) {
+		if( !is_json_space( *s ) )
+			return s;
+		++s;
+	}
+
+	const uint8x16_t blank = vdupq_n_u8( ' ' );
+	const uint8x16_t tab = vdupq_n_u8( '\t' );
+	const uint8x16_t span = vdupq_n_u8( '\r' - '\t' );
+	for( ;; s += 16 ) {
+		uint8x16_t v = vld1q_u8( (const uint8_t*) s );
+		uint8x16_t space = vorrq_u8( vcleq_u8( vsubq_u8( v, tab ), span ),
+			vceqq_u8( v, blank ) );
+		uint64_t mask = ~neon_mask( space );
+		if( mask )
+			return s + ( __builtin_ctzll( mask ) >> 2 );
+	}
+}
+#endif
+
+/**
+	@brief Pick the fastest scanners that the CPU supports.
+
+	Called the first time we parse anything.  If two threads race to get here first, they
+	both store the same answers.
+*/
+static void choose_scanners( void ) {
+	const char* (*string_func)( const char* ) = scan_string_plain;
+	const char* (*space_func)( const char* ) = scan_space_plain;
+
+#if defined(PARSER_SSE2)
+	string_func = scan_string_sse2;
+	space_func = scan_space_sse2;
+#if defined(PARSER_AVX2)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) )
+		string_func = scan_string_avx2;
+#endif
+#elif defined(PARSER_NEON)
+	string_func = scan_string_neon;
+	space_func = scan_space_neon;
+#endif
+
+	scan_space = space_func;
+	scan_string = string_func;
 }
 
 /**
@@ -809,17 +1116,23 @@ static void report_error( Parser* parser, char badchar, const char* err ) {
 
 	const int max_margin = 15;  // How many characters to show
 	                            // on either side of the error
-	int pre = parser->index - max_margin;
+
+	// Having read the terminal nul, the parser may already be past it
+	int index = parser->index;
+	if( index > 0 && '\0' == parser->buff[ index - 1 ] )
+		--index;
+
+	int pre = index - max_margin;
 	if( pre < 0 )
 		pre = 0;
 
-	int post = parser->index + 15;
-	if( '\0' == parser->buff[ parser->index ] ) {
-		post = parser->index - 1;
+	int post = index + 15;
+	if( '\0' == parser->buff[ index ] ) {
+		post = index - 1;
 	} else {
-		int remaining = strlen(parser->buff + parser->index);
+		int remaining = strlen(parser->buff + index);
 		if( remaining < max_margin )
-			post = parser->index + remaining;
+			post = index + remaining;
 	}
 
 	// Copy the fragment into a buffer
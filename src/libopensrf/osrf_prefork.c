@@ -9,18 +9,46 @@
 	child dies, either deliberately or otherwise, we can spawn another one to replace it,
 	keeping the number of children within a predefined range.
 
-	Use a doubly-linked circular list to keep track of the children to whom we have forwarded
-	a request, and who are still working on them.  Use a separate linear linked list to keep
-	track of children that are currently idle.  Move them back and forth as needed.
-
-	For each child, set up two pipes:
-	- One for the parent to send requests to the child.
-	- One for the child to notify the parent that it is available for another request.
+	Requests wait for an available child in a backlog queue (see osrf_backlog.h), which is
+	really three queues: one for each priority class.  Requests can be assigned to the high
+	or low priority class by method name or by ingress; CONNECT requests are high priority
+	whenever any priorities are configured.  Requests that have waited too long are dropped
+	rather than sent to a child, since their clients have presumably given up on them.
+
+	Optionally, the parent forks a template process before any children.  The template
+	runs the application's osrfAppTemplateInit(), if any, to set up state that can be
+	shared copy-on-write; afterwards new children are forked from the template instead of
+	from the parent, so that they needn't repeat that work.  The parent hands the template
+	each new child's data pipe over a unix socket, and the template forks twice, so that
+	the child becomes the parent's own (via PR_SET_CHILD_SUBREAPER), to be reaped like any
+	other.  If the template fails, the parent goes back to forking children itself.
+
+	Within that range, an optional autoscaler keeps a configurable number of spare idle
+	children on hand.  It spawns more, at an accelerating but capped rate, when the spares run low or
+	requests start waiting in the backlog queue; and it retires spares beyond the maximum
+	once they have been idle for a while.
 
-	The message sent to the child represents an XML stanza as received from Jabber.
-
-	When the child finishes processing the request, it writes the string "available" back
-	to the parent.  Then the parent knows that it can send that child another request.
+	Use a doubly-linked circular list to keep track of the children to whom we have forwarded
+	a request, and who are still working on them.  Use a separate doubly-linked linear list
+	to keep track of children that are currently idle.  Move them back and forth as needed.
+	Index the children by process ID and by status board slot, so that we can find any
+	child, and move it or remove it, in constant time however many there are.
+
+	For each child, set up a pipe for the parent to send requests to the child.  The message
+	sent to the child is the transport_message as parsed by the parent, packed by
+	message_pack() so that the child needn't parse it again.  Each request is
+	preceded by a request_frame giving its length, so that the child can read it in one go.
+	A request larger than a configurable threshold goes instead into a POSIX shared memory
+	segment, and only the name of the segment goes down the pipe, with just enough of the
+	request for the child to answer it with an error should it be unable to map the segment.
+
+	The children report their status through a status board: an array of slots in shared
+	memory, one cache line per child, holding the child's state, the number of requests it
+	has served, and when it started on its current request.  When the child finishes
+	processing a request, it marks its slot idle, adds its slot number to a shared ready
+	queue, and rings a doorbell (an eventfd where available, otherwise a pipe) shared by
+	all the children.  The parent takes newly idle children from the ready queue, and waits
+	on the doorbell when it has nothing better to do.
 */
 
 #include <errno.h>
@@ -31,8 +59,22 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 
 #include "opensrf/utils.h"
 #include "opensrf/log.h"
@@ -40,9 +82,159 @@
 #include "opensrf/osrf_stack.h"
 #include "opensrf/osrf_settings.h"
 #include "opensrf/osrf_application.h"
+#include "opensrf/osrf_trace.h"
+#include "opensrf/osrf_affinity.h"
+#include "opensrf/osrf_prefork.h"
+#include "opensrf/osrf_backlog.h"
 
 #define READ_BUFSIZE 1024
-#define ABS_MAX_CHILDREN 256
+#define HANDOFF_THRESHOLD 262144
+#define MAX_SPAWN_RATE 8
+#define MAX_IDLE_TIME 60
+
+#define HANDOFF_NAME_SIZE 64
+
+#define DRONE_METHOD_SIZE 128  /**< Room for a method name on the status board. */
+#define DRONE_XID_SIZE    64   /**< Room for a log transaction ID on the status board. */
+#define METHOD_STATS_MAX  256  /**< Most methods for which to keep latency statistics. */
+/** Number of latency buckets: under 1 ms, then doubling up to 16 seconds and over. */
+#define LATENCY_BUCKETS   16
+/** Most seconds to wait for the first drones to start, before registering anyway. */
+#define DRONE_START_TIMEOUT 30
+/** Milliseconds to wait for the fork template to report a new child's pid. */
+#define TEMPLATE_LAUNCH_TIMEOUT 5000
+/** Method that the listener answers itself, with a report of its health. */
+#define OSRF_HEALTH_METHOD "opensrf.system.health"
+
+#define FRAME_PIPE 0  /**< The request follows the frame on the pipe. */
+#define FRAME_SHM  1  /**< The name of a shared memory segment follows the frame. */
+
+#define SHUTDOWN_GRACEFUL 1  /**< A SIGTERM asked us to let the children finish. */
+#define SHUTDOWN_NOW      2  /**< A SIGINT or SIGQUIT asked us not to wait. */
+
+/**
+	@brief Header written to a child's data pipe ahead of each request.
+*/
+typedef struct {
+	int type;        /**< FRAME_PIPE or FRAME_SHM. */
+	size_t length;   /**< Number of bytes following the frame, not counting any terminal nul. */
+} request_frame;
+
+#define DRONE_FREE    0  /**< Status board slot not assigned to any child. */
+#define DRONE_IDLE    1  /**< Child is waiting for a request. */
+#define DRONE_BUSY    2  /**< Child has been sent a request and hasn't finished it. */
+#define DRONE_EXITING 3  /**< Child has been killed, and is waiting to be reaped. */
+
+/**
+	@brief One child's slot on the status board.
+
+	The parent assigns the slot and sets the state to DRONE_BUSY before it sends a request.
+	The child sets the start time when it reads the request, and sets the state back to
+	DRONE_IDLE when it's done.  While a method runs, the child also posts its name and
+	the log transaction ID, for anyone wondering what the drone is up to.  Readers may
+	catch those strings half written, which is harmless for telemetry.
+
+	Each slot occupies its own cache lines, so that children updating their own slots
+	don't contend with each other.
+*/
+typedef struct {
+	volatile int state;              /**< One of the DRONE_* values. */
+	volatile pid_t pid;              /**< Process ID of the child using the slot. */
+	volatile unsigned long served;   /**< Number of requests the child has finished. */
+	volatile double request_start;   /**< When the current request arrived, in seconds. */
+	volatile double method_start;    /**< When the current method started, or zero. */
+	volatile int started;            /**< Boolean; set once the child is initialized. */
+	char method[ DRONE_METHOD_SIZE ];  /**< Name of the method now running, or empty. */
+	char xid[ DRONE_XID_SIZE ];      /**< Log transaction ID of the method now running. */
+} __attribute__(( aligned( 64 ))) drone_slot;
+
+/**
+	@brief Latency statistics for one method, accumulated by all the children.
+
+	Children update the counters with atomic increments.  Bucket 0 counts calls that took
+	less than a millisecond; bucket n, calls that took less than 2^n milliseconds but at
+	least half that; the last bucket, everything slower.
+*/
+typedef struct {
+	char name[ DRONE_METHOD_SIZE ];     /**< Name of the method. */
+	volatile unsigned long count;       /**< Number of calls finished. */
+	volatile unsigned long total_usec;  /**< Total time spent in those calls. */
+	volatile unsigned long max_usec;    /**< Time taken by the slowest call. */
+	volatile unsigned long buckets[ LATENCY_BUCKETS ];  /**< Calls by latency. */
+} method_stats;
+
+/**
+	@brief Shared table of method_stats, one per method that any child has run.
+
+	A child adds an entry while holding the lock, filling in the name before it bumps
+	the count of entries in use; so readers need no lock to look at the first @em used
+	entries.  Entries are never removed.
+
+	The lock is a robust mutex, so that a child dying while it holds the lock doesn't
+	leave the others waiting for it forever.  Since the count goes up only after the
+	new entry is complete, the next child to take the lock finds the table consistent.
+*/
+typedef struct {
+	pthread_mutex_t lock;  /**< Process-shared lock held while adding an entry. */
+	volatile int used;   /**< Number of entries in use. */
+	method_stats entries[ METHOD_STATS_MAX ];
+} method_table;
+
+/**
+	@brief Settings that the parent may change while the children are running.
+
+	The parent writes them, and each child reads them afresh for each request, so that a
+	configuration reload reaches children that are already running.
+*/
+typedef struct {
+	volatile int max_requests;  /**< How many requests a child processes before terminating. */
+	volatile int keepalive;     /**< Keepalive time for stateful sessions. */
+	volatile int log_level;     /**< Log level for the children. */
+} drone_settings;
+
+/**
+	@brief Shared queue of children that have become idle, in the order that they did so.
+
+	Children add themselves at the tail: each one claims a position with an atomic
+	increment, and then fills in a report of its slot number, stamped with the position
+	(see READY_REPORT).  The parent takes them from the head, which it keeps privately.
+	An entry not stamped with the head's position means either that the queue is empty,
+	or that the child who claimed it hasn't filled it in yet; either way, the parent can
+	stop there and await the doorbell.  The stamp also keeps the parent from trusting a
+	report left over from an earlier time round the ring.
+
+	A child that dies between claiming an entry and filling it in leaves a hole that would
+	stop the parent for good, so once such a child is reaped, the parent falls back on the
+	status board to step over it (see recover_ready_queue()).  A report filled in after
+	the parent has stepped over it is stamped too late ever to be taken.
+
+	Each child can have at most one report outstanding for each request it's sent, so a
+	queue with room for twice as many entries as there are slots can't overflow.
+*/
+typedef struct {
+	unsigned long mask;            /**< Number of entries, less one (a power of two, less one). */
+	volatile unsigned long tail;   /**< Next position to be claimed, modulo the size. */
+	volatile uint64_t entries[];   /**< Report of each newly idle child (see READY_REPORT). */
+} ready_queue;
+
+/** Bits of a ready queue report given to the slot number; the rest hold the stamp. */
+#define READY_SLOT_BITS 24
+#define READY_SLOT_MASK ( ( (uint64_t) 1 << READY_SLOT_BITS ) - 1 )
+#define READY_STAMP_MASK ( ~(uint64_t) 0 >> READY_SLOT_BITS )
+/** The stamp for a position in the ready queue: the position plus one, so that an entry
+	never filled in doesn't look like a report for the first position. */
+#define READY_STAMP(pos) ( ( (uint64_t) (pos) + 1 ) & READY_STAMP_MASK )
+/** The report that a child in a given slot, at a given position, has become idle. */
+#define READY_REPORT(pos, slot) \
+	( READY_STAMP( pos ) << READY_SLOT_BITS | ( (uint64_t) (slot) + 1 ))
+/** Boolean: a report is stamped with a later position than a given stamp. */
+#define READY_NEWER(report, stamp) \
+	( ( ( ( (report) >> READY_SLOT_BITS ) - (stamp) ) & READY_STAMP_MASK ) - 1 \
+		< READY_STAMP_MASK / 2 )
+
+#define CHILD_NO_LIST     0  /**< prefork_child is on neither list. */
+#define CHILD_IDLE_LIST   1  /**< prefork_child is on the idle list. */
+#define CHILD_ACTIVE_LIST 2  /**< prefork_child is on the active list. */
 
 typedef struct {
 	int max_requests;     /**< How many requests a child processes before terminating. */
@@ -54,66 +246,165 @@ typedef struct {
 	int data_to_parent;   /**< Unused. */
 	int current_num_children;   /**< How many children are currently on the list. */
 	int keepalive;        /**< Keepalive time for stateful sessions. */
+	int autoscale;        /**< Boolean: true if the autoscaler is to run. */
+	int min_spare_children;  /**< Spawn more children when fewer than this are idle. */
+	int max_spare_children;  /**< Retire children when more than this are idle; 0 for never. */
+	int max_spawn_rate;   /**< Most children the autoscaler may spawn in one second. */
+	int spawn_rate;       /**< How many children the autoscaler may spawn next time. */
+	int max_idle_time;    /**< Seconds a surplus child may stay idle before it's retired. */
+	double queue_wait_threshold;  /**< Backlog wait, in seconds, that calls for more children. */
+	double max_queue_wait;  /**< Drop requests that have waited longer than this; 0 for never. */
+	osrfHash* method_priority;   /**< Priority class for each listed method, or NULL. */
+	osrfHash* ingress_priority;  /**< Priority class for each listed ingress, or NULL. */
+	double last_scale;    /**< When the autoscaler last ran. */
+	double last_finished; /**< When a child last finished a request, or zero. */
+	size_t handoff_threshold;  /**< Requests this big go through shared memory; 0 for never. */
+	unsigned long handoff_count;  /**< Used to give each shared memory segment a unique name. */
 	char* appname;        /**< Name of the application. */
 	/** Points to a circular linked list of children. */
 	struct prefork_child_struct* first_child;
 	/** List of of child processes that aren't doing anything at the moment and are
 		therefore available to service a new request. */
 	struct prefork_child_struct* idle_list;
+	/** The last child on the idle list, which has been idle the longest. */
+	struct prefork_child_struct* idle_tail;
+	int idle_count;       /**< How many children are on the idle list. */
 	/** List of allocated but unused prefork_children, available for reuse.  Each one is just
 		raw memory, apart from the "next" pointer used to stitch them together.  In particular,
 		there is no child process for them, and the file descriptors are not open. */
 	struct prefork_child_struct* free_list;
-    struct prefork_child_struct* sighup_pending_list;
+	osrfHash* pid_index;  /**< Each child's prefork_child, keyed by process ID. */
+	/** Each slot's prefork_child, indexed like the status board, or NULL. */
+	struct prefork_child_struct** slot_index;
 	transport_client* connection;  /**< Connection to Jabber. */
+	drone_slot* board;    /**< Status board shared with the children. */
+	int board_size;       /**< Number of slots on the status board. */
+	size_t board_bytes;   /**< Size of the shared memory holding the board and friends. */
+	ready_queue* ready;   /**< Shared queue of newly idle children. */
+	method_table* methods;  /**< Shared latency statistics for each method. */
+	drone_settings* settings;  /**< Settings shared with the children. */
+	unsigned long ready_head;  /**< Next position to take from the ready queue. */
+	/** Boolean: true if a child that died may have left a hole in the ready queue. */
+	int ready_stalled;
+	int bell_read_fd;     /**< Parent waits on this for children to become idle. */
+	int bell_write_fd;    /**< Children use to ring the doorbell. */
+	int template_fd;      /**< Parent's socket to the template process, or -1 if none. */
+	pid_t template_pid;   /**< Process ID of the template process, or 0 if none. */
+	/** Settings that children read only when they start, less the ones we can change
+		on the fly; used to tell whether a reload calls for new children. */
+	jsonObject* fixed_config;
+	int generation;       /**< Bumped whenever a reload calls for new children. */
+	int rolling;          /**< Boolean: true if children of older generations remain. */
+	pid_t reload_pid;     /**< Process ID of the process fetching new settings, or 0. */
+	FILE* reload_file;    /**< Where the process fetching new settings leaves them. */
 } prefork_simple;
 
 struct prefork_child_struct {
 	pid_t pid;            /**< Process ID of the child. */
 	int read_data_fd;     /**< Child uses to read request. */
 	int write_data_fd;    /**< Parent uses to write request. */
-	int read_status_fd;   /**< Parent reads to see if child is available. */
-	int write_status_fd;  /**< Child uses to notify parent when it's available again. */
-	int max_requests;     /**< How many requests a child can process before terminating. */
+	drone_slot* slot;     /**< The child's slot on the status board. */
+	int slot_number;      /**< Index of the child's slot on the status board. */
+	ready_queue* ready;   /**< Where to report that the child has become idle. */
+	int list;             /**< Which list the child is on: one of the CHILD_*_LIST values. */
+	int generation;       /**< The parent's generation when the child was launched. */
+	int bell_fd;          /**< Child uses to notify parent when it's available again. */
+	drone_settings* settings;  /**< Settings shared with the parent. */
 	const char* appname;  /**< Name of the application. */
-	int keepalive;        /**< Keepalive time for stateful sessions. */
+	double idle_since;    /**< When the parent last found the child idle. */
+	int from_template;    /**< Boolean: true if forked from the template process. */
+	/** Name of the shared memory segment holding the child's current request, if any. */
+	char handoff[ HANDOFF_NAME_SIZE ];
 	struct prefork_child_struct* next;  /**< Linkage pointer for linked list. */
 	struct prefork_child_struct* prev;  /**< Linkage pointer for linked list. */
 };
 
 typedef struct prefork_child_struct prefork_child;
 
+/**
+	@brief The settings for a listener and its children, as loaded from the settings server.
+*/
+typedef struct {
+	int max_requests;     /**< How many requests a child processes before terminating. */
+	int min_children;     /**< Minimum number of children to maintain. */
+	int max_children;     /**< Maximum number of children to maintain. */
+	int max_backlog_queue; /**< Maximum size of backlog queue. */
+	int keepalive;        /**< Keepalive time for stateful sessions. */
+	long handoff;         /**< Requests this big go through shared memory; 0 for never. */
+	int autoscale;        /**< Boolean: true if the autoscaler is to run. */
+	int min_spare;        /**< Spawn more children when fewer than this are idle. */
+	int max_spare;        /**< Retire children when more than this are idle; 0 for never. */
+	int spawn_rate;       /**< Most children the autoscaler may spawn in one second. */
+	int max_idle;         /**< Seconds a surplus child may stay idle before it's retired. */
+	double queue_wait;    /**< Backlog wait, in seconds, that calls for more children. */
+	double max_queue_wait;  /**< Drop requests that have waited longer than this; 0 for never. */
+	int use_template;     /**< Boolean: true if children are to be forked from a template. */
+} prefork_config;
+
 /** Boolean.  Set to true by a signal handler when it traps SIGCHLD. */
 static volatile sig_atomic_t child_dead;
 
+/** Boolean.  Set to true by a signal handler when it traps SIGUSR2. */
+static volatile sig_atomic_t stats_dump_pending;
+
+/** Boolean.  Set to true by a signal handler when it traps SIGHUP. */
+static volatile sig_atomic_t reload_pending;
+
+/** Set by a signal handler: SHUTDOWN_GRACEFUL for SIGTERM, SHUTDOWN_NOW for SIGINT or
+	SIGQUIT.  Zero until then. */
+static volatile sig_atomic_t shutdown_pending;
+
+
 static int prefork_simple_init( prefork_simple* prefork, transport_client* client,
 	int max_requests, int min_children, int max_children, int max_backlog_queue );
+static void read_prefork_config( const char* appname, prefork_config* cfg );
+static void apply_config( prefork_simple* forker, const prefork_config* cfg );
+static jsonObject* fixed_settings( const char* appname );
+static void reload_start( prefork_simple* forker );
+static void reload_finish( prefork_simple* forker, int status );
+static void roll_children( prefork_simple* forker );
 static prefork_child* launch_child( prefork_simple* forker );
 static void prefork_launch_children( prefork_simple* forker );
+static int wait_for_children( prefork_simple* forker );
 static void prefork_run( prefork_simple* forker );
 static void add_prefork_child( prefork_simple* forker, prefork_child* child );
 
-static void del_prefork_child( prefork_simple* forker, pid_t pid );
+static int del_prefork_child( prefork_simple* forker, pid_t pid );
+static void idle_push( prefork_simple* forker, prefork_child* child );
+static prefork_child* idle_pop( prefork_simple* forker );
+static void idle_remove( prefork_simple* forker, prefork_child* child );
+static void active_remove( prefork_simple* forker, prefork_child* child );
+static void doom_child( prefork_simple* forker, prefork_child* child, int sig );
 static int check_children( prefork_simple* forker, int forever );
-static int  prefork_child_process_request( prefork_child*, char* data );
+static void child_now_idle( prefork_simple* forker, prefork_child* child );
+static int recover_ready_queue( prefork_simple* forker );
+static int  prefork_child_process_request( prefork_child*, const char* data, size_t len );
+static void apply_drone_affinity( const prefork_child* child );
 static int prefork_child_init_hook( prefork_child* );
 static prefork_child* prefork_child_init( prefork_simple* forker,
-	int read_data_fd, int write_data_fd,
-	int read_status_fd, int write_status_fd );
+	int read_data_fd, int write_data_fd, drone_slot* slot );
 
 /* listens on the 'data_to_child' fd and wait for incoming data */
 static void prefork_child_wait( prefork_child* child );
 static void prefork_clear( prefork_simple*, bool graceful);
 static void prefork_child_free( prefork_simple* forker, prefork_child* );
-static void osrf_prefork_register_routers( const char* appname, bool unregister );
 static void osrf_prefork_child_exit( prefork_child* );
 
+static void reset_child_signals( void );
+static void run_drone( prefork_child* child );
+static void template_start( prefork_simple* forker );
+static pid_t template_launch( prefork_simple* forker, prefork_child* child );
+static void template_stop( prefork_simple* forker );
+static void template_main( prefork_simple* forker, int sock );
+
 static void sigchld_handler( int sig );
 static void sigusr1_handler( int sig );
 static void sigusr2_handler( int sig );
 static void sigterm_handler( int sig );
 static void sigint_handler( int sig );
 static void sighup_handler( int sig );
+static void prefork_shutdown( prefork_simple* forker );
+static void drone_sigusr1_handler( int sig );
 
 /** Maintain a global pointer to the prefork_simple object
  *  for the current process so we can refer to it later
@@ -123,65 +414,329 @@ static void sighup_handler( int sig );
 static prefork_simple *global_forker = NULL;
 
 /**
-	@brief Spawn and manage a collection of drone processes for servicing requests.
+	@brief Load the names listed for a priority class into a lookup table.
+	@param table Pointer to the table pointer, which is created on first use.
+	@param priority The priority class to assign.
+	@param names Pointer to a jsonObject holding a name, or an array of names (or NULL).
+*/
+static void add_priorities( osrfHash** table, int priority, const jsonObject* names ) {
+	if( !names )
+		return;
+
+	unsigned long i = 0;
+	const jsonObject* name = names;
+	do {
+		if( JSON_ARRAY == names->type )
+			name = jsonObjectGetIndex( names, i );
+		const char* str = jsonObjectGetString( name );
+		if( str && *str ) {
+			if( !*table )
+				*table = osrfNewHash();
+			// Store priority + 1, so that it's never NULL
+			osrfHashSet( *table, (void*) (long) ( priority + 1 ), "%s", str );
+		}
+	} while( JSON_ARRAY == names->type && ++i < names->size );
+}
+
+/**
+	@brief Load the method and ingress priority classes for an application.
+	@param forker Pointer to the prefork_simple for the application.
 	@param appname Name of the application.
-	@return 0 if successful, or -1 if error.
+
+	The configuration looks like this, where any element may be repeated or omitted:
+
+	@code
+	<unix_config>
+	  <priority>
+	    <high><method>...</method><ingress>...</ingress></high>
+	    <low><method>...</method><ingress>...</ingress></low>
+	  </priority>
+	</unix_config>
+	@endcode
 */
-int osrf_prefork_run( const char* appname ) {
+static void load_priorities( prefork_simple* forker, const char* appname ) {
+	static const char* classes[] = { "high", NULL, "low" };
+	int i;
+	for( i = 0; i < OSRF_PRIORITY_COUNT; i++ ) {
+		if( !classes[ i ] )
+			continue;
 
-	if( !appname ) {
-		osrfLogError( OSRF_LOG_MARK, "osrf_prefork_run requires an appname to run!");
-		return -1;
-	}
+		jsonObject* names = osrf_settings_host_value_object(
+			"/apps/%s/unix_config/priority/%s/method", appname, classes[ i ] );
+		add_priorities( &forker->method_priority, i, names );
+		jsonObjectFree( names );
 
-	set_proc_title( "OpenSRF Listener [%s]", appname );
+		names = osrf_settings_host_value_object(
+			"/apps/%s/unix_config/priority/%s/ingress", appname, classes[ i ] );
+		add_priorities( &forker->ingress_priority, i, names );
+		jsonObjectFree( names );
+	}
+}
 
-	int maxr = 1000;
-	int maxc = 10;
-	int maxbq = 1000;
-	int minc = 3;
-	int kalive = 5;
+/**
+	@brief Load the settings for the listener and its children.
+	@param appname Name of the application.
+	@param cfg Pointer to the prefork_config to fill in.
 
-	// Get configuration settings
-	osrfLogInfo( OSRF_LOG_MARK, "Loading config in osrf_forker for app %s", appname );
+	Fill in a default for anything missing, and patch up anything inconsistent.
+*/
+static void read_prefork_config( const char* appname, prefork_config* cfg ) {
+
+	cfg->max_requests = 1000;
+	cfg->max_children = 10;
+	cfg->max_backlog_queue = 1000;
+	cfg->min_children = 3;
+	cfg->keepalive = 5;
+	cfg->handoff = HANDOFF_THRESHOLD;
+	cfg->autoscale = 0;
+	cfg->min_spare = 0;
+	cfg->max_spare = 0;
+	cfg->spawn_rate = MAX_SPAWN_RATE;
+	cfg->max_idle = MAX_IDLE_TIME;
+	cfg->queue_wait = 0.0;
+	cfg->max_queue_wait = 0.0;
+	cfg->use_template = 0;
 
 	char* max_req      = osrf_settings_host_value( "/apps/%s/unix_config/max_requests", appname );
 	char* min_children = osrf_settings_host_value( "/apps/%s/unix_config/min_children", appname );
 	char* max_children = osrf_settings_host_value( "/apps/%s/unix_config/max_children", appname );
 	char* max_backlog_queue = osrf_settings_host_value( "/apps/%s/unix_config/max_backlog_queue", appname );
 	char* keepalive    = osrf_settings_host_value( "/apps/%s/keepalive", appname );
+	char* shm_threshold = osrf_settings_host_value( "/apps/%s/unix_config/shm_threshold", appname );
+	char* autoscale    = osrf_settings_host_value( "/apps/%s/unix_config/autoscale", appname );
+	char* min_spare    = osrf_settings_host_value( "/apps/%s/unix_config/min_spare_children", appname );
+	char* max_spare    = osrf_settings_host_value( "/apps/%s/unix_config/max_spare_children", appname );
+	char* spawn_rate   = osrf_settings_host_value( "/apps/%s/unix_config/max_spawn_rate", appname );
+	char* max_idle     = osrf_settings_host_value( "/apps/%s/unix_config/max_idle_time", appname );
+	char* queue_wait   = osrf_settings_host_value( "/apps/%s/unix_config/queue_wait_threshold", appname );
+	char* max_queue_wait = osrf_settings_host_value( "/apps/%s/unix_config/max_queue_wait", appname );
+	char* fork_template = osrf_settings_host_value( "/apps/%s/unix_config/fork_template", appname );
 
 	if( !keepalive )
-		osrfLogWarning( OSRF_LOG_MARK, "Keepalive is not defined, assuming %d", kalive );
+		osrfLogWarning( OSRF_LOG_MARK, "Keepalive is not defined, assuming %d", cfg->keepalive );
 	else
-		kalive = atoi( keepalive );
+		cfg->keepalive = atoi( keepalive );
 
 	if( !max_req )
-		osrfLogWarning( OSRF_LOG_MARK, "Max requests not defined, assuming %d", maxr );
+		osrfLogWarning( OSRF_LOG_MARK, "Max requests not defined, assuming %d", cfg->max_requests );
 	else
-		maxr = atoi( max_req );
+		cfg->max_requests = atoi( max_req );
 
 	if( !min_children )
-		osrfLogWarning( OSRF_LOG_MARK, "Min children not defined, assuming %d", minc );
+		osrfLogWarning( OSRF_LOG_MARK, "Min children not defined, assuming %d", cfg->min_children );
 	else
-		minc = atoi( min_children );
+		cfg->min_children = atoi( min_children );
 
 	if( !max_children )
-		osrfLogWarning( OSRF_LOG_MARK, "Max children not defined, assuming %d", maxc );
+		osrfLogWarning( OSRF_LOG_MARK, "Max children not defined, assuming %d", cfg->max_children );
 	else
-		maxc = atoi( max_children );
+		cfg->max_children = atoi( max_children );
 
 	if( !max_backlog_queue )
-		osrfLogWarning( OSRF_LOG_MARK, "Max backlog queue size not defined, assuming %d", maxbq );
+		osrfLogWarning( OSRF_LOG_MARK, "Max backlog queue size not defined, assuming %d", cfg->max_backlog_queue );
 	else
-		maxbq = atoi( max_backlog_queue );
+		cfg->max_backlog_queue = atoi( max_backlog_queue );
+
+	if( shm_threshold )
+		cfg->handoff = atol( shm_threshold );
+	if( cfg->handoff < 0 )
+		cfg->handoff = 0;
+
+	if( autoscale && !strcasecmp( autoscale, "true" ))
+		cfg->autoscale = 1;
+	if( min_spare )
+		cfg->min_spare = atoi( min_spare );
+	if( max_spare )
+		cfg->max_spare = atoi( max_spare );
+	if( spawn_rate )
+		cfg->spawn_rate = atoi( spawn_rate );
+	if( max_idle )
+		cfg->max_idle = atoi( max_idle );
+	if( queue_wait )
+		cfg->queue_wait = strtod( queue_wait, NULL );
+	if( max_queue_wait )
+		cfg->max_queue_wait = strtod( max_queue_wait, NULL );
+	if( fork_template && !strcasecmp( fork_template, "true" ))
+		cfg->use_template = 1;
+
+	if( cfg->min_spare < 0 )
+		cfg->min_spare = 0;
+	if( cfg->max_spare && cfg->max_spare < cfg->min_spare ) {
+		osrfLogWarning( OSRF_LOG_MARK, "max_spare_children (%d) is less than "
+			"min_spare_children (%d); using %d", cfg->max_spare, cfg->min_spare, cfg->min_spare );
+		cfg->max_spare = cfg->min_spare;
+	}
+	if( cfg->spawn_rate < 1 )
+		cfg->spawn_rate = 1;
 
 	free( keepalive );
+	free( shm_threshold );
+	free( autoscale );
+	free( min_spare );
+	free( max_spare );
+	free( spawn_rate );
+	free( max_idle );
+	free( queue_wait );
+	free( max_queue_wait );
+	free( fork_template );
 	free( max_req );
 	free( min_children );
 	free( max_children );
 	free( max_backlog_queue );
-	/* --------------------------------------------------- */
+}
+
+/**
+	@brief Put settings into effect for a listener and its children.
+	@param forker Pointer to the prefork_simple for the application.
+	@param cfg Pointer to the settings.
+
+	Everything here takes effect at once, or as soon as it's next needed.  Children already
+	running pick up max_requests, keepalive, and the log level from the shared
+	drone_settings before each request.  The status board can't grow, however, so
+	max_children can't go beyond what it was when the listener started.
+*/
+static void apply_config( prefork_simple* forker, const prefork_config* cfg ) {
+
+	int max_children = cfg->max_children;
+	if( max_children > forker->board_size ) {
+		osrfLogWarning( OSRF_LOG_MARK, "max_children (%d) can't grow beyond %d without "
+			"a restart; using %d", max_children, forker->board_size, forker->board_size );
+		max_children = forker->board_size;
+	}
+
+	if( max_children < 1 || cfg->min_children > max_children )
+		osrfLogError( OSRF_LOG_MARK, "Ignoring min_children (%d) and max_children (%d); "
+			"keeping %d and %d", cfg->min_children, max_children,
+			forker->min_children, forker->max_children );
+	else {
+		forker->min_children = cfg->min_children;
+		forker->max_children = max_children;
+	}
+
+	forker->max_requests = cfg->max_requests;
+	forker->max_backlog_queue = cfg->max_backlog_queue;
+	forker->keepalive = cfg->keepalive;
+	forker->handoff_threshold = (size_t) cfg->handoff;
+	forker->autoscale = cfg->autoscale;
+	forker->min_spare_children = cfg->min_spare;
+	forker->max_spare_children = cfg->max_spare;
+	forker->max_spawn_rate = cfg->spawn_rate;
+	if( forker->spawn_rate > forker->max_spawn_rate )
+		forker->spawn_rate = forker->max_spawn_rate;
+	forker->max_idle_time = cfg->max_idle;
+	forker->queue_wait_threshold = cfg->queue_wait;
+	forker->max_queue_wait = cfg->max_queue_wait;
+
+	osrfHashFree( forker->method_priority );
+	forker->method_priority = NULL;
+	osrfHashFree( forker->ingress_priority );
+	forker->ingress_priority = NULL;
+	load_priorities( forker, forker->appname );
+
+	forker->settings->max_requests = forker->max_requests;
+	forker->settings->keepalive = forker->keepalive;
+	forker->settings->log_level = osrfLogGetLevel();
+}
+
+/**
+	@brief Load the settings that children read only when they start.
+	@param appname Name of the application.
+	@return Pointer to a newly created jsonObject, or NULL if the application has no settings.
+
+	That's everything in the application's entry, less the settings that apply_config()
+	puts into effect on the fly.  The calling code is responsible for freeing the
+	jsonObject.
+*/
+static jsonObject* fixed_settings( const char* appname ) {
+	static const char* live[] = { "max_requests", "min_children", "max_children",
+		"max_backlog_queue", "shm_threshold", "autoscale", "min_spare_children",
+		"max_spare_children",
+		"max_spawn_rate", "max_idle_time", "queue_wait_threshold", "max_queue_wait",
+		"priority", NULL };
+
+	jsonObject* app = osrf_settings_host_value_object( "/apps/%s", appname );
+	if( app ) {
+		jsonObjectRemoveKey( app, "keepalive" );
+		jsonObject* unix_config = jsonObjectGetKey( app, "unix_config" );
+		int i;
+		for( i = 0; live[ i ]; i++ )
+			jsonObjectRemoveKey( unix_config, live[ i ] );
+	}
+	return app;
+}
+
+/**
+	@brief Compare two jsonObjects, disregarding the order of keys.
+	@param a Pointer to one jsonObject (may be NULL).
+	@param b Pointer to the other jsonObject (may be NULL).
+	@return 1 if they hold the same values, or 0 if not.
+
+	The settings server makes no promises about the order of keys, so comparing the JSON
+	text won't do.
+*/
+static int same_json( const jsonObject* a, const jsonObject* b ) {
+	if( !a || !b )
+		return a == b;
+	if( a->type != b->type )
+		return 0;
+
+	int same = 1;
+	unsigned long i;
+	switch( a->type ) {
+		case JSON_HASH : {
+			if( osrfHashGetCount( a->value.h ) != osrfHashGetCount( b->value.h ))
+				return 0;
+			jsonIterator* itr = jsonNewIterator( a );
+			const jsonObject* item;
+			while( same && ( item = jsonIteratorNext( itr )))
+				same = same_json( item, jsonObjectGetKeyConst( b, itr->key ));
+			jsonIteratorFree( itr );
+			break;
+		}
+		case JSON_ARRAY :
+			if( a->size != b->size )
+				return 0;
+			for( i = 0; same && i < a->size; i++ )
+				same = same_json( jsonObjectGetIndex( a, i ), jsonObjectGetIndex( b, i ));
+			break;
+		case JSON_STRING :
+		case JSON_NUMBER :
+			same = !strcmp( a->value.s, b->value.s );
+			break;
+		case JSON_BOOL :
+			same = a->value.b == b->value.b;
+			break;
+		default :
+			break;
+	}
+	return same;
+}
+
+/**
+	@brief Spawn and manage a collection of drone processes for servicing requests.
+	@param appname Name of the application.
+	@return 0 if successful, or -1 if error.
+*/
+int osrf_prefork_run( const char* appname ) {
+
+	if( !appname ) {
+		osrfLogError( OSRF_LOG_MARK, "osrf_prefork_run requires an appname to run!");
+		return -1;
+	}
+
+	set_proc_title( "OpenSRF Listener [%s]", appname );
+
+	// Get configuration settings
+	osrfLogInfo( OSRF_LOG_MARK, "Loading config in osrf_forker for app %s", appname );
+	prefork_config cfg;
+	read_prefork_config( appname, &cfg );
+
+
+	// Keep the listener off the drones' CPUs, if so configured
+	char* listener_cpus = osrf_settings_host_value(
+		"/apps/%s/unix_config/listener_cpu_affinity", appname );
+	osrfAffinityApply( listener_cpus, 0, 0, -1, "listener" );
+	free( listener_cpus );
 
 	char* resc = va_list_to_string( "%s_listener", appname );
 
@@ -196,7 +751,8 @@ int osrf_prefork_run( const char* appname ) {
 
 	prefork_simple forker;
 
-	if( prefork_simple_init( &forker, osrfSystemGetTransportClient(), maxr, minc, maxc, maxbq )) {
+	if( prefork_simple_init( &forker, osrfSystemGetTransportClient(), cfg.max_requests,
+			cfg.min_children, cfg.max_children, cfg.max_backlog_queue )) {
 		osrfLogError( OSRF_LOG_MARK,
 			"osrf_prefork_run() failed to create prefork_simple object" );
 		return -1;
@@ -204,14 +760,22 @@ int osrf_prefork_run( const char* appname ) {
 
 	// Finish initializing the prefork_simple.
 	forker.appname   = strdup( appname );
-	forker.keepalive = kalive;
+	apply_config( &forker, &cfg );
+	forker.fixed_config = fixed_settings( appname );
 	global_forker = &forker;
 
+	// Fork the template process, if we're using one, before any children
+	// so that it doesn't inherit any of their pipes.
+	if( cfg.use_template )
+		template_start( &forker );
+
 	// Spawn the children; put them in the idle list.
 	prefork_launch_children( &forker );
+	int started = wait_for_children( &forker );
 
 	// Tell the router that you're open for business.
 	osrf_prefork_register_routers( appname, false );
+	osrfSystemReportReady( started ? "ready" : "drones failed to start" );
 
 	signal( SIGUSR1, sigusr1_handler);
 	signal( SIGUSR2, sigusr2_handler);
@@ -260,7 +824,18 @@ static void osrf_prefork_send_router_registration(
     } else {
 
 	    osrfLogInfo( OSRF_LOG_MARK, "%s registering with router %s", appname, jid );
-	    msg = message_init( "registering", NULL, NULL, jid, NULL );
+
+	    // Advertise how many requests we can work on at once, for load-aware routing,
+	    // and where we are, for locality-aware routing
+	    jsonObject* reg = jsonNewObjectType( JSON_HASH );
+	    jsonObjectSetKey( reg, "capacity",
+	        jsonNewNumberObject( global_forker ? global_forker->max_children : 1 ));
+	    if( client->locality )
+	        jsonObjectSetKey( reg, "locality", jsonNewObject( client->locality ));
+	    char* body = jsonObjectToJSON( reg );
+	    jsonObjectFree( reg );
+	    msg = message_init( body, NULL, NULL, jid, NULL );
+	    free( body );
 	    message_set_router_info( msg, NULL, NULL, appname, "register", 0 );
     }
 
@@ -324,10 +899,11 @@ static void osrf_prefork_parse_router_chunk(
 /**
 	@brief Register the application with one or more routers, according to the configuration.
 	@param appname Name of the application.
+	@param unregister Boolean: true to unregister instead.
 
-	Called only by the parent process.
+	Called only by the parent process, or by the listener of a worker pool.
 */
-static void osrf_prefork_register_routers( const char* appname, bool unregister ) {
+void osrf_prefork_register_routers( const char* appname, bool unregister ) {
 
 	jsonObject* routerInfo = osrfConfigGetValueObject( NULL, "/routers/router" );
 
@@ -353,23 +929,63 @@ static void osrf_prefork_register_routers( const char* appname, bool unregister
 	jsonObjectFree( routerInfo );
 }
 
+/**
+	@brief Pin a child process to its CPUs, according to the settings for the application.
+	@param child Pointer to the prefork_child representing the new child process.
+
+	The configuration looks like this, where any element may be omitted:
+
+	@code
+	<unix_config>
+	  <cpu_affinity>0-7,16-23</cpu_affinity>
+	  <numa_spread>true</numa_spread>
+	  <numa_bind_memory>false</numa_bind_memory>
+	</unix_config>
+	@endcode
+
+	With numa_spread, each child runs on the CPUs that one NUMA node shares with
+	cpu_affinity, taking the nodes in turn by status board slot.  Since the slots are
+	handed out lowest first, the children stay spread evenly as they come and go.
+*/
+static void apply_drone_affinity( const prefork_child* child ) {
+	char* cpus   = osrf_settings_host_value( "/apps/%s/unix_config/cpu_affinity",
+		child->appname );
+	char* spread = osrf_settings_host_value( "/apps/%s/unix_config/numa_spread",
+		child->appname );
+	char* bind   = osrf_settings_host_value( "/apps/%s/unix_config/numa_bind_memory",
+		child->appname );
+
+	osrfAffinityApply( cpus, spread && !strcasecmp( spread, "true" ),
+		bind && !strcasecmp( bind, "true" ), child->slot_number, "drone" );
+
+	free( cpus );
+	free( spread );
+	free( bind );
+}
+
 /**
 	@brief Initialize a child process.
 	@param child Pointer to the prefork_child representing the new child process.
 	@return Zero if successful, or -1 if not.
 
 	Called only by child processes.  Actions:
+	- Pin the process to its CPUs, if so configured
 	- Connect to one or more cache servers
 	- Reconfigure logger, if necessary
 	- Discard parent's Jabber connection and open a new one
 	- Dynamically call an application-specific initialization routine
+	- Set how long to hold back responses to pipelined requests, if so configured
 	- Change the command line as reported by ps
 */
 static int prefork_child_init_hook( prefork_child* child ) {
 
 	if( !child ) return -1;
+	osrfLogResetPid();
 	osrfLogDebug( OSRF_LOG_MARK, "Child init hook for child %d", child->pid );
 
+	// Pin ourselves before we touch much memory, so that it's allocated locally
+	apply_drone_affinity( child );
+
 	// Connect to cache server(s).
 	osrfSystemInitCache();
 	char* resc = va_list_to_string( "%s_drone", child->appname );
@@ -393,6 +1009,12 @@ static int prefork_child_init_hook( prefork_child* child ) {
 
 	free( resc );
 
+	// Set up whatever the template process would have, if we didn't come from one.
+	if( !child->from_template && osrfAppRunTemplateInit( child->appname )) {
+		osrfLogError( OSRF_LOG_MARK, "Prefork template_init failed\n" );
+		return -1;
+	}
+
 	// Dynamically call the application-specific initialization function
 	// from a previously loaded shared library.
 	if( ! osrfAppRunChildInit( child->appname )) {
@@ -402,6 +1024,13 @@ static int prefork_child_init_hook( prefork_child* child ) {
 		return -1;
 	}
 
+	// Hold back the responses to pipelined requests, so as to send them together
+	char* batch_wait = osrf_settings_host_value( "/apps/%s/unix_config/response_batch_wait",
+		child->appname );
+	if( batch_wait )
+		osrf_stack_set_batch_wait( atoi( batch_wait ));
+	free( batch_wait );
+
 	// Change the command line as reported by ps
 	set_proc_title( "OpenSRF Drone [%s]", child->appname );
 	return 0;
@@ -410,13 +1039,14 @@ static int prefork_child_init_hook( prefork_child* child ) {
 /**
 	@brief Respond to a client request forwarded by the parent.
 	@param child Pointer to the state of the child process.
-	@param data Pointer to the raw XMPP message received from the parent.
+	@param data Pointer to the message received from the parent, as packed by message_pack().
+	@param len Length of the packed message.
 	@return 0 on success; non-zero means that the child process should clean itself up
 		and terminate immediately, presumably due to a fatal error condition.
 
 	Called only by a child process.
 */
-static int prefork_child_process_request( prefork_child* child, char* data ) {
+static int prefork_child_process_request( prefork_child* child, const char* data, size_t len ) {
 	if( !child ) return 0;
 
 	transport_client* client = osrfSystemGetTransportClient();
@@ -433,8 +1063,15 @@ static int prefork_child_process_request( prefork_child* child, char* data ) {
 		}
 	}
 
-	// Construct the message from the xml.
-	transport_message* msg = new_message_from_xml( data );
+	// Rebuild the message that the parent parsed, without parsing it again.
+	transport_message* msg = message_unpack( data, len );
+	if( !msg )
+		return 0;
+
+	// As new_message_from_xml() would, take the router's word for who sent it, so that
+	// we reply to the client rather than to the router
+	if( msg->router_from && *msg->router_from )
+		message_set_sender( msg, msg->router_from );
 
 	// Respond to the transport message.  This is where method calls are buried.
 	osrfAppSession* session = osrf_stack_transport_handler( msg, child->appname );
@@ -466,7 +1103,7 @@ static int prefork_child_process_request( prefork_child* child, char* data ) {
 	// either the client disconnects or an error occurs.
 
 	osrfLogDebug( OSRF_LOG_MARK, "Entering keepalive loop for session %s", session->session_id );
-	int keepalive = child->keepalive;
+	int keepalive = child->settings->keepalive;
 	int retval;
 	int recvd;
 	time_t start;
@@ -523,6 +1160,33 @@ static int prefork_child_process_request( prefork_child* child, char* data ) {
 	return rc;
 }
 
+/**
+	@brief Set up the lock guarding the shared method_table.
+	@param table Pointer to the method_table, in memory shared with the children.
+	@return Zero if successful, or 1 if not.
+
+	The lock is shared between processes, and robust, so that a child can recover it
+	from another child that died holding it.
+*/
+static int init_method_lock( method_table* table ) {
+	pthread_mutexattr_t attr;
+	int rc = pthread_mutexattr_init( &attr );
+	if( !rc )
+		rc = pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+	if( !rc )
+		rc = pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+	if( !rc )
+		rc = pthread_mutex_init( &table->lock, &attr );
+	pthread_mutexattr_destroy( &attr );
+
+	if( rc ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to set up latency statistics lock: %s",
+			strerror( rc ));
+		return 1;
+	}
+	return 0;
+}
+
 /**
 	@brief Partially initialize a prefork_simple provided by the caller.
 	@param prefork Pointer to a a raw prefork_simple to be initialized.
@@ -532,7 +1196,11 @@ static int prefork_child_process_request( prefork_child* child, char* data ) {
 	@param min_children Minimum number of child processes to maintain.
 	@param max_children Maximum number of child processes to maintain.
 	@param max_backlog_queue Maximum size of backlog queue.
-	@return 0 if successful, or 1 if not (due to invalid parameters).
+	@return 0 if successful, or 1 if not (due to invalid parameters, or failure to set up
+		the status board).
+
+	The status board and its doorbell are created here, before any children are forked,
+	so that every child inherits them.
 */
 static int prefork_simple_init( prefork_simple* prefork, transport_client* client,
 		int max_requests, int min_children, int max_children, int max_backlog_queue ) {
@@ -543,9 +1211,8 @@ static int prefork_simple_init( prefork_simple* prefork, transport_client* clien
 		return 1;
 	}
 
-	if( max_children > ABS_MAX_CHILDREN ) {
-		osrfLogError( OSRF_LOG_MARK,  "max_children (%d) is greater than ABS_MAX_CHILDREN (%d)",
-			max_children, ABS_MAX_CHILDREN );
+	if( max_children < 1 ) {
+		osrfLogError( OSRF_LOG_MARK,  "max_children (%d) must be at least 1", max_children );
 		return 1;
 	}
 
@@ -562,145 +1229,1016 @@ static int prefork_simple_init( prefork_simple* prefork, transport_client* clien
 	prefork->data_to_parent = 0;
 	prefork->current_num_children = 0;
 	prefork->keepalive    = 0;
+	prefork->autoscale = 0;
+	prefork->min_spare_children = 0;
+	prefork->max_spare_children = 0;
+	prefork->max_spawn_rate = MAX_SPAWN_RATE;
+	prefork->spawn_rate   = 1;
+	prefork->max_idle_time = MAX_IDLE_TIME;
+	prefork->queue_wait_threshold = 0.0;
+	prefork->max_queue_wait = 0.0;
+	prefork->method_priority = NULL;
+	prefork->ingress_priority = NULL;
+	prefork->last_scale   = 0.0;
+	prefork->last_finished = 0.0;
+	prefork->handoff_threshold = 0;
+	prefork->handoff_count = 0;
 	prefork->appname      = NULL;
 	prefork->first_child  = NULL;
 	prefork->idle_list    = NULL;
+	prefork->idle_tail    = NULL;
+	prefork->idle_count   = 0;
 	prefork->free_list    = NULL;
 	prefork->connection   = client;
-	prefork->sighup_pending_list = NULL;
+	prefork->pid_index    = osrfNewHash();
+	prefork->slot_index   = safe_malloc( max_children * sizeof( prefork_child* ));
+	prefork->template_fd  = -1;
+	prefork->template_pid = 0;
+	prefork->fixed_config = NULL;
+	prefork->generation   = 0;
+	prefork->rolling      = 0;
+	prefork->reload_pid   = 0;
+	prefork->reload_file  = NULL;
+
+	// Set up the status board, one slot per potential child, followed by the ready queue
+	// and then, on a cache line boundary, the method statistics
+	unsigned long queue_size = 2;
+	while( queue_size < 2 * (unsigned long) max_children )
+		queue_size *= 2;
+	size_t queue_bytes = sizeof( ready_queue ) + queue_size * sizeof( uint64_t );
+	size_t table_offset = max_children * sizeof( drone_slot ) + ( ( queue_bytes + 63 ) & ~63 );
+	prefork->board_size = max_children;
+	prefork->board_bytes = table_offset + sizeof( method_table ) + sizeof( drone_settings );
+	prefork->board = mmap( NULL, prefork->board_bytes,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( MAP_FAILED == prefork->board ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to map drone status board: %s",
+			strerror( errno ));
+		prefork->board = NULL;
+		return 1;
+	}
+	memset( prefork->board, 0, prefork->board_bytes );
+	prefork->ready = (ready_queue*) ( prefork->board + max_children );
+	prefork->ready->mask = queue_size - 1;
+	prefork->ready_head = 0;
+	prefork->ready_stalled = 0;
+	prefork->methods = (method_table*) ( (char*) prefork->board + table_offset );
+	prefork->settings = (drone_settings*) ( prefork->methods + 1 );
+	if( init_method_lock( prefork->methods )) {
+		munmap( prefork->board, prefork->board_bytes );
+		prefork->board = NULL;
+		return 1;
+	}
+	prefork->settings->max_requests = max_requests;
+	prefork->settings->keepalive = 0;
+	prefork->settings->log_level = osrfLogGetLevel();
+
+	// Set up the doorbell
+#ifdef HAVE_SYS_EVENTFD_H
+	prefork->bell_read_fd = eventfd( 0, EFD_NONBLOCK );
+	prefork->bell_write_fd = prefork->bell_read_fd;
+	if( prefork->bell_read_fd < 0 ) {
+#else
+	int bell_fd[2];
+	if( pipe( bell_fd ) < 0 ) {
+#endif
+		osrfLogError( OSRF_LOG_MARK, "Unable to create drone doorbell: %s",
+			strerror( errno ));
+		munmap( prefork->board, prefork->board_bytes );
+		prefork->board = NULL;
+		return 1;
+	}
+#ifndef HAVE_SYS_EVENTFD_H
+	prefork->bell_read_fd = bell_fd[0];
+	prefork->bell_write_fd = bell_fd[1];
+	set_fl( prefork->bell_read_fd, O_NONBLOCK );
+	set_fl( prefork->bell_write_fd, O_NONBLOCK );
+#endif
 
 	return 0;
 }
 
 /**
-	@brief Spawn a new child process and put it in the idle list.
-	@param forker Pointer to the prefork_simple that will own the process.
-	@return Pointer to the new prefork_child, or not at all.
-
-	Spawn a new child process.  Create a prefork_child for it and put it in the idle list.
-
-	After forking, the parent returns a pointer to the new prefork_child.  The child
-	services its quota of requests and then terminates without returning.
+	@brief Claim an unused slot on the status board for a new child.
+	@param forker Pointer to the prefork_simple that owns the board.
+	@return Pointer to the slot, or NULL if they're all in use.
 */
-static prefork_child* launch_child( prefork_simple* forker ) {
-
-	pid_t pid;
-	int data_fd[2];
-	int status_fd[2];
-
-	// Set up the data and status pipes
-	if( pipe( data_fd ) < 0 ) { /* build the data pipe*/
-		osrfLogError( OSRF_LOG_MARK,  "Pipe making error" );
-		return NULL;
+static drone_slot* claim_drone_slot( prefork_simple* forker ) {
+	int i;
+	for( i = 0; i < forker->board_size; i++ ) {
+		drone_slot* slot = forker->board + i;
+		if( DRONE_FREE == slot->state ) {
+			slot->pid = 0;
+			slot->served = 0;
+			slot->request_start = 0;
+			slot->method_start = 0;
+			slot->started = 0;
+			slot->method[ 0 ] = '\0';
+			slot->xid[ 0 ] = '\0';
+			slot->state = DRONE_IDLE;
+			return slot;
+		}
 	}
+	return NULL;
+}
 
-	if( pipe( status_fd ) < 0 ) {/* build the status pipe */
-		osrfLogError( OSRF_LOG_MARK,  "Pipe making error" );
-		close( data_fd[1] );
-		close( data_fd[0] );
-		return NULL;
-	}
+/**
+	@brief Mark a child busy on the status board.
+	@param child Pointer to the prefork_child about to be sent a request.
 
-	osrfLogInternal( OSRF_LOG_MARK, "Pipes: %d %d %d %d",
-		data_fd[0], data_fd[1], status_fd[0], status_fd[1] );
+	Called by the parent before it writes the request, so that it can't overwrite the
+	child's report of having finished it.
+*/
+static void mark_drone_busy( prefork_child* child ) {
+	child->slot->state = DRONE_BUSY;
+	__sync_synchronize();
+}
 
-	// Create and initialize a prefork_child for the new process
-	prefork_child* child = prefork_child_init( forker, data_fd[0],
-		data_fd[1], status_fd[0], status_fd[1] );
+/**
+	@brief Tell the parent that this child is available for another request.
+	@param child Pointer to the prefork_child representing the child process.
 
-	if( (pid=fork()) < 0 ) {
-		osrfLogError( OSRF_LOG_MARK, "Forking Error" );
-		prefork_child_free( forker, child );
-		return NULL;
-	}
+	Called only by a child process.  Mark the slot idle, and add it to the ready queue;
+	then ring the doorbell in case
+	the parent is waiting on it.  If the doorbell is already full, the parent has plenty
+	of notice, so ignore EAGAIN.
+*/
+static void mark_drone_idle( prefork_child* child ) {
+	drone_slot* slot = child->slot;
+	if( slot->pid != child->pid )
+		return;    // The parent has already given up on us
+
+	slot->served++;
+	__sync_synchronize();
+	slot->state = DRONE_IDLE;
+
+	// Join the ready queue.  Should we be so slow that the parent has stepped over our
+	// position, and someone else has since claimed the entry, leave theirs alone.
+	ready_queue* ready = child->ready;
+	unsigned long pos = __sync_fetch_and_add( &ready->tail, 1 );
+	uint64_t report = READY_REPORT( pos, child->slot_number );
+	volatile uint64_t* entry = ready->entries + ( pos & ready->mask );
+	uint64_t old = *entry;
+	while( !READY_NEWER( old, READY_STAMP( pos ))
+			&& !__sync_bool_compare_and_swap( entry, old, report ))
+		old = *entry;
+	__sync_synchronize();
+
+	uint64_t one = 1;
+	if( write( child->bell_fd, &one, sizeof( one )) < 0 && errno != EAGAIN )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to ring listener's doorbell: %s",
+			strerror( errno ));
+}
 
-	// Add the new child to the head of the idle list
-	child->next = forker->idle_list;
-	forker->idle_list = child;
+/**
+	@brief Empty the doorbell, so that the next wait blocks until a child rings it again.
+	@param forker Pointer to the prefork_simple that owns the doorbell.
+*/
+static void drain_doorbell( prefork_simple* forker ) {
+	char buf[ 64 ];
+	while( read( forker->bell_read_fd, buf, sizeof( buf )) == sizeof( buf ))
+		;
+}
 
-	if( pid > 0 ) {  /* parent */
+/** The child process we're running in, if we're a drone; used by the method monitor. */
+static prefork_child* drone_self = NULL;
 
-		signal( SIGCHLD, sigchld_handler );
-		( forker->current_num_children )++;
-		child->pid = pid;
+/** A drone's private index of the shared method_table, keyed by method name. */
+static osrfHash* drone_method_index = NULL;
 
-		osrfLogDebug( OSRF_LOG_MARK, "Parent launched %d", pid );
-		/* *no* child pipe FD's can be closed or the parent will re-use fd's that
-			the children are currently using */
-		return child;
-	}
+/**
+	@brief Copy a string into a fixed-size field on the status board, truncating it to fit.
+	@param dest Pointer to the field.
+	@param src Pointer to the string to copy, or NULL to clear the field.
+	@param size Size of the field.
+*/
+static void board_copy( char* dest, const char* src, size_t size ) {
+	size_t len = src ? strlen( src ) : 0;
+	if( len >= size )
+		len = size - 1;
+	if( len )
+		memcpy( dest, src, len );
+	dest[ len ] = '\0';
+}
 
-	else { /* child */
+/**
+	@brief Find a method's entry in the shared method_table, adding one if necessary.
+	@param forker Pointer to the prefork_simple that owns the table.
+	@param name Name of the method.
+	@return Pointer to the entry, or NULL if the table is full.
 
-		// we don't want to adopt our parent's handlers.
-		signal( SIGUSR1, SIG_DFL );
-		signal( SIGUSR2, SIG_DFL );
-		signal( SIGTERM, SIG_DFL );
-		signal( SIGINT,  SIG_DFL );
-		signal( SIGQUIT, SIG_DFL );
-		signal( SIGCHLD, SIG_DFL );
-		signal( SIGHUP,  SIG_DFL );
-
-		osrfLogInternal( OSRF_LOG_MARK,
-			"I am new child with read_data_fd = %d and write_status_fd = %d",
-			child->read_data_fd, child->write_status_fd );
-
-		child->pid = getpid();
-		close( child->write_data_fd );
-		close( child->read_status_fd );
+	Called only by a child process.
+*/
+static method_stats* find_method_stats( prefork_simple* forker, const char* name ) {
+	method_stats* stats = osrfHashGet( drone_method_index, name );
+	if( stats )
+		return stats;
+
+	method_table* table = forker->methods;
+	int rc = pthread_mutex_lock( &table->lock );
+	if( EOWNERDEAD == rc ) {
+		// A child died while adding an entry; whatever it left half done is unused
+		osrfLogWarning( OSRF_LOG_MARK,
+			"Recovering latency statistics lock from a dead child" );
+		pthread_mutex_consistent( &table->lock );
+	} else if( rc ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to lock latency statistics: %s",
+			strerror( rc ));
+		return NULL;
+	}
 
-		/* do the initing */
-		if( prefork_child_init_hook( child ) == -1 ) {
-			osrfLogError( OSRF_LOG_MARK,
-				"Forker child going away because we could not connect to OpenSRF..." );
-			osrf_prefork_child_exit( child );
+	// Some other child may have added it since we last looked
+	int i;
+	for( i = 0; i < table->used; i++ )
+		if( !strcmp( table->entries[ i ].name, name )) {
+			stats = table->entries + i;
+			break;
 		}
 
-		prefork_child_wait( child );      // Should exit without returning
-		osrf_prefork_child_exit( child ); // Just to be sure
-		return NULL;  // Unreachable, but it keeps the compiler happy
+	if( !stats && table->used < METHOD_STATS_MAX ) {
+		stats = table->entries + table->used;
+		board_copy( stats->name, name, sizeof( stats->name ));
+		__sync_synchronize();   // The name must be seen before the new entry
+		table->used++;
 	}
-}
 
-/**
-	@brief Terminate a child process.
-	@param child Pointer to the prefork_child representing the child process (not used).
+	pthread_mutex_unlock( &table->lock );
 
-	Called only by child processes.  Dynamically call an application-specific shutdown
-	function from a previously loaded shared library; then exit.
-*/
-static void osrf_prefork_child_exit( prefork_child* child ) {
-	osrfAppRunExitCode();
-	exit( 0 );
+	if( stats )
+		osrfHashSet( drone_method_index, stats, "%s", name );
+	else
+		osrfLogWarning( OSRF_LOG_MARK, "No room for latency statistics on method %s",
+			name );
+	return stats;
 }
 
 /**
-	@brief Launch all the child processes, putting them in the idle list.
-	@param forker Pointer to the prefork_simple that will own the children.
+	@brief Post the name of a method that's about to run, and the current transaction ID.
+	@param method_name Name of the method.
 
-	Called only by the parent process (in order to become a parent).
+	Installed as the start callback of the method monitor in each child process.
 */
-static void prefork_launch_children( prefork_simple* forker ) {
-	if( !forker ) return;
-	int c = 0;
-	while( c++ < forker->min_children )
-		launch_child( forker );
+static void drone_method_start( const char* method_name ) {
+	drone_slot* slot = drone_self->slot;
+	board_copy( slot->method, method_name, sizeof( slot->method ));
+	board_copy( slot->xid, osrfLogGetXid(), sizeof( slot->xid ));
+	slot->method_start = get_timestamp_millis();
 }
 
 /**
-	@brief Signal handler for SIGCHLD: note that a child process has terminated.
-	@param sig The value of the trapped signal; always SIGCHLD.
+	@brief Clear the current method from the status board, and record how long it took.
+	@param method_name Name of the method.
+	@param elapsed How long the method took, in seconds.
 
-	Set a boolean to be checked later.
+	Installed as the finish callback of the method monitor in each child process.
 */
-static void sigchld_handler( int sig ) {
-	signal( SIGCHLD, sigchld_handler );
-	child_dead = 1;
+static void drone_method_finish( const char* method_name, double elapsed ) {
+	drone_slot* slot = drone_self->slot;
+	slot->method_start = 0.0;
+	slot->method[ 0 ] = '\0';
+	slot->xid[ 0 ] = '\0';
+
+	method_stats* stats = find_method_stats( global_forker, method_name );
+	if( !stats )
+		return;
+
+	unsigned long usec = elapsed > 0.0 ? (unsigned long) ( elapsed * 1000000.0 ) : 0;
+	int bucket = 0;
+	while( bucket < LATENCY_BUCKETS - 1 && usec >= ( 1000UL << bucket ))
+		bucket++;
+
+	__sync_fetch_and_add( &stats->buckets[ bucket ], 1 );
+	__sync_fetch_and_add( &stats->total_usec, usec );
+	__sync_fetch_and_add( &stats->count, 1 );
+
+	unsigned long old_max = stats->max_usec;
+	while( usec > old_max ) {
+		unsigned long seen = __sync_val_compare_and_swap( &stats->max_usec, old_max, usec );
+		if( seen == old_max )
+			break;
+		old_max = seen;
+	}
 }
 
 /**
-	@brief Signal handler for SIGUSR1
-	@param sig The value of the trapped signal; always SIGUSR1.
+	@brief Describe the state of every child and the latency of every method.
+	@param forker Pointer to the prefork_simple that owns the status board.
+	@return Pointer to a newly allocated jsonObject.
+
+	The result is a hash with two entries: "drones", an array with one hash per child,
+	and "methods", a hash of statistics keyed by method name.  Each method's "histogram"
+	counts calls by latency: under 1 ms, under 2 ms, under 4 ms, and so on, with the last
+	entry counting everything from 16 seconds up.
+
+	Called by the parent when it traps SIGUSR2, and by any child asked to run
+	opensrf.system.drone_stats.  The caller is responsible for freeing the result.
+*/
+static jsonObject* drone_stats( const prefork_simple* forker ) {
+	static const char* const state_names[] = { "free", "idle", "busy", "exiting" };
+	double now = get_timestamp_millis();
+	char buf[ DRONE_METHOD_SIZE ];
+	int i, j;
+
+	jsonObject* drones = jsonNewObjectType( JSON_ARRAY );
+	for( i = 0; i < forker->board_size; i++ ) {
+		const drone_slot* slot = forker->board + i;
+		int state = slot->state;
+		if( DRONE_FREE == state || state < 0 || state > DRONE_EXITING )
+			continue;
+
+		jsonObject* drone = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( drone, "pid", jsonNewNumberObject( slot->pid ));
+		jsonObjectSetKey( drone, "state", jsonNewObject( state_names[ state ] ));
+		jsonObjectSetKey( drone, "served", jsonNewNumberObject( slot->served ));
+
+		double method_start = slot->method_start;
+		if( DRONE_BUSY == state && method_start > 0.0 ) {
+			memcpy( buf, slot->method, sizeof( slot->method ));
+			buf[ sizeof( buf ) - 1 ] = '\0';
+			jsonObjectSetKey( drone, "method", jsonNewObject( buf ));
+			memcpy( buf, slot->xid, sizeof( slot->xid ));
+			buf[ sizeof( slot->xid ) - 1 ] = '\0';
+			jsonObjectSetKey( drone, "xid", jsonNewObject( buf ));
+			jsonObjectSetKey( drone, "started", jsonNewNumberObject( method_start ));
+			jsonObjectSetKey( drone, "running", jsonNewNumberObject( now - method_start ));
+		}
+		jsonObjectPush( drones, drone );
+	}
+
+	jsonObject* methods = jsonNewObjectType( JSON_HASH );
+	int used = forker->methods->used;
+	__sync_synchronize();   // Read the count of entries before the entries themselves
+	for( i = 0; i < used && i < METHOD_STATS_MAX; i++ ) {
+		const method_stats* stats = forker->methods->entries + i;
+		jsonObject* method = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( method, "count", jsonNewNumberObject( stats->count ));
+		jsonObjectSetKey( method, "total", jsonNewNumberObject( stats->total_usec / 1e6 ));
+		jsonObjectSetKey( method, "max", jsonNewNumberObject( stats->max_usec / 1e6 ));
+		jsonObject* histogram = jsonNewObjectType( JSON_ARRAY );
+		for( j = 0; j < LATENCY_BUCKETS; j++ )
+			jsonObjectPush( histogram, jsonNewNumberObject( stats->buckets[ j ] ));
+		jsonObjectSetKey( method, "histogram", histogram );
+		jsonObjectSetKey( methods, stats->name, method );
+	}
+
+	jsonObject* report = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( report, "drones", drones );
+	jsonObjectSetKey( report, "methods", methods );
+	return report;
+}
+
+/**
+	@brief Build the response to opensrf.system.drone_stats.
+	@return Pointer to a newly allocated jsonObject.
+
+	Installed as the report callback of the method monitor in each child process.
+*/
+static jsonObject* drone_method_report( void ) {
+	return drone_stats( global_forker );
+}
+
+/**
+	@brief Write the state of every child and the latency of every method to the log.
+	@param forker Pointer to the prefork_simple that owns the status board.
+
+	Called by the parent after it traps SIGUSR2.  Log one line per child and one per
+	method, so that no one line gets too long for syslog.
+*/
+static void dump_drone_stats( prefork_simple* forker ) {
+	jsonObject* report = drone_stats( forker );
+
+	const jsonObject* drones = jsonObjectGetKeyConst( report, "drones" );
+	osrfLogInfo( OSRF_LOG_MARK, "Drone stats for %s: %d drones",
+		forker->appname, (int) drones->size );
+	unsigned int i;
+	for( i = 0; i < drones->size; i++ ) {
+		char* json = jsonObjectToJSON( jsonObjectGetIndex( drones, i ));
+		osrfLogInfo( OSRF_LOG_MARK, "Drone stats: drone %s", json );
+		free( json );
+	}
+
+	jsonIterator* itr = jsonNewIterator( jsonObjectGetKeyConst( report, "methods" ));
+	const jsonObject* method;
+	while( (method = jsonIteratorNext( itr ))) {
+		char* json = jsonObjectToJSON( method );
+		osrfLogInfo( OSRF_LOG_MARK, "Drone stats: method %s %s", itr->key, json );
+		free( json );
+	}
+	jsonIteratorFree( itr );
+
+	jsonObjectFree( report );
+}
+
+/**
+	@brief Write a buffer in full, resuming after partial writes and interruptions.
+	@param fd File descriptor to write to.
+	@param buf Pointer to the bytes to be written.
+	@param len Number of bytes to write.
+	@return 0 if successful, or -1 if not.
+*/
+static int write_full( int fd, const void* buf, size_t len ) {
+	const char* p = buf;
+	while( len > 0 ) {
+		ssize_t n = write( fd, p, len );
+		if( n < 0 ) {
+			if( EINTR == errno )
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+	@brief Read a buffer in full, resuming after partial reads and interruptions.
+	@param fd File descriptor to read from.
+	@param buf Pointer to the buffer to fill.
+	@param len Number of bytes to read.
+	@return 1 if successful, 0 if the other end closed the pipe, or -1 on error.
+*/
+static int read_full( int fd, void* buf, size_t len ) {
+	char* p = buf;
+	while( len > 0 ) {
+		ssize_t n = read( fd, p, len );
+		if( n < 0 ) {
+			if( EINTR == errno )
+				continue;
+			return -1;
+		} else if( 0 == n )
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/**
+	@brief Remove the shared memory segment, if any, for a child's last request.
+	@param child Pointer to the prefork_child that was sent the request.
+
+	Called by the parent once the child is done with the request, or dead.
+*/
+static void release_handoff( prefork_child* child ) {
+	if( child->handoff[ 0 ] ) {
+		shm_unlink( child->handoff );
+		child->handoff[ 0 ] = '\0';
+	}
+}
+
+/**
+	@brief Copy a large request into a new shared memory segment.
+	@param forker Pointer to the prefork_simple that owns the child.
+	@param child Pointer to the prefork_child to be sent the request.
+	@param data Pointer to the request.
+	@param len Length of the request.
+	@return 0 if successful, in which case the segment is named in child->handoff,
+		or -1 if not.
+*/
+static int make_handoff( prefork_simple* forker, prefork_child* child,
+		const char* data, size_t len ) {
+
+	snprintf( child->handoff, sizeof( child->handoff ), "/osrf-prefork-%ld-%lu",
+		(long) getpid(), ++forker->handoff_count );
+
+	int fd = shm_open( child->handoff, O_CREAT | O_EXCL | O_RDWR, 0600 );
+	if( fd < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to create shared memory segment %s: %s",
+			child->handoff, strerror( errno ));
+		child->handoff[ 0 ] = '\0';
+		return -1;
+	}
+
+	int rc = write_full( fd, data, len );
+	if( rc )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to fill shared memory segment %s: %s",
+			child->handoff, strerror( errno ));
+	close( fd );
+
+	if( rc )
+		release_handoff( child );
+	return rc;
+}
+
+/**
+	@brief Send a request to a child process.
+	@param forker Pointer to the prefork_simple that owns the child.
+	@param child Pointer to the prefork_child to be sent the request.
+	@param msg Pointer to the request.
+	@return 0 if successful, or -1 if not, in which case the child is presumably unusable.
+
+	Pack the request with message_pack(), so that the child doesn't have to parse XML
+	that we just finished parsing.  Write a request_frame, followed either by the packed
+	request itself or, if it is at least as big as the handoff threshold, by the name of
+	a shared memory segment holding it.  If we can't set up the segment, fall back to
+	the pipe.
+
+	After the name of a segment, and its terminal nul, comes a packed transport_message
+	with the request's addresses, thread, and transaction ID, but no body: what the child
+	needs to tell the client that something went wrong, if it can't map the segment.
+*/
+static int send_request( prefork_simple* forker, prefork_child* child,
+		const transport_message* msg ) {
+
+	size_t len = 0;
+	char* data = message_pack( msg, &len );
+	if( !data )
+		return -1;
+
+	request_frame frame;
+	frame.type = FRAME_PIPE;
+	frame.length = len;
+	const char* payload = data;
+	char* reply_to = NULL;
+	size_t reply_len = 0;
+	size_t name_len = 0;
+
+	if( forker->handoff_threshold && frame.length >= forker->handoff_threshold
+			&& 0 == make_handoff( forker, child, data, frame.length )) {
+		transport_message* envelope =
+			message_init( NULL, NULL, msg->thread, msg->recipient, msg->sender );
+		message_set_router_info( envelope, msg->router_from, NULL, NULL, NULL, 0 );
+		message_set_osrf_xid( envelope, msg->osrf_xid );
+		reply_to = message_pack( envelope, &reply_len );
+		message_free( envelope );
+
+		name_len = strlen( child->handoff ) + 1;
+		frame.type = FRAME_SHM;
+		frame.length = name_len + reply_len;
+		payload = child->handoff;
+	}
+
+	int rc = 0;
+	if( write_full( child->write_data_fd, &frame, sizeof( frame ))
+			|| write_full( child->write_data_fd, payload, frame.length - reply_len )
+			|| ( reply_len && write_full( child->write_data_fd, reply_to, reply_len ))) {
+		release_handoff( child );
+		rc = -1;
+	}
+
+	free( reply_to );
+	free( data );
+	return rc;
+}
+
+/**
+	@brief Spawn a new child process and put it in the idle list.
+	@param forker Pointer to the prefork_simple that will own the process.
+	@return Pointer to the new prefork_child, or not at all.
+
+	Spawn a new child process.  Create a prefork_child for it and put it in the idle list.
+
+	After forking, the parent returns a pointer to the new prefork_child.  The child
+	services its quota of requests and then terminates without returning.
+*/
+static prefork_child* launch_child( prefork_simple* forker ) {
+
+	pid_t pid = -1;
+	int data_fd[2];
+
+	drone_slot* slot = claim_drone_slot( forker );
+	if( !slot ) {
+		osrfLogError( OSRF_LOG_MARK, "No free slot on the drone status board" );
+		return NULL;
+	}
+
+	// Set up the data pipe
+	if( pipe( data_fd ) < 0 ) { /* build the data pipe*/
+		osrfLogError( OSRF_LOG_MARK,  "Pipe making error" );
+		slot->state = DRONE_FREE;
+		return NULL;
+	}
+
+	osrfLogInternal( OSRF_LOG_MARK, "Pipes: %d %d", data_fd[0], data_fd[1] );
+
+	// Create and initialize a prefork_child for the new process
+	prefork_child* child = prefork_child_init( forker, data_fd[0], data_fd[1], slot );
+
+	// Let the template process fork it, if possible
+	if( forker->template_fd >= 0 ) {
+		if( ( pid = template_launch( forker, child )) > 0 ) {
+			close( child->read_data_fd );
+			child->read_data_fd = -1;
+			child->from_template = 1;
+		} else
+			template_stop( forker );
+	}
+
+	if( !child->from_template && (pid=fork()) < 0 ) {
+		osrfLogError( OSRF_LOG_MARK, "Forking Error" );
+		prefork_child_free( forker, child );
+		return NULL;
+	}
+
+	if( pid > 0 ) {  /* parent */
+
+		signal( SIGCHLD, sigchld_handler );
+		( forker->current_num_children )++;
+		child->pid = pid;
+		slot->pid = pid;
+		osrfHashSet( forker->pid_index, child, "%ld", (long) pid );
+
+		// Add the new child to the head of the idle list
+		idle_push( forker, child );
+
+		osrfLogDebug( OSRF_LOG_MARK, "Parent launched %d", pid );
+		/* *no* child pipe FD's can be closed or the parent will re-use fd's that
+			the children are currently using */
+		return child;
+	}
+
+	else { /* child */
+
+		// we don't want to adopt our parent's handlers.
+		reset_child_signals();
+		run_drone( child );
+		return NULL;  // Unreachable, but it keeps the compiler happy
+	}
+}
+
+/**
+	@brief Restore default signal handling in a newly forked process.
+
+	The exception is SIGUSR1, which dumps the log's flight recorder, if there is one
+	(see osrfLogSetRecorder()).
+*/
+static void reset_child_signals( void ) {
+	struct sigaction act;
+	memset( &act, 0, sizeof( act ));
+	act.sa_handler = drone_sigusr1_handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset( &act.sa_mask );
+	sigaction( SIGUSR1, &act, NULL );
+	signal( SIGUSR2, SIG_DFL );
+	signal( SIGTERM, SIG_DFL );
+	signal( SIGINT,  SIG_DFL );
+	signal( SIGQUIT, SIG_DFL );
+	signal( SIGCHLD, SIG_DFL );
+	signal( SIGHUP,  SIG_DFL );
+}
+
+/**
+	@brief Initialize a newly forked child process, and service its quota of requests.
+	@param child Pointer to the prefork_child representing the child process.
+
+	Called only by child processes.  Does not return.
+*/
+static void run_drone( prefork_child* child ) {
+
+	osrfLogInternal( OSRF_LOG_MARK,
+		"I am new child with read_data_fd = %d and bell_fd = %d",
+		child->read_data_fd, child->bell_fd );
+
+	child->pid = getpid();
+	child->slot->pid = child->pid;   // Whichever of us gets here first
+	if( child->write_data_fd >= 0 )
+		close( child->write_data_fd );
+	osrfSystemReportReady( NULL );
+
+	// Keep the status board posted on what methods we run, and how long they take
+	drone_self = child;
+	drone_method_index = osrfNewHash();
+	osrfMethodMonitor monitor = {
+		drone_method_start, drone_method_finish, drone_method_report
+	};
+	osrfAppSetMethodMonitor( &monitor );
+
+	/* do the initing */
+	if( prefork_child_init_hook( child ) == -1 ) {
+		osrfLogError( OSRF_LOG_MARK,
+			"Forker child going away because we could not connect to OpenSRF..." );
+		osrf_prefork_child_exit( child );
+	}
+	child->slot->started = 1;
+
+	prefork_child_wait( child );      // Should exit without returning
+	osrf_prefork_child_exit( child ); // Just to be sure
+}
+
+/**
+	@brief Send a file descriptor, and an int to go with it, over a unix socket.
+	@param sock The socket.
+	@param value The int.
+	@param fd The file descriptor to send.
+	@return 0 if successful, or -1 if not.
+*/
+static int send_fd( int sock, int value, int fd ) {
+	char control[ CMSG_SPACE( sizeof( int )) ];
+	memset( control, 0, sizeof( control ));
+
+	struct iovec iov;
+	iov.iov_base = &value;
+	iov.iov_len = sizeof( value );
+
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( msg ));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof( control );
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN( sizeof( int ));
+	memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ));
+
+	// Don't let a dead template take us down with a SIGPIPE
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#endif
+
+	ssize_t n;
+	while( ( n = sendmsg( sock, &msg, flags )) < 0 && EINTR == errno )
+		;
+	return n == sizeof( value ) ? 0 : -1;
+}
+
+/**
+	@brief Receive a file descriptor, and the int that goes with it, from a unix socket.
+	@param sock The socket.
+	@param value Pointer to where to store the int.
+	@return The file descriptor, or -1 if the socket has closed, or on error.
+*/
+static int recv_fd( int sock, int* value ) {
+	char control[ CMSG_SPACE( sizeof( int )) ];
+
+	struct iovec iov;
+	iov.iov_base = value;
+	iov.iov_len = sizeof( *value );
+
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( msg ));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof( control );
+
+	ssize_t n;
+	while( ( n = recvmsg( sock, &msg, 0 )) < 0 && EINTR == errno )
+		;
+	if( n != sizeof( *value ))
+		return -1;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+	if( !cmsg || SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type )
+		return -1;
+
+	int fd;
+	memcpy( &fd, CMSG_DATA( cmsg ), sizeof( int ));
+	return fd;
+}
+
+/**
+	@brief Fork the template process from which to fork children.
+	@param forker Pointer to the prefork_simple that will own the template.
+
+	Make the parent a subreaper first, so that children orphaned by the template's
+	intermediate processes become the parent's children.  On platforms without
+	PR_SET_CHILD_SUBREAPER, or if anything goes wrong, go on without a template.
+*/
+static void template_start( prefork_simple* forker ) {
+#ifdef PR_SET_CHILD_SUBREAPER
+	if( prctl( PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0 ) < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to become a subreaper; not using a "
+			"fork template: %s", strerror( errno ));
+		return;
+	}
+
+	int sv[2];
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to create socket for fork template: %s",
+			strerror( errno ));
+		return;
+	}
+
+	pid_t pid = fork();
+	if( pid < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to fork template: %s", strerror( errno ));
+		close( sv[0] );
+		close( sv[1] );
+		return;
+	}
+
+	if( pid > 0 ) {
+		signal( SIGCHLD, sigchld_handler );
+		close( sv[1] );
+		forker->template_fd = sv[0];
+		forker->template_pid = pid;
+		osrfLogInfo( OSRF_LOG_MARK, "Launched fork template %ld", (long) pid );
+		return;
+	}
+
+	close( sv[0] );
+	reset_child_signals();
+	template_main( forker, sv[1] );
+#else
+	osrfLogWarning( OSRF_LOG_MARK,
+		"Fork templates are not supported on this platform; forking drones directly" );
+#endif
+}
+
+/**
+	@brief Ask the template process to fork a new child.
+	@param forker Pointer to the prefork_simple that owns the template.
+	@param child Pointer to the prefork_child for the new child.
+	@return Process ID of the new child, or -1 if the template couldn't fork it.
+
+	Wait no more than TEMPLATE_LAUNCH_TIMEOUT milliseconds for the answer.  A template
+	that is hung, or gone, leaves the caller to fork the child itself.
+*/
+static pid_t template_launch( prefork_simple* forker, prefork_child* child ) {
+	if( send_fd( forker->template_fd, (int) ( child->slot - forker->board ),
+			child->read_data_fd )) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to send request to fork template: %s",
+			strerror( errno ));
+		return -1;
+	}
+
+	struct pollfd pfd = { .fd = forker->template_fd, .events = POLLIN };
+	long long deadline = get_monotonic_millis() + TEMPLATE_LAUNCH_TIMEOUT;
+	int rc;
+	do {
+		long long remaining = deadline - get_monotonic_millis();
+		rc = poll( &pfd, 1, remaining > 0 ? (int) remaining : 0 );
+	} while( rc < 0 && EINTR == errno );
+
+	if( rc <= 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Fork template %s launching a child",
+			rc ? "failed while" : "timed out" );
+		return -1;
+	}
+
+	pid_t pid = -1;
+	if( read_full( forker->template_fd, &pid, sizeof( pid )) != 1 || pid <= 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Fork template failed to launch a child" );
+		return -1;
+	}
+
+	return pid;
+}
+
+/**
+	@brief Stop using the template process, and kill it.
+	@param forker Pointer to the prefork_simple that owns the template.
+
+	The template's last breath will arrive as a SIGCHLD, which reap_children() ignores.
+*/
+static void template_stop( prefork_simple* forker ) {
+	if( forker->template_fd >= 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Not using fork template any more" );
+		close( forker->template_fd );
+		forker->template_fd = -1;
+	}
+	if( forker->template_pid > 0 )
+		kill( forker->template_pid, SIGKILL );
+}
+
+/**
+	@brief Main loop of the template process.
+	@param forker Pointer to the template's copy of the parent's prefork_simple.
+	@param sock The template's end of its socket to the parent.
+
+	Do the part of child initialization that children can share, then fork a child each
+	time the parent sends a data pipe.  Fork twice, so that the intermediate process can
+	report the child's pid and exit, leaving the child to the parent.  Exit when the
+	parent closes the socket.  Does not return.
+*/
+static void template_main( prefork_simple* forker, int sock ) {
+
+	set_proc_title( "OpenSRF Drone Template [%s]", forker->appname );
+
+	// Leave the parent's Jabber connection alone, and its report of readiness
+	osrfSystemIgnoreTransportClient();
+	osrfSystemReportReady( NULL );
+
+	if( osrfAppRunTemplateInit( forker->appname )) {
+		osrfLogError( OSRF_LOG_MARK, "Fork template for %s going away because "
+			"template_init failed", forker->appname );
+		_exit( 1 );
+	}
+
+	int slot;
+	int data_fd;
+	while( ( data_fd = recv_fd( sock, &slot )) >= 0 ) {
+
+		if( slot < 0 || slot >= forker->board_size ) {
+			close( data_fd );
+			_exit( 1 );
+		}
+
+		pid_t pid = fork();
+		if( 0 == pid ) {
+			pid_t drone = fork();
+			if( 0 == drone ) {
+				close( sock );
+				prefork_child* child =
+					prefork_child_init( forker, data_fd, -1, forker->board + slot );
+				child->from_template = 1;
+				run_drone( child );
+			}
+			write_full( sock, &drone, sizeof( drone ));
+			_exit( 0 );
+		}
+
+		close( data_fd );
+		if( pid < 0 ) {
+			write_full( sock, &pid, sizeof( pid ));
+		} else {
+			while( waitpid( pid, NULL, 0 ) < 0 && EINTR == errno )
+				;
+		}
+	}
+
+	_exit( 0 );
+}
+
+/**
+	@brief Terminate a child process.
+	@param child Pointer to the prefork_child representing the child process (not used).
+
+	Called only by child processes.  Dynamically call an application-specific shutdown
+	function from a previously loaded shared library; then exit, removing our shared
+	memory ring, if any, on the way out.
+*/
+static void osrf_prefork_child_exit( prefork_child* child ) {
+	osrfAppRunExitCode();
+	client_close_shm( osrfSystemGetTransportClient() );
+	exit( 0 );
+}
+
+/**
+	@brief Launch all the child processes, putting them in the idle list.
+	@param forker Pointer to the prefork_simple that will own the children.
+
+	Called only by the parent process (in order to become a parent).
+*/
+static void prefork_launch_children( prefork_simple* forker ) {
+	if( !forker ) return;
+	int c = 0;
+	while( c++ < forker->min_children )
+		launch_child( forker );
+}
+
+/**
+	@brief Wait for the first children to connect and initialize.
+	@param forker Pointer to the prefork_simple that owns the children.
+	@return 1 if the minimum number of children are up, or 0 if one of them died, or
+		they took too long.
+
+	A listener that registered with the routers any earlier would collect requests
+	that it had no one to pass to.
+*/
+static int wait_for_children( prefork_simple* forker ) {
+	double deadline = get_timestamp_millis() + DRONE_START_TIMEOUT;
+	while( 1 ) {
+		int started = 0;
+		int i;
+		for( i = 0; i < forker->board_size; i++ ) {
+			const drone_slot* slot = forker->board + i;
+			if( DRONE_FREE != slot->state && slot->started )
+				started++;
+		}
+
+		if( started >= forker->min_children )
+			return 1;
+
+		if( child_dead || get_timestamp_millis() > deadline ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Only %d of %d children started for %s",
+				started, forker->min_children, forker->appname );
+			return 0;
+		}
+
+		usleep( 20000 );
+	}
+}
+
+/**
+	@brief Signal handler for SIGCHLD: note that a child process has terminated.
+	@param sig The value of the trapped signal; always SIGCHLD.
+
+	Set a boolean to be checked later.
+*/
+static void sigchld_handler( int sig ) {
+	signal( SIGCHLD, sigchld_handler );
+	child_dead = 1;
+}
+
+/**
+	@brief Signal handler for SIGUSR1 in a drone.
+	@param sig The value of the trapped signal; always SIGUSR1.
+
+	Dump the log's flight recorder.
+*/
+static void drone_sigusr1_handler( int sig ) {
+	osrfLogDumpRecorder( "SIGUSR1" );
+}
+
+/**
+	@brief Signal handler for SIGUSR1
+	@param sig The value of the trapped signal; always SIGUSR1.
 
 	Send unregister command to all registered routers.
 */
@@ -714,11 +2252,13 @@ static void sigusr1_handler( int sig ) {
 	@brief Signal handler for SIGUSR2
 	@param sig The value of the trapped signal; always SIGUSR2.
 
-	Send register command to all known routers
+	Send register command to all known routers, and arrange to log the drone statistics
+	once we get back to the main loop.
 */
 static void sigusr2_handler( int sig ) {
 	if (!global_forker) return;
 	osrf_prefork_register_routers(global_forker->appname, false);
+	stats_dump_pending = 1;
 	signal( SIGUSR2, sigusr2_handler );
 }
 
@@ -726,91 +2266,260 @@ static void sigusr2_handler( int sig ) {
 	@brief Signal handler for SIGTERM
 	@param sig The value of the trapped signal; always SIGTERM
 
-	Perform a graceful prefork server shutdown.
-*/
-static void sigterm_handler(int sig) {
-	if (!global_forker) return;
-	osrfLogInfo(OSRF_LOG_MARK, "server: received SIGTERM, shutting down");
-	prefork_clear(global_forker, true);
-	_exit(0);
+	Ask for a graceful prefork server shutdown, which prefork_run() performs by way of
+	prefork_shutdown().  Nothing here may take a lock, such as the logger's, that the
+	interrupted code might be holding.
+*/
+static void sigterm_handler(int sig) {
+	if (!global_forker) return;
+	if( !shutdown_pending )
+		shutdown_pending = SHUTDOWN_GRACEFUL;
+}
+
+/**
+	@brief Signal handler for SIGINT or SIGQUIT
+	@param sig The value of the trapped signal
+
+	Ask for a non-graceful prefork server shutdown, which prefork_run() performs by way
+	of prefork_shutdown().  It overrides a graceful shutdown still under way.
+*/
+static void sigint_handler(int sig) {
+	if (!global_forker) return;
+	shutdown_pending = SHUTDOWN_NOW;
+}
+
+/**
+	@brief Shut down the prefork server, as a signal handler asked.
+	@param forker Pointer to the prefork_simple for the application.
+
+	Stop the children, gracefully or otherwise, and exit normally, so that the log and
+	anything else registered with atexit() gets flushed.
+*/
+static void prefork_shutdown( prefork_simple* forker ) {
+	int graceful = SHUTDOWN_GRACEFUL == shutdown_pending;
+	osrfLogInfo( OSRF_LOG_MARK, "server: received %s, shutting down",
+		graceful ? "SIGTERM" : "SIGINT/QUIT" );
+	prefork_clear( forker, graceful );
+	exit( 0 );
+}
+
+/**
+	@brief Signal handler for SIGHUP: ask for a configuration reload.
+	@param sig The value of the trapped signal; always SIGHUP.
+
+	Set a boolean to be checked later, by prefork_run(), which calls reload_start().
+*/
+static void sighup_handler( int sig ) {
+	if( !global_forker ) return;
+	reload_pending = 1;
+}
+
+/**
+	@brief Begin reloading the configuration.
+	@param forker Pointer to the prefork_simple for the application.
+
+	Reread the bootstrap configuration file, and apply its log level at once.  Then fork
+	a process to fetch the settings anew, so that the listener can go on dispatching
+	requests in the meantime.  The listener has no business using its own connection to
+	wait for a reply from the settings server; it would take any requests arriving
+	meanwhile for its own.  The process leaves the settings, as JSON, in a temporary file;
+	when it exits, reap_children() calls reload_finish() to pick them up.
+*/
+static void reload_start( prefork_simple* forker ) {
+
+	if( forker->reload_pid > 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "server: received SIGHUP while reloading; ignored" );
+		return;
+	}
+
+	osrfLogInfo( OSRF_LOG_MARK, "server: received SIGHUP, reloading config" );
+
+	osrfConfig* oldConfig = osrfConfigGetDefaultConfig();
+	osrfConfig* newConfig = osrfConfigInit(
+		oldConfig->configFileName, oldConfig->configContext );
+
+	if( !newConfig ) {
+		osrfLogError( OSRF_LOG_MARK, "Config reload failed" );
+		return;
+	}
+
+	// frees oldConfig
+	osrfConfigSetDefaultConfig( newConfig );
+
+	// in case the log file has been rotated
+	osrfLogReopen();
+
+	// apply the log level from the reloaded file
+	char* log_level = osrfConfigGetValue( NULL, "/loglevel" );
+	if( log_level ) {
+		osrfLogSetLevel( atoi( log_level ));
+		forker->settings->log_level = osrfLogGetLevel();
+		free( log_level );
+	}
+
+	const char* hostname = osrf_settings_hostname();
+	FILE* file = hostname ? tmpfile() : NULL;
+	if( !file ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to reload settings for %s: %s",
+			forker->appname, hostname ? strerror( errno ) : "none loaded" );
+		return;
+	}
+
+	pid_t pid = fork();
+	if( pid < 0 ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to fork to reload settings: %s",
+			strerror( errno ));
+		fclose( file );
+		return;
+	}
+
+	if( pid > 0 ) {
+		signal( SIGCHLD, sigchld_handler );
+		forker->reload_pid = pid;
+		forker->reload_file = file;
+		return;
+	}
+
+	// The child fetches the settings over its own connection
+	reset_child_signals();
+	set_proc_title( "OpenSRF Settings Reload [%s]", forker->appname );
+	osrfSystemIgnoreTransportClient();
+
+	int rc = 1;
+	char* resc = va_list_to_string( "%s_reload", forker->appname );
+	if( osrfSystemBootstrapClientResc( NULL, NULL, resc )) {
+		jsonObject* cfg = osrf_settings_fetch( hostname );
+		if( cfg ) {
+			char* json = jsonObjectToJSON( cfg );
+			if( fputs( json, file ) >= 0 && 0 == fflush( file ))
+				rc = 0;
+			free( json );
+			jsonObjectFree( cfg );
+		}
+		osrf_system_disconnect_client();
+	}
+	free( resc );
+	_exit( rc );
 }
 
 /**
-	@brief Signal handler for SIGINT or SIGQUIT
-	@param sig The value of the trapped signal
-
-	Perform a non-graceful prefork server shutdown.
+	@brief Finish reloading the configuration, once the settings have been fetched.
+	@param forker Pointer to the prefork_simple for the application.
+	@param status Exit status of the process that fetched the settings.
+
+	Apply everything that can be changed on the fly (see apply_config()).  If anything else
+	has changed, the children need to start over to see it; so bump the generation, and
+	let roll_children() replace the older children a few at a time.  Restart the
+	template process, if there is one, so that new children start from the new settings.
 */
-static void sigint_handler(int sig) {
-	if (!global_forker) return;
-	osrfLogInfo(OSRF_LOG_MARK, "server: received SIGINT/QUIT, shutting down");
-	prefork_clear(global_forker, false);
-	_exit(0);
-}
-
-static void sighup_handler(int sig) {
-    if (!global_forker) return;
-    osrfLogInfo(OSRF_LOG_MARK, "server: received SIGHUP, reloading config");
+static void reload_finish( prefork_simple* forker, int status ) {
+
+	FILE* file = forker->reload_file;
+	forker->reload_pid = 0;
+	forker->reload_file = NULL;
+
+	jsonObject* cfg = NULL;
+	if( file && WIFEXITED( status ) && 0 == WEXITSTATUS( status )) {
+		long len = fseek( file, 0, SEEK_END ) ? -1 : ftell( file );
+		if( len > 0 ) {
+			char* json = safe_malloc( len + 1 );
+			rewind( file );
+			if( fread( json, 1, len, file ) == (size_t) len ) {
+				json[ len ] = '\0';
+				cfg = jsonParse( json );
+			}
+			free( json );
+		}
+	}
+	if( file )
+		fclose( file );
 
-    osrfConfig* oldConfig = osrfConfigGetDefaultConfig();
-    osrfConfig* newConfig = osrfConfigInit(
-        oldConfig->configFileName, oldConfig->configContext);
+	if( !cfg || osrf_settings_replace( cfg )) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to reload settings for %s; "
+			"keeping the old ones", forker->appname );
+		return;
+	}
 
-    if (!newConfig) {
-        osrfLogError(OSRF_LOG_MARK, "Config reload failed");
-        return;
-    }
+	prefork_config pc;
+	read_prefork_config( forker->appname, &pc );
+	apply_config( forker, &pc );
+
+	osrfLogInfo( OSRF_LOG_MARK, "Reloaded settings for %s: max_requests=%d, "
+		"min_children=%d, max_children=%d, max_backlog_queue=%d, keepalive=%d",
+		forker->appname, forker->max_requests, forker->min_children,
+		forker->max_children, forker->max_backlog_queue, forker->keepalive );
+
+	// Retire idle children beyond a lowered max_children
+	int surplus = forker->current_num_children - forker->max_children;
+	while( surplus-- > 0 && forker->idle_tail ) {
+		prefork_child* child = forker->idle_tail;
+		idle_remove( forker, child );
+		doom_child( forker, child, SIGTERM );
+	}
 
-    // frees oldConfig
-    osrfConfigSetDefaultConfig(newConfig); 
-    
-    // apply the log level from the reloaded file
-    char* log_level = osrfConfigGetValue(NULL, "/loglevel");
-    if(log_level) {
-        int level = atoi(log_level);
-        osrfLogSetLevel(level);
-    }
+	jsonObject* fixed = fixed_settings( forker->appname );
+	if( same_json( fixed, forker->fixed_config )) {
+		jsonObjectFree( fixed );
+		return;
+	}
 
-    // Copy the list of active children into the sighup_pending list.
-    // Cloning is necessary, since the nodes in the active list, particularly
-    // their next/prev pointers, will start changing once we exit this func.
-    // sighup_pending_list is a non-circular, singly linked list.
-    prefork_child* cur_child = global_forker->first_child;
-    prefork_child* clone;
+	jsonObjectFree( forker->fixed_config );
+	forker->fixed_config = fixed;
+	forker->generation++;
+	forker->rolling = 1;
+	osrfLogInfo( OSRF_LOG_MARK, "Settings for %s changed in ways that call for new "
+		"children; replacing them gradually", forker->appname );
 
-    // the first_pid lets us know when we've made a full circle of the active 
-    // children
-    pid_t first_pid = 0;
-    while (cur_child && cur_child->pid != first_pid) {
+	template_stop( forker );
+	if( pc.use_template )
+		template_start( forker );
+}
 
-        if (!first_pid) first_pid = cur_child->pid;
+/**
+	@brief Retire a few of the children left over from before a configuration reload.
+	@param forker Pointer to the prefork_simple for the application.
 
-        // all we need to keep track of is the pid
-        clone = safe_malloc(sizeof(prefork_child));
-        clone->pid = cur_child->pid;
-        clone->next = NULL;
+	Retire up to max_spawn_rate idle children of older generations, starting with the one
+	that has been idle the longest, and leave the rest for next time.  Busy children
+	stay at work until they come back to the idle list.  The usual machinery replaces
+	the retired children as demand calls for it.  Once no older children remain, stop.
+*/
+static void roll_children( prefork_simple* forker ) {
 
-        osrfLogDebug(OSRF_LOG_MARK, 
-            "Adding child %d to sighup pending list", clone->pid);
+	int budget = forker->max_spawn_rate;
+	int remaining = 0;
 
-        // add the clone to the front of the list
-        if (global_forker->sighup_pending_list) 
-            clone->next = global_forker->sighup_pending_list;
-        global_forker->sighup_pending_list = clone;
+	prefork_child* child = forker->idle_tail;
+	while( child ) {
+		prefork_child* prev = child->prev;
+		if( child->generation != forker->generation ) {
+			if( budget > 0 ) {
+				osrfLogDebug( OSRF_LOG_MARK, "Retiring child %d after reload", child->pid );
+				idle_remove( forker, child );
+				doom_child( forker, child, SIGTERM );
+				budget--;
+			} else
+				remaining++;
+		}
+		child = prev;
+	}
 
-        cur_child = cur_child->next;
-    }
+	child = forker->first_child;
+	if( child ) {
+		do {
+			if( child->generation != forker->generation
+					&& DRONE_EXITING != child->slot->state )
+				remaining++;
+			child = child->next;
+		} while( child != forker->first_child );
+	}
 
-    // Kill all idle children.
-    // Let them get cleaned up through the normal response-handling cycle
-    cur_child = global_forker->idle_list;
-    while (cur_child) {
-        osrfLogDebug(OSRF_LOG_MARK, "Killing child in SIGHUP %d", cur_child->pid);
-        kill(cur_child->pid, SIGKILL);
-        cur_child = cur_child->next;
-    }
+	if( !remaining ) {
+		forker->rolling = 0;
+		osrfLogInfo( OSRF_LOG_MARK, "All children of %s now run with the reloaded settings",
+			forker->appname );
+	}
 }
-    
 
 /**
 	@brief Replenish the collection of child processes, after one has terminated.
@@ -825,6 +2534,8 @@ static void sighup_handler(int sig) {
 static void reap_children( prefork_simple* forker ) {
 
 	pid_t child_pid;
+	int status;
+	int killed = 0;
 
 	// Reset our boolean so that we can detect any further terminations.
 	child_dead = 0;
@@ -832,27 +2543,351 @@ static void reap_children( prefork_simple* forker ) {
 	// Bury the children so that they won't be zombies.  WNOHANG means that waitpid() returns
 	// immediately if there are no waitable children, instead of waiting for more to die.
 	// Ignore the return code of the child.  We don't do an autopsy.
-	while( (child_pid = waitpid( -1, NULL, WNOHANG )) > 0 ) {
-		--forker->current_num_children;
-		del_prefork_child( forker, child_pid );
+	while( (child_pid = waitpid( -1, &status, WNOHANG )) > 0 ) {
+		if( child_pid == forker->template_pid ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Fork template %ld has died", (long) child_pid );
+			forker->template_pid = 0;
+			template_stop( forker );
+		} else if( child_pid == forker->reload_pid )
+			reload_finish( forker, status );
+		else {
+			// A child killed in the midst of joining the ready queue may leave a hole in it
+			prefork_child* child = osrfHashGetFmt( forker->pid_index, "%ld", (long) child_pid );
+			if( child && CHILD_ACTIVE_LIST == child->list && DRONE_IDLE == child->slot->state )
+				forker->ready_stalled = 1;
+			if( !del_prefork_child( forker, child_pid ))
+				continue;
+			--forker->current_num_children;
+			if( WIFSIGNALED( status ))
+				killed = 1;
+		}
 	}
 
+	// A drone that was killed didn't get to remove its shared memory ring
+	if( killed )
+		client_sweep_shm( forker->connection );
+
 	// Spawn more children as needed.
 	while( forker->current_num_children < forker->min_children )
 		launch_child( forker );
 }
 
+/**
+	@brief Grow or shrink the collection of child processes according to demand.
+	@param forker Pointer to the prefork_simple that manages the child processes.
+	@param backlog_size Number of requests in the backlog queue.
+	@param oldest_wait How long, in seconds, the oldest request in the backlog has waited.
+
+	Run at most once a second.  Do nothing more than roll children over after a reload
+	unless the autoscale setting is true; without it, the listener spawns children only
+	when a request arrives to find none idle, as it always has.
+
+	If there are fewer than min_spare_children idle children, or requests have waited in
+	the backlog for at least queue_wait_threshold seconds, spawn enough children to make
+	up the difference, within max_children.  Spawn only spawn_rate of them at a time,
+	doubling spawn_rate (up to max_spawn_rate) each second that demand outstrips it, and
+	resetting it to 1 once demand is met.
+
+	Otherwise, if there are more than max_spare_children idle children, retire the one that
+	has been idle the longest, provided that it has been idle for at least max_idle_time
+	seconds (see doom_child()).
+*/
+static void prefork_autoscale( prefork_simple* forker, int backlog_size, double oldest_wait ) {
+
+	double now = get_timestamp_millis();
+	if( now - forker->last_scale < 1.0 )
+		return;
+	forker->last_scale = now;
+
+	if( forker->rolling )
+		roll_children( forker );
+
+	if( !forker->autoscale )
+		return;
+
+	// Since the idle list operates as a stack, the last child is
+	// the one that has been idle the longest.
+	int idle = forker->idle_count;
+	prefork_child* oldest = forker->idle_tail;
+
+	int wanted = forker->min_spare_children - idle;
+	if( backlog_size > 0 && oldest_wait >= forker->queue_wait_threshold
+			&& backlog_size > wanted )
+		wanted = backlog_size;
+	if( wanted > forker->max_children - forker->current_num_children )
+		wanted = forker->max_children - forker->current_num_children;
+
+	if( wanted > 0 ) {
+		int n = wanted < forker->spawn_rate ? wanted : forker->spawn_rate;
+		osrfLogInfo( OSRF_LOG_MARK, "Autoscaler spawning %d children: %d idle, %d queued, "
+			"oldest waited %.3f seconds", n, idle, backlog_size, oldest_wait );
+		while( n-- > 0 ) {
+			if( !launch_child( forker ))
+				break;
+		}
+
+		// Still short-handed?  Then grow faster next time.
+		if( wanted > forker->spawn_rate ) {
+			forker->spawn_rate *= 2;
+			if( forker->spawn_rate > forker->max_spawn_rate )
+				forker->spawn_rate = forker->max_spawn_rate;
+		}
+		return;
+	}
+
+	forker->spawn_rate = 1;
+
+	if( forker->max_spare_children && idle > forker->max_spare_children
+			&& forker->current_num_children > forker->min_children
+			&& now - oldest->idle_since >= forker->max_idle_time ) {
+
+		osrfLogInfo( OSRF_LOG_MARK, "Autoscaler retiring child %d after %.0f idle seconds",
+			oldest->pid, now - oldest->idle_since );
+
+		idle_remove( forker, oldest );
+		doom_child( forker, oldest, SIGTERM );
+	}
+}
+
+/**
+	@brief Look up a name in a priority table.
+	@param table Pointer to the table (may be NULL).
+	@param name The name to look up (may be NULL).
+	@return The priority class for the name, or OSRF_PRIORITY_NORMAL if it isn't listed.
+*/
+static int lookup_priority( osrfHash* table, const char* name ) {
+	if( !table || !name )
+		return OSRF_PRIORITY_NORMAL;
+	long found = (long) osrfHashGet( table, name );
+	return found ? (int) found - 1 : OSRF_PRIORITY_NORMAL;
+}
+
+/**
+	@brief Decide which priority class a request belongs to.
+	@param forker Pointer to the prefork_simple for the application.
+	@param msg Pointer to the request.
+	@return One of the OSRF_PRIORITY_* values.
+
+	If no priorities are configured, every request is OSRF_PRIORITY_NORMAL, and we don't look
+	inside it.  Otherwise parse the body, and give the request the highest priority of any
+	of the osrfMessages in it, considering their types, ingresses, and methods.  A
+	message whose method or ingress is listed as high priority is high priority; failing
+	that, one whose method or ingress is listed as low priority is low priority.
+*/
+static int classify_request( prefork_simple* forker, const transport_message* msg ) {
+
+	if( !forker->method_priority && !forker->ingress_priority )
+		return OSRF_PRIORITY_NORMAL;
+
+	jsonObject* body = msg->body ? jsonParseRaw( msg->body ) : NULL;
+	if( !body )
+		return OSRF_PRIORITY_NORMAL;
+
+	int priority = OSRF_PRIORITY_LOW + 1;
+	unsigned long i = 0;
+	const jsonObject* cur = body;
+	do {
+		if( JSON_ARRAY == body->type )
+			cur = jsonObjectGetIndex( body, i );
+
+		const jsonObject* envelope = jsonObjectGetKeyConst( cur, "__p" );
+		const char* type = jsonObjectGetString( jsonObjectGetKeyConst( envelope, "type" ));
+		const char* ingress =
+			jsonObjectGetString( jsonObjectGetKeyConst( envelope, "ingress" ));
+		const char* method = jsonObjectGetString( jsonObjectGetKeyConst(
+			jsonObjectGetKeyConst( jsonObjectGetKeyConst( envelope, "payload" ), "__p" ),
+			"method" ));
+
+		int p;
+		if( type && !strcmp( type, "CONNECT" ))
+			p = OSRF_PRIORITY_HIGH;
+		else {
+			// A listing as high priority beats a listing as low priority
+			int m = lookup_priority( forker->method_priority, method );
+			int g = lookup_priority( forker->ingress_priority, ingress );
+			if( OSRF_PRIORITY_HIGH == m || OSRF_PRIORITY_HIGH == g )
+				p = OSRF_PRIORITY_HIGH;
+			else if( OSRF_PRIORITY_LOW == m || OSRF_PRIORITY_LOW == g )
+				p = OSRF_PRIORITY_LOW;
+			else
+				p = OSRF_PRIORITY_NORMAL;
+		}
+		if( p < priority )
+			priority = p;
+
+	} while( JSON_ARRAY == body->type && ++i < body->size );
+
+	jsonObjectFree( body );
+	return priority > OSRF_PRIORITY_LOW ? OSRF_PRIORITY_NORMAL : priority;
+}
+
+/**
+	@brief Find out when the client of a request stops waiting for it.
+	@param msg Pointer to the request.
+	@return The latest deadline of the osrfMessages in it, on the monotonic clock in ms; or
+		zero if any of them has none.
+
+	Most requests don't carry a deadline, and cost one strstr() of the body.  The others
+	we deserialize lazily, leaving the parameters for the drone to parse.
+*/
+static long long request_deadline( const transport_message* msg ) {
+	if( !strstr( msg->body, "\"deadline\"" ))
+		return 0;
+
+	osrfMessage* arr[ OSRF_MAX_MSGS_PER_PACKET ];
+	int count = osrf_message_deserialize_lazy( msg->body, arr, OSRF_MAX_MSGS_PER_PACKET );
+	long long deadline = 0;
+	int i;
+	for( i = 0; i < count; i++ ) {
+		long long d = arr[ i ]->deadline;
+		if( 0 == i || !d || ( deadline && d > deadline ))
+			deadline = d;
+		osrfMessageFree( arr[ i ] );
+	}
+	return deadline;
+}
+
+/**
+	@brief Tell a client that its request won't be serviced.
+	@param msg Pointer to the request.
+	@param status The OSRF status code to report.
+	@param text Description of the problem.
+*/
+static void reject_request( const transport_message* msg, int status, const char* text ) {
+	osrfMessage* err = osrf_message_init( STATUS, 1, 1 );
+	osrf_message_set_status_info( err, "osrfMethodException", text, status );
+	char *data = osrf_message_serialize( err );
+	osrfMessageFree( err );
+	transport_message* tresponse = message_init( data, "", msg->thread, msg->router_from, msg->recipient );
+	message_set_osrf_xid(tresponse, msg->osrf_xid);
+	free( data );
+	transport_client* client = osrfSystemGetTransportClient();
+	client_send_message( client, tresponse );
+	message_free( tresponse );
+}
+
+/**
+	@brief Answer a health probe, if that's what a message is.
+	@param forker Pointer to the prefork_simple.
+	@param msg Pointer to the incoming message.
+	@param backlog_size How many requests are waiting for a drone.
+	@return 1 if the message was a probe, and was answered; or 0 if not.
+
+	A probe is a stateless REQUEST for OSRF_HEALTH_METHOD, alone in its message.  The
+	listener answers it from what it already knows, so that a load balancer or a monitor
+	may probe often without taking drones, or backlog room, from real requests; and so
+	that a probe still gets an answer when all the drones are busy.
+
+	The result is a hash of the number of idle and busy drones, the number of children
+	and their limits, the size and limit of the backlog, and "last_success_age": the
+	seconds since a drone last finished a request, or null if none has yet.
+
+	Anything else costs one strstr() of the body.
+*/
+static int answer_health_probe( prefork_simple* forker, const transport_message* msg,
+		int backlog_size ) {
+
+	if( !strstr( msg->body, OSRF_HEALTH_METHOD ))
+		return 0;
+
+	osrfMessage* arr[ 2 ];
+	int count = osrf_message_deserialize( msg->body, arr, 2 );
+	int probe = 1 == count && REQUEST == arr[ 0 ]->m_type && arr[ 0 ]->method_name
+		&& !strcmp( arr[ 0 ]->method_name, OSRF_HEALTH_METHOD );
+	int thread_trace = count > 0 ? arr[ 0 ]->thread_trace : 0;
+	int i;
+	for( i = 0; i < count; i++ )
+		osrfMessageFree( arr[ i ] );
+	if( !probe )
+		return 0;
+
+	int idle = 0;
+	int busy = 0;
+	for( i = 0; i < forker->board_size; i++ ) {
+		int state = forker->board[ i ].state;
+		if( DRONE_IDLE == state )
+			idle++;
+		else if( DRONE_BUSY == state )
+			busy++;
+	}
+
+	jsonObject* health = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( health, "service", jsonNewObject( forker->appname ));
+	jsonObjectSetKey( health, "idle", jsonNewNumberObject( idle ));
+	jsonObjectSetKey( health, "busy", jsonNewNumberObject( busy ));
+	jsonObjectSetKey( health, "children", jsonNewNumberObject( forker->current_num_children ));
+	jsonObjectSetKey( health, "min_children", jsonNewNumberObject( forker->min_children ));
+	jsonObjectSetKey( health, "max_children", jsonNewNumberObject( forker->max_children ));
+	jsonObjectSetKey( health, "backlog", jsonNewNumberObject( backlog_size ));
+	jsonObjectSetKey( health, "max_backlog_queue",
+		jsonNewNumberObject( forker->max_backlog_queue ));
+	jsonObjectSetKey( health, "last_success_age", forker->last_finished > 0.0
+		? jsonNewNumberObject( get_timestamp_millis() - forker->last_finished )
+		: jsonNewObject( NULL ));
+
+	osrfMessage* reply[ 2 ];
+	reply[ 0 ] = osrf_message_init( RESULT, thread_trace, 1 );
+	osrf_message_set_status_info( reply[ 0 ], "osrfResult", "OK", OSRF_STATUS_OK );
+	osrf_message_set_result( reply[ 0 ], health );
+	reply[ 1 ] = osrf_message_init( STATUS, thread_trace, 1 );
+	osrf_message_set_status_info( reply[ 1 ], "osrfConnectStatus", "Request Complete",
+		OSRF_STATUS_COMPLETE );
+	jsonObjectFree( health );
+
+	char* data = osrfMessageSerializeBatch( reply, 2 );
+	osrfMessageFree( reply[ 0 ] );
+	osrfMessageFree( reply[ 1 ] );
+
+	transport_message* response = message_init( data, "", msg->thread, msg->router_from,
+		msg->recipient );
+	message_set_osrf_xid( response, msg->osrf_xid );
+	free( data );
+	client_send_message( forker->connection, response );
+	message_free( response );
+	return 1;
+}
+
+/**
+	@brief Drop requests that have waited in the backlog queue for too long.
+	@param forker Pointer to the prefork_simple that owns the queue.
+	@param queue Pointer to the osrfBacklog.
+
+	Since each priority class is in order of arrival, we only ever need to look at the
+	oldest requests.  Tell the clients in case they're still listening.
+*/
+static void backlog_expire( prefork_simple* forker, osrfBacklog* queue ) {
+	if( forker->max_queue_wait <= 0.0 || !queue->size )
+		return;
+
+	double cutoff = get_timestamp_millis() - forker->max_queue_wait;
+	int i;
+	for( i = 0; i < OSRF_PRIORITY_COUNT; i++ ) {
+		while( queue->head[ i ] && queue->head[ i ]->arrived < cutoff ) {
+			transport_message* msg = osrfBacklogPop( queue, i );
+			osrfLogWarning( OSRF_LOG_MARK, "Dropping request from %s after %.1f seconds "
+				"in the backlog queue", msg->sender, forker->max_queue_wait );
+			reject_request( msg, OSRF_STATUS_TIMEOUT,
+				"Request timed out waiting for an available child" );
+			message_free( msg );
+		}
+	}
+}
+
 /**
 	@brief Read transport_messages and dispatch them to child processes for servicing.
 	@param forker Pointer to the prefork_simple that manages the child processes.
 
 	This is the main loop of the parent process, and once entered, does not exit.
 
-	For each usable transport_message received: look for an idle child to service it.  If
+	Each usable transport_message received goes into the backlog queue.  For the
+	highest-priority request in the queue, look for an idle child to service it.  If
 	no idle children are available, either spawn a new one or, if we've already spawned the
 	maximum number of children, wait for one to become available.  Once a child is available
 	by whatever means, write an XML version of the input message, to a pipe designated for
 	use by that child.
+
+	A request whose client stops waiting for it, by its deadline or by max_queue_wait,
+	leaves the queue without taking a child.
 */
 static void prefork_run( prefork_simple* forker ) {
 
@@ -867,22 +2902,48 @@ static void prefork_run( prefork_simple* forker ) {
 	// the transport client's queue in the backlog queue gives us the
 	// ability to set a limit on the size of the backlog queue (and
 	// then to drop messages once the backlog queue has filled up)
-	transport_message* backlog_queue_head = NULL;
-	transport_message* backlog_queue_tail = NULL;
-	int backlog_queue_size = 0;
+	osrfBacklog backlog;
+	memset( &backlog, 0, sizeof( backlog ));
 
 	while( 1 ) {
 
 		if( forker->first_child == NULL && forker->idle_list == NULL ) {/* no more children */
 			osrfLogWarning( OSRF_LOG_MARK, "No more children..." );
+			osrfBacklogClear( &backlog );
 			return;
 		}
 
+		if( shutdown_pending )
+			prefork_shutdown( forker );
+
+		if( stats_dump_pending ) {
+			stats_dump_pending = 0;
+			dump_drone_stats( forker );
+		}
+
+		if( reload_pending ) {
+			reload_pending = 0;
+			reload_start( forker );
+		}
+
+		// The oldest request in the queue is at the head of one of the classes
+		double oldest = 0.0;
+		int i;
+		for( i = 0; i < OSRF_PRIORITY_COUNT; i++ )
+			if( backlog.head[ i ] && ( !oldest || backlog.head[ i ]->arrived < oldest ))
+				oldest = backlog.head[ i ]->arrived;
+		prefork_autoscale( forker, backlog.size,
+			oldest ? get_timestamp_millis() - oldest : 0.0 );
+
 		int received_from_network = 0;
-		if ( backlog_queue_size == 0 ) {
-			// Wait indefinitely for an input message
+		if ( backlog.size == 0 ) {
+			// Wait for an input message -- indefinitely, unless the
+			// autoscaler needs to wake up to retire surplus or outdated children
 			osrfLogDebug( OSRF_LOG_MARK, "Forker going into wait for data..." );
-			cur_msg = client_recv( forker->connection, -1 );
+			osrfLogFlush();
+			osrfTraceFlush();
+			cur_msg = client_recv( forker->connection,
+				( forker->autoscale && forker->max_spare_children ) || forker->rolling ? 1 : -1 );
 			received_from_network = 1;
 		} else {
 			// We have queued messages, which means all of our drones
@@ -907,53 +2968,58 @@ static void prefork_run( prefork_simple* forker ) {
 				osrfLogInfo(OSRF_LOG_MARK,
 					"Listener received an XMPP error message.  "
 					"Likely a bounced message. sender=%s", cur_msg->sender);
+				message_free( cur_msg );
 				if(child_dead)
 					reap_children(forker);
 				continue;
 			}
 
-			message_prepare_xml( cur_msg );
-			const char* msg_data = cur_msg->msg_xml;
-			if( ! msg_data || ! *msg_data ) {
-				osrfLogWarning( OSRF_LOG_MARK, "Received % message from %s, thread %",
-					(msg_data ? "empty" : "NULL"), cur_msg->sender, cur_msg->thread );
+			if( ! cur_msg->body || ! *cur_msg->body ) {
+				osrfLogWarning( OSRF_LOG_MARK, "Received empty message from %s, thread %s",
+					cur_msg->sender, cur_msg->thread );
 				message_free( cur_msg );
 				continue;       // Message not usable; go on to the next one.
 			}
 
-			// stick message onto queue
-			cur_msg->next = NULL;
-			if (backlog_queue_size == 0) {
-				backlog_queue_head = cur_msg;
-				backlog_queue_tail = cur_msg;
+			// Answer a health probe ourselves, rather than spend a drone on it
+			if( answer_health_probe( forker, cur_msg, backlog.size )) {
+				message_free( cur_msg );
+				cur_msg = NULL;
 			} else {
-				if (backlog_queue_size >= forker->max_backlog_queue) {
+				// stick message onto queue
+				int priority = classify_request( forker, cur_msg );
+				// When the queue is full, a lower-priority request may make room for this
+				// one; otherwise this one is dropped.
+				transport_message* dropped = osrfBacklogAdmit( &backlog, cur_msg, priority,
+					request_deadline( cur_msg ), forker->max_backlog_queue );
+				if( dropped != cur_msg && backlog.size > 1 )
+					osrfLogWarning( OSRF_LOG_MARK, "Adding message to non-empty backlog queue." );
+				if( dropped ) {
 					osrfLogWarning ( OSRF_LOG_MARK, "Reached backlog queue limit of %d; dropping "
-						"latest message",
-						forker->max_backlog_queue );
-					osrfMessage* err = osrf_message_init( STATUS, 1, 1 );
-					osrf_message_set_status_info( err, "osrfMethodException",
-						"Service unavailable: no available children and backlog queue at limit",
-						OSRF_STATUS_SERVICEUNAVAILABLE );
-					char *data = osrf_message_serialize( err );
-					osrfMessageFree( err );
-					transport_message* tresponse = message_init( data, "", cur_msg->thread, cur_msg->router_from, cur_msg->recipient );
-					message_set_osrf_xid(tresponse, cur_msg->osrf_xid);
-					free( data );
-					transport_client* client = osrfSystemGetTransportClient();
-					client_send_message( client, tresponse );
-					message_free( tresponse );
-					message_free(cur_msg);
-					continue;
+						"%s message", forker->max_backlog_queue,
+						dropped == cur_msg ? "latest" : "a lower-priority" );
+					reject_request( dropped, OSRF_STATUS_SERVICEUNAVAILABLE,
+						"Service unavailable: no available children and backlog queue at limit" );
+					message_free( dropped );
 				}
-				backlog_queue_tail->next = cur_msg;
-				backlog_queue_tail = cur_msg;
-				osrfLogWarning( OSRF_LOG_MARK, "Adding message to non-empty backlog queue." );
+				cur_msg = NULL;
 			}
-			backlog_queue_size++;
 		}
 
-		if (backlog_queue_size == 0) {
+		// Don't waste a child on a request whose client has given up on it
+		backlog_expire( forker, &backlog );
+
+		osrfBacklogItem* next_item;
+		while( ( next_item = osrfBacklogPeek( &backlog )) && next_item->deadline
+				&& get_monotonic_millis() >= next_item->deadline ) {
+			transport_message* msg = osrfBacklogPop( &backlog, next_item->priority );
+			osrfLogWarning( OSRF_LOG_MARK, "Dropping request from %s: its deadline passed "
+				"in the backlog queue", msg->sender );
+			reject_request( msg, OSRF_STATUS_DEADLINEEXCEEDED, "Request deadline exceeded" );
+			message_free( msg );
+		}
+
+		if (backlog.size == 0) {
 			// strictly speaking, this check may be redundant, but
 			// from this point forward we can be sure that the
 			// backlog queue has at least one message in it and
@@ -962,7 +3028,21 @@ static void prefork_run( prefork_simple* forker ) {
 			continue;
 		}
 
-		cur_msg = backlog_queue_head;
+		next_item = osrfBacklogPeek( &backlog );
+		cur_msg = next_item->msg;
+
+		// Time the request's wait for a drone, as a span of whatever sent it.  The drone
+		// works within the new span, so the request carries it along.
+		osrfSpan queued;
+		osrfTraceSetContext( cur_msg->osrf_span );
+		if( osrfSpanStart( &queued, "backlog", OSRF_SPAN_CONSUMER, next_item->arrived )) {
+			char traceparent[ OSRF_TRACEPARENT_SIZE ];
+			osrfSpanFormat( &queued, traceparent );
+			message_set_osrf_span( cur_msg, traceparent );
+		}
+
+		// Let the drone charge the wait against the request's deadline
+		cur_msg->queued = (int) (( get_timestamp_millis() - next_item->arrived ) * 1000 );
 
 		int honored = 0;     /* will be set to true when we service the request */
 		int no_recheck = 0;
@@ -984,13 +3064,14 @@ static void prefork_run( prefork_simple* forker ) {
 			// as a stack, the child we get is the one that was most recently active, or
 			// most recently spawned.  That means it's the one most likely still to be in
 			// physical memory, and the one least likely to have to be swapped in.
-			while( forker->idle_list ) {
+			while( ( cur_child = idle_pop( forker )) ) {
 
 				osrfLogDebug( OSRF_LOG_MARK, "Looking for idle child" );
-				// Grab the prefork_child at the head of the idle list
-				cur_child = forker->idle_list;
-				forker->idle_list = cur_child->next;
-				cur_child->next = NULL;
+				if( DRONE_EXITING == cur_child->slot->state ) {
+					// Killed, and waiting to be reaped
+					add_prefork_child( forker, cur_child );
+					continue;
+				}
 
 				osrfLogInternal( OSRF_LOG_MARK,
 					"Searching for available child. cur_child->pid = %d", cur_child->pid );
@@ -1001,14 +3082,12 @@ static void prefork_run( prefork_simple* forker ) {
 				osrfLogInternal( OSRF_LOG_MARK, "Writing to child fd %d",
 					cur_child->write_data_fd );
 
-				const char* msg_data = cur_msg->msg_xml;
-				int written = write( cur_child->write_data_fd, msg_data, strlen( msg_data ) + 1 );
-				if( written < 0 ) {
+				mark_drone_busy( cur_child );
+				if( send_request( forker, cur_child, cur_msg )) {
 					// This child appears to be dead or unusable.  Discard it.
 					osrfLogWarning( OSRF_LOG_MARK, "Write returned error %d: %s",
 						errno, strerror( errno ));
-					kill( cur_child->pid, SIGKILL );
-					del_prefork_child( forker, cur_child->pid );
+					doom_child( forker, cur_child, SIGKILL );
 					continue;
 				}
 
@@ -1025,26 +3104,19 @@ static void prefork_run( prefork_simple* forker ) {
 					osrfLogDebug( OSRF_LOG_MARK,  "Launching new child with current_num = %d",
 						forker->current_num_children );
 
-					launch_child( forker );  // Put a new child into the idle list
-					if( forker->idle_list ) {
-
-						// Take the new child from the idle list
-						prefork_child* new_child = forker->idle_list;
-						forker->idle_list = new_child->next;
-						new_child->next = NULL;
+					// Put a new child into the idle list, then take it right back out
+					if( launch_child( forker )) {
+						prefork_child* new_child = idle_pop( forker );
 
 						osrfLogDebug( OSRF_LOG_MARK, "Writing to new child fd %d : pid %d",
 							new_child->write_data_fd, new_child->pid );
 
-						const char* msg_data = cur_msg->msg_xml;
-						int written = write(
-							new_child->write_data_fd, msg_data, strlen( msg_data ) + 1 );
-						if( written < 0 ) {
+						mark_drone_busy( new_child );
+						if( send_request( forker, new_child, cur_msg )) {
 							// This child appears to be dead or unusable.  Discard it.
 							osrfLogWarning( OSRF_LOG_MARK, "Write returned error %d: %s",
 								errno, strerror( errno ));
-							kill( cur_child->pid, SIGKILL );
-							del_prefork_child( forker, cur_child->pid );
+							doom_child( forker, new_child, SIGKILL );
 						} else {
 							add_prefork_child( forker, new_child );
 							honored = 1;
@@ -1069,11 +3141,13 @@ static void prefork_run( prefork_simple* forker ) {
 		} // end while( ! honored )
 
 		if ( honored ) {
-			backlog_queue_head = cur_msg->next;
-			backlog_queue_size--;
-			cur_msg->next = NULL;
-			message_free( cur_msg );
+			osrfSpanEnd( &queued );
+			message_free( osrfBacklogPop( &backlog, next_item->priority ));
+		} else if( queued.recording ) {
+			// Still waiting; try again later, with a span of its own
+			message_set_osrf_span( cur_msg, osrfTraceGetContext() );
 		}
+		osrfTraceClearContext();
 
 	} /* end top level listen loop */
 }
@@ -1083,13 +3157,14 @@ static void prefork_run( prefork_simple* forker ) {
 	@brief See if any children have become available.
 	@param forker Pointer to the prefork_simple that owns the children.
 	@param forever Boolean: true if we should wait indefinitely.
-    @return 0 or greater if successful, -1 on select error/interrupt
+    @return The number of children found available, or -1 on poll error/interrupt
 
-	Call select() for all the children in the active list.  Read each active file
-	descriptor and move the corresponding child to the idle list.
+	Take children from the ready queue, and move them from the active list to the idle
+	list.  Ignore stale reports from children that have since died, or been replaced.
 
-	If @a forever is true, wait indefinitely for input.  Otherwise return immediately if
-	there are no active file descriptors.
+	If @a forever is true, and no child is available yet, wait on the doorbell until one
+	is.  Otherwise return immediately.  Either way, no system call is needed unless we
+	have to wait.
 */
 static int check_children( prefork_simple* forker, int forever ) {
 
@@ -1106,132 +3181,105 @@ static int check_children( prefork_simple* forker, int forever ) {
 		return 0;
 	}
 
-	int select_ret;
-	fd_set read_set;
-	FD_ZERO( &read_set );
-	int max_fd = 0;
-	int n;
-
-	// Prepare to select() on pipes from all the active children
-	prefork_child* cur_child = forker->first_child;
-	do {
-		if( cur_child->read_status_fd > max_fd )
-			max_fd = cur_child->read_status_fd;
-		FD_SET( cur_child->read_status_fd, &read_set );
-		cur_child = cur_child->next;
-	} while( cur_child != forker->first_child );
-
-	FD_CLR( 0, &read_set ); /* just to be sure */
-
-	if( forever ) {
-
-		if( (select_ret=select( max_fd + 1, &read_set, NULL, NULL, NULL )) == -1 ) {
-			osrfLogWarning( OSRF_LOG_MARK, "Select returned error %d on check_children: %s",
-				errno, strerror( errno ));
-		}
-		osrfLogInfo( OSRF_LOG_MARK,
-			"select() completed after waiting on children to become available" );
-
-	} else {
+	ready_queue* ready = forker->ready;
+	int num_handled = 0;
+	while( 1 ) {
 
-		struct timeval tv;
-		tv.tv_sec   = 0;
-		tv.tv_usec  = 0;
+		// Empty the doorbell before looking at the queue, so that any child
+		// finishing after we look will leave it ringing for the poll() below.
+		if( forever )
+			drain_doorbell( forker );
+		__sync_synchronize();
 
-		if( (select_ret=select( max_fd + 1, &read_set, NULL, NULL, &tv )) == -1 ) {
-			osrfLogWarning( OSRF_LOG_MARK, "Select returned error %d on check_children: %s",
-				errno, strerror( errno ));
-		}
-	}
+		uint64_t report;
+		while( ( ( report = ready->entries[ forker->ready_head & ready->mask ] )
+				>> READY_SLOT_BITS ) == READY_STAMP( forker->ready_head )) {
+			forker->ready_head++;
 
-    if( select_ret <= 0 ) // we're done here
-		return select_ret;
+			uint64_t entry = report & READY_SLOT_MASK;
+			prefork_child* cur_child = NULL;
+			if( entry > 0 && entry <= (uint64_t) forker->board_size )
+				cur_child = forker->slot_index[ entry - 1 ];
+			if( !cur_child || CHILD_ACTIVE_LIST != cur_child->list
+					|| DRONE_IDLE != cur_child->slot->state )
+				continue;   // Stale report
 
-	// Check each child in the active list.
-	// If it has responded, move it to the idle list.
-	cur_child = forker->first_child;
-	prefork_child* next_child = NULL;
-	int num_handled = 0;
-	do {
-		next_child = cur_child->next;
-		if( FD_ISSET( cur_child->read_status_fd, &read_set )) {
 			osrfLogDebug( OSRF_LOG_MARK,
 				"Server received status from a child %d", cur_child->pid );
 
 			num_handled++;
+			child_now_idle( forker, cur_child );
+		}
 
-			/* now suck off the data */
-			char buf[64];
-			if( (n=read( cur_child->read_status_fd, buf, sizeof( buf ) - 1 )) < 0 ) {
-				osrfLogWarning( OSRF_LOG_MARK,
-					"Read error after select in child status read with errno %d: %s",
-					errno, strerror( errno ));
-			}
-			else {
-				buf[n] = '\0';
-				osrfLogDebug( OSRF_LOG_MARK,  "Read %d bytes from status buffer: %s", n, buf );
-			}
-
+		if( forker->ready_stalled )
+			num_handled += recover_ready_queue( forker );
 
-            // if this child is in the sighup_pending list, kill the child,
-            // but leave it in the active list so that it won't be picked
-            // for new work.  When reap_children() next runs, it will be 
-            // properly cleaned up.
-            prefork_child* hup_child = forker->sighup_pending_list;
-            prefork_child* prev_hup_child = NULL;
-            int hup_cleanup = 0;
-
-            while (hup_child) {
-                pid_t hup_pid = hup_child->pid;
-                if (hup_pid == cur_child->pid) {
-
-                    osrfLogDebug(OSRF_LOG_MARK, 
-                        "server: killing previously-active child after "
-                        "receiving SIGHUP: %d", hup_pid);
-
-                    if (forker->sighup_pending_list == hup_child) {
-                        // hup_child is the first (maybe only) in the list
-                        forker->sighup_pending_list = hup_child->next;
-                    } else {
-                        // splice it from the list
-                        prev_hup_child->next = hup_child->next;
-                    }
-
-                    free(hup_child); // clean up the thin clone
-                    kill(hup_pid, SIGKILL);
-                    hup_cleanup = 1;
-                    break;
-                }
+		if( num_handled || !forever || NULL == forker->first_child )
+			return num_handled;
 
-                prev_hup_child = hup_child;
-                hup_child = hup_child->next;
-            }
+		// Nobody is available yet.  Wait for somebody to ring the doorbell.
+		struct pollfd bell;
+		bell.fd = forker->bell_read_fd;
+		bell.events = POLLIN;
+		bell.revents = 0;
+		if( poll( &bell, 1, -1 ) < 0 ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Poll returned error %d on check_children: %s",
+				errno, strerror( errno ));
+			return -1;
+		}
+		osrfLogInfo( OSRF_LOG_MARK,
+			"poll() completed after waiting on children to become available" );
+	}
+}
 
-            if (!hup_cleanup) {
+/**
+	@brief Move a child that has reported itself idle from the active list to the idle list.
+	@param forker Pointer to the prefork_simple that owns the child.
+	@param child Pointer to the prefork_child, which must be on the active list.
+*/
+static void child_now_idle( prefork_simple* forker, prefork_child* child ) {
+	release_handoff( child );
+	active_remove( forker, child );
+	child->idle_since = get_timestamp_millis();
+	forker->last_finished = child->idle_since;
+	idle_push( forker, child );
+}
 
-                // Remove the child from the active list
-                if( forker->first_child == cur_child ) {
-                    if( cur_child->next == cur_child ) {
-                        // only child in the active list
-                        forker->first_child = NULL;   
-                    } else {
-                        forker->first_child = cur_child->next;
-                    }
-                }
-                cur_child->next->prev = cur_child->prev;
-                cur_child->prev->next = cur_child->next;
+/**
+	@brief Step over any hole in the ready queue left by a child that died.
+	@param forker Pointer to the prefork_simple that owns the children.
+	@return The number of children found available.
+
+	Called after a child was reaped that may have claimed a position in the ready queue
+	without filling it in.  Every child marks its slot idle before claiming a position,
+	so once we've taken every active child whose slot says so straight from the status
+	board, no report up to the current tail can tell us anything new.  Skip them all.
+	Reports filled in late bear the stamps of positions we've passed, so they are never
+	taken, and they give way to the reports of later times round the ring.
+*/
+static int recover_ready_queue( prefork_simple* forker ) {
+	ready_queue* ready = forker->ready;
+	forker->ready_stalled = 0;
 
-                // Add it to the idle list
-                cur_child->prev = NULL;
-                cur_child->next = forker->idle_list;
-                forker->idle_list = cur_child;
-            }
-        }
+	unsigned long tail = ready->tail;
+	__sync_synchronize();
+	if( tail == forker->ready_head )
+		return 0;    // No hole, just an empty queue
 
-        cur_child = next_child;
-    } while( forker->first_child && forker->first_child != next_child );
+	int num_handled = 0;
+	int i;
+	for( i = 0; i < forker->board_size; i++ ) {
+		prefork_child* child = forker->slot_index[ i ];
+		if( child && CHILD_ACTIVE_LIST == child->list && DRONE_IDLE == child->slot->state ) {
+			child_now_idle( forker, child );
+			num_handled++;
+		}
+	}
 
-    return select_ret;
+	osrfLogInfo( OSRF_LOG_MARK, "Skipped %lu entries of the ready queue after a child died; "
+		"found %d children idle", tail - forker->ready_head, num_handled );
+	forker->ready_head = tail;
+	return num_handled;
 }
 
 /**
@@ -1243,54 +3291,124 @@ static int check_children( prefork_simple* forker, int forever ) {
 	Enter a loop, for up to max_requests iterations.  On each iteration:
 	- Wait indefinitely for a request from the parent.
 	- Service the request.
-	- Increment a counter.  If the limit hasn't been reached, notify the parent that you
-	are available for another request.
+	- Increment a counter.  If the limit hasn't been reached, mark yourself idle on the
+	status board, so that the parent can send you another request.
 
 	After exiting the loop, shut down and terminate the process.
 */
 static void prefork_child_wait( prefork_child* child ) {
 
-	int i,n;
-	growing_buffer* gbuf = buffer_init( READ_BUFSIZE );
-	char buf[READ_BUFSIZE];
-
-	for( i = 0; i < child->max_requests; i++ ) {
+	int i;
+	size_t buf_size = READ_BUFSIZE;
+	char* buf = safe_malloc( buf_size );
+
+	// Optionally parse each request into an arena, released in one go when we're done
+	osrfArena* arena = NULL;
+	char* json_arena = osrf_settings_host_value( "/apps/%s/unix_config/json_arena",
+		child->appname );
+	if( json_arena && !strcasecmp( json_arena, "true" )) {
+		arena = osrfNewArena( 0 );
+		osrf_stack_set_arena( arena );
+	}
+	free( json_arena );
 
-		n = -1;
-		int gotdata = 0;    // boolean; set to true if we get data
-		clr_fl( child->read_data_fd, O_NONBLOCK );
+	for( i = 0; i < child->settings->max_requests; i++ ) {
 
-		// Read a request from the parent, via a pipe, into a growing_buffer.
-		while( (n = read( child->read_data_fd, buf, READ_BUFSIZE-1 )) > 0 ) {
-			buf[n] = '\0';
-			osrfLogDebug( OSRF_LOG_MARK, "Prefork child read %d bytes of data", n );
-			if( !gotdata ) {
-				set_fl( child->read_data_fd, O_NONBLOCK );
-				gotdata = 1;
-			}
-			buffer_add_n( gbuf, buf, n );
+		// Read the frame announcing the next request
+		request_frame frame;
+		int rc = read_full( child->read_data_fd, &frame, sizeof( frame ));
+		if( 0 == rc ) {
+			osrfLogDebug( OSRF_LOG_MARK, "C child found its pipe closed, exiting..." );
+			break;
+		} else if( rc < 0 ) {
+			osrfLogWarning( OSRF_LOG_MARK,
+				"Prefork child read returned error with errno %d", errno );
+			break;
 		}
 
-		if( errno == EAGAIN )
-			n = 0;
+		const char* data = NULL;
+		size_t data_len = 0;
+		void* map = NULL;
+		size_t map_len = 0;
 
-		if( errno == EPIPE ) {
-			osrfLogDebug( OSRF_LOG_MARK, "C child attempted read on broken pipe, exiting..." );
+		// Read what follows the frame in one go, into a buffer of the right size
+		if( frame.length > buf_size ) {
+			buf_size = frame.length;
+			free( buf );
+			buf = safe_malloc( buf_size );
+		}
+		if( read_full( child->read_data_fd, buf, frame.length ) != 1 ) {
+			osrfLogWarning( OSRF_LOG_MARK,
+				"Prefork child read returned error with errno %d", errno );
 			break;
 		}
 
+		if( FRAME_SHM == frame.type ) {
+			// Map the shared memory segment named in the frame
+			const char* name = buf;
+			size_t name_len = strnlen( name, frame.length );
+			if( name_len >= HANDOFF_NAME_SIZE || name_len == frame.length ) {
+				osrfLogWarning( OSRF_LOG_MARK, "Prefork child unable to read segment name" );
+				break;
+			}
+
+			int fd = shm_open( name, O_RDONLY, 0 );
+			struct stat st;
+			if( fd >= 0 && 0 == fstat( fd, &st ) && st.st_size > 0 ) {
+				map_len = st.st_size;
+				map = mmap( NULL, map_len, PROT_READ, MAP_SHARED, fd, 0 );
+				if( MAP_FAILED == map )
+					map = NULL;
+			}
+			if( fd >= 0 )
+				close( fd );
+
+			if( map ) {
+				data = map;
+				data_len = map_len;
+			} else {
+				// Don't leave the client waiting for an answer that will never come
+				osrfLogError( OSRF_LOG_MARK,
+					"Prefork child unable to map shared memory segment %s", name );
+				transport_message* envelope =
+					message_unpack( buf + name_len + 1, frame.length - name_len - 1 );
+				if( envelope ) {
+					reject_request( envelope, OSRF_STATUS_INTERNALSERVERERROR,
+						"Internal server error: unable to read the request" );
+					message_free( envelope );
+				}
+			}
+
+		} else {
+			osrfLogDebug( OSRF_LOG_MARK, "Prefork child read %lu bytes of data",
+				(unsigned long) frame.length );
+			data = buf;
+			data_len = frame.length;
+		}
+
 		int terminate_now = 0;     // Boolean
 
-		if( n < 0 ) {
-			osrfLogWarning( OSRF_LOG_MARK,
-				"Prefork child read returned error with errno %d", errno );
-			break;
+		// Pick up any new log level from a configuration reload
+		int log_level = child->settings->log_level;
+		if( log_level && log_level != osrfLogGetLevel() )
+			osrfLogSetLevel( log_level );
 
-		} else if( gotdata ) {
+		if( data ) {
 			// Process the request
 			osrfLogDebug( OSRF_LOG_MARK, "Prefork child got a request.. processing.." );
-			terminate_now = prefork_child_process_request( child, gbuf->buf );
-			buffer_reset( gbuf );
+			child->slot->request_start = get_timestamp_millis();
+			terminate_now = prefork_child_process_request( child, data, data_len );
+			osrfArenaReset( arena );
+		}
+
+		if( map )
+			munmap( map, map_len );
+
+		// Don't hang on to a buffer sized for an occasional huge request
+		if( buf_size > HANDOFF_THRESHOLD ) {
+			free( buf );
+			buf_size = READ_BUFSIZE;
+			buf = safe_malloc( buf_size );
 		}
 
 		if( terminate_now ) {
@@ -1299,25 +3417,21 @@ static void prefork_child_wait( prefork_child* child ) {
 			break;
 		}
 
-		if( i < child->max_requests - 1 ) {
-			// Report back to the parent for another request.
-			size_t msg_len = 9;
-			ssize_t len = write(
-				child->write_status_fd, "available" /*less than 64 bytes*/, msg_len );
-			if( len != msg_len ) {
-				osrfLogError( OSRF_LOG_MARK,
-					"Drone terminating: unable to notify listener of availability: %s",
-					strerror( errno ));
-				buffer_free( gbuf );
-				osrf_prefork_child_exit( child );
-			}
+		if( i < child->settings->max_requests - 1 ) {
+			// Report back to the parent for another request, without leaving
+			// the log of this one, or its spans, in a buffer while we wait
+			osrfLogFlush();
+			osrfTraceFlush();
+			mark_drone_idle( child );
 		}
 	}
 
-	buffer_free( gbuf );
+	free( buf );
+	osrf_stack_set_arena( NULL );
+	osrfArenaFree( arena );
 
 	osrfLogDebug( OSRF_LOG_MARK, "Child with max-requests=%d, num-served=%d exiting...[%ld]",
-		child->max_requests, i, (long) getpid());
+		child->settings->max_requests, i, (long) getpid());
 
 	osrf_prefork_child_exit( child );
 }
@@ -1344,68 +3458,121 @@ static void add_prefork_child( prefork_simple* forker, prefork_child* child ) {
 		child->next      = forker->first_child;
 		forker->first_child->prev = child;
 	}
+	child->list = CHILD_ACTIVE_LIST;
+}
+
+/**
+	@brief Remove a prefork_child from the active list.
+	@param forker Pointer to the prefork_simple that owns the list.
+	@param child Pointer to the prefork_child to be removed, which must be on the list.
+*/
+static void active_remove( prefork_simple* forker, prefork_child* child ) {
+	if( child->next == child )
+		forker->first_child = NULL;    // only child in the list
+	else {
+		if( forker->first_child == child )
+			forker->first_child = child->next;  // Reseat forker->first_child
+
+		// Stitch the adjacent nodes together
+		child->prev->next = child->next;
+		child->next->prev = child->prev;
+	}
+	child->next = NULL;
+	child->prev = NULL;
+	child->list = CHILD_NO_LIST;
+}
+
+/**
+	@brief Add a prefork_child to the head of the idle list.
+	@param forker Pointer to the prefork_simple that owns the list.
+	@param child Pointer to the prefork_child to be added, which must be on no list.
+*/
+static void idle_push( prefork_simple* forker, prefork_child* child ) {
+	child->prev = NULL;
+	child->next = forker->idle_list;
+	if( forker->idle_list )
+		forker->idle_list->prev = child;
+	else
+		forker->idle_tail = child;
+	forker->idle_list = child;
+	forker->idle_count++;
+	child->list = CHILD_IDLE_LIST;
+}
+
+/**
+	@brief Remove a prefork_child from the idle list.
+	@param forker Pointer to the prefork_simple that owns the list.
+	@param child Pointer to the prefork_child to be removed, which must be on the list.
+*/
+static void idle_remove( prefork_simple* forker, prefork_child* child ) {
+	if( child->prev )
+		child->prev->next = child->next;
+	else
+		forker->idle_list = child->next;
+	if( child->next )
+		child->next->prev = child->prev;
+	else
+		forker->idle_tail = child->prev;
+	child->next = NULL;
+	child->prev = NULL;
+	forker->idle_count--;
+	child->list = CHILD_NO_LIST;
+}
+
+/**
+	@brief Take the prefork_child from the head of the idle list.
+	@param forker Pointer to the prefork_simple that owns the list.
+	@return Pointer to the most recently idle child, or NULL if the list is empty.
+*/
+static prefork_child* idle_pop( prefork_simple* forker ) {
+	prefork_child* child = forker->idle_list;
+	if( child )
+		idle_remove( forker, child );
+	return child;
+}
+
+/**
+	@brief Kill a child that we're done with, and park it until it's reaped.
+	@param forker Pointer to the prefork_simple that owns the child.
+	@param child Pointer to the prefork_child, which must be on no list, or on the
+		active list.
+	@param sig The signal to kill it with.
+
+	The child goes on the active list, marked as exiting, so that it won't be picked for
+	new work; reap_children() buries it in due course, and keeps the count of children
+	straight.
+*/
+static void doom_child( prefork_simple* forker, prefork_child* child, int sig ) {
+	child->slot->state = DRONE_EXITING;
+	if( CHILD_ACTIVE_LIST != child->list )
+		add_prefork_child( forker, child );
+	kill( child->pid, sig );
 }
 
 /**
 	@brief Delete and destroy a dead child from our list.
 	@param forker Pointer to the prefork_simple that owns the dead child.
 	@param pid Process ID of the dead child.
+	@return 1 if we found the child, or 0 if not.
 
-	Look for the dead child first in the list of active children.  If you don't find it
-	there, look in the list of idle children.  If you find it, remove it from whichever
-	list it's on, and destroy it.
+	Look up the dead child by process ID, remove it from whichever list it's on, and
+	destroy it.
 */
-static void del_prefork_child( prefork_simple* forker, pid_t pid ) {
+static int del_prefork_child( prefork_simple* forker, pid_t pid ) {
 
 	osrfLogDebug( OSRF_LOG_MARK, "Deleting Child: %d", pid );
 
-	prefork_child* cur_child = NULL;
-
-	// Look first in the active list
-	if( forker->first_child ) {
-		cur_child = forker->first_child; /* current pointer */
-		while( cur_child->pid != pid && cur_child->next != forker->first_child )
-			cur_child = cur_child->next;
-
-		if( cur_child->pid == pid ) {
-			// We found the right node.  Remove it from the list.
-			if( cur_child->next == cur_child )
-				forker->first_child = NULL;    // only child in the list
-			else {
-				if( forker->first_child == cur_child )
-					forker->first_child = cur_child->next;  // Reseat forker->first_child
-
-				// Stitch the adjacent nodes together
-				cur_child->prev->next = cur_child->next;
-				cur_child->next->prev = cur_child->prev;
-			}
-		} else
-			cur_child = NULL;  // Didn't find it in the active list
-	}
-
-	if( ! cur_child ) {
-		// Maybe it's in the idle list.  This can happen if, for example,
-		// a child is killed by a signal while it's between requests.
-
-		prefork_child* prev = NULL;
-		cur_child = forker->idle_list;
-		while( cur_child && cur_child->pid != pid ) {
-			prev = cur_child;
-			cur_child = cur_child->next;
-		}
+	prefork_child* cur_child = osrfHashGetFmt( forker->pid_index, "%ld", (long) pid );
+	if( !cur_child )
+		return 0;   // we can't find it
 
-		if( cur_child ) {
-			// Detach from the list
-			if( prev )
-				prev->next = cur_child->next;
-			else
-				forker->idle_list = cur_child->next;
-		} // else we can't find it
-	}
+	if( CHILD_ACTIVE_LIST == cur_child->list )
+		active_remove( forker, cur_child );
+	else if( CHILD_IDLE_LIST == cur_child->list )
+		idle_remove( forker, cur_child );
 
-	// If we found the node, destroy it.
-	if( cur_child )
-		prefork_child_free( forker, cur_child );
+	prefork_child_free( forker, cur_child );
+	return 1;
 }
 
 /**
@@ -1413,16 +3580,14 @@ static void del_prefork_child( prefork_simple* forker, pid_t pid ) {
 	@param forker Pointer to the prefork_simple that will own the prefork_child.
 	@param read_data_fd Used by child to read request from parent.
 	@param write_data_fd Used by parent to write request to child.
-	@param read_status_fd Used by parent to read status from child.
-	@param write_status_fd Used by child to write status to parent.
+	@param slot The child's slot on the status board.
 	@return Pointer to the newly created prefork_child.
 
 	The calling code is responsible for freeing the prefork_child by calling
 	prefork_child_free().
 */
 static prefork_child* prefork_child_init( prefork_simple* forker,
-	int read_data_fd, int write_data_fd,
-	int read_status_fd, int write_status_fd ) {
+	int read_data_fd, int write_data_fd, drone_slot* slot ) {
 
 	// Allocate a prefork_child -- from the free list if possible, or from
 	// the heap if necessary.  The free list is a non-circular, singly-linked list.
@@ -1436,14 +3601,21 @@ static prefork_child* prefork_child_init( prefork_simple* forker,
 	child->pid              = 0;
 	child->read_data_fd     = read_data_fd;
 	child->write_data_fd    = write_data_fd;
-	child->read_status_fd   = read_status_fd;
-	child->write_status_fd  = write_status_fd;
-	child->max_requests     = forker->max_requests;
+	child->slot             = slot;
+	child->slot_number      = slot - forker->board;
+	child->ready            = forker->ready;
+	child->list             = CHILD_NO_LIST;
+	child->generation       = forker->generation;
+	child->bell_fd          = forker->bell_write_fd;
+	child->idle_since       = get_timestamp_millis();
+	child->from_template    = 0;
+	child->handoff[ 0 ]     = '\0';
+	child->settings         = forker->settings;
 	child->appname          = forker->appname;  // We don't make a separate copy
-	child->keepalive        = forker->keepalive;
 	child->next             = NULL;
 	child->prev             = NULL;
 
+	forker->slot_index[ child->slot_number ] = child;
 	return child;
 }
 
@@ -1461,6 +3633,10 @@ static void prefork_clear( prefork_simple* prefork, bool graceful ) {
 
 	while( prefork->first_child ) {
 
+		// A SIGINT or SIGQUIT cuts short a graceful shutdown
+		if( graceful && SHUTDOWN_NOW == shutdown_pending )
+			graceful = false;
+
 		if (graceful) {
 			// wait for at least one active child to become idle, then repeat.
 			// once complete, all children will be idle and cleaned up below.
@@ -1481,13 +3657,10 @@ static void prefork_clear( prefork_simple* prefork, bool graceful ) {
 
 	// Kill all the idle prefork children, close their file
 	// descriptors, and move them to the free list.
-	prefork_child* child = prefork->idle_list;
-	prefork->idle_list = NULL;
-	while( child ) {
-		prefork_child* temp = child->next;
+	prefork_child* child;
+	while( ( child = idle_pop( prefork )) ) {
 		kill( child->pid, SIGKILL );
 		prefork_child_free( prefork, child );
-		child = temp;
 	}
 	//prefork->current_num_children = 0;
 
@@ -1500,9 +3673,8 @@ static void prefork_clear( prefork_simple* prefork, bool graceful ) {
 		child = temp;
 	}
 
-	// Close the Jabber connection
-	client_free( prefork->connection );
-	prefork->connection = NULL;
+	// Kill the template process, if any
+	template_stop( prefork );
 
 	// After giving the child processes a second to terminate, wait on them so that they
 	// don't become zombies.  We don't wait indefinitely, so it's possible that some
@@ -1512,8 +3684,41 @@ static void prefork_clear( prefork_simple* prefork, bool graceful ) {
 		--prefork->current_num_children;
 	}
 
+	// The children we killed left their shared memory rings behind
+	client_sweep_shm( prefork->connection );
+
+	// Close the Jabber connection
+	client_free( prefork->connection );
+	prefork->connection = NULL;
+
 	free( prefork->appname );
 	prefork->appname = NULL;
+
+	osrfHashFree( prefork->method_priority );
+	prefork->method_priority = NULL;
+	osrfHashFree( prefork->ingress_priority );
+	prefork->ingress_priority = NULL;
+
+	jsonObjectFree( prefork->fixed_config );
+	prefork->fixed_config = NULL;
+	if( prefork->reload_file ) {
+		fclose( prefork->reload_file );
+		prefork->reload_file = NULL;
+	}
+
+	// Take down the status board and its doorbell
+	if( prefork->board ) {
+		munmap( prefork->board, prefork->board_bytes );
+		prefork->board = NULL;
+		prefork->ready = NULL;
+	}
+	osrfHashFree( prefork->pid_index );
+	prefork->pid_index = NULL;
+	free( prefork->slot_index );
+	prefork->slot_index = NULL;
+	close( prefork->bell_read_fd );
+	if( prefork->bell_write_fd != prefork->bell_read_fd )
+		close( prefork->bell_write_fd );
 }
 
 /**
@@ -1522,10 +3727,16 @@ static void prefork_clear( prefork_simple* prefork, bool graceful ) {
 	@param child Pointer to the prefork_child to be destroyed.
 */
 static void prefork_child_free( prefork_simple* forker, prefork_child* child ) {
-	close( child->read_data_fd );
+	if( child->read_data_fd >= 0 )
+		close( child->read_data_fd );
 	close( child->write_data_fd );
-	close( child->read_status_fd );
-	close( child->write_status_fd );
+	release_handoff( child );
+	if( child->pid )
+		osrfHashRemove( forker->pid_index, "%ld", (long) child->pid );
+	forker->slot_index[ child->slot_number ] = NULL;
+	child->slot->state = DRONE_FREE;
+	child->slot = NULL;
+	child->list = CHILD_NO_LIST;
 
 	// Stick the prefork_child in a free list for potential reuse.  This is a
 	// non-circular, singly linked list.
@@ -1,8 +1,27 @@
 /**
 	@file osrf_settings.c
 	@brief Facility for retrieving server configuration settings.
+
+	If the bootstrap configuration names a settings_snapshot file, the first process on a
+	host to fetch its settings saves them there, and the rest load the file instead of
+	asking opensrf.settings.  A lock file next to the snapshot makes sure that only one
+	process at a time goes to the settings server, and the others wait for its result
+	rather than joining the queue.
+
+	Lookups may come from several threads at once, as from an application's worker pool.
+	The index of the settings is built whenever they are loaded or replaced, and only
+	read after that; the cache of compiled search paths, which grows as paths are looked
+	up, has a lock of its own.
 */
-#include <opensrf/osrf_settings.h> 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <opensrf/osrf_settings.h>
+#include <opensrf/osrfConfig.h>
+#include <opensrf/osrf_msgpack.h>
 
 /**
 	@brief Stores a copy of server configuration settings as a jsonObject.
@@ -15,9 +34,32 @@ struct osrf_host_config_ {
 	char* hostname;
 	/** @brief The configuration settings as a jsonObject */
 jsonObject* config;
+	/** @brief Search paths already compiled, keyed by path; guarded by paths_lock */
+	osrfHash* paths;
+	/** @brief Every node reachable through hash keys alone, keyed by its path */
+	osrfHash* index;
 };
 
+/** @brief Guards the cache of compiled search paths. */
+static pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Most search paths to keep compiled; beyond this we compile each time. */
+#define MAX_CACHED_PATHS 256
+
+/** @brief How old, in seconds, a settings snapshot may be before it's fetched anew. */
+#define SNAPSHOT_MAX_AGE 86400
+
+/** @brief How old, in seconds, a snapshot may get before one process refreshes it. */
+#define SNAPSHOT_REFRESH_AGE 600
+
 static osrf_host_config* osrf_settings_new_host_config(const char* hostname);
+static long config_long(const char* path, long dflt);
+static jsonPath* compiled_path(const char* path, int* cached);
+static void free_compiled_path(char* key, void* item);
+static const jsonObject* find_node(const char* path, int* multi);
+static void index_node(osrfHash* index, growing_buffer* path, const jsonObject* node);
+static void reset_lookups(osrf_host_config* c);
+static void set_config(osrf_host_config* c, jsonObject* cfg);
 
 static osrf_host_config* config = NULL;
 
@@ -48,9 +90,22 @@ char* osrf_settings_host_value(const char* format, ...) {
 		exit( 99 );
 	}
 
-	jsonObject* o = jsonObjectFindPath(config->config, VA_BUF);
+	int multi;
+	const jsonObject* node = find_node(VA_BUF, &multi);
+	if( !multi )
+		return jsonObjectToSimpleString(node);
+
+	int cached;
+	jsonPath* path = compiled_path(VA_BUF, &cached);
+	if( !path )
+		return NULL;
+
+	jsonObject* o = jsonPathEval(path, config->config);
 	char* val = jsonObjectToSimpleString(o);
 	jsonObjectFree(o);
+
+	if( !cached )
+		jsonPathFree(path);
 	return val;
 }
 
@@ -81,7 +136,198 @@ jsonObject* osrf_settings_host_value_object(const char* format, ...) {
 		exit( 99 );
 	}
 
-	return jsonObjectFindPath(config->config, VA_BUF);
+	int multi;
+	const jsonObject* node = find_node(VA_BUF, &multi);
+	if( !multi )
+		return jsonObjectClone(node);
+
+	int cached;
+	jsonPath* path = compiled_path(VA_BUF, &cached);
+	if( !path )
+		return NULL;
+
+	jsonObject* o = jsonPathEval(path, config->config);
+	if( !cached )
+		jsonPathFree(path);
+	return o;
+}
+
+/**
+	@brief Fetch a specified part of an already-loaded configuration, without copying it.
+	@param format A printf-style format string.  Subsequent parameters, if any, will be formatted
+		and inserted into the format string.
+	@return A pointer to the value if it's found, or NULL if not.
+
+	Like osrf_settings_host_value_object(), but the result belongs to the configuration,
+	and stays valid until the configuration is freed or reloaded.  For a path beginning
+	with "//", the result is the first match rather than an array of them all.
+
+	If no configuration has been loaded, this function returns NULL.
+*/
+const jsonObject* osrf_settings_host_value_const(const char* format, ...) {
+	if( ! config )
+		return NULL;
+
+	VA_LIST_TO_STRING(format);
+
+	int multi;
+	const jsonObject* node = find_node(VA_BUF, &multi);
+	if( !multi )
+		return node;
+
+	int cached;
+	jsonPath* path = compiled_path(VA_BUF, &cached);
+	if( !path )
+		return NULL;
+
+	node = jsonPathFind(path, config->config);
+	if( !cached )
+		jsonPathFree(path);
+	return node;
+}
+
+/**
+	@brief Look up a search path in the index of the configuration.
+	@param path The search path.
+	@param multi Pointer to an int, set to 1 if the path begins with "//" and so can't be
+		looked up this way, or to 0 otherwise.
+	@return Pointer to the node the path leads to, or NULL if there is none.
+
+	A path that doesn't begin with "//" follows hash keys from the top, so every place it
+	can lead is in the index, built along with the configuration by set_config().  Before we
+	look, we put the path in the form the index uses: a slash before each key, and no empty
+	steps.
+*/
+static const jsonObject* find_node(const char* path, int* multi) {
+	if( path[ 0 ] == '/' && path[ 1 ] == '/' && path[ 2 ] != '\0' ) {
+		*multi = 1;
+		return NULL;
+	}
+	*multi = 0;
+
+	if( !config->index )
+		return NULL;
+
+	char key[ strlen( path ) + 2 ];
+	char* k = key;
+	const char* p = path;
+	while( *p ) {
+		while( '/' == *p )
+			++p;
+		if( *p ) {
+			*k++ = '/';
+			while( *p && *p != '/' )
+				*k++ = *p++;
+		}
+	}
+	*k = '\0';
+
+	return k == key ? NULL : osrfHashGet( config->index, key );
+}
+
+/**
+	@brief Add a node's children to the index, under their paths, and theirs in turn.
+	@param index Pointer to the index.
+	@param path Pointer to a growing_buffer holding the path of @a node.
+	@param node Pointer to the node.
+
+	Keys with a slash in them can't be reached by a search path, so they're left out.
+*/
+static void index_node(osrfHash* index, growing_buffer* path, const jsonObject* node) {
+	if( !node || node->type != JSON_HASH )
+		return;
+
+	size_t len = path->n_used;
+	osrfHashCursor cursor = NULL;
+	const char* key;
+	const jsonObject* child;
+	while( (child = osrfHashCursorNext( node->value.h, &cursor, &key )) ) {
+		if( !*key || strchr( key, '/' ))
+			continue;
+		OSRF_BUFFER_ADD_CHAR( path, '/' );
+		OSRF_BUFFER_ADD( path, key );
+		osrfHashSet( index, (void*) child, "%s", OSRF_BUFFER_C_STR( path ));
+		index_node( index, path, child );
+		path->n_used = len;
+		path->buf[ len ] = '\0';
+	}
+}
+
+/**
+	@brief Forget the compiled paths and the index of a configuration.
+	@param c Pointer to the osrf_host_config, whose settings are about to change or go.
+*/
+static void reset_lookups(osrf_host_config* c) {
+	pthread_mutex_lock( &paths_lock );
+	osrfHashFree( c->paths );
+	c->paths = NULL;
+	pthread_mutex_unlock( &paths_lock );
+	osrfHashFree( c->index );
+	c->index = NULL;
+}
+
+/**
+	@brief Install a configuration's settings, and index them.
+	@param c Pointer to the osrf_host_config.
+	@param cfg Pointer to the settings, which @a c takes over.
+
+	Whatever settings @a c held before are freed, along with their lookups.  The index is
+	built here, once, so that lookups only ever read it.
+*/
+static void set_config(osrf_host_config* c, jsonObject* cfg) {
+	reset_lookups( c );
+	jsonObjectFree( c->config );
+	c->config = cfg;
+
+	c->index = osrfNewHash();
+	growing_buffer* buf = buffer_init( 64 );
+	index_node( c->index, buf, c->config );
+	buffer_free( buf );
+}
+
+/**
+	@brief Get a compiled form of a search path, compiling it only the first time.
+	@param path The search path.
+	@param cached Pointer to an int, set to 1 if the result belongs to the cache, or to 0
+		if the caller must free it with jsonPathFree().
+	@return Pointer to the compiled path, or NULL if the path is invalid.
+
+	Servers look up the same handful of settings over and over, so the cache spares them
+	from parsing the same paths each time.  It is bounded in case a caller builds paths
+	from data.  A compiled path, once cached, isn't changed or freed until the settings
+	are, so it may be used after the lock is released.
+*/
+static jsonPath* compiled_path(const char* path, int* cached) {
+	*cached = 0;
+	pthread_mutex_lock( &paths_lock );
+	if( !config->paths ) {
+		config->paths = osrfNewHash();
+		osrfHashSetCallback(config->paths, free_compiled_path);
+	}
+
+	jsonPath* compiled = osrfHashGet(config->paths, path);
+	if( compiled ) {
+		*cached = 1;
+		pthread_mutex_unlock( &paths_lock );
+		return compiled;
+	}
+
+	compiled = jsonPathCompile(path);
+	if( compiled && osrfHashGetCount(config->paths) < MAX_CACHED_PATHS ) {
+		osrfHashSet(config->paths, compiled, path);
+		*cached = 1;
+	}
+	pthread_mutex_unlock( &paths_lock );
+	return compiled;
+}
+
+/**
+	@brief Free a compiled path on behalf of the path cache.
+	@param key The path (not used).
+	@param item Pointer to the jsonPath.
+*/
+static void free_compiled_path(char* key, void* item) {
+	jsonPathFree(item);
 }
 
 
@@ -95,6 +341,13 @@ jsonObject* osrf_settings_host_value_object(const char* format, ...) {
 	a client process (that is not also a server in its own right) will read its own
 	configuration file locally.
 
+	If the bootstrap configuration has a settings_snapshot, we look there first, and use
+	what we find if it's for the same host and settings_generation, and no older than
+	settings_snapshot_max_age seconds (a day by default).  Once it's older than
+	settings_snapshot_refresh seconds (ten minutes by default), the first process to notice
+	fetches the settings anew and rewrites the snapshot, while the others carry on with the
+	one they have.  Bump settings_generation to make every process ignore older snapshots.
+
 	The settings are cached as a jsonObject for future lookups by the functions
 	osrf_settings_host_value() and osrf_settings_host_value_object().
 
@@ -103,44 +356,237 @@ jsonObject* osrf_settings_host_value_object(const char* format, ...) {
  */
 int osrf_settings_retrieve(const char* hostname) {
 
-	if(!config) {
-
-		osrfAppSession* session = osrfAppSessionClientInit("opensrf.settings");
-		jsonObject* params = jsonNewObject(NULL);
-		jsonObjectPush(params, jsonNewObject(hostname));
-		int req_id = osrfAppSessionSendRequest( 
-			session, params, "opensrf.settings.host_config.get", 1 );
-		osrfMessage* omsg = osrfAppSessionRequestRecv( session, req_id, 60 );
-		jsonObjectFree(params);
-
-		if(!omsg) {
-			osrfLogError( OSRF_LOG_MARK, "No osrfMessage received from host %s (timeout?)", hostname);
-		} else if(!omsg->_result_content) {
-			osrfMessageFree(omsg);
-			osrfLogError(
-				OSRF_LOG_MARK,
-			"NULL or non-existent osrfMessage result content received from host %s, "
-				"broken message or no settings for host",
-				hostname
-			);
-		} else {
-			config = osrf_settings_new_host_config(hostname);
-			config->config = jsonObjectClone(omsg->_result_content);
-			osrfMessageFree(omsg);
-		}
-
-		osrf_app_session_request_finish( session, req_id );
-		osrfAppSessionFree( session );
+	if(config)
+		return 0;
 
-		if(!config) {
+	char* snapshot = osrfConfigHasDefaultConfig() ?
+		osrfConfigGetValue( NULL, "/settings_snapshot" ) : NULL;
+	if( !snapshot ) {
+		jsonObject* cfg = osrf_settings_fetch( hostname );
+		if( !cfg ) {
 			osrfLogError( OSRF_LOG_MARK, "Unable to load config for host %s", hostname);
 			return -1;
 		}
+		config = osrf_settings_new_host_config(hostname);
+		set_config( config, cfg );
+		return 0;
+	}
+
+	long generation = config_long( "/settings_generation", 0 );
+	long max_age = config_long( "/settings_snapshot_max_age", SNAPSHOT_MAX_AGE );
+	long refresh_age = config_long( "/settings_snapshot_refresh", SNAPSHOT_REFRESH_AGE );
+
+	size_t len = strlen( snapshot );
+	char lockname[ len + sizeof( ".lock" ) ];
+	memcpy( lockname, snapshot, len );
+	strcpy( lockname + len, ".lock" );
+	int lock = open( lockname, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+	if( lock < 0 )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to open settings lock file %s: %s",
+			lockname, strerror( errno ) );
+
+	time_t age;
+	int ret = osrf_settings_load_snapshot( snapshot, hostname, generation, max_age, &age );
+	if( 0 == ret ) {
+		// Good enough; refresh it if it's getting old and nobody else is already
+		if( age >= refresh_age && lock >= 0 && 0 == flock( lock, LOCK_EX | LOCK_NB ) ) {
+			jsonObject* cfg = osrf_settings_fetch( hostname );
+			if( cfg ) {
+				set_config( config, cfg );
+				osrf_settings_save_snapshot( snapshot, generation );
+			}
+		}
+	} else {
+		// Wait for anyone already fetching, in case they save us the trouble
+		if( lock >= 0 )
+			flock( lock, LOCK_EX );
+		ret = osrf_settings_load_snapshot( snapshot, hostname, generation, max_age, NULL );
+		if( ret ) {
+			jsonObject* cfg = osrf_settings_fetch( hostname );
+			if( cfg ) {
+				config = osrf_settings_new_host_config(hostname);
+				set_config( config, cfg );
+				osrf_settings_save_snapshot( snapshot, generation );
+				ret = 0;
+			} else
+				osrfLogError( OSRF_LOG_MARK, "Unable to load config for host %s", hostname);
+		}
+	}
+
+	if( lock >= 0 )
+		close( lock );    // releases the lock, if we have it
+	free( snapshot );
+	return ret;
+}
+
+/**
+	@brief Ask the settings server for the configuration of a host.
+	@param hostname The host name.
+	@return Pointer to a newly created jsonObject holding the settings, or NULL if they
+		couldn't be had.
+
+	Unlike osrf_settings_retrieve(), always ask the server, and leave the cached settings
+	alone.  The calling code is responsible for freeing the jsonObject, or for handing it
+	to osrf_settings_replace().
+*/
+jsonObject* osrf_settings_fetch(const char* hostname) {
+	jsonObject* cfg = NULL;
+
+	osrfAppSession* session = osrfAppSessionClientInit("opensrf.settings");
+	jsonObject* params = jsonNewObject(NULL);
+	jsonObjectPush(params, jsonNewObject(hostname));
+	int req_id = osrfAppSessionSendRequest( 
+		session, params, "opensrf.settings.host_config.get", 1 );
+	osrfMessage* omsg = osrfAppSessionRequestRecv( session, req_id, 60 );
+	jsonObjectFree(params);
+
+	if(!omsg) {
+		osrfLogError( OSRF_LOG_MARK, "No osrfMessage received from host %s (timeout?)", hostname);
+	} else if(!omsg->_result_content) {
+		osrfMessageFree(omsg);
+		osrfLogError(
+			OSRF_LOG_MARK,
+		"NULL or non-existent osrfMessage result content received from host %s, "
+			"broken message or no settings for host",
+			hostname
+		);
+	} else {
+		cfg = jsonObjectClone(omsg->_result_content);
+		osrfMessageFree(omsg);
 	}
 
+	osrf_app_session_request_finish( session, req_id );
+	osrfAppSessionFree( session );
+	return cfg;
+}
+
+/**
+	@brief Read a number from the bootstrap configuration.
+	@param path The path to the value.
+	@param dflt What to return if the value is missing.
+	@return The value, or @a dflt.
+*/
+static long config_long(const char* path, long dflt) {
+	char* str = osrfConfigGetValue( NULL, "%s", path );
+	long value = str ? atol( str ) : dflt;
+	free( str );
+	return value;
+}
+
+/**
+	@brief Load the configuration settings from a snapshot file.
+	@param path Name of the snapshot file.
+	@param hostname The host name the settings must be for.
+	@param generation The settings generation the snapshot must be from.
+	@param max_age How many seconds old the snapshot may be.
+	@param age Pointer through which to return the age of the snapshot, or NULL.
+	@return Zero if successful, or -1 if there's no usable snapshot.
+
+	The file is mapped rather than read, and decoded in place.  A snapshot for some other
+	host or generation, or too old, is ignored.  If settings are already loaded, they are
+	replaced.
+*/
+int osrf_settings_load_snapshot( const char* path, const char* hostname, long generation,
+		long max_age, time_t* age ) {
+	if( !(path && hostname) )
+		return -1;
+
+	int fd = open( path, O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+		return -1;
+
+	struct stat st;
+	jsonObject* snap = NULL;
+	if( 0 == fstat( fd, &st ) && st.st_size > 0 ) {
+		void* map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( map != MAP_FAILED ) {
+			snap = jsonMsgpackToObject( map, st.st_size );
+			munmap( map, st.st_size );
+		}
+	}
+	close( fd );
+
+	const char* host = jsonObjectGetString( jsonObjectGetKeyConst( snap, "hostname" ));
+	time_t fetched = (time_t) jsonObjectGetNumber( jsonObjectGetKeyConst( snap, "fetched" ));
+	time_t now = time( NULL );
+	if( !snap || !host || strcmp( host, hostname )
+			|| (long) jsonObjectGetNumber( jsonObjectGetKeyConst( snap, "generation" )) != generation
+			|| now - fetched > max_age || !jsonObjectGetKeyConst( snap, "config" )) {
+		osrfLogDebug( OSRF_LOG_MARK, "Settings snapshot %s is missing, stale, or for "
+			"another host or generation", path );
+		jsonObjectFree( snap );
+		return -1;
+	}
+
+	osrf_settings_free_host_config( NULL );
+	config = osrf_settings_new_host_config( hostname );
+	set_config( config, jsonObjectExtractKey( snap, "config" ));
+	jsonObjectFree( snap );
+
+	if( age )
+		*age = now - fetched;
+	osrfLogInfo( OSRF_LOG_MARK, "Loaded settings for %s from snapshot %s (%ld seconds old)",
+		hostname, path, (long) ( now - fetched ));
 	return 0;
 }
 
+/**
+	@brief Save the loaded configuration settings to a snapshot file.
+	@param path Name of the snapshot file.
+	@param generation The settings generation to record.
+	@return Zero if successful, or -1 if not.
+
+	The snapshot is written to a temporary file and renamed into place, so that a reader
+	sees the old one or the new one, never a mix.  It may hold passwords, so only the
+	owner may read it.
+*/
+int osrf_settings_save_snapshot( const char* path, long generation ) {
+	if( !(path && config && config->config) )
+		return -1;
+
+	jsonObject* snap = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( snap, "hostname", jsonNewObject( config->hostname ));
+	jsonObjectSetKey( snap, "generation", jsonNewNumberObject( (double) generation ));
+	jsonObjectSetKey( snap, "fetched", jsonNewNumberObject( (double) time( NULL )));
+	jsonObjectSetKey( snap, "config", jsonObjectClone( config->config ));
+
+	size_t len;
+	char* data = jsonObjectToMsgpack( snap, &len );
+	jsonObjectFree( snap );
+
+	growing_buffer* tmpname = buffer_init( 64 );
+	buffer_fadd( tmpname, "%s.%ld", path, (long) getpid() );
+	const char* tmp = OSRF_BUFFER_C_STR( tmpname );
+
+	int ret = -1;
+	int fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+	if( fd >= 0 ) {
+		size_t done = 0;
+		while( done < len ) {
+			ssize_t n = write( fd, data + done, len - done );
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				break;
+			done += n;
+		}
+		if( close( fd ) == 0 && done == len && rename( tmp, path ) == 0 )
+			ret = 0;
+		else
+			unlink( tmp );
+	}
+
+	if( ret )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to write settings snapshot %s: %s",
+			path, strerror( errno ) );
+	else
+		osrfLogInfo( OSRF_LOG_MARK, "Saved settings snapshot %s", path );
+
+	buffer_free( tmpname );
+	free( data );
+	return ret;
+}
+
 /**
 	@brief Allocate and initialize an osrf_host_config for a given host name.
 	@param hostname Pointer to a host name.
@@ -151,9 +597,38 @@ static osrf_host_config* osrf_settings_new_host_config(const char* hostname) {
 	osrf_host_config* c = safe_malloc(sizeof(osrf_host_config));
 	c->hostname = strdup(hostname);
 	c->config = NULL;
+	c->paths = NULL;
+	c->index = NULL;
 	return c;
 }
 
+/**
+	@brief Report which host the cached settings are for.
+	@return The host name, or NULL if no settings have been loaded.
+*/
+const char* osrf_settings_hostname( void ) {
+	return config ? config->hostname : NULL;
+}
+
+/**
+	@brief Replace the cached settings with a fresh copy.
+	@param cfg Pointer to the new settings, which the cache takes over.
+	@return Zero if successful, or -1 if no settings were loaded to begin with.
+
+	Meant for a long-running process that has fetched its settings again by way of
+	osrf_settings_fetch().  Pointers previously returned by osrf_settings_host_value_const()
+	become invalid.  If unsuccessful, free @a cfg.
+*/
+int osrf_settings_replace( jsonObject* cfg ) {
+	if( !config || !cfg ) {
+		jsonObjectFree( cfg );
+		return -1;
+	}
+
+	set_config( config, cfg );
+	return 0;
+}
+
 /**
 	@brief Deallocate an osrf_host_config and its contents.
 	@param c A pointer to the osrf_host_config to be deallocated.
@@ -165,6 +640,7 @@ void osrf_settings_free_host_config(osrf_host_config* c) {
 	}
 	if( c ) {
 		free(c->hostname);
+		reset_lookups(c);
 		jsonObjectFree(c->config);
 		free(c);
 	}
@@ -1,17 +1,90 @@
 #include <opensrf/osrf_stack.h>
 #include <opensrf/osrf_application.h>
+#include <opensrf/osrf_trace.h>
+#include <opensrf/osrf_capture.h>
 
 /**
 	@file osrf_stack.c
 	@brief Routines to receive and process input osrfMessages.
 */
 
-/* the max number of oilsMessage blobs present in any one root packet */
-#define OSRF_MAX_MSGS_PER_PACKET 256
 // -----------------------------------------------------------------------------
 
+/** @brief Most server sessions that may hold back their responses during one drain. */
+#define DRAIN_MAX_SESSIONS 16
+
+/**
+	@brief The server sessions holding back their responses until the end of a drain.
+
+	While osrf_stack_process_ms() works through the messages available on its socket,
+	each server session they're for answers into its output buffer, as it would for
+	several requests in one transport message.  The buffers go out together once the
+	socket has nothing more for us, or once the first of the held responses has waited
+	as long as it may.
+*/
+typedef struct {
+	osrfAppSession* sessions[ DRAIN_MAX_SESSIONS ];
+	int count;             /**< How many sessions are holding back responses. */
+	long long started;     /**< When the held responses started to accumulate, in ms. */
+} drain_batch;
+
 static void _do_client( osrfAppSession*, osrfMessage* );
 static void _do_server( osrfAppSession*, osrfMessage* );
+static void drain_add( drain_batch* drain, osrfAppSession* session );
+static void drain_flush( drain_batch* drain );
+static void drain_end( drain_batch* drain );
+
+/**
+	@brief Longest that responses may be held back for the rest of a drain, in milliseconds,
+	or zero to send each transport message's responses as soon as it's been handled.
+
+	Thread-local, like request_arena.
+*/
+static __thread int batch_wait = 0;
+
+/** @brief The drain under way in this thread, or NULL if none. */
+static __thread drain_batch* current_drain = NULL;
+
+/**
+	@brief Arena into which to parse requests to server sessions, or NULL for the heap.
+
+	Thread-local, so that each worker thread may have its own.
+*/
+static __thread osrfArena* request_arena = NULL;
+
+/**
+	@brief Parse subsequent requests to server sessions into a given arena.
+	@param arena Pointer to the osrfArena, or NULL to go back to the heap.
+
+	The caller owns the arena, and resets it when it's done with the request -- that is,
+	when nothing could still be looking at the request's parameters.  Responses that a
+	client session receives always go on the heap, since they may sit in the session's
+	queue indefinitely.
+
+	Applies to the calling thread only.
+*/
+void osrf_stack_set_arena( osrfArena* arena ) {
+	request_arena = arena;
+}
+
+/**
+	@brief Hold back the responses of server sessions while draining the socket.
+	@param ms Longest that any response may be held, in milliseconds; zero or less to send
+	responses as soon as each transport message has been handled, as by default.
+
+	A client pipelining requests over a stateful session may have several of them waiting
+	on our socket at once.  With a batch wait, osrf_stack_process_ms() handles all of
+	them before it sends any of the responses, so that they go out in as few transport
+	messages as will hold them.  The wait caps the delay: once the oldest held response
+	has waited that long, the responses so far go out before the next message is handled.
+	They also go out before anything waits for more input, such as a method calling
+	another service, so that holding them never adds a round trip.
+
+	Applies to the calling thread only.
+*/
+void osrf_stack_set_batch_wait( int ms ) {
+	batch_wait = ms > 0 ? ms : 0;
+}
 
 /**
 	@brief Read and process available transport_messages for a transport_client.
@@ -32,20 +105,55 @@ static void _do_server( osrfAppSession*, osrfMessage* );
 	a boolean.  Set it to true if you receive at least one transport_message, or to false
 	if you don't.  A timeout is not treated as an error; it just means you must set that
 	boolean to false.
+
+	A thin wrapper for osrf_stack_process_ms().
 */
 int osrf_stack_process( transport_client* client, int timeout, int* msg_received ) {
+	return osrf_stack_process_ms( client, timeout_secs_to_millis( timeout ), msg_received );
+}
+
+/**
+	@brief Read and process available transport_messages, waiting up to a given number of
+	milliseconds for the first one.
+	@param client Pointer to the transport_client whose socket is to be read.
+	@param timeout How many milliseconds to wait for the first message: negative to wait
+		indefinitely, or zero not to wait at all.
+	@param msg_received A pointer through which to report whether a message was received.
+	@return 0 upon success (even if a timeout occurs), or -1 upon failure.
+
+	Otherwise the same as osrf_stack_process().  See also osrf_stack_set_batch_wait().
+*/
+int osrf_stack_process_ms( transport_client* client, int timeout, int* msg_received ) {
 	if( !client ) return -1;
 	transport_message* msg = NULL;
 	if(msg_received) *msg_received = 0;
 
+	// If we're within a drain already, say for a method calling another service,
+	// send what it has held back before we wait for anything
+	drain_batch* outer = current_drain;
+	if( outer )
+		drain_flush( outer );
+
+	drain_batch drain;
+	drain.count = 0;
+	current_drain = batch_wait ? &drain : NULL;
+
 	// Loop through the available input messages
-	while( (msg = client_recv( client, timeout )) ) {
+	while( (msg = client_recv_ms( client, timeout )) ) {
 		if(msg_received) *msg_received = 1;
 		osrfLogDebug( OSRF_LOG_MARK, "Received message from transport code from %s", msg->sender );
 		osrf_stack_transport_handler( msg, NULL );
 		timeout = 0;
+
+		if( current_drain && drain.count
+				&& get_monotonic_millis() - drain.started >= batch_wait )
+			drain_flush( &drain );
 	}
 
+	if( current_drain )
+		drain_end( &drain );
+	current_drain = outer;
+
 	if( client->error ) {
 		osrfLogWarning(OSRF_LOG_MARK, "transport_client had trouble reading from the socket..");
 		return -1;
@@ -114,16 +222,48 @@ struct osrf_app_session_struct* osrf_stack_transport_handler( transport_message*
 	if(!msg->is_error)
 		osrfLogDebug( OSRF_LOG_MARK, "Session [%s] found or built", session->session_id );
 
+	// A request carries the context of the span it's part of.  A response doesn't change
+	// ours: we're still within whatever span sent the request.
+	if( session->type == OSRF_SESSION_SERVER )
+		osrfTraceSetContext( msg->osrf_span );
+
+	// Keep the session from being evicted as idle while we're busy with it
+	++session->in_use;
+
+	if( current_drain && session->type == OSRF_SESSION_SERVER )
+		drain_add( current_drain, session );
+
 	osrf_app_session_set_remote( session, msg->sender );
 	osrfMessage* arr[OSRF_MAX_MSGS_PER_PACKET];
 
 	/* Convert the message body into one or more osrfMessages */
+	osrfArena* prev_arena = NULL;
+	int use_arena = request_arena && session->type == OSRF_SESSION_SERVER;
+	if( use_arena )
+		prev_arena = jsonSetArena( request_arena );
 	int num_msgs = osrf_message_deserialize(msg->body, arr, OSRF_MAX_MSGS_PER_PACKET);
+	if( use_arena )
+		jsonSetArena( prev_arena );
 
 	osrfLogDebug( OSRF_LOG_MARK, "We received %d messages from %s", num_msgs, msg->sender );
 
+	// A deadline counts down from when we deserialized it; charge any time the request
+	// spent waiting in our listener's backlog before it got to us
+	if( msg->queued > 0 ) {
+		int i;
+		for( i = 0; i < num_msgs; i++ )
+			if( arr[i]->deadline > 0 )
+				arr[i]->deadline -= msg->queued;
+	}
+
 	double starttime = get_timestamp_millis();
 
+	// A server answering several requests at once holds back the responses, so as to
+	// bundle them into as few transport messages as it can
+	int batch = session->type == OSRF_SESSION_SERVER && num_msgs > 1;
+	if( batch )
+		++session->batch;
+
 	int i;
 	for( i = 0; i < num_msgs; i++ ) {
 
@@ -159,6 +299,10 @@ struct osrf_app_session_struct* osrf_stack_transport_handler( transport_message*
 			_do_server( session, arr[i] );
 	}
 
+	if( batch && --session->batch == 0 )
+		osrfAppSessionFlush( session );
+	--session->in_use;
+
 	double duration = get_timestamp_millis() - starttime;
 	osrfLogInfo(OSRF_LOG_MARK, "Message processing duration %f", duration);
 
@@ -168,6 +312,55 @@ struct osrf_app_session_struct* osrf_stack_transport_handler( transport_message*
 	return session;
 }
 
+/**
+	@brief Have a server session hold back its responses for the rest of a drain.
+	@param drain Pointer to the drain under way.
+	@param session Pointer to the server session.
+
+	The session stays in use, and so safe from eviction, until the drain is over.  Beyond
+	DRAIN_MAX_SESSIONS sessions, the rest answer as usual.
+*/
+static void drain_add( drain_batch* drain, osrfAppSession* session ) {
+	int i;
+	for( i = 0; i < drain->count; i++ )
+		if( drain->sessions[ i ] == session )
+			return;
+	if( drain->count >= DRAIN_MAX_SESSIONS )
+		return;
+
+	if( 0 == drain->count )
+		drain->started = get_monotonic_millis();
+	drain->sessions[ drain->count++ ] = session;
+	++session->batch;
+	++session->in_use;
+}
+
+/**
+	@brief Send the responses held back so far in a drain, and keep holding the rest.
+	@param drain Pointer to the drain under way.
+*/
+static void drain_flush( drain_batch* drain ) {
+	int i;
+	for( i = 0; i < drain->count; i++ )
+		osrfAppSessionFlush( drain->sessions[ i ] );
+	drain->started = get_monotonic_millis();
+}
+
+/**
+	@brief Send the responses held back in a drain, and let the sessions go.
+	@param drain Pointer to the drain that's over.
+*/
+static void drain_end( drain_batch* drain ) {
+	int i;
+	for( i = 0; i < drain->count; i++ ) {
+		osrfAppSession* session = drain->sessions[ i ];
+		osrfAppSessionFlush( session );
+		--session->batch;
+		--session->in_use;
+	}
+	drain->count = 0;
+}
+
 /**
 	@brief Acting as a client, process an incoming osrfMessage.
 	@param session Pointer to the osrfAppSession to which the message pertains.
@@ -193,6 +386,9 @@ static void _do_client( osrfAppSession* session, osrfMessage* msg ) {
 				// only from the router, in response to a CONNECT message.
 				osrfLogDebug( OSRF_LOG_MARK, "We connected successfully");
 				session->state = OSRF_SESSION_CONNECTED;
+				// Talk to the server in the encoding it agreed to, if it's one we asked for
+				session->encoding = msg->encoding == session->accept_encoding
+					? msg->encoding : OSRF_ENCODING_JSON;
 				osrfLogDebug( OSRF_LOG_MARK,  "State: %x => %s => %d", session,
 						session->session_id, session->state );
 				osrfMessageFree(msg);
@@ -282,6 +478,10 @@ static void _do_server( osrfAppSession* session, osrfMessage* msg ) {
 	switch( msg->m_type ) {
 
 		case STATUS:
+			// The only STATUS a client sends us is a grant of flow control credit
+			if( msg->status_code == OSRF_STATUS_CREDIT
+					&& msg->thread_trace == session->credit_request )
+				session->send_credit += msg->window;
 			break;
 
 		case DISCONNECT:
@@ -291,8 +491,16 @@ static void _do_server( osrfAppSession* session, osrfMessage* msg ) {
 			break;
 
 		case CONNECT:
-			osrfAppSessionStatus( session, OSRF_STATUS_OK,
-					"osrfConnectStatus", msg->thread_trace, "Connection Successful" );
+			{
+				// Agree to the body encoding the client asked for, if we know it
+				osrfAppSessionUseEncoding( session, msg->encoding );
+				osrfMessage* ack = osrf_message_init( STATUS, msg->thread_trace, 1 );
+				osrf_message_set_status_info( ack, "osrfConnectStatus",
+						"Connection Successful", OSRF_STATUS_OK );
+				ack->encoding = session->encoding;
+				osrfAppSessionSendBatch( session, &ack, 1 );
+				osrfMessageFree( ack );
+			}
 			session->state = OSRF_SESSION_CONNECTED;
 			break;
 
@@ -300,8 +508,34 @@ static void _do_server( osrfAppSession* session, osrfMessage* msg ) {
 			osrfLogDebug( OSRF_LOG_MARK, "server passing message %d to application handler "
 					"for session %s", msg->thread_trace, session->session_id );
 
-			osrfAppRunMethod( session->remote_service, msg->method_name,
-				session, msg->thread_trace, msg->_params );
+			if( osrfCaptureEnabled() )
+				osrfCaptureRequest( session->remote_service, msg );
+
+			// A stateless client asks for its body encoding with every request
+			if( msg->encoding != OSRF_ENCODING_JSON )
+				osrfAppSessionUseEncoding( session, msg->encoding );
+
+			{
+				// Flow-control the chunks of any partial response if the client asked.
+				// Save the state of the request we may be nested within.
+				int outer_request = session->credit_request;
+				int outer_credit = session->send_credit;
+				int outer_abandoned = session->abandoned_request;
+				session->credit_request = msg->window > 0 ? msg->thread_trace : -1;
+				session->send_credit = msg->window;
+				session->abandoned_request = -1;
+
+				// The method, and whatever it asks of others, works to the client's deadline
+				long long outer_deadline = osrfAppSessionSetDeadline( msg->deadline );
+
+				osrfAppRunMethod( session->remote_service, msg->method_name,
+					session, msg->thread_trace, msg->_params );
+
+				osrfAppSessionSetDeadline( outer_deadline );
+				session->credit_request = outer_request;
+				session->send_credit = outer_credit;
+				session->abandoned_request = outer_abandoned;
+			}
 
 			break;
 
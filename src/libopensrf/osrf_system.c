@@ -12,12 +12,17 @@
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "opensrf/utils.h"
 #include "opensrf/log.h"
 #include "opensrf/osrf_system.h"
 #include "opensrf/osrf_application.h"
 #include "opensrf/osrf_prefork.h"
+#include "opensrf/osrf_worker_pool.h"
+#include "opensrf/osrf_trace.h"
+#include "opensrf/osrf_capture.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
@@ -25,8 +30,9 @@
 
 osrfStringArray* log_protect_arr = NULL;
 
-/** Pointer to the global transport_client; i.e. our connection to Jabber. */
-static transport_client* osrfGlobalTransportClient = NULL;
+/** Pointer to the global transport_client; i.e. our connection to Jabber.  Each thread
+	has its own, so that the threads of a worker pool can each have a connection. */
+static __thread transport_client* osrfGlobalTransportClient = NULL;
 
 /** Boolean: set to true when we finish shutting down. */
 static int shutdownComplete = 0;
@@ -36,11 +42,41 @@ static char* get_pid_file(const char* path, const char* service);
 
 static int stop_service(const char* path, const char* service);
 
+/** Default for how many seconds the launcher waits for its services to become ready. */
+#define OSRF_STARTUP_TIMEOUT 120
+
+#define LAUNCH_PENDING  0  /**< Service waiting for the services it starts after. */
+#define LAUNCH_STARTING 1  /**< Listener forked, but not yet ready. */
+#define LAUNCH_READY    2  /**< Listener ready for requests. */
+#define LAUNCH_FAILED   3  /**< Service failed, or wasn't started. */
+
+/**
+	@brief The launcher's view of one service it's starting.
+*/
+typedef struct {
+	const char* appname;  /**< Name of the service. */
+	int state;            /**< One of the LAUNCH_* values. */
+	int fd;               /**< Pipe through which the listener says it's ready, or -1. */
+	pid_t pid;            /**< Process ID of the forked listener. */
+	double start;         /**< When it was forked, in seconds. */
+} launch_state;
+
+static int launch_services(launch_state* launches, int count, const char* piddir,
+		int timeout);
+static int json_names(const jsonObject* names, const char* appname);
+static int start_service(launch_state* launch, launch_state* launches, int count,
+		const char* piddir);
+static void read_readiness(launch_state* launch, int* failures);
+static void run_listener(const char* appname, const char* piddir);
+
+/** Pipe through which a listener tells the launcher that it's ready, or -1. */
+static int ready_fd = -1;
+
 /**
 	@brief Return a pointer to the global transport_client.
 	@return Pointer to the global transport_client, or NULL.
 
-	A given process needs only one connection to Jabber, so we keep it a pointer to it at
+	A given thread needs only one connection to Jabber, so we keep it a pointer to it at
 	file scope.  This function returns that pointer.
 
 	If the connection has been opened by a previous call to osrfSystemBootstrapClientResc(),
@@ -50,6 +86,33 @@ transport_client* osrfSystemGetTransportClient( void ) {
 	return osrfGlobalTransportClient;
 }
 
+/**
+	@brief Tell whoever launched the service whether it's ready for requests.
+	@param status "ready", or a few words on what went wrong; or NULL to say nothing.
+
+	Only the first call does anything, and only in a listener started by
+	osrf_system_service_ctrl().  A process forked from the listener should call it with
+	NULL, so that its copy of the pipe doesn't keep the launcher waiting if the listener
+	dies.
+*/
+void osrfSystemReportReady( const char* status ) {
+	if( ready_fd < 0 )
+		return;
+
+	if( status ) {
+		char buf[ 256 ];
+		int len = snprintf( buf, sizeof( buf ), "%ld %s\n", (long) getpid(), status );
+		if( len >= (int) sizeof( buf ))
+			len = sizeof( buf ) - 1;
+		if( write( ready_fd, buf, len ) != len )
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to report readiness: %s",
+				strerror( errno ));
+	}
+
+	close( ready_fd );
+	ready_fd = -1;
+}
+
 /**
 	@brief Discard the global transport_client, but without disconnecting from Jabber.
 
@@ -78,12 +141,34 @@ int osrf_system_bootstrap_client( char* config_file, char* contextnode ) {
 	return osrfSystemBootstrapClientResc(config_file, contextnode, NULL);
 }
 
+/**
+	@brief Override a memcached behavior from the settings, if it's there.
+	@param name Name of the setting under /cache/global/behaviors.
+	@param value Pointer to the boolean to set.
+*/
+static void cache_behavior_setting( const char* name, int* value ) {
+	char* str = osrf_settings_host_value( "/cache/global/behaviors/%s", name );
+	if( str ) {
+		*value = !strcasecmp( str, "true" ) || !strcmp( str, "1" );
+		free( str );
+	}
+}
+
 /**
 	@brief Connect to one or more cache servers.
 	@return Zero in all cases.
 */
 int osrfSystemInitCache( void ) {
 
+	osrfCacheBehaviors behaviors;
+	osrfCacheDefaultBehaviors( &behaviors );
+	cache_behavior_setting( "binary_protocol", &behaviors.binary_protocol );
+	cache_behavior_setting( "tcp_nodelay", &behaviors.tcp_nodelay );
+	cache_behavior_setting( "consistent_hashing", &behaviors.consistent_hashing );
+	cache_behavior_setting( "noreply", &behaviors.noreply );
+	cache_behavior_setting( "non_blocking", &behaviors.non_blocking );
+	osrfCacheSetBehaviors( &behaviors );
+
 	jsonObject* cacheServers = osrf_settings_host_value_object("/cache/global/servers/server");
 	char* maxCache = osrf_settings_host_value("/cache/global/max_cache_time");
 
@@ -104,6 +189,22 @@ int osrfSystemInitCache( void ) {
 			osrfCacheInit( servers, 1, atoi(maxCache) );
 		}
 
+		// Optional compression of big values
+		char* compress = osrf_settings_host_value("/cache/global/compress_threshold");
+		if( compress ) {
+			osrfCacheSetCompression( (size_t) atol(compress) );
+			free( compress );
+		}
+
+		// Optional in-process cache in front of memcached
+		char* localSize = osrf_settings_host_value("/cache/global/local_cache_size");
+		if( localSize ) {
+			char* localAge = osrf_settings_host_value("/cache/global/local_cache_max_age");
+			osrfCacheInitLocal( atoi(localSize), localAge ? atoi(localAge) : 0 );
+			free( localAge );
+			free( localSize );
+		}
+
 	} else {
 		osrfLogError( OSRF_LOG_MARK,  "Missing config value for /cache/global/servers/server _or_ "
 			"/cache/global/max_cache_time");
@@ -237,6 +338,31 @@ int osrf_system_service_ctrl(
     }
     jsonObjectFree(apps);
 
+    // a service may be given as a comma-separated list of them
+    osrfStringArray* wanted = NULL;
+    if (service) {
+        wanted = osrfNewStringArray(8);
+        char* names = strdup(service);
+        char* save = NULL;
+        char* name = strtok_r(names, ",", &save);
+        while (name) {
+            osrfStringArrayAdd(wanted, name);
+            name = strtok_r(NULL, ",", &save);
+        }
+        free(names);
+    }
+
+    int startup_timeout = OSRF_STARTUP_TIMEOUT;
+    char* timeout_str = osrfConfigGetValue(NULL, "/startup_timeout");
+    if (timeout_str) {
+        startup_timeout = atoi(timeout_str);
+        free(timeout_str);
+    }
+
+    int count = arr->size;
+    launch_state* launches = safe_malloc((count + 1) * sizeof(launch_state));
+    int n = 0;
+
     i = 0;
     const char* appname = NULL;
     while ((appname = osrfStringArrayGetString(arr, i++))) {
@@ -250,10 +376,14 @@ int osrf_system_service_ctrl(
         char* lang = osrf_settings_host_value("/apps/%s/language", appname);
 
         // this is not a C service, skip it.
-        if (!lang || strcasecmp(lang, "c")) continue;
+        if (!lang || strcasecmp(lang, "c")) {
+            free(lang);
+            continue;
+        }
+        free(lang);
 
-        // caller requested a specific service, but not this one
-        if (service && strcmp(service, appname))
+        // caller requested specific services, but not this one
+        if (wanted && !osrfStringArrayContains(wanted, appname))
             continue;
 
         // stop service(s)
@@ -262,66 +392,336 @@ int osrf_system_service_ctrl(
             continue;
         }
 
-        pid_t pid;
-        if ((pid = fork())) {
-            // parent process forks the Listener, logs the PID to stdout, 
-            // then goes about its business
-            fprintf(stdout, 
-                "* starting service pid=%ld %s\n", (long) pid, appname);
-            continue;
+        launch_state* launch = launches + n++;
+        launch->appname = appname;
+        launch->state = LAUNCH_PENDING;
+        launch->fd = -1;
+        launch->pid = 0;
+        launch->start = 0.0;
+    }
+
+    int failures = 0;
+    if (n > 0)
+        failures = launch_services(launches, n, piddir, startup_timeout);
+
+    // main process can now go away
+    free(launches);
+    osrfStringArrayFree(wanted);
+    osrfStringArrayFree(arr);
+    osrfConfigCleanup();
+    osrf_settings_free_host_config(NULL);
+
+    return failures ? -1 : 0;
+}
+
+/**
+	@brief Start a batch of services together, and wait for them to become ready.
+	@param launches The services to start, all LAUNCH_PENDING.
+	@param count How many there are.
+	@param piddir Name of the directory for the PID files.
+	@param timeout Most seconds to wait for the services to become ready.
+	@return The number of services that failed or didn't become ready in time.
+
+	A service starts as soon as the services named by its start_after setting are ready,
+	if they are in the batch; the rest start at once.  Each listener reports, through a
+	pipe, when it has registered with the routers and its minimum number of drones are
+	up; so the whole batch takes about as long as the slowest chain of services, and not
+	as long as all of them put together.
+*/
+static int launch_services(launch_state* launches, int count, const char* piddir,
+        int timeout) {
+
+    struct pollfd fds[count];
+    int which[count];
+    double deadline = get_timestamp_millis() + timeout;
+    int failures = 0;
+
+    while (1) {
+
+        // start whatever isn't waiting for anything that's still starting
+        int i;
+        for (i = 0; i < count; i++) {
+            launch_state* launch = launches + i;
+            if (launch->state != LAUNCH_PENDING)
+                continue;
+
+            int blocked = 0;
+            const char* failed = NULL;
+            jsonObject* after = osrf_settings_host_value_object(
+                "/apps/%s/start_after", launch->appname);
+            int j;
+            for (j = 0; after && j < count; j++) {
+                if (!json_names(after, launches[j].appname))
+                    continue;
+                if (launches[j].state == LAUNCH_FAILED)
+                    failed = launches[j].appname;
+                else if (launches[j].state != LAUNCH_READY)
+                    blocked = 1;
+            }
+            jsonObjectFree(after);
+
+            if (failed) {
+                fprintf(stdout, "* not starting service %s: %s failed\n",
+                    launch->appname, failed);
+                launch->state = LAUNCH_FAILED;
+                failures++;
+                i = -1;   // that may doom others we've already passed over
+                continue;
+            }
+
+            if (!blocked && start_service(launch, launches, count, piddir)) {
+                failures++;
+                i = -1;   // as above
+            }
         }
 
-        // this is the top-level Listener process.  It's responsible
-        // for managing all of the processes related to a given service.
-        daemonize();
+        // wait for word from whatever is starting
+        int nfds = 0;
+        for (i = 0; i < count; i++) {
+            if (launches[i].state == LAUNCH_STARTING) {
+                fds[nfds].fd = launches[i].fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                which[nfds++] = i;
+            }
+        }
+        if (nfds == 0) {
+            // anything still pending is waiting on itself
+            for (i = 0; i < count; i++) {
+                if (launches[i].state == LAUNCH_PENDING) {
+                    fprintf(stdout, "* not starting service %s: start_after "
+                        "never became ready\n", launches[i].appname);
+                    failures++;
+                }
+            }
+            break;
+        }
 
-        char* libfile = osrf_settings_host_value(
-            "/apps/%s/implementation", appname);
+        int wait = (int) ((deadline - get_timestamp_millis()) * 1000.0);
+        if (wait <= 0 || poll(fds, nfds, wait) == 0) {
+            for (i = 0; i < count; i++) {
+                if (launches[i].state == LAUNCH_STARTING
+                        || launches[i].state == LAUNCH_PENDING) {
+                    fprintf(stdout, "* service %s not ready after %d seconds\n",
+                        launches[i].appname, timeout);
+                    failures++;
+                }
+            }
+            break;
+        }
 
-        if (!libfile) {
-            osrfLogError(OSRF_LOG_MARK, 
-                "Service %s has no implemention", appname);
-            exit(1);
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents)
+                read_readiness(launches + which[i], &failures);
         }
+    }
 
-        osrfLogInfo(OSRF_LOG_MARK, 
-            "Launching application %s with implementation %s",
-            appname, libfile);
-
-        // write the PID of our newly detached process to the PID file
-        // pid file name is /path/to/dir/<service>.pid
-        char* pidfile_name = get_pid_file(piddir, appname);
-        FILE* pidfile = fopen(pidfile_name, "w");
-        if (pidfile) {
-            osrfLogDebug(OSRF_LOG_MARK, 
-                "Writing PID %ld for service %s", (long) getpid(), appname);
-            fprintf(pidfile, "%ld\n", (long) getpid());
-            fclose(pidfile);
-        } else {
-            osrfLogError(OSRF_LOG_MARK, 
-                "Unable to open PID file '%s': %s", 
-                    pidfile_name, strerror(errno));
-            exit(1);
+    int i;
+    for (i = 0; i < count; i++) {
+        if (launches[i].fd >= 0)
+            close(launches[i].fd);
+        launches[i].fd = -1;
+    }
+
+    fflush(stdout);
+    return failures;
+}
+
+/**
+	@brief Tell whether a setting names a given service.
+	@param names Pointer to a jsonObject holding a name, or an array of names.
+	@param appname Name of the service.
+	@return Boolean; true if it does.
+*/
+static int json_names(const jsonObject* names, const char* appname) {
+    if (names->type == JSON_ARRAY) {
+        int i;
+        for (i = 0; i < names->size; i++) {
+            const char* name = jsonObjectGetString(jsonObjectGetIndex(names, i));
+            if (name && !strcmp(name, appname))
+                return 1;
         }
-        free(pidfile_name);
+        return 0;
+    }
+    const char* name = jsonObjectGetString(names);
+    return name && !strcmp(name, appname);
+}
 
-        if (osrfAppRegisterApplication(appname, libfile) == 0)
-            osrf_prefork_run(appname);
+/**
+	@brief Fork the listener of a service, with a pipe through which to say it's ready.
+	@param launch The service to start.
+	@param launches All the services in the batch.
+	@param count How many there are.
+	@param piddir Name of the directory for the PID files.
+	@return 0 if the listener was forked, or -1 if it couldn't be.
+
+	The new listener doesn't return from here.
+*/
+static int start_service(launch_state* launch, launch_state* launches, int count,
+        const char* piddir) {
+
+    int ready[2];
+    if (pipe(ready) < 0) {
+        osrfLogError(OSRF_LOG_MARK, "Unable to create a pipe for %s: %s",
+            launch->appname, strerror(errno));
+        ready[0] = ready[1] = -1;
+    }
 
-        osrfLogInfo(OSRF_LOG_MARK, 
-            "Prefork Server exiting for service %s and implementation %s\n", 
-            appname, libfile);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        osrfLogError(OSRF_LOG_MARK, "Unable to fork a listener for %s: %s",
+            launch->appname, strerror(errno));
+        fprintf(stdout, "* unable to start service %s\n", launch->appname);
+        if (ready[0] >= 0) {
+            close(ready[0]);
+            close(ready[1]);
+        }
+        launch->state = LAUNCH_FAILED;
+        return -1;
+    }
 
-        exit(0);
+    if (pid) {
+        // parent process forks the Listener, logs the PID to stdout, 
+        // then waits to hear that it's ready
+        fprintf(stdout, 
+            "* starting service pid=%ld %s\n", (long) pid, launch->appname);
+        if (ready[1] >= 0)
+            close(ready[1]);
+        launch->fd = ready[0];
+        launch->pid = pid;
+        launch->start = get_timestamp_millis();
+        launch->state = ready[0] >= 0 ? LAUNCH_STARTING : LAUNCH_READY;
+        return 0;
+    }
 
-    } // service name loop
+    // the listener hears nothing from the pipes of the other services
+    int i;
+    for (i = 0; i < count; i++) {
+        if (launches[i].fd >= 0)
+            close(launches[i].fd);
+    }
+    if (ready[0] >= 0)
+        close(ready[0]);
+    ready_fd = ready[1];
 
-    // main process can now go away
-    osrfStringArrayFree(arr);
-    osrfConfigCleanup();
-    osrf_settings_free_host_config(NULL);
+    run_listener(launch->appname, piddir);
+    return 0;   // not reached
+}
 
-    return 0;
+/**
+	@brief Read what a listener has to say about whether it's ready.
+	@param launch The service that the listener serves.
+	@param failures Pointer to the count of failures, to bump if it failed.
+
+	The listener writes one line: its PID, and "ready" or what went wrong.  If it closes
+	the pipe without a word, it has exited.
+*/
+static void read_readiness(launch_state* launch, int* failures) {
+    char buf[256];
+    ssize_t n = read(launch->fd, buf, sizeof(buf) - 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    close(launch->fd);
+    launch->fd = -1;
+    double elapsed = get_timestamp_millis() - launch->start;
+
+    long pid = 0;
+    char status[sizeof(buf)] = "";
+    if (n > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "%ld %255[^\n]", &pid, status);
+    }
+
+    if (!strcmp(status, "ready")) {
+        fprintf(stdout, "* service ready pid=%ld %s (%.1fs)\n",
+            pid, launch->appname, elapsed);
+        launch->state = LAUNCH_READY;
+    } else {
+        fprintf(stdout, "* service %s failed to start: %s\n", launch->appname,
+            *status ? status : "listener exited");
+        launch->state = LAUNCH_FAILED;
+        (*failures)++;
+    }
+}
+
+/**
+	@brief Run the top-level Listener process of a service.
+	@param appname Name of the service.
+	@param piddir Name of the directory for the PID file.
+
+	Does not return.
+*/
+static void run_listener(const char* appname, const char* piddir) {
+
+    // this is the top-level Listener process.  It's responsible
+    // for managing all of the processes related to a given service.
+    daemonize();
+
+    char* libfile = osrf_settings_host_value(
+        "/apps/%s/implementation", appname);
+
+    if (!libfile) {
+        osrfLogError(OSRF_LOG_MARK, 
+            "Service %s has no implemention", appname);
+        exit(1);
+    }
+
+    osrfLogInfo(OSRF_LOG_MARK, 
+        "Launching application %s with implementation %s",
+        appname, libfile);
+
+    // write the PID of our newly detached process to the PID file
+    // pid file name is /path/to/dir/<service>.pid
+    char* pidfile_name = get_pid_file(piddir, appname);
+    FILE* pidfile = fopen(pidfile_name, "w");
+    if (pidfile) {
+        osrfLogDebug(OSRF_LOG_MARK, 
+            "Writing PID %ld for service %s", (long) getpid(), appname);
+        fprintf(pidfile, "%ld\n", (long) getpid());
+        fclose(pidfile);
+    } else {
+        osrfLogError(OSRF_LOG_MARK, 
+            "Unable to open PID file '%s': %s", 
+                pidfile_name, strerror(errno));
+        exit(1);
+    }
+    free(pidfile_name);
+
+    if (osrfAppRegisterApplication(appname, libfile) == 0) {
+        osrfAppLoadMethodCache(appname);
+        osrfAppLoadCallLog(appname);
+
+        char* slow = osrf_settings_host_value(
+            "/apps/%s/slow_request_threshold", appname);
+        if (slow) {
+            osrfAppSetSlowThreshold(atof(slow));
+            free(slow);
+        }
+
+        char* idle = osrf_settings_host_value(
+            "/apps/%s/session_idle_timeout", appname);
+        if (idle) {
+            osrfAppSessionSetIdleTimeout(atoi(idle));
+            free(idle);
+        }
+
+        // thread-safe applications may run in a pool of threads instead
+        char* thread_safe = osrf_settings_host_value(
+            "/apps/%s/thread_safe", appname);
+        if (thread_safe && !strcasecmp(thread_safe, "true"))
+            osrf_worker_pool_run(appname);
+        else
+            osrf_prefork_run(appname);
+        free(thread_safe);
+    }
+
+    osrfLogInfo(OSRF_LOG_MARK, 
+        "Prefork Server exiting for service %s and implementation %s\n", 
+        appname, libfile);
+
+    exit(0);
 }
 
 /**
@@ -389,6 +789,17 @@ int osrfSystemBootstrapClientResc( const char* config_file,
 		osrfLogSetIsClient(1);
 	free(isclient);
 
+	/* compress the Jabber stream only if asked to */
+	char* compress = osrfConfigGetValue(NULL, "/compress");
+	int use_compression = compress && !strcasecmp(compress, "true");
+	free(compress);
+
+	/* bypass Jabber for same-host traffic, if configured */
+	char* shm_dir = osrfConfigGetValue(NULL, "/shm_dir");
+
+	/* where we run, for locality-aware routers */
+	char* locality = osrfConfigGetValue(NULL, "/locality");
+
 	int llevel = 0;
 	int iport = 0;
 	if(port) iport = atoi(port);
@@ -405,6 +816,47 @@ int osrfSystemBootstrapClientResc( const char* config_file,
 		osrfLogSetFile( log_file );
 	}
 
+	/* optionally hand log messages to a background thread */
+	char* log_async = osrfConfigGetValue( NULL, "/log_async" );
+	if( log_async ) {
+		char* log_async_full = osrfConfigGetValue( NULL, "/log_async_full" );
+		int block = !( log_async_full && !strcasecmp( log_async_full, "drop" ));
+		if( osrfLogSetAsync( atoi( log_async ), block ))
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to set up log queue; logging directly" );
+		free( log_async_full );
+		free( log_async );
+	}
+
+	/* optionally keep the latest messages of every level, to dump when things go wrong */
+	char* log_recorder = osrfConfigGetValue( NULL, "/log_recorder" );
+	if( log_recorder ) {
+		char* log_recorder_file = osrfConfigGetValue( NULL, "/log_recorder_file" );
+		if( osrfLogSetRecorder( atoi( log_recorder ), log_recorder_file ))
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to set up the log's flight recorder" );
+		free( log_recorder_file );
+		free( log_recorder );
+	}
+
+	/* optionally export spans timing each request, for an OpenTelemetry collector */
+	char* trace_file = osrfConfigGetValue( NULL, "/trace_file" );
+	if( trace_file ) {
+		char* trace_batch = osrfConfigGetValue( NULL, "/trace_batch" );
+		char* trace_sample = osrfConfigGetValue( NULL, "/trace_sample" );
+		osrfTraceInit( contextnode, trace_file, trace_batch ? atoi( trace_batch ) : 0,
+			trace_sample ? atof( trace_sample ) : 1.0 );
+		free( trace_sample );
+		free( trace_batch );
+		free( trace_file );
+	}
+
+	/* optionally record the requests we receive, for srfsh to replay elsewhere */
+	char* capture_file = osrfConfigGetValue( NULL, "/capture_file" );
+	if( capture_file ) {
+		if( osrfCaptureInit( capture_file ))
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to capture requests to %s", capture_file );
+		free( capture_file );
+	}
+
 
 	/* Get a domain, if one is specified */
 	const char* domain = osrfStringArrayGetString( arr, 0 ); /* just the first for now */
@@ -447,12 +899,20 @@ int osrfSystemBootstrapClientResc( const char* config_file,
 		free(facility);
 		free(actlog);
 		free(logtag);
+		free(locality);
 		return 0;
 	}
 
 	osrfLogInfo( OSRF_LOG_MARK, "Bootstrapping system with domain %s, port %d, and unixpath %s",
 		domain, iport, unixpath ? unixpath : "(none)" );
 	transport_client* client = client_init( domain, iport, unixpath, 0 );
+	client_set_compression( client, use_compression );
+	if( shm_dir ) {
+		client_set_shm( client, shm_dir, 1 );
+		free( shm_dir );
+	}
+	client_set_locality( client, locality );
+	free( locality );
 
 	char host[HOST_NAME_MAX + 1] = "";
 	gethostname(host, sizeof(host) );
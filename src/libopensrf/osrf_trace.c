@@ -0,0 +1,593 @@
+/**
+	@file osrf_trace.c
+	@brief Spans, the context that relates them, and the batching exporter behind them.
+
+	A finished span is serialized at once, and appended to a batch shared by all of the
+	process's threads, under a mutex, since a router ends spans in several threads.  The
+	batch goes out in a single write() when it holds the configured number of spans, when
+	its oldest span has waited a second, when someone calls osrfTraceFlush() before going
+	idle, or when the process exits.  A forked child drops whatever its parent had batched,
+	so that nothing goes out twice.
+
+	The file is opened for each batch, so that it may be rotated like a log file.
+*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <opensrf/osrf_trace.h>
+#include <opensrf/osrf_utf8.h>
+#include <opensrf/log.h>
+
+/** @brief Default number of spans to collect before writing them. */
+#define OSRF_TRACE_BATCH 64
+/** @brief Most seconds that a finished span may wait before being written. */
+#define OSRF_TRACE_FLUSH_INTERVAL 1
+
+/** @brief Where to append the spans, or NULL if we don't export them. */
+static char* trace_file = NULL;
+/** @brief Name of the service, for the "service.name" resource attribute. */
+static char* trace_service = NULL;
+/** @brief How many spans to collect before writing them. */
+static int trace_batch = OSRF_TRACE_BATCH;
+/** @brief Fraction of new traces to record; those continued from elsewhere always are. */
+static double trace_sample = 1.0;
+/** @brief Boolean; true if we export spans. */
+static volatile int trace_enabled = 0;
+
+/** @brief Guards the batch, and the settings above. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/** @brief Finished spans, serialized and separated by commas. */
+static growing_buffer* trace_spans = NULL;
+/** @brief Number of spans in the batch. */
+static int trace_count = 0;
+/** @brief When the oldest span in the batch finished. */
+static time_t trace_oldest = 0;
+/** @brief Bumped in each forked child, so that it doesn't repeat its parent's ids. */
+static volatile unsigned long trace_generation = 1;
+/** @brief For registering the exit and fork handlers once. */
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/** @brief The context of the current span, as a traceparent; or empty, if none. */
+static __thread char trace_context[ OSRF_TRACEPARENT_SIZE ];
+/** @brief State of this thread's generator for ids. */
+static __thread unsigned long long trace_rng = 0;
+/** @brief The value of trace_generation when trace_rng was seeded. */
+static __thread unsigned long trace_rng_generation = 0;
+
+static void trace_set_up( void );
+static void trace_prepare_fork( void );
+static void trace_parent_fork( void );
+static void trace_child_fork( void );
+static void trace_flush( void );
+static unsigned long long trace_random( void );
+static void trace_make_id( char* buf, int digits );
+static long long trace_now( void );
+static int parse_hex( const char* s, int digits );
+static void add_json_string( growing_buffer* buf, const char* key, const char* value );
+static void add_json_nanos( growing_buffer* buf, const char* key, long long nanos );
+static void add_json_attr( growing_buffer* buf, const char* key, const char* value );
+
+/**
+	@brief Start or stop exporting spans.
+	@param service Name of the service, for the trace viewer.
+	@param path Name of the file to which to append the spans; or NULL, to stop.
+	@param batch How many spans to collect before writing them; zero or less for the
+		default.
+	@param sample Fraction of new traces to record, from 0 to 1.
+	@return 0 if successful, or -1 if not.
+
+	Traces continued from elsewhere are recorded whatever the sample, unless the context
+	says that they are not sampled.  When stopping, write out whatever is batched.
+*/
+int osrfTraceInit( const char* service, const char* path, int batch, double sample ) {
+	pthread_once( &trace_once, trace_set_up );
+
+	pthread_mutex_lock( &trace_lock );
+	trace_flush();
+	if( trace_file ) {
+		free( trace_file );
+		trace_file = NULL;
+	}
+	trace_enabled = 0;
+
+	if( path && *path ) {
+		trace_file = strdup( path );
+		trace_batch = batch > 0 ? batch : OSRF_TRACE_BATCH;
+		trace_sample = sample < 0.0 ? 0.0 : sample;
+		if( !trace_spans )
+			trace_spans = buffer_init( 4096 );
+		trace_enabled = 1;
+	}
+	pthread_mutex_unlock( &trace_lock );
+
+	if( service )
+		osrfTraceSetService( service );
+	return 0;
+}
+
+/**
+	@brief Set the name of the service whose spans we export.
+	@param service The name, such as an application name.
+
+	A drone learns what it is only after the configuration is loaded, hence this function.
+*/
+void osrfTraceSetService( const char* service ) {
+	if( !service )
+		return;
+	pthread_mutex_lock( &trace_lock );
+	free( trace_service );
+	trace_service = strdup( service );
+	pthread_mutex_unlock( &trace_lock );
+}
+
+/**
+	@brief Tell whether we export spans.
+	@return Non-zero if we do, or zero if not.
+*/
+int osrfTraceEnabled( void ) {
+	return trace_enabled;
+}
+
+/**
+	@brief Register the exit and fork handlers.
+*/
+static void trace_set_up( void ) {
+	atexit( osrfTraceFlush );
+	pthread_atfork( trace_prepare_fork, trace_parent_fork, trace_child_fork );
+}
+
+/** @brief Keep the batch still while forking. */
+static void trace_prepare_fork( void ) {
+	pthread_mutex_lock( &trace_lock );
+}
+
+/** @brief Let go of the batch after forking. */
+static void trace_parent_fork( void ) {
+	pthread_mutex_unlock( &trace_lock );
+}
+
+/**
+	@brief Start afresh in a forked child.
+
+	The parent's spans are the parent's to write.
+*/
+static void trace_child_fork( void ) {
+	if( trace_spans )
+		OSRF_BUFFER_RESET( trace_spans );
+	trace_count = 0;
+	++trace_generation;
+	pthread_mutex_unlock( &trace_lock );
+}
+
+/**
+	@brief Take apart a traceparent.
+	@param traceparent The traceparent, perhaps from the "osrf_span" attribute of a message.
+	@param trace_id Pointer to a buffer of at least 33 bytes for the trace id, or NULL.
+	@param span_id Pointer to a buffer of at least 17 bytes for the span id, or NULL.
+	@param sampled Pointer through which to return the sampled flag, or NULL.
+	@return 0 if the traceparent is well formed, or -1 if not.
+
+	Any version but the forbidden ff is accepted, so long as it begins with the fields of
+	version 00.  Ids of all zeroes are invalid.
+*/
+int osrfTraceParse( const char* traceparent, char* trace_id, char* span_id, int* sampled ) {
+	if( !traceparent || strlen( traceparent ) < OSRF_TRACEPARENT_SIZE - 1 )
+		return -1;
+
+	const char* s = traceparent;
+	if( parse_hex( s, 2 ) || !strncmp( s, "ff", 2 ) || s[ 2 ] != '-'
+			|| parse_hex( s + 3, 32 ) || s[ 35 ] != '-'
+			|| parse_hex( s + 36, 16 ) || s[ 52 ] != '-'
+			|| parse_hex( s + 53, 2 ) )
+		return -1;
+	if( s[ 55 ] && ( !strncmp( s, "00", 2 ) || s[ 55 ] != '-' ))
+		return -1;
+	if( strspn( s + 3, "0" ) >= 32 || strspn( s + 36, "0" ) >= 16 )
+		return -1;
+
+	if( trace_id ) {
+		memcpy( trace_id, s + 3, 32 );
+		trace_id[ 32 ] = '\0';
+	}
+	if( span_id ) {
+		memcpy( span_id, s + 36, 16 );
+		span_id[ 16 ] = '\0';
+	}
+	if( sampled ) {
+		char flags[ 3 ] = { s[ 53 ], s[ 54 ], '\0' };
+		*sampled = (int) ( strtol( flags, NULL, 16 ) & 1 );
+	}
+	return 0;
+}
+
+/**
+	@brief Check for a run of lower case hex digits.
+	@param s Pointer to the first of them.
+	@param digits How many there should be.
+	@return 0 if they are all there, or -1 if not.
+*/
+static int parse_hex( const char* s, int digits ) {
+	int i;
+	for( i = 0; i < digits; ++i )
+		if( !( ( s[ i ] >= '0' && s[ i ] <= '9' ) || ( s[ i ] >= 'a' && s[ i ] <= 'f' )))
+			return -1;
+	return 0;
+}
+
+/**
+	@brief Adopt the context of a span started elsewhere, typically by whoever sent us
+	the message we are working on.
+	@param traceparent The context, as a traceparent; or NULL or empty, for none.
+
+	A malformed context is ignored, as if there were none.  The context belongs to the
+	calling thread.
+*/
+void osrfTraceSetContext( const char* traceparent ) {
+	if( traceparent && *traceparent && !osrfTraceParse( traceparent, NULL, NULL, NULL )) {
+		// A later version may add fields; keep just the ones we know
+		memcpy( trace_context, traceparent, OSRF_TRACEPARENT_SIZE - 1 );
+		trace_context[ OSRF_TRACEPARENT_SIZE - 1 ] = '\0';
+	} else
+		trace_context[ 0 ] = '\0';
+}
+
+/**
+	@brief Get the context of the current span, to send along with a message.
+	@return The context, as a traceparent; or an empty string, if there is none.
+*/
+const char* osrfTraceGetContext( void ) {
+	return trace_context;
+}
+
+/**
+	@brief Forget the context of the current span.
+*/
+void osrfTraceClearContext( void ) {
+	trace_context[ 0 ] = '\0';
+}
+
+/**
+	@brief Start a span within the current one, or a new trace if there is none.
+	@param span Pointer to the osrfSpan to be started.
+	@param name What the span times, such as a method name.
+	@param kind One of the OSRF_SPAN_* kinds.
+	@param start When the span started, as from get_timestamp_millis(); or zero for now.
+	@return Non-zero if the span is recording, or zero if not.
+
+	The span isn't recording if we don't export spans, if the current context is not
+	sampled, or if a new trace didn't make the sample.  The transaction id, if any, goes
+	along as the "opensrf.xid" attribute.
+*/
+int osrfSpanStart( osrfSpan* span, const char* name, int kind, double start ) {
+	if( !span )
+		return 0;
+	span->recording = 0;
+	span->error = 0;
+	span->attr_count = 0;
+	span->event_count = 0;
+	span->saved[ 0 ] = '\0';
+
+	if( !trace_enabled )
+		return 0;
+
+	int sampled = 0;
+	if( !osrfTraceParse( trace_context, span->trace_id, span->parent_id, &sampled )) {
+		if( !sampled )
+			return 0;
+	} else {
+		if( trace_sample < 1.0
+				&& ( trace_random() >> 11 ) * ( 1.0 / 9007199254740992.0 ) >= trace_sample )
+			return 0;
+		trace_make_id( span->trace_id, 32 );
+		span->parent_id[ 0 ] = '\0';
+	}
+	trace_make_id( span->span_id, 16 );
+
+	strncpy( span->name, name ? name : "", sizeof( span->name ) - 1 );
+	span->name[ sizeof( span->name ) - 1 ] = '\0';
+	span->kind = kind;
+	span->start = start > 0.0 ? (long long) ( start * 1e9 ) : trace_now();
+	span->recording = 1;
+
+	const char* xid = osrfLogGetXid();
+	if( xid && *xid )
+		osrfSpanSetAttr( span, "opensrf.xid", xid );
+	return 1;
+}
+
+/**
+	@brief Attach an attribute to a span.
+	@param span Pointer to the osrfSpan.
+	@param key Name of the attribute, which must outlive the span, such as a literal.
+	@param value Value of the attribute, which is copied, truncated if necessary.
+
+	Attributes beyond the first OSRF_SPAN_ATTRS are ignored.
+*/
+void osrfSpanSetAttr( osrfSpan* span, const char* key, const char* value ) {
+	if( !span || !span->recording || !key || span->attr_count >= OSRF_SPAN_ATTRS )
+		return;
+
+	int i = span->attr_count++;
+	span->attr_keys[ i ] = key;
+	strncpy( span->attr_values[ i ], value ? value : "", sizeof( span->attr_values[ i ] ) - 1 );
+	span->attr_values[ i ][ sizeof( span->attr_values[ i ] ) - 1 ] = '\0';
+}
+
+/**
+	@brief Note that something happened during a span, such as the arrival of a response.
+	@param span Pointer to the osrfSpan.
+	@param name Name of the event, which must outlive the span, such as a literal.
+
+	Events beyond the first OSRF_SPAN_EVENTS are ignored.
+*/
+void osrfSpanAddEvent( osrfSpan* span, const char* name ) {
+	if( !span || !span->recording || !name || span->event_count >= OSRF_SPAN_EVENTS )
+		return;
+
+	int i = span->event_count++;
+	span->event_names[ i ] = name;
+	span->event_times[ i ] = trace_now();
+}
+
+/**
+	@brief Format the context of a span, for a message that goes out on its behalf.
+	@param span Pointer to the osrfSpan.
+	@param buf Pointer to a buffer of at least OSRF_TRACEPARENT_SIZE bytes.
+
+	If the span isn't recording, format the context it would have been part of, so that
+	the context still travels on.
+*/
+void osrfSpanFormat( const osrfSpan* span, char* buf ) {
+	if( span && span->recording )
+		snprintf( buf, OSRF_TRACEPARENT_SIZE, "00-%s-%s-01", span->trace_id, span->span_id );
+	else
+		strcpy( buf, trace_context );
+}
+
+/**
+	@brief Make a span the current one, for whatever the thread does next.
+	@param span Pointer to the osrfSpan.
+
+	Spans started, and messages sent, while the span is current belong to it.  Call
+	osrfSpanDeactivate() to put back the previous context.
+*/
+void osrfSpanActivate( osrfSpan* span ) {
+	if( !span || !span->recording )
+		return;
+	strcpy( span->saved, trace_context );
+	osrfSpanFormat( span, trace_context );
+}
+
+/**
+	@brief Put back the context that osrfSpanActivate() displaced.
+	@param span Pointer to the osrfSpan.
+*/
+void osrfSpanDeactivate( osrfSpan* span ) {
+	if( !span || !span->recording )
+		return;
+	strcpy( trace_context, span->saved );
+}
+
+/**
+	@brief Finish a span, and hand it to the exporter.
+	@param span Pointer to the osrfSpan.
+
+	The span stops recording, so that ending it again does nothing.
+*/
+void osrfSpanEnd( osrfSpan* span ) {
+	if( !span || !span->recording )
+		return;
+	span->recording = 0;
+	long long end = trace_now();
+
+	growing_buffer* buf = buffer_init( 512 );
+	OSRF_BUFFER_ADD_CHAR( buf, '{' );
+	add_json_string( buf, "traceId", span->trace_id );
+	OSRF_BUFFER_ADD_CHAR( buf, ',' );
+	add_json_string( buf, "spanId", span->span_id );
+	if( span->parent_id[ 0 ] ) {
+		OSRF_BUFFER_ADD_CHAR( buf, ',' );
+		add_json_string( buf, "parentSpanId", span->parent_id );
+	}
+	OSRF_BUFFER_ADD_CHAR( buf, ',' );
+	add_json_string( buf, "name", span->name );
+	buffer_fadd( buf, ",\"kind\":%d,", span->kind );
+	add_json_nanos( buf, "startTimeUnixNano", span->start );
+	OSRF_BUFFER_ADD_CHAR( buf, ',' );
+	add_json_nanos( buf, "endTimeUnixNano", end );
+
+	int i;
+	if( span->attr_count ) {
+		OSRF_BUFFER_ADD( buf, ",\"attributes\":[" );
+		for( i = 0; i < span->attr_count; ++i ) {
+			if( i )
+				OSRF_BUFFER_ADD_CHAR( buf, ',' );
+			add_json_attr( buf, span->attr_keys[ i ], span->attr_values[ i ] );
+		}
+		OSRF_BUFFER_ADD_CHAR( buf, ']' );
+	}
+	if( span->event_count ) {
+		OSRF_BUFFER_ADD( buf, ",\"events\":[" );
+		for( i = 0; i < span->event_count; ++i ) {
+			OSRF_BUFFER_ADD( buf, i ? ",{" : "{" );
+			add_json_nanos( buf, "timeUnixNano", span->event_times[ i ] );
+			OSRF_BUFFER_ADD_CHAR( buf, ',' );
+			add_json_string( buf, "name", span->event_names[ i ] );
+			OSRF_BUFFER_ADD_CHAR( buf, '}' );
+		}
+		OSRF_BUFFER_ADD_CHAR( buf, ']' );
+	}
+	if( span->error )
+		OSRF_BUFFER_ADD( buf, ",\"status\":{\"code\":2}" );
+	OSRF_BUFFER_ADD_CHAR( buf, '}' );
+
+	pthread_mutex_lock( &trace_lock );
+	if( trace_enabled ) {
+		time_t now = time( NULL );
+		if( trace_count++ )
+			OSRF_BUFFER_ADD_CHAR( trace_spans, ',' );
+		else
+			trace_oldest = now;
+		buffer_add_n( trace_spans, OSRF_BUFFER_C_STR( buf ), buffer_length( buf ));
+		if( trace_count >= trace_batch || now - trace_oldest >= OSRF_TRACE_FLUSH_INTERVAL )
+			trace_flush();
+	}
+	pthread_mutex_unlock( &trace_lock );
+	buffer_free( buf );
+}
+
+/**
+	@brief Write out whatever spans are batched.
+
+	Call it before waiting for work, so that spans don't sit in the batch while the
+	process is idle.  It costs nothing if there's nothing to write.
+*/
+void osrfTraceFlush( void ) {
+	if( !__atomic_load_n( &trace_count, __ATOMIC_RELAXED ))
+		return;
+	pthread_mutex_lock( &trace_lock );
+	trace_flush();
+	pthread_mutex_unlock( &trace_lock );
+}
+
+/**
+	@brief Write the batch as one OTLP/JSON export request, on a line of its own.
+
+	The caller must hold trace_lock.  If the file can't be written, the spans are lost;
+	we complain in the log, but don't keep them.
+*/
+static void trace_flush( void ) {
+	if( !trace_count || !trace_file )
+		return;
+
+	char host[ 256 ] = "";
+	gethostname( host, sizeof( host ) - 1 );
+
+	growing_buffer* out = buffer_init( buffer_length( trace_spans ) + 512 );
+	OSRF_BUFFER_ADD( out, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[" );
+	add_json_attr( out, "service.name", trace_service ? trace_service : "opensrf" );
+	OSRF_BUFFER_ADD_CHAR( out, ',' );
+	add_json_attr( out, "host.name", host );
+	buffer_fadd( out, ",{\"key\":\"process.pid\",\"value\":{\"intValue\":\"%ld\"}}]},",
+		(long) getpid() );
+	OSRF_BUFFER_ADD( out, "\"scopeSpans\":[{\"scope\":{\"name\":\"opensrf\"},\"spans\":[" );
+	buffer_add_n( out, OSRF_BUFFER_C_STR( trace_spans ), buffer_length( trace_spans ));
+	OSRF_BUFFER_ADD( out, "]}]}]}\n" );
+
+	OSRF_BUFFER_RESET( trace_spans );
+	trace_count = 0;
+
+	// One write(), so that lines from different processes don't get mixed up
+	int fd = open( trace_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+	if( fd < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to open trace file %s: %s",
+			trace_file, strerror( errno ));
+	} else {
+		const char* p = OSRF_BUFFER_C_STR( out );
+		size_t left = buffer_length( out );
+		while( left ) {
+			ssize_t n = write( fd, p, left );
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 ) {
+				osrfLogWarning( OSRF_LOG_MARK, "Unable to write trace file %s: %s",
+					trace_file, strerror( errno ));
+				break;
+			}
+			p += n;
+			left -= n;
+		}
+		close( fd );
+	}
+	buffer_free( out );
+}
+
+/**
+	@brief Generate a random number for an id, or for sampling.
+	@return The number.
+
+	Each thread has its own splitmix64 generator, seeded from the clock, the process id,
+	and its own address, and seeded again in a forked child.  Ids need to be unique, not
+	unpredictable.
+*/
+static unsigned long long trace_random( void ) {
+	if( trace_rng_generation != trace_generation ) {
+		struct timespec ts;
+		clock_gettime( CLOCK_REALTIME, &ts );
+		trace_rng = ( (unsigned long long) getpid() << 32 )
+			^ ( (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec )
+			^ (unsigned long long) (uintptr_t) &trace_rng;
+		trace_rng_generation = trace_generation;
+	}
+
+	unsigned long long z = ( trace_rng += 0x9E3779B97F4A7C15ULL );
+	z = ( z ^ ( z >> 30 )) * 0xBF58476D1CE4E5B9ULL;
+	z = ( z ^ ( z >> 27 )) * 0x94D049BB133111EBULL;
+	return z ^ ( z >> 31 );
+}
+
+/**
+	@brief Make up a random id, never all zeroes.
+	@param buf Pointer to a buffer of at least @a digits + 1 bytes.
+	@param digits How many hex digits: 16 or 32.
+*/
+static void trace_make_id( char* buf, int digits ) {
+	static const char hex[] = "0123456789abcdef";
+	int i = 0;
+	while( i < digits ) {
+		unsigned long long r = trace_random();
+		int j;
+		for( j = 0; j < 16 && i < digits; ++j, r >>= 4 )
+			buf[ i++ ] = hex[ r & 0xf ];
+	}
+	buf[ digits ] = '\0';
+	if( strspn( buf, "0" ) == (size_t) digits )
+		buf[ digits - 1 ] = '1';
+}
+
+/**
+	@brief Read the clock.
+	@return Nanoseconds since the epoch.
+*/
+static long long trace_now( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+	@brief Append a JSON member whose value is a string.
+	@param buf Pointer to the growing_buffer.
+	@param key Name of the member, which needs no escaping.
+	@param value The string, to be escaped.
+*/
+static void add_json_string( growing_buffer* buf, const char* key, const char* value ) {
+	buffer_fadd( buf, "\"%s\":\"", key );
+	buffer_append_utf8( buf, value );
+	OSRF_BUFFER_ADD_CHAR( buf, '"' );
+}
+
+/**
+	@brief Append a JSON member holding a time, as the string OTLP/JSON expects.
+	@param buf Pointer to the growing_buffer.
+	@param key Name of the member.
+	@param nanos The time, in nanoseconds since the epoch.
+*/
+static void add_json_nanos( growing_buffer* buf, const char* key, long long nanos ) {
+	buffer_fadd( buf, "\"%s\":\"%lld\"", key, nanos );
+}
+
+/**
+	@brief Append an OTLP attribute with a string value.
+	@param buf Pointer to the growing_buffer.
+	@param key Name of the attribute.
+	@param value The value.
+*/
+static void add_json_attr( growing_buffer* buf, const char* key, const char* value ) {
+	OSRF_BUFFER_ADD( buf, "{\"key\":\"" );
+	buffer_append_utf8( buf, key );
+	OSRF_BUFFER_ADD( buf, "\",\"value\":{" );
+	add_json_string( buf, "stringValue", value );
+	OSRF_BUFFER_ADD( buf, "}}" );
+}
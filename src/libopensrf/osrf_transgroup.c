@@ -1,8 +1,21 @@
 #include <opensrf/osrf_transgroup.h>
-#include <sys/select.h>
-
-
-osrfTransportGroupNode* osrfNewTransportGroupNode( 
+#include <poll.h>
+#include <stdint.h>
+
+static void osrfTGFreeDomainList( char* key, void* item );
+static void osrfTGNodeFree( osrfTransportGroupNode* node );
+static int osrfTGNodeConnect( osrfTransportGroupNode* node );
+static void osrfTGNodeFailed( osrfTransportGroupNode* node );
+static void osrfTGRetryFailed( osrfTransportGroup* grp );
+static osrfTransportGroupNode* osrfTGPick( osrfTransportGroup* grp, const osrfList* nodes,
+		const transport_message* msg );
+static int osrfTGSendVia( osrfTransportGroup* grp, const osrfList* nodes,
+		transport_message* msg, const char* recip_user, const char* recip_res );
+static transport_message* osrfTGRecv( osrfTransportGroup* grp, const osrfList* nodes,
+		int timeout );
+
+
+osrfTransportGroupNode* osrfNewTransportGroupNode(
 		char* domain, int port, char* username, char* password, char* resource ) {
 
 	if(!(domain && port && username && password && resource)) return NULL;
@@ -12,78 +25,270 @@ osrfTransportGroupNode* osrfNewTransportGroupNode(
 	node->port		= port;
 	node->username = strdup(username);
 	node->password = strdup(password);
-	node->domain	= strdup(domain);
 	node->resource	= strdup(resource);
 	node->active	= 0;
 	node->lastsent	= 0;
+	node->weight	= 1;
+	node->current_weight = 0;
+	node->failed	= 0;
 	node->connection = client_init( domain, port, NULL, 0 );
 
 	return node;
 }
 
+void osrfTransportGroupNodeSetWeight( osrfTransportGroupNode* node, int weight ) {
+	if(node) node->weight = weight > 0 ? weight : 1;
+}
+
+static void osrfTGNodeFree( osrfTransportGroupNode* node ) {
+	if(!node) return;
+	client_free(node->connection);
+	free(node->domain);
+	free(node->username);
+	free(node->password);
+	free(node->resource);
+	free(node);
+}
+
+static void osrfTGFreeDomainList( char* key, void* item ) {
+	osrfListFree( (osrfList*) item );
+}
+
 
 osrfTransportGroup* osrfNewTransportGroup( osrfTransportGroupNode* nodes[], int count ) {
 	if(!nodes || count < 1) return NULL;
 
 	osrfTransportGroup* grp = safe_malloc(sizeof(osrfTransportGroup));
-	grp->nodes					= osrfNewHash();
-	grp->itr						= osrfNewHashIterator(grp->nodes);
+	grp->members				= osrfNewList();
+	grp->domains				= osrfNewHash();
+	osrfHashSetCallback(grp->domains, osrfTGFreeDomainList);
+	grp->policy					= OSRF_TG_WEIGHTED;
+	grp->retry_interval		= OSRF_TG_RETRY_INTERVAL;
+	grp->next					= 0;
 
 	int i;
 	for( i = 0; i != count; i++ ) {
-		if(!(nodes[i] && nodes[i]->domain) ) return NULL;
-		osrfHashSet( grp->nodes, nodes[i], nodes[i]->domain );
-		osrfLogDebug( OSRF_LOG_MARK, "Adding domain %s to TransportGroup", nodes[i]->domain);
+		if( osrfTransportGroupAddNode( grp, nodes[i] ) ) {
+			osrfTransportGroupFree( grp );
+			return NULL;
+		}
 	}
 
 	return grp;
 }
 
+int osrfTransportGroupAddNode( osrfTransportGroup* grp, osrfTransportGroupNode* node ) {
+	if(!(grp && node && node->domain)) return -1;
+
+	osrfList* list = osrfHashGet(grp->domains, node->domain);
+	if(!list) {
+		list = osrfNewList();
+		osrfHashSet(grp->domains, list, "%s", node->domain);
+	}
+	osrfListPush(list, node);
+	osrfListPush(grp->members, node);
+	osrfLogDebug( OSRF_LOG_MARK, "Adding domain %s (%s) to TransportGroup",
+		node->domain, node->resource);
+	return 0;
+}
+
+int osrfTransportGroupAddConnections( osrfTransportGroup* grp, char* domain, int port,
+		char* username, char* password, char* resource, int count ) {
+	if(!(grp && resource)) return 0;
+
+	int added = 0;
+	int i;
+	for( i = 1; i <= count; i++ ) {
+		int len = strlen(resource) + 16;
+		char res[len];
+		snprintf(res, sizeof(res), "%s_%d", resource, i);
+		osrfTransportGroupNode* node =
+			osrfNewTransportGroupNode(domain, port, username, password, res);
+		if( node && osrfTransportGroupAddNode(grp, node) == 0 )
+			added++;
+		else
+			osrfTGNodeFree(node);
+	}
+	return added;
+}
+
+void osrfTransportGroupSetPolicy( osrfTransportGroup* grp, int policy ) {
+	if(grp) grp->policy = (policy == OSRF_TG_STICKY) ? OSRF_TG_STICKY : OSRF_TG_WEIGHTED;
+}
+
+void osrfTransportGroupSetRetryInterval( osrfTransportGroup* grp, int seconds ) {
+	if(grp) grp->retry_interval = seconds;
+}
+
+void osrfTransportGroupFree( osrfTransportGroup* grp ) {
+	if(!grp) return;
+
+	unsigned int i;
+	for( i = 0; i < grp->members->size; i++ )
+		osrfTGNodeFree( OSRF_LIST_GET_INDEX(grp->members, i) );
+	osrfListFree(grp->members);
+	osrfHashFree(grp->domains);
+	free(grp);
+}
+
+osrfTransportGroupNode* __osrfTransportGroupFindNode( osrfTransportGroup* grp, char* domain ) {
+	if(!(grp && domain)) return NULL;
+	return osrfListGetIndex( osrfHashGet(grp->domains, domain), 0 );
+}
+
+
+static int osrfTGNodeConnect( osrfTransportGroupNode* node ) {
+	osrfLogInfo( OSRF_LOG_MARK, "TransportGroup attempting to connect to domain %s as %s",
+		node->domain, node->resource);
+
+	if(client_connect( node->connection, node->username,
+				node->password, node->resource, 10, AUTH_DIGEST )) {
+		node->active = 1;
+		node->current_weight = 0;
+		osrfLogInfo( OSRF_LOG_MARK, "TransportGroup successfully connected to domain %s",
+			node->domain);
+		return 1;
+	}
+
+	osrfLogWarning( OSRF_LOG_MARK, "TransportGroup unable to connect to domain %s",
+		node->domain);
+	osrfTGNodeFailed(node);
+	return 0;
+}
+
+/* Set a node aside, with a fresh client to reconnect with later */
+static void osrfTGNodeFailed( osrfTransportGroupNode* node ) {
+	node->active = 0;
+	node->failed = time(NULL);
+	client_free(node->connection);
+	node->connection = client_init( node->domain, node->port, NULL, 0 );
+}
+
+/* Reconnect any failed nodes that have sat out long enough */
+static void osrfTGRetryFailed( osrfTransportGroup* grp ) {
+	if( grp->retry_interval < 0 ) return;
+
+	time_t now = time(NULL);
+	unsigned int i;
+	for( i = 0; i < grp->members->size; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(grp->members, i);
+		if( !node->active && now - node->failed >= grp->retry_interval )
+			osrfTGNodeConnect(node);
+	}
+}
 
 /* connect all of the nodes to their servers */
 int osrfTransportGroupConnectAll( osrfTransportGroup* grp ) {
 	if(!grp) return -1;
 	int active = 0;
 
-	osrfTransportGroupNode* node;
-	osrfHashIteratorReset(grp->itr);
-
-	while( (node = osrfHashIteratorNext(grp->itr)) ) {
-		osrfLogInfo( OSRF_LOG_MARK, "TransportGroup attempting to connect to domain %s", 
-							 node->connection->session->server);
-
-		if(client_connect( node->connection, node->username, 
-					node->password, node->resource, 10, AUTH_DIGEST )) {
-			node->active = 1;
+	unsigned int i;
+	for( i = 0; i < grp->members->size; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(grp->members, i);
+		if( node->active || osrfTGNodeConnect(node) )
 			active++;
-			osrfLogInfo( OSRF_LOG_MARK, "TransportGroup successfully connected to domain %s", 
-							 node->connection->session->server);
-		} else {
-			osrfLogWarning( OSRF_LOG_MARK, "TransportGroup unable to connect to domain %s", 
-							 node->connection->session->server);
-		}
 	}
 
-	osrfHashIteratorReset(grp->itr);
 	return active;
 }
 
 void osrfTransportGroupDisconnectAll( osrfTransportGroup* grp ) {
 	if(!grp) return;
 
-	osrfTransportGroupNode* node;
-	osrfHashIteratorReset(grp->itr);
-
-	while( (node = osrfHashIteratorNext(grp->itr)) ) {
-		osrfLogInfo( OSRF_LOG_MARK, "TransportGroup disconnecting from domain %s", 
-							 node->connection->session->server);
+	unsigned int i;
+	for( i = 0; i < grp->members->size; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(grp->members, i);
+		osrfLogInfo( OSRF_LOG_MARK, "TransportGroup disconnecting from domain %s",
+			node->domain);
 		client_disconnect(node->connection);
 		node->active = 0;
 	}
+}
+
 
-	osrfHashIteratorReset(grp->itr);
+/* 64-bit FNV-1a, for the sticky policy */
+static uint64_t osrfTGHash( uint64_t hash, const char* s ) {
+	while( s && *s ) {
+		hash ^= (unsigned char) *s++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
+/*
+	Choose an active node from a list.  By default, a smooth weighted round robin: each
+	node gains its weight on every pick, and the leader is picked and pays back the total.
+	Sticky: rendezvous hashing on the thread, so that a thread moves only when its own
+	node fails.
+*/
+static osrfTransportGroupNode* osrfTGPick( osrfTransportGroup* grp, const osrfList* nodes,
+		const transport_message* msg ) {
+
+	osrfTransportGroupNode* best = NULL;
+	unsigned int i;
+
+	if( grp->policy == OSRF_TG_STICKY && msg->thread && *msg->thread ) {
+		/* each node draws once per unit of weight, and the highest draw wins */
+		uint64_t best_score = 0;
+		uint64_t seed = osrfTGHash( 14695981039346656037ULL, msg->thread );
+		for( i = 0; i < nodes->size; i++ ) {
+			osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(nodes, i);
+			if( !node->active ) continue;
+			uint64_t h = osrfTGHash( osrfTGHash( seed, node->domain ), node->resource );
+			int w;
+			for( w = 0; w < node->weight; w++ ) {
+				h = ( h ^ (uint64_t) w ) * 1099511628211ULL;
+				h ^= h >> 29;
+				if( !best || h > best_score ) {
+					best = node;
+					best_score = h;
+				}
+			}
+		}
+		return best;
+	}
+
+	int total = 0;
+	for( i = 0; i < nodes->size; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(nodes, i);
+		if( !node->active ) continue;
+		node->current_weight += node->weight;
+		total += node->weight;
+		if( !best || node->current_weight > best->current_weight )
+			best = node;
+	}
+	if(best) best->current_weight -= total;
+	return best;
+}
+
+/*
+	Send over the nodes in a list, failing over to the next choice until we run out.
+	If recip_user is not NULL, readdress the message to the domain of each node tried.
+*/
+static int osrfTGSendVia( osrfTransportGroup* grp, const osrfList* nodes,
+		transport_message* msg, const char* recip_user, const char* recip_res ) {
+
+	osrfTransportGroupNode* node;
+	while( (node = osrfTGPick( grp, nodes, msg )) ) {
+
+		if(recip_user) {
+			char newrcp[1024];
+			snprintf(newrcp, sizeof(newrcp), "%s@%s/%s", recip_user, node->domain, recip_res);
+			message_set_recipient(msg, newrcp);
+		}
+
+		if( (client_send_message( node->connection, msg )) == 0 ) {
+			node->lastsent = time(NULL);
+			return 0;
+		}
+
+		osrfLogWarning( OSRF_LOG_MARK, "TransportGroup failed sending to domain %s as %s; "
+			"setting it aside", node->domain, node->resource );
+		osrfTGNodeFailed(node);
+	}
+
+	return -1;
+}
 
 int osrfTransportGroupSendMatch( osrfTransportGroup* grp, transport_message* msg ) {
 	if(!(grp && msg)) return -1;
@@ -92,11 +297,11 @@ int osrfTransportGroupSendMatch( osrfTransportGroup* grp, transport_message* msg
 	domain[0] = '\0';
 	jid_get_domain( msg->recipient, domain, 255 );
 
-	osrfTransportGroupNode* node = osrfHashGet(grp->nodes, domain);
-	if(node) {
-		if( (client_send_message( node->connection, msg )) == 0 )
-			return 0;
-	}
+	osrfTGRetryFailed(grp);
+
+	osrfList* nodes = osrfHashGet(grp->domains, domain);
+	if( nodes && osrfTGSendVia( grp, nodes, msg, NULL, NULL ) == 0 )
+		return 0;
 
 	osrfLogWarning( OSRF_LOG_MARK, "Error sending message to domain %s", domain );
 	return -1;
@@ -119,125 +324,91 @@ int osrfTransportGroupSend( osrfTransportGroup* grp, transport_message* msg ) {
 	msgres[0] = '\0';
 	jid_get_resource(msg->recipient, msgres, bufsize - 1);
 
-	char* firstdomain = NULL;
-	char newrcp[1024];
+	osrfTGRetryFailed(grp);
 
-	int updateRecip = 1;
 	/* if we don't host this domain, don't update the recipient but send it as is */
-	if(!osrfHashGet(grp->nodes, domain)) updateRecip = 0;
-
-	osrfTransportGroupNode* node;
-
-	do {
-
-		node = osrfHashIteratorNext(grp->itr);
-		if(!node) osrfHashIteratorReset(grp->itr);
-
-		node = osrfHashIteratorNext(grp->itr);
-		if(!node) return -1;
-
-		if(firstdomain == NULL) {
-			firstdomain = node->domain;
-
-		} else {
-			if(!strcmp(firstdomain, node->domain)) { /* we've made a full loop */
-				osrfLogWarning( OSRF_LOG_MARK, "We've tried to send to all domains.. giving up");
-				return -1;
-			}
-		}
-
-		/* update the recipient domain if necessary */
-
-		if(updateRecip) {
-			snprintf(newrcp, sizeof(newrcp), "%s@%s/%s", msgrecip, node->domain, msgres);
-			free(msg->recipient);
-			msg->recipient = strdup(newrcp);
-		}
+	int updateRecip = osrfHashGet(grp->domains, domain) ? 1 : 0;
 
-		if( (client_send_message( node->connection, msg )) == 0 ) 
-			return 0;
-
-	} while(1);
+	if( osrfTGSendVia( grp, grp->members, msg,
+			updateRecip ? msgrecip : NULL, msgres ) == 0 )
+		return 0;
 
+	osrfLogWarning( OSRF_LOG_MARK, "We've tried to send to all domains.. giving up");
 	return -1;
 }
 
-static int __osrfTGWait( fd_set* fdset, int maxfd, int timeout ) {
-	if(!(fdset && maxfd)) return 0;
 
-	struct timeval tv;
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
-	int retval = 0;
-
-	if( timeout < 0 ) {
-		if( (retval = select( maxfd + 1, fdset, NULL, NULL, NULL)) == -1 ) 
-			return 0;
-
-	} else {
-		if( (retval = select( maxfd + 1, fdset, NULL, NULL, &tv)) == -1 ) 
-			return 0;
+/*
+	Wait on the active nodes in a list, and return a message from one of them.  Look
+	first for messages already queued; then poll the sockets.  The scan starts at a
+	different node each time, so that a busy connection can't starve the others.
+*/
+static transport_message* osrfTGRecv( osrfTransportGroup* grp, const osrfList* nodes,
+		int timeout ) {
+
+	unsigned int count = nodes->size;
+	if( !count ) return NULL;
+
+	struct pollfd fds[count];
+	osrfTransportGroupNode* polled[count];
+	unsigned int nfds = 0;
+	unsigned int start = grp->next++ % count;
+	unsigned int i;
+
+	for( i = 0; i < count; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(nodes, (start + i) % count);
+		if( !node->active ) continue;
+		if( node->connection->msg_q_head )
+			return client_recv( node->connection, 0 );
+		fds[nfds].fd = node->connection->session->sock_id;
+		fds[nfds].events = POLLIN;
+		fds[nfds].revents = 0;
+		polled[nfds++] = node;
+	}
+	if( !nfds ) return NULL;
+
+	if( poll( fds, nfds, timeout_secs_to_millis( timeout ) ) <= 0 )
+		return NULL;
+
+	for( i = 0; i < nfds; i++ ) {
+		if( !fds[i].revents ) continue;
+		osrfTransportGroupNode* node = polled[i];
+		transport_message* msg = client_recv( node->connection, 0 );
+		if( msg ) return msg;
+		if( !client_connected( node->connection ) || node->connection->error ) {
+			osrfLogWarning( OSRF_LOG_MARK, "TransportGroup lost connection to domain %s as %s",
+				node->domain, node->resource );
+			osrfTGNodeFailed(node);
+		}
 	}
 
-	return retval;
+	return NULL;
 }
 
-
 transport_message* osrfTransportGroupRecvAll( osrfTransportGroup* grp, int timeout ) {
 	if(!grp) return NULL;
-
-	int maxfd = 0;
-	fd_set fdset;
-	FD_ZERO( &fdset );
-
-	osrfTransportGroupNode* node;
-	osrfHashIterator* itr = osrfNewHashIterator(grp->nodes);
-
-	while( (node = osrfHashIteratorNext(itr)) ) {
-		if(node->active) {
-			int fd = node->connection->session->sock_id;
-			if( fd < maxfd ) maxfd = fd;
-			FD_SET( fd, &fdset );
-		}
-	}
-	osrfHashIteratorReset(itr);
-
-	if( __osrfTGWait( &fdset, maxfd, timeout ) ) {
-		while( (node = osrfHashIteratorNext(itr)) ) {
-			if(node->active) {
-				int fd = node->connection->session->sock_id;
-				if( FD_ISSET( fd, &fdset ) ) {
-					return client_recv( node->connection, 0 );
-				}
-			}
-		}
-	}
-
-	osrfHashIteratorFree(itr);
-	return NULL;
+	osrfTGRetryFailed(grp);
+	return osrfTGRecv( grp, grp->members, timeout );
 }
 
 transport_message* osrfTransportGroupRecv( osrfTransportGroup* grp, char* domain, int timeout ) {
 	if(!(grp && domain)) return NULL;
 
-	osrfTransportGroupNode* node = osrfHashGet(grp->nodes, domain);
-	if(!node && node->connection && node->connection->session) return NULL;
-	int fd = node->connection->session->sock_id;
-
-	fd_set fdset;
-	FD_ZERO( &fdset );
-	FD_SET( fd, &fdset );
-
-	int active = __osrfTGWait( &fdset, fd, timeout );
-	if(active) return client_recv( node->connection, 0 );
-	
-	return NULL;
+	osrfList* nodes = osrfHashGet(grp->domains, domain);
+	if(!nodes) return NULL;
+	return osrfTGRecv( grp, nodes, timeout );
 }
 
 void osrfTransportGroupSetInactive( osrfTransportGroup* grp, char* domain ) {
 	if(!(grp && domain)) return;
-	osrfTransportGroupNode* node = osrfHashGet(grp->nodes, domain );
-	if(node) node->active = 0;
-}
 
+	osrfList* nodes = osrfHashGet(grp->domains, domain);
+	if(!nodes) return;
 
+	unsigned int i;
+	for( i = 0; i < nodes->size; i++ ) {
+		osrfTransportGroupNode* node = OSRF_LIST_GET_INDEX(nodes, i);
+		if( node->active )
+			osrfTGNodeFailed(node);
+	}
+}
@@ -26,11 +26,31 @@ Date       Change
  2008/11/20 Initial creation
  2008/11/27 Emit surrogate pairs for code points > 0xFFFF
  ----------------------------------------------------------*/
+#include <stdint.h>
 #include <opensrf/utils.h>
 #include <opensrf/osrf_utf8.h>
 
-static void append_surrogate_pair(growing_buffer * buf, unsigned long code_point);
-static void append_uxxxx(growing_buffer * buf, unsigned long i);
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_SSE2 1
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define UTF8_NEON 1
+#endif
+
+/*
+	A vector scan reads whole aligned blocks, which may run past the terminal nul -- but
+	never past the end of the page holding it, so it can't fault.  Keep AddressSanitizer from
+	objecting.
+*/
+#if defined(__GNUC__)
+#define UTF8_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define UTF8_NO_ASAN
+#endif
+
+static size_t escape_utf8( const unsigned char* s, char* out, int* rc );
+static const unsigned char* scan_plain( const unsigned char* s );
 
 unsigned char osrf_utf8_mask_[] =
 {
@@ -343,13 +363,170 @@ typedef enum {
  Translate a UTF-8 input string into properly escaped text suitable
  for a JSON string -- including escaped hex values and surrogate
  pairs  where needed.  Append the result to a growing_buffer.
+
+ Return zero if the input is valid UTF-8, or else the offset of the
+ first malformed byte past the start of the string; or -1 if the
+ buffer can't be expanded.
+
+ We make room once for the worst case -- six bytes out for every
+ byte in -- and then translate straight into the buffer.  If the
+ worst case would be too big for a growing_buffer, we measure the
+ result exactly first.
 */
 int buffer_append_utf8( growing_buffer* buf, const char* string ) {
+	if( !(buf && string) )
+		return 0;
+
+	const unsigned char* s = (const unsigned char*) string;
+	size_t room = 6 * strlen( string );
+	if( buf->n_used + room >= BUFFER_MAX_SIZE )
+		room = escape_utf8( s, NULL, NULL );
+	if( buffer_reserve( buf, room ) )
+		return -1;
+
+	int rc = 0;
+	buf->n_used += escape_utf8( s, buf->buf + buf->n_used, &rc );
+	buf->buf[ buf->n_used ] = '\0';
+	return rc;
+}
+
+/**
+	@brief Compute the length of a string as escaped by osrf_utf8_escape().
+	@param string Pointer to the nul-terminated string.
+	@return The number of bytes that osrf_utf8_escape() would write, not counting any
+		terminal nul.
+
+	This is also the number of bytes that buffer_append_utf8() would append.
+*/
+size_t osrf_utf8_escaped_length( const char* string ) {
+	return escape_utf8( (const unsigned char*) string, NULL, NULL );
+}
+
+/**
+	@brief Escape a string for JSON, into memory supplied by the caller.
+	@param dest Pointer to where to write, with room for osrf_utf8_escaped_length() bytes.
+	@param string Pointer to the nul-terminated string to escape.
+	@return Pointer to the byte just past the last one written.
+
+	The translation is exactly that of buffer_append_utf8(), for callers that have
+	already worked out how much room they need.  No terminal nul is written.
+*/
+char* osrf_utf8_escape( char* dest, const char* string ) {
+	return dest + escape_utf8( (const unsigned char*) string, dest, NULL );
+}
+
+/**
+	@brief Find the end of a run of bytes that stand for themselves in a JSON string.
+	@param s Pointer to where to start looking.
+	@return Pointer to the first byte that isn't printable ASCII, or is a quotation mark
+		or backslash.  The terminal nul is such a byte.
+
+	Uses SSE2 or NEON where available, to look at sixteen bytes at a time.
+*/
+#if defined(UTF8_SSE2)
+UTF8_NO_ASAN static const unsigned char* scan_plain( const unsigned char* s ) {
+	// Step up to a 16-byte boundary, so that no load strays into the next page.
+	while( (uintptr_t) s & 15 ) {
+		if( *s < 0x20 || *s >= 0x7F || '"' == *s || '\\' == *s )
+			return s;
+		++s;
+	}
+
+	const __m128i space = _mm_set1_epi8( 0x20 );
+	const __m128i del = _mm_set1_epi8( 0x7F );
+	const __m128i quote = _mm_set1_epi8( '"' );
+	const __m128i backslash = _mm_set1_epi8( '\\' );
+	for( ;; s += 16 ) {
+		__m128i v = _mm_load_si128( (const __m128i*) s );
+		// As signed bytes, both controls and non-ASCII bytes are less than a space
+		__m128i hit = _mm_or_si128(
+			_mm_or_si128( _mm_cmplt_epi8( v, space ), _mm_cmpeq_epi8( v, del ) ),
+			_mm_or_si128( _mm_cmpeq_epi8( v, quote ), _mm_cmpeq_epi8( v, backslash ) ) );
+		int mask = _mm_movemask_epi8( hit );
+		if( mask )
+			return s + __builtin_ctz( mask );
+	}
+}
+#elif defined(UTF8_NEON)
+UTF8_NO_ASAN static const unsigned char* scan_plain( const unsigned char* s ) {
+	while( (uintptr_t) s & 15 ) {
+		if( *s < 0x20 || *s >= 0x7F || '"' == *s || '\\' == *s )
+			return s;
+		++s;
+	}
+
+	const uint8x16_t space = vdupq_n_u8( 0x20 );
+	const uint8x16_t del = vdupq_n_u8( 0x7F );
+	const uint8x16_t quote = vdupq_n_u8( '"' );
+	const uint8x16_t backslash = vdupq_n_u8( '\\' );
+	for( ;; s += 16 ) {
+		uint8x16_t v = vld1q_u8( s );
+		uint8x16_t hit = vorrq_u8(
+			vorrq_u8( vcltq_u8( v, space ), vcgeq_u8( v, del ) ),
+			vorrq_u8( vceqq_u8( v, quote ), vceqq_u8( v, backslash ) ) );
+		uint8x8_t nibbles = vshrn_n_u16( vreinterpretq_u16_u8( hit ), 4 );
+		uint64_t mask = vget_lane_u64( vreinterpret_u64_u8( nibbles ), 0 );
+		if( mask )
+			return s + ( __builtin_ctzll( mask ) >> 2 );
+	}
+}
+#else
+static const unsigned char* scan_plain( const unsigned char* s ) {
+	while( *s >= 0x20 && *s < 0x7F && '"' != *s && '\\' != *s )
+		++s;
+	return s;
+}
+#endif
+
+/** @brief Write one byte, if we're writing, and count it either way. */
+#define ESCAPE_EMIT(c) do { if( out ) out[ len ] = (c); ++len; } while( 0 )
+
+/** @brief Write a code unit as "\uxxxx", if we're writing, and count it either way. */
+#define ESCAPE_UXXXX(u) do { \
+		if( out ) { \
+			static const char hex_chars[] = "0123456789abcdef"; \
+			out[ len ]     = '\\'; \
+			out[ len + 1 ] = 'u'; \
+			out[ len + 2 ] = hex_chars[ ((u) >> 12) & 0x000F ]; \
+			out[ len + 3 ] = hex_chars[ ((u) >>  8) & 0x000F ]; \
+			out[ len + 4 ] = hex_chars[ ((u) >>  4) & 0x000F ]; \
+			out[ len + 5 ] = hex_chars[ (u)         & 0x000F ]; \
+		} \
+		len += 6; \
+	} while( 0 )
+
+/**
+	@brief Write a code point above 0xFFFF as a surrogate pair, if we're writing.
+
+	This is loosely based on a code snippet at http://www.unicode.org/faq/utf_bom.html.
+*/
+#define ESCAPE_PAIR(cp) do { \
+		unsigned long hi__ = 0xD7C0 + ((cp) >> 10); \
+		unsigned long low__ = 0xDC00 + ((cp) & 0x3FF); \
+		ESCAPE_UXXXX( hi__ ); \
+		ESCAPE_UXXXX( low__ ); \
+	} while( 0 )
+
+/** @brief Note the offset of a malformed byte, if we're noting them and it's the first. */
+#define ESCAPE_ERROR() do { if( rc && 0 == *rc ) *rc = (int) i; } while( 0 )
+
+/**
+	@brief Escape a string for JSON, or just measure the result.
+	@param s Pointer to the nul-terminated string.
+	@param out Pointer to where to write the result, or NULL to write nothing.
+	@param rc Pointer to an int, initially zero, to receive the offset of the first
+		malformed byte as buffer_append_utf8() reports it; or NULL.
+	@return The length of the result.
+
+	Malformed UTF-8 is dropped, and translation resumes at the next byte that can start a
+	character.  Runs of plain ASCII are found sixteen bytes at a time, and copied in
+	one go.
+*/
+static size_t escape_utf8( const unsigned char* s, char* out, int* rc ) {
 	utf8_state state = S_BEGIN;
 	unsigned long utf8_char = 0;
-	const unsigned char* s = (unsigned char *) string;
-	int i = 0;
-	int rc = 0;
+	size_t len = 0;
+	size_t i = 0;
 
 	do
 	{
@@ -358,56 +535,53 @@ int buffer_append_utf8( growing_buffer* buf, const char* string ) {
 			case S_BEGIN :
 
 				while( s[i] && (s[i] < 0x80) ) {    // Handle ASCII
-					if( is_utf8_print( s[i] ) ) {   // Printable
-						switch( s[i] )
-						{
-							case '"' :
-							case '\\' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-							default :
-								OSRF_BUFFER_ADD_CHAR( buf, s[i] );
-								break;
-						}
-					} else if( s[i] ) {   // Control character
-
-						switch( s[i] )    // Escape some
-						{
-							case '\n' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-								OSRF_BUFFER_ADD_CHAR( buf, 'n' );
-								break;
-							case '\t' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-								OSRF_BUFFER_ADD_CHAR( buf, 't' );
-								break;
-							case '\r' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-								OSRF_BUFFER_ADD_CHAR( buf, 'r' );
-								break;
-							case '\f' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-								OSRF_BUFFER_ADD_CHAR( buf, 'f' );
-								break;
-							case '\b' :
-								OSRF_BUFFER_ADD_CHAR( buf, '\\' );
-								OSRF_BUFFER_ADD_CHAR( buf, 'b' );
-								break;
-							default : {   // Format the rest in hex
-								append_uxxxx(buf, s[i]);
-								break;
-							}
-						}
+					const unsigned char* end = scan_plain( s + i );
+					if( end > s + i ) {
+						size_t n = end - (s + i);
+						if( out )
+							memcpy( out + len, s + i, n );
+						len += n;
+						i += n;
+						continue;
+					}
+
+					switch( s[i] )
+					{
+						case '"' :
+						case '\\' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( s[i] );
+							break;
+						case '\n' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( 'n' );
+							break;
+						case '\t' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( 't' );
+							break;
+						case '\r' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( 'r' );
+							break;
+						case '\f' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( 'f' );
+							break;
+						case '\b' :
+							ESCAPE_EMIT( '\\' );
+							ESCAPE_EMIT( 'b' );
+							break;
+						default :   // Format the rest in hex
+							if( s[i] )
+								ESCAPE_UXXXX( s[i] );
+							break;
 					}
 					++i;
 				}
 
-				// If the next byte is the first of a multibyte sequence, we zero out
-				// the length bits and store the rest.
-				
 				if( '\0' == s[i] )
 					state = S_END;
-				else if( 128 > s[i] )
-					state = S_BEGIN;
 				else if( is_utf8_2_byte( s[i] ) ) {
 					utf8_char = s[i] ^ 0xC0;
 					state = S_2_OF_2;   // Expect 1 continuation byte
@@ -418,109 +592,48 @@ int buffer_append_utf8( growing_buffer* buf, const char* string ) {
 					utf8_char = s[i] ^ 0xF0;
 					state = S_2_OF_4;   // Expect 3 continuation bytes
 				} else {
-					if( 0 == rc )
-						rc = i;
+					ESCAPE_ERROR();
 					state = S_ERROR;
 				}
-				
+
 				++i;
 				break;
-			case S_2_OF_2 :  //Expect second byte of 1-byte character
-				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
-					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					append_uxxxx(buf, utf8_char);
-					state = S_BEGIN;
-					++i;
-				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
-					state = S_END;
-				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
-					state = S_BEGIN;
-				}
-				break;
-			case S_2_OF_3 :
-				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
-					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					state = S_3_OF_3;
-					++i;
-				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
-					state = S_END;
-				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
-					state = S_BEGIN;
-				}
-				break;
+			case S_2_OF_2 :
 			case S_3_OF_3 :
+			case S_4_OF_4 :  // Expect the last byte of a character
 				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
 					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					if(utf8_char > 0xFFFF )
-						append_surrogate_pair(buf, utf8_char);
+					if( S_2_OF_2 != state && utf8_char > 0xFFFF )
+						ESCAPE_PAIR( utf8_char );
 					else
-						append_uxxxx(buf, utf8_char);
+						ESCAPE_UXXXX( utf8_char );
 					state = S_BEGIN;
 					++i;
 				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
+					ESCAPE_ERROR();
 					state = S_END;
 				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
+					ESCAPE_ERROR();
 					state = S_BEGIN;
 				}
 				break;
+			case S_2_OF_3 :
 			case S_2_OF_4 :
+			case S_3_OF_4 :  // Expect a byte in the middle of a character
 				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
 					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					state = S_3_OF_4;
-					++i;
-				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
-					state = S_END;
-				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
-					state = S_BEGIN;
-				}
-				break;
-			case S_3_OF_4 :
-				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
-					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					state = S_4_OF_4;
-					++i;
-				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
-					state = S_END;
-				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
-					state = S_BEGIN;
-				}
-				break;
-			case S_4_OF_4 :
-				if( is_utf8_continue( s[i] ) ) {  // Append lower 6 bits
-					utf8_char = (utf8_char << 6) | (s[i] & 0x3F);
-					if(utf8_char > 0xFFFF )
-						append_surrogate_pair(buf, utf8_char);
+					if( S_2_OF_3 == state )
+						state = S_3_OF_3;
+					else if( S_2_OF_4 == state )
+						state = S_3_OF_4;
 					else
-						append_uxxxx(buf, utf8_char);
-					state = S_BEGIN;
+						state = S_4_OF_4;
 					++i;
 				} else if( '\0' == s[i] ) {  // Unexpected end of string
-					if( 0 == rc )
-						rc = i;
+					ESCAPE_ERROR();
 					state = S_END;
 				} else {   // Non-continuation character
-					if( 0 == rc )
-						rc = i;
+					ESCAPE_ERROR();
 					state = S_BEGIN;
 				}
 				break;
@@ -538,43 +651,6 @@ int buffer_append_utf8( growing_buffer* buf, const char* string ) {
 				break;
 		}
 	} while ( state != S_END );
-	
-	return rc;
-}
-
-/**
- Break a code point up into two pieces, and format each piec
- in hex. as a surrogate pair.  Append the results to a growing_buffer.
-
- This code is loosely based on a code snippet at:
- http://www.unicode.org/faq/utf_bom.html
- It isn't obvious how, why, or whether it works.
-*/
-static void append_surrogate_pair(growing_buffer * buf, unsigned long code_point) {
-	unsigned int hi;   // high surrogate
-	unsigned int low;  // low surrogate
-
-	hi = 0xD7C0 + (code_point >> 10);
-	append_uxxxx(buf, hi);
-
-	low = 0xDC00 + (code_point & 0x3FF);
-	append_uxxxx(buf, low);
-}
-
-/**
- Format the lower 16 bits of an unsigned long in hex,
- in the format "\uxxxx" where each x is a hex digit.
- Append the result to a growing_buffer.
-*/
-static void append_uxxxx( growing_buffer * buf, unsigned long i ) {
-	static const char hex_chars[] = "0123456789abcdef";
-	char hex_buf[7] = "\\u";
-
-	hex_buf[2] = hex_chars[ (i >> 12) & 0x000F ];
-	hex_buf[3] = hex_chars[ (i >>  8) & 0x000F ];
-	hex_buf[4] = hex_chars[ (i >>  4) & 0x000F ];
-	hex_buf[5] = hex_chars[ i         & 0x000F ];
-	hex_buf[6] = '\0';
 
-	OSRF_BUFFER_ADD(buf, hex_buf);
+	return len;
 }
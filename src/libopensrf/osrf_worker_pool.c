@@ -0,0 +1,553 @@
+/**
+	@file osrf_worker_pool.c
+	@brief Serve an application from a pool of threads within a single process.
+
+	For applications that declare themselves thread-safe, this is an alternative to the
+	prefork server that doesn't pay for a whole process per drone.  The listener, running
+	in the main thread, receives requests from Jabber and appends them to a work queue.
+	A fixed number of worker threads take requests from the head of the queue and
+	service them, one at a time each.
+
+	Each worker opens its own Jabber connection, as a drone would, and keeps its own
+	application sessions, JSON free list, and cache connection in thread-local storage;
+	so a client that opens a stateful session talks directly to the same worker for the
+	rest of it, just as it would to a drone.  Each worker runs the application's
+	osrfAppChildInit() for itself, so that the application can set up per-thread state
+	there.  osrfAppTemplateInit(), if any, runs once, before the workers start.
+
+	If a method panics, the worker reconnects and runs osrfAppChildInit() again, as a
+	replacement drone would.  The workers never exit on their own.
+
+	Signals are handled by the main thread: SIGTERM unregisters from the routers, lets the
+	workers finish the queue, and exits; SIGINT and SIGQUIT exit right after unregistering.
+	SIGUSR1 and SIGUSR2 unregister and register, as with the prefork server.  SIGHUP is
+	ignored, since there are no drones to recycle.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opensrf/utils.h"
+#include "opensrf/log.h"
+#include "opensrf/transport_client.h"
+#include "opensrf/osrf_stack.h"
+#include "opensrf/osrf_settings.h"
+#include "opensrf/osrf_application.h"
+#include "opensrf/osrf_system.h"
+#include "opensrf/osrf_prefork.h"
+#include "opensrf/osrf_worker_pool.h"
+
+#define WORKER_THREADS 8
+
+struct worker_pool_struct;
+
+/**
+	@brief One worker thread.
+*/
+typedef struct {
+	struct worker_pool_struct* pool;  /**< The pool the worker belongs to. */
+	int index;            /**< Position in the pool, used to name its Jabber resource. */
+	pthread_t thread;     /**< The thread itself. */
+	int started;          /**< 0 while starting up; then 1 if ready, or -1 if it failed. */
+} worker;
+
+/**
+	@brief The listener's view of a pool of worker threads, and the queue they share.
+*/
+typedef struct worker_pool_struct {
+	char* appname;        /**< Name of the application. */
+	int keepalive;        /**< Keepalive time for stateful sessions. */
+	int max_backlog_queue;  /**< Maximum number of requests waiting in the queue. */
+	int thread_count;     /**< Number of worker threads. */
+	worker* workers;      /**< Array of worker threads. */
+	transport_client* connection;  /**< The listener's connection to Jabber. */
+	pthread_mutex_t lock; /**< Guards everything below. */
+	pthread_cond_t work_ready;  /**< Signaled when a request joins the queue. */
+	pthread_cond_t started;     /**< Signaled when a worker finishes starting up. */
+	transport_message* head;    /**< Oldest waiting request, linked through "next". */
+	transport_message* tail;    /**< Newest waiting request. */
+	int size;             /**< Number of requests waiting. */
+	int shutdown;         /**< Boolean: true when the workers should exit once idle. */
+} worker_pool;
+
+/** Serializes Jabber logins, which share some static buffers. */
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Set by a signal handler to the signal that should stop the listener, if any. */
+static volatile sig_atomic_t stop_signal = 0;
+
+/** Set by a signal handler to SIGUSR1 or SIGUSR2, for the listener to act on. */
+static volatile sig_atomic_t router_signal = 0;
+
+static int worker_connect( worker* w );
+static void* worker_main( void* arg );
+static int worker_process_request( worker* w, transport_message* msg );
+static void pool_push( worker_pool* pool, transport_message* msg );
+static transport_message* pool_pop( worker_pool* pool );
+static int pool_start( worker_pool* pool );
+static void pool_stop( worker_pool* pool );
+static void pool_listen( worker_pool* pool );
+static void pool_signal_handler( int sig );
+
+/**
+	@brief Serve an application from a pool of worker threads.
+	@param appname Name of the application.
+	@return 0 if successful, or -1 if error.
+
+	Called in place of osrf_prefork_run() for an application whose configuration says
+	that it is thread-safe.  Returns only once the listener has been told to stop.
+*/
+int osrf_worker_pool_run( const char* appname ) {
+
+	if( !appname ) {
+		osrfLogError( OSRF_LOG_MARK, "osrf_worker_pool_run requires an appname to run!" );
+		return -1;
+	}
+
+	set_proc_title( "OpenSRF Listener [%s]", appname );
+
+	worker_pool pool;
+	memset( &pool, 0, sizeof( pool ));
+	pool.keepalive = 5;
+	pool.max_backlog_queue = 1000;
+	pool.thread_count = WORKER_THREADS;
+
+	osrfLogInfo( OSRF_LOG_MARK, "Loading config in worker pool for app %s", appname );
+
+	char* keepalive  = osrf_settings_host_value( "/apps/%s/keepalive", appname );
+	char* threads    = osrf_settings_host_value( "/apps/%s/unix_config/worker_threads", appname );
+	char* max_backlog_queue = osrf_settings_host_value(
+		"/apps/%s/unix_config/max_backlog_queue", appname );
+
+	if( keepalive )
+		pool.keepalive = atoi( keepalive );
+	if( threads )
+		pool.thread_count = atoi( threads );
+	else
+		osrfLogWarning( OSRF_LOG_MARK, "Worker threads not defined, assuming %d",
+			pool.thread_count );
+	if( max_backlog_queue )
+		pool.max_backlog_queue = atoi( max_backlog_queue );
+
+	free( keepalive );
+	free( threads );
+	free( max_backlog_queue );
+
+	if( pool.thread_count < 1 ) {
+		osrfLogError( OSRF_LOG_MARK, "worker_threads must be at least 1" );
+		return -1;
+	}
+
+	pool.appname = strdup( appname );
+	pool.connection = osrfSystemGetTransportClient();
+	pthread_mutex_init( &pool.lock, NULL );
+	pthread_cond_init( &pool.work_ready, NULL );
+	pthread_cond_init( &pool.started, NULL );
+
+	// Set up whatever the application would share among drones, before any workers start
+	int rc = -1;
+	if( osrfAppRunTemplateInit( appname )) {
+		osrfLogError( OSRF_LOG_MARK, "Worker pool template_init failed" );
+		osrfSystemReportReady( "template_init failed" );
+	} else if( 0 == pool_start( &pool )) {
+
+		// Tell the router that you're open for business.
+		osrf_prefork_register_routers( appname, false );
+		osrfSystemReportReady( "ready" );
+
+		osrfLogInfo( OSRF_LOG_MARK, "Launching worker pool of %d threads for app %s",
+			pool.thread_count, appname );
+		pool_listen( &pool );
+
+		osrf_prefork_register_routers( appname, true );
+		if( SIGINT == stop_signal || SIGQUIT == stop_signal ) {
+			osrfLogInfo( OSRF_LOG_MARK, "server: received SIGINT/QUIT, shutting down" );
+			_exit( 0 );
+		}
+
+		osrfLogInfo( OSRF_LOG_MARK, "server: finishing queued requests and shutting down" );
+		if( stop_signal )
+			rc = 0;
+	}
+
+	pool_stop( &pool );
+	osrfAppRunExitCode();
+	free( pool.workers );
+	free( pool.appname );
+	return rc;
+}
+
+/**
+	@brief Start the worker threads, one at a time.
+	@param pool Pointer to the worker_pool.
+	@return 0 if they all started, or -1 if not.
+
+	Wait for each worker to connect to Jabber and run the application's child init before
+	starting the next, so that they don't all hit the Jabber server at once.  The workers
+	block the signals that the listener handles, so that the listener gets them all.
+*/
+static int pool_start( worker_pool* pool ) {
+
+	sigset_t handled, old_mask;
+	sigemptyset( &handled );
+	sigaddset( &handled, SIGTERM );
+	sigaddset( &handled, SIGINT );
+	sigaddset( &handled, SIGQUIT );
+	sigaddset( &handled, SIGUSR1 );
+	sigaddset( &handled, SIGUSR2 );
+	sigaddset( &handled, SIGHUP );
+
+	struct sigaction action;
+	memset( &action, 0, sizeof( action ));
+	action.sa_handler = pool_signal_handler;   // No SA_RESTART: interrupt the listener
+	sigemptyset( &action.sa_mask );
+	sigaction( SIGTERM, &action, NULL );
+	sigaction( SIGINT,  &action, NULL );
+	sigaction( SIGQUIT, &action, NULL );
+	sigaction( SIGUSR1, &action, NULL );
+	sigaction( SIGUSR2, &action, NULL );
+	signal( SIGHUP, SIG_IGN );
+
+	pool->workers = safe_malloc( pool->thread_count * sizeof( worker ));
+	pthread_sigmask( SIG_BLOCK, &handled, &old_mask );
+
+	int rc = 0;
+	int i;
+	for( i = 0; i < pool->thread_count; i++ ) {
+		worker* w = pool->workers + i;
+		w->pool = pool;
+		w->index = i;
+		if( pthread_create( &w->thread, NULL, worker_main, w )) {
+			osrfLogError( OSRF_LOG_MARK, "Unable to create worker thread: %s",
+				strerror( errno ));
+			rc = -1;
+			break;
+		}
+
+		pthread_mutex_lock( &pool->lock );
+		while( 0 == w->started )
+			pthread_cond_wait( &pool->started, &pool->lock );
+		pthread_mutex_unlock( &pool->lock );
+
+		if( w->started < 0 ) {
+			osrfLogError( OSRF_LOG_MARK, "Worker %d failed to start", i );
+			rc = -1;
+			break;
+		}
+	}
+
+	pthread_sigmask( SIG_SETMASK, &old_mask, NULL );
+	return rc;
+}
+
+/**
+	@brief Tell the workers to exit once the queue is empty, and wait for them to do so.
+	@param pool Pointer to the worker_pool.
+*/
+static void pool_stop( worker_pool* pool ) {
+	if( !pool->workers )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->shutdown = 1;
+	pthread_cond_broadcast( &pool->work_ready );
+	pthread_mutex_unlock( &pool->lock );
+
+	int i;
+	for( i = 0; i < pool->thread_count; i++ )
+		if( pool->workers[ i ].started )
+			pthread_join( pool->workers[ i ].thread, NULL );
+
+	// Anything left over was never going to be serviced
+	transport_message* msg;
+	while( (msg = pool->head) ) {
+		pool->head = msg->next;
+		message_free( msg );
+	}
+	pool->tail = NULL;
+	pool->size = 0;
+}
+
+/**
+	@brief Receive requests from Jabber and queue them for the workers.
+	@param pool Pointer to the worker_pool.
+
+	Return when a signal says to stop, or when we lose our Jabber connection.
+*/
+static void pool_listen( worker_pool* pool ) {
+
+	while( !stop_signal ) {
+
+		if( router_signal ) {
+			int unregister = ( SIGUSR1 == router_signal );
+			router_signal = 0;
+			osrf_prefork_register_routers( pool->appname, unregister );
+		}
+
+		transport_message* msg = client_recv( pool->connection, -1 );
+		if( !msg ) {
+			// Most likely a signal was received
+			if( !client_connected( pool->connection )) {
+				osrfLogError( OSRF_LOG_MARK, "Worker pool listener lost its connection" );
+				break;
+			}
+			continue;
+		}
+
+		if( msg->error_type ) {
+			osrfLogInfo( OSRF_LOG_MARK, "Listener received an XMPP error message.  "
+				"Likely a bounced message. sender=%s", msg->sender );
+			message_free( msg );
+			continue;
+		}
+
+		if( !msg->body || !*msg->body ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Received empty message from %s, thread %s",
+				msg->sender, msg->thread );
+			message_free( msg );
+			continue;
+		}
+
+		pool_push( pool, msg );
+	}
+}
+
+/**
+	@brief Add a request to the tail of the work queue, and wake a worker.
+	@param pool Pointer to the worker_pool.
+	@param msg Pointer to the request, which the queue takes over.
+
+	If the queue is full, drop the request.
+*/
+static void pool_push( worker_pool* pool, transport_message* msg ) {
+	pthread_mutex_lock( &pool->lock );
+
+	if( pool->size >= pool->max_backlog_queue ) {
+		pthread_mutex_unlock( &pool->lock );
+		osrfLogWarning( OSRF_LOG_MARK, "Reached backlog queue limit of %d; dropping "
+			"latest message", pool->max_backlog_queue );
+		message_free( msg );
+		return;
+	}
+
+	msg->next = NULL;
+	if( pool->tail )
+		pool->tail->next = msg;
+	else
+		pool->head = msg;
+	pool->tail = msg;
+	pool->size++;
+
+	pthread_cond_signal( &pool->work_ready );
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/**
+	@brief Take the request at the head of the work queue, waiting for one if necessary.
+	@param pool Pointer to the worker_pool.
+	@return Pointer to the request, or NULL if the pool is shutting down and the queue is
+		empty.
+
+	Called only by worker threads.
+*/
+static transport_message* pool_pop( worker_pool* pool ) {
+	pthread_mutex_lock( &pool->lock );
+
+	while( !pool->head && !pool->shutdown )
+		pthread_cond_wait( &pool->work_ready, &pool->lock );
+
+	transport_message* msg = pool->head;
+	if( msg ) {
+		pool->head = msg->next;
+		if( !pool->head )
+			pool->tail = NULL;
+		pool->size--;
+		msg->next = NULL;
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+	return msg;
+}
+
+/**
+	@brief Connect a worker to Jabber and to the cache, and run the application's child init.
+	@param w Pointer to the worker.
+	@return 0 if successful, or -1 if not.
+
+	Called only by the worker thread itself, when it starts and whenever it needs to
+	start over.
+*/
+static int worker_connect( worker* w ) {
+
+	const char* appname = w->pool->appname;
+
+	pthread_mutex_lock( &connect_lock );
+	if( osrfSystemGetTransportClient() )
+		osrf_system_disconnect_client();
+
+	osrfSystemInitCache();
+	char* resc = va_list_to_string( "%s_worker%d", appname, w->index );
+	int connected = osrfSystemBootstrapClientResc( NULL, NULL, resc );
+	free( resc );
+	pthread_mutex_unlock( &connect_lock );
+
+	if( connected != 1 ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to bootstrap client for worker %d", w->index );
+		return -1;
+	}
+
+	if( osrfAppRunChildInit( appname )) {
+		osrfLogError( OSRF_LOG_MARK, "Worker %d child_init failed", w->index );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+	@brief Service requests from the work queue until the pool shuts down.
+	@param arg Pointer to the worker, disguised as a void pointer.
+	@return NULL.
+
+	The thread function of each worker.
+*/
+static void* worker_main( void* arg ) {
+	worker* w = arg;
+	worker_pool* pool = w->pool;
+
+	int rc = worker_connect( w );
+
+	pthread_mutex_lock( &pool->lock );
+	w->started = rc ? -1 : 1;
+	pthread_cond_broadcast( &pool->started );
+	pthread_mutex_unlock( &pool->lock );
+
+	if( rc ) {
+		osrf_system_disconnect_client();
+		return NULL;
+	}
+
+	transport_message* msg;
+	while( (msg = pool_pop( pool )) ) {
+		if( worker_process_request( w, msg )) {
+			// The application wants a fresh start, as a new drone would get
+			osrfLogWarning( OSRF_LOG_MARK, "Worker %d starting over", w->index );
+			while( worker_connect( w ) && !pool->shutdown )
+				sleep( 1 );
+		}
+	}
+
+	osrf_system_disconnect_client();
+	jsonObjectFreeUnused();
+	return NULL;
+}
+
+/**
+	@brief Respond to a client request taken from the work queue.
+	@param w Pointer to the worker.
+	@param msg Pointer to the request, which we take over.
+	@return 0 on success; non-zero means that the worker should reconnect and run the
+		application's child init again, presumably due to a fatal error condition.
+
+	Like prefork_child_process_request(): if the client opens a stateful session, stay
+	with it until it disconnects or times out.
+*/
+static int worker_process_request( worker* w, transport_message* msg ) {
+
+	// Make sure that we're still connected to Jabber; reconnect if necessary.
+	if( !client_connected( osrfSystemGetTransportClient() )) {
+		osrfLogWarning( OSRF_LOG_MARK, "Reconnecting worker %d after disconnect...",
+			w->index );
+		if( worker_connect( w )) {
+			osrfLogError( OSRF_LOG_MARK, "Worker %d dropping request for lack of a "
+				"connection", w->index );
+			message_free( msg );
+			sleep( 1 );
+			return 0;
+		}
+	}
+
+	// Respond to the transport message.  This is where method calls are buried.
+	osrfAppSession* session = osrf_stack_transport_handler( msg, w->pool->appname );
+	if( !session )
+		return 0;
+
+	int rc = session->panic;
+
+	if( rc ) {
+		osrfLogWarning( OSRF_LOG_MARK,
+			"Worker for session %s starting over immediately", session->session_id );
+		osrfAppSessionFree( session );
+		return rc;
+	}
+
+	if( session->stateless && session->state != OSRF_SESSION_CONNECTED ) {
+		osrfAppSessionFree( session );
+		return rc;
+	}
+
+	// The client has opened a stateful session, so it will send us the rest of its
+	// requests directly.  Serve them until it disconnects or goes quiet.
+	osrfLogDebug( OSRF_LOG_MARK, "Entering keepalive loop for session %s", session->session_id );
+	int keepalive = w->pool->keepalive;
+	int retval;
+	int recvd;
+	time_t start;
+	time_t end;
+
+	while( 1 ) {
+
+		start   = time( NULL );
+		retval  = osrf_app_session_queue_wait( session, keepalive, &recvd );
+		end     = time( NULL );
+
+		if( session->panic )
+			rc = 1;
+
+		if( retval ) {
+			osrfLogError( OSRF_LOG_MARK, "queue-wait returned non-success %d", retval );
+			break;
+		}
+
+		if( session->state != OSRF_SESSION_CONNECTED )
+			break;
+
+		if( !recvd && (end - start) >= keepalive ) {
+			osrfLogInfo( OSRF_LOG_MARK,
+				"No request was received in %d seconds, exiting stateful session", keepalive );
+			osrfAppSessionStatus(
+				session,
+				OSRF_STATUS_TIMEOUT,
+				"osrfConnectStatus",
+				0, "Disconnected on timeout" );
+
+			break;
+		}
+
+		if( rc )
+			break;
+	}
+
+	osrfLogDebug( OSRF_LOG_MARK, "Exiting keepalive loop for session %s", session->session_id );
+	osrfAppSessionFree( session );
+	return rc;
+}
+
+/**
+	@brief Signal handler for the worker pool's listener.
+	@param sig The value of the trapped signal.
+
+	Note the signal, to be acted on once client_recv() returns to the listener's loop.
+*/
+static void pool_signal_handler( int sig ) {
+	if( SIGUSR1 == sig || SIGUSR2 == sig )
+		router_signal = sig;
+	else if( !stop_signal )
+		stop_signal = sig;
+}
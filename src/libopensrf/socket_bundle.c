@@ -1,9 +1,28 @@
 /**
 	@file socket_bundle.c
 	@brief Collection of socket-handling routines.
+
+	A socket_manager waits for input with epoll where the platform offers it, and with
+	poll() otherwise.  Either way readiness is level-triggered, so a socket that still has
+	unread input is reported again on the next wait, and we aren't limited by FD_SETSIZE.
+
+	Input is read into a buffer owned by the socket_manager.  The buffer starts small and
+	doubles whenever a read fills it, so that a large response arrives in a few big reads
+	rather than in thousands of small ones.  After a long run of small reads it shrinks
+	again.
 */
 
+#include <limits.h>
+#include <poll.h>
 #include <opensrf/socket_bundle.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define OSRF_SOCKET_EPOLL
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define LISTENER_SOCKET   1
 #define DATA_SOCKET       2
@@ -28,9 +47,39 @@ struct socket_node_struct {
 	struct socket_node_struct* next;  /**< Linkage pointer for linked list. */
 };
 
-/** @brief Size of buffer used to read from the sockets */
+/** @brief Initial size of the buffer used to read from the sockets */
 #define RBUFSIZE 1024
 
+/** @brief Largest size to which the read buffer may grow */
+#define RBUFSIZE_MAX (1024 * 1024)
+
+/** @brief Number of consecutive reads using under a quarter of the buffer before it shrinks */
+#define RBUF_SHRINK_READS 64
+
+/** @brief Maximum number of readiness events to collect from one call to epoll_wait() */
+#define SOCKET_MAX_EVENTS 64
+
+/**
+	@brief Read buffer and readiness state for a socket_manager.
+
+	Sockets become ready in batches.  While we work through a batch, a callback may close
+	any of the sockets in it; socket_remove_node() then knocks the freed node out of the
+	ready list so that we don't touch it again.
+*/
+struct socket_io_struct {
+	char* rbuf;             /**< Buffer for receiving data. */
+	size_t rbuf_size;       /**< Current capacity of rbuf, including room for a nul. */
+	int small_reads;        /**< Consecutive reads using under a quarter of rbuf. */
+	int poll_fd;            /**< epoll descriptor, or -1 if we're using poll(). */
+	pid_t poll_pid;         /**< Process that opened poll_fd (it doesn't survive fork()). */
+	int use_poll;           /**< Set if epoll has failed us; use poll() from then on. */
+	struct pollfd* pollfds; /**< For poll(): one entry per socket. */
+	socket_node** ready;    /**< Nodes reported ready by the latest wait. */
+	int ready_size;         /**< Capacity of pollfds and ready. */
+	int ready_count;        /**< Number of entries in the ready list. */
+};
+typedef struct socket_io_struct socket_io;
+
 static socket_node* _socket_add_node(socket_manager* mgr,
 		int endpoint, int addr_type, int sock_fd, int parent_id );
 static socket_node* socket_find_node(socket_manager* mgr, int sock_fd);
@@ -38,6 +87,12 @@ static void socket_remove_node(socket_manager*, int sock_fd);
 static int _socket_send(int sock_fd, const char* data, int flags);
 static int _socket_handle_new_client(socket_manager* mgr, socket_node* node);
 static int _socket_handle_client_data(socket_manager* mgr, socket_node* node);
+static socket_io* socket_io_get(socket_manager* mgr);
+static void socket_io_free(socket_io* io);
+static int socket_io_reserve(socket_io* io, int count);
+static void socket_poll_open(socket_manager* mgr, socket_io* io);
+static void socket_poll_add(socket_io* io, socket_node* node);
+static int socket_poll_wait(socket_manager* mgr, socket_io* io, int timeout);
 
 
 /* --------------------------------------------------------------------
@@ -106,6 +161,10 @@ static socket_node* _socket_add_node(socket_manager* mgr,
 
 	new_node->next			= mgr->socket;
 	mgr->socket				= new_node;
+
+	if(mgr->io)
+		socket_poll_add(mgr->io, new_node);
+
 	return new_node;
 }
 
@@ -474,6 +533,8 @@ static socket_node* socket_find_node(socket_manager* mgr, int sock_fd) {
 
 	This function does @em not close the socket.  It just removes a node from the list, and
 	frees it.  The disposition of the socket is the responsibility of the calling code.
+	Call it before closing the socket, so that the socket can still be unregistered from
+	the poller.
 */
 static void socket_remove_node(socket_manager* mgr, int sock_fd) {
 
@@ -481,6 +542,24 @@ static void socket_remove_node(socket_manager* mgr, int sock_fd) {
 
 	osrfLogDebug( OSRF_LOG_MARK, "removing socket %d", sock_fd);
 
+	socket_io* io = mgr->io;
+	if(io) {
+		int i;
+		for(i = 0; i < io->ready_count; ++i) {
+			if(io->ready[i] && io->ready[i]->sock_fd == sock_fd)
+				io->ready[i] = NULL;
+		}
+
+#if defined(OSRF_SOCKET_EPOLL)
+		/* An epoll descriptor inherited across fork() still belongs to our parent */
+		if(io->poll_fd >= 0 && io->poll_pid == getpid()) {
+			struct epoll_event ev;     // Ignored, but older kernels insist on it
+			memset(&ev, 0, sizeof(ev));
+			epoll_ctl(io->poll_fd, EPOLL_CTL_DEL, sock_fd, &ev);
+		}
+#endif
+	}
+
 	socket_node* head = mgr->socket;
 	socket_node* tail = head;
 	if(head == NULL) return;
@@ -566,6 +645,77 @@ static int _socket_send(int sock_fd, const char* data, int flags) {
 }
 
 
+/**
+	@brief Hold back, or release, partial TCP segments on a socket.
+	@param sock_fd The file descriptor for the socket.
+	@param cork Boolean: 1 to hold back partial segments, or 0 to send them.
+
+	Where the platform has no such option, or the socket isn't TCP, do nothing.
+*/
+static void socket_set_cork( int sock_fd, int cork ) {
+#if defined(TCP_CORK)
+	setsockopt( sock_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof( cork ) );
+#elif defined(TCP_NOPUSH)
+	setsockopt( sock_fd, IPPROTO_TCP, TCP_NOPUSH, &cork, sizeof( cork ) );
+#endif
+}
+
+/**
+	@brief Send a series of buffers over a socket, with as few system calls as possible.
+	@param sock_fd The file descriptor for the socket.
+	@param iov Pointer to an array of buffers to be sent, in order.
+	@param count Number of entries in @a iov.
+	@return 0 if successful, -1 if not.
+
+	Hand the buffers to writev(), at most IOV_MAX at a time, until they have all been sent.
+	If that takes more than one call, cork a TCP socket for the duration, so that the
+	calls don't leave any undersized segments behind them.
+
+	The contents of @a iov are updated as data is sent, and are of no further use to the
+	calling code.
+*/
+int socket_send_iov( int sock_fd, struct iovec* iov, int count ) {
+
+	signal(SIGPIPE, SIG_IGN); /* in case a unix socket was closed */
+
+	int corked = 0;
+	if( count > IOV_MAX ) {
+		socket_set_cork( sock_fd, 1 );
+		corked = 1;
+	}
+
+	int rc = 0;
+	while( count > 0 ) {
+		errno = 0;
+		ssize_t sent = writev( sock_fd, iov, count > IOV_MAX ? IOV_MAX : count );
+		if( sent < 0 ) {
+			if( errno == EINTR )
+				continue;
+			osrfLogWarning( OSRF_LOG_MARK, "socket_send_iov(): Error sending data: %s",
+				strerror( errno ));
+			rc = -1;
+			break;
+		}
+
+		// Skip past whatever went out, which may end in the middle of a buffer
+		while( count > 0 && (size_t) sent >= iov->iov_len ) {
+			sent -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if( count > 0 ) {
+			iov->iov_base = (char*) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	if( corked )
+		socket_set_cork( sock_fd, 0 );
+
+	return rc;
+}
+
+
 /* sends the given data to the given socket.
  * sets the send flag MSG_DONTWAIT which will allow the
  * process to continue even if the socket buffer is full
@@ -617,12 +767,12 @@ int socket_send_timeout( int sock_fd, const char* data, int usecs ) {
 	@param mgr Pointer to the socket_manager.
 	@param sock_fd File descriptor for the socket to be closed.
 
-	We close the socket before determining whether it belongs to the socket_manager in question.
+	We close the socket whether or not it belongs to the socket_manager in question.
 */
 void socket_disconnect(socket_manager* mgr, int sock_fd) {
 	osrfLogInternal( OSRF_LOG_MARK, "Closing socket %d", sock_fd);
-	close( sock_fd );
 	socket_remove_node(mgr, sock_fd);
+	close( sock_fd );
 }
 
 
@@ -666,8 +816,24 @@ int socket_connected(int sock_fd) {
 
 	If @a timeout is -1, wait indefinitely for input activity to appear.  If @a timeout is
 	zero, don't wait at all.  If @a timeout is positive, wait that number of seconds
-	before timing out.  If @a timeout has a negative value other than -1, the results are not
-	well defined, but we'll probably get an EINVAL error from select().
+	before timing out.  Any other negative value is treated like -1.
+
+	A thin wrapper for socket_wait_ms().
+*/
+int socket_wait( socket_manager* mgr, int timeout, int sock_fd ) {
+	return socket_wait_ms( mgr, timeout_secs_to_millis( timeout ), sock_fd );
+}
+
+/**
+	@brief Look for input on a given socket, waiting up to a given number of milliseconds.
+	@param mgr Pointer to the socket_manager that presumably owns the socket.
+	@param timeout Timeout interval, in milliseconds (see notes).
+	@param sock_fd The file descriptor to look at.
+	@return 0 if successful, or -1 if a timeout or other error occurs, or if the sender
+		closes the connection.
+
+	If @a timeout is negative, wait indefinitely for input activity to appear.  If
+	@a timeout is zero, don't wait at all.  Otherwise wait up to that many milliseconds.
 
 	If we detect activity, branch on the type of socket:
 
@@ -676,37 +842,25 @@ int socket_connected(int sock_fd) {
 	- Otherwise, read as much data as is available from the input socket, passing it a
 	buffer at a time to whatever callback function has been defined to the socket_manager.
 */
-int socket_wait( socket_manager* mgr, int timeout, int sock_fd ) {
+int socket_wait_ms( socket_manager* mgr, int timeout, int sock_fd ) {
 
 	int retval = 0;
-	fd_set read_set;
-	FD_ZERO( &read_set );
-	FD_SET( sock_fd, &read_set );
-
-	struct timeval tv;
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
+	struct pollfd pfd;
+	pfd.fd = sock_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 	errno = 0;
 
-	if( timeout < 0 ) {
-
-		// If timeout is -1, we block indefinitely
-		if( (retval = select( sock_fd + 1, &read_set, NULL, NULL, NULL)) == -1 ) {
-			osrfLogDebug( OSRF_LOG_MARK, "Call to select() interrupted: Sys Error: %s",
-					strerror(errno));
-			return -1;
-		}
-
-	} else if( timeout > 0 ) { /* timeout of 0 means don't block */
+	if( timeout != 0 ) { /* timeout of 0 means don't block */
 
-		if( (retval = select( sock_fd + 1, &read_set, NULL, NULL, &tv)) == -1 ) {
-			osrfLogDebug( OSRF_LOG_MARK, "Call to select() interrupted: Sys Error: %s",
+		if( (retval = poll( &pfd, 1, timeout < 0 ? -1 : timeout )) == -1 ) {
+			osrfLogDebug( OSRF_LOG_MARK, "Call to poll() interrupted: Sys Error: %s",
 					strerror(errno));
 			return -1;
 		}
 	}
 
-	osrfLogInternal( OSRF_LOG_MARK, "%d active sockets after select()", retval);
+	osrfLogInternal( OSRF_LOG_MARK, "%d active sockets after poll()", retval);
 
 	socket_node* node = socket_find_node(mgr, sock_fd);
 	if( node ) {
@@ -715,8 +869,8 @@ int socket_wait( socket_manager* mgr, int timeout, int sock_fd ) {
 		} else {
 			int status = _socket_handle_client_data( mgr, node );   // read data
 			if( status == -1 ) {
-				close( sock_fd );
 				socket_remove_node( mgr, sock_fd );
+				close( sock_fd );
 				return -1;
 			}
 		}
@@ -734,9 +888,25 @@ int socket_wait( socket_manager* mgr, int timeout, int sock_fd ) {
 	@return 0 if successful, or -1 if a timeout or other error occurs.
 
 	If @a timeout is -1, wait indefinitely for input activity to appear.  If @a timeout is
-	zero, don't wait at all.  If @a timeout is positive, wait that number of seconds
-	before timing out.  If @a timeout has a negative value other than -1, the results are not
-	well defined, but we'll probably get an EINVAL error from select().
+	zero, check for input without waiting.  If @a timeout is positive, wait that number of
+	seconds before timing out.  Any other negative value is treated like -1.
+
+	A thin wrapper for socket_wait_all_ms().
+*/
+int socket_wait_all(socket_manager* mgr, int timeout) {
+	return socket_wait_all_ms( mgr, timeout_secs_to_millis( timeout ) );
+}
+
+/**
+	@brief Wait for input on all of a socket_manager's sockets, up to a given number of
+	milliseconds; react to any input found.
+	@param mgr Pointer to the socket_manager.
+	@param timeout How many milliseconds to wait before timing out (see notes).
+	@return 0 if successful, or -1 if a timeout or other error occurs.
+
+	If @a timeout is negative, wait indefinitely for input activity to appear.  If
+	@a timeout is zero, check for input without waiting.  Otherwise wait up to that many
+	milliseconds.
 
 	For each active socket found:
 
@@ -745,81 +915,259 @@ int socket_wait( socket_manager* mgr, int timeout, int sock_fd ) {
 	- Otherwise, read as much data as is available from the input socket, passing it a
 	buffer at a time to whatever callback function has been defined to the socket_manager.
 */
-int socket_wait_all(socket_manager* mgr, int timeout) {
+int socket_wait_all_ms(socket_manager* mgr, int timeout) {
 
 	if(mgr == NULL) {
 		osrfLogWarning( OSRF_LOG_MARK,  "socket_wait_all(): null mgr" );
 		return -1;
 	}
 
-	int num_active = 0;
-	fd_set read_set;
-	FD_ZERO( &read_set );
+	socket_io* io = socket_io_get( mgr );
+	if( !io )
+		return -1;
 
-	socket_node* node = mgr->socket;
-	int max_fd = 0;
-	while(node) {
-		osrfLogInternal( OSRF_LOG_MARK, "Adding socket fd %d to select set",node->sock_fd);
-		FD_SET( node->sock_fd, &read_set );
-		if(node->sock_fd > max_fd) max_fd = node->sock_fd;
-		node = node->next;
+	errno = 0;
+	int num_active = socket_poll_wait( mgr, io, timeout < 0 ? -1 : timeout );
+	if( num_active == -1 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "poll call aborted: %s", strerror(errno));
+		return -1;
 	}
-	max_fd += 1;
 
-	struct timeval tv;
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
-	errno = 0;
+	osrfLogDebug( OSRF_LOG_MARK, "%d active sockets after poll", num_active);
 
-	if( timeout < 0 ) {
+	int i;
+	for( i = 0; i < io->ready_count; ++i ) {
 
-		// If timeout is -1, there is no timeout passed to the call to select
-		if( (num_active = select( max_fd, &read_set, NULL, NULL, NULL)) == -1 ) {
-			osrfLogWarning( OSRF_LOG_MARK, "select() call aborted: %s", strerror(errno));
-			return -1;
-		}
+		socket_node* node = io->ready[ i ];
+		if( !node )
+			continue;    /* someone yanked this socket_node out from under us */
 
-	} else if( timeout != 0 ) { /* timeout of 0 means don't block */
+		int sock_fd = node->sock_fd;
+		osrfLogInternal( OSRF_LOG_MARK, "Socket %d active", sock_fd);
 
-		if( (num_active = select( max_fd, &read_set, NULL, NULL, &tv)) == -1 ) {
-			osrfLogWarning( OSRF_LOG_MARK, "select() call aborted: %s", strerror(errno));
-			return -1;
+		if(node->endpoint == LISTENER_SOCKET)
+			_socket_handle_new_client(mgr, node);
+
+		else {
+			if( _socket_handle_client_data(mgr, node) == -1 ) {
+				socket_remove_node( mgr, sock_fd );
+				close( sock_fd );
+			}
 		}
 	}
+	io->ready_count = 0;
+
+	return 0;
+}
+
+/**
+	@brief Fetch a socket_manager's read buffer and poller, creating them if necessary.
+	@param mgr Pointer to the socket_manager.
+	@return Pointer to the socket_io, or NULL if memory runs out.
+*/
+static socket_io* socket_io_get(socket_manager* mgr) {
+	if( mgr->io )
+		return mgr->io;
+
+	socket_io* io = safe_malloc( sizeof( socket_io ) );
+	io->rbuf = malloc( RBUFSIZE );
+	if( !io->rbuf ) {
+		free( io );
+		return NULL;
+	}
+	io->rbuf_size = RBUFSIZE;
+	io->poll_fd = -1;
+	mgr->io = io;
+	return io;
+}
 
-	osrfLogDebug( OSRF_LOG_MARK, "%d active sockets after select()", num_active);
+/**
+	@brief Free a socket_io, closing its epoll descriptor if it has one.
+	@param io Pointer to the socket_io to be freed.
+*/
+static void socket_io_free(socket_io* io) {
+	if( !io )
+		return;
+#if defined(OSRF_SOCKET_EPOLL)
+	if( io->poll_fd >= 0 )
+		close( io->poll_fd );
+#endif
+	free( io->rbuf );
+	free( io->pollfds );
+	free( io->ready );
+	free( io );
+}
 
-	node = mgr->socket;
-	int handled = 0;
+/**
+	@brief Make sure that the ready list (and the poll() array) can hold a given number of
+	entries.
+	@param io Pointer to the socket_io.
+	@param count The number of entries needed.
+	@return 0 if successful, or -1 if memory runs out.
+*/
+static int socket_io_reserve(socket_io* io, int count) {
+	if( count <= io->ready_size )
+		return 0;
 
-	while(node && (handled < num_active)) {
+	int size = io->ready_size ? io->ready_size : SOCKET_MAX_EVENTS;
+	while( size < count )
+		size *= 2;
 
-		socket_node* next_node = node->next;
-		int sock_fd = node->sock_fd;
+	socket_node** ready = realloc( io->ready, size * sizeof( socket_node* ) );
+	if( !ready )
+		return -1;
+	io->ready = ready;
+
+	struct pollfd* pollfds = realloc( io->pollfds, size * sizeof( struct pollfd ) );
+	if( !pollfds )
+		return -1;
+	io->pollfds = pollfds;
 
-		/* does this socket have data? */
-		if( FD_ISSET( sock_fd, &read_set ) ) {
+	io->ready_size = size;
+	return 0;
+}
 
-			osrfLogInternal( OSRF_LOG_MARK, "Socket %d active", sock_fd);
-			handled++;
-			FD_CLR(sock_fd, &read_set);
+/**
+	@brief Open an epoll descriptor, and register every socket we already have with it.
+	@param mgr Pointer to the socket_manager.
+	@param io Pointer to the socket_manager's socket_io.
 
-			if(node->endpoint == LISTENER_SOCKET)
-				_socket_handle_new_client(mgr, node);
+	If we're in a child of the process that opened the current descriptor, open a new one.
+	The old one is shared with the parent, and so is its list of registered sockets.
 
-			else {
-				if( _socket_handle_client_data(mgr, node) == -1 ) {
-					/* someone may have yanked a socket_node out from under us */
-					close( sock_fd );
-					socket_remove_node( mgr, sock_fd );
-				}
-			}
+	If there's no epoll, or it lets us down, leave poll_fd at -1; we'll use poll() instead.
+*/
+static void socket_poll_open(socket_manager* mgr, socket_io* io) {
+#if defined(OSRF_SOCKET_EPOLL)
+	if( io->use_poll )
+		return;
+
+	pid_t pid = getpid();
+	if( io->poll_fd >= 0 ) {
+		if( io->poll_pid == pid )
+			return;
+		close( io->poll_fd );   /* inherited from our parent */
+	}
+
+	io->poll_fd = epoll_create( SOCKET_MAX_EVENTS );
+	if( io->poll_fd < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to open epoll, falling back to poll(): %s",
+			strerror( errno ) );
+		io->poll_fd = -1;
+		io->use_poll = 1;
+		return;
+	}
+	io->poll_pid = pid;
+
+	socket_node* node = mgr->socket;
+	while( node ) {
+		socket_poll_add( io, node );
+		node = node->next;
+	}
+#endif
+}
+
+/**
+	@brief Register a socket with the epoll descriptor, if there is one.
+	@param io Pointer to the socket_io.
+	@param node Pointer to the socket_node for the socket to be watched.
+
+	Without epoll there's nothing to do, since we build the poll() array afresh on each
+	wait.
+*/
+static void socket_poll_add(socket_io* io, socket_node* node) {
+#if defined(OSRF_SOCKET_EPOLL)
+	if( io->poll_fd < 0 || io->poll_pid != getpid() )
+		return;     /* socket_poll_open() will register it */
+
+	struct epoll_event ev;
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.ptr = node;
+	if( epoll_ctl( io->poll_fd, EPOLL_CTL_ADD, node->sock_fd, &ev ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to register socket %d with epoll: %s",
+			node->sock_fd, strerror( errno ) );
+		close( io->poll_fd );   /* poll() will see all of the sockets */
+		io->poll_fd = -1;
+		io->use_poll = 1;
+	}
+#endif
+}
+
+/**
+	@brief Wait for input on any of a socket_manager's sockets.
+	@param mgr Pointer to the socket_manager.
+	@param io Pointer to the socket_manager's socket_io.
+	@param timeout Timeout in milliseconds: -1 to wait forever, or 0 not to wait.
+	@return The number of sockets with input, or -1 on error (with errno set).
+
+	Load the ready list with the socket_nodes whose sockets have input.  A socket that
+	reports a hangup or error counts as having input, so that reading it will notice the
+	problem and close it.
+*/
+static int socket_poll_wait(socket_manager* mgr, socket_io* io, int timeout) {
+
+	io->ready_count = 0;
+	socket_poll_open( mgr, io );
+
+#if defined(OSRF_SOCKET_EPOLL)
+	if( io->poll_fd >= 0 ) {
+		if( socket_io_reserve( io, SOCKET_MAX_EVENTS ) ) {
+			errno = ENOMEM;
+			return -1;
 		}
 
-		node = next_node;
-	} // is_set
+		struct epoll_event events[ SOCKET_MAX_EVENTS ];
+		int count = epoll_wait( io->poll_fd, events, SOCKET_MAX_EVENTS, timeout );
+		int i;
+		for( i = 0; i < count; ++i )
+			io->ready[ io->ready_count++ ] = events[ i ].data.ptr;
+		return count;
+	}
+#endif
 
-	return 0;
+	int nfds = 0;
+	socket_node* node = mgr->socket;
+	while( node ) {
+		++nfds;
+		node = node->next;
+	}
+
+	if( socket_io_reserve( io, nfds ) ) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	int i = 0;
+	for( node = mgr->socket; node; node = node->next ) {
+		osrfLogInternal( OSRF_LOG_MARK, "Adding socket fd %d to poll set", node->sock_fd);
+		io->pollfds[ i ].fd = node->sock_fd;
+		io->pollfds[ i ].events = POLLIN;
+		io->pollfds[ i ].revents = 0;
+		++i;
+	}
+
+	int count = poll( io->pollfds, nfds, timeout );
+	if( count <= 0 )
+		return count;
+
+	/* The list is unchanged since we built the array, so the two still line up */
+	for( i = 0, node = mgr->socket; node && i < nfds; ++i, node = node->next ) {
+		short revents = io->pollfds[ i ].revents;
+		if( revents && !( revents & POLLNVAL ) )
+			io->ready[ io->ready_count++ ] = node;
+	}
+
+	/* Drop any sockets that have been closed behind our back; they'd never go quiet */
+	for( i = 0; i < nfds; ++i ) {
+		if( io->pollfds[ i ].revents & POLLNVAL ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Removing socket %d, which is not open",
+				io->pollfds[ i ].fd );
+			socket_remove_node( mgr, io->pollfds[ i ].fd );
+		}
+	}
+
+	return count;
 }
 
 /**
@@ -865,6 +1213,10 @@ static int _socket_handle_new_client(socket_manager* mgr, socket_node* node) {
 	terminal nul to each buffer and pass it to a callback function previously defined by the
 	application to the socket_manager.
 
+	Whenever a read fills the buffer, double its size (up to RBUFSIZE_MAX) before reading
+	again.  After RBUF_SHRINK_READS reads in a row that use less than a quarter of it,
+	halve it (down to RBUFSIZE).
+
 	If the sender closes the connection, call another callback function, if one has been
 	defined.
 
@@ -877,7 +1229,9 @@ static int _socket_handle_new_client(socket_manager* mgr, socket_node* node) {
 static int _socket_handle_client_data(socket_manager* mgr, socket_node* node) {
 	if(mgr == NULL || node == NULL) return -1;
 
-	char buf[RBUFSIZE];
+	socket_io* io = socket_io_get(mgr);
+	if(io == NULL) return -1;
+
 	int read_bytes;
 	int sock_fd = node->sock_fd;
 
@@ -886,12 +1240,35 @@ static int _socket_handle_client_data(socket_manager* mgr, socket_node* node) {
 	osrfLogInternal( OSRF_LOG_MARK, "%ld : Received data at %f\n",
 			(long) getpid(), get_timestamp_millis());
 
-	while( (read_bytes = recv(sock_fd, buf, RBUFSIZE-1, 0) ) > 0 ) {
-		buf[read_bytes] = '\0';
+	while( (read_bytes = recv(sock_fd, io->rbuf, io->rbuf_size - 1, 0) ) > 0 ) {
+		io->rbuf[read_bytes] = '\0';
 		osrfLogInternal( OSRF_LOG_MARK, "Socket %d Read %d bytes and data: %s",
-				sock_fd, read_bytes, buf);
+				sock_fd, read_bytes, io->rbuf);
+		mgr->data_len = read_bytes;
 		if(mgr->data_received)
-			mgr->data_received(mgr->blob, mgr, sock_fd, buf, node->parent_id);
+			mgr->data_received(mgr->blob, mgr, sock_fd, io->rbuf, node->parent_id);
+
+		/* Fit the buffer to the traffic we're seeing */
+		size_t new_size = 0;
+		if( (size_t) read_bytes == io->rbuf_size - 1 ) {
+			io->small_reads = 0;
+			if( io->rbuf_size < RBUFSIZE_MAX )
+				new_size = io->rbuf_size * 2;
+		} else if( (size_t) read_bytes < io->rbuf_size / 4 && io->rbuf_size > RBUFSIZE ) {
+			if( ++io->small_reads >= RBUF_SHRINK_READS ) {
+				io->small_reads = 0;
+				new_size = io->rbuf_size / 2;
+			}
+		} else
+			io->small_reads = 0;
+
+		if( new_size ) {
+			char* rbuf = realloc( io->rbuf, new_size );
+			if( rbuf ) {    /* if not, carry on with what we have */
+				io->rbuf = rbuf;
+				io->rbuf_size = new_size;
+			}
+		}
 	}
 	int local_errno = errno; /* capture errno as set by recv() */
 
@@ -930,6 +1307,7 @@ void socket_manager_free(socket_manager* mgr) {
 		socket_disconnect(mgr, mgr->socket->sock_fd);
 		mgr->socket = tmp;
 	}
+	socket_io_free(mgr->io);
 	free(mgr);
 
 }
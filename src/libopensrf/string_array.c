@@ -7,9 +7,17 @@
 	a layer of malloc() and free().
 
 	Operations on the osrfList are restricted so as not to leave NULL pointers in the middle.
+
+	For membership tests on a bigger array, osrfStringArrayContains() keeps an osrfHash
+	whose keys are the strings, built when first needed.  Adding a string adds it to the
+	index as well; removing, clearing, or swapping drops the index, to be rebuilt by the
+	next search.
 */
 
 #include <opensrf/string_array.h>
+#include <opensrf/osrf_hash.h>
+
+static void drop_index( osrfStringArray* arr );
 
 /**
 	@brief Create and initialize an osrfStringArray.
@@ -29,22 +37,9 @@ osrfStringArray* osrfNewStringArray(int size) {
 	osrfStringArray* arr;
 	OSRF_MALLOC(arr, sizeof(osrfStringArray));
 	arr->size = 0;
+	arr->index = NULL;
 
-	// Initialize list
-	arr->list.size = 0;
-	arr->list.freeItem = NULL;
-	if( size <= 0 )
-		arr->list.arrsize = 16;
-	else
-		arr->list.arrsize = size;
-	OSRF_MALLOC( arr->list.arrlist, arr->list.arrsize * sizeof(void*) );
-
-	// Nullify all pointers in the array
-
-	int i;
-	for( i = 0; i < arr->list.arrsize; ++i )
-		arr->list.arrlist[ i ] = NULL;
-
+	osrfListInit( &arr->list, size > 0 ? size : 0 );
 	osrfListSetDefaultFree(&arr->list);
 	return arr;
 }
@@ -62,8 +57,11 @@ void osrfStringArrayAdd( osrfStringArray* arr, const char* string ) {
 	if(arr == NULL || string == NULL ) return;
 	if( arr->list.size > STRING_ARRAY_MAX_SIZE )
 		osrfLogError( OSRF_LOG_MARK, "osrfStringArrayAdd size is too large" );
-    osrfListPush(&arr->list, strdup(string));
+	char* str = strdup(string);
+    osrfListPush(&arr->list, str);
     arr->size = arr->list.size;
+	if( arr->index )
+		osrfHashSet( arr->index, str, "%s", str );
 }
 
 /**
@@ -84,6 +82,7 @@ const char* osrfStringArrayGetString( const osrfStringArray* arr, int index ) {
 */
 void osrfStringArrayClear( osrfStringArray* arr ) {
 	if( arr ) {
+		drop_index( arr );
 		osrfListClear( &arr->list );
 		arr->size = 0;
 	}
@@ -106,6 +105,9 @@ void osrfStringArraySwap( osrfStringArray* one, osrfStringArray* two ) {
 		int temp = one->size;
 		one->size = two->size;
 		two->size = temp;
+		struct _osrfHashStruct* index = one->index;
+		one->index = two->index;
+		two->index = index;
 	}
 }
 
@@ -117,19 +119,28 @@ void osrfStringArrayFree(osrfStringArray* arr) {
 
 	// This function is a sleazy hack designed to avoid the
 	// need to duplicate the code in osrfListFree().  It
-	// works because:
+	// works because the osrfList is the first member of an
+	// osrfStringArray.  C guarantees that a pointer to the
+	// one is also a pointer to the other.
 	//
-	// 1. The osrfList is the first member of an
-	//    osrfStringArray.  C guarantees that a pointer
-	//    to the one is also a pointer to the other.
-	//
-	// 2. The rest of the osrfStringArray owns no memory
-	//    and requires no special attention when freeing.
-	//
-	// If these facts ever cease to be true, we'll have to
-	// revisit this function.
+	// The only other memory the osrfStringArray owns is
+	// the index, which we free first.
 
-	osrfListFree( (osrfList*) arr );
+	if( arr ) {
+		drop_index( arr );
+		osrfListFree( (osrfList*) arr );
+	}
+}
+
+/**
+	@brief Discard the index of an osrfStringArray, if it has one.
+	@param arr Pointer to the osrfStringArray.
+*/
+static void drop_index( osrfStringArray* arr ) {
+	if( arr->index ) {
+		osrfHashFree( arr->index );
+		arr->index = NULL;
+	}
 }
 
 /**
@@ -139,10 +150,29 @@ void osrfStringArrayFree(osrfStringArray* arr) {
 	@return A boolean: 1 if the string is present in the osrfStringArray, or 0 if it isn't.
 
 	The search is case-sensitive.
+
+	For an array of more than STRING_ARRAY_INDEX_MIN strings, the first search builds an
+	index, which later searches use until the array is changed.  So although the array is
+	const, sharing it between threads calls for a lock.
 */
 int osrfStringArrayContains(
 	const osrfStringArray* arr, const char* string ) {
 	if(!(arr && string)) return 0;
+
+	if( arr->index || arr->size > STRING_ARRAY_INDEX_MIN ) {
+		osrfStringArray* self = (osrfStringArray*) arr;  // the index is a cache
+		if( ! self->index ) {
+			self->index = osrfNewHash();
+			int j;
+			for( j = 0; j < arr->size; j++ ) {
+				char* str = OSRF_LIST_GET_INDEX(&arr->list, j);
+				if( str )
+					osrfHashSet( self->index, str, "%s", str );
+			}
+		}
+		return osrfHashGet( self->index, string ) ? 1 : 0;
+	}
+
 	int i;
 	for( i = 0; i < arr->size; i++ ) {
         char* str = OSRF_LIST_GET_INDEX(&arr->list, i);
@@ -177,6 +207,8 @@ void osrfStringArrayRemove( osrfStringArray* arr, const char* tstr ) {
 	if( ! removed )
 		return;         // Nothing was removed
 
+	drop_index( arr );  // there may be another copy, so don't just delete the key
+
     /* disable automatic item freeing on delete, and shift
      * items down in the array to fill in the gap
      */
@@ -1,4 +1,7 @@
+#include <errno.h>
+#include <poll.h>
 #include <opensrf/transport_client.h>
+#include <opensrf/transport_shm.h>
 
 /**
 	@file transport_client.c
@@ -8,9 +11,14 @@
 	two main purposes:
 	- They remember a Jabber ID to use when sending messages.
 	- They maintain a queue of input messages that the calling code can get one at a time.
+
+	Optionally (see client_set_shm()) messages to and from other processes on the same
+	host bypass Jabber, by way of shared memory.
 */
 
 static void client_message_handler( void* client, transport_message* msg );
+static int client_wait_ms( transport_client* client, int timeout );
+static void client_drain_shm( transport_client* client );
 
 //int main( int argc, char** argv );
 
@@ -88,6 +96,9 @@ transport_client* client_init( const char* server, int port, const char* unix_pa
 	client->error = 0;
 	client->host = strdup(server);
 	client->xmpp_id = NULL;
+	client->shm = NULL;
+	client->shm_listen = 0;
+	client->locality = NULL;
 
 	return client;
 }
@@ -129,8 +140,16 @@ int client_connect( transport_client* client,
 	client->xmpp_id = va_list_to_string( "%s@%s/%s", username, client->host, resource );
 
 	// Open a transport_session
-	return session_connect( client->session, username,
+	int rc = session_connect( client->session, username,
 			password, resource, connect_timeout, auth_type );
+
+	if( rc && client->shm_listen && -1 == transport_shm_fd( client->shm ) ) {
+		if( transport_shm_listen( client->shm, client->xmpp_id ) )
+			osrfLogWarning( OSRF_LOG_MARK,
+				"Receiving only through Jabber; no shared memory ring for %s", client->xmpp_id );
+	}
+
+	return rc;
 }
 
 /**
@@ -167,9 +186,11 @@ int client_connected( const transport_client* client ) {
 int client_send_message( transport_client* client, transport_message* msg ) {
 	if( client == NULL || client->error )
 		return -1;
-	if( msg->sender )
-		free( msg->sender );
-	msg->sender = strdup(client->xmpp_id);
+	message_set_sender( msg, client->xmpp_id );
+	if( client->locality && !msg->osrf_locality )
+		message_set_osrf_locality( msg, client->locality );
+	if( client->shm && transport_shm_send( client->shm, msg ) )
+		return 0;
 	return session_send_msg( client->session, msg );
 }
 
@@ -188,12 +209,30 @@ int client_send_message( transport_client* client, transport_message* msg ) {
 	don't wait at all.
 
 	The calling code is responsible for freeing the transport_message by calling message_free().
+
+	A thin wrapper for client_recv_ms().
 */
 transport_message* client_recv( transport_client* client, int timeout ) {
+	return client_recv_ms( client, timeout_secs_to_millis( timeout ) );
+}
+
+/**
+	@brief Fetch an input message, waiting up to a given number of milliseconds.
+	@param client Pointer to a transport_client.
+	@param timeout How long to wait for a message to arrive, in milliseconds: negative to wait
+		indefinitely, or zero not to wait at all.
+	@return A pointer to a transport_message if successful, or NULL if not.
+
+	Otherwise the same as client_recv().  Time is measured with a monotonic clock, so that
+	the timeout isn't thrown off if someone sets the system clock.
+*/
+transport_message* client_recv_ms( transport_client* client, int timeout ) {
 	if( client == NULL ) { return NULL; }
 
 	int error = 0;  /* boolean */
 
+	client_drain_shm( client );
+
 	if( NULL == client->msg_q_head ) {
 
 		// No message available on the queue?  Try to get a fresh one.
@@ -215,35 +254,32 @@ transport_message* client_recv( transport_client* client, int timeout ) {
 		// Likewise we could time out while still receiving the second or subsequent message,
 		// return the first message, and resume receiving messages later.
 
-		if( timeout == -1 ) {  /* wait potentially forever for data to arrive */
+		if( timeout < 0 ) {  /* wait potentially forever for data to arrive */
 
 			int x;
 			do {
-				if( (x = session_wait( client->session, -1 )) ) {
+				if( (x = client_wait_ms( client, -1 )) ) {
 					osrfLogDebug(OSRF_LOG_MARK, "session_wait returned failure code %d\n", x);
 					error = 1;
 					break;
 				}
 			} while( client->msg_q_head == NULL );
 
-		} else {    /* loop up to 'timeout' seconds waiting for data to arrive  */
+		} else {    /* loop up to 'timeout' milliseconds waiting for data to arrive  */
 
-			/* This loop assumes that a time_t is denominated in seconds -- not */
-			/* guaranteed by Standard C, but a fair bet for Linux or UNIX       */
-
-			time_t start = time(NULL);
-			time_t remaining = (time_t) timeout;
+			long long deadline = get_monotonic_millis() + timeout;
+			long long remaining = timeout;
 
 			int wait_ret;
 			do {
-				if( (wait_ret = session_wait( client->session, (int) remaining)) ) {
+				if( (wait_ret = client_wait_ms( client, (int) remaining)) ) {
 					error = 1;
 					osrfLogDebug(OSRF_LOG_MARK,
 						"session_wait returned failure code %d: setting error=1\n", wait_ret);
 					break;
 				}
 
-				remaining -= time(NULL) - start;
+				remaining = deadline - get_monotonic_millis();
 			} while( NULL == client->msg_q_head && remaining > 0 );
 		}
 	}
@@ -262,6 +298,59 @@ transport_message* client_recv( transport_client* client, int timeout ) {
 	return msg;
 }
 
+/**
+	@brief Wait for input from Jabber or, if we're listening, from shared memory.
+	@param client Pointer to the transport_client.
+	@param timeout How many milliseconds to wait: negative to wait indefinitely, or zero
+		not to wait at all.
+	@return 0 if successful, or -1 if a timeout or other error occurs.
+
+	Without a shared memory ring this is just session_wait_ms().  Otherwise poll both the
+	Jabber socket and the ring's doorbell, then read whichever is ready.
+*/
+static int client_wait_ms( transport_client* client, int timeout ) {
+	int bell_fd = transport_shm_fd( client->shm );
+	if( bell_fd < 0 )
+		return session_wait_ms( client->session, timeout );
+
+	struct pollfd fds[ 2 ];
+	fds[ 0 ].fd = client->session->sock_id;
+	fds[ 0 ].events = POLLIN;
+	fds[ 0 ].revents = 0;
+	fds[ 1 ].fd = bell_fd;
+	fds[ 1 ].events = POLLIN;
+	fds[ 1 ].revents = 0;
+
+	int rc = 0;
+	if( ! transport_shm_sleep( client->shm ) )
+		rc = poll( fds, 2, timeout );
+	transport_shm_wake( client->shm );
+
+	if( rc < 0 && errno != EINTR ) {
+		osrfLogWarning( OSRF_LOG_MARK, "poll() failed waiting for messages: %s",
+			strerror( errno ) );
+		return -1;
+	}
+
+	int ret = 0;
+	if( fds[ 0 ].revents )
+		ret = session_wait_ms( client->session, 0 );
+	client_drain_shm( client );
+	return ret;
+}
+
+/**
+	@brief Move any messages waiting in our shared memory ring onto the message queue.
+	@param client Pointer to the transport_client.
+*/
+static void client_drain_shm( transport_client* client ) {
+	if( client->shm_listen ) {
+		transport_message* msg;
+		while( (msg = transport_shm_recv( client->shm )) )
+			client_message_handler( client, msg );
+	}
+}
+
 /**
 	@brief Enqueue a newly received transport_message.
 	@param client A pointer to a transport_client, cast to a void pointer.
@@ -302,6 +391,8 @@ int client_free( transport_client* client ) {
 		return 0;
 	session_free( client->session );
 	client->session = NULL;
+	transport_shm_free( client->shm, 1 );
+	client->shm = NULL;
 	return client_discard( client );
 }
 
@@ -328,8 +419,10 @@ int client_discard( transport_client* client ) {
 		current = next;
 	}
 
+	transport_shm_free( client->shm, 0 );
 	free(client->host);
 	free(client->xmpp_id);
+	free(client->locality);
 	free( client );
 	return 1;
 }
@@ -341,3 +434,140 @@ int client_sock_fd( transport_client* client )
 	else
 		return client->session->sock_id;
 }
+
+/**
+	@brief Turn on or off capturing the encoded body of each incoming message.
+	@param client Pointer to the transport_client.
+	@param keep Boolean; true to populate body_xml in received transport_messages.
+
+	See session_keep_body_xml().
+*/
+void client_keep_body_xml( transport_client* client, int keep )
+{
+	if( client )
+		session_keep_body_xml( client->session, keep );
+}
+
+/**
+	@brief Ask for compression of the stream to Jabber on the next client_connect().
+	@param client Pointer to the transport_client.
+	@param compress Boolean; true to ask for compression.
+
+	See session_set_compression().
+*/
+void client_set_compression( transport_client* client, int compress )
+{
+	if( client )
+		session_set_compression( client->session, compress );
+}
+
+/**
+	@brief Tell routers where we run, so that they can prefer listeners nearby.
+	@param client Pointer to the transport_client.
+	@param locality A tag such as a host, rack or zone name; NULL or empty for none.
+
+	Every message we send from now on carries the tag in its "osrf_locality" attribute.
+	A listener also advertises it when it registers with a router.
+*/
+void client_set_locality( transport_client* client, const char* locality )
+{
+	if( !client )
+		return;
+	free( client->locality );
+	client->locality = locality && *locality ? strdup( locality ) : NULL;
+}
+
+/**
+	@brief Send messages to other processes on the same host through shared memory.
+	@param client Pointer to the transport_client.
+	@param dir Directory holding the shared memory rings, preferably on tmpfs.
+	@param listen Boolean; true to receive through a ring of our own as well.
+	@return 0 if successful, or -1 if not.
+
+	Call before client_connect(); the ring, if any, is created under our Jabber ID when
+	we connect.  Jabber remains the fallback for everything the rings can't carry.  A
+	client that listens must receive only through client_recv() or client_recv_ms(),
+	not by waiting on client_sock_fd() by itself.
+
+	See transport_shm.c for the details.
+*/
+int client_set_shm( transport_client* client, const char* dir, int listen )
+{
+	if( client == NULL || client->shm || dir == NULL )
+		return -1;
+	client->shm = transport_shm_init( dir, 0 );
+	if( client->shm == NULL )
+		return -1;
+	client->shm_listen = listen ? 1 : 0;
+	return 0;
+}
+
+/**
+	@brief Stop receiving through shared memory, removing our ring and doorbell.
+	@param client Pointer to the transport_client.
+
+	For a process about to exit without calling client_free(), such as a drone, so that
+	its files don't outlive it.  Messages still in the ring are lost, as they would be
+	anyway.  From then on everything goes through Jabber.
+*/
+void client_close_shm( transport_client* client )
+{
+	if( !client )
+		return;
+	transport_shm_free( client->shm, 1 );
+	client->shm = NULL;
+	client->shm_listen = 0;
+}
+
+/**
+	@brief Remove the shared memory files of processes that died without cleaning up.
+	@param client Pointer to the transport_client.
+	@return The number of rings removed.
+
+	See transport_shm_sweep().
+*/
+int client_sweep_shm( transport_client* client )
+{
+	return client ? transport_shm_sweep( client->shm ) : 0;
+}
+
+/**
+	@brief Hold back outgoing messages, to be sent together by client_uncork().
+	@param client Pointer to the transport_client.
+
+	See session_cork().
+*/
+void client_cork( transport_client* client )
+{
+	if( client )
+		session_cork( client->session );
+}
+
+/**
+	@brief Undo a call to client_cork(), sending the held messages if it's the outermost one.
+	@param client Pointer to the transport_client.
+	@return 0 if successful, or -1 if not.
+
+	See session_uncork().
+*/
+int client_uncork( transport_client* client )
+{
+	if( client == NULL )
+		return -1;
+	return session_uncork( client->session );
+}
+
+/**
+	@brief Send whatever client_cork() has held back, without undoing it.
+	@param client Pointer to the transport_client.
+	@return 0 if successful, or -1 if not.
+
+	For a sender about to wait on its peer, which mustn't sit on messages the peer is
+	waiting for.  See session_flush().
+*/
+int client_flush( transport_client* client )
+{
+	if( client == NULL )
+		return -1;
+	return session_flush( client->session );
+}
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <opensrf/transport_message.h>
 
 /**
@@ -6,7 +7,232 @@
 
 	These routines are largely concerned with the conversion of XML to transport_messages,
 	and vice versa.
+
+	Each transport_message is allocated together with a block of room for its header
+	strings: sender, recipient, thread, and so on.  Most messages fit their headers
+	there, so that building or parsing one takes a single allocation instead of a dozen.
+	A header that doesn't fit, or that replaces an earlier value, gets its own allocation
+	as before.  Freed messages go back to a small per-thread pool for reuse.
+*/
+
+/** @brief Bytes of room for header strings in the block allocated with each message. */
+#define MESSAGE_STRINGS_SIZE 768
+
+/** @brief Most freed messages to keep for reuse, per thread. */
+#define MESSAGE_POOL_MAX 64
+
+/**
+	@brief A transport_message together with storage for its header strings.
+
+	The message comes first, so that a pointer to the message is a pointer to the block,
+	and so that code that calls free() directly on a transport_message still works.
+*/
+typedef struct {
+	transport_message msg;                 /**< The message proper. */
+	size_t strings_used;                   /**< Bytes of strings[] in use. */
+	char strings[ MESSAGE_STRINGS_SIZE ];  /**< Header strings, packed end to end. */
+} message_block;
+
+/** @brief Freed message_blocks available for reuse, linked through msg.next. */
+static __thread transport_message* message_pool = NULL;
+
+/** @brief Number of message_blocks in message_pool. */
+static __thread int message_pool_count = 0;
+
+static transport_message* message_alloc( void );
+static char* message_strdup( transport_message* msg, const char* text );
+static void message_strfree( transport_message* msg, char* text );
+static void message_replace( transport_message* msg, char** member, const char* text );
+static void message_readdress( transport_message* msg, char** member, const char* jid );
+
+/**
+	@brief Reference-counted storage for the text of a message body.
+
+	Message bodies are stored this way so that several transport_messages can share one
+	copy, as when the router keeps the last message sent to each node in case it
+	bounces.  A transport_message points both to the transport_text (to manage it) and
+	to the text itself (for readers, who see an ordinary nul-terminated string).
+
+	Usually the text follows the header in the same allocation.  Text adopted from
+	elsewhere, such as a parser's buffer, is allocated separately, which saves copying it.
+*/
+struct transport_text_struct {
+	int refcount;         /**< How many transport_messages point to this text. */
+	char* text;           /**< The nul-terminated text: either inline_text, or adopted. */
+	char inline_text[];   /**< The text, when it was copied in. */
+};
+
+static transport_text* text_new( const char* text, size_t len );
+static transport_text* text_adopt( char* text );
+static transport_text* text_ref( transport_text* t );
+static void text_unref( transport_text* t );
+
+/**
+	@brief Allocate a reference-counted copy of a string.
+	@param text Pointer to the text to be copied (need not be nul-terminated).
+	@param len Number of bytes to copy.
+	@return Pointer to a new transport_text, with a reference count of one.
+*/
+static transport_text* text_new( const char* text, size_t len ) {
+	transport_text* t = safe_malloc( sizeof( transport_text ) + len + 1 );
+	t->refcount = 1;
+	t->text = t->inline_text;
+	memcpy( t->inline_text, text, len );
+	t->inline_text[ len ] = '\0';
+	return t;
+}
+
+/**
+	@brief Wrap a malloc'ed string in a transport_text, without copying it.
+	@param text Pointer to the nul-terminated string, which the transport_text takes over.
+	@return Pointer to a new transport_text, with a reference count of one.
+*/
+static transport_text* text_adopt( char* text ) {
+	transport_text* t = safe_malloc( sizeof( transport_text ) );
+	t->refcount = 1;
+	t->text = text;
+	return t;
+}
+
+/**
+	@brief Add a reference to a transport_text.
+	@param t Pointer to the transport_text, or NULL.
+	@return The same pointer.
+
+	The count is updated atomically, since messages may be passed between threads.
 */
+static transport_text* text_ref( transport_text* t ) {
+	if( t )
+		__sync_add_and_fetch( &t->refcount, 1 );
+	return t;
+}
+
+/**
+	@brief Drop a reference to a transport_text.
+	@param t Pointer to the transport_text, or NULL.
+
+	Free the text when the last reference goes away.
+*/
+static void text_unref( transport_text* t ) {
+	if( t && 0 == __sync_sub_and_fetch( &t->refcount, 1 ) ) {
+		if( t->text != t->inline_text )
+			free( t->text );
+		free( t );
+	}
+}
+
+/**
+	@brief Get a blank transport_message, from the pool if possible.
+	@return Pointer to a transport_message with every member zeroed or NULL.
+*/
+static transport_message* message_alloc( void ) {
+	message_block* block;
+	if( message_pool ) {
+		block = (message_block*) message_pool;
+		message_pool = message_pool->next;
+		--message_pool_count;
+	} else
+		block = safe_malloc( sizeof( message_block ) );
+
+	memset( &block->msg, 0, sizeof( block->msg ) );
+	block->strings_used = 0;
+	return &block->msg;
+}
+
+/**
+	@brief Copy a header string into a message's string block, if it fits.
+	@param msg Pointer to the transport_message that will own the copy.
+	@param text The string to be copied.
+	@return Pointer to the copy, which is in the block or else allocated by strdup().
+
+	Release the copy with message_strfree(), not free().
+*/
+static char* message_strdup( transport_message* msg, const char* text ) {
+	message_block* block = (message_block*) msg;
+	size_t len = strlen( text ) + 1;
+	if( len > MESSAGE_STRINGS_SIZE - block->strings_used )
+		return strdup( text );
+
+	char* copy = block->strings + block->strings_used;
+	memcpy( copy, text, len );
+	block->strings_used += len;
+	return copy;
+}
+
+/**
+	@brief Release a header string from message_strdup().
+	@param msg Pointer to the transport_message that owns the string.
+	@param text Pointer to the string, or NULL.
+
+	Strings in the message's block stay where they are until the message is freed.
+*/
+static void message_strfree( transport_message* msg, char* text ) {
+	message_block* block = (message_block*) msg;
+	if( text && ( text < block->strings || text >= block->strings + MESSAGE_STRINGS_SIZE ) )
+		free( text );
+}
+
+/**
+	@brief Replace one of a message's header strings.
+	@param msg Pointer to the transport_message.
+	@param member Pointer to the member to be replaced.
+	@param text The new value, which is copied.
+*/
+static void message_replace( transport_message* msg, char** member, const char* text ) {
+	message_strfree( msg, *member );
+	*member = message_strdup( msg, text );
+}
+
+/**
+	@brief Change the sender or recipient of a message.
+	@param msg Pointer to the transport_message.
+	@param member Pointer to the sender or recipient member.
+	@param jid The new Jabber ID.
+
+	If the value really changes, any XML already built for the message is stale, so
+	discard it.
+*/
+static void message_readdress( transport_message* msg, char** member, const char* jid ) {
+	if( *member && !strcmp( *member, jid ) )
+		return;
+
+	message_replace( msg, member, jid );
+	if( msg->msg_xml ) {
+		free( msg->msg_xml );
+		msg->msg_xml = NULL;
+	}
+}
+
+/**
+	@brief Install a new body in a transport_message, releasing the old one.
+	@param msg Pointer to the transport_message.
+	@param t Pointer to the transport_text holding the new body (a reference we take over).
+*/
+static void message_install_body( transport_message* msg, transport_text* t ) {
+	text_unref( msg->body_text );
+	msg->body_text = t;
+	msg->body = t ? t->text : NULL;
+	if( msg->msg_xml ) {   // Stale now
+		free( msg->msg_xml );
+		msg->msg_xml = NULL;
+	}
+}
+
+/**
+	@brief Install a new encoded body in a transport_message, releasing the old one.
+	@param msg Pointer to the transport_message.
+	@param t Pointer to the transport_text holding the new body_xml (a reference we take
+	over), or NULL.
+*/
+static void message_install_body_xml( transport_message* msg, transport_text* t ) {
+	text_unref( msg->body_xml_text );
+	msg->body_xml_text = t;
+	msg->body_xml = t ? t->text : NULL;
+	if( msg->msg_xml ) {   // Stale now
+		free( msg->msg_xml );
+		msg->msg_xml = NULL;
+	}
+}
 
 /**
 	@brief Allocate and initialize a new transport_message to be send via Jabber.
@@ -28,7 +254,7 @@
 transport_message* message_init( const char* body, const char* subject,
 		const char* thread, const char* recipient, const char* sender ) {
 
-	transport_message* msg = safe_malloc( sizeof(transport_message) );
+	transport_message* msg = message_alloc();
 
 	if( body        == NULL ) { body       = ""; }
 	if( thread      == NULL ) { thread     = ""; }
@@ -36,38 +262,20 @@ transport_message* message_init( const char* body, const char* subject,
 	if( sender      == NULL ) { sender     = ""; }
 	if( recipient   == NULL ) { recipient  = ""; }
 
-	msg->body       = strdup(body);
-	msg->thread     = strdup(thread);
-	msg->subject    = strdup(subject);
-	msg->recipient  = strdup(recipient);
-	msg->sender     = strdup(sender);
-
-	if( msg->body        == NULL || msg->thread    == NULL  ||
-			msg->subject == NULL || msg->recipient == NULL  ||
-			msg->sender  == NULL ) {
+	msg->body_text  = text_new( body, strlen( body ) );
+	msg->body       = msg->body_text->text;
+	msg->thread     = message_strdup( msg, thread );
+	msg->subject    = message_strdup( msg, subject );
+	msg->recipient  = message_strdup( msg, recipient );
+	msg->sender     = message_strdup( msg, sender );
 
+	if( msg->thread == NULL || msg->subject == NULL ||
+			msg->recipient == NULL || msg->sender == NULL ) {
 		osrfLogError(OSRF_LOG_MARK, "message_init(): Out of Memory" );
-		free( msg->body );
-		free( msg->thread );
-		free( msg->subject );
-		free( msg->recipient );
-		free( msg->sender );
-		free( msg );
+		message_free( msg );
 		return NULL;
 	}
 
-	msg->router_from    = NULL;
-	msg->router_to      = NULL;
-	msg->router_class   = NULL;
-	msg->router_command = NULL;
-	msg->osrf_xid       = NULL;
-	msg->is_error       = 0;
-	msg->error_type     = NULL;
-	msg->error_code     = 0;
-	msg->broadcast      = 0;
-	msg->msg_xml        = NULL;
-	msg->next           = NULL;
-
 	return msg;
 }
 
@@ -90,24 +298,7 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 	if( msg_xml == NULL || *msg_xml == '\0' )
 		return NULL;
 
-	transport_message* new_msg = safe_malloc( sizeof(transport_message) );
-
-	new_msg->body           = NULL;
-	new_msg->subject        = NULL;
-	new_msg->thread         = NULL;
-	new_msg->recipient      = NULL;
-	new_msg->sender         = NULL;
-	new_msg->router_from    = NULL;
-	new_msg->router_to      = NULL;
-	new_msg->router_class   = NULL;
-	new_msg->router_command = NULL;
-	new_msg->osrf_xid       = NULL;
-	new_msg->is_error       = 0;
-	new_msg->error_type     = NULL;
-	new_msg->error_code     = 0;
-	new_msg->broadcast      = 0;
-	new_msg->msg_xml        = NULL;
-	new_msg->next           = NULL;
+	transport_message* new_msg = message_alloc();
 
 	/* Parse the XML document and grab the root */
 	xmlKeepBlanksDefault(0);
@@ -126,24 +317,26 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 	xmlChar* router_command = NULL;
 	xmlChar* broadcast      = NULL;
 	xmlChar* osrf_xid       = NULL;
+	xmlChar* osrf_span      = NULL;
+	xmlChar* osrf_locality  = NULL;
 
 	if( sender ) {
-		new_msg->sender = strdup((const char*)sender);
+		new_msg->sender = message_strdup( new_msg, (const char*)sender );
 		xmlFree(sender);
 	}
 
 	if( recipient ) {
-		new_msg->recipient  = strdup((const char*)recipient);
+		new_msg->recipient  = message_strdup( new_msg, (const char*)recipient );
 		xmlFree(recipient);
 	}
 
 	if(subject){
-		new_msg->subject    = strdup((const char*)subject);
+		new_msg->subject    = message_strdup( new_msg, (const char*)subject );
 		xmlFree(subject);
 	}
 
 	if(thread) {
-		new_msg->thread     = strdup((const char*)thread);
+		new_msg->thread     = message_strdup( new_msg, (const char*)thread );
 		xmlFree(thread);
 	}
 
@@ -154,12 +347,14 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 
 		if( ! strcmp( (const char*) search_node->name, "thread" ) ) {
 			if( search_node->children && search_node->children->content )
-				new_msg->thread = strdup( (const char*) search_node->children->content );
+				message_replace( new_msg, &new_msg->thread,
+					(const char*) search_node->children->content );
 		}
 
 		if( ! strcmp( (const char*) search_node->name, "subject" ) ) {
 			if( search_node->children && search_node->children->content )
-				new_msg->subject = strdup( (const char*) search_node->children->content );
+				message_replace( new_msg, &new_msg->subject,
+					(const char*) search_node->children->content );
 		}
 
 		if( ! strcmp( (const char*) search_node->name, "opensrf" ) ) {
@@ -175,30 +370,38 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 				xmlFree(osrf_xid);
 			}
 
+			osrf_span      = xmlGetProp( search_node, BAD_CAST "osrf_span" );
+			if( osrf_span ) {
+				message_set_osrf_span( new_msg, (char*) osrf_span );
+				xmlFree( osrf_span );
+			}
+
+			osrf_locality  = xmlGetProp( search_node, BAD_CAST "osrf_locality" );
+			if( osrf_locality ) {
+				message_set_osrf_locality( new_msg, (char*) osrf_locality );
+				xmlFree( osrf_locality );
+			}
+
 			if( router_from ) {
-				if (new_msg->sender) {
-					// Sender value applied above.  Clear it and
-					// use the router value instead.
-					free(new_msg->sender);
-				}
-
-				new_msg->sender = strdup((const char*)router_from);
-				new_msg->router_from = strdup((const char*)router_from);
+				// Any sender value applied above is replaced by the router value.
+				message_replace( new_msg, &new_msg->sender, (const char*)router_from );
+				message_replace( new_msg, &new_msg->router_from, (const char*)router_from );
 				xmlFree(router_from);
 			}
 
 			if(router_to) {
-				new_msg->router_to  = strdup((const char*)router_to);
+				message_replace( new_msg, &new_msg->router_to, (const char*)router_to );
 				xmlFree(router_to);
 			}
 
 			if(router_class) {
-				new_msg->router_class = strdup((const char*)router_class);
+				message_replace( new_msg, &new_msg->router_class, (const char*)router_class );
 				xmlFree(router_class);
 			}
 
 			if(router_command) {
-				new_msg->router_command = strdup((const char*)router_command);
+				message_replace( new_msg, &new_msg->router_command,
+					(const char*)router_command );
 				xmlFree(router_command);
 			}
 
@@ -210,24 +413,25 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 		}
 
 		if( ! strcmp( (const char*) search_node->name, "body" ) ) {
-			if( search_node->children && search_node->children->content )
-				new_msg->body = strdup((const char*) search_node->children->content );
+			if( search_node->children && search_node->children->content ) {
+				const char* content = (const char*) search_node->children->content;
+				message_install_body( new_msg, text_new( content, strlen( content ) ) );
+			}
 		}
 
 		search_node = search_node->next;
 	}
 
 	if( new_msg->thread == NULL )
-		new_msg->thread = strdup("");
+		new_msg->thread = message_strdup( new_msg, "" );
 	if( new_msg->subject == NULL )
-		new_msg->subject = strdup("");
+		new_msg->subject = message_strdup( new_msg, "" );
 	if( new_msg->body == NULL )
-		new_msg->body = strdup("");
+		message_install_body( new_msg, text_new( "", 0 ) );
 
 	/* Convert the XML document back into a string, and store it. */
 	new_msg->msg_xml = xmlDocToString(msg_doc, 0);
 	xmlFreeDoc(msg_doc);
-	xmlCleanupParser();
 
 	return new_msg;
 }
@@ -242,12 +446,155 @@ transport_message* new_message_from_xml( const char* msg_xml ) {
 	See also message_set_router_info().
 */
 void message_set_osrf_xid( transport_message* msg, const char* osrf_xid ) {
-	if( msg ) {
-		if( msg->osrf_xid ) free( msg->osrf_xid );
-		msg->osrf_xid = strdup( osrf_xid ? osrf_xid : "" );
+	if( msg )
+		message_replace( msg, &msg->osrf_xid, osrf_xid ? osrf_xid : "" );
+}
+
+/**
+	@brief Populate the osrf_span (an OSRF extension) of a transport_message.
+	@param msg Pointer to the transport_message.
+	@param osrf_span Trace context of the span on whose behalf the message goes, as a W3C
+		traceparent (see osrf_trace.h).
+
+	If @a osrf_span is NULL or empty, the message carries no trace context, and its XML has
+	no "osrf_span" attribute.
+*/
+void message_set_osrf_span( transport_message* msg, const char* osrf_span ) {
+	if( !msg )
+		return;
+	if( osrf_span && *osrf_span )
+		message_replace( msg, &msg->osrf_span, osrf_span );
+	else if( msg->osrf_span ) {
+		message_strfree( msg, msg->osrf_span );
+		msg->osrf_span = NULL;
+	}
+}
+
+/**
+	@brief Populate the osrf_locality (an OSRF extension) of a transport_message.
+	@param msg Pointer to the transport_message.
+	@param osrf_locality Where the sender runs, as a tag of the deployment's choosing.
+
+	A router may prefer to pass a message to a listener with the same tag.  If
+	@a osrf_locality is NULL or empty, the XML has no "osrf_locality" attribute.
+*/
+void message_set_osrf_locality( transport_message* msg, const char* osrf_locality ) {
+	if( !msg )
+		return;
+	if( osrf_locality && *osrf_locality )
+		message_replace( msg, &msg->osrf_locality, osrf_locality );
+	else if( msg->osrf_locality ) {
+		message_strfree( msg, msg->osrf_locality );
+		msg->osrf_locality = NULL;
 	}
 }
 
+/**
+	@brief Set the sender of a transport_message.
+	@param msg Pointer to the transport_message.
+	@param sender The Jabber ID of the sender.  If NULL, populate with an empty string.
+
+	The header strings of a transport_message don't necessarily have allocations of their
+	own, so use this function rather than replacing the sender member directly.
+*/
+void message_set_sender( transport_message* msg, const char* sender ) {
+	if( msg )
+		message_readdress( msg, &msg->sender, sender ? sender : "" );
+}
+
+/**
+	@brief Set the recipient of a transport_message.
+	@param msg Pointer to the transport_message.
+	@param recipient The Jabber ID of the recipient.  If NULL, populate with an empty string.
+
+	As with message_set_sender(), use this function rather than replacing the recipient
+	member directly.
+*/
+void message_set_recipient( transport_message* msg, const char* recipient ) {
+	if( msg )
+		message_readdress( msg, &msg->recipient, recipient ? recipient : "" );
+}
+
+/**
+	@brief Attach the still-encoded text of a message body to a transport_message.
+	@param msg Pointer to the transport_message.
+	@param body_xml The body as it appears between the &lt;body&gt; tags on the wire.
+
+	When body_xml is populated, message_prepare_xml() copies it verbatim into the
+	outgoing stanza instead of escaping the body member again.  The caller must make
+	sure that it encodes the same text as the body member.  If @a body_xml is NULL,
+	revert to escaping the body member.
+*/
+void message_set_body_xml( transport_message* msg, const char* body_xml ) {
+	message_set_body_xml_n( msg, body_xml, body_xml ? strlen( body_xml ) : 0 );
+}
+
+/**
+	@brief Attach the still-encoded text of a message body, given its length.
+	@param msg Pointer to the transport_message.
+	@param body_xml Pointer to the encoded body, which need not be nul-terminated.
+	@param len Length of the encoded body.
+
+	Like message_set_body_xml(), but for a body that sits inside a larger buffer.
+*/
+void message_set_body_xml_n( transport_message* msg, const char* body_xml, size_t len ) {
+	if( msg )
+		message_install_body_xml( msg, body_xml ? text_new( body_xml, len ) : NULL );
+}
+
+/**
+	@brief Attach the encoded text of a message body, taking it over.
+	@param msg Pointer to the transport_message.
+	@param body_xml Pointer to a nul-terminated string allocated by malloc().
+
+	Like message_set_body_xml(), but without copying: the message takes ownership of
+	@a body_xml and frees it when the last message sharing it is freed.  If @a body_xml
+	is NULL, revert to escaping the body member.
+*/
+void message_adopt_body_xml( transport_message* msg, char* body_xml ) {
+	if( !msg ) {
+		free( body_xml );
+		return;
+	}
+	message_install_body_xml( msg, body_xml ? text_adopt( body_xml ) : NULL );
+}
+
+/**
+	@brief Make one transport_message share the body of another.
+	@param msg Pointer to the transport_message that is to receive the body.
+	@param src Pointer to the transport_message whose body is to be shared.
+
+	Both the body and, if present, its encoded form are shared by reference rather than
+	copied, so this costs the same however large the body is.  Neither message may
+	modify the shared text in place; each drops its reference in message_free().
+
+	Meant for messages that get re-addressed and sent again, such as the copy of the
+	last message that the router keeps for each node.
+*/
+void message_share_body( transport_message* msg, const transport_message* src ) {
+	if( msg && src && msg != src ) {
+		message_install_body( msg, text_ref( src->body_text ) );
+		message_install_body_xml( msg, text_ref( src->body_xml_text ) );
+	}
+}
+
+/**
+	@brief Replace the body of a transport_message with a string, taking it over.
+	@param msg Pointer to the transport_message.
+	@param body Pointer to a nul-terminated string allocated by malloc().
+
+	Unlike passing a body to message_init(), this doesn't copy the text: the message
+	takes ownership of @a body and frees it when the last message sharing it is freed.
+	If @a body is NULL, install an empty body.
+*/
+void message_adopt_body( transport_message* msg, char* body ) {
+	if( !msg ) {
+		free( body );
+		return;
+	}
+	message_install_body( msg, body ? text_adopt( body ) : text_new( "", 0 ) );
+}
+
 /**
 	@brief Populate some OSRF extensions to XMPP in a transport_message.
 	@param msg Pointer to the transport_message to be populated.
@@ -268,17 +615,11 @@ void message_set_router_info( transport_message* msg, const char* router_from,
 
 	if( msg ) {
 
-		/* free old values, if any */
-		if( msg->router_from    ) free( msg->router_from );
-		if( msg->router_to      ) free( msg->router_to );
-		if( msg->router_class   ) free( msg->router_class );
-		if( msg->router_command ) free( msg->router_command );
-
-		/* install new values */
-		msg->router_from     = strdup( router_from     ? router_from     : "" );
-		msg->router_to       = strdup( router_to       ? router_to       : "" );
-		msg->router_class    = strdup( router_class    ? router_class    : "" );
-		msg->router_command  = strdup( router_command  ? router_command  : "" );
+		/* replace old values, if any */
+		message_replace( msg, &msg->router_from,    router_from    ? router_from    : "" );
+		message_replace( msg, &msg->router_to,      router_to      ? router_to      : "" );
+		message_replace( msg, &msg->router_class,   router_class   ? router_class   : "" );
+		message_replace( msg, &msg->router_command, router_command ? router_command : "" );
 		msg->broadcast = broadcast_enabled;
 
 		if( msg->router_from == NULL || msg->router_to == NULL ||
@@ -292,27 +633,240 @@ void message_set_router_info( transport_message* msg, const char* router_from,
 	@brief Free a transport_message and all the memory it owns.
 	@param msg Pointer to the transport_message to be destroyed.
 	@return 1 if successful, or 0 upon error.  The only error condition is if @a msg is NULL.
+
+	Keep the message's memory for reuse, unless the pool is full.
 */
 int message_free( transport_message* msg ){
 	if( msg == NULL ) { return 0; }
 
-	free(msg->body);
-	free(msg->thread);
-	free(msg->subject);
-	free(msg->recipient);
-	free(msg->sender);
-	free(msg->router_from);
-	free(msg->router_to);
-	free(msg->router_class);
-	free(msg->router_command);
-	free(msg->osrf_xid);
-	if( msg->error_type != NULL ) free(msg->error_type);
+	text_unref(msg->body_text);
+	message_strfree(msg, msg->thread);
+	message_strfree(msg, msg->subject);
+	message_strfree(msg, msg->recipient);
+	message_strfree(msg, msg->sender);
+	message_strfree(msg, msg->router_from);
+	message_strfree(msg, msg->router_to);
+	message_strfree(msg, msg->router_class);
+	message_strfree(msg, msg->router_command);
+	message_strfree(msg, msg->osrf_xid);
+	message_strfree(msg, msg->osrf_span);
+	message_strfree(msg, msg->osrf_locality);
+	message_strfree(msg, msg->error_type);
 	if( msg->msg_xml != NULL ) free(msg->msg_xml);
-	free(msg);
+	text_unref(msg->body_xml_text);
+
+	if( message_pool_count < MESSAGE_POOL_MAX ) {
+		msg->next = message_pool;
+		message_pool = msg;
+		++message_pool_count;
+	} else
+		free(msg);
 	return 1;
 }
 
 
+/**
+	@brief Copy text into a stanza being built, or just measure it.
+	@param out Where to copy the text, or NULL to copy nothing.
+	@param text Pointer to the text.
+	@param len Length of the text.
+	@return The number of bytes the text occupies in the stanza; i.e. @a len.
+*/
+static size_t stanza_put( char* out, const char* text, size_t len ) {
+	if( out )
+		memcpy( out, text, len );
+	return len;
+}
+
+/**
+	@brief Copy text content into a stanza being built, replacing XML special characters.
+	@param out Where to write the escaped text, or NULL just to measure it.
+	@param text The text to be escaped; NULL is treated as an empty string.
+	@return The number of bytes the escaped text occupies.
+
+	See osrfXmlEscape(), which scans for the special characters sixteen bytes at a time.
+*/
+static size_t stanza_put_text( char* out, const char* text ) {
+	return out ? (size_t) ( osrfXmlEscape( out, text ) - out ) : osrfXmlEscapeSize( text );
+}
+
+/**
+	@brief Copy an attribute value into a stanza being built, replacing XML special
+		characters.
+	@param out Where to write the escaped text, or NULL just to measure it.
+	@param text The text to be escaped; NULL is treated as an empty string.
+	@return The number of bytes the escaped text occupies.
+
+	Escape the text the same way libxml2 does when it serializes a document without a
+	declared encoding, so that our stanzas are byte for byte the ones we used to get by
+	way of a DOM.  In attribute values that means escaping quotes and whitespace as well
+	as the characters escaped in text content, and writing non-ASCII characters as
+	numeric character references.
+*/
+static size_t stanza_put_attr( char* out, const char* text ) {
+	if( !text )
+		return 0;
+
+	size_t n = 0;
+	const unsigned char* p = (const unsigned char*) text;
+	const unsigned char* start = p;
+
+	while( *p ) {
+		const char* entity = NULL;
+		unsigned char c = *p;
+
+		if( '<' == c )
+			entity = "&lt;";
+		else if( '>' == c )
+			entity = "&gt;";
+		else if( '&' == c )
+			entity = "&amp;";
+		else if( '\r' == c )
+			entity = "&#13;";
+		else if( '"' == c )
+			entity = "&quot;";
+		else if( '\n' == c )
+			entity = "&#10;";
+		else if( '\t' == c )
+			entity = "&#9;";
+
+		if( entity ) {
+			n += stanza_put( out ? out + n : NULL, (const char*) start, p - start );
+			n += stanza_put( out ? out + n : NULL, entity, strlen( entity ) );
+			start = ++p;
+		} else if( c >= 0x80 ) {
+			// Decode a UTF-8 sequence into a character reference
+			unsigned long code = c;
+			int len = 1;
+			if( ( c & 0xE0 ) == 0xC0 ) {
+				code = c & 0x1F;
+				len = 2;
+			} else if( ( c & 0xF0 ) == 0xE0 ) {
+				code = c & 0x0F;
+				len = 3;
+			} else if( ( c & 0xF8 ) == 0xF0 ) {
+				code = c & 0x07;
+				len = 4;
+			}
+
+			int i;
+			for( i = 1; i < len; ++i ) {
+				if( ( p[ i ] & 0xC0 ) != 0x80 )
+					break;
+				code = ( code << 6 ) | ( p[ i ] & 0x3F );
+			}
+			if( i < len || ( code >= 0xD800 && code <= 0xDFFF ) || code > 0x10FFFF ) {
+				// malformed; reference the lone byte
+				code = c;
+				len = 1;
+			}
+
+			char ref[ 16 ];
+			int ref_len = snprintf( ref, sizeof( ref ), "&#x%lX;", code );
+			n += stanza_put( out ? out + n : NULL, (const char*) start, p - start );
+			n += stanza_put( out ? out + n : NULL, ref, ref_len );
+			p += len;
+			start = p;
+		} else
+			++p;
+	}
+
+	n += stanza_put( out ? out + n : NULL, (const char*) start, p - start );
+	return n;
+}
+
+/**
+	@brief Serialize a transport_message as a &lt;message&gt; element, or measure it.
+	@param msg Pointer to the transport_message.
+	@param out Where to write the stanza, or NULL to write nothing.
+	@return The length of the stanza, not counting a terminal nul (which we don't write).
+
+	Measuring and writing go through the same code, so that they can't disagree.  If
+	the body_xml member is populated, it is copied verbatim in place of the body.
+
+	Unless @a with_body is true, stop short of the body, leaving it and the closing tag
+	to the caller (see message_append_xml()).
+*/
+static size_t stanza_write( const transport_message* msg, char* out, int with_body ) {
+
+	size_t n = 0;
+
+#define PUT(s)          n += stanza_put( out ? out + n : NULL, (s), strlen( s ) )
+#define PUT_ATTR(s)     n += stanza_put_attr( out ? out + n : NULL, (s) )
+#define PUT_TEXT(s)     n += stanza_put_text( out ? out + n : NULL, (s) )
+
+	PUT( "<message to=\"" );
+	PUT_ATTR( msg->recipient );
+	PUT( "\" from=\"" );
+	PUT_ATTR( msg->sender );
+	PUT( "\">" );
+
+	if( msg->is_error ) {
+		char code_buf[ 16 ];
+		snprintf( code_buf, sizeof( code_buf ), "%d", msg->error_code );
+		PUT( "<error type=\"" );
+		PUT_ATTR( msg->error_type );
+		PUT( "\" code=\"" );
+		PUT( code_buf );
+		PUT( "\"/>" );
+	}
+
+	PUT( "<opensrf router_from=\"" );
+	PUT_ATTR( msg->router_from );
+	PUT( "\" router_to=\"" );
+	PUT_ATTR( msg->router_to );
+	PUT( "\" router_class=\"" );
+	PUT_ATTR( msg->router_class );
+	PUT( "\" router_command=\"" );
+	PUT_ATTR( msg->router_command );
+	PUT( "\" osrf_xid=\"" );
+	PUT_ATTR( msg->osrf_xid );
+	if( msg->osrf_span ) {
+		PUT( "\" osrf_span=\"" );
+		PUT_ATTR( msg->osrf_span );
+	}
+	if( msg->osrf_locality ) {
+		PUT( "\" osrf_locality=\"" );
+		PUT_ATTR( msg->osrf_locality );
+	}
+	PUT( msg->broadcast ? "\" broadcast=\"1\"/>" : "\"/>" );
+
+	if( msg->thread && *msg->thread ) {
+		PUT( "<thread>" );
+		PUT_TEXT( msg->thread );
+		PUT( "</thread>" );
+	}
+
+	if( msg->subject && *msg->subject ) {
+		PUT( "<subject>" );
+		PUT_TEXT( msg->subject );
+		PUT( "</subject>" );
+	}
+
+	if( ! with_body )
+		return n;
+
+	if( msg->body_xml ) {
+		if( *msg->body_xml ) {
+			PUT( "<body>" );
+			PUT( msg->body_xml );
+			PUT( "</body>" );
+		}
+	} else if( msg->body && *msg->body ) {
+		PUT( "<body>" );
+		PUT_TEXT( msg->body );
+		PUT( "</body>" );
+	}
+
+	PUT( "</message>" );
+
+#undef PUT
+#undef PUT_ATTR
+#undef PUT_TEXT
+
+	return n;
+}
+
 /**
 	@brief Build a &lt;message&gt; element and store it as a string in the msg_xml member.
 	@param msg Pointer to a transport_message.
@@ -323,93 +877,218 @@ int message_free( transport_message* msg ){
 	The contents of the &lt;message&gt; element come from various members of the
 	transport_message.  Store the resulting string as the msg_xml member.
 
-	To build the XML we first build a DOM structure, and then export it to a string.  That
-	way we can let the XML library worry about replacing certain characters with
-	character entity references -- not a trivial task when UTF-8 characters may be present.
+	We write the XML directly, in two passes over the message: one to measure the stanza,
+	and one to fill a buffer allocated to exactly that size.  The escaping matches what
+	libxml2 would produce for the same message built as a DOM.  If body_xml is populated,
+	it goes into the stanza as is, without being escaped again.
 */
 int message_prepare_xml( transport_message* msg ) {
 
 	if( !msg ) return 0;
 	if( msg->msg_xml ) return 1;   /* already done */
 
-	xmlNodePtr  message_node;
-	xmlNodePtr  body_node;
-	xmlNodePtr  thread_node;
-	xmlNodePtr  opensrf_node;
-	xmlNodePtr  subject_node;
-	xmlNodePtr  error_node;
+	size_t len = stanza_write( msg, NULL, 1 );
+	char* xml = safe_malloc( len + 1 );
+	stanza_write( msg, xml, 1 );
+	xml[ len ] = '\0';
 
-	xmlDocPtr   doc;
+	msg->msg_xml = xml;
+	msg->xml_len = len;
+	return 1;
+}
 
-	xmlKeepBlanksDefault(0);
+/**
+	@brief Give back a reference to a transport_text held by an osrfIoChain.
+	@param t Pointer to the transport_text.
+*/
+static void release_text( void* t ) {
+	text_unref( (transport_text*) t );
+}
 
-	doc = xmlReadDoc( BAD_CAST "<message/>", NULL, NULL, XML_PARSE_NSCLEAN );
-	message_node = xmlDocGetRootElement(doc);
+/**
+	@brief Append a &lt;message&gt; element to an osrfIoChain, without copying the body.
+	@param msg Pointer to a transport_message.
+	@param chain Pointer to the osrfIoChain.
+	@return The length of the stanza, or 0 upon error.
 
-	if( msg->is_error ) {
-		error_node = xmlNewChild(message_node, NULL, BAD_CAST "error" , NULL );
-		xmlAddChild( message_node, error_node );
-		xmlNewProp( error_node, BAD_CAST "type", BAD_CAST msg->error_type );
-		char code_buf[16];
-		osrf_clearbuf( code_buf, sizeof(code_buf));
-		sprintf(code_buf, "%d", msg->error_code );
-		xmlNewProp( error_node, BAD_CAST "code", BAD_CAST code_buf  );
+	The stanza is the same as from message_prepare_xml(), but the body goes into the chain
+	as a reference to the message's own reference-counted copy, whenever it can go as is:
+	that is, when it's the already encoded body_xml, or when it has no characters that
+	need escaping, as is usual for JSON.  Only the rest of the stanza, and a body that does
+	need escaping, is written into the chain's own storage.
+
+	The msg_xml member is neither used nor populated, so the message stays free to be
+	changed and sent again.
+*/
+size_t message_append_xml( transport_message* msg, osrfIoChain* chain ) {
+
+	if( !msg || !chain ) return 0;
+
+	const char* body = NULL;
+	transport_text* body_text = NULL;
+	if( msg->body_xml ) {
+		body = msg->body_xml;
+		body_text = msg->body_xml_text;
+	} else if( msg->body && msg->body_text ) {
+		body = msg->body;
+		body_text = msg->body_text;
+	}
+	size_t body_len = body ? strlen( body ) : 0;
+
+	// A body that needs escaping goes into the chain's storage along with the rest
+	int escape = !msg->body_xml && msg->body && *msg->body
+		&& ( !body_text || osrfXmlEscapeSize( msg->body ) != body_len );
+	if( escape || !body_len ) {
+		size_t len = stanza_write( msg, NULL, 1 );
+		char* p = osrfIoChainAlloc( chain, len );
+		if( !p )
+			return 0;
+		stanza_write( msg, p, 1 );
+		msg->xml_len = len;
+		return len;
 	}
 
-	/* set from and to */
-	xmlNewProp( message_node, BAD_CAST "to", BAD_CAST msg->recipient );
-	xmlNewProp( message_node, BAD_CAST "from", BAD_CAST msg->sender );
+	// Otherwise the body goes in by reference, between two slices of markup
+	size_t len = stanza_write( msg, NULL, 0 );
+	char* p = osrfIoChainAlloc( chain, len + 6 );
+	if( !p )
+		return 0;
+	stanza_write( msg, p, 0 );
+	memcpy( p + len, "<body>", 6 );
 
-	/* set from and to on a new node, also */
-	opensrf_node = xmlNewChild(message_node, NULL, (xmlChar*) "opensrf", NULL );
-	xmlNewProp( opensrf_node, BAD_CAST "router_from", BAD_CAST msg->router_from );
-	xmlNewProp( opensrf_node, BAD_CAST "router_to", BAD_CAST msg->router_to );
-	xmlNewProp( opensrf_node, BAD_CAST "router_class", BAD_CAST msg->router_class );
-	xmlNewProp( opensrf_node, BAD_CAST "router_command", BAD_CAST msg->router_command );
-	xmlNewProp( opensrf_node, BAD_CAST "osrf_xid", BAD_CAST msg->osrf_xid );
+	if( osrfIoChainAddRef( chain, body, body_len, release_text, text_ref( body_text ) )
+			|| osrfIoChainAddStatic( chain, "</body></message>", 17 ) )
+		return 0;
 
-	xmlAddChild(message_node, opensrf_node);
+	msg->xml_len = len + 6 + body_len + 17;
+	return msg->xml_len;
+}
 
-	if( msg->broadcast ) {
-		xmlNewProp( opensrf_node, BAD_CAST "broadcast", BAD_CAST "1" );
-	}
+/** @brief Number of header strings in a packed message, counting the body. */
+#define PACK_FIELDS 13
 
-	/* Now add nodes where appropriate */
-	char* body      = msg->body;
-	char* subject   = msg->subject;
-	char* thread    = msg->thread;
+/** @brief Number of integer members in a packed message. */
+#define PACK_INTS 4
 
-	if( thread && *thread ) {
-		thread_node = xmlNewChild(message_node, NULL, (xmlChar*) "thread", NULL );
-		xmlNodePtr txt = xmlNewText((xmlChar*) thread);
-		xmlAddChild(thread_node, txt);
-		xmlAddChild(message_node, thread_node);
+/**
+	@brief Serialize a transport_message into a compact binary form.
+	@param msg Pointer to the transport_message.
+	@param len Pointer through which to return the length of the result.
+	@return Pointer to a newly allocated buffer, or NULL if @a msg is NULL.
+
+	The result is an array of string lengths, then broadcast, is_error, error_code, and
+	queued, then the strings themselves without terminal nuls: body, subject, thread,
+	recipient, sender, router_from, router_to, router_class, router_command, osrf_xid,
+	error_type, osrf_span, and osrf_locality.
+	It is meant for handing a message to another process on the same host (see
+	message_unpack()), not for the wire; the integers are in host byte order.  The
+	body_xml member doesn't travel.
+
+	The calling code is responsible for freeing the result.
+*/
+char* message_pack( const transport_message* msg, size_t* len ) {
+	if( !msg || !len ) return NULL;
+
+	const char* fields[ PACK_FIELDS ] = {
+		msg->body, msg->subject, msg->thread, msg->recipient, msg->sender,
+		msg->router_from, msg->router_to, msg->router_class, msg->router_command,
+		msg->osrf_xid, msg->error_type, msg->osrf_span, msg->osrf_locality
+	};
+	uint32_t lens[ PACK_FIELDS ];
+	int32_t ints[ PACK_INTS ] = { msg->broadcast, msg->is_error, msg->error_code,
+		msg->queued };
+
+	size_t total = sizeof( lens ) + sizeof( ints );
+	int i;
+	for( i = 0; i < PACK_FIELDS; ++i ) {
+		lens[ i ] = fields[ i ] ? strlen( fields[ i ] ) : 0;
+		total += lens[ i ];
 	}
 
-	if( subject && *subject ) {
-		subject_node = xmlNewChild(message_node, NULL, (xmlChar*) "subject", NULL );
-		xmlNodePtr txt = xmlNewText((xmlChar*) subject);
-		xmlAddChild(subject_node, txt);
-		xmlAddChild( message_node, subject_node );
+	char* buf = safe_malloc( total );
+	char* p = buf;
+	memcpy( p, lens, sizeof( lens ) );
+	p += sizeof( lens );
+	memcpy( p, ints, sizeof( ints ) );
+	p += sizeof( ints );
+	for( i = 0; i < PACK_FIELDS; ++i ) {
+		if( lens[ i ] )
+			memcpy( p, fields[ i ], lens[ i ] );
+		p += lens[ i ];
 	}
 
-	if( body && *body ) {
-		body_node = xmlNewChild(message_node, NULL, (xmlChar*) "body", NULL);
-		xmlNodePtr txt = xmlNewText((xmlChar*) body);
-		xmlAddChild(body_node, txt);
-		xmlAddChild( message_node, body_node );
+	*len = total;
+	return buf;
+}
+
+/**
+	@brief Rebuild a transport_message from the output of message_pack().
+	@param buf Pointer to the packed message.
+	@param len Length of the packed message.
+	@return Pointer to a newly allocated transport_message, or NULL if @a buf is malformed.
+
+	The calling code is responsible for freeing the message by calling message_free().
+*/
+transport_message* message_unpack( const char* buf, size_t len ) {
+	uint32_t lens[ PACK_FIELDS ];
+	int32_t ints[ PACK_INTS ];
+
+	if( !buf || len < sizeof( lens ) + sizeof( ints ) ) {
+		osrfLogError( OSRF_LOG_MARK, "message_unpack(): packed message is truncated" );
+		return NULL;
 	}
 
-	// Export the xmlDoc to a string
-	xmlBufferPtr xmlbuf = xmlBufferCreate();
-	xmlNodeDump( xmlbuf, doc, xmlDocGetRootElement(doc), 0, 0);
-	msg->msg_xml = strdup((const char*) (xmlBufferContent(xmlbuf)));
+	const char* p = buf;
+	memcpy( lens, p, sizeof( lens ) );
+	p += sizeof( lens );
+	memcpy( ints, p, sizeof( ints ) );
+	p += sizeof( ints );
 
-	xmlBufferFree(xmlbuf);
-	xmlFreeDoc( doc );
-	xmlCleanupParser();
+	size_t remaining = len - sizeof( lens ) - sizeof( ints );
+	size_t rest = 0;
+	int i;
+	for( i = 0; i < PACK_FIELDS; ++i ) {
+		if( lens[ i ] > remaining ) {
+			osrfLogError( OSRF_LOG_MARK, "message_unpack(): packed message is truncated" );
+			return NULL;
+		}
+		remaining -= lens[ i ];
+		if( i > 0 )
+			rest += lens[ i ] + 1;
+	}
 
-	return 1;
+	// The body gets a buffer of its own, for the message to adopt; the rest share one
+	char* body = safe_malloc( lens[ 0 ] + 1 );
+	memcpy( body, p, lens[ 0 ] );
+	p += lens[ 0 ];
+
+	char* strings = safe_malloc( rest );
+	char* fields[ PACK_FIELDS ];
+	char* s = strings;
+	for( i = 1; i < PACK_FIELDS; ++i ) {
+		memcpy( s, p, lens[ i ] );
+		p += lens[ i ];
+		fields[ i ] = s;
+		s += lens[ i ] + 1;   // safe_malloc() supplied the terminal nul
+	}
+
+	transport_message* msg = message_init( NULL, fields[ 1 ], fields[ 2 ], fields[ 3 ],
+		fields[ 4 ] );
+	if( msg ) {
+		message_adopt_body( msg, body );
+		message_set_router_info( msg, fields[ 5 ], fields[ 6 ], fields[ 7 ], fields[ 8 ],
+			ints[ 0 ] );
+		message_set_osrf_xid( msg, fields[ 9 ] );
+		message_set_osrf_span( msg, fields[ 11 ] );
+		message_set_osrf_locality( msg, fields[ 12 ] );
+		if( ints[ 1 ] )
+			set_msg_error( msg, fields[ 10 ], ints[ 2 ] );
+		msg->queued = ints[ 3 ];
+	} else
+		free( body );
+
+	free( strings );
+	return msg;
 }
 
 
@@ -520,10 +1199,7 @@ void set_msg_error( transport_message* msg, const char* type, int err_code ) {
 	if( !msg ) return;
 
 	if( type != NULL && *type ) {
-		if( msg->error_type )
-			free( msg->error_type );
-		msg->error_type = safe_malloc( strlen(type)+1 );
-		strcpy( msg->error_type, type );
+		message_replace( msg, &msg->error_type, type );
 		msg->error_code = err_code;
 	}
 	msg->is_error = 1;
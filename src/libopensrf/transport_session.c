@@ -1,15 +1,33 @@
 #include <opensrf/transport_session.h>
+#include <zlib.h>
+#include <opensrf/osrf_trace.h>
+#include <opensrf/osrf_digest.h>
 
 /**
 	@file transport_session.c
 	@brief Routines to manage a connection to a Jabber server.
 
 	In all cases, a transport_session acts as a client with regard to Jabber.
+
+	If asked to (see session_set_compression()), a client session negotiates zlib stream
+	compression (XEP-0138) right after the stream opens, before logging in.  If the server
+	agrees, everything after that point is deflated on the way out and inflated on the way
+	in; the SAX parser and the rest of the session never see the difference.  If the server
+	declines, we carry on uncompressed.
 */
 
 #define CONNECTING_1 1   /**< just starting the connection to Jabber */
 #define CONNECTING_2 2   /**< XML stream opened but not yet logged in */
 
+#define COMPRESS_NONE      0  /**< not compressing, and not asking to */
+#define COMPRESS_REQUESTED 1  /**< sent &lt;compress&gt;; awaiting the reply */
+#define COMPRESS_ACCEPTED  2  /**< received &lt;compressed/&gt;; switch on after parsing */
+#define COMPRESS_ACTIVE    3  /**< the stream is compressed both ways */
+#define COMPRESS_REFUSED   4  /**< the server declined */
+
+/** Size of the buffer for inflated input */
+#define SESSION_ZIN_BUFSIZE  (16 * 1024)
+
 
 /* Note. these are growing buffers, so all that's necessary is a sane starting point */
 #define JABBER_BODY_BUFSIZE    4096  /**< buffer size for message body */
@@ -18,6 +36,9 @@
 #define JABBER_JID_BUFSIZE       64  /**< buffer size for various ids */
 #define JABBER_STATUS_BUFSIZE    16  /**< buffer size for status code */
 
+/** Flush the outbound queue once it holds this many bytes, even if still corked */
+#define SESSION_OUT_QUEUE_BYTES  (256 * 1024)
+
 // ---------------------------------------------------------------------------------
 // Callback for handling the startElement event.  Much of the jabber logic occurs
 // in this and the characterHandler callbacks.
@@ -91,8 +112,19 @@ static const xmlSAXHandlerPtr SAXHandler = &SAXHandlerStruct;
 
 static void grab_incoming(void* blob, socket_manager* mgr, int sockid, char* data, int parent);
 static void reset_session_buffers( transport_session* session );
+static void trim_raw_buffer( transport_session* ses );
+static char* take_body_buffer( transport_session* ses );
+static void capture_raw_body( transport_session* ses );
 static const char* get_xml_attr( const xmlChar** atts, const char* attr_name );
+static void discard_out_queue( transport_session* ses );
 static int get_xmpp_error_code( const xmlChar *name );
+static void parse_incoming( transport_session* ses, const char* data, int len );
+static int session_send_str( transport_session* ses, const char* data );
+static int session_send_iov( transport_session* ses, struct iovec* iov, int count );
+static int negotiate_compression( transport_session* ses, const char* stream_header,
+		int timeout );
+static int start_compression( transport_session* ses );
+static void end_compression( transport_session* ses );
 
 /**
 	@brief Allocate and initialize a transport_session.
@@ -142,11 +174,30 @@ transport_session* init_transport( const char* server,
 	session->router_to_buffer   = buffer_init( JABBER_JID_BUFSIZE );
 	session->router_from_buffer = buffer_init( JABBER_JID_BUFSIZE );
 	session->osrf_xid_buffer    = buffer_init( JABBER_JID_BUFSIZE );
+	session->osrf_span_buffer   = buffer_init( OSRF_TRACEPARENT_SIZE );
+	session->osrf_locality_buffer = buffer_init( JABBER_JID_BUFSIZE );
 	session->router_class_buffer    = buffer_init( JABBER_JID_BUFSIZE );
 	session->router_command_buffer  = buffer_init( JABBER_JID_BUFSIZE );
 
 	session->router_broadcast   = 0;
 
+	session->keep_body_xml      = 0;
+	session->raw_buffer         = NULL;
+	session->raw_offset         = 0;
+	session->raw_body_start     = 0;
+	session->raw_body_len       = -1;
+
+	session->cork_depth         = 0;
+	session->out_chain          = NULL;
+
+	session->compress           = 0;
+	session->compress_state     = COMPRESS_NONE;
+	session->zout               = NULL;
+	session->zin                = NULL;
+	session->zout_buf           = NULL;
+	session->zout_size          = 0;
+	session->zin_buf            = NULL;
+
 	/* initialize the jabber state machine */
 	session->state_machine = (jabber_machine*) safe_malloc( sizeof(jabber_machine) );
 	session->state_machine->connected        = 0;
@@ -224,10 +275,6 @@ int session_discard( transport_session* session ) {
 		xmlFreeParserCtxt(session->parser_ctxt);
 	}
 
-	xmlCleanupCharEncodingHandlers();
-	xmlDictCleanup();
-	xmlCleanupParser();
-
 	buffer_free(session->body_buffer);
 	buffer_free(session->subject_buffer);
 	buffer_free(session->thread_buffer);
@@ -238,9 +285,15 @@ int session_discard( transport_session* session ) {
 	buffer_free(session->router_to_buffer);
 	buffer_free(session->router_from_buffer);
 	buffer_free(session->osrf_xid_buffer);
+	buffer_free(session->osrf_span_buffer);
+	buffer_free(session->osrf_locality_buffer);
 	buffer_free(session->router_class_buffer);
 	buffer_free(session->router_command_buffer);
 	buffer_free(session->session_id);
+	if( session->raw_buffer )
+		buffer_free(session->raw_buffer);
+	osrfIoChainFree( session->out_chain );
+	end_compression( session );
 
 	free(session->server);
 	free(session->unix_path);
@@ -276,13 +329,30 @@ int session_connected( transport_session* session ) {
 	There is no guarantee that we will get a complete message from a single call.  As a
 	result, the calling code should call this function in a loop until it gets a complete
 	message, or until an error occurs.
+
+	A thin wrapper for session_wait_ms().
 */
 int session_wait( transport_session* session, int timeout ) {
+	return session_wait_ms( session, timeout_secs_to_millis( timeout ) );
+}
+
+/**
+	@brief Wait on the client socket connected to Jabber for up to a given number of
+	milliseconds, and process any resulting input.
+	@param session Pointer to the transport_session.
+	@param timeout How many milliseconds to wait before timing out: negative to wait
+		indefinitely, or zero not to wait at all.
+	@return 0 if successful, or -1 if a timeout or other error occurs, or if the server
+		closes the connection at the other end.
+
+	Otherwise the same as session_wait().
+*/
+int session_wait_ms( transport_session* session, int timeout ) {
 	if( ! session || ! session->sock_mgr ) {
 		return 0;
 	}
 
-	int ret =  socket_wait( session->sock_mgr, timeout, session->sock_id );
+	int ret =  socket_wait_ms( session->sock_mgr, timeout, session->sock_id );
 
 	if( ret ) {
 		osrfLogDebug(OSRF_LOG_MARK, "socket_wait returned error code %d", ret);
@@ -295,6 +365,13 @@ int session_wait( transport_session* session, int timeout ) {
 	@param session Pointer to the transport_session.
 	@param msg Pointer to a transport_message enclosing the message.
 	@return 0 if successful, or -1 upon error.
+
+	The stanza is assembled as an osrfIoChain (see message_append_xml()), so that the body
+	goes to writev() straight from the message, without being copied into the stanza.
+
+	Between session_cork() and session_uncork(), don't send the stanza yet; add it to a
+	queue to be sent along with the others.  In that case an error in sending may not be
+	reported until the queue is flushed.
 */
 int session_send_msg(
 		transport_session* session, transport_message* msg ) {
@@ -306,9 +383,94 @@ int session_send_msg(
 		return -1;
 	}
 
-	message_prepare_xml( msg );
-	return socket_send( session->sock_id, msg->msg_xml );
+	// A stanza already serialized, by the caller or an earlier send, can go as it is
+	if( msg->msg_xml && ! session->cork_depth )
+		return session_send_str( session, msg->msg_xml );
+
+	if( ! session->out_chain )
+		session->out_chain = osrfNewIoChain();
+	osrfIoChain* chain = session->out_chain;
+
+	if( msg->msg_xml ) {
+		// Take over the serialized stanza; if the message is sent again, it can rebuild it.
+		char* xml = msg->msg_xml;
+		msg->msg_xml = NULL;
+		if( osrfIoChainAddRef( chain, xml, strlen( xml ), free, xml ) ) {
+			osrfLogError( OSRF_LOG_MARK, "Out of memory queueing a stanza" );
+			discard_out_queue( session );
+			return -1;
+		}
+	} else if( ! message_append_xml( msg, chain ) ) {
+		osrfLogError( OSRF_LOG_MARK, "Out of memory serializing a stanza" );
+		discard_out_queue( session );
+		return -1;
+	}
+
+	if( ! session->cork_depth || chain->length >= SESSION_OUT_QUEUE_BYTES )
+		return session_flush( session );
+
+	return 0;
+}
+
+/**
+	@brief Hold back outgoing stanzas, to be sent together later.
+	@param session Pointer to the transport_session.
+
+	Until the matching call to session_uncork(), session_send_msg() queues each stanza
+	instead of sending it.  The queue goes out, in as few system calls as the kernel
+	allows, when the outermost session_uncork() is called, when session_flush() is called,
+	or when it grows past SESSION_OUT_QUEUE_BYTES.
+
+	Calls may be nested.
+*/
+void session_cork( transport_session* session ) {
+	if( session )
+		++session->cork_depth;
+}
+
+/**
+	@brief Undo a call to session_cork(), flushing the queue if it's the outermost one.
+	@param session Pointer to the transport_session.
+	@return 0 if successful, or -1 if any queued stanza could not be sent.
+*/
+int session_uncork( transport_session* session ) {
+	if( ! session )
+		return -1;
+
+	if( session->cork_depth > 0 )
+		--session->cork_depth;
+
+	if( session->cork_depth )
+		return 0;
+	else
+		return session_flush( session );
+}
+
+/**
+	@brief Send any stanzas held back by session_cork().
+	@param session Pointer to the transport_session.
+	@return 0 if successful, or -1 if not.
+
+	The queue is emptied whether or not the send succeeds.
+*/
+int session_flush( transport_session* session ) {
+	if( ! session )
+		return -1;
+
+	if( ! session->out_chain || ! session->out_chain->count )
+		return 0;
 
+	int rc = session_send_iov( session, session->out_chain->iov, session->out_chain->count );
+	discard_out_queue( session );
+	return rc;
+}
+
+/**
+	@brief Free any stanzas waiting in a transport_session's outbound queue.
+	@param ses Pointer to the transport_session.
+*/
+static void discard_out_queue( transport_session* ses ) {
+	osrfIoChainReset( ses->out_chain );
 }
 
 
@@ -335,6 +497,9 @@ int session_send_msg(
 	it's AUTH_DIGEST, we send it as a hash.
 
 	At this writing, we only use AUTH_DIGEST.
+
+	If compression was requested (see session_set_compression()), and we're not a component,
+	we negotiate it between the two stages, which adds a third wait for the server.
 */
 int session_connect( transport_session* session,
 		const char* username, const char* password,
@@ -428,7 +593,9 @@ int session_connect( transport_session* session,
 			snprintf( hashstuff, sizeof(hashstuff), "%s%s",
 					OSRF_BUFFER_C_STR( session->session_id ), password );
 
-			char* hash = shahash( hashstuff );
+			osrfSHA1Buffer sha;
+			osrf_sha1_digest( &sha, hashstuff );
+			const char* hash = sha.hex;
 			size2 = 100 + strlen( hash );
 			char stanza2[ size2 ];
 			snprintf( stanza2, sizeof(stanza2), "<handshake>%s</handshake>", hash );
@@ -464,6 +631,16 @@ int session_connect( transport_session* session,
 		/* wait for reply */
 		socket_wait( session->sock_mgr, connect_timeout, session->sock_id ); /* make the timeout smarter XXX */
 
+		/* ask for compression before we log in, so that the login is compressed too */
+		if( session->compress && session->state_machine->connecting == CONNECTING_2 ) {
+			if( negotiate_compression( session, stanza1, connect_timeout ) ) {
+				socket_disconnect( session->sock_mgr, session->sock_id );
+				session->sock_id = 0;
+				end_compression( session );
+				return 0;
+			}
+		}
+
 		if( auth_type == AUTH_PLAIN ) {
 
 			/* the second jabber connect stanza including login info*/
@@ -476,7 +653,7 @@ int session_connect( transport_session* session,
 
 			/* server acknowledges our existence, now see if we can login */
 			if( session->state_machine->connecting == CONNECTING_2 ) {
-				if( socket_send( session->sock_id, stanza2 )  ) {
+				if( session_send_str( session, stanza2 )  ) {
 					osrfLogWarning(OSRF_LOG_MARK, "error sending");
 					socket_disconnect( session->sock_mgr, session->sock_id );
 					session->sock_id = 0;
@@ -490,7 +667,9 @@ int session_connect( transport_session* session,
 			char hashstuff[ss];
 			snprintf( hashstuff, sizeof(hashstuff), "%s%s", OSRF_BUFFER_C_STR( session->session_id ), password );
 
-			char* hash = shahash( hashstuff );
+			osrfSHA1Buffer sha;
+			osrf_sha1_digest( &sha, hashstuff );
+			const char* hash = sha.hex;
 
 			/* the second jabber connect stanza including login info */
 			size2 = 150 + strlen( username ) + strlen( hash ) + strlen(resource);
@@ -502,7 +681,7 @@ int session_connect( transport_session* session,
 
 			/* server acknowledges our existence, now see if we can login */
 			if( session->state_machine->connecting == CONNECTING_2 ) {
-				if( socket_send( session->sock_id, stanza2 )  ) {
+				if( session_send_str( session, stanza2 )  ) {
 					osrfLogWarning(OSRF_LOG_MARK, "error sending");
 					socket_disconnect( session->sock_mgr, session->sock_id );
 					session->sock_id = 0;
@@ -530,10 +709,228 @@ int session_connect( transport_session* session,
 	} else {
 		socket_disconnect( session->sock_mgr, session->sock_id );
 		session->sock_id = 0;
+		end_compression( session );
 		return 0;
 	}
 }
 
+/**
+	@brief Ask the Jabber server to compress the stream, and restart the stream if it agrees.
+	@param ses Pointer to the transport_session, whose stream has just opened.
+	@param stream_header The stream header that opened the stream.
+	@param timeout How many seconds to wait for each reply; -1 for no limit.
+	@return 0 if we may go on to log in, compressed or not; -1 if the connection is unusable.
+
+	A refusal is not an error.  Silence is, since a late &lt;compressed/&gt; would leave
+	the two ends disagreeing about what's on the wire.
+*/
+static int negotiate_compression( transport_session* ses, const char* stream_header,
+		int timeout ) {
+
+	ses->compress_state = COMPRESS_REQUESTED;
+	if( socket_send( ses->sock_id, "<compress xmlns='http://jabber.org/protocol/compress'>"
+			"<method>zlib</method></compress>" ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "error sending" );
+		return -1;
+	}
+
+	int timeout_ms = timeout_secs_to_millis( timeout );
+	long long deadline = get_monotonic_millis() + timeout_ms;
+	while( ses->compress_state == COMPRESS_REQUESTED ) {
+		int wait_ms = -1;
+		if( timeout_ms >= 0 ) {
+			long long left = deadline - get_monotonic_millis();
+			wait_ms = left > 0 ? (int) left : 0;
+		}
+		if( socket_wait_ms( ses->sock_mgr, wait_ms, ses->sock_id ) || 0 == wait_ms )
+			break;
+	}
+
+	if( ses->compress_state == COMPRESS_REFUSED ) {
+		osrfLogWarning( OSRF_LOG_MARK,
+			"Jabber server declined stream compression; continuing without it" );
+		return 0;
+	} else if( ses->compress_state != COMPRESS_ACTIVE ) {
+		osrfLogError( OSRF_LOG_MARK, "No reply from Jabber server to compression request" );
+		return -1;
+	}
+
+	/* Start over with a new stream, compressed this time */
+	buffer_reset( ses->session_id );
+	ses->state_machine->connecting = CONNECTING_1;
+	if( session_send_str( ses, stream_header ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "error sending" );
+		return -1;
+	}
+
+	deadline = get_monotonic_millis() + timeout_ms;
+	while( ses->state_machine->connecting == CONNECTING_1 ) {
+		int wait_ms = -1;
+		if( timeout_ms >= 0 ) {
+			long long left = deadline - get_monotonic_millis();
+			wait_ms = left > 0 ? (int) left : 0;
+		}
+		if( socket_wait_ms( ses->sock_mgr, wait_ms, ses->sock_id ) || 0 == wait_ms )
+			break;
+	}
+
+	if( ses->state_machine->connecting != CONNECTING_2 ) {
+		osrfLogError( OSRF_LOG_MARK, "Jabber server did not restart the compressed stream" );
+		return -1;
+	}
+
+	osrfLogInfo( OSRF_LOG_MARK, "Jabber stream on socket %d is compressed", ses->sock_id );
+	return 0;
+}
+
+/**
+	@brief Switch a session over to a compressed stream.
+	@param ses Pointer to the transport_session.
+	@return 0 if successful, or -1 if zlib can't be set up.
+
+	Called once the parser has finished with the input that carried &lt;compressed/&gt;.
+	The stream restarts from scratch, so we start a new parser as well.
+*/
+static int start_compression( transport_session* ses ) {
+	ses->zout = safe_malloc( sizeof( z_stream ) );
+	ses->zin = safe_malloc( sizeof( z_stream ) );
+	if( deflateInit( ses->zout, Z_DEFAULT_COMPRESSION ) != Z_OK ) {
+		free( ses->zout );
+		ses->zout = NULL;
+	}
+	if( inflateInit( ses->zin ) != Z_OK ) {
+		free( ses->zin );
+		ses->zin = NULL;
+	}
+	if( ! ses->zout || ! ses->zin ) {
+		osrfLogError( OSRF_LOG_MARK, "Unable to initialize zlib for stream compression" );
+		end_compression( ses );
+		return -1;
+	}
+	ses->zin_buf = safe_malloc( SESSION_ZIN_BUFSIZE + 1 );
+
+	xmlFreeDoc( ses->parser_ctxt->myDoc );
+	xmlFreeParserCtxt( ses->parser_ctxt );
+	ses->parser_ctxt = xmlCreatePushParserCtxt( SAXHandler, ses, "", 0, NULL );
+
+	ses->raw_offset = 0;
+	if( ses->raw_buffer )
+		buffer_reset( ses->raw_buffer );
+
+	ses->compress_state = COMPRESS_ACTIVE;
+	return 0;
+}
+
+/**
+	@brief Release the zlib state of a session, returning it to an uncompressed stream.
+	@param ses Pointer to the transport_session.
+*/
+static void end_compression( transport_session* ses ) {
+	if( ses->zout ) {
+		deflateEnd( ses->zout );
+		free( ses->zout );
+		ses->zout = NULL;
+	}
+	if( ses->zin ) {
+		inflateEnd( ses->zin );
+		free( ses->zin );
+		ses->zin = NULL;
+	}
+	free( ses->zout_buf );
+	ses->zout_buf = NULL;
+	ses->zout_size = 0;
+	free( ses->zin_buf );
+	ses->zin_buf = NULL;
+	ses->compress_state = COMPRESS_NONE;
+}
+
+/**
+	@brief Send a nul-terminated string over a session's socket, compressing it if need be.
+	@param ses Pointer to the transport_session.
+	@param data The string to send.
+	@return 0 if successful, or -1 if not.
+*/
+static int session_send_str( transport_session* ses, const char* data ) {
+	if( ! ses->zout )
+		return socket_send( ses->sock_id, data );
+
+	struct iovec iov;
+	iov.iov_base = (char*) data;
+	iov.iov_len = strlen( data );
+	return session_send_iov( ses, &iov, 1 );
+}
+
+/**
+	@brief Send a series of buffers over a session's socket, compressing them if need be.
+	@param ses Pointer to the transport_session.
+	@param iov Pointer to an array of buffers.
+	@param count Number of buffers in the array.
+	@return 0 if successful, or -1 if not.
+
+	When compressing, deflate the buffers into a single block, ending with a sync flush so
+	that the server can decode everything we've sent so far, and send that.
+*/
+static int session_send_iov( transport_session* ses, struct iovec* iov, int count ) {
+	if( ! ses->zout )
+		return socket_send_iov( ses->sock_id, iov, count );
+
+	z_stream* z = ses->zout;
+	size_t used = 0;
+	int i;
+	for( i = 0; i < count; ++i ) {
+		z->next_in = (Bytef*) iov[ i ].iov_base;
+		z->avail_in = iov[ i ].iov_len;
+		int flush = ( i == count - 1 ) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		do {
+			if( ses->zout_size - used < 1024 ) {
+				size_t size = ses->zout_size ? ses->zout_size * 2 : SESSION_ZIN_BUFSIZE;
+				char* buf = realloc( ses->zout_buf, size );
+				if( ! buf ) {
+					osrfLogError( OSRF_LOG_MARK, "Out of memory compressing output" );
+					return -1;
+				}
+				ses->zout_buf = buf;
+				ses->zout_size = size;
+			}
+			z->next_out = (Bytef*) ses->zout_buf + used;
+			z->avail_out = ses->zout_size - used;
+			if( deflate( z, flush ) == Z_STREAM_ERROR ) {
+				osrfLogError( OSRF_LOG_MARK, "Error compressing output" );
+				return -1;
+			}
+			used = ses->zout_size - z->avail_out;
+		} while( z->avail_in > 0 || z->avail_out == 0 );
+	}
+
+	struct iovec out;
+	out.iov_base = ses->zout_buf;
+	out.iov_len = used;
+	return socket_send_iov( ses->sock_id, &out, 1 );
+}
+
+/**
+	@brief Ask for zlib compression of the stream on the next session_connect().
+	@param session Pointer to the transport_session.
+	@param compress Boolean; true to ask for compression.
+
+	Compression is negotiated only for client sessions; components connect uncompressed.
+	It's worth having where the link to the Jabber server is slow or metered.  On the same
+	host, and especially over a UNIX domain socket, it usually costs more CPU than it saves.
+*/
+void session_set_compression( transport_session* session, int compress ) {
+	if( session )
+		session->compress = compress ? 1 : 0;
+}
+
+/**
+	@brief Determine whether a session's stream is compressed.
+	@param session Pointer to the transport_session.
+	@return 1 if the stream is compressed, or 0 if not.
+*/
+int session_compressed( const transport_session* session ) {
+	return ( session && session->compress_state == COMPRESS_ACTIVE ) ? 1 : 0;
+}
+
 /**
 	@brief Callback function: push a buffer of XML into an XML parser.
 	@param blob Void pointer pointing to the transport_session.
@@ -545,11 +942,127 @@ int session_connect( transport_session* session,
 	The socket_manager calls this function when it reads a buffer's worth of data from
 	the Jabber socket.  The XML parser calls other callback functions when it sees various
 	features of the XML.
+
+	If the stream is compressed, inflate the data first.
 */
 static void grab_incoming(void* blob, socket_manager* mgr, int sockid, char* data, int parent) {
 	transport_session* ses = (transport_session*) blob;
 	if( ! ses ) { return; }
-	xmlParseChunk(ses->parser_ctxt, data, strlen(data), 0);
+
+	if( ! ses->zin ) {
+		parse_incoming( ses, data, strlen( data ) );
+		if( ses->compress_state == COMPRESS_ACCEPTED && start_compression( ses ) )
+			ses->compress_state = COMPRESS_REFUSED;
+		return;
+	}
+
+	z_stream* z = ses->zin;
+	z->next_in = (Bytef*) data;
+	z->avail_in = mgr->data_len;
+	do {
+		z->next_out = (Bytef*) ses->zin_buf;
+		z->avail_out = SESSION_ZIN_BUFSIZE;
+		int rc = inflate( z, Z_SYNC_FLUSH );
+		if( rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END ) {
+			osrfLogError( OSRF_LOG_MARK, "Corrupt compressed input on socket %d: %s",
+				sockid, z->msg ? z->msg : "unknown error" );
+			ses->state_machine->connected = 0;
+			return;
+		}
+		int len = SESSION_ZIN_BUFSIZE - z->avail_out;
+		if( len > 0 ) {
+			ses->zin_buf[ len ] = '\0';
+			parse_incoming( ses, ses->zin_buf, len );
+		}
+		if( rc != Z_OK || ! ses->zin )
+			break;
+	} while( z->avail_in > 0 || z->avail_out == 0 );
+}
+
+/**
+	@brief Push a buffer of XML into the XML parser.
+	@param ses Pointer to the transport_session.
+	@param data Pointer to the XML, as a nul-terminated string.
+	@param len Length of the XML.
+*/
+static void parse_incoming( transport_session* ses, const char* data, int len ) {
+	if( ses->keep_body_xml ) {
+		// Keep a copy of the raw input, so that we can recover the encoded body
+		buffer_add_n( ses->raw_buffer, data, len );
+		xmlParseChunk(ses->parser_ctxt, data, len, 0);
+		if( ! ses->state_machine->in_message )
+			trim_raw_buffer( ses );
+	} else {
+		ses->raw_offset += len;   // raw_buffer stays empty; track where it would start
+		xmlParseChunk(ses->parser_ctxt, data, len, 0);
+	}
+}
+
+/**
+	@brief Discard the raw input that the XML parser has already consumed.
+	@param ses Pointer to the transport_session.
+
+	Called between message stanzas, so that raw_buffer holds no more than the input for
+	the current stanza plus whatever partial input follows it.
+*/
+static void trim_raw_buffer( transport_session* ses ) {
+	growing_buffer* raw = ses->raw_buffer;
+	long consumed = xmlByteConsumed( ses->parser_ctxt );
+	if( consumed < 0 )
+		consumed = ses->raw_offset + raw->n_used;   // offset unknown; drop everything
+
+	long drop = consumed - ses->raw_offset;
+	if( drop <= 0 )
+		return;
+	if( drop > raw->n_used )
+		drop = raw->n_used;
+
+	raw->n_used -= drop;
+	memmove( raw->buf, raw->buf + drop, raw->n_used );
+	raw->buf[ raw->n_used ] = '\0';
+	ses->raw_offset += drop;
+}
+
+/**
+	@brief Locate the encoded text of the &lt;body&gt; element that just closed.
+	@param ses Pointer to the transport_session.
+
+	The parser has consumed the input at least up to the closing tag.  Since escaped
+	character data may not contain a literal '<', the last '<' before that point starts
+	the closing tag, and the '<' before that one starts the opening tag.  Anything
+	else -- CDATA sections, comments, input we no longer hold -- leaves raw_body_len at
+	-1, and the message is then encoded from the decoded body as usual.
+
+	The body is recorded as an offset into raw_buffer, which is not trimmed until the
+	end of the enclosing message.
+*/
+static void capture_raw_body( transport_session* ses ) {
+	growing_buffer* raw = ses->raw_buffer;
+	ses->raw_body_len = -1;
+
+	long end = xmlByteConsumed( ses->parser_ctxt ) - ses->raw_offset;
+	if( end <= 0 || end > raw->n_used )
+		return;
+
+	const char* buf = raw->buf;
+	long close = end - 1;
+	while( close >= 0 && buf[ close ] != '<' )
+		--close;
+	if( close < 0 || strncmp( buf + close, "</body", 6 ) )
+		return;
+
+	long open = close - 1;
+	while( open >= 0 && buf[ open ] != '<' )
+		--open;
+	if( open < 0 || strncmp( buf + open, "<body", 5 ) )
+		return;
+
+	const char* gt = memchr( buf + open, '>', close - open );
+	if( !gt || gt[ -1 ] == '/' )
+		return;
+
+	ses->raw_body_start = gt + 1 - buf;
+	ses->raw_body_len = close - ses->raw_body_start;
 }
 
 
@@ -574,7 +1087,7 @@ static void startElementHandler(
 // It's necessary because the session state machine's in_message_error variable
 // is not granular enough to distinguish a XMPP error from other stream errors.
 // --------------------------------------------------------------------------------
-	static int isXMPPError = 0;
+	static __thread int isXMPPError = 0;
 
 	if( strcmp( (char*) name, "message" ) == 0 ) {
 		ses->state_machine->in_message = 1;
@@ -589,6 +1102,8 @@ static void startElementHandler(
 		if( strcmp( (char*) name, "opensrf" ) == 0 ) {
 			buffer_add( ses->router_from_buffer, get_xml_attr( atts, "router_from" ) );
 			buffer_add( ses->osrf_xid_buffer, get_xml_attr( atts, "osrf_xid" ) );
+			buffer_add( ses->osrf_span_buffer, get_xml_attr( atts, "osrf_span" ) );
+			buffer_add( ses->osrf_locality_buffer, get_xml_attr( atts, "osrf_locality" ) );
 			buffer_add( ses->router_to_buffer, get_xml_attr( atts, "router_to" ) );
 			buffer_add( ses->router_class_buffer, get_xml_attr( atts, "router_class" ) );
 			buffer_add( ses->router_command_buffer, get_xml_attr( atts, "router_command" ) );
@@ -646,6 +1161,18 @@ static void startElementHandler(
 		return;
 	}
 
+	/* reply to our request for stream compression */
+	if( ses->compress_state == COMPRESS_REQUESTED ) {
+		if( strcmp( (char*) name, "compressed" ) == 0 ) {
+			ses->compress_state = COMPRESS_ACCEPTED;
+			return;
+		}
+		if( strcmp( (char*) name, "failure" ) == 0 ) {
+			ses->compress_state = COMPRESS_REFUSED;
+			return;
+		}
+	}
+
 	if( strcmp( (char*) name, "handshake" ) == 0 ) {
 		ses->state_machine->connected = 1;
 		ses->state_machine->connecting = 0;
@@ -794,7 +1321,7 @@ static void endElementHandler( void *session, const xmlChar *name) {
 		if( ses->message_callback ) {
 
 			transport_message* msg =  message_init(
-				OSRF_BUFFER_C_STR( ses->body_buffer ),
+				NULL,
 				OSRF_BUFFER_C_STR( ses->subject_buffer ),
 				OSRF_BUFFER_C_STR( ses->thread_buffer ),
 				OSRF_BUFFER_C_STR( ses->recipient_buffer ),
@@ -808,22 +1335,38 @@ static void endElementHandler( void *session, const xmlChar *name) {
 				ses->router_broadcast );
 
 			message_set_osrf_xid( msg, ses->osrf_xid_buffer->buf );
+			message_set_osrf_span( msg, ses->osrf_span_buffer->buf );
+			message_set_osrf_locality( msg, ses->osrf_locality_buffer->buf );
 
 			if( ses->message_error_type->n_used > 0 ) {
 				set_msg_error( msg, ses->message_error_type->buf, ses->message_error_code );
 			}
 
 			if( msg == NULL ) { return; }
+
+			// Hand over the body buffer itself, rather than a copy of it
+			message_adopt_body( msg, take_body_buffer( ses ) );
+
+			if( ses->keep_body_xml && ses->raw_body_len >= 0 )
+				message_set_body_xml_n( msg, ses->raw_buffer->buf + ses->raw_body_start,
+					ses->raw_body_len );
+
 			ses->message_callback( ses->user_data, msg );
 		}
 
 		machine->in_message = 0;
 		reset_session_buffers( session );
+		if( ses->keep_body_xml ) {
+			ses->raw_body_len = -1;
+			trim_raw_buffer( ses );
+		}
 		return;
 	}
 
 	if( machine->in_message_body && strcmp( (const char*) name, "body" ) == 0 ) {
 		machine->in_message_body = 0;
+		if( ses->keep_body_xml )
+			capture_raw_body( ses );
 		return;
 	}
 
@@ -877,6 +1420,38 @@ static void endElementHandler( void *session, const xmlChar *name) {
 	}
 }
 
+/**
+	@brief Take the text out of a session's body buffer, leaving a fresh buffer in its place.
+	@param ses Pointer to the transport_session.
+	@return Pointer to the body text, a malloc'ed string that the caller must free.
+
+	Size the new buffer to hold another body as big as this one, since consecutive
+	messages tend to be alike; that way a large body seldom has to be regrown piece
+	by piece as the parser delivers it.  If the old buffer is more than twice the size
+	of its contents, shrink it before handing it over, so that messages sitting in a
+	queue don't pin down memory they don't use.
+*/
+static char* take_body_buffer( transport_session* ses ) {
+	growing_buffer* body = ses->body_buffer;
+	int len = body->n_used;
+	int size = body->size;
+
+	int hint = len + len / 4;
+	if( hint < JABBER_BODY_BUFSIZE )
+		hint = JABBER_BODY_BUFSIZE;
+	ses->body_buffer = buffer_init( hint );
+	if( ! ses->body_buffer )   // hint too big for a growing_buffer
+		ses->body_buffer = buffer_init( JABBER_BODY_BUFSIZE );
+
+	char* text = buffer_release( body );
+	if( size > 2 * len ) {
+		char* shrunk = realloc( text, len + 1 );
+		if( shrunk )
+			text = shrunk;
+	}
+	return text;
+}
+
 /**
 	@brief Clear all the buffers of a transport_session.
 	@param ses Pointer to the transport_session whose buffers are to be cleared.
@@ -889,6 +1464,8 @@ static void reset_session_buffers( transport_session* ses ) {
 	OSRF_BUFFER_RESET( ses->recipient_buffer );
 	OSRF_BUFFER_RESET( ses->router_from_buffer );
 	OSRF_BUFFER_RESET( ses->osrf_xid_buffer );
+	OSRF_BUFFER_RESET( ses->osrf_span_buffer );
+	OSRF_BUFFER_RESET( ses->osrf_locality_buffer );
 	OSRF_BUFFER_RESET( ses->router_to_buffer );
 	OSRF_BUFFER_RESET( ses->router_class_buffer );
 	OSRF_BUFFER_RESET( ses->router_command_buffer );
@@ -977,6 +1554,32 @@ static void  parseErrorHandler( void *session, const char* msg, ... ){
 	osrfLogError( OSRF_LOG_MARK, VA_BUF );
 }
 
+/**
+	@brief Turn on or off capturing the encoded text of incoming message bodies.
+	@param session Pointer to the transport_session.
+	@param keep Boolean; true to populate the body_xml member of incoming messages.
+
+	Meant for code that forwards messages without looking inside them, such as the
+	router: with body_xml populated, message_prepare_xml() can copy the body into the
+	outgoing stanza verbatim.  Capturing costs a copy of the raw input for the duration
+	of each stanza.
+*/
+void session_keep_body_xml( transport_session* session, int keep ) {
+	if( ! session )
+		return;
+
+	session->keep_body_xml = keep ? 1 : 0;
+	if( session->keep_body_xml ) {
+		if( ! session->raw_buffer )
+			session->raw_buffer = buffer_init( JABBER_BODY_BUFSIZE );
+	} else if( session->raw_buffer ) {
+		session->raw_offset += session->raw_buffer->n_used;
+		buffer_free( session->raw_buffer );
+		session->raw_buffer = NULL;
+	}
+	session->raw_body_len = -1;
+}
+
 /**
 	@brief Disconnect from Jabber, and close the socket.
 	@param session Pointer to the transport_session to be disconnected.
@@ -984,9 +1587,11 @@ static void  parseErrorHandler( void *session, const char* msg, ... ){
 */
 int session_disconnect( transport_session* session ) {
 	if( session && session->sock_id != 0 ) {
-		socket_send(session->sock_id, "</stream:stream>");
+		session_flush( session );
+		session_send_str( session, "</stream:stream>" );
 		socket_disconnect(session->sock_mgr, session->sock_id);
 		session->sock_id = 0;
+		end_compression( session );
 	}
 	return 0;
 }
@@ -0,0 +1,711 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <opensrf/transport_shm.h>
+#include <opensrf/osrf_hash.h>
+#include <opensrf/utils.h>
+#include <opensrf/log.h>
+
+/**
+	@file transport_shm.c
+	@brief Pass transport_messages between processes on the same host through shared memory.
+
+	A listener creates two files in a shared directory (typically on tmpfs, such as
+	/dev/shm), both named after a hash of its Jabber ID:
+	- a ring buffer, mapped into memory by the listener and by every process that sends
+	to it;
+	- a FIFO serving as a doorbell, which the listener can poll() alongside its socket.
+
+	The ring holds a series of frames, each one a transport_message laid out as a set of
+	lengths followed by the strings themselves, with no XML encoding.  Any number of
+	senders may write (a process-shared mutex, robust against a sender dying while it
+	holds it, keeps them in line), and only the listener reads, so the reader needs no
+	lock.  A sender rings the doorbell only if the listener has said that it's about to
+	go to sleep.
+
+	If the recipient has no ring, if its ring is full, or if the message is too big,
+	the sender falls back to Jabber.  So does a sender who finds that the listener has
+	gone away.  Messages between the same two processes normally take one path or the
+	other, but because of these fallbacks, ordering across the two paths is not
+	guaranteed.
+
+	The files are created with mode 0600, so only processes running as the same user
+	can use them.  Since messages on this path never pass through the Jabber server,
+	the sender's address is whatever the sender says it is.
+*/
+
+#define SHM_MAGIC        0x4f535246  /**< "OSRF" */
+#define SHM_VERSION      2           /**< Layout version of the ring */
+#define SHM_JID_MAX      256         /**< Room for the listener's Jabber ID */
+#define SHM_FIELDS       13          /**< Number of string fields in a frame */
+#define SHM_INTS         3           /**< Number of integer fields in a frame */
+#define SHM_MIN_RING     (64 * 1024)   /**< Smallest ring we'll create */
+#define SHM_DEFAULT_RING (1024 * 1024) /**< Ring size if the caller doesn't choose one */
+#define SHM_CHECK_SECS   5           /**< How often to re-check a peer, or the lack of one */
+#define SHM_MAX_PEERS    256         /**< Forget all peers when we know this many */
+
+/** Round up to a multiple of 8, so that every frame starts aligned. */
+#define SHM_ALIGN(n) ( ( (n) + 7 ) & ~( (uint64_t) 7 ) )
+
+/**
+	@brief The start of a ring, followed (after SHM_HEADER_SIZE bytes) by its data.
+
+	@a head and @a tail count bytes from the beginning of time; their difference is
+	the number of bytes in use.
+*/
+typedef struct {
+	uint32_t magic;            /**< SHM_MAGIC, once the ring is ready for use. */
+	uint32_t version;          /**< SHM_VERSION. */
+	pid_t consumer;            /**< Process ID of the listener. */
+	volatile int closed;       /**< Set when the listener goes away. */
+	volatile int waiting;      /**< Set while the listener may be asleep. */
+	uint64_t size;             /**< Size of the data area; a power of two. */
+	volatile uint64_t head;    /**< Where the listener reads next; written only by it. */
+	volatile uint64_t tail;    /**< Where a sender writes next; written under the lock. */
+	pthread_mutex_t lock;      /**< Serializes the senders. */
+	char jid[ SHM_JID_MAX ];   /**< Listener's Jabber ID, in case two IDs hash alike. */
+} shm_ring_header;
+
+/** Offset of the data area from the start of the ring. */
+#define SHM_HEADER_SIZE ( ( sizeof( shm_ring_header ) + 63 ) & ~( (size_t) 63 ) )
+
+/**
+	@brief What a sender knows about one recipient.
+*/
+typedef struct {
+	shm_ring_header* hdr;      /**< The recipient's ring, or NULL if it has none. */
+	size_t map_size;           /**< Size of the mapping. */
+	int bell_fd;               /**< Write end of the recipient's doorbell. */
+	time_t checked;            /**< When we last looked for the ring or its listener. */
+} shm_peer;
+
+/**
+	@brief Our own ring, if we're listening, and what we know about other processes' rings.
+*/
+struct transport_shm_struct {
+	char* dir;                 /**< Directory holding the rings and doorbells. */
+	size_t ring_size;          /**< Size of the data area of a ring we create. */
+	shm_ring_header* ring;     /**< Our own ring, or NULL if not listening. */
+	size_t map_size;           /**< Size of the mapping of our ring. */
+	int bell_fd;               /**< Our doorbell, or -1. */
+	char* ring_path;           /**< File name of our ring. */
+	char* bell_path;           /**< File name of our doorbell. */
+	osrfHash* peers;           /**< shm_peers, keyed on Jabber ID. */
+};
+
+static char* shm_path( const char* dir, const char* jid, const char* suffix );
+static shm_peer* shm_find_peer( transport_shm* shm, const char* jid );
+static int shm_attach( transport_shm* shm, shm_peer* peer, const char* jid );
+static void shm_detach( shm_peer* peer );
+static void shm_peer_free( char* key, void* item );
+static int shm_lock( shm_ring_header* hdr );
+static void shm_copy_in( shm_ring_header* hdr, uint64_t pos, const void* data, size_t len );
+static void shm_copy_out( const shm_ring_header* hdr, uint64_t pos, void* data, size_t len );
+
+/**
+	@brief Allocate a transport_shm.
+	@param dir Directory in which to find or create rings, preferably on tmpfs.
+	@param ring_size Size of the ring to create if we listen, in bytes; 0 for the default.
+	@return Pointer to a newly allocated transport_shm, or NULL if @a dir is NULL.
+
+	This doesn't touch the file system.  Until transport_shm_listen() is called, the
+	transport_shm can only send.
+
+	The calling code is responsible for freeing the transport_shm by calling
+	transport_shm_free().
+*/
+transport_shm* transport_shm_init( const char* dir, size_t ring_size ) {
+	if( !dir || !*dir )
+		return NULL;
+
+	size_t size = SHM_MIN_RING;
+	if( 0 == ring_size )
+		ring_size = SHM_DEFAULT_RING;
+	while( size < ring_size && size < ( (size_t) 1 << 30 ) )
+		size *= 2;
+
+	transport_shm* shm = safe_malloc( sizeof( transport_shm ) );
+	shm->dir = strdup( dir );
+	shm->ring_size = size;
+	shm->ring = NULL;
+	shm->map_size = 0;
+	shm->bell_fd = -1;
+	shm->ring_path = NULL;
+	shm->bell_path = NULL;
+	shm->peers = osrfNewHash();
+	osrfHashSetCallback( shm->peers, shm_peer_free );
+	return shm;
+}
+
+/**
+	@brief Build the file name of a ring or doorbell.
+	@param dir The directory.
+	@param jid The listener's Jabber ID.
+	@param suffix "ring" or "bell".
+	@return A newly allocated string, to be freed by the caller.
+
+	The name is based on a 64-bit FNV-1a hash of the Jabber ID.
+*/
+static char* shm_path( const char* dir, const char* jid, const char* suffix ) {
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char* p = (const unsigned char*) jid;
+	while( *p ) {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	return va_list_to_string( "%s/osrf-%016llx.%s", dir, (unsigned long long) hash, suffix );
+}
+
+/**
+	@brief Create a ring and doorbell on which to receive messages.
+	@param shm Pointer to the transport_shm.
+	@param jid The Jabber ID under which other processes will find us.
+	@return 0 if successful, or -1 if not.
+
+	Any ring left behind by an earlier process with the same Jabber ID is replaced.  The
+	ring appears under its final name only once it's ready for use.
+*/
+int transport_shm_listen( transport_shm* shm, const char* jid ) {
+	if( !shm || !jid || shm->ring || strlen( jid ) >= SHM_JID_MAX )
+		return -1;
+
+	char* ring_path = shm_path( shm->dir, jid, "ring" );
+	char* bell_path = shm_path( shm->dir, jid, "bell" );
+	char* tmp_path = va_list_to_string( "%s.%ld", ring_path, (long) getpid() );
+	size_t map_size = SHM_HEADER_SIZE + shm->ring_size;
+	shm_ring_header* hdr = MAP_FAILED;
+	int ring_fd = -1;
+
+	unlink( ring_path );
+	unlink( bell_path );
+	unlink( tmp_path );
+
+	if( mkfifo( bell_path, 0600 ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to create doorbell %s: %s",
+			bell_path, strerror( errno ) );
+		goto fail;
+	}
+
+	// Opening for both reading and writing, we neither block nor ever see end-of-file
+	shm->bell_fd = open( bell_path, O_RDWR | O_NONBLOCK );
+	if( shm->bell_fd < 0 ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to open doorbell %s: %s",
+			bell_path, strerror( errno ) );
+		goto fail;
+	}
+
+	ring_fd = open( tmp_path, O_RDWR | O_CREAT | O_EXCL, 0600 );
+	if( ring_fd < 0 || ftruncate( ring_fd, map_size ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to create ring %s: %s",
+			tmp_path, strerror( errno ) );
+		goto fail;
+	}
+
+	hdr = mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0 );
+	if( MAP_FAILED == hdr ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to map ring %s: %s",
+			tmp_path, strerror( errno ) );
+		goto fail;
+	}
+	close( ring_fd );
+	ring_fd = -1;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+	pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+	pthread_mutex_init( &hdr->lock, &attr );
+	pthread_mutexattr_destroy( &attr );
+
+	hdr->version = SHM_VERSION;
+	hdr->consumer = getpid();
+	hdr->closed = 0;
+	hdr->waiting = 0;
+	hdr->size = shm->ring_size;
+	hdr->head = 0;
+	hdr->tail = 0;
+	strcpy( hdr->jid, jid );
+	__sync_synchronize();
+	hdr->magic = SHM_MAGIC;
+
+	if( rename( tmp_path, ring_path ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to publish ring %s: %s",
+			ring_path, strerror( errno ) );
+		goto fail;
+	}
+
+	free( tmp_path );
+	shm->ring = hdr;
+	shm->map_size = map_size;
+	shm->ring_path = ring_path;
+	shm->bell_path = bell_path;
+	osrfLogInfo( OSRF_LOG_MARK, "Listening for same-host messages on %s", ring_path );
+	return 0;
+
+fail:
+	if( hdr != MAP_FAILED )
+		munmap( hdr, map_size );
+	if( ring_fd >= 0 )
+		close( ring_fd );
+	if( shm->bell_fd >= 0 ) {
+		close( shm->bell_fd );
+		shm->bell_fd = -1;
+	}
+	unlink( tmp_path );
+	unlink( bell_path );
+	free( tmp_path );
+	free( ring_path );
+	free( bell_path );
+	return -1;
+}
+
+/**
+	@brief Return the file descriptor of our doorbell.
+	@param shm Pointer to the transport_shm.
+	@return The file descriptor, or -1 if we're not listening.
+
+	The descriptor becomes readable when a message arrives while we're asleep (see
+	transport_shm_sleep()).
+*/
+int transport_shm_fd( const transport_shm* shm ) {
+	return ( shm && shm->ring ) ? shm->bell_fd : -1;
+}
+
+/**
+	@brief Send a message through the recipient's ring, if it has one.
+	@param shm Pointer to the transport_shm.
+	@param msg Pointer to the message, with its sender filled in.
+	@return 1 if the message was sent, or 0 if it should go through Jabber instead.
+*/
+int transport_shm_send( transport_shm* shm, const transport_message* msg ) {
+	if( !shm || !msg || !msg->recipient )
+		return 0;
+
+	shm_peer* peer = shm_find_peer( shm, msg->recipient );
+	if( !peer || !peer->hdr )
+		return 0;
+	shm_ring_header* hdr = peer->hdr;
+
+	const char* fields[ SHM_FIELDS ] = {
+		msg->body, msg->subject, msg->thread, msg->recipient, msg->sender,
+		msg->router_from, msg->router_to, msg->router_class, msg->router_command,
+		msg->osrf_xid, msg->error_type, msg->osrf_span, msg->osrf_locality
+	};
+	uint32_t lens[ SHM_FIELDS ];
+	int32_t ints[ SHM_INTS ] = { msg->broadcast, msg->is_error, msg->error_code };
+
+	uint64_t total = sizeof( uint32_t ) + sizeof( lens ) + sizeof( ints );
+	int i;
+	for( i = 0; i < SHM_FIELDS; ++i ) {
+		lens[ i ] = fields[ i ] ? strlen( fields[ i ] ) : 0;
+		total += lens[ i ];
+	}
+
+	uint64_t need = SHM_ALIGN( total );
+	if( need > hdr->size / 2 )
+		return 0;    // Not worth hogging the ring
+
+	if( shm_lock( hdr ) )
+		return 0;
+
+	if( hdr->closed ) {
+		pthread_mutex_unlock( &hdr->lock );
+		shm_detach( peer );
+		return 0;
+	}
+
+	uint64_t tail = hdr->tail;
+	__sync_synchronize();
+	if( hdr->size - ( tail - hdr->head ) < need ) {
+		pthread_mutex_unlock( &hdr->lock );
+		osrfLogDebug( OSRF_LOG_MARK, "Ring for %s is full; sending through Jabber",
+			msg->recipient );
+		return 0;
+	}
+
+	uint32_t frame_len = total;
+	uint64_t pos = tail;
+	shm_copy_in( hdr, pos, &frame_len, sizeof( frame_len ) );
+	pos += sizeof( frame_len );
+	shm_copy_in( hdr, pos, lens, sizeof( lens ) );
+	pos += sizeof( lens );
+	shm_copy_in( hdr, pos, ints, sizeof( ints ) );
+	pos += sizeof( ints );
+	for( i = 0; i < SHM_FIELDS; ++i ) {
+		shm_copy_in( hdr, pos, fields[ i ], lens[ i ] );
+		pos += lens[ i ];
+	}
+
+	__sync_synchronize();   // The frame must be seen before the new tail
+	hdr->tail = tail + need;
+	pthread_mutex_unlock( &hdr->lock );
+
+	__sync_synchronize();
+	if( hdr->waiting && write( peer->bell_fd, "", 1 ) < 0 && errno != EAGAIN )
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to ring doorbell for %s: %s",
+			msg->recipient, strerror( errno ) );
+
+	return 1;
+}
+
+/**
+	@brief Take the next message from our ring.
+	@param shm Pointer to the transport_shm.
+	@return Pointer to a newly allocated transport_message, or NULL if there isn't one.
+
+	The calling code is responsible for freeing the message by calling message_free().
+*/
+transport_message* transport_shm_recv( transport_shm* shm ) {
+	if( !shm || !shm->ring )
+		return NULL;
+	shm_ring_header* hdr = shm->ring;
+
+	uint64_t head = hdr->head;
+	uint64_t tail = hdr->tail;
+	__sync_synchronize();   // Read the frame only after reading the tail
+	if( head == tail )
+		return NULL;
+
+	uint32_t frame_len;
+	uint32_t lens[ SHM_FIELDS ];
+	int32_t ints[ SHM_INTS ];
+	uint64_t pos = head;
+	shm_copy_out( hdr, pos, &frame_len, sizeof( frame_len ) );
+	pos += sizeof( frame_len );
+	shm_copy_out( hdr, pos, lens, sizeof( lens ) );
+	pos += sizeof( lens );
+	shm_copy_out( hdr, pos, ints, sizeof( ints ) );
+	pos += sizeof( ints );
+
+	// The body gets a buffer of its own, for the message to adopt; the rest share one
+	char* body = safe_malloc( lens[ 0 ] + 1 );
+	shm_copy_out( hdr, pos, body, lens[ 0 ] );
+	pos += lens[ 0 ];
+
+	size_t rest = 0;
+	int i;
+	for( i = 1; i < SHM_FIELDS; ++i )
+		rest += lens[ i ] + 1;
+	char* strings = safe_malloc( rest );
+	char* fields[ SHM_FIELDS ];
+	char* p = strings;
+	for( i = 1; i < SHM_FIELDS; ++i ) {
+		shm_copy_out( hdr, pos, p, lens[ i ] );
+		pos += lens[ i ];
+		fields[ i ] = p;
+		p += lens[ i ] + 1;   // safe_malloc() supplied the terminal nul
+	}
+
+	__sync_synchronize();   // Done reading the frame before giving up its space
+	hdr->head = head + SHM_ALIGN( frame_len );
+
+	transport_message* msg = message_init( NULL, fields[ 1 ], fields[ 2 ], fields[ 3 ],
+		fields[ 4 ] );
+	if( msg ) {
+		message_adopt_body( msg, body );
+		message_set_router_info( msg, fields[ 5 ], fields[ 6 ], fields[ 7 ], fields[ 8 ],
+			ints[ 0 ] );
+		message_set_osrf_xid( msg, fields[ 9 ] );
+		message_set_osrf_span( msg, fields[ 11 ] );
+		message_set_osrf_locality( msg, fields[ 12 ] );
+		if( ints[ 1 ] )
+			set_msg_error( msg, fields[ 10 ], ints[ 2 ] );
+	} else
+		free( body );
+
+	free( strings );
+	return msg;
+}
+
+/**
+	@brief Get ready to wait on the doorbell.
+	@param shm Pointer to the transport_shm.
+	@return 1 if messages are already waiting in the ring, so that there's no point in
+		blocking; otherwise 0.
+
+	Once this returns 0, any sender who adds a message rings the doorbell, until
+	transport_shm_wake() is called.
+*/
+int transport_shm_sleep( transport_shm* shm ) {
+	if( !shm || !shm->ring )
+		return 0;
+
+	shm->ring->waiting = 1;
+	__sync_synchronize();   // Announce that we're waiting before looking at the tail
+	return shm->ring->head != shm->ring->tail;
+}
+
+/**
+	@brief Stop waiting on the doorbell, and silence it.
+	@param shm Pointer to the transport_shm.
+
+	Call this after waking up for any reason, and before reading the ring.
+*/
+void transport_shm_wake( transport_shm* shm ) {
+	if( !shm || !shm->ring )
+		return;
+
+	shm->ring->waiting = 0;
+	char buf[ 64 ];
+	while( read( shm->bell_fd, buf, sizeof( buf ) ) > 0 )
+		;
+}
+
+/**
+	@brief Free a transport_shm.
+	@param shm Pointer to the transport_shm.
+	@param owner Boolean; true if we're the process that created our ring.
+
+	The owner marks its ring closed and removes its files.  A forked child passes 0, so
+	as to release its copy of the parent's resources without disturbing the parent.
+*/
+void transport_shm_free( transport_shm* shm, int owner ) {
+	if( !shm )
+		return;
+
+	if( shm->ring ) {
+		if( owner ) {
+			shm->ring->closed = 1;
+			unlink( shm->ring_path );
+			unlink( shm->bell_path );
+		}
+		munmap( shm->ring, shm->map_size );
+		close( shm->bell_fd );
+	}
+
+	osrfHashFree( shm->peers );
+	free( shm->ring_path );
+	free( shm->bell_path );
+	free( shm->dir );
+	free( shm );
+}
+
+/**
+	@brief Remove the rings and doorbells of listeners that died without cleaning up.
+	@param shm Pointer to the transport_shm, naming the directory to sweep.
+	@return The number of rings removed.
+
+	A listener killed outright, or one that exits without calling transport_shm_free(),
+	leaves its files behind.  Remove every ring in the directory whose listener no longer
+	exists, together with its doorbell.  Rings we can't read, or whose listener is still
+	around, stay where they are.
+*/
+int transport_shm_sweep( transport_shm* shm ) {
+	if( !shm )
+		return 0;
+
+	DIR* dir = opendir( shm->dir );
+	if( !dir )
+		return 0;
+
+	int removed = 0;
+	struct dirent* entry;
+	while( (entry = readdir( dir )) ) {
+		// Only finished rings, not the temporary files they're built in
+		size_t len = strlen( entry->d_name );
+		if( strncmp( entry->d_name, "osrf-", 5 ) || len < 10
+				|| strcmp( entry->d_name + len - 5, ".ring" ) )
+			continue;
+
+		char* ring_path = va_list_to_string( "%s/%s", shm->dir, entry->d_name );
+		shm_ring_header hdr;
+		int fd = open( ring_path, O_RDONLY );
+		int dead = 0;
+		if( fd >= 0 ) {
+			dead = pread( fd, &hdr, sizeof( hdr ), 0 ) == (ssize_t) sizeof( hdr )
+				&& SHM_MAGIC == hdr.magic && SHM_VERSION == hdr.version
+				&& hdr.consumer != getpid()
+				&& kill( hdr.consumer, 0 ) < 0 && ESRCH == errno;
+			close( fd );
+		}
+
+		if( dead ) {
+			char* bell_path = strdup( ring_path );
+			strcpy( bell_path + strlen( bell_path ) - 4, "bell" );
+			unlink( ring_path );
+			unlink( bell_path );
+			osrfLogDebug( OSRF_LOG_MARK, "Removed ring %s, left by process %ld",
+				ring_path, (long) hdr.consumer );
+			free( bell_path );
+			++removed;
+		}
+		free( ring_path );
+	}
+
+	closedir( dir );
+	return removed;
+}
+
+/**
+	@brief Look up what we know about a recipient, attaching to its ring if we can.
+	@param shm Pointer to the transport_shm.
+	@param jid The recipient's Jabber ID.
+	@return Pointer to the shm_peer, whose hdr is NULL if the recipient has no ring.
+
+	We remember both rings and their absence, and look again every SHM_CHECK_SECS
+	seconds, both for rings that have appeared and for listeners that have disappeared.
+*/
+static shm_peer* shm_find_peer( transport_shm* shm, const char* jid ) {
+	time_t now = time( NULL );
+	shm_peer* peer = osrfHashGet( shm->peers, jid );
+
+	if( peer ) {
+		if( now - peer->checked < SHM_CHECK_SECS )
+			return peer;
+		peer->checked = now;
+		if( peer->hdr ) {
+			if( peer->hdr->closed ||
+					( kill( peer->hdr->consumer, 0 ) && ESRCH == errno ) )
+				shm_detach( peer );
+			else
+				return peer;
+		}
+	} else {
+		if( osrfHashGetCount( shm->peers ) >= SHM_MAX_PEERS ) {
+			osrfHashFree( shm->peers );
+			shm->peers = osrfNewHash();
+			osrfHashSetCallback( shm->peers, shm_peer_free );
+		}
+		peer = safe_malloc( sizeof( shm_peer ) );
+		peer->hdr = NULL;
+		peer->bell_fd = -1;
+		peer->checked = now;
+		osrfHashSet( shm->peers, peer, "%s", jid );
+	}
+
+	shm_attach( shm, peer, jid );
+	return peer;
+}
+
+/**
+	@brief Map a recipient's ring and open its doorbell.
+	@param shm Pointer to the transport_shm.
+	@param peer Pointer to the shm_peer to be filled in.
+	@param jid The recipient's Jabber ID.
+	@return 0 if successful, or -1 if the recipient has no usable ring.
+*/
+static int shm_attach( transport_shm* shm, shm_peer* peer, const char* jid ) {
+	char* ring_path = shm_path( shm->dir, jid, "ring" );
+	int fd = open( ring_path, O_RDWR );
+	free( ring_path );
+	if( fd < 0 )
+		return -1;
+
+	struct stat st;
+	shm_ring_header* hdr = MAP_FAILED;
+	if( 0 == fstat( fd, &st ) && st.st_size > (off_t) SHM_HEADER_SIZE )
+		hdr = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( MAP_FAILED == hdr )
+		return -1;
+
+	if( hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION || hdr->closed
+			|| SHM_HEADER_SIZE + hdr->size != (uint64_t) st.st_size
+			|| strncmp( hdr->jid, jid, SHM_JID_MAX )
+			|| ( kill( hdr->consumer, 0 ) && ESRCH == errno ) ) {
+		munmap( hdr, st.st_size );
+		return -1;
+	}
+
+	char* bell_path = shm_path( shm->dir, jid, "bell" );
+	peer->bell_fd = open( bell_path, O_WRONLY | O_NONBLOCK );
+	free( bell_path );
+	if( peer->bell_fd < 0 ) {
+		munmap( hdr, st.st_size );
+		return -1;
+	}
+
+	peer->hdr = hdr;
+	peer->map_size = st.st_size;
+	osrfLogDebug( OSRF_LOG_MARK, "Sending to %s through shared memory", jid );
+	return 0;
+}
+
+/**
+	@brief Let go of a recipient's ring and doorbell.
+	@param peer Pointer to the shm_peer.
+*/
+static void shm_detach( shm_peer* peer ) {
+	if( peer->hdr ) {
+		munmap( peer->hdr, peer->map_size );
+		peer->hdr = NULL;
+	}
+	if( peer->bell_fd >= 0 ) {
+		close( peer->bell_fd );
+		peer->bell_fd = -1;
+	}
+}
+
+/**
+	@brief Free an shm_peer; a callback for the hash of peers.
+	@param key The Jabber ID (not used).
+	@param item Pointer to the shm_peer, cast to a void pointer.
+*/
+static void shm_peer_free( char* key, void* item ) {
+	shm_peer* peer = item;
+	shm_detach( peer );
+	free( peer );
+}
+
+/**
+	@brief Lock a ring against other senders.
+	@param hdr Pointer to the ring.
+	@return 0 if successful, or -1 if not.
+
+	If the previous holder died with the lock, it had not yet published its frame, so
+	the ring is still consistent.
+*/
+static int shm_lock( shm_ring_header* hdr ) {
+	int rc = pthread_mutex_lock( &hdr->lock );
+	if( EOWNERDEAD == rc )
+		rc = pthread_mutex_consistent( &hdr->lock );
+	if( rc ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to lock ring for %s: %s",
+			hdr->jid, strerror( rc ) );
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Copy data into a ring, wrapping around the end as needed.
+	@param hdr Pointer to the ring.
+	@param pos Position in the ring, counted from the beginning of time.
+	@param data The data to copy.
+	@param len The number of bytes to copy.
+*/
+static void shm_copy_in( shm_ring_header* hdr, uint64_t pos, const void* data, size_t len ) {
+	if( 0 == len )
+		return;
+	char* base = (char*) hdr + SHM_HEADER_SIZE;
+	size_t offset = pos & ( hdr->size - 1 );
+	size_t first = hdr->size - offset;
+	if( first > len )
+		first = len;
+	memcpy( base + offset, data, first );
+	memcpy( base, (const char*) data + first, len - first );
+}
+
+/**
+	@brief Copy data out of a ring, wrapping around the end as needed.
+	@param hdr Pointer to the ring.
+	@param pos Position in the ring, counted from the beginning of time.
+	@param data Where to copy the data.
+	@param len The number of bytes to copy.
+*/
+static void shm_copy_out( const shm_ring_header* hdr, uint64_t pos, void* data, size_t len ) {
+	if( 0 == len )
+		return;
+	const char* base = (const char*) hdr + SHM_HEADER_SIZE;
+	size_t offset = pos & ( hdr->size - 1 );
+	size_t first = hdr->size - offset;
+	if( first > len )
+		first = len;
+	memcpy( data, base + offset, first );
+	memcpy( (char*) data + first, base, len - first );
+}
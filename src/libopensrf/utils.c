@@ -23,7 +23,33 @@ GNU General Public License for more details.
 */
 #include <opensrf/utils.h>
 #include <opensrf/log.h>
+#include <opensrf/osrf_utf8.h>
+#include <opensrf/osrf_digest.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define XML_SSE2 1
+#elif defined(__GNUC__) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define XML_NEON 1
+#endif
+
+/*
+	The vector scan for XML special characters reads whole aligned blocks, which may run
+	past the terminal nul, but never past the end of its page.
+*/
+#if defined(__GNUC__)
+#define XML_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define XML_NO_ASAN
+#endif
+
+static size_t xml_escape( const unsigned char* s, char* out );
 
 /**
 	@brief A thin wrapper for malloc().
@@ -150,6 +176,41 @@ double get_timestamp_millis( void ) {
 	return time;
 }
 
+/**
+	@brief Read a clock that doesn't jump when someone sets the system time.
+	@return Milliseconds since some arbitrary starting point.
+
+	Used for measuring timeouts.  Only differences between two readings are meaningful.
+	Where CLOCK_MONOTONIC is unavailable, fall back to the time of day.
+*/
+long long get_monotonic_millis( void ) {
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	if( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 )
+		return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+	@brief Convert a timeout in seconds to one in milliseconds.
+	@param secs Timeout in seconds: negative to wait indefinitely, or zero not to wait.
+	@return The equivalent timeout in milliseconds, with any negative value mapped to -1.
+
+	Lets the second-based timeout functions hand off to their millisecond counterparts.
+	A timeout too long to express in milliseconds is cut down to the longest that is.
+*/
+int timeout_secs_to_millis( int secs ) {
+	if( secs < 0 )
+		return -1;
+	else if( secs > INT_MAX / 1000 )
+		return INT_MAX;
+	else
+		return secs * 1000;
+}
+
 
 /**
 	@brief Set designated file status flags for an open file descriptor.
@@ -234,20 +295,12 @@ long va_list_size(const char* format, va_list args) {
 */
 char* va_list_to_string(const char* format, ...) {
 
-	long len = 0;
 	va_list args;
-	va_list a_copy;
-
-	va_copy(a_copy, args);
 	va_start(args, format);
-
-	char* buf = safe_malloc( va_list_size(format, args) );
-	*buf = '\0';
-
-	va_start(a_copy, format);
-	vsnprintf(buf, len - 1, format, a_copy);
-	va_end(a_copy);
-	return buf;
+	growing_buffer* gb = buffer_init( 64 );
+	buffer_vfadd( gb, format, args );
+	va_end(args);
+	return buffer_release( gb );
 }
 
 // ---------------------------------------------------------------------------------
@@ -345,23 +398,134 @@ int buffer_fadd(growing_buffer* gb, const char* format, ... ) {
 
 	if(!gb || !format) return -1; 
 
-	long len = 0;
 	va_list args;
-	va_list a_copy;
+	va_start(args, format);
+	int len = buffer_vfadd( gb, format, args );
+	va_end(args);
+	return len;
+}
 
-	va_copy(a_copy, args);
+/**
+	@brief Append a formatted string to a growing_buffer, given a va_list.
+	@param gb A pointer to the growing_buffer.
+	@param format A printf-style format string.
+	@param args The values to be formatted.
+	@return If successful,the length of the resulting string; otherwise -1.
 
-	va_start(args, format);
-	len = va_list_size(format, args);
+	Format straight into the unused part of the buffer.  Only if that isn't big enough,
+	expand the buffer and format again.  Fails under the same conditions as buffer_fadd().
+*/
+int buffer_vfadd( growing_buffer* gb, const char* format, va_list args ) {
 
-	char buf[len];
-	osrf_clearbuf(buf, sizeof(buf));
+	if(!gb || !format) return -1;
 
-	va_start(a_copy, format);
-	vsnprintf(buf, len - 1, format, a_copy);
+	va_list a_copy;
+	va_copy(a_copy, args);
+
+	int len = vsnprintf( gb->buf + gb->n_used, gb->size - gb->n_used, format, args );
+	if( len < 0 ) {
+		gb->buf[ gb->n_used ] = '\0';
+		va_end(a_copy);
+		return -1;
+	}
+
+	int total_len = gb->n_used + len;
+	if( total_len >= gb->size ) {
+		// Didn't fit; make room and try again
+		if( buffer_expand( gb, total_len ) ) {
+			va_end(a_copy);
+			return -1;
+		}
+		vsnprintf( gb->buf + gb->n_used, gb->size - gb->n_used, format, a_copy );
+	}
 	va_end(a_copy);
 
-	return buffer_add(gb, buf);
+	gb->n_used = total_len;
+	return total_len;
+}
+
+/** @brief Pairs of decimal digits, for formatting two digits at a time. */
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/**
+	@brief Format an unsigned integer in decimal, backwards from the end of a buffer.
+	@param end Pointer just past the last byte of the buffer.
+	@param n The number to be formatted.
+	@return Pointer to the first digit.
+
+	The buffer must have room for 20 digits.  No terminal nul is added.
+*/
+static char* format_uint( char* end, unsigned long long n ) {
+	char* p = end;
+	while( n >= 100 ) {
+		const char* pair = digit_pairs + ( n % 100 ) * 2;
+		n /= 100;
+		*--p = pair[ 1 ];
+		*--p = pair[ 0 ];
+	}
+	if( n >= 10 ) {
+		const char* pair = digit_pairs + n * 2;
+		*--p = pair[ 1 ];
+		*--p = pair[ 0 ];
+	} else
+		*--p = '0' + n;
+	return p;
+}
+
+/**
+	@brief Append a signed integer, in decimal, to a growing_buffer.
+	@param gb A pointer to the growing_buffer.
+	@param n The number to be appended.
+	@return If successful, the length of the resulting string; or if not, -1.
+
+	The result is the same as from buffer_fadd() with "%lld", without parsing a format.
+*/
+int buffer_add_int64( growing_buffer* gb, int64_t n ) {
+	char buf[ 24 ];
+	char* end = buf + sizeof( buf );
+	char* p = format_uint( end, n < 0 ? - (uint64_t) n : (uint64_t) n );
+	if( n < 0 )
+		*--p = '-';
+	return buffer_add_n( gb, p, end - p );
+}
+
+/**
+	@brief Append an unsigned integer, in decimal, to a growing_buffer.
+	@param gb A pointer to the growing_buffer.
+	@param n The number to be appended.
+	@return If successful, the length of the resulting string; or if not, -1.
+
+	The result is the same as from buffer_fadd() with "%llu", without parsing a format.
+*/
+int buffer_add_uint( growing_buffer* gb, unsigned long long n ) {
+	char buf[ 24 ];
+	char* end = buf + sizeof( buf );
+	char* p = format_uint( end, n );
+	return buffer_add_n( gb, p, end - p );
+}
+
+/**
+	@brief Append a double to a growing_buffer, the way doubleToString() formats it.
+	@param gb A pointer to the growing_buffer.
+	@param num The number to be appended.
+	@return If successful, the length of the resulting string; or if not, -1.
+
+	A whole number in the range of an int64_t takes the integer path, which gives the same
+	digits that "%.30g" would.  Anything else goes through snprintf(), once.
+*/
+int buffer_add_double( growing_buffer* gb, double num ) {
+	if( num >= -9223372036854775808.0 && num < 9223372036854775808.0
+			&& num == (double) (int64_t) num && !( 0 == num && signbit( num )) )
+		return buffer_add_int64( gb, (int64_t) num );
+
+	char buf[ 64 ];
+	int len = snprintf( buf, sizeof( buf ), "%.30g", num );
+	if( len < 0 || len >= (int) sizeof( buf ) )
+		return buffer_fadd( gb, "%.30g", num );   // should never be necessary
+	return buffer_add_n( gb, buf, len );
 }
 
 
@@ -419,6 +583,26 @@ int buffer_add_n(growing_buffer* gb, const char* data, size_t n) {
 }
 
 
+/**
+	@brief Make room in a growing_buffer for more bytes, plus a terminal nul.
+	@param gb A pointer to the growing_buffer.
+	@param n How many bytes the caller means to add.
+	@return 0 if successful, or -1 if not.
+
+	The caller may then write up to @a n bytes at gb->buf + gb->n_used without further
+	checks, and must then update gb->n_used and the terminal nul itself.  As with the
+	other functions, a failure frees the buffer.
+*/
+int buffer_reserve( growing_buffer* gb, size_t n ) {
+	if( !gb ) return -1;
+
+	size_t total_len = gb->n_used + n;
+	if( total_len >= (size_t) gb->size && buffer_expand( gb, total_len ) )
+		return -1;
+	return 0;
+}
+
+
 /**
 	@brief Reset a growing_buffer so that it contains an empty string.
 	@param gb A pointer to the growing_buffer.
@@ -722,40 +906,18 @@ int stringisnum(const char* s) {
 
 
 /**
-	@brief Translate a printf-style formatted string into an MD5 message digest.
-	@param text The format string.  Subsequent parameters, if any, provide values to be
-		formatted and inserted into the format string.
+	@brief Calculate the MD5 message digest of a string.
+	@param text The string.
 	@return A pointer to a string of 32 hexadecimal characters.
 
 	The calling code is responsible for freeing the returned string.
 
-	This function is a wrapper for some public domain routines written by David Madore,
-	Ron Rivest, and Colin Plumb.
+	This function is a wrapper for osrf_md5_digest().
 */
 char* md5sum( const char* text ) {
-
-	struct md5_ctx ctx;
-	unsigned char digest[16];
-
-	MD5_start (&ctx);
-
-	int i;
-	for ( i=0 ; i != strlen(text) ; i++ )
-		MD5_feed (&ctx, text[i]);
-
-	MD5_stop (&ctx, digest);
-
-	char buf[16];
-	char final[ 1 + 2 * sizeof( digest ) ];
-	final[0] = '\0';
-
-	for ( i=0 ; i<16 ; i++ ) {
-		snprintf(buf, sizeof(buf), "%02x", digest[i]);
-		strcat( final, buf );
-	}
-
-	return strdup(final);
-
+	osrfMD5Buffer digest;
+	osrf_md5_digest( &digest, text );
+	return strdup( digest.hex );
 }
 
 /**
@@ -782,6 +944,153 @@ int osrfUtilsCheckFileDescriptor( int fd ) {
 	return 0;
 }
 
+/**
+	@brief Find the next byte of a string that XML text content can't hold as is.
+	@param s Pointer to where to start looking.
+	@return Pointer to the first '<', '>', '&', carriage return, or terminal nul.
+
+	Uses SSE2 or NEON where available, to look at sixteen bytes at a time.
+*/
+#if defined(XML_SSE2)
+XML_NO_ASAN static const unsigned char* scan_xml_plain( const unsigned char* s ) {
+	// Step up to a 16-byte boundary, so that no load strays into the next page.
+	while( (uintptr_t) s & 15 ) {
+		if( !*s || '<' == *s || '>' == *s || '&' == *s || '\r' == *s )
+			return s;
+		++s;
+	}
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lt = _mm_set1_epi8( '<' );
+	const __m128i gt = _mm_set1_epi8( '>' );
+	const __m128i amp = _mm_set1_epi8( '&' );
+	const __m128i cr = _mm_set1_epi8( '\r' );
+	for( ;; s += 16 ) {
+		__m128i v = _mm_load_si128( (const __m128i*) s );
+		__m128i hit = _mm_or_si128(
+			_mm_or_si128( _mm_cmpeq_epi8( v, zero ), _mm_cmpeq_epi8( v, cr ) ),
+			_mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, lt ), _mm_cmpeq_epi8( v, gt ) ),
+				_mm_cmpeq_epi8( v, amp ) ) );
+		int mask = _mm_movemask_epi8( hit );
+		if( mask )
+			return s + __builtin_ctz( mask );
+	}
+}
+#elif defined(XML_NEON)
+XML_NO_ASAN static const unsigned char* scan_xml_plain( const unsigned char* s ) {
+	while( (uintptr_t) s & 15 ) {
+		if( !*s || '<' == *s || '>' == *s || '&' == *s || '\r' == *s )
+			return s;
+		++s;
+	}
+
+	const uint8x16_t zero = vdupq_n_u8( 0 );
+	const uint8x16_t lt = vdupq_n_u8( '<' );
+	const uint8x16_t gt = vdupq_n_u8( '>' );
+	const uint8x16_t amp = vdupq_n_u8( '&' );
+	const uint8x16_t cr = vdupq_n_u8( '\r' );
+	for( ;; s += 16 ) {
+		uint8x16_t v = vld1q_u8( s );
+		uint8x16_t hit = vorrq_u8(
+			vorrq_u8( vceqq_u8( v, zero ), vceqq_u8( v, cr ) ),
+			vorrq_u8( vorrq_u8( vceqq_u8( v, lt ), vceqq_u8( v, gt ) ), vceqq_u8( v, amp ) ) );
+		uint8x8_t nibbles = vshrn_n_u16( vreinterpretq_u16_u8( hit ), 4 );
+		uint64_t mask = vget_lane_u64( vreinterpret_u64_u8( nibbles ), 0 );
+		if( mask )
+			return s + ( __builtin_ctzll( mask ) >> 2 );
+	}
+}
+#else
+static const unsigned char* scan_xml_plain( const unsigned char* s ) {
+	while( *s && '<' != *s && '>' != *s && '&' != *s && '\r' != *s )
+		++s;
+	return s;
+}
+#endif
+
+/**
+	@brief Escape a string as XML text content, or just measure the result.
+	@param s Pointer to the nul-terminated string.
+	@param out Pointer to where to write the result, or NULL to write nothing.
+	@return The length of the result.
+
+	Replace '<', '>', and '&' with entities, and carriage returns with a character
+	reference, as libxml2 does when it serializes text; copy everything else as is.
+*/
+static size_t xml_escape( const unsigned char* s, char* out ) {
+	size_t len = 0;
+	for( ;; ) {
+		const unsigned char* end = scan_xml_plain( s );
+		if( out )
+			memcpy( out + len, s, end - s );
+		len += end - s;
+		s = end;
+
+		const char* entity;
+		switch( *s ) {
+			case '<'  : entity = "&lt;"; break;
+			case '>'  : entity = "&gt;"; break;
+			case '&'  : entity = "&amp;"; break;
+			case '\r' : entity = "&#13;"; break;
+			default   : return len;     // The terminal nul
+		}
+
+		size_t n = strlen( entity );
+		if( out )
+			memcpy( out + len, entity, n );
+		len += n;
+		++s;
+	}
+}
+
+/**
+	@brief Compute the length of a string as escaped by osrfXmlEscape().
+	@param str Pointer to the nul-terminated string; NULL is treated as empty.
+	@return The number of bytes that osrfXmlEscape() would write, not counting any
+		terminal nul.
+*/
+size_t osrfXmlEscapeSize( const char* str ) {
+	return str ? xml_escape( (const unsigned char*) str, NULL ) : 0;
+}
+
+/**
+	@brief Escape a string as XML text content, into memory supplied by the caller.
+	@param dest Pointer to where to write, with room for osrfXmlEscapeSize() bytes.
+	@param str Pointer to the nul-terminated string; NULL is treated as empty.
+	@return Pointer to the byte just past the last one written.
+
+	No terminal nul is written.  This is the escaping that message_prepare_xml() applies
+	to the body of a stanza.
+*/
+char* osrfXmlEscape( char* dest, const char* str ) {
+	return str ? dest + xml_escape( (const unsigned char*) str, dest ) : dest;
+}
+
+/**
+	@brief Append a string to a growing_buffer, escaped as XML text content.
+	@param gb Pointer to the growing_buffer.
+	@param str Pointer to the nul-terminated string.
+	@return 0 if successful, or -1 if not.
+
+	Room is made once for the worst case, five bytes out for every byte in, so that the
+	string is scanned only once -- unless the worst case would be too big for a
+	growing_buffer, in which case we measure first.
+*/
+int buffer_add_xml_escaped( growing_buffer* gb, const char* str ) {
+	if( !(gb && str) )
+		return -1;
+
+	size_t room = 5 * strlen( str );
+	if( gb->n_used + room >= BUFFER_MAX_SIZE )
+		room = osrfXmlEscapeSize( str );
+	if( buffer_reserve( gb, room ) )
+		return -1;
+
+	gb->n_used += xml_escape( (const unsigned char*) str, gb->buf + gb->n_used );
+	gb->buf[ gb->n_used ] = '\0';
+	return 0;
+}
+
 size_t osrfXmlEscapingLength ( const char* str ) {
 	int extra = 0;
 	const char* s;
@@ -805,3 +1114,151 @@ size_t osrfXmlEscapingLength ( const char* str ) {
 	return extra;
 }
 
+
+/** Longest string that osrf_intern() will take, not counting the terminal nul. */
+#define INTERN_MAX_LEN 64
+
+/** Longest string that osrf_intern_name() will take. */
+#define INTERN_NAME_MAX_LEN 32
+
+/** Slots in the table of interned strings: a power of two.  Room for the hash keys and
+	class names of a large IDL, on top of the hints. */
+#define INTERN_SLOTS 8192
+
+/** Most strings to intern: half the slots, so that probes stay short. */
+#define INTERN_MAX_COUNT ( INTERN_SLOTS / 2 )
+
+/**
+	@brief A string interned by osrf_intern(), with its JSON encoding.
+*/
+typedef struct {
+	unsigned int hash;  /**< Hash of the string. */
+	const char* json;   /**< The string as a JSON string literal. */
+	char str[];         /**< The string itself. */
+} intern_entry;
+
+/**
+	@brief Open-addressed table of interned strings.
+
+	Slots go from NULL to an entry exactly once, by compare-and-swap, and entries are
+	never freed; so readers in any thread can look without a lock.
+*/
+static intern_entry* volatile intern_table[ INTERN_SLOTS ];
+
+/** Number of slots in use, or reserved by a thread about to fill one. */
+static volatile int intern_count = 0;
+
+/**
+	@brief Hash a string for the table of interned strings.
+	@param str The string.
+	@return A 32-bit FNV-1a hash of the string.
+*/
+static unsigned int intern_hash( const char* str ) {
+	unsigned int h = 2166136261u;
+	while( *str ) {
+		h ^= (unsigned char) *str++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+	@brief Get a shared, permanent copy of a short string.
+	@param str The string to intern.
+	@return A pointer to the copy, or NULL if @a str is NULL, longer than INTERN_MAX_LEN,
+	or new when the table is full.
+
+	Interning the same string again returns the same pointer, in any thread.  Meant for
+	the handful of distinct values of things like locales, time zones and ingress names
+	that every message carries: callers that get NULL back must keep a copy of their own.
+	The copies last for the life of the process.
+*/
+const char* osrf_intern( const char* str ) {
+	if( !str || strlen( str ) > INTERN_MAX_LEN )
+		return NULL;
+
+	unsigned int hash = intern_hash( str );
+	unsigned int i = hash & ( INTERN_SLOTS - 1 );
+	intern_entry* fresh = NULL;
+
+	while( 1 ) {
+		intern_entry* entry = intern_table[ i ];
+		if( !entry ) {
+			if( !fresh ) {
+				if( __sync_fetch_and_add( &intern_count, 1 ) >= INTERN_MAX_COUNT ) {
+					__sync_fetch_and_sub( &intern_count, 1 );
+					return NULL;
+				}
+				size_t len = strlen( str );
+				fresh = safe_malloc( sizeof( intern_entry ) + len + 1 );
+				fresh->hash = hash;
+				memcpy( fresh->str, str, len + 1 );
+				growing_buffer* buf = buffer_init( len + 3 );
+				buffer_add_char( buf, '"' );
+				buffer_append_utf8( buf, str );
+				buffer_add_char( buf, '"' );
+				fresh->json = buffer_release( buf );
+			}
+			entry = __sync_val_compare_and_swap( &intern_table[ i ], NULL, fresh );
+			if( !entry )
+				return fresh->str;   // It's ours now
+			// Another thread filled the slot first; see what it put there
+		}
+
+		if( entry->hash == hash && !strcmp( entry->str, str )) {
+			if( fresh ) {
+				free( (char*) fresh->json );
+				free( fresh );
+				__sync_fetch_and_sub( &intern_count, 1 );
+			}
+			return entry->str;
+		}
+		i = ( i + 1 ) & ( INTERN_SLOTS - 1 );
+	}
+}
+
+/**
+	@brief Get a shared, permanent copy of a name, such as a hash key or a class name.
+	@param name The name to intern.
+	@return A pointer to the copy, as from osrf_intern(); or NULL if @a name doesn't look
+	like an identifier, or osrf_intern() can't take it.
+
+	Field names and class names recur in object after object, but a hash may be keyed by
+	anything -- ids, timestamps, session names -- and what we intern stays forever.  So we
+	take only what looks like an identifier: up to INTERN_NAME_MAX_LEN letters, digits and
+	underscores, not beginning with a digit.
+*/
+const char* osrf_intern_name( const char* name ) {
+	if( !name || !( isalpha( (unsigned char) *name ) || '_' == *name ))
+		return NULL;
+
+	const char* p = name + 1;
+	while( isalnum( (unsigned char) *p ) || '_' == *p )
+		++p;
+	if( *p || p - name > INTERN_NAME_MAX_LEN )
+		return NULL;
+
+	return osrf_intern( name );
+}
+
+/**
+	@brief Get the JSON encoding of an interned string.
+	@param interned A string, which may or may not have come from osrf_intern().
+	@return The string as a JSON string literal, including the quotation marks, if it came
+	from osrf_intern(); otherwise NULL.
+
+	The result is permanent, and must not be freed.
+*/
+const char* osrf_intern_json( const char* interned ) {
+	if( !interned )
+		return NULL;
+
+	unsigned int i = intern_hash( interned ) & ( INTERN_SLOTS - 1 );
+	intern_entry* entry;
+	while( (entry = intern_table[ i ]) ) {
+		if( entry->str == interned )
+			return entry->json;
+		i = ( i + 1 ) & ( INTERN_SLOTS - 1 );
+	}
+	return NULL;
+}
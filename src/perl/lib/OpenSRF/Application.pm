@@ -138,8 +138,8 @@ sub handler {
 
 		# By default, we log all method params at the info level
 		# Here we are consult our shared portion of the config file
-		# to look for any exceptions to this behavior
-		my $logdata = "CALL: ".$session->service." $method_name ";
+		# to look for any exceptions to this behavior.  The service's
+		# call_log settings may sample, redact or truncate as well.
 		my $redact_params = 0;
 		if (@p) {
 			if (ref($shared_conf->shared->log_protect) eq 'ARRAY') {
@@ -150,13 +150,8 @@ sub handler {
 					}
 				}
 			}
-			if ($redact_params) {
-				$logdata .= "**PARAMS REDACTED**";
-			} else {
-				$logdata .= join(', ', map { (defined $_) ? $_ : '' } @p);
-			}
 		}
-		$log->info($logdata);
+		$log->call($session->service, $method_name, \@p, $redact_params);
 
 		my $coderef = $app->method_lookup( $method_name, $method_proto, 1, 1 );
 
@@ -91,6 +91,7 @@ sub run_service {
     my $getval = sub { $sclient->config_value(apps => $service => @_); };
 
     my $impl = $getval->('implementation');
+    $logger->set_call_log($getval->('call_log'));
 
     OpenSRF::Application::server_class($service);
     OpenSRF::Application->application_implementation($impl);
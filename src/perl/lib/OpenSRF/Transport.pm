@@ -112,9 +112,9 @@ sub handler {
 		throw OpenSRF::EX::Session ("Transport::handler(): No AppSession object returned from server_build()");
 	}
 
-	# Create a document from the JSON contained within the message 
+	# Create a document from the JSON (or MessagePack) contained within the message 
 	my $doc; 
-	eval { $doc = OpenSRF::Utils::JSON->JSON2perl($body); };
+	eval { $doc = OpenSRF::Utils::JSON->body2perl($body); };
 	if( $@ ) {
 
 		$logger->warn("Received bogus JSON: $@");
@@ -92,9 +92,11 @@ sub to_xml {
     my $self = shift;
 
     my $body = $self->{body};
-    $body =~ s/&/&amp;/sog;
-    $body =~ s/</&lt;/sog;
-    $body =~ s/>/&gt;/sog;
+    if($body =~ tr/&<>//) { # most JSON bodies need no escaping
+        $body =~ s/&/&amp;/sog;
+        $body =~ s/</&lt;/sog;
+        $body =~ s/>/&gt;/sog;
+    }
 
     return sprintf(
         JABBER_MESSAGE,
@@ -37,6 +37,17 @@ use constant IN_THREAD  => 3;
 use constant IN_STATUS  => 4;
 
 
+# -----------------------------------------------------------
+# Once we're logged in, <message> stanzas are read by a fast
+# path for the fixed shape of OpenSRF messages, while anything
+# else still goes through the XML parser.  Set to 0 to send
+# everything through the parser.
+# -----------------------------------------------------------
+our $FAST_PATH = 1;
+
+my %ENTITIES = (lt => '<', gt => '>', amp => '&', quot => '"', apos => "'");
+
+
 # -----------------------------------------------------------
 # Constructor, getter/setters
 # -----------------------------------------------------------
@@ -49,6 +60,10 @@ sub new {
     $self->{queue} = [];
     $self->{stream_state} = DISCONNECTED;
     $self->{xml_state} = IN_NOTHING;
+    $self->{depth} = 0;       # element depth in the parser
+    $self->{fast} = 0;        # 1 once the fast path takes over, -1 if it gave up
+    $self->{buffer} = '';     # input not yet read by the fast path
+    $self->{scanned} = 0;     # how much of it holds no </message>
     $self->socket($socket);
 
     my $p = new XML::Parser(Handlers => {
@@ -239,13 +254,13 @@ sub wait {
 
     # now slurp the data off the socket
     my $buf;
-    my $read_size = 1024;
+    my $read_size = 65536;
     my $nonblock = 0;
     my $nbytes;
     my $first_read = 1;
 
     while($nbytes = sysread($socket, $buf, $read_size)) {
-        $self->{parser}->parse_more($buf) if $buf;
+        $self->consume($buf) if $buf;
         if($nbytes < $read_size or $self->peek_msg) {
             set_block($socket) if $nonblock;
             last;
@@ -293,6 +308,163 @@ sub wait_msg {
 }
 
 
+# -----------------------------------------------------------
+# Hands data from the socket to the XML parser, until we're
+# logged in and the parser is between stanzas.  From then on,
+# reads each complete <message> stanza with read_message, and
+# passes anything else to the parser whole.
+# -----------------------------------------------------------
+sub consume {
+    my($self, $data) = @_;
+
+    if($self->{fast} <= 0) {
+        $self->{parser}->parse_more($data);
+        $self->{fast} = 1 if $FAST_PATH and !$self->{fast}
+            and $self->{stream_state} == CONNECTED
+            and $self->{depth} == 1 and $data =~ />\s*\z/;
+        return;
+    }
+
+    my $buf = \$self->{buffer};
+    $$buf .= $data;
+
+    while(1) {
+        $$buf =~ s/\A\s+//;
+        last unless length $$buf;
+
+        if($$buf =~ m#\A<message[\s/>]#) {
+            my $len;
+            if($$buf =~ m#\A<message\b[^<>]*/>#) {
+                $len = $+[0];
+            } else {
+                my $end = index($$buf, '</message>', $self->{scanned});
+                if($end < 0) {
+                    # Wait for the rest, without searching this part again
+                    $self->{scanned} = length($$buf) > 10 ? length($$buf) - 10 : 0;
+                    last;
+                }
+                $self->{scanned} = 0;
+                $len = $end + 10;
+            }
+
+            my $xml = substr($$buf, 0, $len, '');
+            if(my $msg = read_message($xml)) {
+                $self->push_msg($msg);
+            } else {
+                $self->{parser}->parse_more($xml);
+            }
+
+        } elsif($$buf =~ m#\A<(/?)([\w:.-]+)[^<>]*?(/?)>#) {
+            # Some other stanza, or the end of the stream
+            my $len = $+[0];
+            unless($1 or $3) {
+                my $end = index($$buf, "</$2>", $len);
+                last if $end < 0;
+                $len = $end + length("</$2>");
+            }
+            $self->{parser}->parse_more(substr($$buf, 0, $len, ''));
+
+        } elsif($$buf =~ /\A<[^<>]*\z/) {
+            last;   # Wait for the rest of the tag
+
+        } else {
+            # Something we don't expect between stanzas; leave it all to the parser
+            $logger->debug("XMPP fast path giving up on: " . substr($$buf, 0, 256));
+            $self->{fast} = -1;
+            $self->{parser}->parse_more($$buf);
+            $$buf = '';
+            last;
+        }
+    }
+}
+
+# -----------------------------------------------------------
+# Reads a complete <message> stanza of the usual OpenSRF shape
+# into an XMPPMessage, just as the SAX handlers would.  Returns
+# undef for anything else -- CDATA, comments, unknown entities,
+# markup in the body -- which is then left to the XML parser.
+# -----------------------------------------------------------
+sub read_message {
+    my $xml = shift;
+
+    return undef if index($xml, '<!') >= 0 or index($xml, '<?') >= 0;
+    return undef unless utf8::decode($xml);
+
+    $xml =~ m#\A<message\b([^<>]*?)(/?)>#gc or return undef;
+    my $closed = $2;
+    my $attrs = _read_attrs($1) or return undef;
+
+    my $msg = OpenSRF::Transport::SlimJabber::XMPPMessage->new;
+    $msg->{to} = $attrs->{to};
+    $msg->{from} = $attrs->{from};
+    $msg->{type} = $attrs->{type};
+    return $msg if $closed;
+
+    while($xml =~ m#\G\s*<([\w:.-]+)([^<>]*?)(/?)>#gc) {
+        my($name, $closed) = ($1, $3);
+        $attrs = _read_attrs($2) or return undef;
+
+        my $text = '';
+        unless($closed) {
+            $xml =~ m#\G(.*?)</\Q$name\E\s*>#gcs or return undef;
+            $text = $1;
+        }
+
+        if($name eq 'opensrf') {
+            # These will be authoritative if they exist
+            $msg->{from} = $attrs->{router_from} if $attrs->{router_from};
+            $msg->{osrf_xid} = $attrs->{osrf_xid};
+
+        } elsif($name eq 'body' or $name eq 'thread') {
+            return undef if index($text, '<') >= 0;
+            $text = _unescape($text);
+            return undef unless defined $text;
+            $msg->{$name} .= $text;
+
+        } elsif($name eq 'error') {
+            $msg->{err_type} = $attrs->{type};
+            $msg->{err_code} = $attrs->{code};
+        }
+    }
+
+    return undef unless $xml =~ m#\G\s*</message\s*>\z#gc;
+    return $msg;
+}
+
+# -----------------------------------------------------------
+# Returns a hash of the attributes in the text of a tag, or
+# undef if they aren't well-formed.
+# -----------------------------------------------------------
+sub _read_attrs {
+    my $text = shift;
+    my %attrs;
+
+    while($text =~ /\G\s*([\w:.-]+)\s*=\s*(?:'([^'<]*)'|"([^"<]*)")/gc) {
+        my $name = $1;
+        my $value = _unescape(defined $2 ? $2 : $3);
+        return undef unless defined $value;
+        $attrs{$name} = $value;
+    }
+
+    return undef unless $text =~ /\G\s*\z/gc;
+    return \%attrs;
+}
+
+# -----------------------------------------------------------
+# Replaces XML entities and character references, or returns
+# undef if there's one we don't know.
+# -----------------------------------------------------------
+sub _unescape {
+    my $text = shift;
+    return $text if index($text, '&') < 0;
+
+    return undef if $text =~ /&(?!(?:lt|gt|amp|quot|apos|#[0-9]+|#x[0-9a-fA-F]+);)/;
+    $text =~ s/&(?:(lt|gt|amp|quot|apos)|#([0-9]+)|#x([0-9a-fA-F]+));/
+        defined $1 ? $ENTITIES{$1} : chr(defined $2 ? $2 : hex $3)/ge;
+    return $text;
+}
+
+
 # -----------------------------------------------------------
 # SAX Handlers
 # -----------------------------------------------------------
@@ -301,6 +473,7 @@ sub wait_msg {
 sub start_element {
     my($parser, $name, %attrs) = @_;
     my $self = $parser->{_parent_};
+    $self->{depth}++;
 
     if($name eq 'message') {
 
@@ -362,6 +535,7 @@ sub end_element {
     my($parser, $name) = @_;
     my $self = $parser->{_parent_};
     $self->{xml_state} = IN_NOTHING;
+    $self->{depth}--;
 
     if($name eq 'message') {
         $self->push_msg($self->{message});
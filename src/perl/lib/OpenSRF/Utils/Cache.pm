@@ -20,6 +20,10 @@ OpenSRF::Utils::Cache
 This class just subclasses Cache::Memcached.
 see Cache::Memcached for more options.
 
+Values of at least compress_threshold bytes, if set for the cache in
+opensrf.xml, are stored gzipped.  Compressed values, whether stored by
+Perl or by C, are read back transparently.
+
 The value passed to the call to current is the cache type
 you wish to access.  The below example sets/gets data
 from the 'user' cache.
@@ -28,6 +32,12 @@ my $cache = OpenSRF::Utils::Cache->current("user");
 $cache->set( "key1", "value1" [, $expire_secs ] );
 my $val = $cache->get( "key1" );
 
+To fetch or store a batch of keys with one round trip:
+
+my $vals = $cache->get_cache_multi( [ "key1", "key2" ] );
+$cache->put_cache_multi( { key1 => "value1", key2 => "value2" } [, $expire_secs ] );
+$cache->delete_cache_multi( [ "key1", "key2" ] );
+
 
 =cut
 
@@ -91,9 +101,15 @@ sub new {
 
 	$servers = [ $servers ] if(!ref($servers));
 
+	# values this big or bigger are gzipped, flagged the same way the C client does
+	my $compress = $conf->config_value( cache => $cache_type => 'compress_threshold' );
+
 	my $self = {};
 	$self->{persist} = $persist || 0;
-	$self->{memcache} = Cache::Memcached->new( { servers => $servers } ); 
+	$self->{memcache} = Cache::Memcached->new( {
+		servers => $servers,
+		$compress ? ( compress_threshold => $compress ) : ()
+	} ); 
 	if(!$self->{memcache}) {
 		throw OpenSRF::EX::PANIC ("Unable to create a new memcache object for $cache_type");
 	}
@@ -208,6 +224,86 @@ sub get_cache {
 }
 
 
+=head2 get_cache_multi
+
+Fetch several keys with a single request.  Takes an array ref of keys and
+returns a hash ref mapping each key that was found, as given, to its value.
+
+=cut
+
+sub get_cache_multi {
+	my($self, $keys) = @_;
+
+	return {} unless ref($keys) and @$keys;
+
+	# memcached answers by cleaned key, so remember which key each came from
+	my %originals;
+	for my $key (grep { defined } @$keys) {
+		my $clean = _clean_cache_key($key);
+		$originals{$clean} = $key unless $clean eq '';
+	}
+
+	my $vals = $self->{memcache}->get_multi( keys %originals ) || {};
+
+	my %found;
+	while( my($clean, $val) = each %$vals ) {
+		next unless defined $val;
+		$found{$originals{$clean}} = OpenSRF::Utils::JSON->JSON2perl($val);
+	}
+
+	# anything memcache didn't have may still be in the persist server
+	if( $self->{persist} ) {
+		for my $key (values %originals) {
+			next if exists $found{$key};
+			my $val = $self->get_cache($key);
+			$found{$key} = $val if defined $val;
+		}
+	}
+
+	return \%found;
+}
+
+
+=head2 put_cache_multi
+
+Store each key/value pair of a hash ref, as put_cache does.  Returns the
+number of pairs stored.
+
+=cut
+
+sub put_cache_multi {
+	my($self, $pairs, $expiretime) = @_;
+
+	return 0 unless ref($pairs);
+
+	my $stored = 0;
+	while( my($key, $value) = each %$pairs ) {
+		$stored++ if defined $self->put_cache($key, $value, $expiretime);
+	}
+	return $stored;
+}
+
+
+=head2 delete_cache_multi
+
+Delete each key of an array ref, as delete_cache does.  Returns the
+number of keys deleted.
+
+=cut
+
+sub delete_cache_multi {
+	my($self, $keys) = @_;
+
+	return 0 unless ref($keys);
+
+	my $deleted = 0;
+	for my $key (@$keys) {
+		$deleted++ if defined $self->delete_cache($key);
+	}
+	return $deleted;
+}
+
+
 =head2 _load_methods
 
 =cut
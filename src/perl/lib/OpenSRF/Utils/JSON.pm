@@ -11,6 +11,11 @@ $parser->allow_nonref(1); # allows non-reference values to equate to themselves
 our %_class_map = ();
 our $JSON_CLASS_KEY = '__c';   # points to the classname of encoded objects
 our $JSON_PAYLOAD_KEY = '__p'; # same, for payload
+our $MSGPACK_PREFIX = 'msgpack:'; # begins a message body in MessagePack
+our $msgpack;                   # Data::MessagePack object, loaded on first use
+
+# libopensrf's parser and serializer, if OpenSRF::Utils::JSON::XS was built
+our $xs = eval { require OpenSRF::Utils::JSON::XS; 1 } ? 1 : 0;
 
 
 
@@ -29,6 +34,12 @@ invocant, as in
 The routines which are called by existing external code all deal with
 the serialization/stringification of objects and their revivification.
 
+If OpenSRF was configured with C<--enable-perl-xs>, L</JSON2perl> and
+L</perl2JSON> hand the work to L<OpenSRF::Utils::JSON::XS>, which
+applies the class hints while it parses or serializes, instead of in a
+second walk over the data.  Setting C<$OpenSRF::Utils::JSON::xs> to 0
+turns it off.
+
 
 
 =head1 ROUTINES
@@ -72,6 +83,10 @@ that string.
 sub JSON2perl {
     # FIXME $string is not checked for any criteria, even existance
     my( $pkg, $string ) = @_;
+    if ($xs) {
+        my @perl = OpenSRF::Utils::JSON::XS::JSON2perl($string);
+        return $perl[0] if @perl;
+    }
     my $perl = $pkg->rawJSON2perl($string);
     return $pkg->JSONObject2Perl($perl);
 }
@@ -88,14 +103,88 @@ sorted in any particular order.
 sub perl2JSON {
     my( $pkg, $obj ) = @_;
     # FIXME no validation of any sort
+    return OpenSRF::Utils::JSON::XS::perl2JSON($obj) if $xs;
     my $json = $pkg->perl2JSONObject($obj);
     return $pkg->rawPerl2JSON($json);
 }
 
 
 
+=head2 body2perl
+
+Given the body of an OpenSRF message -- JSON, or MessagePack encoded
+as base64 behind C<msgpack:>, as a C service sends it to a client that
+asked for it -- returns a vivified Perl object built from it.
+
+MessagePack needs Data::MessagePack, which is loaded only when the
+first such body arrives.
+
+=cut
+
+sub body2perl {
+    my( $pkg, $body ) = @_;
+    return $pkg->JSON2perl($body)
+        unless defined $body and index($body, $MSGPACK_PREFIX) == 0;
+
+    require MIME::Base64;
+    my $packed = MIME::Base64::decode_base64(substr($body, length $MSGPACK_PREFIX));
+    return $pkg->JSONObject2Perl($pkg->_msgpack->unpack($packed));
+}
+
+
+=head2 perl2msgpack
+
+Given a Perl object, returns it as MessagePack encoded as base64
+behind C<msgpack:>, which a C service reads in place of JSON.  Needs
+Data::MessagePack.
+
+=cut
+
+sub perl2msgpack {
+    my( $pkg, $obj ) = @_;
+    require MIME::Base64;
+    my $packed = $pkg->_msgpack->pack(_msgpack_bools($pkg->perl2JSONObject($obj)));
+    return $MSGPACK_PREFIX . MIME::Base64::encode_base64($packed, '');
+}
+
+
+
 =head1 INTERNAL ROUTINES
 
+=head2 _msgpack
+
+Returns the Data::MessagePack object, creating it the first time.
+
+=cut
+
+sub _msgpack {
+    return $msgpack if $msgpack;
+    require Data::MessagePack;
+    $msgpack = Data::MessagePack->new;
+    $msgpack->utf8(1);  # strings are characters, as from JSON::XS
+    return $msgpack;
+}
+
+
+=head2 _msgpack_bools
+
+Replaces the JSON::XS Booleans in data from L</perl2JSONObject> with
+the ones Data::MessagePack packs as Booleans.
+
+=cut
+
+sub _msgpack_bools {
+    my $obj = shift;
+    if (JSON::XS::is_bool $obj) {
+        return $obj ? Data::MessagePack::true() : Data::MessagePack::false();
+    } elsif (ref $obj eq 'HASH') {
+        $obj->{$_} = _msgpack_bools($obj->{$_}) for keys %$obj;
+    } elsif (ref $obj eq 'ARRAY') {
+        $_ = _msgpack_bools($_) for @$obj;
+    }
+    return $obj;
+}
+
 =head2 rawJSON2perl
 
 Performs actual JSON -> data transformation, before
@@ -0,0 +1,48 @@
+package OpenSRF::Utils::JSON::XS;
+
+use warnings;
+use strict;
+use JSON::XS;
+use XSLoader;
+
+our $VERSION = '1.00';
+
+XSLoader::load('OpenSRF::Utils::JSON::XS', $VERSION);
+_set_booleans(JSON::XS::true, JSON::XS::false);
+
+
+
+=head1 NAME
+
+OpenSRF::Utils::JSON::XS - libopensrf's JSON parser and serializer for Perl
+
+=head1 SYNOPSIS
+
+Nothing calls this package directly. L<OpenSRF::Utils::JSON> loads
+it if it was built, and then uses it for L<OpenSRF::Utils::JSON/JSON2perl>
+and L<OpenSRF::Utils::JSON/perl2JSON>.
+
+It's built only when OpenSRF is configured with C<--enable-perl-xs>,
+since it links against libopensrf.
+
+=head1 ROUTINES
+
+=head2 JSON2perl
+
+Given a JSON string, returns the Perl structure it stands for, with
+every C<__c>/C<__p> class hint blessed into the class registered for
+it through L<OpenSRF::Utils::JSON/register_class_hint>, in one pass.
+Returns undef for an undefined or empty string.
+
+Returns an empty list if libopensrf can't parse the string, so that
+the caller can fall back on JSON::XS.
+
+=head2 perl2JSON
+
+Given a Perl structure, returns it as JSON, with a class hint for
+every blessed object, and without any keys its class asked to strip.
+Booleans are those of JSON::XS.
+
+=cut
+
+1;
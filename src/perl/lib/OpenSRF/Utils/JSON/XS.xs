@@ -0,0 +1,433 @@
+/*
+ * XS accelerator for OpenSRF::Utils::JSON.
+ *
+ * Converts between JSON text with __c/__p class hints and blessed Perl
+ * structures in one pass, with libopensrf's parser and serializer, instead
+ * of decoding with JSON::XS and then walking the result again in Perl to
+ * apply the class hints.  The hints are the ones registered through
+ * OpenSRF::Utils::JSON->register_class_hint, read from its %_class_map.
+ *
+ * The intermediate jsonObjects live in an osrfArena, which is reset after
+ * each conversion, so that nothing is freed piece by piece.
+ */
+
+#include <opensrf/osrf_json.h>
+#include <opensrf/osrf_arena.h>
+#include <opensrf/log.h>
+
+#define PERL_NO_GET_CONTEXT
+#include "EXTERN.h"
+#include "perl.h"
+#include "XSUB.h"
+
+/* Same nesting limit as JSON::XS */
+#define MAX_DEPTH 512
+
+#define CLASS_MAP "OpenSRF::Utils::JSON::_class_map"
+
+static SV* json_true = NULL;       /* JSON::XS::true */
+static SV* json_false = NULL;      /* JSON::XS::false */
+static HV* bool_stash = NULL;      /* Package they're blessed into */
+static osrfArena* arena = NULL;    /* Holds the jsonObjects of one conversion */
+static int arena_busy = 0;         /* True while a conversion is using the arena */
+
+/* Tell whether a string has any bytes outside of ASCII */
+static int has_high_bytes( const char* s, STRLEN len ) {
+	while( len-- )
+		if( (unsigned char) *s++ & 0x80 )
+			return 1;
+	return 0;
+}
+
+/* Fetch one half ("hints" or "classes") of %_class_map */
+static HV* class_map( pTHX_ const char* half ) {
+	HV* map = get_hv( CLASS_MAP, 0 );
+	if( !map )
+		return NULL;
+	SV** svp = hv_fetch( map, half, strlen( half ), 0 );
+	if( !svp || !SvROK( *svp ) || SvTYPE( SvRV( *svp )) != SVt_PVHV )
+		return NULL;
+	return (HV*) SvRV( *svp );
+}
+
+/* Fetch a field ("name", "hint" or "strip") of a hint or class registered in a half
+   of %_class_map; or NULL if there isn't one */
+static SV* class_field( pTHX_ HV* half, const char* key, STRLEN len, const char* field ) {
+	if( !half )
+		return NULL;
+	SV** svp = hv_fetch( half, key, len, 0 );
+	if( !svp || !SvROK( *svp ) || SvTYPE( SvRV( *svp )) != SVt_PVHV )
+		return NULL;
+	svp = hv_fetch( (HV*) SvRV( *svp ), field, strlen( field ), 0 );
+	return svp && SvOK( *svp ) ? *svp : NULL;
+}
+
+/* ------------------------------------- JSON to Perl */
+
+/* Build a Perl number from the text of a JSON_NUMBER, as JSON::XS would: an integer if
+   it fits, else a floating-point value, except that an integer too big for either is
+   kept as a string */
+static SV* number_to_sv( pTHX_ const char* s ) {
+	STRLEN len = strlen( s );
+	UV uv;
+	int flags = grok_number( s, len, &uv );
+
+	if( flags & IS_NUMBER_NOT_INT )
+		return newSVnv( Atof( s ));
+	else if( !( flags & IS_NUMBER_IN_UV ))
+		return newSVpvn( s, len );
+	else if( !( flags & IS_NUMBER_NEG ))
+		return uv <= (UV) IV_MAX ? newSViv( (IV) uv ) : newSVuv( uv );
+	else if( uv <= (UV) IV_MAX )
+		return newSViv( -(IV) uv );
+	else if( uv == (UV) IV_MAX + 1 )
+		return newSViv( IV_MIN );
+	else
+		return newSVpvn( s, len );
+}
+
+/* Bless a value decoded from a class hint into its class, as JSONObject2Perl does */
+static SV* bless_sv( pTHX_ SV* sv, const char* classname, HV* hints ) {
+	// Trim the class hint
+	while( isSPACE( *classname ))
+		++classname;
+	STRLEN len = strlen( classname );
+	while( len > 0 && isSPACE( classname[ len - 1 ] ))
+		--len;
+
+	SV* name = class_field( aTHX_ hints, classname, len, "name" );
+	HV* stash;
+	if( name )
+		stash = gv_stashsv( name, GV_ADD );
+	else
+		stash = gv_stashpvn( classname, len, GV_ADD );
+
+	// Bless a scalar, or a Boolean, by reference
+	if( !SvROK( sv ) || ( SvOBJECT( SvRV( sv )) && SvSTASH( SvRV( sv )) == bool_stash ))
+		sv = newRV_noinc( sv );
+
+	sv_bless( sv, stash );
+	return sv;
+}
+
+/* Recursively translate a jsonObject into a new Perl value */
+static SV* object_to_sv( pTHX_ const jsonObject* obj, HV* hints ) {
+	if( !obj )
+		return newSV( 0 );
+
+	// A class hint with a null payload stands for undef
+	if( obj->classname && JSON_NULL == obj->type )
+		return newSV( 0 );
+
+	SV* sv;
+	switch( obj->type ) {
+		case JSON_HASH : {
+			HV* hv = newHV();
+			osrfHashCursor cursor = NULL;
+			const char* key;
+			const jsonObject* item;
+			while( (item = osrfHashCursorNext( obj->value.h, &cursor, &key )) ) {
+				I32 klen = strlen( key );
+				if( has_high_bytes( key, klen ))
+					klen = -klen;     // UTF-8
+				hv_store( hv, key, klen, object_to_sv( aTHX_ item, hints ), 0 );
+			}
+			sv = newRV_noinc( (SV*) hv );
+			break;
+		}
+
+		case JSON_ARRAY : {
+			AV* av = newAV();
+			if( obj->value.l && obj->value.l->size ) {
+				unsigned int i;
+				av_extend( av, obj->value.l->size - 1 );
+				for( i = 0; i < obj->value.l->size; i++ )
+					av_push( av, object_to_sv( aTHX_
+						OSRF_LIST_GET_INDEX( obj->value.l, i ), hints ));
+			}
+			sv = newRV_noinc( (SV*) av );
+			break;
+		}
+
+		case JSON_STRING : {
+			STRLEN len = strlen( obj->value.s );
+			sv = newSVpvn( obj->value.s, len );
+			if( has_high_bytes( obj->value.s, len ))
+				SvUTF8_on( sv );
+			break;
+		}
+
+		case JSON_NUMBER :
+			sv = number_to_sv( aTHX_ obj->value.s ? obj->value.s : "0" );
+			break;
+
+		case JSON_BOOL :
+			sv = newSVsv( jsonBoolIsTrue( obj ) ? json_true : json_false );
+			break;
+
+		default :
+			sv = newSV( 0 );
+			break;
+	}
+
+	if( obj->classname )
+		sv = bless_sv( aTHX_ sv, obj->classname, hints );
+
+	return sv;
+}
+
+/* ------------------------------------- Perl to JSON */
+
+/* Translate a plain scalar into a JSON string or number, by the same rule as JSON::XS:
+   a number only if it was last used as one, and never stringified */
+static jsonObject* scalar_to_object( pTHX_ SV* sv ) {
+	jsonObject* obj = NULL;
+	char buf[ 64 ];
+
+	if( !SvPOKp( sv ) && SvIOKp( sv )) {
+		if( SvIsUV( sv ))
+			snprintf( buf, sizeof( buf ), "%" UVuf, SvUVX( sv ));
+		else
+			snprintf( buf, sizeof( buf ), "%" IVdf, SvIVX( sv ));
+		obj = jsonNewNumberStringObject( buf );
+	} else if( !SvPOKp( sv ) && SvNOKp( sv )) {
+		snprintf( buf, sizeof( buf ), "%.*" NVgf, NV_DIG, SvNVX( sv ));
+		obj = jsonNewNumberStringObject( buf );   // NULL for inf or nan
+	}
+	if( obj )
+		return obj;
+
+	STRLEN len;
+	const char* s = SvPV_nomg( sv, len );
+	if( SvUTF8( sv ) || !has_high_bytes( s, len ))
+		return jsonNewObject( s );
+
+	// Latin-1; upgrade it to UTF-8
+	U8* utf8 = bytes_to_utf8( (U8*) s, &len );
+	obj = jsonNewObject( (char*) utf8 );
+	Safefree( utf8 );
+	return obj;
+}
+
+/* Tell whether a hash key belongs to the keys to strip from a class */
+static int is_stripped( pTHX_ AV* strip, const char* key, STRLEN len ) {
+	SSize_t i;
+	for( i = 0; i <= av_len( strip ); i++ ) {
+		SV** svp = av_fetch( strip, i, 0 );
+		STRLEN slen;
+		const char* s;
+		if( svp && SvOK( *svp ) && (s = SvPV( *svp, slen )) && slen == len
+				&& !memcmp( s, key, len ))
+			return 1;
+	}
+	return 0;
+}
+
+/* Recursively translate a Perl value into a jsonObject, as perl2JSONObject does, but
+   with the class hint attached to the jsonObject instead of a wrapper.  Return NULL if
+   it's nested too deeply. */
+static jsonObject* sv_to_object( pTHX_ SV* sv, HV* classes, int depth ) {
+	if( depth > MAX_DEPTH )
+		return NULL;
+
+	SvGETMAGIC( sv );
+	if( !SvOK( sv ))
+		return jsonNewObject( NULL );
+	if( !SvROK( sv ))
+		return scalar_to_object( aTHX_ sv );
+
+	SV* rv = SvRV( sv );
+	const char* classname = NULL;
+	if( SvOBJECT( rv )) {
+		if( SvSTASH( rv ) == bool_stash )
+			return jsonNewBoolObject( SvTRUE( rv ));
+		classname = HvNAME( SvSTASH( rv ));
+	}
+
+	jsonObject* obj;
+	if( SvTYPE( rv ) == SVt_PVHV ) {
+		HV* hv = (HV*) rv;
+		AV* strip = NULL;
+		if( classname ) {
+			SV* s = class_field( aTHX_ classes, classname, strlen( classname ), "strip" );
+			if( s && SvROK( s ) && SvTYPE( SvRV( s )) == SVt_PVAV )
+				strip = (AV*) SvRV( s );
+		}
+
+		obj = jsonNewObjectType( JSON_HASH );
+		HE* he;
+		hv_iterinit( hv );
+		while( (he = hv_iternext( hv )) ) {
+			STRLEN klen;
+			const char* key = HePV( he, klen );
+			if( strip && is_stripped( aTHX_ strip, key, klen ))
+				continue;
+
+			jsonObject* item = sv_to_object( aTHX_ hv_iterval( hv, he ), classes, depth + 1 );
+			if( !item ) {
+				jsonObjectFree( obj );
+				return NULL;
+			}
+
+			if( HeUTF8( he ) || !has_high_bytes( key, klen ))
+				jsonObjectSetKey( obj, key, item );
+			else {
+				U8* utf8 = bytes_to_utf8( (U8*) key, &klen );
+				jsonObjectSetKey( obj, (char*) utf8, item );
+				Safefree( utf8 );
+			}
+		}
+
+	} else if( SvTYPE( rv ) == SVt_PVAV ) {
+		AV* av = (AV*) rv;
+		SSize_t i;
+		SSize_t last = av_len( av );
+		obj = jsonNewObjectType( JSON_ARRAY );
+		for( i = 0; i <= last; i++ ) {
+			SV** svp = av_fetch( av, i, 0 );
+			jsonObject* item = svp
+				? sv_to_object( aTHX_ *svp, classes, depth + 1 ) : jsonNewObject( NULL );
+			if( !item ) {
+				jsonObjectFree( obj );
+				return NULL;
+			}
+			jsonObjectPush( obj, item );
+		}
+
+	} else {
+		// A reference to anything else goes out as a class hint of its type, with
+		// a null payload
+		obj = jsonNewObject( NULL );
+		if( !classname )
+			classname = sv_reftype( rv, 0 );
+	}
+
+	if( classname ) {
+		SV* hint = class_field( aTHX_ classes, classname, strlen( classname ), "hint" );
+		jsonObjectSetClass( obj, hint ? SvPV_nolen( hint ) : classname );
+	}
+
+	return obj;
+}
+
+/* ------------------------------------- Arena */
+
+/* The state of a conversion, to be put back when it's done */
+typedef struct {
+	osrfArena* previous;   /* The arena in use before the conversion began */
+	int used_arena;        /* True if the conversion has the arena */
+	jsonObject* obj;       /* What to free afterwards, if it doesn't */
+} conversion;
+
+/* Finish a conversion begun by start_conversion(), freeing its jsonObjects.  Runs when
+   the caller's scope is left, whether normally or by a croak from a tied or overloaded
+   value, so that the arena isn't left busy */
+static void finish_conversion( pTHX_ void* p ) {
+	conversion* conv = (conversion*) p;
+	jsonSetArena( conv->previous );
+	if( conv->used_arena ) {
+		osrfArenaReset( arena );
+		arena_busy = 0;
+	} else
+		jsonObjectFree( conv->obj );
+	Safefree( conv );
+}
+
+/* Start a conversion: put its jsonObjects in the arena, unless a conversion already
+   has it, as when a tied hash converts something else while being converted.  The
+   caller must be within ENTER and LEAVE, and set the conversion's obj to the result */
+static conversion* start_conversion( pTHX ) {
+	conversion* conv;
+	Newxz( conv, 1, conversion );
+	if( !arena )
+		arena = osrfNewArena( 64 * 1024 );
+	conv->used_arena = !arena_busy;
+	arena_busy = 1;
+	conv->previous = jsonSetArena( conv->used_arena ? arena : NULL );
+	SAVEDESTRUCTOR_X( finish_conversion, conv );
+	return conv;
+}
+
+MODULE = OpenSRF::Utils::JSON::XS		PACKAGE = OpenSRF::Utils::JSON::XS
+
+PROTOTYPES: DISABLE
+
+void
+_set_booleans( true_sv, false_sv )
+		SV* true_sv
+		SV* false_sv
+	CODE:
+		if( !SvROK( true_sv ) || !SvOBJECT( SvRV( true_sv )))
+			croak( "OpenSRF::Utils::JSON::XS: the Booleans must be objects" );
+		SvREFCNT_dec( json_true );
+		SvREFCNT_dec( json_false );
+		json_true = newSVsv( true_sv );
+		json_false = newSVsv( false_sv );
+		bool_stash = SvSTASH( SvRV( true_sv ));
+
+void
+JSON2perl( json )
+		SV* json
+	PREINIT:
+		STRLEN len;
+		const char* s;
+		U8* utf8 = NULL;
+		conversion* conv;
+		jsonObject* obj;
+		SV* sv = NULL;
+		int log_level;
+	PPCODE:
+		if( !SvOK( json ))
+			XSRETURN_UNDEF;
+		s = SvPV_const( json, len );
+		while( len && isSPACE( *s )) {
+			++s;
+			--len;
+		}
+		if( !len )
+			XSRETURN_UNDEF;
+
+		// Characters, as JSON::XS takes them; upgrade Latin-1 without touching the caller's
+		if( !SvUTF8( json ) && has_high_bytes( s, len ))
+			s = (const char*) ( utf8 = bytes_to_utf8( (U8*) s, &len ));
+
+		ENTER;
+		if( utf8 )
+			SAVEFREEPV( utf8 );
+		conv = start_conversion( aTHX );
+		// Whatever libopensrf can't parse goes to JSON::XS, which reports it its own way
+		log_level = osrfLogGetLevel();
+		osrfLogSetLevel( 0 );
+		conv->obj = obj = jsonParse( s );
+		osrfLogSetLevel( log_level );
+		if( obj )
+			sv = object_to_sv( aTHX_ obj, class_map( aTHX_ "hints" ));
+		LEAVE;
+
+		// Return an empty list for JSON we can't parse, so that the caller can try
+		// again with JSON::XS, which takes a few things we don't, or reports the error
+		if( !obj )
+			XSRETURN_EMPTY;
+		XPUSHs( sv_2mortal( sv ));
+
+SV*
+perl2JSON( perl )
+		SV* perl
+	PREINIT:
+		conversion* conv;
+		jsonObject* obj;
+		char* json = NULL;
+	CODE:
+		ENTER;
+		conv = start_conversion( aTHX );
+		conv->obj = obj = sv_to_object( aTHX_ perl, class_map( aTHX_ "classes" ), 0 );
+		if( obj )
+			json = jsonObjectToJSON( obj );
+		LEAVE;
+
+		if( !json )
+			croak( "json text or perl structure exceeds maximum nesting level (max_depth set too low?)" );
+		RETVAL = newSVpv( json, 0 );
+		free( json );
+	OUTPUT:
+		RETVAL
@@ -41,6 +41,10 @@ my $act_syslog_enabled = 0; # is syslog enabled?
 my $logfile_enabled = 1;    # are we logging to a file?
 my $act_logfile_enabled = 1;# are we logging to a file?
 my $max_log_msg_len = 1536; # SYSLOG default maximum is 2048
+my $call_log_json = 0;      # log calls as JSON instead of as text?
+my $call_log_max_params = 0;# most characters of params to log; 0 for no limit
+my @call_log_rules;         # [ prefix, every, redact ] from the call_log settings
+my %call_log_methods;       # [ every, redact, seen ] for each method, once worked out
 
 our $logger = "OpenSRF::Utils::Logger";
 
@@ -172,6 +176,94 @@ sub set_service {
     }
 }
 
+# ----------------------------------------------------------------------
+# Configures the logging of calls from a service's call_log settings
+# in opensrf.xml (see osrfAppLoadCallLog() for the C version): format
+# (text or json), max_params, and any number of sample (rate, methods)
+# and redact (methods) blocks.  Methods are matched by name prefix, and
+# the last sample that matches wins.
+# ----------------------------------------------------------------------
+sub set_call_log {
+    my( $self, $conf ) = @_;
+    @call_log_rules = ();
+    %call_log_methods = ();
+    return unless ref($conf) eq 'HASH';
+
+    $call_log_json = (($conf->{format} || '') =~ /^json$/i) ? 1 : 0;
+    $call_log_max_params = $conf->{max_params} || 0;
+
+    my $list = sub { my $v = shift; return ref($v) eq 'ARRAY' ? @$v : defined($v) ? ($v) : (); };
+
+    for my $sample ($list->($conf->{sample})) {
+        next unless ref($sample) eq 'HASH';
+        my $rate = defined($sample->{rate}) ? $sample->{rate} : 1;
+        # log one call in every so many; 0 for none
+        my $every = $rate <= 0 ? 0 : $rate >= 1 ? 1 : int(1 / $rate + 0.5);
+        push(@call_log_rules, [ $_, $every, undef ]) for $list->($sample->{method});
+    }
+
+    if (ref($conf->{redact}) eq 'HASH') {
+        push(@call_log_rules, [ $_, undef, 1 ]) for $list->($conf->{redact}->{method});
+    }
+}
+
+# ----------------------------------------------------------------------
+# Logs a call to a method, with its params, at the INFO level, unless
+# the log level or the method's sampling rate rules it out, in which
+# case the params aren't even looked at.  $redact leaves out the params.
+# ----------------------------------------------------------------------
+sub call {
+    my( $self, $svc, $method, $params, $redact ) = @_;
+    return if INFO() > $loglevel;
+
+    my $how = $call_log_methods{$method};
+    if (!$how) {
+        $how = $call_log_methods{$method} = [ 1, 0, 0 ];
+        for my $rule (@call_log_rules) {
+            next unless index($method, $rule->[0]) == 0;
+            $how->[0] = $rule->[1] if defined $rule->[1];
+            $how->[1] = $rule->[2] if defined $rule->[2];
+        }
+    }
+    if ($how->[0] != 1) {
+        return unless $how->[0] and ($how->[2]++ % $how->[0]) == 0;
+    }
+
+    $params ||= [];
+    require OpenSRF::Utils::JSON if $call_log_json;
+    my $text;
+    my $truncated = 0;
+    if ($redact or $how->[1]) {
+        $redact = 1;
+        $text = '**PARAMS REDACTED**';
+    } elsif ($call_log_json) {
+        $text = OpenSRF::Utils::JSON->perl2JSON($params);
+    } else {
+        $text = join(', ', map { (defined $_) ? $_ : '' } @$params);
+    }
+    if (!$redact and $call_log_max_params and length($text) > $call_log_max_params) {
+        $text = substr($text, 0, $call_log_max_params) . '...';
+        $truncated = 1;
+    }
+
+    my $msg;
+    if ($call_log_json) {
+        my $json = 'OpenSRF::Utils::JSON';
+        $msg = '{"service":' . $json->perl2JSON($svc) . ',"method":' . $json->perl2JSON($method);
+        if ($redact or $truncated) {
+            # not valid JSON as it stands, so embed it as a string
+            $msg .= ',"params":' . $json->perl2JSON($text)
+                . ($redact ? ',"redacted":true}' : ',"truncated":true}');
+        } else {
+            $msg .= ",\"params\":$text}";
+        }
+    } else {
+        $msg = "$svc $method $text";
+    }
+
+    _log_message( "CALL: $msg", INFO() );
+}
+
 sub error {
     my( $self, $msg, $level ) = @_;
     $level = ERROR() unless defined ($level);
@@ -0,0 +1,69 @@
+#!perl -T
+use strict;
+use warnings;
+
+use Test::More;
+use Socket;
+use IO::Handle;
+
+BEGIN {
+    plan skip_all => "XML::Parser is not installed"
+        unless eval { require XML::Parser; 1 };
+}
+
+use OpenSRF;
+use OpenSRF::Transport::SlimJabber::XMPPReader;
+
+plan tests => 9;
+
+my @stanzas = (
+    "<message to='a\@localhost/1' from='b\@localhost/2'>" .
+        "<opensrf router_from='c\@localhost/3' osrf_xid='xid1'/>" .
+        "<thread>t1</thread><body>[{&quot;x&quot;:&quot;&lt;&amp;&gt;&quot;}]</body></message>",
+    "<presence from='x\@localhost' type='unavailable'/>",
+    qq{<message from="b\@localhost/2" to="a\@localhost/1" type="error">} .
+        qq{<thread>t2</thread><body>caf\xc3\xa9 &#x263a;</body>} .
+        "<error type='cancel' code='503'>" .
+        "<service-unavailable xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></message>",
+    "<message to='a' from='b'><body><![CDATA[<raw>]]></body></message>",
+    "<message to='a' from='b'/>",
+);
+
+# Log in, then dribble the stanzas in, a few bytes at a time, cutting
+# them anywhere, and return the messages read
+sub read_all {
+    my $fast = shift;
+    local $OpenSRF::Transport::SlimJabber::XMPPReader::FAST_PATH = $fast;
+
+    socketpair(my $ours, my $theirs, AF_UNIX, SOCK_STREAM, PF_UNSPEC) or die $!;
+    $theirs->autoflush(1);
+    my $reader = OpenSRF::Transport::SlimJabber::XMPPReader->new($ours);
+
+    print $theirs "<stream:stream xmlns='jabber:client' " .
+        "xmlns:stream='http://etherx.jabber.org/streams'><iq type='result' id='123'/>";
+    $reader->wait(1);
+
+    my @msgs;
+    my $data = join("\n", @stanzas);
+    for (my $i = 0; $i < length $data; $i += 7) {
+        print $theirs substr($data, $i, 7);
+        while (my $msg = $reader->wait(0)) {
+            push @msgs, { %$msg };
+        }
+    }
+    return ($reader, @msgs);
+}
+
+my ($slow, @slow) = read_all(0);
+my ($fast, @fast) = read_all(1);
+
+is ($fast->{stream_state}, OpenSRF::Transport::SlimJabber::XMPPReader::CONNECTED, "Logged in");
+is ($fast->{fast}, 1, "The fast path took over after the login");
+is ($slow->{fast}, 0, "And stays off when turned off");
+is (scalar @fast, 4, "Every message is read");
+is_deeply (\@fast, \@slow, "The fast path reads messages just as the XML parser does");
+
+is ($fast[0]{from}, 'c@localhost/3', "router_from is authoritative");
+is ($fast[0]{body}, '[{"x":"<&>"}]', "Entities are replaced");
+is ($fast[1]{body}, "caf\x{e9} \x{263a}", "The body is characters");
+is ($fast[1]{err_code}, '503', "Errors are read");
@@ -0,0 +1,80 @@
+#!perl -T
+use strict;
+use warnings;
+
+use Test::More;
+
+use OpenSRF::Utils::JSON;
+
+plan skip_all => "OpenSRF::Utils::JSON::XS was not built (see --enable-perl-xs)"
+    unless $OpenSRF::Utils::JSON::xs;
+plan tests => 22;
+
+my $J = 'OpenSRF::Utils::JSON';
+
+# What the pure-Perl routines make of the same input
+sub pp_JSON2perl { local $OpenSRF::Utils::JSON::xs = 0; $J->JSON2perl(@_) }
+sub pp_perl2JSON { local $OpenSRF::Utils::JSON::xs = 0; $J->perl2JSON(@_) }
+
+$J->register_class_hint( hint => 'osrfException',
+                         strip => ['session'],
+                         name => 'OpenSRF::DomainObject::oilsException');
+
+
+#
+# JSON2perl
+is ($J->JSON2perl(), undef, "Undefined string");
+is ($J->JSON2perl(" \n "), undef, "Empty string");
+
+my $json = '[1,-2,3.5,"four",null,true,false,{"a":[{}],"b":"\\u00e9"},' .
+           '{"__c":"osrfException","__p":{"foo":"bar"}},' .
+           '{"__c":" foo ","__p":"bar"},{"__c":"foo","__p":null}]';
+my $perl = $J->JSON2perl($json);
+is_deeply ($perl, pp_JSON2perl($json), "Same structure as the pure-Perl routines");
+is (ref $perl->[8], 'OpenSRF::DomainObject::oilsException', "A registered hint is blessed into its class");
+is (ref $perl->[9], 'foo', "An unregistered hint is blessed into a class of its own name");
+is_deeply ($perl->[9], \'bar', "A scalar payload is blessed by reference");
+is ($perl->[10], undef, "A null payload vivifies to undef");
+ok (JSON::XS::is_bool($perl->[5]) && $perl->[5], "true is a JSON::XS Boolean");
+ok (JSON::XS::is_bool($perl->[6]) && !$perl->[6], "false is a JSON::XS Boolean");
+is ($perl->[7]{b}, "\x{e9}", "Strings are characters");
+is ($J->JSON2perl('12345678901234567890123'), '12345678901234567890123',
+    "An integer too big for Perl is kept whole");
+
+is_deeply ($J->JSON2perl('{"a":1,"a":2}'), pp_JSON2perl('{"a":1,"a":2}'),
+           "What libopensrf can't parse goes to JSON::XS");
+
+
+#
+# perl2JSON
+my $fakeobj = bless { foo => 'bar', session => 'hidden session stuff' },
+                    'OpenSRF::DomainObject::oilsException';
+is ($J->perl2JSON($fakeobj), '{"__c":"osrfException","__p":{"foo":"bar"}}',
+    "Objects get their class hint, less the keys to strip");
+is ($J->perl2JSON(bless [1], 'foo'), '{"__c":"foo","__p":[1]}', "Unregistered classes hint as themselves");
+is ($J->perl2JSON(sub { 0 }), '{"__c":"CODE","__p":null}', "Other references hint as their type");
+is ($J->perl2JSON([ 1, "2", 2.5, undef, $J->true, $J->false ]), '[1,"2",2.5,null,true,false]',
+    "Numbers, strings, nulls and Booleans");
+is ($J->perl2JSON("caf\x{e9} \x{263a}"), '"caf\u00e9 \u263a"', "Characters beyond ASCII are escaped");
+
+my $struct = { list => [ 1, { x => 'y' } ], obj => $fakeobj, str => 'quux' };
+is_deeply ($J->JSON2perl($J->perl2JSON($struct)), pp_JSON2perl(pp_perl2JSON($struct)),
+           "Round trip as with the pure-Perl routines");
+
+my $deep = [];
+$deep = [ $deep ] for 1 .. 600;
+ok (!eval { $J->perl2JSON($deep); 1 }, "Too deep a structure is an error");
+is ($J->perl2JSON([ 'still', 'works' ]), '["still","works"]', "And then all is well again");
+
+{
+    package Explosive;
+    sub TIEHASH { bless {}, shift }
+    sub FIRSTKEY { 'a' }
+    sub NEXTKEY { undef }
+    sub FETCH { die "boom\n" }
+}
+tie my %explosive, 'Explosive';
+is (eval { $J->perl2JSON([ \%explosive ]); 1 } ? '' : $@, "boom\n",
+    "A tied hash that dies takes the conversion with it");
+is ($J->perl2JSON({ after => [ 'the', 'blast' ] }), '{"after":["the","blast"]}',
+    "And the next conversion has the arena back");
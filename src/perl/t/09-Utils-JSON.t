@@ -2,7 +2,7 @@
 use strict;
 use warnings;
 
-use Test::More tests => 54;
+use Test::More tests => 57;
 
 use OpenSRF::Utils::JSON;
 
@@ -153,3 +153,19 @@ is_deeply ($vivobj, \'bar', "Scalar payload and non-resolvable class hint vivifi
 my $perlobj = OpenSRF::Utils::JSON->JSON2perl($jsonstr);
 is (ref $perlobj, 'OpenSRF::DomainObject::oilsException');
 is_deeply ($perlobj,  { foo => 'bar' }, "Successful revivification from JSON in one step");
+
+
+#
+# body2perl and perl2msgpack
+$perlobj = OpenSRF::Utils::JSON->body2perl($jsonstr);
+is_deeply ($perlobj,  { foo => 'bar' }, "A JSON body vivifies as with JSON2perl");
+
+SKIP: {
+    skip "Data::MessagePack is not installed", 2
+        unless eval { require Data::MessagePack; 1 };
+
+    my $body = OpenSRF::Utils::JSON->perl2msgpack($perlobj);
+    like ($body, qr/^msgpack:[A-Za-z0-9+\/]+=*$/, "MessagePack bodies are base64 behind a prefix");
+    $perlobj = OpenSRF::Utils::JSON->body2perl($body);
+    is (ref $perlobj, 'OpenSRF::DomainObject::oilsException', "A MessagePack body vivifies to its class");
+}
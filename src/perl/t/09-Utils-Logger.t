@@ -1,6 +1,6 @@
 #!perl -T
 
-use Test::More tests => 3;
+use Test::More tests => 7;
 
 BEGIN {
 	use_ok( 'OpenSRF::Utils::Logger' );
@@ -14,3 +14,18 @@ $msg = OpenSRF::Utils::Logger::_log_message(
     OpenSRF::Utils::Logger::INFO()
 );
 like($msg, qr/generated by a subroutine/, 'can use a subroutine as a log message');
+
+$msg = OpenSRF::Utils::Logger->call('svc', 'a.b', [1, 'x']);
+like($msg, qr/CALL: svc a\.b 1, x/, 'calls are logged as text by default');
+
+OpenSRF::Utils::Logger->set_call_log({
+    format => 'json',
+    max_params => 4,
+    sample => { rate => '0.5', method => 'a.' },
+    redact => { method => [ 'r.' ] }
+});
+$msg = OpenSRF::Utils::Logger->call('svc', 'r.q', [1]);
+like($msg, qr/"params":"\*\*PARAMS REDACTED\*\*","redacted":true/, 'redacted methods are logged without params');
+my @logged = grep { $_ } map { OpenSRF::Utils::Logger->call('svc', 'a.b', [1, 2, 3]) } 1..4;
+is(scalar(@logged), 2, 'sampled methods are logged at the configured rate');
+like($logged[0], qr/"params":"\[1,2\.\.\.","truncated":true/, 'long params are truncated');
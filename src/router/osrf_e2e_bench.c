@@ -0,0 +1,1486 @@
+/**
+	@file osrf_e2e_bench.c
+	@brief End-to-end benchmark of a router, its listeners, and their drones, on one host.
+
+	The benchmark needs no Jabber server, settings server, or configuration files of its
+	own.  It plays the part of the Jabber server itself: a relay thread listens on a
+	loopback port, lets every connection log in, and passes each &lt;message&gt; on to the
+	connection named by its "to" attribute.  It then forks a router, and listeners for
+	opensrf.dbmath, opensrf.math, and opensrf.version, each with a fixed number of drones.
+	Their configuration and settings are written to a temporary directory, and the
+	settings are loaded from a snapshot (see osrf_settings_load_snapshot()).
+
+	The main thread is the client.  Through an osrfMultiSession it keeps a fixed number of
+	calls in flight; each call is drawn from the request mix with a seeded generator, so
+	that every run makes the same calls in the same order.  The mix names calls of four
+	kinds:
+
+	- echo: opensrf.system.echo on opensrf.dbmath, with a string of the payload size;
+	- dbmath: opensrf.dbmath add, answered by the drone itself;
+	- math: opensrf.math add, which the drone passes on to opensrf.dbmath;
+	- version: opensrf.version.verify of opensrf.math add, three services deep.
+
+	Because every message goes through the relay, the relay can time each hop, keyed by
+	the message's thread:
+
+	- send: from the client's call until the request reaches the relay;
+	- route: from there until the router has passed it to a listener;
+	- service: from there until the first reply heads back, through the listener, a drone,
+	and any calls the drone makes in turn;
+	- deliver: from there until the client has the complete result.
+
+	Nested calls, such as those from opensrf.math to opensrf.dbmath, are timed by route
+	and service as well, per service called.
+
+	The results go to standard output, one JSON object per line: one per kind of call,
+	one for all of them together, and one per service called, for instance:
+
+	{"benchmark":"e2e","call":"math","calls":1000,"errors":0,"seconds":1.2034,
+	"calls_per_sec":831.0,"total_us":{"mean":9512.3,"p50":9397.0,"p90":11472.0,
+	"p99":14009.0,"max":16011.0},"send_us":{...},"route_us":{...},...}
+
+	{"benchmark":"e2e_hop","service":"opensrf.dbmath","calls":2000,"route_us":{...},
+	"service_us":{...}}
+
+	Usage: osrf_e2e_bench -L libdir [-n calls] [-w warmup] [-c concurrency] [-d drones]
+	[-m mix] [-p bytes] [-s seed] [-C memcached] [-l loglevel] [-k]
+
+	-L names the directory holding libosrf_dbmath.so and the like; -n is the number of
+	calls to time (default 2000), after -w calls to warm up (default 100); -c is the number
+	of calls in flight at once (default 8); -d is the number of drones per service
+	(default as many as calls in flight, so that no call waits in a listener's backlog,
+	which makes for steadier timings); -m is the mix, as kinds with optional weights (default
+	"echo:1,math:1,version:1"); -p is the size of an echo payload (default 64); -s seeds
+	the choice of calls (default 1); -C names a memcached server for opensrf.version to
+	cache its answers in, which it otherwise recomputes every time; -l is the log level
+	(default 1); and -k keeps the temporary directory, with its logs, instead of removing
+	it.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+#include "opensrf/utils.h"
+#include "opensrf/log.h"
+#include "opensrf/osrf_hash.h"
+#include "opensrf/osrf_json.h"
+#include "opensrf/osrf_msgpack.h"
+#include "opensrf/osrfConfig.h"
+#include "opensrf/osrf_settings.h"
+#include "opensrf/osrf_system.h"
+#include "opensrf/osrf_application.h"
+#include "opensrf/osrf_prefork.h"
+#include "opensrf/osrf_multisession.h"
+#include "osrf_router.h"
+
+/** @brief Domain of every Jabber ID; an address, so that nothing depends on a resolver. */
+#define BENCH_DOMAIN "127.0.0.1"
+/** @brief Host name the settings snapshot is for. */
+#define BENCH_HOST "localhost"
+/** @brief User name of the router; the first part of its Jabber IDs. */
+#define BENCH_ROUTER "router"
+/** @brief User name of the listeners, drones, and client. */
+#define BENCH_USER "opensrf"
+/** @brief Prefix of every Jabber ID belonging to the router. */
+#define ROUTER_PREFIX BENCH_ROUTER "@" BENCH_DOMAIN "/"
+/** @brief How many seconds to allow for everything to start. */
+#define STARTUP_TIMEOUT 30
+/** @brief How many milliseconds to allow for a call. */
+#define CALL_TIMEOUT 30000
+
+/** @brief The services the benchmark starts, and the libraries that implement them. */
+static const char* const services[][ 2 ] = {
+	{ "opensrf.dbmath",  "libosrf_dbmath.so" },
+	{ "opensrf.math",    "libosrf_math.so" },
+	{ "opensrf.version", "libosrf_version.so" },
+};
+#define SERVICE_COUNT ( sizeof( services ) / sizeof( services[ 0 ] ) )
+
+/**
+	@brief A byte buffer read from the front and appended to at the back.
+
+	Unlike a growing_buffer, it has no size limit, so that a slow reader can fall behind
+	by as much as it likes.  The contents are always nul-terminated.
+*/
+typedef struct {
+	char* data;       /**< The bytes. */
+	size_t start;     /**< Offset of the first byte not yet consumed. */
+	size_t len;       /**< Offset just past the last byte. */
+	size_t cap;       /**< Size of @a data. */
+} byte_queue;
+
+/** @brief Where a relay connection is in logging in. */
+enum relay_state {
+	RELAY_STREAM,     /**< Waiting for the stream header. */
+	RELAY_AUTH,       /**< Waiting for the login. */
+	RELAY_READY       /**< Passing messages. */
+};
+
+/**
+	@brief One connection to the relay.
+*/
+typedef struct {
+	int fd;                 /**< The socket. */
+	enum relay_state state; /**< How far it has got in logging in. */
+	char* jid;              /**< Its Jabber ID, once logged in. */
+	byte_queue in;          /**< Received and not yet handled. */
+	byte_queue out;         /**< Waiting to be sent. */
+	size_t scanned;         /**< How much of @a in is known to hold no end tag. */
+} relay_conn;
+
+/**
+	@brief The times of one request on its way through the router and back.
+
+	All times are in microseconds on the monotonic clock.
+*/
+typedef struct {
+	char* service;          /**< The service called. */
+	char* origin;           /**< Jabber ID of the caller. */
+	double t_in;            /**< When the request reached the relay, bound for the router. */
+	double t_routed;        /**< When the router passed it on to a listener. */
+	double t_reply;         /**< When the first reply came back for the caller. */
+} hop_record;
+
+/**
+	@brief A growing collection of timings, in microseconds.
+*/
+typedef struct {
+	double* v;              /**< The timings. */
+	size_t n;               /**< How many there are. */
+	size_t cap;             /**< How many there is room for. */
+} sample_set;
+
+/**
+	@brief Route and service timings of the calls to one service.
+*/
+typedef struct {
+	sample_set route;
+	sample_set service;
+} hop_stats;
+
+/**
+	@brief The relay's state, shared with the client thread under @a lock.
+*/
+static struct {
+	int listen_fd;           /**< Socket accepting connections. */
+	int port;                /**< Port it listens on. */
+	relay_conn** conns;      /**< Open connections. */
+	int conn_count;          /**< How many there are. */
+	int conn_cap;            /**< How many there is room for. */
+	osrfHash* by_jid;        /**< Connections keyed by Jabber ID. */
+	osrfHash* threads;       /**< hop_records in flight, keyed by thread. */
+	osrfHash* finished;      /**< hop_records of the client's calls, keyed by thread. */
+	osrfHash* hops;          /**< hop_stats, keyed by service. */
+	char* client_jid;        /**< Jabber ID of the client thread. */
+	long dropped;            /**< Messages for nobody we know. */
+	volatile int stop;       /**< Boolean: true when the relay thread should quit. */
+	pthread_mutex_t lock;
+} relay;
+
+/**
+	@brief One kind of call in the mix, and its results.
+*/
+typedef struct {
+	const char* name;        /**< Name of the kind, as given in the mix. */
+	const char* service;     /**< Service to call. */
+	const char* method;      /**< Method to call. */
+	jsonObject* params;      /**< Parameters of the call. */
+	int weight;              /**< Share of the mix. */
+	long calls;              /**< Calls finished while timing. */
+	long errors;             /**< Of those, how many failed. */
+	sample_set total;        /**< Whole calls, as the client saw them. */
+	sample_set send;
+	sample_set route;
+	sample_set service_time;
+	sample_set deliver;
+} call_kind;
+
+/**
+	@brief What the client keeps with each call in flight.
+*/
+typedef struct {
+	call_kind* kind;         /**< The kind of call. */
+	double start;            /**< When it was made. */
+	char* thread;            /**< The thread it went out on, once known. */
+} bench_call;
+
+/** @brief Boolean: true while the calls are being timed, rather than warming up. */
+static int timing = 0;
+
+/** @brief Process group of the router, listeners, and drones, once there is one. */
+static volatile pid_t child_group = 0;
+
+static double now_usec( void );
+static void queue_add( byte_queue* q, const char* data, size_t n );
+static void queue_consume( byte_queue* q, size_t n );
+static void queue_free( byte_queue* q );
+static void sample_add( sample_set* s, double value );
+static int sample_cmp( const void* a, const void* b );
+static void sample_report( growing_buffer* buf, const char* name, sample_set* s );
+static char* tag_text( const char* start, const char* end, const char* tag );
+static char* attr_text( const char* start, const char* end, const char* attr );
+static void hop_record_free( char* key, void* item );
+static void hop_stats_free( char* key, void* item );
+static int relay_start( void );
+static void* relay_run( void* arg );
+static void relay_accept( void );
+static void relay_close( int i );
+static int relay_read( relay_conn* conn );
+static void relay_flush( relay_conn* conn );
+static void relay_send( relay_conn* conn, const char* data, size_t n );
+static int relay_handle( relay_conn* conn );
+static void relay_route( relay_conn* from, const char* stanza, size_t len );
+static void relay_note_hop( const char* sender, const char* recipient, const char* thread,
+		double now );
+static int relay_wait_jid( const char* jid, double deadline );
+static int write_setup( const char* dir, const char* libdir, int drones,
+		const char* memcached, int loglevel, char** config_file, char** snapshot );
+static pid_t start_child( pid_t* group );
+static void stop_handler( int sig );
+static void run_router( const char* dir, int loglevel );
+static void run_service( const char* config_file, const char* snapshot, const char* appname );
+static int parse_mix( const char* spec, int payload, call_kind** kinds, int* count );
+static int wait_until_ready( osrfMultiSession* ms );
+static void on_response( osrfMultiSession* ms, osrfMultiRequest* req,
+		const jsonObject* content );
+static void on_complete( osrfMultiSession* ms, osrfMultiRequest* req );
+static int run_calls( osrfMultiSession* ms, call_kind* kinds, int kind_count, long count,
+		int concurrency, unsigned long long* seed );
+static void report( call_kind* kinds, int kind_count, double seconds, int concurrency,
+		int drones, int payload, unsigned long seed );
+static void remove_dir( const char* dir );
+static void usage( const char* prog );
+
+int main( int argc, char* argv[] ) {
+
+	const char* libdir = NULL;
+	const char* mix = "echo:1,math:1,version:1";
+	const char* memcached = NULL;
+	long count = 2000;
+	long warmup = 100;
+	int concurrency = 8;
+	int drones = 0;
+	int payload = 64;
+	unsigned long seed = 1;
+	int loglevel = 1;
+	int keep = 0;
+
+	int opt;
+	while( ( opt = getopt( argc, argv, "L:n:w:c:d:m:p:s:C:l:kh" ) ) != -1 ) {
+		switch( opt ) {
+			case 'L' : libdir = optarg; break;
+			case 'n' : count = atol( optarg ); break;
+			case 'w' : warmup = atol( optarg ); break;
+			case 'c' : concurrency = atoi( optarg ); break;
+			case 'd' : drones = atoi( optarg ); break;
+			case 'm' : mix = optarg; break;
+			case 'p' : payload = atoi( optarg ); break;
+			case 's' : seed = strtoul( optarg, NULL, 10 ); break;
+			case 'C' : memcached = optarg; break;
+			case 'l' : loglevel = atoi( optarg ); break;
+			case 'k' : keep = 1; break;
+			default  : usage( argv[ 0 ] ); return 1;
+		}
+	}
+
+	if( !drones )
+		drones = concurrency;
+
+	if( !libdir || count < 1 || warmup < 0 || concurrency < 1 || drones < 1 || payload < 0 ) {
+		usage( argv[ 0 ] );
+		return 1;
+	}
+
+	call_kind* kinds = NULL;
+	int kind_count = 0;
+	if( parse_mix( mix, payload, &kinds, &kind_count ) )
+		return 1;
+
+	// The listeners and drones retitle themselves, overwriting argv, so copy what we need
+	libdir = strdup( libdir );
+	if( memcached )
+		memcached = strdup( memcached );
+	init_proc_title( argc, argv );
+
+	char dir[] = "/tmp/osrf_e2e_bench_XXXXXX";
+	if( !mkdtemp( dir ) ) {
+		fprintf( stderr, "Unable to create a temporary directory: %s\n", strerror( errno ) );
+		return 1;
+	}
+
+	signal( SIGPIPE, SIG_IGN );
+	signal( SIGINT, stop_handler );
+	signal( SIGTERM, stop_handler );
+	signal( SIGHUP, stop_handler );
+
+	int rc = 1;
+	pid_t group = 0;
+	char* config_file = NULL;
+	char* snapshot = NULL;
+
+	if( relay_start() )
+		goto cleanup;
+
+	if( write_setup( dir, libdir, drones, memcached, loglevel, &config_file, &snapshot ) )
+		goto cleanup;
+
+	// The router first, so that the listeners have someone to register with
+	double deadline = now_usec() + STARTUP_TIMEOUT * 1e6;
+	pid_t pid = start_child( &group );
+	if( pid == 0 )
+		run_router( dir, loglevel );
+	if( pid < 0 || relay_wait_jid( ROUTER_PREFIX "router", deadline ) ) {
+		fprintf( stderr, "The router didn't start\n" );
+		goto cleanup;
+	}
+
+	int i;
+	for( i = 0; i < SERVICE_COUNT; i++ ) {
+		pid = start_child( &group );
+		if( pid == 0 )
+			run_service( config_file, snapshot, services[ i ][ 0 ] );
+		if( pid < 0 )
+			goto cleanup;
+	}
+
+	// Each service is ready once the router has opened a connection for it
+	for( i = 0; i < SERVICE_COUNT; i++ ) {
+		char jid[ 256 ];
+		snprintf( jid, sizeof( jid ), "%s%s", ROUTER_PREFIX, services[ i ][ 0 ] );
+		if( relay_wait_jid( jid, deadline ) ) {
+			fprintf( stderr, "%s didn't start; see the logs in %s\n", services[ i ][ 0 ], dir );
+			keep = 1;
+			goto cleanup;
+		}
+	}
+
+	if( !osrfSystemBootstrapClientResc( config_file, "opensrf", "e2e_bench" ) ) {
+		fprintf( stderr, "Unable to connect the client\n" );
+		goto cleanup;
+	}
+
+	pthread_mutex_lock( &relay.lock );
+	relay.client_jid = strdup( osrfSystemGetTransportClient()->xmpp_id );
+	pthread_mutex_unlock( &relay.lock );
+
+	osrfMultiSession* ms = osrfMultiSessionInit( 0 );
+	osrfMultiSessionSetTimeout( ms, CALL_TIMEOUT );
+
+	if( wait_until_ready( ms ) ) {
+		fprintf( stderr, "The services aren't answering; see the logs in %s\n", dir );
+		keep = 1;
+	} else {
+		unsigned long long state = seed;
+		if( warmup > 0 && run_calls( ms, kinds, kind_count, warmup, concurrency, &state ) )
+			fprintf( stderr, "Lost the connection while warming up\n" );
+		else {
+			pthread_mutex_lock( &relay.lock );
+			osrfHashFree( relay.hops );
+			relay.hops = osrfNewHash();
+			osrfHashSetCallback( relay.hops, hop_stats_free );
+			pthread_mutex_unlock( &relay.lock );
+
+			timing = 1;
+			double start = now_usec();
+			if( run_calls( ms, kinds, kind_count, count, concurrency, &state ) )
+				fprintf( stderr, "Lost the connection while timing\n" );
+			else {
+				report( kinds, kind_count, ( now_usec() - start ) / 1e6, concurrency,
+					drones, payload, seed );
+				rc = 0;
+			}
+		}
+	}
+
+	osrfMultiSessionFree( ms );
+	osrf_system_shutdown();
+
+cleanup:
+	if( group > 0 ) {
+		kill( -group, SIGTERM );
+		double until = now_usec() + 5e6;
+		while( waitpid( -group, NULL, WNOHANG ) >= 0 && now_usec() < until )
+			usleep( 10000 );
+		kill( -group, SIGKILL );
+		while( waitpid( -group, NULL, 0 ) > 0 )
+			;
+	}
+
+	relay.stop = 1;
+	if( relay.listen_fd >= 0 )
+		close( relay.listen_fd );
+
+	if( relay.dropped )
+		fprintf( stderr, "The relay dropped %ld messages for unknown recipients\n",
+			relay.dropped );
+
+	if( keep )
+		fprintf( stderr, "Logs and configuration are in %s\n", dir );
+	else
+		remove_dir( dir );
+
+	free( config_file );
+	free( snapshot );
+	return rc;
+}
+
+/**
+	@brief Read the monotonic clock.
+	@return The time, in microseconds.
+*/
+static double now_usec( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+	@brief Append bytes to a byte_queue.
+	@param q Pointer to the byte_queue.
+	@param data Pointer to the bytes.
+	@param n How many there are.
+*/
+static void queue_add( byte_queue* q, const char* data, size_t n ) {
+	if( q->start > 0 && q->start >= q->len / 2 ) {
+		memmove( q->data, q->data + q->start, q->len - q->start );
+		q->len -= q->start;
+		q->start = 0;
+	}
+
+	if( q->len + n + 1 > q->cap ) {
+		size_t cap = q->cap ? q->cap : 4096;
+		while( cap < q->len + n + 1 )
+			cap *= 2;
+		char* data_new = safe_malloc( cap );
+		if( q->len )
+			memcpy( data_new, q->data, q->len );
+		free( q->data );
+		q->data = data_new;
+		q->cap = cap;
+	}
+
+	if( data )
+		memcpy( q->data + q->len, data, n );
+	q->len += n;
+	q->data[ q->len ] = '\0';
+}
+
+/**
+	@brief Take bytes off the front of a byte_queue.
+	@param q Pointer to the byte_queue.
+	@param n How many to take.
+*/
+static void queue_consume( byte_queue* q, size_t n ) {
+	q->start += n;
+	if( q->start >= q->len )
+		q->start = q->len = 0;
+	if( q->data )
+		q->data[ q->len ] = '\0';
+}
+
+/**
+	@brief Free the contents of a byte_queue.
+	@param q Pointer to the byte_queue.
+*/
+static void queue_free( byte_queue* q ) {
+	free( q->data );
+	q->data = NULL;
+	q->start = q->len = q->cap = 0;
+}
+
+/**
+	@brief Add a timing to a sample_set.
+	@param s Pointer to the sample_set.
+	@param value The timing, in microseconds.
+*/
+static void sample_add( sample_set* s, double value ) {
+	if( s->n == s->cap ) {
+		size_t cap = s->cap ? s->cap * 2 : 256;
+		double* v = safe_malloc( cap * sizeof( double ) );
+		if( s->n )
+			memcpy( v, s->v, s->n * sizeof( double ) );
+		free( s->v );
+		s->v = v;
+		s->cap = cap;
+	}
+	s->v[ s->n++ ] = value;
+}
+
+/**
+	@brief Compare two timings, for qsort().
+*/
+static int sample_cmp( const void* a, const void* b ) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+	@brief Append a summary of a sample_set to a JSON object under construction.
+	@param buf Pointer to the growing_buffer holding the object so far.
+	@param name Name of the member to add.
+	@param s Pointer to the sample_set, which is sorted in the process.
+
+	Add nothing if there are no timings.
+*/
+static void sample_report( growing_buffer* buf, const char* name, sample_set* s ) {
+	if( !s->n )
+		return;
+
+	qsort( s->v, s->n, sizeof( double ), sample_cmp );
+	double sum = 0.0;
+	size_t i;
+	for( i = 0; i < s->n; i++ )
+		sum += s->v[ i ];
+
+	buffer_fadd( buf, ",\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+		"\"p99\":%.1f,\"max\":%.1f}", name, sum / s->n,
+		s->v[ (size_t) ( 0.50 * ( s->n - 1 ) + 0.5 ) ],
+		s->v[ (size_t) ( 0.90 * ( s->n - 1 ) + 0.5 ) ],
+		s->v[ (size_t) ( 0.99 * ( s->n - 1 ) + 0.5 ) ],
+		s->v[ s->n - 1 ] );
+}
+
+/**
+	@brief Find the text of an element within a stanza.
+	@param start Start of the stanza.
+	@param end End of the stanza.
+	@param tag Name of the element.
+	@return A newly allocated copy of the text, or NULL if there's no such element.
+*/
+static char* tag_text( const char* start, const char* end, const char* tag ) {
+	char open[ 32 ];
+	char close[ 32 ];
+	snprintf( open, sizeof( open ), "<%s>", tag );
+	snprintf( close, sizeof( close ), "</%s>", tag );
+
+	const char* p = strstr( start, open );
+	if( !p || p >= end )
+		return NULL;
+	p += strlen( open );
+	const char* q = strstr( p, close );
+	if( !q || q >= end )
+		return NULL;
+
+	char* text = safe_malloc( q - p + 1 );
+	memcpy( text, p, q - p );
+	text[ q - p ] = '\0';
+	return text;
+}
+
+/**
+	@brief Find the value of an attribute within a start tag.
+	@param start Start of the tag.
+	@param end End of the tag.
+	@param attr Name of the attribute.
+	@return A newly allocated copy of the value, or NULL if there's no such attribute.
+*/
+static char* attr_text( const char* start, const char* end, const char* attr ) {
+	size_t len = strlen( attr );
+	const char* p = start;
+	while( ( p = strstr( p, attr ) ) && p < end ) {
+		if( p > start && p[ -1 ] == ' ' && p[ len ] == '='
+				&& ( p[ len + 1 ] == '"' || p[ len + 1 ] == '\'' ) ) {
+			char quote = p[ len + 1 ];
+			p += len + 2;
+			const char* q = strchr( p, quote );
+			if( !q || q >= end )
+				return NULL;
+			char* value = safe_malloc( q - p + 1 );
+			memcpy( value, p, q - p );
+			value[ q - p ] = '\0';
+			return value;
+		}
+		p += len;
+	}
+	return NULL;
+}
+
+/**
+	@brief Free a hop_record; callback for an osrfHash.
+*/
+static void hop_record_free( char* key, void* item ) {
+	hop_record* rec = item;
+	free( rec->service );
+	free( rec->origin );
+	free( rec );
+}
+
+/**
+	@brief Free a hop_stats; callback for an osrfHash.
+*/
+static void hop_stats_free( char* key, void* item ) {
+	hop_stats* stats = item;
+	free( stats->route.v );
+	free( stats->service.v );
+	free( stats );
+}
+
+/**
+	@brief Open the relay's socket and start its thread.
+	@return Zero if successful, or -1 if not.
+*/
+static int relay_start( void ) {
+	relay.listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( relay.listen_fd < 0 ) {
+		fprintf( stderr, "Unable to create a socket: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt( relay.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	addr.sin_port = 0;
+	socklen_t addr_len = sizeof( addr );
+	if( bind( relay.listen_fd, (struct sockaddr*) &addr, sizeof( addr ) )
+			|| listen( relay.listen_fd, 64 )
+			|| getsockname( relay.listen_fd, (struct sockaddr*) &addr, &addr_len ) ) {
+		fprintf( stderr, "Unable to listen on the loopback interface: %s\n",
+			strerror( errno ) );
+		return -1;
+	}
+	relay.port = ntohs( addr.sin_port );
+
+	relay.by_jid = osrfNewHash();
+	relay.threads = osrfNewHash();
+	osrfHashSetCallback( relay.threads, hop_record_free );
+	relay.finished = osrfNewHash();
+	osrfHashSetCallback( relay.finished, hop_record_free );
+	relay.hops = osrfNewHash();
+	osrfHashSetCallback( relay.hops, hop_stats_free );
+	pthread_mutex_init( &relay.lock, NULL );
+
+	pthread_t thread;
+	if( pthread_create( &thread, NULL, relay_run, NULL ) ) {
+		fprintf( stderr, "Unable to start the relay thread\n" );
+		return -1;
+	}
+	pthread_detach( thread );
+	return 0;
+}
+
+/**
+	@brief Pass messages among the relay's connections until told to stop.
+	@param arg Not used.
+	@return NULL.
+*/
+static void* relay_run( void* arg ) {
+	struct pollfd* fds = NULL;
+	int fds_cap = 0;
+
+	while( !relay.stop ) {
+		if( fds_cap < relay.conn_count + 1 ) {
+			fds_cap = ( relay.conn_count + 1 ) * 2;
+			free( fds );
+			fds = safe_malloc( fds_cap * sizeof( struct pollfd ) );
+		}
+
+		fds[ 0 ].fd = relay.listen_fd;
+		fds[ 0 ].events = POLLIN;
+		fds[ 0 ].revents = 0;
+		int i;
+		for( i = 0; i < relay.conn_count; i++ ) {
+			relay_conn* conn = relay.conns[ i ];
+			fds[ i + 1 ].fd = conn->fd;
+			fds[ i + 1 ].events = POLLIN | ( conn->out.len > conn->out.start ? POLLOUT : 0 );
+			fds[ i + 1 ].revents = 0;
+		}
+
+		int count = relay.conn_count;
+		if( poll( fds, count + 1, 50 ) < 0 ) {
+			if( errno == EINTR )
+				continue;
+			break;
+		}
+
+		// Work backwards, so that closing one connection doesn't move the next
+		for( i = count - 1; i >= 0; i-- ) {
+			relay_conn* conn = relay.conns[ i ];
+			if( fds[ i + 1 ].revents & POLLOUT )
+				relay_flush( conn );
+			if( fds[ i + 1 ].revents & ( POLLIN | POLLHUP | POLLERR ) ) {
+				if( relay_read( conn ) || relay_handle( conn ) )
+					relay_close( i );
+			}
+		}
+
+		if( fds[ 0 ].revents & POLLIN )
+			relay_accept();
+	}
+
+	free( fds );
+	return NULL;
+}
+
+/**
+	@brief Accept a new connection to the relay.
+*/
+static void relay_accept( void ) {
+	int fd = accept( relay.listen_fd, NULL, NULL );
+	if( fd < 0 )
+		return;
+
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+	if( relay.conn_count == relay.conn_cap ) {
+		int cap = relay.conn_cap ? relay.conn_cap * 2 : 16;
+		relay_conn** conns = safe_malloc( cap * sizeof( relay_conn* ) );
+		if( relay.conn_count )
+			memcpy( conns, relay.conns, relay.conn_count * sizeof( relay_conn* ) );
+		free( relay.conns );
+		relay.conns = conns;
+		relay.conn_cap = cap;
+	}
+
+	relay_conn* conn = safe_malloc( sizeof( relay_conn ) );
+	conn->fd = fd;
+	conn->state = RELAY_STREAM;
+	relay.conns[ relay.conn_count++ ] = conn;
+}
+
+/**
+	@brief Close one of the relay's connections.
+	@param i Index of the connection.
+*/
+static void relay_close( int i ) {
+	relay_conn* conn = relay.conns[ i ];
+	relay.conns[ i ] = relay.conns[ --relay.conn_count ];
+
+	if( conn->jid ) {
+		pthread_mutex_lock( &relay.lock );
+		if( osrfHashGet( relay.by_jid, conn->jid ) == conn )
+			osrfHashRemove( relay.by_jid, conn->jid );
+		pthread_mutex_unlock( &relay.lock );
+		free( conn->jid );
+	}
+
+	close( conn->fd );
+	queue_free( &conn->in );
+	queue_free( &conn->out );
+	free( conn );
+}
+
+/**
+	@brief Read whatever has arrived on a connection.
+	@param conn Pointer to the relay_conn.
+	@return Zero if the connection is still open, or -1 if not.
+*/
+static int relay_read( relay_conn* conn ) {
+	for( ;; ) {
+		size_t room = 65536;
+		queue_add( &conn->in, NULL, room );
+		conn->in.len -= room;
+		ssize_t n = read( conn->fd, conn->in.data + conn->in.len, room );
+		if( n > 0 ) {
+			conn->in.len += n;
+			conn->in.data[ conn->in.len ] = '\0';
+			if( (size_t) n < room )
+				return 0;
+		} else {
+			conn->in.data[ conn->in.len ] = '\0';
+			if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+				return 0;
+			if( n < 0 && errno == EINTR )
+				continue;
+			return -1;
+		}
+	}
+}
+
+/**
+	@brief Send as much as a connection will take of what is waiting for it.
+	@param conn Pointer to the relay_conn.
+*/
+static void relay_flush( relay_conn* conn ) {
+	while( conn->out.len > conn->out.start ) {
+		ssize_t n = write( conn->fd, conn->out.data + conn->out.start,
+			conn->out.len - conn->out.start );
+		if( n > 0 )
+			queue_consume( &conn->out, n );
+		else if( n < 0 && errno == EINTR )
+			continue;
+		else
+			break;   // Try again when poll() says there's room; or find out it's closed
+	}
+}
+
+/**
+	@brief Send something to a connection, or queue it to be sent.
+	@param conn Pointer to the relay_conn.
+	@param data Pointer to the bytes.
+	@param n How many there are.
+*/
+static void relay_send( relay_conn* conn, const char* data, size_t n ) {
+	queue_add( &conn->out, data, n );
+	relay_flush( conn );
+}
+
+/**
+	@brief Handle whatever complete stanzas a connection has sent.
+	@param conn Pointer to the relay_conn.
+	@return Zero if the connection stays open, or -1 if it's done.
+
+	Take the stream header and the login at face value; log in whoever asks.
+*/
+static int relay_handle( relay_conn* conn ) {
+	for( ;; ) {
+		char* in = conn->in.data ? conn->in.data + conn->in.start : "";
+
+		if( conn->state == RELAY_STREAM ) {
+			char* p = strstr( in, "<stream:stream" );
+			char* end = p ? strchr( p, '>' ) : NULL;
+			if( !end )
+				return 0;
+			queue_consume( &conn->in, end + 1 - in );
+			const char* header = "<stream:stream xmlns='jabber:client' "
+				"xmlns:stream='http://etherx.jabber.org/streams' from='" BENCH_DOMAIN
+				"' id='e2e_bench'>";
+			relay_send( conn, header, strlen( header ) );
+			conn->state = RELAY_AUTH;
+
+		} else if( conn->state == RELAY_AUTH ) {
+			char* end = strstr( in, "</iq>" );
+			if( !end )
+				return 0;
+			char* username = tag_text( in, end, "username" );
+			char* resource = tag_text( in, end, "resource" );
+			queue_consume( &conn->in, end + 5 - in );
+			if( !username || !resource ) {
+				free( username );
+				free( resource );
+				return -1;
+			}
+
+			conn->jid = va_list_to_string( "%s@%s/%s", username, BENCH_DOMAIN, resource );
+			free( username );
+			free( resource );
+			pthread_mutex_lock( &relay.lock );
+			osrfHashSet( relay.by_jid, conn, "%s", conn->jid );
+			pthread_mutex_unlock( &relay.lock );
+
+			const char* result = "<iq type='result' id='123456789'/>";
+			relay_send( conn, result, strlen( result ) );
+			conn->state = RELAY_READY;
+
+		} else {
+			char* p = strstr( in, "<message" );
+			char* close = strstr( in, "</stream:stream>" );
+			if( close && ( !p || close < p ) )
+				return -1;
+			if( !p )
+				return 0;
+
+			// Don't look again through what we've already looked through
+			char* from = in + conn->scanned;
+			if( from < p )
+				from = p;
+			char* end = strstr( from, "</message>" );
+			if( !end ) {
+				size_t len = strlen( in );
+				conn->scanned = len > 10 ? len - 10 : 0;
+				return 0;
+			}
+
+			end += strlen( "</message>" );
+			relay_route( conn, p, end - p );
+			conn->scanned = 0;
+			queue_consume( &conn->in, end - in );
+		}
+	}
+}
+
+/**
+	@brief Pass a message on to its recipient, noting the time as it goes by.
+	@param from Pointer to the relay_conn that sent it.
+	@param stanza Pointer to the message.
+	@param len Length of the message.
+*/
+static void relay_route( relay_conn* from, const char* stanza, size_t len ) {
+	double now = now_usec();
+	const char* end = stanza + len;
+	const char* tag_end = strchr( stanza, '>' );
+	char* to = attr_text( stanza, tag_end ? tag_end : end, "to" );
+	if( !to ) {
+		relay.dropped++;
+		return;
+	}
+
+	char* thread = tag_text( stanza, end, "thread" );
+	if( thread ) {
+		pthread_mutex_lock( &relay.lock );
+		relay_note_hop( from->jid, to, thread, now );
+		pthread_mutex_unlock( &relay.lock );
+		free( thread );
+	}
+
+	relay_conn* target = osrfHashGet( relay.by_jid, to );
+	if( target )
+		relay_send( target, stanza, len );
+	else
+		relay.dropped++;
+	free( to );
+}
+
+/**
+	@brief Note the time of a message, on whichever hop it is taking.
+	@param sender Jabber ID of the sender.
+	@param recipient Jabber ID of the recipient.
+	@param thread The message's thread.
+	@param now The time, in microseconds.
+
+	A message for the router, other than for the router's own control connection, starts
+	a call.  The router's message to a listener on the same thread ends the route hop,
+	and the first message back to the caller ends the service hop.
+
+	Called with the lock held.
+*/
+static void relay_note_hop( const char* sender, const char* recipient, const char* thread,
+		double now ) {
+	size_t prefix_len = strlen( ROUTER_PREFIX );
+	int from_router = !strncmp( sender, ROUTER_PREFIX, prefix_len );
+
+	if( !from_router && !strncmp( recipient, ROUTER_PREFIX, prefix_len ) ) {
+		if( !strcmp( recipient + prefix_len, "router" ) )
+			return;
+		hop_record* rec = safe_malloc( sizeof( hop_record ) );
+		rec->service = strdup( recipient + prefix_len );
+		rec->origin = strdup( sender );
+		rec->t_in = now;
+		osrfHashSet( relay.threads, rec, "%s", thread );
+		return;
+	}
+
+	hop_record* rec = osrfHashGet( relay.threads, thread );
+	if( !rec )
+		return;
+
+	if( from_router ) {
+		if( !rec->t_routed )
+			rec->t_routed = now;
+	} else if( rec->t_routed && !strcmp( recipient, rec->origin ) ) {
+		rec->t_reply = now;
+		osrfHashExtract( relay.threads, thread );
+
+		hop_stats* stats = osrfHashGet( relay.hops, rec->service );
+		if( !stats ) {
+			stats = safe_malloc( sizeof( hop_stats ) );
+			osrfHashSet( relay.hops, stats, "%s", rec->service );
+		}
+		sample_add( &stats->route, rec->t_routed - rec->t_in );
+		sample_add( &stats->service, rec->t_reply - rec->t_routed );
+
+		if( relay.client_jid && !strcmp( rec->origin, relay.client_jid ) )
+			osrfHashSet( relay.finished, rec, "%s", thread );
+		else
+			hop_record_free( NULL, rec );
+	}
+}
+
+/**
+	@brief Wait for someone to log in to the relay with a given Jabber ID.
+	@param jid The Jabber ID.
+	@param deadline When to give up, in microseconds on the monotonic clock.
+	@return Zero if someone did, or -1 if not.
+*/
+static int relay_wait_jid( const char* jid, double deadline ) {
+	for( ;; ) {
+		pthread_mutex_lock( &relay.lock );
+		int found = osrfHashGet( relay.by_jid, jid ) != NULL;
+		pthread_mutex_unlock( &relay.lock );
+		if( found )
+			return 0;
+		if( now_usec() > deadline )
+			return -1;
+		usleep( 10000 );
+	}
+}
+
+/**
+	@brief Write the configuration file and settings snapshot the processes start from.
+	@param dir The temporary directory to write them in.
+	@param libdir Directory holding the libraries that implement the services.
+	@param drones How many drones each service should have.
+	@param memcached A memcached server, as host:port, or NULL for none.
+	@param loglevel Log level for all the processes.
+	@param config_file Pointer through which to return the name of the configuration file.
+	@param snapshot Pointer through which to return the name of the settings snapshot.
+	@return Zero if successful, or -1 if not.
+*/
+static int write_setup( const char* dir, const char* libdir, int drones,
+		const char* memcached, int loglevel, char** config_file, char** snapshot ) {
+
+	*config_file = va_list_to_string( "%s/opensrf_core.xml", dir );
+	FILE* file = fopen( *config_file, "w" );
+	if( !file ) {
+		fprintf( stderr, "Unable to write %s: %s\n", *config_file, strerror( errno ) );
+		return -1;
+	}
+	fprintf( file,
+		"<config><opensrf>"
+		"<routers><router>" BENCH_DOMAIN "</router></routers>"
+		"<router_name>" BENCH_ROUTER "</router_name>"
+		"<domain>" BENCH_DOMAIN "</domain>"
+		"<username>" BENCH_USER "</username><passwd>e2e_bench</passwd>"
+		"<port>%d</port>"
+		"<logfile>%s/osrfsys.log</logfile><loglevel>%d</loglevel>"
+		"</opensrf><shared><log_protect/></shared></config>\n",
+		relay.port, dir, loglevel );
+	fclose( file );
+
+	jsonObject* apps = jsonNewObjectType( JSON_HASH );
+	int i;
+	for( i = 0; i < SERVICE_COUNT; i++ ) {
+		jsonObject* unix_config = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( unix_config, "min_children", jsonNewNumberObject( drones ) );
+		jsonObjectSetKey( unix_config, "max_children", jsonNewNumberObject( drones ) );
+		// Drones live for the whole run, so that none is replaced while we time them
+		jsonObjectSetKey( unix_config, "max_requests", jsonNewNumberObject( 1000000 ) );
+
+		jsonObject* app = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( app, "language", jsonNewObject( "C" ) );
+		jsonObjectSetKey( app, "implementation",
+			jsonNewObjectFmt( "%s/%s", libdir, services[ i ][ 1 ] ) );
+		jsonObjectSetKey( app, "unix_config", unix_config );
+		jsonObjectSetKey( apps, services[ i ][ 0 ], app );
+	}
+
+	jsonObject* config = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( config, "apps", apps );
+	if( memcached ) {
+		jsonObject* global = jsonNewObjectType( JSON_HASH );
+		jsonObject* servers = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( servers, "server", jsonNewObject( memcached ) );
+		jsonObjectSetKey( global, "servers", servers );
+		jsonObjectSetKey( global, "max_cache_time", jsonNewObject( "300" ) );
+		jsonObject* cache = jsonNewObjectType( JSON_HASH );
+		jsonObjectSetKey( cache, "global", global );
+		jsonObjectSetKey( config, "cache", cache );
+	}
+
+	jsonObject* snap = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( snap, "hostname", jsonNewObject( BENCH_HOST ) );
+	jsonObjectSetKey( snap, "generation", jsonNewNumberObject( 0 ) );
+	jsonObjectSetKey( snap, "fetched", jsonNewNumberObject( (double) time( NULL ) ) );
+	jsonObjectSetKey( snap, "config", config );
+
+	size_t len = 0;
+	char* packed = jsonObjectToMsgpack( snap, &len );
+	jsonObjectFree( snap );
+
+	*snapshot = va_list_to_string( "%s/settings.snapshot", dir );
+	file = fopen( *snapshot, "w" );
+	if( !packed || !file || fwrite( packed, 1, len, file ) != len ) {
+		fprintf( stderr, "Unable to write %s\n", *snapshot );
+		free( packed );
+		if( file )
+			fclose( file );
+		return -1;
+	}
+	free( packed );
+	fclose( file );
+	return 0;
+}
+
+/**
+	@brief Fork a process to be the router or a listener.
+	@param group Pointer to the process group of all of them, or to zero for the first.
+	@return As for fork().
+
+	Putting them all, drones included, in a process group of their own lets us stop them
+	all at once when we're done.
+*/
+static pid_t start_child( pid_t* group ) {
+	fflush( NULL );
+	pid_t pid = fork();
+	if( pid < 0 ) {
+		fprintf( stderr, "Unable to fork: %s\n", strerror( errno ) );
+		return pid;
+	}
+
+	if( pid == 0 ) {
+		close( relay.listen_fd );
+		setpgid( 0, *group );
+		signal( SIGINT, SIG_DFL );
+		signal( SIGTERM, SIG_DFL );
+		signal( SIGHUP, SIG_DFL );
+#ifdef HAVE_SYS_PRCTL_H
+		// Don't outlive the benchmark, even if it's killed outright
+		prctl( PR_SET_PDEATHSIG, SIGKILL );
+#endif
+		return 0;
+	}
+
+	// Both sides set the group, so that it's set before either goes on
+	setpgid( pid, *group );
+	if( !*group )
+		*group = child_group = pid;
+	return pid;
+}
+
+/**
+	@brief Stop everything we started, and quit; handler for SIGINT and the like.
+	@param sig The signal.
+*/
+static void stop_handler( int sig ) {
+	if( child_group > 0 )
+		kill( -child_group, SIGKILL );
+	_exit( 1 );
+}
+
+/**
+	@brief Run the router; called in a child process, and never returns.
+	@param dir The temporary directory, for the log.
+	@param loglevel Log level.
+*/
+static void run_router( const char* dir, int loglevel ) {
+	char* log_file = va_list_to_string( "%s/router.log", dir );
+	osrfLogInit( OSRF_LOG_TYPE_FILE, "router", loglevel );
+	osrfLogSetFile( log_file );
+	free( log_file );
+
+	osrfStringArray* clients = osrfNewStringArray( 1 );
+	osrfStringArray* servers = osrfNewStringArray( 1 );
+	osrfStringArrayAdd( clients, BENCH_DOMAIN );
+	osrfStringArrayAdd( servers, BENCH_DOMAIN );
+
+	osrfRouter* router = osrfNewRouter( BENCH_DOMAIN, BENCH_ROUTER, "router", "e2e_bench",
+		relay.port, clients, servers );
+	if( !router || osrfRouterConnect( router ) )
+		_exit( 1 );
+
+	osrfRouterRun( router );
+	_exit( 0 );
+}
+
+/**
+	@brief Run a listener and its drones; called in a child process, and never returns.
+	@param config_file Name of the configuration file.
+	@param snapshot Name of the settings snapshot.
+	@param appname Name of the service.
+*/
+static void run_service( const char* config_file, const char* snapshot, const char* appname ) {
+	osrfConfig* cfg = osrfConfigInit( config_file, "opensrf" );
+	if( !cfg )
+		_exit( 1 );
+	osrfConfigSetDefaultConfig( cfg );
+
+	if( osrf_settings_load_snapshot( snapshot, BENCH_HOST, 0, 86400, NULL ) )
+		_exit( 1 );
+
+	char* libfile = osrf_settings_host_value( "/apps/%s/implementation", appname );
+	if( !libfile || osrfAppRegisterApplication( appname, libfile ) )
+		_exit( 1 );
+	free( libfile );
+
+	osrf_prefork_run( appname );
+	_exit( 0 );
+}
+
+/**
+	@brief Build the kinds of call from a mix specification.
+	@param spec The specification, e.g. "echo:4,math:1".
+	@param payload Size of an echo payload.
+	@param kinds Pointer through which to return an array of call_kinds.
+	@param count Pointer through which to return the number of call_kinds.
+	@return Zero if successful, or -1 if the specification is bad.
+*/
+static int parse_mix( const char* spec, int payload, call_kind** kinds, int* count ) {
+	char* copy = strdup( spec );
+	int max = 1;
+	const char* p;
+	for( p = spec; *p; p++ )
+		if( *p == ',' )
+			max++;
+
+	*kinds = safe_malloc( max * sizeof( call_kind ) );
+	*count = 0;
+
+	char* save = NULL;
+	char* item;
+	for( item = strtok_r( copy, ",", &save ); item; item = strtok_r( NULL, ",", &save ) ) {
+		call_kind* kind = *kinds + (*count)++;
+		char* colon = strchr( item, ':' );
+		kind->weight = 1;
+		if( colon ) {
+			*colon = '\0';
+			kind->weight = atoi( colon + 1 );
+		}
+
+		if( !strcmp( item, "echo" ) ) {
+			kind->name = "echo";
+			kind->service = "opensrf.dbmath";
+			kind->method = "opensrf.system.echo";
+			char* text = safe_malloc( payload + 1 );
+			int i;
+			for( i = 0; i < payload; i++ )
+				text[ i ] = "abcdefghijklmnopqrstuvwxyz0123456789"[ i % 36 ];
+			kind->params = jsonNewObjectType( JSON_ARRAY );
+			jsonObjectPush( kind->params, jsonNewObject( text ) );
+			free( text );
+		} else if( !strcmp( item, "dbmath" ) ) {
+			kind->name = "dbmath";
+			kind->service = "opensrf.dbmath";
+			kind->method = "add";
+			kind->params = jsonParse( "[2,3]" );
+		} else if( !strcmp( item, "math" ) ) {
+			kind->name = "math";
+			kind->service = "opensrf.math";
+			kind->method = "add";
+			kind->params = jsonParse( "[2,3]" );
+		} else if( !strcmp( item, "version" ) ) {
+			kind->name = "version";
+			kind->service = "opensrf.version";
+			kind->method = "opensrf.version.verify";
+			kind->params = jsonParse( "[\"opensrf.math\",\"add\",2,3]" );
+		} else {
+			fprintf( stderr, "Unknown kind of call in the mix: %s\n", item );
+			free( copy );
+			return -1;
+		}
+
+		if( kind->weight < 1 ) {
+			fprintf( stderr, "Bad weight for %s in the mix\n", kind->name );
+			free( copy );
+			return -1;
+		}
+	}
+
+	free( copy );
+	if( !*count ) {
+		fprintf( stderr, "The mix is empty\n" );
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Ask each service's listener for its health, until all of them answer.
+	@param ms Pointer to the client's osrfMultiSession.
+	@return Zero if they all answered, or -1 if not.
+*/
+static int wait_until_ready( osrfMultiSession* ms ) {
+	int i;
+	for( i = 0; i < SERVICE_COUNT; i++ )
+		osrfMultiSessionRequest( ms, services[ i ][ 0 ], "opensrf.system.health",
+			NULL, NULL, NULL, NULL );
+
+	if( osrfMultiSessionRun( ms, STARTUP_TIMEOUT * 1000 ) != 0 )
+		return -1;
+
+	int failed = 0;
+	osrfMultiRequest* req;
+	while( ( req = osrfMultiSessionNextComplete( ms ) ) ) {
+		if( req->status_code != OSRF_STATUS_OK || !req->responses->size ) {
+			fprintf( stderr, "%s failed its health check: %s\n", req->service,
+				req->status_text ? req->status_text : "no answer" );
+			failed = 1;
+		}
+		osrfMultiRequestFree( req );
+	}
+	return failed ? -1 : 0;
+}
+
+/**
+	@brief Note the thread of a call when its first response arrives.
+*/
+static void on_response( osrfMultiSession* ms, osrfMultiRequest* req,
+		const jsonObject* content ) {
+	bench_call* call = req->userData;
+	if( !call->thread && req->session )
+		call->thread = strdup( req->session->session_id );
+}
+
+/**
+	@brief Record the timings of a finished call.
+*/
+static void on_complete( osrfMultiSession* ms, osrfMultiRequest* req ) {
+	double done = now_usec();
+	bench_call* call = req->userData;
+
+	hop_record* rec = NULL;
+	if( call->thread ) {
+		pthread_mutex_lock( &relay.lock );
+		rec = osrfHashExtract( relay.finished, call->thread );
+		pthread_mutex_unlock( &relay.lock );
+	}
+
+	if( timing ) {
+		call_kind* kind = call->kind;
+		kind->calls++;
+		if( req->status_code != OSRF_STATUS_OK )
+			kind->errors++;
+		else {
+			sample_add( &kind->total, done - call->start );
+			if( rec ) {
+				sample_add( &kind->send, rec->t_in - call->start );
+				sample_add( &kind->route, rec->t_routed - rec->t_in );
+				sample_add( &kind->service_time, rec->t_reply - rec->t_routed );
+				sample_add( &kind->deliver, done - rec->t_reply );
+			}
+		}
+	}
+
+	if( rec )
+		hop_record_free( NULL, rec );
+	free( call->thread );
+	free( call );
+}
+
+/**
+	@brief Make a number of calls, keeping a fixed number in flight.
+	@param ms Pointer to the client's osrfMultiSession.
+	@param kinds The kinds of call in the mix.
+	@param kind_count How many kinds there are.
+	@param count How many calls to make.
+	@param concurrency How many to keep in flight.
+	@param seed Pointer to the state of the generator choosing the calls.
+	@return Zero if successful, or -1 if the connection was lost.
+*/
+static int run_calls( osrfMultiSession* ms, call_kind* kinds, int kind_count, long count,
+		int concurrency, unsigned long long* seed ) {
+
+	int total_weight = 0;
+	int i;
+	for( i = 0; i < kind_count; i++ )
+		total_weight += kinds[ i ].weight;
+
+	long made = 0;
+	while( made < count || osrfMultiSessionOutstanding( ms ) > 0 ) {
+		while( made < count && osrfMultiSessionOutstanding( ms ) < concurrency ) {
+			// A 64-bit linear congruential generator; the same seed makes the same calls
+			*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			int pick = (int) ( ( *seed >> 33 ) % total_weight );
+			call_kind* kind = kinds;
+			while( pick >= kind->weight ) {
+				pick -= kind->weight;
+				kind++;
+			}
+
+			bench_call* call = safe_malloc( sizeof( bench_call ) );
+			call->kind = kind;
+			call->start = now_usec();
+			osrfMultiSessionRequest( ms, kind->service, kind->method, kind->params,
+				on_response, on_complete, call );
+			made++;
+		}
+
+		if( osrfMultiSessionWait( ms, -1 ) < 0 )
+			return -1;
+	}
+	return 0;
+}
+
+/**
+	@brief Print the results.
+	@param kinds The kinds of call, with their timings.
+	@param kind_count How many kinds there are.
+	@param seconds How long the timed calls took.
+	@param concurrency How many calls were kept in flight.
+	@param drones How many drones each service had.
+	@param payload Size of an echo payload.
+	@param seed Seed of the choice of calls.
+*/
+static void report( call_kind* kinds, int kind_count, double seconds, int concurrency,
+		int drones, int payload, unsigned long seed ) {
+
+	call_kind all;
+	memset( &all, 0, sizeof( all ) );
+	all.name = "all";
+
+	int i;
+	for( i = 0; i <= kind_count; i++ ) {
+		call_kind* kind = i < kind_count ? kinds + i : &all;
+		if( kind != &all ) {
+			all.calls += kind->calls;
+			all.errors += kind->errors;
+			size_t j;
+			for( j = 0; j < kind->total.n; j++ )
+				sample_add( &all.total, kind->total.v[ j ] );
+			for( j = 0; j < kind->send.n; j++ ) {
+				sample_add( &all.send, kind->send.v[ j ] );
+				sample_add( &all.route, kind->route.v[ j ] );
+				sample_add( &all.service_time, kind->service_time.v[ j ] );
+				sample_add( &all.deliver, kind->deliver.v[ j ] );
+			}
+		}
+
+		growing_buffer* buf = buffer_init( 512 );
+		buffer_fadd( buf, "{\"benchmark\":\"e2e\",\"call\":\"%s\",\"calls\":%ld,"
+			"\"errors\":%ld,\"seconds\":%.4f,\"calls_per_sec\":%.1f", kind->name,
+			kind->calls, kind->errors, seconds, seconds > 0 ? kind->calls / seconds : 0.0 );
+		if( kind == &all )
+			buffer_fadd( buf, ",\"concurrency\":%d,\"drones\":%d,\"payload\":%d,\"seed\":%lu",
+				concurrency, drones, payload, seed );
+		sample_report( buf, "total_us", &kind->total );
+		sample_report( buf, "send_us", &kind->send );
+		sample_report( buf, "route_us", &kind->route );
+		sample_report( buf, "service_us", &kind->service_time );
+		sample_report( buf, "deliver_us", &kind->deliver );
+		buffer_add_char( buf, '}' );
+		printf( "%s\n", OSRF_BUFFER_C_STR( buf ) );
+		buffer_free( buf );
+	}
+
+	pthread_mutex_lock( &relay.lock );
+	osrfStringArray* names = osrfHashKeys( relay.hops );
+	for( i = 0; i < names->size; i++ ) {
+		const char* name = osrfStringArrayGetString( names, i );
+		hop_stats* stats = osrfHashGet( relay.hops, name );
+		growing_buffer* buf = buffer_init( 256 );
+		buffer_fadd( buf, "{\"benchmark\":\"e2e_hop\",\"service\":\"%s\",\"calls\":%lu",
+			name, (unsigned long) stats->route.n );
+		sample_report( buf, "route_us", &stats->route );
+		sample_report( buf, "service_us", &stats->service );
+		buffer_add_char( buf, '}' );
+		printf( "%s\n", OSRF_BUFFER_C_STR( buf ) );
+		buffer_free( buf );
+	}
+	osrfStringArrayFree( names );
+	pthread_mutex_unlock( &relay.lock );
+	fflush( stdout );
+}
+
+/**
+	@brief Remove the temporary directory and the files in it.
+	@param dir Name of the directory.
+*/
+static void remove_dir( const char* dir ) {
+	const char* files[] = { "opensrf_core.xml", "settings.snapshot", "osrfsys.log",
+		"router.log" };
+	int i;
+	for( i = 0; i < sizeof( files ) / sizeof( files[ 0 ] ); i++ ) {
+		char* path = va_list_to_string( "%s/%s", dir, files[ i ] );
+		unlink( path );
+		free( path );
+	}
+	rmdir( dir );
+}
+
+static void usage( const char* prog ) {
+	fprintf( stderr, "Usage: %s -L libdir [-n calls] [-w warmup] [-c concurrency] "
+		"[-d drones] [-m mix] [-p bytes] [-s seed] [-C memcached] [-l loglevel] [-k]\n",
+		prog );
+}
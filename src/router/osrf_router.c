@@ -1,5 +1,17 @@
 #include <sys/select.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define OSRF_ROUTER_EPOLL
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define OSRF_ROUTER_KQUEUE
+#endif
 #include "opensrf/utils.h"
 #include "opensrf/log.h"
 #include "opensrf/osrf_list.h"
@@ -9,6 +21,7 @@
 #include "opensrf/transport_client.h"
 #include "opensrf/transport_message.h"
 #include "opensrf/osrf_message.h"
+#include "opensrf/osrf_trace.h"
 
 /**
 	@file osrf_router.c
@@ -20,7 +33,114 @@
 
 	For each server class there may be multiple server nodes.  Each node corresponds to a
 	listener process for a service.
+
+	Where the platform offers it, the main loop waits on epoll (Linux) or kqueue (BSD)
+	instead of select().  Each socket is registered once, when its connection is opened,
+	and the readiness event carries a pointer straight to the osrfRouterClass that owns
+	it.  The cost of dispatching a message then does not depend on how many classes are
+	registered, and we aren't limited by FD_SETSIZE.
+
+	Optionally (see osrfRouterSetWorkers()) the classes may be divided into shards, each
+	serviced by its own worker thread with its own poller.  Since every class has its own
+	Jabber connection, a shard owns the connections of its classes outright.  The main
+	thread keeps the top-level connection, and with it registration and information
+	requests.  A mutex guards the shared tables of classes and nodes; it is held while
+	a message is being routed, but not while waiting for input or reading from a socket.
+	Only the shard that owns a class may free it, since only that shard reads from the
+	class's connection.  When the main thread removes a class, it hands the class over to
+	the owning shard to be freed there.
+*/
+
+/** Maximum number of readiness events to collect from one call to the poller. */
+#define ROUTER_MAX_EVENTS 64
+
+/**
+	@brief Half-life, in seconds, of a node's in-flight estimate.
+
+	The router never sees the responses, which go straight from the server to the client.
+	So we can't know exactly how many messages a node is still working on.  Instead we
+	count each routed message as in flight, and let the count decay exponentially,
+	as if the node works off half of its queue every ROUTER_INFLIGHT_HALFLIFE seconds.
+*/
+#define ROUTER_INFLIGHT_HALFLIFE 1.0
+
+/**
+	@brief Most sender JIDs to remember as verified, per connection.
+
+	When a cache fills up we simply empty it; steady-state traffic comes from a modest
+	number of drones and clients, and refills it at once.
+*/
+#define ROUTER_JID_CACHE_SIZE 512
+
+/**
+	@brief Number of buckets in a latency histogram.
+
+	Bucket 0 counts latencies under 2 microseconds; bucket i (for i > 0) counts latencies
+	of at least 2^i and under 2^(i+1) microseconds, except that the last bucket also
+	counts everything longer.  24 buckets reach about 16 seconds.
+*/
+#define ROUTER_LATENCY_BUCKETS 24
+
+/**
+	@brief Running counters for a class or a node, reported by the "stats" command.
+
+	The counters are only ever incremented, under the router lock, and cost a few
+	additions per message.  For a node, msgs_in and bytes_in stay zero, since messages
+	arrive per class.  Latency is measured from reading a message to handing its
+	forwarded copy to the socket.
+*/
+typedef struct {
+	unsigned long msgs_in;      /**< Messages received for the class. */
+	unsigned long msgs_out;     /**< Messages successfully forwarded. */
+	unsigned long bytes_in;     /**< Body bytes received. */
+	unsigned long bytes_out;    /**< Stanza bytes forwarded. */
+	unsigned long bounces;      /**< Error stanzas for messages that a node didn't take. */
+	unsigned long latency[ ROUTER_LATENCY_BUCKETS ];  /**< Log-scale latency histogram. */
+} osrfRouterStats;
+
+/**
+	@brief Strategies for picking a node of a class to receive a message.
+
+	Set by osrfRouterSetPolicy().
+*/
+typedef enum {
+	ROUTER_POLICY_ROUND_ROBIN,       /**< Take turns, regardless of load (the default). */
+	ROUTER_POLICY_LEAST_OUTSTANDING, /**< Pick the node with the fewest messages in flight. */
+	ROUTER_POLICY_WEIGHTED,          /**< Least in flight relative to advertised capacity. */
+	ROUTER_POLICY_TWO_CHOICES        /**< Sample two nodes at random; take the less loaded. */
+} osrfRouterPolicy;
+
+/**
+	@brief A set of sockets registered with an epoll or kqueue descriptor.
+*/
+struct _osrfRouterPollerStruct {
+	/** epoll or kqueue descriptor; -1 if we're using select(). */
+	int fd;
+	/**
+		@brief Classes reported ready by the most recent wait, not yet dispatched.
+
+		If a class is freed while we're working through this list, its entry is set to
+		NULL so that we don't touch it again.
+	*/
+	struct _osrfRouterClassStruct* ready[ ROUTER_MAX_EVENTS ];
+	int ready_count;            /**< Number of entries in the ready list. */
+};
+typedef struct _osrfRouterPollerStruct osrfRouterPoller;
+
+/**
+	@brief A worker thread, servicing a subset of the router's classes.
 */
+struct _osrfRouterShardStruct {
+	struct osrfRouterStruct* router;  /**< The osrfRouter that owns this shard. */
+	pthread_t thread;           /**< The thread servicing this shard. */
+	osrfRouterPoller poller;    /**< Watches the sockets of this shard's classes. */
+	/** The main thread writes a byte to wake_pipe[1] to get our attention. */
+	int wake_pipe[ 2 ];
+	/** Classes removed by another thread, for us to free.  Guarded by router->lock. */
+	osrfList* doomed;
+	int class_count;            /**< How many classes are assigned to this shard. */
+};
+typedef struct _osrfRouterShardStruct osrfRouterShard;
 
 /**
 	@brief Collection of server classes, with connection parameters for Jabber.
@@ -46,17 +166,46 @@ struct osrfRouterStruct {
 	osrfStringArray* trustedClients;
 	/** Array of server domains that we allow to register, etc. with us. */
 	osrfStringArray* trustedServers;
+	/** The same client domains, hashed for lookup; each datum is a dummy. */
+	osrfHash* trustedClientSet;
+	/** The same server domains, hashed for lookup; each datum is a dummy. */
+	osrfHash* trustedServerSet;
+	/** Senders on the top-level connection already found to be on a trusted server domain. */
+	osrfHash* verifiedServers;
 	/** List of osrfMessages to be returned from osrfMessageDeserialize() */
 	osrfList* message_list;
 
 	transport_client* connection;
+
+	osrfRouterPolicy policy;    /**< How to pick a node for each message. */
+	/** Load per unit of capacity at which we stop preferring nodes with the sender's */
+	/** locality; zero to ignore localities.                                         */
+	double locality_spill;
+
+	/** Watches the top-level socket, and (unless sharded) the class sockets. */
+	osrfRouterPoller poller;
+
+	int compress;               /**< Boolean; true if we ask Jabber to compress our streams. */
+	char* shm_dir;              /**< Where to look for same-host rings, or NULL. */
+
+	int worker_count;           /**< How many worker threads were requested. */
+	int shard_count;            /**< How many worker threads are running; 0 if unsharded. */
+	osrfRouterShard* shards;    /**< Array of shards, one per worker thread. */
+	/** Guards classes, nodes, and the doomed lists; used only when sharded. */
+	pthread_mutex_t lock;
 };
 
+/** Lock the shared tables, if other threads might be using them. */
+#define ROUTER_LOCK(r) do { if( (r)->shard_count ) pthread_mutex_lock( &(r)->lock ); } while(0)
+/** Release the lock taken by ROUTER_LOCK. */
+#define ROUTER_UNLOCK(r) do { if( (r)->shard_count ) pthread_mutex_unlock( &(r)->lock ); } while(0)
+
 /**
 	@brief Maintains a set of server nodes belonging to the same class.
 */
 struct _osrfRouterClassStruct {
 	osrfRouter* router;         /**< The osrfRouter that owns this osrfRouterClass. */
+	char* classname;            /**< Name of the class; also the key in router->classes. */
 	osrfHashIterator* itr;      /**< Iterator for set of osrfRouterNodes. */
 	/**
 		@brief Hash store of server nodes.
@@ -67,6 +216,15 @@ struct _osrfRouterClassStruct {
 	osrfHash* nodes;
 	/** The transport_client used for communicating with this server. */
 	transport_client* connection;
+	/** Where to start looking for the least loaded node, so that ties are spread out. */
+	unsigned int scan_start;
+	/** The shard that services this class, or NULL if the main thread does. */
+	osrfRouterShard* shard;
+	/** Boolean; true once the class has been removed and is waiting to be freed. */
+	int doomed;
+	/** Senders already found to be on a trusted client domain. */
+	osrfHash* verifiedClients;
+	osrfRouterStats stats;      /**< Traffic counters for the class as a whole. */
 };
 typedef struct _osrfRouterClassStruct osrfRouterClass;
 
@@ -76,15 +234,32 @@ typedef struct _osrfRouterClassStruct osrfRouterClass;
 struct _osrfRouterNodeStruct {
 	char* remoteId;     /**< Send message to me via this login. */
 	int count;          /**< How many message have been sent to this node. */
+	double inflight;    /**< Decaying estimate of messages sent and not yet finished. */
+	double inflight_time; /**< When inflight was last brought up to date. */
+	int capacity;       /**< Concurrent requests the node advertised when registering. */
+	char* locality;     /**< Where the node runs, as advertised when registering; or NULL. */
 	transport_message* lastMessage;
+	osrfRouterStats stats; /**< Traffic counters for this node. */
 };
 typedef struct _osrfRouterNodeStruct osrfRouterNode;
 
 static osrfRouterClass* osrfRouterAddClass( osrfRouter* router, const char* classname );
-static void osrfRouterClassAddNode( osrfRouterClass* rclass, const char* remoteId );
+static void osrfRouterClassAddNode( osrfRouterClass* rclass, const char* remoteId,
+		const char* body );
+static void osrfRouterNodeRegister( osrfRouterNode* node, const char* body );
+static osrfRouterNode* osrfRouterClassPickNode( osrfRouter* router, osrfRouterClass* rclass,
+		const char* locality );
+static osrfRouterNode* osrfRouterClassPickLocalNode( osrfRouter* router,
+		osrfRouterClass* rclass, const char* locality );
+static double osrfRouterNodeLoad( osrfRouterNode* node, double now, int weighted );
 static void osrfRouterHandleCommand( osrfRouter* router, const transport_message* msg );
 static void osrfRouterClassHandleMessage( osrfRouter* router,
-		osrfRouterClass* rclass, const transport_message* msg );
+		osrfRouterClass* rclass, const transport_message* msg, double received );
+static osrfHash* osrfRouterDomainSet( const osrfStringArray* domains );
+static int osrfRouterSenderTrusted( osrfHash* trusted, osrfHash* verified, const char* jid );
+static void osrfRouterStatsAddLatency( osrfRouterStats* stats, double seconds );
+static jsonObject* osrfRouterStatsToJSON( const osrfRouterStats* stats, double inflight );
+static void osrfRouterRespondStats( osrfRouter* router, const transport_message* msg );
 static void osrfRouterRemoveClass( osrfRouter* router, const char* classname );
 static void osrfRouterClassRemoveNode( osrfRouter* router, const char* classname,
 		const char* remoteId );
@@ -94,6 +269,17 @@ static osrfRouterClass* osrfRouterFindClass( osrfRouter* router, const char* cla
 static osrfRouterNode* osrfRouterClassFindNode( osrfRouterClass* rclass,
 		const char* remoteId );
 static int _osrfRouterFillFDSet( osrfRouter* router, fd_set* set );
+static void _osrfRouterRunSelect( osrfRouter* router );
+static int _osrfRouterPollOpen( osrfRouterPoller* poller );
+static int _osrfRouterPollInit( osrfRouter* router );
+static int _osrfRouterPollAdd( osrfRouterPoller* poller, int fd, osrfRouterClass* rclass );
+static void _osrfRouterPollRemove( osrfRouterPoller* poller, osrfRouterClass* rclass );
+static int _osrfRouterPollWait( osrfRouter* router, osrfRouterPoller* poller, int* top_ready );
+static void _osrfRouterRunPoll( osrfRouter* router );
+static int _osrfRouterStartShards( osrfRouter* router );
+static void _osrfRouterStopShards( osrfRouter* router );
+static void* _osrfRouterShardRun( void* arg );
+static void _osrfRouterShardReap( osrfRouterShard* shard );
 static void osrfRouterHandleIncoming( osrfRouter* router );
 static void osrfRouterClassHandleIncoming( osrfRouter* router,
 		const char* classname,  osrfRouterClass* class );
@@ -111,12 +297,14 @@ static void osrfRouterHandleMethodNFound( osrfRouter* router,
 
 #define ROUTER_REGISTER "register"
 #define ROUTER_UNREGISTER "unregister"
+#define ROUTER_STATS "stats"
 
 #define ROUTER_REQUEST_CLASS_LIST "opensrf.router.info.class.list"
 #define ROUTER_REQUEST_STATS_NODE_FULL "opensrf.router.info.stats.class.node.all"
 #define ROUTER_REQUEST_STATS_CLASS_FULL "opensrf.router.info.stats.class.all"
 #define ROUTER_REQUEST_STATS_CLASS "opensrf.router.info.stats.class"
 #define ROUTER_REQUEST_STATS_CLASS_SUMMARY "opensrf.router.info.stats.class.summary"
+#define ROUTER_REQUEST_HEALTH "opensrf.router.info.health"
 
 /**
 	@brief Stop the otherwise endless main loop of the router.
@@ -164,12 +352,24 @@ osrfRouter* osrfNewRouter(
 
 	router->trustedClients = trustedClients;
 	router->trustedServers = trustedServers;
-
+	router->trustedClientSet = osrfRouterDomainSet( trustedClients );
+	router->trustedServerSet = osrfRouterDomainSet( trustedServers );
+	router->verifiedServers = osrfNewHash();
 
 	router->classes = osrfNewHash();
 	osrfHashSetCallback(router->classes, &osrfRouterClassFree);
 	router->class_itr = osrfNewHashIterator( router->classes );
 	router->message_list = NULL;   // We'll allocate one later
+	router->policy = ROUTER_POLICY_ROUND_ROBIN;
+	router->locality_spill = 0.0;
+	router->poller.fd = -1;        // Opened by osrfRouterRun(), after we daemonize
+	router->poller.ready_count = 0;
+	router->compress = 0;
+	router->shm_dir = NULL;
+	router->worker_count = 0;
+	router->shard_count = 0;
+	router->shards = NULL;
+	pthread_mutex_init( &router->lock, NULL );
 
 	// Prepare to connect to Jabber, as a non-component, over TCP (not UNIX domain).
 	router->connection = client_init( domain, port, NULL, 0 );
@@ -177,6 +377,55 @@ osrfRouter* osrfNewRouter(
 	return router;
 }
 
+/**
+	@brief Load a list of trusted domains into a hash, for quick lookups.
+	@param domains Pointer to the list of domains.
+	@return Pointer to a newly allocated osrfHash, keyed on domain.
+
+	The data are meaningless; we only care whether a key is present.
+*/
+static osrfHash* osrfRouterDomainSet( const osrfStringArray* domains ) {
+	osrfHash* set = osrfNewHash();
+	int i;
+	for( i = 0; i < domains->size; ++i ) {
+		const char* domain = osrfStringArrayGetString( domains, i );
+		if( domain )
+			osrfHashSet( set, (void*) set, "%s", domain );
+	}
+	return set;
+}
+
+/**
+	@brief Determine whether the sender of a message is on a trusted domain.
+	@param trusted Pointer to the hashed set of trusted domains.
+	@param verified Pointer to the cache of senders already found to be trusted.
+	@param jid The sender's Jabber ID.
+	@return 1 if the sender is trusted, or 0 if not.
+
+	Each connection keeps its own cache, so that a JID seen before is accepted with a
+	single hash lookup, without parsing out the domain.  Untrusted senders are never
+	cached.
+*/
+static int osrfRouterSenderTrusted( osrfHash* trusted, osrfHash* verified, const char* jid ) {
+	if( osrfHashGet( verified, jid ) )
+		return 1;
+
+	int len = strlen( jid ) + 1;
+	char domain[ len ];
+	jid_get_domain( jid, domain, len - 1 );
+	if( !osrfHashGet( trusted, domain ) )
+		return 0;
+
+	if( osrfHashGetCount( verified ) >= ROUTER_JID_CACHE_SIZE ) {
+		osrfHashIterator* itr = osrfNewHashIterator( verified );
+		while( osrfHashIteratorNext( itr ) )
+			osrfHashRemove( verified, "%s", osrfHashIteratorKey( itr ) );
+		osrfHashIteratorFree( itr );
+	}
+	osrfHashSet( verified, (void*) verified, "%s", jid );
+	return 1;
+}
+
 /**
 	@brief Connect to Jabber.
 	@param router Pointer to the osrfRouter to connect to Jabber.
@@ -194,6 +443,125 @@ int osrfRouterConnect( osrfRouter* router ) {
 	return 0;
 }
 
+/**
+	@brief Choose how the router picks a node for each message routed to a class.
+	@param router Pointer to the osrfRouter.
+	@param policy Name of the policy.
+	@return 0 if successful, or -1 if the policy name is not recognized.
+
+	Recognized policies:
+	- "round_robin" -- take turns among the nodes (the default).
+	- "least_outstanding" -- pick the node with the fewest messages in flight.
+	- "weighted" -- like least_outstanding, but scaled by the capacity each node
+	advertised when it registered, so that a bigger node gets a bigger share.
+	- "two_choices" -- pick two nodes at random and use the one with fewer messages in
+	flight relative to its capacity ("power of two choices").
+
+	A NULL or empty name selects round_robin.
+*/
+int osrfRouterSetPolicy( osrfRouter* router, const char* policy ) {
+	if( !router )
+		return -1;
+
+	if( !policy || !*policy || !strcmp( policy, "round_robin" ) )
+		router->policy = ROUTER_POLICY_ROUND_ROBIN;
+	else if( !strcmp( policy, "least_outstanding" ) )
+		router->policy = ROUTER_POLICY_LEAST_OUTSTANDING;
+	else if( !strcmp( policy, "weighted" ) )
+		router->policy = ROUTER_POLICY_WEIGHTED;
+	else if( !strcmp( policy, "two_choices" ) )
+		router->policy = ROUTER_POLICY_TWO_CHOICES;
+	else {
+		osrfLogWarning( OSRF_LOG_MARK, "Unrecognized routing policy: %s", policy );
+		return -1;
+	}
+
+	osrfLogInfo( OSRF_LOG_MARK, "Router using routing policy %s",
+		( policy && *policy ) ? policy : "round_robin" );
+	return 0;
+}
+
+/**
+	@brief Divide the router's classes among a number of worker threads.
+	@param router Pointer to the osrfRouter.
+	@param workers How many worker threads to run.
+	@return 0 if successful, or -1 if the request is invalid.
+
+	With zero or one workers (the default), a single thread does everything.  With more,
+	osrfRouterRun() starts that many worker threads, assigns each new class to the
+	least busy of them, and leaves the top-level connection to the main thread.
+
+	Sharding requires epoll or kqueue.  Where neither is available, the setting is
+	ignored.  Must be called before osrfRouterRun().
+*/
+int osrfRouterSetWorkers( osrfRouter* router, int workers ) {
+	if( !router || workers < 0 || router->shard_count )
+		return -1;
+
+	router->worker_count = workers > 1 ? workers : 0;
+	return 0;
+}
+
+/**
+	@brief Prefer the nodes that run where the sender of a message does.
+	@param router Pointer to the osrfRouter.
+	@param spill When the least loaded of those nodes has this many messages in flight per
+		unit of the capacity it advertised, consider all the nodes; zero or less to ignore
+		localities (the default).
+
+	Senders and listeners say where they run by a locality tag in their configuration:
+	the sender in each message, a listener when it registers.  When a message has a tag,
+	and some nodes of its class share it, the router sends the message to the least loaded
+	of them, by the same measure as the weighted policy.  Once they're all loaded up to
+	@a spill, the message goes to a node picked by the routing policy from the whole
+	class, wherever it runs.
+*/
+void osrfRouterSetLocalitySpill( osrfRouter* router, double spill ) {
+	if( !router )
+		return;
+
+	router->locality_spill = spill > 0.0 ? spill : 0.0;
+	if( router->locality_spill > 0.0 )
+		osrfLogInfo( OSRF_LOG_MARK, "Router preferring nodes of the sender's locality, "
+			"up to a load of %.2f", router->locality_spill );
+}
+
+/**
+	@brief Ask Jabber to compress the router's streams.
+	@param router Pointer to the osrfRouter.
+	@param compress Boolean; true to ask for compression.
+
+	Applies to the top-level connection and to the connection of every class registered
+	afterwards.  Must be called before osrfRouterConnect().
+*/
+void osrfRouterSetCompression( osrfRouter* router, int compress ) {
+	if( !router )
+		return;
+
+	router->compress = compress ? 1 : 0;
+	client_set_compression( router->connection, router->compress );
+}
+
+/**
+	@brief Send to listeners on the same host through shared memory where they allow it.
+	@param router Pointer to the osrfRouter.
+	@param dir Directory holding the shared memory rings.
+
+	The router only sends this way; it still receives everything through Jabber, since
+	its main loop waits on the Jabber sockets directly.  Applies to the top-level
+	connection and to the connection of every class registered afterwards.  Must be
+	called before osrfRouterConnect().
+
+	See client_set_shm().
+*/
+void osrfRouterSetShm( osrfRouter* router, const char* dir ) {
+	if( !router || !dir || router->shm_dir )
+		return;
+
+	router->shm_dir = strdup( dir );
+	client_set_shm( router->connection, router->shm_dir, 0 );
+}
+
 /**
 	@brief Enter endless loop to receive and respond to input.
 	@param router Pointer to the osrfRouter that's looping.
@@ -207,6 +575,26 @@ int osrfRouterConnect( osrfRouter* router ) {
 void osrfRouterRun( osrfRouter* router ) {
 	if(!(router && router->classes)) return;
 
+	if( _osrfRouterPollInit( router ) == 0 ) {
+		if( router->worker_count && _osrfRouterStartShards( router ) )
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to start router worker threads; "
+				"running single-threaded" );
+		_osrfRouterRunPoll( router );
+		_osrfRouterStopShards( router );
+	} else
+		_osrfRouterRunSelect( router );
+}
+
+/**
+	@brief Main loop of the router, using select().
+	@param router Pointer to the osrfRouter that's looping.
+
+	This is the fallback for platforms with neither epoll nor kqueue.  On each pass we
+	rebuild the fd_set from scratch and then check every class to see whether its socket
+	fired.
+*/
+static void _osrfRouterRunSelect( osrfRouter* router ) {
+
 	int routerfd = client_sock_fd( router->connection );
 	int selectret = 0;
 
@@ -217,6 +605,8 @@ void osrfRouterRun( osrfRouter* router ) {
 		int maxfd = _osrfRouterFillFDSet( router, &set );
 
 		// Wait indefinitely for an incoming message
+		osrfLogFlush();
+		osrfTraceFlush();
 		if( (selectret = select(maxfd + 1, &set, NULL, NULL, NULL)) < 0 ) {
 			if( EINTR == errno ) {
 				if( router->stop ) {
@@ -262,6 +652,417 @@ void osrfRouterRun( osrfRouter* router ) {
 }
 
 
+/**
+	@brief Main loop of the router, using epoll or kqueue.
+	@param router Pointer to the osrfRouter that's looping.
+
+	Every socket is already registered with the poller, so each wakeup tells us exactly
+	which classes have input.  We service the top-level connection first, then each ready
+	class in turn.  Any class freed along the way (e.g. by an unregister command, or by a
+	bounce that takes out its last node) drops out of the ready list.
+*/
+static void _osrfRouterRunPoll( osrfRouter* router ) {
+
+	while( ! router->stop ) {
+
+		int top_ready = 0;
+		int count = _osrfRouterPollWait( router, &router->poller, &top_ready );
+
+		if( count < 0 ) {
+			if( EINTR == errno ) {
+				if( router->stop ) {
+					osrfLogInfo(OSRF_LOG_MARK, "Router shutting down");
+					break;
+				}
+				else
+					continue;    // Irrelevant signal; ignore it
+			} else {
+				osrfLogWarning( OSRF_LOG_MARK, "Top level poll call failed with errno %d: %s",
+						errno, strerror( errno ) );
+				break;
+			}
+		}
+
+		if( top_ready ) {
+			osrfLogDebug( OSRF_LOG_MARK, "Top router socket is active: %d",
+				client_sock_fd( router->connection ) );
+			osrfRouterHandleIncoming( router );
+		}
+
+		int i;
+		for( i = 0; i < router->poller.ready_count; ++i ) {
+			osrfRouterClass* class = router->poller.ready[ i ];
+			if( class ) {
+				osrfLogDebug( OSRF_LOG_MARK, "Socket is active for %s: %d",
+					class->classname, client_sock_fd( class->connection ) );
+				osrfRouterClassHandleIncoming( router, class->classname, class );
+			}
+		}
+		router->poller.ready_count = 0;
+	}
+}
+
+/**
+	@brief Start the worker threads, one per shard.
+	@param router Pointer to the osrfRouter.
+	@return 0 if successful, or -1 if not.
+
+	Any classes that already exist stay with the main thread.  Signals are blocked in the
+	worker threads, so that they are delivered to the main thread, which then stops the
+	workers by way of _osrfRouterStopShards().
+*/
+static int _osrfRouterStartShards( osrfRouter* router ) {
+
+	router->shards = safe_malloc( router->worker_count * sizeof( osrfRouterShard ) );
+
+	// libxml2 must initialize its global state before several threads start parsing
+	xmlInitParser();
+
+	sigset_t all_signals;
+	sigset_t old_signals;
+	sigfillset( &all_signals );
+	pthread_sigmask( SIG_BLOCK, &all_signals, &old_signals );
+
+	int i;
+	for( i = 0; i < router->worker_count; ++i ) {
+		osrfRouterShard* shard = router->shards + i;
+		shard->router = router;
+		shard->class_count = 0;
+		shard->doomed = osrfNewList();
+		shard->poller.ready_count = 0;
+		shard->wake_pipe[ 0 ] = shard->wake_pipe[ 1 ] = -1;
+
+		if( _osrfRouterPollOpen( &shard->poller )
+				|| pipe( shard->wake_pipe )
+				|| _osrfRouterPollAdd( &shard->poller, shard->wake_pipe[ 0 ], NULL )
+				|| pthread_create( &shard->thread, NULL, _osrfRouterShardRun, shard ) ) {
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to start router worker thread %d: %s",
+				i, strerror( errno ) );
+			if( shard->poller.fd >= 0 )
+				close( shard->poller.fd );
+			if( shard->wake_pipe[ 0 ] >= 0 ) {
+				close( shard->wake_pipe[ 0 ] );
+				close( shard->wake_pipe[ 1 ] );
+			}
+			osrfListFree( shard->doomed );
+			break;
+		}
+
+		// Protect the shards that are already running from changes to shard_count
+		pthread_mutex_lock( &router->lock );
+		router->shard_count = i + 1;
+		pthread_mutex_unlock( &router->lock );
+	}
+
+	pthread_sigmask( SIG_SETMASK, &old_signals, NULL );
+
+	if( 0 == router->shard_count ) {
+		free( router->shards );
+		router->shards = NULL;
+		return -1;
+	}
+
+	osrfLogInfo( OSRF_LOG_MARK, "Router started %d worker threads", router->shard_count );
+	return 0;
+}
+
+/**
+	@brief Stop the worker threads and wait for them to finish.
+	@param router Pointer to the osrfRouter.
+
+	When we return, the main thread once again owns every remaining class, and
+	osrfRouterFree() can free them.
+*/
+static void _osrfRouterStopShards( osrfRouter* router ) {
+	if( !router->shard_count )
+		return;
+
+	int i;
+	router->stop = 1;
+	for( i = 0; i < router->shard_count; ++i ) {
+		if( write( router->shards[ i ].wake_pipe[ 1 ], "", 1 ) < 0 )
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to wake router worker thread %d", i );
+	}
+
+	for( i = 0; i < router->shard_count; ++i )
+		pthread_join( router->shards[ i ].thread, NULL );
+
+	int count = router->shard_count;
+	router->shard_count = 0;     // From here on there's only one thread
+
+	for( i = 0; i < count; ++i ) {
+		osrfRouterShard* shard = router->shards + i;
+		_osrfRouterShardReap( shard );
+		osrfListFree( shard->doomed );
+		close( shard->poller.fd );
+		close( shard->wake_pipe[ 0 ] );
+		close( shard->wake_pipe[ 1 ] );
+	}
+
+	// The classes will be freed in the main thread; don't let them look for their shards.
+	osrfRouterClass* class;
+	osrfHashIterator* itr = router->class_itr;
+	osrfHashIteratorReset( itr );
+	while( (class = osrfHashIteratorNext( itr )) )
+		class->shard = NULL;
+
+	free( router->shards );
+	router->shards = NULL;
+}
+
+/**
+	@brief Free the classes that other threads have removed from a shard.
+	@param shard Pointer to the osrfRouterShard.
+
+	Called with the router's lock held, or after the worker threads have stopped.
+*/
+static void _osrfRouterShardReap( osrfRouterShard* shard ) {
+	osrfRouterClass* class;
+	while( (class = osrfListPop( shard->doomed )) ) {
+		osrfLogDebug( OSRF_LOG_MARK, "Freeing removed router class %s", class->classname );
+		osrfRouterClassFree( class->classname, class );
+	}
+}
+
+/**
+	@brief Main loop of a worker thread.
+	@param arg Pointer to the osrfRouterShard serviced by the thread.
+	@return NULL.
+
+	Like _osrfRouterRunPoll(), but for the classes of a single shard.  The only other
+	descriptor is the wake pipe, which tells us to free removed classes or to stop.
+*/
+static void* _osrfRouterShardRun( void* arg ) {
+	osrfRouterShard* shard = arg;
+	osrfRouter* router = shard->router;
+
+	while( ! router->stop ) {
+
+		int wake = 0;
+		int count = _osrfRouterPollWait( router, &shard->poller, &wake );
+
+		if( count < 0 ) {
+			if( EINTR == errno )
+				continue;
+			osrfLogWarning( OSRF_LOG_MARK, "Router worker poll call failed with errno %d: %s",
+				errno, strerror( errno ) );
+			break;
+		}
+
+		if( wake ) {
+			char buf[ 64 ];
+			if( read( shard->wake_pipe[ 0 ], buf, sizeof( buf ) ) < 0 )
+				osrfLogDebug( OSRF_LOG_MARK, "Nothing on router worker wake pipe" );
+			pthread_mutex_lock( &router->lock );
+			_osrfRouterShardReap( shard );
+			pthread_mutex_unlock( &router->lock );
+		}
+
+		int i;
+		for( i = 0; i < shard->poller.ready_count && ! router->stop; ++i ) {
+			osrfRouterClass* class = shard->poller.ready[ i ];
+			if( class )
+				osrfRouterClassHandleIncoming( router, class->classname, class );
+		}
+		shard->poller.ready_count = 0;
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Open a poller and register every socket we already have with it.
+	@param router Pointer to the osrfRouter.
+	@return 0 if successful, or -1 if no poller is available.
+
+	We open the poller here rather than in osrfNewRouter() because the router daemonizes
+	between the two calls, and a kqueue doesn't survive a fork().
+*/
+static int _osrfRouterPollInit( osrfRouter* router ) {
+
+	if( _osrfRouterPollOpen( &router->poller ) ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to open poller, falling back to select(): %s",
+			strerror( errno ) );
+		return -1;
+	}
+
+	if( _osrfRouterPollAdd( &router->poller, client_sock_fd( router->connection ), NULL ) ) {
+		close( router->poller.fd );
+		router->poller.fd = -1;
+		return -1;
+	}
+
+	// Normally there are no classes yet, but register any that we have
+	osrfRouterClass* class;
+	osrfHashIterator* itr = router->class_itr;
+	osrfHashIteratorReset( itr );
+	while( (class = osrfHashIteratorNext( itr )) )
+		_osrfRouterPollAdd( &router->poller, client_sock_fd( class->connection ), class );
+
+	return 0;
+}
+
+/**
+	@brief Open an epoll or kqueue descriptor.
+	@param poller Pointer to the osrfRouterPoller to be initialized.
+	@return 0 if successful, or -1 if not (including if no poller is available).
+*/
+static int _osrfRouterPollOpen( osrfRouterPoller* poller ) {
+
+	poller->ready_count = 0;
+
+#if defined(OSRF_ROUTER_EPOLL)
+	poller->fd = epoll_create( ROUTER_MAX_EVENTS );
+#elif defined(OSRF_ROUTER_KQUEUE)
+	poller->fd = kqueue();
+#else
+	poller->fd = -1;
+	errno = ENOSYS;
+#endif
+
+	if( poller->fd < 0 ) {
+		poller->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+	@brief Register a socket with a poller.
+	@param poller Pointer to the osrfRouterPoller.
+	@param fd The socket to watch for input.
+	@param rclass Pointer to the osrfRouterClass that owns the socket, or NULL for the
+	router's top-level connection (or a shard's wake pipe).
+	@return 0 if successful (or if we're not using a poller), or -1 on error.
+*/
+static int _osrfRouterPollAdd( osrfRouterPoller* poller, int fd, osrfRouterClass* rclass ) {
+	if( poller->fd < 0 )
+		return 0;
+
+	int rc = 0;
+
+#if defined(OSRF_ROUTER_EPOLL)
+	struct epoll_event ev;
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.ptr = rclass;
+	rc = epoll_ctl( poller->fd, EPOLL_CTL_ADD, fd, &ev );
+#elif defined(OSRF_ROUTER_KQUEUE)
+	struct kevent ev;
+	EV_SET( &ev, fd, EVFILT_READ, EV_ADD, 0, 0, rclass );
+	rc = kevent( poller->fd, &ev, 1, NULL, 0, NULL );
+#endif
+
+	if( rc ) {
+		osrfLogWarning( OSRF_LOG_MARK, "Unable to register socket %d with poller: %s",
+			fd, strerror( errno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+	@brief Stop watching a class's socket.
+	@param poller Pointer to the osrfRouterPoller watching the socket.
+	@param rclass Pointer to the osrfRouterClass that is going away.
+
+	Must be called before the class's socket is closed.  Also knock the class out of the
+	list of classes waiting to be serviced in the current pass, if it's there.
+*/
+static void _osrfRouterPollRemove( osrfRouterPoller* poller, osrfRouterClass* rclass ) {
+
+	int i;
+	for( i = 0; i < poller->ready_count; ++i ) {
+		if( poller->ready[ i ] == rclass )
+			poller->ready[ i ] = NULL;
+	}
+
+	if( poller->fd < 0 )
+		return;
+
+	int fd = client_sock_fd( rclass->connection );
+	if( fd <= 0 )
+		return;
+
+#if defined(OSRF_ROUTER_EPOLL)
+	struct epoll_event ev;     // Ignored, but older kernels insist on it
+	memset( &ev, 0, sizeof( ev ) );
+	epoll_ctl( poller->fd, EPOLL_CTL_DEL, fd, &ev );
+#elif defined(OSRF_ROUTER_KQUEUE)
+	struct kevent ev;
+	EV_SET( &ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL );
+	kevent( poller->fd, &ev, 1, NULL, 0, NULL );
+#endif
+}
+
+/**
+	@brief Wait indefinitely for input on any of the sockets watched by a poller.
+	@param router Pointer to the osrfRouter.
+	@param poller Pointer to the osrfRouterPoller.
+	@param top_ready Pointer to a flag, set to 1 if the socket registered without a class
+	(the top-level connection, or a shard's wake pipe) has input.
+	@return The number of events received, or -1 on error (with errno set).
+
+	Load the poller's ready list with the classes whose sockets have input.  If a class's
+	socket reports an error or hangup with no input to read, remove the class, as
+	_osrfRouterFillFDSet() does for a bad descriptor.
+*/
+static int _osrfRouterPollWait( osrfRouter* router, osrfRouterPoller* poller, int* top_ready ) {
+
+	poller->ready_count = 0;
+	int count = -1;
+	osrfLogFlush();
+	osrfTraceFlush();
+
+#if defined(OSRF_ROUTER_EPOLL)
+	int i;
+	struct epoll_event events[ ROUTER_MAX_EVENTS ];
+	count = epoll_wait( poller->fd, events, ROUTER_MAX_EVENTS, -1 );
+	for( i = 0; i < count; ++i ) {
+		osrfRouterClass* class = events[ i ].data.ptr;
+		if( !class )
+			*top_ready = 1;
+		else if( !( events[ i ].events & EPOLLIN )
+				&& ( events[ i ].events & ( EPOLLERR | EPOLLHUP ) ) ) {
+			osrfLogWarning( OSRF_LOG_MARK,
+				"Removing router class '%s' because of a bad top-level file descriptor [%d]",
+				class->classname, client_sock_fd( class->connection ) );
+			ROUTER_LOCK( router );
+			if( !class->doomed )
+				osrfRouterRemoveClass( router, class->classname );
+			ROUTER_UNLOCK( router );
+		} else
+			poller->ready[ poller->ready_count++ ] = class;
+	}
+#elif defined(OSRF_ROUTER_KQUEUE)
+	int i;
+	struct kevent events[ ROUTER_MAX_EVENTS ];
+	count = kevent( poller->fd, NULL, 0, events, ROUTER_MAX_EVENTS, NULL );
+	for( i = 0; i < count; ++i ) {
+		osrfRouterClass* class = events[ i ].udata;
+		if( !class )
+			*top_ready = 1;
+		else if( ( events[ i ].flags & EV_ERROR ) ||
+				( ( events[ i ].flags & EV_EOF ) && events[ i ].data == 0 ) ) {
+			osrfLogWarning( OSRF_LOG_MARK,
+				"Removing router class '%s' because of a bad top-level file descriptor [%d]",
+				class->classname, client_sock_fd( class->connection ) );
+			ROUTER_LOCK( router );
+			if( !class->doomed )
+				osrfRouterRemoveClass( router, class->classname );
+			ROUTER_UNLOCK( router );
+		} else
+			poller->ready[ poller->ready_count++ ] = class;
+	}
+#else
+	errno = ENOSYS;
+#endif
+
+	return count;
+}
+
 /**
 	@brief Handle incoming requests to the router.
 	@param router Pointer to the osrfRouter.
@@ -285,18 +1086,17 @@ static void osrfRouterHandleIncoming( osrfRouter* router ) {
 				"osrfRouterHandleIncoming(): investigating message from %s", msg->sender);
 
 			/* if the server is not on a trusted domain, drop the message */
-			int len = strlen(msg->sender) + 1;
-			char domain[len];
-			jid_get_domain( msg->sender, domain, len - 1 );
-
-			if(osrfStringArrayContains( router->trustedServers, domain)) {
+			if( osrfRouterSenderTrusted( router->trustedServerSet,
+					router->verifiedServers, msg->sender ) ) {
 
 				// If there's a command, obey it.  Otherwise, treat
 				// the message as an app session level request.
+				ROUTER_LOCK( router );
 				if( msg->router_command && *msg->router_command )
 					osrfRouterHandleCommand( router, msg );
 				else
 					osrfRouterHandleAppRequest( router, msg );
+				ROUTER_UNLOCK( router );
 			}
 			else
 				osrfLogWarning( OSRF_LOG_MARK, 
@@ -325,21 +1125,34 @@ static void osrfRouterClassHandleIncoming( osrfRouter* router, const char* class
 	// For each incoming message for this class:
 	while( (msg = client_recv( class->connection, 0 )) ) {
 
+		double received = get_timestamp_millis();
+
 		// Save the transaction id so that we can incorporate it
 		// into any relevant messages
 		osrfLogSetXid(msg->osrf_xid);
 
+		// Hold the lock while routing, since the main thread may be changing the class
+		ROUTER_LOCK( router );
+
+		if( class->doomed ) {
+			// Another thread removed the class; we'll free it once we see the wake pipe
+			ROUTER_UNLOCK( router );
+			message_free( msg );
+			osrfLogClearXid();
+			break;
+		}
+
+		++class->stats.msgs_in;
+		class->stats.bytes_in += strlen( msg->body_xml ? msg->body_xml : msg->body );
+
 		if( msg->sender ) {
 
 			osrfLogDebug(OSRF_LOG_MARK,
 				"osrfRouterClassHandleIncoming(): investigating message from %s", msg->sender);
 
 			/* if the client is not from a trusted domain, drop the message */
-			int len = strlen(msg->sender) + 1;
-			char domain[len];
-			jid_get_domain( msg->sender, domain, len - 1 );
-
-			if(osrfStringArrayContains( router->trustedClients, domain )) {
+			if( osrfRouterSenderTrusted( router->trustedClientSet,
+					class->verifiedClients, msg->sender ) ) {
 
 				if( msg->is_error )  {
 
@@ -365,22 +1178,25 @@ static void osrfRouterClassHandleIncoming( osrfRouter* router, const char* class
 						osrfLogClearXid();
 						
 						// See if the class still exists
-						if( osrfHashGet( router->classes, classname_copy ) )
+						int exists = osrfHashGet( router->classes, classname_copy ) != NULL;
+						ROUTER_UNLOCK( router );
+						if( exists )
 							continue;   // It does; keep going
 						else
 							break;      // It doesn't; don't try to read from it any more
 					}
-					osrfRouterClassHandleMessage( router, class, bouncedMessage );
+					osrfRouterClassHandleMessage( router, class, bouncedMessage, received );
 					message_free( bouncedMessage );
 				} else
-					osrfRouterClassHandleMessage( router, class, msg );
+					osrfRouterClassHandleMessage( router, class, msg, received );
 
 			} else {
-				osrfLogWarning( OSRF_LOG_MARK, 
-						"Received client message from untrusted client domain %s", domain );
+				osrfLogWarning( OSRF_LOG_MARK,
+						"Received client message from untrusted client %s", msg->sender );
 			}
 		}
 
+		ROUTER_UNLOCK( router );
 		message_free( msg );
 		osrfLogClearXid();  // We're done with this transaction id
 	}
@@ -395,6 +1211,7 @@ static void osrfRouterClassHandleIncoming( osrfRouter* router, const char* class
 	- "register" -- Add a server class and/or a server node to our lists.
 	- "unregister" -- Remove a node from a class, and the class as well if no nodes are
 	left for it.
+	- "stats" -- Reply with traffic counters and latency histograms.
 */
 static void osrfRouterHandleCommand( osrfRouter* router, const transport_message* msg ) {
 	if(!(router && msg && msg->router_class)) return;
@@ -408,9 +1225,15 @@ static void osrfRouterHandleCommand( osrfRouter* router, const transport_message
 		if(!class)
 			class = osrfRouterAddClass( router, msg->router_class );
 
-		// Add the node to the osrfRouterClass's list, if it isn't already there
-		if(class && ! osrfRouterClassFindNode( class, msg->sender ) )
-			osrfRouterClassAddNode( class, msg->sender );
+		// Add the node to the osrfRouterClass's list, if it isn't already there; if it
+		// is, take in whatever the listener says about itself now
+		if( class ) {
+			osrfRouterNode* node = osrfRouterClassFindNode( class, msg->sender );
+			if( node )
+				osrfRouterNodeRegister( node, msg->body );
+			else
+				osrfRouterClassAddNode( class, msg->sender, msg->body );
+		}
 
 	} else if( !strcmp( msg->router_command, ROUTER_UNREGISTER ) ) {
 
@@ -418,7 +1241,99 @@ static void osrfRouterHandleCommand( osrfRouter* router, const transport_message
 			osrfLogInfo( OSRF_LOG_MARK, "Unregistering router class %s", msg->router_class );
 			osrfRouterClassRemoveNode( router, msg->router_class, msg->sender );
 		}
+
+	} else if( !strcmp( msg->router_command, ROUTER_STATS ) ) {
+		osrfRouterRespondStats( router, msg );
+	}
+}
+
+/**
+	@brief Record one latency sample in a histogram.
+	@param stats Pointer to the osrfRouterStats holding the histogram.
+	@param seconds The latency, in seconds.
+*/
+static void osrfRouterStatsAddLatency( osrfRouterStats* stats, double seconds ) {
+	double micros = seconds * 1000000.0;
+	int bucket = 0;
+	while( bucket < ROUTER_LATENCY_BUCKETS - 1 && micros >= (double) ( 2UL << bucket ) )
+		++bucket;
+	++stats->latency[ bucket ];
+}
+
+/**
+	@brief Describe a set of counters as a JSON hash.
+	@param stats Pointer to the osrfRouterStats.
+	@param inflight The current in-flight estimate for the class or node.
+	@return Pointer to a newly allocated jsonObject, which the caller must free.
+*/
+static jsonObject* osrfRouterStatsToJSON( const osrfRouterStats* stats, double inflight ) {
+	jsonObject* obj = jsonNewObjectType( JSON_HASH );
+	jsonObjectSetKey( obj, "msgs_in", jsonNewNumberObject( (double) stats->msgs_in ) );
+	jsonObjectSetKey( obj, "msgs_out", jsonNewNumberObject( (double) stats->msgs_out ) );
+	jsonObjectSetKey( obj, "bytes_in", jsonNewNumberObject( (double) stats->bytes_in ) );
+	jsonObjectSetKey( obj, "bytes_out", jsonNewNumberObject( (double) stats->bytes_out ) );
+	jsonObjectSetKey( obj, "bounces", jsonNewNumberObject( (double) stats->bounces ) );
+	jsonObjectSetKey( obj, "inflight", jsonNewNumberObject( inflight ) );
+
+	jsonObject* hist = jsonNewObjectType( JSON_ARRAY );
+	int i;
+	for( i = 0; i < ROUTER_LATENCY_BUCKETS; ++i )
+		jsonObjectPush( hist, jsonNewNumberObject( (double) stats->latency[ i ] ) );
+	jsonObjectSetKey( obj, "latency", hist );
+
+	return obj;
+}
+
+/**
+	@brief Reply to a "stats" command with the traffic counters of each class and node.
+	@param router Pointer to the osrfRouter.
+	@param msg Pointer to the transport_message carrying the command.
+
+	If the message names a router_class, report only that class.  The body of the reply
+	is a JSON hash keyed on class name.  Each class is described by a hash of counters
+	(see osrfRouterStatsToJSON()), plus a "nodes" hash, keyed on remote id, describing
+	each node the same way.  The "latency" member of each is the histogram described at
+	ROUTER_LATENCY_BUCKETS.
+*/
+static void osrfRouterRespondStats( osrfRouter* router, const transport_message* msg ) {
+	double now = get_timestamp_millis();
+	jsonObject* jresponse = jsonNewObjectType( JSON_HASH );
+
+	osrfRouterClass* class;
+	osrfHashIterator* class_itr = osrfNewHashIterator( router->classes );
+	while( (class = osrfHashIteratorNext( class_itr )) ) {
+
+		const char* classname = osrfHashIteratorKey( class_itr );
+		if( msg->router_class && *msg->router_class && strcmp( msg->router_class, classname ) )
+			continue;
+
+		double inflight = 0.0;
+		jsonObject* nodes = jsonNewObjectType( JSON_HASH );
+		osrfRouterNode* node;
+		osrfHashIterator* node_itr = osrfNewHashIterator( class->nodes );
+		while( (node = osrfHashIteratorNext( node_itr )) ) {
+			double load = osrfRouterNodeLoad( node, now, 0 );
+			inflight += load;
+			jsonObject* node_res = osrfRouterStatsToJSON( &node->stats, load );
+			if( node->locality )
+				jsonObjectSetKey( node_res, "locality", jsonNewObject( node->locality ));
+			jsonObjectSetKey( nodes, node->remoteId, node_res );
+		}
+		osrfHashIteratorFree( node_itr );
+
+		jsonObject* class_res = osrfRouterStatsToJSON( &class->stats, inflight );
+		jsonObjectSetKey( class_res, "nodes", nodes );
+		jsonObjectSetKey( jresponse, classname, class_res );
 	}
+	osrfHashIteratorFree( class_itr );
+
+	char* data = jsonObjectToJSON( jresponse );
+	jsonObjectFree( jresponse );
+
+	transport_message* reply = message_init( data, "", msg->thread, msg->sender, "" );
+	free( data );
+	client_send_message( router->connection, reply );
+	message_free( reply );
 }
 
 
@@ -439,9 +1354,21 @@ static osrfRouterClass* osrfRouterAddClass( osrfRouter* router, const char* clas
 	class->itr = osrfNewHashIterator(class->nodes);
 	osrfHashSetCallback(class->nodes, &osrfRouterNodeFree);
 	class->router = router;
+	class->classname = strdup( classname );
+	class->scan_start = 0;
+	class->shard = NULL;
+	class->doomed = 0;
+	class->verifiedClients = osrfNewHash();
+	memset( &class->stats, 0, sizeof( class->stats ) );
 
 	class->connection = client_init( router->domain, router->port, NULL, 0 );
 
+	// We only forward what arrives here, so keep the bodies in their wire form
+	client_keep_body_xml( class->connection, 1 );
+	client_set_compression( class->connection, router->compress );
+	if( router->shm_dir )
+		client_set_shm( class->connection, router->shm_dir, 0 );
+
 	if(!client_connect( class->connection, router->name,
 			router->password, classname, 10, AUTH_DIGEST ) ) {
 		// Cast away the constness of classname.  Though ugly, this
@@ -453,6 +1380,25 @@ static osrfRouterClass* osrfRouterAddClass( osrfRouter* router, const char* clas
 		return NULL;
 	}
 
+	// If we have worker threads, give the class to the one with the fewest classes
+	osrfRouterPoller* poller = &router->poller;
+	if( router->shard_count ) {
+		int i;
+		osrfRouterShard* shard = router->shards;
+		for( i = 1; i < router->shard_count; ++i ) {
+			if( router->shards[ i ].class_count < shard->class_count )
+				shard = router->shards + i;
+		}
+		class->shard = shard;
+		++shard->class_count;
+		poller = &shard->poller;
+	}
+
+	if( _osrfRouterPollAdd( poller, client_sock_fd( class->connection ), class ) ) {
+		osrfRouterClassFree( (char *) classname, class );
+		return NULL;
+	}
+
 	osrfHashSet( router->classes, class, classname );
 	return class;
 }
@@ -462,20 +1408,62 @@ static osrfRouterClass* osrfRouterAddClass( osrfRouter* router, const char* clas
 	@brief Add a new server node to an osrfRouterClass.
 	@param rclass Pointer to the osrfRouterClass to which we are to add the node.
 	@param remoteId The remote login of the osrfRouterNode.
+	@param body The body of the registration message.
 */
-static void osrfRouterClassAddNode( osrfRouterClass* rclass, const char* remoteId ) {
+static void osrfRouterClassAddNode( osrfRouterClass* rclass, const char* remoteId,
+		const char* body ) {
 	if(!(rclass && rclass->nodes && remoteId)) return;
 
-	osrfLogInfo( OSRF_LOG_MARK, "Adding router node for remote id %s", remoteId );
-
 	osrfRouterNode* node = safe_malloc(sizeof(osrfRouterNode));
 	node->count = 0;
+	node->inflight = 0.0;
+	node->inflight_time = 0.0;
 	node->lastMessage = NULL;
 	node->remoteId = strdup(remoteId);
+	memset( &node->stats, 0, sizeof( node->stats ) );
+	osrfRouterNodeRegister( node, body );
+
+	osrfLogInfo( OSRF_LOG_MARK, "Adding router node for remote id %s with capacity %d "
+		"and locality %s", remoteId, (int) node->capacity,
+		node->locality ? node->locality : "(none)" );
 
 	osrfHashSet( rclass->nodes, node, remoteId );
 }
 
+/**
+	@brief Set a server node's capacity and locality from its registration message.
+	@param node Pointer to the osrfRouterNode.
+	@param body The body of the registration message.
+
+	Older listeners send a body of "registering".  Newer ones send a JSON object such as
+	{"capacity":10,"locality":"rack1"}, where the capacity is the most drones the listener
+	will run, and the locality, if any, says where it runs.  The capacity defaults to 1.
+
+	A listener registers again whenever it restarts or reloads, perhaps somewhere else;
+	what it says then replaces what it said before.
+*/
+static void osrfRouterNodeRegister( osrfRouterNode* node, const char* body ) {
+	int capacity = 1;
+	const char* locality = NULL;
+	jsonObject* reg = body && '{' == *body ? jsonParse( body ) : NULL;
+	if( reg ) {
+		capacity = (int) jsonObjectGetNumber( jsonObjectGetKeyConst( reg, "capacity" ) );
+		locality = jsonObjectGetString( jsonObjectGetKeyConst( reg, "locality" ) );
+	}
+	if( locality && !*locality )
+		locality = NULL;
+
+	if( node->locality && ( !locality || strcmp( node->locality, locality ) ) )
+		osrfLogInfo( OSRF_LOG_MARK, "Router node %s moved from locality %s to %s",
+			node->remoteId, node->locality, locality ? locality : "(none)" );
+
+	node->capacity = capacity > 0 ? capacity : 1;
+	char* old_locality = node->locality;
+	node->locality = locality ? strdup( locality ) : NULL;
+	free( old_locality );
+	jsonObjectFree( reg );
+}
+
 /**
 	@brief Handle an input message representing a Jabber error stanza.
 	@param router Pointer to the current osrfRouter.
@@ -504,6 +1492,9 @@ static transport_message* osrfRouterClassHandleBounce( osrfRouter* router,
 		return NULL;
 	}
 
+	++node->stats.bounces;
+	++rclass->stats.bounces;
+
 	if( osrfHashGetCount(rclass->nodes) == 1 ) { /* the last node is dead */
 
 		if( node->lastMessage ) {
@@ -511,9 +1502,10 @@ static transport_message* osrfRouterClassHandleBounce( osrfRouter* router,
 					"We lost the last node in the class, responding with error and removing...");
 
 			transport_message* error = message_init(
-				node->lastMessage->body, node->lastMessage->subject,
+				NULL, node->lastMessage->subject,
 				node->lastMessage->thread, node->lastMessage->router_from,
 				node->lastMessage->recipient );
+			message_share_body(error, node->lastMessage);
 			message_set_osrf_xid(error, node->lastMessage->osrf_xid);
 			set_msg_error( error, "cancel", 501 );
 
@@ -532,12 +1524,15 @@ static transport_message* osrfRouterClassHandleBounce( osrfRouter* router,
 
 		if( node->lastMessage ) {
 			osrfLogDebug( OSRF_LOG_MARK, "Cloning lastMessage so next node can send it");
-			lastSent = message_init( node->lastMessage->body,
+			lastSent = message_init( NULL,
 				node->lastMessage->subject, node->lastMessage->thread, "",
 				node->lastMessage->router_from );
 			message_set_router_info( lastSent, node->lastMessage->router_from,
 				NULL, NULL, NULL, 0 );
 			message_set_osrf_xid( lastSent, node->lastMessage->osrf_xid );
+			message_set_osrf_span( lastSent, node->lastMessage->osrf_span );
+			message_set_osrf_locality( lastSent, node->lastMessage->osrf_locality );
+			message_share_body( lastSent, node->lastMessage );
 		}
 
 		/* remove the dead node */
@@ -547,38 +1542,196 @@ static transport_message* osrfRouterClassHandleBounce( osrfRouter* router,
 }
 
 
+/**
+	@brief Bring a node's in-flight estimate up to date, and report its load.
+	@param node Pointer to the osrfRouterNode.
+	@param now The current time, in seconds.
+	@param weighted Boolean; if true, scale the load by the node's capacity.
+	@return The estimated number of messages in flight, optionally divided by capacity.
+*/
+static double osrfRouterNodeLoad( osrfRouterNode* node, double now, int weighted ) {
+	if( node->inflight > 0.0 && now > node->inflight_time ) {
+		node->inflight *= pow( 0.5, ( now - node->inflight_time ) / ROUTER_INFLIGHT_HALFLIFE );
+		if( node->inflight < 0.01 )
+			node->inflight = 0.0;
+	}
+	node->inflight_time = now;
+
+	return weighted ? ( node->inflight / node->capacity ) : node->inflight;
+}
+
+/**
+	@brief Pick the least loaded node of a class that runs where the sender does.
+	@param router Pointer to the current osrfRouter.
+	@param rclass Pointer to the class to which the message is directed.
+	@param locality The sender's locality tag.
+	@return Pointer to the chosen osrfRouterNode; or NULL if no node has the same tag, or
+		if they're all loaded up to the router's locality_spill.
+
+	The load is by the same measure as the weighted policy.  Like the other load-aware
+	policies, we start each scan one node further along, so that ties are spread out.
+*/
+static osrfRouterNode* osrfRouterClassPickLocalNode( osrfRouter* router,
+		osrfRouterClass* rclass, const char* locality ) {
+
+	unsigned long count = osrfHashGetCount( rclass->nodes );
+	if( 0 == count )
+		return NULL;
+
+	double now = get_timestamp_millis();
+	unsigned long start = rclass->scan_start++ % count;
+	osrfRouterNode* best = NULL;
+	double best_load = 0.0;
+	osrfRouterNode* node;
+	unsigned long i = 0;
+
+	// Walk the nodes with a cursor of our own, leaving the round robin position alone
+	osrfHashCursor cursor = NULL;
+	osrfRouterNode* nodes[ count ];
+	while( i < count && (node = osrfHashCursorNext( rclass->nodes, &cursor, NULL )) )
+		nodes[ i++ ] = node;
+	count = i;
+
+	for( i = 0; i < count; ++i ) {
+		node = nodes[ ( start + i ) % count ];
+		if( !node->locality || strcmp( node->locality, locality ) )
+			continue;
+
+		double load = osrfRouterNodeLoad( node, now, 1 );
+		if( !best || load < best_load ) {
+			best = node;
+			best_load = load;
+		}
+	}
+
+	return best && best_load < router->locality_spill ? best : NULL;
+}
+
+/**
+	@brief Pick a node of a class to receive the next message, according to the policy.
+	@param router Pointer to the current osrfRouter.
+	@param rclass Pointer to the class to which the message is directed.
+	@param locality The sender's locality tag, or NULL if it has none.
+	@return Pointer to the chosen osrfRouterNode, or NULL if the class has no nodes.
+
+	If the router prefers local nodes (see osrfRouterSetLocalitySpill()), and one with the
+	sender's locality has room, that's the one (see osrfRouterClassPickLocalNode()).
+
+	For round robin, we use an iterator, stored with the class, to maintain a position in
+	the class's list of nodes.  Advance the iterator to pick the next node, and if we reach
+	the end, go back to the beginning of the list.
+
+	The other policies compare in-flight estimates.  A class rarely has more than a few
+	nodes, so a linear scan is cheap.  We start each scan one node further along than the
+	last one, so that idle nodes with equal loads still take turns.
+*/
+static osrfRouterNode* osrfRouterClassPickNode( osrfRouter* router, osrfRouterClass* rclass,
+		const char* locality ) {
+
+	osrfRouterNode* node = NULL;
+
+	if( locality && router->locality_spill > 0.0 ) {
+		node = osrfRouterClassPickLocalNode( router, rclass, locality );
+		if( node )
+			return node;
+	}
+
+	if( ROUTER_POLICY_ROUND_ROBIN == router->policy ) {
+		node = osrfHashIteratorNext( rclass->itr );
+		if(!node) {   // wrap around to the beginning of the list
+			osrfHashIteratorReset(rclass->itr);
+			node = osrfHashIteratorNext( rclass->itr );
+		}
+		return node;
+	}
+
+	unsigned long count = osrfHashGetCount( rclass->nodes );
+	if( 0 == count )
+		return NULL;
+
+	double now = get_timestamp_millis();
+	int weighted = ( ROUTER_POLICY_LEAST_OUTSTANDING != router->policy );
+
+	// For two choices, pick the two candidate positions up front
+	unsigned long first = 0;
+	unsigned long second = 0;
+	if( ROUTER_POLICY_TWO_CHOICES == router->policy && count > 1 ) {
+		first = random() % count;
+		second = random() % ( count - 1 );
+		if( second >= first )
+			++second;
+	}
+
+	unsigned long start = rclass->scan_start++ % count;
+	osrfRouterNode* best = NULL;
+	double best_load = 0.0;
+	unsigned long i = 0;
+	unsigned long pos;
+
+	// Visit the nodes in order, from position start, wrapping around
+	osrfHashIteratorReset( rclass->itr );
+	osrfRouterNode* nodes[ count ];
+	while( i < count && (node = osrfHashIteratorNext( rclass->itr )) )
+		nodes[ i++ ] = node;
+	count = i;
+
+	for( i = 0; i < count; ++i ) {
+		pos = ( start + i ) % count;
+		if( ROUTER_POLICY_TWO_CHOICES == router->policy && count > 1
+				&& pos != first && pos != second )
+			continue;
+
+		double load = osrfRouterNodeLoad( nodes[ pos ], now, weighted );
+		if( !best || load < best_load ) {
+			best = nodes[ pos ];
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
 /**
 	@brief Forward a class-level message to a listener for the corresponding service.
 	@param router Pointer to the current osrfRouter.
 	@param rclass Pointer to the class to which the message is directed.
 	@param msg Pointer to the message to be forwarded.
+	@param received When the message was read, as reported by get_timestamp_millis().
 
-	Pick a node for the specified class, and forward the message to it.
+	Pick a node for the specified class, according to the router's policy, and forward
+	the message to it.
 
-	We use an iterator, stored with the class, to maintain a position in the class's list
-	of nodes.  Advance the iterator to pick the next node, and if we reach the end, go
-	back to the beginning of the list.
+	The outgoing message shares the body of @a msg, along with its still-encoded form if
+	the session captured one, so that the body is neither copied nor encoded again.
+
+	If we're tracing, time the message from its arrival until it's forwarded, as a span of
+	whatever sent it, and pass the new span along as the context of the outgoing message.
 */
-static void osrfRouterClassHandleMessage(
-		osrfRouter* router, osrfRouterClass* rclass, const transport_message* msg ) {
+static void osrfRouterClassHandleMessage( osrfRouter* router, osrfRouterClass* rclass,
+		const transport_message* msg, double received ) {
 	if(!(router && rclass && msg)) return;
 
 	osrfLogDebug( OSRF_LOG_MARK, "osrfRouterClassHandleMessage()");
 
-	// Pick a node, in a round-robin.
-	osrfRouterNode* node = osrfHashIteratorNext( rclass->itr );
-	if(!node) {   // wrap around to the beginning of the list
-		osrfHashIteratorReset(rclass->itr);
-		node = osrfHashIteratorNext( rclass->itr );
-	}
+	osrfRouterNode* node = osrfRouterClassPickNode( router, rclass, msg->osrf_locality );
 
 	if(node) {  // should always be true -- no class without a node
 
-		// Build a transport message
-		transport_message* new_msg = message_init( msg->body,
+		osrfTraceSetContext( msg->osrf_span );
+		osrfSpan span;
+		char traceparent[ OSRF_TRACEPARENT_SIZE ];
+		if( osrfSpanStart( &span, rclass->classname, OSRF_SPAN_PRODUCER, received ))
+			osrfSpanSetAttr( &span, "opensrf.node", node->remoteId );
+		osrfSpanFormat( &span, traceparent );
+
+		// Build a transport message, sharing the body rather than copying it
+		transport_message* new_msg = message_init( NULL,
 				msg->subject, msg->thread, node->remoteId, msg->sender );
 		message_set_router_info( new_msg, msg->sender, NULL, NULL, NULL, 0 );
 		message_set_osrf_xid( new_msg, msg->osrf_xid );
+		message_set_osrf_span( new_msg, traceparent );
+		message_set_osrf_locality( new_msg, msg->osrf_locality );
+		message_share_body( new_msg, msg );
 
 		osrfLogInfo( OSRF_LOG_MARK,  "Routing message:\nfrom: [%s]\nto: [%s]",
 				new_msg->router_from, new_msg->recipient );
@@ -588,15 +1741,31 @@ static void osrfRouterClassHandleMessage(
 		node->lastMessage = new_msg;
 
 		// Send it
-		if ( client_send_message( rclass->connection, new_msg ) == 0 )
+		if ( client_send_message( rclass->connection, new_msg ) == 0 ) {
+			double now = get_timestamp_millis();
+			unsigned long bytes = new_msg->xml_len;
 			node->count++;
+			osrfRouterNodeLoad( node, now, 0 );
+			node->inflight += 1.0;
+
+			++node->stats.msgs_out;
+			node->stats.bytes_out += bytes;
+			osrfRouterStatsAddLatency( &node->stats, now - received );
+			++rclass->stats.msgs_out;
+			rclass->stats.bytes_out += bytes;
+			osrfRouterStatsAddLatency( &rclass->stats, now - received );
+		}
 
 		else {
 			message_prepare_xml(new_msg);
 			osrfLogWarning( OSRF_LOG_MARK, "Error sending message from %s to %s\n%s",
 					new_msg->sender, new_msg->recipient, new_msg->msg_xml );
+			span.error = 1;
 		}
 		// We don't free new_msg here because we saved it as node->lastMessage.
+
+		osrfSpanEnd( &span );
+		osrfTraceClearContext();
 	}
 }
 
@@ -608,10 +1777,26 @@ static void osrfRouterClassHandleMessage(
 
 	Delete an osrfRouterClass from the router's list of classes.  Indirectly (via a callback
 	function installed in the osrfHash), free the osrfRouterClass and any associated nodes.
+
+	If the class belongs to a worker thread other than the current one, don't free it
+	here; hand it over to that thread to be freed.
 */
 static void osrfRouterRemoveClass( osrfRouter* router, const char* classname ) {
 	if( router && router->classes && classname ) {
 		osrfLogInfo( OSRF_LOG_MARK, "Removing router class %s", classname );
+
+		osrfRouterClass* class = osrfRouterFindClass( router, classname );
+		if( class && class->shard && !pthread_equal( pthread_self(), class->shard->thread ) ) {
+			// The owning shard may be reading from the class's connection right now.
+			// Take the class out of circulation, and let the shard free it.
+			osrfHashExtract( router->classes, classname );
+			class->doomed = 1;
+			osrfListPush( class->shard->doomed, class );
+			if( write( class->shard->wake_pipe[ 1 ], "", 1 ) < 0 )
+				osrfLogWarning( OSRF_LOG_MARK, "Unable to wake router worker thread" );
+			return;
+		}
+
 		osrfHashRemove( router->classes, classname );
 	}
 }
@@ -653,6 +1838,11 @@ static void osrfRouterClassFree( char* classname, void* c ) {
 	if( !c )
 		return;
 	osrfRouterClass* rclass = (osrfRouterClass*) c;
+	if( rclass->shard ) {
+		_osrfRouterPollRemove( &rclass->shard->poller, rclass );
+		--rclass->shard->class_count;
+	} else
+		_osrfRouterPollRemove( &rclass->router->poller, rclass );
 	client_disconnect( rclass->connection );
 	client_free( rclass->connection );
 
@@ -664,7 +1854,9 @@ static void osrfRouterClassFree( char* classname, void* c ) {
 
 	osrfHashIteratorFree(rclass->itr);
 	osrfHashFree(rclass->nodes);
+	osrfHashFree(rclass->verifiedClients);
 
+	free(rclass->classname);
 	free(rclass);
 }
 
@@ -679,6 +1871,7 @@ static void osrfRouterNodeFree( char* remoteId, void* n ) {
 	if(!n) return;
 	osrfRouterNode* node = (osrfRouterNode*) n;
 	free(node->remoteId);
+	free(node->locality);
 	message_free(node->lastMessage);
 	free(node);
 }
@@ -699,12 +1892,20 @@ void osrfRouterFree( osrfRouter* router ) {
 	free(router->domain);
 	free(router->name);
 	free(router->resource);
+	free(router->shm_dir);
 	free(router->password);
 
 	osrfStringArrayFree( router->trustedClients );
 	osrfStringArrayFree( router->trustedServers );
+	osrfHashFree( router->trustedClientSet );
+	osrfHashFree( router->trustedServerSet );
+	osrfHashFree( router->verifiedServers );
 	osrfListFree( router->message_list );
 
+	if( router->poller.fd >= 0 )
+		close( router->poller.fd );
+	pthread_mutex_destroy( &router->lock );
+
 	client_free( router->connection );
 	free(router);
 }
@@ -881,6 +2082,8 @@ static void osrfRouterRespondConnect( osrfRouter* router, const transport_messag
 	- "opensrf.router.info.stats.class" -- count for every node of a specified class.
 	- "opensrf.router.info.stats.class.all" -- count for every node of every class.
 	- "opensrf.router.info.stats.class.node.all" -- total count for every class.
+	- "opensrf.router.info.health" -- nodes, capacity, and estimated messages in flight
+	for every class, without the counters of the stats requests.
 */
 static void osrfRouterProcessAppRequest( osrfRouter* router, const transport_message* msg,
 		const osrfMessage* omsg ) {
@@ -1003,6 +2206,42 @@ static void osrfRouterProcessAppRequest( osrfRouter* router, const transport_mes
 
 		osrfHashIteratorFree(class_itr);
 
+	} else if(!strcmp( omsg->method_name, ROUTER_REQUEST_HEALTH )) {
+
+		// Prepare a hash.  Key: class name.  Datum: a hash of the number of nodes, their
+		// total capacity, and the messages estimated to be in flight to them.
+
+		osrfRouterClass* class;
+		osrfRouterNode* node;
+		double now = get_timestamp_millis();
+		jresponse = jsonNewObjectType(JSON_HASH);
+
+		osrfHashIterator* class_itr = osrfNewHashIterator(router->classes);
+		while( (class = osrfHashIteratorNext(class_itr)) ) {  // For each class
+
+			int nodes = 0;
+			int capacity = 0;
+			double inflight = 0.0;
+			const char* classname = osrfHashIteratorKey(class_itr);
+
+			osrfHashIterator* node_itr = osrfNewHashIterator(class->nodes);
+			while( (node = osrfHashIteratorNext(node_itr)) ) {  // For each node
+				nodes++;
+				capacity += node->capacity;
+				inflight += osrfRouterNodeLoad( node, now, 0 );
+			}
+			osrfHashIteratorFree(node_itr);
+
+			jsonObject* class_res = jsonNewObjectType(JSON_HASH);
+			jsonObjectSetKey( class_res, "nodes", jsonNewNumberObject( (double) nodes ) );
+			jsonObjectSetKey( class_res, "capacity",
+					jsonNewNumberObject( (double) capacity ) );
+			jsonObjectSetKey( class_res, "inflight", jsonNewNumberObject( inflight ) );
+			jsonObjectSetKey( jresponse, classname, class_res );
+		}
+
+		osrfHashIteratorFree(class_itr);
+
 	} else {  // None of the above
 
 		osrfRouterHandleMethodNFound( router, msg, omsg );
@@ -7,7 +7,9 @@
 
 	The router receives messages from clients and passes each one to a listener for the
 	targeted service.  Where there are multiple listeners for the same service, the router
-	picks one on a round-robin basis.  If a message bounces because the listener has died,
+	picks one on a round-robin basis, or according to a load-aware policy chosen by
+	osrfRouterSetPolicy(), preferring listeners near the sender if so configured by
+	osrfRouterSetLocalitySpill().  If a message bounces because the listener has died,
 	the router sends it to another listener for the same service, if one is available.
 
 	The server's response to the client, if any, bypasses the router.  If the server needs to
@@ -40,6 +42,16 @@ osrfRouter* osrfNewRouter( const char* domain, const char* name, const char* res
 
 int osrfRouterConnect( osrfRouter* router );
 
+int osrfRouterSetPolicy( osrfRouter* router, const char* policy );
+
+int osrfRouterSetWorkers( osrfRouter* router, int workers );
+
+void osrfRouterSetLocalitySpill( osrfRouter* router, double spill );
+
+void osrfRouterSetCompression( osrfRouter* router, int compress );
+
+void osrfRouterSetShm( osrfRouter* router, const char* dir );
+
 void osrfRouterRun( osrfRouter* router );
 
 void router_stop( osrfRouter* router );
@@ -25,6 +25,8 @@
 #include "opensrf/osrf_list.h"
 #include "opensrf/string_array.h"
 #include "opensrf/osrfConfig.h"
+#include "opensrf/osrf_trace.h"
+#include "opensrf/osrf_affinity.h"
 #include "osrf_router.h"
 
 static osrfRouter* router = NULL;
@@ -253,11 +255,17 @@ static void setupRouter( const jsonObject* configChunk, int configPos ) {
 	const char* username = jsonObjectGetString( jsonObjectGetKeyConst( transport_cfg, "username" ));
 	const char* password = jsonObjectGetString( jsonObjectGetKeyConst( transport_cfg, "password" ));
 	const char* resource = jsonObjectGetString( jsonObjectGetKeyConst( transport_cfg, "resource" ));
+	const char* compress = jsonObjectGetString( jsonObjectGetKeyConst( transport_cfg, "compress" ));
+	const char* shm_dir  = jsonObjectGetString( jsonObjectGetKeyConst( transport_cfg, "shm_dir" ));
 
 	const char* level    = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "loglevel" ));
 	const char* log_file = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "logfile" ));
 	const char* log_tag  = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "logtag" ));
 	const char* facility = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "syslog" ));
+	const char* policy   = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "routing_policy" ));
+	const char* workers  = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "workers" ));
+	const char* spill    = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "locality_spill" ));
+	const char* cpus     = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "cpu_affinity" ));
 
 	int llevel = 1;
 	if(level) llevel = atoi(level);
@@ -278,6 +286,25 @@ static void setupRouter( const jsonObject* configChunk, int configPos ) {
 		osrfLogSetFile( log_file );
 	}
 
+	const char* log_async = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "log_async" ));
+	if( log_async ) {
+		const char* log_async_full =
+			jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "log_async_full" ));
+		if( osrfLogSetAsync( atoi( log_async ),
+				!( log_async_full && !strcasecmp( log_async_full, "drop" ))))
+			osrfLogWarning( OSRF_LOG_MARK, "Unable to set up log queue; logging directly" );
+	}
+
+	const char* trace_file = jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "trace_file" ));
+	if( trace_file ) {
+		const char* trace_batch =
+			jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "trace_batch" ));
+		const char* trace_sample =
+			jsonObjectGetString( jsonObjectGetKeyConst( configChunk, "trace_sample" ));
+		osrfTraceInit( "router", trace_file, trace_batch ? atoi( trace_batch ) : 0,
+			trace_sample ? atof( trace_sample ) : 1.0 );
+	}
+
 	osrfLogInfo( OSRF_LOG_MARK, "Router connecting as: server: %s port: %s "
 		"user: %s resource: %s", server, port, username, resource );
 
@@ -326,9 +353,28 @@ static void setupRouter( const jsonObject* configChunk, int configPos ) {
 		return;
 	}
 
+	// Pin ourselves, and the worker threads to come, off the drones' CPUs
+	if( cpus )
+		osrfAffinityApply( cpus, 0, 0, -1, "router" );
+
 	router = osrfNewRouter( server,
 			username, resource, password, iport, tclients, tservers );
 
+	if( osrfRouterSetPolicy( router, policy ) )
+		osrfLogWarning( OSRF_LOG_MARK, "Using round_robin routing instead" );
+
+	if( workers )
+		osrfRouterSetWorkers( router, atoi( workers ) );
+
+	if( spill )
+		osrfRouterSetLocalitySpill( router, atof( spill ) );
+
+	if( compress && !strcasecmp( compress, "true" ) )
+		osrfRouterSetCompression( router, 1 );
+
+	if( shm_dir )
+		osrfRouterSetShm( router, shm_dir );
+
 	signal(SIGHUP,routerSignalHandler);
 	signal(SIGINT,routerSignalHandler);
 	signal(SIGTERM,routerSignalHandler);
@@ -6,8 +6,11 @@
 #include <opensrf/transport_client.h>
 #include <opensrf/osrf_message.h>
 #include <opensrf/osrf_app_session.h>
+#include <opensrf/osrf_multisession.h>
+#include <opensrf/osrf_capture.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <sys/timeb.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -77,6 +80,8 @@ static int send_request( const char* server,
 				const char* method, growing_buffer* buffer, int relay );
 static int parse_error( const char* request );
 static int router_query_servers( const char* server );
+static int router_query_stats( const char* server, const char* classname );
+static void print_router_stats( const char* name, const jsonObject* stats );
 static int print_help( void );
 
 //static int srfsh_client_connect();
@@ -88,6 +93,11 @@ static char* get_request( void );
 static int load_history( void );
 static int handle_math( const osrfStringArray* cmd_array );
 static int do_math( int count, int style );
+static int handle_bench( const osrfStringArray* cmd_array );
+static int do_bench( const char* service, const char* method, const jsonObject* params,
+		int count, int concurrency, double rate, int timeout );
+static int handle_replay( const osrfStringArray* cmd_array );
+static int do_replay( const char* path, double speed, int concurrency, int timeout );
 static int handle_introspect( const osrfStringArray* cmd_array );
 static int handle_login( const osrfStringArray* cmd_array );
 static int handle_open( const osrfStringArray* cmd_array );
@@ -369,6 +379,12 @@ static int process_request( const char* request ) {
 	else if ( !strcmp( command, "math_bench" ) )
 		ret_val = handle_math( cmd_array );
 
+	else if ( !strcmp( command, "bench" ) )
+		ret_val = handle_bench( cmd_array );
+
+	else if ( !strcmp( command, "replay" ) )
+		ret_val = handle_replay( cmd_array );
+
 	else if ( !strcmp( command, "introspect" ) )
 		ret_val = handle_introspect( cmd_array );
 
@@ -712,6 +728,14 @@ static int handle_router( const osrfStringArray* cmd_array ) {
 			}
 			return 0;
 		}
+
+		if( !strcmp( word_1, "stats" ) ) {
+			if( word_2 ) {
+				router_query_stats( word_2, osrfStringArrayGetString( cmd_array, 3 ) );
+				return 1;
+			}
+			return 0;
+		}
 		return 0;
 	}
 	return 0;
@@ -989,6 +1013,106 @@ static int router_query_servers( const char* router_server ) {
 	return 1;
 }
 
+/**
+	@brief Ask a router for its traffic counters, and print them as a table.
+	@param router_server Domain of the router.
+	@param classname Name of the one class to report, or NULL for all of them.
+	@return 1 in all cases.
+
+	Latency percentiles are read from the router's log-scale histograms, so each is
+	the upper bound of the bucket containing it.
+*/
+static int router_query_stats( const char* router_server, const char* classname ) {
+
+	if( ! router_server || strlen(router_server) == 0 )
+		return 0;
+
+	static const char router_text[] = "router@%s/router";
+	size_t len = sizeof( router_text ) + strlen( router_server ) + 1;
+	char rbuf[len];
+	snprintf(rbuf, sizeof(rbuf), router_text, router_server );
+
+	transport_message* send = message_init( "stats", NULL, NULL, rbuf, NULL );
+	message_set_router_info( send, NULL, NULL, classname, "stats", 0 );
+
+	client_send_message( client, send );
+	message_free( send );
+
+	transport_message* recv = client_recv( client, -1 );
+	if( recv == NULL ) {
+		fprintf(stderr, "NULL message received from router\n");
+		return 1;
+	}
+
+	jsonObject* stats = jsonParse( recv->body );
+	message_free( recv );
+	if( !stats || stats->type != JSON_HASH ) {
+		fprintf(stderr, "Unexpected stats reply from router\n");
+		jsonObjectFree( stats );
+		return 1;
+	}
+
+	printf(
+		"---------------------------------------------------------------------------------------------\n"
+		"%-40s %9s %9s %11s %7s %8s %8s %8s\n"
+		"---------------------------------------------------------------------------------------------\n",
+		"class / node", "msgs in", "msgs out", "bytes out", "bounce",
+		"inflight", "p50 us", "p99 us" );
+
+	jsonIterator* class_itr = jsonNewIterator( stats );
+	const jsonObject* class_stats;
+	while( (class_stats = jsonIteratorNext( class_itr )) ) {
+		print_router_stats( class_itr->key, class_stats );
+
+		jsonIterator* node_itr = jsonNewIterator( jsonObjectGetKeyConst( class_stats, "nodes" ) );
+		const jsonObject* node_stats;
+		while( (node_stats = jsonIteratorNext( node_itr )) ) {
+			char name[ strlen( node_itr->key ) + 3 ];
+			snprintf( name, sizeof( name ), "  %s", node_itr->key );
+			print_router_stats( name, node_stats );
+		}
+		jsonIteratorFree( node_itr );
+	}
+	jsonIteratorFree( class_itr );
+
+	printf( "---------------------------------------------------------------------------------------------\n" );
+	jsonObjectFree( stats );
+	return 1;
+}
+
+/**
+	@brief Print one row of the table for router_query_stats().
+	@param name Name of the class or node.
+	@param stats Pointer to the counters reported for it.
+*/
+static void print_router_stats( const char* name, const jsonObject* stats ) {
+
+	const jsonObject* hist = jsonObjectGetKeyConst( stats, "latency" );
+	unsigned int buckets = hist ? hist->size : 0;
+	double total = 0;
+	unsigned int i;
+	for( i = 0; i < buckets; ++i )
+		total += jsonObjectGetNumber( jsonObjectGetIndex( hist, i ) );
+
+	// Upper bound, in microseconds, of the buckets holding the 50th and 99th percentiles
+	double p50 = 0, p99 = 0, seen = 0;
+	for( i = 0; i < buckets && total > 0; ++i ) {
+		seen += jsonObjectGetNumber( jsonObjectGetIndex( hist, i ) );
+		if( !p50 && seen >= total * 0.50 )
+			p50 = (double) ( 2UL << i );
+		if( !p99 && seen >= total * 0.99 )
+			p99 = (double) ( 2UL << i );
+	}
+
+	printf( "%-40s %9.0f %9.0f %11.0f %7.0f %8.2f %8.0f %8.0f\n", name,
+		jsonObjectGetNumber( jsonObjectGetKeyConst( stats, "msgs_in" ) ),
+		jsonObjectGetNumber( jsonObjectGetKeyConst( stats, "msgs_out" ) ),
+		jsonObjectGetNumber( jsonObjectGetKeyConst( stats, "bytes_out" ) ),
+		jsonObjectGetNumber( jsonObjectGetKeyConst( stats, "bounces" ) ),
+		jsonObjectGetNumber( jsonObjectGetKeyConst( stats, "inflight" ) ),
+		p50, p99 );
+}
+
 static int print_help( void ) {
 
 	fputs(
@@ -1033,6 +1157,10 @@ static int print_help( void ) {
 			"router query servers <server1 [, server2, ...]>\n"
 			"       - Returns stats on connected services\n"
 			"\n"
+			"router stats <server> [ <class> ]\n"
+			"       - Shows traffic counters and forwarding latency for each class\n"
+			"                and node on the router, or just for one class\n"
+			"\n"
 			"relay <service> <method>\n"
 			"       - Performs the requested query using the last received result as the param\n"
 			"\n"
@@ -1040,6 +1168,17 @@ static int print_help( void ) {
 			"       - 0 means don't reconnect, 1 means reconnect after each batch of 4, and\n"
 			"                2 means reconnect after every request\n"
 			"\n"
+			"bench <service> <method> <calls> <concurrency> [rate=<n>] [timeout=<secs>]\n"
+			"        [ <JSON formatted string of params> ]\n"
+			"       - Makes <calls> calls, <concurrency> at a time, and reports throughput,\n"
+			"                latency percentiles, and errors.  With rate=<n>, starts <n> calls\n"
+			"                per second instead of a new one as each finishes\n"
+			"\n"
+			"replay <file> [speed=<x>|speed=max] [concurrency=<n>] [timeout=<secs>]\n"
+			"       - Replays the requests in a capture file, spaced as they were received,\n"
+			"                or <x> times faster, or as fast as <n> calls in flight allow,\n"
+			"                and reports latency percentiles and errors for each method\n"
+			"\n"
 			"---------------------------------------------------------------------------------\n"
 			" Commands for Evergreen\n"
 			"---------------------------------------------------------------------------------\n"
@@ -1194,6 +1333,510 @@ static int do_math( int count, int style ) {
 	return 1;
 }
 
+/**
+	@brief The running totals of a "bench" command.
+*/
+typedef struct {
+	double* start;      /**< When each call started (or was due to), in milliseconds. */
+	double* latency;    /**< Latency of each finished call, in milliseconds. */
+	int finished;       /**< How many calls have finished. */
+	int errors;         /**< How many finished with a failing status. */
+	int timeouts;       /**< How many of those timed out. */
+	int last_error;     /**< Status code of the most recent failure. */
+} BenchStats;
+
+/**
+	@brief Execute the "bench" command.
+	@param cmd_array A list of command arguments.
+	@return 1 if successful, 0 if not.
+
+	bench <service> <method> <calls> <concurrency> [rate=<n>] [timeout=<secs>] [params]
+
+	Any words after the options are the parameters, wrapped in a JSON array as for the
+	"request" command.
+*/
+static int handle_bench( const osrfStringArray* cmd_array ) {
+
+	if( !client )
+		return 1;
+
+	const char* service = osrfStringArrayGetString( cmd_array, 1 );
+	const char* method = osrfStringArrayGetString( cmd_array, 2 );
+	const char* calls_arg = osrfStringArrayGetString( cmd_array, 3 );
+	const char* concurrency_arg = osrfStringArrayGetString( cmd_array, 4 );
+	if( !service || !method || !calls_arg || !concurrency_arg )
+		return 0;
+
+	int count = atoi( calls_arg );
+	if( count < 1 )
+		count = 1;
+	int concurrency = atoi( concurrency_arg );
+	if( concurrency < 1 )
+		concurrency = 1;
+
+	double rate = 0.0;
+	int timeout = recv_timeout;
+	int i = 5;
+	const char* word;
+	while( (word = osrfStringArrayGetString( cmd_array, i )) ) {
+		if( !strncmp( word, "rate=", 5 ))
+			rate = atof( word + 5 );
+		else if( !strncmp( word, "timeout=", 8 ))
+			timeout = atoi( word + 8 );
+		else
+			break;
+		i++;
+	}
+
+	int first = 1;   // boolean
+	growing_buffer* buffer = buffer_init( 128 );
+	buffer_add_char( buffer, '[' );
+	while( (word = osrfStringArrayGetString( cmd_array, i++ )) ) {
+		if( first )
+			first = 0;
+		else
+			buffer_add( buffer, ", " );
+		buffer_add( buffer, word );
+	}
+	buffer_add_char( buffer, ']' );
+
+	// Temporarily redirect parsing error messages to stderr
+	osrfLogToStderr();
+	jsonObject* params = jsonParse( OSRF_BUFFER_C_STR( buffer ) );
+	osrfRestoreLogType();
+	buffer_free( buffer );
+
+	if( !params ) {
+		fprintf( stderr, "JSON error detected, not executing\n" );
+		return 1;
+	}
+
+	int rc = do_bench( service, method, params, count, concurrency, rate,
+		timeout > 0 ? timeout : recv_timeout );
+	jsonObjectFree( params );
+	return rc;
+}
+
+/**
+	@brief Discard a response to a "bench" call; only the timing matters.
+*/
+static void bench_response( osrfMultiSession* ms, osrfMultiRequest* req,
+		const jsonObject* content ) {
+}
+
+/**
+	@brief Record a finished "bench" call.
+*/
+static void bench_complete( osrfMultiSession* ms, osrfMultiRequest* req ) {
+	BenchStats* stats = ms->userData;
+	int index = (int) (intptr_t) req->userData;
+
+	stats->latency[ stats->finished++ ] = get_monotonic_millis() - stats->start[ index ];
+
+	if( req->status_code != OSRF_STATUS_OK ) {
+		stats->errors++;
+		stats->last_error = req->status_code;
+		if( req->status_code == OSRF_STATUS_TIMEOUT )
+			stats->timeouts++;
+	}
+}
+
+static int compare_doubles( const void* a, const void* b ) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+	@brief Pick a percentile from a sorted array, by nearest rank.
+*/
+static double percentile( const double* sorted, int count, double pct ) {
+	double exact = pct / 100.0 * count;
+	int rank = (int) exact;
+	if( rank < exact )
+		rank++;
+	if( rank < 1 )
+		rank = 1;
+	return sorted[ rank - 1 ];
+}
+
+/**
+	@brief Drive concurrent calls to a method, and report how the service kept up.
+	@param service Name of the service.
+	@param method Name of the method.
+	@param params JSON array of parameters for each call.
+	@param count How many calls to make.
+	@param concurrency Most calls to have in flight at once.
+	@param rate Calls to start per second, or zero to start one as each finishes.
+	@param timeout Seconds to wait for each call.
+	@return 1.
+
+	Without a rate, the load is closed-loop: @a concurrency calls are kept in flight.  With
+	a rate, call i is due at i / rate seconds, and its latency is measured from then, so
+	that calls held back by a slow service count against it.
+*/
+static int do_bench( const char* service, const char* method, const jsonObject* params,
+		int count, int concurrency, double rate, int timeout ) {
+
+	BenchStats stats;
+	memset( &stats, 0, sizeof( stats ));
+	stats.start = safe_malloc( count * sizeof( double ));
+	stats.latency = safe_malloc( count * sizeof( double ));
+
+	osrfMultiSession* ms = osrfMultiSessionInit( 0 );
+	osrfMultiSessionSetTimeout( ms, timeout * 1000 );
+	ms->userData = &stats;
+
+	int sent = 0;
+	int failed = 0;
+	double begin = get_monotonic_millis();
+
+	while( stats.finished < count ) {
+
+		double now = get_monotonic_millis();
+		double next_due = now;
+
+		while( sent < count && sent - stats.finished < concurrency ) {
+			if( rate > 0.0 ) {
+				next_due = begin + sent * 1000.0 / rate;
+				if( next_due > now )
+					break;
+				stats.start[ sent ] = next_due;
+			} else
+				stats.start[ sent ] = now;
+
+			osrfMultiSessionRequest( ms, service, method, params,
+				bench_response, bench_complete, (void*) (intptr_t) sent );
+			sent++;
+		}
+
+		// Wait for responses, but not past the next call that's due
+		int wait = -1;
+		if( rate > 0.0 && sent < count && sent - stats.finished < concurrency ) {
+			wait = (int) ( next_due - now );
+			if( wait < 0 )
+				wait = 0;
+		}
+
+		if( !osrfMultiSessionOutstanding( ms )) {
+			if( wait > 0 )
+				usleep( wait * 1000 );
+			continue;
+		}
+
+		if( osrfMultiSessionWait( ms, wait ) < 0 ) {
+			fprintf( stderr, "Transport error; stopping\n" );
+			failed = 1;
+			break;
+		}
+	}
+
+	double elapsed = ( get_monotonic_millis() - begin ) / 1000.0;
+	osrfMultiSessionFree( ms );
+
+	printf( "bench %s %s: %d calls, concurrency %d", service, method, stats.finished,
+		concurrency );
+	if( rate > 0.0 )
+		printf( ", rate %.1f/s", rate );
+	printf( "\n" );
+
+	printf( "  elapsed %.3fs, throughput %.1f calls/s\n", elapsed,
+		elapsed > 0.0 ? stats.finished / elapsed : 0.0 );
+
+	if( stats.finished > 0 ) {
+		qsort( stats.latency, stats.finished, sizeof( double ), compare_doubles );
+		printf( "  latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f\n",
+			stats.latency[ 0 ],
+			percentile( stats.latency, stats.finished, 50.0 ),
+			percentile( stats.latency, stats.finished, 90.0 ),
+			percentile( stats.latency, stats.finished, 99.0 ),
+			percentile( stats.latency, stats.finished, 99.9 ),
+			stats.latency[ stats.finished - 1 ] );
+	}
+
+	printf( "  errors %d (timeouts %d", stats.errors, stats.timeouts );
+	if( stats.errors )
+		printf( ", last status %d", stats.last_error );
+	printf( ")%s\n", failed ? ", stopped by a transport error" : "" );
+
+	free( stats.start );
+	free( stats.latency );
+	return 1;
+}
+
+/**
+	@brief The running totals of a "replay" command for one method.
+*/
+typedef struct {
+	char* name;         /**< Name of the method. */
+	double* latency;    /**< Latency of each finished call, in milliseconds. */
+	int finished;       /**< How many calls have finished. */
+	int size;           /**< Room in @a latency. */
+	int errors;         /**< How many finished with a failing status. */
+	int timeouts;       /**< How many of those timed out. */
+} ReplayMethod;
+
+/**
+	@brief One call made by a "replay" command.
+*/
+typedef struct {
+	ReplayMethod* method;   /**< Totals for its method. */
+	double start;           /**< When it was due, in milliseconds. */
+} ReplayCall;
+
+/**
+	@brief Execute the "replay" command.
+	@param cmd_array A list of command arguments.
+	@return 1 if successful, 0 if not.
+
+	replay <file> [speed=<x>|speed=max] [concurrency=<n>] [timeout=<secs>]
+
+	By default the calls are spaced as the requests were received, with no limit on how
+	many are in flight at once.  speed=max sends them as fast as the concurrency allows,
+	16 at a time unless told otherwise.
+*/
+static int handle_replay( const osrfStringArray* cmd_array ) {
+
+	if( !client )
+		return 1;
+
+	const char* path = osrfStringArrayGetString( cmd_array, 1 );
+	if( !path )
+		return 0;
+
+	double speed = 1.0;
+	int concurrency = -1;
+	int timeout = recv_timeout;
+	int i = 2;
+	const char* word;
+	while( (word = osrfStringArrayGetString( cmd_array, i++ )) ) {
+		if( !strcmp( word, "speed=max" ))
+			speed = 0.0;
+		else if( !strncmp( word, "speed=", 6 )) {
+			speed = atof( word + 6 );
+			if( speed <= 0.0 ) {
+				fprintf( stderr, "Invalid speed: %s\n", word + 6 );
+				return 1;
+			}
+		} else if( !strncmp( word, "concurrency=", 12 ))
+			concurrency = atoi( word + 12 );
+		else if( !strncmp( word, "timeout=", 8 ))
+			timeout = atoi( word + 8 );
+		else
+			return 0;
+	}
+
+	if( concurrency < 0 )
+		concurrency = speed > 0.0 ? 0 : 16;
+	else if( concurrency == 0 && speed == 0.0 )
+		concurrency = 1;
+
+	return do_replay( path, speed, concurrency, timeout > 0 ? timeout : recv_timeout );
+}
+
+/**
+	@brief Record a finished "replay" call.
+*/
+static void replay_complete( osrfMultiSession* ms, osrfMultiRequest* req ) {
+	ReplayCall* call = req->userData;
+	ReplayMethod* method = call->method;
+
+	if( method->finished == method->size ) {
+		method->size = method->size ? method->size * 2 : 64;
+		method->latency = realloc( method->latency, method->size * sizeof( double ));
+		if( !method->latency ) {
+			fprintf( stderr, "Out of memory\n" );
+			exit( 99 );
+		}
+	}
+	method->latency[ method->finished++ ] = get_monotonic_millis() - call->start;
+
+	if( req->status_code != OSRF_STATUS_OK ) {
+		method->errors++;
+		if( req->status_code == OSRF_STATUS_TIMEOUT )
+			method->timeouts++;
+	}
+
+	free( call );
+}
+
+static void free_replay_method( char* key, void* item ) {
+	ReplayMethod* method = item;
+	free( method->name );
+	free( method->latency );
+	free( method );
+}
+
+static int compare_replay_methods( const void* a, const void* b ) {
+	const ReplayMethod* x = *(ReplayMethod* const*) a;
+	const ReplayMethod* y = *(ReplayMethod* const*) b;
+	return strcmp( x->name, y->name );
+}
+
+/**
+	@brief Replay the requests in a capture file, and report how each method fared.
+	@param path Name of the capture file.
+	@param speed How many times faster than recorded to send the calls, or zero to send
+		them as fast as possible.
+	@param concurrency Most calls to have in flight at once; zero for no limit.
+	@param timeout Seconds to wait for each call.
+	@return 1.
+
+	Each call goes to the service that received it, wherever the current configuration
+	points.  Its latency is measured from when it was due, so that calls held back by the
+	concurrency limit count against the service.  Requests captured without their
+	parameters, because their methods are protected, are skipped.
+*/
+static int do_replay( const char* path, double speed, int concurrency, int timeout ) {
+
+	osrfCaptureFile* file = osrfCaptureOpen( path );
+	if( !file ) {
+		fprintf( stderr, "Unable to read capture file %s\n", path );
+		return 1;
+	}
+
+	osrfHash* methods = osrfNewHash();
+	osrfHashSetCallback( methods, free_replay_method );
+	int method_count = 0;
+
+	osrfMultiSession* ms = osrfMultiSessionInit( 0 );
+	osrfMultiSessionSetTimeout( ms, timeout * 1000 );
+
+	int sent = 0;
+	int skipped = 0;
+	int failed = 0;
+	int corrupt = 0;
+	long long first = -1;
+	double begin = get_monotonic_millis();
+
+	osrfCaptureRecord rec;
+	int have = osrfCaptureRead( file, &rec );
+
+	while( have == 1 ) {
+
+		jsonObject* params = NULL;
+		if( rec.params ) {
+			osrfLogToStderr();
+			params = jsonParse( rec.params );
+			osrfRestoreLogType();
+		}
+		if( !params ) {
+			skipped++;
+			have = osrfCaptureRead( file, &rec );
+			continue;
+		}
+
+		if( first < 0 )
+			first = rec.time;
+		double due = begin;
+		if( speed > 0.0 )
+			due += ( rec.time - first ) / 1000.0 / speed;
+
+		// Wait until the call is due, and there's room for it
+		double now;
+		while( (now = get_monotonic_millis()) < due || ( concurrency
+				&& osrfMultiSessionOutstanding( ms ) >= concurrency )) {
+			int wait = now < due ? (int) ( due - now ) : 0;
+			if( concurrency && osrfMultiSessionOutstanding( ms ) >= concurrency )
+				wait = -1;
+			if( !osrfMultiSessionOutstanding( ms )) {
+				usleep( (useconds_t) ( ( due - now ) * 1000.0 ));
+				continue;
+			}
+			if( osrfMultiSessionWait( ms, wait ) < 0 ) {
+				failed = 1;
+				break;
+			}
+		}
+		if( failed ) {
+			jsonObjectFree( params );
+			break;
+		}
+
+		ReplayMethod* method = osrfHashGet( methods, rec.method );
+		if( !method ) {
+			method = safe_malloc( sizeof( ReplayMethod ));
+			method->name = strdup( rec.method );
+			osrfHashSet( methods, method, "%s", rec.method );
+			method_count++;
+		}
+
+		ReplayCall* call = safe_malloc( sizeof( ReplayCall ));
+		call->method = method;
+		call->start = speed > 0.0 ? due : now;
+		osrfMultiSessionRequest( ms, rec.service, rec.method, params,
+			NULL, replay_complete, call );
+		jsonObjectFree( params );
+		sent++;
+
+		have = osrfCaptureRead( file, &rec );
+	}
+
+	if( have < 0 )
+		corrupt = 1;
+
+	while( !failed && osrfMultiSessionOutstanding( ms )) {
+		if( osrfMultiSessionWait( ms, -1 ) < 0 )
+			failed = 1;
+	}
+
+	if( failed )
+		fprintf( stderr, "Transport error; stopping\n" );
+	if( corrupt )
+		fprintf( stderr, "Capture file %s is truncated or corrupt; stopped early\n", path );
+
+	// Calls cut short by a transport error never completed
+	osrfMultiRequest* req;
+	for( req = ms->pending; req; req = req->next )
+		free( req->userData );
+	for( req = ms->waiting; req; req = req->next )
+		free( req->userData );
+
+	double elapsed = ( get_monotonic_millis() - begin ) / 1000.0;
+	osrfMultiSessionFree( ms );
+	osrfCaptureClose( file );
+
+	printf( "replay %s: %d calls, %d skipped, ", path, sent, skipped );
+	if( speed > 0.0 )
+		printf( "speed %.2fx", speed );
+	else
+		printf( "speed max" );
+	if( concurrency )
+		printf( ", concurrency %d", concurrency );
+	printf( "\n" );
+	printf( "  elapsed %.3fs, throughput %.1f calls/s\n", elapsed,
+		elapsed > 0.0 ? sent / elapsed : 0.0 );
+
+	ReplayMethod** sorted = safe_malloc( ( method_count + 1 ) * sizeof( ReplayMethod* ));
+	int n = 0;
+	osrfHashIterator* itr = osrfNewHashIterator( methods );
+	ReplayMethod* method;
+	while( (method = osrfHashIteratorNext( itr )) )
+		sorted[ n++ ] = method;
+	osrfHashIteratorFree( itr );
+	qsort( sorted, n, sizeof( ReplayMethod* ), compare_replay_methods );
+
+	int i;
+	for( i = 0; i < n; i++ ) {
+		method = sorted[ i ];
+		printf( "  %s: %d calls, errors %d (timeouts %d)\n", method->name,
+			method->finished, method->errors, method->timeouts );
+		if( method->finished > 0 ) {
+			qsort( method->latency, method->finished, sizeof( double ), compare_doubles );
+			printf( "    latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+				method->latency[ 0 ],
+				percentile( method->latency, method->finished, 50.0 ),
+				percentile( method->latency, method->finished, 90.0 ),
+				percentile( method->latency, method->finished, 99.0 ),
+				method->latency[ method->finished - 1 ] );
+		}
+	}
+
+	free( sorted );
+	osrfHashFree( methods );
+	return 1;
+}
+
 /**
 	@name Command line parser
 
@@ -28,17 +28,53 @@
  *
  * websocketd --port 7682 --max-forks 250 ./osrf-websocket-stdio /path/to/opensrf_core.xml &
  *
+ * Multiplexing mode:
+ *
+ * Instead of one process per websocket connection, a single process
+ * accepts the websocket connections itself and serves all of them from
+ * one epoll loop, over a small pool of OpenSRF/XMPP connections.  The
+ * listener speaks plain (ws://) websockets; put it behind a proxy for
+ * wss://.
+ *
+ * ./osrf-websocket-stdio /path/to/opensrf_core.xml --listen 7682 \
+ *      [--transports 4] [--max-clients 10000] &
+ *
+ * --listen takes a port or an address:port.  The OpenSRF thread of
+ * each message is prefixed with the id of its websocket connection, so
+ * that replies arriving on any of the transport connections find their
+ * way back to it, and clients choosing the same thread don't collide.
+ *
+ * Batching:
+ *
+ * A client may send a JSON array of request wrappers in one message
+ * instead of a single wrapper; they're relayed in order.  From then on,
+ * the client's replies come back batched the same way: a JSON array of
+ * reply wrappers, in the order they arrived, one message for each read
+ * of whatever is waiting on the OpenSRF connection.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define WS_MULTIPLEX
+#endif
 #include <opensrf/utils.h>
 #include <opensrf/osrf_hash.h>
+#include <opensrf/osrf_list.h>
 #include <opensrf/transport_client.h>
 #include <opensrf/osrf_message.h>
 #include <opensrf/osrf_app_session.h>
+#include <opensrf/osrf_digest.h>
 #include <opensrf/log.h>
 
 #define MAX_THREAD_SIZE 64
@@ -53,26 +89,147 @@
 #define MAX_ACTIVE_STATEFUL_SESSIONS 64
 
 // Message exceeding this size are discarded.
-// This value must be greater than RESET_MESSAGE_SIZE (below)
+// This value must be greater than POOLED_BUFFER_MAX_SIZE (below)
 // ~10M
 #define MAX_MESSAGE_SIZE 10485760
 
-// After processing any message this size or larger, free and
-// recreate the stdin buffer to release the memory.
-// ~100k
-#define RESET_MESSAGE_SIZE 102400
-
-// After receiving the initial shutdow call, wake the event loop every 
+// Message and output buffers are kept for reuse, up to BUFFER_POOL_SIZE
+// of them.  A buffer that grew past POOLED_BUFFER_MAX_SIZE is freed
+// instead, to release the memory.
+// ~1M
+#define BUFFER_POOL_SIZE 8
+#define POOLED_BUFFER_MAX_SIZE 1048576
+
+// Bytes read from STDIN at a time.
+#define STDIN_READ_SIZE 65536
+
+// Replies batched for a client go out early once they pass this size.
+#define REPLY_BATCH_MAX_SIZE 262144
+
+// Once a client's unwritten output passes OUTPUT_HIGH_WATERMARK, its
+// replies are held back until the output drains below
+// OUTPUT_LOW_WATERMARK.  In the STDIO mode, reading from OpenSRF pauses
+// meanwhile.  A multiplexed client is dropped if its held-back replies
+// pass OUTPUT_PARKED_MAX.
+#define OUTPUT_HIGH_WATERMARK 1048576
+#define OUTPUT_LOW_WATERMARK 262144
+#define OUTPUT_PARKED_MAX 33554432
+
+// After receiving the initial shutdow call, wake the event loop every
 // SHUTDOWN_POLL_INTERVAL_SECONDS to see if we can shut down.
 #define SHUTDOWN_POLL_INTERVAL_SECONDS 1
 
-// Attempt to gracefully disconnect the client until 
+// Attempt to gracefully disconnect the client until
 // SHUTDOWN_MAX_GRACEFUL_SECONDS has passed without a shutdown
 // opportunity, at which point force-close the connection.
 #define SHUTDOWN_MAX_GRACEFUL_SECONDS 120
 
-// Incremented with every REQUEST, decremented with every COMPLETE.
-static int requests_in_flight = 0;
+// Multiplexing mode defaults and limits.
+#define DEFAULT_TRANSPORTS 4
+#define MAX_TRANSPORTS 64
+#define DEFAULT_MAX_CLIENTS 10000
+// Largest websocket handshake we'll wait for.
+#define MAX_HANDSHAKE_SIZE 8192
+// Bytes read from a websocket connection at a time.
+#define CLIENT_READ_SIZE 16384
+// Room for a client thread with its connection prefix.
+#define MUX_THREAD_SIZE (MAX_THREAD_SIZE + 32)
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Websocket frame opcodes
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+// Websocket close codes
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+
+// What an epoll event refers to
+#define WS_SOCK_LISTEN 1
+#define WS_SOCK_TRANSPORT 2
+#define WS_SOCK_CLIENT 3
+
+// A reply held back for a client that has fallen behind.
+typedef struct park_reply_struct {
+    struct park_reply_struct* next;
+    size_t len;
+    char text[];
+} park_reply;
+
+// The held-back replies of one thread, oldest first.
+typedef struct park_queue_struct {
+    struct park_queue_struct* next;
+    park_reply* head;
+    park_reply* tail;
+    char thread[];
+} park_queue;
+
+/**
+ * One websocket client.  In the default mode there is only one, reading
+ * newline-delimited messages on STDIN and writing them to STDOUT.  In
+ * multiplexing mode there is one for each websocket connection.
+ */
+typedef struct {
+    int type;                   // WS_SOCK_CLIENT; must come first
+    unsigned long id;           // Connection id, prefixed to its threads
+    int fd;                     // Socket (multiplexing mode only)
+    int open;                   // Boolean; true once the handshake is done
+    int closing;                // Boolean; drop once the output is written
+    int dead;                   // Boolean; dropped, waiting to be freed
+    char ip[64];                // Client IP address (for logging)
+
+    // Cache of opensrf thread strings and back-end receipients.
+    // Tracking this here means the caller only needs to track the thread.
+    // It also means we don't have to expose internal XMPP IDs
+    osrfHash* stateful_session_cache;
+    // Incremented with every REQUEST, decremented with every COMPLETE.
+    int requests_in_flight;
+    // OpenSRF XMPP connection handle used for this client's requests
+    transport_client* handle;
+
+    // Inbound message being assembled, if any
+    growing_buffer* msg_buf;
+    int msg_open;               // Boolean; a fragmented message is underway
+    int msg_skip;               // Boolean; discarding an oversized message
+
+    // Websocket framing state (multiplexing mode only)
+    growing_buffer* in_buf;     // Handshake being read
+    unsigned char hdr[14];      // Frame header being read
+    int hdr_len;
+    int in_frame;               // Boolean; reading a frame's payload
+    int frame_opcode;
+    int frame_fin;
+    unsigned long long frame_left;
+    unsigned char frame_mask[4];
+    int frame_mask_pos;
+    unsigned char ctrl[125];    // Payload of a control frame
+    int ctrl_len;
+
+    growing_buffer* out_buf;    // Output waiting for the socket, if any
+    int out_pos;
+    int want_write;             // Boolean; waiting for room to write
+    int congested;              // Boolean; output is over the high watermark
+    park_queue* parked;         // Replies held back, by thread
+    park_queue* park_next;      // Queue to serve next, round-robin
+    size_t parked_bytes;
+
+    // Batching, for clients that have sent a batch of requests
+    int batch_replies;          // Boolean; send replies in batches too
+    growing_buffer* reply_batch;  // Replies so far in this read, if any
+    char batch_thread[MUX_THREAD_SIZE];  // Thread of the batch's first reply
+    int batch_listed;           // Boolean; on the batched_clients list
+    void* batch_next;           // Next client on the batched_clients list
+} ws_client;
+
+// A transport connection, as registered with epoll.
+typedef struct {
+    int type;                   // WS_SOCK_TRANSPORT; must come first
+    transport_client* handle;
+} ws_transport;
 
 // default values, replaced during setup (below) as needed.
 static char* config_file = "/openils/conf/opensrf_core.xml";
@@ -80,36 +237,88 @@ static char* config_ctxt = "gateway";
 static char* osrf_router = NULL;
 static char* osrf_domain = NULL;
 
-// Cache of opensrf thread strings and back-end receipients.
-// Tracking this here means the caller only needs to track the thread.
-// It also means we don't have to expose internal XMPP IDs
-static osrfHash* stateful_session_cache = NULL;
-// Message on STDIN go into our reusable buffer
-static growing_buffer* stdin_buf = NULL;
 // OpenSRF XMPP connection handle
 static transport_client* osrf_handle = NULL;
 // Reusable string buf for recipient addresses
 static char recipient_buf[RECIP_BUF_SIZE];
-// Websocket client IP address (for logging)
-static char* client_ip = NULL;
-
-static void rebuild_stdin_buffer();
+// The websocket client of the default, one-connection mode
+static ws_client* stdio_client = NULL;
+// Clients with batched replies to send once the read from OpenSRF is done
+static ws_client* batched_clients = NULL;
+// Spare buffers
+static growing_buffer* buffer_pool[BUFFER_POOL_SIZE];
+static int buffer_pool_count = 0;
+
+// Multiplexing mode.  listen_addr is set by --listen.
+static char* listen_addr = NULL;
+static int pool_size = DEFAULT_TRANSPORTS;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+#ifdef WS_MULTIPLEX
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int listen_type = WS_SOCK_LISTEN;
+static ws_transport transports[MAX_TRANSPORTS];
+static int transport_count = 0;
+// Connected clients, keyed on their id
+static osrfHash* clients = NULL;
+// Clients dropped during the current pass of the event loop
+static osrfList* dead_clients = NULL;
+static unsigned long last_client_id = 0;
+#endif
+
+static ws_client* ws_client_new(void);
+static void ws_client_free(ws_client*);
+static growing_buffer* take_buffer(void);
+static void give_buffer(growing_buffer*);
+static void parse_args(int argc, char* argv[]);
 static void child_init(int argc, char* argv[]);
+static int run_stdio(void);
 static void read_from_stdin();
-static void relay_stdin_message(const char*);
-static char* extract_inbound_messages();
-static void log_request(const char*, osrfMessage*);
-static void read_from_osrf();
+static void relay_client_message(ws_client*, const char*);
+static void relay_one_request(ws_client*, const jsonObject*);
+static char* extract_inbound_messages(ws_client*, const char*,
+    const char*, const jsonObject*);
+static void log_request(ws_client*, const char*, osrfMessage*);
+static void read_from_osrf(transport_client*);
 static void read_one_osrf_message(transport_message*);
+static ws_client* client_for_thread(const char*, const char**);
+static const char* client_thread(ws_client*, const char*, char*);
+static void deliver_to_client(ws_client*, const char*, const char*);
+static void queue_reply(ws_client*, const char*, const char*);
+static void send_reply_batch(ws_client*);
+static void send_reply_batches(void);
+static int add_output(ws_client*, const char*, size_t);
+static int add_frame(ws_client*, int, const char*, size_t);
+static int output_pending(const ws_client*);
+static void client_overflow(ws_client*, const char*);
+static void hold_reply(ws_client*, const char*, const char*);
+static void release_parked(ws_client*);
+static void free_parked(ws_client*);
+static void send_frame(ws_client*, int, const char*, size_t);
+static void flush_client(ws_client*);
+static void watch_client(ws_client*, int);
 static int shut_it_down(int);
 static void release_hash_string(char*, void*);
 static int can_shutdown_gracefully();
+#ifdef WS_MULTIPLEX
+static int run_multiplex(void);
+static int open_listener(const char*);
+static void connect_transports(void);
+static void accept_clients(void);
+static void read_from_client(ws_client*);
+static int read_handshake(ws_client*, char*, int);
+static void read_frames(ws_client*, unsigned char*, int);
+static void finish_frame(ws_client*);
+static void send_close(ws_client*, int);
+static void drop_client(ws_client*, const char*);
+static void reap_clients(void);
+#endif
 
 // Websocketd closes STDIN on shutdown, followed by SIGTERM.
-// Signal the back-ends it's time for graceful shutdown by 
-// sending a SIGUSER1 to the backend processes (or parent 
+// Signal the back-ends it's time for graceful shutdown by
+// sending a SIGUSER1 to the backend processes (or parent
 // process group).  Websocket ignores SIGUSR1.
-static time_t shutdown_requested = 0; 
+static time_t shutdown_requested = 0;
 static void sigusr1_handler(int sig) {
     signal(SIGUSR1, sigusr1_handler);
     osrfLogInfo(OSRF_LOG_MARK, "WS received SIGUSR1 -- graceful shutdown");
@@ -124,40 +333,70 @@ int main(int argc, char* argv[]) {
     // Connect to OpenSR -- exits on error
     child_init(argc, argv);
 
-    // Disable output buffering.
-    setbuf(stdout, NULL);
-    rebuild_stdin_buffer();
+#ifdef WS_MULTIPLEX
+    if (listen_addr)
+        return run_multiplex();
+#endif
+
+    return run_stdio();
+}
+
+// Serve the one websocket client on STDIN/STDOUT.
+static int run_stdio(void) {
+
+    stdio_client = ws_client_new();
+    stdio_client->open = 1;
+    stdio_client->handle = osrf_handle;
+
+    // Replies are written to STDOUT as it has room for them, so that a
+    // slow client backs up here rather than stalling the process.
+    stdio_client->fd = fileno(stdout);
+    fcntl(stdio_client->fd, F_SETFL, fcntl(stdio_client->fd, F_GETFL) | O_NONBLOCK);
+
+    const char* remote_addr = getenv("REMOTE_ADDR");
+    if (remote_addr)
+        snprintf(stdio_client->ip, sizeof(stdio_client->ip), "%s", remote_addr);
+    osrfLogInfo(OSRF_LOG_MARK, "WS connect from %s", remote_addr);
 
     // The main loop waits for data to be available on both STDIN
-    // (websocket client request) and the OpenSRF XMPP socket 
-    // (replies returning to the websocket client).
+    // (websocket client request) and the OpenSRF XMPP socket
+    // (replies returning to the websocket client), and for room on
+    // STDOUT when replies are waiting.  While the client is behind on
+    // its replies, the XMPP socket is left unread.
     fd_set fds;
+    fd_set wfds;
     int stdin_no = fileno(stdin);
+    int stdout_no = stdio_client->fd;
     int osrf_no = osrf_handle->session->sock_id;
     int maxfd = osrf_no > stdin_no ? osrf_no : stdin_no;
+    if (stdout_no > maxfd) maxfd = stdout_no;
     int sel_resp;
     int shutdown_stat;
 
     while (1) {
 
         FD_ZERO(&fds);
-        FD_SET(osrf_no, &fds);
+        FD_ZERO(&wfds);
+        if (!stdio_client->congested)
+            FD_SET(osrf_no, &fds);
         FD_SET(stdin_no, &fds);
+        if (output_pending(stdio_client) > 0)
+            FD_SET(stdout_no, &wfds);
 
         if (shutdown_requested) {
 
             struct timeval tv;
             tv.tv_usec = 0;
             tv.tv_sec = SHUTDOWN_POLL_INTERVAL_SECONDS;
-    
+
             // Wait indefinitely for activity to process
-            sel_resp = select(maxfd + 1, &fds, NULL, NULL, &tv);
+            sel_resp = select(maxfd + 1, &fds, &wfds, NULL, &tv);
 
         } else {
 
             // Wait indefinitely for activity to process.
             // This will be interrupted during a shutdown request signal.
-            sel_resp = select(maxfd + 1, &fds, NULL, NULL, NULL);
+            sel_resp = select(maxfd + 1, &fds, &wfds, NULL, NULL);
         }
 
         if (sel_resp < 0) { // error
@@ -176,12 +415,16 @@ int main(int argc, char* argv[]) {
 
         if (sel_resp > 0) {
 
+            if (FD_ISSET(stdout_no, &wfds)) {
+                flush_client(stdio_client);
+            }
+
             if (FD_ISSET(stdin_no, &fds)) {
                 read_from_stdin();
             }
 
             if (FD_ISSET(osrf_no, &fds)) {
-                read_from_osrf();
+                read_from_osrf(osrf_handle);
             }
         }
 
@@ -190,9 +433,9 @@ int main(int argc, char* argv[]) {
 
             if (shutdown_stat == 0) {
                 // continue graceful shutdown cycle
-                continue; 
+                continue;
             }
-            
+
             // graceful shutdown cycle has completed either successfully
             // or via timeout.
             return shut_it_down(shutdown_stat > 0 ? 0 : 1);
@@ -213,43 +456,149 @@ static int can_shutdown_gracefully() {
         return -1;
     }
 
-    unsigned long active_sessions = osrfHashGetCount(stateful_session_cache);
-    if (active_sessions == 0 && requests_in_flight == 0) {
+    unsigned long active_sessions = 0;
+    int requests_in_flight = 0;
+    int unflushed = 0; // clients with replies not yet written out
+
+    if (stdio_client) {
+        active_sessions = osrfHashGetCount(stdio_client->stateful_session_cache);
+        requests_in_flight = stdio_client->requests_in_flight;
+        if (output_pending(stdio_client) || stdio_client->parked)
+            unflushed++;
+    }
+#ifdef WS_MULTIPLEX
+    if (clients) {
+        ws_client* client;
+        osrfHashIterator* itr = osrfNewHashIterator(clients);
+        while ((client = osrfHashIteratorNext(itr))) {
+            active_sessions += osrfHashGetCount(client->stateful_session_cache);
+            requests_in_flight += client->requests_in_flight;
+            if (!client->dead && (output_pending(client) || client->parked))
+                unflushed++;
+        }
+        osrfHashIteratorFree(itr);
+    }
+#endif
+
+    if (active_sessions == 0 && requests_in_flight == 0 && unflushed == 0) {
         osrfLogInfo(OSRF_LOG_MARK, "Graceful shutdown cycle complete");
         return 1;
     }
 
-    osrfLogInfo(OSRF_LOG_MARK, "Graceful shutdown cycle continuing with " 
-        "sessions=%d requests=%d", active_sessions, requests_in_flight);
+    osrfLogInfo(OSRF_LOG_MARK, "Graceful shutdown cycle continuing with "
+        "sessions=%d requests=%d unflushed=%d",
+        active_sessions, requests_in_flight, unflushed);
 
     return 0;
 }
 
-static void rebuild_stdin_buffer() {
+static ws_client* ws_client_new(void) {
+    ws_client* client = safe_malloc(sizeof(ws_client));
+    client->type = WS_SOCK_CLIENT;
+    client->fd = -1;
+    client->stateful_session_cache = osrfNewHash();
+    osrfHashSetCallback(client->stateful_session_cache, release_hash_string);
+    return client;
+}
 
-    if (stdin_buf != NULL) {
-        buffer_free(stdin_buf);
+static void ws_client_free(ws_client* client) {
+    if (client == NULL) return;
+    osrfHashFree(client->stateful_session_cache);
+    give_buffer(client->msg_buf);
+    buffer_free(client->in_buf);
+    give_buffer(client->out_buf);
+    give_buffer(client->reply_batch);
+    free_parked(client);
+    free(client);
+}
+
+// Get an empty buffer, from the pool if there's one there.
+static growing_buffer* take_buffer(void) {
+    if (buffer_pool_count > 0)
+        return buffer_pool[--buffer_pool_count];
+    return buffer_init(1024);
+}
+
+// Return a buffer to the pool, or free it if it has grown large or the
+// pool is full.
+static void give_buffer(growing_buffer* buf) {
+    if (buf == NULL)
+        return;
+
+    if (buf->size > POOLED_BUFFER_MAX_SIZE || buffer_pool_count >= BUFFER_POOL_SIZE) {
+        buffer_free(buf);
+        return;
     }
 
-    stdin_buf = buffer_init(1024);
+    buffer_reset(buf);
+    buffer_pool[buffer_pool_count++] = buf;
 }
 
 static int shut_it_down(int stat) {
-    osrfHashFree(stateful_session_cache);
-    buffer_free(stdin_buf);
+    ws_client_free(stdio_client);
+#ifdef WS_MULTIPLEX
+    if (clients) {
+        // Tell the websocket clients we're going away
+        ws_client* client;
+        osrfHashIterator* itr = osrfNewHashIterator(clients);
+        while ((client = osrfHashIteratorNext(itr))) {
+            send_close(client, WS_CLOSE_GOING_AWAY);
+            drop_client(client, "shutdown");
+        }
+        osrfHashIteratorFree(itr);
+        reap_clients();
+    }
+
+    // The first transport belongs to osrf_system
+    int i;
+    for (i = 1; i < transport_count; i++) {
+        client_disconnect(transports[i].handle);
+        client_free(transports[i].handle);
+    }
+#endif
     osrf_system_shutdown(); // clean XMPP disconnect
     exit(stat);
     return stat;
 }
 
+// Read the command line:
+// osrf-websocket-stdio [config_file] [--listen [address:]port]
+//      [--transports N] [--max-clients N]
+static void parse_args(int argc, char* argv[]) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (!strcmp(arg, "--listen") && i + 1 < argc) {
+            listen_addr = argv[++i];
+
+        } else if (!strcmp(arg, "--transports") && i + 1 < argc) {
+            pool_size = atoi(argv[++i]);
+            if (pool_size < 1) pool_size = 1;
+            if (pool_size > MAX_TRANSPORTS) pool_size = MAX_TRANSPORTS;
+
+        } else if (!strcmp(arg, "--max-clients") && i + 1 < argc) {
+            max_clients = atoi(argv[++i]);
+            if (max_clients < 1) max_clients = DEFAULT_MAX_CLIENTS;
+
+        } else {
+            config_file = argv[i];
+        }
+    }
+
+#ifndef WS_MULTIPLEX
+    if (listen_addr) {
+        fprintf(stderr, "--listen is not supported on this platform\n");
+        exit(1);
+    }
+#endif
+}
 
 // Connect to OpenSRF/XMPP
 // Apply settings and command line args.
 static void child_init(int argc, char* argv[]) {
 
-    if (argc > 1) {
-        config_file = argv[1];
-    }
+    parse_args(argc, argv);
 
     if (!osrf_system_bootstrap_client(config_file, config_ctxt) ) {
         fprintf(stderr, "Cannot boostrap OSRF\n");
@@ -261,12 +610,6 @@ static void child_init(int argc, char* argv[]) {
 
     osrf_router = osrfConfigGetValue(NULL, "/router_name");
     osrf_domain = osrfConfigGetValue(NULL, "/domain");
-
-    stateful_session_cache = osrfNewHash();
-    osrfHashSetCallback(stateful_session_cache, release_hash_string);
-
-    client_ip = getenv("REMOTE_ADDR");
-    osrfLogInfo(OSRF_LOG_MARK, "WS connect from %s", client_ip);
 }
 
 // Called by osrfHash when a string is removed.  We strdup each
@@ -277,91 +620,148 @@ static void release_hash_string(char* key, void* str) {
 }
 
 
-// Relay websocket client messages from STDIN to OpenSRF.  Reads one
-// message then returns, allowing responses to intermingle with long
-// series of requests.
-static void read_from_stdin() {
-    char char_buf[1];
-    char c;
+// Discard the rest of a message that exceeds MAX_MESSAGE_SIZE.
+static void discard_message(ws_client* client) {
+    osrfLogError(OSRF_LOG_MARK,
+        "WS message exceeded MAX_MESSAGE_SIZE, discarding");
+    client->msg_skip = 1;
+    give_buffer(client->msg_buf);
+    client->msg_buf = NULL;
+}
 
-    // Read one char at a time so we can stop at the first newline
-    // and leave any other data on the wire until read_from_stdin()
-    // is called again.
+// Add part of a message to the one being assembled, unless that makes
+// it too big.
+static void add_to_message(ws_client* client, const char* data, size_t len) {
 
-    while (1) {
-        int stat = read(fileno(stdin), char_buf, 1);
+    if (client->msg_skip || len == 0)
+        return;
 
-        if (stat < 0) {
+    if (client->msg_buf == NULL)
+        client->msg_buf = take_buffer();
 
-            if (errno == EAGAIN) {
-                // read interrupted.  Return to main loop to resume.
-                // Returning here will leave any in-progress message in
-                // the stdin_buf.  We return to the main select loop
-                // to confirm we really have more data to read and to
-                // perform additional error checking on the stream.
-                return;
-            }
+    if (client->msg_buf->n_used + len >= MAX_MESSAGE_SIZE) {
+        discard_message(client);
+        return;
+    }
 
-            // All other errors reading STDIN are considered fatal.
-            osrfLogError(OSRF_LOG_MARK,
-                "WS STDIN read failed with [%s]. Exiting", strerror(errno));
-            shut_it_down(1);
-            return;
-        }
+    buffer_add_n(client->msg_buf, data, len);
+}
+
+// Relay the message assembled for a client, if any, and get ready for
+// the next one.
+static void finish_message(ws_client* client) {
+
+    if (client->msg_buf && !client->msg_skip && client->msg_buf->n_used > 0)
+        relay_client_message(client, client->msg_buf->buf);
+
+    give_buffer(client->msg_buf);
+    client->msg_buf = NULL;
+    client->msg_skip = 0;
+}
+
+// Relay websocket client messages from STDIN to OpenSRF.  Reads one
+// block of input, relays each message completed within it, and keeps
+// any partial message for next time, allowing responses to intermingle
+// with long series of requests.
+//
+// Each byte is scanned once: a message that arrives whole within the
+// block is relayed from where it lies, and only the pieces of messages
+// that span blocks are copied into a message buffer.
+static void read_from_stdin() {
+    char block[STDIN_READ_SIZE + 1];
+
+    int stat = read(fileno(stdin), block, STDIN_READ_SIZE);
 
-        if (stat == 0) { // EOF
-            osrfLogInfo(OSRF_LOG_MARK, "WS exiting on disconnect");
-            shut_it_down(0);
+    if (stat < 0) {
+
+        if (errno == EAGAIN || errno == EINTR) {
+            // read interrupted.  Return to main loop to resume.
+            // Returning here will leave any in-progress message in
+            // the message buffer.  We return to the main select loop
+            // to confirm we really have more data to read and to
+            // perform additional error checking on the stream.
             return;
         }
 
-        c = char_buf[0];
+        // All other errors reading STDIN are considered fatal.
+        osrfLogError(OSRF_LOG_MARK,
+            "WS STDIN read failed with [%s]. Exiting", strerror(errno));
+        shut_it_down(1);
+        return;
+    }
 
-        if (c == '\n') { // end of current message
+    if (stat == 0) { // EOF
+        osrfLogInfo(OSRF_LOG_MARK, "WS exiting on disconnect");
+        shut_it_down(0);
+        return;
+    }
 
-            if (stdin_buf->n_used >= MAX_MESSAGE_SIZE) {
-                osrfLogError(OSRF_LOG_MARK,
-                    "WS message exceeded MAX_MESSAGE_SIZE, discarding");
-                rebuild_stdin_buffer();
-                return;
+    char* start = block;
+    char* end = block + stat;
+    char* newline;
+
+    while ((newline = memchr(start, '\n', end - start))) { // end of a message
+        size_t len = newline - start;
+
+        if (stdio_client->msg_buf == NULL && !stdio_client->msg_skip) {
+            // The whole message is in this block
+            if (len > 0) {
+                *newline = '\0';
+                relay_client_message(stdio_client, start);
             }
 
-            if (stdin_buf->n_used > 0) {
-                relay_stdin_message(stdin_buf->buf);
+        } else {
+            add_to_message(stdio_client, start, len);
+            finish_message(stdio_client);
+        }
 
-                if (stdin_buf->n_used >= RESET_MESSAGE_SIZE) {
-                    // Current message is large.  Rebuild the buffer
-                    // to free the excess memory.
-                    rebuild_stdin_buffer();
+        start = newline + 1;
+    }
 
-                } else {
+    // Keep the start of a message that continues in the next block
+    add_to_message(stdio_client, start, end - start);
+}
 
-                    // Reset the buffer and carry on.
-                    buffer_reset(stdin_buf);
-                }
-            }
+// Returns the thread to use on the OpenSRF network for a client's
+// thread.  In multiplexing mode that's the thread prefixed with the id
+// of the connection, built in buf (MUX_THREAD_SIZE bytes).
+static const char* client_thread(ws_client* client, const char* thread, char* buf) {
+    if (client == stdio_client)
+        return thread;
 
-            return;
+    snprintf(buf, MUX_THREAD_SIZE, "ws%lu-%s", client->id, thread ? thread : "");
+    return buf;
+}
 
-        } else {
+// Relays a websocket message to the OpenSRF/XMPP network.  That's one
+// request wrapper, or a batch of them in an array, relayed in order.  A
+// client that sends a batch gets its replies batched too.
+static void relay_client_message(ws_client* client, const char* msg_string) {
 
-            if (stdin_buf->n_used >= MAX_MESSAGE_SIZE) {
-                // Message exceeds max message size.  Continue reading
-                // and discarding data.  NOTE: don't reset stdin_buf
-                // here becase we check n_used again once reading is done.
-                continue;
-            }
+    osrfLogInternal(OSRF_LOG_MARK, "WS received inbound message: %s", msg_string);
 
-            // Add the char to our current message buffer
-            buffer_add_char(stdin_buf, c);
-        }
+    jsonObject *msg_wrapper = jsonParse(msg_string); // free me
+
+    if (msg_wrapper == NULL) {
+        osrfLogWarning(OSRF_LOG_MARK, "WS Invalid JSON: %s", msg_string);
+        return;
+    }
+
+    if (msg_wrapper->type == JSON_ARRAY) {
+        unsigned long i;
+        client->batch_replies = 1;
+        for (i = 0; i < msg_wrapper->size && !client->dead; i++)
+            relay_one_request(client, jsonObjectGetIndex(msg_wrapper, i));
+    } else {
+        relay_one_request(client, msg_wrapper);
     }
+
+    jsonObjectFree(msg_wrapper);
 }
 
 // Relays a single websocket request to the OpenSRF/XMPP network.
-static void relay_stdin_message(const char* msg_string) {
+static void relay_one_request(ws_client* client, const jsonObject* msg_wrapper) {
 
-    jsonObject *msg_wrapper = NULL; // free me
     const jsonObject *tmp_obj = NULL;
     const jsonObject *osrf_msg = NULL;
     const char *service = NULL;
@@ -369,17 +769,14 @@ static void relay_stdin_message(const char* msg_string) {
     const char *log_xid = NULL;
     char *msg_body = NULL;
     char *recipient = NULL;
+    char thread_buf[MUX_THREAD_SIZE];
 
     // generate a new log trace for this request. it
     // may be replaced by a client-provided trace below.
     osrfLogMkXid();
 
-    osrfLogInternal(OSRF_LOG_MARK, "WS received inbound message: %s", msg_string);
-
-    msg_wrapper = jsonParse(msg_string);
-
-    if (msg_wrapper == NULL) {
-        osrfLogWarning(OSRF_LOG_MARK, "WS Invalid JSON: %s", msg_string);
+    if (msg_wrapper == NULL || msg_wrapper->type != JSON_HASH) {
+        osrfLogWarning(OSRF_LOG_MARK, "WS request is not an object");
         return;
     }
 
@@ -414,7 +811,7 @@ static void relay_stdin_message(const char* msg_string) {
 
         // since clients can provide their own threads at session start time,
         // the presence of a thread does not guarantee a cached recipient
-        recipient = (char*) osrfHashGet(stateful_session_cache, thread);
+        recipient = (char*) osrfHashGet(client->stateful_session_cache, thread);
 
         if (recipient) {
             osrfLogDebug(OSRF_LOG_MARK, "WS found cached recipient %s", recipient);
@@ -435,6 +832,11 @@ static void relay_stdin_message(const char* msg_string) {
         }
     }
 
+    if (!osrf_msg || osrf_msg->type != JSON_ARRAY) {
+        osrfLogWarning(OSRF_LOG_MARK, "WS message has no osrf_msg array");
+        return;
+    }
+
     osrfLogDebug(OSRF_LOG_MARK,
         "WS relaying message to opensrf thread=%s, recipient=%s",
             thread, recipient);
@@ -443,32 +845,31 @@ static void relay_stdin_message(const char* msg_string) {
     // during a DISCONNECT call.  Retain a local copy.
     recipient = strdup(recipient);
 
-    msg_body = extract_inbound_messages(service, thread, osrf_msg);
+    msg_body = extract_inbound_messages(client, service, thread, osrf_msg);
 
     osrfLogInternal(OSRF_LOG_MARK,
         "WS relaying inbound message: %s", msg_body);
 
-    transport_message *tmsg = message_init(
-        msg_body, NULL, thread, recipient, NULL);
+    transport_message *tmsg = message_init(msg_body, NULL,
+        client_thread(client, thread, thread_buf), recipient, NULL);
 
     free(recipient);
 
     message_set_osrf_xid(tmsg, osrfLogGetXid());
 
-    if (client_send_message(osrf_handle, tmsg) != 0) {
+    if (client_send_message(client->handle, tmsg) != 0) {
         osrfLogError(OSRF_LOG_MARK, "WS failed sending data to OpenSRF, exiting");
         shut_it_down(1);
     }
 
     osrfLogClearXid();
     message_free(tmsg);
-    jsonObjectFree(msg_wrapper);
     free(msg_body);
 }
 
-// Turn the OpenSRF message JSON into a set of osrfMessage's for 
+// Turn the OpenSRF message JSON into a set of osrfMessage's for
 // analysis, ingress application, and logging.
-static char* extract_inbound_messages(
+static char* extract_inbound_messages(ws_client* client,
         const char* service, const char* thread, const jsonObject *osrf_msg) {
 
     int i;
@@ -481,7 +882,9 @@ static char* extract_inbound_messages(
     // TODO: consider a version of osrf_message_init which can
     // accept a jsonObject* instead of a JSON string.
     char *osrf_msg_json = jsonObjectToJSON(osrf_msg);
-    osrf_message_deserialize(osrf_msg_json, msg_list, num_msgs);
+    // Only the envelopes are needed; payloads are parsed on demand, or
+    // passed through as they are.
+    num_msgs = osrf_message_deserialize_lazy(osrf_msg_json, msg_list, num_msgs);
     free(osrf_msg_json);
 
     // should we require the caller to always pass the service?
@@ -497,12 +900,13 @@ static char* extract_inbound_messages(
                 break;
 
             case REQUEST:
-                log_request(service, msg);
-                requests_in_flight++;
+                log_request(client, service, msg);
+                client->requests_in_flight++;
                 break;
 
             case DISCONNECT:
-                osrfHashRemove(stateful_session_cache, thread);
+                if (thread)
+                    osrfHashRemove(client->stateful_session_cache, thread);
                 break;
 
             default:
@@ -522,9 +926,9 @@ static char* extract_inbound_messages(
 }
 
 // All REQUESTs are logged as activity.
-static void log_request(const char* service, osrfMessage* msg) {
+static void log_request(ws_client* client, const char* service, osrfMessage* msg) {
 
-    const jsonObject* params = msg->_params;
+    const jsonObject* params = NULL;
     growing_buffer* act = buffer_init(128);
     char* method = msg->method_name;
     const jsonObject* obj = NULL;
@@ -532,7 +936,7 @@ static void log_request(const char* service, osrfMessage* msg) {
     const char* str;
     int redactParams = 0;
 
-    buffer_fadd(act, "[%s] [%s] %s %s", client_ip, "", service, method);
+    buffer_fadd(act, "[%s] [%s] %s %s", client->ip, "", service, method);
 
     while ( (str = osrfStringArrayGetString(log_protect_arr, i++)) ) {
         if (!strncmp(method, str, strlen(str))) {
@@ -544,6 +948,7 @@ static void log_request(const char* service, osrfMessage* msg) {
     if (redactParams) {
         OSRF_BUFFER_ADD(act, " **PARAMS REDACTED**");
     } else {
+        params = osrfMessageGetParams(msg);
         i = 0;
         while ((obj = jsonObjectGetIndex(params, i++))) {
             char* str = jsonObjectToJSON(obj);
@@ -562,14 +967,14 @@ static void log_request(const char* service, osrfMessage* msg) {
 
 
 
-// Relay response messages from OpenSRF to STDIN
+// Relay response messages from OpenSRF to the websocket clients
 // Relays all available messages
-static void read_from_osrf() {
+static void read_from_osrf(transport_client* handle) {
     transport_message* tmsg = NULL;
 
     // Double check the socket connection before continuing.
-    if (!client_connected(osrf_handle) ||
-        !socket_connected(osrf_handle->session->sock_id)) {
+    if (!client_connected(handle) ||
+        !socket_connected(handle->session->sock_id)) {
         osrfLogWarning(OSRF_LOG_MARK,
             "WS: Jabber socket disconnected, exiting");
         shut_it_down(1);
@@ -579,22 +984,56 @@ static void read_from_osrf() {
     // read.  This means we can't return to the main select() loop after
     // each message, because any subsequent messages will get stuck in
     // the opensrf receive queue. Process all available messages.
-    while ( (tmsg = client_recv(osrf_handle, 0)) ) {
+    while ( (tmsg = client_recv(handle, 0)) ) {
         read_one_osrf_message(tmsg);
         message_free(tmsg);
     }
+
+    send_reply_batches();
+}
+
+// Find the websocket client a reply belongs to, setting *thread to the
+// thread as that client knows it.  Returns NULL if the client is gone.
+static ws_client* client_for_thread(const char* osrf_thread, const char** thread) {
+    *thread = osrf_thread;
+    if (stdio_client)
+        return stdio_client;
+
+#ifdef WS_MULTIPLEX
+    // ws<id>-<thread>
+    char* end = NULL;
+    if (osrf_thread && !strncmp(osrf_thread, "ws", 2)) {
+        unsigned long id = strtoul(osrf_thread + 2, &end, 10);
+        if (end != osrf_thread + 2 && *end == '-') {
+            char key[32];
+            snprintf(key, sizeof(key), "%lu", id);
+            *thread = end + 1;
+            return osrfHashGet(clients, key);
+        }
+    }
+#endif
+
+    return NULL;
 }
 
-// Process a single OpenSRF response message and print the reponse
-// to STDOUT for delivery to the websocket client.
+// Process a single OpenSRF response message and relay the reponse
+// to its websocket client.
 static void read_one_osrf_message(transport_message* tmsg) {
     osrfList *msg_list = NULL;
     osrfMessage *one_msg = NULL;
+    const char* thread = NULL;
     int i;
 
     osrfLogDebug(OSRF_LOG_MARK,
         "WS received opensrf response for thread=%s", tmsg->thread);
 
+    ws_client* client = client_for_thread(tmsg->thread, &thread);
+    if (client == NULL) {
+        osrfLogDebug(OSRF_LOG_MARK,
+            "WS dropping response for departed client, thread=%s", tmsg->thread);
+        return;
+    }
+
     // first we need to perform some maintenance
     msg_list = osrfMessageDeserialize(tmsg->body, NULL);
 
@@ -611,19 +1050,19 @@ static void read_one_osrf_message(transport_message* tmsg) {
 
             if (one_msg->status_code == OSRF_STATUS_OK) {
 
-                if (!osrfHashGet(stateful_session_cache, tmsg->thread)) {
+                if (!osrfHashGet(client->stateful_session_cache, thread)) {
 
                     unsigned long ses_size =
-                        osrfHashGetCount(stateful_session_cache);
+                        osrfHashGetCount(client->stateful_session_cache);
 
                     if (ses_size < MAX_ACTIVE_STATEFUL_SESSIONS) {
 
                         osrfLogDebug(OSRF_LOG_MARK, "WS caching sender "
                             "thread=%s, sender=%s; concurrent=%d",
-                            tmsg->thread, tmsg->sender, ses_size);
+                            thread, tmsg->sender, ses_size);
 
                         char* sender = strdup(tmsg->sender); // free in *Remove
-                        osrfHashSet(stateful_session_cache, sender, tmsg->thread);
+                        osrfHashSet(client->stateful_session_cache, sender, "%s", thread);
 
                     } else {
 
@@ -639,12 +1078,12 @@ static void read_one_osrf_message(transport_message* tmsg) {
 
                 // connection timed out; clear the cached recipient
                 if (one_msg->status_code == OSRF_STATUS_TIMEOUT) {
-                    osrfHashRemove(stateful_session_cache, tmsg->thread);
+                    osrfHashRemove(client->stateful_session_cache, thread);
 
                 } else {
 
                     if (one_msg->status_code == OSRF_STATUS_COMPLETE) {
-                        requests_in_flight--;
+                        client->requests_in_flight--;
                     }
                 }
             }
@@ -661,7 +1100,7 @@ static void read_one_osrf_message(transport_message* tmsg) {
     char *msg_string = NULL;
     msg_wrapper = jsonNewObject(NULL);
 
-    jsonObjectSetKey(msg_wrapper, "thread", jsonNewObject(tmsg->thread));
+    jsonObjectSetKey(msg_wrapper, "thread", jsonNewObject(thread));
     jsonObjectSetKey(msg_wrapper, "log_xid", jsonNewObject(tmsg->osrf_xid));
     jsonObjectSetKey(msg_wrapper, "osrf_msg", jsonParseRaw(tmsg->body));
 
@@ -677,11 +1116,1049 @@ static void read_one_osrf_message(transport_message* tmsg) {
 
     msg_string = jsonObjectToJSONRaw(msg_wrapper);
 
-    // Send the JSON to STDOUT
-    printf("%s\n", msg_string);
+    queue_reply(client, thread, msg_string);
 
     free(msg_string);
     jsonObjectFree(msg_wrapper);
 }
 
+// Write all of a block of data to a blocking descriptor.
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Queue one reply for a client: a line on STDOUT, or a websocket text
+// frame.  Returns -1 if the output buffer can't hold it.
+static int add_output(ws_client* client, const char* data, size_t len) {
+
+    if (client->out_buf == NULL)
+        client->out_buf = take_buffer();
+
+    if (client == stdio_client) {
+        if (len + output_pending(client) + 1 >= BUFFER_MAX_SIZE) {
+            // Too big to buffer.  Write it out the slow way, as
+            // everything was once written.
+            int flags = fcntl(client->fd, F_GETFL);
+            fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK);
+            int stat = 0;
+            if (write_all(client->fd, client->out_buf->buf + client->out_pos,
+                    output_pending(client)) < 0
+                    || write_all(client->fd, data, len) < 0
+                    || write_all(client->fd, "\n", 1) < 0)
+                stat = -1;
+            fcntl(client->fd, F_SETFL, flags);
+            buffer_reset(client->out_buf);
+            client->out_pos = 0;
+            return stat;
+        }
+
+        if (buffer_add_n(client->out_buf, data, len) < 0
+                || buffer_add_char(client->out_buf, '\n') < 0)
+            return -1;
+        return 0;
+    }
+
+    return add_frame(client, WS_OP_TEXT, data, len);
+}
+
+// Queue a websocket frame for a client.  Returns -1 if the output
+// buffer can't hold it.
+static int add_frame(ws_client* client, int opcode, const char* data, size_t len) {
+
+    unsigned char hdr[10];
+    int hdr_len = 2;
+    hdr[0] = 0x80 | opcode;
+
+    if (len < 126) {
+        hdr[1] = len;
+    } else if (len < 65536) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len & 0xFF;
+        hdr_len = 4;
+    } else {
+        int i;
+        hdr[1] = 127;
+        for (i = 0; i < 8; i++)
+            hdr[2 + i] = ((unsigned long long) len >> (56 - 8 * i)) & 0xFF;
+        hdr_len = 10;
+    }
+
+    if (client->out_buf == NULL)
+        client->out_buf = take_buffer();
+
+    if (buffer_add_n(client->out_buf, (char*) hdr, hdr_len) < 0
+            || buffer_add_n(client->out_buf, data, len) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Bytes queued for a client and not yet written.
+static int output_pending(const ws_client* client) {
+    return client->out_buf ? client->out_buf->n_used - client->out_pos : 0;
+}
+
+// Give up on a client that can't take its output.
+static void client_overflow(ws_client* client, const char* reason) {
+    osrfLogWarning(OSRF_LOG_MARK, "WS %s for %s; disconnecting", reason, client->ip);
+
+    if (client == stdio_client) {
+        shut_it_down(1);
+        return;
+    }
+
+#ifdef WS_MULTIPLEX
+    drop_client(client, "output overflow");
+#endif
+}
+
+// Hold a reply back until the client catches up, in the queue of its
+// thread.
+static void hold_reply(ws_client* client, const char* thread, const char* msg) {
+
+    if (thread == NULL) thread = "";
+
+    park_queue* queue = client->parked;
+    park_queue* last = NULL;
+    while (queue && strcmp(queue->thread, thread)) {
+        last = queue;
+        queue = queue->next;
+    }
+
+    if (queue == NULL) {
+        queue = safe_malloc(sizeof(park_queue) + strlen(thread) + 1);
+        strcpy(queue->thread, thread);
+        if (last)
+            last->next = queue;
+        else
+            client->parked = queue;
+    }
+
+    size_t len = strlen(msg);
+    park_reply* reply = safe_malloc(sizeof(park_reply) + len + 1);
+    reply->len = len;
+    memcpy(reply->text, msg, len + 1);
+
+    if (queue->tail)
+        queue->tail->next = reply;
+    else
+        queue->head = reply;
+    queue->tail = reply;
+
+    client->parked_bytes += len;
+
+    // Reads from OpenSRF are shared by every client on a transport
+    // connection, so a multiplexed client can't make them wait; it may
+    // only fall so far behind.
+    if (client != stdio_client && client->parked_bytes > OUTPUT_PARKED_MAX)
+        client_overflow(client, "held-back replies exceeded the limit");
+}
+
+// Move held-back replies to the output, one from each thread in turn,
+// until the output reaches the high watermark.
+static void release_parked(ws_client* client) {
+
+    while (client->parked && !client->dead
+            && output_pending(client) < OUTPUT_HIGH_WATERMARK) {
+
+        park_queue* queue = client->park_next ? client->park_next : client->parked;
+        park_reply* reply = queue->head;
+
+        queue->head = reply->next;
+        client->park_next = queue->next;
+
+        if (queue->head == NULL) {
+            // The thread has caught up; retire its queue
+            park_queue** link = &client->parked;
+            while (*link != queue)
+                link = &(*link)->next;
+            *link = queue->next;
+            free(queue);
+        }
+
+        client->parked_bytes -= reply->len;
+        int stat = add_output(client, reply->text, reply->len);
+        free(reply);
+
+        if (stat < 0) {
+            client_overflow(client, "a reply exceeded the output buffer");
+            return;
+        }
+    }
+}
+
+// Free a client's held-back replies.
+static void free_parked(ws_client* client) {
+    while (client->parked) {
+        park_queue* queue = client->parked;
+        client->parked = queue->next;
+        while (queue->head) {
+            park_reply* reply = queue->head;
+            queue->head = reply->next;
+            free(reply);
+        }
+        free(queue);
+    }
+    client->park_next = NULL;
+    client->parked_bytes = 0;
+}
+
+// Send one reply to a websocket client.  A client that has fallen
+// behind, over the high watermark, gets its replies held back in a
+// queue per thread, until its output drains below the low watermark.
+// The queues are then served round-robin, so that one session pulling
+// a huge result doesn't hold up the client's other sessions.
+static void deliver_to_client(ws_client* client, const char* thread,
+        const char* msg_string) {
+
+    if (client->dead || client->closing)
+        return;
+
+    if (client->congested || client->parked) {
+        hold_reply(client, thread, msg_string);
+        return;
+    }
+
+    if (add_output(client, msg_string, strlen(msg_string)) < 0) {
+        client_overflow(client, "a reply exceeded the output buffer");
+        return;
+    }
+
+    flush_client(client);
+}
+
+// Send a reply to a client, or, if the client batches its requests, add
+// it to the client's batch of replies.  The batch is a JSON array of
+// reply wrappers, in the order the replies arrived, and goes out as one
+// message once everything waiting on the OpenSRF connection has been
+// read, so that batching never holds a reply back for long.
+static void queue_reply(ws_client* client, const char* thread,
+        const char* msg_string) {
+
+    if (!client->batch_replies) {
+        deliver_to_client(client, thread, msg_string);
+        return;
+    }
+
+    if (client->reply_batch == NULL) {
+        client->reply_batch = take_buffer();
+        snprintf(client->batch_thread, sizeof(client->batch_thread), "%.*s",
+            (int) sizeof(client->batch_thread) - 1, thread ? thread : "");
+    }
+
+    if (!client->batch_listed) {
+        client->batch_listed = 1;
+        client->batch_next = batched_clients;
+        batched_clients = client;
+    }
+
+    buffer_add_char(client->reply_batch,
+        client->reply_batch->n_used ? ',' : '[');
+    buffer_add(client->reply_batch, msg_string);
+
+    if (client->reply_batch->n_used >= REPLY_BATCH_MAX_SIZE)
+        send_reply_batch(client);
+}
+
+// Send a client's batch of replies, if it has one.  A client that has
+// fallen behind holds the batch back under the thread of its first reply.
+static void send_reply_batch(ws_client* client) {
+    growing_buffer* batch = client->reply_batch;
+    if (batch == NULL)
+        return;
+
+    client->reply_batch = NULL;
+    buffer_add_char(batch, ']');
+    deliver_to_client(client, client->batch_thread, batch->buf);
+    give_buffer(batch);
+}
+
+// Send every client's batch of replies.
+static void send_reply_batches(void) {
+    while (batched_clients) {
+        ws_client* client = batched_clients;
+        batched_clients = client->batch_next;
+        client->batch_next = NULL;
+        client->batch_listed = 0;
+        send_reply_batch(client);
+    }
+}
+
+// Queue a websocket frame for a client and try sending it.
+static void send_frame(ws_client* client, int opcode, const char* data, size_t len) {
+
+    if (client->dead || client->closing)
+        return;
+
+    if (add_frame(client, opcode, data, len) < 0) {
+        client_overflow(client, "output exceeded the buffer limit");
+        return;
+    }
+
+    flush_client(client);
+}
+
+// Write as much pending output as the socket will take, topping it up
+// from the held-back replies as it drains.
+static void flush_client(ws_client* client) {
+
+    while (!client->dead) {
+        growing_buffer* out = client->out_buf;
+
+        while (out && client->out_pos < out->n_used) {
+            ssize_t written;
+            if (client == stdio_client)
+                written = write(client->fd, out->buf + client->out_pos,
+                    out->n_used - client->out_pos);
+            else
+                written = send(client->fd, out->buf + client->out_pos,
+                    out->n_used - client->out_pos, MSG_NOSIGNAL);
+
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+                if (client == stdio_client) {
+                    osrfLogError(OSRF_LOG_MARK,
+                        "WS STDOUT write failed with [%s]. Exiting", strerror(errno));
+                    shut_it_down(1);
+                }
+#ifdef WS_MULTIPLEX
+                drop_client(client, strerror(errno));
+#endif
+                return;
+            }
+
+            client->out_pos += written;
+        }
+
+        int pending = output_pending(client);
+
+        if (pending > OUTPUT_HIGH_WATERMARK) {
+            client->congested = 1;
+        } else if (pending <= OUTPUT_LOW_WATERMARK) {
+            client->congested = 0;
+        }
+
+        if (!client->congested && client->parked) {
+            release_parked(client);
+            if (output_pending(client) > pending)
+                continue; // Try writing what was released
+        }
+
+        break;
+    }
+
+    if (client->dead)
+        return;
+
+    growing_buffer* out = client->out_buf;
+
+    if (out && client->out_pos < out->n_used) {
+        // Shift the rest to the front, now and then
+        if (client->out_pos > out->n_used / 2) {
+            memmove(out->buf, out->buf + client->out_pos, out->n_used - client->out_pos);
+            out->n_used -= client->out_pos;
+            out->buf[out->n_used] = '\0';
+            client->out_pos = 0;
+        }
+        watch_client(client, 1);
+        return;
+    }
+
+    // All written; an idle client holds no buffer
+    give_buffer(out);
+    client->out_buf = NULL;
+    client->out_pos = 0;
+    watch_client(client, 0);
+
+    if (client->closing && client != stdio_client) {
+#ifdef WS_MULTIPLEX
+        drop_client(client, "closed");
+#endif
+    }
+}
+
+// Watch a client for room to write, or stop.  The STDIO loop checks
+// for pending output itself.
+static void watch_client(ws_client* client, int want_write) {
+    if (client->want_write == want_write)
+        return;
+    client->want_write = want_write;
+
+#ifdef WS_MULTIPLEX
+    if (client == stdio_client)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+#endif
+}
+
+#ifdef WS_MULTIPLEX
+
+// Serve websocket connections accepted on listen_addr.
+static int run_multiplex(void) {
+
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        osrfLogError(OSRF_LOG_MARK,
+            "WS epoll_create1() failed with [%s]. Exiting", strerror(errno));
+        shut_it_down(1);
+    }
+
+    clients = osrfNewHash();
+    dead_clients = osrfNewList();
+
+    connect_transports();
+
+    listen_fd = open_listener(listen_addr);
+    if (listen_fd < 0)
+        shut_it_down(1);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_type;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    osrfLogInfo(OSRF_LOG_MARK, "WS listening on %s with %d transport connections",
+        listen_addr, transport_count);
+
+    struct epoll_event events[256];
+    int shutdown_stat;
+
+    while (1) {
+
+        int timeout = shutdown_requested ? SHUTDOWN_POLL_INTERVAL_SECONDS * 1000 : -1;
+        int count = epoll_wait(epoll_fd, events, 256, timeout);
+
+        if (count < 0) {
+
+            if (errno == EINTR) {
+                // Interrupted by a signal.  Start the loop over.
+                // Could be a SIGNUSR1 shutdown request.
+                if (!shutdown_requested)
+                    continue;
+                count = 0;
+
+            } else {
+                osrfLogError(OSRF_LOG_MARK,
+                    "WS epoll_wait() failed with [%s]. Exiting", strerror(errno));
+                shut_it_down(1);
+            }
+        }
+
+        int i;
+        for (i = 0; i < count; i++) {
+            int type = *(int*) events[i].data.ptr;
+
+            if (type == WS_SOCK_LISTEN) {
+                accept_clients();
+
+            } else if (type == WS_SOCK_TRANSPORT) {
+                read_from_osrf(((ws_transport*) events[i].data.ptr)->handle);
+
+            } else {
+                ws_client* client = events[i].data.ptr;
+
+                if (!client->dead && (events[i].events & EPOLLOUT))
+                    flush_client(client);
+
+                if (!client->dead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    read_from_client(client);
+            }
+        }
+
+        reap_clients();
+
+        if (shutdown_requested) {
+
+            if (listen_fd >= 0) {
+                // Stop taking new connections
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+                close(listen_fd);
+                listen_fd = -1;
+            }
+
+            shutdown_stat = can_shutdown_gracefully();
+
+            if (shutdown_stat == 0) {
+                // continue graceful shutdown cycle
+                continue;
+            }
+
+            // graceful shutdown cycle has completed either successfully
+            // or via timeout.
+            return shut_it_down(shutdown_stat > 0 ? 0 : 1);
+        }
+    }
+
+    return shut_it_down(0);
+}
+
+// Open a non-blocking listening socket on "port" or "address:port".
+// Returns the socket, or -1 on error.
+static int open_listener(const char* addr) {
+
+    char host[256];
+    const char* port = strrchr(addr, ':');
+    const char* node = NULL;
+
+    if (port) {
+        size_t len = port - addr;
+        if (len >= sizeof(host)) len = sizeof(host) - 1;
+        memcpy(host, addr, len);
+        host[len] = '\0';
+
+        // [::1]:7682
+        node = host;
+        if (host[0] == '[' && len > 1 && host[len - 1] == ']') {
+            host[len - 1] = '\0';
+            node = host + 1;
+        }
+        if (*node == '\0') node = NULL;
+        port++;
+
+    } else {
+        port = addr;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(node, port, &hints, &info);
+    if (rc) {
+        osrfLogError(OSRF_LOG_MARK, "WS unable to resolve listen address %s: %s",
+            addr, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    struct addrinfo* ai;
+    for (ai = info; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ai->ai_protocol);
+        if (fd < 0) continue;
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 512) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+
+    if (fd < 0)
+        osrfLogError(OSRF_LOG_MARK, "WS unable to listen on %s: %s",
+            addr, strerror(errno));
+
+    return fd;
+}
+
+// Fill the transport pool: the bootstrap connection, plus more logins
+// of the same user.  Replies come back to whichever one sent the
+// request, so all of them are watched.
+static void connect_transports(void) {
+
+    transports[0].type = WS_SOCK_TRANSPORT;
+    transports[0].handle = osrf_handle;
+    transport_count = 1;
+
+    char* username = osrfConfigGetValue(NULL, "/username");
+    char* password = osrfConfigGetValue(NULL, "/passwd");
+    char* port = osrfConfigGetValue(NULL, "/port");
+    char* unixpath = osrfConfigGetValue(NULL, "/unixpath");
+    char* compress = osrfConfigGetValue(NULL, "/compress");
+    int use_compression = compress && !strcasecmp(compress, "true");
+    int iport = port ? atoi(port) : 0;
+
+    char host[256] = "";
+    gethostname(host, sizeof(host));
+    host[sizeof(host) - 1] = '\0';
+
+    int i;
+    for (i = 1; i < pool_size; i++) {
+        transport_client* handle =
+            client_init(osrf_domain, iport, unixpath, 0);
+        if (handle == NULL) break;
+        client_set_compression(handle, use_compression);
+
+        char resource[512];
+        snprintf(resource, sizeof(resource), "ws-mux_%s_%ld_%d",
+            host, (long) getpid(), i);
+
+        if (!client_connect(handle, username, password, resource, 10, AUTH_DIGEST)) {
+            osrfLogWarning(OSRF_LOG_MARK,
+                "WS unable to open transport connection %d; using %d", i, i);
+            client_free(handle);
+            break;
+        }
+
+        transports[i].type = WS_SOCK_TRANSPORT;
+        transports[i].handle = handle;
+        transport_count++;
+    }
+
+    free(username);
+    free(password);
+    free(port);
+    free(unixpath);
+    free(compress);
+
+    for (i = 0; i < transport_count; i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &transports[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+                client_sock_fd(transports[i].handle), &ev) < 0) {
+            osrfLogError(OSRF_LOG_MARK, "WS unable to watch transport "
+                "connection %d: %s. Exiting", i, strerror(errno));
+            shut_it_down(1);
+        }
+    }
+}
+
+// Accept waiting websocket connections.
+static void accept_clients(void) {
+
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+
+        int fd = accept(listen_fd, (struct sockaddr*) &addr, &addr_len);
+
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                osrfLogWarning(OSRF_LOG_MARK,
+                    "WS accept() failed with [%s]", strerror(errno));
+            return;
+        }
+
+        if (osrfHashGetCount(clients) >= (unsigned long) max_clients) {
+            osrfLogWarning(OSRF_LOG_MARK,
+                "WS max clients (%d) reached; refusing connection", max_clients);
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        ws_client* client = ws_client_new();
+        client->id = ++last_client_id;
+        client->fd = fd;
+        client->handle = transports[client->id % transport_count].handle;
+        client->in_buf = buffer_init(1024);
+
+        if (getnameinfo((struct sockaddr*) &addr, addr_len, client->ip,
+                sizeof(client->ip), NULL, 0, NI_NUMERICHOST))
+            strcpy(client->ip, "unknown");
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            osrfLogWarning(OSRF_LOG_MARK,
+                "WS unable to watch connection: %s", strerror(errno));
+            close(fd);
+            ws_client_free(client);
+            continue;
+        }
+
+        osrfHashSet(clients, client, "%lu", client->id);
+        osrfLogDebug(OSRF_LOG_MARK, "WS connection %lu from %s", client->id, client->ip);
+    }
+}
+
+// Read what's waiting on a websocket connection.
+static void read_from_client(ws_client* client) {
+    char buf[CLIENT_READ_SIZE];
+
+    int len = read(client->fd, buf, sizeof(buf));
+
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        drop_client(client, strerror(errno));
+        return;
+    }
+
+    if (len == 0) {
+        drop_client(client, "disconnect");
+        return;
+    }
+
+    if (client->closing)
+        return; // Not listening any more
+
+    int used = 0;
+    if (!client->open) {
+        used = read_handshake(client, buf, len);
+        if (used < 0 || client->dead)
+            return;
+    }
+
+    if (used < len)
+        read_frames(client, (unsigned char*) buf + used, len - used);
+}
+
+// Encode binary data as base64, nul-terminated.
+static void base64_encode(const unsigned char* in, size_t len, char* out) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+    for (i = 0; i < len; i += 3) {
+        unsigned long v = (unsigned long) in[i] << 16;
+        if (i + 1 < len) v |= (unsigned long) in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        *out++ = digits[(v >> 18) & 0x3F];
+        *out++ = digits[(v >> 12) & 0x3F];
+        *out++ = (i + 1 < len) ? digits[(v >> 6) & 0x3F] : '=';
+        *out++ = (i + 2 < len) ? digits[v & 0x3F] : '=';
+    }
+    *out = '\0';
+}
+
+// Fold a string to lower case, in place.
+static char* lowercase(char* str) {
+    char* p;
+    for (p = str; *p; p++)
+        *p = tolower((unsigned char) *p);
+    return str;
+}
+
+// Find the value of a header in a handshake, copying it, trimmed, into
+// value.  Returns 1 if found.
+static int handshake_header(const char* request, const char* name,
+        char* value, size_t size) {
+
+    size_t name_len = strlen(name);
+    const char* line = strstr(request, "\r\n");
+
+    while (line && line[2] != '\r') {
+        line += 2;
+        if (!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+            const char* start = line + name_len + 1;
+            const char* end = strstr(start, "\r\n");
+            while (*start == ' ' || *start == '\t') start++;
+            while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+            size_t len = end - start;
+            if (len >= size) return 0;
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    return 0;
+}
+
+// Collect and answer the HTTP upgrade request that opens a websocket
+// connection.  Returns how many bytes of data it used, or -1 if the
+// handshake isn't yet complete, or failed.
+static int read_handshake(ws_client* client, char* data, int len) {
+
+    int before = client->in_buf->n_used;
+    buffer_add_n(client->in_buf, data, len);
+
+    char* request = client->in_buf->buf;
+    char* end = strstr(request, "\r\n\r\n");
+
+    if (end == NULL) {
+        if (client->in_buf->n_used > MAX_HANDSHAKE_SIZE)
+            drop_client(client, "oversized handshake");
+        return -1;
+    }
+    end[2] = '\0'; // keep the last header's \r\n
+    int used = (end + 4 - request) - before;
+
+    char key[64];
+    char value[256];
+
+    if (strncmp(request, "GET ", 4)
+            || !handshake_header(request, "Upgrade", value, sizeof(value))
+            || !strstr(lowercase(value), "websocket")
+            || !handshake_header(request, "Sec-WebSocket-Key", key, sizeof(key))) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        client->out_buf = take_buffer();
+        buffer_add_n(client->out_buf, bad, sizeof(bad) - 1);
+        client->closing = 1;
+        flush_client(client);
+        return -1;
+    }
+
+    if (handshake_header(request, "Sec-WebSocket-Version", value, sizeof(value))
+            && strcmp(value, "13")) {
+        static const char upgrade[] = "HTTP/1.1 426 Upgrade Required\r\n"
+            "Sec-WebSocket-Version: 13\r\nContent-Length: 0\r\n"
+            "Connection: close\r\n\r\n";
+        client->out_buf = take_buffer();
+        buffer_add_n(client->out_buf, upgrade, sizeof(upgrade) - 1);
+        client->closing = 1;
+        flush_client(client);
+        return -1;
+    }
+
+    // Behind a local proxy, log the address it was forwarding for.
+    if ((!strcmp(client->ip, "127.0.0.1") || !strcmp(client->ip, "::1"))
+            && handshake_header(request, "X-Forwarded-For", value, sizeof(value))) {
+        value[strcspn(value, ", ")] = '\0';
+        if (value[0])
+            snprintf(client->ip, sizeof(client->ip), "%.*s",
+                (int) sizeof(client->ip) - 1, value);
+    }
+
+    // Sec-WebSocket-Accept: base64 of the binary SHA1 of key + GUID
+    osrfSHA1Buffer digest;
+    osrfDigest sha;
+    char accept[32];
+    int digested = !osrfDigestInit(&sha, OSRF_DIGEST_SHA1);
+    osrfDigestUpdate(&sha, key, strlen(key));
+    osrfDigestUpdate(&sha, WS_GUID, strlen(WS_GUID));
+    if (!digested || !osrfDigestFinal(&sha, digest.binary, NULL)) {
+        static const char failed[] = "HTTP/1.1 500 Internal Server Error\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        osrfLogError(OSRF_LOG_MARK, "Unable to compute the SHA-1 digest for a "
+            "websocket handshake from %s", client->ip);
+        client->out_buf = take_buffer();
+        buffer_add_n(client->out_buf, failed, sizeof(failed) - 1);
+        client->closing = 1;
+        flush_client(client);
+        return -1;
+    }
+    base64_encode(digest.binary, sizeof(digest.binary), accept);
+
+    client->out_buf = take_buffer();
+    buffer_fadd(client->out_buf, "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+    client->open = 1;
+    buffer_free(client->in_buf);
+    client->in_buf = NULL;
+    osrfLogInfo(OSRF_LOG_MARK, "WS connect from %s", client->ip);
+
+    flush_client(client);
+    return used;
+}
+
+// Parse websocket frames, which may arrive in pieces, relaying each
+// complete message.
+static void read_frames(ws_client* client, unsigned char* data, int len) {
+
+    while (len > 0 && !client->closing && !client->dead) {
+
+        if (!client->in_frame) {
+            // Collect the header: 2 bytes, then the extended length,
+            // then the mask.
+            client->hdr[client->hdr_len++] = *data++;
+            len--;
+
+            if (client->hdr_len < 2)
+                continue;
+
+            int len7 = client->hdr[1] & 0x7F;
+            int need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+
+            if (!(client->hdr[1] & 0x80) || (client->hdr[0] & 0x70)) {
+                // Clients must mask, and we negotiate no extensions
+                send_close(client, WS_CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+
+            if (client->hdr_len < need)
+                continue;
+
+            unsigned long long payload = len7;
+            int i;
+            if (len7 == 126) {
+                payload = (client->hdr[2] << 8) | client->hdr[3];
+            } else if (len7 == 127) {
+                payload = 0;
+                for (i = 2; i < 10; i++)
+                    payload = (payload << 8) | client->hdr[i];
+            }
+            memcpy(client->frame_mask, client->hdr + need - 4, 4);
+
+            client->frame_fin = client->hdr[0] & 0x80;
+            client->frame_opcode = client->hdr[0] & 0x0F;
+            client->frame_left = payload;
+            client->frame_mask_pos = 0;
+            client->ctrl_len = 0;
+            client->hdr_len = 0;
+            client->in_frame = 1;
+
+            int opcode = client->frame_opcode;
+            int bad = 0;
+
+            if (opcode & 0x8) {
+                bad = !client->frame_fin || payload > sizeof(client->ctrl);
+
+            } else if (opcode == WS_OP_CONTINUATION) {
+                bad = !client->msg_open;
+
+            } else if (opcode == WS_OP_TEXT || opcode == WS_OP_BINARY) {
+                bad = client->msg_open;
+                client->msg_open = 1;
+
+            } else {
+                bad = 1;
+            }
+
+            if (bad) {
+                send_close(client, WS_CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+
+            // No need to collect what we already know is too big
+            if (!(opcode & 0x8) && !client->msg_skip && payload >= MAX_MESSAGE_SIZE)
+                discard_message(client);
+
+            if (payload == 0)
+                finish_frame(client);
+
+            continue;
+        }
+
+        // Unmask as much of the payload as we have
+        int n = client->frame_left < (unsigned long long) len ?
+            (int) client->frame_left : len;
+        int i;
+        for (i = 0; i < n; i++)
+            data[i] ^= client->frame_mask[client->frame_mask_pos++ & 3];
+
+        if (client->frame_opcode & 0x8) {
+            memcpy(client->ctrl + client->ctrl_len, data, n);
+            client->ctrl_len += n;
+        } else {
+            add_to_message(client, (char*) data, n);
+        }
+
+        data += n;
+        len -= n;
+        client->frame_left -= n;
+
+        if (client->frame_left == 0)
+            finish_frame(client);
+    }
+}
+
+// Act on a frame whose payload has all arrived.
+static void finish_frame(ws_client* client) {
+    client->in_frame = 0;
+
+    switch (client->frame_opcode) {
+
+        case WS_OP_CLOSE:
+        {
+            int code = WS_CLOSE_GOING_AWAY;
+            if (client->ctrl_len >= 2)
+                code = (client->ctrl[0] << 8) | client->ctrl[1];
+            send_close(client, code);
+            return;
+        }
+
+        case WS_OP_PING:
+            send_frame(client, WS_OP_PONG, (char*) client->ctrl, client->ctrl_len);
+            return;
+
+        case WS_OP_PONG:
+            return;
+    }
+
+    if (!client->frame_fin)
+        return; // More fragments to come
+
+    client->msg_open = 0;
+    finish_message(client);
+}
+
+// Send a close frame; the connection is dropped once it's written.
+static void send_close(ws_client* client, int code) {
+    if (client->open) {
+        char payload[2];
+        payload[0] = (code >> 8) & 0xFF;
+        payload[1] = code & 0xFF;
+        send_frame(client, WS_OP_CLOSE, payload, 2);
+    }
+    client->closing = 1;
+    flush_client(client);
+}
+
+// Close a websocket connection.  Any stateful sessions it left open are
+// disconnected, so the drones serving them needn't wait for a timeout.
+// The client itself is freed by reap_clients(), since other events of
+// the current pass may still refer to it.
+static void drop_client(ws_client* client, const char* reason) {
+
+    if (client->dead)
+        return;
+    client->dead = 1;
+
+    if (client->open)
+        osrfLogInfo(OSRF_LOG_MARK, "WS disconnect from %s (%s)", client->ip, reason);
+
+    const char* recipient;
+    osrfHashIterator* itr = osrfNewHashIterator(client->stateful_session_cache);
+    while ((recipient = osrfHashIteratorNext(itr))) {
+        char thread_buf[MUX_THREAD_SIZE];
+        osrfMessage* msg = osrf_message_init(DISCONNECT, 0, 1);
+        osrfMessageSetIngress(msg, WEBSOCKET_INGRESS);
+        char* body = osrfMessageSerializeBatch(&msg, 1);
+        transport_message* tmsg = message_init(body, NULL,
+            client_thread(client, osrfHashIteratorKey(itr), thread_buf),
+            recipient, NULL);
+        client_send_message(client->handle, tmsg);
+        message_free(tmsg);
+        free(body);
+        osrfMessageFree(msg);
+    }
+    osrfHashIteratorFree(itr);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+
+    char key[32];
+    snprintf(key, sizeof(key), "%lu", client->id);
+    osrfHashRemove(clients, key);
+    osrfListPush(dead_clients, client);
+}
+
+// Free the clients dropped during the pass of the event loop.
+static void reap_clients(void) {
+    ws_client* client;
+    while ((client = osrfListPop(dead_clients)))
+        ws_client_free(client);
+}
 
+#endif
@@ -0,0 +1,266 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "opensrf/log.h"
+
+char logfile[] = "/tmp/check_log_XXXXXX";
+char rotated[ sizeof(logfile) + 8 ];
+char flight[ sizeof(logfile) + 8 ];
+
+//Count the lines in a file containing a string
+static int count_lines(const char* path, const char* text) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -1;
+  char line[1024];
+  int count = 0;
+  while (fgets(line, sizeof(line), file))
+    if (strstr(line, text))
+      count++;
+  fclose(file);
+  return count;
+}
+
+//Set up the test fixture
+void setup(void) {
+  int fd = mkstemp(logfile);
+  close(fd);
+  snprintf(rotated, sizeof(rotated), "%s.1", logfile);
+  snprintf(flight, sizeof(flight), "%s.flight", logfile);
+  osrfLogInit(OSRF_LOG_TYPE_FILE, "check_log", OSRF_LOG_INFO);
+  osrfLogSetFile(logfile);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfLogCleanup();
+  unlink(logfile);
+  unlink(rotated);
+  unlink(flight);
+  strcpy(logfile, "/tmp/check_log_XXXXXX");
+}
+
+//Tests
+
+START_TEST(test_log_buffered)
+{
+  osrfLogInfo(OSRF_LOG_MARK, "first line");
+  osrfLogFlush();
+  osrfLogInfo(OSRF_LOG_MARK, "second line");
+  osrfLogDebug(OSRF_LOG_MARK, "suppressed line");
+  osrfLogFlush();
+  fail_unless(count_lines(logfile, "first line") == 1
+      && count_lines(logfile, "second line") == 1,
+      "osrfLogFlush should write each buffered message once");
+  fail_unless(count_lines(logfile, "suppressed line") == 0,
+      "Messages above the log level should not be written");
+  fail_unless(count_lines(logfile, "check_log ") == 2,
+      "Each message should begin with the appname");
+
+  osrfLogError(OSRF_LOG_MARK, "broken");
+  fail_unless(count_lines(logfile, "[ERR :") == 1,
+      "An error should be written without waiting for a flush");
+}
+END_TEST
+
+START_TEST(test_log_long_message)
+{
+  char big[20000];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  osrfLogInfo(OSRF_LOG_MARK, "short line");
+  osrfLogInfo(OSRF_LOG_MARK, "%s", big);
+  osrfLogFlush();
+
+  FILE* file = fopen(logfile, "r");
+  fail_unless(file != NULL, "The log file should exist");
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+  fail_unless(size > (long) sizeof(big),
+      "A message bigger than the buffer should be written whole");
+  fail_unless(count_lines(logfile, "short line") == 1,
+      "The message before it should be written first");
+}
+END_TEST
+
+START_TEST(test_log_reopen)
+{
+  osrfLogInfo(OSRF_LOG_MARK, "before rotation");
+  osrfLogFlush();
+  fail_unless(rename(logfile, rotated) == 0, "Unable to rotate the log file");
+
+  osrfLogReopen();
+  osrfLogInfo(OSRF_LOG_MARK, "after rotation");
+  osrfLogFlush();
+  fail_unless(count_lines(rotated, "before rotation") == 1
+      && count_lines(rotated, "after rotation") == 0,
+      "The rotated file should keep only the old messages");
+  fail_unless(count_lines(logfile, "after rotation") == 1,
+      "New messages should go to a new file by the old name");
+}
+END_TEST
+
+START_TEST(test_log_fork)
+{
+  osrfLogInfo(OSRF_LOG_MARK, "prime the flush timer");
+  osrfLogFlush();
+  osrfLogInfo(OSRF_LOG_MARK, "parent's line");
+
+  pid_t pid = fork();
+  if (0 == pid) {
+    osrfLogInfo(OSRF_LOG_MARK, "child's line");
+    exit(0);
+  }
+  fail_unless(pid > 0, "Unable to fork");
+  waitpid(pid, NULL, 0);
+  osrfLogFlush();
+
+  fail_unless(count_lines(logfile, "parent's line") == 1,
+      "A child should not write what the parent had buffered");
+  fail_unless(count_lines(logfile, "child's line") == 1,
+      "A child's own messages should be written on exit");
+}
+END_TEST
+
+START_TEST(test_log_header)
+{
+  osrfLogWarning(OSRF_LOG_MARK, "headed line");
+  osrfLogActivity(OSRF_LOG_MARK, "activity line");
+  pid_t pid = fork();
+  if (0 == pid) {
+    osrfLogInfo(OSRF_LOG_MARK, "child's headed line");
+    exit(0);
+  }
+  fail_unless(pid > 0, "Unable to fork");
+  waitpid(pid, NULL, 0);
+  osrfLogFlush();
+
+  char head[64];
+  snprintf(head, sizeof(head), "[WARN:%ld:", (long) getpid());
+  fail_unless(count_lines(logfile, head) == 1,
+      "A message should carry its label, pid, and file");
+  snprintf(head, sizeof(head), "[ACT:%ld:", (long) getpid());
+  fail_unless(count_lines(logfile, head) == 1,
+      "An activity message should carry its own label");
+  snprintf(head, sizeof(head), "[INFO:%ld:", (long) pid);
+  fail_unless(count_lines(logfile, head) == 1,
+      "A forked child should log its own pid");
+
+  FILE* file = fopen(logfile, "r");
+  fail_unless(file != NULL, "The log file should exist");
+  char line[256];
+  int year, mon, day, hour, min, sec, lineno;
+  while (fgets(line, sizeof(line), file) && !strstr(line, "[WARN:"))
+    ;
+  fclose(file);
+  fail_unless(sscanf(line, "check_log %d-%d-%d %d:%d:%d [WARN:%*d:%*[^:]:%d:] headed line",
+      &year, &mon, &day, &hour, &min, &sec, &lineno) == 7,
+      "A line should hold the appname, date, header, and message");
+  fail_unless(lineno > 0, "A line should hold the line number");
+}
+END_TEST
+
+START_TEST(test_log_async)
+{
+  fail_unless(osrfLogSetAsync(4, 1) == 0, "osrfLogSetAsync should succeed");
+  int i;
+  for (i = 0; i < 100; i++)
+    osrfLogInfo(OSRF_LOG_MARK, "queued line %d", i);
+  osrfLogFlush();
+  fail_unless(count_lines(logfile, "queued line") == 100,
+      "When blocking, every queued message should be written");
+  fail_unless(osrfLogGetDropped() == 0, "Nothing should be dropped when blocking");
+
+  // An error goes out at once, along with whatever was queued ahead of it
+  for (i = 0; i < 3; i++)
+    osrfLogInfo(OSRF_LOG_MARK, "ahead of error %d", i);
+  osrfLogError(OSRF_LOG_MARK, "urgent error");
+  fail_unless(count_lines(logfile, "urgent error") == 1,
+      "An error should be written without waiting for a flush");
+  fail_unless(count_lines(logfile, "ahead of error") == 3,
+      "Messages queued before an error should be written before it");
+
+  // Dropping: whatever gets through, gets through whole
+  osrfLogSetAsync(4, 0);
+  for (i = 0; i < 100; i++)
+    osrfLogInfo(OSRF_LOG_MARK, "droppable line %d", i);
+  osrfLogFlush();
+  fail_unless(count_lines(logfile, "droppable line") + (int) osrfLogGetDropped() == 100,
+      "Every message should be either written or counted as dropped");
+
+  fail_unless(osrfLogSetAsync(0, 0) == 0, "osrfLogSetAsync(0) should succeed");
+  osrfLogInfo(OSRF_LOG_MARK, "direct line");
+  osrfLogFlush();
+  fail_unless(count_lines(logfile, "direct line") == 1,
+      "Messages should be written directly again");
+}
+END_TEST
+
+START_TEST(test_log_recorder)
+{
+  fail_unless(osrfLogDumpRecorder("nothing") == -1,
+      "There should be no recorder to dump until there is one");
+  fail_unless(osrfLogSetRecorder(8, NULL) == 0, "osrfLogSetRecorder should succeed");
+  int i;
+  for (i = 0; i < 20; i++)
+    osrfLogDebug(OSRF_LOG_MARK, "recorded line %02d", i);
+  osrfLogSetXid("recxid");
+  osrfLogInfo(OSRF_LOG_MARK, "logged line");
+  osrfLogSetXid("");
+  osrfLogFlush();
+  fail_unless(count_lines(logfile, "recorded line") == 0,
+      "Recorded messages above the log level should not be logged");
+
+  fail_unless(osrfLogDumpRecorder("testing") == 0, "osrfLogDumpRecorder should succeed");
+  fail_unless(count_lines(flight, "==== Flight recorder of check_log pid ") == 1
+      && count_lines(flight, ": testing ====") == 1,
+      "A dump should begin with a heading");
+  fail_unless(count_lines(flight, "recorded line") == 7
+      && count_lines(flight, "recorded line 12") == 0
+      && count_lines(flight, "[DEBG:") == 7
+      && count_lines(flight, "recxid] logged line") == 1,
+      "A dump should hold the latest messages, formatted as for the log file");
+
+  osrfLogInternal(OSRF_LOG_MARK, "later line");
+  osrfLogDumpRecorder("again");
+  fail_unless(count_lines(flight, "recorded line") == 7
+      && count_lines(flight, "[INT :") == 1,
+      "A dump should hold only what's new since the last one");
+
+  osrfLogSetRecorder(0, NULL);
+  osrfLogDebug(OSRF_LOG_MARK, "unrecorded line");
+  osrfLogDumpRecorder("stopped");
+  fail_unless(count_lines(flight, "unrecorded line") == 0,
+      "Nothing should be recorded once the recorder is off");
+}
+END_TEST
+
+//END TESTS
+
+Suite *log_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("log");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_log_buffered);
+  tcase_add_test(tc_core, test_log_long_message);
+  tcase_add_test(tc_core, test_log_reopen);
+  tcase_add_test(tc_core, test_log_fork);
+  tcase_add_test(tc_core, test_log_header);
+  tcase_add_test(tc_core, test_log_async);
+  tcase_add_test(tc_core, test_log_recorder);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, log_suite());
+}
@@ -0,0 +1,141 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "opensrf/osrf_affinity.h"
+
+char nodedir[] = "/tmp/check_osrf_affinity_XXXXXX";
+
+// Describe a NUMA node the way sysfs does
+static void add_node(int node, const char* cpulist) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/node%d", nodedir, node);
+  mkdir(path, 0700);
+  strcat(path, "/cpulist");
+  FILE* file = fopen(path, "w");
+  fprintf(file, "%s\n", cpulist);
+  fclose(file);
+}
+
+static void remove_node(int node) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/node%d/cpulist", nodedir, node);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/node%d", nodedir, node);
+  rmdir(path);
+}
+
+//Set up the test fixture
+void setup(void) {
+  mkdtemp(nodedir);
+  add_node(0, "0-3,8-11");
+  add_node(1, "4-7,12-15");
+  osrfNumaSetSysfsDir(nodedir);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfNumaSetSysfsDir(NULL);
+  remove_node(0);
+  remove_node(1);
+  rmdir(nodedir);
+  strcpy(nodedir, "/tmp/check_osrf_affinity_XXXXXX");
+}
+
+//Tests
+
+START_TEST(test_osrf_cpu_set_parse)
+{
+  osrfCpuSet set;
+  fail_unless(osrfCpuSetParse(&set, " 0-3, 8,10 - 11\n") == 0,
+      "osrfCpuSetParse should accept ranges and white space");
+  ck_assert_int_eq(osrfCpuSetCount(&set), 7);
+  fail_unless(osrfCpuSetHas(&set, 3) && osrfCpuSetHas(&set, 10),
+      "The set should hold the CPUs listed");
+  fail_unless(!osrfCpuSetHas(&set, 4) && !osrfCpuSetHas(&set, -1)
+      && !osrfCpuSetHas(&set, OSRF_MAX_CPUS),
+      "The set should hold nothing else");
+
+  char* str = osrfCpuSetFormat(&set);
+  ck_assert_str_eq(str, "0-3,8,10,11");
+  free(str);
+
+  fail_unless(osrfCpuSetParse(&set, "3-1") == -1, "A backwards range is invalid");
+  fail_unless(osrfCpuSetParse(&set, "0,x") == -1, "So is anything but numbers");
+  fail_unless(osrfCpuSetParse(&set, "1-") == -1, "So is an open range");
+  fail_unless(osrfCpuSetParse(&set, "") == -1, "So is an empty list");
+  fail_unless(osrfCpuSetParse(&set, NULL) == -1, "So is no list");
+}
+END_TEST
+
+START_TEST(test_osrf_affinity_plan)
+{
+  osrfCpuSet cpus;
+  int node;
+  char* str;
+
+  fail_unless(osrfAffinityPlan(&cpus, &node, "2-5", 0, 3) == 0,
+      "osrfAffinityPlan should accept a valid list");
+  str = osrfCpuSetFormat(&cpus);
+  ck_assert_str_eq(str, "2-5");
+  free(str);
+  ck_assert_int_eq(node, -1);
+
+  // Spreading takes the nodes in turn
+  osrfAffinityPlan(&cpus, &node, "0-15", 1, 0);
+  str = osrfCpuSetFormat(&cpus);
+  ck_assert_str_eq(str, "0-3,8-11");
+  free(str);
+  ck_assert_int_eq(node, 0);
+
+  osrfAffinityPlan(&cpus, &node, "0-15", 1, 3);
+  str = osrfCpuSetFormat(&cpus);
+  ck_assert_str_eq(str, "4-7,12-15");
+  free(str);
+  ck_assert_int_eq(node, 1);
+
+  // Only within the list, and only among nodes that share CPUs with it
+  osrfAffinityPlan(&cpus, &node, "2-4", 1, 1);
+  str = osrfCpuSetFormat(&cpus);
+  ck_assert_str_eq(str, "4");
+  free(str);
+  osrfAffinityPlan(&cpus, &node, "8-9", 1, 1);
+  str = osrfCpuSetFormat(&cpus);
+  ck_assert_str_eq(str, "8,9");
+  free(str);
+  ck_assert_int_eq(node, 0);
+
+  // Without a NUMA layout, the whole list
+  osrfNumaSetSysfsDir("/nonexistent");
+  osrfAffinityPlan(&cpus, &node, "0-15", 1, 1);
+  ck_assert_int_eq(osrfCpuSetCount(&cpus), 16);
+  ck_assert_int_eq(node, -1);
+
+  fail_unless(osrfAffinityPlan(&cpus, &node, "bogus", 1, 1) == -1,
+      "osrfAffinityPlan should reject an invalid list");
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_affinity_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_affinity");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_cpu_set_parse);
+  tcase_add_test(tc_core, test_osrf_affinity_plan);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_affinity_suite());
+}
@@ -0,0 +1,155 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opensrf/osrf_backlog.h"
+
+osrfBacklog queue;
+
+//Set up the test fixture
+void setup(void) {
+  memset(&queue, 0, sizeof(queue));
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfBacklogClear(&queue);
+}
+
+// Make a request we can tell apart from the others by its thread
+static transport_message* request(const char* thread) {
+  return message_init("body", NULL, thread, "client", "service");
+}
+
+//BEGIN TESTS
+
+START_TEST(test_osrf_backlog_order)
+{
+  osrfBacklogPush(&queue, request("low"), OSRF_PRIORITY_LOW, 0);
+  osrfBacklogPush(&queue, request("normal1"), OSRF_PRIORITY_NORMAL, 0);
+  osrfBacklogPush(&queue, request("high"), OSRF_PRIORITY_HIGH, 0);
+  osrfBacklogPush(&queue, request("normal2"), OSRF_PRIORITY_NORMAL, 0);
+  ck_assert_int_eq(queue.size, 4);
+
+  const char* expected[] = { "high", "normal1", "normal2", "low" };
+  int i;
+  for (i = 0; i < 4; i++) {
+    osrfBacklogItem* item = osrfBacklogPeek(&queue);
+    fail_if(item == NULL, "osrfBacklogPeek should find a request");
+    transport_message* msg = osrfBacklogPop(&queue, item->priority);
+    ck_assert_str_eq(msg->thread, expected[i]);
+    message_free(msg);
+  }
+
+  ck_assert_int_eq(queue.size, 0);
+  fail_unless(osrfBacklogPeek(&queue) == NULL,
+      "osrfBacklogPeek should find nothing in an empty queue");
+}
+END_TEST
+
+START_TEST(test_osrf_backlog_limit)
+{
+  fail_unless(osrfBacklogAdmit(&queue, request("one"), OSRF_PRIORITY_NORMAL, 0, 2) == NULL,
+      "A queue below its limit should take a request");
+  fail_unless(osrfBacklogAdmit(&queue, request("two"), OSRF_PRIORITY_NORMAL, 0, 2) == NULL,
+      "A queue below its limit should take a request");
+
+  // At the limit, a request of the same priority is turned away
+  transport_message* three = request("three");
+  fail_unless(osrfBacklogAdmit(&queue, three, OSRF_PRIORITY_NORMAL, 0, 2) == three,
+      "A full queue should turn away a request of the same priority");
+  message_free(three);
+  ck_assert_int_eq(queue.size, 2);
+
+  // ...and so is one of lower priority
+  transport_message* low = request("low");
+  fail_unless(osrfBacklogAdmit(&queue, low, OSRF_PRIORITY_LOW, 0, 2) == low,
+      "A full queue should turn away a request of lower priority");
+  message_free(low);
+  ck_assert_int_eq(queue.size, 2);
+}
+END_TEST
+
+START_TEST(test_osrf_backlog_evict)
+{
+  osrfBacklogAdmit(&queue, request("normal"), OSRF_PRIORITY_NORMAL, 0, 3);
+  osrfBacklogAdmit(&queue, request("low1"), OSRF_PRIORITY_LOW, 0, 3);
+  osrfBacklogAdmit(&queue, request("low2"), OSRF_PRIORITY_LOW, 0, 3);
+
+  // A high-priority request takes the place of the newest low-priority one
+  transport_message* dropped =
+      osrfBacklogAdmit(&queue, request("high"), OSRF_PRIORITY_HIGH, 0, 3);
+  fail_if(dropped == NULL, "A full queue should make room for a higher priority");
+  ck_assert_str_eq(dropped->thread, "low2");
+  message_free(dropped);
+  ck_assert_int_eq(queue.size, 3);
+
+  // A normal one takes the place of the other; then there's nothing left to evict
+  dropped = osrfBacklogAdmit(&queue, request("normal2"), OSRF_PRIORITY_NORMAL, 0, 3);
+  fail_if(dropped == NULL, "A full queue should make room for a higher priority");
+  ck_assert_str_eq(dropped->thread, "low1");
+  message_free(dropped);
+  fail_unless(queue.head[OSRF_PRIORITY_LOW] == NULL && queue.tail[OSRF_PRIORITY_LOW] == NULL,
+      "Evicting the last of a class should empty it");
+
+  transport_message* normal = request("normal3");
+  fail_unless(osrfBacklogAdmit(&queue, normal, OSRF_PRIORITY_NORMAL, 0, 3) == normal,
+      "A full queue with nothing of lower priority should turn a request away");
+  message_free(normal);
+  ck_assert_int_eq(queue.size, 3);
+}
+END_TEST
+
+START_TEST(test_osrf_backlog_zero_limit)
+{
+  // A limit of zero still lets one request wait
+  fail_unless(osrfBacklogAdmit(&queue, request("first"), OSRF_PRIORITY_NORMAL, 0, 0) == NULL,
+      "An empty queue should take a request whatever its limit");
+  ck_assert_int_eq(queue.size, 1);
+
+  transport_message* second = request("second");
+  fail_unless(osrfBacklogAdmit(&queue, second, OSRF_PRIORITY_NORMAL, 0, 0) == second,
+      "A queue with a limit of zero should hold only one request");
+  message_free(second);
+
+  // Once it's gone, there's room again
+  message_free(osrfBacklogPop(&queue, OSRF_PRIORITY_NORMAL));
+  fail_unless(osrfBacklogAdmit(&queue, request("third"), OSRF_PRIORITY_NORMAL, 0, 0) == NULL,
+      "An emptied queue should take a request again");
+  ck_assert_int_eq(queue.size, 1);
+}
+END_TEST
+
+START_TEST(test_osrf_backlog_deadline)
+{
+  osrfBacklogPush(&queue, request("timed"), OSRF_PRIORITY_NORMAL, 12345);
+  osrfBacklogItem* item = osrfBacklogPeek(&queue);
+  fail_unless(item->deadline == 12345, "The item should keep the request's deadline");
+  ck_assert_int_eq(item->priority, OSRF_PRIORITY_NORMAL);
+  fail_unless(item->arrived > 0.0, "The item should record when it arrived");
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_backlog_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_backlog");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_backlog_order);
+  tcase_add_test(tc_core, test_osrf_backlog_limit);
+  tcase_add_test(tc_core, test_osrf_backlog_evict);
+  tcase_add_test(tc_core, test_osrf_backlog_zero_limit);
+  tcase_add_test(tc_core, test_osrf_backlog_deadline);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_backlog_suite());
+}
@@ -0,0 +1,151 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "opensrf/osrf_capture.h"
+#include "opensrf/osrf_system.h"
+#include "opensrf/log.h"
+
+char capturefile[] = "/tmp/check_osrf_capture_XXXXXX";
+
+//Build a request for a method, with parameters given as JSON text
+static osrfMessage* make_request(const char* method, const char* params) {
+  osrfMessage* msg = osrf_message_init(REQUEST, 1, 1);
+  osrf_message_set_method(msg, method);
+  if (params) {
+    jsonObject* obj = jsonParse(params);
+    osrf_message_set_params(msg, obj);
+    jsonObjectFree(obj);
+  }
+  return msg;
+}
+
+//Set up the test fixture
+void setup(void) {
+  int fd = mkstemp(capturefile);
+  close(fd);
+  unlink(capturefile);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfCaptureInit(NULL);
+  osrfLogClearXid();
+  osrfStringArrayFree(log_protect_arr);
+  log_protect_arr = NULL;
+  unlink(capturefile);
+  strcpy(capturefile, "/tmp/check_osrf_capture_XXXXXX");
+}
+
+//Tests
+
+START_TEST(test_osrf_capture_round_trip)
+{
+  fail_unless(osrfCaptureEnabled() == 0, "Capture should be off by default");
+  fail_unless(osrfCaptureInit(capturefile) == 0, "osrfCaptureInit should succeed");
+  fail_unless(osrfCaptureEnabled() == 1, "Capture should be on once initialized");
+
+  log_protect_arr = osrfNewStringArray(2);
+  osrfStringArrayAdd(log_protect_arr, "open-ils.auth.");
+
+  osrfLogSetXid("capturexid");
+  osrfMessage* msg = make_request("opensrf.math.add", "[1,\"two\"]");
+  osrfCaptureRequest("opensrf.math", msg);
+  osrfMessageFree(msg);
+
+  msg = make_request("open-ils.auth.authenticate.complete", "[{\"password\":\"secret\"}]");
+  osrfCaptureRequest("open-ils.auth", msg);
+  osrfMessageFree(msg);
+
+  msg = osrf_message_init(CONNECT, 1, 1);
+  osrfCaptureRequest("opensrf.math", msg);
+  osrfMessageFree(msg);
+
+  osrfLogClearXid();
+  msg = make_request("opensrf.system.echo", NULL);
+  osrfCaptureRequest("opensrf.math", msg);
+  osrfMessageFree(msg);
+
+  // Reopening an existing file appends to it, without another magic string
+  fail_unless(osrfCaptureInit(capturefile) == 0, "osrfCaptureInit should reopen the file");
+  msg = make_request("opensrf.math.div", "[4,2]");
+  osrfCaptureRequest("opensrf.math", msg);
+  osrfMessageFree(msg);
+  osrfCaptureInit(NULL);
+
+  osrfCaptureFile* file = osrfCaptureOpen(capturefile);
+  fail_unless(file != NULL, "osrfCaptureOpen should open a capture file");
+
+  osrfCaptureRecord rec;
+  fail_unless(osrfCaptureRead(file, &rec) == 1, "The first request should be there");
+  fail_unless(strcmp(rec.service, "opensrf.math") == 0
+      && strcmp(rec.method, "opensrf.math.add") == 0
+      && strcmp(rec.xid, "capturexid") == 0
+      && strcmp(rec.params, "[1,\"two\"]") == 0,
+      "A record should carry the service, method, xid, and params");
+  long long first = rec.time;
+  fail_unless(first > 0, "A record should carry the time");
+
+  fail_unless(osrfCaptureRead(file, &rec) == 1
+      && strcmp(rec.method, "open-ils.auth.authenticate.complete") == 0
+      && rec.params == NULL,
+      "A protected method should be captured without its params");
+
+  fail_unless(osrfCaptureRead(file, &rec) == 1
+      && strcmp(rec.method, "opensrf.system.echo") == 0
+      && strcmp(rec.xid, "") == 0 && strcmp(rec.params, "[]") == 0,
+      "Only requests should be captured, even without an xid or params");
+
+  fail_unless(osrfCaptureRead(file, &rec) == 1
+      && strcmp(rec.method, "opensrf.math.div") == 0 && rec.time >= first,
+      "A reopened file should be appended to");
+
+  fail_unless(osrfCaptureRead(file, &rec) == 0, "The file should end there");
+  osrfCaptureClose(file);
+}
+END_TEST
+
+START_TEST(test_osrf_capture_bad_files)
+{
+  fail_unless(osrfCaptureOpen(capturefile) == NULL,
+      "osrfCaptureOpen should fail on a missing file");
+
+  FILE* out = fopen(capturefile, "w");
+  fputs("not a capture", out);
+  fclose(out);
+  fail_unless(osrfCaptureOpen(capturefile) == NULL,
+      "osrfCaptureOpen should reject a file without the magic string");
+
+  out = fopen(capturefile, "w");
+  fputs(OSRF_CAPTURE_MAGIC, out);
+  fwrite("\x30\x00\x00\x00\x01\x02", 1, 6, out);
+  fclose(out);
+  osrfCaptureFile* file = osrfCaptureOpen(capturefile);
+  fail_unless(file != NULL, "osrfCaptureOpen should accept the magic string");
+  osrfCaptureRecord rec;
+  fail_unless(osrfCaptureRead(file, &rec) == -1, "A truncated record should be an error");
+  osrfCaptureClose(file);
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_capture_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_capture");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_capture_round_trip);
+  tcase_add_test(tc_core, test_osrf_capture_bad_files);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_capture_suite());
+}
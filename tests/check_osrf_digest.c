@@ -0,0 +1,134 @@
+#include <check.h>
+#include <string.h>
+#include "opensrf/osrf_digest.h"
+#include "opensrf/utils.h"
+#include "opensrf/sha.h"
+#include "opensrf/md5.h"
+
+//Set up the test fixture
+void setup(void) {
+}
+
+//Clean up the test fixture
+void teardown(void) {
+}
+
+//Tests
+
+START_TEST(test_osrf_digest_one_shot)
+{
+  osrfMD5Buffer md5;
+  osrf_md5_digest(&md5, "abc");
+  ck_assert_str_eq(md5.hex, "900150983cd24fb0d6963f7d28e17f72");
+  fail_unless(md5.binary[0] == 0x90 && md5.binary[15] == 0x72,
+      "osrf_md5_digest should fill in the binary digest");
+
+  osrfSHA1Buffer sha1;
+  osrf_sha1_digest_fmt(&sha1, "%s%c", "ab", 'c');
+  ck_assert_str_eq(sha1.hex, "a9993e364706816aba3e25717850c26c9cd0d89d");
+
+  osrfSHA256Buffer sha256;
+  osrf_sha256_digest(&sha256, "abc");
+  ck_assert_str_eq(sha256.hex,
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  osrf_sha256_digest(&sha256, NULL);
+  ck_assert_str_eq(sha256.hex, "");
+}
+END_TEST
+
+START_TEST(test_osrf_digest_incremental)
+{
+  osrfDigest digest;
+  unsigned char binary[OSRF_DIGEST_MAX_SIZE];
+  char hex[2 * OSRF_DIGEST_MAX_SIZE + 1];
+
+  fail_unless(osrfDigestInit(&digest, OSRF_DIGEST_SHA256) == 0,
+      "osrfDigestInit should succeed");
+  osrfDigestUpdate(&digest, "a", 1);
+  osrfDigestUpdate(&digest, "", 0);
+  osrfDigestUpdate(&digest, "bc", 2);
+  ck_assert_int_eq(osrfDigestFinal(&digest, binary, hex), 32);
+  ck_assert_str_eq(hex,
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  fail_unless(binary[0] == 0xba && binary[31] == 0xad,
+      "osrfDigestFinal should fill in the binary digest");
+
+  // A long input, fed in uneven pieces, matches the one-shot digest
+  char big[5000];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  osrfSHA1Buffer sha1;
+  osrf_sha1_digest(&sha1, big);
+
+  osrfDigestInit(&digest, OSRF_DIGEST_SHA1);
+  size_t pos = 0;
+  size_t step = 1;
+  while (pos < sizeof(big) - 1) {
+    size_t n = sizeof(big) - 1 - pos < step ? sizeof(big) - 1 - pos : step;
+    osrfDigestUpdate(&digest, big + pos, n);
+    pos += n;
+    step = step * 3 + 1;
+  }
+  ck_assert_int_eq(osrfDigestFinal(&digest, NULL, hex), 20);
+  ck_assert_str_eq(hex, sha1.hex);
+
+  ck_assert_int_eq(osrfDigestFinal(&digest, binary, hex), 0);
+  ck_assert_str_eq(hex, "");
+  ck_assert_int_eq(osrfDigestSize(OSRF_DIGEST_MD5), 16);
+}
+END_TEST
+
+START_TEST(test_osrf_digest_wrappers)
+{
+  char* sum = md5sum("abc");
+  ck_assert_str_eq(sum, "900150983cd24fb0d6963f7d28e17f72");
+  free(sum);
+
+  ck_assert_str_eq(shahash("abc"), "a9993e364706816aba3e25717850c26c9cd0d89d");
+  ck_assert_str_eq(shahash(""), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+}
+END_TEST
+
+START_TEST(test_osrf_digest_md5_fallback)
+{
+  // What osrfDigest falls back on when gnutls won't do MD5 must agree with gnutls
+  const char* text = "The quick brown fox jumps over the lazy dog";
+  osrfMD5Buffer md5;
+  osrf_md5_digest(&md5, text);
+
+  struct md5_ctx ctx;
+  unsigned char binary[16];
+  MD5_start(&ctx);
+  const char* p;
+  for (p = text; *p; p++)
+    MD5_feed(&ctx, (unsigned char) *p);
+  MD5_stop(&ctx, binary);
+  fail_unless(memcmp(binary, md5.binary, 16) == 0,
+      "The bundled MD5 should compute the same digest as gnutls");
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_digest_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_digest");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_digest_one_shot);
+  tcase_add_test(tc_core, test_osrf_digest_incremental);
+  tcase_add_test(tc_core, test_osrf_digest_wrappers);
+  tcase_add_test(tc_core, test_osrf_digest_md5_fallback);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_digest_suite());
+}
@@ -0,0 +1,248 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include "opensrf/osrf_hash.h"
+
+osrfHash *testOsrfHash;
+int items[100];
+
+//Keep track of how many items have been freed using the callback
+unsigned int freedItemsSize;
+
+//Define a custom freeing function for hash items
+void osrfCustomHashFree(char *key, void *item) {
+  freedItemsSize++;
+}
+
+//Set up the test fixture
+void setup(void) {
+  freedItemsSize = 0;
+  testOsrfHash = osrfNewHash();
+  osrfHashSetCallback(testOsrfHash, osrfCustomHashFree);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfHashFree(testOsrfHash);
+}
+
+//Fill the fixture with keys "key0", "key1"... for the first n items
+static void fill(int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    osrfHashSet(testOsrfHash, &items[i], "key%d", i);
+}
+
+//Check that every key is found, and that iteration yields them in order
+static int check_contents(int n, int skip) {
+  int i;
+  for (i = 0; i < n; i++) {
+    void *item = osrfHashGetFmt(testOsrfHash, "key%d", i);
+    if (i == skip ? item != NULL : item != &items[i])
+      return 0;
+  }
+
+  osrfHashIterator *itr = osrfNewHashIterator(testOsrfHash);
+  void *item;
+  i = 0;
+  while ((item = osrfHashIteratorNext(itr))) {
+    if (i == skip)
+      i++;
+    char key[20];
+    snprintf(key, sizeof(key), "key%d", i);
+    if (item != &items[i] || strcmp(osrfHashIteratorKey(itr), key)) {
+      osrfHashIteratorFree(itr);
+      return 0;
+    }
+    i++;
+  }
+  osrfHashIteratorFree(itr);
+  return i == n || (skip == n - 1 && i == n - 1);
+}
+
+// BEGIN TESTS
+
+START_TEST(test_osrf_hash_small)
+{
+  fill(5);
+  fail_unless(osrfHashGetCount(testOsrfHash) == 5, "osrfHash should hold 5 items");
+  fail_unless(check_contents(5, -1), "A small osrfHash should find its keys in order");
+  fail_unless(osrfHashGet(testOsrfHash, "nonesuch") == NULL,
+      "osrfHashGet should return NULL for a missing key");
+}
+END_TEST
+
+START_TEST(test_osrf_hash_large)
+{
+  //Big enough to build a table, and then to grow it
+  fill(100);
+  fail_unless(osrfHashGetCount(testOsrfHash) == 100, "osrfHash should hold 100 items");
+  fail_unless(check_contents(100, -1), "A large osrfHash should find its keys in order");
+  fail_unless(osrfHashGet(testOsrfHash, "nonesuch") == NULL,
+      "osrfHashGet should return NULL for a missing key");
+}
+END_TEST
+
+START_TEST(test_osrf_hash_churn)
+{
+  //Removing from a table has to leave every other key where a search will find it
+  fill(100);
+  int i;
+  for (i = 0; i < 100; i += 2)
+    osrfHashRemove(testOsrfHash, "key%d", i);
+  fail_unless(osrfHashGetCount(testOsrfHash) == 50, "osrfHash should hold 50 items");
+  for (i = 0; i < 100; i++) {
+    void *item = osrfHashGetFmt(testOsrfHash, "key%d", i);
+    fail_unless(i % 2 ? item == &items[i] : item == NULL,
+        "After removals, key%d should be %s", i, i % 2 ? "found" : "gone");
+  }
+
+  for (i = 0; i < 100; i += 2)
+    osrfHashSet(testOsrfHash, &items[i], "key%d", i);
+  for (i = 0; i < 100; i++)
+    fail_unless(osrfHashGetFmt(testOsrfHash, "key%d", i) == &items[i],
+        "After putting keys back, key%d should be found", i);
+  fail_unless(osrfHashGetCount(testOsrfHash) == 100, "osrfHash should hold 100 items");
+}
+END_TEST
+
+START_TEST(test_osrf_hash_osrfHashSet_replace)
+{
+  fill(20);
+  int other = 0;
+  fail_unless(osrfHashSet(testOsrfHash, &other, "key7") == NULL,
+      "osrfHashSet should free the old item through the callback");
+  fail_unless(freedItemsSize == 1, "osrfHashSet should call the callback once");
+  fail_unless(osrfHashGet(testOsrfHash, "key7") == &other,
+      "osrfHashSet should replace the item in place");
+  fail_unless(osrfHashGetCount(testOsrfHash) == 20, "Replacing should not add an item");
+}
+END_TEST
+
+START_TEST(test_osrf_hash_osrfHashRemove)
+{
+  int n;
+  for (n = 5; n <= 50; n += 45) {
+    osrfHashFree(testOsrfHash);
+    setup();
+    fill(n);
+    fail_unless(osrfHashRemove(testOsrfHash, "key%d", 3) == NULL,
+        "osrfHashRemove should free the item through the callback");
+    fail_unless(freedItemsSize == 1, "osrfHashRemove should call the callback once");
+    fail_unless(osrfHashGetCount(testOsrfHash) == n - 1, "osrfHashRemove should drop an item");
+    fail_unless(check_contents(n, 3), "Removing should leave the other keys in order");
+    fail_unless(osrfHashExtract(testOsrfHash, "key%d", n - 1) == &items[n - 1],
+        "osrfHashExtract should return the item");
+    fail_unless(freedItemsSize == 1, "osrfHashExtract should not call the callback");
+
+    //A removed key may be added again, at the end
+    osrfHashSet(testOsrfHash, &items[3], "key3");
+    fail_unless(osrfHashGet(testOsrfHash, "key3") == &items[3],
+        "A removed key should be found again once re-added");
+  }
+}
+END_TEST
+
+START_TEST(test_osrf_hash_iterator_removal)
+{
+  //Removing the entry at the iterator leaves the iterator usable
+  fill(12);
+  osrfHashIterator *itr = osrfNewHashIterator(testOsrfHash);
+  int count = 0;
+  while (osrfHashIteratorNext(itr)) {
+    osrfHashRemove(testOsrfHash, osrfHashIteratorKey(itr));
+    count++;
+  }
+  osrfHashIteratorFree(itr);
+  fail_unless(count == 12, "The iterator should visit every item");
+  fail_unless(osrfHashGetCount(testOsrfHash) == 0, "Every item should be gone");
+  fail_unless(freedItemsSize == 12, "The callback should run for every item");
+}
+END_TEST
+
+START_TEST(test_osrf_hash_osrfHashFree)
+{
+  fill(30);
+  osrfHashRemove(testOsrfHash, "key0");
+  osrfHashFree(testOsrfHash);
+  fail_unless(freedItemsSize == 30, "osrfHashFree should call the callback for every item");
+  testOsrfHash = NULL;
+}
+END_TEST
+
+START_TEST(test_osrf_hash_osrfHashKeys)
+{
+  fill(10);
+  osrfStringArray *keys = osrfHashKeys(testOsrfHash);
+  fail_unless(keys->size == 10, "osrfHashKeys should return every key");
+  fail_unless(strcmp(osrfStringArrayGetString(keys, 9), "key9") == 0,
+      "osrfHashKeys should return the keys in order");
+  osrfStringArrayFree(keys);
+}
+END_TEST
+
+START_TEST(test_osrf_hash_intern_keys)
+{
+  osrfHashInternKeys(testOsrfHash);
+  char key[16];
+  int i;
+  for (i = 0; i < 20; i++) {
+    snprintf(key, sizeof(key), "field_%d", i);
+    osrfHashSet(testOsrfHash, &items[i], key);
+  }
+  osrfHashSet(testOsrfHash, &items[20], "not-a-name");
+  osrfHashSet(testOsrfHash, &items[21], "2024");
+
+  osrfHashCursor cursor = NULL;
+  const char *first;
+  osrfHashCursorNext(testOsrfHash, &cursor, &first);
+  fail_unless(first == osrf_intern_name("field_0"),
+      "A key that looks like a name should be interned");
+
+  fail_unless(osrfHashGet(testOsrfHash, "field_13") == &items[13],
+      "An interned key should be found by its string");
+  fail_unless(osrfHashGet(testOsrfHash, osrf_intern_name("field_19")) == &items[19],
+      "An interned key should be found by its interned pointer");
+  fail_unless(osrfHashGet(testOsrfHash, "not-a-name") == &items[20]
+      && osrfHashGet(testOsrfHash, "2024") == &items[21],
+      "Keys that aren't names should be copied as usual");
+  fail_unless(osrfHashGet(testOsrfHash, "field_20") == NULL,
+      "A missing key should not be found");
+
+  osrfHashSet(testOsrfHash, &items[99], "field_5");
+  fail_unless(osrfHashGetCount(testOsrfHash) == 22 && freedItemsSize == 1,
+      "Setting an interned key again should replace its item");
+  osrfHashRemove(testOsrfHash, "field_5");
+  fail_unless(osrfHashGet(testOsrfHash, "field_5") == NULL,
+      "An interned key should be removable");
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_hash_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_hash");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_hash_small);
+  tcase_add_test(tc_core, test_osrf_hash_large);
+  tcase_add_test(tc_core, test_osrf_hash_churn);
+  tcase_add_test(tc_core, test_osrf_hash_osrfHashSet_replace);
+  tcase_add_test(tc_core, test_osrf_hash_osrfHashRemove);
+  tcase_add_test(tc_core, test_osrf_hash_iterator_removal);
+  tcase_add_test(tc_core, test_osrf_hash_osrfHashFree);
+  tcase_add_test(tc_core, test_osrf_hash_osrfHashKeys);
+  tcase_add_test(tc_core, test_osrf_hash_intern_keys);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_hash_suite());
+}
@@ -0,0 +1,109 @@
+#include <check.h>
+#include <string.h>
+#include "opensrf/osrf_iochain.h"
+
+osrfIoChain* chain;
+int released;
+
+static void count_release(void* owner) {
+  released += *(int*) owner;
+}
+
+//Set up the test fixture
+void setup(void) {
+  chain = osrfNewIoChain();
+  released = 0;
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfIoChainFree(chain);
+}
+
+//Tests
+
+START_TEST(test_osrf_iochain_slices)
+{
+  static const char body[] = "a body not to be copied";
+  int one = 1;
+
+  fail_unless(osrfIoChainAdd(chain, "<a>", 3) == 0, "osrfIoChainAdd should copy");
+  fail_unless(osrfIoChainAdd(chain, "<b>", 3) == 0, "osrfIoChainAdd should copy");
+  fail_unless(chain->count == 1 && chain->iov[0].iov_len == 6,
+      "Adjacent copies should share a slice");
+
+  fail_unless(osrfIoChainAddRef(chain, body, strlen(body), count_release, &one) == 0,
+      "osrfIoChainAddRef should add a slice");
+  fail_unless(chain->iov[1].iov_base == body, "A referenced slice should not be copied");
+  fail_unless(osrfIoChainAddStatic(chain, "</b>", 4) == 0,
+      "osrfIoChainAddStatic should add a slice");
+  char* p = osrfIoChainAlloc(chain, 4);
+  memcpy(p, "</a>", 4);
+  fail_unless(chain->count == 4, "Each kind of slice should be kept apart");
+  fail_unless(chain->length == 6 + strlen(body) + 8, "The length should add up");
+
+  char* str = osrfIoChainFlatten(chain);
+  fail_unless(strcmp(str, "<a><b>a body not to be copied</b></a>") == 0,
+      "osrfIoChainFlatten should join the slices in order: %s", str);
+  free(str);
+
+  fail_unless(osrfIoChainAdd(NULL, "x", 1) == -1 && osrfIoChainAdd(chain, NULL, 1) == -1,
+      "osrfIoChainAdd should refuse NULLs");
+  fail_unless(osrfIoChainAddRef(NULL, body, 1, count_release, &one) == -1 && released == 1,
+      "A reference that can't be added should be given back at once");
+
+  osrfIoChainReset(chain);
+  fail_unless(released == 2, "osrfIoChainReset should give back references");
+  fail_unless(chain->count == 0 && chain->length == 0, "osrfIoChainReset should empty it");
+}
+END_TEST
+
+START_TEST(test_osrf_iochain_growth)
+{
+  // Many slices, and a copy bigger than a block
+  int i;
+  for (i = 0; i < 100; i++) {
+    osrfIoChainAddStatic(chain, "s", 1);
+    osrfIoChainAdd(chain, "cc", 2);
+  }
+  char big[5000];
+  memset(big, 'x', sizeof(big));
+  fail_unless(osrfIoChainAdd(chain, big, sizeof(big)) == 0, "A big copy should fit");
+  fail_unless(chain->count == 201 && chain->length == 300 + sizeof(big),
+      "Every slice should be kept");
+
+  char* str = osrfIoChainFlatten(chain);
+  fail_unless(strncmp(str, "sccscc", 6) == 0 && str[299] == 'c' && str[300] == 'x'
+      && strlen(str) == chain->length, "The slices should survive growth");
+  free(str);
+
+  // Storage is reused after a reset
+  osrfIoChainReset(chain);
+  osrfIoChainAdd(chain, "again", 5);
+  str = osrfIoChainFlatten(chain);
+  fail_unless(strcmp(str, "again") == 0, "A reset chain should be usable");
+  free(str);
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_iochain_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_iochain");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_iochain_slices);
+  tcase_add_test(tc_core, test_osrf_iochain_growth);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_iochain_suite());
+}
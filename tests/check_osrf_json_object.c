@@ -1,5 +1,8 @@
 #include <check.h>
+#include <limits.h>
 #include "opensrf/osrf_json.h"
+#include "opensrf/utils.h"
+#include "opensrf/osrf_utf8.h"
 
 jsonObject *jsonObj;
 jsonObject *jsonHash;
@@ -348,6 +351,484 @@ START_TEST(test_osrf_json_object_jsonBoolIsTrue)
 }
 END_TEST
 
+START_TEST(test_osrf_json_object_jsonObjectGetInteger)
+{
+  fail_unless(jsonObjectGetInteger(NULL) == 0,
+      "jsonObjectGetInteger should return 0 if passed a NULL object");
+  fail_unless(jsonObjectGetInteger(jsonObj) == 0,
+      "jsonObjectGetInteger should return 0 if passed a non-number");
+  fail_unless(jsonObjectGetInteger(jsonNumber) == 123,
+      "jsonObjectGetInteger should truncate a fraction");
+
+  //Integers too big for a double stay exact
+  jsonObject *id = jsonParse("9007199254740993");
+  fail_unless(jsonObjectGetInteger(id) == 9007199254740993LL,
+      "jsonObjectGetInteger should return big integers exactly");
+  fail_unless(jsonObjectGetNumber(id) == 9007199254740992.0,
+      "jsonObjectGetNumber should round big integers as strtod() does");
+  jsonObject *clone = jsonObjectClone(id);
+  fail_unless(jsonObjectGetInteger(clone) == 9007199254740993LL,
+      "jsonObjectClone should keep the exact value");
+  jsonObjectFree(clone);
+
+  //Changing the number replaces the cached value
+  jsonObjectSetNumberString(id, "-2.75");
+  fail_unless(jsonObjectGetNumber(id) == -2.75,
+      "jsonObjectGetNumber should see the new value");
+  fail_unless(jsonObjectGetInteger(id) == -2,
+      "jsonObjectGetInteger should truncate toward zero");
+  jsonObjectSetNumberString(id, "1e300");
+  fail_unless(jsonObjectGetInteger(id) == LLONG_MAX,
+      "jsonObjectGetInteger should clamp huge numbers");
+  jsonObjectFree(id);
+
+  //Whole numbers are formatted as doubleToString() would
+  double values[] = { 0, -1, 42, 1e15, -9007199254740992.0, 1e20, 0.5, -0.0 };
+  int i;
+  for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    jsonObject *num = jsonNewNumberObject(values[i]);
+    char *expected = doubleToString(values[i]);
+    fail_unless(strcmp(jsonObjectGetString(num), expected) == 0,
+        "jsonNewNumberObject should format numbers as doubleToString() does");
+    fail_unless(jsonObjectGetNumber(num) == values[i],
+        "jsonObjectGetNumber should return the number stored");
+    free(expected);
+    jsonObjectFree(num);
+  }
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_jsonParse_long_strings)
+{
+  //Strings long enough for the vector scanners, starting at every alignment
+  char text[200];
+  char json[300];
+  int offset;
+  for (offset = 0; offset < 40; offset++) {
+    int i;
+    for (i = 0; i < 150; i++)
+      text[i] = 'a' + (i % 26);
+    text[150] = '\0';
+    snprintf(json, sizeof(json), "%*s[\n%*s\"%s\\n\\\"x\\u00e9\"  ,\t\"%.*s\"]",
+        offset, "", offset, "", text, offset, text);
+    jsonObject *parsed = jsonParse(json);
+    fail_if(parsed == NULL, "jsonParse should parse long strings");
+    char expected[300];
+    snprintf(expected, sizeof(expected), "%s\n\"x\xc3\xa9", text);
+    fail_unless(strcmp(jsonObjectGetString(jsonObjectGetIndex(parsed, 0)), expected) == 0,
+        "jsonParse should copy long runs and translate escapes");
+    fail_unless(strncmp(jsonObjectGetString(jsonObjectGetIndex(parsed, 1)), text, offset) == 0
+        && strlen(jsonObjectGetString(jsonObjectGetIndex(parsed, 1))) == offset,
+        "jsonParse should stop at the closing quote");
+    jsonObjectFree(parsed);
+  }
+
+  fail_unless(jsonParse("[\"abcdefghijklmnopqrstuvwxyz0123456789") == NULL,
+      "jsonParse should reject an unterminated string");
+  fail_unless(jsonParse("[\"abcdefghijklmnopqrstuvwxyz0123456789\\") == NULL,
+      "jsonParse should reject a string ending in a backslash");
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_arena)
+{
+  osrfArena *arena = osrfNewArena(0);
+  osrfArena *prev = jsonSetArena(arena);
+  jsonObject *parsed = jsonParse(
+    "{\"a\":[1,2.5,\"three\"],\"b\":{\"__c\":\"cls\",\"__p\":[true,null]}}");
+  jsonSetArena(prev);
+  fail_if(parsed == NULL, "jsonParse should parse into an arena");
+  fail_unless(parsed->arena == arena, "Parsed objects should live in the arena");
+  fail_unless(osrfArenaUsed(arena) > 0, "The arena should have been used");
+
+  //Heap children are adopted by arena parents and freed on reset
+  jsonObject *child = jsonNewObject("heap");
+  fail_unless(child->arena == NULL, "New objects should go on the heap by default");
+  jsonObjectSetKey(parsed, "c", child);
+  jsonObjectPush(jsonObjectGetKey(parsed, "a"), jsonNewNumberObject(4));
+
+  //Extracted children are the caller's again
+  jsonObject *extracted = jsonObjectExtractIndex(jsonObjectGetKey(parsed, "a"), 3);
+  fail_unless(extracted != NULL && extracted->arena == NULL,
+      "jsonObjectExtractIndex should hand back the heap child");
+
+  //Clones always go on the heap
+  jsonObject *clone = jsonObjectClone(parsed);
+  fail_unless(clone->arena == NULL, "jsonObjectClone should copy to the heap");
+
+  //Freeing an arena object is harmless
+  jsonObjectFree(parsed);
+  osrfArenaReset(arena);
+  fail_unless(osrfArenaUsed(arena) == 0, "osrfArenaReset should empty the arena");
+
+  char *json = jsonObjectToJSON(clone);
+  fail_unless(strcmp(json, "{\"a\":[1,2.5,\"three\",null],"
+      "\"b\":{\"__c\":\"cls\",\"__p\":[true,null]},\"c\":\"heap\"}") == 0,
+      "The clone should survive the arena");
+  free(json);
+  fail_unless(jsonObjectGetNumber(extracted) == 4,
+      "The extracted child should survive the arena");
+
+  jsonObjectFree(clone);
+  jsonObjectFree(extracted);
+  osrfArenaFree(arena);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_escape)
+{
+  //Bytes worth mixing: plain text, escapes, controls, lead and continuation bytes
+  static const unsigned char pick[] = { 'a', 'Z', ' ', '~', '"', '\\', '\n', '\t',
+    '\b', 0x01, 0x1f, 0x7f, 0x80, 0xbf, 0xc3, 0xa9, 0xe2, 0x82, 0xac, 0xf0, 0x9f,
+    0x98, 0x80, 0xf8, 0xff };
+  char in[200];
+  char out[200 * 12];
+  int trial;
+  srand(42);
+  for (trial = 0; trial < 2000; trial++) {
+    int len = rand() % 199;
+    int i;
+    for (i = 0; i < len; i++) {
+      if (rand() % 2)
+        in[i] = 'a' + rand() % 26;
+      else
+        in[i] = (char) pick[rand() % sizeof(pick)];
+    }
+    in[len] = '\0';
+
+    growing_buffer *buf = buffer_init(64);
+    buffer_append_utf8(buf, in);
+    size_t n = osrf_utf8_escaped_length(in);
+    char *end = osrf_utf8_escape(out, in);
+    *end = '\0';
+    fail_unless(n == (size_t) buf->n_used && end - out == buf->n_used,
+        "osrf_utf8_escape should match buffer_append_utf8 in length");
+    fail_unless(strcmp(out, buf->buf) == 0,
+        "osrf_utf8_escape should match buffer_append_utf8");
+    buffer_free(buf);
+  }
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_append_utf8)
+{
+  growing_buffer *buf = buffer_init(1);
+  fail_unless(buffer_append_utf8(buf, "caf\xc3\xa9 \"a\\b\"\n\x01 \xf0\x9f\x98\x80") == 0,
+      "buffer_append_utf8 should accept valid UTF-8");
+  ck_assert_str_eq(buf->buf, "caf\\u00e9 \\\"a\\\\b\\\"\\n\\u0001 \\ud83d\\ude00");
+  ck_assert_int_eq(buf->n_used, strlen(buf->buf));
+
+  //Long plain runs are copied whole, up to the first byte needing attention
+  char in[1002];
+  memset(in, 'x', 1000);
+  in[517] = '"';
+  in[1000] = '\xff';
+  in[1001] = '\0';
+  buffer_reset(buf);
+  ck_assert_int_eq(buffer_append_utf8(buf, in), 1000);
+  ck_assert_int_eq(buf->n_used, 1001);
+  fail_unless(buf->buf[516] == 'x' && buf->buf[517] == '\\' && buf->buf[518] == '"'
+      && buf->buf[1000] == 'x', "buffer_append_utf8 should escape within a long run");
+
+  //A truncated character is dropped, and reported where the string ends
+  buffer_reset(buf);
+  ck_assert_int_eq(buffer_append_utf8(buf, "ab\xc3"), 3);
+  ck_assert_str_eq(buf->buf, "ab");
+  buffer_free(buf);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_serialize)
+{
+  jsonObject *tree = jsonParse("{\"id\":12,\"name\":\"caf\xc3\xa9 \\\"quoted\\\"\\n\","
+      "\"tags\":[\"x\",{\"__c\":\"aou\",\"__p\":[1,null,false]}],\"empty\":{},"
+      "\"none\":[],\"long\":\"" "0123456789abcdef0123456789abcdef0123456789" "\"}");
+  fail_if(tree == NULL, "jsonParse should parse the sample");
+
+  char *json = jsonObjectToJSON(tree);
+  fail_unless(strcmp(json, "{\"id\":12,\"name\":\"caf\\u00e9 \\\"quoted\\\"\\n\","
+      "\"tags\":[\"x\",{\"__c\":\"aou\",\"__p\":[1,null,false]}],\"empty\":{},"
+      "\"none\":[],\"long\":\"0123456789abcdef0123456789abcdef0123456789\"}") == 0,
+      "jsonObjectToJSON should expand class names and escape strings");
+  free(json);
+
+  json = jsonObjectToJSONRaw(tree);
+  fail_unless(strcmp(json, "{\"id\":12,\"name\":\"caf\\u00e9 \\\"quoted\\\"\\n\","
+      "\"tags\":[\"x\",[1,null,false]],\"empty\":{},"
+      "\"none\":[],\"long\":\"0123456789abcdef0123456789abcdef0123456789\"}") == 0,
+      "jsonObjectToJSONRaw should leave out class names");
+  free(json);
+
+  //A key that needs escaping
+  jsonObjectSetKey(jsonHash, "a\"b", jsonNewNumberObject(1));
+  json = jsonObjectToJSON(jsonHash);
+  fail_unless(strcmp(json, "{\"a\\\"b\":1}") == 0,
+      "jsonObjectToJSON should escape hash keys");
+  free(json);
+
+  jsonObjectFree(tree);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_class_in_place)
+{
+  const char *json = "{\"a\":{\"__c\":\"aou\",\"__p\":[1,{\"__c\":\"aout\",\"__p\":[2]}]},"
+    "\"b\":[{\"__c\":\"x\"},\"plain\"],\"c\":{\"__c\":\"y\",\"__p\":\"str\"}}";
+  jsonObject *raw = jsonParseRaw(json);
+  jsonObject *copy = jsonObjectDecodeClass(raw);
+  jsonObject *decoded = jsonObjectDecodeClassInPlace(raw);
+  char *s1 = jsonObjectToJSON(copy);
+  char *s2 = jsonObjectToJSON(decoded);
+  fail_unless(strcmp(s1, s2) == 0,
+      "Decoding in place should match jsonObjectDecodeClass: %s", s2);
+  fail_unless(decoded == raw, "A regular hash should be decoded where it is");
+  fail_unless(strcmp(jsonObjectGetClass(jsonObjectGetKeyConst(decoded, "a")), "aou") == 0,
+      "A payload should take the class name");
+  fail_unless(jsonObjectGetIndex(jsonObjectGetKeyConst(decoded, "b"), 0)->type == JSON_NULL,
+      "A class hint without a payload should become a null");
+  free(s1);
+  free(s2);
+  jsonObjectFree(copy);
+
+  jsonObject *encoded = jsonObjectEncodeClassInPlace(decoded);
+  s1 = jsonObjectToJSONRaw(encoded);
+  fail_unless(strcmp(s1, "{\"a\":{\"__c\":\"aou\",\"__p\":[1,{\"__c\":\"aout\",\"__p\":[2]}]},"
+      "\"b\":[null,\"plain\"],\"c\":{\"__c\":\"y\",\"__p\":\"str\"}}") == 0,
+      "Encoding in place should wrap the class names: %s", s1);
+  fail_unless(jsonObjectGetClass(encoded) == NULL, "A wrapper should have no class name");
+  free(s1);
+  jsonObjectFree(encoded);
+
+  // A class hint at the top
+  decoded = jsonObjectDecodeClassInPlace(jsonParseRaw("{\"__c\":\"aou\",\"__p\":[3]}"));
+  fail_unless(decoded->type == JSON_ARRAY && strcmp(jsonObjectGetClass(decoded), "aou") == 0,
+      "A wrapper at the top should become its payload");
+  jsonObjectFree(decoded);
+  fail_unless(jsonObjectDecodeClassInPlace(jsonParseRaw("{\"__c\":\"aou\"}")) == NULL,
+      "A class hint without a payload at the top should yield NULL");
+
+  // Shared parts are copied, not changed
+  jsonObject *shared = jsonObjectShare(jsonParseRaw("{\"__c\":\"aou\",\"__p\":[4]}"));
+  jsonObject *outer = jsonNewObjectType(JSON_ARRAY);
+  jsonObjectPush(outer, jsonObjectClone(shared));
+  outer = jsonObjectDecodeClassInPlace(outer);
+  fail_unless(strcmp(jsonObjectGetClass(jsonObjectGetIndex(outer, 0)), "aou") == 0,
+      "A shared wrapper should be decoded by copying");
+  fail_unless(jsonObjectGetKeyConst(shared, "__p") != NULL, "A shared wrapper should be left alone");
+  jsonObjectFree(outer);
+  jsonObjectFree(shared);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_jsonParse_class_hints)
+{
+  jsonObject *obj = jsonParse("{\"__p\":[1],\"extra\":true,\"__c\":\"aou\"}");
+  fail_unless(obj->type == JSON_ARRAY && strcmp(jsonObjectGetClass(obj), "aou") == 0,
+      "A payload before the class hint should still be found");
+  jsonObjectFree(obj);
+
+  obj = jsonParse("{\"__c\":\"aou\"}");
+  fail_unless(obj->type == JSON_NULL, "A class hint without a payload should be a null");
+  jsonObjectFree(obj);
+
+  obj = jsonParse("{\"__c\":{\"a\":1},\"__p\":2}");
+  fail_unless(obj->type == JSON_HASH && obj->size == 2,
+      "A class hint that isn't a string should be a regular key");
+  jsonObjectFree(obj);
+
+  obj = jsonParse("{\"a_key_long_enough_not_to_fit_in_the_buffer_on_the_stack_of_the_parser\":1}");
+  fail_unless(jsonObjectGetKeyConst(obj,
+      "a_key_long_enough_not_to_fit_in_the_buffer_on_the_stack_of_the_parser") != NULL,
+      "A long key should survive");
+  jsonObjectFree(obj);
+
+  fail_unless(jsonParse("{\"__c\":\"a\",\"__p\":1,\"__p\":2}") == NULL,
+      "A duplicate payload should be rejected");
+  fail_unless(jsonParse("{\"__p\":1,\"__c\":\"a\",\"__p\":2}") == NULL,
+      "A duplicate payload should be rejected either side of the class hint");
+  fail_unless(jsonParse("{\"__c\":\"a\",\"__c\":\"b\"}") == NULL,
+      "A duplicate class hint should be rejected");
+  fail_unless(jsonParse("{\"__c\":\"a\",\"__p\":[1]") == NULL,
+      "An unclosed hash should be rejected");
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_intern)
+{
+  jsonObject *a = jsonParse("{\"__c\":\"aou\",\"__p\":[1,\"BR1\"]}");
+  jsonObject *b = jsonParse("{\"shortname\":\"BR2\",\"id\":2}");
+  jsonObjectSetClass(b, "aou");
+  fail_unless(jsonObjectGetClass(a) == jsonObjectGetClass(b),
+      "Objects of the same class should share the class name");
+
+  jsonObject *clone = jsonObjectClone(b);
+  fail_unless(jsonObjectGetClass(clone) == jsonObjectGetClass(b),
+      "A clone should share the class name");
+  jsonObjectSetClass(clone, "not a name");
+  fail_unless(strcmp(jsonObjectGetClass(clone), "not a name") == 0,
+      "A class name that can't be interned should be copied");
+
+  const char *key_b;
+  const char *key_clone;
+  osrfHashCursor cursor = NULL;
+  osrfHashCursorNext(b->value.h, &cursor, &key_b);
+  cursor = NULL;
+  osrfHashCursorNext(clone->value.h, &cursor, &key_clone);
+  fail_unless(key_b == key_clone && strcmp(key_b, "shortname") == 0,
+      "Hash keys should be interned");
+
+  jsonObjectFree(a);
+  jsonObjectFree(b);
+  jsonObjectFree(clone);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_share)
+{
+  jsonObject *tree = jsonParse("{\"a\":{\"b\":[1,2]},\"c\":\"see\"}");
+  fail_if(jsonObjectIsShared(tree), "A new object should not be shared");
+
+  jsonObject *ref = jsonObjectShare(tree);
+  fail_unless(ref == tree && jsonObjectIsShared(tree),
+      "jsonObjectShare should hand out another reference");
+  jsonObject *clone = jsonObjectClone(tree);
+  fail_unless(clone == tree, "Cloning a shared object should share it");
+
+  //A tree holding a shared part shares that part when cloned
+  jsonObject *outer = jsonNewObjectType(JSON_HASH);
+  jsonObjectSetKey(outer, "tree", jsonObjectShare(tree));
+  jsonObject *outer_clone = jsonObjectClone(outer);
+  fail_unless(outer_clone != outer && jsonObjectGetKey(outer_clone, "tree") == tree,
+      "Cloning should copy what isn't shared and share what is");
+  jsonObjectFree(outer);
+
+  //Nothing may change a shared object in place
+  fail_unless(jsonObjectSetKey(tree, "d", NULL) == (unsigned long) -1,
+      "jsonObjectSetKey should refuse to change a shared object");
+  jsonObjectSetString(jsonObjectGetKey(tree, "c"), "changed");
+  fail_unless(strcmp(jsonObjectGetString(jsonObjectGetKey(tree, "c")), "see") == 0,
+      "The parts of a shared object should be shared too");
+
+  //Making a writable copy copies the top level only
+  jsonObject *mine = jsonObjectMakeWritable(clone);
+  fail_unless(mine != tree && !jsonObjectIsShared(mine) && jsonObjectIsShared(tree),
+      "jsonObjectMakeWritable should copy a shared object");
+  fail_unless(jsonObjectGetKey(mine, "a") == jsonObjectGetKey(tree, "a"),
+      "jsonObjectMakeWritable should share the contents");
+  jsonObjectSetKey(mine, "d", jsonNewObject("dee"));
+
+  jsonObject *b = jsonObjectGetKeyWritable(mine, "a");
+  fail_unless(b != jsonObjectGetKey(tree, "a"),
+      "jsonObjectGetKeyWritable should copy a shared item");
+  jsonObjectPush(jsonObjectGetIndexWritable(b, 0), NULL);
+  jsonObjectPush(jsonObjectGetKeyWritable(b, "b"), jsonNewNumberObject(3));
+
+  char *json = jsonObjectToJSON(mine);
+  fail_unless(strcmp(json, "{\"a\":{\"b\":[1,2,3]},\"c\":\"see\",\"d\":\"dee\"}") == 0,
+      "The writable copy should take the changes: %s", json);
+  free(json);
+  json = jsonObjectToJSON(tree);
+  fail_unless(strcmp(json, "{\"a\":{\"b\":[1,2]},\"c\":\"see\"}") == 0,
+      "The shared original should not change: %s", json);
+  free(json);
+  jsonObjectFree(mine);
+
+  //Once the other holders let go, the last one may change it without a copy
+  jsonObjectFree(outer_clone);
+  jsonObjectFree(ref);
+  fail_unless(jsonObjectIsShared(tree), "The last holder should still be sharing");
+  fail_unless(jsonObjectMakeWritable(tree) == tree && !jsonObjectIsShared(tree),
+      "jsonObjectMakeWritable should not copy what no one else holds");
+  fail_unless(jsonObjectGetKeyWritable(tree, "a") == jsonObjectGetKey(tree, "a"),
+      "jsonObjectGetKeyWritable should not copy what no one else holds");
+  jsonObjectSetKey(tree, "d", NULL);
+  fail_unless(tree->size == 3, "The last holder should be able to change it");
+  jsonObjectFree(tree);
+
+  //Something in an arena can only be copied
+  osrfArena *arena = osrfNewArena(0);
+  osrfArena *prev = jsonSetArena(arena);
+  jsonObject *parsed = jsonParse("[1,2]");
+  jsonSetArena(prev);
+  jsonObject *copy = jsonObjectShare(parsed);
+  fail_unless(copy != parsed && copy->arena == NULL,
+      "jsonObjectShare should copy an object in an arena");
+
+  //...and an arena takes a copy of anything shared attached to it
+  jsonObjectPush(parsed, jsonObjectShare(copy));
+  fail_unless(jsonObjectGetIndex(parsed, 2) != copy,
+      "An arena parent should get a copy of a shared child");
+  fail_unless(jsonObjectMakeWritable(copy) == copy, "The arena should not keep a reference");
+  jsonObjectFree(copy);
+  osrfArenaFree(arena);
+}
+END_TEST
+
+START_TEST(test_osrf_json_object_path)
+{
+  jsonObject *tree = jsonParse("{\"a\":{\"b\":{\"c\":1},\"d\":[2,3]},"
+      "\"list\":[{\"b\":{\"c\":4}},{\"b\":{\"e\":5}},{\"b\":{\"c\":[6,7]}}]}");
+
+  fail_unless(jsonPathCompile("") == NULL, "An empty path should not compile");
+  fail_unless(jsonPathCompile("/") == NULL, "A path without keys should not compile");
+
+  //A plain path
+  jsonPath *path = jsonPathCompile("/a/b/c");
+  fail_if(jsonPathIsMulti(path), "A plain path should not be multi");
+  const jsonObject *found = jsonPathFind(path, tree);
+  fail_unless(found == jsonObjectGetKeyConst(jsonObjectGetKeyConst(
+      jsonObjectGetKeyConst(tree, "a"), "b"), "c"),
+      "jsonPathFind should point into the tree");
+  jsonObject *copy = jsonObjectFindPath(tree, "/a/%s/c", "b");
+  fail_unless(copy != found && jsonObjectGetNumber(copy) == 1,
+      "jsonObjectFindPath should return a copy");
+  jsonObjectFree(copy);
+  jsonPathFree(path);
+
+  path = jsonPathCompile("a//x");
+  fail_unless(jsonPathFind(path, tree) == NULL, "A missing key should not be found");
+  copy = jsonPathEval(path, tree);
+  fail_unless(copy && copy->type == JSON_NULL, "jsonPathEval should give a JSON null");
+  jsonObjectFree(copy);
+  jsonPathFree(path);
+
+  //A search at any depth, with nothing below it
+  path = jsonPathCompile("//b");
+  fail_unless(jsonPathIsMulti(path), "A // path should be multi");
+  osrfList *list = osrfNewList();
+  fail_unless(jsonPathFindAll(path, tree, list) == 4, "Each b should be found");
+  fail_unless((OSRF_LIST_GET_INDEX(list, 0)) == jsonPathFind(path, tree),
+      "jsonPathFind should give the first match");
+  osrfListFree(list);
+  jsonPathFree(path);
+
+  //...and with something below it
+  path = jsonPathCompile("//b/c");
+  list = osrfNewList();
+  fail_unless(jsonPathFindAll(path, tree, list) == 4,
+      "A trailing array should be flattened, and misses left out");
+  fail_unless(jsonObjectGetNumber(OSRF_LIST_GET_INDEX(list, 3)) == 7,
+      "The matches should come in order");
+  osrfListFree(list);
+
+  copy = jsonPathEval(path, tree);
+  char *json = jsonObjectToJSON(copy);
+  fail_unless(strcmp(json, "[1,4,null,6,7]") == 0,
+      "jsonPathEval should keep a null for each miss: %s", json);
+  free(json);
+  jsonObjectFree(copy);
+  jsonPathFree(path);
+
+  copy = jsonObjectFindPath(tree, "//d");
+  json = jsonObjectToJSON(copy);
+  fail_unless(strcmp(json, "[[2,3]]") == 0, "An array found by // should not be flattened");
+  free(json);
+  jsonObjectFree(copy);
+
+  jsonObjectFree(tree);
+}
+END_TEST
+
 //END Tests
 
 
@@ -381,6 +862,17 @@ Suite *osrf_json_object_suite (void) {
   tcase_add_test(tc_core, test_osrf_json_object_jsonObjectSetIndex);
   tcase_add_test(tc_core, test_osrf_json_object_jsonObjectGetIndex);
   tcase_add_test(tc_core, test_osrf_json_object_jsonObjectClone);
+  tcase_add_test(tc_core, test_osrf_json_object_jsonObjectGetInteger);
+  tcase_add_test(tc_core, test_osrf_json_object_jsonParse_long_strings);
+  tcase_add_test(tc_core, test_osrf_json_object_arena);
+  tcase_add_test(tc_core, test_osrf_json_object_escape);
+  tcase_add_test(tc_core, test_osrf_json_object_append_utf8);
+  tcase_add_test(tc_core, test_osrf_json_object_serialize);
+  tcase_add_test(tc_core, test_osrf_json_object_path);
+  tcase_add_test(tc_core, test_osrf_json_object_share);
+  tcase_add_test(tc_core, test_osrf_json_object_intern);
+  tcase_add_test(tc_core, test_osrf_json_object_class_in_place);
+  tcase_add_test(tc_core, test_osrf_json_object_jsonParse_class_hints);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
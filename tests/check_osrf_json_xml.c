@@ -0,0 +1,146 @@
+#include <check.h>
+#include "opensrf/osrf_json.h"
+
+typedef struct {
+  growing_buffer* buf;
+  int calls;
+  int fail_after;
+} sink_data;
+
+static int collect(void* blob, const char* data, size_t len) {
+  sink_data* s = blob;
+  ++s->calls;
+  if (s->fail_after && s->calls >= s->fail_after)
+    return -1;
+  buffer_add_n(s->buf, data, len);
+  return 0;
+}
+
+static jsonObject* parse_in_pieces(const char* xml, size_t chunk) {
+  jsonXMLParser* p = jsonNewXMLParser();
+  size_t len = strlen(xml);
+  size_t i;
+  for (i = 0; i < len; i += chunk)
+    jsonXMLParserPush(p, xml + i, len - i < chunk ? len - i : chunk);
+  jsonObject* obj = jsonXMLParserFinish(p);
+  jsonXMLParserFree(p);
+  return obj;
+}
+
+//Set up the test fixture
+void setup(void) {
+}
+
+//Clean up the test fixture
+void teardown(void) {
+}
+
+//Tests
+
+START_TEST(test_osrf_json_xml_jsonObjectToXML)
+{
+  jsonObject* obj = jsonParse("{\"a\":[1,2.5,\"x<&>y\",true,null],"
+      "\"b\":{\"__c\":\"aou\",\"__p\":[\"\"]}}");
+  char* xml = jsonObjectToXML(obj);
+  fail_unless(strcmp(xml, "<object><element key=\"a\"><array><number>1</number>"
+      "<number>2.500000</number><string>x&lt;&amp;&gt;y</string><boolean value=\"true\"/>"
+      "<null/></array></element><element key=\"b\"><array class_hint=\"aou\">"
+      "<string></string></array></element></object>") == 0,
+      "jsonObjectToXML should write the expected XML: %s", xml);
+  free(xml);
+  jsonObjectFree(obj);
+
+  xml = jsonObjectToXML(NULL);
+  fail_unless(strcmp(xml, "<null/>") == 0, "A NULL object should be <null/>");
+  free(xml);
+}
+END_TEST
+
+START_TEST(test_osrf_json_xml_stream)
+{
+  jsonObject* rows = jsonNewObjectType(JSON_ARRAY);
+  int i;
+  for (i = 0; i < 2000; i++) {
+    jsonObject* row = jsonParse("{\"__c\":\"acp\",\"__p\":[1,\"barcode & more\",null]}");
+    jsonObjectPush(rows, row);
+  }
+
+  sink_data s = { buffer_init(1024), 0, 0 };
+  fail_unless(jsonObjectToXMLStream(rows, collect, &s) == 0,
+      "jsonObjectToXMLStream should succeed");
+  char* whole = jsonObjectToXML(rows);
+  fail_unless(strcmp(OSRF_BUFFER_C_STR(s.buf), whole) == 0,
+      "The streamed XML should be the same as jsonObjectToXML()");
+  fail_unless(s.calls > 1, "A large object should be written in pieces");
+
+  // Round trip, a few bytes at a time
+  jsonObject* back = parse_in_pieces(whole, 7);
+  fail_if(back == NULL, "The XML should parse in pieces");
+  char* s1 = jsonObjectToJSON(rows);
+  char* s2 = jsonObjectToJSON(back);
+  fail_unless(strcmp(s1, s2) == 0, "The XML should survive a round trip");
+  free(s1);
+  free(s2);
+  jsonObjectFree(back);
+
+  // A failing sink stops the output
+  sink_data failing = { buffer_init(1024), 0, 2 };
+  fail_unless(jsonObjectToXMLStream(rows, collect, &failing) == -1,
+      "jsonObjectToXMLStream should report a failing sink");
+  fail_unless(failing.calls == 2, "Nothing should be written after the sink fails");
+
+  buffer_free(failing.buf);
+  buffer_free(s.buf);
+  free(whole);
+  jsonObjectFree(rows);
+}
+END_TEST
+
+START_TEST(test_osrf_json_xml_parser)
+{
+  jsonObject* obj = parse_in_pieces("<object><element key=\"k\"><string>caf&#233; &amp; "
+      "cr&#232;me</string></element><element key=\"e\"><string></string></element>"
+      "<element key=\"n\"><number>42</number></element></object>", 1);
+  fail_if(obj == NULL, "A byte at a time should work");
+  fail_unless(strcmp(jsonObjectGetString(jsonObjectGetKeyConst(obj, "k")),
+      "caf\xc3\xa9 & cr\xc3\xa8me") == 0, "Text split by entities should be joined");
+  fail_unless(strcmp(jsonObjectGetString(jsonObjectGetKeyConst(obj, "e")), "") == 0,
+      "An empty string should survive");
+  fail_unless(jsonObjectGetNumber(jsonObjectGetKeyConst(obj, "n")) == 42,
+      "A number should survive");
+  jsonObjectFree(obj);
+
+  fail_unless(jsonXMLToJSONObject("<array><string>x</array>") == NULL,
+      "Malformed XML should be rejected");
+  fail_unless(jsonXMLToJSONObject("") == NULL, "Empty XML should be rejected");
+
+  jsonXMLParser* p = jsonNewXMLParser();
+  fail_unless(jsonXMLParserPush(p, "<array><nul", 11) == 0,
+      "A partial document should be accepted");
+  fail_unless(jsonXMLParserFinish(p) == NULL, "An unfinished document should be rejected");
+  jsonXMLParserFree(p);
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_json_xml_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_json_xml");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_json_xml_jsonObjectToXML);
+  tcase_add_test(tc_core, test_osrf_json_xml_stream);
+  tcase_add_test(tc_core, test_osrf_json_xml_parser);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_json_xml_suite());
+}
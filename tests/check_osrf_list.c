@@ -389,6 +389,91 @@ START_TEST(test_osrf_list_osrfListSetDefaultFree)
 }
 END_TEST
 
+START_TEST(test_osrf_list_inline_slots)
+{
+  osrfList *smallList = osrfNewListSize(2);
+  fail_unless(smallList->arrlist == smallList->inline_slots,
+      "A small list should use its inline slots");
+  fail_unless(smallList->arrsize == OSRF_LIST_INLINE_SIZE,
+      "A small list should have OSRF_LIST_INLINE_SIZE slots");
+
+  int i;
+  for (i = 0; i < OSRF_LIST_INLINE_SIZE; i++)
+    osrfListPush(smallList, &globalItem1);
+  fail_unless(smallList->arrlist == smallList->inline_slots,
+      "A full small list should still use its inline slots");
+
+  osrfListPush(smallList, &globalItem3);
+  fail_unless(smallList->arrlist != smallList->inline_slots,
+      "An overfull small list should move to the heap");
+  fail_unless(smallList->arrsize == 48,
+      "A list leaving its inline slots should grow to the default size");
+  fail_unless(osrfListGetIndex(smallList, 0) == &globalItem1 &&
+      osrfListGetIndex(smallList, OSRF_LIST_INLINE_SIZE) == &globalItem3,
+      "A list leaving its inline slots should keep its contents");
+
+  //Swapping must not leave either list pointing into the other
+  osrfList *other = osrfNewListSize(1);
+  osrfListPush(other, &globalItem3);
+  osrfListSwap(smallList, other);
+  fail_unless(smallList->arrlist == smallList->inline_slots &&
+      osrfListGetIndex(smallList, 0) == &globalItem3,
+      "A swapped list should use its own inline slots");
+  fail_unless(osrfListGetCount(other) == OSRF_LIST_INLINE_SIZE + 1,
+      "A swapped list should take the other's heap array");
+  osrfListSwap(smallList, smallList);
+  fail_unless(smallList->arrlist == smallList->inline_slots,
+      "Swapping a list with itself should change nothing");
+
+  osrfListFree(other);
+  osrfListFree(smallList);
+}
+END_TEST
+
+START_TEST(test_osrf_list_osrfListReserve)
+{
+  fail_unless(osrfListReserve(NULL, 10) == -1,
+      "osrfListReserve should return -1 when not given a list");
+  fail_unless(osrfListReserve(testOsrfList, 5) == 0 && testOsrfList->arrsize == 10,
+      "osrfListReserve should not shrink a list");
+  fail_unless(osrfListReserve(testOsrfList, 300) == 0 && testOsrfList->arrsize == 300,
+      "osrfListReserve should grow a list to the size given");
+  fail_unless(osrfListGetIndex(testOsrfList, 2) == &globalItem3 &&
+      testOsrfList->size == 3 && osrfListGetIndex(testOsrfList, 299) == NULL,
+      "osrfListReserve should keep the contents of a list");
+}
+END_TEST
+
+START_TEST(test_osrf_list_osrfListPushMany)
+{
+  void* items[] = { &globalItem1, &globalItem3, &globalItem1 };
+  fail_unless(osrfListPushMany(NULL, items, 3) == -1,
+      "osrfListPushMany should return -1 when not given a list");
+  fail_unless(osrfListPushMany(testOsrfList, NULL, 1) == -1,
+      "osrfListPushMany should return -1 when not given items");
+  fail_unless(osrfListPushMany(testOsrfList, NULL, 0) == 0 && testOsrfList->size == 3,
+      "osrfListPushMany should accept an empty series");
+
+  osrfList *smallList = osrfNewListSize(1);
+  fail_unless(osrfListPushMany(smallList, items, 3) == 0 &&
+      smallList->arrlist == smallList->inline_slots && smallList->size == 3,
+      "osrfListPushMany should fill the inline slots");
+  fail_unless(osrfListPushMany(smallList, items, 3) == 0 &&
+      smallList->arrsize == 6 && smallList->size == 6,
+      "osrfListPushMany should grow a list just enough");
+  fail_unless(osrfListGetIndex(smallList, 4) == &globalItem3,
+      "osrfListPushMany should append the items in order");
+
+  //A cleared list keeps its array for reuse
+  void** arrlist = smallList->arrlist;
+  osrfListClear(smallList);
+  osrfListPushMany(smallList, items, 3);
+  fail_unless(smallList->arrlist == arrlist && smallList->size == 3,
+      "A cleared list should be refilled in place");
+  osrfListFree(smallList);
+}
+END_TEST
+
 //END TESTS
 
 Suite *osrf_list_suite(void) {
@@ -417,6 +502,9 @@ Suite *osrf_list_suite(void) {
   tcase_add_test(tc_core, test_osrf_list_osrfListIteratorFree);
   tcase_add_test(tc_core, test_osrf_list_osrfListIteratorReset);
   tcase_add_test(tc_core, test_osrf_list_osrfListSetDefaultFree);
+  tcase_add_test(tc_core, test_osrf_list_inline_slots);
+  tcase_add_test(tc_core, test_osrf_list_osrfListReserve);
+  tcase_add_test(tc_core, test_osrf_list_osrfListPushMany);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
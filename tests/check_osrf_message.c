@@ -83,6 +83,171 @@ START_TEST(test_osrf_message_set_params)
 }
 END_TEST
 
+START_TEST(test_osrf_message_add_result_prefix)
+{
+  jsonObject* content = jsonParse("{\"a\":[1,\"<&>\\\"\",null],\"b\":{\"__c\":\"x\",\"__p\":[2]}}");
+  osrfMessage* msg = osrf_message_init(RESULT, 7, 1);
+  osrf_message_set_status_info(msg, NULL, "OK", OSRF_STATUS_OK);
+  osrf_message_set_locale(msg, "en-CA");
+  osrf_message_set_tz(msg, "America/Toronto");
+  osrf_message_set_result(msg, content);
+
+  jsonObject* whole = osrfMessageToJSON(msg);
+  char* expected = jsonObjectToJSON(whole);
+  jsonObjectFree(whole);
+
+  growing_buffer* buf = buffer_init(64);
+  osrfMessageAddResultPrefix(buf, msg);
+  char* content_json = jsonObjectToJSON(content);
+  buffer_add(buf, content_json);
+  buffer_add(buf, OSRF_RESULT_JSON_SUFFIX);
+
+  fail_unless(strcmp(OSRF_BUFFER_C_STR(buf), expected) == 0,
+      "osrfMessageAddResultPrefix should write the same JSON as osrfMessageToJSON");
+
+  free(content_json);
+  free(expected);
+  buffer_free(buf);
+  osrfMessageFree(msg);
+  jsonObjectFree(content);
+}
+END_TEST
+
+START_TEST(test_osrf_message_window)
+{
+  osrfMessage* msg = osrf_message_init(STATUS, 3, 1);
+  osrf_message_set_status_info(msg, "osrfFlowCredit", "Credit", OSRF_STATUS_CREDIT);
+  msg->window = 8;
+  char* json = osrfMessageSerializeBatch(&msg, 1);
+
+  osrfMessage* arr[2];
+  fail_unless(osrf_message_deserialize(json, arr, 2) == 1,
+      "osrf_message_deserialize should find one message");
+  fail_unless(arr[0]->window == 8,
+      "osrf_message_deserialize should restore the flow control window");
+  fail_unless(arr[0]->status_code == OSRF_STATUS_CREDIT,
+      "osrf_message_deserialize should restore the status code");
+  osrfMessageFree(arr[0]);
+  free(json);
+
+  msg->window = 0;
+  json = osrfMessageSerializeBatch(&msg, 1);
+  fail_unless(strstr(json, "window") == NULL,
+      "osrfMessageToJSON should leave out a zero window");
+  fail_unless(osrf_message_deserialize(json, arr, 2) == 1 && arr[0]->window == 0,
+      "osrf_message_deserialize should default the window to zero");
+  osrfMessageFree(arr[0]);
+  free(json);
+  osrfMessageFree(msg);
+}
+END_TEST
+
+START_TEST(test_osrf_message_deadline)
+{
+  osrfMessage* msg = osrf_message_init(REQUEST, 4, 1);
+  osrf_message_set_method(msg, "opensrf.system.echo");
+  char* json = osrfMessageSerializeBatch(&msg, 1);
+  fail_unless(strstr(json, "deadline") == NULL,
+      "osrfMessageToJSON should leave out a missing deadline");
+  osrfMessage* arr[2];
+  fail_unless(osrf_message_deserialize(json, arr, 2) == 1
+      && osrfMessageTimeLeft(arr[0]) == -1,
+      "osrf_message_deserialize should default to no deadline");
+  osrfMessageFree(arr[0]);
+  free(json);
+
+  msg->deadline = get_monotonic_millis() + 5000;
+  json = osrfMessageSerializeBatch(&msg, 1);
+  fail_unless(osrf_message_deserialize(json, arr, 2) == 1,
+      "osrf_message_deserialize should find one message");
+  long long left = osrfMessageTimeLeft(arr[0]);
+  fail_unless(left > 4000 && left <= 5000,
+      "osrf_message_deserialize should count the time left down from now");
+  osrfMessageFree(arr[0]);
+  free(json);
+
+  msg->deadline = get_monotonic_millis() - 100;
+  json = osrfMessageSerializeBatch(&msg, 1);
+  fail_unless(strstr(json, "\"deadline\":0") != NULL,
+      "osrfMessageToJSON should send a passed deadline as no time left");
+  fail_unless(osrf_message_deserialize(json, arr, 2) == 1
+      && arr[0]->deadline > 0 && osrfMessageTimeLeft(arr[0]) == 0,
+      "osrf_message_deserialize should keep a passed deadline");
+  osrfMessageFree(arr[0]);
+  free(json);
+  osrfMessageFree(msg);
+}
+END_TEST
+
+START_TEST(test_osrf_message_deserialize_lazy)
+{
+  osrfMessage* req = osrf_message_init(REQUEST, 3, 1);
+  osrf_message_set_method(req, "opensrf.system.echo");
+  jsonObject* params = jsonParse("[\"a\",{\"__c\":\"aou\",\"__p\":[1,2]},[3]]");
+  osrf_message_set_params(req, params);
+  osrfMessage* res = osrf_message_init(RESULT, 3, 1);
+  osrf_message_set_status_info(res, "osrfResult", "OK", OSRF_STATUS_OK);
+  osrf_message_set_result_content(res, "{\"content\":[\"params\"],\"n\":-1.5e3}");
+  osrfMessage* batch[2] = { req, res };
+  char* json = osrfMessageSerializeBatch(batch, 2);
+
+  osrfMessage* arr[3];
+  fail_unless(osrf_message_deserialize_lazy(json, arr, 3) == 2,
+      "osrf_message_deserialize_lazy should find two messages");
+  fail_unless(arr[0]->m_type == REQUEST && arr[0]->thread_trace == 3
+      && !strcmp(arr[0]->method_name, "opensrf.system.echo"),
+      "osrf_message_deserialize_lazy should parse the envelope");
+  fail_unless(arr[0]->_params == NULL && arr[0]->_raw_params != NULL,
+      "osrf_message_deserialize_lazy should leave the params unparsed");
+  fail_unless(arr[1]->status_code == OSRF_STATUS_OK && arr[1]->_result_content == NULL,
+      "osrf_message_deserialize_lazy should leave the content unparsed");
+
+  //Unparsed payloads pass straight through
+  char* again = osrfMessageSerializeBatch(arr, 2);
+  fail_unless(strcmp(json, again) == 0,
+      "A lazy message should serialize as it arrived");
+  free(again);
+
+  //Parsed on demand, they match what eager deserialization makes of them
+  osrfMessage* eager[3];
+  fail_unless(osrf_message_deserialize(json, eager, 3) == 2);
+  char* a = jsonObjectToJSON(osrfMessageGetParams(arr[0]));
+  char* b = jsonObjectToJSON(eager[0]->_params);
+  fail_unless(strcmp(a, b) == 0, "osrfMessageGetParams should parse the params");
+  free(a);
+  free(b);
+  a = jsonObjectToJSON(osrfMessageGetResult(arr[1]));
+  b = jsonObjectToJSON(eager[1]->_result_content);
+  fail_unless(strcmp(a, b) == 0, "osrfMessageGetResult should parse the content");
+  free(a);
+  free(b);
+  fail_unless(arr[0]->_raw_params == NULL && arr[1]->_raw_content == NULL,
+      "The JSON text should go once parsed");
+  again = osrfMessageSerializeBatch(arr, 2);
+  fail_unless(strcmp(json, again) == 0,
+      "A parsed lazy message should serialize as before");
+  free(again);
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    osrfMessageFree(arr[i]);
+    osrfMessageFree(eager[i]);
+  }
+
+  //The osrfList flavor, and something it can't make sense of
+  osrfList* list = osrfMessageDeserializeLazy(json, NULL);
+  fail_unless(list->size == 2, "osrfMessageDeserializeLazy should find two messages");
+  fail_unless(osrfMessageDeserializeLazy("[{\"bad\"", list)->size == 0,
+      "osrfMessageDeserializeLazy should reject bad JSON");
+  osrfListFree(list);
+
+  free(json);
+  jsonObjectFree(params);
+  osrfMessageFree(req);
+  osrfMessageFree(res);
+}
+END_TEST
+
 //END Tests
 
 Suite *osrf_message_suite(void) {
@@ -98,6 +263,10 @@ Suite *osrf_message_suite(void) {
   tcase_add_test(tc_core, test_osrf_message_set_default_locale);
   tcase_add_test(tc_core, test_osrf_message_set_method);
   tcase_add_test(tc_core, test_osrf_message_set_params);
+  tcase_add_test(tc_core, test_osrf_message_add_result_prefix);
+  tcase_add_test(tc_core, test_osrf_message_window);
+  tcase_add_test(tc_core, test_osrf_message_deadline);
+  tcase_add_test(tc_core, test_osrf_message_deserialize_lazy);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
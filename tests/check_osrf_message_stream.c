@@ -0,0 +1,218 @@
+#include <check.h>
+#include "opensrf/osrf_json.h"
+#include "opensrf/osrf_message.h"
+#include "opensrf/osrf_message_stream.h"
+
+#define MAX_SEEN 10
+
+typedef struct {
+  int rows;
+  int row_index[MAX_SEEN];
+  jsonObject* row[MAX_SEEN];
+  int messages;
+  int msg_index[MAX_SEEN];
+  osrfMessage* msg[MAX_SEEN];
+} seen_t;
+
+seen_t seen;
+char* batch;
+
+static void on_row(void* blob, int index, jsonObject* row) {
+  seen_t* s = blob;
+  if (s->rows < MAX_SEEN) {
+    s->row_index[s->rows] = index;
+    s->row[s->rows++] = row;
+  } else
+    jsonObjectFree(row);
+}
+
+static void on_message(void* blob, int index, osrfMessage* msg) {
+  seen_t* s = blob;
+  if (s->messages < MAX_SEEN) {
+    s->msg_index[s->messages] = index;
+    s->msg[s->messages++] = msg;
+  } else
+    osrfMessageFree(msg);
+}
+
+static void clear_seen(void) {
+  int i;
+  for (i = 0; i < seen.rows; i++)
+    jsonObjectFree(seen.row[i]);
+  for (i = 0; i < seen.messages; i++)
+    osrfMessageFree(seen.msg[i]);
+  memset(&seen, 0, sizeof(seen));
+}
+
+static int push_in_chunks(osrfMessageStream* stream, const char* json, size_t chunk) {
+  size_t len = strlen(json);
+  size_t i;
+  for (i = 0; i < len; i += chunk) {
+    size_t n = len - i < chunk ? len - i : chunk;
+    if (osrfMessageStreamPush(stream, json + i, n))
+      return -1;
+  }
+  return osrfMessageStreamFinish(stream);
+}
+
+//Set up the test fixture
+void setup(void) {
+  memset(&seen, 0, sizeof(seen));
+
+  osrfMessage* msgs[3];
+  msgs[0] = osrf_message_init(REQUEST, 1, 1);
+  osrf_message_set_method(msgs[0], "open-ils.test.echo");
+  osrf_message_add_param(msgs[0], "\"caf\\u00e9 \\\"quoted\\\"\"");
+
+  msgs[1] = osrf_message_init(RESULT, 1, 1);
+  osrf_message_set_status_info(msgs[1], "osrfResult", "OK", OSRF_STATUS_OK);
+  jsonObject* content = jsonParse(
+    "[{\"__c\":\"acp\",\"__p\":[1,\"abc\",null]},\"caf\xc3\xa9\",[true,{\"a\":2}]]");
+  osrf_message_set_result(msgs[1], content);
+  jsonObjectFree(content);
+
+  msgs[2] = osrf_message_init(STATUS, 1, 1);
+  osrf_message_set_status_info(msgs[2], "osrfConnectStatus", "Request Complete",
+      OSRF_STATUS_COMPLETE);
+
+  batch = osrfMessageSerializeBatch(msgs, 3);
+  int i;
+  for (i = 0; i < 3; i++)
+    osrfMessageFree(msgs[i]);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  clear_seen();
+  free(batch);
+}
+
+//Tests
+
+START_TEST(test_osrf_message_stream_rows)
+{
+  osrfMessageStream* stream = osrfNewMessageStream(on_row, on_message, &seen);
+  fail_unless(push_in_chunks(stream, batch, 7) == 0,
+      "osrfMessageStreamPush should accept a valid batch in pieces");
+
+  fail_unless(seen.rows == 3, "Each element of the content should be a row");
+  fail_unless(seen.row_index[0] == 1 && seen.row_index[2] == 1,
+      "Rows should carry the index of their message");
+  fail_unless(strcmp(jsonObjectGetClass(seen.row[0]), "acp") == 0,
+      "A classed row should be decoded");
+  fail_unless(strcmp(jsonObjectGetString(jsonObjectGetIndex(seen.row[0], 1)), "abc") == 0,
+      "A classed row should keep its payload");
+  fail_unless(strcmp(jsonObjectGetString(seen.row[1]), "caf\xc3\xa9") == 0,
+      "UTF-8 in a row should survive");
+  char* s = jsonObjectToJSON(seen.row[2]);
+  fail_unless(strcmp(s, "[true,{\"a\":2}]") == 0, "A nested row should be intact");
+  free(s);
+
+  fail_unless(seen.messages == 3, "Each message should be handed out");
+  fail_unless(seen.msg_index[0] == 0 && seen.msg_index[2] == 2,
+      "Messages should carry their index");
+
+  osrfMessage* req = seen.msg[0];
+  fail_unless(req->m_type == REQUEST, "The first message should be a REQUEST");
+  fail_unless(strcmp(req->method_name, "open-ils.test.echo") == 0,
+      "The method name should survive");
+  const jsonObject* param = jsonObjectGetIndex(osrfMessageGetParams(req), 0);
+  fail_unless(strcmp(jsonObjectGetString(param), "caf\xc3\xa9 \"quoted\"") == 0,
+      "Escaped strings should be decoded");
+
+  osrfMessage* res = seen.msg[1];
+  fail_unless(res->m_type == RESULT, "The second message should be a RESULT");
+  fail_unless(res->status_code == OSRF_STATUS_OK, "The status code should survive");
+  const jsonObject* content = osrfMessageGetResult(res);
+  fail_unless(content && content->type == JSON_ARRAY && content->size == 0,
+      "Streamed content should be left empty");
+
+  osrfMessage* status = seen.msg[2];
+  fail_unless(status->m_type == STATUS && status->status_code == OSRF_STATUS_COMPLETE,
+      "The status should survive");
+  fail_unless(strcmp(status->status_text, "Request Complete") == 0,
+      "The status text should survive");
+
+  osrfMessageStreamFree(stream);
+}
+END_TEST
+
+START_TEST(test_osrf_message_stream_no_rows)
+{
+  osrfMessageStream* stream = osrfNewMessageStream(NULL, on_message, &seen);
+  fail_unless(push_in_chunks(stream, batch, 1) == 0,
+      "osrfMessageStreamPush should accept a batch a byte at a time");
+  fail_unless(seen.rows == 0, "Without a row handler there should be no rows");
+  fail_unless(seen.messages == 3, "Each message should be handed out");
+
+  const jsonObject* content = osrfMessageGetResult(seen.msg[1]);
+  fail_unless(content && content->size == 3, "The content should stay in the message");
+  fail_unless(strcmp(jsonObjectGetClass(jsonObjectGetIndex(content, 0)), "acp") == 0,
+      "Content should be decoded");
+
+  osrfMessageStreamFree(stream);
+}
+END_TEST
+
+START_TEST(test_osrf_message_stream_error_and_reset)
+{
+  osrfMessageStream* stream = osrfNewMessageStream(on_row, on_message, &seen);
+  fail_unless(osrfMessageStreamPush(stream, "[{\"__c\":}", 9) == -1,
+      "osrfMessageStreamPush should reject invalid JSON");
+  fail_unless(osrfMessageStreamPush(stream, "]", 1) == -1,
+      "osrfMessageStreamPush should reject everything after an error");
+  fail_unless(osrfMessageStreamFinish(stream) == -1,
+      "osrfMessageStreamFinish should report an earlier error");
+
+  osrfMessageStreamReset(stream);
+  fail_unless(osrfMessageStreamPush(stream, "[{\"__c\":\"osrfMessage\"", 21) == 0,
+      "osrfMessageStreamPush should accept a partial message");
+  osrfMessageStreamReset(stream);
+  fail_unless(seen.messages == 0, "Reset should discard a partial message");
+
+  fail_unless(push_in_chunks(stream, batch, 64) == 0,
+      "A reset stream should accept a new batch");
+  fail_unless(seen.messages == 3 && seen.msg_index[0] == 0,
+      "Reset should start the index over");
+  fail_unless(seen.rows == 3, "A reset stream should hand out rows");
+
+  osrfMessageStreamFree(stream);
+}
+END_TEST
+
+START_TEST(test_osrf_message_stream_incomplete)
+{
+  osrfMessageStream* stream = osrfNewMessageStream(on_row, on_message, &seen);
+  size_t len = strlen(batch);
+  fail_unless(osrfMessageStreamPush(stream, batch, len - 1) == 0,
+      "osrfMessageStreamPush should accept all but the last bracket");
+  fail_unless(seen.messages == 3, "Complete messages should already be handed out");
+  fail_unless(osrfMessageStreamFinish(stream) == -1,
+      "osrfMessageStreamFinish should reject an unclosed array");
+  osrfMessageStreamFree(stream);
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_message_stream_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_message_stream");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_message_stream_rows);
+  tcase_add_test(tc_core, test_osrf_message_stream_no_rows);
+  tcase_add_test(tc_core, test_osrf_message_stream_error_and_reset);
+  tcase_add_test(tc_core, test_osrf_message_stream_incomplete);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_message_stream_suite());
+}
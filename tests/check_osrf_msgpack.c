@@ -0,0 +1,249 @@
+#include <check.h>
+#include "opensrf/osrf_json.h"
+#include "opensrf/osrf_msgpack.h"
+#include "opensrf/osrf_message.h"
+
+//Set up the test fixture
+void setup(void) {
+}
+
+//Clean up the test fixture
+void teardown(void) {
+}
+
+//Tests
+
+START_TEST(test_osrf_msgpack_scalars)
+{
+  size_t len;
+  jsonObject* obj = jsonNewNumberStringObject("5");
+  char* data = jsonObjectToMsgpack(obj, &len);
+  fail_unless(len == 1 && data[0] == 5, "A small integer should be a positive fixint");
+  free(data);
+  jsonObjectFree(obj);
+
+  obj = jsonNewNumberStringObject("-1");
+  data = jsonObjectToMsgpack(obj, &len);
+  fail_unless(len == 1 && (unsigned char) data[0] == 0xFF,
+      "-1 should be a negative fixint");
+  free(data);
+  jsonObjectFree(obj);
+
+  obj = jsonNewNumberStringObject("70000");
+  data = jsonObjectToMsgpack(obj, &len);
+  fail_unless(len == 5 && (unsigned char) data[0] == 0xCE,
+      "70000 should be a uint 32");
+  free(data);
+  jsonObjectFree(obj);
+
+  obj = jsonNewObject("abc");
+  data = jsonObjectToMsgpack(obj, &len);
+  fail_unless(len == 4 && (unsigned char) data[0] == 0xA3 && !memcmp(data + 1, "abc", 3),
+      "A short string should be a fixstr");
+  free(data);
+  jsonObjectFree(obj);
+
+  fail_unless(jsonObjectToMsgpack(NULL, &len) == NULL,
+      "jsonObjectToMsgpack should return NULL for a NULL object");
+}
+END_TEST
+
+START_TEST(test_osrf_msgpack_round_trip)
+{
+  const char* json = "{\"id\":123,\"neg\":-9000000000,\"big\":18446744073709551615,"
+    "\"price\":12.5,\"ok\":true,\"no\":false,\"none\":null,"
+    "\"name\":\"caf\xc3\xa9 \\\"quoted\\\"\",\"empty\":\"\",\"list\":[1,[],{}],"
+    "\"obj\":{\"__c\":\"acp\",\"__p\":[1,\"barcode\",null]}}";
+  jsonObject* obj = jsonParse(json);
+  size_t len;
+  char* data = jsonObjectToMsgpack(obj, &len);
+  fail_unless(len < strlen(json), "MessagePack should be smaller than the JSON");
+
+  jsonObject* back = jsonMsgpackToObject(data, len);
+  fail_if(back == NULL, "jsonMsgpackToObject should read what jsonObjectToMsgpack wrote");
+
+  char* s1 = jsonObjectToJSON(obj);
+  char* s2 = jsonObjectToJSON(back);
+  fail_unless(strcmp(s1, s2) == 0, "A round trip should preserve the JSON: %s", s2);
+  fail_unless(strcmp(jsonObjectGetClass(jsonObjectGetKeyConst(back, "obj")), "acp") == 0,
+      "A round trip should decode class names");
+  fail_unless(jsonObjectGetKeyConst(back, "id")->type == JSON_NUMBER,
+      "Integers should come back as numbers");
+
+  free(s1);
+  free(s2);
+  jsonObjectFree(back);
+
+  // Truncated or padded MessagePack is invalid
+  fail_unless(jsonMsgpackToObject(data, len - 1) == NULL,
+      "jsonMsgpackToObject should reject truncated MessagePack");
+  char* longer = malloc(len + 1);
+  memcpy(longer, data, len);
+  longer[len] = (char) 0xC0;
+  fail_unless(jsonMsgpackToObject(longer, len + 1) == NULL,
+      "jsonMsgpackToObject should reject trailing bytes");
+  free(longer);
+
+  free(data);
+  jsonObjectFree(obj);
+
+  // A count that can't fit in what's left is rejected before anything is allocated
+  const char huge_array[] = { (char) 0xDD, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF };
+  fail_unless(jsonMsgpackToObject(huge_array, sizeof(huge_array)) == NULL,
+      "jsonMsgpackToObject should reject an impossible count");
+  const char ext[] = { (char) 0xD4, 1, 2 };
+  fail_unless(jsonMsgpackToObject(ext, sizeof(ext)) == NULL,
+      "jsonMsgpackToObject should reject extension types");
+}
+END_TEST
+
+START_TEST(test_osrf_msgpack_text)
+{
+  int n;
+  for (n = 0; n < 5; n++) {
+    // Strings of several lengths, to exercise each kind of base64 padding
+    char str[8] = "abcdefg";
+    str[n] = '\0';
+    jsonObject* obj = jsonNewObject(str);
+    char* text = jsonObjectToMsgpackText(obj);
+    fail_unless(jsonIsMsgpackText(text), "The text form should begin with the prefix");
+    fail_unless(strlen(text + strlen(OSRF_MSGPACK_PREFIX)) % 4 == 0,
+        "The base64 should come in whole groups");
+    jsonObject* back = jsonMsgpackTextToObject(text);
+    fail_unless(back && strcmp(jsonObjectGetString(back), str) == 0,
+        "The text form should survive a round trip");
+    jsonObjectFree(back);
+    free(text);
+    jsonObjectFree(obj);
+  }
+
+  fail_if(jsonIsMsgpackText("[1,2]"), "JSON should not look like MessagePack");
+  fail_unless(jsonMsgpackTextToObject("msgpack:kA=") == NULL,
+      "jsonMsgpackTextToObject should reject a partial group");
+  fail_unless(jsonMsgpackTextToObject("msgpack:k*==") == NULL,
+      "jsonMsgpackTextToObject should reject invalid base64");
+  jsonObject* empty = jsonMsgpackTextToObject("msgpack:kA==");
+  fail_unless(empty && empty->type == JSON_ARRAY && empty->size == 0,
+      "msgpack:kA== should be an empty array");
+  jsonObjectFree(empty);
+}
+END_TEST
+
+START_TEST(test_osrf_msgpack_messages)
+{
+  osrfMessage* msgs[2];
+  msgs[0] = osrf_message_init(RESULT, 4, 1);
+  osrf_message_set_status_info(msgs[0], "osrfResult", "OK", OSRF_STATUS_OK);
+  osrf_message_set_result_content(msgs[0], "[{\"__c\":\"acp\",\"__p\":[1,\"abc\"]}]");
+  msgs[1] = osrf_message_init(STATUS, 4, 1);
+  osrf_message_set_status_info(msgs[1], "osrfConnectStatus", "Connection Successful",
+      OSRF_STATUS_OK);
+  msgs[1]->encoding = OSRF_ENCODING_MSGPACK;
+
+  char* json = osrfMessageSerializeBatchEncoded(msgs, 2, OSRF_ENCODING_JSON);
+  char* plain = osrfMessageSerializeBatch(msgs, 2);
+  fail_unless(strcmp(json, plain) == 0,
+      "The JSON encoding should be the same as osrfMessageSerializeBatch()");
+  free(plain);
+
+  char* body = osrfMessageSerializeBatchEncoded(msgs, 2, OSRF_ENCODING_MSGPACK);
+  fail_unless(jsonIsMsgpackText(body), "The body should be MessagePack");
+
+  osrfMessage* out[4];
+  int lazy;
+  for (lazy = 0; lazy < 2; lazy++) {
+    int count = lazy ? osrf_message_deserialize_lazy(body, out, 4)
+      : osrf_message_deserialize(body, out, 4);
+    fail_unless(count == 2, "Both messages should be read back");
+    fail_unless(out[0]->m_type == RESULT && out[0]->thread_trace == 4,
+        "The RESULT should survive");
+    const jsonObject* content = osrfMessageGetResult(out[0]);
+    fail_unless(strcmp(jsonObjectGetClass(jsonObjectGetIndex(content, 0)), "acp") == 0,
+        "The content should be decoded");
+    fail_unless(out[1]->encoding == OSRF_ENCODING_MSGPACK,
+        "The encoding of a message should survive");
+    fail_unless(strcmp(out[1]->status_text, "Connection Successful") == 0,
+        "The STATUS should survive");
+    osrfMessageFree(out[0]);
+    osrfMessageFree(out[1]);
+  }
+
+  osrfList* list = osrfMessageDeserialize(body, NULL);
+  fail_unless(list->size == 2, "osrfMessageDeserialize should read MessagePack too");
+  osrfListFree(list);
+
+  osrfList* from_json = osrfMessageDeserialize(json, NULL);
+  osrfMessage* ack = OSRF_LIST_GET_INDEX(from_json, 1);
+  fail_unless(ack->encoding == OSRF_ENCODING_MSGPACK,
+      "The encoding should travel in JSON as well");
+  osrfListFree(from_json);
+
+  free(json);
+  free(body);
+  osrfMessageFree(msgs[0]);
+  osrfMessageFree(msgs[1]);
+}
+END_TEST
+
+//END TESTS
+
+START_TEST(test_osrf_msgpack_fragments)
+{
+  const char* content_json = "[{\"__c\":\"acp\",\"__p\":[1,\"abc\"]}]";
+  osrfMessage* msgs[2];
+  msgs[0] = osrf_message_init(RESULT, 4, 1);
+  osrf_message_set_status_info(msgs[0], "osrfResult", "OK", OSRF_STATUS_OK);
+  osrf_message_set_result_content(msgs[0], content_json);
+  msgs[1] = osrf_message_init(STATUS, 4, 1);
+  osrf_message_set_status_info(msgs[1], "osrfConnectStatus", "Request Complete",
+      OSRF_STATUS_COMPLETE);
+  char* expected = osrfMessageSerializeBatchEncoded(msgs, 2, OSRF_ENCODING_MSGPACK);
+
+  // The same messages, with the content packed in place of a bare RESULT's
+  osrfMessage* bare = osrf_message_init(RESULT, 4, 1);
+  osrf_message_set_status_info(bare, "osrfResult", "OK", OSRF_STATUS_OK);
+  jsonObject* content = jsonParse(content_json);
+  growing_buffer* buf = buffer_init(64);
+  osrfMessageAddMsgpack(buf, bare, content);
+  osrfMessageAddMsgpack(buf, msgs[1], NULL);
+  char* body = osrfMsgpackArrayText(OSRF_BUFFER_C_STR(buf), buffer_length(buf), 2);
+  fail_unless(strcmp(body, expected) == 0,
+      "Packed fragments should make the same body as osrfMessageSerializeBatchEncoded()");
+  free(body);
+
+  body = osrfMsgpackArrayText(NULL, 0, 0);
+  fail_unless(strcmp(body, "msgpack:kA==") == 0,
+      "No fragments should make an empty array");
+  free(body);
+
+  buffer_free(buf);
+  jsonObjectFree(content);
+  osrfMessageFree(bare);
+  free(expected);
+  osrfMessageFree(msgs[0]);
+  osrfMessageFree(msgs[1]);
+}
+END_TEST
+
+Suite *osrf_msgpack_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_msgpack");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_msgpack_scalars);
+  tcase_add_test(tc_core, test_osrf_msgpack_round_trip);
+  tcase_add_test(tc_core, test_osrf_msgpack_text);
+  tcase_add_test(tc_core, test_osrf_msgpack_messages);
+  tcase_add_test(tc_core, test_osrf_msgpack_fragments);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_msgpack_suite());
+}
@@ -0,0 +1,180 @@
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "opensrf/osrf_settings.h"
+#include "opensrf/osrf_msgpack.h"
+
+char snapshot[] = "/tmp/check_osrf_settings.XXXXXX";
+
+//Set up the test fixture
+void setup(void) {
+  int fd = mkstemp(snapshot);
+  close(fd);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrf_settings_free_host_config(NULL);
+  unlink(snapshot);
+  strcpy(snapshot + strlen(snapshot) - 6, "XXXXXX");
+}
+
+static void write_snapshot(const char* host, long generation, time_t fetched) {
+  jsonObject* snap = jsonParse("{\"config\":{\"apps\":{\"opensrf.math\":{\"language\":\"c\"}}}}");
+  jsonObjectSetKey(snap, "hostname", jsonNewObject(host));
+  jsonObjectSetKey(snap, "generation", jsonNewNumberObject(generation));
+  jsonObjectSetKey(snap, "fetched", jsonNewNumberObject(fetched));
+  size_t len;
+  char* data = jsonObjectToMsgpack(snap, &len);
+  FILE* f = fopen(snapshot, "w");
+  fwrite(data, 1, len, f);
+  fclose(f);
+  free(data);
+  jsonObjectFree(snap);
+}
+
+//Tests
+
+START_TEST(test_osrf_settings_load_snapshot)
+{
+  time_t age;
+  write_snapshot("host.example", 3, time(NULL) - 5);
+  fail_unless(osrf_settings_load_snapshot(snapshot, "host.example", 3, 60, &age) == 0,
+      "osrf_settings_load_snapshot should load a fresh snapshot");
+  fail_unless(age >= 5 && age < 60, "osrf_settings_load_snapshot should report the age");
+
+  char* lang = osrf_settings_host_value("/apps/opensrf.math/language");
+  fail_unless(lang && strcmp(lang, "c") == 0,
+      "Settings loaded from a snapshot should be searchable");
+  free(lang);
+
+  osrf_settings_free_host_config(NULL);
+  fail_unless(osrf_settings_load_snapshot(snapshot, "other.example", 3, 60, NULL) == -1,
+      "A snapshot for another host should be ignored");
+  fail_unless(osrf_settings_load_snapshot(snapshot, "host.example", 4, 60, NULL) == -1,
+      "A snapshot from another generation should be ignored");
+  fail_unless(osrf_settings_load_snapshot(snapshot, "host.example", 3, 1, NULL) == -1,
+      "A snapshot older than max_age should be ignored");
+
+  write_snapshot("host.example", 3, time(NULL));
+  fail_unless(truncate(snapshot, 10) == 0, "truncate failed");
+  fail_unless(osrf_settings_load_snapshot(snapshot, "host.example", 3, 60, NULL) == -1,
+      "A damaged snapshot should be ignored");
+  fail_unless(osrf_settings_load_snapshot("/nonexistent/snapshot", "host.example", 3, 60,
+      NULL) == -1, "A missing snapshot should be ignored");
+}
+END_TEST
+
+START_TEST(test_osrf_settings_save_snapshot)
+{
+  fail_unless(osrf_settings_save_snapshot(snapshot, 7) == -1,
+      "osrf_settings_save_snapshot should fail with no settings loaded");
+
+  write_snapshot("host.example", 3, time(NULL));
+  osrf_settings_load_snapshot(snapshot, "host.example", 3, 60, NULL);
+  fail_unless(osrf_settings_save_snapshot(snapshot, 7) == 0,
+      "osrf_settings_save_snapshot should save the loaded settings");
+  osrf_settings_free_host_config(NULL);
+
+  fail_unless(osrf_settings_load_snapshot(snapshot, "host.example", 7, 60, NULL) == 0,
+      "A saved snapshot should load with its own generation");
+  char* lang = osrf_settings_host_value("/apps/opensrf.math/language");
+  fail_unless(lang && strcmp(lang, "c") == 0, "A saved snapshot should keep the settings");
+  free(lang);
+}
+END_TEST
+
+START_TEST(test_osrf_settings_lookups)
+{
+  fail_unless(osrf_settings_host_value_const("/apps") == NULL,
+      "osrf_settings_host_value_const should return NULL with no settings loaded");
+
+  write_snapshot("host.example", 3, time(NULL));
+  osrf_settings_load_snapshot(snapshot, "host.example", 3, 60, NULL);
+
+  const jsonObject* lang = osrf_settings_host_value_const("/apps/%s/language", "opensrf.math");
+  fail_unless(lang && strcmp(jsonObjectGetString(lang), "c") == 0,
+      "osrf_settings_host_value_const should find a value");
+  fail_unless(osrf_settings_host_value_const("apps//opensrf.math/language/") == lang,
+      "osrf_settings_host_value_const should return the stored value itself, "
+      "however the path is written");
+  fail_unless(osrf_settings_host_value_const("/apps/opensrf.math/language/x") == NULL
+      && osrf_settings_host_value_const("/nope") == NULL
+      && osrf_settings_host_value_const("/") == NULL,
+      "osrf_settings_host_value_const should return NULL for a path that leads nowhere");
+  fail_unless(osrf_settings_host_value_const("//language") == lang,
+      "osrf_settings_host_value_const should return the first match for a // path");
+
+  jsonObject* apps = osrf_settings_host_value_object("/apps");
+  fail_unless(apps && apps->type == JSON_HASH,
+      "osrf_settings_host_value_object should return a copy of a subtree");
+  jsonObjectFree(apps);
+  jsonObject* all = osrf_settings_host_value_object("//language");
+  fail_unless(all && all->type == JSON_ARRAY && all->size == 1,
+      "osrf_settings_host_value_object should gather everything a // path matches");
+  jsonObjectFree(all);
+}
+END_TEST
+
+static void* look_up_settings(void* arg) {
+  int i;
+  for (i = 0; i < 2000; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "//language%d", i % 300);  // more than the cache holds
+    osrf_settings_host_value_const("%s", path);
+    if (!osrf_settings_host_value_const("//language")
+        || !osrf_settings_host_value_const("/apps/opensrf.math/language"))
+      return (void*) 1;
+  }
+  return NULL;
+}
+
+START_TEST(test_osrf_settings_threads)
+{
+  write_snapshot("host.example", 3, time(NULL));
+  osrf_settings_load_snapshot(snapshot, "host.example", 3, 60, NULL);
+
+  pthread_t threads[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, look_up_settings, NULL);
+  int failed = 0;
+  for (i = 0; i < 4; i++) {
+    void* rc;
+    pthread_join(threads[i], &rc);
+    failed |= rc != NULL;
+  }
+  fail_if(failed, "Lookups from several threads at once should all succeed");
+
+  // The index is rebuilt for the new settings
+  osrf_settings_replace(jsonParse("{\"apps\":{\"opensrf.math\":{\"language\":\"perl\"}}}"));
+  const jsonObject* lang = osrf_settings_host_value_const("/apps/opensrf.math/language");
+  fail_unless(lang && strcmp(jsonObjectGetString(lang), "perl") == 0,
+      "osrf_settings_replace should make the new settings the ones found");
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_settings_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_settings");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_settings_load_snapshot);
+  tcase_add_test(tc_core, test_osrf_settings_save_snapshot);
+  tcase_add_test(tc_core, test_osrf_settings_lookups);
+  tcase_add_test(tc_core, test_osrf_settings_threads);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_settings_suite());
+}
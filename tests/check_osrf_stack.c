@@ -1,14 +1,97 @@
 #include <check.h>
 #include "opensrf/osrf_stack.h"
+#include "opensrf/osrf_app_session.h"
+#include "opensrf/osrf_system.h"
 
+transport_client *a_client;
+osrfAppSession *a_session;
 
+// Transport messages waiting to be received, and the bodies of those sent
+#define MAX_MESSAGES 8
+static transport_message* inbox[MAX_MESSAGES];
+static int inbox_count;
+static int inbox_next;
+static char* sent[MAX_MESSAGES];
+static int sent_count;
+
+// Which call to client_recv_ms() should first process the input itself, as a method
+// calling another service would; zero for none
+static int nest_on_call;
+static int recv_calls;
 
 //Set up the test fixture
 void setup(void){
+  a_client = safe_malloc(sizeof(transport_client));
+  inbox_count = inbox_next = sent_count = 0;
+  nest_on_call = recv_calls = 0;
+  a_session = osrf_app_server_session_init("thread", "test.app", "client@localhost/c");
+  a_session->state = OSRF_SESSION_CONNECTED;
 }
 
 //Clean up the test fixture
 void teardown(void){
+  osrf_stack_set_batch_wait(0);
+  osrfAppSessionFree(a_session);
+  while (inbox_next < inbox_count)
+    message_free(inbox[inbox_next++]);
+  int i;
+  for (i = 0; i < sent_count; i++)
+    free(sent[i]);
+  free(a_client);
+}
+
+// Stub functions to stand in for the transport_client used by osrf_stack.c and
+// osrf_app_session.c (to isolate system under test)
+
+transport_client* osrfSystemGetTransportClient(void) {
+  return a_client;
+}
+
+transport_message* client_recv_ms(transport_client* client, int timeout) {
+  if (nest_on_call && ++recv_calls == nest_on_call) {
+    nest_on_call = 0;
+    osrf_stack_process_ms(client, 0, NULL);
+  }
+  return inbox_next < inbox_count ? inbox[inbox_next++] : NULL;
+}
+
+int client_send_message(transport_client* client, transport_message* msg) {
+  if (sent_count < MAX_MESSAGES)
+    sent[sent_count++] = strdup(msg->body);
+  return 0;
+}
+
+int client_connected(const transport_client* client) {
+  return 1;
+}
+
+//End Stubs
+
+// Queue up a transport message holding one request.  There's no such application,
+// so each request is answered with an exception, which is all we need to see how the
+// answers go out.
+static void add_request(int trace) {
+  osrfMessage* req = osrf_message_init(REQUEST, trace, 1);
+  osrf_message_set_method(req, "test.method");
+  char* body = osrf_message_serialize(req);
+  osrfMessageFree(req);
+  inbox[inbox_count++] = message_init(body, "", "thread", "test.app@localhost/s",
+      "client@localhost/c");
+  free(body);
+}
+
+// Tell how many osrfMessages a transport message body held, and check the first one's
+// thread trace
+static int count_answers(const char* body, int first_trace) {
+  osrfMessage* msgs[MAX_MESSAGES];
+  int n = osrf_message_deserialize(body, msgs, MAX_MESSAGES);
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i == 0)
+      ck_assert_int_eq(msgs[i]->thread_trace, first_trace);
+    osrfMessageFree(msgs[i]);
+  }
+  return n;
 }
 
 // BEGIN TESTS
@@ -21,6 +104,44 @@ START_TEST(test_osrf_stack_process)
 }
 END_TEST
 
+START_TEST(test_osrf_stack_pipelined)
+{
+  osrf_stack_set_batch_wait(1000);
+  add_request(1);
+  add_request(2);
+  add_request(3);
+
+  int received = 0;
+  ck_assert_int_eq(osrf_stack_process_ms(a_client, 0, &received), 0);
+  fail_unless(received, "osrf_stack_process_ms should report that it received messages");
+
+  // Three requests in three transport messages, answered in one
+  ck_assert_int_eq(sent_count, 1);
+  ck_assert_int_eq(count_answers(sent[0], 1), 3);
+  ck_assert_int_eq(a_session->batch, 0);
+  ck_assert_int_eq(a_session->in_use, 0);
+}
+END_TEST
+
+START_TEST(test_osrf_stack_nested)
+{
+  osrf_stack_set_batch_wait(1000);
+  add_request(1);
+  add_request(2);
+
+  // Having handled the first request, the outer drain is interrupted by an inner one,
+  // which must send the first answer before it handles the second request
+  nest_on_call = 2;
+  ck_assert_int_eq(osrf_stack_process_ms(a_client, 0, NULL), 0);
+
+  ck_assert_int_eq(sent_count, 2);
+  ck_assert_int_eq(count_answers(sent[0], 1), 1);
+  ck_assert_int_eq(count_answers(sent[1], 2), 1);
+  ck_assert_int_eq(a_session->batch, 0);
+  ck_assert_int_eq(a_session->in_use, 0);
+}
+END_TEST
+
 //END TESTS
 
 Suite *osrf_stack_suite(void) {
@@ -31,6 +152,8 @@ Suite *osrf_stack_suite(void) {
 
   //Add tests to test case
   tcase_add_test(tc_core, test_osrf_stack_process);
+  tcase_add_test(tc_core, test_osrf_stack_pipelined);
+  tcase_add_test(tc_core, test_osrf_stack_nested);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
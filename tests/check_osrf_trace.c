@@ -0,0 +1,235 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "opensrf/osrf_trace.h"
+#include "opensrf/log.h"
+
+char tracefile[] = "/tmp/check_osrf_trace_XXXXXX";
+
+static const char* parent = "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01";
+
+//Read the trace file into a newly allocated string
+static char* read_trace(void) {
+  FILE* file = fopen(tracefile, "r");
+  if (!file)
+    return NULL;
+  char* text = calloc(65536, 1);
+  fread(text, 1, 65535, file);
+  fclose(file);
+  return text;
+}
+
+//Count the occurrences of a string in another
+static int count(const char* text, const char* target) {
+  int n = 0;
+  while ((text = strstr(text, target))) {
+    n++;
+    text++;
+  }
+  return n;
+}
+
+//Set up the test fixture
+void setup(void) {
+  int fd = mkstemp(tracefile);
+  close(fd);
+  osrfTraceClearContext();
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfTraceInit(NULL, NULL, 0, 1.0);
+  osrfTraceClearContext();
+  osrfLogClearXid();
+  unlink(tracefile);
+  strcpy(tracefile, "/tmp/check_osrf_trace_XXXXXX");
+}
+
+//Tests
+
+START_TEST(test_osrf_trace_parse)
+{
+  char trace_id[33];
+  char span_id[17];
+  int sampled = -1;
+  fail_unless(osrfTraceParse(parent, trace_id, span_id, &sampled) == 0,
+      "osrfTraceParse should accept a well-formed traceparent");
+  fail_unless(strcmp(trace_id, "0af7651916cd43dd8448eb211c80319c") == 0
+      && strcmp(span_id, "b7ad6b7169203331") == 0 && sampled == 1,
+      "osrfTraceParse should return the ids and the sampled flag");
+  fail_unless(osrfTraceParse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00",
+      NULL, NULL, &sampled) == 0 && sampled == 0,
+      "osrfTraceParse should report an unsampled context");
+  fail_unless(osrfTraceParse("01-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-xyz",
+      NULL, NULL, NULL) == 0,
+      "osrfTraceParse should accept extra fields from a later version");
+
+  fail_unless(osrfTraceParse(NULL, NULL, NULL, NULL) == -1
+      && osrfTraceParse("", NULL, NULL, NULL) == -1
+      && osrfTraceParse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b716920333-01",
+          NULL, NULL, NULL) == -1
+      && osrfTraceParse("00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01",
+          NULL, NULL, NULL) == -1
+      && osrfTraceParse("ff-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01",
+          NULL, NULL, NULL) == -1
+      && osrfTraceParse("00-00000000000000000000000000000000-b7ad6b7169203331-01",
+          NULL, NULL, NULL) == -1
+      && osrfTraceParse("00-0af7651916cd43dd8448eb211c80319c-0000000000000000-01",
+          NULL, NULL, NULL) == -1
+      && osrfTraceParse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-",
+          NULL, NULL, NULL) == -1,
+      "osrfTraceParse should reject a malformed traceparent");
+
+  osrfTraceSetContext("garbage");
+  fail_unless(strcmp(osrfTraceGetContext(), "") == 0,
+      "A malformed context should be ignored");
+  osrfTraceSetContext(parent);
+  fail_unless(strcmp(osrfTraceGetContext(), parent) == 0,
+      "osrfTraceSetContext should adopt a well-formed context");
+}
+END_TEST
+
+START_TEST(test_osrf_trace_disabled)
+{
+  osrfSpan span;
+  osrfTraceSetContext(parent);
+  fail_unless(osrfSpanStart(&span, "method", OSRF_SPAN_SERVER, 0.0) == 0,
+      "A span should not record unless we export spans");
+
+  char buf[OSRF_TRACEPARENT_SIZE];
+  osrfSpanFormat(&span, buf);
+  fail_unless(strcmp(buf, parent) == 0,
+      "A span that isn't recording should pass the context on unchanged");
+  osrfSpanActivate(&span);
+  fail_unless(strcmp(osrfTraceGetContext(), parent) == 0,
+      "Activating a span that isn't recording should change nothing");
+  osrfSpanEnd(&span);
+}
+END_TEST
+
+START_TEST(test_osrf_trace_context)
+{
+  fail_unless(osrfTraceInit("check", tracefile, 0, 1.0) == 0, "osrfTraceInit should succeed");
+
+  osrfSpan span;
+  osrfTraceSetContext(parent);
+  fail_unless(osrfSpanStart(&span, "method", OSRF_SPAN_SERVER, 0.0) == 1,
+      "A span within a sampled context should record");
+  fail_unless(strcmp(span.trace_id, "0af7651916cd43dd8448eb211c80319c") == 0
+      && strcmp(span.parent_id, "b7ad6b7169203331") == 0,
+      "A span should belong to the trace, and the span, of the current context");
+
+  char buf[OSRF_TRACEPARENT_SIZE];
+  osrfSpanFormat(&span, buf);
+  fail_unless(osrfTraceParse(buf, NULL, NULL, NULL) == 0
+      && strncmp(buf, "00-0af7651916cd43dd8448eb211c80319c-", 36) == 0
+      && strcmp(buf + 36, parent + 36) != 0,
+      "A span's context should name the span itself");
+
+  osrfSpanActivate(&span);
+  fail_unless(strcmp(osrfTraceGetContext(), buf) == 0,
+      "An active span should be the current context");
+  osrfSpan inner;
+  osrfSpanStart(&inner, "inner", OSRF_SPAN_CLIENT, 0.0);
+  fail_unless(strcmp(inner.parent_id, span.span_id) == 0,
+      "A span started within an active span should be its child");
+  osrfSpanDeactivate(&span);
+  fail_unless(strcmp(osrfTraceGetContext(), parent) == 0,
+      "Deactivating a span should put back the previous context");
+
+  osrfTraceSetContext("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00");
+  fail_unless(osrfSpanStart(&span, "unsampled", OSRF_SPAN_SERVER, 0.0) == 0,
+      "A span within an unsampled context should not record");
+
+  osrfTraceClearContext();
+  fail_unless(osrfSpanStart(&span, "root", OSRF_SPAN_CLIENT, 0.0) == 1
+      && span.parent_id[0] == '\0' && strlen(span.trace_id) == 32
+      && strcmp(span.trace_id, inner.trace_id) != 0,
+      "Without a context, a span should start a new trace");
+
+  osrfTraceInit("check", tracefile, 0, 0.0);
+  fail_unless(osrfSpanStart(&span, "root", OSRF_SPAN_CLIENT, 0.0) == 0,
+      "A new trace should not record if it misses the sample");
+}
+END_TEST
+
+START_TEST(test_osrf_trace_export)
+{
+  osrfTraceInit("check_service", tracefile, 2, 1.0);
+  osrfLogSetXid("tracexid");
+
+  osrfSpan span;
+  osrfTraceSetContext(parent);
+  osrfSpanStart(&span, "open-ils.\"quoted\"", OSRF_SPAN_SERVER, 0.0);
+  osrfSpanSetAttr(&span, "rpc.service", "opensrf.math");
+  osrfSpanAddEvent(&span, "response");
+  span.error = 1;
+  osrfSpanEnd(&span);
+  osrfSpanEnd(&span);
+
+  char* text = read_trace();
+  fail_unless(text && *text == '\0', "One span should wait for the rest of its batch");
+  free(text);
+
+  osrfSpan other;
+  osrfSpanStart(&other, "second", OSRF_SPAN_CLIENT, 1.5);
+  osrfSpanEnd(&other);
+
+  text = read_trace();
+  fail_unless(count(text, "\n") == 1 && count(text, "{\"resourceSpans\":") == 1,
+      "A full batch should be written as one line");
+  fail_unless(count(text, "{\"key\":\"service.name\",\"value\":{\"stringValue\":\"check_service\"}}") == 1,
+      "The batch should name the service");
+  fail_unless(count(text, "\"scopeSpans\":[{\"scope\":{\"name\":\"opensrf\"},\"spans\":[{") == 1,
+      "The spans should be within the scope");
+  fail_unless(count(text, "\"traceId\":\"0af7651916cd43dd8448eb211c80319c\"") == 2
+      && count(text, "\"parentSpanId\":\"b7ad6b7169203331\"") == 2,
+      "Each span should name its trace and parent");
+  fail_unless(count(text, "\"name\":\"open-ils.\\\"quoted\\\"\",\"kind\":2,") == 1,
+      "A span's name should be escaped, and followed by its kind");
+  fail_unless(count(text, "{\"key\":\"opensrf.xid\",\"value\":{\"stringValue\":\"tracexid\"}}") == 2
+      && count(text, "{\"key\":\"rpc.service\",\"value\":{\"stringValue\":\"opensrf.math\"}}") == 1,
+      "A span should carry the xid and its own attributes");
+  fail_unless(count(text, "\"events\":[{\"timeUnixNano\":\"") == 1
+      && count(text, "\",\"name\":\"response\"}]") == 1,
+      "A span should carry its events");
+  fail_unless(count(text, "\"status\":{\"code\":2}") == 1,
+      "A failed span should say so");
+  fail_unless(count(text, "\"startTimeUnixNano\":\"1500000000\"") == 1,
+      "A span may start at a given time");
+  free(text);
+
+  osrfSpanStart(&span, "third", OSRF_SPAN_INTERNAL, 0.0);
+  osrfSpanEnd(&span);
+  osrfTraceFlush();
+  text = read_trace();
+  fail_unless(count(text, "\n") == 2 && count(text, "\"name\":\"third\"") == 1,
+      "osrfTraceFlush should write a partial batch");
+  free(text);
+}
+END_TEST
+
+//END TESTS
+
+Suite *osrf_trace_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("osrf_trace");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_osrf_trace_parse);
+  tcase_add_test(tc_core, test_osrf_trace_disabled);
+  tcase_add_test(tc_core, test_osrf_trace_context);
+  tcase_add_test(tc_core, test_osrf_trace_export);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, osrf_trace_suite());
+}
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <check.h>
 #include "opensrf/utils.h"
 
@@ -23,6 +24,156 @@ START_TEST(test_osrfXmlEscapingLength)
 }
 END_TEST
 
+START_TEST(test_osrfXmlEscape)
+{
+  ck_assert_int_eq(osrfXmlEscapeSize(NULL), 0);
+  const char* special = "<a b=\"c\">x & y\r\n</a>";
+  const char* expected = "&lt;a b=\"c\"&gt;x &amp; y&#13;\n&lt;/a&gt;";
+  ck_assert_int_eq(osrfXmlEscapeSize(special), strlen(expected));
+  char out[ 256 ];
+  char* end = osrfXmlEscape(out, special);
+  *end = '\0';
+  ck_assert_str_eq(out, expected);
+
+  // Special characters at every offset of a long string, whatever its alignment
+  char in[ 80 ];
+  int offset, pos;
+  for (offset = 0; offset < 16; offset++) {
+    for (pos = 0; pos < 60; pos++) {
+      memset(in, 'x', sizeof(in));
+      in[ offset + pos ] = '&';
+      in[ offset + 60 ] = '\0';
+      ck_assert_int_eq(osrfXmlEscapeSize(in + offset), 64);
+
+      growing_buffer* gb = buffer_init( 2 );
+      buffer_add(gb, "<");
+      fail_unless(buffer_add_xml_escaped(gb, in + offset) == 0,
+          "buffer_add_xml_escaped should succeed");
+      ck_assert_int_eq(gb->n_used, 65);
+      fail_unless(!strncmp(gb->buf + 1 + pos, "&amp;", 5) && gb->buf[ 65 ] == '\0',
+          "buffer_add_xml_escaped should escape at offset %d", pos);
+      buffer_free(gb);
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_timeout_secs_to_millis)
+{
+  ck_assert_int_eq(timeout_secs_to_millis(-1), -1);
+  ck_assert_int_eq(timeout_secs_to_millis(-5), -1);
+  ck_assert_int_eq(timeout_secs_to_millis(0), 0);
+  ck_assert_int_eq(timeout_secs_to_millis(3), 3000);
+  fail_unless(timeout_secs_to_millis(INT_MAX) > 0,
+      "A huge timeout should not overflow into a negative one");
+
+  long long before = get_monotonic_millis();
+  usleep(20000);
+  long long elapsed = get_monotonic_millis() - before;
+  fail_unless(elapsed >= 19 && elapsed < 1000,
+      "get_monotonic_millis should measure short intervals in milliseconds");
+}
+END_TEST
+
+START_TEST(test_osrf_intern)
+{
+  char buf[ 16 ];
+  strcpy( buf, "en-US" );
+  const char* interned = osrf_intern( buf );
+  fail_unless( interned != NULL && strcmp( interned, "en-US" ) == 0,
+      "osrf_intern should return a copy of the string" );
+  fail_unless( interned != buf, "osrf_intern should not return its argument" );
+  fail_unless( osrf_intern( "en-US" ) == interned,
+      "osrf_intern should return the same copy for the same string" );
+  fail_unless( osrf_intern( "fr-CA" ) != interned,
+      "osrf_intern should return different copies for different strings" );
+
+  ck_assert_str_eq( osrf_intern_json( interned ), "\"en-US\"" );
+  ck_assert_str_eq( osrf_intern_json( osrf_intern( "a\"b" )), "\"a\\\"b\"" );
+  fail_unless( osrf_intern_json( buf ) == NULL,
+      "osrf_intern_json should return NULL for a string not interned" );
+
+  char long_str[ 100 ];
+  memset( long_str, 'x', sizeof( long_str ) - 1 );
+  long_str[ sizeof( long_str ) - 1 ] = '\0';
+  fail_unless( osrf_intern( long_str ) == NULL,
+      "osrf_intern should refuse a long string" );
+  fail_unless( osrf_intern( NULL ) == NULL, "osrf_intern should refuse NULL" );
+}
+END_TEST
+
+START_TEST(test_osrf_intern_name)
+{
+  const char* name = osrf_intern_name( "shortname" );
+  fail_unless( name != NULL && name == osrf_intern( "shortname" ),
+      "osrf_intern_name should intern an identifier" );
+  fail_unless( osrf_intern_name( "_ou_type2" ) != NULL,
+      "osrf_intern_name should take underscores and digits" );
+  fail_unless( osrf_intern_name( "12345" ) == NULL,
+      "osrf_intern_name should refuse a number" );
+  fail_unless( osrf_intern_name( "4f2a-9c" ) == NULL && osrf_intern_name( "a.b" ) == NULL,
+      "osrf_intern_name should refuse what isn't an identifier" );
+  fail_unless( osrf_intern_name( "" ) == NULL, "osrf_intern_name should refuse nothing" );
+  fail_unless( osrf_intern_name( "abcdefghijklmnopqrstuvwxyz0123456789" ) == NULL,
+      "osrf_intern_name should refuse a long name" );
+}
+END_TEST
+
+START_TEST(test_buffer_fadd)
+{
+  growing_buffer* gb = buffer_init( 8 );
+  fail_unless( buffer_fadd( gb, "%d-%s", 42, "abc" ) == 6 && !strcmp( gb->buf, "42-abc" ),
+      "buffer_fadd should format into the space it has" );
+
+  char long_str[ 100 ];
+  memset( long_str, 'y', sizeof( long_str ) - 1 );
+  long_str[ sizeof( long_str ) - 1 ] = '\0';
+  fail_unless( buffer_fadd( gb, "[%s]", long_str ) == 107,
+      "buffer_fadd should grow the buffer when it has to" );
+  fail_unless( !strncmp( gb->buf, "42-abc[yyy", 10 ) && gb->buf[ 106 ] == ']'
+      && gb->buf[ 107 ] == '\0', "buffer_fadd should keep what was there" );
+  fail_unless( buffer_fadd( NULL, "%d", 1 ) == -1 && buffer_fadd( gb, NULL ) == -1,
+      "buffer_fadd should refuse NULLs" );
+  buffer_free( gb );
+
+  char* str = va_list_to_string( "%s:%d", long_str, 7 );
+  fail_unless( strlen( str ) == 101 && !strcmp( str + 99, ":7" ),
+      "va_list_to_string should format the whole string" );
+  free( str );
+}
+END_TEST
+
+START_TEST(test_buffer_add_numbers)
+{
+  growing_buffer* gb = buffer_init( 4 );
+  buffer_add_int64( gb, 0 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_int64( gb, -7 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_int64( gb, 1234567 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_int64( gb, INT64_MIN );
+  buffer_add_char( gb, ' ' );
+  buffer_add_uint( gb, UINT64_MAX );
+  fail_unless( !strcmp( gb->buf, "0 -7 1234567 -9223372036854775808 18446744073709551615" ),
+      "buffer_add_int64 and buffer_add_uint should give decimal: %s", gb->buf );
+
+  buffer_reset( gb );
+  buffer_add_double( gb, 3 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_double( gb, -2.5 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_double( gb, -0.0 );
+  buffer_add_char( gb, ' ' );
+  buffer_add_double( gb, 1e300 );
+  char expected[ 512 ];
+  snprintf( expected, sizeof( expected ), "3 -2.5 -0 %.30g", 1e300 );
+  fail_unless( !strcmp( gb->buf, expected ),
+      "buffer_add_double should format like doubleToString: %s", gb->buf );
+  buffer_free( gb );
+}
+END_TEST
+
 //END TESTS
 
 Suite *osrf_utils_suite(void) {
@@ -33,6 +184,12 @@ Suite *osrf_utils_suite(void) {
 
   //Add tests to test case
   tcase_add_test(tc_core, test_osrfXmlEscapingLength);
+  tcase_add_test(tc_core, test_osrfXmlEscape);
+  tcase_add_test(tc_core, test_timeout_secs_to_millis);
+  tcase_add_test(tc_core, test_osrf_intern);
+  tcase_add_test(tc_core, test_osrf_intern_name);
+  tcase_add_test(tc_core, test_buffer_fadd);
+  tcase_add_test(tc_core, test_buffer_add_numbers);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
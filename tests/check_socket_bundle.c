@@ -0,0 +1,129 @@
+#include <check.h>
+#include <sys/wait.h>
+#include "opensrf/socket_bundle.h"
+
+#define BIG_SIZE (2 * 1024 * 1024)
+
+socket_manager *server;
+socket_manager *client;
+char sock_path[64];
+int server_fd;
+int client_fd;
+int calls;
+size_t received;
+int bad_data;
+int closed_fd;
+
+static void count_data(void* blob, socket_manager* mgr, int sock_fd, char* data,
+    int parent_id) {
+  size_t len = strlen(data);
+  size_t i;
+  for(i = 0; i < len; i++)
+    if(data[i] != 'a' + (received + i) % 26)
+      bad_data = 1;
+  received += len;
+  calls++;
+}
+
+static void note_closed(void* blob, int sock_fd) {
+  closed_fd = sock_fd;
+}
+
+//Set up the test fixture
+void setup(void) {
+  snprintf(sock_path, sizeof(sock_path), "/tmp/check_socket_bundle.%ld", (long) getpid());
+  unlink(sock_path);
+  server = safe_malloc(sizeof(socket_manager));
+  server->data_received = count_data;
+  server->on_socket_closed = note_closed;
+  client = safe_malloc(sizeof(socket_manager));
+  server_fd = socket_open_unix_server(server, sock_path);
+  client_fd = socket_open_unix_client(client, sock_path);
+  socket_wait_all(server, 1);    // accept the connection
+  calls = 0;
+  received = 0;
+  bad_data = 0;
+  closed_fd = -1;
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  socket_manager_free(client);
+  socket_manager_free(server);
+  unlink(sock_path);
+}
+
+//BEGIN TESTS
+
+START_TEST(test_socket_bundle_large_read)
+{
+  fail_if(server_fd < 0 || client_fd < 0, "The sockets should open");
+
+  pid_t pid = fork();
+  if(pid == 0) {
+    char* big = malloc(BIG_SIZE + 1);
+    size_t i;
+    for(i = 0; i < BIG_SIZE; i++)
+      big[i] = 'a' + i % 26;
+    big[BIG_SIZE] = '\0';
+    _exit(socket_send(client_fd, big) ? 1 : 0);
+  }
+
+  int i;
+  for(i = 0; i < 1000 && received < BIG_SIZE; i++)
+    socket_wait_all(server, 5);
+
+  int status;
+  waitpid(pid, &status, 0);
+  fail_unless(received == BIG_SIZE, "Every byte sent should be received");
+  fail_if(bad_data, "The data should arrive intact and in order");
+  fail_unless(calls < 200,
+      "The read buffer should grow, rather than reading 1K at a time");
+}
+END_TEST
+
+START_TEST(test_socket_bundle_no_wait)
+{
+  fail_unless(socket_wait_all(server, 0) == 0,
+      "A zero timeout with no input should return without error");
+  fail_unless(calls == 0, "No data should be reported when none was sent");
+
+  socket_send(client_fd, "hello");
+  socket_wait_all(server, 0);
+  fail_unless(received == 5, "A zero timeout should still pick up pending input");
+}
+END_TEST
+
+START_TEST(test_socket_bundle_peer_closed)
+{
+  socket_disconnect(client, client_fd);
+  socket_wait_all(server, 1);
+  fail_if(closed_fd < 0, "Closing the peer should invoke on_socket_closed");
+  fail_unless(socket_wait(server, 0, closed_fd) == -1,
+      "The closed socket should be removed from the socket_manager");
+}
+END_TEST
+
+//END TESTS
+
+Suite *socket_bundle_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("socket_bundle");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+  tcase_set_timeout(tc_core, 30);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_socket_bundle_large_read);
+  tcase_add_test(tc_core, test_socket_bundle_no_wait);
+  tcase_add_test(tc_core, test_socket_bundle_peer_closed);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, socket_bundle_suite());
+}
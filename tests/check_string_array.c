@@ -0,0 +1,100 @@
+#include <check.h>
+#include <stdio.h>
+#include "opensrf/string_array.h"
+
+osrfStringArray* arr;
+
+//Set up the test fixture
+void setup(void) {
+  arr = osrfNewStringArray(0);
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfStringArrayFree(arr);
+}
+
+//Tests
+
+START_TEST(test_string_array_contains_small)
+{
+  osrfStringArrayAdd(arr, "one");
+  osrfStringArrayAdd(arr, "two");
+  fail_unless(osrfStringArrayContains(arr, "two") == 1,
+      "osrfStringArrayContains should find a string that is present");
+  fail_unless(osrfStringArrayContains(arr, "three") == 0,
+      "osrfStringArrayContains should not find a string that is absent");
+  fail_unless(arr->index == NULL, "A small array should not be indexed");
+  fail_unless(osrfStringArrayContains(arr, NULL) == 0 && osrfStringArrayContains(NULL, "one") == 0,
+      "osrfStringArrayContains should return 0 for NULLs");
+}
+END_TEST
+
+START_TEST(test_string_array_contains_indexed)
+{
+  char buf[32];
+  int i;
+  for (i = 0; i < 20; i++) {
+    snprintf(buf, sizeof(buf), "domain%d.example%%s", i);
+    osrfStringArrayAdd(arr, buf);
+  }
+
+  fail_unless(osrfStringArrayContains(arr, "domain7.example%s") == 1,
+      "osrfStringArrayContains should find a string that is present");
+  fail_unless(arr->index != NULL, "A bigger array should be indexed on first search");
+  fail_unless(osrfStringArrayContains(arr, "domain7.example") == 0,
+      "osrfStringArrayContains should not find a string that is absent");
+
+  // Adding keeps the index
+  osrfStringArrayAdd(arr, "late");
+  fail_unless(arr->index != NULL && osrfStringArrayContains(arr, "late") == 1,
+      "An added string should be found through the index");
+
+  // Removing drops it, but a duplicate stays findable
+  osrfStringArrayAdd(arr, "late");
+  osrfStringArrayRemove(arr, "late");
+  fail_unless(arr->index == NULL, "osrfStringArrayRemove should drop the index");
+  fail_unless(osrfStringArrayContains(arr, "late") == 1,
+      "A second copy of a removed string should still be found");
+  osrfStringArrayRemove(arr, "late");
+  fail_unless(osrfStringArrayContains(arr, "late") == 0,
+      "A removed string should not be found");
+
+  // Swapping moves the index with the strings
+  osrfStringArray* other = osrfNewStringArray(0);
+  osrfStringArrayAdd(other, "lonely");
+  osrfStringArraySwap(arr, other);
+  fail_unless(osrfStringArrayContains(arr, "domain3.example%s") == 0
+      && osrfStringArrayContains(arr, "lonely") == 1,
+      "A swapped array should find only its new strings");
+  fail_unless(osrfStringArrayContains(other, "domain3.example%s") == 1,
+      "The other array should find the swapped strings");
+  OSRF_STRING_ARRAY_FREE(other);
+
+  osrfStringArrayClear(arr);
+  fail_unless(arr->index == NULL && osrfStringArrayContains(arr, "lonely") == 0,
+      "osrfStringArrayClear should drop the index");
+}
+END_TEST
+
+//END TESTS
+
+Suite *string_array_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("string_array");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_string_array_contains_small);
+  tcase_add_test(tc_core, test_string_array_contains_indexed);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, string_array_suite());
+}
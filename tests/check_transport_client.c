@@ -76,6 +76,10 @@ int session_wait(transport_session* session, int timeout) {
     return 1;
 }
 
+int session_wait_ms(transport_session* session, int timeout) {
+  return session_wait(session, timeout < 0 ? -1 : (timeout + 999) / 1000);
+}
+
 //End Stubs
 
 // BEGIN TESTS
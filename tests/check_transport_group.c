@@ -0,0 +1,282 @@
+#include <check.h>
+#include <string.h>
+#include "opensrf/osrf_transgroup.h"
+
+osrfTransportGroup *a_group;
+transport_message *a_message;
+
+// Nodes, as "domain/resource", that refuse to connect or to send
+static const char* down_nodes[4];
+
+// The node, as "domain/resource", that sent the last message
+static char last_sent[256];
+
+//Set up the test fixture
+void setup(void) {
+  osrfTransportGroupNode* nodes[] = {
+    osrfNewTransportGroupNode("a.example", 5222, "user", "password", "r1"),
+    osrfNewTransportGroupNode("a.example", 5222, "user", "password", "r2"),
+    osrfNewTransportGroupNode("b.example", 5222, "user", "password", "r1")
+  };
+  a_group = osrfNewTransportGroup(nodes, 3);
+  osrfTransportGroupSetRetryInterval(a_group, -1);
+  a_message = message_init("body", "subject", "thread", "service@a.example/res", "sender");
+  memset(down_nodes, 0, sizeof(down_nodes));
+  last_sent[0] = '\0';
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  osrfTransportGroupFree(a_group);
+  message_free(a_message);
+}
+
+// Stub functions to simulate the transport_client functions used in
+// osrf_transgroup.c (to isolate system under test).  Each client remembers
+// its resource in xmpp_id once it connects.
+
+static int is_down(const transport_client* client, const char* resource) {
+  char name[256];
+  snprintf(name, sizeof(name), "%s/%s", client->host, resource);
+  int i;
+  for (i = 0; i < 4; i++)
+    if (down_nodes[i] && !strcmp(down_nodes[i], name))
+      return 1;
+  return 0;
+}
+
+transport_client* client_init(const char* server, int port, const char* unix_path,
+    int component) {
+  transport_client* client = safe_malloc(sizeof(transport_client));
+  client->host = strdup(server);
+  return client;
+}
+
+int client_connect(transport_client* client, const char* username,
+    const char* password, const char* resource, int connect_timeout,
+    enum TRANSPORT_AUTH_TYPE auth_type) {
+  if (is_down(client, resource))
+    return 0;
+  free(client->xmpp_id);
+  client->xmpp_id = strdup(resource);
+  return 1;
+}
+
+int client_disconnect(transport_client* client) {
+  return 1;
+}
+
+int client_connected(const transport_client* client) {
+  return client && client->xmpp_id;
+}
+
+int client_send_message(transport_client* client, transport_message* msg) {
+  if (!client->xmpp_id || is_down(client, client->xmpp_id))
+    return -1;
+  snprintf(last_sent, sizeof(last_sent), "%s/%s", client->host, client->xmpp_id);
+  return 0;
+}
+
+transport_message* client_recv(transport_client* client, int timeout) {
+  return NULL;
+}
+
+int client_free(transport_client* client) {
+  if (client) {
+    free(client->host);
+    free(client->xmpp_id);
+    free(client);
+  }
+  return 1;
+}
+
+//End Stubs
+
+static osrfTransportGroupNode* member(int i) {
+  return OSRF_LIST_GET_INDEX(a_group->members, i);
+}
+
+//BEGIN TESTS
+
+START_TEST(test_transport_group_membership)
+{
+  fail_unless(osrfNewTransportGroup(NULL, 1) == NULL,
+      "osrfNewTransportGroup should reject a NULL node array");
+  ck_assert_int_eq(a_group->members->size, 3);
+
+  fail_unless(__osrfTransportGroupFindNode(a_group, "a.example") == member(0),
+      "The first node added for a domain should be found for it");
+  fail_unless(__osrfTransportGroupFindNode(a_group, "b.example") == member(2),
+      "Each domain should find its own node");
+  fail_unless(__osrfTransportGroupFindNode(a_group, "c.example") == NULL,
+      "A domain with no nodes should find none");
+
+  ck_assert_int_eq(osrfTransportGroupAddConnections(a_group, "c.example", 5222,
+      "user", "password", "pool", 2), 2);
+  ck_assert_int_eq(a_group->members->size, 5);
+  ck_assert_str_eq(member(3)->resource, "pool_1");
+  ck_assert_str_eq(member(4)->resource, "pool_2");
+  fail_unless(__osrfTransportGroupFindNode(a_group, "c.example") == member(3),
+      "Added connections should be found by their domain");
+
+  fail_unless(osrfTransportGroupAddNode(a_group, NULL) == -1,
+      "osrfTransportGroupAddNode should reject a NULL node");
+
+  down_nodes[0] = "c.example/pool_2";
+  ck_assert_int_eq(osrfTransportGroupConnectAll(a_group), 4);
+  fail_unless(member(3)->active && !member(4)->active,
+      "Only the nodes that connect should be active");
+}
+END_TEST
+
+START_TEST(test_transport_group_weighted)
+{
+  osrfTransportGroupConnectAll(a_group);
+  osrfTransportGroupNodeSetWeight(member(0), 2);
+
+  // Two to one, over the nodes for the recipient's domain only
+  int counts[3] = { 0, 0, 0 };
+  int i;
+  for (i = 0; i < 9; i++) {
+    ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+    if (!strcmp(last_sent, "a.example/r1"))
+      counts[0]++;
+    else if (!strcmp(last_sent, "a.example/r2"))
+      counts[1]++;
+    else
+      counts[2]++;
+  }
+  ck_assert_int_eq(counts[0], 6);
+  ck_assert_int_eq(counts[1], 3);
+  ck_assert_int_eq(counts[2], 0);
+}
+END_TEST
+
+START_TEST(test_transport_group_readdress)
+{
+  osrfTransportGroupConnectAll(a_group);
+  member(0)->active = 0;
+  member(1)->active = 0;
+
+  // A message for a domain we host goes to whichever domain has a node to spare
+  ck_assert_int_eq(osrfTransportGroupSend(a_group, a_message), 0);
+  ck_assert_str_eq(last_sent, "b.example/r1");
+  ck_assert_str_eq(a_message->recipient, "service@b.example/res");
+
+  // A message for any other domain goes as it is
+  message_set_recipient(a_message, "service@elsewhere/res");
+  ck_assert_int_eq(osrfTransportGroupSend(a_group, a_message), 0);
+  ck_assert_str_eq(a_message->recipient, "service@elsewhere/res");
+}
+END_TEST
+
+START_TEST(test_transport_group_failover)
+{
+  osrfTransportGroupConnectAll(a_group);
+  down_nodes[0] = "a.example/r1";
+  down_nodes[1] = "a.example/r2";
+
+  // Both nodes for the domain fail, so the message goes to the other domain
+  ck_assert_int_eq(osrfTransportGroupSend(a_group, a_message), 0);
+  ck_assert_str_eq(last_sent, "b.example/r1");
+  fail_unless(!member(0)->active && !member(1)->active && member(2)->active,
+      "Nodes that fail to send should be set aside");
+
+  // SendMatch doesn't leave the domain
+  message_set_recipient(a_message, "service@a.example/res");
+  fail_unless(osrfTransportGroupSendMatch(a_group, a_message) == -1,
+      "osrfTransportGroupSendMatch should fail when its domain has no working node");
+
+  // Once the retry interval has passed, the nodes come back
+  down_nodes[0] = NULL;
+  osrfTransportGroupSetRetryInterval(a_group, 0);
+  ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+  ck_assert_str_eq(last_sent, "a.example/r1");
+  fail_unless(member(0)->active && !member(1)->active,
+      "Only the node that reconnects should be active again");
+
+  // With every node down, there is nowhere left to go
+  down_nodes[0] = "a.example/r1";
+  down_nodes[2] = "b.example/r1";
+  osrfTransportGroupSetRetryInterval(a_group, -1);
+  fail_unless(osrfTransportGroupSend(a_group, a_message) == -1,
+      "osrfTransportGroupSend should fail when no node can send");
+}
+END_TEST
+
+START_TEST(test_transport_group_set_inactive)
+{
+  osrfTransportGroupConnectAll(a_group);
+
+  osrfTransportGroupSetInactive(a_group, "a.example");
+  fail_unless(!member(0)->active && !member(1)->active && member(2)->active,
+      "osrfTransportGroupSetInactive should set aside every node for the domain");
+  fail_unless(osrfTransportGroupSendMatch(a_group, a_message) == -1,
+      "A domain that has been set aside should not be sent to");
+
+  ck_assert_int_eq(osrfTransportGroupSend(a_group, a_message), 0);
+  ck_assert_str_eq(last_sent, "b.example/r1");
+
+  // Unknown domains are ignored
+  osrfTransportGroupSetInactive(a_group, "c.example");
+  fail_unless(member(2)->active, "Other domains should stay active");
+
+  // The set-aside nodes are reconnected when the retry interval comes around
+  osrfTransportGroupSetRetryInterval(a_group, 0);
+  message_set_recipient(a_message, "service@a.example/res");
+  ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+  fail_unless(member(0)->active && member(1)->active,
+      "Set-aside nodes should be reconnected after the retry interval");
+}
+END_TEST
+
+START_TEST(test_transport_group_sticky)
+{
+  osrfTransportGroupConnectAll(a_group);
+  osrfTransportGroupSetPolicy(a_group, OSRF_TG_STICKY);
+
+  ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+  char first[256];
+  strcpy(first, last_sent);
+  int i;
+  for (i = 0; i < 5; i++) {
+    ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+    ck_assert_str_eq(last_sent, first);
+  }
+
+  // When its node fails, the thread moves to the other one, and stays there
+  down_nodes[0] = first;
+  ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+  fail_if(!strcmp(last_sent, first), "The thread should move off its failed node");
+  char second[256];
+  strcpy(second, last_sent);
+  ck_assert_int_eq(osrfTransportGroupSendMatch(a_group, a_message), 0);
+  ck_assert_str_eq(last_sent, second);
+}
+END_TEST
+
+//END TESTS
+
+Suite *transport_group_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("transport_group");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_transport_group_membership);
+  tcase_add_test(tc_core, test_transport_group_weighted);
+  tcase_add_test(tc_core, test_transport_group_readdress);
+  tcase_add_test(tc_core, test_transport_group_failover);
+  tcase_add_test(tc_core, test_transport_group_set_inactive);
+  tcase_add_test(tc_core, test_transport_group_sticky);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, transport_group_suite());
+}
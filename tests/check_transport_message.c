@@ -156,6 +156,58 @@ START_TEST(test_transport_message_set_osrf_xid)
 }
 END_TEST
 
+START_TEST(test_transport_message_osrf_span)
+{
+  const char* span = "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01";
+  fail_unless(a_message->osrf_span == NULL,
+      "A new message should carry no trace context");
+  message_set_osrf_span(a_message, span);
+  message_prepare_xml(a_message);
+  fail_unless(strstr(a_message->msg_xml, " osrf_span=\"00-0af7651916cd43dd8448eb211c80319c-"
+      "b7ad6b7169203331-01\"") != NULL,
+      "The trace context should go out in the osrf_span attribute");
+
+  transport_message* copy = new_message_from_xml(a_message->msg_xml);
+  fail_unless(copy->osrf_span && strcmp(copy->osrf_span, span) == 0,
+      "new_message_from_xml should populate the osrf_span field");
+  message_free(copy);
+
+  message_set_osrf_span(a_message, "");
+  fail_unless(a_message->osrf_span == NULL,
+      "An empty trace context should leave none");
+  free(a_message->msg_xml);
+  a_message->msg_xml = NULL;
+  message_prepare_xml(a_message);
+  fail_unless(strstr(a_message->msg_xml, "osrf_span") == NULL,
+      "A message without a trace context should have no osrf_span attribute");
+}
+END_TEST
+
+START_TEST(test_transport_message_osrf_locality)
+{
+  fail_unless(a_message->osrf_locality == NULL,
+      "A new message should carry no locality");
+  message_set_osrf_locality(a_message, "rack1");
+  message_prepare_xml(a_message);
+  fail_unless(strstr(a_message->msg_xml, " osrf_locality=\"rack1\"") != NULL,
+      "The locality should go out in the osrf_locality attribute");
+
+  transport_message* copy = new_message_from_xml(a_message->msg_xml);
+  fail_unless(copy->osrf_locality && strcmp(copy->osrf_locality, "rack1") == 0,
+      "new_message_from_xml should populate the osrf_locality field");
+  message_free(copy);
+
+  message_set_osrf_locality(a_message, NULL);
+  fail_unless(a_message->osrf_locality == NULL,
+      "A NULL locality should leave none");
+  free(a_message->msg_xml);
+  a_message->msg_xml = NULL;
+  message_prepare_xml(a_message);
+  fail_unless(strstr(a_message->msg_xml, "osrf_locality") == NULL,
+      "A message without a locality should have no osrf_locality attribute");
+}
+END_TEST
+
 START_TEST(test_transport_message_set_router_info_empty)
 {
   message_set_router_info(a_message, NULL, NULL, NULL, NULL, 0);
@@ -222,6 +274,107 @@ START_TEST(test_transport_message_prepare_xml)
 }
 END_TEST
 
+START_TEST(test_transport_message_prepare_xml_escaping)
+{
+  transport_message *msg = message_init("b\"o'dy<&>\r\n\t \xc3\xa9 ]]>", "s\"ub", "th\r",
+      "to<\"\n\t\r\xc3\xa9", "from&");
+  message_set_router_info(msg, "rf", NULL, NULL, NULL, 0);
+  message_set_osrf_xid(msg, "x");
+
+  fail_unless(message_prepare_xml(msg) == 1,
+      "message_prepare_xml should return 1 upon success");
+  fail_unless(strcmp(msg->msg_xml, "<message to=\"to&lt;&quot;&#10;&#9;&#13;&#xE9;\" from=\"from&amp;\"><opensrf router_from=\"rf\" router_to=\"\" router_class=\"\" router_command=\"\" osrf_xid=\"x\"/><thread>th&#13;</thread><subject>s\"ub</subject><body>b\"o'dy&lt;&amp;&gt;&#13;\n\t \xc3\xa9 ]]&gt;</body></message>") == 0,
+      "message_prepare_xml should escape attributes and text the way libxml2 does");
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_message_prepare_xml_body_xml)
+{
+  const char* body = "[\"a<b & c>d\", \"\xc3\xa9\"]";
+  transport_message *dom_msg = message_init(body, "subject", "thread", "to\"\xc3\xa9", "sender");
+  message_set_router_info(dom_msg, "routerfrom", NULL, NULL, NULL, 0);
+  message_set_osrf_xid(dom_msg, "x&id");
+  message_prepare_xml(dom_msg);
+
+  transport_message *fwd_msg = message_init(body, "subject", "thread", "to\"\xc3\xa9", "sender");
+  message_set_router_info(fwd_msg, "routerfrom", NULL, NULL, NULL, 0);
+  message_set_osrf_xid(fwd_msg, "x&id");
+  message_set_body_xml(fwd_msg, "[&quot;a&lt;b &amp; c&gt;d&quot;, &quot;\xc3\xa9&quot;]");
+  fail_unless(message_prepare_xml(fwd_msg) == 1,
+      "message_prepare_xml should return 1 upon success with an encoded body");
+
+  fail_unless(strstr(fwd_msg->msg_xml, "<body>[&quot;a&lt;b") != NULL,
+      "message_prepare_xml should copy body_xml into the stanza verbatim");
+  fail_unless(strcmp(strstr(dom_msg->msg_xml, "<body>"), "<body>[\"a&lt;b &amp; c&gt;d\", \"\xc3\xa9\"]</body></message>") == 0,
+      "message_prepare_xml should escape the body when no body_xml is present");
+
+  // Apart from the body, the hand-built stanza should match the DOM-built one
+  size_t head = strstr(dom_msg->msg_xml, "<body>") - dom_msg->msg_xml;
+  fail_unless(strncmp(dom_msg->msg_xml, fwd_msg->msg_xml, head) == 0,
+      "message_prepare_xml should encode the addressing the same way for body_xml");
+
+  message_set_body_xml(fwd_msg, NULL);
+  fail_unless(fwd_msg->body_xml == NULL,
+      "message_set_body_xml should clear body_xml when passed NULL");
+
+  message_free(dom_msg);
+  message_free(fwd_msg);
+}
+END_TEST
+
+START_TEST(test_transport_message_share_body)
+{
+  transport_message *copy = message_init("other", NULL, NULL, "recipient2", NULL);
+  message_set_body_xml(a_message, "body");
+  message_share_body(copy, a_message);
+  fail_unless(copy->body == a_message->body,
+      "message_share_body should share the body rather than copy it");
+  fail_unless(copy->body_xml == a_message->body_xml,
+      "message_share_body should share body_xml rather than copy it");
+
+  // The shared text must outlive the message it came from
+  message_free(a_message);
+  a_message = message_init(NULL, NULL, NULL, NULL, NULL);
+  fail_unless(strcmp(copy->body, "body") == 0,
+      "A shared body should survive the freeing of the original message");
+  message_free(copy);
+}
+END_TEST
+
+START_TEST(test_transport_message_adopt_body)
+{
+  char* body = strdup("adopted");
+  message_prepare_xml(a_message);
+  message_adopt_body(a_message, body);
+  fail_unless(a_message->body == body,
+      "message_adopt_body should install the string itself, not a copy");
+  fail_unless(a_message->msg_xml == NULL,
+      "message_adopt_body should discard any XML built from the old body");
+
+  message_adopt_body(a_message, NULL);
+  fail_unless(strcmp(a_message->body, "") == 0,
+      "message_adopt_body should install an empty body when passed NULL");
+}
+END_TEST
+
+START_TEST(test_transport_message_adopt_body_xml)
+{
+  char* body_xml = strdup("&lt;adopted&gt;");
+  message_adopt_body(a_message, strdup("<adopted>"));
+  message_adopt_body_xml(a_message, body_xml);
+  fail_unless(a_message->body_xml == body_xml,
+      "message_adopt_body_xml should install the string itself, not a copy");
+  message_prepare_xml(a_message);
+  fail_unless(strstr(a_message->msg_xml, "<body>&lt;adopted&gt;</body>") != NULL,
+      "message_prepare_xml should copy an adopted body_xml into the stanza verbatim");
+
+  message_adopt_body_xml(a_message, NULL);
+  fail_unless(a_message->body_xml == NULL && a_message->msg_xml == NULL,
+      "message_adopt_body_xml should clear body_xml and the stale XML when passed NULL");
+}
+END_TEST
+
 START_TEST(test_transport_message_jid_get_username)
 {
   int buf_size = 15;
@@ -272,6 +425,129 @@ START_TEST(test_transport_message_set_msg_error)
       "set_msg_error should set msg->error_code to the value of the err_code arg");
 }
 END_TEST
+START_TEST(test_transport_message_header_storage)
+{
+  // Headers too long for the block allocated with the message get their own storage
+  char long_jid[2048];
+  memset(long_jid, 'j', sizeof(long_jid) - 1);
+  long_jid[sizeof(long_jid) - 1] = '\0';
+
+  transport_message* msg = message_init("body", "subject", "thread", long_jid, "sender");
+  fail_unless(strcmp(msg->recipient, long_jid) == 0,
+      "A header too long to pack should still be stored intact");
+  message_set_router_info(msg, "rfrom", "rto", "rclass", "rcommand", 0);
+  message_set_router_info(msg, long_jid, NULL, "rclass2", NULL, 1);
+  fail_unless(strcmp(msg->router_from, long_jid) == 0 && strcmp(msg->router_to, "") == 0
+      && strcmp(msg->router_class, "rclass2") == 0,
+      "message_set_router_info should replace earlier values");
+
+  message_prepare_xml(msg);
+  fail_if(msg->msg_xml == NULL, "message_prepare_xml should build the stanza");
+  message_set_sender(msg, "sender");
+  fail_if(msg->msg_xml == NULL, "Setting the same sender should keep the stanza");
+  message_set_sender(msg, "other");
+  fail_unless(msg->msg_xml == NULL, "Changing the sender should invalidate the stanza");
+  fail_unless(strcmp(msg->sender, "other") == 0, "message_set_sender should set the sender");
+  message_free(msg);
+
+  // A recycled message starts out clean
+  msg = message_init(NULL, NULL, NULL, NULL, NULL);
+  fail_unless(msg->router_from == NULL && msg->osrf_xid == NULL && msg->broadcast == 0
+      && msg->is_error == 0 && msg->msg_xml == NULL,
+      "A new message should not inherit anything from a freed one");
+  fail_unless(strcmp(msg->sender, "") == 0 && strcmp(msg->recipient, "") == 0,
+      "message_init should default NULL headers to empty strings");
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_message_pack)
+{
+  transport_message* msg = message_init("body <&>", "subject", "thread", "recipient",
+      "sender");
+  message_set_router_info(msg, "rfrom", "rto", "rclass", "rcommand", 1);
+  message_set_osrf_xid(msg, "xid");
+  message_set_osrf_span(msg, "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+  set_msg_error(msg, "cancel", 503);
+  msg->queued = 250;
+  message_set_osrf_locality(msg, "rack1");
+
+  size_t len = 0;
+  char* packed = message_pack(msg, &len);
+  fail_if(packed == NULL, "message_pack should pack a message");
+  fail_unless(message_unpack(packed, len - 1) == NULL,
+      "message_unpack should reject a truncated message");
+
+  transport_message* copy = message_unpack(packed, len);
+  fail_if(copy == NULL, "message_unpack should rebuild a packed message");
+  fail_unless(strcmp(copy->body, "body <&>") == 0
+      && strcmp(copy->subject, "subject") == 0
+      && strcmp(copy->thread, "thread") == 0
+      && strcmp(copy->recipient, "recipient") == 0
+      && strcmp(copy->sender, "sender") == 0,
+      "message_unpack should restore the body and the basic headers");
+  fail_unless(strcmp(copy->router_from, "rfrom") == 0
+      && strcmp(copy->router_to, "rto") == 0
+      && strcmp(copy->router_class, "rclass") == 0
+      && strcmp(copy->router_command, "rcommand") == 0
+      && copy->broadcast == 1
+      && strcmp(copy->osrf_xid, "xid") == 0
+      && strcmp(copy->osrf_span, "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01") == 0,
+      "message_unpack should restore the router headers");
+  fail_unless(copy->is_error == 1 && copy->error_code == 503
+      && strcmp(copy->error_type, "cancel") == 0,
+      "message_unpack should restore the error");
+  fail_unless(copy->osrf_locality && strcmp(copy->osrf_locality, "rack1") == 0,
+      "message_unpack should restore the locality");
+  fail_unless(copy->queued == 250,
+      "message_unpack should restore the time the listener held the message");
+  message_free(copy);
+  free(packed);
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_message_append_xml)
+{
+  const char* bodies[] = { "[\"plain\"]", "a<b&c", "", NULL };
+  int i;
+  for (i = 0; i < 5; i++) {
+    const char* body = i < 4 ? bodies[i] : "ignored";
+    transport_message* msg = message_init(body, "subject", "thread", "recipient", "sender");
+    transport_message* ref = message_init(body, "subject", "thread", "recipient", "sender");
+    if (i == 4) {
+      message_set_body_xml(msg, "&quot;x&quot;");
+      message_set_body_xml(ref, "&quot;x&quot;");
+    }
+    message_prepare_xml(ref);
+
+    osrfIoChain* chain = osrfNewIoChain();
+    size_t len = message_append_xml(msg, chain);
+    char* xml = osrfIoChainFlatten(chain);
+    fail_unless(strcmp(xml, ref->msg_xml) == 0,
+        "message_append_xml should build the same stanza as message_prepare_xml: %s", xml);
+    fail_unless(len == strlen(ref->msg_xml) && msg->xml_len == len && ref->xml_len == len,
+        "message_append_xml should report the length of the stanza");
+    fail_unless(msg->msg_xml == NULL, "message_append_xml should leave msg_xml alone");
+    if (i == 0 || i == 4)
+      fail_unless(chain->count == 3, "A body that needs no escaping should not be copied");
+
+    // The chain holds its own reference to the body
+    message_free(msg);
+    free(xml);
+    xml = osrfIoChainFlatten(chain);
+    fail_unless(strcmp(xml, ref->msg_xml) == 0,
+        "The chain should keep the body alive after the message is freed");
+    free(xml);
+    osrfIoChainFree(chain);
+    message_free(ref);
+  }
+
+  fail_unless(message_append_xml(NULL, NULL) == 0,
+      "message_append_xml should return 0 for a NULL message");
+}
+END_TEST
+
 //END TESTS
 
 Suite *transport_message_suite(void) {
@@ -286,14 +562,24 @@ Suite *transport_message_suite(void) {
   tcase_add_test(tc_core, test_transport_message_new_message_from_xml_empty);
   tcase_add_test(tc_core, test_transport_message_new_message_from_xml_populated);
   tcase_add_test(tc_core, test_transport_message_set_osrf_xid);
+  tcase_add_test(tc_core, test_transport_message_osrf_span);
+  tcase_add_test(tc_core, test_transport_message_osrf_locality);
   tcase_add_test(tc_core, test_transport_message_set_router_info_empty);
   tcase_add_test(tc_core, test_transport_message_set_router_info_populated);
   tcase_add_test(tc_core, test_transport_message_free);
   tcase_add_test(tc_core, test_transport_message_prepare_xml);
+  tcase_add_test(tc_core, test_transport_message_prepare_xml_escaping);
+  tcase_add_test(tc_core, test_transport_message_prepare_xml_body_xml);
+  tcase_add_test(tc_core, test_transport_message_share_body);
+  tcase_add_test(tc_core, test_transport_message_adopt_body);
+  tcase_add_test(tc_core, test_transport_message_adopt_body_xml);
   tcase_add_test(tc_core, test_transport_message_jid_get_username);
   tcase_add_test(tc_core, test_transport_message_jid_get_resource);
   tcase_add_test(tc_core, test_transport_message_jid_get_domain);
   tcase_add_test(tc_core, test_transport_message_set_msg_error);
+  tcase_add_test(tc_core, test_transport_message_header_storage);
+  tcase_add_test(tc_core, test_transport_message_pack);
+  tcase_add_test(tc_core, test_transport_message_append_xml);
 
   //Add test case to test suite
   suite_add_tcase(s, tc_core);
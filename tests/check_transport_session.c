@@ -0,0 +1,312 @@
+#include <check.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include "opensrf/transport_session.h"
+
+transport_session *a_session;
+transport_message *received;
+
+static void grab_message(void* user_data, transport_message* msg) {
+  message_free(received);
+  received = msg;
+}
+
+// Feed a string to the session's parser, as if it came from the socket
+static void feed(const char* data) {
+  char buf[512];
+  strcpy(buf, data);
+  a_session->sock_mgr->data_received(a_session, a_session->sock_mgr, 0, buf, 0);
+}
+
+//Set up the test fixture
+void setup(void) {
+  a_session = init_transport("server", 1234, NULL, NULL, 0);
+  a_session->message_callback = grab_message;
+  received = NULL;
+  feed("<stream:stream xmlns:stream='http://etherx.jabber.org/streams'>");
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  message_free(received);
+  session_discard(a_session);
+}
+
+// Read from a socket until the input, inflated if zin is not NULL, contains a string
+static int read_until(int fd, z_stream* zin, char* buf, size_t size, const char* want) {
+  size_t used = 0;
+  buf[0] = '\0';
+  while (!strstr(buf, want)) {
+    char in[4096];
+    ssize_t n = recv(fd, zin ? in : buf + used, zin ? sizeof(in) : size - used - 1, 0);
+    if (n <= 0)
+      return -1;
+    if (zin) {
+      zin->next_in = (Bytef*) in;
+      zin->avail_in = n;
+      zin->next_out = (Bytef*) buf + used;
+      zin->avail_out = size - used - 1;
+      if (inflate(zin, Z_SYNC_FLUSH) != Z_OK)
+        return -1;
+      n = (size - used - 1) - zin->avail_out;
+    }
+    used += n;
+    buf[used] = '\0';
+  }
+  return 0;
+}
+
+// Send a string over a socket, deflated if zout is not NULL
+static void send_str(int fd, z_stream* zout, const char* data) {
+  if (!zout) {
+    send(fd, data, strlen(data), 0);
+    return;
+  }
+  char out[4096];
+  zout->next_in = (Bytef*) data;
+  zout->avail_in = strlen(data);
+  zout->next_out = (Bytef*) out;
+  zout->avail_out = sizeof(out);
+  deflate(zout, Z_SYNC_FLUSH);
+  send(fd, out, sizeof(out) - zout->avail_out, 0);
+}
+
+// Play the part of a Jabber server that accepts or refuses compression, then echo a message
+static void fake_jabber_server(int listen_fd, int accept_compression) {
+  char buf[8192];
+  z_stream zin, zout;
+  memset(&zin, 0, sizeof(zin));
+  memset(&zout, 0, sizeof(zout));
+  z_stream* pin = NULL;
+  z_stream* pout = NULL;
+
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0 || read_until(fd, NULL, buf, sizeof(buf), "<stream:stream"))
+    _exit(1);
+  send_str(fd, NULL, "<stream:stream xmlns:stream='http://etherx.jabber.org/streams' id='s1'>");
+
+  if (read_until(fd, NULL, buf, sizeof(buf), "</compress>"))
+    _exit(2);
+  if (accept_compression) {
+    send_str(fd, NULL, "<compressed xmlns='http://jabber.org/protocol/compress'/>");
+    inflateInit(&zin);
+    deflateInit(&zout, Z_DEFAULT_COMPRESSION);
+    pin = &zin;
+    pout = &zout;
+    if (read_until(fd, pin, buf, sizeof(buf), "<stream:stream"))
+      _exit(3);
+    send_str(fd, pout, "<stream:stream xmlns:stream='http://etherx.jabber.org/streams' id='s2'>");
+  } else {
+    send_str(fd, NULL, "<failure xmlns='http://jabber.org/protocol/compress'>"
+        "<unsupported-method/></failure>");
+  }
+
+  if (read_until(fd, pin, buf, sizeof(buf), "</iq>"))
+    _exit(4);
+  send_str(fd, pout, "<iq type='result' id='123456789'/>");
+
+  if (read_until(fd, pin, buf, sizeof(buf), "</message>"))
+    _exit(5);
+  send_str(fd, pout, "<message to='a' from='b'><body>compressed &amp; back</body></message>");
+
+  read_until(fd, pin, buf, sizeof(buf), "</stream:stream>");
+  _exit(0);
+}
+
+// Connect to a fake Jabber server, asking for compression, and exchange a message
+static void run_compression_test(int accept_compression) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/check_transport_session.%ld", (long) getpid());
+  unlink(path);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  fail_unless(bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 &&
+      listen(listen_fd, 1) == 0, "The fake Jabber server should be able to listen");
+
+  pid_t pid = fork();
+  if (pid == 0)
+    fake_jabber_server(listen_fd, accept_compression);
+  close(listen_fd);
+
+  transport_session* ses = init_transport("localhost", 0, path, NULL, 0);
+  ses->message_callback = grab_message;
+  session_set_compression(ses, 1);
+  fail_unless(session_connect(ses, "user", "password", "resource", 5, AUTH_PLAIN) == 1,
+      "The session should log in");
+  fail_unless(session_compressed(ses) == accept_compression,
+      "The stream should be compressed only if the server agreed");
+
+  transport_message* msg = message_init("hello", NULL, NULL, "b", "a");
+  fail_unless(session_send_msg(ses, msg) == 0, "Sending a message should succeed");
+  message_free(msg);
+
+  int tries = 0;
+  while (!received && tries++ < 5)
+    session_wait(ses, 1);
+  fail_if(received == NULL, "The echoed message should arrive");
+  fail_unless(strcmp(received->body, "compressed & back") == 0,
+      "The echoed message should be intact");
+
+  session_free(ses);
+  int status = -1;
+  waitpid(pid, &status, 0);
+  unlink(path);
+  fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+      "The fake Jabber server should see everything it expects");
+}
+
+//BEGIN TESTS
+
+START_TEST(test_transport_session_body_xml_off)
+{
+  feed("<message to='a' from='b'><body>x &amp; y</body></message>");
+  fail_if(received == NULL, "A complete stanza should reach the message callback");
+  fail_unless(strcmp(received->body, "x & y") == 0,
+      "The body of a received message should be decoded");
+  fail_unless(received->body_xml == NULL,
+      "body_xml should stay NULL unless session_keep_body_xml() is in effect");
+}
+END_TEST
+
+START_TEST(test_transport_session_body_xml_split)
+{
+  session_keep_body_xml(a_session, 1);
+
+  // Split the stanza across reads, including in the middle of an entity
+  feed("<message to='a' from='b'><opensrf router_from='c' osrf_xid='d'/><body>[&quot;x&am");
+  feed("p; y&gt;z&quot;]</bo");
+  feed("dy></message><message to='e'>");
+  fail_if(received == NULL, "A complete stanza should reach the message callback");
+  fail_unless(strcmp(received->body, "[\"x& y>z\"]") == 0,
+      "The body of a received message should be decoded");
+  fail_if(received->body_xml == NULL, "session_keep_body_xml() should populate body_xml");
+  fail_unless(strcmp(received->body_xml, "[&quot;x&amp; y&gt;z&quot;]") == 0,
+      "body_xml should hold the body exactly as it was received");
+
+  feed("<body>second</body></message>");
+  fail_unless(strcmp(received->body_xml, "second") == 0,
+      "body_xml should be captured for each stanza in turn");
+  fail_unless(a_session->raw_buffer->n_used == 0,
+      "Raw input should be discarded once a stanza is complete");
+}
+END_TEST
+
+START_TEST(test_transport_session_body_xml_cdata)
+{
+  session_keep_body_xml(a_session, 1);
+  feed("<message to='a' from='b'><body><![CDATA[a<b]]></body></message>");
+  fail_if(received == NULL, "A complete stanza should reach the message callback");
+  fail_unless(strcmp(received->body, "a<b") == 0,
+      "The body of a received message should be decoded");
+  fail_unless(received->body_xml == NULL,
+      "body_xml should not be populated for a body that isn't plain character data");
+}
+END_TEST
+
+START_TEST(test_transport_session_body_size_hint)
+{
+  int i;
+  feed("<message to='a' from='b'><body>");
+  for(i = 0; i < 40; i++)
+    feed("0123456789012345678901234567890123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789012345678901234567890123456789"
+        "01234567890123456789012345678901234567890123456789012345678901234567890123456789");
+  feed("</body></message>");
+
+  fail_if(received == NULL, "A complete stanza should reach the message callback");
+  fail_unless(strlen(received->body) == 40 * 290,
+      "The whole body should be delivered, however many reads it took");
+  fail_unless(a_session->body_buffer->n_used == 0,
+      "The session should start the next body in an empty buffer");
+  fail_unless(a_session->body_buffer->size >= 40 * 290,
+      "The next body buffer should be sized from the last body");
+}
+END_TEST
+
+START_TEST(test_transport_session_cork)
+{
+  int fds[2];
+  fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair() should work");
+  a_session->sock_id = fds[0];
+  a_session->state_machine->connected = 1;
+
+  transport_message* msg = message_init("x", NULL, NULL, "a", "b");
+  message_prepare_xml(msg);
+  char* stanza = strdup(msg->msg_xml);
+  size_t len = strlen(stanza);
+
+  session_cork(a_session);
+  session_cork(a_session);
+  fail_unless(session_send_msg(a_session, msg) == 0, "Queueing a stanza should succeed");
+  fail_unless(session_send_msg(a_session, msg) == 0, "Queueing a stanza should succeed");
+  fail_unless(session_send_msg(a_session, msg) == 0, "Queueing a stanza should succeed");
+  fail_unless(session_uncork(a_session) == 0, "An inner uncork should succeed");
+
+  char buf[1024];
+  fail_unless(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT) == -1,
+      "Nothing should be sent until the outermost uncork");
+
+  fail_unless(session_uncork(a_session) == 0, "The outermost uncork should flush");
+  ssize_t n = recv(fds[1], buf, sizeof(buf) - 1, MSG_DONTWAIT);
+  fail_unless(n == 3 * len, "All of the queued stanzas should be sent");
+  buf[n] = '\0';
+  fail_unless(strncmp(buf, stanza, len) == 0 && strncmp(buf + 2 * len, stanza, len) == 0,
+      "The stanzas should be sent intact and in order");
+
+  fail_unless(session_send_msg(a_session, msg) == 0, "An uncorked send should succeed");
+  fail_unless(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT) == len,
+      "Without a cork, each stanza should be sent at once");
+
+  free(stanza);
+  message_free(msg);
+  a_session->state_machine->connected = 0;
+  a_session->sock_id = 0;
+  close(fds[0]);
+  close(fds[1]);
+}
+END_TEST
+
+START_TEST(test_transport_session_compression)
+{
+  run_compression_test(1);
+}
+END_TEST
+
+START_TEST(test_transport_session_compression_refused)
+{
+  run_compression_test(0);
+}
+END_TEST
+
+//END TESTS
+
+Suite *transport_session_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("transport_session");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_transport_session_body_xml_off);
+  tcase_add_test(tc_core, test_transport_session_body_xml_split);
+  tcase_add_test(tc_core, test_transport_session_body_xml_cdata);
+  tcase_add_test(tc_core, test_transport_session_body_size_hint);
+  tcase_add_test(tc_core, test_transport_session_cork);
+  tcase_add_test(tc_core, test_transport_session_compression);
+  tcase_add_test(tc_core, test_transport_session_compression_refused);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, transport_session_suite());
+}
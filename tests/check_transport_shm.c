@@ -0,0 +1,198 @@
+#include <check.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "opensrf/transport_shm.h"
+
+char shm_dir[64];
+transport_shm *listener;
+transport_shm *sender;
+
+//Set up the test fixture
+void setup(void) {
+  snprintf(shm_dir, sizeof(shm_dir), "/tmp/check_transport_shm.%ld", (long) getpid());
+  mkdir(shm_dir, 0700);
+  listener = transport_shm_init(shm_dir, 0);
+  sender = transport_shm_init(shm_dir, 0);
+  fail_unless(transport_shm_listen(listener, "opensrf@localhost/listener") == 0,
+      "Creating a ring should succeed");
+}
+
+//Clean up the test fixture
+void teardown(void) {
+  transport_shm_free(sender, 1);
+  transport_shm_free(listener, 1);
+  rmdir(shm_dir);
+}
+
+//BEGIN TESTS
+
+START_TEST(test_transport_shm_roundtrip)
+{
+  transport_message* msg = message_init("[{\"__c\":\"osrfMessage\"}] & <more>", "subj",
+      "thread1", "opensrf@localhost/listener", "router@localhost/router");
+  message_set_router_info(msg, "client@localhost/c", "router@localhost", "opensrf.math",
+      "register", 1);
+  message_set_osrf_xid(msg, "xid42");
+  message_set_osrf_span(msg, "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+  message_set_osrf_locality(msg, "rack1");
+
+  fail_unless(transport_shm_send(sender, msg) == 1,
+      "A message to a listening recipient should go through shared memory");
+  message_free(msg);
+
+  transport_message* got = transport_shm_recv(listener);
+  fail_if(got == NULL, "The listener should receive the message");
+  fail_unless(strcmp(got->body, "[{\"__c\":\"osrfMessage\"}] & <more>") == 0,
+      "The body should arrive unchanged");
+  fail_unless(strcmp(got->subject, "subj") == 0 && strcmp(got->thread, "thread1") == 0,
+      "The subject and thread should arrive");
+  fail_unless(strcmp(got->sender, "router@localhost/router") == 0 &&
+      strcmp(got->recipient, "opensrf@localhost/listener") == 0,
+      "The addresses should arrive");
+  fail_unless(strcmp(got->router_from, "client@localhost/c") == 0 &&
+      strcmp(got->router_class, "opensrf.math") == 0 &&
+      strcmp(got->router_command, "register") == 0 && got->broadcast == 1,
+      "The router info should arrive");
+  fail_unless(strcmp(got->osrf_xid, "xid42") == 0, "The xid should arrive");
+  fail_unless(strcmp(got->osrf_span,
+      "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01") == 0,
+      "The trace context should arrive");
+  fail_unless(got->osrf_locality && strcmp(got->osrf_locality, "rack1") == 0,
+      "The locality should arrive");
+  fail_unless(got->is_error == 0, "The message should not be an error");
+  message_free(got);
+
+  fail_unless(transport_shm_recv(listener) == NULL, "The ring should now be empty");
+}
+END_TEST
+
+START_TEST(test_transport_shm_not_local)
+{
+  transport_message* msg = message_init("x", NULL, NULL, "someone@elsewhere/r", "me@here/r");
+  fail_unless(transport_shm_send(sender, msg) == 0,
+      "A message to a recipient without a ring should be left for Jabber");
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_shm_full)
+{
+  char* body = malloc(200 * 1024);
+  memset(body, 'x', 200 * 1024 - 1);
+  body[200 * 1024 - 1] = '\0';
+  transport_message* msg = message_init(body, NULL, NULL, "opensrf@localhost/listener",
+      "me@here/r");
+
+  int sent = 0;
+  while (sent < 100 && transport_shm_send(sender, msg))
+    sent++;
+  fail_unless(sent > 0 && sent < 100, "A full ring should turn messages away");
+
+  int got = 0;
+  transport_message* m;
+  while ((m = transport_shm_recv(listener))) {
+    fail_unless(strlen(m->body) == 200 * 1024 - 1, "Wrapped messages should arrive intact");
+    message_free(m);
+    got++;
+  }
+  fail_unless(got == sent, "Every message that went in should come out");
+  fail_unless(transport_shm_send(sender, msg) == 1, "Space should be reusable");
+
+  message_free(msg);
+  free(body);
+}
+END_TEST
+
+START_TEST(test_transport_shm_doorbell)
+{
+  struct pollfd pfd;
+  pfd.fd = transport_shm_fd(listener);
+  pfd.events = POLLIN;
+  fail_unless(pfd.fd >= 0, "A listener should have a doorbell");
+
+  transport_message* msg = message_init("x", NULL, NULL, "opensrf@localhost/listener",
+      "me@here/r");
+  transport_shm_send(sender, msg);
+  fail_unless(poll(&pfd, 1, 0) == 0, "The doorbell should not ring for a listener awake");
+  fail_unless(transport_shm_sleep(listener) == 1,
+      "A listener should not go to sleep with messages waiting");
+  transport_shm_wake(listener);
+  message_free(transport_shm_recv(listener));
+
+  fail_unless(transport_shm_sleep(listener) == 0, "An empty ring should let us sleep");
+  transport_shm_send(sender, msg);
+  fail_unless(poll(&pfd, 1, 1000) == 1, "The doorbell should ring for a sleeping listener");
+  transport_shm_wake(listener);
+  fail_unless(poll(&pfd, 1, 0) == 0, "Waking should silence the doorbell");
+  message_free(transport_shm_recv(listener));
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_shm_closed)
+{
+  transport_message* msg = message_init("x", NULL, NULL, "opensrf@localhost/listener",
+      "me@here/r");
+  fail_unless(transport_shm_send(sender, msg) == 1, "The first send should use the ring");
+  transport_shm_free(listener, 1);
+  listener = NULL;
+  fail_unless(transport_shm_send(sender, msg) == 0,
+      "Once the listener has gone, messages should be left for Jabber");
+  message_free(msg);
+}
+END_TEST
+
+START_TEST(test_transport_shm_sweep)
+{
+  // A listener that dies without cleaning up leaves its ring behind
+  pid_t pid = fork();
+  if (pid == 0) {
+    transport_shm* drone = transport_shm_init(shm_dir, 0);
+    _exit(transport_shm_listen(drone, "opensrf@localhost/drone") ? 1 : 0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+      "The child should have created a ring");
+
+  transport_message* msg = message_init("x", NULL, NULL, "opensrf@localhost/drone",
+      "me@here/r");
+  fail_unless(transport_shm_sweep(sender) == 1, "The dead listener's ring should be removed");
+  fail_unless(transport_shm_send(sender, msg) == 0,
+      "Once removed, the ring should no longer take messages");
+  message_free(msg);
+
+  fail_unless(transport_shm_sweep(sender) == 0,
+      "A live listener's ring should stay where it is");
+  msg = message_init("x", NULL, NULL, "opensrf@localhost/listener", "me@here/r");
+  fail_unless(transport_shm_send(sender, msg) == 1, "So should its messages");
+  message_free(msg);
+}
+END_TEST
+
+//END TESTS
+
+Suite *transport_shm_suite(void) {
+  //Create test suite, test case, initialize fixture
+  Suite *s = suite_create("transport_shm");
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, setup, teardown);
+
+  //Add tests to test case
+  tcase_add_test(tc_core, test_transport_shm_roundtrip);
+  tcase_add_test(tc_core, test_transport_shm_not_local);
+  tcase_add_test(tc_core, test_transport_shm_full);
+  tcase_add_test(tc_core, test_transport_shm_doorbell);
+  tcase_add_test(tc_core, test_transport_shm_closed);
+  tcase_add_test(tc_core, test_transport_shm_sweep);
+
+  //Add test case to test suite
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+void run_tests(SRunner *sr) {
+  srunner_add_suite(sr, transport_shm_suite());
+}